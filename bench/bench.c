@@ -0,0 +1,169 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+/**
+ * Micro-benchmarks of the receive path, written as JSON to compare builds:
+ *
+ * {"context": {...}, "benchmarks": [{"name", "params", "iterations", "ns_per_op_min", "ns_per_op_median", "mb_per_s"}, ...]}
+ *
+ * Every benchmark is run for a number of repetitions of at least --min-time-ms each.
+ * The minimum is the most stable number to compare, the median shows how noisy the run was.
+ */
+
+#include "bench.h"
+
+#include <chiaki/common.h>
+#include <chiaki/time.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_MIN_TIME_MS_DEFAULT 200
+#define BENCH_REPETITIONS_DEFAULT 5
+
+static int compare_double(const void *a, const void *b)
+{
+	double da = *(const double *)a;
+	double db = *(const double *)b;
+	return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+/**
+ * Find a number of iterations that takes at least min_time_us, doubling from 1.
+ *
+ * @return 0 if func failed
+ */
+static uint64_t bench_calibrate(Bench *bench, BenchFunc func, void *user)
+{
+	uint64_t iterations = 1;
+	while(true)
+	{
+		uint64_t start_us = chiaki_time_now_monotonic_us();
+		if(!func(user, iterations))
+			return 0;
+		uint64_t duration_us = chiaki_time_now_monotonic_us() - start_us;
+		if(duration_us >= bench->min_time_us)
+			return iterations;
+		if(duration_us < bench->min_time_us / 16)
+			iterations *= 8;
+		else
+			iterations *= 2;
+	}
+}
+
+void bench_run(Bench *bench, const char *name, const char *params, size_t bytes_per_op, BenchFunc func, void *user)
+{
+	if(bench->filter && !strstr(name, bench->filter))
+		return;
+
+	fprintf(stderr, "%s %s ...\n", name, params);
+	uint64_t iterations = bench_calibrate(bench, func, user);
+	if(!iterations)
+	{
+		fprintf(stderr, "%s %s failed, skipping\n", name, params);
+		return;
+	}
+
+	double ns_per_op[BENCH_REPETITIONS_MAX];
+	for(unsigned int i=0; i<bench->repetitions; i++)
+	{
+		uint64_t start_us = chiaki_time_now_monotonic_us();
+		if(!func(user, iterations))
+		{
+			fprintf(stderr, "%s %s failed, skipping\n", name, params);
+			return;
+		}
+		uint64_t duration_us = chiaki_time_now_monotonic_us() - start_us;
+		ns_per_op[i] = (double)duration_us * 1000.0 / (double)iterations;
+	}
+	qsort(ns_per_op, bench->repetitions, sizeof(double), compare_double);
+	double min = ns_per_op[0];
+	double median = ns_per_op[bench->repetitions / 2];
+
+	fprintf(bench->out, "%s\n\t\t{\"name\": \"%s\", \"params\": \"%s\", \"iterations\": %llu, "
+			"\"ns_per_op_min\": %.2f, \"ns_per_op_median\": %.2f",
+			bench->first ? "" : ",", name, params, (unsigned long long)iterations, min, median);
+	if(bytes_per_op && min > 0.0)
+		fprintf(bench->out, ", \"mb_per_s\": %.2f", (double)bytes_per_op * 1000.0 / min);
+	fprintf(bench->out, "}");
+	bench->first = false;
+}
+
+static void print_usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [--filter <substring>] [--min-time-ms <ms>] [--repetitions <n>] [--out <file.json>]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	Bench bench = { 0 };
+	bench.out = stdout;
+	bench.min_time_us = BENCH_MIN_TIME_MS_DEFAULT * 1000;
+	bench.repetitions = BENCH_REPETITIONS_DEFAULT;
+	bench.first = true;
+	const char *out_filename = NULL;
+	for(int i=1; i<argc; i++)
+	{
+		if(!strcmp(argv[i], "--filter") && i + 1 < argc)
+			bench.filter = argv[++i];
+		else if(!strcmp(argv[i], "--min-time-ms") && i + 1 < argc)
+			bench.min_time_us = strtoull(argv[++i], NULL, 0) * 1000;
+		else if(!strcmp(argv[i], "--repetitions") && i + 1 < argc)
+			bench.repetitions = (unsigned int)strtoul(argv[++i], NULL, 0);
+		else if(!strcmp(argv[i], "--out") && i + 1 < argc)
+			out_filename = argv[++i];
+		else
+		{
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+	if(bench.repetitions < 1 || bench.repetitions > BENCH_REPETITIONS_MAX)
+	{
+		fprintf(stderr, "Repetitions must be between 1 and %u\n", BENCH_REPETITIONS_MAX);
+		return 1;
+	}
+
+	ChiakiErrorCode err = chiaki_lib_init();
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to init lib: %s\n", chiaki_error_string(err));
+		return 1;
+	}
+	chiaki_log_init(&bench.log, 0, NULL, NULL);
+
+	if(out_filename)
+	{
+		bench.out = fopen(out_filename, "w");
+		if(!bench.out)
+		{
+			fprintf(stderr, "Failed to open %s\n", out_filename);
+			return 1;
+		}
+	}
+
+	char date[32];
+	time_t now = time(NULL);
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+	fprintf(bench.out, "{\n\t\"context\": {\"date\": \"%s\", \"crypto\": \"%s\", \"min_time_ms\": %llu, \"repetitions\": %u},\n\t\"benchmarks\": [",
+			date,
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+			"mbedtls",
+#else
+			"openssl",
+#endif
+			(unsigned long long)(bench.min_time_us / 1000), bench.repetitions);
+
+	bench_gkcrypt(&bench);
+	bench_fec(&bench);
+	bench_frame_processor(&bench);
+	bench_reorder_queue(&bench);
+	bench_av_packet_parse(&bench);
+	bench_bitstream(&bench);
+
+	fprintf(bench.out, "\n\t]\n}\n");
+	int ret = ferror(bench.out) ? 1 : 0;
+	if(bench.out != stdout)
+		fclose(bench.out);
+	return ret;
+}
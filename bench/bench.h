@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_BENCH_H
+#define CHIAKI_BENCH_H
+
+#include <chiaki/log.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define BENCH_REPETITIONS_MAX 32
+
+/**
+ * Runs iterations operations of a benchmark.
+ *
+ * @return false if an operation failed, which discards the benchmark
+ */
+typedef bool (*BenchFunc)(void *user, uint64_t iterations);
+
+typedef struct bench_t
+{
+	FILE *out;
+	const char *filter; // only run benchmarks whose name contains this, NULL for all
+	uint64_t min_time_us; // of a single repetition
+	unsigned int repetitions;
+	bool first;
+	ChiakiLog log; // silent, for everything that wants one
+} Bench;
+
+/**
+ * Measure func and write its result as one element of the JSON benchmarks array.
+ *
+ * @param params short description of the configuration, e.g. "size=1400", distinguishes runs of the same name
+ * @param bytes_per_op if > 0, also report the throughput
+ */
+void bench_run(Bench *bench, const char *name, const char *params, size_t bytes_per_op, BenchFunc func, void *user);
+
+void bench_gkcrypt(Bench *bench);
+void bench_fec(Bench *bench);
+void bench_frame_processor(Bench *bench);
+void bench_reorder_queue(Bench *bench);
+void bench_av_packet_parse(Bench *bench);
+void bench_bitstream(Bench *bench);
+
+#endif // CHIAKI_BENCH_H
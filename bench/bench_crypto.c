@@ -0,0 +1,96 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include "bench.h"
+
+#include <chiaki/gkcrypt.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct gkcrypt_bench_t
+{
+	ChiakiGKCrypt gkcrypt;
+	uint8_t *buf;
+	size_t buf_size;
+	uint64_t key_pos;
+} GKCryptBench;
+
+static bool bench_gen_key_stream(void *user, uint64_t iterations)
+{
+	GKCryptBench *b = user;
+	for(uint64_t i=0; i<iterations; i++)
+	{
+		// works on whole blocks only
+		size_t size = (b->buf_size + CHIAKI_GKCRYPT_BLOCK_SIZE - 1) / CHIAKI_GKCRYPT_BLOCK_SIZE * CHIAKI_GKCRYPT_BLOCK_SIZE;
+		if(chiaki_gkcrypt_gen_key_stream(&b->gkcrypt, b->key_pos, b->buf, size) != CHIAKI_ERR_SUCCESS)
+			return false;
+		b->key_pos += size;
+	}
+	return true;
+}
+
+static bool bench_decrypt(void *user, uint64_t iterations)
+{
+	GKCryptBench *b = user;
+	for(uint64_t i=0; i<iterations; i++)
+	{
+		if(chiaki_gkcrypt_decrypt(&b->gkcrypt, b->key_pos, b->buf, b->buf_size) != CHIAKI_ERR_SUCCESS)
+			return false;
+		b->key_pos += b->buf_size;
+	}
+	return true;
+}
+
+static bool bench_gmac(void *user, uint64_t iterations)
+{
+	GKCryptBench *b = user;
+	uint8_t gmac[CHIAKI_GKCRYPT_GMAC_SIZE];
+	for(uint64_t i=0; i<iterations; i++)
+	{
+		if(chiaki_gkcrypt_gmac(&b->gkcrypt, b->key_pos, b->buf, b->buf_size, gmac) != CHIAKI_ERR_SUCCESS)
+			return false;
+		// stays within one gmac key index most of the time, like consecutive packets do
+		b->key_pos += b->buf_size;
+	}
+	return true;
+}
+
+void bench_gkcrypt(Bench *bench)
+{
+	static const uint8_t handshake_key[0x10] = {
+		0x60, 0x3f, 0x1a, 0x7c, 0x42, 0x0d, 0x99, 0xe1, 0x5b, 0x23, 0x84, 0xc6, 0x08, 0x7e, 0xd2, 0x31 };
+	static const uint8_t ecdh_secret[0x20] = {
+		0x9e, 0x64, 0x8d, 0x3b, 0x21, 0xf0, 0x57, 0xaa, 0x13, 0xc8, 0x6e, 0x04, 0xb9, 0x72, 0x2f, 0xd5,
+		0x48, 0x1c, 0xe3, 0x90, 0x6b, 0x35, 0xfa, 0x07, 0xcc, 0x5e, 0x81, 0x2a, 0xb4, 0x69, 0x17, 0xde };
+	static const size_t sizes[] = { 1400, 0x10000 };
+
+	GKCryptBench b;
+	// no key buffer and no thread, so every call generates the key stream it needs
+	if(chiaki_gkcrypt_init(&b.gkcrypt, &bench->log, 0, 2, handshake_key, ecdh_secret) != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to init gkcrypt\n");
+		return;
+	}
+	b.buf = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+	if(!b.buf)
+		goto fini;
+	memset(b.buf, 0xa5, sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+
+	for(size_t i=0; i<sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		char params[32];
+		snprintf(params, sizeof(params), "size=%zu", sizes[i]);
+		b.buf_size = sizes[i];
+
+		b.key_pos = 0;
+		bench_run(bench, "gkcrypt_gen_key_stream", params, b.buf_size, bench_gen_key_stream, &b);
+		b.key_pos = 0;
+		bench_run(bench, "gkcrypt_decrypt", params, b.buf_size, bench_decrypt, &b);
+		b.key_pos = 0;
+		bench_run(bench, "gkcrypt_gmac", params, b.buf_size, bench_gmac, &b);
+	}
+
+	free(b.buf);
+fini:
+	chiaki_gkcrypt_fini(&b.gkcrypt);
+}
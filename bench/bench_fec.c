@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include "bench.h"
+
+#include <chiaki/fec.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define FEC_UNIT_SIZE 1400
+#define FEC_STRIDE 1408
+
+typedef struct fec_bench_t
+{
+	ChiakiFecContext ctx;
+	uint8_t *frame_buf;
+	unsigned int k;
+	unsigned int m;
+	unsigned int erasures[CHIAKI_FEC_UNITS_MAX];
+	size_t erasures_count;
+} FecBench;
+
+typedef enum fec_pattern_t
+{
+	FEC_PATTERN_ONE, // a single source unit in the middle
+	FEC_PATTERN_BURST, // m consecutive source units, as lost in one burst
+	FEC_PATTERN_SPREAD, // m source units evenly spread over the frame
+	FEC_PATTERN_COUNT
+} FecPattern;
+
+static const char *fec_pattern_string(FecPattern pattern)
+{
+	switch(pattern)
+	{
+		case FEC_PATTERN_ONE:
+			return "one";
+		case FEC_PATTERN_BURST:
+			return "burst";
+		case FEC_PATTERN_SPREAD:
+			return "spread";
+		default:
+			return "unknown";
+	}
+}
+
+static void fec_erasures(FecBench *b, FecPattern pattern)
+{
+	switch(pattern)
+	{
+		case FEC_PATTERN_ONE:
+			b->erasures[0] = b->k / 2;
+			b->erasures_count = 1;
+			break;
+		case FEC_PATTERN_BURST:
+			for(unsigned int i=0; i<b->m; i++)
+				b->erasures[i] = b->k / 4 + i;
+			b->erasures_count = b->m;
+			break;
+		default:
+			for(unsigned int i=0; i<b->m; i++)
+				b->erasures[i] = i * (b->k / b->m);
+			b->erasures_count = b->m;
+			break;
+	}
+}
+
+static bool bench_fec_decode(void *user, uint64_t iterations)
+{
+	FecBench *b = user;
+	for(uint64_t i=0; i<iterations; i++)
+	{
+		if(chiaki_fec_decode(b->frame_buf, FEC_UNIT_SIZE, FEC_STRIDE, b->k, b->m, b->erasures, b->erasures_count) != CHIAKI_ERR_SUCCESS)
+			return false;
+	}
+	return true;
+}
+
+static bool bench_fec_context_decode(void *user, uint64_t iterations)
+{
+	FecBench *b = user;
+	for(uint64_t i=0; i<iterations; i++)
+	{
+		if(chiaki_fec_context_decode(&b->ctx, b->frame_buf, FEC_UNIT_SIZE, FEC_STRIDE, b->k, b->m, b->erasures, b->erasures_count) != CHIAKI_ERR_SUCCESS)
+			return false;
+	}
+	return true;
+}
+
+void bench_fec(Bench *bench)
+{
+	static const unsigned int configs[][2] = { { 8, 2 }, { 32, 8 }, { 96, 24 } };
+
+	FecBench b;
+	chiaki_fec_context_init(&b.ctx);
+	for(size_t c=0; c<sizeof(configs) / sizeof(configs[0]); c++)
+	{
+		b.k = configs[c][0];
+		b.m = configs[c][1];
+		b.frame_buf = malloc((b.k + b.m) * FEC_STRIDE);
+		if(!b.frame_buf)
+			break;
+		for(size_t i=0; i<b.k * FEC_STRIDE; i++)
+			b.frame_buf[i] = (uint8_t)(i * 31 + (i >> 8));
+		if(chiaki_fec_encode(b.frame_buf, FEC_UNIT_SIZE, FEC_STRIDE, b.k, b.m) != CHIAKI_ERR_SUCCESS)
+		{
+			fprintf(stderr, "Failed to encode FEC k=%u m=%u\n", b.k, b.m);
+			free(b.frame_buf);
+			continue;
+		}
+
+		for(FecPattern pattern=0; pattern<FEC_PATTERN_COUNT; pattern++)
+		{
+			fec_erasures(&b, pattern);
+			char params[64];
+			snprintf(params, sizeof(params), "k=%u m=%u erasures=%s", b.k, b.m, fec_pattern_string(pattern));
+			// the whole frame goes through the decoder, even if only the erased units are written
+			size_t bytes = b.k * FEC_UNIT_SIZE;
+			bench_run(bench, "fec_decode", params, bytes, bench_fec_decode, &b);
+			bench_run(bench, "fec_context_decode", params, bytes, bench_fec_context_decode, &b);
+		}
+		free(b.frame_buf);
+	}
+	chiaki_fec_context_fini(&b.ctx);
+}
@@ -0,0 +1,141 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include "bench.h"
+
+#include <chiaki/reorderqueue.h>
+#include <chiaki/takion.h>
+#include <chiaki/gkcrypt.h>
+
+#include <string.h>
+
+/**
+ * The same workload is generated for the generic queue and the one specialized for 32 bit seqnums,
+ * prefix is chiaki_reorder_queue or chiaki_reorder_queue32 and seq_num_t its seqnum type.
+ */
+#define REORDER_BENCH(name, queue_t, prefix, seq_num_t) \
+typedef struct name##_t \
+{ \
+	queue_t queue; \
+	ChiakiSeqNum32 seq_num; \
+	bool swapped; /* every pair of packets arrives in reverse order */ \
+} name##_Bench; \
+\
+static bool name(void *user, uint64_t iterations) \
+{ \
+	name##_Bench *b = user; \
+	/* one iteration is one packet, so pairs are pushed every second one */ \
+	for(uint64_t i=0; i<iterations; i+=2) \
+	{ \
+		ChiakiSeqNum32 first = b->seq_num; \
+		ChiakiSeqNum32 second = b->seq_num + 1; \
+		prefix##_push(&b->queue, b->swapped ? second : first, b); \
+		if(!b->swapped) \
+		{ \
+			seq_num_t seq_num; \
+			void *elem; \
+			if(!prefix##_pull(&b->queue, &seq_num, &elem)) \
+				return false; \
+		} \
+		prefix##_push(&b->queue, b->swapped ? first : second, b); \
+		for(size_t p=b->swapped ? 0 : 1; p<2; p++) \
+		{ \
+			seq_num_t seq_num; \
+			void *elem; \
+			if(!prefix##_pull(&b->queue, &seq_num, &elem)) \
+				return false; \
+		} \
+		b->seq_num += 2; \
+	} \
+	return true; \
+}
+
+REORDER_BENCH(bench_reorder, ChiakiReorderQueue, chiaki_reorder_queue, uint64_t)
+REORDER_BENCH(bench_reorder32, ChiakiReorderQueue32, chiaki_reorder_queue32, ChiakiSeqNum32)
+
+#undef REORDER_BENCH
+
+void bench_reorder_queue(Bench *bench)
+{
+	for(int swapped=0; swapped<2; swapped++)
+	{
+		const char *params = swapped ? "size_exp=4 order=pairs_swapped" : "size_exp=4 order=in_order";
+		// sized like the data queue of Takion, starting close to the wraparound so longer runs cross it
+		bench_reorder_Bench b;
+		b.seq_num = 0xfffff000;
+		b.swapped = swapped;
+		if(chiaki_reorder_queue_init_32(&b.queue, 4, b.seq_num) != CHIAKI_ERR_SUCCESS)
+			return;
+		bench_run(bench, "reorder_queue", params, 0, bench_reorder, &b);
+		chiaki_reorder_queue_fini(&b.queue);
+
+		bench_reorder32_Bench b32;
+		b32.seq_num = 0xfffff000;
+		b32.swapped = swapped;
+		if(chiaki_reorder_queue32_init(&b32.queue, 4, b32.seq_num) != CHIAKI_ERR_SUCCESS)
+			return;
+		bench_run(bench, "reorder_queue32", params, 0, bench_reorder32, &b32);
+		chiaki_reorder_queue32_fini(&b32.queue);
+	}
+}
+
+#define AV_PACKET_SIZE 1400
+
+typedef struct av_packet_bench_t
+{
+	ChiakiTakionAVPacketParse parse;
+	ChiakiKeyState key_state;
+	uint8_t buf[AV_PACKET_SIZE];
+	uint32_t key_pos;
+} AVPacketBench;
+
+static void write_u32_be(uint8_t *buf, uint32_t v)
+{
+	buf[0] = (uint8_t)(v >> 24);
+	buf[1] = (uint8_t)(v >> 16);
+	buf[2] = (uint8_t)(v >> 8);
+	buf[3] = (uint8_t)v;
+}
+
+static bool bench_av_packet(void *user, uint64_t iterations)
+{
+	AVPacketBench *b = user;
+	ChiakiTakionAVPacket packet;
+	for(uint64_t i=0; i<iterations; i++)
+	{
+		// advances like consecutive packets, so the key state sees no jumps
+		write_u32_be(b->buf + 1 + 0xd, b->key_pos);
+		b->key_pos += AV_PACKET_SIZE;
+		if(b->parse(&packet, &b->key_state, b->buf, sizeof(b->buf)) != CHIAKI_ERR_SUCCESS || !packet.is_video)
+			return false;
+	}
+	return true;
+}
+
+void bench_av_packet_parse(Bench *bench)
+{
+	AVPacketBench b;
+	memset(b.buf, 0x5a, sizeof(b.buf));
+	b.buf[0] = 2; // video
+	uint8_t *av = b.buf + 1;
+	av[0] = 0; av[1] = 1; // packet index
+	av[2] = 0; av[3] = 1; // frame index
+	// unit 3 of 32 source + 8 fec units
+	write_u32_be(av + 4, (3u << 0x15) | ((40u - 1) << 0xa) | 8u);
+	av[8] = 3; // codec
+
+	static const struct
+	{
+		const char *params;
+		ChiakiTakionAVPacketParse parse;
+	} cases[] = {
+		{ "v9 video", chiaki_takion_v9_av_packet_parse },
+		{ "v12 video", chiaki_takion_v12_av_packet_parse }
+	};
+	for(size_t c=0; c<sizeof(cases) / sizeof(cases[0]); c++)
+	{
+		b.parse = cases[c].parse;
+		chiaki_key_state_init(&b.key_state);
+		b.key_pos = 0;
+		bench_run(bench, "av_packet_parse", cases[c].params, 0, bench_av_packet, &b);
+	}
+}
@@ -0,0 +1,173 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include "bench.h"
+
+#include <chiaki/frameprocessor.h>
+#include <chiaki/bitstream.h>
+#include <chiaki/fec.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAME_UNIT_SIZE 1400
+#define FRAME_UNIT_STRIDE 1408 // what the frame processor uses for FRAME_UNIT_SIZE
+#define FRAME_UNITS_SOURCE 32
+#define FRAME_UNITS_FEC 8
+#define FRAME_UNITS_TOTAL (FRAME_UNITS_SOURCE + FRAME_UNITS_FEC)
+
+typedef struct frame_bench_t
+{
+	ChiakiFrameProcessor frame_processor;
+	uint8_t *units; // FRAME_UNITS_TOTAL units at FRAME_UNIT_STRIDE, fec units encoded from the source units
+	ChiakiTakionAVPacket packets[FRAME_UNITS_TOTAL];
+	unsigned int units_lost; // source units at the start of the frame that never arrive
+	bool stream;
+} FrameBench;
+
+static bool bench_frame(void *user, uint64_t iterations)
+{
+	FrameBench *b = user;
+	for(uint64_t i=0; i<iterations; i++)
+	{
+		// the units after the lost ones are put in order until the frame can be flushed,
+		// without losses that is after the last source unit, the remaining fec units only arrive afterwards
+		unsigned int first = b->units_lost;
+		unsigned int last = FRAME_UNITS_SOURCE + b->units_lost;
+		if(chiaki_frame_processor_alloc_frame(&b->frame_processor, &b->packets[first]) != CHIAKI_ERR_SUCCESS)
+			return false;
+		for(unsigned int u=first; u<last; u++)
+		{
+			if(chiaki_frame_processor_put_unit(&b->frame_processor, &b->packets[u]) != CHIAKI_ERR_SUCCESS)
+				return false;
+			if(b->stream)
+			{
+				uint8_t *frame;
+				chiaki_frame_processor_stream(&b->frame_processor, &frame);
+			}
+		}
+		uint8_t *frame;
+		size_t frame_size;
+		ChiakiFrameProcessorFlushResult result = chiaki_frame_processor_flush(&b->frame_processor, &frame, &frame_size);
+		if(result != (b->units_lost ? CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS : CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_SUCCESS))
+			return false;
+	}
+	return true;
+}
+
+void bench_frame_processor(Bench *bench)
+{
+	FrameBench b;
+	b.units = malloc(FRAME_UNITS_TOTAL * FRAME_UNIT_STRIDE);
+	if(!b.units)
+		return;
+	memset(b.units, 0, FRAME_UNITS_TOTAL * FRAME_UNIT_STRIDE);
+	for(size_t u=0; u<FRAME_UNITS_SOURCE; u++)
+	{
+		uint8_t *unit = b.units + u * FRAME_UNIT_STRIDE;
+		// the first 2 bytes are the padding of the unit, none here
+		for(size_t i=2; i<FRAME_UNIT_SIZE; i++)
+			unit[i] = (uint8_t)(u * 7 + i);
+	}
+	if(chiaki_fec_encode(b.units, FRAME_UNIT_SIZE, FRAME_UNIT_STRIDE, FRAME_UNITS_SOURCE, FRAME_UNITS_FEC) != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to encode FEC for the frame processor\n");
+		free(b.units);
+		return;
+	}
+
+	memset(b.packets, 0, sizeof(b.packets));
+	for(unsigned int u=0; u<FRAME_UNITS_TOTAL; u++)
+	{
+		ChiakiTakionAVPacket *packet = &b.packets[u];
+		packet->is_video = true;
+		packet->unit_index = (ChiakiSeqNum16)u;
+		packet->units_in_frame_total = FRAME_UNITS_TOTAL;
+		packet->units_in_frame_fec = FRAME_UNITS_FEC;
+		packet->data = b.units + u * FRAME_UNIT_STRIDE;
+		packet->data_size = FRAME_UNIT_SIZE;
+	}
+
+	static const struct
+	{
+		const char *params;
+		unsigned int units_lost;
+		bool stream;
+	} cases[] = {
+		{ "units=32+8 lost=0", 0, false },
+		{ "units=32+8 lost=2", 2, false },
+		{ "units=32+8 lost=0 stream", 0, true }
+	};
+	for(size_t c=0; c<sizeof(cases) / sizeof(cases[0]); c++)
+	{
+		chiaki_frame_processor_init(&b.frame_processor, NULL, &bench->log);
+		chiaki_frame_processor_set_stream(&b.frame_processor, cases[c].stream);
+		b.units_lost = cases[c].units_lost;
+		b.stream = cases[c].stream;
+		bench_run(bench, "frame_processor", cases[c].params, FRAME_UNITS_SOURCE * FRAME_UNIT_SIZE, bench_frame, &b);
+		chiaki_frame_processor_fini(&b.frame_processor);
+	}
+	free(b.units);
+}
+
+#define SLICE_SIZE 0x8000
+
+typedef struct bitstream_bench_t
+{
+	ChiakiBitstream bitstream;
+	uint8_t *slice;
+	size_t slice_size;
+	ChiakiBitstreamSliceType expected;
+} BitstreamBench;
+
+static bool bench_slice(void *user, uint64_t iterations)
+{
+	BitstreamBench *b = user;
+	for(uint64_t i=0; i<iterations; i++)
+	{
+		ChiakiBitstreamSlice slice;
+		if(!chiaki_bitstream_slice(&b->bitstream, b->slice, (unsigned)b->slice_size, &slice) || slice.slice_type != b->expected)
+			return false;
+	}
+	return true;
+}
+
+void bench_bitstream(Bench *bench)
+{
+	// baseline profile sps, log2_max_frame_num_minus4 = 0
+	static uint8_t sps[] = { 0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0x00, 0x1f, 0xe9, 0x40, 0x28, 0x02, 0xdd, 0x08 };
+	// first_mb_in_slice = 0, slice_type, pic_parameter_set_id = 0, frame_num = 0, ...
+	static const uint8_t slice_p[] = { 0x00, 0x00, 0x00, 0x01, 0x61, 0x9a, 0x65 };
+	static const uint8_t slice_idr[] = { 0x00, 0x00, 0x00, 0x01, 0x65, 0x88 };
+	static const struct
+	{
+		const char *params;
+		const uint8_t *header;
+		size_t header_size;
+		ChiakiBitstreamSliceType expected;
+	} cases[] = {
+		{ "h264 p", slice_p, sizeof(slice_p), CHIAKI_BITSTREAM_SLICE_P },
+		{ "h264 idr", slice_idr, sizeof(slice_idr), CHIAKI_BITSTREAM_SLICE_I }
+	};
+
+	BitstreamBench b;
+	chiaki_bitstream_init(&b.bitstream, &bench->log, CHIAKI_CODEC_H264);
+	if(!chiaki_bitstream_header(&b.bitstream, sps, sizeof(sps)))
+	{
+		fprintf(stderr, "Failed to parse the sps for the bitstream\n");
+		return;
+	}
+	b.slice = malloc(SLICE_SIZE);
+	if(!b.slice)
+		return;
+	b.slice_size = SLICE_SIZE;
+	for(size_t c=0; c<sizeof(cases) / sizeof(cases[0]); c++)
+	{
+		// the rest of the slice is never looked at, but may not contain a start code
+		for(size_t i=0; i<SLICE_SIZE; i++)
+			b.slice[i] = (uint8_t)(0x80 | (i * 13));
+		memcpy(b.slice, cases[c].header, cases[c].header_size);
+		b.expected = cases[c].expected;
+		bench_run(bench, "bitstream_slice", cases[c].params, 0, bench_slice, &b);
+	}
+	free(b.slice);
+}
@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_AESCTR_H
+#define CHIAKI_AESCTR_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_AES_CTR_BLOCK_SIZE 0x10
+
+/**
+ * Table-based AES-128 encryption specialized for generating a CTR mode key stream.
+ *
+ * Used instead of the crypto library on targets where calling into it for every single block is too slow (PS Vita).
+ * The counter is the 16 byte iv interpreted as a little endian integer to which the block index is added,
+ * matching what ChiakiGKCrypt expects.
+ */
+typedef struct chiaki_aes_ctr_t
+{
+	uint32_t round_keys[44];
+} ChiakiAesCtr;
+
+CHIAKI_EXPORT void chiaki_aes_ctr_init(ChiakiAesCtr *ctr, const uint8_t *key);
+
+/**
+ * Generate the key stream for blocks_count blocks, starting at counter iv + block_index.
+ *
+ * @param buf must have space for blocks_count * CHIAKI_AES_CTR_BLOCK_SIZE bytes
+ */
+CHIAKI_EXPORT void chiaki_aes_ctr_gen_key_stream(ChiakiAesCtr *ctr, const uint8_t *iv, uint64_t block_index, uint8_t *buf, size_t blocks_count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_AESCTR_H
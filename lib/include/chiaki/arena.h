@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_ARENA_H
+#define CHIAKI_ARENA_H
+
+#include "common.h"
+#include "log.h"
+#include "thread.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Subsystem an allocation is accounted to
+ */
+typedef enum chiaki_arena_tag_t
+{
+	CHIAKI_ARENA_TAG_VIDEO,
+	CHIAKI_ARENA_TAG_CTRL,
+	CHIAKI_ARENA_TAG_TAKION,
+	CHIAKI_ARENA_TAG_RUDP,
+	CHIAKI_ARENA_TAG_COUNT
+} ChiakiArenaTag;
+
+CHIAKI_EXPORT const char *chiaki_arena_tag_string(ChiakiArenaTag tag);
+
+/**
+ * Size classes are powers of 2 from 1 << CHIAKI_ARENA_CLASS_MIN_EXP up to 1 << CHIAKI_ARENA_CLASS_MAX_EXP bytes
+ */
+#define CHIAKI_ARENA_CLASS_MIN_EXP 6
+#define CHIAKI_ARENA_CLASS_MAX_EXP 12
+#define CHIAKI_ARENA_CLASSES (CHIAKI_ARENA_CLASS_MAX_EXP - CHIAKI_ARENA_CLASS_MIN_EXP + 1)
+
+/**
+ * Size of the chunks that blocks of all classes are carved from
+ */
+#define CHIAKI_ARENA_CHUNK_SIZE 0x10000
+
+typedef struct chiaki_arena_stats_t
+{
+	uint64_t current; // bytes requested and not freed yet
+	uint64_t peak;
+	uint64_t allocs;
+	uint64_t frees;
+} ChiakiArenaStats;
+
+typedef struct chiaki_arena_usage_t
+{
+	ChiakiArenaStats tags[CHIAKI_ARENA_TAG_COUNT];
+	uint64_t reserved; // bytes taken from the heap, i.e. all chunks and large blocks
+	uint64_t reserved_peak;
+} ChiakiArenaUsage;
+
+typedef struct chiaki_arena_block_t ChiakiArenaBlock;
+typedef struct chiaki_arena_chunk_t ChiakiArenaChunk;
+
+/**
+ * Allocator for the small buffers that come and go over the lifetime of a session.
+ *
+ * Blocks up to 1 << CHIAKI_ARENA_CLASS_MAX_EXP bytes are carved from large chunks and kept on a free list
+ * of their size class when freed, so they are reused instead of going back to the system heap, which
+ * fragments quickly on the Vita. Larger blocks are taken from the heap directly.
+ * Everything is released at once in chiaki_arena_fini(), even blocks that have not been freed.
+ *
+ * All functions are thread-safe.
+ */
+typedef struct chiaki_arena_t
+{
+	ChiakiLog *log;
+	ChiakiMutex mutex;
+
+	// protected by mutex
+	ChiakiArenaChunk *chunks;
+	size_t chunk_used; // bytes used of the first chunk
+	size_t chunks_count;
+	ChiakiArenaBlock *free_lists[CHIAKI_ARENA_CLASSES];
+	ChiakiArenaBlock *large; // blocks that are too large for any class
+	ChiakiArenaStats stats[CHIAKI_ARENA_TAG_COUNT];
+	uint64_t reserved;
+	uint64_t reserved_peak;
+} ChiakiArena;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_arena_init(ChiakiArena *arena, ChiakiLog *log);
+
+/**
+ * Release all memory of the arena, logging every tag that still had blocks allocated.
+ */
+CHIAKI_EXPORT void chiaki_arena_fini(ChiakiArena *arena);
+
+/**
+ * If arena is NULL, this is plain malloc(), so code that is used outside of a session can call it unconditionally.
+ *
+ * @return a block aligned for any type, or NULL
+ */
+CHIAKI_EXPORT void *chiaki_arena_alloc(ChiakiArena *arena, ChiakiArenaTag tag, size_t size);
+
+/**
+ * @param ptr block from chiaki_arena_alloc() with the same arena, or NULL
+ */
+CHIAKI_EXPORT void chiaki_arena_free(ChiakiArena *arena, void *ptr);
+
+/**
+ * Resize ptr like realloc(), staying in place if the block's size class still fits.
+ * On failure, ptr is left untouched.
+ */
+CHIAKI_EXPORT void *chiaki_arena_realloc(ChiakiArena *arena, ChiakiArenaTag tag, void *ptr, size_t size);
+
+CHIAKI_EXPORT void chiaki_arena_get_stats(ChiakiArena *arena, ChiakiArenaTag tag, ChiakiArenaStats *stats);
+
+/**
+ * Get the stats of all tags at once, e.g. for an overlay that derives allocation rates from two readings.
+ */
+CHIAKI_EXPORT void chiaki_arena_get_usage(ChiakiArena *arena, ChiakiArenaUsage *usage);
+
+CHIAKI_EXPORT void chiaki_arena_log(ChiakiArena *arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_ARENA_H
@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_ATOMIC_H
+#define CHIAKI_ATOMIC_H
+
+#include "common.h"
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Minimal set of atomic operations on size_t for lock-free structures shared between threads.
+ *
+ * GCC and Clang (including the Vita and Switch toolchains) use the __atomic builtins,
+ * MSVC falls back to volatile accesses with full memory barriers.
+ */
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <windows.h>
+
+static inline size_t chiaki_atomic_load_acquire(const size_t *p) { size_t v = *(const volatile size_t *)p; MemoryBarrier(); return v; }
+static inline void chiaki_atomic_store_release(size_t *p, size_t v) { MemoryBarrier(); *(volatile size_t *)p = v; }
+static inline size_t chiaki_atomic_load_seq_cst(const size_t *p) { MemoryBarrier(); size_t v = *(const volatile size_t *)p; MemoryBarrier(); return v; }
+static inline void chiaki_atomic_store_seq_cst(size_t *p, size_t v) { MemoryBarrier(); *(volatile size_t *)p = v; MemoryBarrier(); }
+static inline void chiaki_atomic_fence_seq_cst() { MemoryBarrier(); }
+#ifdef _WIN64
+static inline size_t chiaki_atomic_fetch_add(size_t *p, size_t v) { return (size_t)InterlockedExchangeAdd64((volatile LONG64 *)p, (LONG64)v); }
+static inline size_t chiaki_atomic_cas_value(size_t *p, size_t expected, size_t desired) { return (size_t)InterlockedCompareExchange64((volatile LONG64 *)p, (LONG64)desired, (LONG64)expected); }
+#else
+static inline size_t chiaki_atomic_fetch_add(size_t *p, size_t v) { return (size_t)InterlockedExchangeAdd((volatile LONG *)p, (LONG)v); }
+static inline size_t chiaki_atomic_cas_value(size_t *p, size_t expected, size_t desired) { return (size_t)InterlockedCompareExchange((volatile LONG *)p, (LONG)desired, (LONG)expected); }
+#endif
+static inline bool chiaki_atomic_compare_exchange(size_t *p, size_t *expected, size_t desired)
+{
+	size_t prev = chiaki_atomic_cas_value(p, *expected, desired);
+	if(prev == *expected)
+		return true;
+	*expected = prev;
+	return false;
+}
+
+#else
+
+static inline size_t chiaki_atomic_load_acquire(const size_t *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline void chiaki_atomic_store_release(size_t *p, size_t v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+static inline size_t chiaki_atomic_load_seq_cst(const size_t *p) { return __atomic_load_n(p, __ATOMIC_SEQ_CST); }
+static inline void chiaki_atomic_store_seq_cst(size_t *p, size_t v) { __atomic_store_n(p, v, __ATOMIC_SEQ_CST); }
+static inline void chiaki_atomic_fence_seq_cst() { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+static inline size_t chiaki_atomic_fetch_add(size_t *p, size_t v) { return __atomic_fetch_add(p, v, __ATOMIC_RELAXED); }
+
+/**
+ * Set *p to desired if it is *expected (acquire-release), otherwise load its current value into *expected.
+ */
+static inline bool chiaki_atomic_compare_exchange(size_t *p, size_t *expected, size_t desired) { return __atomic_compare_exchange_n(p, expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); }
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_ATOMIC_H
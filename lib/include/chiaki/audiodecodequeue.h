@@ -0,0 +1,116 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_AUDIODECODEQUEUE_H
+#define CHIAKI_AUDIODECODEQUEUE_H
+
+#include "common.h"
+#include "log.h"
+#include "thread.h"
+#include "audio.h"
+#include "audioreceiver.h"
+#include "spscring.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Max number of compressed frames waiting to be decoded = 2^CHIAKI_AUDIO_DECODE_QUEUE_SIZE_EXP
+ */
+#define CHIAKI_AUDIO_DECODE_QUEUE_SIZE_EXP 5
+
+/**
+ * Audio units have an 8 bit size, so every frame fits
+ */
+#define CHIAKI_AUDIO_DECODE_QUEUE_FRAME_SIZE_MAX 0x100
+
+typedef struct chiaki_audio_decode_queue_entry_t
+{
+	bool is_header;
+	ChiakiAudioHeader header;
+	unsigned int frames_lost; // frames lost right before this one, including dropped ones
+	size_t buf_size;
+	uint8_t buf[CHIAKI_AUDIO_DECODE_QUEUE_FRAME_SIZE_MAX];
+} ChiakiAudioDecodeQueueEntry;
+
+typedef struct chiaki_audio_decode_queue_stats_t
+{
+	uint64_t frames; // passed to the sink
+	uint64_t frames_dropped; // because the queue was full
+	size_t depth; // frames queued when the last one was taken out
+	size_t depth_max;
+	uint64_t decode_us_avg; // time spent in the sink's frame callback
+	uint64_t decode_us_max;
+} ChiakiAudioDecodeQueueStats;
+
+/**
+ * Lock-free ring of compressed audio frames in front of a dedicated thread that passes them on to the audio sink,
+ * so decoding and a possibly blocking audio output do not stall the thread receiving the stream.
+ *
+ * The queue lives as long as the session, the thread runs from chiaki_audio_decode_queue_start()
+ * to chiaki_audio_decode_queue_stop(). Pushing must always happen from the same thread or under the same lock.
+ * If the ring is full, the new frame is dropped and reported to the sink as lost with the next one.
+ */
+typedef struct chiaki_audio_decode_queue_t
+{
+	ChiakiLog *log;
+	ChiakiAudioSink sink;
+	ChiakiSPSCRing ring;
+	ChiakiThread thread;
+	bool running;
+
+	ChiakiMutex mutex; // only used to sleep on an empty ring and for the stats
+	ChiakiCond cond;
+	size_t waiting; // atomic, nonzero while the thread is waiting for cond
+	bool should_stop; // protected by mutex
+
+	unsigned int frames_lost_pending; // only written by the producer
+	size_t frames_dropped; // atomic
+
+	uint64_t frames; // protected by mutex
+	uint64_t decode_us_sum;
+	uint64_t decode_us_max;
+	size_t depth;
+	size_t depth_max;
+} ChiakiAudioDecodeQueue;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_audio_decode_queue_init(ChiakiAudioDecodeQueue *queue, ChiakiLog *log);
+CHIAKI_EXPORT void chiaki_audio_decode_queue_fini(ChiakiAudioDecodeQueue *queue);
+
+/**
+ * Start the thread passing frames on to sink.
+ *
+ * @param sink contents are copied
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_audio_decode_queue_start(ChiakiAudioDecodeQueue *queue, ChiakiAudioSink *sink);
+
+/**
+ * Stop and join the thread. Frames still in the ring are discarded.
+ */
+CHIAKI_EXPORT void chiaki_audio_decode_queue_stop(ChiakiAudioDecodeQueue *queue);
+
+/**
+ * Queue a header, which is passed to the sink in order with the frames.
+ */
+CHIAKI_EXPORT void chiaki_audio_decode_queue_push_header(ChiakiAudioDecodeQueue *queue, ChiakiAudioHeader *header);
+
+/**
+ * Queue a compressed frame.
+ *
+ * @param frames_lost frames lost right before this one
+ */
+CHIAKI_EXPORT void chiaki_audio_decode_queue_push_frame(ChiakiAudioDecodeQueue *queue, uint8_t *buf, size_t buf_size, unsigned int frames_lost);
+
+/**
+ * Can be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_audio_decode_queue_get_stats(ChiakiAudioDecodeQueue *queue, ChiakiAudioDecodeQueueStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_AUDIODECODEQUEUE_H
@@ -16,6 +16,7 @@ extern "C" {
 
 typedef void (*ChiakiAudioSinkHeader)(ChiakiAudioHeader *header, void *user);
 typedef void (*ChiakiAudioSinkFrame)(uint8_t *buf, size_t buf_size, void *user);
+typedef void (*ChiakiAudioSinkFramesLost)(unsigned int frames_lost, void *user);
 
 /**
  * Sink that receives Audio encoded as Opus
@@ -25,8 +26,39 @@ typedef struct chiaki_audio_sink_t
 	void *user;
 	ChiakiAudioSinkHeader header_cb;
 	ChiakiAudioSinkFrame frame_cb;
+
+	/**
+	 * Optional, called right before frame_cb when frames_lost frames directly preceding
+	 * the next frame never arrived, so the sink can conceal them.
+	 */
+	ChiakiAudioSinkFramesLost frames_lost_cb;
 } ChiakiAudioSink;
 
+/**
+ * Frames after a gap that are held back so the missing ones can still be played if they arrive a little late
+ */
+#define CHIAKI_AUDIO_RECEIVER_REORDER_FRAMES 4
+
+/**
+ * Max time a frame is held back, until the sink reports one with chiaki_session_audio_reorder_deadline()
+ */
+#define CHIAKI_AUDIO_RECEIVER_REORDER_DEADLINE_DEFAULT_US 10000
+
+/**
+ * Units of audio packets are at most 0xff bytes
+ */
+#define CHIAKI_AUDIO_RECEIVER_REORDER_BUF_SIZE 0x100
+
+typedef struct chiaki_audio_receiver_reorder_entry_t
+{
+	bool used;
+	bool is_haptics;
+	ChiakiSeqNum16 frame_index;
+	uint64_t arrival_us;
+	size_t buf_size;
+	uint8_t buf[CHIAKI_AUDIO_RECEIVER_REORDER_BUF_SIZE];
+} ChiakiAudioReceiverReorderEntry;
+
 typedef struct chiaki_audio_receiver_t
 {
 	struct chiaki_session_t *session;
@@ -34,7 +66,14 @@ typedef struct chiaki_audio_receiver_t
 	ChiakiMutex mutex;
 	ChiakiSeqNum16 frame_index_prev;
 	bool frame_index_startup; // whether frame_index_prev has definitely not wrapped yet
+	bool frame_index_valid; // whether any frame has been passed on yet
+	uint64_t frames_lost;
+	uint64_t frames_reordered; // late frames that were still played because the ones after them were held back
+	ChiakiAudioReceiverReorderEntry reorder[CHIAKI_AUDIO_RECEIVER_REORDER_FRAMES]; // all after frame_index_prev, in no particular order
+	size_t reorder_count;
 	ChiakiPacketStats *packet_stats;
+	struct chiaki_audio_decode_queue_t *decode_queue; // audio frames and headers go through this if not NULL
+
 } ChiakiAudioReceiver;
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_audio_receiver_init(ChiakiAudioReceiver *audio_receiver, struct chiaki_session_t *session, ChiakiPacketStats *packet_stats);
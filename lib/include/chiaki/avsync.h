@@ -0,0 +1,78 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_AVSYNC_H
+#define CHIAKI_AVSYNC_H
+
+#include "common.h"
+#include "thread.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Max delay added to either audio or video to bring them in sync
+ */
+#define CHIAKI_AV_SYNC_DELAY_MAX_US 200000
+
+/**
+ * Samples needed of each before steering starts
+ */
+#define CHIAKI_AV_SYNC_VIDEO_SAMPLES_MIN 60
+#define CHIAKI_AV_SYNC_AUDIO_SAMPLES_MIN 4
+
+typedef struct chiaki_av_sync_state_t
+{
+	uint64_t video_latency_us; // averaged, from the first unit received to the frame displayed
+	uint64_t audio_latency_us; // averaged, from the frame received to being played, as reported by the sink
+	int64_t offset_us; // audio_latency_us - video_latency_us, positive if audio is late
+	uint64_t audio_delay_us; // delay the audio sink should add, e.g. to its jitter buffer target
+	uint64_t video_delay_us; // delay the video sink should add before presenting a frame
+} ChiakiAVSyncState;
+
+/**
+ * Keeps audio and video within max_offset_us of each other.
+ *
+ * Both sinks report the latency of what they output, and each audio report steers the delays
+ * so that the offset stays within the bound with the lowest total latency: a delay on the side that
+ * is ahead is only added after the delay on the side that is behind has been removed, and delays are
+ * shrunk again as far as the bound allows.
+ * The delays are part of the reported latencies, so a sink must not subtract them.
+ *
+ * Can be used from multiple threads.
+ */
+typedef struct chiaki_av_sync_t
+{
+	ChiakiMutex mutex;
+	uint64_t max_offset_us; // 0 disables steering
+	uint64_t video_latency_avg_us;
+	uint64_t video_samples;
+	uint64_t audio_latency_avg_us;
+	uint64_t audio_samples;
+	uint64_t audio_delay_us;
+	uint64_t video_delay_us;
+} ChiakiAVSync;
+
+/**
+ * @param max_offset_us max latency difference between audio and video that is tolerated, 0 to never add any delays
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_av_sync_init(ChiakiAVSync *sync, uint64_t max_offset_us);
+CHIAKI_EXPORT void chiaki_av_sync_fini(ChiakiAVSync *sync);
+
+CHIAKI_EXPORT void chiaki_av_sync_video_latency(ChiakiAVSync *sync, uint64_t latency_us);
+
+/**
+ * Report the audio latency and steer the delays.
+ */
+CHIAKI_EXPORT void chiaki_av_sync_audio_latency(ChiakiAVSync *sync, uint64_t latency_us);
+
+CHIAKI_EXPORT void chiaki_av_sync_get(ChiakiAVSync *sync, ChiakiAVSyncState *state);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_AVSYNC_H
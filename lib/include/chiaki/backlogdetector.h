@@ -0,0 +1,116 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_BACKLOGDETECTOR_H
+#define CHIAKI_BACKLOGDETECTOR_H
+
+#include "common.h"
+#include "log.h"
+#include "seqnum.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Default age a frame must have when it arrives within a draining backlog to start skipping
+ */
+#define CHIAKI_BACKLOG_THRESHOLD_MS_DEFAULT 200
+
+/**
+ * While skipping, the IDR frame is requested again if it has not arrived after this long
+ */
+#define CHIAKI_BACKLOG_IDR_RETRY_MS 500
+
+/**
+ * Give up waiting for an IDR frame after this long and pass frames on again
+ */
+#define CHIAKI_BACKLOG_SKIP_MAX_MS 3000
+
+typedef enum chiaki_backlog_action_t
+{
+	CHIAKI_BACKLOG_ACTION_NONE, // pass the frame on as usual
+	CHIAKI_BACKLOG_ACTION_SKIP, // the frame is stale, skip it
+	CHIAKI_BACKLOG_ACTION_SKIP_REQUEST_IDR // skip it and (again) request an IDR frame
+} ChiakiBacklogAction;
+
+typedef struct chiaki_backlog_stats_t
+{
+	uint64_t backlogs; // detected
+	uint64_t frames_skipped;
+	uint64_t idr_requests;
+	uint64_t timeouts; // backlogs given up on because no IDR frame came
+	uint64_t age_max_us; // of a frame that started a backlog
+} ChiakiBacklogStats;
+
+/**
+ * Detects a backlog of stale frames, e.g. the burst of queued packets after a Wi-Fi stall, so they can be
+ * skipped instead of being assembled and decoded one after another while the display lags behind.
+ *
+ * The console sends frames at a fixed rate, so a frame's nominal send time follows from its index. The age of a
+ * frame is how much later than that it arrives, relative to a baseline that follows the frames arriving at the
+ * regular pace (or slower, if the console sends fewer frames). A frame that arrives faster than its nominal interval
+ * after the previous one, so a queue is draining, at an age above the threshold starts a backlog. Everything is
+ * skipped from then on until a keyframe, which the caller requests, so the stream resumes at the live edge after
+ * a short freeze.
+ *
+ * Not thread-safe, frames are pushed from the receiving thread only.
+ */
+typedef struct chiaki_backlog_detector_t
+{
+	ChiakiLog *log;
+	uint64_t frame_interval_us; // 0 if disabled
+	uint64_t threshold_us;
+
+	bool frame_valid;
+	ChiakiSeqNum16 frame_index_prev;
+	uint64_t arrival_prev_us;
+	uint64_t send_us; // nominal send time of frame_index_prev, from the first frame on
+	int64_t base_offset_us; // arrival - send_us of a frame arriving on time
+
+	bool skipping;
+	uint64_t skip_start_us;
+	uint64_t idr_requested_us;
+	uint64_t skipped_cur; // in the current backlog
+	uint64_t holdoff_until_us; // no new backlog is started before, so a late keyframe can not start another one
+
+	ChiakiBacklogStats stats;
+} ChiakiBacklogDetector;
+
+/**
+ * @param frame_interval_us interval the console sends frames at, 0 disables the detector
+ * @param threshold_ms 0 for CHIAKI_BACKLOG_THRESHOLD_MS_DEFAULT
+ */
+CHIAKI_EXPORT void chiaki_backlog_detector_init(ChiakiBacklogDetector *detector, ChiakiLog *log,
+		uint64_t frame_interval_us, unsigned int threshold_ms);
+
+/**
+ * Report the arrival of the first packet of a new frame. Frames older than the newest one so far are only
+ * skipped while a backlog is being skipped.
+ */
+CHIAKI_EXPORT ChiakiBacklogAction chiaki_backlog_detector_frame(ChiakiBacklogDetector *detector, ChiakiSeqNum16 frame_index,
+		uint64_t arrival_us);
+
+/**
+ * A keyframe arrived while skipping, frames are passed on again from it.
+ *
+ * @return number of frames skipped in the backlog that ended
+ */
+CHIAKI_EXPORT uint64_t chiaki_backlog_detector_keyframe(ChiakiBacklogDetector *detector);
+
+/**
+ * Count a frame that was skipped.
+ */
+static inline void chiaki_backlog_detector_skipped(ChiakiBacklogDetector *detector)
+{
+	detector->skipped_cur++;
+	detector->stats.frames_skipped++;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_BACKLOGDETECTOR_H
@@ -4,6 +4,8 @@
 #define CHIAKI_BITSTREAM_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
 
 #include "common.h"
 #include "log.h"
@@ -12,6 +14,12 @@
 extern "C" {
 #endif
 
+/**
+ * Max number of bytes of a slice NAL unit that are looked at to parse its header.
+ * Slice headers are much smaller, this only keeps parsing independent of the frame size.
+ */
+#define CHIAKI_BITSTREAM_SLICE_HEADER_MAX 128
+
 typedef struct chiaki_bitstream_t
 {
 	ChiakiLog *log;
@@ -47,11 +55,29 @@ typedef struct chiaki_bitstream_slice_t
 {
 	ChiakiBitstreamSliceType slice_type;
 	unsigned reference_frame;
+	bool is_reference; // whether later frames may reference this one
 } ChiakiBitstreamSlice;
 
+/**
+ * Find the next 3 byte start code (00 00 01), scanning a machine word at a time.
+ *
+ * @return offset of the first byte of the start code in data, or size if there is none.
+ * For a 4 byte start code, this is the offset of its second byte.
+ */
+CHIAKI_EXPORT size_t chiaki_bitstream_find_startcode(const uint8_t *data, size_t size);
+
 CHIAKI_EXPORT void chiaki_bitstream_init(ChiakiBitstream *bitstream, ChiakiLog *log, ChiakiCodec codec);
 CHIAKI_EXPORT bool chiaki_bitstream_header(ChiakiBitstream *bitstream, uint8_t *data, unsigned size);
+
+/**
+ * Parse the fields of the first slice header in data that are needed for reference tracking.
+ * Only the first CHIAKI_BITSTREAM_SLICE_HEADER_MAX bytes after the start code are read.
+ */
 CHIAKI_EXPORT bool chiaki_bitstream_slice(ChiakiBitstream *bitstream, uint8_t *data, unsigned size, ChiakiBitstreamSlice *slice);
+
+/**
+ * Rewrite the reference of the first slice in data. Only supported for H.265.
+ */
 CHIAKI_EXPORT bool chiaki_bitstream_slice_set_reference_frame(ChiakiBitstream *bitstream, uint8_t *data, unsigned size, unsigned reference_frame);
 
 #ifdef __cplusplus
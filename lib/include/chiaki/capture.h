@@ -0,0 +1,99 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_CAPTURE_H
+#define CHIAKI_CAPTURE_H
+
+#include "common.h"
+#include "thread.h"
+#include "ecdh.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_CAPTURE_KEY_SIZE 0x10 // same as CHIAKI_HANDSHAKE_KEY_SIZE
+
+/**
+ * A capture file starts with CHIAKI_CAPTURE_MAGIC, followed by records of a 16 byte header
+ * (type: u32, payload size: u32, time in us since the Takion record: u64, all little endian) and the payload.
+ */
+#define CHIAKI_CAPTURE_MAGIC "CHKCAP01"
+#define CHIAKI_CAPTURE_MAGIC_SIZE 8
+#define CHIAKI_CAPTURE_RECORD_HEADER_SIZE 16
+
+typedef enum chiaki_capture_record_type_t
+{
+	CHIAKI_CAPTURE_RECORD_TAKION = 1, // version: u8, tag_local: u32, tag_remote: u32, written once the handshake is done
+	CHIAKI_CAPTURE_RECORD_KEYS = 2, // handshake key, ECDH secret
+	CHIAKI_CAPTURE_RECORD_DATAGRAM = 3 // raw datagram as received from the socket
+} ChiakiCaptureRecordType;
+
+/**
+ * Records everything needed to replay the receiving side of a stream connection with a ChiakiCaptureReader.
+ * The file contains the session keys, so it can be used to decrypt the whole session.
+ *
+ * Writing is buffered and can be done from any thread.
+ */
+typedef struct chiaki_capture_t
+{
+	FILE *file;
+	ChiakiMutex mutex;
+	uint64_t start_us;
+	uint64_t datagrams;
+	bool failed;
+} ChiakiCapture;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_capture_init(ChiakiCapture *capture, const char *filename);
+CHIAKI_EXPORT void chiaki_capture_fini(ChiakiCapture *capture);
+
+CHIAKI_EXPORT void chiaki_capture_takion(ChiakiCapture *capture, uint8_t version, uint32_t tag_local, uint32_t tag_remote);
+CHIAKI_EXPORT void chiaki_capture_keys(ChiakiCapture *capture, const uint8_t *handshake_key, const uint8_t *ecdh_secret);
+CHIAKI_EXPORT void chiaki_capture_datagram(ChiakiCapture *capture, const uint8_t *buf, size_t buf_size);
+
+/**
+ * Reads a capture for a Takion to replay instead of reading its socket.
+ */
+typedef struct chiaki_capture_reader_t
+{
+	FILE *file;
+	long data_offset;
+
+	uint8_t version;
+	uint32_t tag_local;
+	uint32_t tag_remote;
+	uint8_t handshake_key[CHIAKI_CAPTURE_KEY_SIZE];
+	uint8_t ecdh_secret[CHIAKI_ECDH_SECRET_SIZE];
+
+	/**
+	 * If true, datagrams are passed on as fast as they can be processed once the stream is running,
+	 * otherwise at the times they were recorded at.
+	 */
+	bool max_speed;
+} ChiakiCaptureReader;
+
+/**
+ * Open filename and read its Takion and keys records, then position the reader at the first datagram.
+ *
+ * @return CHIAKI_ERR_INVALID_DATA if the file is not a capture or does not contain both records
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_capture_reader_init(ChiakiCaptureReader *reader, const char *filename);
+CHIAKI_EXPORT void chiaki_capture_reader_fini(ChiakiCaptureReader *reader);
+
+/**
+ * Read the next datagram.
+ *
+ * @param buf_size size of buf, set to the size of the datagram
+ * @param time_us set to the time the datagram was received at, relative to the Takion record
+ * @return CHIAKI_ERR_DISCONNECTED at the end of the capture, CHIAKI_ERR_BUF_TOO_SMALL if the datagram does not fit
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_capture_reader_next(ChiakiCaptureReader *reader, uint8_t *buf, size_t *buf_size, uint64_t *time_us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_CAPTURE_H
@@ -5,28 +5,78 @@
 
 #include "takion.h"
 #include "thread.h"
+#include "timerwheel.h"
 #include "packetstats.h"
+#include "delayestimator.h"
+#include "loadmonitor.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * Max share of the received packets reported as lost to make the console lower its bitrate
+ */
+#define CHIAKI_CONGESTION_CONTROL_REPORTED_LOSS_MAX 0.15
+
+typedef struct chiaki_congestion_control_stats_t
+{
+	uint64_t bandwidth_bps; // estimated capacity of the path, 0 if not known yet
+	uint64_t received_bps;
+	double delay_trend_ms;
+	double delay_threshold_ms;
+	ChiakiDelayUsage delay_usage;
+	double reported_loss; // share of packets reported as lost, including the actual losses
+} ChiakiCongestionControlStats;
+
 typedef struct chiaki_congestion_control_t
 {
 	ChiakiTakion *takion;
 	ChiakiPacketStats *stats;
-	ChiakiThread thread;
-	ChiakiBoolPredCond stop_cond;
+	ChiakiDelayEstimator *delay_estimator;
+	ChiakiLoadMonitor *load_monitor;
+	ChiakiTimerWheel *timer_wheel; // NULL while not started
+	ChiakiTimerTask task;
 	double packet_loss;
+
+	// only accessed from the task
+	uint64_t updated_us;
+	uint64_t decreased_us;
+	bool backing_off;
+
+	// written by the task, protected by stats_mutex
+	ChiakiMutex stats_mutex;
+	double bandwidth_bps;
+	double received_bps;
+	double delay_trend_ms;
+	double delay_threshold_ms;
+	ChiakiDelayUsage delay_usage;
+	double reported_loss;
 } ChiakiCongestionControl;
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion, ChiakiPacketStats *stats);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_init(ChiakiCongestionControl *control);
+CHIAKI_EXPORT void chiaki_congestion_control_fini(ChiakiCongestionControl *control);
 
 /**
- * Stop control and join the thread
+ * Send congestion reports periodically as a task on timer_wheel.
+ *
+ * @param delay_estimator if not NULL, estimate the bandwidth from the delay gradient of the stream and report
+ * additional loss while it is exceeded, so the console backs off before packets actually get lost
+ * @param load_monitor if not NULL, also report the additional loss it asks for while the client can not keep up
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTimerWheel *timer_wheel,
+		ChiakiTakion *takion, ChiakiPacketStats *stats, ChiakiDelayEstimator *delay_estimator, ChiakiLoadMonitor *load_monitor);
+
+/**
+ * Stop control and wait for a report that is being sent. Does nothing if not started.
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_stop(ChiakiCongestionControl *control);
 
+/**
+ * Can be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_congestion_control_get_stats(ChiakiCongestionControl *control, ChiakiCongestionControlStats *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,96 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_CORRUPTFRAMEREPORTER_H
+#define CHIAKI_CORRUPTFRAMEREPORTER_H
+
+#include "common.h"
+#include "log.h"
+#include "thread.h"
+#include "seqnum.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Min time between two corrupt frame messages, reports in between are merged
+ */
+#define CHIAKI_CORRUPT_FRAME_REPORT_INTERVAL_MS 30
+
+/**
+ * Default number of frames in a row that could not be decoded after which an IDR frame is requested
+ */
+#define CHIAKI_CORRUPT_FRAME_IDR_FRAMES_DEFAULT 8
+
+/**
+ * Rate-limits corrupt frame messages to the server.
+ *
+ * The first report after a quiet period is sent immediately, everything reported within
+ * CHIAKI_CORRUPT_FRAME_REPORT_INTERVAL_MS after that is merged into a single range and sent with
+ * the next call to chiaki_corrupt_frame_reporter_poll() once the interval has passed.
+ * Ranges are merged into the smallest range covering all of them, so frames between two disjoint
+ * reports are marked corrupt too, which only makes the server pick an older reference.
+ *
+ * Can be used from multiple threads.
+ */
+typedef struct chiaki_corrupt_frame_reporter_t
+{
+	ChiakiLog *log;
+	struct chiaki_stream_connection_t *stream_connection;
+	ChiakiMutex mutex;
+
+	bool pending;
+	ChiakiSeqNum16 pending_start;
+	ChiakiSeqNum16 pending_end;
+	uint64_t last_sent_us;
+
+	unsigned int idr_frames;
+	unsigned int unrecoverable_frames; // frames in a row that could not be decoded
+
+	uint64_t reports;
+	uint64_t messages_sent;
+	uint64_t idr_requests;
+} ChiakiCorruptFrameReporter;
+
+/**
+ * @param idr_frames number of frames in a row that could not be decoded after which an IDR frame is requested,
+ * 0 for CHIAKI_CORRUPT_FRAME_IDR_FRAMES_DEFAULT
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_corrupt_frame_reporter_init(ChiakiCorruptFrameReporter *reporter, ChiakiLog *log,
+		struct chiaki_stream_connection_t *stream_connection, unsigned int idr_frames);
+
+/**
+ * Pending reports are discarded.
+ */
+CHIAKI_EXPORT void chiaki_corrupt_frame_reporter_fini(ChiakiCorruptFrameReporter *reporter);
+
+/**
+ * Report the frames from start to end (inclusive) as missing or corrupt.
+ */
+CHIAKI_EXPORT void chiaki_corrupt_frame_reporter_report(ChiakiCorruptFrameReporter *reporter, ChiakiSeqNum16 start, ChiakiSeqNum16 end);
+
+/**
+ * Report a frame that was assembled, but could not be decoded.
+ * Also counts towards requesting an IDR frame.
+ */
+CHIAKI_EXPORT void chiaki_corrupt_frame_reporter_report_unrecoverable(ChiakiCorruptFrameReporter *reporter, ChiakiSeqNum16 frame);
+
+/**
+ * To be called for every frame that was decoded successfully.
+ */
+CHIAKI_EXPORT void chiaki_corrupt_frame_reporter_frame_decoded(ChiakiCorruptFrameReporter *reporter);
+
+/**
+ * Send the merged pending reports if the interval has passed.
+ * Must be called regularly, e.g. for every received frame.
+ */
+CHIAKI_EXPORT void chiaki_corrupt_frame_reporter_poll(ChiakiCorruptFrameReporter *reporter);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_CORRUPTFRAMEREPORTER_H
@@ -24,7 +24,25 @@ extern "C" {
 
 typedef void (*ChiakiCantDisplayCb)(void *user, bool cant_display);
 
-typedef struct chiaki_ctrl_message_queue_t ChiakiCtrlMessageQueue;
+#define CHIAKI_CTRL_MESSAGE_QUEUE_SIZE 16
+#define CHIAKI_CTRL_MESSAGE_INLINE_PAYLOAD_SIZE 64
+
+/**
+ * Received messages are decrypted and handled right in the receive buffer, so none may be larger than this.
+ */
+#define CHIAKI_CTRL_RECV_BUF_SIZE 512
+
+/**
+ * Message waiting to be sent by the ctrl thread.
+ * Payloads up to CHIAKI_CTRL_MESSAGE_INLINE_PAYLOAD_SIZE are stored inline, only larger ones are allocated.
+ */
+typedef struct chiaki_ctrl_message_t
+{
+	uint16_t type;
+	size_t payload_size;
+	uint8_t *payload_alloc;
+	uint8_t payload[CHIAKI_CTRL_MESSAGE_INLINE_PAYLOAD_SIZE];
+} ChiakiCtrlMessage;
 
 typedef struct chiaki_ctrl_display_sink_t
 {
@@ -41,8 +59,11 @@ typedef struct chiaki_ctrl_t
 	bool login_pin_entered;
 	uint8_t *login_pin;
 	size_t login_pin_size;
-	ChiakiCtrlMessageQueue *msg_queue;
+	ChiakiCtrlMessage msg_queue[CHIAKI_CTRL_MESSAGE_QUEUE_SIZE]; // ring, protected by notif_mutex
+	size_t msg_queue_begin;
+	size_t msg_queue_count;
 	ChiakiStopPipe notif_pipe;
+	ChiakiStopPipeWaiter sock_waiter; // sock and notif_pipe, only used by the thread
 	ChiakiMutex notif_mutex;
 
 	bool login_pin_requested;
@@ -54,10 +75,10 @@ typedef struct chiaki_ctrl_t
 #ifdef __GNUC__
 	__attribute__((aligned(__alignof__(uint32_t))))
 #endif
-	uint8_t recv_buf[512];
-	uint8_t rudp_recv_buf[520];
+	uint8_t recv_buf[CHIAKI_CTRL_RECV_BUF_SIZE + 1]; // one spare byte, so a payload at the end can be terminated in place
 
-	size_t recv_buf_size;
+	size_t recv_buf_begin; // start of the first message not handled yet, everything before has been handled
+	size_t recv_buf_size; // end of the received data
 	uint64_t crypt_counter_local;
 	uint64_t crypt_counter_remote;
 	uint32_t keyboard_text_counter;
@@ -67,6 +88,11 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_ctrl_init(ChiakiCtrl *ctrl, struct chiaki_s
 CHIAKI_EXPORT ChiakiErrorCode chiaki_ctrl_start(ChiakiCtrl *ctrl);
 CHIAKI_EXPORT void chiaki_ctrl_stop(ChiakiCtrl *ctrl);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_ctrl_join(ChiakiCtrl *ctrl);
+/**
+ * Prepare a joined ctrl for chiaki_ctrl_start() again, e.g. to resume a session after the link was lost.
+ * Messages queued meanwhile are dropped, the mutex stays valid for other threads sending messages.
+ */
+CHIAKI_EXPORT void chiaki_ctrl_reset(ChiakiCtrl *ctrl);
 CHIAKI_EXPORT void chiaki_ctrl_fini(ChiakiCtrl *ctrl);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_ctrl_send_message(ChiakiCtrl *ctrl, uint16_t type, const uint8_t *payload, size_t payload_size);
 CHIAKI_EXPORT ChiakiErrorCode ctrl_message_toggle_microphone(ChiakiCtrl *ctrl, bool muted);
@@ -0,0 +1,111 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_DELAYESTIMATOR_H
+#define CHIAKI_DELAYESTIMATOR_H
+
+#include "common.h"
+#include "thread.h"
+#include "seqnum.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Number of frames the delay trend is fitted over
+ */
+#define CHIAKI_DELAY_ESTIMATOR_WINDOW 20
+
+typedef enum chiaki_delay_usage_t
+{
+	CHIAKI_DELAY_USAGE_NORMAL,
+	CHIAKI_DELAY_USAGE_OVERUSE, // queueing delay is building up, we receive more than the path can carry
+	CHIAKI_DELAY_USAGE_UNDERUSE // queues are draining
+} ChiakiDelayUsage;
+
+CHIAKI_EXPORT const char *chiaki_delay_usage_string(ChiakiDelayUsage usage);
+
+typedef struct chiaki_delay_estimate_t
+{
+	ChiakiDelayUsage usage;
+	double trend_ms; // scaled slope of the queueing delay, compared against threshold_ms
+	double threshold_ms;
+	uint64_t bytes; // received since the last call with reset
+} ChiakiDelayEstimate;
+
+/**
+ * Overuse detector on the one-way delay gradient of the video stream, after the one in Google Congestion Control.
+ *
+ * The console encodes and sends frames at a fixed rate, so the send time of a frame follows from its index.
+ * The difference between the inter-arrival time of two frames and their nominal interval is the change of
+ * queueing delay between them. The accumulated changes are smoothed and a line is fitted over the last
+ * CHIAKI_DELAY_ESTIMATOR_WINDOW frames. If its slope stays above an adaptive threshold, the path is overused.
+ *
+ * Frames and packets are pushed from the receiving thread only, the estimate can be read from any thread.
+ */
+typedef struct chiaki_delay_estimator_t
+{
+	ChiakiMutex mutex;
+
+	// only accessed from the receiving thread
+	uint64_t frame_interval_us;
+	bool frame_valid;
+	ChiakiSeqNum16 frame_index_prev;
+	uint64_t arrival_prev_us;
+	uint64_t arrival_first_us;
+	uint64_t bytes_pending;
+	double delay_acc_ms;
+	double delay_smoothed_ms;
+	double window_time_ms[CHIAKI_DELAY_ESTIMATOR_WINDOW];
+	double window_delay_ms[CHIAKI_DELAY_ESTIMATOR_WINDOW];
+	size_t window_count;
+	size_t window_next;
+	uint64_t deltas;
+	uint64_t threshold_updated_us;
+	double overuse_time_ms; // how long the trend has been above the threshold, < 0 if it is not
+	unsigned int overuse_count;
+	double trend_prev_ms;
+
+	// protected by mutex
+	ChiakiDelayUsage usage;
+	double trend_ms;
+	double threshold_ms;
+	uint64_t bytes;
+} ChiakiDelayEstimator;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_delay_estimator_init(ChiakiDelayEstimator *estimator);
+CHIAKI_EXPORT void chiaki_delay_estimator_fini(ChiakiDelayEstimator *estimator);
+
+/**
+ * Start over, e.g. for a new stream. Must not be called while frames are pushed.
+ *
+ * @param frame_interval_us interval the console sends frames at, 0 disables the detector
+ */
+CHIAKI_EXPORT void chiaki_delay_estimator_reset(ChiakiDelayEstimator *estimator, uint64_t frame_interval_us);
+
+/**
+ * Count a received packet of any frame.
+ */
+static inline void chiaki_delay_estimator_packet(ChiakiDelayEstimator *estimator, size_t bytes)
+{
+	estimator->bytes_pending += bytes;
+}
+
+/**
+ * Report the arrival of the first packet of a frame. Frames older than the newest one so far are ignored.
+ */
+CHIAKI_EXPORT void chiaki_delay_estimator_frame(ChiakiDelayEstimator *estimator, ChiakiSeqNum16 frame_index, uint64_t arrival_us);
+
+/**
+ * @param reset whether to reset the received bytes
+ */
+CHIAKI_EXPORT void chiaki_delay_estimator_get(ChiakiDelayEstimator *estimator, bool reset, ChiakiDelayEstimate *estimate);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_DELAYESTIMATOR_H
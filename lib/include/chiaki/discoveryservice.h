@@ -10,6 +10,12 @@
 extern "C" {
 #endif
 
+/**
+ * Known hosts are pinged directly starting at this interval, doubling up to ping_ms
+ */
+#define CHIAKI_DISCOVERY_SERVICE_FAST_PING_INITIAL_MS 50
+#define CHIAKI_DISCOVERY_SERVICE_KNOWN_ADDRS_MAX 16
+
 typedef void (*ChiakiDiscoveryServiceCb)(ChiakiDiscoveryHost *hosts, size_t hosts_count, void *user);
 
 typedef struct chiaki_discovery_service_options_t
@@ -21,10 +27,19 @@ typedef struct chiaki_discovery_service_options_t
 	struct sockaddr_in6 *send_addr;
 	size_t send_addr_size;
 	char *send_host;
+	const char **known_hosts; // addresses of hosts seen before, pinged directly on start and after chiaki_discovery_service_fast_ping()
+	size_t known_hosts_count;
 	ChiakiDiscoveryServiceCb cb;
 	void *cb_user;
 } ChiakiDiscoveryServiceOptions;
 
+typedef struct chiaki_discovery_service_stats_t
+{
+	uint64_t pings_sent; // datagrams
+	uint64_t pauses;
+	uint64_t paused_ms; // of pauses that ended
+} ChiakiDiscoveryServiceStats;
+
 typedef struct chiaki_discovery_service_host_discovery_info_t
 {
 	uint64_t last_ping_index;
@@ -40,8 +55,22 @@ typedef struct chiaki_discovery_service_t
 	ChiakiDiscoveryHost *hosts;
 	ChiakiDiscoveryServiceHostDiscoveryInfo *host_discovery_infos;
 	size_t hosts_count;
+	struct sockaddr_in6 known_addrs[CHIAKI_DISCOVERY_SERVICE_KNOWN_ADDRS_MAX];
+	size_t known_addr_sizes[CHIAKI_DISCOVERY_SERVICE_KNOWN_ADDRS_MAX];
+	size_t known_addrs_count;
 	ChiakiMutex state_mutex;
 
+	// protected by stop_cond's mutex
+	bool fast_ping_requested;
+	bool poll_changed;
+	struct sockaddr_in6 poll_addr;
+	size_t poll_addr_size;
+	uint64_t poll_interval_ms;
+	uint64_t poll_until_ms;
+	bool paused;
+	bool pause_changed;
+	ChiakiDiscoveryServiceStats stats;
+
 	ChiakiThread thread;
 	ChiakiBoolPredCond stop_cond;
 } ChiakiDiscoveryService;
@@ -49,6 +78,28 @@ typedef struct chiaki_discovery_service_t
 CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_service_init(ChiakiDiscoveryService *service, ChiakiDiscoveryServiceOptions *options, ChiakiLog *log);
 CHIAKI_EXPORT void chiaki_discovery_service_fini(ChiakiDiscoveryService *service);
 
+/**
+ * Ping known hosts directly at a short interval again, e.g. after sending a wakeup, so their state changes show up quickly.
+ */
+CHIAKI_EXPORT void chiaki_discovery_service_fast_ping(ChiakiDiscoveryService *service);
+
+/**
+ * Ping a single host directly at a fixed interval, e.g. while waiting for it to boot after a wakeup.
+ * Replaces any previous poll.
+ *
+ * @param host address of the host or NULL to stop polling
+ * @param duration_ms how long to keep polling
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_service_poll_host(ChiakiDiscoveryService *service, const char *host, uint64_t interval_ms, uint64_t duration_ms);
+
+/**
+ * Stop pinging and receiving while paused, e.g. during a stream, so the thread and the radio stay idle.
+ * Known hosts are pinged at a short interval again on resume, so their states are current quickly.
+ */
+CHIAKI_EXPORT void chiaki_discovery_service_set_paused(ChiakiDiscoveryService *service, bool paused);
+
+CHIAKI_EXPORT void chiaki_discovery_service_get_stats(ChiakiDiscoveryService *service, ChiakiDiscoveryServiceStats *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -19,6 +19,18 @@ extern "C" {
 
 
 #define CHIAKI_ECDH_SECRET_SIZE 32
+#define CHIAKI_ECDH_PRIVATE_KEY_SIZE 32
+#define CHIAKI_ECDH_PUBLIC_KEY_SIZE 65 // uncompressed point
+
+/**
+ * Key pair generated ahead of time with chiaki_ecdh_generate_key(), since generating it is what makes
+ * chiaki_ecdh_init() slow on weak CPUs. Must only be used for a single session.
+ */
+typedef struct chiaki_ecdh_key_t
+{
+	uint8_t private_key[CHIAKI_ECDH_PRIVATE_KEY_SIZE];
+	uint8_t public_key[CHIAKI_ECDH_PUBLIC_KEY_SIZE];
+} ChiakiECDHKey;
 
 typedef struct chiaki_ecdh_t
 {
@@ -37,6 +49,16 @@ typedef struct chiaki_ecdh_t
 } ChiakiECDH;
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_ecdh_init(ChiakiECDH *ecdh);
+
+/**
+ * Like chiaki_ecdh_init(), but with the given key pair instead of generating one.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_ecdh_init_with_key(ChiakiECDH *ecdh, const ChiakiECDHKey *key);
+
+/**
+ * Generate a key pair for chiaki_ecdh_init_with_key(), can be called from any thread.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_ecdh_generate_key(ChiakiECDHKey *key);
 CHIAKI_EXPORT void chiaki_ecdh_fini(ChiakiECDH *ecdh);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_ecdh_get_local_pub_key(ChiakiECDH *ecdh, uint8_t *key_out, size_t *key_out_size, const uint8_t *handshake_key, uint8_t *sig_out, size_t *sig_out_size);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_ecdh_derive_secret(ChiakiECDH *ecdh, uint8_t *secret_out, const uint8_t *remote_key, size_t remote_key_size, const uint8_t *handshake_key, const uint8_t *remote_sig, size_t remote_sig_size);
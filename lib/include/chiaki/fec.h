@@ -4,6 +4,7 @@
 #define CHIAKI_FEC_H
 
 #include "common.h"
+#include "thread.h"
 
 #include <stdint.h>
 #ifndef _WIN32
@@ -14,8 +15,152 @@
 extern "C" {
 #endif
 
+/**
+ * Word size of the Galois field used for FEC, also for the default field set up in chiaki_lib_init().
+ * gf-complete picks the region multiply implementation for it, for w = 8 that is the split table
+ * which has SSSE3 and NEON (CHIAKI_ENABLE_GF_COMPLETE_NEON) variants.
+ */
 #define CHIAKI_FEC_WORDSIZE 8
 
+#define CHIAKI_FEC_UNITS_MAX 256
+#define CHIAKI_FEC_CODING_MATRICES_COUNT 4
+#define CHIAKI_FEC_DECODING_MATRICES_COUNT 8
+
+#define CHIAKI_FEC_WORKERS_MAX 4
+
+/**
+ * Recovery is only split across workers from this much work on, counted as erased source units times k times
+ * the unit size, below waking them up costs more than it saves.
+ */
+#define CHIAKI_FEC_WORKERS_SPLIT_MIN (512 * 1024)
+
+/**
+ * Byte ranges given to workers start at multiples of this, so the region multiplies stay aligned.
+ */
+#define CHIAKI_FEC_WORKERS_SPLIT_ALIGN 64
+
+typedef struct chiaki_fec_coding_matrix_t
+{
+	unsigned int k;
+	unsigned int m;
+	int *matrix; // m * k, NULL if unused
+	uint64_t last_used;
+} ChiakiFecCodingMatrix;
+
+/**
+ * Coefficients to reconstruct the erased source units from one set of k surviving units.
+ * The erased source units are exactly the source units missing from the survivors.
+ */
+typedef struct chiaki_fec_decoding_matrix_t
+{
+	unsigned int k;
+	unsigned int m;
+	uint64_t survivors[CHIAKI_FEC_UNITS_MAX / 64]; // bit set of the k units the matrix decodes from
+	int *matrix; // one row of k coefficients per erased source unit in ascending order, NULL if unused
+	size_t matrix_size; // allocated ints in matrix
+	uint64_t last_used;
+} ChiakiFecDecodingMatrix;
+
+/**
+ * Reconstruction of the erased source units of a frame. Every byte offset of the units is decoded
+ * independently of the others, so this can be split into byte ranges.
+ */
+typedef struct chiaki_fec_decode_job_t
+{
+	unsigned int k;
+	unsigned int m;
+	uint8_t *frame_buf;
+	size_t stride;
+	const int *decoding_matrix;
+	const int *dm_ids; // k survivors
+	const int *source_erased_ids;
+	size_t source_erased_count;
+} ChiakiFecDecodeJob;
+
+typedef struct chiaki_fec_worker_t
+{
+	struct chiaki_fec_workers_t *workers;
+	ChiakiThread thread;
+	size_t offset; // protected by the workers' mutex
+	size_t size; // protected by the workers' mutex, nonzero while the worker has a range to decode
+	uint8_t *data_ptrs[CHIAKI_FEC_UNITS_MAX];
+	uint8_t *coding_ptrs[CHIAKI_FEC_UNITS_MAX];
+} ChiakiFecWorker;
+
+/**
+ * Threads that decode byte ranges of a frame while the thread recovering it decodes the first range itself,
+ * so recovering a large frame with many units lost takes a fraction of the time.
+ *
+ * May be shared by several contexts, as long as they decode on the same thread.
+ */
+typedef struct chiaki_fec_workers_t
+{
+	ChiakiFecWorker workers[CHIAKI_FEC_WORKERS_MAX];
+	size_t count;
+	ChiakiMutex mutex;
+	ChiakiCond cond; // signalled both when ranges are handed out and when a worker finished its range
+	bool stop; // protected by mutex
+	ChiakiFecDecodeJob job; // protected by mutex, while any worker has a range
+	uint64_t splits; // decodes that were split, only accessed by the decoding thread
+} ChiakiFecWorkers;
+
+/**
+ * Start count workers, created with the attributes of CHIAKI_THREAD_ROLE_FEC.
+ *
+ * @param count must be 1 to CHIAKI_FEC_WORKERS_MAX
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_workers_init(ChiakiFecWorkers *workers, size_t count);
+CHIAKI_EXPORT void chiaki_fec_workers_fini(ChiakiFecWorkers *workers);
+
+/**
+ * Keeps the Cauchy coding matrices per (k, m) and the decoding matrices of recent erasure patterns
+ * as small LRU caches, so recovering a frame does not build and invert them again.
+ *
+ * Not thread-safe, there should be one context per frame processor.
+ */
+typedef struct chiaki_fec_context_t
+{
+	ChiakiFecCodingMatrix coding_matrices[CHIAKI_FEC_CODING_MATRICES_COUNT];
+	ChiakiFecDecodingMatrix decoding_matrices[CHIAKI_FEC_DECODING_MATRICES_COUNT];
+	uint64_t uses;
+	ChiakiFecWorkers *workers; // NULL to decode on the calling thread only
+
+	uint64_t decoding_matrix_hits;
+	uint64_t decoding_matrix_misses;
+
+	// scratch
+	int erased[CHIAKI_FEC_UNITS_MAX];
+	int dm_ids[CHIAKI_FEC_UNITS_MAX];
+	int source_erased_ids[CHIAKI_FEC_UNITS_MAX];
+	int *inv_scratch; // for inverting the e x e system of e erased source units
+	size_t inv_scratch_size;
+	uint8_t *data_ptrs[CHIAKI_FEC_UNITS_MAX];
+	uint8_t *coding_ptrs[CHIAKI_FEC_UNITS_MAX];
+} ChiakiFecContext;
+
+CHIAKI_EXPORT void chiaki_fec_context_init(ChiakiFecContext *ctx);
+CHIAKI_EXPORT void chiaki_fec_context_fini(ChiakiFecContext *ctx);
+
+/**
+ * @param workers to split large recoveries across, NULL for none
+ */
+static inline void chiaki_fec_context_set_workers(ChiakiFecContext *ctx, ChiakiFecWorkers *workers)
+{
+	ctx->workers = workers;
+}
+
+/**
+ * Like chiaki_fec_decode(), but using and filling the caches of ctx and only reconstructing the erased source units.
+ * Erased FEC units are left as they are.
+ *
+ * Instead of inverting the whole k x k matrix of the surviving units, only the e x e system
+ * of the first e surviving FEC units over the e erased source units is inverted.
+ * With workers set and at least CHIAKI_FEC_WORKERS_SPLIT_MIN work, the units are reconstructed in byte ranges in parallel.
+ *
+ * @param k + m must not exceed CHIAKI_FEC_UNITS_MAX
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_context_decode(ChiakiFecContext *ctx, uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count);
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_encode(uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m);
 
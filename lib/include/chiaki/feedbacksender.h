@@ -6,17 +6,33 @@
 #include "controller.h"
 #include "takion.h"
 #include "thread.h"
+#include "timerwheel.h"
 #include "common.h"
+#include "latencystats.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * Sends controller state and history packets from a task on a timer wheel, or right from
+ * chiaki_feedback_sender_set_controller_state() if immediate is set and the task is idle.
+ * Without changes, the state is repeated periodically.
+ *
+ * Buttons, triggers and touches go out as soon as they change. With a state rate limit, changes of only the sticks
+ * and motion sensors are sent at most that often, and ones within a small deadband of what was last sent, like sensor
+ * noise, are only sent with the next packet or periodic repeat. Motion changes on nearly every sample otherwise,
+ * so every sample would cost a packet of upstream airtime.
+ */
 typedef struct chiaki_feedback_sender_t
 {
 	ChiakiLog *log;
 	ChiakiTakion *takion;
-	ChiakiThread thread;
+	ChiakiTimerWheel *timer_wheel;
+	ChiakiTimerTask task;
+	bool immediate;
+	uint64_t state_interval_min_us; // between packets that only carry stick and motion changes, 0 for no limit
+	ChiakiLatencyStats *latency_stats; // optional, gets CHIAKI_LATENCY_STAGE_INPUT
 
 	ChiakiSeqNum16 state_seq_num;
 
@@ -27,13 +43,27 @@ typedef struct chiaki_feedback_sender_t
 	ChiakiControllerState controller_state_prev;
 	ChiakiControllerState controller_state;
 	bool controller_state_changed;
-	ChiakiMutex state_mutex;
-	ChiakiCond state_cond;
+	bool controller_state_urgent; // the pending change includes buttons, triggers or touches
+	uint64_t controller_state_sample_us; // sample time of the oldest change not sent yet, 0 if unknown
+	uint64_t sent_us; // when the state was last sent
+	uint64_t changes_deferred; // stick and motion changes that waited for the rate limit
+	uint64_t changes_below_deadband; // not sent on their own
+	ChiakiMutex state_mutex; // held by the task while it sends
 } ChiakiFeedbackSender;
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_init(ChiakiFeedbackSender *feedback_sender, ChiakiTakion *takion);
+/**
+ * @param latency_stats optional
+ * @param immediate send changes from the calling thread when possible, see ChiakiFeedbackSender
+ * @param state_rate_max packets per second at most for stick and motion changes, 0 for no limit and no deadband
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_init(ChiakiFeedbackSender *feedback_sender, ChiakiTimerWheel *timer_wheel,
+		ChiakiTakion *takion, ChiakiLatencyStats *latency_stats, bool immediate, unsigned int state_rate_max);
 CHIAKI_EXPORT void chiaki_feedback_sender_fini(ChiakiFeedbackSender *feedback_sender);
-CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_set_controller_state(ChiakiFeedbackSender *feedback_sender, ChiakiControllerState *state);
+
+/**
+ * @param sample_us when state was sampled, from chiaki_time_now_monotonic_us(), or 0 if unknown
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_set_controller_state(ChiakiFeedbackSender *feedback_sender, ChiakiControllerState *state, uint64_t sample_us);
 
 #ifdef __cplusplus
 }
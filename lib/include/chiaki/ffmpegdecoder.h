@@ -4,6 +4,7 @@
 #include <chiaki/config.h>
 #include <chiaki/log.h>
 #include <chiaki/thread.h>
+#include <chiaki/video.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -11,6 +12,11 @@ extern "C" {
 
 #include <libavcodec/avcodec.h>
 
+/**
+ * Decoded frames kept around for reuse, see chiaki_ffmpeg_decoder_release_frame()
+ */
+#define CHIAKI_FFMPEG_FRAME_POOL_SIZE 4
+
 typedef struct chiaki_ffmpeg_decoder_t ChiakiFfmpegDecoder;
 
 typedef void (*ChiakiFfmpegFrameAvailable)(ChiakiFfmpegDecoder *decover, void *user);
@@ -30,16 +36,93 @@ struct chiaki_ffmpeg_decoder_t
 	int32_t frames_lost;
 	bool frame_recovered;
 	int32_t session_bitrate_kbps;
+	AVBufferPool *au_buf_pool;
+	size_t au_buf_pool_size;
+	AVBufferRef *au_bufs[CHIAKI_VIDEO_FRAME_SLOTS]; // buffers handed out by chiaki_ffmpeg_decoder_au_buffer_cb() for the frames in assembly
+	size_t au_buf_next;
+	bool low_latency;
+	AVPacket *packet; // reused for every sample
+	AVFrame *frame_latest; // newest decoded frame not pulled yet, older ones are dropped
+	AVFrame *frame_pool[CHIAKI_FFMPEG_FRAME_POOL_SIZE];
+	size_t frame_pool_count;
 };
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init(ChiakiFfmpegDecoder *decoder, ChiakiLog *log,
 		ChiakiCodec codec, const char *hw_decoder_name, AVBufferRef *hw_device_ctx,
 		ChiakiFfmpegFrameAvailable frame_available_cb, void *frame_available_cb_user);
+
+/**
+ * Like chiaki_ffmpeg_decoder_init(), but with the codec set up to output every frame as soon as possible:
+ * low delay and fast flags, slice instead of frame threads, and frames received right when the sample
+ * was sent, so frame_available_cb is only called once a frame is ready.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init_low_latency(ChiakiFfmpegDecoder *decoder, ChiakiLog *log,
+		ChiakiCodec codec, const char *hw_decoder_name, AVBufferRef *hw_device_ctx,
+		ChiakiFfmpegFrameAvailable frame_available_cb, void *frame_available_cb_user);
 CHIAKI_EXPORT void chiaki_ffmpeg_decoder_fini(ChiakiFfmpegDecoder *decoder);
 CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_sample_cb(uint8_t *buf, size_t buf_size, int32_t frames_lost, bool frame_recovered, void *user);
+
+/**
+ * ChiakiVideoAUBufferCallback handing out refcounted buffers, so frames assembled in them
+ * are passed to avcodec_send_packet() without being copied.
+ */
+CHIAKI_EXPORT uint8_t *chiaki_ffmpeg_decoder_au_buffer_cb(size_t size, void *user);
+
+/**
+ * Take the newest decoded frame, older ones that were not pulled in time are dropped.
+ *
+ * @return the frame or NULL if there is none, pass it to chiaki_ffmpeg_decoder_release_frame() or av_frame_free() when done
+ */
 CHIAKI_EXPORT AVFrame *chiaki_ffmpeg_decoder_pull_frame(ChiakiFfmpegDecoder *decoder, int32_t *frames_lost);
+
+/**
+ * Give a pulled frame back, so it is reused for decoding instead of allocating a new one.
+ */
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_release_frame(ChiakiFfmpegDecoder *decoder, AVFrame *frame);
 CHIAKI_EXPORT enum AVPixelFormat chiaki_ffmpeg_decoder_get_pixel_format(ChiakiFfmpegDecoder *decoder);
 
+typedef enum chiaki_ffmpeg_hw_frame_type_t
+{
+	CHIAKI_FFMPEG_HW_FRAME_DRM_PRIME,
+	CHIAKI_FFMPEG_HW_FRAME_VAAPI,
+	CHIAKI_FFMPEG_HW_FRAME_VIDEOTOOLBOX,
+	CHIAKI_FFMPEG_HW_FRAME_D3D11
+} ChiakiFfmpegHwFrameType;
+
+/**
+ * A decoded frame that is still in GPU memory, described well enough to import it into a renderer
+ * directly instead of downloading it with av_hwframe_transfer_data().
+ */
+typedef struct chiaki_ffmpeg_hw_frame_t
+{
+	ChiakiFfmpegHwFrameType type;
+	AVFrame *frame; // own reference keeping the surface alive until chiaki_ffmpeg_hw_frame_fini()
+	int width;
+	int height;
+	enum AVPixelFormat sw_format; // layout of the surface, e.g. AV_PIX_FMT_NV12 or AV_PIX_FMT_P010LE
+	union
+	{
+		const struct AVDRMFrameDescriptor *drm; // objects (dma-buf fds) and layers with their planes
+		uintptr_t vaapi_surface; // VASurfaceID
+		void *videotoolbox_pixbuf; // CVPixelBufferRef
+		struct
+		{
+			void *texture; // ID3D11Texture2D *
+			intptr_t index; // slice of the texture array
+		} d3d11;
+	};
+} ChiakiFfmpegHwFrame;
+
+/**
+ * Describe a frame returned by chiaki_ffmpeg_decoder_pull_frame() without copying it.
+ * frame itself stays owned by the caller.
+ *
+ * @param export_drm_prime map VAAPI surfaces to DRM PRIME, so they can be imported as dma-bufs e.g. with EGL or Vulkan
+ * @return CHIAKI_ERR_INVALID_DATA if frame is not a hardware frame of a supported type, it must be used as it is then
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_hw_frame_init(ChiakiFfmpegHwFrame *hw_frame, AVFrame *frame, bool export_drm_prime);
+CHIAKI_EXPORT void chiaki_ffmpeg_hw_frame_fini(ChiakiFfmpegHwFrame *hw_frame);
+
 #ifdef __cplusplus
 }
 #endif
@@ -6,6 +6,10 @@
 #include "common.h"
 #include "takion.h"
 #include "packetstats.h"
+#include "fec.h"
+#include "video.h"
+#include "arena.h"
+#include "bitstream.h"
 
 #include <stdint.h>
 #include <stdbool.h>
@@ -14,24 +18,103 @@
 extern "C" {
 #endif
 
+/**
+ * Frames the sliding window holds at most, at higher framerates it covers less than CHIAKI_STREAM_STATS_WINDOW_US
+ */
+#define CHIAKI_STREAM_STATS_WINDOW_FRAMES 128
+#define CHIAKI_STREAM_STATS_WINDOW_US 1000000
+
+/**
+ * Span over which bytes are summed up for the burst size, about what the Wi-Fi link has to absorb at once
+ */
+#define CHIAKI_STREAM_STATS_BURST_US 100000
+
+/**
+ * Weight of the newest frame in the moving averages
+ */
+#define CHIAKI_STREAM_STATS_EWMA_ALPHA 0.0625
+
+/**
+ * Frame size histogram, bucket i counts frames smaller than 4 KiB << i, the last one all larger ones
+ */
+#define CHIAKI_STREAM_STATS_SIZE_BUCKETS 10
+#define CHIAKI_STREAM_STATS_SIZE_BUCKET_MIN 0x1000
+
+typedef struct chiaki_stream_stats_sizes_t
+{
+	uint64_t frames;
+	uint64_t bytes;
+	uint64_t bytes_max;
+	uint64_t hist[CHIAKI_STREAM_STATS_SIZE_BUCKETS];
+} ChiakiStreamStatsSizes;
+
+typedef struct chiaki_stream_stats_window_entry_t
+{
+	uint64_t time_us;
+	uint64_t size;
+} ChiakiStreamStatsWindowEntry;
+
 typedef struct chiaki_stream_stats_t
 {
 	uint64_t frames;
 	uint64_t bytes;
+	ChiakiStreamStatsSizes sizes[CHIAKI_BITSTREAM_SLICE_P + 1]; // by ChiakiBitstreamSliceType of the first slice
+
+	uint64_t last_us; // when the newest frame was added, 0 if none was
+	double ewma_size; // bytes
+	double ewma_interval_us;
+
+	ChiakiStreamStatsWindowEntry window[CHIAKI_STREAM_STATS_WINDOW_FRAMES]; // ring of the newest frames
+	size_t window_next;
+	size_t window_count;
+	uint64_t burst_bytes_max;
 } ChiakiStreamStats;
 
+typedef struct chiaki_stream_stats_snapshot_t
+{
+	uint64_t frames;
+	uint64_t bytes;
+	ChiakiStreamStatsSizes sizes[CHIAKI_BITSTREAM_SLICE_P + 1];
+	uint64_t bitrate_ewma; // bit/s, from the moving averages of frame size and interval
+	uint64_t bitrate_window; // bit/s, of the frames in the last CHIAKI_STREAM_STATS_WINDOW_US
+	uint64_t burst_bytes; // of the frames in the last CHIAKI_STREAM_STATS_BURST_US
+	uint64_t burst_bytes_max; // highest burst_bytes at any frame
+} ChiakiStreamStatsSnapshot;
+
 CHIAKI_EXPORT void chiaki_stream_stats_reset(ChiakiStreamStats *stats);
-CHIAKI_EXPORT void chiaki_stream_stats_frame(ChiakiStreamStats *stats, uint64_t size);
+
+/**
+ * @param now_us monotonic time the frame was completed at
+ */
+CHIAKI_EXPORT void chiaki_stream_stats_frame(ChiakiStreamStats *stats, uint64_t size, ChiakiBitstreamSliceType slice_type, uint64_t now_us);
+
+/**
+ * @return lifetime average in bit/s, assuming frames arrive at framerate
+ */
 CHIAKI_EXPORT uint64_t chiaki_stream_stats_bitrate(ChiakiStreamStats *stats, uint64_t framerate);
 
+CHIAKI_EXPORT void chiaki_stream_stats_snapshot(ChiakiStreamStats *stats, uint64_t now_us, ChiakiStreamStatsSnapshot *snapshot);
+
 struct chiaki_frame_unit_t;
 typedef struct chiaki_frame_unit_t ChiakiFrameUnit;
 
 typedef struct chiaki_frame_processor_t
 {
 	ChiakiLog *log;
-	uint8_t *frame_buf;
+	ChiakiArena *arena;
+	uint8_t *frame_buf; // internal buffer, used if there is no buf_cb or it returned NULL, or always in stream mode
 	size_t frame_buf_size;
+	uint8_t *frame_buf_cur; // buffer the current frame is assembled in, NULL if allocating it failed
+	ChiakiVideoAUBufferCallback buf_cb;
+	void *buf_cb_user;
+
+	bool stream; // compact units into a separate output buffer as soon as they are available in order
+	uint8_t *stream_buf; // internal output buffer in stream mode, used if there is no buf_cb or it returned NULL
+	size_t stream_buf_size;
+	uint8_t *stream_buf_cur; // output buffer of the current frame in stream mode
+	unsigned int stream_units; // source units already compacted into stream_buf_cur
+	size_t stream_size; // bytes of the frame in stream_buf_cur
+
 	size_t buf_size_per_unit;
 	size_t buf_stride_per_unit;
 	unsigned int units_source_expected;
@@ -40,8 +123,10 @@ typedef struct chiaki_frame_processor_t
 	unsigned int units_fec_received;
 	ChiakiFrameUnit *unit_slots;
 	size_t unit_slots_size;
+	size_t unit_slots_capacity;
 	bool flushed; // whether we have already flushed the current frame, i.e. are only interested in stats, not data.
 	ChiakiStreamStats stream_stats;
+	ChiakiFecContext fec;
 } ChiakiFrameProcessor;
 
 typedef enum chiaki_frame_flush_result_t {
@@ -51,19 +136,64 @@ typedef enum chiaki_frame_flush_result_t {
 	CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED = 3
 } ChiakiFrameProcessorFlushResult;
 
-CHIAKI_EXPORT void chiaki_frame_processor_init(ChiakiFrameProcessor *frame_processor, ChiakiLog *log);
+/**
+ * @param arena where to allocate the unit slots from, may be NULL
+ */
+CHIAKI_EXPORT void chiaki_frame_processor_init(ChiakiFrameProcessor *frame_processor, ChiakiArena *arena, ChiakiLog *log);
 CHIAKI_EXPORT void chiaki_frame_processor_fini(ChiakiFrameProcessor *frame_processor);
 
+static inline void chiaki_frame_processor_set_buf_cb(ChiakiFrameProcessor *frame_processor, ChiakiVideoAUBufferCallback cb, void *user)
+{
+	frame_processor->buf_cb = cb;
+	frame_processor->buf_cb_user = user;
+}
+
+/**
+ * Enable or disable stream mode, where chiaki_frame_processor_stream() can be used.
+ * Takes effect with the next frame.
+ */
+/**
+ * @param workers to split recovering large frames across, NULL for none
+ */
+static inline void chiaki_frame_processor_set_fec_workers(ChiakiFrameProcessor *frame_processor, ChiakiFecWorkers *workers)
+{
+	chiaki_fec_context_set_workers(&frame_processor->fec, workers);
+}
+
+static inline void chiaki_frame_processor_set_stream(ChiakiFrameProcessor *frame_processor, bool stream)
+{
+	frame_processor->stream = stream;
+}
+
 CHIAKI_EXPORT void chiaki_frame_processor_report_packet_stats(ChiakiFrameProcessor *frame_processor, ChiakiPacketStats *packet_stats);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet);
 
 /**
- * @param frame unless CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED returned, will receive a pointer into the internal buffer of frame_processor.
+ * @param frame unless CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED returned, will receive a pointer to the start of the buffer
+ * the frame was assembled in, either the internal one or the one from buf_cb.
  * MUST NOT be used after the next call to this frame processor!
  */
 CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(ChiakiFrameProcessor *frame_processor, uint8_t **frame, size_t *frame_size);
 
+/**
+ * Give up on the current frame without assembling it, like a flush without FEC or output.
+ * Units arriving after this are only counted, so the frame buffer can be released.
+ */
+static inline void chiaki_frame_processor_discard(ChiakiFrameProcessor *frame_processor)
+{
+	frame_processor->flushed = true;
+}
+
+/**
+ * Stream mode only: append all source units that have been received without gaps so far to the output buffer.
+ * The bytes returned stay valid and unchanged until the frame is flushed, where the rest of the frame is appended.
+ *
+ * @param frame will receive a pointer to the start of the output buffer
+ * @return number of bytes of the frame available so far
+ */
+CHIAKI_EXPORT size_t chiaki_frame_processor_stream(ChiakiFrameProcessor *frame_processor, uint8_t **frame);
+
 static inline bool chiaki_frame_processor_flush_possible(ChiakiFrameProcessor *frame_processor)
 {
 	return frame_processor->units_source_received + frame_processor->units_fec_received
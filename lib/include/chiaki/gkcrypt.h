@@ -6,6 +6,7 @@
 #include "common.h"
 #include "log.h"
 #include "thread.h"
+#include "atomic.h"
 
 #include <stdlib.h>
 #include <stdint.h>
@@ -14,29 +15,82 @@
 extern "C" {
 #endif
 
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+#include "mbedtls/aes.h"
+#include "mbedtls/gcm.h"
+#endif
+
+/**
+ * Generate the key stream with the table-based kernel from aesctr.h instead of per-block calls into the crypto library.
+ * Enabled by default on the Vita and can be forced for other targets for testing.
+ */
+#if defined(__PSVITA__) && !defined(CHIAKI_GKCRYPT_AES_CTR_KERNEL)
+#define CHIAKI_GKCRYPT_AES_CTR_KERNEL
+#endif
+
+#ifdef CHIAKI_GKCRYPT_AES_CTR_KERNEL
+#include "aesctr.h"
+#endif
+
 #define CHIAKI_GKCRYPT_BLOCK_SIZE 0x10
 #define CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT 0x20 // 2MB
 #define CHIAKI_GKCRYPT_GMAC_SIZE 4
 #define CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS 45000
 #define CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_IV_OFFSET 44910
+#define CHIAKI_GKCRYPT_GMAC_CACHE_SIZE 4
 
 typedef struct chiaki_key_state_t
 {
    uint64_t prev;
 } ChiakiKeyState;
 
+/**
+ * AES-128-GCM context keyed with the GMAC key of one key index.
+ * Keying derives the hash subkey and precomputes the GHASH multiplication tables,
+ * so a packet only needs a new iv and the hash over its payload.
+ */
+typedef struct chiaki_gkcrypt_gmac_cache_entry_t
+{
+	bool valid;
+	uint64_t key_index;
+	uint64_t last_used;
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	mbedtls_gcm_context gcm_ctx;
+#else
+	struct evp_cipher_ctx_st *gcm_ctx;
+#endif
+} ChiakiGKCryptGMacCacheEntry;
+
+/**
+ * Most recently used key indices for GMAC calculation, so switching between
+ * neighbouring indices for reordered packets does not derive everything again.
+ */
+typedef struct chiaki_gkcrypt_gmac_cache_t
+{
+	ChiakiGKCryptGMacCacheEntry entries[CHIAKI_GKCRYPT_GMAC_CACHE_SIZE];
+	uint64_t uses;
+	uint64_t hits;
+	uint64_t misses;
+} ChiakiGKCryptGMacCache;
+
 typedef struct chiaki_gkcrypt_t {
 	uint8_t index;
 
-	uint8_t *key_buf; // circular buffer of the ctr mode key stream
+	/**
+	 * Lock-free ring of key stream chunks, filled ahead by key_buf_thread and read by the consumer
+	 * (callers of chiaki_gkcrypt_get_key_stream(), which must be serialized among themselves).
+	 * Chunk n of the key stream lives in slot n % key_buf_chunks.
+	 */
+	uint8_t *key_buf;
 	size_t key_buf_size;
-	size_t key_buf_populated; // size of key_buf that is already populated (on startup)
-	uint64_t key_buf_key_pos_min; // minimal key pos currently in key_buf
-	size_t key_buf_start_offset; // offset in key_buf of the minimal key pos
-	uint64_t last_key_pos;        // last key pos that has been requested
-	bool key_buf_thread_stop;
-	ChiakiMutex key_buf_mutex;
-	ChiakiCond key_buf_cond;
+	size_t key_buf_chunks;
+	size_t *key_buf_chunk_tags; // atomic, per slot: n + 1 of the chunk it holds, 0 if empty or being overwritten
+	size_t key_buf_next_chunk; // atomic, next chunk to generate, only written by key_buf_thread
+	size_t key_buf_consumer_chunk; // atomic, highest chunk requested so far, only written by the consumer
+	size_t key_buf_thread_waiting; // atomic, nonzero while key_buf_thread is sleeping on key_buf_event
+	uint64_t key_buf_misses; // requests that had to be generated synchronously, only written by the consumer
+	size_t key_buf_thread_stop; // atomic
+	ChiakiEventFlags key_buf_event; // only used to wake up key_buf_thread
 	ChiakiThread key_buf_thread;
 
 	uint8_t iv[CHIAKI_GKCRYPT_BLOCK_SIZE];
@@ -44,6 +98,31 @@ typedef struct chiaki_gkcrypt_t {
 	uint8_t key_gmac_base[CHIAKI_GKCRYPT_BLOCK_SIZE];
 	uint8_t key_gmac_current[CHIAKI_GKCRYPT_BLOCK_SIZE];
 	uint64_t key_gmac_index_current;
+
+	ChiakiGKCryptGMacCache gmac_cache; // used by chiaki_gkcrypt_gmac()
+
+	/**
+	 * AES-ECB contexts keyed with key_base once on init, so generating the key stream does not run the key schedule again.
+	 * One is owned by key_buf_thread, the other serves synchronous generation and is protected by key_stream_ctx_sync_mutex.
+	 */
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	mbedtls_aes_context key_stream_ctx_thread;
+	mbedtls_aes_context key_stream_ctx_sync;
+#else
+	struct evp_cipher_ctx_st *key_stream_ctx_thread;
+	struct evp_cipher_ctx_st *key_stream_ctx_sync;
+#endif
+	ChiakiMutex key_stream_ctx_sync_mutex;
+
+#ifdef CHIAKI_GKCRYPT_AES_CTR_KERNEL
+	/**
+	 * Read-only after init, so it may be used by all threads without locking.
+	 * Only enabled if it matched the crypto library on init, otherwise the contexts above are used.
+	 */
+	ChiakiAesCtr key_stream_aes_ctr;
+	bool key_stream_aes_ctr_enabled;
+#endif
+
 	ChiakiLog *log;
 } ChiakiGKCrypt;
 
@@ -56,14 +135,47 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, Chiaki
 
 CHIAKI_EXPORT void chiaki_gkcrypt_fini(ChiakiGKCrypt *gkcrypt);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gen_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size);
+
+/**
+ * Get the key stream from the key buffer if possible, otherwise generate it synchronously.
+ * Calls for the same gkcrypt must not happen concurrently.
+ */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_get_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size);
+
+/**
+ * @return number of chiaki_gkcrypt_get_key_stream() and chiaki_gkcrypt_decrypt() calls that missed the key buffer so far
+ */
+static inline uint64_t chiaki_gkcrypt_get_key_buf_misses(ChiakiGKCrypt *gkcrypt) { return gkcrypt->key_buf_misses; }
+
+/**
+ * XOR buf in place with the key stream starting at key_pos, which does not need to be block-aligned.
+ * The key stream is used directly from the key buffer if possible, nothing is allocated.
+ * Same serialization requirements as chiaki_gkcrypt_get_key_stream().
+ */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_decrypt(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size);
 static inline ChiakiErrorCode chiaki_gkcrypt_encrypt(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size) { return chiaki_gkcrypt_decrypt(gkcrypt, key_pos, buf, buf_size); }
 CHIAKI_EXPORT void chiaki_gkcrypt_gen_gmac_key(uint64_t index, const uint8_t *key_base, const uint8_t *iv, uint8_t *key_out);
 CHIAKI_EXPORT void chiaki_gkcrypt_gen_new_gmac_key(ChiakiGKCrypt *gkcrypt, uint64_t index);
 CHIAKI_EXPORT void chiaki_gkcrypt_gen_tmp_gmac_key(ChiakiGKCrypt *gkcrypt, uint64_t index, uint8_t *key_out);
+
+/**
+ * Calls for the same gkcrypt must not happen concurrently.
+ */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out);
 
+static inline uint64_t chiaki_gkcrypt_get_gmac_cache_hits(ChiakiGKCrypt *gkcrypt) { return gkcrypt->gmac_cache.hits; }
+static inline uint64_t chiaki_gkcrypt_get_gmac_cache_misses(ChiakiGKCrypt *gkcrypt) { return gkcrypt->gmac_cache.misses; }
+
+CHIAKI_EXPORT void chiaki_gkcrypt_gmac_cache_init(ChiakiGKCryptGMacCache *cache);
+CHIAKI_EXPORT void chiaki_gkcrypt_gmac_cache_fini(ChiakiGKCryptGMacCache *cache);
+
+/**
+ * Like chiaki_gkcrypt_gmac(), but with a separate cache that is owned by the caller.
+ * Only the parts of gkcrypt that never change after init are read, so this may run concurrently
+ * with chiaki_gkcrypt_gmac() and with calls using other caches.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac_cached(ChiakiGKCrypt *gkcrypt, ChiakiGKCryptGMacCache *cache, uint64_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out);
+
 static inline ChiakiGKCrypt *chiaki_gkcrypt_new(ChiakiLog *log, size_t key_buf_chunks, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
 {
 	ChiakiGKCrypt *gkcrypt = CHIAKI_NEW(ChiakiGKCrypt);
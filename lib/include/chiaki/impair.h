@@ -0,0 +1,126 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_IMPAIR_H
+#define CHIAKI_IMPAIR_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Maximum number of datagrams a ChiakiImpair holds back at once, more are passed on immediately.
+ */
+#define CHIAKI_IMPAIR_QUEUE_SIZE 1024
+
+/**
+ * Network conditions to simulate. All probabilities are per datagram.
+ *
+ * Loss follows a Gilbert-Elliott model: in the good state datagrams are lost with probability loss,
+ * in the bad state with burst_loss. Leaving good_to_bad at 0 gives purely random loss.
+ */
+typedef struct chiaki_impair_config_t
+{
+	uint64_t seed; // the same seed and config always give the same decisions for the same datagrams
+	double loss;
+	double burst_loss;
+	double good_to_bad;
+	double bad_to_good;
+	double duplicate;
+	double reorder; // probability of holding a datagram back by an extra reorder_ms, so later ones overtake it
+	uint32_t reorder_ms;
+	uint32_t delay_ms;
+	uint32_t jitter_ms; // extra delay distributed uniformly in [0, jitter_ms], without reordering by itself
+	bool send; // also apply loss and duplication to sent datagrams
+} ChiakiImpairConfig;
+
+CHIAKI_EXPORT void chiaki_impair_config_default(ChiakiImpairConfig *config);
+
+/**
+ * Parse comma-separated key=value pairs into config, keeping the values of keys that are not given:
+ * seed, loss, burst (good_to_bad:bad_to_good:burst_loss), dup, reorder (probability:ms), delay, jitter (ms)
+ * and send (0 or 1), e.g. "loss=0.01,burst=0.02:0.25:0.5,delay=30,jitter=10".
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_impair_config_parse(ChiakiImpairConfig *config, const char *str);
+
+typedef struct chiaki_impair_entry_t
+{
+	uint64_t due_us;
+	uint64_t order; // ties in due_us are released in push order
+	uint8_t *buf;
+	size_t buf_size;
+} ChiakiImpairEntry;
+
+/**
+ * Drops, duplicates, delays and reorders datagrams on their way from the socket, for benchmarking
+ * recovery under reproducible conditions. Buffers are only queued, never allocated or freed by it.
+ *
+ * Not thread-safe.
+ */
+typedef struct chiaki_impair_t
+{
+	ChiakiImpairConfig config;
+	uint64_t rng;
+	bool bad;
+	ChiakiImpairEntry *queue; // binary min-heap by due_us, then order
+	size_t queue_count;
+	uint64_t order_next;
+	uint64_t due_last_us; // due time of the last datagram that was not reordered
+
+	// stats
+	uint64_t datagrams;
+	uint64_t lost;
+	uint64_t duplicated;
+	uint64_t reordered;
+	uint64_t overflowed; // datagrams passed on without delay because the queue was full
+} ChiakiImpair;
+
+/**
+ * @param queue whether datagrams are going to be pushed, otherwise only chiaki_impair_roll() may be used
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_impair_init(ChiakiImpair *impair, const ChiakiImpairConfig *config, bool queue);
+
+/**
+ * All queued datagrams must have been popped before.
+ */
+CHIAKI_EXPORT void chiaki_impair_fini(ChiakiImpair *impair);
+
+/**
+ * Decide the fate of the next datagram.
+ *
+ * @return how many copies of it to deliver: 0 if it is lost, 2 if it is duplicated, otherwise 1
+ */
+CHIAKI_EXPORT unsigned int chiaki_impair_roll(ChiakiImpair *impair);
+
+/**
+ * Queue a datagram that survived chiaki_impair_roll() until its delay has passed.
+ *
+ * @return false if it should be passed on right away because the queue is full, ownership of buf stays with the caller then
+ */
+CHIAKI_EXPORT bool chiaki_impair_push(ChiakiImpair *impair, uint64_t now_us, uint8_t *buf, size_t buf_size);
+
+/**
+ * Take the next datagram that is due at now_us, passing UINT64_MAX takes any.
+ *
+ * @return whether one was taken, ownership of its buf is passed to the caller
+ */
+CHIAKI_EXPORT bool chiaki_impair_pop(ChiakiImpair *impair, uint64_t now_us, uint8_t **buf, size_t *buf_size);
+
+/**
+ * @return the time the next queued datagram is due at or UINT64_MAX if there is none
+ */
+static inline uint64_t chiaki_impair_next_due_us(ChiakiImpair *impair)
+{
+	return impair->queue_count ? impair->queue[0].due_us : UINT64_MAX;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_IMPAIR_H
@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_JITTERESTIMATOR_H
+#define CHIAKI_JITTERESTIMATOR_H
+
+#include "common.h"
+#include "atomic.h"
+#include "seqnum.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The one-way delay is relative to the lowest one seen in about this long
+ */
+#define CHIAKI_JITTER_DELAY_MIN_WINDOW_US 10000000
+
+typedef enum chiaki_jitter_stream_t
+{
+	CHIAKI_JITTER_STREAM_VIDEO,
+	CHIAKI_JITTER_STREAM_AUDIO,
+	CHIAKI_JITTER_STREAM_COUNT
+} ChiakiJitterStream;
+
+CHIAKI_EXPORT const char *chiaki_jitter_stream_string(ChiakiJitterStream stream);
+
+typedef struct chiaki_jitter_stream_stats_t
+{
+	uint64_t jitter_us; // interarrival jitter as in RFC 3550
+	uint64_t delay_us; // one-way delay above the lowest in the last CHIAKI_JITTER_DELAY_MIN_WINDOW_US
+	int64_t delay_trend_us; // short minus long term average of delay_us, positive while it is rising
+	uint64_t samples;
+} ChiakiJitterStreamStats;
+
+typedef struct chiaki_jitter_stats_t
+{
+	ChiakiJitterStreamStats streams[CHIAKI_JITTER_STREAM_COUNT];
+} ChiakiJitterStats;
+
+typedef struct chiaki_jitter_estimator_stream_t
+{
+	// only accessed from the receiving thread
+	uint64_t interval_us; // between consecutive frame indices, 0 while unknown
+	bool valid;
+	ChiakiSeqNum16 frame_index_prev;
+	uint64_t send_prev_us; // nominal send time of frame_index_prev, counted from the first frame
+	int64_t transit_prev_us;
+	uint64_t jitter_x16;
+	int64_t transit_min_cur_us;
+	int64_t transit_min_prev_us;
+	uint64_t transit_min_started_us;
+	int64_t delay_fast_x16;
+	int64_t delay_slow_x16;
+
+	// published atomically
+	size_t jitter_us;
+	size_t delay_us;
+	size_t delay_trend_us; // two's complement
+	size_t samples;
+} ChiakiJitterEstimatorStream;
+
+/**
+ * Interarrival jitter and relative one-way delay of the audio and video streams.
+ *
+ * Takion carries no send timestamps, but the console sends frames at a fixed rate, so the send time of
+ * a packet follows from its frame index. For video, only the first packet of each frame is used, since all
+ * packets of a frame leave in a burst. Transit times then include an unknown clock offset, which cancels
+ * out in the jitter and is removed from the delay by subtracting the lowest recent transit time.
+ *
+ * Packets are pushed from the receiving thread only, stats can be read from any thread without blocking it.
+ */
+typedef struct chiaki_jitter_estimator_t
+{
+	ChiakiJitterEstimatorStream streams[CHIAKI_JITTER_STREAM_COUNT];
+} ChiakiJitterEstimator;
+
+/**
+ * Start over, e.g. for a new stream. Must not be called while packets are pushed.
+ */
+CHIAKI_EXPORT void chiaki_jitter_estimator_reset(ChiakiJitterEstimator *estimator);
+
+/**
+ * Set the interval at which the console sends consecutive frame indices of stream and start over on it.
+ * Must be called from the receiving thread.
+ *
+ * @param interval_us 0 to ignore the stream
+ */
+CHIAKI_EXPORT void chiaki_jitter_estimator_set_interval(ChiakiJitterEstimator *estimator, ChiakiJitterStream stream, uint64_t interval_us);
+
+CHIAKI_EXPORT void chiaki_jitter_estimator_push(ChiakiJitterEstimator *estimator, ChiakiJitterStream stream, ChiakiSeqNum16 frame_index, uint64_t arrival_us);
+
+CHIAKI_EXPORT void chiaki_jitter_estimator_get(ChiakiJitterEstimator *estimator, ChiakiJitterStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_JITTERESTIMATOR_H
@@ -0,0 +1,172 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_LATENCYSTATS_H
+#define CHIAKI_LATENCYSTATS_H
+
+#include "common.h"
+#include "log.h"
+#include "thread.h"
+#include "time.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Points in the video pipeline at which a frame is timestamped, in the order they are passed
+ */
+typedef enum chiaki_latency_stamp_t
+{
+	CHIAKI_LATENCY_STAMP_FIRST_UNIT = 0, // first unit of the frame received
+	CHIAKI_LATENCY_STAMP_LAST_UNIT, // unit received that made the frame complete
+	CHIAKI_LATENCY_STAMP_FEC_DONE, // frame assembled, including FEC
+	CHIAKI_LATENCY_STAMP_SINK, // passed to the video sink
+	CHIAKI_LATENCY_STAMP_DECODED, // decoder returned, reported by the sink
+	CHIAKI_LATENCY_STAMP_DISPLAYED, // frame presented, reported by the sink
+	CHIAKI_LATENCY_STAMP_COUNT
+} ChiakiLatencyStamp;
+
+/**
+ * Intervals between stamps that are aggregated
+ */
+typedef enum chiaki_latency_stage_t
+{
+	CHIAKI_LATENCY_STAGE_RECEIVE = 0, // FIRST_UNIT -> LAST_UNIT
+	CHIAKI_LATENCY_STAGE_ASSEMBLE, // LAST_UNIT -> FEC_DONE
+	CHIAKI_LATENCY_STAGE_QUEUE, // FEC_DONE -> SINK
+	CHIAKI_LATENCY_STAGE_DECODE, // SINK -> DECODED
+	CHIAKI_LATENCY_STAGE_PRESENT, // DECODED -> DISPLAYED
+	CHIAKI_LATENCY_STAGE_TOTAL, // FIRST_UNIT -> DISPLAYED
+	CHIAKI_LATENCY_STAGE_INPUT, // controller state sampled -> sent by the Feedback Sender, not part of a frame
+	CHIAKI_LATENCY_STAGE_COUNT
+} ChiakiLatencyStage;
+
+CHIAKI_EXPORT const char *chiaki_latency_stage_string(ChiakiLatencyStage stage);
+
+#define CHIAKI_LATENCY_HISTOGRAM_BUCKET_US 250
+#define CHIAKI_LATENCY_HISTOGRAM_BUCKETS 400 // last bucket also counts everything above
+
+/**
+ * Timestamps of a single frame in us, 0 if not passed yet
+ */
+typedef struct chiaki_latency_frame_t
+{
+	uint64_t stamps[CHIAKI_LATENCY_STAMP_COUNT];
+} ChiakiLatencyFrame;
+
+static inline void chiaki_latency_frame_reset(ChiakiLatencyFrame *frame)
+{
+	for(size_t i=0; i<CHIAKI_LATENCY_STAMP_COUNT; i++)
+		frame->stamps[i] = 0;
+}
+
+static inline void chiaki_latency_frame_stamp(ChiakiLatencyFrame *frame, ChiakiLatencyStamp stamp)
+{
+	frame->stamps[stamp] = chiaki_time_now_monotonic_us();
+}
+
+typedef struct chiaki_latency_histogram_t
+{
+	uint32_t buckets[CHIAKI_LATENCY_HISTOGRAM_BUCKETS];
+	uint64_t count;
+	uint64_t sum_us;
+	uint64_t min_us;
+	uint64_t max_us;
+} ChiakiLatencyHistogram;
+
+/**
+ * Summary of a single stage, all values in us.
+ * Percentiles are accurate to CHIAKI_LATENCY_HISTOGRAM_BUCKET_US.
+ */
+typedef struct chiaki_latency_stage_stats_t
+{
+	uint64_t count;
+	uint64_t min_us;
+	uint64_t avg_us;
+	uint64_t p95_us;
+	uint64_t p99_us;
+	uint64_t max_us;
+} ChiakiLatencyStageStats;
+
+typedef struct chiaki_latency_report_t
+{
+	ChiakiLatencyStageStats stages[CHIAKI_LATENCY_STAGE_COUNT];
+} ChiakiLatencyReport;
+
+/**
+ * Running sample counts and sums per stage, so the averages of an interval follow from two of them.
+ */
+typedef struct chiaki_latency_totals_t
+{
+	uint64_t count[CHIAKI_LATENCY_STAGE_COUNT];
+	uint64_t sum_us[CHIAKI_LATENCY_STAGE_COUNT];
+} ChiakiLatencyTotals;
+
+/**
+ * Buckets that double in width, for exporting the distributions compactly:
+ * bucket 0 holds samples below CHIAKI_LATENCY_HISTOGRAM_BUCKET_US, bucket k below CHIAKI_LATENCY_HISTOGRAM_BUCKET_US << k
+ * and the last one also everything above.
+ */
+#define CHIAKI_LATENCY_COARSE_BUCKETS 10
+
+typedef struct chiaki_latency_coarse_histograms_t
+{
+	uint64_t buckets[CHIAKI_LATENCY_STAGE_COUNT][CHIAKI_LATENCY_COARSE_BUCKETS];
+} ChiakiLatencyCoarseHistograms;
+
+/**
+ * Per-stage latency histograms of the video pipeline, plus CHIAKI_LATENCY_STAGE_INPUT.
+ *
+ * The receiving side stamps the frame it is working on in a ChiakiLatencyFrame and hands it over
+ * with chiaki_latency_stats_sink_frame(). Everything after that is stamped on the frame most recently
+ * passed to the sink with chiaki_latency_stats_stamp(), which may be called from any thread.
+ */
+typedef struct chiaki_latency_stats_t
+{
+	ChiakiMutex mutex;
+	ChiakiLatencyHistogram stages[CHIAKI_LATENCY_STAGE_COUNT];
+	ChiakiLatencyFrame sink_frame;
+} ChiakiLatencyStats;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_latency_stats_init(ChiakiLatencyStats *stats);
+CHIAKI_EXPORT void chiaki_latency_stats_fini(ChiakiLatencyStats *stats);
+CHIAKI_EXPORT void chiaki_latency_stats_reset(ChiakiLatencyStats *stats);
+
+/**
+ * Stamp frame with CHIAKI_LATENCY_STAMP_SINK, add its stages so far and make it the frame that following
+ * calls to chiaki_latency_stats_stamp() apply to.
+ */
+CHIAKI_EXPORT void chiaki_latency_stats_sink_frame(ChiakiLatencyStats *stats, ChiakiLatencyFrame *frame);
+
+/**
+ * Stamp the frame most recently passed to the sink. Each stamp is only taken once per frame.
+ *
+ * @param stamp CHIAKI_LATENCY_STAMP_DECODED or CHIAKI_LATENCY_STAMP_DISPLAYED
+ * @return total latency of the frame in us if this stamp completed it, 0 otherwise
+ */
+CHIAKI_EXPORT uint64_t chiaki_latency_stats_stamp(ChiakiLatencyStats *stats, ChiakiLatencyStamp stamp);
+
+/**
+ * Add a sample that was measured outside of the video pipeline, e.g. for CHIAKI_LATENCY_STAGE_INPUT.
+ */
+CHIAKI_EXPORT void chiaki_latency_stats_add(ChiakiLatencyStats *stats, ChiakiLatencyStage stage, uint64_t us);
+
+CHIAKI_EXPORT void chiaki_latency_stats_get(ChiakiLatencyStats *stats, ChiakiLatencyReport *report);
+
+CHIAKI_EXPORT void chiaki_latency_stats_get_totals(ChiakiLatencyStats *stats, ChiakiLatencyTotals *totals);
+
+/**
+ * Get the sample counts per coarse bucket since the last reset, so the distribution of an interval follows from two of them.
+ */
+CHIAKI_EXPORT void chiaki_latency_stats_get_coarse_histograms(ChiakiLatencyStats *stats, ChiakiLatencyCoarseHistograms *histograms);
+
+CHIAKI_EXPORT void chiaki_latency_stats_log(ChiakiLatencyStats *stats, ChiakiLog *log);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_LATENCYSTATS_H
@@ -0,0 +1,101 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_LOADMONITOR_H
+#define CHIAKI_LOADMONITOR_H
+
+#include "common.h"
+#include "thread.h"
+#include "latencystats.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Max number of steps the bitrate is lowered by, each one reports CHIAKI_LOAD_MONITOR_LOSS_PER_STEP of the packets as lost
+ */
+#define CHIAKI_LOAD_MONITOR_STEPS_MAX 5
+#define CHIAKI_LOAD_MONITOR_LOSS_PER_STEP 0.03
+
+typedef enum chiaki_client_load_t
+{
+	CHIAKI_CLIENT_LOAD_NORMAL,
+	CHIAKI_CLIENT_LOAD_OVERLOADED, // decoding, presenting or assembling frames can not keep up with the stream
+	CHIAKI_CLIENT_LOAD_HEADROOM // everything keeps up comfortably, so a higher bitrate would fit
+} ChiakiClientLoad;
+
+CHIAKI_EXPORT const char *chiaki_client_load_string(ChiakiClientLoad load);
+
+typedef struct chiaki_load_monitor_stats_t
+{
+	ChiakiClientLoad load; // of the last period
+	unsigned int steps; // current downgrade, 0 if none
+	double decode_ms; // average of the last period, 0 if the client does not report decoded frames
+	double queue_ms; // average time assembled frames waited for the sink in the last period
+	double present_fps; // 0 if the client does not report presented frames
+	double drop_rate; // share of frames passed to the sink that were never presented in the last period
+	double packet_loss;
+} ChiakiLoadMonitorStats;
+
+/**
+ * Closed loop between how well the client keeps up with the stream and the bitrate the console sends at.
+ *
+ * Once per period, the latency stats of the frames since the last period are compared against the frame interval:
+ * decode time (sink -> decoded), the wait for the sink after assembly, how many frames were presented
+ * and how many of those passed to the sink were never presented, which includes the ones dropped by a pacer.
+ * The client only has to stamp CHIAKI_LATENCY_STAMP_DECODED and CHIAKI_LATENCY_STAMP_DISPLAYED, criteria whose
+ * stamps it does not take are skipped.
+ *
+ * After a sustained overload the downgrade is raised by one step, after sustained headroom without network loss
+ * it is lowered again. The console adapts its bitrate to the reported loss, so every step adds a share of
+ * the received packets to the loss reported by ChiakiCongestionControl.
+ *
+ * Only updated from one thread, stats can be read from any thread.
+ */
+typedef struct chiaki_load_monitor_t
+{
+	ChiakiLog *log;
+	ChiakiLatencyStats *latency_stats;
+	uint64_t frame_interval_us;
+
+	// only accessed from chiaki_load_monitor_update()
+	uint64_t period_start_us;
+	ChiakiLatencyTotals totals_prev;
+	double loss_sum;
+	unsigned int loss_samples;
+	ChiakiClientLoad streak_load;
+	unsigned int streak_periods;
+
+	// protected by stats_mutex
+	ChiakiMutex stats_mutex;
+	ChiakiLoadMonitorStats stats;
+} ChiakiLoadMonitor;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_load_monitor_init(ChiakiLoadMonitor *monitor, ChiakiLog *log, ChiakiLatencyStats *latency_stats);
+CHIAKI_EXPORT void chiaki_load_monitor_fini(ChiakiLoadMonitor *monitor);
+
+/**
+ * Start over, e.g. for a new stream. Must not be called concurrently with chiaki_load_monitor_update().
+ *
+ * @param frame_interval_us interval the console sends frames at, 0 disables the monitor
+ */
+CHIAKI_EXPORT void chiaki_load_monitor_reset(ChiakiLoadMonitor *monitor, uint64_t frame_interval_us);
+
+/**
+ * Called periodically, e.g. with every congestion report.
+ *
+ * @param packet_loss actual share of packets lost since the last call
+ * @return share of the received packets to report as lost on top of the actual losses
+ */
+CHIAKI_EXPORT double chiaki_load_monitor_update(ChiakiLoadMonitor *monitor, uint64_t now_us, double packet_loss);
+
+CHIAKI_EXPORT void chiaki_load_monitor_get_stats(ChiakiLoadMonitor *monitor, ChiakiLoadMonitorStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_LOADMONITOR_H
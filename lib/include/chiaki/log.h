@@ -13,6 +13,7 @@ extern "C" {
 #endif
 
 typedef enum {
+	CHIAKI_LOG_TRACE =		(1 << 5), // per-packet messages
 	CHIAKI_LOG_DEBUG =		(1 << 4),
 	CHIAKI_LOG_VERBOSE =	(1 << 3),
 	CHIAKI_LOG_INFO =		(1 << 2),
@@ -20,17 +21,20 @@ typedef enum {
 	CHIAKI_LOG_ERROR =		(1 << 0)
 } ChiakiLogLevel;
 
-#define CHIAKI_LOG_ALL ((1 << 5) - 1)
+#define CHIAKI_LOG_ALL ((1 << 6) - 1)
 
 CHIAKI_EXPORT char chiaki_log_level_char(ChiakiLogLevel level);
 
 typedef void (*ChiakiLogCb)(ChiakiLogLevel level, const char *msg, void *user);
 
+struct chiaki_log_ring_t;
+
 typedef struct chiaki_log_t
 {
 	uint32_t level_mask;
 	ChiakiLogCb cb;
 	void *user;
+	struct chiaki_log_ring_t *ring; // if set, messages are formatted and passed to cb on the ring's thread
 } ChiakiLog;
 
 CHIAKI_EXPORT void chiaki_log_init(ChiakiLog *log, uint32_t level_mask, ChiakiLogCb cb, void *user);
@@ -44,11 +48,24 @@ CHIAKI_EXPORT void chiaki_log(ChiakiLog *log, ChiakiLogLevel level, const char *
 CHIAKI_EXPORT void chiaki_log_hexdump(ChiakiLog *log, ChiakiLogLevel level, const uint8_t *buf, size_t buf_size);
 CHIAKI_EXPORT void chiaki_log_hexdump_raw(ChiakiLog *log, ChiakiLogLevel level, const uint8_t *buf, size_t buf_size);
 
-#define CHIAKI_LOGD(log, ...) do { chiaki_log((log), CHIAKI_LOG_DEBUG, __VA_ARGS__); } while(0)
-#define CHIAKI_LOGV(log, ...) do { chiaki_log((log), CHIAKI_LOG_VERBOSE, __VA_ARGS__); } while(0)
-#define CHIAKI_LOGI(log, ...) do { chiaki_log((log), CHIAKI_LOG_INFO, __VA_ARGS__); } while(0)
-#define CHIAKI_LOGW(log, ...) do { chiaki_log((log), CHIAKI_LOG_WARNING, __VA_ARGS__); } while(0)
-#define CHIAKI_LOGE(log, ...) do { chiaki_log((log), CHIAKI_LOG_ERROR, __VA_ARGS__); } while(0)
+/**
+ * Least severe level that the CHIAKI_LOG* macros compile in, set by the CHIAKI_LOG_MIN_LEVEL CMake option.
+ * Messages below it are eliminated at compile time, including the evaluation of their arguments.
+ */
+#ifndef CHIAKI_LOG_MIN_LEVEL
+#define CHIAKI_LOG_MIN_LEVEL CHIAKI_LOG_TRACE
+#endif
+
+#define CHIAKI_LOG_ENABLED(level) ((level) <= CHIAKI_LOG_MIN_LEVEL)
+
+#define CHIAKI_LOG_LEVEL(log, level, ...) do { if(CHIAKI_LOG_ENABLED(level)) chiaki_log((log), (level), __VA_ARGS__); } while(0)
+
+#define CHIAKI_LOGT(log, ...) CHIAKI_LOG_LEVEL((log), CHIAKI_LOG_TRACE, __VA_ARGS__)
+#define CHIAKI_LOGD(log, ...) CHIAKI_LOG_LEVEL((log), CHIAKI_LOG_DEBUG, __VA_ARGS__)
+#define CHIAKI_LOGV(log, ...) CHIAKI_LOG_LEVEL((log), CHIAKI_LOG_VERBOSE, __VA_ARGS__)
+#define CHIAKI_LOGI(log, ...) CHIAKI_LOG_LEVEL((log), CHIAKI_LOG_INFO, __VA_ARGS__)
+#define CHIAKI_LOGW(log, ...) CHIAKI_LOG_LEVEL((log), CHIAKI_LOG_WARNING, __VA_ARGS__)
+#define CHIAKI_LOGE(log, ...) CHIAKI_LOG_LEVEL((log), CHIAKI_LOG_ERROR, __VA_ARGS__)
 
 typedef struct chiaki_log_sniffer_t
 {
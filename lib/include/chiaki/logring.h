@@ -0,0 +1,123 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_LOGRING_H
+#define CHIAKI_LOGRING_H
+
+#include "common.h"
+#include "log.h"
+#include "thread.h"
+#include "atomic.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Max number of arguments of a message, including * widths and precisions
+ */
+#define CHIAKI_LOG_RING_ARGS_MAX 12
+
+/**
+ * Bytes a record has for copies of its %s arguments, longer ones are truncated
+ */
+#define CHIAKI_LOG_RING_STRS_SIZE 256
+
+/**
+ * Formatted messages longer than this are truncated
+ */
+#define CHIAKI_LOG_RING_MSG_SIZE 0x400
+
+/**
+ * How often the thread looks for new records if it is not woken up by a filling ring
+ */
+#define CHIAKI_LOG_RING_POLL_MS 20
+
+typedef union chiaki_log_ring_arg_t
+{
+	long long i;
+	unsigned long long u;
+	double d;
+	const void *p;
+	size_t str; // offset into strs, SIZE_MAX for NULL
+} ChiakiLogRingArg;
+
+typedef struct chiaki_log_ring_record_t
+{
+	size_t seq; // ring position this record is ready to be written (== pos) or read (== pos + 1) for
+	ChiakiLogLevel level;
+	ChiakiLogCb cb;
+	void *user;
+	uint64_t time_us;
+	const char *fmt; // must be a string literal, only its pointer is kept
+	size_t args_count;
+	ChiakiLogRingArg args[CHIAKI_LOG_RING_ARGS_MAX];
+	size_t strs_size;
+	char strs[CHIAKI_LOG_RING_STRS_SIZE];
+} ChiakiLogRingRecord;
+
+/**
+ * Asynchronous backend for ChiakiLog, see chiaki_log_set_ring().
+ *
+ * Logging threads only copy the format pointer, the arguments and a timestamp into a record of a
+ * lock-free multi-producer ring. Formatting and calling the log's callback is done on a thread of
+ * the lowest priority, so logging from a hot path costs no formatting and no output.
+ * If the ring is full, messages are dropped and the number of dropped messages is logged later.
+ *
+ * Format strings that cannot be captured (%n, long double, too many arguments) are formatted
+ * synchronously as without a ring.
+ */
+typedef struct chiaki_log_ring_t
+{
+	ChiakiLogRingRecord *records;
+	size_t size_exp; // real size = 2^size_exp records
+	bool timestamps;
+
+	size_t tail; // next position to write, claimed by producers
+	size_t head; // next position to read, only written by the thread
+	size_t dropped;
+
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	bool should_stop;
+	ChiakiThread thread;
+} ChiakiLogRing;
+
+/**
+ * Allocate the ring and start its thread.
+ *
+ * @param size_exp exponent for 2 of the number of records
+ * @param timestamps if true, prefix every message with the time it was logged at in ms
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_log_ring_init(ChiakiLogRing *ring, size_t size_exp, bool timestamps);
+
+/**
+ * Output everything still queued and stop the thread.
+ * No log must be using the ring anymore.
+ */
+CHIAKI_EXPORT void chiaki_log_ring_fini(ChiakiLogRing *ring);
+
+/**
+ * Queue a message for cb. Can be called from any thread.
+ *
+ * @return false if fmt cannot be captured, so the caller has to format it itself
+ */
+CHIAKI_EXPORT bool chiaki_log_ring_vpush(ChiakiLogRing *ring, ChiakiLogLevel level, ChiakiLogCb cb, void *user, const char *fmt, va_list args);
+
+/**
+ * Make log pass all its messages through ring, or output them synchronously again if ring is NULL.
+ * Not thread-safe, set it before log is used from other threads.
+ */
+static inline void chiaki_log_set_ring(ChiakiLog *log, ChiakiLogRing *ring)
+{
+	log->ring = ring;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_LOGRING_H
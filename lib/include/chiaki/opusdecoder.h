@@ -15,16 +15,37 @@ extern "C" {
 typedef void (*ChiakiOpusDecoderSettingsCallback)(uint32_t channels, uint32_t rate, void *user);
 typedef void (*ChiakiOpusDecoderFrameCallback)(int16_t *buf, size_t samples_count, void *user);
 
+/**
+ * Provide the buffer for the next frame of samples_count samples per channel, which is then passed to the
+ * frame callback. Return NULL to decode into a buffer of the decoder instead.
+ */
+typedef int16_t *(*ChiakiOpusDecoderBufferCallback)(size_t samples_count, void *user);
+
+/**
+ * Max number of lost frames that are concealed before the next one, longer gaps are mostly skipped
+ */
+#define CHIAKI_OPUS_DECODER_CONCEAL_FRAMES_MAX 5
+
+/**
+ * The decoder state is allocated for this many channels once, so any header can be decoded in it
+ */
+#define CHIAKI_OPUS_DECODER_CHANNELS_MAX 2
+
 typedef struct chiaki_opus_decoder_t
 {
 	ChiakiLog *log;
-	struct OpusDecoder *opus_decoder;
+	struct OpusDecoder *opus_decoder; // in opus_decoder_mem, NULL until a header initialized it
+	void *opus_decoder_mem; // for CHIAKI_OPUS_DECODER_CHANNELS_MAX channels
 	ChiakiAudioHeader audio_header;
-	int16_t *pcm_buf;
-	size_t pcm_buf_size;
+	int16_t *pcm_buf; // only allocated once needed, kept for headers that need no more
+	size_t pcm_buf_size; // of a frame of audio_header
+	size_t pcm_buf_alloc_size;
+	unsigned int frames_lost; // to conceal before decoding the next frame
+	uint64_t frames_concealed;
 
 	ChiakiOpusDecoderSettingsCallback settings_cb;
 	ChiakiOpusDecoderFrameCallback frame_cb;
+	ChiakiOpusDecoderBufferCallback buf_cb;
 	void *cb_user;
 } ChiakiOpusDecoder;
 
@@ -39,6 +60,15 @@ static inline void chiaki_opus_decoder_set_cb(ChiakiOpusDecoder *decoder, Chiaki
 	decoder->cb_user = user;
 }
 
+/**
+ * Let the frame callback's user provide the buffers to decode into, saving a copy per frame.
+ * Must be called after chiaki_opus_decoder_set_cb().
+ */
+static inline void chiaki_opus_decoder_set_buf_cb(ChiakiOpusDecoder *decoder, ChiakiOpusDecoderBufferCallback buf_cb)
+{
+	decoder->buf_cb = buf_cb;
+}
+
 #ifdef __cplusplus
 }
 #endif
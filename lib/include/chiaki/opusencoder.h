@@ -13,18 +13,50 @@
 extern "C" {
 #endif
 
+typedef enum chiaki_opus_encoder_profile_t
+{
+	CHIAKI_OPUS_ENCODER_PROFILE_DEFAULT = 0, // opus defaults, vbr limited to the packet size
+	CHIAKI_OPUS_ENCODER_PROFILE_LOW_CPU // low complexity cbr, silence is not sent
+} ChiakiOpusEncoderProfile;
+
+/**
+ * The frame duration is not part of these, it is given by the frame size in the audio header.
+ */
+typedef struct chiaki_opus_encoder_settings_t
+{
+	int complexity; // 0 to 10
+	bool vbr; // otherwise every frame fills the whole packet unit
+	bool dtx; // silent frames encode to at most 2 bytes and are not sent
+} ChiakiOpusEncoderSettings;
+
+CHIAKI_EXPORT void chiaki_opus_encoder_settings_preset(ChiakiOpusEncoderSettings *settings, ChiakiOpusEncoderProfile profile);
+
 typedef struct chiaki_opus_encoder_t
 {
 	ChiakiLog *log;
+	ChiakiOpusEncoderSettings settings;
 	struct OpusEncoder *opus_encoder;
 	ChiakiAudioHeader audio_header;
 	uint8_t *opus_frame_buf;
 	size_t opus_frame_buf_size;
 	ChiakiAudioSender *audio_sender;
+
+	uint64_t frames;
+	uint64_t frames_silent; // not sent because of dtx
+	uint64_t encode_us_sum;
 } ChiakiOpusEncoder;
 
 CHIAKI_EXPORT void chiaki_opus_encoder_init(ChiakiOpusEncoder *encoder, ChiakiLog *log);
 CHIAKI_EXPORT void chiaki_opus_encoder_fini(ChiakiOpusEncoder *encoder);
+
+/**
+ * Applied on the next call to chiaki_opus_encoder_header(), the default is CHIAKI_OPUS_ENCODER_PROFILE_DEFAULT.
+ */
+static inline void chiaki_opus_encoder_set_settings(ChiakiOpusEncoder *encoder, const ChiakiOpusEncoderSettings *settings)
+{
+	encoder->settings = *settings;
+}
+
 CHIAKI_EXPORT void chiaki_opus_encoder_header(ChiakiAudioHeader *header, ChiakiOpusEncoder *encoder, ChiakiSession *session);
 CHIAKI_EXPORT void chiaki_opus_encoder_frame(int16_t *pcm_buf, ChiakiOpusEncoder *header);
 
@@ -36,9 +36,26 @@ typedef struct chiaki_orientation_tracker_t
 	uint64_t sample_index;
 } ChiakiOrientationTracker;
 
+typedef struct chiaki_orientation_sample_t
+{
+	float gx, gy, gz;
+	float ax, ay, az;
+	uint32_t timestamp_us;
+} ChiakiOrientationSample;
+
 CHIAKI_EXPORT void chiaki_orientation_tracker_init(ChiakiOrientationTracker *tracker);
 CHIAKI_EXPORT void chiaki_orientation_tracker_update(ChiakiOrientationTracker *tracker,
 		float gx, float gy, float gz, float ax, float ay, float az, uint32_t timestamp_us);
+
+/**
+ * Integrate all samples buffered since the last update at once, e.g. once per feedback packet,
+ * instead of calling chiaki_orientation_tracker_update() for each one.
+ * The gyro/accel state is taken from the last sample.
+ *
+ * @param samples in chronological order
+ */
+CHIAKI_EXPORT void chiaki_orientation_tracker_update_batch(ChiakiOrientationTracker *tracker,
+		const ChiakiOrientationSample *samples, size_t samples_count);
 CHIAKI_EXPORT void chiaki_orientation_tracker_apply_to_controller_state(ChiakiOrientationTracker *tracker,
 		ChiakiControllerState *state);
 
@@ -0,0 +1,90 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_PACKETPOOL_H
+#define CHIAKI_PACKETPOOL_H
+
+#include "common.h"
+#include "thread.h"
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Size of every buffer handed out by a ChiakiPacketPool, enough for one datagram on a regular Ethernet MTU.
+ */
+#define CHIAKI_PACKET_POOL_BUF_SIZE 1500
+
+/**
+ * Every buffer is followed by this many bytes, 16-byte aligned, where its current owner can keep metadata
+ * about the packet in it, see chiaki_packet_pool_buf_reserve().
+ */
+#define CHIAKI_PACKET_POOL_BUF_RESERVE 64
+#define CHIAKI_PACKET_POOL_BUF_RESERVE_OFFSET ((CHIAKI_PACKET_POOL_BUF_SIZE + 15) & ~(size_t)15)
+#define CHIAKI_PACKET_POOL_BUF_STRIDE (CHIAKI_PACKET_POOL_BUF_RESERVE_OFFSET + CHIAKI_PACKET_POOL_BUF_RESERVE)
+
+/**
+ * Fixed-capacity pool of equally-sized packet buffers backed by a single slab.
+ *
+ * If the pool is exhausted, buffers are allocated from the heap instead and
+ * transparently freed again when released, so callers never have to care where a buffer came from.
+ */
+typedef struct chiaki_packet_pool_t
+{
+	ChiakiMutex mutex;
+	uint8_t *slab;
+	size_t buf_size; // usable by the packet, the reserve comes after it
+	size_t buf_stride;
+	size_t bufs_count;
+	uint8_t **free_bufs; // stack of currently unused buffers inside slab
+	size_t free_count;
+
+	// stats
+	size_t in_use_max; // high-water mark of slab buffers in use at once
+	uint64_t fallback_allocs; // number of allocations that had to go to the heap
+} ChiakiPacketPool;
+
+/**
+ * @param bufs_count number of buffers of size CHIAKI_PACKET_POOL_BUF_SIZE to preallocate
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_packet_pool_init(ChiakiPacketPool *pool, size_t bufs_count);
+CHIAKI_EXPORT void chiaki_packet_pool_fini(ChiakiPacketPool *pool);
+
+/**
+ * Get a buffer of size pool->buf_size.
+ *
+ * Thread-safe.
+ *
+ * @return the buffer or NULL if both the pool and the heap are exhausted
+ */
+CHIAKI_EXPORT uint8_t *chiaki_packet_pool_alloc(ChiakiPacketPool *pool);
+
+/**
+ * Give a buffer obtained by chiaki_packet_pool_alloc() back to the pool.
+ *
+ * Thread-safe.
+ *
+ * @param buf may be NULL
+ */
+CHIAKI_EXPORT void chiaki_packet_pool_free(ChiakiPacketPool *pool, uint8_t *buf);
+
+static inline bool chiaki_packet_pool_owns(ChiakiPacketPool *pool, const uint8_t *buf)
+{
+	return buf >= pool->slab && buf < pool->slab + pool->buf_stride * pool->bufs_count;
+}
+
+/**
+ * @return the CHIAKI_PACKET_POOL_BUF_RESERVE bytes that come with buf, which may be from the pool or its heap fallback
+ */
+static inline void *chiaki_packet_pool_buf_reserve(uint8_t *buf)
+{
+	return buf + CHIAKI_PACKET_POOL_BUF_RESERVE_OFFSET;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_PACKETPOOL_H
@@ -3,34 +3,119 @@
 #ifndef CHIAKI_PACKETSTATS_H
 #define CHIAKI_PACKETSTATS_H
 
-#include "thread.h"
+#include "common.h"
+#include "atomic.h"
 #include "seqnum.h"
 
+#include <stdint.h>
+#include <stdbool.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-typedef struct chiaki_packet_stats_t
+/**
+ * Lengths of lost runs, buckets for 1, 2, 3-4, 5-8, 9-16 and more
+ */
+#define CHIAKI_PACKET_STATS_BURST_BUCKETS 6
+
+/**
+ * Intervals between packets, buckets for < 0.25 ms, doubling up to >= 32 ms
+ */
+#define CHIAKI_PACKET_STATS_ARRIVAL_BUCKETS 9
+#define CHIAKI_PACKET_STATS_ARRIVAL_BUCKET_MIN_US 250
+
+/**
+ * Rolling windows are made up of slots of this length
+ */
+#define CHIAKI_PACKET_STATS_SLOT_US 100000
+#define CHIAKI_PACKET_STATS_SLOTS 128
+
+#define CHIAKI_PACKET_STATS_WINDOW_SHORT_US 1000000
+#define CHIAKI_PACKET_STATS_WINDOW_LONG_US 10000000
+
+typedef struct chiaki_packet_stats_counts_t
+{
+	uint64_t received;
+	uint64_t lost;
+} ChiakiPacketStatsCounts;
+
+typedef struct chiaki_packet_stats_snapshot_t
+{
+	ChiakiPacketStatsCounts total; // since init
+	ChiakiPacketStatsCounts window_short; // last CHIAKI_PACKET_STATS_WINDOW_SHORT_US
+	ChiakiPacketStatsCounts window_long; // last CHIAKI_PACKET_STATS_WINDOW_LONG_US
+	uint64_t loss_bursts[CHIAKI_PACKET_STATS_BURST_BUCKETS];
+	uint64_t arrival_intervals[CHIAKI_PACKET_STATS_ARRIVAL_BUCKETS];
+} ChiakiPacketStatsSnapshot;
+
+typedef struct chiaki_packet_stats_slot_t
 {
-	ChiakiMutex mutex;
+	size_t seq; // odd while being written
+	size_t index; // slot number, i.e. time / CHIAKI_PACKET_STATS_SLOT_US
+	size_t received; // totals when the slot started
+	size_t lost;
+} ChiakiPacketStatsSlot;
 
-	// For generations of packets, i.e. where we know the number of expected packets per generation
-	uint64_t gen_received;
-	uint64_t gen_lost;
+/**
+ * Received and lost packet counts of the stream.
+ *
+ * All pushes must come from the same thread, i.e. the one receiving the stream.
+ * Counters only ever grow and are published atomically, so any number of threads can read them
+ * without blocking the receiving thread. They wrap at the size of size_t, differences are taken modulo that.
+ */
+typedef struct chiaki_packet_stats_t
+{
+	// published by the receiving thread
+	size_t gen_received; // For generations of packets, i.e. where we know the number of expected packets per generation
+	size_t gen_lost;
+	size_t seq_received; // For sequential packets, i.e. where packets are identified by a sequence number
+	size_t seq_lost;
+	size_t loss_bursts[CHIAKI_PACKET_STATS_BURST_BUCKETS];
+	size_t arrival_intervals[CHIAKI_PACKET_STATS_ARRIVAL_BUCKETS];
+	size_t slot_cur; // newest slot written, 0 before the first arrival
+	ChiakiPacketStatsSlot slots[CHIAKI_PACKET_STATS_SLOTS];
 
-	// For sequential packets, i.e. where packets are identified by a sequence number
-	ChiakiSeqNum16 seq_min; // sequence number that was max at the last reset
+	// only accessed from the receiving thread
+	bool seq_valid;
 	ChiakiSeqNum16 seq_max; // currently maximal sequence number
-	uint64_t seq_received; // total received packets since the last reset
+	uint64_t arrival_prev_us;
+
+	// totals at the last reset, only written by the one reader that resets
+	size_t reset_received;
+	size_t reset_lost;
 } ChiakiPacketStats;
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_packet_stats_init(ChiakiPacketStats *stats);
 CHIAKI_EXPORT void chiaki_packet_stats_fini(ChiakiPacketStats *stats);
+
+/**
+ * Restart the counts returned by chiaki_packet_stats_get(). Only one thread may reset.
+ */
 CHIAKI_EXPORT void chiaki_packet_stats_reset(ChiakiPacketStats *stats);
+
 CHIAKI_EXPORT void chiaki_packet_stats_push_generation(ChiakiPacketStats *stats, uint64_t received, uint64_t lost);
 CHIAKI_EXPORT void chiaki_packet_stats_push_seq(ChiakiPacketStats *stats, ChiakiSeqNum16 seq_num);
+
+/**
+ * Count the arrival of any packet for the inter-arrival histogram and advance the rolling windows.
+ */
+CHIAKI_EXPORT void chiaki_packet_stats_push_arrival(ChiakiPacketStats *stats, uint64_t arrival_us);
+
+/**
+ * Get the counts since the last reset.
+ *
+ * @param reset whether to reset afterwards, see chiaki_packet_stats_reset()
+ */
 CHIAKI_EXPORT void chiaki_packet_stats_get(ChiakiPacketStats *stats, bool reset, uint64_t *received, uint64_t *lost);
 
+/**
+ * Get totals, rolling windows and histograms without resetting anything. Can be called from any thread.
+ *
+ * @param now_us current monotonic time, to end the windows at
+ */
+CHIAKI_EXPORT void chiaki_packet_stats_snapshot(ChiakiPacketStats *stats, uint64_t now_us, ChiakiPacketStatsSnapshot *snapshot);
+
 #ifdef __cplusplus
 }
 #endif
@@ -3,6 +3,7 @@
 
 #include <chiaki/config.h>
 #include <chiaki/log.h>
+#include <chiaki/video.h>
 
 #include <ilclient.h>
 
@@ -12,6 +13,11 @@
 extern "C" {
 #endif
 
+/**
+ * Size of the OMX input buffers, big enough for whole I-frames so frames can be assembled in them directly
+ */
+#define CHIAKI_PI_DECODER_INPUT_BUFFER_SIZE (1024 * 1024)
+
 typedef struct chiaki_pi_decoder_t
 {
 	ChiakiLog *log;
@@ -22,6 +28,8 @@ typedef struct chiaki_pi_decoder_t
 	COMPONENT_T *video_render;
 	bool port_settings_changed;
 	bool first_packet;
+	OMX_BUFFERHEADERTYPE *au_bufs[CHIAKI_VIDEO_FRAME_SLOTS]; // handed out by chiaki_pi_decoder_au_buffer_cb() and not emptied yet
+	size_t au_buf_next;
 } ChiakiPiDecoder;
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_pi_decoder_init(ChiakiPiDecoder *decoder, ChiakiLog *log);
@@ -29,6 +37,12 @@ CHIAKI_EXPORT void chiaki_pi_decoder_fini(ChiakiPiDecoder *decoder);
 CHIAKI_EXPORT void chiaki_pi_decoder_set_params(ChiakiPiDecoder *decoder, int x, int y, int w, int h, bool visible);
 CHIAKI_EXPORT bool chiaki_pi_decoder_video_sample_cb(uint8_t *buf, size_t buf_size, void *user);
 
+/**
+ * ChiakiVideoAUBufferCallback handing out OMX input buffers, so frames assembled in them
+ * are passed to the decoder without being copied.
+ */
+CHIAKI_EXPORT uint8_t *chiaki_pi_decoder_au_buffer_cb(size_t size, void *user);
+
 #ifdef __cplusplus
 }
 #endif
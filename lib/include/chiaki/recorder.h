@@ -0,0 +1,96 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_RECORDER_H
+#define CHIAKI_RECORDER_H
+
+#include "common.h"
+#include "thread.h"
+#include "audio.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A recording starts with CHIAKI_RECORDER_MAGIC, followed by records with the same 16 byte header as
+ * a capture (type: u32, payload size: u32, time in us since the recorder was started: u64, all little endian)
+ * and the payload. Video payloads are H.264 or H.265 Annex B access units as passed to the video sink,
+ * so concatenating them gives a raw elementary stream, audio payloads are single Opus packets.
+ */
+#define CHIAKI_RECORDER_MAGIC "CHKREC01"
+#define CHIAKI_RECORDER_MAGIC_SIZE 8
+#define CHIAKI_RECORDER_RECORD_HEADER_SIZE 16
+
+#define CHIAKI_RECORDER_QUEUE_SIZE_DEFAULT 0x200000
+
+typedef enum chiaki_recorder_record_type_t
+{
+	CHIAKI_RECORDER_RECORD_VIDEO = 1,
+	CHIAKI_RECORDER_RECORD_AUDIO_HEADER = 2, // as written by chiaki_audio_header_save()
+	CHIAKI_RECORDER_RECORD_AUDIO = 3
+} ChiakiRecorderRecordType;
+
+typedef struct chiaki_recorder_stats_t
+{
+	uint64_t frames_written; // queued for writing
+	uint64_t bytes_written; // actually written, including the record headers
+	uint64_t frames_dropped; // because the queue was full or writing failed, the stream itself is never held up
+	uint64_t bytes_dropped;
+	uint64_t push_us; // time the receiving threads spent queueing frames, which is all the stream pays for
+	uint64_t write_us; // time the writer thread spent writing
+	size_t queue_peak; // most bytes queued at once
+	bool failed; // writing failed, everything after is dropped
+} ChiakiRecorderStats;
+
+/**
+ * Records the assembled video and the audio frames of a session, as a session passes them to its sinks.
+ *
+ * Frames are copied into a ring of fixed size on the receiving threads and written by a thread of its own,
+ * so a slow storage device only makes the recording lose frames. Video is dropped until the next keyframe then,
+ * so the rest of the recording stays decodable.
+ */
+typedef struct chiaki_recorder_t
+{
+	FILE *file;
+	ChiakiThread thread;
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	uint8_t *queue;
+	size_t queue_size;
+	size_t queue_head; // offset of the oldest queued byte
+	size_t queue_used;
+	bool should_stop;
+	bool video_resync; // a video frame was dropped, drop the following ones until a keyframe
+	uint64_t start_us;
+	ChiakiRecorderStats stats;
+} ChiakiRecorder;
+
+/**
+ * @param queue_size bytes of frames that can wait for being written, e.g. CHIAKI_RECORDER_QUEUE_SIZE_DEFAULT
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_recorder_init(ChiakiRecorder *recorder, const char *filename, size_t queue_size);
+
+/**
+ * Write everything still queued and close the file.
+ */
+CHIAKI_EXPORT void chiaki_recorder_fini(ChiakiRecorder *recorder);
+
+/**
+ * @param keyframe whether decoding can start at this frame, parameter sets count as keyframes
+ */
+CHIAKI_EXPORT void chiaki_recorder_video(ChiakiRecorder *recorder, const uint8_t *buf, size_t buf_size, bool keyframe);
+CHIAKI_EXPORT void chiaki_recorder_audio_header(ChiakiRecorder *recorder, ChiakiAudioHeader *audio_header);
+CHIAKI_EXPORT void chiaki_recorder_audio(ChiakiRecorder *recorder, const uint8_t *buf, size_t buf_size);
+
+CHIAKI_EXPORT void chiaki_recorder_get_stats(ChiakiRecorder *recorder, ChiakiRecorderStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_RECORDER_H
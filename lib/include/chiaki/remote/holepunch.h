@@ -12,12 +12,16 @@
  * messages (using the same protocol as a local connection).
  *
  * The functions defined in this header should be used in this order:
- * 1. `chiaki_holepunch_list_devices` to get a list of devices that can be used for remote play
+ * 1. `chiaki_holepunch_list_devices` (or `chiaki_holepunch_cache_list_devices`) to get a list of devices
+ *    that can be used for remote play
  * 2. `chiaki_holepunch_session_init` to initialize a session with a valid OAuth2 token
  * 3. `chiaki_holepunch_session_create` to create a remote play session on the PSN server
  * 4. `chiaki_holepunch_session_start` to start the session for a specific device
  * 5. `chiaki_holepunch_session_punch_hole` called twice, to obtain the control and data sockets
  * 6. `chiaki_holepunch_session_fini` once the streaming session has terminated.
+ *
+ * A `ChiakiHolepunchCache` kept for as long as the application runs saves the PSN requests whose answers
+ * rarely change (device lists, websocket FQDN, user profile URL) on every connect.
  */
 
 #ifndef CHIAKI_HOLEPUNCH_H
@@ -51,6 +55,9 @@ extern "C" {
 /** Handle to holepunching session state */
 typedef struct session_t* ChiakiHolepunchSession;
 
+/** Handle to PSN data cached across holepunching sessions */
+typedef struct psn_cache_t* ChiakiHolepunchCache;
+
 /** Info for Remote Registration */
 typedef struct holepunch_regist_info_t
 {
@@ -108,6 +115,39 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_holepunch_list_devices(
 */
 CHIAKI_EXPORT void chiaki_holepunch_free_device_list(ChiakiHolepunchDeviceInfo** devices);
 
+/**
+ * Create a cache for PSN answers that rarely change between sessions of the same account: the device lists,
+ * the push notification websocket FQDN and the user profile base URL.
+ *
+ * The cache starts a thread that fetches the PS5 device list and the websocket FQDN right away and refreshes
+ * every entry that has been used before it expires, so a connect can go straight to
+ * `chiaki_holepunch_session_create` without waiting for these requests. Entries are only used within their TTL.
+ *
+ * @param[in] psn_oauth2_token PSN OAuth2 token, as for `chiaki_holepunch_session_init`
+ * @param[in] log logging instance to use, must stay valid until the cache is freed
+ * @return handle to the cache on success, otherwise NULL
+*/
+CHIAKI_EXPORT ChiakiHolepunchCache chiaki_holepunch_cache_new(const char *psn_oauth2_token, ChiakiLog *log);
+
+/**
+ * Stop the refresh thread and free the cache. No session may use it anymore.
+ */
+CHIAKI_EXPORT void chiaki_holepunch_cache_free(ChiakiHolepunchCache cache);
+
+/**
+ * Replace the token used for background refreshes, e.g. after it was refreshed.
+ * A token of another account needs a new cache.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_holepunch_cache_set_token(ChiakiHolepunchCache cache, const char *psn_oauth2_token);
+
+/**
+ * Like `chiaki_holepunch_list_devices`, but answered from the cache while its entry is fresh.
+ *
+ * @param[out] devices must be freed with `chiaki_holepunch_free_device_list`
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_holepunch_cache_list_devices(ChiakiHolepunchCache cache,
+    ChiakiHolepunchConsoleType console_type, ChiakiHolepunchDeviceInfo** devices, size_t* device_count);
+
 /**
  * This function returns the data needed for regist from the ChiakiHolepunchSession
  *
@@ -184,6 +224,17 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_holepunch_generate_client_device_uid(
 CHIAKI_EXPORT ChiakiHolepunchSession chiaki_holepunch_session_init(
     const char* psn_oauth2_token, ChiakiLog *log);
 
+/**
+ * Let a session take PSN data from a cache and put what it had to fetch itself into it.
+ *
+ * Must be called before `chiaki_holepunch_session_create`, the cache must outlive the session.
+ *
+ * @param[in] session Handle to the holepunching session
+ * @param[in] cache Cache of the same account, NULL for none
+*/
+CHIAKI_EXPORT void chiaki_holepunch_session_set_cache(
+    ChiakiHolepunchSession session, ChiakiHolepunchCache cache);
+
 /**
  * Create a remote play session on the PSN server.
  *
@@ -22,6 +22,7 @@
 #include <chiaki/common.h>
 #include <chiaki/sock.h>
 #include <chiaki/stoppipe.h>
+#include <chiaki/arena.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -60,15 +61,35 @@ struct rudp_message_t
     uint16_t subMessage_size;
 };
 
+/**
+ * Rudp Message parsed in place, without any allocation.
+ *
+ * data points into the buffer the message was parsed from, so a view is only valid as long as that buffer is.
+ * For views from chiaki_rudp_recv_view() that is until the next call to it on the same Rudp instance.
+ * Nothing has to be freed.
+ */
+typedef struct rudp_message_view_t
+{
+    uint8_t subtype;
+    RudpPacketType type;
+    uint16_t size;
+    const uint8_t *data;
+    size_t data_size;
+    uint16_t remote_counter;
+    const uint8_t *next; // serialized sub message or NULL
+    size_t next_size;
+} RudpMessageView;
+
 /**
  * Create rudp instance
  *
  * @param[in] sock Pointer to a sock to use for Rudp messages
+ * @param[in] arena The ChiakiArena to allocate messages from, may be NULL
  * @param[in] log The ChiakiLog to use for log messages
  * @return The initialized rudp instance
 */
 CHIAKI_EXPORT ChiakiRudp chiaki_rudp_init(chiaki_socket_t *sock,
-    ChiakiLog *log);
+    ChiakiArena *arena, ChiakiLog *log);
 
 /**
  * Creates and sends an init rudp message for use when starting the session
@@ -194,6 +215,36 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_select_recv(ChiakiRudp rudp, size_t bu
 */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_recv_only(ChiakiRudp rudp, size_t buf_size,  RudpMessage *message);
 
+/**
+ * Receives the rudp message into the receive buffer of the Rudp instance and parses it in place.
+ * Must use select separately from this function and must only be called from one thread.
+ *
+ * @param rudp Pointer to the Rudp instance to use
+ * @param[out] view The message, valid until the next call
+ * @return CHIAKI_ERR_SUCCESS on success, otherwise another error code
+ *
+*/
+CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_recv_view(ChiakiRudp rudp, RudpMessageView *view);
+
+/**
+ * Parses a serialized rudp message in place
+ *
+ * @param[in] buf The serialized message, must outlive view
+ * @param[in] buf_size The size of the serialized message
+ * @param[out] view The parsed message
+ * @return CHIAKI_ERR_SUCCESS on success, otherwise another error code
+ *
+*/
+CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_message_view_parse(const uint8_t *buf, size_t buf_size, RudpMessageView *view);
+
+/**
+ * Replaces view with its sub message
+ *
+ * @return true if there was a sub message, false if view is unchanged
+ *
+*/
+CHIAKI_EXPORT bool chiaki_rudp_message_view_next(RudpMessageView *view);
+
 /**
  * Selects a rudp message using the given stop pipe and timeout
  *
@@ -8,6 +8,7 @@
 #include "../thread.h"
 #include "../seqnum.h"
 #include "../sock.h"
+#include "../arena.h"
 #include "../remote/rudp.h"
 
 #include <stdbool.h>
@@ -18,14 +19,33 @@ extern "C" {
 
 typedef struct chiaki_rudp_send_buffer_packet_t ChiakiRudpSendBufferPacket;
 
+/**
+ * Sliding window of sent reliable RUDP packets that have not been acked yet.
+ *
+ * Packets are stored in a ring indexed by seq_num % packets_size, so all outstanding seqnums
+ * must lie within a window of packets_size, i.e. [seq_num_begin, seq_num_end).
+ */
 typedef struct chiaki_rudp_send_buffer_t
 {
 	ChiakiLog *log;
 	ChiakiRudp rudp;
+	ChiakiArena *arena;
 
 	ChiakiRudpSendBufferPacket *packets;
 	size_t packets_size; // allocated size
-	size_t packets_count; // current count
+	size_t packets_count; // current count of outstanding packets
+
+	ChiakiSeqNum16 seq_num_begin; // oldest outstanding seqnum, only valid if packets_count > 0
+	ChiakiSeqNum16 seq_num_end; // one after the newest outstanding seqnum, only valid if packets_count > 0
+
+	/**
+	 * Retransmission timeout estimator (RFC 6298), fed by the time between sending a packet and its ack.
+	 * Only packets that have never been re-sent are sampled (Karn's algorithm).
+	 */
+	bool rtt_sampled;
+	uint64_t srtt_us;
+	uint64_t rttvar_us;
+	uint64_t rto_us;
 
 	ChiakiMutex mutex;
 	ChiakiCond cond;
@@ -38,9 +58,10 @@ typedef struct chiaki_rudp_send_buffer_t
  * Init a Send Buffer and start a thread that automatically re-sends RUDP packets.
  *
  * @param sock if NULL, the Send Buffer thread will effectively do nothing (for unit testing)
- * @param size number of packet slots
+ * @param arena all pushed buffers must have been allocated from this, may be NULL
+ * @param size number of packet slots, must be a power of 2
  */
-CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_buffer_init(ChiakiRudpSendBuffer *send_buffer, ChiakiRudp rudp, ChiakiLog *log, size_t size);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_buffer_init(ChiakiRudpSendBuffer *send_buffer, ChiakiRudp rudp, ChiakiArena *arena, ChiakiLog *log, size_t size);
 CHIAKI_EXPORT void chiaki_rudp_send_buffer_fini(ChiakiRudpSendBuffer *send_buffer);
 
 /**
@@ -50,6 +71,10 @@ CHIAKI_EXPORT void chiaki_rudp_send_buffer_fini(ChiakiRudpSendBuffer *send_buffe
 CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_buffer_push(ChiakiRudpSendBuffer *send_buffer, ChiakiSeqNum16 seq_num, uint8_t *buf, size_t buf_size);
 
 /**
+ * Ack all packets up to and including seq_num.
+ * If the oldest packet is still outstanding after this and has been out for longer than the measured rtt,
+ * it was most likely lost and is re-sent right away instead of waiting for its timeout.
+ *
  * @param acked_seq_nums optional array of size of at least send_buffer->packets_size where acked seq nums will be stored
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_buffer_ack(ChiakiRudpSendBuffer *send_buffer, ChiakiSeqNum16 seq_num, ChiakiSeqNum16 *acked_seq_nums, size_t *acked_seq_nums_count);
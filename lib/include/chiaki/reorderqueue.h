@@ -18,8 +18,7 @@ typedef enum chiaki_reorder_queue_drop_strategy_t {
 
 typedef struct chiaki_reorder_queue_entry_t
 {
-	void *user;
-	bool set;
+	void *user; // only valid if the entry's bit in set_bits is set
 } ChiakiReorderQueueEntry;
 
 typedef void (*ChiakiReorderQueueDropCb)(uint64_t seq_num, void *elem_user, void *cb_user);
@@ -32,6 +31,7 @@ typedef struct chiaki_reorder_queue_t
 {
 	size_t size_exp; // real size = 2^size * sizeof(ChiakiReorderQueueEntry)
 	ChiakiReorderQueueEntry *queue;
+	uint64_t *set_bits; // bit idx(seq_num) is set if the element with seq_num has been pushed and not pulled or dropped yet
 	uint64_t begin;
 	uint64_t count;
 	ChiakiReorderQueueSeqNumGt seq_num_gt;
@@ -106,11 +106,16 @@ CHIAKI_EXPORT void chiaki_reorder_queue_push(ChiakiReorderQueue *queue, uint64_t
  */
 CHIAKI_EXPORT bool chiaki_reorder_queue_pull(ChiakiReorderQueue *queue, uint64_t *seq_num, void **user);
 
+/**
+ * @return how many elements chiaki_reorder_queue_pull() would return in a row right now
+ */
+CHIAKI_EXPORT uint64_t chiaki_reorder_queue_ready(ChiakiReorderQueue *queue);
+
 /**
  * Peek the element at a specific index inside the queue.
  *
  * @param index Offset to be added to the begin sequence number, this is NOT a sequence number itself! (0 <= index < count)
- * @param seq_num pointer where the sequence number of the peeked packet is written, undefined contents if false is returned
+ * @param seq_num pointer where the sequence number of the peeked packet is written, undefined contents if false is returned, may be NULL
  * @param user pointer where the user pointer of the pulled packet is written, undefined contents if false is returned
  * @return true if an element was peeked, false if there is no element at index.
  */
@@ -123,6 +128,269 @@ CHIAKI_EXPORT bool chiaki_reorder_queue_peek(ChiakiReorderQueue *queue, uint64_t
  */
 CHIAKI_EXPORT void chiaki_reorder_queue_drop(ChiakiReorderQueue *queue, uint64_t index);
 
+#define CHIAKI_REORDER_QUEUE_BITS_WORDS(size_exp) ((((size_t)1 << (size_exp)) + 63) / 64)
+
+static inline bool chiaki_reorder_queue_bit_get(const uint64_t *set_bits, size_t i)
+{
+	return (set_bits[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void chiaki_reorder_queue_bit_set(uint64_t *set_bits, size_t i)
+{
+	set_bits[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static inline void chiaki_reorder_queue_bit_clear(uint64_t *set_bits, size_t i)
+{
+	set_bits[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
+
+static inline unsigned int chiaki_reorder_queue_trailing_ones(uint64_t x)
+{
+	if(x == UINT64_MAX)
+		return 64;
+#if defined(__GNUC__)
+	return (unsigned int)__builtin_ctzll(~x);
+#else
+	unsigned int r = 0;
+	while(x & 1)
+	{
+		x >>= 1;
+		r++;
+	}
+	return r;
+#endif
+}
+
+/**
+ * @return length of the run of set bits starting at index start of a bitmap of 2^size_exp bits,
+ * wrapping around at the end, but at most max
+ */
+static inline uint64_t chiaki_reorder_queue_bits_run(const uint64_t *set_bits, size_t size_exp, size_t start, uint64_t max)
+{
+	// a word at a time
+	size_t size = (size_t)1 << size_exp;
+	size_t i = start;
+	uint64_t run = 0;
+	while(run < max)
+	{
+		unsigned int shift = (unsigned int)(i % 64);
+		uint64_t word = set_bits[i / 64] >> shift;
+		size_t avail = 64 - shift;
+		if(avail > size - i)
+			avail = size - i; // bitmaps smaller than 64 only use the low bits
+		unsigned int ones = chiaki_reorder_queue_trailing_ones(word);
+		if(ones < avail)
+		{
+			run += ones;
+			break;
+		}
+		run += avail;
+		i = (i + avail) & (size - 1);
+	}
+	return run < max ? run : max;
+}
+
+/**
+ * Type-specialized variants of ChiakiReorderQueue, ChiakiReorderQueue16 with chiaki_reorder_queue16_*()
+ * and ChiakiReorderQueue32 with chiaki_reorder_queue32_*(). They behave exactly like a ChiakiReorderQueue
+ * initialized with chiaki_reorder_queue_init_16() or chiaki_reorder_queue_init_32() respectively, but all
+ * sequence number arithmetic is inlined instead of going through function pointers, for the packet hot path.
+ */
+#define CHIAKI_DEFINE_REORDER_QUEUE(bits) \
+\
+typedef struct chiaki_reorder_queue_##bits##_t \
+{ \
+	size_t size_exp; \
+	ChiakiReorderQueueEntry *queue; \
+	uint64_t *set_bits; \
+	ChiakiSeqNum##bits begin; \
+	uint64_t count; \
+	ChiakiReorderQueueDropStrategy drop_strategy; \
+	ChiakiReorderQueueDropCb drop_cb; \
+	void *drop_cb_user; \
+} ChiakiReorderQueue##bits; \
+\
+static inline ChiakiErrorCode chiaki_reorder_queue##bits##_init(ChiakiReorderQueue##bits *queue, size_t size_exp, ChiakiSeqNum##bits seq_num_start) \
+{ \
+	queue->size_exp = size_exp; \
+	queue->begin = seq_num_start; \
+	queue->count = 0; \
+	queue->drop_strategy = CHIAKI_REORDER_QUEUE_DROP_STRATEGY_END; \
+	queue->drop_cb = NULL; \
+	queue->drop_cb_user = NULL; \
+	queue->queue = (ChiakiReorderQueueEntry *)calloc((size_t)1 << size_exp, sizeof(ChiakiReorderQueueEntry)); \
+	if(!queue->queue) \
+		return CHIAKI_ERR_MEMORY; \
+	queue->set_bits = (uint64_t *)calloc(CHIAKI_REORDER_QUEUE_BITS_WORDS(size_exp), sizeof(uint64_t)); \
+	if(!queue->set_bits) \
+	{ \
+		free(queue->queue); \
+		return CHIAKI_ERR_MEMORY; \
+	} \
+	return CHIAKI_ERR_SUCCESS; \
+} \
+\
+static inline size_t chiaki_reorder_queue##bits##_idx(ChiakiReorderQueue##bits *queue, ChiakiSeqNum##bits seq_num) \
+{ \
+	return (size_t)seq_num & (((size_t)1 << queue->size_exp) - 1); \
+} \
+\
+static inline void chiaki_reorder_queue##bits##_fini(ChiakiReorderQueue##bits *queue) \
+{ \
+	if(queue->drop_cb) \
+	{ \
+		for(uint64_t i=0; i<queue->count; i++) \
+		{ \
+			ChiakiSeqNum##bits seq_num = (ChiakiSeqNum##bits)(queue->begin + i); \
+			size_t idx = chiaki_reorder_queue##bits##_idx(queue, seq_num); \
+			if(chiaki_reorder_queue_bit_get(queue->set_bits, idx)) \
+				queue->drop_cb(seq_num, queue->queue[idx].user, queue->drop_cb_user); \
+		} \
+	} \
+	free(queue->set_bits); \
+	free(queue->queue); \
+} \
+\
+static inline void chiaki_reorder_queue##bits##_set_drop_strategy(ChiakiReorderQueue##bits *queue, ChiakiReorderQueueDropStrategy drop_strategy) \
+{ \
+	queue->drop_strategy = drop_strategy; \
+} \
+\
+static inline void chiaki_reorder_queue##bits##_set_drop_cb(ChiakiReorderQueue##bits *queue, ChiakiReorderQueueDropCb cb, void *user) \
+{ \
+	queue->drop_cb = cb; \
+	queue->drop_cb_user = user; \
+} \
+\
+static inline size_t chiaki_reorder_queue##bits##_size(ChiakiReorderQueue##bits *queue) \
+{ \
+	return ((size_t)1) << queue->size_exp; \
+} \
+\
+static inline uint64_t chiaki_reorder_queue##bits##_count(ChiakiReorderQueue##bits *queue) \
+{ \
+	return queue->count; \
+} \
+\
+static inline void chiaki_reorder_queue##bits##_push(ChiakiReorderQueue##bits *queue, ChiakiSeqNum##bits seq_num, void *user) \
+{ \
+	/* distance from begin, wrapped around, so one subtraction covers all RFC 1982 comparisons */ \
+	ChiakiSeqNum##bits d = (ChiakiSeqNum##bits)(seq_num - queue->begin); \
+	size_t idx = chiaki_reorder_queue##bits##_idx(queue, seq_num); \
+	if(d < queue->count) \
+	{ \
+		if(chiaki_reorder_queue_bit_get(queue->set_bits, idx)) /* received twice */ \
+			goto drop_it; \
+		queue->queue[idx].user = user; \
+		chiaki_reorder_queue_bit_set(queue->set_bits, idx); \
+		return; \
+	} \
+\
+	if(d >= ((ChiakiSeqNum##bits)1 << (bits - 1))) /* before begin */ \
+		goto drop_it; \
+\
+	uint64_t size = chiaki_reorder_queue##bits##_size(queue); \
+	if((uint64_t)d + 1 > size) \
+	{ \
+		if(queue->drop_strategy == CHIAKI_REORDER_QUEUE_DROP_STRATEGY_END) \
+			goto drop_it; \
+\
+		/* drop first until empty or enough space */ \
+		while(queue->count > 0 && (uint64_t)d + 1 > size) \
+		{ \
+			size_t begin_idx = chiaki_reorder_queue##bits##_idx(queue, queue->begin); \
+			if(chiaki_reorder_queue_bit_get(queue->set_bits, begin_idx)) \
+			{ \
+				chiaki_reorder_queue_bit_clear(queue->set_bits, begin_idx); \
+				if(queue->drop_cb) \
+					queue->drop_cb(queue->begin, queue->queue[begin_idx].user, queue->drop_cb_user); \
+			} \
+			queue->begin++; \
+			queue->count--; \
+			d--; \
+		} \
+\
+		/* empty, just shift to the seq_num */ \
+		if(queue->count == 0) \
+		{ \
+			queue->begin = seq_num; \
+			d = 0; \
+		} \
+	} \
+\
+	/* the bits of everything outside of the queue are always clear */ \
+	queue->count = (uint64_t)d + 1; \
+	queue->queue[idx].user = user; \
+	chiaki_reorder_queue_bit_set(queue->set_bits, idx); \
+	return; \
+drop_it: \
+	if(queue->drop_cb) \
+		queue->drop_cb(seq_num, user, queue->drop_cb_user); \
+} \
+\
+static inline bool chiaki_reorder_queue##bits##_pull(ChiakiReorderQueue##bits *queue, ChiakiSeqNum##bits *seq_num, void **user) \
+{ \
+	if(queue->count == 0) \
+		return false; \
+	size_t idx = chiaki_reorder_queue##bits##_idx(queue, queue->begin); \
+	if(!chiaki_reorder_queue_bit_get(queue->set_bits, idx)) \
+		return false; \
+	chiaki_reorder_queue_bit_clear(queue->set_bits, idx); \
+	if(seq_num) \
+		*seq_num = queue->begin; \
+	if(user) \
+		*user = queue->queue[idx].user; \
+	queue->begin++; \
+	queue->count--; \
+	return true; \
+} \
+\
+static inline uint64_t chiaki_reorder_queue##bits##_ready(ChiakiReorderQueue##bits *queue) \
+{ \
+	return chiaki_reorder_queue_bits_run(queue->set_bits, queue->size_exp, \
+			chiaki_reorder_queue##bits##_idx(queue, queue->begin), queue->count); \
+} \
+\
+static inline bool chiaki_reorder_queue##bits##_peek(ChiakiReorderQueue##bits *queue, uint64_t index, ChiakiSeqNum##bits *seq_num, void **user) \
+{ \
+	if(index >= queue->count) \
+		return false; \
+	ChiakiSeqNum##bits seq_num_val = (ChiakiSeqNum##bits)(queue->begin + index); \
+	size_t idx = chiaki_reorder_queue##bits##_idx(queue, seq_num_val); \
+	if(!chiaki_reorder_queue_bit_get(queue->set_bits, idx)) \
+		return false; \
+	if(seq_num) \
+		*seq_num = seq_num_val; \
+	*user = queue->queue[idx].user; \
+	return true; \
+} \
+\
+static inline void chiaki_reorder_queue##bits##_drop(ChiakiReorderQueue##bits *queue, uint64_t index) \
+{ \
+	if(index >= queue->count) \
+		return; \
+	ChiakiSeqNum##bits seq_num = (ChiakiSeqNum##bits)(queue->begin + index); \
+	size_t idx = chiaki_reorder_queue##bits##_idx(queue, seq_num); \
+	if(!chiaki_reorder_queue_bit_get(queue->set_bits, idx)) \
+		return; \
+	chiaki_reorder_queue_bit_clear(queue->set_bits, idx); \
+	if(queue->drop_cb) \
+		queue->drop_cb(seq_num, queue->queue[idx].user, queue->drop_cb_user); \
+\
+	/* reduce count if necessary */ \
+	if(index == queue->count - 1) \
+	{ \
+		while(queue->count > 0 && !chiaki_reorder_queue_bit_get(queue->set_bits, \
+					chiaki_reorder_queue##bits##_idx(queue, (ChiakiSeqNum##bits)(queue->begin + queue->count - 1)))) \
+			queue->count--; \
+	} \
+}
+
+CHIAKI_DEFINE_REORDER_QUEUE(16)
+CHIAKI_DEFINE_REORDER_QUEUE(32)
+#undef CHIAKI_DEFINE_REORDER_QUEUE
+
 #ifdef __cplusplus
 }
 #endif
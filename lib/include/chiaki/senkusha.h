@@ -11,6 +11,11 @@ extern "C" {
 
 typedef struct chiaki_session_t ChiakiSession;
 
+/**
+ * Max number of pings or MTU requests in flight at once in fast probe mode
+ */
+#define CHIAKI_SENKUSHA_FAST_PINGS_MAX 16
+
 typedef struct senkusha_t
 {
 	ChiakiSession *session;
@@ -28,6 +33,17 @@ typedef struct senkusha_t
 	uint32_t ping_tag;
 	uint32_t mtu_id;
 
+	/**
+	 * Pipeline pings and MTU requests, see chiaki_senkusha_run().
+	 * In this mode, ping_index is the number of pings in flight, which are matched by their unit index
+	 * against ping_tags and recorded in pong_times_us, and MTU responses with ids from mtu_id on are
+	 * recorded in mtu_answered.
+	 */
+	bool fast_probe;
+	uint32_t ping_tags[CHIAKI_SENKUSHA_FAST_PINGS_MAX];
+	uint64_t pong_times_us[CHIAKI_SENKUSHA_FAST_PINGS_MAX];
+	uint32_t mtu_answered;
+
 	/**
 	 * signaled on change of state_finished or should_stop
 	 */
@@ -41,7 +57,17 @@ typedef struct senkusha_t
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_init(ChiakiSenkusha *senkusha, ChiakiSession *session);
 CHIAKI_EXPORT void chiaki_senkusha_fini(ChiakiSenkusha *senkusha);
-CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint32_t *mtu_in, uint32_t *mtu_out, uint64_t *rtt_us, chiaki_socket_t *sock);
+
+/**
+ * Measure RTT and MTU in both directions.
+ *
+ * If senkusha->fast_probe is set, pings are sent back to back and RTT measurement stops as soon as
+ * the samples agree, with timeouts derived from the RTT. The MTU searches then test several sizes
+ * per round instead of a single one.
+ *
+ * @param probe_us optional, set to the time spent, including the Takion connect
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint32_t *mtu_in, uint32_t *mtu_out, uint64_t *rtt_us, uint64_t *probe_us, chiaki_socket_t *sock);
 
 #ifdef __cplusplus
 }
@@ -19,6 +19,13 @@
 #endif
 #include "remote/rudp.h"
 #include "regist.h"
+#include "latencystats.h"
+#include "videostats.h"
+#include "audiodecodequeue.h"
+#include "avsync.h"
+#include "timerwheel.h"
+#include "arena.h"
+#include "recorder.h"
 
 #include <stdint.h>
 
@@ -72,6 +79,70 @@ typedef enum {
 
 CHIAKI_EXPORT void chiaki_connect_video_profile_preset(ChiakiConnectVideoProfile *profile, ChiakiVideoResolutionPreset resolution, ChiakiVideoFPSPreset fps);
 
+/**
+ * Lower the bitrate of profile to what a path with the given Senkusha results can be expected to carry,
+ * and the resolution too if the bitrate gets too low for it. Never raises anything.
+ */
+CHIAKI_EXPORT void chiaki_connect_video_profile_fit_path(ChiakiConnectVideoProfile *profile, uint64_t rtt_us, uint32_t mtu_in, uint32_t mtu_out);
+
+typedef enum {
+	CHIAKI_LATENCY_MODE_COMPETITIVE, // shallowest buffers, late data is dropped rather than waited for
+	CHIAKI_LATENCY_MODE_BALANCED,
+	CHIAKI_LATENCY_MODE_UNSTABLE_WIFI // deeper buffers to ride out bursts of loss, jitter and reordering
+} ChiakiLatencyMode;
+
+CHIAKI_EXPORT const char *chiaki_latency_mode_string(ChiakiLatencyMode mode);
+
+/**
+ * Depths of the buffers between the socket and the screen and speakers, so they are all configured consistently.
+ * The library applies the first part, the sinks are expected to apply the rest.
+ */
+typedef struct chiaki_latency_profile_t
+{
+	size_t recv_ring_size_exp; // datagrams between the socket reader and Takion, log2, see ChiakiTakionConnectInfo
+	size_t data_queue_size_exp; // Takion data packets held for reordering, log2
+	size_t key_buf_chunks; // of the ctr mode key stream generated ahead, see chiaki_gkcrypt_init()
+
+	unsigned int audio_device_buffers; // audio output buffers queued behind each other
+	unsigned int audio_device_queue_frames; // refill the audio output once no more than this many frames are left in it
+	unsigned int audio_jitter_percentile; // of the arrival lateness the audio jitter buffer covers
+	unsigned int video_present_queue; // decoded frames that may wait to be presented, 0 for as many as the sink has room for
+} ChiakiLatencyProfile;
+
+CHIAKI_EXPORT void chiaki_latency_profile_preset(ChiakiLatencyProfile *profile, ChiakiLatencyMode mode);
+
+/**
+ * What Senkusha measured, which a later session with the same console over the same network can reuse
+ */
+typedef struct chiaki_connect_path_t
+{
+	uint32_t mtu_in;
+	uint32_t mtu_out;
+	uint64_t rtt_us;
+} ChiakiConnectPath;
+
+/**
+ * Bounds of the receive buffer sized from ChiakiConnectInfo.recv_buffer_burst_ms
+ */
+#define CHIAKI_SESSION_RECV_BUFFER_MIN 0x19000
+#define CHIAKI_SESSION_RECV_BUFFER_MAX 0x100000
+
+/**
+ * With ChiakiConnectInfo.resume, the link counts as lost after nothing arrived for this long while streaming
+ */
+#define CHIAKI_SESSION_LINK_TIMEOUT_MS 2000
+
+/**
+ * With ChiakiConnectInfo.resume, give up re-establishing the connection after this long and quit
+ */
+#define CHIAKI_SESSION_RESUME_TIMEOUT_MS 20000
+
+/**
+ * Wait between attempts to re-establish the connection, doubled up to CHIAKI_SESSION_RESUME_RETRY_MAX_MS
+ */
+#define CHIAKI_SESSION_RESUME_RETRY_MS 250
+#define CHIAKI_SESSION_RESUME_RETRY_MAX_MS 2000
+
 #define CHIAKI_SESSION_AUTH_SIZE 0x10
 
 typedef struct chiaki_connect_info_t
@@ -82,13 +153,40 @@ typedef struct chiaki_connect_info_t
 	uint8_t morning[0x10];
 	ChiakiConnectVideoProfile video_profile;
 	bool video_profile_auto_downgrade; // Downgrade video_profile if server does not seem to support it.
+	bool video_profile_fit_path; // Treat video_profile as the upper bound and fit it to the path measured by Senkusha, see chiaki_connect_video_profile_fit_path().
+	bool senkusha_fast_probe; // Pipeline the Senkusha pings and MTU probes and stop once the estimates are stable, see chiaki_senkusha_run().
+	const ChiakiConnectPath *path_known; // If set, skip Senkusha and use this instead, e.g. from a recent session on the same network.
+	const ChiakiECDHKey *ecdh_key; // If set, use this key pair from chiaki_ecdh_generate_key() instead of generating one while connecting. Must not be reused.
 	bool enable_keyboard;
 	bool enable_dualsense;
+	bool video_decode_queue; // Pass video frames to the sink from a dedicated thread, see ChiakiVideoDecodeQueue.
+	bool audio_decode_queue; // Pass audio frames to the sink from a dedicated thread, see ChiakiAudioDecodeQueue.
+	const ChiakiLatencyProfile *latency_profile; // Buffer depths, see chiaki_latency_profile_preset(). NULL for CHIAKI_LATENCY_MODE_BALANCED.
+	unsigned int av_sync_max_offset_ms; // Keep audio and video latency within this of each other, 0 to disable, see ChiakiAVSync.
+	bool feedback_immediate; // Send controller changes from the thread setting them if the Feedback Sender is idle, see ChiakiFeedbackSender.
+	unsigned int feedback_state_rate_max; // Send changes of only sticks and motion at most this many times per second, see ChiakiFeedbackSender. 0 for no limit.
+	bool congestion_control_delay_based; // Report loss to the console as soon as queueing delay builds up, see ChiakiDelayEstimator.
+	bool load_monitor; // Lower the bitrate while decoding or presenting can not keep up with the stream, see ChiakiLoadMonitor.
+	bool mac_offload; // Check the MACs of batches of AV packets partly on a second thread, see ChiakiTakionConnectInfo.
+	unsigned int ack_delay_ms; // Ack received data up to this much later, so one ack covers all data arriving meanwhile, see ChiakiTakionConnectInfo. 0 to ack right away.
+	unsigned int upstream_packets_budget; // Datagrams per second the stream may send before acks are delayed even longer, see ChiakiTakionConnectInfo. 0 for no budget.
+	unsigned int recv_buffer_burst_ms; // Size the stream socket's receive buffer to hold this much video at the profile's bitrate, 0 for the Takion receive window.
+	uint8_t dscp; // DiffServ code point to mark the stream, Senkusha and ctrl packets with, e.g. CHIAKI_DSCP_AF41, 0 to not mark them.
+	unsigned int video_ref_frames; // Number of reference frames the decoder keeps, 0 for CHIAKI_VIDEO_REF_FRAMES_MAX.
+	unsigned int video_idr_request_frames; // Request an IDR frame after this many frames in a row could not be decoded, 0 for CHIAKI_CORRUPT_FRAME_IDR_FRAMES_DEFAULT.
+	unsigned int video_backlog_threshold_ms; // Skip stale frames arriving this late in a burst until a requested IDR frame, see ChiakiBacklogDetector. 0 to never skip.
+	bool video_frame_deadline; // Flush frames whose last units do not arrive in time instead of waiting for the next frame, see ChiakiVideoFrameSlot.
+	unsigned int fec_workers; // Threads to split recovering large frames across, see ChiakiFecWorkers. 0 to recover on the receiving thread only.
+	bool resume; // If the link is lost while streaming, re-establish ctrl and stream connection with the parameters of this session instead of quitting, see CHIAKI_EVENT_RECONNECTING. Local connections only.
 #if !(defined(__SWITCH__) || defined(__PSVITA__))
 	ChiakiHolepunchSession holepunch_session;
 #endif
 	chiaki_socket_t *rudp_sock;
 	uint8_t psn_account_id[CHIAKI_PSN_ACCOUNT_ID_SIZE];
+	ChiakiCapture *capture; // If set, record the datagrams and keys of the StreamConnection, must stay valid until the session has quit.
+	ChiakiRecorder *recorder; // If set, record the video and audio frames as they are passed to the sinks, must stay valid until the session has quit.
+	ChiakiCaptureReader *replay; // If set, replay this capture instead of connecting to host, see ChiakiCaptureReader. The video profile should match the recorded one.
+	const ChiakiImpairConfig *impair; // If set, simulate these network conditions on the StreamConnection's datagrams for benchmarking, see ChiakiImpair.
 } ChiakiConnectInfo;
 
 
@@ -107,6 +205,7 @@ typedef enum {
 	CHIAKI_QUIT_REASON_STREAM_CONNECTION_REMOTE_DISCONNECTED,
 	CHIAKI_QUIT_REASON_STREAM_CONNECTION_REMOTE_SHUTDOWN, // like REMOTE_DISCONNECTED, but because the server shut down
 	CHIAKI_QUIT_REASON_PSN_REGIST_FAILED,
+	CHIAKI_QUIT_REASON_STREAM_CONNECTION_LINK_LOST, // the link was lost and could not be re-established, see ChiakiConnectInfo.resume
 } ChiakiQuitReason;
 
 CHIAKI_EXPORT const char *chiaki_quit_reason_string(ChiakiQuitReason reason);
@@ -158,6 +257,7 @@ typedef enum {
 	CHIAKI_EVENT_RUMBLE,
 	CHIAKI_EVENT_QUIT,
 	CHIAKI_EVENT_TRIGGER_EFFECTS,
+	CHIAKI_EVENT_RECONNECTING, // the link was lost, the session is being re-established and CHIAKI_EVENT_CONNECTED follows with connected.resumed
 } ChiakiEventType;
 
 typedef struct chiaki_event_t
@@ -170,6 +270,14 @@ typedef struct chiaki_event_t
 		ChiakiRumbleEvent rumble;
 		ChiakiTriggerEffectsEvent trigger_effects;
 		struct
+		{
+			bool resumed; // true if this follows CHIAKI_EVENT_RECONNECTING, decoders and sinks keep running
+		} connected;
+		struct
+		{
+			unsigned int attempt; // starting at 1
+		} reconnecting;
+		struct
 		{
 			bool pin_incorrect; // false on first request, true if the pin entered before was incorrect
 		} login_pin_request;
@@ -189,6 +297,18 @@ typedef void (*ChiakiEventCallback)(ChiakiEvent *event, void *user);
  */
 typedef bool (*ChiakiVideoSampleCallback)(uint8_t *buf, size_t buf_size, int32_t frames_lost, bool frame_recovered, void *user);
 
+/**
+ * Alternative to ChiakiVideoSampleCallback for decoders that accept partial access units.
+ * Called with one or more complete slices (NAL units including their start codes) of the current frame
+ * as soon as they have been received, the next call continues the same frame until frame_end is true.
+ *
+ * @param frame_end whether this is the last part of the frame, buffers of the previous parts stay valid until then
+ * @param frame_aborted only with frame_end: the frame could not be completed and all its parts must be discarded, buf_size is 0
+ * @param frames_lost same for all parts of a frame
+ * @return whether the slices were successfully pushed into the decoder. On false, the rest of the frame is aborted.
+ */
+typedef bool (*ChiakiVideoSliceCallback)(uint8_t *buf, size_t buf_size, bool frame_end, bool frame_aborted, int32_t frames_lost, bool frame_recovered, void *user);
+
 
 
 typedef struct chiaki_session_t
@@ -204,9 +324,39 @@ typedef struct chiaki_session_t
 		uint8_t did[CHIAKI_RP_DID_SIZE];
 		ChiakiConnectVideoProfile video_profile;
 		bool video_profile_auto_downgrade;
+		bool video_profile_fit_path;
+		bool senkusha_fast_probe;
+		bool path_known;
+		ChiakiConnectPath path;
+		bool ecdh_key_known;
+		ChiakiECDHKey ecdh_key;
 		bool enable_keyboard;
 		bool enable_dualsense;
+		bool video_decode_queue;
+		bool audio_decode_queue;
+		ChiakiLatencyProfile latency_profile;
+		unsigned int av_sync_max_offset_ms;
+		bool feedback_immediate;
+		unsigned int feedback_state_rate_max;
+		bool congestion_control_delay_based;
+		bool load_monitor;
+		bool mac_offload;
+		unsigned int ack_delay_ms;
+		unsigned int upstream_packets_budget;
+		unsigned int recv_buffer_burst_ms;
+		uint8_t dscp;
+		unsigned int video_ref_frames;
+		unsigned int video_idr_request_frames;
+		unsigned int video_backlog_threshold_ms;
+		bool video_frame_deadline;
+		unsigned int fec_workers;
+		bool resume;
 		uint8_t psn_account_id[CHIAKI_PSN_ACCOUNT_ID_SIZE];
+		ChiakiCapture *capture;
+		ChiakiRecorder *recorder;
+		ChiakiCaptureReader *replay;
+		ChiakiImpairConfig impair_config;
+		const ChiakiImpairConfig *impair; // NULL or &impair_config
 	} connect_info;
 
 	ChiakiTarget target;
@@ -218,6 +368,8 @@ typedef struct chiaki_session_t
 	uint32_t mtu_in;
 	uint32_t mtu_out;
 	uint64_t rtt_us;
+	uint64_t senkusha_us; // time spent measuring the path with Senkusha
+	bool path_probed; // mtu_in, mtu_out and rtt_us were measured by Senkusha in this session, not fallbacks or known values
 	ChiakiECDH ecdh;
 
 	ChiakiQuitReason quit_reason;
@@ -227,6 +379,10 @@ typedef struct chiaki_session_t
 	void *event_cb_user;
 	ChiakiVideoSampleCallback video_sample_cb;
 	void *video_sample_cb_user;
+	ChiakiVideoSliceCallback video_slice_cb;
+	void *video_slice_cb_user;
+	ChiakiVideoAUBufferCallback video_au_buffer_cb;
+	void *video_au_buffer_cb_user;
 	ChiakiAudioSink audio_sink;
 	ChiakiAudioSink haptics_sink;
 	ChiakiCtrlDisplaySink display_sink;
@@ -256,6 +412,13 @@ typedef struct chiaki_session_t
 	ChiakiLog *log;
 
 	ChiakiStreamConnection stream_connection;
+	ChiakiLatencyStats latency_stats;
+	ChiakiVideoStats video_stats;
+	ChiakiAudioDecodeQueue audio_decode_queue;
+	ChiakiAVSync av_sync;
+	size_t audio_reorder_deadline_us; // atomic, see chiaki_session_audio_reorder_deadline()
+	ChiakiTimerWheel timer_wheel; // runs the periodic work of ctrl, takion and the stream connection
+	ChiakiArena arena; // small buffers of ctrl, takion, rudp and video, released at once in chiaki_session_fini()
 
 	ChiakiControllerState controller_state;
 } ChiakiSession;
@@ -266,6 +429,13 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_start(ChiakiSession *session);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_stop(ChiakiSession *session);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_join(ChiakiSession *session);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_set_controller_state(ChiakiSession *session, ChiakiControllerState *state);
+
+/**
+ * Like chiaki_session_set_controller_state(), but the input latency is measured from sample_us instead of from the call.
+ *
+ * @param sample_us when state was sampled, from chiaki_time_now_monotonic_us(), or 0 if unknown
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_session_set_controller_state_sampled(ChiakiSession *session, ChiakiControllerState *state, uint64_t sample_us);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_set_login_pin(ChiakiSession *session, const uint8_t *pin, size_t pin_size);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_set_stream_connection_switch_received(ChiakiSession *session);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_goto_bed(ChiakiSession *session);
@@ -276,6 +446,105 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_keyboard_reject(ChiakiSession *sess
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_keyboard_accept(ChiakiSession *session);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_go_home(ChiakiSession *session);
 
+/**
+ * Get min/avg/p95/p99/max of the time video frames spent in each stage of the pipeline since the session started.
+ * Can be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_session_get_latency_stats(ChiakiSession *session, ChiakiLatencyReport *report);
+
+/**
+ * Get the distributions behind chiaki_session_get_latency_stats().
+ * Can be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_session_get_latency_histograms(ChiakiSession *session, ChiakiLatencyCoarseHistograms *histograms);
+
+/**
+ * To be called by the video sink when the frame it most recently got has been decoded or displayed,
+ * to complete the latency stats.
+ *
+ * The total latency of a displayed frame also goes to the A/V sync.
+ *
+ * @param stamp CHIAKI_LATENCY_STAMP_DECODED or CHIAKI_LATENCY_STAMP_DISPLAYED
+ */
+CHIAKI_EXPORT void chiaki_session_latency_stamp(ChiakiSession *session, ChiakiLatencyStamp stamp);
+
+/**
+ * To be called by the audio sink regularly with the time from a frame arriving to it being played,
+ * including any delay it added for the A/V sync.
+ * Can be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_session_av_sync_audio_latency(ChiakiSession *session, uint64_t latency_us);
+
+/**
+ * To be called by the audio sink when its jitter buffer target changes, with how late a frame may arrive
+ * and still be played in time. Frames after a gap are held back for at most this long so a missing frame
+ * that arrives late is not discarded, 0 passes frames on right away.
+ * Can be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_session_audio_reorder_deadline(ChiakiSession *session, uint64_t deadline_us);
+
+/**
+ * Get the current latencies and the delays the sinks should add to keep audio and video in sync.
+ * Can be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_session_get_av_sync(ChiakiSession *session, ChiakiAVSyncState *state);
+
+/**
+ * Get the video receiver counters since the session started.
+ * Can be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_session_get_video_stats(ChiakiSession *session, ChiakiVideoStatsCounters *counters);
+
+/**
+ * Get the bitrates, frame size distribution by slice type and burst sizes of the video stream, as of now.
+ * Can be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_session_get_stream_stats(ChiakiSession *session, ChiakiStreamStatsSnapshot *snapshot);
+
+/**
+ * Get the packets received and lost since congestion control last reported them to the server,
+ * which happens every few hundred ms. Does not reset the counts.
+ * Can be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_session_get_packet_stats(ChiakiSession *session, uint64_t *received, uint64_t *lost);
+
+/**
+ * Get totals, rolling windows and histograms of the stream packets, see ChiakiPacketStats.
+ * Can be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_session_get_packet_stats_snapshot(ChiakiSession *session, ChiakiPacketStatsSnapshot *snapshot);
+
+/**
+ * Get how well the client kept up with the stream recently and how far the bitrate is lowered because of it.
+ * Only meaningful with ChiakiConnectInfo.load_monitor.
+ * Can be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_session_get_load_stats(ChiakiSession *session, ChiakiLoadMonitorStats *stats);
+
+/**
+ * Get the jitter and relative one-way delay of the audio and video streams, see ChiakiJitterEstimator.
+ * Can be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_session_get_jitter_stats(ChiakiSession *session, ChiakiJitterStats *stats);
+
+/**
+ * Get the state of the delay based congestion control, all 0 if it is not used.
+ * Can be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_session_get_congestion_stats(ChiakiSession *session, ChiakiCongestionControlStats *stats);
+
+/**
+ * Get the stats of the audio decode queue since the session started, all 0 if it is not used.
+ * Can be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_session_get_audio_decode_stats(ChiakiSession *session, ChiakiAudioDecodeQueueStats *stats);
+
+/**
+ * Memory of the session's arena per subsystem.
+ * Can be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_session_get_arena_usage(ChiakiSession *session, ChiakiArenaUsage *usage);
+
 static inline void chiaki_session_set_event_cb(ChiakiSession *session, ChiakiEventCallback cb, void *user)
 {
 	session->event_cb = cb;
@@ -288,6 +557,27 @@ static inline void chiaki_session_set_video_sample_cb(ChiakiSession *session, Ch
 	session->video_sample_cb_user = user;
 }
 
+/**
+ * Optional, must be set before the session is started.
+ * If set, video is passed to this slice by slice instead of to the video sample callback.
+ * Not used with connect_info.video_decode_queue.
+ */
+static inline void chiaki_session_set_video_slice_cb(ChiakiSession *session, ChiakiVideoSliceCallback cb, void *user)
+{
+	session->video_slice_cb = cb;
+	session->video_slice_cb_user = user;
+}
+
+/**
+ * Optional, must be set before the session is started.
+ * Not used with connect_info.video_decode_queue, where frames are assembled in buffers of the queue.
+ */
+static inline void chiaki_session_set_video_au_buffer_cb(ChiakiSession *session, ChiakiVideoAUBufferCallback cb, void *user)
+{
+	session->video_au_buffer_cb = cb;
+	session->video_au_buffer_cb_user = user;
+}
+
 /**
  * @param sink contents are copied
  */
@@ -297,11 +587,23 @@ static inline void chiaki_session_set_audio_sink(ChiakiSession *session, ChiakiA
 }
 
 /**
- * @param sink contents are copied
+ * @return mask of ChiakiTakionAVSubstream the session needs, haptics only when there is a sink consuming them
+ */
+static inline uint32_t chiaki_session_av_substreams(ChiakiSession *session)
+{
+	uint32_t substreams = CHIAKI_TAKION_AV_SUBSTREAM_VIDEO | CHIAKI_TAKION_AV_SUBSTREAM_AUDIO;
+	if(session->haptics_sink.frame_cb)
+		substreams |= CHIAKI_TAKION_AV_SUBSTREAM_HAPTICS;
+	return substreams;
+}
+
+/**
+ * @param sink contents are copied. Setting one without frame_cb makes the stream drop haptics packets right on arrival.
  */
 static inline void chiaki_session_set_haptics_sink(ChiakiSession *session, ChiakiAudioSink *sink)
 {
 	session->haptics_sink = *sink;
+	chiaki_takion_set_av_substreams(&session->stream_connection.takion, chiaki_session_av_substreams(session));
 }
 
 /**
@@ -4,8 +4,11 @@
 #define CHIAKI_SOCK_H
 
 #include "common.h"
+#include "log.h"
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -46,6 +49,40 @@ typedef int chiaki_socket_t;
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_socket_set_nonblock(chiaki_socket_t sock, bool nonblock);
 
+/**
+ * DiffServ code points, EF for traffic that must not queue at all, AF41 for interactive video
+ */
+#define CHIAKI_DSCP_EF 46
+#define CHIAKI_DSCP_AF41 34
+
+typedef struct chiaki_socket_options_t
+{
+	size_t rcvbuf; // SO_RCVBUF in bytes, 0 to keep the system default
+	size_t sndbuf; // SO_SNDBUF in bytes, 0 to keep the system default
+	uint8_t dscp; // DiffServ code point to mark sent packets with, 0 to not mark them
+} ChiakiSocketOptions;
+
+/**
+ * Apply options to sock and log what the system actually granted, as name.
+ * Systems may silently cap the buffer sizes (Linux at net.core.rmem_max) or ignore the marking (Windows without qWAVE).
+ *
+ * @return CHIAKI_ERR_NETWORK if a buffer size was rejected, failing to mark only logs a warning
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_socket_set_options(chiaki_socket_t sock, const ChiakiSocketOptions *options, const char *name, ChiakiLog *log);
+
+typedef struct chiaki_socket_recv_stats_t
+{
+	uint64_t drops; // datagrams the system discarded because the receive buffer was full
+	size_t queued; // bytes waiting in the receive buffer
+} ChiakiSocketRecvStats;
+
+/**
+ * Query the system's counters of a UDP socket.
+ *
+ * @return CHIAKI_ERR_UNKNOWN if the platform does not expose them, which is everywhere but Linux
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_socket_get_recv_stats(chiaki_socket_t sock, ChiakiSocketRecvStats *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,68 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_SPSCRING_H
+#define CHIAKI_SPSCRING_H
+
+#include "common.h"
+#include "atomic.h"
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Lock-free ring of fixed-size elements for exactly one producer and one consumer thread.
+ */
+typedef struct chiaki_spsc_ring_t
+{
+	uint8_t *elems;
+	size_t elem_size;
+	size_t size_exp; // real size = 2^size_exp elements
+
+	size_t head; // next element to pop, only written by the consumer
+	size_t tail; // next element to push, only written by the producer
+
+	size_t high_water; // max number of elements queued at once, only written by the producer
+} ChiakiSPSCRing;
+
+/**
+ * @param size_exp exponent for 2 of the number of elements
+ * @param elem_size size of a single element in bytes
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_spsc_ring_init(ChiakiSPSCRing *ring, size_t size_exp, size_t elem_size);
+CHIAKI_EXPORT void chiaki_spsc_ring_fini(ChiakiSPSCRing *ring);
+
+static inline size_t chiaki_spsc_ring_size(ChiakiSPSCRing *ring)
+{
+	return ((size_t)1) << ring->size_exp;
+}
+
+/**
+ * Current number of queued elements. Exact only when called from the producer or consumer thread.
+ */
+static inline size_t chiaki_spsc_ring_count(ChiakiSPSCRing *ring)
+{
+	return chiaki_atomic_load_acquire(&ring->tail) - chiaki_atomic_load_acquire(&ring->head);
+}
+
+/**
+ * Copy elem into the ring. Must only be called from the producer thread.
+ *
+ * @return false if the ring is full
+ */
+CHIAKI_EXPORT bool chiaki_spsc_ring_push(ChiakiSPSCRing *ring, const void *elem);
+
+/**
+ * Copy the oldest element out of the ring into elem. Must only be called from the consumer thread.
+ *
+ * @return false if the ring is empty
+ */
+CHIAKI_EXPORT bool chiaki_spsc_ring_pop(ChiakiSPSCRing *ring, void *elem);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_SPSCRING_H
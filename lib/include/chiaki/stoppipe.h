@@ -15,6 +15,12 @@
 #include <arpa/inet.h>
 #endif
 
+#if defined(__PSVITA__)
+#include <sys/select.h>
+#elif !defined(_WIN32) && !defined(__linux__)
+#include <poll.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -50,9 +56,76 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_select_single(ChiakiStopPipe *sto
  * Like connect(), but can be canceled by the stop pipe. Only makes sense with a non-blocking socket.
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_connect(ChiakiStopPipe *stop_pipe, chiaki_socket_t fd, struct sockaddr *addr, size_t addrlen);
+
+#define CHIAKI_STOP_PIPE_CONNECT_ANY_MAX 16
+
+/**
+ * Head start of a pending connect before the next address is tried in parallel, as in Happy Eyeballs (RFC 8305)
+ */
+#define CHIAKI_STOP_PIPE_CONNECT_STAGGER_MS 250
+
+/**
+ * Open a TCP connection to whichever of addrs answers first, so an unreachable address does not cost a whole
+ * connect timeout. The addresses are tried in order, the next one after CHIAKI_STOP_PIPE_CONNECT_STAGGER_MS
+ * or as soon as all pending ones failed, and the other attempts are closed once one succeeded.
+ * At most CHIAKI_STOP_PIPE_WAITER_SOCKS_MAX connects are pending at once, and only the first
+ * CHIAKI_STOP_PIPE_CONNECT_ANY_MAX addresses are tried.
+ *
+ * @param sock_out set to the connected socket, which is non-blocking
+ * @param index_out set to the index of the address it is connected to
+ * @return CHIAKI_ERR_CANCELED if the stop pipe was triggered, otherwise the error of the last address that failed
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_connect_any(ChiakiStopPipe *stop_pipe, struct sockaddr **addrs, const size_t *addrlens,
+		size_t count, chiaki_socket_t *sock_out, size_t *index_out);
 static inline ChiakiErrorCode chiaki_stop_pipe_sleep(ChiakiStopPipe *stop_pipe, uint64_t timeout_ms) { return chiaki_stop_pipe_select_single(stop_pipe, CHIAKI_INVALID_SOCKET, false, timeout_ms); }
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_reset(ChiakiStopPipe *stop_pipe);
 
+#define CHIAKI_STOP_PIPE_WAITER_SOCKS_MAX 4
+
+/**
+ * Waits for any of a set of sockets or a stop pipe, like chiaki_stop_pipe_select_single(), but everything is
+ * registered once instead of for every wait: an epoll instance on Linux, a pollfd array on other POSIX systems,
+ * persistent WSAEVENTs on Windows and a prepared fd_set on the Vita, whose newlib does not expose its net ids to sceNetEpoll.
+ *
+ * On Windows, a socket can only be associated with one waiter at a time and is made non-blocking.
+ */
+typedef struct chiaki_stop_pipe_waiter_t
+{
+	ChiakiStopPipe *stop_pipe;
+	chiaki_socket_t socks[CHIAKI_STOP_PIPE_WAITER_SOCKS_MAX];
+	bool socks_write[CHIAKI_STOP_PIPE_WAITER_SOCKS_MAX];
+	size_t socks_count;
+#if defined(_WIN32)
+	WSAEVENT events[CHIAKI_STOP_PIPE_WAITER_SOCKS_MAX + 1]; // [0] is the stop pipe's event
+#elif defined(__PSVITA__)
+	fd_set rfds;
+	fd_set wfds;
+	int nfds;
+#elif defined(__linux__)
+	int epoll_fd;
+#else
+	struct pollfd pfds[CHIAKI_STOP_PIPE_WAITER_SOCKS_MAX + 1]; // [0] is the stop pipe's fd
+#endif
+} ChiakiStopPipeWaiter;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_waiter_init(ChiakiStopPipeWaiter *waiter, ChiakiStopPipe *stop_pipe);
+CHIAKI_EXPORT void chiaki_stop_pipe_waiter_fini(ChiakiStopPipeWaiter *waiter);
+
+/**
+ * Register a socket to wait for being readable, or writable if write is set.
+ * Sockets must stay open until the waiter is finished or they have been closed by their owner.
+ *
+ * @return CHIAKI_ERR_OVERFLOW if CHIAKI_STOP_PIPE_WAITER_SOCKS_MAX sockets have already been added
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_waiter_add(ChiakiStopPipeWaiter *waiter, chiaki_socket_t sock, bool write);
+
+/**
+ * @param timeout_ms UINT64_MAX to wait without timeout
+ * @param ready_mask if not NULL, set to a mask with bit i set if the i-th added socket is ready
+ * @return CHIAKI_ERR_SUCCESS if any socket is ready, CHIAKI_ERR_CANCELED if the stop pipe was triggered or CHIAKI_ERR_TIMEOUT
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_waiter_wait(ChiakiStopPipeWaiter *waiter, uint64_t timeout_ms, uint32_t *ready_mask);
+
 #ifdef __cplusplus
 }
 #endif
@@ -11,6 +11,7 @@
 #include "audioreceiver.h"
 #include "videoreceiver.h"
 #include "congestioncontrol.h"
+#include "jitterestimator.h"
 
 #include <stdbool.h>
 
@@ -30,12 +31,16 @@ typedef struct chiaki_stream_connection_t
 	ChiakiGKCrypt *gkcrypt_remote;
 
 	ChiakiPacketStats packet_stats;
+	ChiakiDelayEstimator delay_estimator;
+	ChiakiLoadMonitor load_monitor;
+	ChiakiJitterEstimator jitter_estimator;
 	ChiakiAudioReceiver *audio_receiver;
 	ChiakiVideoReceiver *video_receiver;
 	ChiakiAudioReceiver *haptics_receiver;
 
 	ChiakiFeedbackSender feedback_sender;
 	ChiakiCongestionControl congestion_control;
+	ChiakiTimerTask heartbeat_task; // on the session's timer wheel while connected
 	/**
 	 * whether feedback_sender is initialized
 	 * only if this is true, feedback_sender may be accessed!
@@ -62,6 +67,9 @@ typedef struct chiaki_stream_connection_t
 	bool should_stop;
 	bool remote_disconnected;
 	char *remote_disconnect_reason;
+	bool link_lost; // nothing arrived for CHIAKI_SESSION_LINK_TIMEOUT_MS while streaming, only checked with connect_info.resume
+	bool connected; // the last run got as far as CHIAKI_EVENT_CONNECTED
+	size_t last_recv_ms; // monotonic, of the last packet from the console, atomic
 	// FIXME ywnico a workaround to deal with bang being called twice
 	// I'm not sure what the real problem is...something with the threading implementation on vita...?
 	#if defined(__PSVITA__)
@@ -69,15 +77,31 @@ typedef struct chiaki_stream_connection_t
 	#endif
 
 	double measured_bitrate;
+	uint64_t resend_timeout_us; // current retransmission timeout of reliable takion data, updated with measured_bitrate
+
+	/**
+	 * TakionMessages that are sent over and over, encoded once in chiaki_stream_connection_init().
+	 * The corrupt frame message is everything up to the length of corrupt_payload, its fields are appended for every send.
+	 */
+	uint8_t heartbeat_msg[8];
+	size_t heartbeat_msg_size;
+	uint8_t idr_request_msg[8];
+	size_t idr_request_msg_size;
+	uint8_t corrupt_frame_msg_prefix[8];
+	size_t corrupt_frame_msg_prefix_size;
 } ChiakiStreamConnection;
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_init(ChiakiStreamConnection *stream_connection, ChiakiSession *session);
 CHIAKI_EXPORT void chiaki_stream_connection_fini(ChiakiStreamConnection *stream_connection);
 
 /**
- * Run stream_connection synchronously
+ * Run stream_connection synchronously.
+ * May be run again after it returned, e.g. to resume after the link was lost.
+ *
+ * @param resumed passed on in the CHIAKI_EVENT_CONNECTED event
+ * @return CHIAKI_ERR_TIMEOUT if a lost link ended it, see link_lost
  */
-CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnection *stream_connection, chiaki_socket_t *socket);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnection *stream_connection, chiaki_socket_t *socket, bool resumed);
 
 CHIAKI_EXPORT ChiakiErrorCode stream_connection_send_toggle_mute_direct_message(ChiakiStreamConnection *stream_connection, bool muted);
 /**
@@ -87,6 +111,11 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_stop(ChiakiStreamConnecti
 
 CHIAKI_EXPORT ChiakiErrorCode stream_connection_send_corrupt_frame(ChiakiStreamConnection *stream_connection, ChiakiSeqNum16 start, ChiakiSeqNum16 end);
 
+/**
+ * Ask the server to encode the next frame as an IDR frame, for when the stream can not be recovered from references anymore.
+ */
+CHIAKI_EXPORT ChiakiErrorCode stream_connection_send_idr_request(ChiakiStreamConnection *stream_connection);
+
 #ifdef __cplusplus
 }
 #endif
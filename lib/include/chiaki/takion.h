@@ -12,6 +12,13 @@
 #include "reorderqueue.h"
 #include "feedback.h"
 #include "takionsendbuffer.h"
+#include "packetpool.h"
+#include "spscring.h"
+#include "arena.h"
+#include "capture.h"
+#include "impair.h"
+#include "atomic.h"
+#include "sock.h"
 
 #include <stdbool.h>
 
@@ -47,6 +54,7 @@ typedef struct chiaki_takion_av_packet_t
 	uint8_t byte_at_0x2c;
 
 	uint64_t key_pos;
+	uint64_t recv_us; // monotonic time the packet was handed on from Takion
 
 	uint8_t *data; // not owned
 	size_t data_size;
@@ -56,6 +64,16 @@ static inline uint8_t chiaki_takion_av_packet_audio_unit_size(ChiakiTakionAVPack
 static inline uint8_t chiaki_takion_av_packet_audio_source_units_count(ChiakiTakionAVPacket *packet)	{ return packet->units_in_frame_fec & 0xf; }
 static inline uint8_t chiaki_takion_av_packet_audio_fec_units_count(ChiakiTakionAVPacket *packet)		{ return (packet->units_in_frame_fec >> 4) & 0xf; }
 
+/**
+ * AV substreams that can be subscribed to, packets of all others are dropped before their MAC is even checked.
+ */
+typedef enum chiaki_takion_av_substream_t {
+	CHIAKI_TAKION_AV_SUBSTREAM_VIDEO = (1 << 0),
+	CHIAKI_TAKION_AV_SUBSTREAM_AUDIO = (1 << 1),
+	CHIAKI_TAKION_AV_SUBSTREAM_HAPTICS = (1 << 2), // only in v12 audio packets
+	CHIAKI_TAKION_AV_SUBSTREAM_ALL = CHIAKI_TAKION_AV_SUBSTREAM_VIDEO | CHIAKI_TAKION_AV_SUBSTREAM_AUDIO | CHIAKI_TAKION_AV_SUBSTREAM_HAPTICS
+} ChiakiTakionAVSubstream;
+
 typedef ChiakiErrorCode (*ChiakiTakionAVPacketParse)(ChiakiTakionAVPacket *packet, ChiakiKeyState *key_state, uint8_t *buf, size_t buf_size);
 
 typedef struct chiaki_takion_congestion_packet_t
@@ -109,8 +127,119 @@ typedef struct chiaki_takion_connect_info_t
 	bool enable_dualsense;
 	uint8_t protocol_version;
 	bool close_socket; // close socket when finishing takion
+	bool recv_batch; // after each wakeup, drain all queued datagrams before waiting again
+
+	/**
+	 * If > 0, the socket is read on a separate thread that only pushes datagrams into a ring of 2^recv_ring_size_exp entries,
+	 * which is consumed by the Takion thread doing all processing.
+	 * If 0, the Takion thread reads the socket itself.
+	 */
+	size_t recv_ring_size_exp;
+
+	/**
+	 * Data packets are held for reordering in a queue of 2^data_queue_size_exp entries, 0 for the default.
+	 */
+	size_t data_queue_size_exp;
+
+	/**
+	 * If > 0, a previously measured round-trip time (e.g. from Senkusha) used to seed
+	 * the retransmission timeout of reliable data before the first ack has been timed.
+	 */
+	uint64_t initial_rtt_us;
+
+	/**
+	 * Runs the re-sending of reliable data, may be NULL to never re-send.
+	 */
+	ChiakiTimerWheel *timer_wheel;
+
+	/**
+	 * Allocates received data entries and sent data packets kept for re-sending, may be NULL.
+	 */
+	ChiakiArena *arena;
+
+	/**
+	 * If set, every datagram received after the handshake is recorded here.
+	 */
+	ChiakiCapture *capture;
+
+	/**
+	 * If set, no socket is used at all: the handshake is skipped, datagrams are read from this capture
+	 * and everything sent is discarded. sa and recv_ring_size_exp are ignored.
+	 */
+	ChiakiCaptureReader *replay;
+
+	/**
+	 * If set, datagrams received after the handshake go through a ChiakiImpair with this config
+	 * before being handled, and sent ones too if its send is set. Captures still record them unimpaired.
+	 */
+	const ChiakiImpairConfig *impair;
+
+	/**
+	 * Mask of ChiakiTakionAVSubstream to pass on to the callback.
+	 */
+	uint32_t av_substreams;
+
+	/**
+	 * If set, the MACs of AV packets arriving in batches are checked half on a separate thread, half on the Takion thread.
+	 * Only used with enable_crypt.
+	 */
+	bool mac_offload;
+
+	/**
+	 * If > 0 and timer_wheel is set, the ack of received data is sent up to this long later, so all data arriving
+	 * in the meantime is acked by the same packet. 0 acks every flush of the data queue right away.
+	 */
+	uint64_t ack_delay_us;
+
+	/**
+	 * If > 0, datagrams to send per second before delayed acks are held CHIAKI_TAKION_ACK_DELAY_OVER_BUDGET_FACTOR
+	 * times as long. Only used with ack_delay_us.
+	 */
+	unsigned int upstream_packets_budget;
+
+	/**
+	 * Applied to the socket before connecting, a zero rcvbuf means the advertised receive window.
+	 */
+	ChiakiSocketOptions sock_options;
 } ChiakiTakionConnectInfo;
 
+#define CHIAKI_TAKION_RECV_BATCH_HISTOGRAM_SIZE 6
+
+/**
+ * Statistics about how many datagrams are received per socket wakeup.
+ */
+typedef struct chiaki_takion_recv_stats_t
+{
+	uint64_t wakeups;
+	uint64_t packets;
+	uint64_t batch_max;
+
+	/**
+	 * Number of wakeups by batch size, bucket i counts batches of [2^i, 2^(i+1)) packets,
+	 * the last bucket everything above.
+	 */
+	uint64_t batch_histogram[CHIAKI_TAKION_RECV_BATCH_HISTOGRAM_SIZE];
+
+	// only set if the receive ring is used
+	size_t ring_size;
+	size_t ring_high_water; // max number of datagrams waiting for processing at once
+	uint64_t ring_drops; // datagrams dropped because the ring was full
+} ChiakiTakionRecvStats;
+
+#define CHIAKI_TAKION_ACK_DELAY_OVER_BUDGET_FACTOR 4
+
+/**
+ * Statistics about the datagrams sent to the console.
+ */
+typedef struct chiaki_takion_upstream_stats_t
+{
+	uint64_t packets; // including every copy sent by the impairment
+	uint64_t acks_sent;
+	uint64_t acks_merged; // data acks saved because a later ack covered them
+	uint64_t acks_over_budget; // acks held longer because the packet budget was used up
+	uint64_t budget_windows_exceeded; // seconds in which the packet budget was used up
+} ChiakiTakionUpstreamStats;
+
 
 typedef struct chiaki_takion_t
 {
@@ -129,12 +258,14 @@ typedef struct chiaki_takion_t
 	bool enable_crypt;
 
 	/**
-	 * Array to be temporarily allocated when non-data packets come, enable_crypt is true, but gkcrypt_remote is NULL
-	 * to not ignore any MACs in this period.
+	 * Fixed-size ring to be allocated when non-data packets come, enable_crypt is true, but gkcrypt_remote is NULL
+	 * to not ignore any MACs in this period. When full, the oldest packet is dropped.
+	 * Once gkcrypt_remote is set, it is drained a few packets at a time alongside newly received ones.
 	 */
 	struct chiaki_takion_postponed_packet_t *postponed_packets;
-	size_t postponed_packets_size;
+	size_t postponed_packets_begin;
 	size_t postponed_packets_count;
+	uint64_t postponed_packets_dropped;
 
 	ChiakiGKCrypt *gkcrypt_local; // if NULL (default), no gmac is calculated and nothing is encrypted
 	uint64_t key_pos_local;
@@ -142,7 +273,14 @@ typedef struct chiaki_takion_t
 
 	ChiakiGKCrypt *gkcrypt_remote; // if NULL (default), remote gmacs are IGNORED (!) and everything is expected to be unencrypted
 
-	ChiakiReorderQueue data_queue;
+	/**
+	 * Buffers for all received datagrams. Every buffer passed to takion_handle_packet() comes from here
+	 * and is released back to it once the packet has been processed, dropped or flushed from the data queue.
+	 */
+	ChiakiPacketPool packet_pool;
+
+	ChiakiReorderQueue32 data_queue;
+	size_t data_queue_size_exp;
 	ChiakiTakionSendBuffer send_buffer;
 
 	ChiakiTakionCallback cb;
@@ -150,10 +288,45 @@ typedef struct chiaki_takion_t
 	chiaki_socket_t sock;
 	ChiakiThread thread;
 	ChiakiStopPipe stop_pipe;
+	ChiakiStopPipeWaiter sock_waiter; // sock and stop_pipe, only waited on by the thread reading the socket
+	bool recv_batch;
+	uint64_t initial_rtt_us;
+	ChiakiTimerWheel *timer_wheel;
+	ChiakiArena *arena;
+	ChiakiTakionRecvStats recv_stats; // only written by the thread reading the socket
+
+	size_t recv_ring_size_exp;
+	ChiakiSPSCRing recv_ring;
+	ChiakiThread recv_thread;
+	ChiakiMutex recv_ring_mutex; // only used to sleep on an empty ring
+	ChiakiCond recv_ring_cond;
+	size_t recv_ring_waiting; // atomic, nonzero while the Takion thread is waiting for recv_ring_cond
+	bool recv_ring_done; // protected by recv_ring_mutex
+	uint64_t recv_ring_drops; // only written by recv_thread
+
+	bool mac_offload;
+	ChiakiThread mac_thread;
+	ChiakiMutex mac_mutex;
+	ChiakiCond mac_cond; // signalled both when jobs are handed to mac_thread and when it finished them
+	struct takion_mac_job_t *mac_jobs; // protected by mac_mutex
+	size_t mac_jobs_count; // protected by mac_mutex, nonzero while mac_thread has jobs to do
+	bool mac_thread_stop; // protected by mac_mutex
+	ChiakiGKCryptGMacCache mac_cache; // only used by mac_thread
 	uint32_t tag_local;
 	uint32_t tag_remote;
 	bool close_socket;
 
+	ChiakiCapture *capture;
+	ChiakiCaptureReader *replay;
+	uint64_t replay_start_us;
+	bool replay_av_started; // whether the first av packet has been replayed
+
+	bool impair; // whether impair_recv, impair_send and impair_send_mutex are initialized
+	ChiakiImpair impair_recv; // only used by the thread reading the socket
+	ChiakiImpair impair_send;
+	ChiakiMutex impair_send_mutex;
+	bool impair_send_active; // set once the handshake is done, which is always left unimpaired
+
 	ChiakiSeqNum32 seq_num_local;
 	ChiakiMutex seq_num_local_mutex;
 
@@ -162,10 +335,24 @@ typedef struct chiaki_takion_t
 	 */
 	uint32_t a_rwnd;
 
-	ChiakiTakionAVPacketParse av_packet_parse;
-
 	ChiakiKeyState key_state;
 
+	size_t upstream_packets; // atomic, datagrams sent
+	uint64_t ack_delay_us;
+	unsigned int upstream_packets_budget;
+	ChiakiTimerTask ack_task; // only scheduled while the Takion thread runs
+	ChiakiMutex ack_mutex;
+	bool ack_pending; // protected by ack_mutex
+	bool ack_held; // protected by ack_mutex, whether the pending ack was held for the budget
+	ChiakiSeqNum32 ack_seq_num; // protected by ack_mutex, newest data to ack while ack_pending
+	uint64_t ack_pending_since_us; // protected by ack_mutex
+	uint64_t budget_window_start_us; // protected by ack_mutex
+	size_t budget_window_packets; // protected by ack_mutex, upstream_packets at budget_window_start_us
+	bool budget_window_exceeded; // protected by ack_mutex
+	ChiakiTakionUpstreamStats upstream_stats; // protected by ack_mutex, except packets
+
+	size_t av_substreams; // mask of ChiakiTakionAVSubstream, accessed atomically
+
 	bool enable_dualsense;
 } ChiakiTakion;
 
@@ -182,6 +369,28 @@ static inline void chiaki_takion_set_crypt(ChiakiTakion *takion, ChiakiGKCrypt *
 	takion->gkcrypt_remote = gkcrypt_remote;
 }
 
+/**
+ * Change the subscribed AV substreams, may be called from any thread.
+ *
+ * @param substreams mask of ChiakiTakionAVSubstream
+ */
+static inline void chiaki_takion_set_av_substreams(ChiakiTakion *takion, uint32_t substreams)
+{
+	chiaki_atomic_store_release(&takion->av_substreams, substreams);
+}
+
+/**
+ * Get a copy of the receive batching stats.
+ *
+ * Not synchronized with the Takion thread, so values may be slightly inconsistent while Takion is running.
+ */
+CHIAKI_EXPORT void chiaki_takion_get_recv_stats(ChiakiTakion *takion, ChiakiTakionRecvStats *stats);
+
+/**
+ * Get a copy of the stats of the datagrams sent so far.
+ */
+CHIAKI_EXPORT void chiaki_takion_get_upstream_stats(ChiakiTakion *takion, ChiakiTakionUpstreamStats *stats);
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_packet_mac(ChiakiGKCrypt *crypt, uint8_t *buf, size_t buf_size, uint64_t key_pos, uint8_t *mac_out, uint8_t *mac_old_out);
 
 /**
@@ -247,6 +456,17 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v9_av_packet_parse(ChiakiTakionAVPac
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v12_av_packet_parse(ChiakiTakionAVPacket *packet, ChiakiKeyState *key_state, uint8_t *buf, size_t buf_size);
 
+/**
+ * Write the header of an AV packet the way chiaki_takion_v9_av_packet_parse() reads it, as sent by a console,
+ * with the low 32 bits of packet->key_pos and a zero MAC. The data follows at buf + *header_size_out.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v9_av_packet_format_header(uint8_t *buf, size_t buf_size, size_t *header_size_out, ChiakiTakionAVPacket *packet);
+
+/**
+ * Like chiaki_takion_v9_av_packet_format_header() for chiaki_takion_v12_av_packet_parse(), including packet->is_haptics.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v12_av_packet_format_header(uint8_t *buf, size_t buf_size, size_t *header_size_out, ChiakiTakionAVPacket *packet);
+
 #define CHIAKI_TAKION_V7_AV_HEADER_SIZE_BASE					0x12
 #define CHIAKI_TAKION_V7_AV_HEADER_SIZE_VIDEO_ADD				0x3
 #define CHIAKI_TAKION_V7_AV_HEADER_SIZE_NALU_INFO_STRUCTS_ADD	0x3
@@ -6,6 +6,8 @@
 #include "common.h"
 #include "log.h"
 #include "thread.h"
+#include "timerwheel.h"
+#include "arena.h"
 #include "seqnum.h"
 
 #include <stdbool.h>
@@ -18,6 +20,12 @@ typedef struct chiaki_takion_t ChiakiTakion;
 
 typedef struct chiaki_takion_send_buffer_packet_t ChiakiTakionSendBufferPacket;
 
+/**
+ * Buffer of sent reliable packets that have not been acked yet.
+ *
+ * Packets are stored in a ring indexed by seq_num % packets_size, so all outstanding seqnums
+ * must lie within a window of packets_size, i.e. [seq_num_begin, seq_num_end).
+ */
 typedef struct chiaki_takion_send_buffer_t
 {
 	ChiakiLog *log;
@@ -25,35 +33,76 @@ typedef struct chiaki_takion_send_buffer_t
 
 	ChiakiTakionSendBufferPacket *packets;
 	size_t packets_size; // allocated size
-	size_t packets_count; // current count
+	size_t packets_count; // current count of outstanding packets
+
+	ChiakiSeqNum32 seq_num_begin; // oldest outstanding seqnum, only valid if packets_count > 0
+	ChiakiSeqNum32 seq_num_end; // one after the newest outstanding seqnum, only valid if packets_count > 0
+	bool acked_any;
+	ChiakiSeqNum32 seq_num_acked; // last cumulatively acked seqnum, only valid if acked_any
+
+	/**
+	 * Optional preallocated storage of arena_buf_size bytes per slot
+	 * for packets pushed with chiaki_takion_send_buffer_push_copy()
+	 */
+	uint8_t *arena;
+	size_t arena_buf_size;
+	ChiakiArena *buf_arena; // of takion, for all packet buffers that are not in arena
+
+	/**
+	 * Retransmission timeout estimator (RFC 6298), fed by the time between sending a packet and its ack.
+	 * Only packets that have never been re-sent are sampled (Karn's algorithm).
+	 */
+	bool rtt_sampled;
+	uint64_t srtt_us;
+	uint64_t rttvar_us;
+	uint64_t rto_us;
 
 	ChiakiMutex mutex;
-	ChiakiCond cond;
-	bool should_stop;
-	ChiakiThread thread;
+	ChiakiTimerWheel *timer_wheel;
+	ChiakiTimerTask resend_task; // scheduled while there are outstanding packets
 } ChiakiTakionSendBuffer;
 
 
 /**
- * Init a Send Buffer and start a thread that automatically re-sends packets on takion.
+ * Init a Send Buffer that automatically re-sends packets on takion from a task on timer_wheel.
  *
- * @param takion if NULL, the Send Buffer thread will effectively do nothing (for unit testing)
- * @param size number of packet slots
+ * @param timer_wheel if NULL, packets are never re-sent (for unit testing)
+ * @param takion if NULL, the resend task will effectively do nothing (for unit testing)
+ * @param size number of packet slots, must be a power of 2
+ * @param arena_buf_size if > 0, preallocate this many bytes for every slot to hold packets pushed with chiaki_takion_send_buffer_push_copy()
  */
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuffer *send_buffer, ChiakiTakion *takion, size_t size);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuffer *send_buffer, ChiakiTimerWheel *timer_wheel,
+		ChiakiTakion *takion, size_t size, size_t arena_buf_size);
 CHIAKI_EXPORT void chiaki_takion_send_buffer_fini(ChiakiTakionSendBuffer *send_buffer);
 
 /**
- * @param buf ownership of this is taken by the ChiakiTakionSendBuffer, which will free it automatically later!
+ * @param buf allocated from takion->arena, ownership of this is taken by the ChiakiTakionSendBuffer, which will free it automatically later!
  * On error, buf is freed immediately.
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_push(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, uint8_t *buf, size_t buf_size);
 
+/**
+ * Like chiaki_takion_send_buffer_push(), but buf is copied and not taken ownership of.
+ * The copy lives in the slot's arena buffer if it fits, otherwise in takion->arena.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_push_copy(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, const uint8_t *buf, size_t buf_size);
+
 /**
  * @param acked_seq_nums optional array of size of at least send_buffer->packets_size where acked seq nums will be stored
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_ack(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, ChiakiSeqNum32 *acked_seq_nums, size_t *acked_seq_nums_count);
 
+/**
+ * Use an externally measured round-trip time as the first sample of the retransmission timeout estimator.
+ * Ignored if an ack has already been timed.
+ */
+CHIAKI_EXPORT void chiaki_takion_send_buffer_seed_rtt(ChiakiTakionSendBuffer *send_buffer, uint64_t rtt_us);
+
+/**
+ * @return the current base retransmission timeout, before per-packet exponential backoff
+ */
+CHIAKI_EXPORT uint64_t chiaki_takion_send_buffer_get_rto_us(ChiakiTakionSendBuffer *send_buffer);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_TELEMETRY_H
+#define CHIAKI_TELEMETRY_H
+
+#include "common.h"
+#include "thread.h"
+#include "sock.h"
+#include "log.h"
+#include "session.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Every snapshot is a single UDP datagram, all values little endian:
+ *
+ * header: magic CHIAKI_TELEMETRY_MAGIC (4), version: u16, stage count: u8, role count: u8, seq: u32,
+ *     time in us since the exporter was started: u64
+ * per latency stage, see ChiakiLatencyStage: count, avg_us, p95_us, p99_us, max_us: u32,
+ *     CHIAKI_LATENCY_COARSE_BUCKETS sample counts: u32
+ * network: packets received, packets lost, received and lost in the short window, video jitter_us,
+ *     audio jitter_us, video delay_us, rtt_us: u32
+ * video: frames, frames_failed, frames_fec_recovered, ref_frame_misses, bitrate in kbit/s: u32
+ * audio decode queue: frames, frames_dropped, depth, decode_us_avg: u32
+ * app: the fields of ChiakiTelemetryAppStats in order: u32
+ * per thread role, see ChiakiThreadRole: cpu_ms of ended and running threads: u32, running threads: u32
+ *
+ * All counts are totals since the session started, so a receiver gets intervals from any two snapshots
+ * and a lost datagram loses nothing but resolution.
+ */
+#define CHIAKI_TELEMETRY_MAGIC "CKTM"
+#define CHIAKI_TELEMETRY_VERSION 1
+#define CHIAKI_TELEMETRY_INTERVAL_MS_DEFAULT 100
+#define CHIAKI_TELEMETRY_PORT_DEFAULT 9350
+
+/**
+ * Stats only the application knows, 0 where it has nothing to report.
+ */
+typedef struct chiaki_telemetry_app_stats_t
+{
+	uint32_t fps; // presented
+	uint32_t audio_buffered_ms; // waiting for the audio device
+	uint32_t audio_target_ms;
+	uint32_t audio_underruns;
+	uint32_t audio_overruns;
+	uint32_t cpu_ms; // of the stream threads the application created itself
+} ChiakiTelemetryAppStats;
+
+/**
+ * Called on the telemetry thread before every snapshot, with stats zeroed.
+ */
+typedef void (*ChiakiTelemetryAppStatsCb)(ChiakiTelemetryAppStats *stats, void *user);
+
+typedef struct chiaki_telemetry_stats_t
+{
+	uint64_t sent;
+	uint64_t dropped; // the socket was not ready or sending failed
+} ChiakiTelemetryStats;
+
+/**
+ * Sends snapshots of the stats of a session to a receiver on another machine, e.g. scripts/telemetry_receiver.py.
+ *
+ * The socket is non-blocking and the thread runs at the lowest priority, so a slow network or receiver
+ * only costs snapshots.
+ */
+typedef struct chiaki_telemetry_t
+{
+	ChiakiLog *log;
+	ChiakiSession *session;
+	chiaki_socket_t sock;
+	struct addrinfo *addrinfos;
+	struct addrinfo *addr; // from addrinfos, sent to
+	uint64_t interval_ms;
+	ChiakiTelemetryAppStatsCb app_stats_cb;
+	void *app_stats_cb_user;
+	ChiakiThread thread;
+	ChiakiBoolPredCond stop_cond;
+	uint32_t seq;
+	uint64_t start_us;
+	ChiakiTelemetryStats stats; // only written by the thread, read after fini
+} ChiakiTelemetry;
+
+/**
+ * Start exporting the stats of session, which must stay valid until chiaki_telemetry_fini().
+ *
+ * @param host name or address of the receiver
+ * @param interval_ms between snapshots, e.g. CHIAKI_TELEMETRY_INTERVAL_MS_DEFAULT
+ * @param app_stats_cb may be NULL
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_telemetry_init(ChiakiTelemetry *telemetry, ChiakiSession *session,
+		const char *host, uint16_t port, uint64_t interval_ms,
+		ChiakiTelemetryAppStatsCb app_stats_cb, void *app_stats_cb_user, ChiakiLog *log);
+
+CHIAKI_EXPORT void chiaki_telemetry_fini(ChiakiTelemetry *telemetry);
+
+/**
+ * Serialize a snapshot of the session's stats as sent.
+ *
+ * @return size written, 0 if buf_size is too small
+ */
+CHIAKI_EXPORT size_t chiaki_telemetry_snapshot(ChiakiSession *session, const ChiakiTelemetryAppStats *app_stats,
+		uint32_t seq, uint64_t time_us, uint8_t *buf, size_t buf_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_TELEMETRY_H
@@ -4,6 +4,7 @@
 #define CHIAKI_THREAD_H
 
 #include "common.h"
+#include "log.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -43,6 +44,100 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_join(ChiakiThread *thread, void **re
 CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_timedjoin(ChiakiThread *thread, void **retval, uint64_t timeout_ms);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_set_name(ChiakiThread *thread, const char *name);
 
+/**
+ * Raise the priority of a latency-critical thread above the default, where the platform allows it.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_set_high_priority(ChiakiThread *thread);
+
+typedef struct chiaki_thread_attr_t
+{
+	const char *name; // NULL for none
+	int priority; // native priority (Vita: 64 is the highest for user threads, Windows: THREAD_PRIORITY_*), 0 keeps the default
+	unsigned int cpu_affinity_mask; // native mask (Vita: SCE_KERNEL_CPU_MASK_USER_*, elsewhere: bit n for core n), 0 for any core
+	size_t stack_size; // 0 keeps the default
+} ChiakiThreadAttr;
+
+/**
+ * Create a thread that starts out with the given attributes instead of changing them from inside the thread.
+ * Priority and affinity are a best effort where the platform can only apply them after creation.
+ *
+ * @param attr NULL for the defaults, as chiaki_thread_create()
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_create_attr(ChiakiThread *thread, ChiakiThreadFunc func, void *arg, const ChiakiThreadAttr *attr);
+
+/**
+ * What a library thread does, to look up the attributes it is created with.
+ */
+typedef enum chiaki_thread_role_t
+{
+	CHIAKI_THREAD_ROLE_DEFAULT,
+	CHIAKI_THREAD_ROLE_SESSION,
+	CHIAKI_THREAD_ROLE_CTRL,
+	CHIAKI_THREAD_ROLE_TAKION,
+	CHIAKI_THREAD_ROLE_TAKION_RECV,
+	CHIAKI_THREAD_ROLE_TAKION_MAC,
+	CHIAKI_THREAD_ROLE_RUDP_SEND_BUFFER,
+	CHIAKI_THREAD_ROLE_GKCRYPT,
+	CHIAKI_THREAD_ROLE_TIMER_WHEEL,
+	CHIAKI_THREAD_ROLE_VIDEO_DECODE,
+	CHIAKI_THREAD_ROLE_AUDIO_DECODE,
+	CHIAKI_THREAD_ROLE_DISCOVERY,
+	CHIAKI_THREAD_ROLE_DISCOVERY_SERVICE,
+	CHIAKI_THREAD_ROLE_REGIST,
+	CHIAKI_THREAD_ROLE_HOLEPUNCH,
+	CHIAKI_THREAD_ROLE_LOG,
+	CHIAKI_THREAD_ROLE_RECORDER,
+	CHIAKI_THREAD_ROLE_TELEMETRY,
+	CHIAKI_THREAD_ROLE_FEC,
+	CHIAKI_THREAD_ROLE_COUNT
+} ChiakiThreadRole;
+
+CHIAKI_EXPORT const char *chiaki_thread_role_string(ChiakiThreadRole role);
+
+/**
+ * Create a thread with the attributes currently set for role.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_create_role(ChiakiThread *thread, ChiakiThreadFunc func, void *arg, ChiakiThreadRole role);
+
+/**
+ * Override the attributes library threads of role are created with, e.g. to lay them out on the cores
+ * around the threads of the application. Not thread-safe, call before any threads of role are started.
+ * The name is not copied and must stay valid.
+ */
+CHIAKI_EXPORT void chiaki_thread_role_attr_set(ChiakiThreadRole role, const ChiakiThreadAttr *attr);
+CHIAKI_EXPORT void chiaki_thread_role_attr_get(ChiakiThreadRole role, ChiakiThreadAttr *attr);
+
+typedef struct chiaki_thread_stats_t
+{
+	uint64_t cpu_us; // time spent running so far
+	unsigned int cpu_affinity_mask; // native, as in ChiakiThreadAttr, 0 if unknown
+	int priority; // native, 0 if unknown
+} ChiakiThreadStats;
+
+/**
+ * Query a thread that has not been joined yet.
+ *
+ * @return CHIAKI_ERR_UNKNOWN if the platform does not account the CPU time of threads
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_get_stats(ChiakiThread *thread, ChiakiThreadStats *stats);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_get_self_stats(ChiakiThreadStats *stats);
+
+/**
+ * CPU time of the threads that were created for a role, added up as they end,
+ * and of the ones still running where the platform allows sampling them (Vita and glibc).
+ */
+typedef struct chiaki_thread_role_stats_t
+{
+	size_t threads;
+	size_t cpu_ms;
+	unsigned int cpu_affinity_mask; // of the last thread that ended
+	size_t running;
+	size_t running_cpu_ms; // so far
+} ChiakiThreadRoleStats;
+
+CHIAKI_EXPORT void chiaki_thread_role_stats_get(ChiakiThreadRole role, ChiakiThreadRoleStats *stats);
+CHIAKI_EXPORT void chiaki_thread_role_stats_reset(void);
+
 
 typedef struct chiaki_mutex_t
 {
@@ -53,6 +148,11 @@ typedef struct chiaki_mutex_t
 #else
 	pthread_mutex_t mutex;
 #endif
+#ifdef CHIAKI_LIB_ENABLE_LOCK_PROFILING
+	struct chiaki_lock_profile_t *profile; // NULL unless named
+	unsigned int depth; // of recursive locking, only touched while locked
+	uint64_t locked_us;
+#endif
 } ChiakiMutex;
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_mutex_init(ChiakiMutex *mutex, bool rec);
@@ -61,6 +161,43 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_mutex_lock(ChiakiMutex *mutex);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_mutex_trylock(ChiakiMutex *mutex);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_mutex_unlock(ChiakiMutex *mutex);
 
+/**
+ * Max number of distinct names lock profiling keeps apart, further names are not profiled
+ */
+#define CHIAKI_LOCK_PROFILE_NAMES_MAX 64
+
+/**
+ * Label a mutex for lock profiling, called after chiaki_mutex_init() and before it is used.
+ * All mutexes of the same name, e.g. of every instance of a struct, are profiled together.
+ * The name is not copied and must stay valid. Does nothing unless built with CHIAKI_LIB_ENABLE_LOCK_PROFILING.
+ */
+CHIAKI_EXPORT void chiaki_mutex_set_name(ChiakiMutex *mutex, const char *name);
+
+typedef struct chiaki_lock_profile_stats_t
+{
+	const char *name;
+	uint64_t locks;
+	uint64_t contended; // locks that had to wait for another thread
+	uint64_t wait_us;
+	uint64_t wait_max_us;
+	uint64_t hold_us; // from locking to unlocking, without waits on a cond
+	uint64_t hold_max_us;
+} ChiakiLockProfileStats;
+
+/**
+ * Stats of the named mutexes since the last reset, ranked by wait_us.
+ * Empty unless built with CHIAKI_LIB_ENABLE_LOCK_PROFILING.
+ *
+ * @return number written to stats
+ */
+CHIAKI_EXPORT size_t chiaki_lock_profile_get(ChiakiLockProfileStats *stats, size_t stats_max);
+CHIAKI_EXPORT void chiaki_lock_profile_reset(void);
+
+/**
+ * Log the ranked stats, e.g. at the end of a session.
+ */
+CHIAKI_EXPORT void chiaki_lock_profile_log(ChiakiLog *log);
+
 
 typedef struct chiaki_cond_t
 {
@@ -102,6 +239,45 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_bool_pred_cond_timedwait(ChiakiBoolPredCond
 CHIAKI_EXPORT ChiakiErrorCode chiaki_bool_pred_cond_signal(ChiakiBoolPredCond *cond);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_bool_pred_cond_broadcast(ChiakiBoolPredCond *cond);
 
+
+/**
+ * Set of event bits to wake up waiting threads, lighter than a ChiakiCond:
+ * an event flag on the Vita and a futex on Linux, so neither side has to take a mutex.
+ *
+ * Bits stay set until a wait consumes them, so a bit set before the wait is not lost.
+ * Any state besides the bits must be protected by the user, e.g. with a mutex that is released while waiting.
+ */
+typedef struct chiaki_event_flags_t
+{
+#if defined(__PSVITA__)
+	SceUID evf_id;
+#elif defined(__linux__)
+	uint32_t bits; // futex word
+	uint32_t waiting; // number of threads waiting
+#else
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	uint32_t bits;
+#endif
+} ChiakiEventFlags;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_flags_init(ChiakiEventFlags *event);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_flags_fini(ChiakiEventFlags *event);
+
+/**
+ * Set bits and wake up the waiting thread if it waits for any of them.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_flags_set(ChiakiEventFlags *event, uint32_t bits);
+
+/**
+ * Wait until any of the bits in mask is set, then clear those of them that are set.
+ *
+ * @param bits_out if not NULL, set to the bits of mask that were consumed, 0 on timeout
+ * @return CHIAKI_ERR_TIMEOUT if none were set within timeout_ms
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_flags_timedwait(ChiakiEventFlags *event, uint32_t mask, uint64_t timeout_ms, uint32_t *bits_out);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_flags_wait(ChiakiEventFlags *event, uint32_t mask, uint32_t *bits_out);
+
 #ifdef __cplusplus
 }
 
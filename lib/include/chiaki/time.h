@@ -11,6 +11,10 @@
 extern "C" {
 #endif
 
+/**
+ * Monotonic time in us with an arbitrary start, cheap enough to stamp every packet.
+ * Timestamps for stats, estimators and pacing should use this, chiaki_time_now_monotonic_ms() is for coarse timeouts.
+ */
 CHIAKI_EXPORT uint64_t chiaki_time_now_monotonic_us();
 
 static inline uint64_t chiaki_time_now_monotonic_ms() { return chiaki_time_now_monotonic_us() / 1000; }
@@ -0,0 +1,111 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_TIMERWHEEL_H
+#define CHIAKI_TIMERWHEEL_H
+
+#include "common.h"
+#include "log.h"
+#include "thread.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_TIMER_WHEEL_SLOTS 256
+#define CHIAKI_TIMER_WHEEL_TICK_US 1000
+
+/**
+ * Returned by a ChiakiTimerTaskCallback to not fire again until the task is scheduled anew
+ */
+#define CHIAKI_TIMER_TASK_STOP UINT64_MAX
+
+/**
+ * Called from the wheel's thread without any lock of the wheel held.
+ *
+ * @param now_us chiaki_time_now_monotonic_us() when the task was fired
+ * @return us until the task should fire again, or CHIAKI_TIMER_TASK_STOP
+ */
+typedef uint64_t (*ChiakiTimerTaskCallback)(void *user, uint64_t now_us);
+
+typedef struct chiaki_timer_task_stats_t
+{
+	uint64_t fires;
+	uint64_t late_us_avg; // how long after being due the task was fired
+	uint64_t late_us_max;
+} ChiakiTimerTaskStats;
+
+typedef struct chiaki_timer_task_t
+{
+	const char *name;
+	ChiakiTimerTaskCallback cb;
+	void *user;
+
+	// protected by the wheel's mutex
+	struct chiaki_timer_task_t *prev;
+	struct chiaki_timer_task_t *next;
+	bool scheduled;
+	size_t slot; // only valid if scheduled
+	uint64_t due_us;
+	uint64_t fires;
+	uint64_t late_us_sum;
+	uint64_t late_us_max;
+} ChiakiTimerTask;
+
+/**
+ * Runs the periodic work of a session as tasks on a single thread, e.g. resends and reports that would
+ * otherwise each need their own thread only to sleep.
+ *
+ * Tasks are hashed into CHIAKI_TIMER_WHEEL_SLOTS slots of CHIAKI_TIMER_WHEEL_TICK_US by their due time, so
+ * scheduling is O(1) and the thread only looks at the slots of the ticks that have passed. Callbacks
+ * should be short since they delay all other tasks, which shows up in their late-fire stats.
+ */
+typedef struct chiaki_timer_wheel_t
+{
+	ChiakiLog *log;
+	ChiakiMutex mutex;
+	ChiakiCond task_done_cond; // signaled after a callback returned, for chiaki_timer_wheel_cancel()
+	ChiakiEventFlags event;
+	ChiakiThread thread;
+
+	// protected by mutex
+	bool should_stop;
+	ChiakiTimerTask *slots[CHIAKI_TIMER_WHEEL_SLOTS];
+	uint64_t tick; // all ticks before this have been processed
+	uint64_t wakeup_us; // when the thread will look at the slots next, UINT64_MAX if it waits without timeout
+	ChiakiTimerTask *running;
+} ChiakiTimerWheel;
+
+/**
+ * Init a Timer Wheel and start its thread.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_timer_wheel_init(ChiakiTimerWheel *wheel, ChiakiLog *log);
+
+/**
+ * Stop the thread. All tasks must have been cancelled before.
+ */
+CHIAKI_EXPORT void chiaki_timer_wheel_fini(ChiakiTimerWheel *wheel);
+
+CHIAKI_EXPORT void chiaki_timer_task_init(ChiakiTimerTask *task, const char *name, ChiakiTimerTaskCallback cb, void *user);
+
+/**
+ * Fire task after delay_us, or earlier if it is already scheduled for before that.
+ * Can be called from any thread, including from inside callbacks.
+ */
+CHIAKI_EXPORT void chiaki_timer_wheel_schedule(ChiakiTimerWheel *wheel, ChiakiTimerTask *task, uint64_t delay_us);
+
+/**
+ * Unschedule task and wait until its callback has returned if it is currently running, then log its stats.
+ * Must not be called from the task's own callback.
+ */
+CHIAKI_EXPORT void chiaki_timer_wheel_cancel(ChiakiTimerWheel *wheel, ChiakiTimerTask *task);
+
+CHIAKI_EXPORT void chiaki_timer_wheel_get_task_stats(ChiakiTimerWheel *wheel, ChiakiTimerTask *task, ChiakiTimerTaskStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_TIMERWHEEL_H
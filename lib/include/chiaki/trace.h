@@ -0,0 +1,97 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_TRACE_H
+#define CHIAKI_TRACE_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Timeline an event is drawn on, usually the thread it happens on
+ */
+typedef enum chiaki_trace_track_t
+{
+	CHIAKI_TRACE_TRACK_TAKION_RECV,
+	CHIAKI_TRACE_TRACK_TAKION,
+	CHIAKI_TRACE_TRACK_GKCRYPT,
+	CHIAKI_TRACE_TRACK_FEEDBACK,
+	CHIAKI_TRACE_TRACK_VIDEO_DECODE,
+	CHIAKI_TRACE_TRACK_VIDEO_PRESENT,
+	CHIAKI_TRACE_TRACK_AUDIO_OUTPUT,
+	CHIAKI_TRACE_TRACK_INPUT,
+	CHIAKI_TRACE_TRACK_COUNT
+} ChiakiTraceTrack;
+
+CHIAKI_EXPORT const char *chiaki_trace_track_string(ChiakiTraceTrack track);
+
+/**
+ * Events ending in _BEGIN and _END span the time between them, all others are instants
+ */
+typedef enum chiaki_trace_event_t
+{
+	CHIAKI_TRACE_EVENT_PACKET_RECV, // arg: size
+	CHIAKI_TRACE_EVENT_FRAME_FLUSH_BEGIN, // arg: frame index
+	CHIAKI_TRACE_EVENT_FRAME_FLUSH_END, // arg: ChiakiFrameProcessorFlushResult
+	CHIAKI_TRACE_EVENT_FEC_BEGIN, // arg: erasures
+	CHIAKI_TRACE_EVENT_FEC_END, // arg: ChiakiErrorCode
+	CHIAKI_TRACE_EVENT_KEY_STREAM_CHUNK, // arg: GKCrypt index
+	CHIAKI_TRACE_EVENT_FEEDBACK_STATE_SEND,
+	CHIAKI_TRACE_EVENT_FEEDBACK_HISTORY_SEND,
+	CHIAKI_TRACE_EVENT_DECODE_BEGIN, // arg: size
+	CHIAKI_TRACE_EVENT_DECODE_END,
+	CHIAKI_TRACE_EVENT_PRESENT_BEGIN,
+	CHIAKI_TRACE_EVENT_PRESENT_END,
+	CHIAKI_TRACE_EVENT_AUDIO_OUTPUT, // arg: buffer index
+	CHIAKI_TRACE_EVENT_INPUT_SAMPLE,
+	CHIAKI_TRACE_EVENT_COUNT
+} ChiakiTraceEvent;
+
+CHIAKI_EXPORT const char *chiaki_trace_event_string(ChiakiTraceEvent event);
+
+typedef struct chiaki_trace_record_t
+{
+	uint64_t time_us;
+	uint32_t event;
+	uint32_t arg;
+} ChiakiTraceRecord;
+
+/**
+ * Global event tracer for looking at how the threads of a session interact.
+ *
+ * Every track has its own ring of records. Recording an event takes a timestamp, one atomic add and
+ * three stores, and only a load and a branch while the tracer is not started. When a ring is full,
+ * the oldest records are overwritten, so a dump shows the most recent part of the session.
+ *
+ * Allocate the rings with chiaki_trace_init() before any session and free them with chiaki_trace_fini()
+ * when no thread can trace anymore, the functions in between can be called at any time.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_trace_init(size_t size_exp);
+CHIAKI_EXPORT void chiaki_trace_fini();
+
+/**
+ * Discard all previous records and start recording.
+ */
+CHIAKI_EXPORT void chiaki_trace_start();
+CHIAKI_EXPORT void chiaki_trace_stop();
+
+CHIAKI_EXPORT void chiaki_trace_event(ChiakiTraceTrack track, ChiakiTraceEvent event, uint32_t arg);
+
+/**
+ * Write all records in the Chrome Trace Event JSON format, as loaded by chrome://tracing and Perfetto.
+ * Should be called after chiaki_trace_stop(), records written meanwhile may appear incomplete.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_trace_dump(const char *filename);
+
+#define CHIAKI_TRACE(track, event, arg) chiaki_trace_event(CHIAKI_TRACE_TRACK_##track, CHIAKI_TRACE_EVENT_##event, (uint32_t)(arg))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_TRACE_H
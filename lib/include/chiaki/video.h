@@ -23,6 +23,24 @@ typedef struct chiaki_video_profile_t
  */
 #define CHIAKI_VIDEO_BUFFER_PADDING_SIZE 64
 
+/**
+ * Number of frames that can be assembled at the same time
+ */
+#define CHIAKI_VIDEO_FRAME_SLOTS 2
+
+/**
+ * Called before a frame is assembled to get the buffer it is assembled in, which then also is the buffer
+ * passed to the ChiakiVideoSampleCallback, so the sink can hand out memory its decoder can consume directly.
+ *
+ * Up to CHIAKI_VIDEO_FRAME_SLOTS buffers are in use at once. Frames are completed in the order of the calls,
+ * so a buffer is used by the library until CHIAKI_VIDEO_FRAME_SLOTS further calls of this callback
+ * or the end of the session.
+ *
+ * @param size required size, including CHIAKI_VIDEO_BUFFER_PADDING_SIZE
+ * @return buffer of at least size bytes owned by the sink, or NULL to assemble the frame in an internal buffer
+ */
+typedef uint8_t *(*ChiakiVideoAUBufferCallback)(size_t size, void *user);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,109 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_VIDEODECODEQUEUE_H
+#define CHIAKI_VIDEODECODEQUEUE_H
+
+#include "common.h"
+#include "log.h"
+#include "thread.h"
+#include "video.h"
+#include "bitstream.h"
+#include "latencystats.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Max number of assembled frames waiting to be decoded
+ */
+#define CHIAKI_VIDEO_DECODE_QUEUE_SIZE 4
+
+/**
+ * Buffers are needed for every frame in assembly, in the queue and the one being decoded
+ */
+#define CHIAKI_VIDEO_DECODE_QUEUE_BUFS_COUNT (CHIAKI_VIDEO_FRAME_SLOTS + CHIAKI_VIDEO_DECODE_QUEUE_SIZE + 1)
+
+typedef struct chiaki_video_decode_queue_frame_t
+{
+	uint8_t *buf; // owned by the queue if it came from chiaki_video_decode_queue_buf_get()
+	size_t buf_size;
+	int32_t frame_index; // -1 for a codec header, which is never dropped
+	int32_t frames_lost; // frames lost right before this one, including dropped ones
+	bool slice_valid;
+	ChiakiBitstreamSlice slice;
+	ChiakiBitstream bitstream; // state when the frame was assembled, for modifying its slice header
+	ChiakiLatencyFrame latency;
+} ChiakiVideoDecodeQueueFrame;
+
+/**
+ * Called on the decode thread for every frame, in order.
+ */
+typedef void (*ChiakiVideoDecodeQueueCallback)(ChiakiVideoDecodeQueueFrame *frame, void *user);
+
+typedef struct chiaki_video_decode_queue_buf_t
+{
+	uint8_t *buf;
+	size_t size;
+	bool in_use;
+} ChiakiVideoDecodeQueueBuf;
+
+/**
+ * Bounded queue of assembled frames in front of a dedicated thread that passes them on to the video sink,
+ * so decoding does not block the thread receiving the stream.
+ *
+ * If the queue is full when pushing, the oldest non-reference frame is dropped,
+ * or the oldest frame at all if there is none.
+ */
+typedef struct chiaki_video_decode_queue_t
+{
+	ChiakiLog *log;
+	ChiakiVideoDecodeQueueCallback cb;
+	void *cb_user;
+	ChiakiThread thread;
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	bool should_stop;
+
+	ChiakiVideoDecodeQueueFrame frames[CHIAKI_VIDEO_DECODE_QUEUE_SIZE];
+	size_t frames_head;
+	size_t frames_count;
+	ChiakiVideoDecodeQueueBuf bufs[CHIAKI_VIDEO_DECODE_QUEUE_BUFS_COUNT];
+
+	uint64_t frames_dropped;
+} ChiakiVideoDecodeQueue;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_video_decode_queue_init(ChiakiVideoDecodeQueue *queue, ChiakiLog *log,
+		ChiakiVideoDecodeQueueCallback cb, void *cb_user);
+
+/**
+ * Stop and join the thread. Frames still in the queue are discarded.
+ */
+CHIAKI_EXPORT void chiaki_video_decode_queue_fini(ChiakiVideoDecodeQueue *queue);
+
+/**
+ * ChiakiVideoAUBufferCallback to assemble frames in, user must be the queue.
+ * The buffer must be given back with either chiaki_video_decode_queue_push() or chiaki_video_decode_queue_buf_release().
+ */
+CHIAKI_EXPORT uint8_t *chiaki_video_decode_queue_buf_get(size_t size, void *user);
+
+/**
+ * Give back a buffer from chiaki_video_decode_queue_buf_get() that will not be pushed. Other buffers are ignored.
+ */
+CHIAKI_EXPORT void chiaki_video_decode_queue_buf_release(ChiakiVideoDecodeQueue *queue, uint8_t *buf);
+
+/**
+ * Queue a frame to be decoded. Ownership of frame->buf is always taken, even if false is returned.
+ *
+ * @return false if the frame could not be queued
+ */
+CHIAKI_EXPORT bool chiaki_video_decode_queue_push(ChiakiVideoDecodeQueue *queue, ChiakiVideoDecodeQueueFrame *frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_VIDEODECODEQUEUE_H
@@ -9,6 +9,10 @@
 #include "takion.h"
 #include "frameprocessor.h"
 #include "bitstream.h"
+#include "videodecodequeue.h"
+#include "corruptframereporter.h"
+#include "delayestimator.h"
+#include "backlogdetector.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -16,6 +20,39 @@ extern "C" {
 
 #define CHIAKI_VIDEO_PROFILES_MAX 8
 
+/**
+ * Max depth of the reference frame window, also the max number of frames a slice can reference back
+ */
+#define CHIAKI_VIDEO_REF_FRAMES_MAX 16
+
+/**
+ * Window over the most recent frame indices, marking which of them have been decoded and can be referenced.
+ */
+typedef struct chiaki_video_ref_frames_t
+{
+	uint32_t bits; // bit i set: frame newest - i is available
+	int32_t newest; // -1 if no frame was added yet
+	unsigned int depth; // frames older than newest - depth + 1 are not available anymore
+} ChiakiVideoRefFrames;
+
+typedef struct chiaki_video_frame_slot_t
+{
+	int32_t frame_index; // frame assembled in this slot, -1 if unused
+	bool pending; // frame has not been flushed yet
+	bool backlog_skip; // stale frame of a backlog, it is neither assembled nor decoded
+	uint64_t deadline_us; // flushed with whatever has arrived once this passes, 0 for no deadline
+	ChiakiFrameProcessor frame_processor;
+	ChiakiLatencyFrame latency;
+
+	// slice streaming
+	bool stream_started; // first slice has been checked and passed on
+	bool stream_failed; // frame is not passed on (anymore)
+	bool stream_recovered;
+	int32_t stream_frames_lost;
+	size_t stream_emitted; // bytes already passed to the slice callback
+	size_t stream_scan; // where to continue searching for the next start code
+} ChiakiVideoFrameSlot;
+
 typedef struct chiaki_video_receiver_t
 {
 	struct chiaki_session_t *session;
@@ -24,18 +61,44 @@ typedef struct chiaki_video_receiver_t
 	size_t profiles_count;
 	int profile_cur; // < 1 if no profile selected yet, else index in profiles
 
-	int32_t frame_index_cur; // frame that is currently being filled
-	int32_t frame_index_prev; // last frame that has been at least partially decoded
-	int32_t frame_index_prev_complete; // last frame that has been completely decoded
-	ChiakiFrameProcessor frame_processor;
+	int32_t frame_index_cur; // newest frame that is being filled
+	int32_t frame_index_prev; // last frame that has been flushed
+	int32_t frame_index_prev_complete; // last frame that has been completely assembled
+
+	/**
+	 * Frames are assembled concurrently in these, so units can still be added to a frame
+	 * while the next one starts arriving. Frames are always flushed in order.
+	 */
+	ChiakiVideoFrameSlot frame_slots[CHIAKI_VIDEO_FRAME_SLOTS];
+	ChiakiStreamStats stream_stats; // of all flushed frames
 	ChiakiPacketStats *packet_stats;
+	ChiakiDelayEstimator *delay_estimator; // NULL if not used
+	ChiakiBacklogDetector backlog_detector;
+
+	/**
+	 * A frame whose last units are lost would only be flushed once a newer frame completes, so it gets a deadline
+	 * of a frame interval plus twice the usual spread between its first and last unit after its first unit.
+	 */
+	uint64_t frame_interval_us; // 0 if frames have no deadline
+	uint64_t unit_spread_us; // moving average over completely received frames
+	uint64_t frames_overdue; // flushed because of their deadline
 
-	int32_t frames_lost;
-	int32_t reference_frames[16];
+	int32_t frames_lost; // frames lost since the last one handed on for decoding
+	ChiakiCorruptFrameReporter corrupt_frame_reporter;
 	ChiakiBitstream bitstream;
+
+	ChiakiVideoDecodeQueue *decode_queue; // NULL if frames are decoded right when they are flushed
+	bool slice_streaming; // frames are passed to the session's video_slice_cb slice by slice
+	ChiakiFecWorkers *fec_workers; // shared by all frame slots, NULL if frames are recovered on the receiving thread only
+
+	// only accessed when decoding, which is on the decode queue's thread if there is one
+	int32_t frames_lost_decode;
+	ChiakiVideoRefFrames ref_frames;
+	uint64_t ref_frame_misses; // P frames whose reference frame was not available
+	uint64_t ref_frame_retargets; // of these, frames changed to reference an older frame instead
 } ChiakiVideoReceiver;
 
-CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receiver, struct chiaki_session_t *session, ChiakiPacketStats *packet_stats);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_video_receiver_init(ChiakiVideoReceiver *video_receiver, struct chiaki_session_t *session, ChiakiPacketStats *packet_stats);
 CHIAKI_EXPORT void chiaki_video_receiver_fini(ChiakiVideoReceiver *video_receiver);
 
 /**
@@ -49,12 +112,24 @@ CHIAKI_EXPORT void chiaki_video_receiver_stream_info(ChiakiVideoReceiver *video_
 
 CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_receiver, ChiakiTakionAVPacket *packet);
 
+/**
+ * Flush frames whose deadline has passed, trying FEC with the units that arrived or reporting them as corrupt.
+ * Called for every AV packet, so audio packets keep checking while no video arrives.
+ *
+ * @param now_us monotonic time, as for the latency stamps
+ */
+CHIAKI_EXPORT void chiaki_video_receiver_check_deadlines(ChiakiVideoReceiver *video_receiver, uint64_t now_us);
+
 static inline ChiakiVideoReceiver *chiaki_video_receiver_new(struct chiaki_session_t *session, ChiakiPacketStats *packet_stats)
 {
 	ChiakiVideoReceiver *video_receiver = CHIAKI_NEW(ChiakiVideoReceiver);
 	if(!video_receiver)
 		return NULL;
-	chiaki_video_receiver_init(video_receiver, session, packet_stats);
+	if(chiaki_video_receiver_init(video_receiver, session, packet_stats) != CHIAKI_ERR_SUCCESS)
+	{
+		free(video_receiver);
+		return NULL;
+	}
 	return video_receiver;
 }
 
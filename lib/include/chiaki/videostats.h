@@ -0,0 +1,55 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_VIDEOSTATS_H
+#define CHIAKI_VIDEOSTATS_H
+
+#include "common.h"
+#include "thread.h"
+#include "frameprocessor.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Totals since the session started
+ */
+typedef struct chiaki_video_stats_counters_t
+{
+	uint64_t frames; // flushed frames, including failed ones
+	uint64_t frames_fec_recovered; // frames that could only be completed with FEC
+	uint64_t frames_failed; // frames that could not be completed, even with FEC
+	uint64_t ref_frame_misses; // P frames whose reference frame was not available
+	uint64_t ref_frame_retargets; // of these, frames changed to reference an older frame instead
+	uint64_t bitrate; // in bit/s, measured over the last connection quality interval
+} ChiakiVideoStatsCounters;
+
+/**
+ * Video receiver counters that can be read from any thread while streaming, e.g. for an overlay.
+ */
+typedef struct chiaki_video_stats_t
+{
+	ChiakiMutex mutex;
+	ChiakiVideoStatsCounters counters;
+	ChiakiStreamStats stream; // of all completed frames since the session started
+} ChiakiVideoStats;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_video_stats_init(ChiakiVideoStats *stats);
+CHIAKI_EXPORT void chiaki_video_stats_fini(ChiakiVideoStats *stats);
+
+CHIAKI_EXPORT void chiaki_video_stats_flush(ChiakiVideoStats *stats, ChiakiFrameProcessorFlushResult result);
+CHIAKI_EXPORT void chiaki_video_stats_ref_frame_miss(ChiakiVideoStats *stats, bool retargeted);
+CHIAKI_EXPORT void chiaki_video_stats_set_bitrate(ChiakiVideoStats *stats, uint64_t bitrate);
+CHIAKI_EXPORT void chiaki_video_stats_frame(ChiakiVideoStats *stats, uint64_t size, ChiakiBitstreamSliceType slice_type, uint64_t now_us);
+
+CHIAKI_EXPORT void chiaki_video_stats_get(ChiakiVideoStats *stats, ChiakiVideoStatsCounters *counters);
+CHIAKI_EXPORT void chiaki_video_stats_get_stream(ChiakiVideoStats *stats, uint64_t now_us, ChiakiStreamStatsSnapshot *snapshot);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_VIDEOSTATS_H
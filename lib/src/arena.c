@@ -0,0 +1,309 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/arena.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#define ARENA_ALIGN 16
+#define ARENA_ALIGN_UP(x) (((x) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define CLASS_LARGE CHIAKI_ARENA_CLASSES
+
+struct chiaki_arena_block_t
+{
+	ChiakiArenaBlock *prev; // only used for large blocks
+	ChiakiArenaBlock *next; // in the free list or the list of large blocks
+	size_t size; // requested size, the usable size is given by cls
+	uint8_t cls;
+	uint8_t tag;
+};
+
+struct chiaki_arena_chunk_t
+{
+	ChiakiArenaChunk *next;
+};
+
+#define BLOCK_HEADER_SIZE ARENA_ALIGN_UP(sizeof(ChiakiArenaBlock))
+#define CHUNK_HEADER_SIZE ARENA_ALIGN_UP(sizeof(ChiakiArenaChunk))
+#define CHUNK_DATA_SIZE (CHIAKI_ARENA_CHUNK_SIZE - CHUNK_HEADER_SIZE)
+
+#define BLOCK_DATA(block) ((uint8_t *)(block) + BLOCK_HEADER_SIZE)
+#define DATA_BLOCK(ptr) ((ChiakiArenaBlock *)((uint8_t *)(ptr) - BLOCK_HEADER_SIZE))
+
+static inline size_t class_size(unsigned int cls)
+{
+	return (size_t)1 << (cls + CHIAKI_ARENA_CLASS_MIN_EXP);
+}
+
+static unsigned int size_class(size_t size)
+{
+	unsigned int cls = 0;
+	while(cls < CHIAKI_ARENA_CLASSES && class_size(cls) < size)
+		cls++;
+	return cls;
+}
+
+CHIAKI_EXPORT const char *chiaki_arena_tag_string(ChiakiArenaTag tag)
+{
+	switch(tag)
+	{
+		case CHIAKI_ARENA_TAG_VIDEO:
+			return "video";
+		case CHIAKI_ARENA_TAG_CTRL:
+			return "ctrl";
+		case CHIAKI_ARENA_TAG_TAKION:
+			return "takion";
+		case CHIAKI_ARENA_TAG_RUDP:
+			return "rudp";
+		default:
+			return "unknown";
+	}
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_arena_init(ChiakiArena *arena, ChiakiLog *log)
+{
+	arena->log = log;
+	arena->chunks = NULL;
+	arena->chunk_used = CHUNK_DATA_SIZE;
+	arena->chunks_count = 0;
+	memset(arena->free_lists, 0, sizeof(arena->free_lists));
+	arena->large = NULL;
+	memset(arena->stats, 0, sizeof(arena->stats));
+	arena->reserved = 0;
+	arena->reserved_peak = 0;
+	return chiaki_mutex_init(&arena->mutex, false);
+}
+
+CHIAKI_EXPORT void chiaki_arena_fini(ChiakiArena *arena)
+{
+	for(size_t i=0; i<CHIAKI_ARENA_TAG_COUNT; i++)
+	{
+		if(arena->stats[i].current)
+			CHIAKI_LOGW(arena->log, "Arena still had %llu bytes allocated for %s when releasing",
+					(unsigned long long)arena->stats[i].current, chiaki_arena_tag_string((ChiakiArenaTag)i));
+	}
+
+	while(arena->large)
+	{
+		ChiakiArenaBlock *next = arena->large->next;
+		free(arena->large);
+		arena->large = next;
+	}
+
+	while(arena->chunks)
+	{
+		ChiakiArenaChunk *next = arena->chunks->next;
+		free(arena->chunks);
+		arena->chunks = next;
+	}
+
+	chiaki_mutex_fini(&arena->mutex);
+}
+
+/**
+ * Must be called with the mutex locked.
+ */
+static void reserved_add(ChiakiArena *arena, size_t size)
+{
+	arena->reserved += size;
+	if(arena->reserved > arena->reserved_peak)
+		arena->reserved_peak = arena->reserved;
+}
+
+/**
+ * Must be called with the mutex locked.
+ */
+static void free_list_push(ChiakiArena *arena, ChiakiArenaBlock *block)
+{
+	block->next = arena->free_lists[block->cls];
+	arena->free_lists[block->cls] = block;
+}
+
+/**
+ * Take a new block of cls from the current chunk, starting a new chunk if it is used up.
+ * Must be called with the mutex locked.
+ */
+static ChiakiArenaBlock *chunk_carve(ChiakiArena *arena, unsigned int cls)
+{
+	size_t block_size = BLOCK_HEADER_SIZE + class_size(cls);
+	if(CHUNK_DATA_SIZE - arena->chunk_used < block_size)
+	{
+		ChiakiArenaChunk *chunk = malloc(CHIAKI_ARENA_CHUNK_SIZE);
+		if(!chunk)
+			return NULL;
+
+		// hand out the rest of the old chunk as smaller blocks instead of wasting it
+		while(arena->chunks)
+		{
+			size_t left = CHUNK_DATA_SIZE - arena->chunk_used;
+			unsigned int c = CHIAKI_ARENA_CLASSES;
+			while(c > 0 && BLOCK_HEADER_SIZE + class_size(c - 1) > left)
+				c--;
+			if(!c)
+				break;
+			ChiakiArenaBlock *rest = (ChiakiArenaBlock *)((uint8_t *)arena->chunks + CHUNK_HEADER_SIZE + arena->chunk_used);
+			rest->cls = (uint8_t)(c - 1);
+			free_list_push(arena, rest);
+			arena->chunk_used += BLOCK_HEADER_SIZE + class_size(c - 1);
+		}
+
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		arena->chunk_used = 0;
+		arena->chunks_count++;
+		reserved_add(arena, CHIAKI_ARENA_CHUNK_SIZE);
+	}
+
+	ChiakiArenaBlock *block = (ChiakiArenaBlock *)((uint8_t *)arena->chunks + CHUNK_HEADER_SIZE + arena->chunk_used);
+	arena->chunk_used += block_size;
+	block->cls = (uint8_t)cls;
+	return block;
+}
+
+/**
+ * Must be called with the mutex locked.
+ */
+static void stats_add(ChiakiArena *arena, ChiakiArenaTag tag, size_t size)
+{
+	ChiakiArenaStats *stats = &arena->stats[tag];
+	stats->current += size;
+	if(stats->current > stats->peak)
+		stats->peak = stats->current;
+	stats->allocs++;
+}
+
+CHIAKI_EXPORT void *chiaki_arena_alloc(ChiakiArena *arena, ChiakiArenaTag tag, size_t size)
+{
+	if(!arena)
+		return malloc(size);
+	if(tag >= CHIAKI_ARENA_TAG_COUNT || size > SIZE_MAX - BLOCK_HEADER_SIZE)
+		return NULL;
+
+	unsigned int cls = size_class(size);
+	ChiakiArenaBlock *block;
+	chiaki_mutex_lock(&arena->mutex);
+	if(cls == CLASS_LARGE)
+	{
+		block = malloc(BLOCK_HEADER_SIZE + size);
+		if(!block)
+			goto beach;
+		block->cls = CLASS_LARGE;
+		block->prev = NULL;
+		block->next = arena->large;
+		if(arena->large)
+			arena->large->prev = block;
+		arena->large = block;
+		reserved_add(arena, BLOCK_HEADER_SIZE + size);
+	}
+	else if(arena->free_lists[cls])
+	{
+		block = arena->free_lists[cls];
+		arena->free_lists[cls] = block->next;
+	}
+	else
+	{
+		block = chunk_carve(arena, cls);
+		if(!block)
+			goto beach;
+	}
+
+	block->size = size;
+	block->tag = (uint8_t)tag;
+	stats_add(arena, tag, size);
+beach:
+	chiaki_mutex_unlock(&arena->mutex);
+	return block ? BLOCK_DATA(block) : NULL;
+}
+
+CHIAKI_EXPORT void chiaki_arena_free(ChiakiArena *arena, void *ptr)
+{
+	if(!arena)
+	{
+		free(ptr);
+		return;
+	}
+	if(!ptr)
+		return;
+
+	ChiakiArenaBlock *block = DATA_BLOCK(ptr);
+	chiaki_mutex_lock(&arena->mutex);
+	arena->stats[block->tag].current -= block->size;
+	arena->stats[block->tag].frees++;
+	if(block->cls == CLASS_LARGE)
+	{
+		arena->reserved -= BLOCK_HEADER_SIZE + block->size;
+		if(block->prev)
+			block->prev->next = block->next;
+		else
+			arena->large = block->next;
+		if(block->next)
+			block->next->prev = block->prev;
+		free(block);
+	}
+	else
+		free_list_push(arena, block);
+	chiaki_mutex_unlock(&arena->mutex);
+}
+
+CHIAKI_EXPORT void *chiaki_arena_realloc(ChiakiArena *arena, ChiakiArenaTag tag, void *ptr, size_t size)
+{
+	if(!arena)
+		return realloc(ptr, size);
+	if(!ptr)
+		return chiaki_arena_alloc(arena, tag, size);
+
+	ChiakiArenaBlock *block = DATA_BLOCK(ptr);
+	if(block->cls != CLASS_LARGE && size <= class_size(block->cls))
+	{
+		chiaki_mutex_lock(&arena->mutex);
+		ChiakiArenaStats *stats = &arena->stats[block->tag];
+		stats->current = stats->current - block->size + size;
+		if(stats->current > stats->peak)
+			stats->peak = stats->current;
+		block->size = size;
+		chiaki_mutex_unlock(&arena->mutex);
+		return ptr;
+	}
+
+	void *r = chiaki_arena_alloc(arena, (ChiakiArenaTag)block->tag, size);
+	if(!r)
+		return NULL;
+	memcpy(r, ptr, block->size < size ? block->size : size);
+	chiaki_arena_free(arena, ptr);
+	return r;
+}
+
+CHIAKI_EXPORT void chiaki_arena_get_stats(ChiakiArena *arena, ChiakiArenaTag tag, ChiakiArenaStats *stats)
+{
+	chiaki_mutex_lock(&arena->mutex);
+	*stats = arena->stats[tag];
+	chiaki_mutex_unlock(&arena->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_arena_get_usage(ChiakiArena *arena, ChiakiArenaUsage *usage)
+{
+	chiaki_mutex_lock(&arena->mutex);
+	memcpy(usage->tags, arena->stats, sizeof(usage->tags));
+	usage->reserved = arena->reserved;
+	usage->reserved_peak = arena->reserved_peak;
+	chiaki_mutex_unlock(&arena->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_arena_log(ChiakiArena *arena)
+{
+	chiaki_mutex_lock(&arena->mutex);
+	CHIAKI_LOGI(arena->log, "Arena used %llu chunks of %llu bytes, reserved peak %llu bytes",
+			(unsigned long long)arena->chunks_count, (unsigned long long)CHIAKI_ARENA_CHUNK_SIZE,
+			(unsigned long long)arena->reserved_peak);
+	for(size_t i=0; i<CHIAKI_ARENA_TAG_COUNT; i++)
+	{
+		ChiakiArenaStats *stats = &arena->stats[i];
+		if(!stats->allocs)
+			continue;
+		CHIAKI_LOGI(arena->log, "Arena %s: %llu allocs, %llu frees, peak %llu bytes, current %llu bytes",
+				chiaki_arena_tag_string((ChiakiArenaTag)i), (unsigned long long)stats->allocs, (unsigned long long)stats->frees,
+				(unsigned long long)stats->peak, (unsigned long long)stats->current);
+	}
+	chiaki_mutex_unlock(&arena->mutex);
+}
@@ -0,0 +1,211 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/audiodecodequeue.h>
+#include <chiaki/time.h>
+
+#include <string.h>
+
+static void *audio_decode_queue_thread_func(void *user);
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_audio_decode_queue_init(ChiakiAudioDecodeQueue *queue, ChiakiLog *log)
+{
+	queue->log = log;
+	memset(&queue->sink, 0, sizeof(queue->sink));
+	queue->running = false;
+	queue->waiting = 0;
+	queue->should_stop = false;
+	queue->frames_lost_pending = 0;
+	queue->frames_dropped = 0;
+	queue->frames = 0;
+	queue->decode_us_sum = 0;
+	queue->decode_us_max = 0;
+	queue->depth = 0;
+	queue->depth_max = 0;
+
+	ChiakiErrorCode err = chiaki_spsc_ring_init(&queue->ring, CHIAKI_AUDIO_DECODE_QUEUE_SIZE_EXP, sizeof(ChiakiAudioDecodeQueueEntry));
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	err = chiaki_mutex_init(&queue->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_ring;
+
+	err = chiaki_cond_init(&queue->cond, &queue->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	return CHIAKI_ERR_SUCCESS;
+error_mutex:
+	chiaki_mutex_fini(&queue->mutex);
+error_ring:
+	chiaki_spsc_ring_fini(&queue->ring);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_audio_decode_queue_fini(ChiakiAudioDecodeQueue *queue)
+{
+	chiaki_audio_decode_queue_stop(queue);
+	chiaki_cond_fini(&queue->cond);
+	chiaki_mutex_fini(&queue->mutex);
+	chiaki_spsc_ring_fini(&queue->ring);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_audio_decode_queue_start(ChiakiAudioDecodeQueue *queue, ChiakiAudioSink *sink)
+{
+	if(queue->running)
+		return CHIAKI_ERR_INVALID_DATA;
+	queue->sink = *sink;
+	queue->should_stop = false;
+	queue->frames_lost_pending = 0;
+
+	ChiakiErrorCode err = chiaki_thread_create_role(&queue->thread, audio_decode_queue_thread_func, queue, CHIAKI_THREAD_ROLE_AUDIO_DECODE);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	queue->running = true;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_audio_decode_queue_stop(ChiakiAudioDecodeQueue *queue)
+{
+	if(!queue->running)
+		return;
+
+	chiaki_mutex_lock(&queue->mutex);
+	queue->should_stop = true;
+	chiaki_cond_signal(&queue->cond);
+	chiaki_mutex_unlock(&queue->mutex);
+	chiaki_thread_join(&queue->thread, NULL);
+	queue->running = false;
+
+	ChiakiAudioDecodeQueueEntry entry;
+	while(chiaki_spsc_ring_pop(&queue->ring, &entry));
+
+	ChiakiAudioDecodeQueueStats stats;
+	chiaki_audio_decode_queue_get_stats(queue, &stats);
+	CHIAKI_LOGI(queue->log, "Audio Decode Queue passed on %llu frames, dropped %llu, max depth %llu/%llu, decode avg %.2f max %.2f ms",
+			(unsigned long long)stats.frames, (unsigned long long)stats.frames_dropped,
+			(unsigned long long)stats.depth_max, (unsigned long long)chiaki_spsc_ring_size(&queue->ring),
+			stats.decode_us_avg / 1000.0, stats.decode_us_max / 1000.0);
+}
+
+static void queue_push(ChiakiAudioDecodeQueue *queue, ChiakiAudioDecodeQueueEntry *entry)
+{
+	if(!chiaki_spsc_ring_push(&queue->ring, entry))
+	{
+		if(entry->is_header)
+			CHIAKI_LOGE(queue->log, "Audio Decode Queue is full, dropping header");
+		else
+		{
+			queue->frames_lost_pending = entry->frames_lost + 1;
+			chiaki_atomic_fetch_add(&queue->frames_dropped, 1);
+		}
+		return;
+	}
+	if(!entry->is_header)
+		queue->frames_lost_pending = 0;
+
+	// pairs with the fence in queue_pop(), so either we see the thread waiting or it sees our entry
+	chiaki_atomic_fence_seq_cst();
+	if(chiaki_atomic_load_seq_cst(&queue->waiting))
+	{
+		chiaki_mutex_lock(&queue->mutex);
+		chiaki_cond_signal(&queue->cond);
+		chiaki_mutex_unlock(&queue->mutex);
+	}
+}
+
+CHIAKI_EXPORT void chiaki_audio_decode_queue_push_header(ChiakiAudioDecodeQueue *queue, ChiakiAudioHeader *header)
+{
+	ChiakiAudioDecodeQueueEntry entry;
+	entry.is_header = true;
+	entry.header = *header;
+	entry.frames_lost = 0; // stays pending for the next frame
+	entry.buf_size = 0;
+	queue_push(queue, &entry);
+}
+
+CHIAKI_EXPORT void chiaki_audio_decode_queue_push_frame(ChiakiAudioDecodeQueue *queue, uint8_t *buf, size_t buf_size, unsigned int frames_lost)
+{
+	ChiakiAudioDecodeQueueEntry entry;
+	entry.frames_lost = queue->frames_lost_pending + frames_lost;
+	if(buf_size > sizeof(entry.buf))
+	{
+		CHIAKI_LOGE(queue->log, "Audio Decode Queue got a frame of %llu bytes, which is too big", (unsigned long long)buf_size);
+		queue->frames_lost_pending = entry.frames_lost + 1;
+		return;
+	}
+	entry.is_header = false;
+	entry.buf_size = buf_size;
+	memcpy(entry.buf, buf, buf_size);
+	queue_push(queue, &entry);
+}
+
+/**
+ * Pop the next entry, waiting until one is available.
+ *
+ * @return false if the queue should stop
+ */
+static bool queue_pop(ChiakiAudioDecodeQueue *queue, ChiakiAudioDecodeQueueEntry *entry)
+{
+	if(chiaki_spsc_ring_pop(&queue->ring, entry))
+		return true;
+
+	chiaki_mutex_lock(&queue->mutex);
+	chiaki_atomic_store_seq_cst(&queue->waiting, 1);
+	chiaki_atomic_fence_seq_cst();
+	while(!queue->should_stop && !chiaki_spsc_ring_pop(&queue->ring, entry))
+		chiaki_cond_wait(&queue->cond, &queue->mutex);
+	chiaki_atomic_store_seq_cst(&queue->waiting, 0);
+	bool r = !queue->should_stop;
+	chiaki_mutex_unlock(&queue->mutex);
+	return r;
+}
+
+static void *audio_decode_queue_thread_func(void *user)
+{
+	ChiakiAudioDecodeQueue *queue = user;
+	ChiakiAudioDecodeQueueEntry entry;
+	while(queue_pop(queue, &entry))
+	{
+		size_t depth = chiaki_spsc_ring_count(&queue->ring) + 1;
+
+		if(entry.is_header)
+		{
+			if(queue->sink.header_cb)
+				queue->sink.header_cb(&entry.header, queue->sink.user);
+			continue;
+		}
+
+		if(entry.frames_lost && queue->sink.frames_lost_cb)
+			queue->sink.frames_lost_cb(entry.frames_lost, queue->sink.user);
+
+		uint64_t start_us = chiaki_time_now_monotonic_us();
+		if(queue->sink.frame_cb)
+			queue->sink.frame_cb(entry.buf, entry.buf_size, queue->sink.user);
+		uint64_t decode_us = chiaki_time_now_monotonic_us() - start_us;
+
+		chiaki_mutex_lock(&queue->mutex);
+		queue->frames++;
+		queue->decode_us_sum += decode_us;
+		if(decode_us > queue->decode_us_max)
+			queue->decode_us_max = decode_us;
+		queue->depth = depth;
+		if(depth > queue->depth_max)
+			queue->depth_max = depth;
+		chiaki_mutex_unlock(&queue->mutex);
+	}
+	return NULL;
+}
+
+CHIAKI_EXPORT void chiaki_audio_decode_queue_get_stats(ChiakiAudioDecodeQueue *queue, ChiakiAudioDecodeQueueStats *stats)
+{
+	chiaki_mutex_lock(&queue->mutex);
+	stats->frames = queue->frames;
+	stats->frames_dropped = chiaki_atomic_load_acquire(&queue->frames_dropped);
+	stats->depth = queue->depth;
+	stats->depth_max = queue->depth_max;
+	stats->decode_us_avg = queue->frames ? queue->decode_us_sum / queue->frames : 0;
+	stats->decode_us_max = queue->decode_us_max;
+	chiaki_mutex_unlock(&queue->mutex);
+}
@@ -1,7 +1,10 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
 #include <chiaki/audioreceiver.h>
+#include <chiaki/audiodecodequeue.h>
 #include <chiaki/session.h>
+#include <chiaki/atomic.h>
+#include <chiaki/time.h>
 
 #include <string.h>
 
@@ -12,13 +15,20 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_audio_receiver_init(ChiakiAudioReceiver *au
 	audio_receiver->session = session;
 	audio_receiver->log = session->log;
 	audio_receiver->packet_stats = packet_stats;
+	audio_receiver->decode_queue = session->audio_decode_queue.running ? &session->audio_decode_queue : NULL;
 
 	audio_receiver->frame_index_prev = 0;
 	audio_receiver->frame_index_startup = true;
+	audio_receiver->frame_index_valid = false;
+	audio_receiver->frames_lost = 0;
+	audio_receiver->frames_reordered = 0;
+	memset(audio_receiver->reorder, 0, sizeof(audio_receiver->reorder));
+	audio_receiver->reorder_count = 0;
 
 	ChiakiErrorCode err = chiaki_mutex_init(&audio_receiver->mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
+	chiaki_mutex_set_name(&audio_receiver->mutex, "audio receiver");
 
 	return CHIAKI_ERR_SUCCESS;
 }
@@ -28,6 +38,10 @@ CHIAKI_EXPORT void chiaki_audio_receiver_fini(ChiakiAudioReceiver *audio_receive
 #ifdef CHIAKI_LIB_ENABLE_OPUS
 	opus_decoder_destroy(audio_receiver->opus_decoder);
 #endif
+	if(audio_receiver->frames_lost)
+		CHIAKI_LOGI(audio_receiver->log, "Audio Receiver lost %llu frames", (unsigned long long)audio_receiver->frames_lost);
+	if(audio_receiver->frames_reordered)
+		CHIAKI_LOGI(audio_receiver->log, "Audio Receiver played %llu frames that arrived out of order", (unsigned long long)audio_receiver->frames_reordered);
 	chiaki_mutex_fini(&audio_receiver->mutex);
 }
 
@@ -42,7 +56,11 @@ CHIAKI_EXPORT void chiaki_audio_receiver_stream_info(ChiakiAudioReceiver *audio_
 	CHIAKI_LOGI(audio_receiver->log, "  frame size = %d", audio_header->frame_size);
 	CHIAKI_LOGI(audio_receiver->log, "  unknown = %d", audio_header->unknown);
 
-	if(audio_receiver->session->audio_sink.header_cb)
+	if(audio_receiver->session->connect_info.recorder)
+		chiaki_recorder_audio_header(audio_receiver->session->connect_info.recorder, audio_header);
+	if(audio_receiver->decode_queue)
+		chiaki_audio_decode_queue_push_header(audio_receiver->decode_queue, audio_header);
+	else if(audio_receiver->session->audio_sink.header_cb)
 		audio_receiver->session->audio_sink.header_cb(audio_header, audio_receiver->session->audio_sink.user);
 
 	chiaki_mutex_unlock(&audio_receiver->mutex);
@@ -109,19 +127,169 @@ CHIAKI_EXPORT void chiaki_audio_receiver_av_packet(ChiakiAudioReceiver *audio_re
 		chiaki_packet_stats_push_seq(audio_receiver->packet_stats, packet->frame_index);
 }
 
-static void chiaki_audio_receiver_frame(ChiakiAudioReceiver *audio_receiver, ChiakiSeqNum16 frame_index, bool is_haptics, uint8_t *buf, size_t buf_size)
+/**
+ * Pass on a frame after frame_index_prev, counting the ones in between as lost.
+ * Must be called with the mutex locked.
+ */
+static void audio_receiver_deliver(ChiakiAudioReceiver *audio_receiver, ChiakiSeqNum16 frame_index, bool is_haptics, uint8_t *buf, size_t buf_size)
 {
-	chiaki_mutex_lock(&audio_receiver->mutex);
-
-	if(!chiaki_seq_num_16_gt(frame_index, audio_receiver->frame_index_prev))
-		goto beach;
+	unsigned int frames_lost = 0;
+	if(audio_receiver->frame_index_valid)
+	{
+		// haptics share the frame indices, but a lost frame can't be told apart, so treat it as audio
+		frames_lost = (ChiakiSeqNum16)(frame_index - audio_receiver->frame_index_prev - 1);
+		audio_receiver->frames_lost += frames_lost;
+	}
 	audio_receiver->frame_index_prev = frame_index;
+	audio_receiver->frame_index_valid = true;
+
+	if(!is_haptics && audio_receiver->session->connect_info.recorder)
+		chiaki_recorder_audio(audio_receiver->session->connect_info.recorder, buf, buf_size);
+
+	if(!is_haptics && audio_receiver->decode_queue)
+	{
+		chiaki_audio_decode_queue_push_frame(audio_receiver->decode_queue, buf, buf_size, frames_lost);
+		return;
+	}
+
+	if(frames_lost && !is_haptics && audio_receiver->session->audio_sink.frames_lost_cb)
+		audio_receiver->session->audio_sink.frames_lost_cb(frames_lost, audio_receiver->session->audio_sink.user);
 
 	if(is_haptics && audio_receiver->session->haptics_sink.frame_cb)
 		audio_receiver->session->haptics_sink.frame_cb(buf, buf_size, audio_receiver->session->haptics_sink.user);
 	else if(!is_haptics && audio_receiver->session->audio_sink.frame_cb)
 		audio_receiver->session->audio_sink.frame_cb(buf, buf_size, audio_receiver->session->audio_sink.user);
+}
+
+/**
+ * @return index of the held back frame closest after frame_index_prev, reorder_count must not be 0
+ */
+static size_t audio_receiver_reorder_oldest(ChiakiAudioReceiver *audio_receiver)
+{
+	size_t oldest = CHIAKI_AUDIO_RECEIVER_REORDER_FRAMES;
+	ChiakiSeqNum16 oldest_dist = 0;
+	for(size_t i=0; i<CHIAKI_AUDIO_RECEIVER_REORDER_FRAMES; i++)
+	{
+		ChiakiAudioReceiverReorderEntry *entry = &audio_receiver->reorder[i];
+		if(!entry->used)
+			continue;
+		ChiakiSeqNum16 dist = (ChiakiSeqNum16)(entry->frame_index - audio_receiver->frame_index_prev);
+		if(oldest == CHIAKI_AUDIO_RECEIVER_REORDER_FRAMES || dist < oldest_dist)
+		{
+			oldest = i;
+			oldest_dist = dist;
+		}
+	}
+	return oldest;
+}
+
+static void audio_receiver_reorder_deliver(ChiakiAudioReceiver *audio_receiver, size_t index)
+{
+	ChiakiAudioReceiverReorderEntry *entry = &audio_receiver->reorder[index];
+	entry->used = false;
+	audio_receiver->reorder_count--;
+	audio_receiver_deliver(audio_receiver, entry->frame_index, entry->is_haptics, entry->buf, entry->buf_size);
+}
+
+/**
+ * Pass on held back frames that are next in line, and the ones held back for longer than deadline_us
+ * together with the gaps before them.
+ */
+static void audio_receiver_reorder_flush(ChiakiAudioReceiver *audio_receiver, uint64_t now_us, uint64_t deadline_us)
+{
+	while(audio_receiver->reorder_count)
+	{
+		size_t oldest = audio_receiver_reorder_oldest(audio_receiver);
+		ChiakiAudioReceiverReorderEntry *entry = &audio_receiver->reorder[oldest];
+		if(entry->frame_index != (ChiakiSeqNum16)(audio_receiver->frame_index_prev + 1)
+				&& now_us - entry->arrival_us < deadline_us)
+			break;
+		audio_receiver_reorder_deliver(audio_receiver, oldest);
+	}
+}
+
+/**
+ * Pass on all held back frames before frame_index, whether their gaps have been filled or not.
+ */
+static void audio_receiver_reorder_flush_before(ChiakiAudioReceiver *audio_receiver, ChiakiSeqNum16 frame_index)
+{
+	while(audio_receiver->reorder_count)
+	{
+		size_t oldest = audio_receiver_reorder_oldest(audio_receiver);
+		if(!chiaki_seq_num_16_lt(audio_receiver->reorder[oldest].frame_index, frame_index))
+			break;
+		audio_receiver_reorder_deliver(audio_receiver, oldest);
+	}
+}
+
+static void chiaki_audio_receiver_frame(ChiakiAudioReceiver *audio_receiver, ChiakiSeqNum16 frame_index, bool is_haptics, uint8_t *buf, size_t buf_size)
+{
+	chiaki_mutex_lock(&audio_receiver->mutex);
+
+	if(!chiaki_seq_num_16_gt(frame_index, audio_receiver->frame_index_prev))
+		goto beach;
+
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	uint64_t deadline_us = chiaki_atomic_load_acquire(&audio_receiver->session->audio_reorder_deadline_us);
+
+	ChiakiSeqNum16 dist = (ChiakiSeqNum16)(frame_index - audio_receiver->frame_index_prev);
+	bool reordered = false;
+	for(size_t i=0; i<CHIAKI_AUDIO_RECEIVER_REORDER_FRAMES; i++)
+	{
+		ChiakiAudioReceiverReorderEntry *entry = &audio_receiver->reorder[i];
+		if(!entry->used)
+			continue;
+		if(entry->frame_index == frame_index)
+			goto flush; // e.g. again from the fec units of a later packet
+		if((ChiakiSeqNum16)(entry->frame_index - audio_receiver->frame_index_prev) > dist)
+			reordered = true;
+	}
+	if(reordered)
+		audio_receiver->frames_reordered++;
+
+	if(!audio_receiver->frame_index_valid || dist == 1)
+	{
+		// anything held back is after this one, so it stays in order
+		audio_receiver_deliver(audio_receiver, frame_index, is_haptics, buf, buf_size);
+		goto flush;
+	}
+
+	if(!deadline_us || buf_size > CHIAKI_AUDIO_RECEIVER_REORDER_BUF_SIZE)
+	{
+		audio_receiver_reorder_flush_before(audio_receiver, frame_index);
+		audio_receiver_deliver(audio_receiver, frame_index, is_haptics, buf, buf_size);
+		goto flush;
+	}
+
+	if(audio_receiver->reorder_count == CHIAKI_AUDIO_RECEIVER_REORDER_FRAMES)
+	{
+		// the window is full, so give up on the gap before the oldest frame, which may be this one
+		size_t oldest = audio_receiver_reorder_oldest(audio_receiver);
+		if(chiaki_seq_num_16_lt(frame_index, audio_receiver->reorder[oldest].frame_index))
+		{
+			audio_receiver_deliver(audio_receiver, frame_index, is_haptics, buf, buf_size);
+			goto flush;
+		}
+		audio_receiver_reorder_deliver(audio_receiver, oldest);
+	}
+
+	for(size_t i=0; i<CHIAKI_AUDIO_RECEIVER_REORDER_FRAMES; i++)
+	{
+		ChiakiAudioReceiverReorderEntry *entry = &audio_receiver->reorder[i];
+		if(entry->used)
+			continue;
+		entry->used = true;
+		entry->is_haptics = is_haptics;
+		entry->frame_index = frame_index;
+		entry->arrival_us = now_us;
+		entry->buf_size = buf_size;
+		memcpy(entry->buf, buf, buf_size);
+		audio_receiver->reorder_count++;
+		break;
+	}
 
+flush:
+	audio_receiver_reorder_flush(audio_receiver, now_us, deadline_us);
 beach:
 	chiaki_mutex_unlock(&audio_receiver->mutex);
 }
@@ -0,0 +1,111 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/avsync.h>
+
+// exponential moving averages, video is reported for every frame, audio much less often
+#define VIDEO_AVG_SHIFT 4
+#define AUDIO_AVG_SHIFT 1
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_av_sync_init(ChiakiAVSync *sync, uint64_t max_offset_us)
+{
+	sync->max_offset_us = max_offset_us;
+	sync->video_latency_avg_us = 0;
+	sync->video_samples = 0;
+	sync->audio_latency_avg_us = 0;
+	sync->audio_samples = 0;
+	sync->audio_delay_us = 0;
+	sync->video_delay_us = 0;
+	return chiaki_mutex_init(&sync->mutex, false);
+}
+
+CHIAKI_EXPORT void chiaki_av_sync_fini(ChiakiAVSync *sync)
+{
+	chiaki_mutex_fini(&sync->mutex);
+}
+
+static uint64_t avg_add(uint64_t avg, uint64_t samples, uint64_t value, unsigned int shift)
+{
+	if(!samples)
+		return value;
+	return (uint64_t)((int64_t)avg + ((int64_t)value - (int64_t)avg) / ((int64_t)1 << shift));
+}
+
+CHIAKI_EXPORT void chiaki_av_sync_video_latency(ChiakiAVSync *sync, uint64_t latency_us)
+{
+	chiaki_mutex_lock(&sync->mutex);
+	sync->video_latency_avg_us = avg_add(sync->video_latency_avg_us, sync->video_samples, latency_us, VIDEO_AVG_SHIFT);
+	sync->video_samples++;
+	chiaki_mutex_unlock(&sync->mutex);
+}
+
+static uint64_t delay_shrink(uint64_t *delay, uint64_t by)
+{
+	if(by > *delay)
+		by = *delay;
+	*delay -= by;
+	return by;
+}
+
+static void delay_grow(uint64_t *delay, uint64_t by)
+{
+	*delay += by;
+	if(*delay > CHIAKI_AV_SYNC_DELAY_MAX_US)
+		*delay = CHIAKI_AV_SYNC_DELAY_MAX_US;
+}
+
+/**
+ * Move the delays halfway to where they would bring the offset back within the bound,
+ * since the averages only follow them with some lag. Must be called with the mutex locked.
+ */
+static void steer(ChiakiAVSync *sync)
+{
+	if(!sync->max_offset_us
+			|| sync->video_samples < CHIAKI_AV_SYNC_VIDEO_SAMPLES_MIN
+			|| sync->audio_samples < CHIAKI_AV_SYNC_AUDIO_SAMPLES_MIN)
+		return;
+
+	int64_t bound = (int64_t)sync->max_offset_us;
+	int64_t offset = (int64_t)sync->audio_latency_avg_us - (int64_t)sync->video_latency_avg_us;
+	if(offset > bound)
+	{
+		// audio late: take away audio delay first, only then hold video back
+		uint64_t excess = (uint64_t)(offset - bound + 1) / 2;
+		excess -= delay_shrink(&sync->audio_delay_us, excess);
+		delay_grow(&sync->video_delay_us, excess);
+	}
+	else if(offset < -bound)
+	{
+		uint64_t excess = (uint64_t)(-bound - offset + 1) / 2;
+		excess -= delay_shrink(&sync->video_delay_us, excess);
+		delay_grow(&sync->audio_delay_us, excess);
+	}
+	else
+	{
+		// within the bound: give back delay as long as a quarter of the bound is left as hysteresis
+		int64_t hysteresis = bound / 4;
+		if(sync->video_delay_us && bound - offset > hysteresis)
+			delay_shrink(&sync->video_delay_us, (uint64_t)(bound - offset - hysteresis) / 2);
+		if(sync->audio_delay_us && offset + bound > hysteresis)
+			delay_shrink(&sync->audio_delay_us, (uint64_t)(offset + bound - hysteresis) / 2);
+	}
+}
+
+CHIAKI_EXPORT void chiaki_av_sync_audio_latency(ChiakiAVSync *sync, uint64_t latency_us)
+{
+	chiaki_mutex_lock(&sync->mutex);
+	sync->audio_latency_avg_us = avg_add(sync->audio_latency_avg_us, sync->audio_samples, latency_us, AUDIO_AVG_SHIFT);
+	sync->audio_samples++;
+	steer(sync);
+	chiaki_mutex_unlock(&sync->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_av_sync_get(ChiakiAVSync *sync, ChiakiAVSyncState *state)
+{
+	chiaki_mutex_lock(&sync->mutex);
+	state->video_latency_us = sync->video_latency_avg_us;
+	state->audio_latency_us = sync->audio_latency_avg_us;
+	state->offset_us = (int64_t)sync->audio_latency_avg_us - (int64_t)sync->video_latency_avg_us;
+	state->audio_delay_us = sync->audio_delay_us;
+	state->video_delay_us = sync->video_delay_us;
+	chiaki_mutex_unlock(&sync->mutex);
+}
@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/backlogdetector.h>
+
+#include <string.h>
+
+// the baseline moves by 1/4 of the difference for every frame arriving at the regular pace, so it follows
+// a lasting change of the path delay or a console sending fewer frames than nominal
+#define BASE_GAIN_SHIFT 2
+
+// frames arriving more than this many nominal intervals after the previous one come after a stall, they are late
+// and do not move the baseline
+#define REGULAR_INTERVALS_MAX 4
+
+CHIAKI_EXPORT void chiaki_backlog_detector_init(ChiakiBacklogDetector *detector, ChiakiLog *log,
+		uint64_t frame_interval_us, unsigned int threshold_ms)
+{
+	memset(detector, 0, sizeof(*detector));
+	detector->log = log;
+	detector->frame_interval_us = frame_interval_us;
+	detector->threshold_us = (uint64_t)(threshold_ms ? threshold_ms : CHIAKI_BACKLOG_THRESHOLD_MS_DEFAULT) * 1000;
+}
+
+CHIAKI_EXPORT ChiakiBacklogAction chiaki_backlog_detector_frame(ChiakiBacklogDetector *detector, ChiakiSeqNum16 frame_index,
+		uint64_t arrival_us)
+{
+	if(!detector->frame_interval_us)
+		return CHIAKI_BACKLOG_ACTION_NONE;
+
+	if(!detector->frame_valid)
+	{
+		detector->frame_valid = true;
+		detector->frame_index_prev = frame_index;
+		detector->arrival_prev_us = arrival_us;
+		detector->send_us = 0;
+		detector->base_offset_us = (int64_t)arrival_us;
+		return CHIAKI_BACKLOG_ACTION_NONE;
+	}
+
+	int frames = (int16_t)(frame_index - detector->frame_index_prev);
+	if(frames <= 0)
+		return detector->skipping ? CHIAKI_BACKLOG_ACTION_SKIP : CHIAKI_BACKLOG_ACTION_NONE;
+
+	uint64_t send_delta_us = (uint64_t)frames * detector->frame_interval_us;
+	uint64_t recv_delta_us = arrival_us - detector->arrival_prev_us;
+	bool draining = recv_delta_us < send_delta_us;
+	bool regular = !draining && recv_delta_us <= send_delta_us * REGULAR_INTERVALS_MAX;
+	detector->send_us += send_delta_us;
+	detector->frame_index_prev = frame_index;
+	detector->arrival_prev_us = arrival_us;
+
+	int64_t offset_us = (int64_t)arrival_us - (int64_t)detector->send_us;
+	if(offset_us < detector->base_offset_us)
+		detector->base_offset_us = offset_us;
+	else if(regular)
+		detector->base_offset_us += (offset_us - detector->base_offset_us) >> BASE_GAIN_SHIFT;
+	uint64_t age_us = (uint64_t)(offset_us - detector->base_offset_us);
+
+	if(detector->skipping)
+	{
+		if(arrival_us - detector->skip_start_us >= CHIAKI_BACKLOG_SKIP_MAX_MS * 1000)
+		{
+			CHIAKI_LOGW(detector->log, "Backlog Detector got no keyframe after skipping %llu frames, passing frames on again",
+					(unsigned long long)detector->skipped_cur);
+			detector->skipping = false;
+			detector->stats.timeouts++;
+			detector->holdoff_until_us = arrival_us + CHIAKI_BACKLOG_IDR_RETRY_MS * 1000;
+			return CHIAKI_BACKLOG_ACTION_NONE;
+		}
+		if(arrival_us - detector->idr_requested_us >= CHIAKI_BACKLOG_IDR_RETRY_MS * 1000)
+		{
+			detector->idr_requested_us = arrival_us;
+			detector->stats.idr_requests++;
+			return CHIAKI_BACKLOG_ACTION_SKIP_REQUEST_IDR;
+		}
+		return CHIAKI_BACKLOG_ACTION_SKIP;
+	}
+
+	if(!draining || age_us < detector->threshold_us || arrival_us < detector->holdoff_until_us)
+		return CHIAKI_BACKLOG_ACTION_NONE;
+
+	CHIAKI_LOGW(detector->log, "Backlog Detector: frame %d arrived %llu ms late, skipping until the next keyframe",
+			(int)frame_index, (unsigned long long)(age_us / 1000));
+	detector->skipping = true;
+	detector->skip_start_us = arrival_us;
+	detector->idr_requested_us = arrival_us;
+	detector->skipped_cur = 0;
+	detector->stats.backlogs++;
+	detector->stats.idr_requests++;
+	if(age_us > detector->stats.age_max_us)
+		detector->stats.age_max_us = age_us;
+	return CHIAKI_BACKLOG_ACTION_SKIP_REQUEST_IDR;
+}
+
+CHIAKI_EXPORT uint64_t chiaki_backlog_detector_keyframe(ChiakiBacklogDetector *detector)
+{
+	uint64_t skipped = detector->skipped_cur;
+	detector->skipping = false;
+	detector->skipped_cur = 0;
+	detector->holdoff_until_us = detector->arrival_prev_us + CHIAKI_BACKLOG_IDR_RETRY_MS * 1000;
+	return skipped;
+}
@@ -6,10 +6,63 @@
 
 #include "vl_rbsp.h"
 
+#define STARTCODE_SEARCH_MAX 64
+
+#define WORD_ONES 0x0101010101010101ULL
+#define WORD_HIGHS 0x8080808080808080ULL
+#define WORD_HAS_ZERO(w) (((w) - WORD_ONES) & ~(w) & WORD_HIGHS)
+
+CHIAKI_EXPORT size_t chiaki_bitstream_find_startcode(const uint8_t *data, size_t size)
+{
+	size_t i = 0;
+	while(i + 3 <= size)
+	{
+		if(i + sizeof(uint64_t) <= size)
+		{
+			uint64_t w;
+			memcpy(&w, data + i, sizeof(w));
+			size_t word_end = i + sizeof(uint64_t);
+			// a start code can only begin in a word that contains a zero byte
+			if(!WORD_HAS_ZERO(w))
+			{
+				i = word_end;
+				continue;
+			}
+			for(; i < word_end && i + 3 <= size; i++)
+			{
+				if(data[i] == 0 && data[i+1] == 0 && data[i+2] == 1)
+					return i;
+			}
+			continue;
+		}
+		if(data[i] == 0 && data[i+1] == 0 && data[i+2] == 1)
+			return i;
+		i++;
+	}
+	return size;
+}
+
+/**
+ * Set up vlc for the beginning of the first NAL unit in data, which is enough to parse a slice header.
+ */
+static bool slice_header_vlc_init(struct vl_vlc *vlc, uint8_t *data, unsigned size)
+{
+	size_t search = size < STARTCODE_SEARCH_MAX + 3 ? size : STARTCODE_SEARCH_MAX + 3;
+	size_t offset = chiaki_bitstream_find_startcode(data, search);
+	if(offset == search)
+		return false;
+	offset += 3;
+	size_t nal_size = size - offset;
+	if(nal_size > CHIAKI_BITSTREAM_SLICE_HEADER_MAX)
+		nal_size = CHIAKI_BITSTREAM_SLICE_HEADER_MAX;
+	vl_vlc_init(vlc, data + offset, (unsigned)nal_size);
+	return true;
+}
+
 static bool skip_startcode(struct vl_vlc *vlc)
 {
 	vl_vlc_fillbits(vlc);
-	for(unsigned i=0; i<64 && vl_vlc_bits_left(vlc)>=32; i++)
+	for(unsigned i=0; i<STARTCODE_SEARCH_MAX && vl_vlc_bits_left(vlc)>=32; i++)
 	{
 		if (vl_vlc_peekbits(vlc, 32) == 1)
 			break;
@@ -156,15 +209,14 @@ sps_start:
 static bool slice_h264(ChiakiBitstream *bitstream, uint8_t *data, unsigned size, ChiakiBitstreamSlice *slice)
 {
 	struct vl_vlc vlc = {0};
-	vl_vlc_init(&vlc, data, size);
-	if(!skip_startcode(&vlc))
+	if(!slice_header_vlc_init(&vlc, data, size))
 	{
 		CHIAKI_LOGW(bitstream->log, "parse_slice_h264: No startcode found");
 		return false;
 	}
 
 	vl_vlc_eatbits(&vlc, 1); // forbidden_zero_bit
-	vl_vlc_eatbits(&vlc, 2); // nal_ref_idc
+	unsigned nal_ref_idc = vl_vlc_get_uimsbf(&vlc, 2);
 	unsigned nal_unit_type = vl_vlc_get_uimsbf(&vlc, 5);
 
 	if(nal_unit_type != 1 && nal_unit_type != 5)
@@ -173,6 +225,8 @@ static bool slice_h264(ChiakiBitstream *bitstream, uint8_t *data, unsigned size,
 		return false;
 	}
 
+	slice->is_reference = nal_ref_idc != 0;
+
 	struct vl_rbsp rbsp;
 	vl_rbsp_init(&rbsp, &vlc, ~0);
 	vl_rbsp_ue(&rbsp); // first_mb_in_slice
@@ -227,9 +281,7 @@ static bool slice_h264(ChiakiBitstream *bitstream, uint8_t *data, unsigned size,
 static bool slice_h265(ChiakiBitstream *bitstream, uint8_t *data, unsigned size, ChiakiBitstreamSlice *slice)
 {
 	struct vl_vlc vlc = {0};
-	vl_vlc_init(&vlc, data, size);
-
-	if(!skip_startcode(&vlc))
+	if(!slice_header_vlc_init(&vlc, data, size))
 	{
 		CHIAKI_LOGW(bitstream->log, "parse_slice_h265: No startcode found");
 		return false;
@@ -246,6 +298,8 @@ static bool slice_h265(ChiakiBitstream *bitstream, uint8_t *data, unsigned size,
 		return false;
 	}
 
+	slice->is_reference = true; // TRAIL_R and IDR_N_LP
+
 	struct vl_rbsp rbsp;
 	vl_rbsp_init(&rbsp, &vlc, ~0);
 	unsigned first_slice_segment_in_pic_flag = vl_rbsp_u(&rbsp, 1);
@@ -0,0 +1,210 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/capture.h>
+#include <chiaki/time.h>
+
+#include <string.h>
+
+#define CAPTURE_FILE_BUF_SIZE 0x40000
+#define CAPTURE_TAKION_SIZE 9
+#define CAPTURE_KEYS_SIZE (CHIAKI_CAPTURE_KEY_SIZE + CHIAKI_ECDH_SECRET_SIZE)
+
+static void write_u32(uint8_t *buf, uint32_t v)
+{
+	for(size_t i=0; i<4; i++)
+		buf[i] = (uint8_t)(v >> (8 * i));
+}
+
+static void write_u64(uint8_t *buf, uint64_t v)
+{
+	for(size_t i=0; i<8; i++)
+		buf[i] = (uint8_t)(v >> (8 * i));
+}
+
+static uint32_t read_u32(const uint8_t *buf)
+{
+	uint32_t v = 0;
+	for(size_t i=0; i<4; i++)
+		v |= (uint32_t)buf[i] << (8 * i);
+	return v;
+}
+
+static uint64_t read_u64(const uint8_t *buf)
+{
+	uint64_t v = 0;
+	for(size_t i=0; i<8; i++)
+		v |= (uint64_t)buf[i] << (8 * i);
+	return v;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_capture_init(ChiakiCapture *capture, const char *filename)
+{
+	capture->file = fopen(filename, "wb");
+	if(!capture->file)
+		return CHIAKI_ERR_UNKNOWN;
+	// datagrams are written from the thread reading the socket, so keep syscalls rare
+	setvbuf(capture->file, NULL, _IOFBF, CAPTURE_FILE_BUF_SIZE);
+
+	ChiakiErrorCode err = chiaki_mutex_init(&capture->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fclose(capture->file);
+		return err;
+	}
+
+	capture->start_us = chiaki_time_now_monotonic_us();
+	capture->datagrams = 0;
+	capture->failed = fwrite(CHIAKI_CAPTURE_MAGIC, 1, CHIAKI_CAPTURE_MAGIC_SIZE, capture->file) != CHIAKI_CAPTURE_MAGIC_SIZE;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_capture_fini(ChiakiCapture *capture)
+{
+	fclose(capture->file);
+	chiaki_mutex_fini(&capture->mutex);
+}
+
+/**
+ * Must be called with the mutex locked.
+ */
+static void capture_write_record(ChiakiCapture *capture, ChiakiCaptureRecordType type, const uint8_t *payload, size_t payload_size)
+{
+	if(capture->failed)
+		return;
+	uint8_t header[CHIAKI_CAPTURE_RECORD_HEADER_SIZE];
+	write_u32(header, (uint32_t)type);
+	write_u32(header + 4, (uint32_t)payload_size);
+	write_u64(header + 8, chiaki_time_now_monotonic_us() - capture->start_us);
+	if(fwrite(header, 1, sizeof(header), capture->file) != sizeof(header)
+		|| fwrite(payload, 1, payload_size, capture->file) != payload_size)
+		capture->failed = true;
+}
+
+CHIAKI_EXPORT void chiaki_capture_takion(ChiakiCapture *capture, uint8_t version, uint32_t tag_local, uint32_t tag_remote)
+{
+	uint8_t payload[CAPTURE_TAKION_SIZE];
+	payload[0] = version;
+	write_u32(payload + 1, tag_local);
+	write_u32(payload + 5, tag_remote);
+	chiaki_mutex_lock(&capture->mutex);
+	// datagram times are relative to this, so a replay can start right at it
+	capture->start_us = chiaki_time_now_monotonic_us();
+	capture_write_record(capture, CHIAKI_CAPTURE_RECORD_TAKION, payload, sizeof(payload));
+	chiaki_mutex_unlock(&capture->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_capture_keys(ChiakiCapture *capture, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
+{
+	uint8_t payload[CAPTURE_KEYS_SIZE];
+	memcpy(payload, handshake_key, CHIAKI_CAPTURE_KEY_SIZE);
+	memcpy(payload + CHIAKI_CAPTURE_KEY_SIZE, ecdh_secret, CHIAKI_ECDH_SECRET_SIZE);
+	chiaki_mutex_lock(&capture->mutex);
+	capture_write_record(capture, CHIAKI_CAPTURE_RECORD_KEYS, payload, sizeof(payload));
+	chiaki_mutex_unlock(&capture->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_capture_datagram(ChiakiCapture *capture, const uint8_t *buf, size_t buf_size)
+{
+	chiaki_mutex_lock(&capture->mutex);
+	capture_write_record(capture, CHIAKI_CAPTURE_RECORD_DATAGRAM, buf, buf_size);
+	capture->datagrams++;
+	chiaki_mutex_unlock(&capture->mutex);
+}
+
+/**
+ * @param payload_size size of payload, set to the size of the record's payload, which is skipped if it does not fit
+ */
+static ChiakiErrorCode capture_read_record(FILE *file, uint32_t *type, uint8_t *payload, size_t *payload_size, uint64_t *time_us)
+{
+	uint8_t header[CHIAKI_CAPTURE_RECORD_HEADER_SIZE];
+	if(fread(header, 1, sizeof(header), file) != sizeof(header))
+		return CHIAKI_ERR_DISCONNECTED;
+	*type = read_u32(header);
+	size_t size = read_u32(header + 4);
+	*time_us = read_u64(header + 8);
+	if(size > *payload_size)
+	{
+		*payload_size = size;
+		return fseek(file, (long)size, SEEK_CUR) == 0 ? CHIAKI_ERR_BUF_TOO_SMALL : CHIAKI_ERR_DISCONNECTED;
+	}
+	*payload_size = size;
+	if(fread(payload, 1, size, file) != size)
+		return CHIAKI_ERR_DISCONNECTED;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_capture_reader_init(ChiakiCaptureReader *reader, const char *filename)
+{
+	memset(reader, 0, sizeof(*reader));
+	reader->file = fopen(filename, "rb");
+	if(!reader->file)
+		return CHIAKI_ERR_UNKNOWN;
+	setvbuf(reader->file, NULL, _IOFBF, CAPTURE_FILE_BUF_SIZE);
+
+	char magic[CHIAKI_CAPTURE_MAGIC_SIZE];
+	if(fread(magic, 1, sizeof(magic), reader->file) != sizeof(magic) || memcmp(magic, CHIAKI_CAPTURE_MAGIC, sizeof(magic)))
+		goto error;
+	reader->data_offset = ftell(reader->file);
+
+	// the keys only arrive after the first datagrams, so look for both records before replaying anything
+	bool takion_found = false;
+	bool keys_found = false;
+	while(!takion_found || !keys_found)
+	{
+		uint8_t payload[CAPTURE_KEYS_SIZE];
+		size_t payload_size = sizeof(payload);
+		uint32_t type;
+		uint64_t time_us;
+		ChiakiErrorCode err = capture_read_record(reader->file, &type, payload, &payload_size, &time_us);
+		if(err == CHIAKI_ERR_BUF_TOO_SMALL)
+			continue;
+		if(err != CHIAKI_ERR_SUCCESS)
+			goto error;
+		if(type == CHIAKI_CAPTURE_RECORD_TAKION && payload_size == CAPTURE_TAKION_SIZE)
+		{
+			reader->version = payload[0];
+			reader->tag_local = read_u32(payload + 1);
+			reader->tag_remote = read_u32(payload + 5);
+			takion_found = true;
+		}
+		else if(type == CHIAKI_CAPTURE_RECORD_KEYS && payload_size == CAPTURE_KEYS_SIZE)
+		{
+			memcpy(reader->handshake_key, payload, CHIAKI_CAPTURE_KEY_SIZE);
+			memcpy(reader->ecdh_secret, payload + CHIAKI_CAPTURE_KEY_SIZE, CHIAKI_ECDH_SECRET_SIZE);
+			keys_found = true;
+		}
+	}
+
+	if(fseek(reader->file, reader->data_offset, SEEK_SET) != 0)
+		goto error;
+	return CHIAKI_ERR_SUCCESS;
+
+error:
+	fclose(reader->file);
+	reader->file = NULL;
+	return CHIAKI_ERR_INVALID_DATA;
+}
+
+CHIAKI_EXPORT void chiaki_capture_reader_fini(ChiakiCaptureReader *reader)
+{
+	if(reader->file)
+		fclose(reader->file);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_capture_reader_next(ChiakiCaptureReader *reader, uint8_t *buf, size_t *buf_size, uint64_t *time_us)
+{
+	while(true)
+	{
+		size_t size = *buf_size;
+		uint32_t type;
+		ChiakiErrorCode err = capture_read_record(reader->file, &type, buf, &size, time_us);
+		if(err == CHIAKI_ERR_BUF_TOO_SMALL && type != CHIAKI_CAPTURE_RECORD_DATAGRAM)
+			continue;
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+		if(type != CHIAKI_CAPTURE_RECORD_DATAGRAM)
+			continue;
+		*buf_size = size;
+		return CHIAKI_ERR_SUCCESS;
+	}
+}
@@ -1,77 +1,189 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
 #include <chiaki/congestioncontrol.h>
+#include <chiaki/time.h>
 
 #define CONGESTION_CONTROL_INTERVAL_MS 200
+#define CONGESTION_CONTROL_INTERVAL_FAST_MS 50 // while backing off, so the console hears about it sooner
 
-static void *congestion_control_thread_func(void *user)
+#define BANDWIDTH_DECREASE_FACTOR 0.85 // on overuse, of the received bitrate
+#define BANDWIDTH_INCREASE_PER_SEC 0.08
+#define BANDWIDTH_RECEIVED_FACTOR_MAX 1.5 // estimate never runs further ahead of the received bitrate than this
+#define BANDWIDTH_DECREASE_INTERVAL_US 200000 // at most one decrease per this, so the console can react
+
+static double clamp_loss(double loss)
 {
-	ChiakiCongestionControl *control = user;
+	if(loss < 0.0)
+		return 0.0;
+	if(loss > CHIAKI_CONGESTION_CONTROL_REPORTED_LOSS_MAX)
+		return CHIAKI_CONGESTION_CONTROL_REPORTED_LOSS_MAX;
+	return loss;
+}
 
-	ChiakiErrorCode err = chiaki_bool_pred_cond_lock(&control->stop_cond);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return NULL;
+/**
+ * Update the bandwidth estimate from the delay estimator, after the rate controller of Google Congestion Control.
+ *
+ * @return share of the received packets to report as lost on top of the actual losses
+ */
+static double bandwidth_update(ChiakiCongestionControl *control, uint64_t now_us)
+{
+	ChiakiDelayEstimate estimate;
+	chiaki_delay_estimator_get(control->delay_estimator, true, &estimate);
+	uint64_t elapsed_us = control->updated_us ? now_us - control->updated_us : 0;
+	control->updated_us = now_us;
+	if(!elapsed_us)
+		return 0.0;
 
-	while(true)
+	double received_bps = (double)estimate.bytes * 8.0 * 1000000.0 / (double)elapsed_us;
+	double bandwidth_bps = control->bandwidth_bps;
+	switch(estimate.usage)
 	{
-		err = chiaki_bool_pred_cond_timedwait(&control->stop_cond, CONGESTION_CONTROL_INTERVAL_MS);
-		if(err != CHIAKI_ERR_TIMEOUT)
+		case CHIAKI_DELAY_USAGE_OVERUSE:
+			if(!control->backing_off || now_us - control->decreased_us >= BANDWIDTH_DECREASE_INTERVAL_US)
+			{
+				bandwidth_bps = BANDWIDTH_DECREASE_FACTOR * received_bps;
+				control->decreased_us = now_us;
+				if(!control->backing_off)
+					CHIAKI_LOGI(control->takion->log, "Congestion Control detected rising delay, backing off to %.2f MBit/s",
+							bandwidth_bps / 1000000.0);
+			}
+			control->backing_off = true;
+			break;
+		case CHIAKI_DELAY_USAGE_UNDERUSE:
+			// queues are draining, hold until they are empty
+			break;
+		case CHIAKI_DELAY_USAGE_NORMAL:
+		default:
+			control->backing_off = false;
+			if(bandwidth_bps <= 0.0)
+				bandwidth_bps = received_bps;
+			else
+				bandwidth_bps *= 1.0 + BANDWIDTH_INCREASE_PER_SEC * (double)elapsed_us / 1000000.0;
+			if(bandwidth_bps > BANDWIDTH_RECEIVED_FACTOR_MAX * received_bps)
+				bandwidth_bps = BANDWIDTH_RECEIVED_FACTOR_MAX * received_bps;
 			break;
-
-		uint64_t received;
-		uint64_t lost;
-		chiaki_packet_stats_get(control->stats, true, &received, &lost);
-		ChiakiTakionCongestionPacket packet = { 0 };
-		packet.received = (uint16_t)received;
-		packet.lost = (uint16_t)lost;
-		uint64_t total = received + lost;
-		control->packet_loss = total > 0 ? (double)lost / total : 0;
-		CHIAKI_LOGV(control->takion->log, "Sending Congestion Control Packet, received: %u, lost: %u",
-			(unsigned int)packet.received, (unsigned int)packet.lost);
-		chiaki_takion_send_congestion(control->takion, &packet);
 	}
 
-	chiaki_bool_pred_cond_unlock(&control->stop_cond);
-	return NULL;
+	double loss_extra = 0.0;
+	if(control->backing_off && received_bps > bandwidth_bps)
+		loss_extra = clamp_loss(1.0 - bandwidth_bps / received_bps);
+
+	chiaki_mutex_lock(&control->stats_mutex);
+	control->bandwidth_bps = bandwidth_bps;
+	control->received_bps = received_bps;
+	control->delay_trend_ms = estimate.trend_ms;
+	control->delay_threshold_ms = estimate.threshold_ms;
+	control->delay_usage = estimate.usage;
+	chiaki_mutex_unlock(&control->stats_mutex);
+	return loss_extra;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion, ChiakiPacketStats *stats)
+static uint64_t congestion_control_task_cb(void *user, uint64_t now_us)
 {
-	control->takion = takion;
-	control->stats = stats;
-	control->packet_loss = 0;
+	ChiakiCongestionControl *control = user;
 
-	ChiakiErrorCode err = chiaki_bool_pred_cond_init(&control->stop_cond);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
+	uint64_t received;
+	uint64_t lost;
+	chiaki_packet_stats_get(control->stats, true, &received, &lost);
+	uint64_t total = received + lost;
+	control->packet_loss = total > 0 ? (double)lost / total : 0;
 
-	err = chiaki_thread_create(&control->thread, congestion_control_thread_func, control);
-	if(err != CHIAKI_ERR_SUCCESS)
+	if(control->delay_estimator || control->load_monitor)
 	{
-		chiaki_bool_pred_cond_fini(&control->stop_cond);
-		return err;
+		// the console adapts its bitrate to the reported loss, so report the share we can not carry
+		// before it actually gets lost in some overflowing buffer, or that the client can not keep up with
+		double loss_extra = control->delay_estimator ? bandwidth_update(control, now_us) : 0.0;
+		if(control->load_monitor)
+		{
+			double load_extra = clamp_loss(chiaki_load_monitor_update(control->load_monitor, now_us, control->packet_loss));
+			if(load_extra > loss_extra)
+				loss_extra = load_extra;
+		}
+		uint64_t lost_min = (uint64_t)(loss_extra * (double)total);
+		if(lost < lost_min)
+		{
+			received = total - lost_min;
+			lost = lost_min;
+		}
+		chiaki_mutex_lock(&control->stats_mutex);
+		control->reported_loss = total > 0 ? (double)lost / total : 0;
+		chiaki_mutex_unlock(&control->stats_mutex);
 	}
 
-	chiaki_thread_set_name(&control->thread, "Chiaki Congestion Control");
+	ChiakiTakionCongestionPacket packet = { 0 };
+	packet.received = (uint16_t)received;
+	packet.lost = (uint16_t)lost;
+	CHIAKI_LOGV(control->takion->log, "Sending Congestion Control Packet, received: %u, lost: %u",
+		(unsigned int)packet.received, (unsigned int)packet.lost);
+	chiaki_takion_send_congestion(control->takion, &packet);
 
+	return (control->backing_off ? CONGESTION_CONTROL_INTERVAL_FAST_MS : CONGESTION_CONTROL_INTERVAL_MS) * 1000;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_init(ChiakiCongestionControl *control)
+{
+	control->bandwidth_bps = 0;
+	control->received_bps = 0;
+	control->delay_trend_ms = 0;
+	control->delay_threshold_ms = 0;
+	control->delay_usage = CHIAKI_DELAY_USAGE_NORMAL;
+	control->reported_loss = 0;
+	control->timer_wheel = NULL;
+	chiaki_timer_task_init(&control->task, "congestion control", congestion_control_task_cb, control);
+	return chiaki_mutex_init(&control->stats_mutex, false);
+}
+
+CHIAKI_EXPORT void chiaki_congestion_control_fini(ChiakiCongestionControl *control)
+{
+	chiaki_mutex_fini(&control->stats_mutex);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTimerWheel *timer_wheel,
+		ChiakiTakion *takion, ChiakiPacketStats *stats, ChiakiDelayEstimator *delay_estimator, ChiakiLoadMonitor *load_monitor)
+{
+	if(control->timer_wheel)
+		return CHIAKI_ERR_INVALID_DATA;
+
+	control->takion = takion;
+	control->stats = stats;
+	control->delay_estimator = delay_estimator;
+	control->load_monitor = load_monitor;
+	control->packet_loss = 0;
+	control->updated_us = 0;
+	control->decreased_us = 0;
+	control->backing_off = false;
+
+	chiaki_mutex_lock(&control->stats_mutex);
+	control->bandwidth_bps = 0;
+	control->received_bps = 0;
+	control->delay_trend_ms = 0;
+	control->delay_threshold_ms = 0;
+	control->delay_usage = CHIAKI_DELAY_USAGE_NORMAL;
+	control->reported_loss = 0;
+	chiaki_mutex_unlock(&control->stats_mutex);
+
+	control->timer_wheel = timer_wheel;
+	chiaki_timer_wheel_schedule(timer_wheel, &control->task, CONGESTION_CONTROL_INTERVAL_MS * 1000);
 	return CHIAKI_ERR_SUCCESS;
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_stop(ChiakiCongestionControl *control)
 {
-	ChiakiErrorCode err = chiaki_bool_pred_cond_signal(&control->stop_cond);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
-
-	err = chiaki_thread_join(&control->thread, NULL);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
-	// FIXME ywnico check what to set thread_id to
-	#ifdef __PSVITA__
-	control->thread.thread_id = 0;
-	#else
-	control->thread.thread = 0;
-	#endif
-
-	return chiaki_bool_pred_cond_fini(&control->stop_cond);
+	if(!control->timer_wheel)
+		return CHIAKI_ERR_SUCCESS;
+	chiaki_timer_wheel_cancel(control->timer_wheel, &control->task);
+	control->timer_wheel = NULL;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_congestion_control_get_stats(ChiakiCongestionControl *control, ChiakiCongestionControlStats *stats)
+{
+	chiaki_mutex_lock(&control->stats_mutex);
+	stats->bandwidth_bps = (uint64_t)control->bandwidth_bps;
+	stats->received_bps = (uint64_t)control->received_bps;
+	stats->delay_trend_ms = control->delay_trend_ms;
+	stats->delay_threshold_ms = control->delay_threshold_ms;
+	stats->delay_usage = control->delay_usage;
+	stats->reported_loss = control->reported_loss;
+	chiaki_mutex_unlock(&control->stats_mutex);
 }
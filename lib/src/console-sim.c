@@ -0,0 +1,1499 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+/**
+ * Simulates the console side of a session for load testing a client: it answers the session request
+ * and ctrl on port 9295, accepts the Takion connection on port 9296 and streams a prerecorded
+ * H.264 Annex B and optionally an Ogg Opus file, looped, at a configurable rate, unit size and FEC ratio.
+ *
+ * The client must be registered with a host using the same morning as passed here.
+ * There is no discovery, Senkusha or retransmission of lost data, and clients are served one after another.
+ */
+
+#include <chiaki/takion.h>
+#include <chiaki/session.h>
+#include <chiaki/rpcrypt.h>
+#include <chiaki/ecdh.h>
+#include <chiaki/gkcrypt.h>
+#include <chiaki/fec.h>
+#include <chiaki/audio.h>
+#include <chiaki/http.h>
+#include <chiaki/base64.h>
+#include <chiaki/random.h>
+#include <chiaki/bitstream.h>
+#include <chiaki/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <takion.pb.h>
+#include "pb_utils.h"
+
+#define SIM_SESSION_PORT 9295
+#define SIM_STREAM_PORT 9296
+#define SIM_EXPECT_TIMEOUT_MS 10000
+#define SIM_IDLE_TIMEOUT_US 5000000
+#define SIM_HTTP_REQUEST_SIZE_MAX 0x1000
+#define SIM_DATAGRAM_SIZE_MAX 0x2000
+#define SIM_MESSAGE_SIZE_MAX 0x2000
+#define SIM_LAUNCH_SPEC_SIZE_MAX 0x1000
+#define SIM_VIDEO_HEADER_SIZE_MAX 0x200
+#define SIM_UNIT_SIZE_DEFAULT 1392
+#define SIM_UNIT_SIZE_MAX 0x1000
+#define SIM_AV_HEADER_SIZE_MAX 0x20
+#define SIM_AUDIO_UNIT_SIZE_MAX 0xff
+#define SIM_AUDIO_RATE 48000
+#define SIM_FILLER_SIZE_MIN 6
+#define SIM_CATCH_UP_US 500000 // if sending falls behind by more than this, skip ahead instead of bursting
+#define SIM_SESSION_ID_SIZE 32
+#define SIM_SEND_BUF_SIZE (4 * 1024 * 1024)
+
+// mirrors of the private Takion constants in takion.c
+#define SIM_TAKION_PACKET_TYPE_CONTROL 0
+#define SIM_TAKION_MESSAGE_HEADER_SIZE 0x10
+#define SIM_TAKION_CHUNK_TYPE_DATA 0
+#define SIM_TAKION_CHUNK_TYPE_INIT 1
+#define SIM_TAKION_CHUNK_TYPE_INIT_ACK 2
+#define SIM_TAKION_CHUNK_TYPE_DATA_ACK 3
+#define SIM_TAKION_CHUNK_TYPE_COOKIE 0xa
+#define SIM_TAKION_CHUNK_TYPE_COOKIE_ACK 0xb
+#define SIM_TAKION_COOKIE_SIZE 0x20
+#define SIM_TAKION_A_RWND 0x19000
+#define SIM_TAKION_STREAMS 0x64
+
+#define SIM_CTRL_MESSAGE_TYPE_SESSION_ID 0x33
+
+typedef struct sim_config_t
+{
+	uint8_t morning[CHIAKI_RPCRYPT_KEY_SIZE];
+	const char *video_filename;
+	const char *audio_filename;
+	unsigned int fps;
+	unsigned int bitrate_kbps; // 0 to send the frames as they are
+	size_t unit_size;
+	double fec_ratio;
+	unsigned int width; // 0 to take the one requested in the launch spec
+	unsigned int height;
+} SimConfig;
+
+typedef struct video_source_t
+{
+	uint8_t *data;
+	size_t *frame_offsets; // frames_count + 1 entries, the last one is the end of data
+	size_t frames_count;
+	size_t frame_cur;
+	uint8_t header[SIM_VIDEO_HEADER_SIZE_MAX]; // first SPS and PPS
+	size_t header_size;
+} VideoSource;
+
+typedef struct audio_packet_t
+{
+	size_t offset;
+	size_t size;
+	uint32_t samples;
+} AudioPacket;
+
+typedef struct audio_source_t
+{
+	uint8_t *data; // packet data without the Ogg framing
+	AudioPacket *packets;
+	size_t packets_count;
+	size_t packet_cur;
+	uint8_t channels;
+	uint32_t frame_size;
+} AudioSource;
+
+typedef struct sim_stats_t
+{
+	uint64_t start_us;
+	uint64_t video_frames;
+	uint64_t video_frames_dropped;
+	uint64_t video_packets;
+	uint64_t video_bytes;
+	uint64_t audio_packets;
+	uint64_t datagrams;
+	uint64_t bytes;
+} SimStats;
+
+typedef struct sim_t
+{
+	ChiakiLog *log;
+	SimConfig *config;
+	VideoSource *video;
+	AudioSource *audio;
+	SimStats stats;
+	bool finished;
+
+	// session request and ctrl
+	ChiakiTarget target;
+	uint8_t nonce[CHIAKI_RPCRYPT_KEY_SIZE];
+	char regist_key[CHIAKI_SESSION_AUTH_SIZE];
+	ChiakiRPCrypt rpcrypt;
+	chiaki_socket_t ctrl_sock;
+	uint64_t ctrl_counter_local;
+
+	// takion
+	chiaki_socket_t udp_sock;
+	struct sockaddr_storage peer;
+	socklen_t peer_len;
+	bool takion_connected;
+	uint32_t tag_local;
+	uint32_t tag_remote;
+	ChiakiSeqNum32 seq_num_local;
+	ChiakiSeqNum32 seq_num_remote_next;
+	uint8_t message_buf[SIM_MESSAGE_SIZE_MAX];
+	size_t message_size;
+	bool message_assembling;
+
+	// stream connection
+	unsigned int protocol_version;
+	uint8_t handshake_key[CHIAKI_HANDSHAKE_KEY_SIZE];
+	unsigned int launch_width;
+	unsigned int launch_height;
+	ChiakiECDH ecdh;
+	bool ecdh_valid;
+	ChiakiGKCrypt gkcrypt;
+	bool crypt_valid;
+	uint64_t key_pos;
+	bool streaming;
+	ChiakiSeqNum16 video_packet_index;
+	ChiakiSeqNum16 video_frame_index;
+	ChiakiSeqNum16 audio_packet_index;
+	ChiakiSeqNum16 audio_frame_index;
+	uint8_t *frame_buf; // padded access unit, followed by the units built from it
+	size_t frame_buf_size;
+} Sim;
+
+static bool read_file(const char *filename, uint8_t **data, size_t *size)
+{
+	FILE *f = fopen(filename, "rb");
+	if(!f)
+		return false;
+	bool r = false;
+	if(fseek(f, 0, SEEK_END) != 0)
+		goto beach;
+	long s = ftell(f);
+	if(s <= 0 || fseek(f, 0, SEEK_SET) != 0)
+		goto beach;
+	*data = malloc((size_t)s);
+	if(!*data)
+		goto beach;
+	if(fread(*data, 1, (size_t)s, f) != (size_t)s)
+	{
+		free(*data);
+		goto beach;
+	}
+	*size = (size_t)s;
+	r = true;
+beach:
+	fclose(f);
+	return r;
+}
+
+/**
+ * @return number of bytes written to buf or -1 if hex is invalid or longer than buf_size
+ */
+static int parse_hex(uint8_t *buf, size_t buf_size, const char *hex)
+{
+	size_t len = strlen(hex);
+	if(len % 2 || len / 2 > buf_size)
+		return -1;
+	for(size_t i=0; i<len/2; i++)
+	{
+		unsigned int v;
+		if(sscanf(hex + i * 2, "%2x", &v) != 1)
+			return -1;
+		buf[i] = (uint8_t)v;
+	}
+	return (int)(len / 2);
+}
+
+/**
+ * Start of a NAL unit including its start code, which counts a single leading zero as part of it.
+ */
+static size_t nal_begin(const uint8_t *data, size_t startcode_pos)
+{
+	return startcode_pos > 0 && data[startcode_pos - 1] == 0 ? startcode_pos - 1 : startcode_pos;
+}
+
+static bool video_source_push_offset(VideoSource *video, size_t *offsets_max, size_t offset)
+{
+	if(video->frames_count + 1 >= *offsets_max)
+	{
+		size_t offsets_max_new = *offsets_max * 2;
+		size_t *offsets_new = realloc(video->frame_offsets, offsets_max_new * sizeof(size_t));
+		if(!offsets_new)
+			return false;
+		video->frame_offsets = offsets_new;
+		*offsets_max = offsets_max_new;
+	}
+	video->frame_offsets[video->frames_count++] = offset;
+	return true;
+}
+
+/**
+ * Split an H.264 Annex B stream into access units. One starts at a slice with first_mb_in_slice == 0
+ * or at an SEI, SPS, PPS or AUD after the slices of the previous one.
+ */
+static ChiakiErrorCode video_source_init(VideoSource *video, const char *filename)
+{
+	memset(video, 0, sizeof(*video));
+	size_t size;
+	if(!read_file(filename, &video->data, &size))
+		return CHIAKI_ERR_UNKNOWN;
+
+	size_t offsets_max = 256;
+	video->frame_offsets = malloc(offsets_max * sizeof(size_t));
+	if(!video->frame_offsets)
+		goto error;
+
+	bool sps_found = false;
+	bool pps_found = false;
+	bool vcl_seen = false;
+	size_t pos = chiaki_bitstream_find_startcode(video->data, size);
+	while(pos + 3 < size)
+	{
+		size_t nal = pos + 3;
+		size_t next = nal + chiaki_bitstream_find_startcode(video->data + nal, size - nal);
+		size_t begin = nal_begin(video->data, pos);
+		size_t end = next < size ? nal_begin(video->data, next) : size;
+
+		uint8_t type = video->data[nal] & 0x1f;
+		bool vcl = type >= 1 && type <= 5;
+		bool first_slice = vcl && nal + 1 < size && (video->data[nal + 1] & 0x80);
+		bool au_start = !video->frames_count
+			|| (vcl_seen && (first_slice || type == 6 || type == 7 || type == 8 || type == 9));
+		if(au_start)
+		{
+			if(!video_source_push_offset(video, &offsets_max, begin))
+				goto error;
+			vcl_seen = false;
+		}
+		if(vcl)
+			vcl_seen = true;
+
+		if(((type == 7 && !sps_found) || (type == 8 && !pps_found))
+				&& video->header_size + (end - begin) <= sizeof(video->header))
+		{
+			memcpy(video->header + video->header_size, video->data + begin, end - begin);
+			video->header_size += end - begin;
+			if(type == 7)
+				sps_found = true;
+			else
+				pps_found = true;
+		}
+		pos = next;
+	}
+
+	if(!sps_found || !pps_found || !video->frames_count)
+	{
+		fprintf(stderr, "%s does not look like an H.264 Annex B stream with SPS and PPS\n", filename);
+		goto error;
+	}
+	video->frame_offsets[video->frames_count] = size;
+	return CHIAKI_ERR_SUCCESS;
+
+error:
+	free(video->frame_offsets);
+	free(video->data);
+	return CHIAKI_ERR_INVALID_DATA;
+}
+
+static void video_source_fini(VideoSource *video)
+{
+	free(video->frame_offsets);
+	free(video->data);
+}
+
+/**
+ * @return duration of an Opus packet in samples at 48 kHz, from its TOC byte
+ */
+static uint32_t opus_packet_samples(const uint8_t *buf, size_t size)
+{
+	static const uint32_t silk_samples[] = { 480, 960, 1920, 2880 };
+	if(!size)
+		return 0;
+	uint8_t config = buf[0] >> 3;
+	uint32_t frame_samples;
+	if(config < 12)
+		frame_samples = silk_samples[config & 3];
+	else if(config < 16)
+		frame_samples = (config & 1) ? 960 : 480;
+	else
+		frame_samples = 120 << (config & 3);
+	switch(buf[0] & 3)
+	{
+		case 0:
+			return frame_samples;
+		case 1:
+		case 2:
+			return frame_samples * 2;
+		default:
+			return size > 1 ? frame_samples * (buf[1] & 0x3f) : 0;
+	}
+}
+
+static ChiakiErrorCode audio_source_init(AudioSource *audio, const char *filename)
+{
+	memset(audio, 0, sizeof(*audio));
+	uint8_t *file;
+	size_t size;
+	if(!read_file(filename, &file, &size))
+		return CHIAKI_ERR_UNKNOWN;
+
+	ChiakiErrorCode err = CHIAKI_ERR_INVALID_DATA;
+	size_t packets_max = 256;
+	audio->data = malloc(size);
+	audio->packets = malloc(packets_max * sizeof(AudioPacket));
+	if(!audio->data || !audio->packets)
+		goto error;
+
+	// packets may span pages, so the segments of all pages are copied together first
+	size_t data_size = 0;
+	size_t packet_start = 0;
+	size_t packets_skipped = 0;
+	size_t pos = 0;
+	while(pos + 27 <= size)
+	{
+		if(memcmp(file + pos, "OggS", 4) != 0)
+		{
+			fprintf(stderr, "%s is not an Ogg file or is corrupt at offset %#llx\n", filename, (unsigned long long)pos);
+			goto error;
+		}
+		size_t segments_count = file[pos + 26];
+		const uint8_t *segments = file + pos + 27;
+		size_t body = pos + 27 + segments_count;
+		if(body > size)
+			break;
+		for(size_t i=0; i<segments_count; i++)
+		{
+			size_t segment_size = segments[i];
+			if(body + segment_size > size)
+				goto error;
+			memcpy(audio->data + data_size, file + body, segment_size);
+			data_size += segment_size;
+			body += segment_size;
+			if(segment_size == 0xff)
+				continue;
+
+			// packet complete
+			const uint8_t *packet = audio->data + packet_start;
+			size_t packet_size = data_size - packet_start;
+			if(packet_size >= 19 && !memcmp(packet, "OpusHead", 8))
+			{
+				audio->channels = packet[9];
+				data_size = packet_start;
+			}
+			else if(packet_size >= 8 && !memcmp(packet, "OpusTags", 8))
+				data_size = packet_start;
+			else if(!packet_size || packet_size > SIM_AUDIO_UNIT_SIZE_MAX)
+			{
+				// audio units carry their size in 8 bits
+				packets_skipped++;
+				data_size = packet_start;
+			}
+			else
+			{
+				if(audio->packets_count == packets_max)
+				{
+					packets_max *= 2;
+					AudioPacket *packets_new = realloc(audio->packets, packets_max * sizeof(AudioPacket));
+					if(!packets_new)
+						goto error;
+					audio->packets = packets_new;
+				}
+				AudioPacket *p = &audio->packets[audio->packets_count++];
+				p->offset = packet_start;
+				p->size = packet_size;
+				p->samples = opus_packet_samples(packet, packet_size);
+			}
+			packet_start = data_size;
+		}
+		pos = body;
+	}
+
+	if(!audio->channels || !audio->packets_count)
+	{
+		fprintf(stderr, "%s does not contain an Opus stream\n", filename);
+		goto error;
+	}
+	if(packets_skipped)
+		fprintf(stderr, "Skipped %llu Opus packets larger than %u bytes\n", (unsigned long long)packets_skipped, SIM_AUDIO_UNIT_SIZE_MAX);
+	audio->frame_size = audio->packets[0].samples;
+	free(file);
+	return CHIAKI_ERR_SUCCESS;
+
+error:
+	free(audio->packets);
+	free(audio->data);
+	free(file);
+	return err;
+}
+
+static void audio_source_fini(AudioSource *audio)
+{
+	free(audio->packets);
+	free(audio->data);
+}
+
+static bool wait_readable(chiaki_socket_t sock, int timeout_ms)
+{
+	struct pollfd pfd = { sock, POLLIN, 0 };
+	return poll(&pfd, 1, timeout_ms) > 0;
+}
+
+static ChiakiErrorCode send_all(chiaki_socket_t sock, const uint8_t *buf, size_t buf_size)
+{
+	while(buf_size)
+	{
+		ssize_t sent = send(sock, buf, buf_size, 0);
+		if(sent <= 0)
+			return CHIAKI_ERR_NETWORK;
+		buf += sent;
+		buf_size -= (size_t)sent;
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static const char *http_header_get(ChiakiHttpHeader *headers, const char *key)
+{
+	for(ChiakiHttpHeader *header=headers; header; header=header->next)
+	{
+		if(!strcasecmp(header->key, key))
+			return header->value;
+	}
+	return NULL;
+}
+
+/**
+ * Receive a GET request into buf. path and headers point into buf.
+ */
+static ChiakiErrorCode sim_recv_http_request(chiaki_socket_t sock, char *buf, size_t buf_size, char **path, ChiakiHttpHeader **headers)
+{
+	size_t received = 0;
+	char *end = NULL;
+	while(!end)
+	{
+		if(received + 1 >= buf_size)
+			return CHIAKI_ERR_BUF_TOO_SMALL;
+		if(!wait_readable(sock, SIM_EXPECT_TIMEOUT_MS))
+			return CHIAKI_ERR_TIMEOUT;
+		ssize_t r = recv(sock, buf + received, buf_size - 1 - received, 0);
+		if(r <= 0)
+			return CHIAKI_ERR_DISCONNECTED;
+		received += (size_t)r;
+		buf[received] = '\0';
+		end = strstr(buf, "\r\n\r\n");
+	}
+
+	char *line_end = strstr(buf, "\r\n");
+	*line_end = '\0';
+	if(strncmp(buf, "GET ", 4) != 0)
+		return CHIAKI_ERR_INVALID_DATA;
+	*path = buf + 4;
+	char *space = strchr(*path, ' ');
+	if(space)
+		*space = '\0';
+
+	char *headers_buf = line_end + 2;
+	return chiaki_http_header_parse(headers, headers_buf, (size_t)(end + 4 - headers_buf));
+}
+
+static void sim_send_http_forbidden(chiaki_socket_t sock)
+{
+	static const char response[] = "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\n\r\n";
+	send_all(sock, (const uint8_t *)response, sizeof(response) - 1);
+}
+
+static ChiakiErrorCode sim_session_request(Sim *sim, chiaki_socket_t sock)
+{
+	char buf[SIM_HTTP_REQUEST_SIZE_MAX];
+	char *path;
+	ChiakiHttpHeader *headers;
+	ChiakiErrorCode err = sim_recv_http_request(sock, buf, sizeof(buf), &path, &headers);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(sim->log, "Failed to receive session request: %s", chiaki_error_string(err));
+		return err;
+	}
+
+	bool ps5 = strstr(path, "/ps5/") != NULL;
+	const char *rp_version = http_header_get(headers, "Rp-Version");
+	const char *regist_key = http_header_get(headers, "RP-Registkey");
+	sim->target = rp_version ? chiaki_rp_version_parse(rp_version, ps5) : CHIAKI_TARGET_PS4_UNKNOWN;
+	memset(sim->regist_key, 0, sizeof(sim->regist_key));
+	if(chiaki_target_is_unknown(sim->target) || !regist_key
+			|| parse_hex((uint8_t *)sim->regist_key, sizeof(sim->regist_key), regist_key) < 0)
+	{
+		CHIAKI_LOGE(sim->log, "Session request for %s has an unknown RP-Version or invalid RP-Registkey", path);
+		sim_send_http_forbidden(sock);
+		err = CHIAKI_ERR_INVALID_DATA;
+		goto beach;
+	}
+
+	err = chiaki_random_bytes_crypt(sim->nonce, sizeof(sim->nonce));
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto beach;
+	char nonce_b64[CHIAKI_RPCRYPT_KEY_SIZE * 2];
+	err = chiaki_base64_encode(sim->nonce, sizeof(sim->nonce), nonce_b64, sizeof(nonce_b64));
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto beach;
+	chiaki_rpcrypt_init_auth(&sim->rpcrypt, sim->target, sim->nonce, sim->config->morning);
+
+	char response[0x100];
+	int response_size = snprintf(response, sizeof(response),
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Length: 0\r\n"
+			"RP-Nonce: %s\r\n"
+			"RP-Version: %s\r\n"
+			"\r\n", nonce_b64, chiaki_rp_version_string(sim->target));
+	err = send_all(sock, (const uint8_t *)response, (size_t)response_size);
+	CHIAKI_LOGI(sim->log, "Session request for %s (RP-Version %s) answered", path, rp_version);
+
+beach:
+	chiaki_http_header_free(headers);
+	return err;
+}
+
+static ChiakiErrorCode sim_ctrl_send(Sim *sim, uint16_t type, const uint8_t *payload, size_t payload_size)
+{
+	uint8_t buf[8 + 0x100];
+	if(payload_size > sizeof(buf) - 8)
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+	*((chiaki_unaligned_uint32_t *)buf) = htonl((uint32_t)payload_size);
+	*((chiaki_unaligned_uint16_t *)(buf + 4)) = htons(type);
+	*((chiaki_unaligned_uint16_t *)(buf + 6)) = 0;
+	ChiakiErrorCode err = chiaki_rpcrypt_encrypt(&sim->rpcrypt, sim->ctrl_counter_local++, payload, buf + 8, payload_size);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	return send_all(sim->ctrl_sock, buf, 8 + payload_size);
+}
+
+static ChiakiErrorCode sim_ctrl_start(Sim *sim)
+{
+	char buf[SIM_HTTP_REQUEST_SIZE_MAX];
+	char *path;
+	ChiakiHttpHeader *headers;
+	ChiakiErrorCode err = sim_recv_http_request(sim->ctrl_sock, buf, sizeof(buf), &path, &headers);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(sim->log, "Failed to receive ctrl request: %s", chiaki_error_string(err));
+		return err;
+	}
+
+	// RP-Auth is the regist key encrypted with our nonce and the morning, so this checks the registration
+	const char *auth = http_header_get(headers, "RP-Auth");
+	uint8_t auth_dec[CHIAKI_SESSION_AUTH_SIZE];
+	size_t auth_dec_size = sizeof(auth_dec);
+	if(!auth || chiaki_base64_decode(auth, strlen(auth), auth_dec, &auth_dec_size) != CHIAKI_ERR_SUCCESS
+			|| auth_dec_size != sizeof(auth_dec)
+			|| chiaki_rpcrypt_decrypt(&sim->rpcrypt, 0, auth_dec, auth_dec, sizeof(auth_dec)) != CHIAKI_ERR_SUCCESS
+			|| memcmp(auth_dec, sim->regist_key, sizeof(auth_dec)) != 0)
+	{
+		CHIAKI_LOGE(sim->log, "Ctrl RP-Auth does not match the regist key, the client's registration uses a different morning");
+		sim_send_http_forbidden(sim->ctrl_sock);
+		err = CHIAKI_ERR_INVALID_DATA;
+		goto beach;
+	}
+
+	uint8_t server_type[0x10] = { 0 };
+	server_type[0] = chiaki_target_is_ps5(sim->target) ? 2 : 0;
+	err = chiaki_rpcrypt_encrypt(&sim->rpcrypt, 0, server_type, server_type, sizeof(server_type));
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto beach;
+	char server_type_b64[sizeof(server_type) * 2];
+	err = chiaki_base64_encode(server_type, sizeof(server_type), server_type_b64, sizeof(server_type_b64));
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto beach;
+
+	char response[0x100];
+	int response_size = snprintf(response, sizeof(response),
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Length: 0\r\n"
+			"RP-Server-Type: %s\r\n"
+			"\r\n", server_type_b64);
+	err = send_all(sim->ctrl_sock, (const uint8_t *)response, (size_t)response_size);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto beach;
+	sim->ctrl_counter_local = 1;
+
+	static const char alnum[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+	uint8_t session_id[1 + SIM_SESSION_ID_SIZE];
+	err = chiaki_random_bytes_crypt(session_id + 1, SIM_SESSION_ID_SIZE);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto beach;
+	session_id[0] = 0x4a;
+	for(size_t i=1; i<sizeof(session_id); i++)
+		session_id[i] = (uint8_t)alnum[session_id[i] % (sizeof(alnum) - 1)];
+	err = sim_ctrl_send(sim, SIM_CTRL_MESSAGE_TYPE_SESSION_ID, session_id, sizeof(session_id));
+	CHIAKI_LOGI(sim->log, "Ctrl started for %s", path);
+
+beach:
+	chiaki_http_header_free(headers);
+	return err;
+}
+
+static void sim_write_message_header(uint8_t *buf, uint32_t tag, uint64_t key_pos, uint8_t chunk_type, uint8_t chunk_flags, size_t payload_data_size)
+{
+	*((chiaki_unaligned_uint32_t *)(buf + 0)) = htonl(tag);
+	memset(buf + 4, 0, CHIAKI_GKCRYPT_GMAC_SIZE);
+	*((chiaki_unaligned_uint32_t *)(buf + 8)) = htonl((uint32_t)key_pos);
+	*(buf + 0xc) = chunk_type;
+	*(buf + 0xd) = chunk_flags;
+	*((chiaki_unaligned_uint16_t *)(buf + 0xe)) = htons((uint16_t)(payload_data_size + 4));
+}
+
+/**
+ * Same key stream accounting as chiaki_takion_crypt_advance_key_pos() for the client's packets.
+ */
+static uint64_t sim_advance_key_pos(Sim *sim, size_t data_size)
+{
+	if(!sim->crypt_valid)
+		return 0;
+	uint64_t key_pos = sim->key_pos;
+	sim->key_pos += data_size + data_size % CHIAKI_GKCRYPT_BLOCK_SIZE;
+	return key_pos;
+}
+
+static ChiakiErrorCode sim_takion_send(Sim *sim, uint8_t *buf, size_t buf_size, uint64_t key_pos)
+{
+	if(sim->crypt_valid)
+	{
+		ChiakiErrorCode err = chiaki_takion_packet_mac(&sim->gkcrypt, buf, buf_size, key_pos, NULL, NULL);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+	}
+	if(sendto(sim->udp_sock, buf, buf_size, 0, (struct sockaddr *)&sim->peer, sim->peer_len) < 0)
+	{
+		CHIAKI_LOGE(sim->log, "Failed to send datagram: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+		return CHIAKI_ERR_NETWORK;
+	}
+	sim->stats.datagrams++;
+	sim->stats.bytes += buf_size;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static ChiakiErrorCode sim_takion_send_data(Sim *sim, const uint8_t *buf, size_t buf_size)
+{
+	uint8_t packet[1 + SIM_TAKION_MESSAGE_HEADER_SIZE + 9 + SIM_MESSAGE_SIZE_MAX];
+	if(buf_size > SIM_MESSAGE_SIZE_MAX)
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+	uint64_t key_pos = sim_advance_key_pos(sim, buf_size);
+	packet[0] = SIM_TAKION_PACKET_TYPE_CONTROL;
+	sim_write_message_header(packet + 1, sim->tag_remote, key_pos, SIM_TAKION_CHUNK_TYPE_DATA, 1, 9 + buf_size);
+	uint8_t *payload = packet + 1 + SIM_TAKION_MESSAGE_HEADER_SIZE;
+	*((chiaki_unaligned_uint32_t *)(payload + 0)) = htonl(sim->seq_num_local++);
+	*((chiaki_unaligned_uint16_t *)(payload + 4)) = htons(1);
+	*((chiaki_unaligned_uint16_t *)(payload + 6)) = 0;
+	payload[8] = CHIAKI_TAKION_MESSAGE_DATA_TYPE_PROTOBUF;
+	memcpy(payload + 9, buf, buf_size);
+	return sim_takion_send(sim, packet, 1 + SIM_TAKION_MESSAGE_HEADER_SIZE + 9 + buf_size, key_pos);
+}
+
+static ChiakiErrorCode sim_takion_send_data_ack(Sim *sim, ChiakiSeqNum32 seq_num)
+{
+	uint8_t packet[1 + SIM_TAKION_MESSAGE_HEADER_SIZE + 0xc];
+	uint64_t key_pos = sim_advance_key_pos(sim, sizeof(packet));
+	packet[0] = SIM_TAKION_PACKET_TYPE_CONTROL;
+	sim_write_message_header(packet + 1, sim->tag_remote, key_pos, SIM_TAKION_CHUNK_TYPE_DATA_ACK, 0, 0xc);
+	uint8_t *data_ack = packet + 1 + SIM_TAKION_MESSAGE_HEADER_SIZE;
+	*((chiaki_unaligned_uint32_t *)(data_ack + 0)) = htonl(seq_num);
+	*((chiaki_unaligned_uint32_t *)(data_ack + 4)) = htonl(SIM_TAKION_A_RWND);
+	*((chiaki_unaligned_uint16_t *)(data_ack + 8)) = 0;
+	*((chiaki_unaligned_uint16_t *)(data_ack + 0xa)) = 0;
+	return sim_takion_send(sim, packet, sizeof(packet), key_pos);
+}
+
+/**
+ * Encrypt data the way stream_connection_takion_av() decrypts it and send it behind the header of packet.
+ */
+static ChiakiErrorCode sim_takion_send_av(Sim *sim, ChiakiTakionAVPacket *packet, const uint8_t *data, size_t data_size)
+{
+	uint8_t buf[SIM_AV_HEADER_SIZE_MAX + SIM_UNIT_SIZE_MAX];
+	packet->key_pos = sim_advance_key_pos(sim, CHIAKI_GKCRYPT_BLOCK_SIZE + data_size);
+	size_t header_size;
+	ChiakiErrorCode err = sim->protocol_version == 12
+		? chiaki_takion_v12_av_packet_format_header(buf, sizeof(buf), &header_size, packet)
+		: chiaki_takion_v9_av_packet_format_header(buf, sizeof(buf), &header_size, packet);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	if(header_size + data_size > sizeof(buf))
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+	memcpy(buf + header_size, data, data_size);
+	err = chiaki_gkcrypt_encrypt(&sim->gkcrypt, packet->key_pos + CHIAKI_GKCRYPT_BLOCK_SIZE, buf + header_size, data_size);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	return sim_takion_send(sim, buf, header_size + data_size, packet->key_pos);
+}
+
+static ChiakiErrorCode sim_send_message(Sim *sim, tkproto_TakionMessage *msg)
+{
+	uint8_t buf[SIM_MESSAGE_SIZE_MAX];
+	pb_ostream_t stream = pb_ostream_from_buffer(buf, sizeof(buf));
+	if(!pb_encode(&stream, tkproto_TakionMessage_fields, msg))
+	{
+		CHIAKI_LOGE(sim->log, "Failed to encode protobuf message of type %d", (int)msg->type);
+		return CHIAKI_ERR_UNKNOWN;
+	}
+	return sim_takion_send_data(sim, buf, stream.bytes_written);
+}
+
+typedef struct sim_resolution_t
+{
+	unsigned int width;
+	unsigned int height;
+	ChiakiPBBuf video_header;
+} SimResolution;
+
+static bool sim_pb_encode_resolution(pb_ostream_t *stream, const pb_field_t *field, void *const *arg)
+{
+	SimResolution *sim_resolution = *arg;
+	tkproto_ResolutionPayload resolution = { 0 };
+	resolution.width = sim_resolution->width;
+	resolution.height = sim_resolution->height;
+	resolution.video_header.arg = &sim_resolution->video_header;
+	resolution.video_header.funcs.encode = chiaki_pb_encode_buf;
+	if(!pb_encode_tag_for_field(stream, field))
+		return false;
+	return pb_encode_submessage(stream, tkproto_ResolutionPayload_fields, &resolution);
+}
+
+static ChiakiErrorCode sim_send_streaminfo(Sim *sim)
+{
+	SimResolution resolution;
+	resolution.width = sim->config->width ? sim->config->width : sim->launch_width;
+	resolution.height = sim->config->height ? sim->config->height : sim->launch_height;
+	resolution.video_header.buf = sim->video->header;
+	resolution.video_header.size = sim->video->header_size;
+
+	ChiakiAudioHeader audio_header_s;
+	if(sim->audio)
+		chiaki_audio_header_set(&audio_header_s, sim->audio->channels, 16, SIM_AUDIO_RATE, sim->audio->frame_size);
+	else
+		chiaki_audio_header_set(&audio_header_s, 2, 16, SIM_AUDIO_RATE, 480);
+	uint8_t audio_header[CHIAKI_AUDIO_HEADER_SIZE];
+	chiaki_audio_header_save(&audio_header_s, audio_header);
+	ChiakiPBBuf audio_header_buf = { sizeof(audio_header), audio_header };
+
+	tkproto_TakionMessage msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.type = tkproto_TakionMessage_PayloadType_STREAMINFO;
+	msg.has_stream_info_payload = true;
+	msg.stream_info_payload.resolution.arg = &resolution;
+	msg.stream_info_payload.resolution.funcs.encode = sim_pb_encode_resolution;
+	msg.stream_info_payload.audio_header.arg = &audio_header_buf;
+	msg.stream_info_payload.audio_header.funcs.encode = chiaki_pb_encode_buf;
+	CHIAKI_LOGI(sim->log, "Sending streaminfo with %ux%u", resolution.width, resolution.height);
+	return sim_send_message(sim, &msg);
+}
+
+/**
+ * Decrypt the launch spec the way stream_connection_send_big() encrypted it and pick the handshake key
+ * and the requested resolution out of its JSON.
+ */
+static ChiakiErrorCode sim_parse_launch_spec(Sim *sim, const char *launch_spec_b64)
+{
+	uint8_t json[SIM_LAUNCH_SPEC_SIZE_MAX];
+	size_t json_size = sizeof(json) - 1;
+	ChiakiErrorCode err = chiaki_base64_decode(launch_spec_b64, strlen(launch_spec_b64), json, &json_size);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	uint8_t key[SIM_LAUNCH_SPEC_SIZE_MAX];
+	memset(key, 0, json_size);
+	err = chiaki_rpcrypt_encrypt(&sim->rpcrypt, 0, key, key, json_size);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	for(size_t i=0; i<json_size; i++)
+		json[i] ^= key[i];
+	json[json_size] = '\0';
+	CHIAKI_LOGV(sim->log, "LaunchSpec: %s", (char *)json);
+
+	static const char handshake_key_prefix[] = "\"handshakeKey\":\"";
+	char *handshake_key = strstr((char *)json, handshake_key_prefix);
+	if(!handshake_key)
+		return CHIAKI_ERR_INVALID_DATA;
+	handshake_key += sizeof(handshake_key_prefix) - 1;
+	char *handshake_key_end = strchr(handshake_key, '"');
+	if(!handshake_key_end)
+		return CHIAKI_ERR_INVALID_DATA;
+	size_t handshake_key_size = sizeof(sim->handshake_key);
+	err = chiaki_base64_decode(handshake_key, (size_t)(handshake_key_end - handshake_key), sim->handshake_key, &handshake_key_size);
+	if(err != CHIAKI_ERR_SUCCESS || handshake_key_size != sizeof(sim->handshake_key))
+		return CHIAKI_ERR_INVALID_DATA;
+
+	char *width = strstr((char *)json, "\"width\":");
+	char *height = strstr((char *)json, "\"height\":");
+	sim->launch_width = width ? (unsigned int)strtoul(width + 8, NULL, 10) : 1280;
+	sim->launch_height = height ? (unsigned int)strtoul(height + 9, NULL, 10) : 720;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static void sim_handle_big(Sim *sim, tkproto_BigPayload *big, const char *session_key, const char *launch_spec,
+		ChiakiPBDecodeBuf *ecdh_pub_key, ChiakiPBDecodeBuf *ecdh_sig)
+{
+	if(sim->crypt_valid)
+	{
+		CHIAKI_LOGW(sim->log, "Received another big, ignoring it");
+		return;
+	}
+	CHIAKI_LOGI(sim->log, "Big received with client version %u", (unsigned int)big->client_version);
+	if(big->client_version != 9 && big->client_version != 12)
+	{
+		CHIAKI_LOGE(sim->log, "Only Takion versions 9 and 12 are supported");
+		goto error;
+	}
+	sim->protocol_version = big->client_version;
+
+	if(sim_parse_launch_spec(sim, launch_spec) != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(sim->log, "Failed to read the handshake key from the launch spec");
+		goto error;
+	}
+
+	if(chiaki_ecdh_init(&sim->ecdh) != CHIAKI_ERR_SUCCESS)
+		goto error;
+	sim->ecdh_valid = true;
+	uint8_t ecdh_secret[CHIAKI_ECDH_SECRET_SIZE];
+	if(chiaki_ecdh_derive_secret(&sim->ecdh, ecdh_secret, ecdh_pub_key->buf, ecdh_pub_key->size,
+			sim->handshake_key, ecdh_sig->buf, ecdh_sig->size) != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(sim->log, "Failed to derive the ECDH secret from big");
+		goto error;
+	}
+	uint8_t local_pub_key[128];
+	ChiakiPBBuf local_pub_key_buf = { sizeof(local_pub_key), local_pub_key };
+	uint8_t local_sig[32];
+	ChiakiPBBuf local_sig_buf = { sizeof(local_sig), local_sig };
+	if(chiaki_ecdh_get_local_pub_key(&sim->ecdh, local_pub_key, &local_pub_key_buf.size,
+			sim->handshake_key, local_sig, &local_sig_buf.size) != CHIAKI_ERR_SUCCESS)
+		goto error;
+
+	// our packets are the client's remote ones
+	if(chiaki_gkcrypt_init(&sim->gkcrypt, sim->log, 0, 3, sim->handshake_key, ecdh_secret) != CHIAKI_ERR_SUCCESS)
+		goto error;
+	sim->crypt_valid = true;
+	sim->key_pos = 0;
+
+	tkproto_TakionMessage msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.type = tkproto_TakionMessage_PayloadType_BANG;
+	msg.has_bang_payload = true;
+	msg.bang_payload.server_version = sim->protocol_version;
+	msg.bang_payload.token = 0;
+	msg.bang_payload.encrypted_key_accepted = true;
+	msg.bang_payload.version_accepted = true;
+	msg.bang_payload.session_key.arg = (void *)session_key;
+	msg.bang_payload.session_key.funcs.encode = chiaki_pb_encode_string;
+	msg.bang_payload.ecdh_pub_key.arg = &local_pub_key_buf;
+	msg.bang_payload.ecdh_pub_key.funcs.encode = chiaki_pb_encode_buf;
+	msg.bang_payload.ecdh_sig.arg = &local_sig_buf;
+	msg.bang_payload.ecdh_sig.funcs.encode = chiaki_pb_encode_buf;
+	if(sim_send_message(sim, &msg) != CHIAKI_ERR_SUCCESS || sim_send_streaminfo(sim) != CHIAKI_ERR_SUCCESS)
+		goto error;
+	return;
+
+error:
+	sim->finished = true;
+}
+
+static void sim_handle_message(Sim *sim, uint8_t *buf, size_t buf_size)
+{
+	char session_key[CHIAKI_SESSION_ID_SIZE_MAX];
+	ChiakiPBDecodeBuf session_key_buf = { sizeof(session_key) - 1, 0, (uint8_t *)session_key };
+	char launch_spec[SIM_LAUNCH_SPEC_SIZE_MAX];
+	ChiakiPBDecodeBuf launch_spec_buf = { sizeof(launch_spec) - 1, 0, (uint8_t *)launch_spec };
+	uint8_t ecdh_pub_key[128];
+	ChiakiPBDecodeBuf ecdh_pub_key_buf = { sizeof(ecdh_pub_key), 0, ecdh_pub_key };
+	uint8_t ecdh_sig[32];
+	ChiakiPBDecodeBuf ecdh_sig_buf = { sizeof(ecdh_sig), 0, ecdh_sig };
+
+	tkproto_TakionMessage msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.big_payload.session_key.arg = &session_key_buf;
+	msg.big_payload.session_key.funcs.decode = chiaki_pb_decode_buf;
+	msg.big_payload.launch_spec.arg = &launch_spec_buf;
+	msg.big_payload.launch_spec.funcs.decode = chiaki_pb_decode_buf;
+	msg.big_payload.ecdh_pub_key.arg = &ecdh_pub_key_buf;
+	msg.big_payload.ecdh_pub_key.funcs.decode = chiaki_pb_decode_buf;
+	msg.big_payload.ecdh_sig.arg = &ecdh_sig_buf;
+	msg.big_payload.ecdh_sig.funcs.decode = chiaki_pb_decode_buf;
+
+	pb_istream_t stream = pb_istream_from_buffer(buf, buf_size);
+	if(!pb_decode(&stream, tkproto_TakionMessage_fields, &msg))
+	{
+		CHIAKI_LOGE(sim->log, "Failed to decode data protobuf");
+		return;
+	}
+
+	switch(msg.type)
+	{
+		case tkproto_TakionMessage_PayloadType_BIG:
+			if(!msg.has_big_payload)
+				break;
+			session_key[session_key_buf.size] = '\0';
+			launch_spec[launch_spec_buf.size] = '\0';
+			sim_handle_big(sim, &msg.big_payload, session_key, launch_spec, &ecdh_pub_key_buf, &ecdh_sig_buf);
+			break;
+		case tkproto_TakionMessage_PayloadType_STREAMINFOACK:
+			if(!sim->streaming)
+			{
+				CHIAKI_LOGI(sim->log, "Streaminfo ack received, streaming");
+				sim->streaming = true;
+				sim->stats.start_us = chiaki_time_now_monotonic_us();
+			}
+			break;
+		case tkproto_TakionMessage_PayloadType_DISCONNECT:
+			CHIAKI_LOGI(sim->log, "Client disconnected");
+			sim->finished = true;
+			break;
+		default:
+			break;
+	}
+}
+
+/**
+ * Handle a data chunk, reassembling messages split into a first chunk and continuations
+ * like stream_connection_send_big() does.
+ */
+static void sim_takion_handle_data(Sim *sim, uint8_t chunk_flags, uint8_t *payload, size_t payload_size)
+{
+	size_t header_size = sim->message_assembling ? 8 : 9;
+	if(payload_size < header_size)
+		return;
+	ChiakiSeqNum32 seq_num = ntohl(*((chiaki_unaligned_uint32_t *)payload));
+	if(seq_num != sim->seq_num_remote_next)
+	{
+		// duplicate or out of order, the client will send it again
+		sim_takion_send_data_ack(sim, sim->seq_num_remote_next - 1);
+		return;
+	}
+	sim->seq_num_remote_next++;
+	sim_takion_send_data_ack(sim, seq_num);
+
+	if(!sim->message_assembling)
+	{
+		sim->message_size = 0;
+		if(payload[8] != CHIAKI_TAKION_MESSAGE_DATA_TYPE_PROTOBUF)
+			return;
+	}
+
+	size_t data_size = payload_size - header_size;
+	if(sim->message_size + data_size > sizeof(sim->message_buf))
+	{
+		CHIAKI_LOGE(sim->log, "Received message is too big, dropping it");
+		sim->message_assembling = false;
+		return;
+	}
+	memcpy(sim->message_buf + sim->message_size, payload + header_size, data_size);
+	sim->message_size += data_size;
+
+	sim->message_assembling = !(chunk_flags & 1);
+	if(!sim->message_assembling)
+		sim_handle_message(sim, sim->message_buf, sim->message_size);
+}
+
+static void sim_takion_handle_init(Sim *sim, uint8_t *payload, size_t payload_size)
+{
+	if(sim->takion_connected || payload_size != 0x10)
+		return;
+	sim->tag_remote = ntohl(*((chiaki_unaligned_uint32_t *)(payload + 0)));
+	sim->seq_num_remote_next = ntohl(*((chiaki_unaligned_uint32_t *)(payload + 0xc)));
+	do
+		sim->tag_local = chiaki_random_32();
+	while(!sim->tag_local);
+	// the client expects our data to start at our tag
+	sim->seq_num_local = sim->tag_local;
+
+	uint8_t packet[1 + SIM_TAKION_MESSAGE_HEADER_SIZE + 0x10 + SIM_TAKION_COOKIE_SIZE];
+	packet[0] = SIM_TAKION_PACKET_TYPE_CONTROL;
+	sim_write_message_header(packet + 1, sim->tag_remote, 0, SIM_TAKION_CHUNK_TYPE_INIT_ACK, 0, 0x10 + SIM_TAKION_COOKIE_SIZE);
+	uint8_t *pl = packet + 1 + SIM_TAKION_MESSAGE_HEADER_SIZE;
+	*((chiaki_unaligned_uint32_t *)(pl + 0)) = htonl(sim->tag_local);
+	*((chiaki_unaligned_uint32_t *)(pl + 4)) = htonl(SIM_TAKION_A_RWND);
+	*((chiaki_unaligned_uint16_t *)(pl + 8)) = htons(SIM_TAKION_STREAMS);
+	*((chiaki_unaligned_uint16_t *)(pl + 0xa)) = htons(SIM_TAKION_STREAMS);
+	*((chiaki_unaligned_uint32_t *)(pl + 0xc)) = htonl(sim->tag_local);
+	chiaki_random_bytes_crypt(pl + 0x10, SIM_TAKION_COOKIE_SIZE);
+	sim_takion_send(sim, packet, sizeof(packet), 0);
+}
+
+static void sim_takion_handle_packet(Sim *sim, uint8_t *buf, size_t buf_size)
+{
+	// AV, feedback and congestion packets from the client are not interesting here
+	if(buf_size < 1 + SIM_TAKION_MESSAGE_HEADER_SIZE || (buf[0] & 0xf) != SIM_TAKION_PACKET_TYPE_CONTROL)
+		return;
+	uint8_t *msg = buf + 1;
+	size_t msg_size = buf_size - 1;
+	uint32_t tag = ntohl(*((chiaki_unaligned_uint32_t *)msg));
+	uint8_t chunk_type = msg[0xc];
+	uint8_t chunk_flags = msg[0xd];
+	size_t payload_size = ntohs(*((chiaki_unaligned_uint16_t *)(msg + 0xe)));
+	if(payload_size < 4 || msg_size != payload_size + 0xc)
+		return;
+	payload_size -= 4;
+	uint8_t *payload = msg + SIM_TAKION_MESSAGE_HEADER_SIZE;
+
+	if(chunk_type == SIM_TAKION_CHUNK_TYPE_INIT)
+	{
+		sim_takion_handle_init(sim, payload, payload_size);
+		return;
+	}
+	if(!sim->tag_local || tag != sim->tag_local)
+		return;
+
+	switch(chunk_type)
+	{
+		case SIM_TAKION_CHUNK_TYPE_COOKIE:
+		{
+			uint8_t packet[1 + SIM_TAKION_MESSAGE_HEADER_SIZE];
+			packet[0] = SIM_TAKION_PACKET_TYPE_CONTROL;
+			sim_write_message_header(packet + 1, sim->tag_remote, 0, SIM_TAKION_CHUNK_TYPE_COOKIE_ACK, 0, 0);
+			sim_takion_send(sim, packet, sizeof(packet), 0);
+			if(!sim->takion_connected)
+				CHIAKI_LOGI(sim->log, "Takion connected");
+			sim->takion_connected = true;
+			break;
+		}
+		case SIM_TAKION_CHUNK_TYPE_DATA:
+			if(sim->takion_connected)
+				sim_takion_handle_data(sim, chunk_flags, payload, payload_size);
+			break;
+		default:
+			break;
+	}
+}
+
+static bool sim_frame_buf_reserve(Sim *sim, size_t size)
+{
+	if(size <= sim->frame_buf_size)
+		return true;
+	uint8_t *buf = realloc(sim->frame_buf, size);
+	if(!buf)
+		return false;
+	sim->frame_buf = buf;
+	sim->frame_buf_size = size;
+	return true;
+}
+
+/**
+ * Send the next access unit, padded to the configured bitrate with a filler NAL,
+ * as source units the frame processor can reassemble plus FEC units over them.
+ */
+static void sim_send_video_frame(Sim *sim)
+{
+	SimConfig *config = sim->config;
+	VideoSource *video = sim->video;
+	const uint8_t *frame = video->data + video->frame_offsets[video->frame_cur];
+	size_t frame_size = video->frame_offsets[video->frame_cur + 1] - video->frame_offsets[video->frame_cur];
+	video->frame_cur = (video->frame_cur + 1) % video->frames_count;
+
+	size_t padded_size = frame_size;
+	if(config->bitrate_kbps)
+	{
+		size_t target_size = (size_t)config->bitrate_kbps * 1000 / 8 / config->fps;
+		if(target_size >= frame_size + SIM_FILLER_SIZE_MIN)
+			padded_size = target_size;
+	}
+
+	size_t unit_size = config->unit_size;
+	size_t unit_payload_size = unit_size - 2;
+	unsigned int k = (unsigned int)((padded_size + unit_payload_size - 1) / unit_payload_size);
+	double fec_units = k * config->fec_ratio;
+	unsigned int m = (unsigned int)fec_units;
+	if((double)m < fec_units)
+		m++;
+	if(m < 1)
+		m = 1;
+	if(k + m > CHIAKI_FEC_UNITS_MAX)
+	{
+		if(!sim->stats.video_frames_dropped)
+			CHIAKI_LOGW(sim->log, "Frame of %llu bytes needs more than %u units, dropping frames like this",
+					(unsigned long long)padded_size, CHIAKI_FEC_UNITS_MAX);
+		sim->stats.video_frames_dropped++;
+		return;
+	}
+
+	size_t units_offset = (padded_size + 0xf) & ~(size_t)0xf;
+	if(!sim_frame_buf_reserve(sim, units_offset + (size_t)(k + m) * unit_size))
+	{
+		sim->stats.video_frames_dropped++;
+		return;
+	}
+	uint8_t *au = sim->frame_buf;
+	memcpy(au, frame, frame_size);
+	if(padded_size > frame_size)
+	{
+		static const uint8_t filler_header[] = { 0, 0, 0, 1, 0x0c };
+		memcpy(au + frame_size, filler_header, sizeof(filler_header));
+		memset(au + frame_size + sizeof(filler_header), 0xff, padded_size - frame_size - sizeof(filler_header) - 1);
+		au[padded_size - 1] = 0x80;
+	}
+
+	// every source unit starts with the number of bytes it is shorter than unit_size
+	uint8_t *units = sim->frame_buf + units_offset;
+	memset(units, 0, (size_t)k * unit_size);
+	size_t unit_data_sizes[CHIAKI_FEC_UNITS_MAX];
+	for(unsigned int i=0; i<k; i++)
+	{
+		size_t offset = (size_t)i * unit_payload_size;
+		size_t chunk_size = padded_size - offset < unit_payload_size ? padded_size - offset : unit_payload_size;
+		uint8_t *unit = units + (size_t)i * unit_size;
+		*((chiaki_unaligned_uint16_t *)unit) = htons((uint16_t)(unit_payload_size - chunk_size));
+		memcpy(unit + 2, au + offset, chunk_size);
+		unit_data_sizes[i] = chunk_size + 2;
+	}
+	if(chiaki_fec_encode(units, unit_size, unit_size, k, m) != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(sim->log, "FEC encoding failed");
+		sim->stats.video_frames_dropped++;
+		return;
+	}
+
+	sim->video_frame_index++;
+	for(unsigned int i=0; i<k+m; i++)
+	{
+		ChiakiTakionAVPacket packet = { 0 };
+		packet.is_video = true;
+		packet.packet_index = sim->video_packet_index++;
+		packet.frame_index = sim->video_frame_index;
+		packet.unit_index = (ChiakiSeqNum16)i;
+		packet.units_in_frame_total = (uint16_t)(k + m);
+		packet.units_in_frame_fec = (uint16_t)m;
+		size_t data_size = i < k ? unit_data_sizes[i] : unit_size;
+		if(sim_takion_send_av(sim, &packet, units + (size_t)i * unit_size, data_size) != CHIAKI_ERR_SUCCESS)
+			return;
+		sim->stats.video_packets++;
+		sim->stats.video_bytes += data_size;
+	}
+	sim->stats.video_frames++;
+}
+
+/**
+ * @return duration of the sent packet in us
+ */
+static uint64_t sim_send_audio_packet(Sim *sim)
+{
+	AudioSource *audio = sim->audio;
+	AudioPacket *p = &audio->packets[audio->packet_cur];
+	audio->packet_cur = (audio->packet_cur + 1) % audio->packets_count;
+
+	ChiakiTakionAVPacket packet = { 0 };
+	packet.is_video = false;
+	packet.codec = 5;
+	packet.packet_index = sim->audio_packet_index++;
+	packet.frame_index = ++sim->audio_frame_index;
+	packet.unit_index = 0;
+	packet.units_in_frame_total = 1;
+	// unit size, no fec units, one source unit, see chiaki_takion_av_packet_audio_unit_size()
+	packet.units_in_frame_fec = (uint16_t)((p->size << 8) | 1);
+	if(sim_takion_send_av(sim, &packet, audio->data + p->offset, p->size) == CHIAKI_ERR_SUCCESS)
+		sim->stats.audio_packets++;
+	return (uint64_t)(p->samples ? p->samples : audio->frame_size) * 1000000 / SIM_AUDIO_RATE;
+}
+
+static void sim_recv_datagrams(Sim *sim)
+{
+	uint8_t buf[SIM_DATAGRAM_SIZE_MAX];
+	while(true)
+	{
+		struct sockaddr_storage addr;
+		socklen_t addr_len = sizeof(addr);
+		ssize_t received = recvfrom(sim->udp_sock, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&addr, &addr_len);
+		if(received <= 0)
+			return;
+		if(!sim->takion_connected && !sim->tag_local)
+		{
+			// the first client to send an init is the one we talk to
+			memcpy(&sim->peer, &addr, addr_len);
+			sim->peer_len = addr_len;
+		}
+		else if(addr_len != sim->peer_len || memcmp(&addr, &sim->peer, addr_len) != 0)
+			continue;
+		sim_takion_handle_packet(sim, buf, (size_t)received);
+	}
+}
+
+static void sim_run_stream(Sim *sim)
+{
+	uint64_t video_interval_us = 1000000 / sim->config->fps;
+	uint64_t last_recv_us = chiaki_time_now_monotonic_us();
+	uint64_t next_video_us = 0;
+	uint64_t next_audio_us = 0;
+	bool was_streaming = false;
+	while(!sim->finished)
+	{
+		uint64_t now_us = chiaki_time_now_monotonic_us();
+		uint64_t wait_us = 100000;
+		if(sim->streaming)
+		{
+			if(!was_streaming)
+			{
+				next_video_us = next_audio_us = now_us;
+				was_streaming = true;
+			}
+			if(now_us >= next_video_us)
+			{
+				sim_send_video_frame(sim);
+				next_video_us += video_interval_us;
+				if(now_us > next_video_us + SIM_CATCH_UP_US)
+					next_video_us = now_us;
+			}
+			if(sim->audio && now_us >= next_audio_us)
+			{
+				next_audio_us += sim_send_audio_packet(sim);
+				if(now_us > next_audio_us + SIM_CATCH_UP_US)
+					next_audio_us = now_us;
+			}
+			uint64_t next_us = next_video_us;
+			if(sim->audio && next_audio_us < next_us)
+				next_us = next_audio_us;
+			now_us = chiaki_time_now_monotonic_us();
+			wait_us = next_us > now_us ? next_us - now_us : 0;
+		}
+
+		uint64_t idle_timeout_us = sim->takion_connected ? SIM_IDLE_TIMEOUT_US : (uint64_t)SIM_EXPECT_TIMEOUT_MS * 1000;
+		if(now_us - last_recv_us > idle_timeout_us)
+		{
+			CHIAKI_LOGW(sim->log, "Client sent nothing for %llu ms, ending session", (unsigned long long)(idle_timeout_us / 1000));
+			break;
+		}
+
+		struct pollfd fds[2] = {
+			{ sim->udp_sock, POLLIN, 0 },
+			{ sim->ctrl_sock, POLLIN, 0 }
+		};
+		if(poll(fds, 2, (int)((wait_us + 999) / 1000)) <= 0)
+			continue;
+		if(fds[0].revents & POLLIN)
+		{
+			sim_recv_datagrams(sim);
+			last_recv_us = chiaki_time_now_monotonic_us();
+		}
+		if(fds[1].revents & (POLLIN | POLLHUP | POLLERR))
+		{
+			// ctrl messages from the client are not answered
+			uint8_t buf[0x400];
+			if(recv(sim->ctrl_sock, buf, sizeof(buf), 0) <= 0)
+			{
+				CHIAKI_LOGI(sim->log, "Ctrl connection closed");
+				break;
+			}
+		}
+	}
+}
+
+static void sim_print_stats(Sim *sim)
+{
+	SimStats *stats = &sim->stats;
+	if(!stats->start_us)
+	{
+		printf("Session ended before streaming\n");
+		return;
+	}
+	uint64_t duration_us = chiaki_time_now_monotonic_us() - stats->start_us;
+	printf("Streamed for %.3f s\n", (double)duration_us / 1000000.0);
+	printf("Video: %llu frames, %llu dropped, %llu packets, %.2f MB\n",
+			(unsigned long long)stats->video_frames, (unsigned long long)stats->video_frames_dropped,
+			(unsigned long long)stats->video_packets, (double)stats->video_bytes / (1024.0 * 1024.0));
+	printf("Audio: %llu packets\n", (unsigned long long)stats->audio_packets);
+	if(duration_us)
+		printf("Sent: %llu datagrams, %.2f Mbit/s, %.1f frames/s\n", (unsigned long long)stats->datagrams,
+				(double)stats->bytes * 8.0 / (double)duration_us,
+				(double)stats->video_frames * 1000000.0 / (double)duration_us);
+}
+
+static chiaki_socket_t sim_socket(int type, uint16_t port)
+{
+	chiaki_socket_t sock = socket(AF_INET, type, 0);
+	if(CHIAKI_SOCKET_IS_INVALID(sock))
+		return sock;
+	int one = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if(type == SOCK_DGRAM)
+	{
+		// a frame's units go out in one burst
+		int send_buf_size = SIM_SEND_BUF_SIZE;
+		setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &send_buf_size, sizeof(send_buf_size));
+	}
+	struct sockaddr_in addr = { 0 };
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || (type == SOCK_STREAM && listen(sock, 4) < 0))
+	{
+		CHIAKI_SOCKET_CLOSE(sock);
+		return CHIAKI_INVALID_SOCKET;
+	}
+	return sock;
+}
+
+static void sim_session(Sim *sim, chiaki_socket_t tcp_sock)
+{
+	chiaki_socket_t sock = accept(tcp_sock, NULL, NULL);
+	if(CHIAKI_SOCKET_IS_INVALID(sock))
+		return;
+	ChiakiErrorCode err = sim_session_request(sim, sock);
+	CHIAKI_SOCKET_CLOSE(sock);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return;
+
+	if(!wait_readable(tcp_sock, SIM_EXPECT_TIMEOUT_MS))
+	{
+		CHIAKI_LOGE(sim->log, "Client did not start ctrl");
+		return;
+	}
+	sim->ctrl_sock = accept(tcp_sock, NULL, NULL);
+	if(CHIAKI_SOCKET_IS_INVALID(sim->ctrl_sock))
+		return;
+	if(sim_ctrl_start(sim) == CHIAKI_ERR_SUCCESS)
+	{
+		// drop whatever a previous client left behind
+		uint8_t buf[SIM_DATAGRAM_SIZE_MAX];
+		while(recv(sim->udp_sock, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+		sim_run_stream(sim);
+		sim_print_stats(sim);
+	}
+	CHIAKI_SOCKET_CLOSE(sim->ctrl_sock);
+}
+
+static void print_usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s --morning <hex> --video <file.h264> [options]\n", name);
+	fprintf(stderr, "  --morning     morning of the registration, 32 hex digits\n");
+	fprintf(stderr, "  --video       H.264 Annex B stream to send, looped\n");
+	fprintf(stderr, "  --audio       Ogg Opus stream to send, looped\n");
+	fprintf(stderr, "  --fps         video frames per second (default 60)\n");
+	fprintf(stderr, "  --bitrate     pad frames with filler data up to this many kbit/s\n");
+	fprintf(stderr, "  --unit-size   video unit size in bytes, rounded down to 16 (default %u)\n", SIM_UNIT_SIZE_DEFAULT);
+	fprintf(stderr, "  --fec-ratio   FEC units per source unit (default 0.05), at least one per frame\n");
+	fprintf(stderr, "  --width       width to announce instead of the requested one\n");
+	fprintf(stderr, "  --height      height to announce instead of the requested one\n");
+}
+
+int main(int argc, char **argv)
+{
+	SimConfig config = { 0 };
+	config.fps = 60;
+	config.unit_size = SIM_UNIT_SIZE_DEFAULT;
+	config.fec_ratio = 0.05;
+	bool morning_set = false;
+	bool verbose = false;
+	for(int i=1; i<argc; i++)
+	{
+		const char *arg = argv[i];
+		const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+		if(!strcmp(arg, "--verbose"))
+			verbose = true;
+		else if(!value)
+		{
+			print_usage(argv[0]);
+			return 1;
+		}
+		else if(!strcmp(arg, "--morning"))
+			morning_set = parse_hex(config.morning, sizeof(config.morning), value) == sizeof(config.morning);
+		else if(!strcmp(arg, "--video"))
+			config.video_filename = value;
+		else if(!strcmp(arg, "--audio"))
+			config.audio_filename = value;
+		else if(!strcmp(arg, "--fps"))
+			config.fps = (unsigned int)strtoul(value, NULL, 0);
+		else if(!strcmp(arg, "--bitrate"))
+			config.bitrate_kbps = (unsigned int)strtoul(value, NULL, 0);
+		else if(!strcmp(arg, "--unit-size"))
+			config.unit_size = (size_t)strtoul(value, NULL, 0) & ~(size_t)0xf;
+		else if(!strcmp(arg, "--fec-ratio"))
+			config.fec_ratio = strtod(value, NULL);
+		else if(!strcmp(arg, "--width"))
+			config.width = (unsigned int)strtoul(value, NULL, 0);
+		else if(!strcmp(arg, "--height"))
+			config.height = (unsigned int)strtoul(value, NULL, 0);
+		else
+		{
+			print_usage(argv[0]);
+			return 1;
+		}
+		if(value && strcmp(arg, "--verbose"))
+			i++;
+	}
+	if(!morning_set || !config.video_filename || !config.fps
+			|| config.unit_size < 0x20 || config.unit_size > SIM_UNIT_SIZE_MAX || config.fec_ratio < 0.0)
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	ChiakiErrorCode err = chiaki_lib_init();
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to init lib: %s\n", chiaki_error_string(err));
+		return 1;
+	}
+
+	ChiakiLog log;
+	chiaki_log_init(&log, verbose ? CHIAKI_LOG_ALL : CHIAKI_LOG_ALL & ~(CHIAKI_LOG_TRACE | CHIAKI_LOG_VERBOSE | CHIAKI_LOG_DEBUG),
+			chiaki_log_cb_print, NULL);
+
+	int ret = 1;
+	VideoSource video;
+	if(video_source_init(&video, config.video_filename) != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to load %s\n", config.video_filename);
+		return 1;
+	}
+	AudioSource audio;
+	if(config.audio_filename && audio_source_init(&audio, config.audio_filename) != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to load %s\n", config.audio_filename);
+		goto error_video;
+	}
+	printf("Loaded %llu video frames", (unsigned long long)video.frames_count);
+	if(config.audio_filename)
+		printf(" and %llu audio packets", (unsigned long long)audio.packets_count);
+	printf("\n");
+
+	chiaki_socket_t tcp_sock = sim_socket(SOCK_STREAM, SIM_SESSION_PORT);
+	chiaki_socket_t udp_sock = sim_socket(SOCK_DGRAM, SIM_STREAM_PORT);
+	if(CHIAKI_SOCKET_IS_INVALID(tcp_sock) || CHIAKI_SOCKET_IS_INVALID(udp_sock))
+	{
+		fprintf(stderr, "Failed to listen on ports %d and %d\n", SIM_SESSION_PORT, SIM_STREAM_PORT);
+		goto error_sockets;
+	}
+	printf("Waiting for clients on ports %d and %d\n", SIM_SESSION_PORT, SIM_STREAM_PORT);
+
+	while(true)
+	{
+		Sim sim;
+		memset(&sim, 0, sizeof(sim));
+		sim.log = &log;
+		sim.config = &config;
+		sim.video = &video;
+		sim.audio = config.audio_filename ? &audio : NULL;
+		sim.udp_sock = udp_sock;
+		sim.ctrl_sock = CHIAKI_INVALID_SOCKET;
+		sim_session(&sim, tcp_sock);
+		if(sim.crypt_valid)
+			chiaki_gkcrypt_fini(&sim.gkcrypt);
+		if(sim.ecdh_valid)
+			chiaki_ecdh_fini(&sim.ecdh);
+		free(sim.frame_buf);
+	}
+	ret = 0;
+
+error_sockets:
+	if(!CHIAKI_SOCKET_IS_INVALID(tcp_sock))
+		CHIAKI_SOCKET_CLOSE(tcp_sock);
+	if(!CHIAKI_SOCKET_IS_INVALID(udp_sock))
+		CHIAKI_SOCKET_CLOSE(udp_sock);
+	if(config.audio_filename)
+		audio_source_fini(&audio);
+error_video:
+	video_source_fini(&video);
+	return ret;
+}
@@ -0,0 +1,122 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/corruptframereporter.h>
+#include <chiaki/streamconnection.h>
+#include <chiaki/time.h>
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_corrupt_frame_reporter_init(ChiakiCorruptFrameReporter *reporter, ChiakiLog *log,
+		struct chiaki_stream_connection_t *stream_connection, unsigned int idr_frames)
+{
+	reporter->log = log;
+	reporter->stream_connection = stream_connection;
+	reporter->pending = false;
+	reporter->pending_start = 0;
+	reporter->pending_end = 0;
+	reporter->last_sent_us = 0;
+	reporter->idr_frames = idr_frames ? idr_frames : CHIAKI_CORRUPT_FRAME_IDR_FRAMES_DEFAULT;
+	reporter->unrecoverable_frames = 0;
+	reporter->reports = 0;
+	reporter->messages_sent = 0;
+	reporter->idr_requests = 0;
+	return chiaki_mutex_init(&reporter->mutex, false);
+}
+
+CHIAKI_EXPORT void chiaki_corrupt_frame_reporter_fini(ChiakiCorruptFrameReporter *reporter)
+{
+	if(reporter->reports)
+		CHIAKI_LOGI(reporter->log, "Corrupt Frame Reporter sent %llu reports in %llu messages, requested %llu IDR frames",
+				(unsigned long long)reporter->reports, (unsigned long long)reporter->messages_sent,
+				(unsigned long long)reporter->idr_requests);
+	chiaki_mutex_fini(&reporter->mutex);
+}
+
+/**
+ * Take the pending range if it is due. Must be called with the mutex locked.
+ *
+ * @return true if *start and *end should be sent after unlocking
+ */
+static bool reporter_take_due(ChiakiCorruptFrameReporter *reporter, ChiakiSeqNum16 *start, ChiakiSeqNum16 *end)
+{
+	if(!reporter->pending)
+		return false;
+	uint64_t now = chiaki_time_now_monotonic_us();
+	if(now - reporter->last_sent_us < CHIAKI_CORRUPT_FRAME_REPORT_INTERVAL_MS * 1000)
+		return false;
+	reporter->pending = false;
+	reporter->last_sent_us = now;
+	reporter->messages_sent++;
+	*start = reporter->pending_start;
+	*end = reporter->pending_end;
+	return true;
+}
+
+/**
+ * Merge a range into the pending one. Must be called with the mutex locked.
+ */
+static void reporter_add(ChiakiCorruptFrameReporter *reporter, ChiakiSeqNum16 start, ChiakiSeqNum16 end)
+{
+	reporter->reports++;
+	if(!reporter->pending)
+	{
+		reporter->pending = true;
+		reporter->pending_start = start;
+		reporter->pending_end = end;
+		return;
+	}
+	if(chiaki_seq_num_16_lt(start, reporter->pending_start))
+		reporter->pending_start = start;
+	if(chiaki_seq_num_16_gt(end, reporter->pending_end))
+		reporter->pending_end = end;
+}
+
+CHIAKI_EXPORT void chiaki_corrupt_frame_reporter_report(ChiakiCorruptFrameReporter *reporter, ChiakiSeqNum16 start, ChiakiSeqNum16 end)
+{
+	chiaki_mutex_lock(&reporter->mutex);
+	reporter_add(reporter, start, end);
+	bool send = reporter_take_due(reporter, &start, &end);
+	chiaki_mutex_unlock(&reporter->mutex);
+
+	if(send)
+		stream_connection_send_corrupt_frame(reporter->stream_connection, start, end);
+}
+
+CHIAKI_EXPORT void chiaki_corrupt_frame_reporter_report_unrecoverable(ChiakiCorruptFrameReporter *reporter, ChiakiSeqNum16 frame)
+{
+	chiaki_mutex_lock(&reporter->mutex);
+	reporter_add(reporter, frame, frame);
+	ChiakiSeqNum16 start, end;
+	bool send = reporter_take_due(reporter, &start, &end);
+	bool request_idr = ++reporter->unrecoverable_frames >= reporter->idr_frames;
+	if(request_idr)
+	{
+		reporter->unrecoverable_frames = 0;
+		reporter->idr_requests++;
+	}
+	chiaki_mutex_unlock(&reporter->mutex);
+
+	if(send)
+		stream_connection_send_corrupt_frame(reporter->stream_connection, start, end);
+	if(request_idr)
+	{
+		CHIAKI_LOGW(reporter->log, "Corrupt Frame Reporter requesting IDR frame after %u frames that could not be decoded", reporter->idr_frames);
+		stream_connection_send_idr_request(reporter->stream_connection);
+	}
+}
+
+CHIAKI_EXPORT void chiaki_corrupt_frame_reporter_frame_decoded(ChiakiCorruptFrameReporter *reporter)
+{
+	chiaki_mutex_lock(&reporter->mutex);
+	reporter->unrecoverable_frames = 0;
+	chiaki_mutex_unlock(&reporter->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_corrupt_frame_reporter_poll(ChiakiCorruptFrameReporter *reporter)
+{
+	ChiakiSeqNum16 start, end;
+	chiaki_mutex_lock(&reporter->mutex);
+	bool send = reporter_take_due(reporter, &start, &end);
+	chiaki_mutex_unlock(&reporter->mutex);
+
+	if(send)
+		stream_connection_send_corrupt_frame(reporter->stream_connection, start, end);
+}
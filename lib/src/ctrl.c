@@ -23,6 +23,7 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #endif
 
 #define SESSION_OSTYPE "Win10.0.0"
@@ -31,6 +32,9 @@
 
 #define CTRL_EXPECT_TIMEOUT 5000
 
+// messages are built in a buffer of this size on the stack if they fit
+#define CTRL_SEND_BUF_SIZE 512
+
 typedef enum ctrl_message_type_t {
 	CTRL_MESSAGE_TYPE_SESSION_ID = 0x33,
 	CTRL_MESSAGE_TYPE_HEARTBEAT_REQ = 0xfe,
@@ -61,14 +65,6 @@ typedef enum ctrl_login_state_t {
 	CTRL_LOGIN_STATE_PIN_INCORRECT = 0x1
 } CtrlLoginState;
 
-struct chiaki_ctrl_message_queue_t
-{
-	ChiakiCtrlMessageQueue *next;
-	uint16_t type;
-	uint8_t *payload;
-	size_t payload_size;
-};
-
 typedef struct ctrl_keyboard_open_t
 {
 	uint8_t unk[0x1C];
@@ -113,6 +109,42 @@ int rudp_packet_type_data_offset(uint8_t subtype)
 
 void chiaki_session_send_event(ChiakiSession *session, ChiakiEvent *event);
 
+/**
+ * Move the messages that have not been handled yet to the start of recv_buf.
+ */
+static void ctrl_recv_buf_compact(ChiakiCtrl *ctrl)
+{
+	if(!ctrl->recv_buf_begin)
+		return;
+	ctrl->recv_buf_size -= ctrl->recv_buf_begin;
+	if(ctrl->recv_buf_size > 0)
+		memmove(ctrl->recv_buf, ctrl->recv_buf + ctrl->recv_buf_begin, ctrl->recv_buf_size);
+	ctrl->recv_buf_begin = 0;
+}
+
+/**
+ * Append the ctrl message at offset in the data of a rudp message to recv_buf, if it is one.
+ */
+static void ctrl_rudp_payload_append(ChiakiCtrl *ctrl, const uint8_t *data, size_t data_size, size_t offset)
+{
+	// ctrl message header is 8 bytes
+	if(data_size < offset + 8)
+		return;
+	// check if message is ctrl message by making sure the payload size (size of message - 8 byte header is correct)
+	uint32_t ctrl_payload_size = ntohl(*(chiaki_unaligned_uint32_t *)(data + offset));
+	if(data_size - offset - 8 != ctrl_payload_size)
+		return;
+	if(ctrl->recv_buf_size + data_size - offset > CHIAKI_CTRL_RECV_BUF_SIZE)
+		ctrl_recv_buf_compact(ctrl);
+	if(ctrl->recv_buf_size + data_size - offset > CHIAKI_CTRL_RECV_BUF_SIZE)
+	{
+		CHIAKI_LOGE(ctrl->session->log, "Ctrl recv buffer overflow, dropping rudp ctrl message");
+		return;
+	}
+	memcpy(ctrl->recv_buf + ctrl->recv_buf_size, data + offset, data_size - offset);
+	ctrl->recv_buf_size += data_size - offset;
+}
+
 static void *ctrl_thread_func(void *user);
 static ChiakiErrorCode ctrl_message_send(ChiakiCtrl *ctrl, uint16_t type, const uint8_t *payload, size_t payload_size);
 static void ctrl_message_received_session_id(ChiakiCtrl *ctrl, uint8_t *payload, size_t payload_size);
@@ -137,7 +169,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_ctrl_init(ChiakiCtrl *ctrl, ChiakiSession *
 	ctrl->login_pin_size = 0;
 	ctrl->cant_displaya = false;
 	ctrl->cant_displayb = false;
-	ctrl->msg_queue = NULL;
+	ctrl->msg_queue_begin = 0;
+	ctrl->msg_queue_count = 0;
 	ctrl->keyboard_text_counter = 0;
 	ctrl->sock = CHIAKI_INVALID_SOCKET;
 
@@ -158,12 +191,7 @@ error_notif_pipe:
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_ctrl_start(ChiakiCtrl *ctrl)
 {
-	ChiakiErrorCode err = chiaki_thread_create(&ctrl->thread, ctrl_thread_func, ctrl);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
-
-	chiaki_thread_set_name(&ctrl->thread, "Chiaki Ctrl");
-	return err;
+	return chiaki_thread_create_role(&ctrl->thread, ctrl_thread_func, ctrl, CHIAKI_THREAD_ROLE_CTRL);
 }
 
 CHIAKI_EXPORT void chiaki_ctrl_stop(ChiakiCtrl *ctrl)
@@ -180,53 +208,82 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_ctrl_join(ChiakiCtrl *ctrl)
 	return chiaki_thread_join(&ctrl->thread, NULL);
 }
 
-CHIAKI_EXPORT void chiaki_ctrl_fini(ChiakiCtrl *ctrl)
+static inline const uint8_t *ctrl_message_payload(ChiakiCtrlMessage *msg)
 {
-	chiaki_stop_pipe_fini(&ctrl->notif_pipe);
-	chiaki_mutex_fini(&ctrl->notif_mutex);
-	free(ctrl->login_pin);
+	return msg->payload_alloc ? msg->payload_alloc : msg->payload;
+}
+
+/**
+ * Remove the first message from the queue, must be called with notif_mutex locked.
+ */
+static void ctrl_message_queue_pop(ChiakiCtrl *ctrl)
+{
+	ChiakiCtrlMessage *msg = &ctrl->msg_queue[ctrl->msg_queue_begin];
+	chiaki_arena_free(&ctrl->session->arena, msg->payload_alloc);
+	msg->payload_alloc = NULL;
+	ctrl->msg_queue_begin = (ctrl->msg_queue_begin + 1) % CHIAKI_CTRL_MESSAGE_QUEUE_SIZE;
+	ctrl->msg_queue_count--;
+}
+
+CHIAKI_EXPORT void chiaki_ctrl_reset(ChiakiCtrl *ctrl)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&ctrl->notif_mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+	ctrl->should_stop = false;
+	ctrl->login_pin_entered = false;
+	ctrl->login_pin_requested = false;
+	chiaki_arena_free(&ctrl->session->arena, ctrl->login_pin);
+	ctrl->login_pin = NULL;
+	ctrl->login_pin_size = 0;
+	ctrl->cant_displaya = false;
+	ctrl->cant_displayb = false;
+	while(ctrl->msg_queue_count)
+		ctrl_message_queue_pop(ctrl);
+	ctrl->msg_queue_begin = 0;
+	ctrl->keyboard_text_counter = 0;
+	ctrl->sock = CHIAKI_INVALID_SOCKET;
+	chiaki_stop_pipe_reset(&ctrl->notif_pipe);
+	chiaki_mutex_unlock(&ctrl->notif_mutex);
 }
 
-static void ctrl_message_queue_free(ChiakiCtrlMessageQueue *queue)
+CHIAKI_EXPORT void chiaki_ctrl_fini(ChiakiCtrl *ctrl)
 {
-	free(queue->payload);
-	free(queue);
+	while(ctrl->msg_queue_count)
+		ctrl_message_queue_pop(ctrl);
+	chiaki_stop_pipe_fini(&ctrl->notif_pipe);
+	chiaki_mutex_fini(&ctrl->notif_mutex);
+	chiaki_arena_free(&ctrl->session->arena, ctrl->login_pin);
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_ctrl_send_message(ChiakiCtrl *ctrl, uint16_t type, const uint8_t *payload, size_t payload_size)
 {
-	ChiakiCtrlMessageQueue *queue = CHIAKI_NEW(ChiakiCtrlMessageQueue);
-	if(!queue)
-		return CHIAKI_ERR_MEMORY;
-	queue->next = NULL;
-	queue->type = type;
-	if(payload)
+	if(!payload)
+		payload_size = 0;
+	uint8_t *payload_alloc = NULL;
+	if(payload_size > CHIAKI_CTRL_MESSAGE_INLINE_PAYLOAD_SIZE)
 	{
-		queue->payload = malloc(payload_size);
-		if(!queue->payload)
-		{
-			free(queue);
+		payload_alloc = chiaki_arena_alloc(&ctrl->session->arena, CHIAKI_ARENA_TAG_CTRL, payload_size);
+		if(!payload_alloc)
 			return CHIAKI_ERR_MEMORY;
-		}
-		memcpy(queue->payload, payload, payload_size);
-		queue->payload_size = payload_size;
-	}
-	else
-	{
-		queue->payload = NULL;
-		queue->payload_size = 0;
+		memcpy(payload_alloc, payload, payload_size);
 	}
+
 	ChiakiErrorCode err = chiaki_mutex_lock(&ctrl->notif_mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
-	if(!ctrl->msg_queue)
-		ctrl->msg_queue = queue;
-	else
+	if(ctrl->msg_queue_count >= CHIAKI_CTRL_MESSAGE_QUEUE_SIZE)
 	{
-		ChiakiCtrlMessageQueue *c = ctrl->msg_queue;
-		while(c->next)
-			c = c->next;
-		c->next = queue;
+		chiaki_mutex_unlock(&ctrl->notif_mutex);
+		chiaki_arena_free(&ctrl->session->arena, payload_alloc);
+		CHIAKI_LOGE(ctrl->session->log, "Ctrl message queue is full, dropping message type %x", (unsigned int)type);
+		return CHIAKI_ERR_OVERFLOW;
 	}
+	ChiakiCtrlMessage *msg = &ctrl->msg_queue[(ctrl->msg_queue_begin + ctrl->msg_queue_count) % CHIAKI_CTRL_MESSAGE_QUEUE_SIZE];
+	msg->type = type;
+	msg->payload_size = payload_size;
+	msg->payload_alloc = payload_alloc;
+	if(!payload_alloc && payload_size)
+		memcpy(msg->payload, payload, payload_size);
+	ctrl->msg_queue_count++;
 	chiaki_mutex_unlock(&ctrl->notif_mutex);
 	chiaki_stop_pipe_stop(&ctrl->notif_pipe);
 	return CHIAKI_ERR_SUCCESS;
@@ -234,14 +291,14 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_ctrl_send_message(ChiakiCtrl *ctrl, uint16_
 
 CHIAKI_EXPORT void chiaki_ctrl_set_login_pin(ChiakiCtrl *ctrl, const uint8_t *pin, size_t pin_size)
 {
-	uint8_t *buf = malloc(pin_size);
+	uint8_t *buf = chiaki_arena_alloc(&ctrl->session->arena, CHIAKI_ARENA_TAG_CTRL, pin_size);
 	if(!buf)
 		return;
 	memcpy(buf, pin, pin_size);
 	ChiakiErrorCode err = chiaki_mutex_lock(&ctrl->notif_mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
 	if(ctrl->login_pin_entered)
-		free(ctrl->login_pin);
+		chiaki_arena_free(&ctrl->session->arena, ctrl->login_pin);
 	ctrl->login_pin_entered = true;
 	ctrl->login_pin = buf;
 	ctrl->login_pin_size = pin_size;
@@ -259,7 +316,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_ctrl_keyboard_set_text(ChiakiCtrl *ctrl, co
 	const uint32_t length = strlen(text);
 	const size_t payload_size = sizeof(CtrlKeyboardTextRequestMessage) + length;
 
-	uint8_t *payload = malloc(payload_size);
+	uint8_t *payload = chiaki_arena_alloc(&ctrl->session->arena, CHIAKI_ARENA_TAG_CTRL, payload_size);
 	if(!payload)
 		return CHIAKI_ERR_MEMORY;
 	memset(payload, 0, payload_size);
@@ -273,7 +330,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_ctrl_keyboard_set_text(ChiakiCtrl *ctrl, co
 	ChiakiErrorCode err;
 	err = chiaki_ctrl_send_message(ctrl, CTRL_MESSAGE_TYPE_KEYBOARD_TEXT_CHANGE_REQ, payload, payload_size);
 
-	free(payload);
+	chiaki_arena_free(&ctrl->session->arena, payload);
 	return err;
 }
 
@@ -319,17 +376,36 @@ static void *ctrl_thread_func(void *user)
 
 	CHIAKI_LOGI(ctrl->session->log, "Ctrl connected");
 
+	bool sock_waiter = false;
+	if(!ctrl->session->rudp)
+	{
+		err = chiaki_stop_pipe_waiter_init(&ctrl->sock_waiter, &ctrl->notif_pipe);
+		if(err == CHIAKI_ERR_SUCCESS)
+		{
+			sock_waiter = true;
+			err = chiaki_stop_pipe_waiter_add(&ctrl->sock_waiter, ctrl->sock, false);
+		}
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGE(ctrl->session->log, "Ctrl failed to create socket waiter");
+			ctrl_failed(ctrl, CHIAKI_QUIT_REASON_CTRL_UNKNOWN);
+			goto beach;
+		}
+	}
+
 	while(true)
 	{
 		bool overflow = false;
-		while(ctrl->recv_buf_size >= 8)
+		// a burst of messages is handled where it was received, only an incomplete one at the end is moved
+		while(ctrl->recv_buf_size - ctrl->recv_buf_begin >= 8)
 		{
-			uint32_t payload_size = *((uint32_t *)ctrl->recv_buf);
+			uint8_t *msg = ctrl->recv_buf + ctrl->recv_buf_begin;
+			uint32_t payload_size = *((chiaki_unaligned_uint32_t *)msg);
 			payload_size = ntohl(payload_size);
 
-			if(ctrl->recv_buf_size < 8 + payload_size)
+			if(ctrl->recv_buf_size - ctrl->recv_buf_begin < 8 + (size_t)payload_size)
 			{
-				if(8 + payload_size > sizeof(ctrl->recv_buf))
+				if(8 + (size_t)payload_size > CHIAKI_CTRL_RECV_BUF_SIZE)
 				{
 					CHIAKI_LOGE(ctrl->session->log, "Ctrl buffer overflow!");
 					overflow = true;
@@ -337,14 +413,16 @@ static void *ctrl_thread_func(void *user)
 				break;
 			}
 
-			uint16_t msg_type = *((chiaki_unaligned_uint16_t *)(ctrl->recv_buf + 4));
+			uint16_t msg_type = *((chiaki_unaligned_uint16_t *)(msg + 4));
 			msg_type = ntohs(msg_type);
 
-			ctrl_message_received(ctrl, msg_type, ctrl->recv_buf + 8, (size_t)payload_size);
-			ctrl->recv_buf_size -= 8 + payload_size;
-			if(ctrl->recv_buf_size > 0)
-				memmove(ctrl->recv_buf, ctrl->recv_buf + 8 + payload_size, ctrl->recv_buf_size);
+			ctrl->recv_buf_begin += 8 + payload_size;
+			ctrl_message_received(ctrl, msg_type, msg + 8, (size_t)payload_size);
 		}
+		if(ctrl->recv_buf_begin == ctrl->recv_buf_size)
+			ctrl->recv_buf_begin = ctrl->recv_buf_size = 0;
+		else
+			ctrl_recv_buf_compact(ctrl);
 
 		if(overflow)
 		{
@@ -356,18 +434,17 @@ static void *ctrl_thread_func(void *user)
 		if(ctrl->session->rudp)
 			err = chiaki_rudp_stop_pipe_select_single(ctrl->session->rudp, &ctrl->notif_pipe, UINT64_MAX);
 		else
-			err = chiaki_stop_pipe_select_single(&ctrl->notif_pipe, ctrl->sock, false, UINT64_MAX);
+			err = chiaki_stop_pipe_waiter_wait(&ctrl->sock_waiter, UINT64_MAX, NULL);
 		chiaki_mutex_lock(&ctrl->notif_mutex);
 
 		bool msg_queue_updated = false;
 		if(err == CHIAKI_ERR_CANCELED)
 		{
-			while(ctrl->msg_queue)
+			while(ctrl->msg_queue_count)
 			{
-				ctrl_message_send(ctrl, ctrl->msg_queue->type, ctrl->msg_queue->payload, ctrl->msg_queue->payload_size);
-				ChiakiCtrlMessageQueue *next = ctrl->msg_queue->next;
-				ctrl_message_queue_free(ctrl->msg_queue);
-				ctrl->msg_queue = next;
+				ChiakiCtrlMessage *msg = &ctrl->msg_queue[ctrl->msg_queue_begin];
+				ctrl_message_send(ctrl, msg->type, msg->payload_size ? ctrl_message_payload(msg) : NULL, msg->payload_size);
+				ctrl_message_queue_pop(ctrl);
 				msg_queue_updated = true;
 			}
 
@@ -376,7 +453,7 @@ static void *ctrl_thread_func(void *user)
 				CHIAKI_LOGI(ctrl->session->log, "Ctrl received entered Login PIN, sending to console");
 				ctrl_message_send(ctrl, CTRL_MESSAGE_TYPE_LOGIN_PIN_REP, ctrl->login_pin, ctrl->login_pin_size);
 				ctrl->login_pin_entered = false;
-				free(ctrl->login_pin);
+				chiaki_arena_free(&ctrl->session->arena, ctrl->login_pin);
 				ctrl->login_pin = NULL;
 				ctrl->login_pin_size = 0;
 				chiaki_stop_pipe_reset(&ctrl->notif_pipe);
@@ -403,10 +480,11 @@ static void *ctrl_thread_func(void *user)
 		int received = 0;
 		if(ctrl->session->rudp)
 		{
-			RudpMessage message;
+			// parsed in place in the rudp receive buffer, only valid until the next receive
+			RudpMessageView message;
 			uint16_t remote_counter = 0;
 			uint16_t ack_counter = 0;
-			err = chiaki_rudp_recv_only(ctrl->session->rudp, sizeof(ctrl->rudp_recv_buf) - ctrl->recv_buf_size, &message);
+			err = chiaki_rudp_recv_view(ctrl->session->rudp, &message);
 			if(err != CHIAKI_ERR_SUCCESS)
 			{
 				CHIAKI_LOGE(ctrl->session->log, "Failed to receive Rudp ctrl packet");
@@ -416,12 +494,12 @@ static void *ctrl_thread_func(void *user)
 			if(message.data_size < 4)
 			{
 				CHIAKI_LOGE(ctrl->session->log, "Rudp ctrl message response too small");
-				chiaki_rudp_print_message(ctrl->session->rudp, &message);
+				chiaki_log_hexdump(ctrl->session->log, CHIAKI_LOG_ERROR, message.data, message.data_size);
 				ctrl_failed(ctrl, CHIAKI_QUIT_REASON_CTRL_UNKNOWN);
 				break;
 			}
 			remote_counter = message.remote_counter;
-			while(true)
+			do
 			{
 				switch(message.subtype) // wrong but works ...
 				{
@@ -429,22 +507,16 @@ static void *ctrl_thread_func(void *user)
 					case 0x12:
 					case 0x26:
 					case 0x36:
+						if(message.data_size < 4)
+							break;
 						ack_counter = ntohs(*((chiaki_unaligned_uint16_t *)(message.data + 2)));
 						chiaki_rudp_ack_packet(ctrl->session->rudp, ack_counter);
 						chiaki_rudp_send_ack_message(ctrl->session->rudp, remote_counter);
-						int offset = rudp_packet_type_data_offset(message.subtype);
-						// ctrl message header is 8 bytes
-						if((message.data_size - offset) < 8)
-							break;
-						// check if message is ctrl message by making sure the payload size (size of message - 8 byte header is correct)
-						uint32_t ctrl_payload_size = ntohl(*(uint32_t*)(message.data + offset));
-						if((message.data_size - offset - 8) == ctrl_payload_size)
-						{
-							memcpy(ctrl->recv_buf + ctrl->recv_buf_size, message.data + offset, message.data_size - offset);
-							ctrl->recv_buf_size += message.data_size - offset;
-						}
+						ctrl_rudp_payload_append(ctrl, message.data, message.data_size, rudp_packet_type_data_offset(message.subtype));
 						break;
 					case 0x24:
+						if(message.data_size < 4)
+							break;
 						ack_counter = ntohs(*((chiaki_unaligned_uint16_t *)(message.data + 2)));
 						chiaki_rudp_ack_packet(ctrl->session->rudp, ack_counter);
 						break;
@@ -456,40 +528,14 @@ static void *ctrl_thread_func(void *user)
 						CHIAKI_LOGI(ctrl->session->log, "Received message of unknown type: 0x%04x", message.type);
 						chiaki_rudp_ack_packet(ctrl->session->rudp, ack_counter);
 						chiaki_rudp_send_ack_message(ctrl->session->rudp, remote_counter);
-						// we already checked before if data size was at least 4
-						int offset2 = 4;
-						// ctrl message header is 8 bytes
-						if((message.data_size - offset2) < 8)
-							break;
-						uint32_t ctrl_payload_size2 = ntohl(*(uint32_t*)(message.data + offset2));
-						if((message.data_size - offset2 - 8) == ctrl_payload_size2)
-						{
-							memcpy(ctrl->recv_buf + ctrl->recv_buf_size, message.data + offset2, message.data_size - offset2);
-							ctrl->recv_buf_size += message.data_size - offset2;
-						}
+						ctrl_rudp_payload_append(ctrl, message.data, message.data_size, 4);
 						break;
 				}
-				if(message.subMessage)
-				{
-					if(message.data)
-					{
-						free(message.data);
-						message.data = NULL;
-					}
-					RudpMessage *tmp = message.subMessage;
-					memcpy(&message, message.subMessage, sizeof(RudpMessage));
-					free(tmp);
-				}
-				else
-				{
-					chiaki_rudp_message_pointers_free(&message);
-					break;
-				}
-			}
+			} while(chiaki_rudp_message_view_next(&message));
 		}
 		else
 		{
-			received = recv(ctrl->sock, (CHIAKI_SOCKET_BUF_TYPE)ctrl->recv_buf + ctrl->recv_buf_size, sizeof(ctrl->recv_buf) - ctrl->recv_buf_size, 0);
+			received = recv(ctrl->sock, (CHIAKI_SOCKET_BUF_TYPE)ctrl->recv_buf + ctrl->recv_buf_size, CHIAKI_CTRL_RECV_BUF_SIZE - ctrl->recv_buf_size, 0);
 			if(received <= 0)
 			{
 				if(received < 0)
@@ -499,15 +545,18 @@ static void *ctrl_thread_func(void *user)
 				}
 				break;
 			}
-			CHIAKI_LOGI(ctrl->session->log, "CTRL RECEIVED");
-			chiaki_log_hexdump(ctrl->session->log, CHIAKI_LOG_INFO, ctrl->recv_buf + ctrl->recv_buf_size, received);
+			CHIAKI_LOGV(ctrl->session->log, "Ctrl received %d bytes", (int)received);
+			chiaki_log_hexdump(ctrl->session->log, CHIAKI_LOG_VERBOSE, ctrl->recv_buf + ctrl->recv_buf_size, received);
 		}
 
 
 		ctrl->recv_buf_size += received;
 	}
 
+beach:
 	chiaki_mutex_unlock(&ctrl->notif_mutex);
+	if(sock_waiter)
+		chiaki_stop_pipe_waiter_fini(&ctrl->sock_waiter);
 	if(!ctrl->session->rudp)
 	{
 		CHIAKI_SOCKET_CLOSE(ctrl->sock);
@@ -517,6 +566,22 @@ static void *ctrl_thread_func(void *user)
 	return NULL;
 }
 
+/**
+ * Send all of buf, which may take multiple calls to send().
+ */
+static ChiakiErrorCode ctrl_send_all(ChiakiCtrl *ctrl, const uint8_t *buf, size_t buf_size)
+{
+	while(buf_size)
+	{
+		int sent = send(ctrl->sock, (CHIAKI_SOCKET_BUF_TYPE)buf, buf_size, 0);
+		if(sent <= 0)
+			return CHIAKI_ERR_NETWORK;
+		buf += sent;
+		buf_size -= (size_t)sent;
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+
 static ChiakiErrorCode ctrl_message_send(ChiakiCtrl *ctrl, uint16_t type, const uint8_t *payload, size_t payload_size)
 {
 	assert(payload_size == 0 || payload);
@@ -526,71 +591,55 @@ static ChiakiErrorCode ctrl_message_send(ChiakiCtrl *ctrl, uint16_t type, const
 	if(payload)
 		chiaki_log_hexdump(ctrl->session->log, CHIAKI_LOG_VERBOSE, payload, payload_size);
 
-	uint8_t *enc = NULL;
-	if(payload && payload_size)
+	// header and encrypted payload go out in a single write, so they end up in one segment
+	uint8_t stack_buf[CTRL_SEND_BUF_SIZE];
+	size_t buf_size = 8 + payload_size;
+	uint8_t *buf = stack_buf;
+	if(buf_size > sizeof(stack_buf))
 	{
-		ChiakiErrorCode err;
-		enc = malloc(payload_size);
-		if(!enc)
+		buf = chiaki_arena_alloc(&ctrl->session->arena, CHIAKI_ARENA_TAG_CTRL, buf_size);
+		if(!buf)
 			return CHIAKI_ERR_MEMORY;
+	}
+
+	*((chiaki_unaligned_uint32_t *)buf) = htonl((uint32_t)payload_size);
+	*((chiaki_unaligned_uint16_t *)(buf + 4)) = htons(type);
+	*((chiaki_unaligned_uint16_t *)(buf + 6)) = 0;
+
+	ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
+	if(payload && payload_size)
+	{
 		if(ctrl->session->rudp && type == CTRL_MESSAGE_TYPE_LOGIN_PIN_REP)
 		{
 			uint16_t local_counter = ctrl->crypt_counter_local++;
-			err = chiaki_rpcrypt_encrypt(&ctrl->session->rpcrypt, local_counter - 1, payload, enc, payload_size);
+			err = chiaki_rpcrypt_encrypt(&ctrl->session->rpcrypt, local_counter - 1, payload, buf + 8, payload_size);
 		}
 		else
-			err = chiaki_rpcrypt_encrypt(&ctrl->session->rpcrypt, ctrl->crypt_counter_local++, payload, enc, payload_size);
+			err = chiaki_rpcrypt_encrypt(&ctrl->session->rpcrypt, ctrl->crypt_counter_local++, payload, buf + 8, payload_size);
 		if(err != CHIAKI_ERR_SUCCESS)
 		{
 			CHIAKI_LOGE(ctrl->session->log, "Ctrl failed to encrypt payload");
-			free(enc);
-			return err;
+			goto beach;
 		}
 	}
 
-#ifdef __GNUC__
-	__attribute__((aligned(__alignof__(uint32_t))))
-#endif
-	uint8_t header[8];
-	*((uint32_t *)header) = htonl((uint32_t)payload_size);
-	*((uint16_t *)(header + 4)) = htons(type);
-	*((uint16_t *)(header + 6)) = 0;
-
 	if(ctrl->session->rudp)
 	{
-		uint8_t buf_size = 8 + payload_size;
-		uint8_t buf[buf_size];
-		memcpy(buf, header, 8);
-		memcpy(buf + 8, enc, payload_size);
-		ChiakiErrorCode err;
 		err = chiaki_rudp_send_ctrl_message(ctrl->session->rudp, buf, buf_size);
 		if(err != CHIAKI_ERR_SUCCESS)
-		{
 			CHIAKI_LOGE(ctrl->session->log, "Failed to send Ctrl Message");
-			return err;
-		}
 	}
 	else
 	{
-		int sent = send(ctrl->sock, (CHIAKI_SOCKET_BUF_TYPE)header, sizeof(header), 0);
-		if(sent < 0)
-		{
-			CHIAKI_LOGE(ctrl->session->log, "Failed to send Ctrl Message Header");
-			return CHIAKI_ERR_NETWORK;
-		}
-
-		if(enc)
-		{
-			sent = send(ctrl->sock, (CHIAKI_SOCKET_BUF_TYPE)enc, payload_size, 0);
-			free(enc);
-			if(sent < 0)
-			{
-				CHIAKI_LOGE(ctrl->session->log, "Failed to send Ctrl Message Payload");
-				return CHIAKI_ERR_NETWORK;
-			}
-		}
+		err = ctrl_send_all(ctrl, buf, buf_size);
+		if(err != CHIAKI_ERR_SUCCESS)
+			CHIAKI_LOGE(ctrl->session->log, "Failed to send Ctrl Message");
 	}
-	return CHIAKI_ERR_SUCCESS;
+
+beach:
+	if(buf != stack_buf)
+		chiaki_arena_free(&ctrl->session->arena, buf);
+	return err;
 }
 
 CHIAKI_EXPORT ChiakiErrorCode ctrl_message_go_home(ChiakiCtrl *ctrl)
@@ -917,6 +966,27 @@ static void ctrl_message_received_login(ChiakiCtrl *ctrl, uint8_t *payload, size
 	}
 }
 
+/**
+ * Send a keyboard event with text, which ends at the end of a payload in recv_buf, terminated in place.
+ * The byte behind it belongs to the next message or is the spare byte of recv_buf, so it is restored afterwards.
+ */
+static void ctrl_send_keyboard_event(ChiakiCtrl *ctrl, ChiakiEventType type, uint8_t *text, size_t text_size)
+{
+	ChiakiEvent keyboard_event;
+	keyboard_event.type = type;
+	keyboard_event.keyboard.text_str = NULL;
+	uint8_t next = 0;
+	if(text_size > 0)
+	{
+		next = text[text_size];
+		text[text_size] = '\0';
+		keyboard_event.keyboard.text_str = (const char *)text;
+	}
+	chiaki_session_send_event(ctrl->session, &keyboard_event);
+	if(text_size > 0)
+		text[text_size] = next;
+}
+
 static void ctrl_message_received_keyboard_open(ChiakiCtrl *ctrl, uint8_t *payload, size_t payload_size)
 {
 	assert(payload_size >= sizeof(CtrlKeyboardOpenMessage));
@@ -925,20 +995,7 @@ static void ctrl_message_received_keyboard_open(ChiakiCtrl *ctrl, uint8_t *paylo
 	msg->text_length = ntohl(msg->text_length);
 	assert(payload_size == sizeof(CtrlKeyboardOpenMessage) + msg->text_length);
 
-	uint8_t *buffer = msg->text_length > 0 ? malloc((size_t)msg->text_length + 1) : NULL;
-	if(buffer)
-	{
-		buffer[msg->text_length] = '\0';
-		memcpy(buffer, payload + sizeof(CtrlKeyboardOpenMessage), msg->text_length);
-	}
-
-	ChiakiEvent keyboard_event;
-	keyboard_event.type = CHIAKI_EVENT_KEYBOARD_OPEN;
-	keyboard_event.keyboard.text_str = (const char *)buffer;
-	chiaki_session_send_event(ctrl->session, &keyboard_event);
-
-	if(buffer)
-		free(buffer);
+	ctrl_send_keyboard_event(ctrl, CHIAKI_EVENT_KEYBOARD_OPEN, payload + sizeof(CtrlKeyboardOpenMessage), msg->text_length);
 }
 
 static void ctrl_message_received_keyboard_close(ChiakiCtrl *ctrl, uint8_t *payload, size_t payload_size)
@@ -960,20 +1017,7 @@ static void ctrl_message_received_keyboard_text_change(ChiakiCtrl *ctrl, uint8_t
 	msg->text_length1 = ntohl(msg->text_length1);
 	assert(payload_size == sizeof(CtrlKeyboardTextResponseMessage) + msg->text_length1);
 
-	uint8_t *buffer = msg->text_length1 > 0 ? malloc((size_t)msg->text_length1 + 1) : NULL;
-	if(buffer)
-	{
-		buffer[msg->text_length1] = '\0';
-		memcpy(buffer, payload + sizeof(CtrlKeyboardTextResponseMessage), msg->text_length1);
-	}
-
-	ChiakiEvent keyboard_event;
-	keyboard_event.type = CHIAKI_EVENT_KEYBOARD_TEXT_CHANGE;
-	keyboard_event.keyboard.text_str = (const char *)buffer;
-	chiaki_session_send_event(ctrl->session, &keyboard_event);
-
-	if(buffer)
-		free(buffer);
+	ctrl_send_keyboard_event(ctrl, CHIAKI_EVENT_KEYBOARD_TEXT_CHANGE, payload + sizeof(CtrlKeyboardTextResponseMessage), msg->text_length1);
 }
 
 typedef struct ctrl_response_t
@@ -1101,6 +1145,16 @@ static ChiakiErrorCode ctrl_connect(ChiakiCtrl *ctrl)
 
 		CHIAKI_LOGI(session->log, "Ctrl connected to %s:%d", session->connect_info.hostname, SESSION_CTRL_PORT);
 		ctrl->sock = sock;
+
+#ifdef TCP_NODELAY
+		// ctrl messages are small and mostly replies like heartbeats, don't hold them back
+		const int nodelay = 1;
+		if(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const CHIAKI_SOCKET_BUF_TYPE)&nodelay, sizeof(nodelay)) < 0)
+			CHIAKI_LOGW(session->log, "Ctrl failed to set TCP_NODELAY: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+#endif
+		ChiakiSocketOptions sock_options = { 0 };
+		sock_options.dscp = session->connect_info.dscp;
+		chiaki_socket_set_options(sock, &sock_options, "Ctrl", session->log);
 	}
 
 	uint8_t auth_enc[CHIAKI_RPCRYPT_KEY_SIZE];
@@ -1356,6 +1410,7 @@ static ChiakiErrorCode ctrl_connect(ChiakiCtrl *ctrl)
 		ctrl->session->display_sink.cantdisplay_cb(ctrl->session->display_sink.user, true);
 
 	// if we already got more data than the header, put the rest in the buffer.
+	ctrl->recv_buf_begin = 0;
 	ctrl->recv_buf_size = received_size - header_size;
 	if(ctrl->recv_buf_size > 0)
 		memcpy(ctrl->recv_buf, buf + header_size, ctrl->recv_buf_size);
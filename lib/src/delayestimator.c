@@ -0,0 +1,227 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/delayestimator.h>
+
+#include <math.h>
+
+// constants as used by the trendline estimator and overuse detector of Google Congestion Control
+#define SMOOTHING 0.9
+#define THRESHOLD_GAIN 4.0
+#define DELTAS_MAX 60
+#define THRESHOLD_INIT_MS 12.5
+#define THRESHOLD_MIN_MS 6.0
+#define THRESHOLD_MAX_MS 600.0
+#define THRESHOLD_K_UP 0.0087
+#define THRESHOLD_K_DOWN 0.039
+#define THRESHOLD_ADAPT_OFFSET_MAX_MS 15.0
+#define THRESHOLD_ADAPT_TIME_MAX_MS 100.0
+#define OVERUSE_TIME_MIN_MS 10.0
+
+// start over after a gap this long, the delay before and after is unrelated
+#define FRAME_GAP_MAX 64
+#define ARRIVAL_GAP_MAX_US 1000000
+
+CHIAKI_EXPORT const char *chiaki_delay_usage_string(ChiakiDelayUsage usage)
+{
+	switch(usage)
+	{
+		case CHIAKI_DELAY_USAGE_NORMAL:
+			return "normal";
+		case CHIAKI_DELAY_USAGE_OVERUSE:
+			return "overuse";
+		case CHIAKI_DELAY_USAGE_UNDERUSE:
+			return "underuse";
+		default:
+			return "unknown";
+	}
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_delay_estimator_init(ChiakiDelayEstimator *estimator)
+{
+	chiaki_delay_estimator_reset(estimator, 0);
+	return chiaki_mutex_init(&estimator->mutex, false);
+}
+
+CHIAKI_EXPORT void chiaki_delay_estimator_fini(ChiakiDelayEstimator *estimator)
+{
+	chiaki_mutex_fini(&estimator->mutex);
+}
+
+/**
+ * Forget the delay history, but keep the threshold
+ */
+static void trend_restart(ChiakiDelayEstimator *estimator)
+{
+	estimator->frame_valid = false;
+	estimator->delay_acc_ms = 0.0;
+	estimator->delay_smoothed_ms = 0.0;
+	estimator->window_count = 0;
+	estimator->window_next = 0;
+	estimator->deltas = 0;
+	estimator->overuse_time_ms = -1.0;
+	estimator->overuse_count = 0;
+	estimator->trend_prev_ms = 0.0;
+}
+
+CHIAKI_EXPORT void chiaki_delay_estimator_reset(ChiakiDelayEstimator *estimator, uint64_t frame_interval_us)
+{
+	estimator->frame_interval_us = frame_interval_us;
+	estimator->bytes_pending = 0;
+	estimator->threshold_updated_us = 0;
+	trend_restart(estimator);
+	estimator->usage = CHIAKI_DELAY_USAGE_NORMAL;
+	estimator->trend_ms = 0.0;
+	estimator->threshold_ms = THRESHOLD_INIT_MS;
+	estimator->bytes = 0;
+}
+
+/**
+ * Least squares slope of the smoothed delay over arrival time in the window
+ */
+static double window_slope(ChiakiDelayEstimator *estimator)
+{
+	size_t n = estimator->window_count;
+	double time_mean = 0.0, delay_mean = 0.0;
+	for(size_t i=0; i<n; i++)
+	{
+		time_mean += estimator->window_time_ms[i];
+		delay_mean += estimator->window_delay_ms[i];
+	}
+	time_mean /= n;
+	delay_mean /= n;
+	double num = 0.0, den = 0.0;
+	for(size_t i=0; i<n; i++)
+	{
+		double dt = estimator->window_time_ms[i] - time_mean;
+		num += dt * (estimator->window_delay_ms[i] - delay_mean);
+		den += dt * dt;
+	}
+	return den > 0.0 ? num / den : 0.0;
+}
+
+/**
+ * @return the new usage, or the previous one if it does not change
+ */
+static ChiakiDelayUsage detect(ChiakiDelayEstimator *estimator, ChiakiDelayUsage usage, double trend_ms, double frame_delta_ms)
+{
+	double threshold_ms = estimator->threshold_ms;
+	if(trend_ms > threshold_ms)
+	{
+		if(estimator->overuse_time_ms < 0.0)
+			estimator->overuse_time_ms = frame_delta_ms / 2.0;
+		else
+			estimator->overuse_time_ms += frame_delta_ms;
+		estimator->overuse_count++;
+		// only signal overuse while the trend is still rising
+		if(estimator->overuse_time_ms > OVERUSE_TIME_MIN_MS && estimator->overuse_count > 1 && trend_ms >= estimator->trend_prev_ms)
+		{
+			estimator->overuse_time_ms = 0.0;
+			estimator->overuse_count = 0;
+			usage = CHIAKI_DELAY_USAGE_OVERUSE;
+		}
+	}
+	else
+	{
+		estimator->overuse_time_ms = -1.0;
+		estimator->overuse_count = 0;
+		usage = trend_ms < -threshold_ms ? CHIAKI_DELAY_USAGE_UNDERUSE : CHIAKI_DELAY_USAGE_NORMAL;
+	}
+	estimator->trend_prev_ms = trend_ms;
+	return usage;
+}
+
+/**
+ * Move the threshold towards the trend, slowly upwards and faster downwards,
+ * so it follows the noise of the path, but not sudden congestion.
+ */
+static void threshold_update(ChiakiDelayEstimator *estimator, double trend_ms, uint64_t now_us)
+{
+	if(!estimator->threshold_updated_us)
+		estimator->threshold_updated_us = now_us;
+	double trend_abs = fabs(trend_ms);
+	double threshold_ms = estimator->threshold_ms;
+	if(trend_abs > threshold_ms + THRESHOLD_ADAPT_OFFSET_MAX_MS)
+	{
+		estimator->threshold_updated_us = now_us;
+		return;
+	}
+	double k = trend_abs < threshold_ms ? THRESHOLD_K_DOWN : THRESHOLD_K_UP;
+	double time_delta_ms = (double)(now_us - estimator->threshold_updated_us) / 1000.0;
+	if(time_delta_ms > THRESHOLD_ADAPT_TIME_MAX_MS)
+		time_delta_ms = THRESHOLD_ADAPT_TIME_MAX_MS;
+	threshold_ms += k * (trend_abs - threshold_ms) * time_delta_ms;
+	if(threshold_ms < THRESHOLD_MIN_MS)
+		threshold_ms = THRESHOLD_MIN_MS;
+	else if(threshold_ms > THRESHOLD_MAX_MS)
+		threshold_ms = THRESHOLD_MAX_MS;
+	estimator->threshold_ms = threshold_ms;
+	estimator->threshold_updated_us = now_us;
+}
+
+CHIAKI_EXPORT void chiaki_delay_estimator_frame(ChiakiDelayEstimator *estimator, ChiakiSeqNum16 frame_index, uint64_t arrival_us)
+{
+	if(!estimator->frame_interval_us)
+		return;
+
+	if(estimator->frame_valid)
+	{
+		int frames = (int16_t)(frame_index - estimator->frame_index_prev);
+		if(frames <= 0)
+			return;
+		if(frames > FRAME_GAP_MAX || arrival_us < estimator->arrival_prev_us
+				|| arrival_us - estimator->arrival_prev_us > ARRIVAL_GAP_MAX_US)
+			trend_restart(estimator);
+	}
+
+	chiaki_mutex_lock(&estimator->mutex);
+	estimator->bytes += estimator->bytes_pending;
+	estimator->bytes_pending = 0;
+
+	if(!estimator->frame_valid)
+	{
+		estimator->frame_valid = true;
+		estimator->frame_index_prev = frame_index;
+		estimator->arrival_prev_us = arrival_us;
+		estimator->arrival_first_us = arrival_us;
+		goto beach;
+	}
+
+	int frames = (int16_t)(frame_index - estimator->frame_index_prev);
+	double send_delta_ms = (double)(frames * estimator->frame_interval_us) / 1000.0;
+	double recv_delta_ms = (double)(arrival_us - estimator->arrival_prev_us) / 1000.0;
+	estimator->frame_index_prev = frame_index;
+	estimator->arrival_prev_us = arrival_us;
+
+	estimator->delay_acc_ms += recv_delta_ms - send_delta_ms;
+	estimator->delay_smoothed_ms = SMOOTHING * estimator->delay_smoothed_ms + (1.0 - SMOOTHING) * estimator->delay_acc_ms;
+	estimator->window_time_ms[estimator->window_next] = (double)(arrival_us - estimator->arrival_first_us) / 1000.0;
+	estimator->window_delay_ms[estimator->window_next] = estimator->delay_smoothed_ms;
+	estimator->window_next = (estimator->window_next + 1) % CHIAKI_DELAY_ESTIMATOR_WINDOW;
+	if(estimator->window_count < CHIAKI_DELAY_ESTIMATOR_WINDOW)
+		estimator->window_count++;
+	if(estimator->deltas < DELTAS_MAX)
+		estimator->deltas++;
+
+	if(estimator->window_count < CHIAKI_DELAY_ESTIMATOR_WINDOW)
+		goto beach;
+
+	double trend_ms = (double)estimator->deltas * window_slope(estimator) * THRESHOLD_GAIN;
+	estimator->usage = detect(estimator, estimator->usage, trend_ms, send_delta_ms);
+	threshold_update(estimator, trend_ms, arrival_us);
+	estimator->trend_ms = trend_ms;
+
+beach:
+	chiaki_mutex_unlock(&estimator->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_delay_estimator_get(ChiakiDelayEstimator *estimator, bool reset, ChiakiDelayEstimate *estimate)
+{
+	chiaki_mutex_lock(&estimator->mutex);
+	estimate->usage = estimator->usage;
+	estimate->trend_ms = estimator->trend_ms;
+	estimate->threshold_ms = estimator->threshold_ms;
+	estimate->bytes = estimator->bytes;
+	if(reset)
+		estimator->bytes = 0;
+	chiaki_mutex_unlock(&estimator->mutex);
+}
@@ -285,15 +285,13 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_thread_start(ChiakiDiscoveryThrea
 		return err;
 	}
 
-	err = chiaki_thread_create(&thread->thread, discovery_thread_func, thread);
+	err = chiaki_thread_create_role(&thread->thread, discovery_thread_func, thread, CHIAKI_THREAD_ROLE_DISCOVERY);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		chiaki_stop_pipe_fini(&thread->stop_pipe);
 		return err;
 	}
 
-	chiaki_thread_set_name(&thread->thread, "Chiaki Discovery");
-
 	return CHIAKI_ERR_SUCCESS;
 }
 
@@ -310,15 +308,13 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_thread_start_oneshot(ChiakiDiscov
 		return err;
 	}
 
-	err = chiaki_thread_create(&thread->thread, discovery_thread_func_oneshot, thread);
+	err = chiaki_thread_create_role(&thread->thread, discovery_thread_func_oneshot, thread, CHIAKI_THREAD_ROLE_DISCOVERY);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		chiaki_stop_pipe_fini(&thread->stop_pipe);
 		return err;
 	}
 
-	chiaki_thread_set_name(&thread->thread, "Chiaki Discovery");
-
 	return CHIAKI_ERR_SUCCESS;
 }
 
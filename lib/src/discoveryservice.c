@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
 #include <chiaki/discoveryservice.h>
+#include <chiaki/time.h>
 
 #include <inttypes.h>
 #include <string.h>
@@ -17,6 +18,9 @@
 
 static void *discovery_service_thread_func(void *user);
 static void discovery_service_ping(ChiakiDiscoveryService *service);
+static void discovery_service_ping_known(ChiakiDiscoveryService *service);
+static void discovery_service_send_srch(ChiakiDiscoveryService *service, struct sockaddr_in6 *addr, size_t addr_size);
+static void discovery_service_known_addr_add(ChiakiDiscoveryService *service, const char *host);
 static void discovery_service_drop_old_hosts(ChiakiDiscoveryService *service);
 static void discovery_service_host_received(ChiakiDiscoveryHost *host, void *user);
 static void discovery_service_report_state(ChiakiDiscoveryService *service);
@@ -41,6 +45,15 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_service_init(ChiakiDiscoveryServi
 	}
 
 	service->hosts_count = 0;
+	service->known_addrs_count = 0;
+	service->fast_ping_requested = false;
+	service->poll_changed = false;
+	service->poll_addr_size = 0;
+	service->poll_interval_ms = 0;
+	service->poll_until_ms = 0;
+	service->paused = false;
+	service->pause_changed = false;
+	memset(&service->stats, 0, sizeof(service->stats));
 
 	err = chiaki_mutex_init(&service->state_mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -68,16 +81,20 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_service_init(ChiakiDiscoveryServi
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_send_addr;
 
+	// not owned by us, so resolve them now
+	for(size_t i=0; i<options->known_hosts_count; i++)
+		discovery_service_known_addr_add(service, options->known_hosts[i]);
+	service->options.known_hosts = NULL;
+	service->options.known_hosts_count = 0;
+
 	err = chiaki_bool_pred_cond_init(&service->stop_cond);
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_discovery;
 
-	err = chiaki_thread_create(&service->thread, discovery_service_thread_func, service);
+	err = chiaki_thread_create_role(&service->thread, discovery_service_thread_func, service, CHIAKI_THREAD_ROLE_DISCOVERY_SERVICE);
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_stop_cond;
 
-	chiaki_thread_set_name(&service->thread, "Chiaki Discovery Service");
-
 	return CHIAKI_ERR_SUCCESS;
 error_stop_cond:
 	chiaki_bool_pred_cond_fini(&service->stop_cond);
@@ -117,6 +134,89 @@ CHIAKI_EXPORT void chiaki_discovery_service_fini(ChiakiDiscoveryService *service
 	free(service->hosts);
 }
 
+CHIAKI_EXPORT void chiaki_discovery_service_fast_ping(ChiakiDiscoveryService *service)
+{
+	ChiakiErrorCode err = chiaki_bool_pred_cond_lock(&service->stop_cond);
+	assert(err == CHIAKI_ERR_SUCCESS);
+	service->fast_ping_requested = true;
+	chiaki_cond_signal(&service->stop_cond.cond);
+	chiaki_bool_pred_cond_unlock(&service->stop_cond);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_service_poll_host(ChiakiDiscoveryService *service, const char *host, uint64_t interval_ms, uint64_t duration_ms)
+{
+	struct sockaddr_in6 addr = { 0 };
+	size_t addr_size = 0;
+	if(host)
+	{
+		struct addrinfo *addrinfos;
+		if(getaddrinfo(host, NULL, NULL, &addrinfos) != 0)
+		{
+			CHIAKI_LOGE(service->log, "Discovery Service failed to resolve host %s to poll", host);
+			return CHIAKI_ERR_PARSE_ADDR;
+		}
+		int family = ((struct sockaddr *)service->options.send_addr)->sa_family;
+		for(struct addrinfo *ai=addrinfos; ai; ai=ai->ai_next)
+		{
+			if(ai->ai_family != family || ai->ai_addrlen > sizeof(addr))
+				continue;
+			memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+			addr_size = ai->ai_addrlen;
+			break;
+		}
+		freeaddrinfo(addrinfos);
+		if(!addr_size)
+		{
+			CHIAKI_LOGE(service->log, "Discovery Service got no suitable address for host %s to poll", host);
+			return CHIAKI_ERR_PARSE_ADDR;
+		}
+	}
+
+	ChiakiErrorCode err = chiaki_bool_pred_cond_lock(&service->stop_cond);
+	assert(err == CHIAKI_ERR_SUCCESS);
+	service->poll_addr = addr;
+	service->poll_addr_size = addr_size;
+	service->poll_interval_ms = interval_ms ? interval_ms : 1;
+	service->poll_until_ms = addr_size ? chiaki_time_now_monotonic_ms() + duration_ms : 0;
+	service->poll_changed = true;
+	chiaki_cond_signal(&service->stop_cond.cond);
+	chiaki_bool_pred_cond_unlock(&service->stop_cond);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_discovery_service_set_paused(ChiakiDiscoveryService *service, bool paused)
+{
+	ChiakiErrorCode err = chiaki_bool_pred_cond_lock(&service->stop_cond);
+	assert(err == CHIAKI_ERR_SUCCESS);
+	if(service->paused != paused)
+	{
+		service->paused = paused;
+		service->pause_changed = true;
+		chiaki_cond_signal(&service->stop_cond.cond);
+	}
+	chiaki_bool_pred_cond_unlock(&service->stop_cond);
+}
+
+CHIAKI_EXPORT void chiaki_discovery_service_get_stats(ChiakiDiscoveryService *service, ChiakiDiscoveryServiceStats *stats)
+{
+	ChiakiErrorCode err = chiaki_bool_pred_cond_lock(&service->stop_cond);
+	assert(err == CHIAKI_ERR_SUCCESS);
+	*stats = service->stats;
+	chiaki_bool_pred_cond_unlock(&service->stop_cond);
+}
+
+static bool discovery_service_check_wakeup_pred(void *user)
+{
+	ChiakiDiscoveryService *service = user;
+	return service->stop_cond.pred || service->fast_ping_requested || service->poll_changed || service->pause_changed;
+}
+
+static bool discovery_service_check_resume_pred(void *user)
+{
+	ChiakiDiscoveryService *service = user;
+	return service->stop_cond.pred || service->pause_changed;
+}
+
 static void *discovery_service_thread_func(void *user)
 {
 	ChiakiDiscoveryService *service = user;
@@ -130,22 +230,140 @@ static void *discovery_service_thread_func(void *user)
 	if(err != CHIAKI_ERR_SUCCESS) {
 		goto beach;
 	}
-
-	err = chiaki_bool_pred_cond_timedwait(&service->stop_cond, service->options.ping_initial_ms);
-
-	while(err == CHIAKI_ERR_TIMEOUT)
+	bool receiving = true;
+
+	// known hosts are pinged directly right away and with backoff, broadcast pings go out at ping_ms
+	uint64_t now = chiaki_time_now_monotonic_ms();
+	uint64_t next_ping = now + service->options.ping_initial_ms;
+	uint64_t next_fast_ping = now;
+	uint64_t fast_ping_interval_ms = CHIAKI_DISCOVERY_SERVICE_FAST_PING_INITIAL_MS;
+	uint64_t next_poll = now;
+	uint64_t pause_start = now;
+	while(true)
 	{
-		discovery_service_ping(service);
-		err = chiaki_bool_pred_cond_timedwait(&service->stop_cond, service->options.ping_ms);
+		now = chiaki_time_now_monotonic_ms();
+		if(service->pause_changed)
+		{
+			service->pause_changed = false;
+			if(service->paused && receiving)
+			{
+				// replies still in flight wait in the socket and are read after the resume
+				chiaki_discovery_thread_stop(&discovery_thread);
+				receiving = false;
+				pause_start = now;
+				service->stats.pauses++;
+				CHIAKI_LOGI(service->log, "Discovery Service paused");
+			}
+			else if(!service->paused && !receiving)
+			{
+				err = chiaki_discovery_thread_start(&discovery_thread, &service->discovery, discovery_service_host_received, service);
+				if(err != CHIAKI_ERR_SUCCESS)
+				{
+					CHIAKI_LOGE(service->log, "Discovery Service failed to restart receiving after pause");
+					goto beach;
+				}
+				receiving = true;
+				uint64_t paused_ms = now - pause_start;
+				service->stats.paused_ms += paused_ms;
+				CHIAKI_LOGI(service->log, "Discovery Service resumed after %llu ms", (unsigned long long)paused_ms);
+				next_ping = now;
+				service->fast_ping_requested = true;
+			}
+		}
+		if(service->paused)
+		{
+			err = chiaki_cond_wait_pred(&service->stop_cond.cond, &service->stop_cond.mutex,
+					discovery_service_check_resume_pred, service);
+			if(err != CHIAKI_ERR_SUCCESS || service->stop_cond.pred)
+				break;
+			continue;
+		}
+		if(service->poll_changed)
+		{
+			service->poll_changed = false;
+			next_poll = now;
+		}
+		bool poll = service->poll_addr_size && now < service->poll_until_ms;
+		if(poll && now >= next_poll)
+		{
+			discovery_service_send_srch(service, &service->poll_addr, service->poll_addr_size);
+			next_poll = now + service->poll_interval_ms;
+		}
+		if(service->fast_ping_requested)
+		{
+			service->fast_ping_requested = false;
+			next_fast_ping = now;
+			fast_ping_interval_ms = CHIAKI_DISCOVERY_SERVICE_FAST_PING_INITIAL_MS;
+		}
+		if(fast_ping_interval_ms && now >= next_fast_ping)
+		{
+			discovery_service_ping_known(service);
+			next_fast_ping = now + fast_ping_interval_ms;
+			fast_ping_interval_ms *= 2;
+			if(fast_ping_interval_ms >= service->options.ping_ms)
+				fast_ping_interval_ms = 0; // the broadcast cadence takes over
+		}
+		if(now >= next_ping)
+		{
+			discovery_service_ping(service);
+			next_ping = now + service->options.ping_ms;
+		}
+
+		uint64_t next = next_ping;
+		if(fast_ping_interval_ms && next_fast_ping < next)
+			next = next_fast_ping;
+		if(poll && next_poll < next)
+			next = next_poll;
+		err = chiaki_cond_timedwait_pred(&service->stop_cond.cond, &service->stop_cond.mutex,
+				next > now ? next - now : 0, discovery_service_check_wakeup_pred, service);
+		if(err == CHIAKI_ERR_TIMEOUT)
+			continue;
+		if(err != CHIAKI_ERR_SUCCESS || service->stop_cond.pred)
+			break;
 	}
 
-	chiaki_discovery_thread_stop(&discovery_thread);
+	if(receiving)
+		chiaki_discovery_thread_stop(&discovery_thread);
 
 beach:
 	chiaki_bool_pred_cond_unlock(&service->stop_cond);
 	return NULL;
 }
 
+/**
+ * Send a search for both PS4 and PS5 to addr, whose port is overwritten.
+ */
+static void discovery_service_send_srch(ChiakiDiscoveryService *service, struct sockaddr_in6 *addr, size_t addr_size)
+{
+	ChiakiDiscoveryPacket packet = { 0 };
+	packet.cmd = CHIAKI_DISCOVERY_CMD_SRCH;
+	packet.protocol_version = CHIAKI_DISCOVERY_PROTOCOL_VERSION_PS4;
+	if(((struct sockaddr *)addr)->sa_family == AF_INET)
+		((struct sockaddr_in *)addr)->sin_port = htons(CHIAKI_DISCOVERY_PORT_PS4);
+	else if(((struct sockaddr *)addr)->sa_family == AF_INET6)
+		addr->sin6_port = htons(CHIAKI_DISCOVERY_PORT_PS4);
+	else
+	{
+		CHIAKI_LOGE(service->log, "Discovery Service send_addr has unknown sa_family");
+		return;
+	}
+	ChiakiErrorCode err = chiaki_discovery_send(&service->discovery, &packet, (struct sockaddr *)addr, addr_size);
+	if(err != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGE(service->log, "Discovery Service failed to send ping for PS4, error was %s (%d)", chiaki_error_string(err), err);
+	else
+		service->stats.pings_sent++;
+	packet.protocol_version = CHIAKI_DISCOVERY_PROTOCOL_VERSION_PS5;
+	if(((struct sockaddr *)addr)->sa_family == AF_INET)
+		((struct sockaddr_in *)addr)->sin_port = htons(CHIAKI_DISCOVERY_PORT_PS5);
+	else
+		addr->sin6_port = htons(CHIAKI_DISCOVERY_PORT_PS5);
+	err = chiaki_discovery_send(&service->discovery, &packet, (struct sockaddr *)addr, addr_size);
+	if(err != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGE(service->log, "Discovery Service failed to send ping for PS5, error was %s (%d)", chiaki_error_string(err), err);
+	else
+		service->stats.pings_sent++;
+}
+
 static void discovery_service_ping(ChiakiDiscoveryService *service)
 {
 	ChiakiErrorCode err = chiaki_mutex_lock(&service->state_mutex);
@@ -189,29 +407,57 @@ static void discovery_service_ping(ChiakiDiscoveryService *service)
 	}
 
 	CHIAKI_LOGV(service->log, "Discovery Service sending ping");
-	ChiakiDiscoveryPacket packet = { 0 };
-	packet.cmd = CHIAKI_DISCOVERY_CMD_SRCH;
-	packet.protocol_version = CHIAKI_DISCOVERY_PROTOCOL_VERSION_PS4;
-	if(((struct sockaddr *)service->options.send_addr)->sa_family == AF_INET)
-		((struct sockaddr_in *)service->options.send_addr)->sin_port = htons(CHIAKI_DISCOVERY_PORT_PS4);
-	else if(((struct sockaddr *)service->options.send_addr)->sa_family == AF_INET6)
-		((struct sockaddr_in6 *)service->options.send_addr)->sin6_port = htons(CHIAKI_DISCOVERY_PORT_PS4);
-	else
+	discovery_service_send_srch(service, service->options.send_addr, service->options.send_addr_size);
+}
+
+static void discovery_service_ping_known(ChiakiDiscoveryService *service)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&service->state_mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+	if(service->known_addrs_count)
+		CHIAKI_LOGV(service->log, "Discovery Service sending ping to %llu known hosts", (unsigned long long)service->known_addrs_count);
+	for(size_t i=0; i<service->known_addrs_count; i++)
+		discovery_service_send_srch(service, &service->known_addrs[i], service->known_addr_sizes[i]);
+	chiaki_mutex_unlock(&service->state_mutex);
+}
+
+/**
+ * Remember the address of a host to ping directly. Must be called with state_mutex locked or before the thread is started.
+ */
+static void discovery_service_known_addr_add(ChiakiDiscoveryService *service, const char *host)
+{
+	if(!host)
+		return;
+	struct addrinfo *addrinfos;
+	if(getaddrinfo(host, NULL, NULL, &addrinfos) != 0)
 	{
-		CHIAKI_LOGE(service->log, "Discovery Service send_addr has unknown sa_family");
+		CHIAKI_LOGW(service->log, "Discovery Service failed to resolve known host %s", host);
 		return;
 	}
-	err = chiaki_discovery_send(&service->discovery, &packet, (struct sockaddr *)service->options.send_addr, service->options.send_addr_size);
-	if(err != CHIAKI_ERR_SUCCESS)
-		CHIAKI_LOGE(service->log, "Discovery Service failed to send ping for PS4, error was %s (%d)", chiaki_error_string(err), err);
-	packet.protocol_version = CHIAKI_DISCOVERY_PROTOCOL_VERSION_PS5;
-	if(((struct sockaddr *)service->options.send_addr)->sa_family == AF_INET)
-		((struct sockaddr_in *)service->options.send_addr)->sin_port = htons(CHIAKI_DISCOVERY_PORT_PS5);
-	else if(((struct sockaddr *)service->options.send_addr)->sa_family == AF_INET6)
-		((struct sockaddr_in6 *)service->options.send_addr)->sin6_port = htons(CHIAKI_DISCOVERY_PORT_PS5);
-	err = chiaki_discovery_send(&service->discovery, &packet, (struct sockaddr *)service->options.send_addr, service->options.send_addr_size);
-	if(err != CHIAKI_ERR_SUCCESS)
-		CHIAKI_LOGE(service->log, "Discovery Service failed to send ping for PS5, error was %s (%d)", chiaki_error_string(err), err);
+	int family = ((struct sockaddr *)service->options.send_addr)->sa_family;
+	for(struct addrinfo *ai=addrinfos; ai; ai=ai->ai_next)
+	{
+		if(ai->ai_family != family || ai->ai_addrlen > sizeof(struct sockaddr_in6))
+			continue;
+		bool known = false;
+		for(size_t i=0; i<service->known_addrs_count; i++)
+		{
+			if(service->known_addr_sizes[i] == ai->ai_addrlen
+					&& memcmp(&service->known_addrs[i], ai->ai_addr, ai->ai_addrlen) == 0)
+			{
+				known = true;
+				break;
+			}
+		}
+		if(!known && service->known_addrs_count < CHIAKI_DISCOVERY_SERVICE_KNOWN_ADDRS_MAX)
+		{
+			memcpy(&service->known_addrs[service->known_addrs_count], ai->ai_addr, ai->ai_addrlen);
+			service->known_addr_sizes[service->known_addrs_count] = ai->ai_addrlen;
+			service->known_addrs_count++;
+		}
+		break;
+	}
+	freeaddrinfo(addrinfos);
 }
 
 static void discovery_service_drop_old_hosts(ChiakiDiscoveryService *service)
@@ -292,6 +538,7 @@ static void discovery_service_host_received(ChiakiDiscoveryHost *host, void *use
 		}
 
 		CHIAKI_LOGI(service->log, "Discovery Service detected new host with id %s", host->host_id);
+		discovery_service_known_addr_add(service, host->host_addr);
 
 		change = true;
 		index = service->hosts_count++;
@@ -20,7 +20,10 @@
 
 #include <stdio.h>
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_ecdh_init(ChiakiECDH *ecdh)
+/**
+ * @param generate whether to generate the local key pair, otherwise it must be set afterwards
+ */
+static ChiakiErrorCode ecdh_init(ChiakiECDH *ecdh, bool generate)
 {
 	memset(ecdh, 0, sizeof(ChiakiECDH));
 #ifdef CHIAKI_LIB_ENABLE_MBEDTLS
@@ -47,8 +50,9 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_ecdh_init(ChiakiECDH *ecdh)
 	// build MBEDTLS_ECP_DP_SECP256K1 group
 	CHECK(mbedtls_ecp_group_load(&ecdh->ctx.grp, MBEDTLS_ECP_DP_SECP256K1));
 	// build key
-	CHECK(mbedtls_ecdh_gen_public(&ecdh->ctx.grp, &ecdh->ctx.d,
-		&ecdh->ctx.Q, mbedtls_ctr_drbg_random, &ecdh->drbg));
+	if(generate)
+		CHECK(mbedtls_ecdh_gen_public(&ecdh->ctx.grp, &ecdh->ctx.d,
+			&ecdh->ctx.Q, mbedtls_ctr_drbg_random, &ecdh->drbg));
 
 	// relese entropy ptr
 	mbedtls_entropy_free(&entropy);
@@ -60,7 +64,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_ecdh_init(ChiakiECDH *ecdh)
 
 	CHECK(ecdh->key_local = EC_KEY_new());
 	CHECK(EC_KEY_set_group(ecdh->key_local, ecdh->group));
-	CHECK(EC_KEY_generate_key(ecdh->key_local));
+	if(generate)
+		CHECK(EC_KEY_generate_key(ecdh->key_local));
 
 #undef CHECK
 #endif
@@ -68,6 +73,62 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_ecdh_init(ChiakiECDH *ecdh)
 	return CHIAKI_ERR_SUCCESS;
 }
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_ecdh_init(ChiakiECDH *ecdh)
+{
+	return ecdh_init(ecdh, true);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_ecdh_init_with_key(ChiakiECDH *ecdh, const ChiakiECDHKey *key)
+{
+	ChiakiErrorCode err = ecdh_init(ecdh, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	// not chiaki_ecdh_set_local_key(), which generates a new key pair with mbedtls
+	if(mbedtls_ecp_point_read_binary(&ecdh->ctx.grp, &ecdh->ctx.Q, key->public_key, sizeof(key->public_key)) != 0
+			|| mbedtls_mpi_read_binary(&ecdh->ctx.d, key->private_key, sizeof(key->private_key)) != 0)
+		err = CHIAKI_ERR_UNKNOWN;
+#else
+	err = chiaki_ecdh_set_local_key(ecdh, key->private_key, sizeof(key->private_key), key->public_key, sizeof(key->public_key));
+#endif
+	if(err != CHIAKI_ERR_SUCCESS)
+		chiaki_ecdh_fini(ecdh);
+	return err;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_ecdh_generate_key(ChiakiECDHKey *key)
+{
+	ChiakiECDH ecdh;
+	ChiakiErrorCode err = chiaki_ecdh_init(&ecdh);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	size_t public_key_size = 0;
+	if(mbedtls_mpi_write_binary(&ecdh.ctx.d, key->private_key, sizeof(key->private_key)) != 0
+			|| mbedtls_ecp_point_write_binary(&ecdh.ctx.grp, &ecdh.ctx.Q, MBEDTLS_ECP_PF_UNCOMPRESSED,
+				&public_key_size, key->public_key, sizeof(key->public_key)) != 0
+			|| public_key_size != sizeof(key->public_key))
+		err = CHIAKI_ERR_UNKNOWN;
+#else
+	const BIGNUM *private_key = EC_KEY_get0_private_key(ecdh.key_local);
+	const EC_POINT *public_key = EC_KEY_get0_public_key(ecdh.key_local);
+	int private_key_size = private_key ? BN_num_bytes(private_key) : -1;
+	if(private_key_size < 0 || private_key_size > (int)sizeof(key->private_key) || !public_key
+			|| EC_POINT_point2oct(ecdh.group, public_key, POINT_CONVERSION_UNCOMPRESSED,
+				key->public_key, sizeof(key->public_key), NULL) != sizeof(key->public_key))
+		err = CHIAKI_ERR_UNKNOWN;
+	else
+	{
+		// left-pad to the full size
+		size_t pad = sizeof(key->private_key) - (size_t)private_key_size;
+		memset(key->private_key, 0, pad);
+		BN_bn2bin(private_key, key->private_key + pad);
+	}
+#endif
+	chiaki_ecdh_fini(&ecdh);
+	return err;
+}
+
 CHIAKI_EXPORT void chiaki_ecdh_fini(ChiakiECDH *ecdh)
 {
 #ifdef CHIAKI_LIB_ENABLE_MBEDTLS
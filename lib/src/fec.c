@@ -4,6 +4,7 @@
 
 #include <jerasure.h>
 #include <cauchy.h>
+#include <galois.h>
 
 #include <string.h>
 #include <stdlib.h>
@@ -127,3 +128,333 @@ error_matrix:
 	free(matrix);
 	return err;
 }
+
+CHIAKI_EXPORT void chiaki_fec_context_init(ChiakiFecContext *ctx)
+{
+	memset(ctx->coding_matrices, 0, sizeof(ctx->coding_matrices));
+	memset(ctx->decoding_matrices, 0, sizeof(ctx->decoding_matrices));
+	ctx->uses = 0;
+	ctx->workers = NULL;
+	ctx->inv_scratch = NULL;
+	ctx->inv_scratch_size = 0;
+	ctx->decoding_matrix_hits = 0;
+	ctx->decoding_matrix_misses = 0;
+}
+
+CHIAKI_EXPORT void chiaki_fec_context_fini(ChiakiFecContext *ctx)
+{
+	for(size_t i=0; i<CHIAKI_FEC_CODING_MATRICES_COUNT; i++)
+		free(ctx->coding_matrices[i].matrix);
+	for(size_t i=0; i<CHIAKI_FEC_DECODING_MATRICES_COUNT; i++)
+		free(ctx->decoding_matrices[i].matrix);
+	free(ctx->inv_scratch);
+}
+
+static int *fec_context_coding_matrix(ChiakiFecContext *ctx, unsigned int k, unsigned int m)
+{
+	ChiakiFecCodingMatrix *victim = &ctx->coding_matrices[0];
+	for(size_t i=0; i<CHIAKI_FEC_CODING_MATRICES_COUNT; i++)
+	{
+		ChiakiFecCodingMatrix *entry = &ctx->coding_matrices[i];
+		if(entry->matrix && entry->k == k && entry->m == m)
+		{
+			entry->last_used = ++ctx->uses;
+			return entry->matrix;
+		}
+		if(victim->matrix && (!entry->matrix || entry->last_used < victim->last_used))
+			victim = entry;
+	}
+
+	free(victim->matrix);
+	victim->matrix = create_matrix(k, m);
+	if(!victim->matrix)
+		return NULL;
+	victim->k = k;
+	victim->m = m;
+	victim->last_used = ++ctx->uses;
+	return victim->matrix;
+}
+
+/**
+ * Compute the rows of the decoding matrix for the erased source units into out (source_erased_count * k).
+ *
+ * With E the erased source units, D the surviving ones and R the e surviving FEC units in ctx->dm_ids:
+ * C[R][E] * d_E = c_R + C[R][D] * d_D, so d_E = inv(C[R][E]) * c_R + inv(C[R][E]) * C[R][D] * d_D.
+ */
+static ChiakiErrorCode fec_context_make_decoding_matrix(ChiakiFecContext *ctx, unsigned int k, int *coding_matrix, size_t source_erased_count, int *out)
+{
+	size_t e = source_erased_count;
+	if(ctx->inv_scratch_size < 2 * e * e)
+	{
+		free(ctx->inv_scratch);
+		ctx->inv_scratch_size = 0;
+		ctx->inv_scratch = malloc(2 * e * e * sizeof(int));
+		if(!ctx->inv_scratch)
+			return CHIAKI_ERR_MEMORY;
+		ctx->inv_scratch_size = 2 * e * e;
+	}
+	int *sys = ctx->inv_scratch;
+	int *inv = ctx->inv_scratch + e * e;
+
+	// survivors are ascending, so the FEC units are the last e of them
+	const int *fec_ids = ctx->dm_ids + (k - e);
+	for(size_t a=0; a<e; a++)
+	{
+		const int *coding_row = coding_matrix + (fec_ids[a] - k) * k;
+		for(size_t b=0; b<e; b++)
+			sys[a * e + b] = coding_row[ctx->source_erased_ids[b]];
+	}
+	if(jerasure_invert_matrix(sys, inv, (int)e, CHIAKI_FEC_WORDSIZE) < 0)
+		return CHIAKI_ERR_FEC_FAILED;
+
+	for(size_t a=0; a<e; a++)
+	{
+		int *row = out + a * k;
+		for(size_t j=0; j<k; j++)
+		{
+			int id = ctx->dm_ids[j];
+			if(id >= k)
+			{
+				row[j] = inv[a * e + (j - (k - e))];
+				continue;
+			}
+			int coef = 0;
+			for(size_t b=0; b<e; b++)
+				coef ^= galois_single_multiply(inv[a * e + b], coding_matrix[(fec_ids[b] - k) * k + id], CHIAKI_FEC_WORDSIZE);
+			row[j] = coef;
+		}
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+
+/**
+ * Get the decoding matrix for the survivors currently in ctx->dm_ids and erased source units in ctx->source_erased_ids,
+ * computing it on a miss.
+ */
+static int *fec_context_decoding_matrix(ChiakiFecContext *ctx, unsigned int k, unsigned int m, int *coding_matrix, size_t source_erased_count)
+{
+	uint64_t survivors[CHIAKI_FEC_UNITS_MAX / 64] = { 0 };
+	for(size_t i=0; i<k; i++)
+		survivors[ctx->dm_ids[i] / 64] |= 1ull << (ctx->dm_ids[i] % 64);
+
+	ChiakiFecDecodingMatrix *victim = &ctx->decoding_matrices[0];
+	for(size_t i=0; i<CHIAKI_FEC_DECODING_MATRICES_COUNT; i++)
+	{
+		ChiakiFecDecodingMatrix *entry = &ctx->decoding_matrices[i];
+		if(entry->matrix && entry->k == k && entry->m == m && !memcmp(entry->survivors, survivors, sizeof(survivors)))
+		{
+			ctx->decoding_matrix_hits++;
+			entry->last_used = ++ctx->uses;
+			return entry->matrix;
+		}
+		if(victim->matrix && (!entry->matrix || entry->last_used < victim->last_used))
+			victim = entry;
+	}
+
+	ctx->decoding_matrix_misses++;
+
+	size_t matrix_size = source_erased_count * k;
+	if(victim->matrix_size < matrix_size)
+	{
+		free(victim->matrix);
+		victim->matrix_size = 0;
+		victim->matrix = malloc(matrix_size * sizeof(int));
+		if(!victim->matrix)
+			return NULL;
+		victim->matrix_size = matrix_size;
+	}
+
+	// invalidate until the inversion succeeded
+	victim->k = 0;
+	victim->last_used = ++ctx->uses;
+	if(fec_context_make_decoding_matrix(ctx, k, coding_matrix, source_erased_count, victim->matrix) != CHIAKI_ERR_SUCCESS)
+		return NULL;
+	victim->k = k;
+	victim->m = m;
+	memcpy(victim->survivors, survivors, sizeof(survivors));
+	return victim->matrix;
+}
+
+/**
+ * Reconstruct size bytes from offset of every erased source unit of job.
+ */
+static void fec_decode_range(const ChiakiFecDecodeJob *job, size_t offset, size_t size, uint8_t **data_ptrs, uint8_t **coding_ptrs)
+{
+	for(size_t i=0; i<job->k+job->m; i++)
+	{
+		uint8_t *buf_ptr = job->frame_buf + job->stride * i + offset;
+		if(i < job->k)
+			data_ptrs[i] = buf_ptr;
+		else
+			coding_ptrs[i - job->k] = buf_ptr;
+	}
+
+	for(size_t i=0; i<job->source_erased_count; i++)
+	{
+		jerasure_matrix_dotprod(job->k, CHIAKI_FEC_WORDSIZE, (int *)job->decoding_matrix + i * job->k, (int *)job->dm_ids,
+				job->source_erased_ids[i], (char **)data_ptrs, (char **)coding_ptrs, (int)size);
+	}
+}
+
+static void *fec_worker_thread_func(void *user)
+{
+	ChiakiFecWorker *worker = user;
+	ChiakiFecWorkers *workers = worker->workers;
+	chiaki_mutex_lock(&workers->mutex);
+	while(true)
+	{
+		while(!worker->size && !workers->stop)
+			chiaki_cond_wait(&workers->cond, &workers->mutex);
+		if(workers->stop)
+			break;
+		ChiakiFecDecodeJob job = workers->job;
+		size_t offset = worker->offset;
+		size_t size = worker->size;
+		chiaki_mutex_unlock(&workers->mutex);
+
+		fec_decode_range(&job, offset, size, worker->data_ptrs, worker->coding_ptrs);
+
+		chiaki_mutex_lock(&workers->mutex);
+		worker->size = 0;
+		chiaki_cond_broadcast(&workers->cond);
+	}
+	chiaki_mutex_unlock(&workers->mutex);
+	return NULL;
+}
+
+static void fec_workers_stop(ChiakiFecWorkers *workers, size_t started)
+{
+	chiaki_mutex_lock(&workers->mutex);
+	workers->stop = true;
+	chiaki_cond_broadcast(&workers->cond);
+	chiaki_mutex_unlock(&workers->mutex);
+	for(size_t i=0; i<started; i++)
+		chiaki_thread_join(&workers->workers[i].thread, NULL);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_workers_init(ChiakiFecWorkers *workers, size_t count)
+{
+	if(!count || count > CHIAKI_FEC_WORKERS_MAX)
+		return CHIAKI_ERR_INVALID_DATA;
+	memset(workers, 0, sizeof(*workers));
+	workers->count = count;
+
+	ChiakiErrorCode err = chiaki_mutex_init(&workers->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	err = chiaki_cond_init(&workers->cond, &workers->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	for(size_t i=0; i<count; i++)
+	{
+		ChiakiFecWorker *worker = &workers->workers[i];
+		worker->workers = workers;
+		err = chiaki_thread_create_role(&worker->thread, fec_worker_thread_func, worker, CHIAKI_THREAD_ROLE_FEC);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			fec_workers_stop(workers, i);
+			goto error_cond;
+		}
+	}
+
+	return CHIAKI_ERR_SUCCESS;
+
+error_cond:
+	chiaki_cond_fini(&workers->cond);
+error_mutex:
+	chiaki_mutex_fini(&workers->mutex);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_fec_workers_fini(ChiakiFecWorkers *workers)
+{
+	fec_workers_stop(workers, workers->count);
+	chiaki_cond_fini(&workers->cond);
+	chiaki_mutex_fini(&workers->mutex);
+}
+
+/**
+ * Hand ranges of job to the workers, decode the first one here and wait for the rest.
+ */
+static void fec_workers_decode(ChiakiFecWorkers *workers, const ChiakiFecDecodeJob *job, size_t unit_size,
+		uint8_t **data_ptrs, uint8_t **coding_ptrs)
+{
+	size_t ranges = workers->count + 1;
+	size_t range_size = (unit_size + ranges - 1) / ranges;
+	range_size = (range_size + CHIAKI_FEC_WORKERS_SPLIT_ALIGN - 1) / CHIAKI_FEC_WORKERS_SPLIT_ALIGN * CHIAKI_FEC_WORKERS_SPLIT_ALIGN;
+	size_t own_size = range_size < unit_size ? range_size : unit_size;
+
+	chiaki_mutex_lock(&workers->mutex);
+	workers->job = *job;
+	for(size_t i=0; i<workers->count; i++)
+	{
+		ChiakiFecWorker *worker = &workers->workers[i];
+		worker->offset = (i + 1) * range_size;
+		worker->size = worker->offset < unit_size ? unit_size - worker->offset : 0;
+		if(worker->size > range_size)
+			worker->size = range_size;
+	}
+	chiaki_cond_broadcast(&workers->cond);
+	chiaki_mutex_unlock(&workers->mutex);
+
+	fec_decode_range(job, 0, own_size, data_ptrs, coding_ptrs);
+
+	chiaki_mutex_lock(&workers->mutex);
+	for(size_t i=0; i<workers->count; i++)
+	{
+		while(workers->workers[i].size)
+			chiaki_cond_wait(&workers->cond, &workers->mutex);
+	}
+	chiaki_mutex_unlock(&workers->mutex);
+	workers->splits++;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_context_decode(ChiakiFecContext *ctx, uint8_t *frame_buf, size_t unit_size, size_t stride, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count)
+{
+	if(stride < unit_size || k + m > CHIAKI_FEC_UNITS_MAX)
+		return CHIAKI_ERR_INVALID_DATA;
+	if(erasures_count > m)
+		return CHIAKI_ERR_FEC_FAILED;
+
+	int *coding_matrix = fec_context_coding_matrix(ctx, k, m);
+	if(!coding_matrix)
+		return CHIAKI_ERR_MEMORY;
+
+	memset(ctx->erased, 0, (k + m) * sizeof(int));
+	for(size_t i=0; i<erasures_count; i++)
+	{
+		if(erasures[i] >= k + m)
+			return CHIAKI_ERR_INVALID_DATA;
+		ctx->erased[erasures[i]] = 1;
+	}
+
+	size_t source_erased_count = 0;
+	for(size_t i=0; i<k; i++)
+	{
+		if(ctx->erased[i])
+			ctx->source_erased_ids[source_erased_count++] = (int)i;
+	}
+	if(!source_erased_count)
+		return CHIAKI_ERR_SUCCESS;
+
+	for(size_t i=0, j=0; j<k; i++)
+	{
+		if(!ctx->erased[i])
+			ctx->dm_ids[j++] = (int)i;
+	}
+
+	int *decoding_matrix = fec_context_decoding_matrix(ctx, k, m, coding_matrix, source_erased_count);
+	if(!decoding_matrix)
+		return CHIAKI_ERR_FEC_FAILED;
+
+	ChiakiFecDecodeJob job = { k, m, frame_buf, stride, decoding_matrix, ctx->dm_ids, ctx->source_erased_ids, source_erased_count };
+	if(ctx->workers && unit_size > CHIAKI_FEC_WORKERS_SPLIT_ALIGN
+		&& source_erased_count * k * unit_size >= CHIAKI_FEC_WORKERS_SPLIT_MIN)
+		fec_workers_decode(ctx->workers, &job, unit_size, ctx->data_ptrs, ctx->coding_ptrs);
+	else
+		fec_decode_range(&job, 0, unit_size, ctx->data_ptrs, ctx->coding_ptrs);
+
+	return CHIAKI_ERR_SUCCESS;
+}
@@ -1,18 +1,36 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
 #include <chiaki/feedbacksender.h>
+#include <chiaki/trace.h>
 
-#define FEEDBACK_STATE_TIMEOUT_MIN_MS 8 // minimum time to wait between sending 2 packets
 #define FEEDBACK_STATE_TIMEOUT_MAX_MS 200 // maximum time to wait between sending 2 packets
 
+// with a state rate limit, changes up to these from the state last sent are noise and not sent on their own
+#define FEEDBACK_STICK_DEADBAND 128 // half a step of an 8 bit stick
+#define FEEDBACK_GYRO_DEADBAND 0.01f // rad/s
+#define FEEDBACK_ACCEL_DEADBAND 0.01f // g
+#define FEEDBACK_ORIENT_DEADBAND 0.001f // per quaternion component, about 0.1 degrees
+
 #define FEEDBACK_HISTORY_BUFFER_SIZE 0x10
 
-static void *feedback_sender_thread_func(void *user);
+static uint64_t feedback_sender_task_cb(void *user, uint64_t now_us);
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_init(ChiakiFeedbackSender *feedback_sender, ChiakiTakion *takion)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_init(ChiakiFeedbackSender *feedback_sender, ChiakiTimerWheel *timer_wheel,
+		ChiakiTakion *takion, ChiakiLatencyStats *latency_stats, bool immediate, unsigned int state_rate_max)
 {
 	feedback_sender->log = takion->log;
 	feedback_sender->takion = takion;
+	feedback_sender->timer_wheel = timer_wheel;
+	feedback_sender->immediate = immediate;
+	feedback_sender->state_interval_min_us = state_rate_max ? 1000000 / state_rate_max : 0;
+	feedback_sender->latency_stats = latency_stats;
+	feedback_sender->controller_state_changed = false;
+	feedback_sender->controller_state_urgent = false;
+	feedback_sender->changes_deferred = 0;
+	feedback_sender->changes_below_deadband = 0;
+	feedback_sender->controller_state_sample_us = 0;
+	feedback_sender->should_stop = false;
+	feedback_sender->sent_us = chiaki_time_now_monotonic_us();
 
 	chiaki_controller_state_set_idle(&feedback_sender->controller_state_prev);
 	chiaki_controller_state_set_idle(&feedback_sender->controller_state);
@@ -27,22 +45,12 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_init(ChiakiFeedbackSender *
 	err = chiaki_mutex_init(&feedback_sender->state_mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_history_buffer;
+	chiaki_mutex_set_name(&feedback_sender->state_mutex, "feedback sender state");
 
-	err = chiaki_cond_init(&feedback_sender->state_cond, &feedback_sender->state_mutex);
-	if(err != CHIAKI_ERR_SUCCESS)
-		goto error_mutex;
-
-	err = chiaki_thread_create(&feedback_sender->thread, feedback_sender_thread_func, feedback_sender);
-	if(err != CHIAKI_ERR_SUCCESS)
-		goto error_cond;
-
-	chiaki_thread_set_name(&feedback_sender->thread, "Chiaki Feedback Sender");
+	chiaki_timer_task_init(&feedback_sender->task, "feedback", feedback_sender_task_cb, feedback_sender);
+	chiaki_timer_wheel_schedule(timer_wheel, &feedback_sender->task, FEEDBACK_STATE_TIMEOUT_MAX_MS * 1000);
 
 	return CHIAKI_ERR_SUCCESS;
-error_cond:
-	chiaki_cond_fini(&feedback_sender->state_cond);
-error_mutex:
-	chiaki_mutex_fini(&feedback_sender->state_mutex);
 error_history_buffer:
 	chiaki_feedback_history_buffer_fini(&feedback_sender->history_buf);
 	return err;
@@ -53,16 +61,68 @@ CHIAKI_EXPORT void chiaki_feedback_sender_fini(ChiakiFeedbackSender *feedback_se
 	chiaki_mutex_lock(&feedback_sender->state_mutex);
 	feedback_sender->should_stop = true;
 	chiaki_mutex_unlock(&feedback_sender->state_mutex);
-	chiaki_cond_signal(&feedback_sender->state_cond);
-	chiaki_thread_join(&feedback_sender->thread, NULL);
-	chiaki_cond_fini(&feedback_sender->state_cond);
+	chiaki_timer_wheel_cancel(feedback_sender->timer_wheel, &feedback_sender->task);
+	if(feedback_sender->state_interval_min_us)
+		CHIAKI_LOGI(feedback_sender->log, "Feedback Sender deferred %llu stick and motion changes for the rate limit, %llu were below the deadband",
+				(unsigned long long)feedback_sender->changes_deferred, (unsigned long long)feedback_sender->changes_below_deadband);
 	chiaki_mutex_fini(&feedback_sender->state_mutex);
 	chiaki_feedback_history_buffer_fini(&feedback_sender->history_buf);
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_set_controller_state(ChiakiFeedbackSender *feedback_sender, ChiakiControllerState *state)
+static void feedback_sender_send(ChiakiFeedbackSender *feedback_sender);
+static bool controller_state_equals_for_feedback_history(ChiakiControllerState *a, ChiakiControllerState *b);
+
+static bool stick_moved(int16_t a, int16_t b)
 {
-	ChiakiErrorCode err = chiaki_mutex_lock(&feedback_sender->state_mutex);
+	return a - b > FEEDBACK_STICK_DEADBAND || b - a > FEEDBACK_STICK_DEADBAND;
+}
+
+static bool motion_moved(float a, float b, float deadband)
+{
+	return a - b > deadband || b - a > deadband;
+}
+
+/**
+ * @return whether the sticks or motion sensors of a moved beyond the deadband from b
+ */
+static bool controller_state_moved_for_feedback_state(ChiakiControllerState *a, ChiakiControllerState *b)
+{
+	return stick_moved(a->left_x, b->left_x) || stick_moved(a->left_y, b->left_y)
+		|| stick_moved(a->right_x, b->right_x) || stick_moved(a->right_y, b->right_y)
+		|| motion_moved(a->gyro_x, b->gyro_x, FEEDBACK_GYRO_DEADBAND)
+		|| motion_moved(a->gyro_y, b->gyro_y, FEEDBACK_GYRO_DEADBAND)
+		|| motion_moved(a->gyro_z, b->gyro_z, FEEDBACK_GYRO_DEADBAND)
+		|| motion_moved(a->accel_x, b->accel_x, FEEDBACK_ACCEL_DEADBAND)
+		|| motion_moved(a->accel_y, b->accel_y, FEEDBACK_ACCEL_DEADBAND)
+		|| motion_moved(a->accel_z, b->accel_z, FEEDBACK_ACCEL_DEADBAND)
+		|| motion_moved(a->orient_x, b->orient_x, FEEDBACK_ORIENT_DEADBAND)
+		|| motion_moved(a->orient_y, b->orient_y, FEEDBACK_ORIENT_DEADBAND)
+		|| motion_moved(a->orient_z, b->orient_z, FEEDBACK_ORIENT_DEADBAND)
+		|| motion_moved(a->orient_w, b->orient_w, FEEDBACK_ORIENT_DEADBAND);
+}
+
+/**
+ * @return us until the pending change may be sent, 0 if right away. Must be called with state_mutex locked.
+ */
+static uint64_t feedback_sender_pending_delay_us(ChiakiFeedbackSender *feedback_sender, uint64_t now_us)
+{
+	if(feedback_sender->controller_state_urgent)
+		return 0;
+	uint64_t elapsed_us = now_us - feedback_sender->sent_us;
+	return elapsed_us < feedback_sender->state_interval_min_us ? feedback_sender->state_interval_min_us - elapsed_us : 0;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_set_controller_state(ChiakiFeedbackSender *feedback_sender, ChiakiControllerState *state, uint64_t sample_us)
+{
+	// The task holds the mutex while it sends, so if we get it right away, nothing is being sent
+	// and we can just as well send ourselves. Otherwise, leave it to the task once it has finished.
+	bool send_now = feedback_sender->immediate;
+	ChiakiErrorCode err = send_now ? chiaki_mutex_trylock(&feedback_sender->state_mutex) : CHIAKI_ERR_MUTEX_LOCKED;
+	if(err == CHIAKI_ERR_MUTEX_LOCKED)
+	{
+		send_now = false;
+		err = chiaki_mutex_lock(&feedback_sender->state_mutex);
+	}
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 
@@ -73,10 +133,36 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_set_controller_state(Chiaki
 	}
 
 	feedback_sender->controller_state = *state;
+	uint64_t delay_us = 0;
+	if(feedback_sender->state_interval_min_us)
+	{
+		ChiakiControllerState *sent = &feedback_sender->controller_state_prev;
+		if(!controller_state_equals_for_feedback_history(state, sent))
+			feedback_sender->controller_state_urgent = true;
+		else if(!feedback_sender->controller_state_changed && !controller_state_moved_for_feedback_state(state, sent))
+		{
+			// goes out with the next packet or the periodic repeat
+			feedback_sender->changes_below_deadband++;
+			chiaki_mutex_unlock(&feedback_sender->state_mutex);
+			return CHIAKI_ERR_SUCCESS;
+		}
+		delay_us = feedback_sender_pending_delay_us(feedback_sender, chiaki_time_now_monotonic_us());
+		if(delay_us)
+			feedback_sender->changes_deferred++;
+	}
 	feedback_sender->controller_state_changed = true;
+	if(!feedback_sender->controller_state_sample_us)
+		feedback_sender->controller_state_sample_us = sample_us;
+
+	if(send_now && !delay_us && !feedback_sender->should_stop)
+	{
+		feedback_sender_send(feedback_sender);
+		chiaki_mutex_unlock(&feedback_sender->state_mutex);
+		return CHIAKI_ERR_SUCCESS;
+	}
 
 	chiaki_mutex_unlock(&feedback_sender->state_mutex);
-	chiaki_cond_signal(&feedback_sender->state_cond);
+	chiaki_timer_wheel_schedule(feedback_sender->timer_wheel, &feedback_sender->task, delay_us);
 
 	return CHIAKI_ERR_SUCCESS;
 }
@@ -160,10 +246,29 @@ static void feedback_sender_send_history_packet(ChiakiFeedbackSender *feedback_s
 	chiaki_takion_send_feedback_history(feedback_sender->takion, feedback_sender->history_seq_num++, buf, buf_size);
 }
 
+/**
+ * Push an event to be sent with the next history packet.
+ * Every packet carries the whole buffer, so one is sent first if the oldest unsent event would be pushed out.
+ */
+static void feedback_sender_push_history_event(ChiakiFeedbackSender *feedback_sender, ChiakiFeedbackHistoryEvent *event, size_t *events_pending)
+{
+	if(*events_pending >= feedback_sender->history_buf.size)
+	{
+		feedback_sender_send_history_packet(feedback_sender);
+		*events_pending = 0;
+	}
+	chiaki_feedback_history_buffer_push(&feedback_sender->history_buf, event);
+	(*events_pending)++;
+}
+
+/**
+ * Send all events of the current state change in as few packets as possible, usually one.
+ */
 static void feedback_sender_send_history(ChiakiFeedbackSender *feedback_sender)
 {
 	ChiakiControllerState *state_prev = &feedback_sender->controller_state_prev;
 	ChiakiControllerState *state_now = &feedback_sender->controller_state;
+	size_t events_pending = 0;
 	uint64_t buttons_prev = state_prev->buttons;
 	uint64_t buttons_now = state_now->buttons;
 	for(uint8_t i=0; i<CHIAKI_CONTROLLER_BUTTONS_COUNT; i++)
@@ -180,8 +285,7 @@ static void feedback_sender_send_history(ChiakiFeedbackSender *feedback_sender)
 				CHIAKI_LOGE(feedback_sender->log, "Feedback Sender failed to format button history event for button id %llu", (unsigned long long)button_id);
 				continue;
 			}
-			chiaki_feedback_history_buffer_push(&feedback_sender->history_buf, &event);
-			feedback_sender_send_history_packet(feedback_sender);
+			feedback_sender_push_history_event(feedback_sender, &event, &events_pending);
 		}
 	}
 
@@ -191,8 +295,7 @@ static void feedback_sender_send_history(ChiakiFeedbackSender *feedback_sender)
 		ChiakiErrorCode err = chiaki_feedback_history_event_set_button(&event, CHIAKI_CONTROLLER_ANALOG_BUTTON_L2, state_now->l2_state);
 		if(err == CHIAKI_ERR_SUCCESS)
 		{
-			chiaki_feedback_history_buffer_push(&feedback_sender->history_buf, &event);
-			feedback_sender_send_history_packet(feedback_sender);
+			feedback_sender_push_history_event(feedback_sender, &event, &events_pending);
 		}
 		else
 			CHIAKI_LOGE(feedback_sender->log, "Feedback Sender failed to format button history event for L2");
@@ -204,8 +307,7 @@ static void feedback_sender_send_history(ChiakiFeedbackSender *feedback_sender)
 		ChiakiErrorCode err = chiaki_feedback_history_event_set_button(&event, CHIAKI_CONTROLLER_ANALOG_BUTTON_R2, state_now->r2_state);
 		if(err == CHIAKI_ERR_SUCCESS)
 		{
-			chiaki_feedback_history_buffer_push(&feedback_sender->history_buf, &event);
-			feedback_sender_send_history_packet(feedback_sender);
+			feedback_sender_push_history_event(feedback_sender, &event, &events_pending);
 		}
 		else
 			CHIAKI_LOGE(feedback_sender->log, "Feedback Sender failed to format button history event for R2");
@@ -218,8 +320,7 @@ static void feedback_sender_send_history(ChiakiFeedbackSender *feedback_sender)
 			ChiakiFeedbackHistoryEvent event;
 			chiaki_feedback_history_event_set_touchpad(&event, false, (uint8_t)state_prev->touches[i].id,
 					state_prev->touches[i].x, state_prev->touches[i].y);
-			chiaki_feedback_history_buffer_push(&feedback_sender->history_buf, &event);
-			feedback_sender_send_history_packet(feedback_sender);
+			feedback_sender_push_history_event(feedback_sender, &event, &events_pending);
 		}
 		else if(state_now->touches[i].id >= 0
 				&& (state_prev->touches[i].id != state_now->touches[i].id
@@ -229,61 +330,91 @@ static void feedback_sender_send_history(ChiakiFeedbackSender *feedback_sender)
 			ChiakiFeedbackHistoryEvent event;
 			chiaki_feedback_history_event_set_touchpad(&event, true, (uint8_t)state_now->touches[i].id,
 					state_now->touches[i].x, state_now->touches[i].y);
-			chiaki_feedback_history_buffer_push(&feedback_sender->history_buf, &event);
-			feedback_sender_send_history_packet(feedback_sender);
+			feedback_sender_push_history_event(feedback_sender, &event, &events_pending);
 		}
 	}
-}
 
-static bool state_cond_check(void *user)
-{
-	ChiakiFeedbackSender *feedback_sender = user;
-	return feedback_sender->should_stop || feedback_sender->controller_state_changed;
+	if(events_pending)
+		feedback_sender_send_history_packet(feedback_sender);
 }
 
-static void *feedback_sender_thread_func(void *user)
+/**
+ * Send the pending change, or only the state if there is none. Must be called with state_mutex locked.
+ */
+static void feedback_sender_send(ChiakiFeedbackSender *feedback_sender)
 {
-	ChiakiFeedbackSender *feedback_sender = user;
-
-	ChiakiErrorCode err = chiaki_mutex_lock(&feedback_sender->state_mutex);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return NULL;
+	bool send_feedback_state = true;
+	bool send_feedback_history = false;
+	bool changed = feedback_sender->controller_state_changed;
 
-	uint64_t next_timeout = FEEDBACK_STATE_TIMEOUT_MAX_MS;
-	while(true)
+	if(changed)
 	{
-		err = chiaki_cond_timedwait_pred(&feedback_sender->state_cond, &feedback_sender->state_mutex, next_timeout, state_cond_check, feedback_sender);
-		if(err != CHIAKI_ERR_SUCCESS && err != CHIAKI_ERR_TIMEOUT)
-			break;
+		feedback_sender->controller_state_changed = false;
+		feedback_sender->controller_state_urgent = false;
 
-		if(feedback_sender->should_stop)
-			break;
+		// don't need to send feedback state if nothing relevant changed
+		if(controller_state_equals_for_feedback_state(&feedback_sender->controller_state, &feedback_sender->controller_state_prev))
+			send_feedback_state = false;
 
-		bool send_feedback_state = true;
-		bool send_feedback_history = false;
+		send_feedback_history = !controller_state_equals_for_feedback_history(&feedback_sender->controller_state, &feedback_sender->controller_state_prev);
+	} // else: timeout
 
-		if(feedback_sender->controller_state_changed)
-		{
-			// TODO: FEEDBACK_STATE_TIMEOUT_MIN_MS
-			feedback_sender->controller_state_changed = false;
+	if(send_feedback_state)
+	{
+		CHIAKI_TRACE(FEEDBACK, FEEDBACK_STATE_SEND, 0);
+		feedback_sender_send_state(feedback_sender);
+	}
 
-			// don't need to send feedback state if nothing relevant changed
-			if(controller_state_equals_for_feedback_state(&feedback_sender->controller_state, &feedback_sender->controller_state_prev))
-				send_feedback_state = false;
+	if(send_feedback_history)
+	{
+		CHIAKI_TRACE(FEEDBACK, FEEDBACK_HISTORY_SEND, 0);
+		feedback_sender_send_history(feedback_sender);
+	}
+
+	feedback_sender->controller_state_prev = feedback_sender->controller_state;
+
+	uint64_t now = chiaki_time_now_monotonic_us();
+	feedback_sender->sent_us = now;
+	uint64_t sample_us = feedback_sender->controller_state_sample_us;
+	if(changed && sample_us)
+	{
+		feedback_sender->controller_state_sample_us = 0;
+		if(feedback_sender->latency_stats && now >= sample_us)
+			chiaki_latency_stats_add(feedback_sender->latency_stats, CHIAKI_LATENCY_STAGE_INPUT, now - sample_us);
+	}
+}
 
-			send_feedback_history = !controller_state_equals_for_feedback_history(&feedback_sender->controller_state, &feedback_sender->controller_state_prev);
-		} // else: timeout
+/**
+ * Send pending changes once the rate limit allows, or repeat the state if it has not been sent for FEEDBACK_STATE_TIMEOUT_MAX_MS.
+ */
+static uint64_t feedback_sender_task_cb(void *user, uint64_t now_us)
+{
+	ChiakiFeedbackSender *feedback_sender = user;
 
-		if(send_feedback_state)
-			feedback_sender_send_state(feedback_sender);
+	if(chiaki_mutex_lock(&feedback_sender->state_mutex) != CHIAKI_ERR_SUCCESS)
+		return CHIAKI_TIMER_TASK_STOP;
 
-		if(send_feedback_history)
-			feedback_sender_send_history(feedback_sender);
+	if(feedback_sender->should_stop)
+	{
+		chiaki_mutex_unlock(&feedback_sender->state_mutex);
+		return CHIAKI_TIMER_TASK_STOP;
+	}
 
-		feedback_sender->controller_state_prev = feedback_sender->controller_state;
+	uint64_t timeout_us = FEEDBACK_STATE_TIMEOUT_MAX_MS * 1000;
+	// the wakeup may be left over from a change that has already been sent immediately
+	bool changed = feedback_sender->controller_state_changed;
+	if((changed && !feedback_sender_pending_delay_us(feedback_sender, now_us)) || now_us - feedback_sender->sent_us >= timeout_us)
+		feedback_sender_send(feedback_sender);
+	now_us = chiaki_time_now_monotonic_us();
+	uint64_t elapsed_us = now_us - feedback_sender->sent_us;
+	uint64_t next_us = elapsed_us < timeout_us ? timeout_us - elapsed_us : 0;
+	if(feedback_sender->controller_state_changed)
+	{
+		uint64_t pending_us = feedback_sender_pending_delay_us(feedback_sender, now_us);
+		if(pending_us < next_us)
+			next_us = pending_us;
 	}
 
 	chiaki_mutex_unlock(&feedback_sender->state_mutex);
-
-	return NULL;
+	return next_us;
 }
@@ -2,8 +2,12 @@
 #include <chiaki/ffmpegdecoder.h>
 
 #include <libavcodec/avcodec.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/hwcontext_drm.h>
 #include <libavutil/pixdesc.h>
 
+#include <string.h>
+
 static enum AVCodecID chiaki_codec_av_codec_id(ChiakiCodec codec)
 {
 	switch(codec)
@@ -16,16 +20,23 @@ static enum AVCodecID chiaki_codec_av_codec_id(ChiakiCodec codec)
 	}
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init(ChiakiFfmpegDecoder *decoder, ChiakiLog *log,
+static ChiakiErrorCode ffmpeg_decoder_init(ChiakiFfmpegDecoder *decoder, ChiakiLog *log,
 		ChiakiCodec codec, const char *hw_decoder_name, AVBufferRef *hw_device_ctx,
-		ChiakiFfmpegFrameAvailable frame_available_cb, void *frame_available_cb_user)
+		ChiakiFfmpegFrameAvailable frame_available_cb, void *frame_available_cb_user, bool low_latency)
 {
 	decoder->log = log;
+	decoder->low_latency = low_latency;
+	decoder->frame_latest = NULL;
+	decoder->frame_pool_count = 0;
 	decoder->frame_available_cb = frame_available_cb;
 	decoder->frame_available_cb_user = frame_available_cb_user;
 	decoder->hdr_enabled = codec == CHIAKI_CODEC_H265_HDR;
 	decoder->frames_lost = 0;
 	decoder->frame_recovered = false;
+	decoder->au_buf_pool = NULL;
+	decoder->au_buf_pool_size = 0;
+	memset(decoder->au_bufs, 0, sizeof(decoder->au_bufs));
+	decoder->au_buf_next = 0;
 
 	ChiakiErrorCode err = chiaki_mutex_init(&decoder->mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -45,11 +56,29 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init(ChiakiFfmpegDecoder *de
 		goto error_mutex;
 	}
 
+	decoder->packet = av_packet_alloc();
+	if(!decoder->packet)
+	{
+		CHIAKI_LOGE(log, "Failed to alloc packet");
+		goto error_mutex;
+	}
+
 	decoder->codec_context = avcodec_alloc_context3(decoder->av_codec);
 	if(!decoder->codec_context)
 	{
 		CHIAKI_LOGE(log, "Failed to alloc codec context");
-		goto error_mutex;
+		goto error_packet;
+	}
+
+	if(low_latency)
+	{
+		decoder->codec_context->flags |= AV_CODEC_FLAG_LOW_DELAY;
+		decoder->codec_context->flags2 |= AV_CODEC_FLAG2_FAST;
+		// frame threads hold back one frame per thread, slices of one frame are decoded in parallel instead
+		if(decoder->av_codec->capabilities & AV_CODEC_CAP_SLICE_THREADS)
+			decoder->codec_context->thread_type = FF_THREAD_SLICE;
+		else
+			decoder->codec_context->thread_count = 1;
 	}
 
 	if(hw_decoder_name)
@@ -97,17 +126,120 @@ error_codec_context:
 	if(decoder->hw_device_ctx)
 		av_buffer_unref(&decoder->hw_device_ctx);
 	avcodec_free_context(&decoder->codec_context);
+error_packet:
+	av_packet_free(&decoder->packet);
 error_mutex:
 	chiaki_mutex_fini(&decoder->mutex);
 	return CHIAKI_ERR_UNKNOWN;
 }
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init(ChiakiFfmpegDecoder *decoder, ChiakiLog *log,
+		ChiakiCodec codec, const char *hw_decoder_name, AVBufferRef *hw_device_ctx,
+		ChiakiFfmpegFrameAvailable frame_available_cb, void *frame_available_cb_user)
+{
+	return ffmpeg_decoder_init(decoder, log, codec, hw_decoder_name, hw_device_ctx,
+			frame_available_cb, frame_available_cb_user, false);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init_low_latency(ChiakiFfmpegDecoder *decoder, ChiakiLog *log,
+		ChiakiCodec codec, const char *hw_decoder_name, AVBufferRef *hw_device_ctx,
+		ChiakiFfmpegFrameAvailable frame_available_cb, void *frame_available_cb_user)
+{
+	return ffmpeg_decoder_init(decoder, log, codec, hw_decoder_name, hw_device_ctx,
+			frame_available_cb, frame_available_cb_user, true);
+}
+
 CHIAKI_EXPORT void chiaki_ffmpeg_decoder_fini(ChiakiFfmpegDecoder *decoder)
 {
 	avcodec_close(decoder->codec_context);
 	avcodec_free_context(&decoder->codec_context);
 	if(decoder->hw_device_ctx)
 		av_buffer_unref(&decoder->hw_device_ctx);
+	for(size_t i=0; i<CHIAKI_VIDEO_FRAME_SLOTS; i++)
+		av_buffer_unref(&decoder->au_bufs[i]);
+	av_buffer_pool_uninit(&decoder->au_buf_pool);
+	av_packet_free(&decoder->packet);
+	av_frame_free(&decoder->frame_latest);
+	for(size_t i=0; i<decoder->frame_pool_count; i++)
+		av_frame_free(&decoder->frame_pool[i]);
+	chiaki_mutex_fini(&decoder->mutex);
+}
+
+static AVFrame *frame_get(ChiakiFfmpegDecoder *decoder)
+{
+	if(decoder->frame_pool_count)
+		return decoder->frame_pool[--decoder->frame_pool_count];
+	return av_frame_alloc();
+}
+
+static void frame_put(ChiakiFfmpegDecoder *decoder, AVFrame *frame)
+{
+	if(decoder->frame_pool_count == CHIAKI_FFMPEG_FRAME_POOL_SIZE)
+	{
+		av_frame_free(&frame);
+		return;
+	}
+	av_frame_unref(frame);
+	decoder->frame_pool[decoder->frame_pool_count++] = frame;
+}
+
+/**
+ * Receive everything the codec has ready, keeping only the newest frame in frame_latest.
+ * Call with the mutex locked.
+ *
+ * @return whether any frame was received
+ */
+static bool receive_frames(ChiakiFfmpegDecoder *decoder)
+{
+	bool received = false;
+	while(true)
+	{
+		AVFrame *frame = frame_get(decoder);
+		if(!frame)
+		{
+			CHIAKI_LOGE(decoder->log, "Failed to alloc AVFrame");
+			break;
+		}
+		int r = avcodec_receive_frame(decoder->codec_context, frame);
+		if(r)
+		{
+			if(r != AVERROR(EAGAIN) && r != AVERROR_EOF)
+				CHIAKI_LOGE(decoder->log, "Decoding with FFMPEG failed");
+			frame_put(decoder, frame);
+			break;
+		}
+		if(decoder->frame_latest)
+			frame_put(decoder, decoder->frame_latest);
+		decoder->frame_latest = frame;
+		received = true;
+	}
+	return received;
+}
+
+CHIAKI_EXPORT uint8_t *chiaki_ffmpeg_decoder_au_buffer_cb(size_t size, void *user)
+{
+	ChiakiFfmpegDecoder *decoder = user;
+
+	// the frame assembled in this one is either referenced by a packet in the codec now or not needed anymore
+	AVBufferRef **au_buf = &decoder->au_bufs[decoder->au_buf_next];
+	decoder->au_buf_next = (decoder->au_buf_next + 1) % CHIAKI_VIDEO_FRAME_SLOTS;
+	av_buffer_unref(au_buf);
+
+	if(decoder->au_buf_pool && decoder->au_buf_pool_size < size)
+		av_buffer_pool_uninit(&decoder->au_buf_pool); // buffers still in use are freed when they are returned
+
+	if(!decoder->au_buf_pool)
+	{
+		// leave some room so the pool is not recreated for every slightly bigger I-frame
+		size_t pool_size = size + size / 4;
+		decoder->au_buf_pool = av_buffer_pool_init(pool_size, NULL);
+		if(!decoder->au_buf_pool)
+			return NULL;
+		decoder->au_buf_pool_size = pool_size;
+	}
+
+	*au_buf = av_buffer_pool_get(decoder->au_buf_pool);
+	return *au_buf ? (*au_buf)->data : NULL;
 }
 
 CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_sample_cb(uint8_t *buf, size_t buf_size, int32_t frames_lost, bool frame_recovered, void *user)
@@ -117,7 +249,17 @@ CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_sample_cb(uint8_t *buf, size_t bu
 	chiaki_mutex_lock(&decoder->mutex);
 	decoder->frames_lost += frames_lost;
 	decoder->frame_recovered = frame_recovered;
-	AVPacket *packet = av_packet_alloc();
+	AVPacket *packet = decoder->packet;
+	for(size_t i=0; i<CHIAKI_VIDEO_FRAME_SLOTS; i++)
+	{
+		AVBufferRef *au_buf = decoder->au_bufs[i];
+		if(au_buf && buf >= au_buf->data && buf < au_buf->data + au_buf->size)
+		{
+			// refcounted, so the codec keeps a reference instead of copying
+			packet->buf = av_buffer_ref(au_buf);
+			break;
+		}
+	}
 	packet->data = buf;
 	packet->size = buf_size;
 	int r;
@@ -128,15 +270,8 @@ send_packet:
 		if(r == AVERROR(EAGAIN))
 		{
 			CHIAKI_LOGE(decoder->log, "AVCodec internal buffer is full removing frames before pushing");
-			AVFrame *frame = av_frame_alloc();
-			if(!frame)
-			{
-				CHIAKI_LOGE(decoder->log, "Failed to alloc AVFrame");
-				goto hell;
-			}
-			r = avcodec_receive_frame(decoder->codec_context, frame);
-			av_frame_free(&frame);
-			if(r != 0)
+			// the newest of them is still presented
+			if(!receive_frames(decoder))
 			{
 				CHIAKI_LOGE(decoder->log, "Failed to pull frame");
 				goto hell;
@@ -151,13 +286,16 @@ send_packet:
 			goto hell;
 		}
 	}
-	av_packet_free(&packet);
+	av_packet_unref(packet);
+	// in low latency mode the consumer is only woken up once there is something to present
+	bool available = !decoder->low_latency || receive_frames(decoder) || decoder->frame_latest;
 	chiaki_mutex_unlock(&decoder->mutex);
 
-	decoder->frame_available_cb(decoder, decoder->frame_available_cb_user);
+	if(available)
+		decoder->frame_available_cb(decoder, decoder->frame_available_cb_user);
 	return true;
 hell:
-	av_packet_free(&packet);
+	av_packet_unref(packet);
 	chiaki_mutex_unlock(&decoder->mutex);
 	return false;
 }
@@ -166,34 +304,9 @@ CHIAKI_EXPORT AVFrame *chiaki_ffmpeg_decoder_pull_frame(ChiakiFfmpegDecoder *dec
 {
 	chiaki_mutex_lock(&decoder->mutex);
 	// always try to pull as much as possible and return only the very last frame
-	AVFrame *frame_last = NULL;
-	AVFrame *frame = NULL;
-	while(true)
-	{
-		AVFrame *next_frame;
-		if(frame_last)
-		{
-			av_frame_unref(frame_last);
-			next_frame = frame_last;
-		}
-		else
-		{
-			next_frame = av_frame_alloc();
-			if(!next_frame)
-				break;
-		}
-		frame_last = frame;
-		frame = next_frame;
-		int r = avcodec_receive_frame(decoder->codec_context, frame);
-		if(r)
-		{
-			if(r != AVERROR(EAGAIN))
-				CHIAKI_LOGE(decoder->log, "Decoding with FFMPEG failed");
-			av_frame_free(&frame);
-			frame = frame_last;
-			break;
-		}
-	}
+	receive_frames(decoder);
+	AVFrame *frame = decoder->frame_latest;
+	decoder->frame_latest = NULL;
 	*frames_lost = decoder->frames_lost;
 	if(frame && decoder->frame_recovered)
 	{
@@ -206,6 +319,15 @@ CHIAKI_EXPORT AVFrame *chiaki_ffmpeg_decoder_pull_frame(ChiakiFfmpegDecoder *dec
 	return frame;
 }
 
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_release_frame(ChiakiFfmpegDecoder *decoder, AVFrame *frame)
+{
+	if(!frame)
+		return;
+	chiaki_mutex_lock(&decoder->mutex);
+	frame_put(decoder, frame);
+	chiaki_mutex_unlock(&decoder->mutex);
+}
+
 CHIAKI_EXPORT enum AVPixelFormat chiaki_ffmpeg_decoder_get_pixel_format(ChiakiFfmpegDecoder *decoder)
 {
 	if (decoder->hw_device_ctx) {
@@ -219,3 +341,72 @@ CHIAKI_EXPORT enum AVPixelFormat chiaki_ffmpeg_decoder_get_pixel_format(ChiakiFf
 	}
 }
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_hw_frame_init(ChiakiFfmpegHwFrame *hw_frame, AVFrame *frame, bool export_drm_prime)
+{
+	memset(hw_frame, 0, sizeof(*hw_frame));
+	if(!frame->hw_frames_ctx)
+		return CHIAKI_ERR_INVALID_DATA;
+	AVHWFramesContext *frames_ctx = (AVHWFramesContext *)frame->hw_frames_ctx->data;
+
+	if(frame->format == AV_PIX_FMT_VAAPI && export_drm_prime)
+	{
+		// exports the dma-bufs behind the surface, the mapped frame keeps a reference to it
+		AVFrame *mapped = av_frame_alloc();
+		if(!mapped)
+			return CHIAKI_ERR_MEMORY;
+		mapped->format = AV_PIX_FMT_DRM_PRIME;
+		if(av_hwframe_map(mapped, frame, AV_HWFRAME_MAP_READ) < 0)
+		{
+			av_frame_free(&mapped);
+			return CHIAKI_ERR_INVALID_DATA;
+		}
+		hw_frame->frame = mapped;
+	}
+	else
+	{
+		switch(frame->format)
+		{
+			case AV_PIX_FMT_DRM_PRIME:
+			case AV_PIX_FMT_VAAPI:
+			case AV_PIX_FMT_VIDEOTOOLBOX:
+			case AV_PIX_FMT_D3D11:
+				break;
+			default:
+				return CHIAKI_ERR_INVALID_DATA;
+		}
+		hw_frame->frame = av_frame_clone(frame);
+		if(!hw_frame->frame)
+			return CHIAKI_ERR_MEMORY;
+	}
+
+	AVFrame *f = hw_frame->frame;
+	hw_frame->width = frame->width;
+	hw_frame->height = frame->height;
+	hw_frame->sw_format = frames_ctx->sw_format;
+	switch(f->format)
+	{
+		case AV_PIX_FMT_DRM_PRIME:
+			hw_frame->type = CHIAKI_FFMPEG_HW_FRAME_DRM_PRIME;
+			hw_frame->drm = (const AVDRMFrameDescriptor *)f->data[0];
+			break;
+		case AV_PIX_FMT_VAAPI:
+			hw_frame->type = CHIAKI_FFMPEG_HW_FRAME_VAAPI;
+			hw_frame->vaapi_surface = (uintptr_t)f->data[3];
+			break;
+		case AV_PIX_FMT_VIDEOTOOLBOX:
+			hw_frame->type = CHIAKI_FFMPEG_HW_FRAME_VIDEOTOOLBOX;
+			hw_frame->videotoolbox_pixbuf = f->data[3];
+			break;
+		default:
+			hw_frame->type = CHIAKI_FFMPEG_HW_FRAME_D3D11;
+			hw_frame->d3d11.texture = f->data[0];
+			hw_frame->d3d11.index = (intptr_t)f->data[1];
+			break;
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_ffmpeg_hw_frame_fini(ChiakiFfmpegHwFrame *hw_frame)
+{
+	av_frame_free(&hw_frame->frame);
+}
@@ -3,6 +3,8 @@
 #include <chiaki/frameprocessor.h>
 #include <chiaki/fec.h>
 #include <chiaki/video.h>
+#include <chiaki/time.h>
+#include <chiaki/trace.h>
 
 #include <jerasure.h>
 
@@ -17,14 +19,70 @@ CHIAKI_EXPORT void chiaki_stream_stats_reset(ChiakiStreamStats *stats)
 {
 	stats->frames = 0;
 	stats->bytes = 0;
+	memset(stats->sizes, 0, sizeof(stats->sizes));
+	stats->last_us = 0;
+	stats->ewma_size = 0.0;
+	stats->ewma_interval_us = 0.0;
+	stats->window_next = 0;
+	stats->window_count = 0;
+	stats->burst_bytes_max = 0;
 }
 
-CHIAKI_EXPORT void chiaki_stream_stats_frame(ChiakiStreamStats *stats, uint64_t size)
+/**
+ * Sum of the sizes of the frames in the window added after since_us
+ */
+static uint64_t stream_stats_window_bytes(ChiakiStreamStats *stats, uint64_t since_us)
+{
+	uint64_t bytes = 0;
+	for(size_t i=0; i<stats->window_count; i++)
+	{
+		ChiakiStreamStatsWindowEntry *entry = &stats->window[(stats->window_next + CHIAKI_STREAM_STATS_WINDOW_FRAMES - 1 - i) % CHIAKI_STREAM_STATS_WINDOW_FRAMES];
+		if(entry->time_us <= since_us)
+			break;
+		bytes += entry->size;
+	}
+	return bytes;
+}
+
+CHIAKI_EXPORT void chiaki_stream_stats_frame(ChiakiStreamStats *stats, uint64_t size, ChiakiBitstreamSliceType slice_type, uint64_t now_us)
 {
 	stats->frames++;
 	stats->bytes += size;
-	//float br = (float)chiaki_stream_stats_bitrate(stats, 60) / 1000000.0f;
-	//CHIAKI_LOGD(NULL, "bitrate: %f", br);
+
+	ChiakiStreamStatsSizes *sizes = &stats->sizes[slice_type <= CHIAKI_BITSTREAM_SLICE_P ? slice_type : CHIAKI_BITSTREAM_SLICE_UNKNOWN];
+	sizes->frames++;
+	sizes->bytes += size;
+	if(size > sizes->bytes_max)
+		sizes->bytes_max = size;
+	size_t bucket = 0;
+	while(bucket < CHIAKI_STREAM_STATS_SIZE_BUCKETS - 1 && size >= ((uint64_t)CHIAKI_STREAM_STATS_SIZE_BUCKET_MIN << bucket))
+		bucket++;
+	sizes->hist[bucket]++;
+
+	if(!stats->last_us)
+		stats->ewma_size = (double)size;
+	else
+	{
+		double interval_us = (double)(now_us - stats->last_us);
+		stats->ewma_size += CHIAKI_STREAM_STATS_EWMA_ALPHA * ((double)size - stats->ewma_size);
+		if(stats->frames == 2)
+			stats->ewma_interval_us = interval_us;
+		else
+			stats->ewma_interval_us += CHIAKI_STREAM_STATS_EWMA_ALPHA * (interval_us - stats->ewma_interval_us);
+	}
+	stats->last_us = now_us;
+
+	ChiakiStreamStatsWindowEntry *entry = &stats->window[stats->window_next];
+	entry->time_us = now_us;
+	entry->size = size;
+	stats->window_next = (stats->window_next + 1) % CHIAKI_STREAM_STATS_WINDOW_FRAMES;
+	if(stats->window_count < CHIAKI_STREAM_STATS_WINDOW_FRAMES)
+		stats->window_count++;
+
+	// frames completed together, e.g. after a burst of retransmissions, still count as one burst
+	uint64_t burst_bytes = stream_stats_window_bytes(stats, now_us >= CHIAKI_STREAM_STATS_BURST_US ? now_us - CHIAKI_STREAM_STATS_BURST_US : 0);
+	if(burst_bytes > stats->burst_bytes_max)
+		stats->burst_bytes_max = burst_bytes;
 }
 
 CHIAKI_EXPORT uint64_t chiaki_stream_stats_bitrate(ChiakiStreamStats *stats, uint64_t framerate)
@@ -34,18 +92,56 @@ CHIAKI_EXPORT uint64_t chiaki_stream_stats_bitrate(ChiakiStreamStats *stats, uin
 	return (stats->bytes * 8 * framerate) / stats->frames;
 }
 
-#define UNIT_SLOTS_MAX 256
+CHIAKI_EXPORT void chiaki_stream_stats_snapshot(ChiakiStreamStats *stats, uint64_t now_us, ChiakiStreamStatsSnapshot *snapshot)
+{
+	memset(snapshot, 0, sizeof(*snapshot));
+	snapshot->frames = stats->frames;
+	snapshot->bytes = stats->bytes;
+	memcpy(snapshot->sizes, stats->sizes, sizeof(snapshot->sizes));
+	snapshot->burst_bytes_max = stats->burst_bytes_max;
+	if(!stats->window_count)
+		return;
+
+	if(stats->ewma_interval_us > 0.0)
+		snapshot->bitrate_ewma = (uint64_t)(stats->ewma_size * 8.0 * 1000000.0 / stats->ewma_interval_us);
+
+	snapshot->burst_bytes = stream_stats_window_bytes(stats, now_us >= CHIAKI_STREAM_STATS_BURST_US ? now_us - CHIAKI_STREAM_STATS_BURST_US : 0);
+
+	// until the stream has run for a whole window, or if the ring does not reach back that far, only the covered span counts
+	uint64_t since_us = now_us >= CHIAKI_STREAM_STATS_WINDOW_US ? now_us - CHIAKI_STREAM_STATS_WINDOW_US : 0;
+	ChiakiStreamStatsWindowEntry *oldest = &stats->window[(stats->window_next + CHIAKI_STREAM_STATS_WINDOW_FRAMES - stats->window_count) % CHIAKI_STREAM_STATS_WINDOW_FRAMES];
+	if(oldest->time_us > since_us)
+	{
+		// the oldest frame was received over the interval before it, which is not covered
+		since_us = oldest->time_us;
+		if(now_us <= since_us)
+			return;
+	}
+	snapshot->bitrate_window = stream_stats_window_bytes(stats, since_us) * 8 * 1000000 / (now_us - since_us);
+}
+
+#define UNIT_SLOTS_MAX CHIAKI_FEC_UNITS_MAX
 
 struct chiaki_frame_unit_t
 {
 	size_t data_size;
 };
 
-CHIAKI_EXPORT void chiaki_frame_processor_init(ChiakiFrameProcessor *frame_processor, ChiakiLog *log)
+CHIAKI_EXPORT void chiaki_frame_processor_init(ChiakiFrameProcessor *frame_processor, ChiakiArena *arena, ChiakiLog *log)
 {
 	frame_processor->log = log;
+	frame_processor->arena = arena;
 	frame_processor->frame_buf = NULL;
 	frame_processor->frame_buf_size = 0;
+	frame_processor->frame_buf_cur = NULL;
+	frame_processor->buf_cb = NULL;
+	frame_processor->buf_cb_user = NULL;
+	frame_processor->stream = false;
+	frame_processor->stream_buf = NULL;
+	frame_processor->stream_buf_size = 0;
+	frame_processor->stream_buf_cur = NULL;
+	frame_processor->stream_units = 0;
+	frame_processor->stream_size = 0;
 	frame_processor->buf_size_per_unit = 0;
 	frame_processor->buf_stride_per_unit = 0;
 	frame_processor->units_source_expected = 0;
@@ -54,14 +150,34 @@ CHIAKI_EXPORT void chiaki_frame_processor_init(ChiakiFrameProcessor *frame_proce
 	frame_processor->units_fec_received = 0;
 	frame_processor->unit_slots = NULL;
 	frame_processor->unit_slots_size = 0;
+	frame_processor->unit_slots_capacity = 0;
 	frame_processor->flushed = true;
 	chiaki_stream_stats_reset(&frame_processor->stream_stats);
+	chiaki_fec_context_init(&frame_processor->fec);
 }
 
 CHIAKI_EXPORT void chiaki_frame_processor_fini(ChiakiFrameProcessor *frame_processor)
 {
 	free(frame_processor->frame_buf);
-	free(frame_processor->unit_slots);
+	free(frame_processor->stream_buf);
+	chiaki_arena_free(frame_processor->arena, frame_processor->unit_slots);
+	chiaki_fec_context_fini(&frame_processor->fec);
+}
+
+static uint8_t *internal_buf(uint8_t **buf, size_t *buf_size, size_t size_required)
+{
+	if(*buf_size < size_required)
+	{
+		free(*buf);
+		*buf = malloc(size_required + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+		if(!*buf)
+		{
+			*buf_size = 0;
+			return NULL;
+		}
+		*buf_size = size_required;
+	}
+	return *buf;
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet)
@@ -73,6 +189,10 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProc
 	}
 
 	frame_processor->flushed = false;
+	frame_processor->frame_buf_cur = NULL;
+	frame_processor->stream_buf_cur = NULL;
+	frame_processor->stream_units = 0;
+	frame_processor->stream_size = 0;
 	frame_processor->units_source_expected = packet->units_in_frame_total - packet->units_in_frame_fec;
 	frame_processor->units_fec_expected = packet->units_in_frame_fec;
 	if(frame_processor->units_fec_expected < 1)
@@ -105,44 +225,48 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProc
 		CHIAKI_LOGE(frame_processor->log, "Packet suggests more than %u unit slots", UNIT_SLOTS_MAX);
 		return CHIAKI_ERR_INVALID_DATA;
 	}
-	if(unit_slots_size_required != frame_processor->unit_slots_size)
+	// only ever grows, frames of the same stream mostly have a similar number of units
+	if(unit_slots_size_required > frame_processor->unit_slots_capacity)
 	{
-		void *new_ptr = NULL;
-		if(frame_processor->unit_slots)
-		{
-			new_ptr = realloc(frame_processor->unit_slots, unit_slots_size_required * sizeof(ChiakiFrameUnit));
-			if(!new_ptr)
-				free(frame_processor->unit_slots);
-		}
-		else
-			new_ptr = malloc(unit_slots_size_required * sizeof(ChiakiFrameUnit));
-
-		frame_processor->unit_slots = new_ptr;
+		ChiakiFrameUnit *new_ptr = chiaki_arena_realloc(frame_processor->arena, CHIAKI_ARENA_TAG_VIDEO,
+				frame_processor->unit_slots, unit_slots_size_required * sizeof(ChiakiFrameUnit));
 		if(!new_ptr)
 		{
 			frame_processor->unit_slots_size = 0;
 			return CHIAKI_ERR_MEMORY;
 		}
-		else
-			frame_processor->unit_slots_size = unit_slots_size_required;
+		frame_processor->unit_slots = new_ptr;
+		frame_processor->unit_slots_capacity = unit_slots_size_required;
 	}
+	frame_processor->unit_slots_size = unit_slots_size_required;
 	memset(frame_processor->unit_slots, 0, frame_processor->unit_slots_size * sizeof(ChiakiFrameUnit));
 
 	if(frame_processor->unit_slots_size > SIZE_MAX / frame_processor->buf_stride_per_unit)
 		return CHIAKI_ERR_OVERFLOW;
 	size_t frame_buf_size_required = frame_processor->unit_slots_size * frame_processor->buf_stride_per_unit;
-	if(frame_processor->frame_buf_size < frame_buf_size_required)
+	uint8_t *buf = NULL;
+	if(frame_processor->buf_cb)
+		buf = frame_processor->buf_cb(frame_buf_size_required + CHIAKI_VIDEO_BUFFER_PADDING_SIZE, frame_processor->buf_cb_user);
+
+	// in stream mode, buf is the output and the units are kept in place internally for fec
+	if(frame_processor->stream)
 	{
-		free(frame_processor->frame_buf);
-		frame_processor->frame_buf = malloc(frame_buf_size_required + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
-		if(!frame_processor->frame_buf)
-		{
-			frame_processor->frame_buf_size = 0;
+		if(!buf)
+			buf = internal_buf(&frame_processor->stream_buf, &frame_processor->stream_buf_size, frame_buf_size_required);
+		if(!buf)
 			return CHIAKI_ERR_MEMORY;
-		}
-		frame_processor->frame_buf_size = frame_buf_size_required;
+		frame_processor->stream_buf_cur = buf;
+		buf = NULL;
 	}
-	memset(frame_processor->frame_buf, 0, frame_buf_size_required + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+
+	if(!buf)
+		buf = internal_buf(&frame_processor->frame_buf, &frame_processor->frame_buf_size, frame_buf_size_required);
+	if(!buf)
+		return CHIAKI_ERR_MEMORY;
+
+	// no memset of the whole buffer here, put_unit() zeroes the rest of each slot it fills
+	// and flush() the padding after the assembled frame. Bytes of missing units are never read.
+	frame_processor->frame_buf_cur = buf;
 
 	return CHIAKI_ERR_SUCCESS;
 }
@@ -176,11 +300,12 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcess
 		unit->data_size = packet->data_size;
 	}
 
-	if(!frame_processor->flushed)
+	if(!frame_processor->flushed && frame_processor->frame_buf_cur)
 	{
-		memcpy(frame_processor->frame_buf + packet->unit_index * frame_processor->buf_stride_per_unit,
-				packet->data,
-				packet->data_size);
+		uint8_t *slot_buf = frame_processor->frame_buf_cur + packet->unit_index * frame_processor->buf_stride_per_unit;
+		memcpy(slot_buf, packet->data, packet->data_size);
+		// fec expects units shorter than buf_size_per_unit to be zero-padded
+		memset(slot_buf + packet->data_size, 0, frame_processor->buf_stride_per_unit - packet->data_size);
 	}
 
 	if(packet->unit_index < frame_processor->units_source_expected)
@@ -207,9 +332,7 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 
 	size_t erasures_count = (frame_processor->units_source_expected + frame_processor->units_fec_expected)
 			- (frame_processor->units_source_received + frame_processor->units_fec_received);
-	unsigned int *erasures = calloc(erasures_count, sizeof(unsigned int));
-	if(!erasures)
-		return CHIAKI_ERR_MEMORY;
+	unsigned int erasures[UNIT_SLOTS_MAX];
 
 	size_t erasure_index = 0;
 	for(size_t i=0; i<frame_processor->units_source_expected + frame_processor->units_fec_expected; i++)
@@ -221,7 +344,6 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 			{
 				// should never happen by design, but too scary not to check
 				assert(false);
-				free(erasures);
 				return CHIAKI_ERR_UNKNOWN;
 			}
 			erasures[erasure_index++] = (unsigned int)i;
@@ -229,10 +351,13 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 	}
 	assert(erasure_index == erasures_count);
 
-	ChiakiErrorCode err = chiaki_fec_decode(frame_processor->frame_buf,
+	uint64_t fec_start_us = chiaki_time_now_monotonic_us();
+	CHIAKI_TRACE(TAKION, FEC_BEGIN, erasures_count);
+	ChiakiErrorCode err = chiaki_fec_context_decode(&frame_processor->fec, frame_processor->frame_buf_cur,
 			frame_processor->buf_size_per_unit, frame_processor->buf_stride_per_unit,
 			frame_processor->units_source_expected, frame_processor->units_fec_expected,
 			erasures, erasures_count);
+	CHIAKI_TRACE(TAKION, FEC_END, err);
 
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
@@ -242,13 +367,14 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 	else
 	{
 		err = CHIAKI_ERR_SUCCESS;
-		CHIAKI_LOGI(frame_processor->log, "FEC successful");
+		CHIAKI_LOGI(frame_processor->log, "FEC successful in %llu us",
+				(unsigned long long)(chiaki_time_now_monotonic_us() - fec_start_us));
 
 		// restore unit sizes
 		for(size_t i=0; i<frame_processor->units_source_expected; i++)
 		{
 			ChiakiFrameUnit *slot = frame_processor->unit_slots + i;
-			uint8_t *buf_ptr = frame_processor->frame_buf + frame_processor->buf_stride_per_unit * i;
+			uint8_t *buf_ptr = frame_processor->frame_buf_cur + frame_processor->buf_stride_per_unit * i;
 			uint16_t padding = ntohs(*((chiaki_unaligned_uint16_t *)buf_ptr));
 			if(padding >= frame_processor->buf_size_per_unit)
 			{
@@ -261,13 +387,51 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 		}
 	}
 
-	free(erasures);
 	return err;
 }
 
+/**
+ * Append the data of source unit i to dst at *cur. dst may be frame_buf_cur itself.
+ */
+static void compact_unit(ChiakiFrameProcessor *frame_processor, size_t i, uint8_t *dst, size_t *cur)
+{
+	ChiakiFrameUnit *unit = frame_processor->unit_slots + i;
+	if(!unit->data_size)
+	{
+		CHIAKI_LOGW(frame_processor->log, "Missing unit %#llx", (unsigned long long)i);
+		return;
+	}
+	if(unit->data_size < 2)
+	{
+		CHIAKI_LOGE(frame_processor->log, "Saved unit has size < 2");
+		chiaki_log_hexdump(frame_processor->log, CHIAKI_LOG_VERBOSE, frame_processor->frame_buf_cur + i*frame_processor->buf_size_per_unit, 0x50);
+		return;
+	}
+	size_t part_size = unit->data_size - 2;
+	uint8_t *buf_ptr = frame_processor->frame_buf_cur + i*frame_processor->buf_stride_per_unit;
+	memmove(dst + *cur, buf_ptr + 2, part_size);
+	*cur += part_size;
+}
+
+CHIAKI_EXPORT size_t chiaki_frame_processor_stream(ChiakiFrameProcessor *frame_processor, uint8_t **frame)
+{
+	*frame = frame_processor->stream_buf_cur;
+	if(!frame_processor->stream_buf_cur || !frame_processor->frame_buf_cur || frame_processor->flushed)
+		return frame_processor->stream_size;
+
+	while(frame_processor->stream_units < frame_processor->units_source_expected
+		&& frame_processor->unit_slots[frame_processor->stream_units].data_size)
+	{
+		compact_unit(frame_processor, frame_processor->stream_units, frame_processor->stream_buf_cur, &frame_processor->stream_size);
+		frame_processor->stream_units++;
+	}
+	return frame_processor->stream_size;
+}
+
 CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(ChiakiFrameProcessor *frame_processor, uint8_t **frame, size_t *frame_size)
 {
-	if(frame_processor->units_source_expected == 0 || frame_processor->flushed)
+	if(frame_processor->units_source_expected == 0 || frame_processor->flushed || !frame_processor->frame_buf_cur
+		|| (frame_processor->stream && !frame_processor->stream_buf_cur))
 		return CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED;
 
 	//CHIAKI_LOGD(NULL, "source: %u, fec: %u",
@@ -284,30 +448,29 @@ CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(Chiak
 			result = CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED;
 	}
 
+	uint8_t *dst = frame_processor->frame_buf_cur;
+	size_t i = 0;
 	size_t cur = 0;
-	for(size_t i=0; i<frame_processor->units_source_expected; i++)
+	if(frame_processor->stream)
 	{
-		ChiakiFrameUnit *unit = frame_processor->unit_slots + i;
-		if(!unit->data_size)
-		{
-			CHIAKI_LOGW(frame_processor->log, "Missing unit %#llx", (unsigned long long)i);
-			continue;
-		}
-		if(unit->data_size < 2)
-		{
-			CHIAKI_LOGE(frame_processor->log, "Saved unit has size < 2");
-			chiaki_log_hexdump(frame_processor->log, CHIAKI_LOG_VERBOSE, frame_processor->frame_buf + i*frame_processor->buf_size_per_unit, 0x50);
-			continue;
-		}
-		size_t part_size = unit->data_size - 2;
-		uint8_t *buf_ptr = frame_processor->frame_buf + i*frame_processor->buf_stride_per_unit;
-		memmove(frame_processor->frame_buf + cur, buf_ptr + 2, part_size);
-		cur += part_size;
+		// continue after what has already been streamed, which was received, not recovered, so it is still valid
+		dst = frame_processor->stream_buf_cur;
+		i = frame_processor->stream_units;
+		cur = frame_processor->stream_size;
 	}
+	for(; i<frame_processor->units_source_expected; i++)
+		compact_unit(frame_processor, i, dst, &cur);
+	frame_processor->stream_units = frame_processor->units_source_expected;
+	frame_processor->stream_size = cur;
 
-	chiaki_stream_stats_frame(&frame_processor->stream_stats, (uint64_t)cur);
+	memset(dst + cur, 0, CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+
+	chiaki_stream_stats_frame(&frame_processor->stream_stats, (uint64_t)cur, CHIAKI_BITSTREAM_SLICE_UNKNOWN, chiaki_time_now_monotonic_us());
+
+	// units arriving after this, usually trailing FEC units, are only counted, not copied anymore
+	frame_processor->flushed = true;
 
-	*frame = frame_processor->frame_buf;
+	*frame = dst;
 	*frame_size = cur;
 	return result;
 }
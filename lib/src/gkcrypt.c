@@ -2,6 +2,7 @@
 
 #include <chiaki/gkcrypt.h>
 #include <chiaki/session.h>
+#include <chiaki/trace.h>
 
 #include <string.h>
 #include <assert.h>
@@ -21,8 +22,31 @@
 
 #define KEY_BUF_CHUNK_SIZE 0x1000
 
+// number of chunks behind the newest requested one that are kept for late (reordered) packets
+#define KEY_BUF_CHUNKS_BEHIND(chunks) ((chunks) / 4)
+
+// stack buffer for key stream that can not be used directly from key_buf in chiaki_gkcrypt_decrypt()
+#define DECRYPT_KEY_STREAM_STACK_SIZE 0x100
+
+#define KEY_BUF_EVENT_WAKEUP 1
+
 static ChiakiErrorCode gkcrypt_gen_key_iv(ChiakiGKCrypt *gkcrypt, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret);
 
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+typedef mbedtls_aes_context GKCryptKeyStreamCtx;
+#else
+typedef EVP_CIPHER_CTX *GKCryptKeyStreamCtx;
+#endif
+
+static ChiakiErrorCode gkcrypt_key_stream_ctx_init(ChiakiGKCrypt *gkcrypt, GKCryptKeyStreamCtx *ctx);
+static void gkcrypt_key_stream_ctx_fini(GKCryptKeyStreamCtx *ctx);
+static ChiakiErrorCode gkcrypt_gen_key_stream_ctx(ChiakiGKCrypt *gkcrypt, GKCryptKeyStreamCtx *ctx, uint64_t key_pos, uint8_t *buf, size_t buf_size);
+#ifdef CHIAKI_GKCRYPT_AES_CTR_KERNEL
+static void gkcrypt_aes_ctr_kernel_init(ChiakiGKCrypt *gkcrypt);
+#endif
+
+static void gkcrypt_gmac_cache_entry_fini(ChiakiGKCryptGMacCacheEntry *entry);
+
 static void *gkcrypt_thread_func(void *user);
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, ChiakiLog *log, size_t key_buf_chunks, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
@@ -30,12 +54,14 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, Chiaki
 	gkcrypt->log = log;
 	gkcrypt->index = index;
 
+	gkcrypt->key_buf_chunks = key_buf_chunks;
 	gkcrypt->key_buf_size = key_buf_chunks * KEY_BUF_CHUNK_SIZE;
-	gkcrypt->key_buf_populated = 0;
-	gkcrypt->key_buf_key_pos_min = 0;
-	gkcrypt->key_buf_start_offset = 0;
-	gkcrypt->last_key_pos = 0;
-	gkcrypt->key_buf_thread_stop = false;
+	gkcrypt->key_buf_chunk_tags = NULL;
+	gkcrypt->key_buf_next_chunk = 0;
+	gkcrypt->key_buf_consumer_chunk = 0;
+	gkcrypt->key_buf_thread_waiting = 0;
+	gkcrypt->key_buf_misses = 0;
+	gkcrypt->key_buf_thread_stop = 0;
 
 	ChiakiErrorCode err;
 	if(gkcrypt->key_buf_size)
@@ -47,13 +73,16 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, Chiaki
 			goto error;
 		}
 
-		err = chiaki_mutex_init(&gkcrypt->key_buf_mutex, false);
-		if(err != CHIAKI_ERR_SUCCESS)
+		gkcrypt->key_buf_chunk_tags = calloc(key_buf_chunks, sizeof(size_t));
+		if(!gkcrypt->key_buf_chunk_tags)
+		{
+			err = CHIAKI_ERR_MEMORY;
 			goto error_key_buf;
+		}
 
-		err = chiaki_cond_init(&gkcrypt->key_buf_cond, &gkcrypt->key_buf_mutex);
+		err = chiaki_event_flags_init(&gkcrypt->key_buf_event);
 		if(err != CHIAKI_ERR_SUCCESS)
-			goto error_key_buf_mutex;
+			goto error_key_buf;
 	}
 	else
 	{
@@ -63,31 +92,57 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, Chiaki
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(gkcrypt->log, "GKCrypt failed to generate key and IV");
-		goto error_key_buf_cond;
+		goto error_key_buf_event;
 	}
 
+	err = gkcrypt_key_stream_ctx_init(gkcrypt, &gkcrypt->key_stream_ctx_sync);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(gkcrypt->log, "GKCrypt failed to init key stream cipher context");
+		goto error_key_buf_event;
+	}
+
+	err = gkcrypt_key_stream_ctx_init(gkcrypt, &gkcrypt->key_stream_ctx_thread);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(gkcrypt->log, "GKCrypt failed to init key stream cipher context");
+		goto error_ctx_sync;
+	}
+
+	err = chiaki_mutex_init(&gkcrypt->key_stream_ctx_sync_mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_ctx_thread;
+	chiaki_mutex_set_name(&gkcrypt->key_stream_ctx_sync_mutex, "gkcrypt key stream");
+
+#ifdef CHIAKI_GKCRYPT_AES_CTR_KERNEL
+	gkcrypt_aes_ctr_kernel_init(gkcrypt);
+#endif
+
 	chiaki_gkcrypt_gen_gmac_key(0, gkcrypt->key_base, gkcrypt->iv, gkcrypt->key_gmac_base);
 	gkcrypt->key_gmac_index_current = 0;
 	memcpy(gkcrypt->key_gmac_current, gkcrypt->key_gmac_base, sizeof(gkcrypt->key_gmac_current));
+	chiaki_gkcrypt_gmac_cache_init(&gkcrypt->gmac_cache);
 
 	if(gkcrypt->key_buf)
 	{
-		err = chiaki_thread_create(&gkcrypt->key_buf_thread, gkcrypt_thread_func, gkcrypt);
+		err = chiaki_thread_create_role(&gkcrypt->key_buf_thread, gkcrypt_thread_func, gkcrypt, CHIAKI_THREAD_ROLE_GKCRYPT);
 		if(err != CHIAKI_ERR_SUCCESS)
-			goto error_key_buf_cond;
-
-		chiaki_thread_set_name(&gkcrypt->key_buf_thread, "Chiaki GKCrypt");
+			goto error_ctx_sync_mutex;
 	}
 
 	return CHIAKI_ERR_SUCCESS;
 
-error_key_buf_cond:
-	if(gkcrypt->key_buf)
-		chiaki_cond_fini(&gkcrypt->key_buf_cond);
-error_key_buf_mutex:
+error_ctx_sync_mutex:
+	chiaki_mutex_fini(&gkcrypt->key_stream_ctx_sync_mutex);
+error_ctx_thread:
+	gkcrypt_key_stream_ctx_fini(&gkcrypt->key_stream_ctx_thread);
+error_ctx_sync:
+	gkcrypt_key_stream_ctx_fini(&gkcrypt->key_stream_ctx_sync);
+error_key_buf_event:
 	if(gkcrypt->key_buf)
-		chiaki_mutex_fini(&gkcrypt->key_buf_mutex);
+		chiaki_event_flags_fini(&gkcrypt->key_buf_event);
 error_key_buf:
+	free(gkcrypt->key_buf_chunk_tags);
 	chiaki_aligned_free(gkcrypt->key_buf);
 error:
 	return err;
@@ -97,15 +152,24 @@ CHIAKI_EXPORT void chiaki_gkcrypt_fini(ChiakiGKCrypt *gkcrypt)
 {
 	if(gkcrypt->key_buf)
 	{
-		chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
-		gkcrypt->key_buf_thread_stop = true;
-		chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
-		chiaki_cond_signal(&gkcrypt->key_buf_cond);
+		chiaki_atomic_store_seq_cst(&gkcrypt->key_buf_thread_stop, 1);
+		chiaki_event_flags_set(&gkcrypt->key_buf_event, KEY_BUF_EVENT_WAKEUP);
 		chiaki_thread_join(&gkcrypt->key_buf_thread, NULL);
-		chiaki_cond_fini(&gkcrypt->key_buf_cond);
-		chiaki_mutex_fini(&gkcrypt->key_buf_mutex);
+		chiaki_event_flags_fini(&gkcrypt->key_buf_event);
+		free(gkcrypt->key_buf_chunk_tags);
 		chiaki_aligned_free(gkcrypt->key_buf);
+		if(gkcrypt->key_buf_misses)
+			CHIAKI_LOGI(gkcrypt->log, "GKCrypt %d key buffer missed %llu times", (int)gkcrypt->index, (unsigned long long)gkcrypt->key_buf_misses);
 	}
+
+	if(gkcrypt->gmac_cache.misses)
+		CHIAKI_LOGV(gkcrypt->log, "GKCrypt %d GMAC key cache hits: %llu, misses: %llu", (int)gkcrypt->index,
+				(unsigned long long)gkcrypt->gmac_cache.hits, (unsigned long long)gkcrypt->gmac_cache.misses);
+	chiaki_gkcrypt_gmac_cache_fini(&gkcrypt->gmac_cache);
+
+	chiaki_mutex_fini(&gkcrypt->key_stream_ctx_sync_mutex);
+	gkcrypt_key_stream_ctx_fini(&gkcrypt->key_stream_ctx_thread);
+	gkcrypt_key_stream_ctx_fini(&gkcrypt->key_stream_ctx_sync);
 }
 
 static ChiakiErrorCode gkcrypt_gen_key_iv(ChiakiGKCrypt *gkcrypt, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
@@ -211,39 +275,65 @@ CHIAKI_EXPORT void chiaki_gkcrypt_gen_tmp_gmac_key(ChiakiGKCrypt *gkcrypt, uint6
 		memcpy(key_out, gkcrypt->key_gmac_base, sizeof(gkcrypt->key_gmac_base));
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gen_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+/**
+ * Create an AES-128-ECB encryption context keyed with gkcrypt->key_base.
+ *
+ */
+static ChiakiErrorCode gkcrypt_key_stream_ctx_init(ChiakiGKCrypt *gkcrypt, GKCryptKeyStreamCtx *ctx)
 {
-	assert(key_pos % CHIAKI_GKCRYPT_BLOCK_SIZE == 0);
-	assert(buf_size % CHIAKI_GKCRYPT_BLOCK_SIZE == 0);
-
 #ifdef CHIAKI_LIB_ENABLE_MBEDTLS
-	// build mbedtls aes context
-	mbedtls_aes_context ctx;
-	mbedtls_aes_init(&ctx);
-
-	if(mbedtls_aes_setkey_enc(&ctx, gkcrypt->key_base, 128) != 0)
+	mbedtls_aes_init(ctx);
+	if(mbedtls_aes_setkey_enc(ctx, gkcrypt->key_base, 128) != 0)
 	{
-		mbedtls_aes_free(&ctx);
+		mbedtls_aes_free(ctx);
 		return CHIAKI_ERR_UNKNOWN;
 	}
-
 #else
-	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-	if(!ctx)
-		return CHIAKI_ERR_UNKNOWN;
+	*ctx = EVP_CIPHER_CTX_new();
+	if(!*ctx)
+		return CHIAKI_ERR_MEMORY;
 
-	if(!EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, gkcrypt->key_base, NULL))
+	if(!EVP_EncryptInit_ex(*ctx, EVP_aes_128_ecb(), NULL, gkcrypt->key_base, NULL))
 	{
-		EVP_CIPHER_CTX_free(ctx);
+		EVP_CIPHER_CTX_free(*ctx);
 		return CHIAKI_ERR_UNKNOWN;
 	}
 
-	if(!EVP_CIPHER_CTX_set_padding(ctx, 0))
+	if(!EVP_CIPHER_CTX_set_padding(*ctx, 0))
 	{
-		EVP_CIPHER_CTX_free(ctx);
+		EVP_CIPHER_CTX_free(*ctx);
 		return CHIAKI_ERR_UNKNOWN;
 	}
 #endif
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static void gkcrypt_key_stream_ctx_fini(GKCryptKeyStreamCtx *ctx)
+{
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	mbedtls_aes_free(ctx);
+#else
+	EVP_CIPHER_CTX_free(*ctx);
+#endif
+}
+
+/**
+ * Generate the key stream using a context from gkcrypt_key_stream_ctx_init(), which must not be used concurrently.
+ */
+static ChiakiErrorCode gkcrypt_gen_key_stream_ctx(ChiakiGKCrypt *gkcrypt, GKCryptKeyStreamCtx *ctx, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+{
+	assert(key_pos % CHIAKI_GKCRYPT_BLOCK_SIZE == 0);
+	assert(buf_size % CHIAKI_GKCRYPT_BLOCK_SIZE == 0);
+
+#ifdef CHIAKI_GKCRYPT_AES_CTR_KERNEL
+	if(gkcrypt->key_stream_aes_ctr_enabled)
+	{
+		chiaki_aes_ctr_gen_key_stream(&gkcrypt->key_stream_aes_ctr, gkcrypt->iv,
+				key_pos / CHIAKI_GKCRYPT_BLOCK_SIZE, buf, buf_size / CHIAKI_GKCRYPT_BLOCK_SIZE);
+		return CHIAKI_ERR_SUCCESS;
+	}
+#endif
+
 	int counter_offset = (int)(key_pos / CHIAKI_GKCRYPT_BLOCK_SIZE);
 
 	for(uint8_t *cur = buf, *end = buf + buf_size; cur < end; cur += CHIAKI_GKCRYPT_BLOCK_SIZE)
@@ -253,115 +343,325 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gen_key_stream(ChiakiGKCrypt *gkcry
 	for(int i = 0; i < buf_size; i = i + 16)
 	{
 		// loop over all blocks of 16 bytes (128 bits)
-		if(mbedtls_aes_crypt_ecb(&ctx, MBEDTLS_AES_ENCRYPT, buf + i, buf + i) != 0)
-		{
-			mbedtls_aes_free(&ctx);
+		if(mbedtls_aes_crypt_ecb(ctx, MBEDTLS_AES_ENCRYPT, buf + i, buf + i) != 0)
 			return CHIAKI_ERR_UNKNOWN;
-		}
 	}
-
-	mbedtls_aes_free(&ctx);
 #else
+	// ecb without padding keeps no state between updates, so the context can be reused as-is
 	int outl;
-	EVP_EncryptUpdate(ctx, buf, &outl, buf, (int)buf_size);
+	EVP_EncryptUpdate(*ctx, buf, &outl, buf, (int)buf_size);
 	if(outl != buf_size)
-	{
-		EVP_CIPHER_CTX_free(ctx);
 		return CHIAKI_ERR_UNKNOWN;
+#endif
+	return CHIAKI_ERR_SUCCESS;
+}
+
+#ifdef CHIAKI_GKCRYPT_AES_CTR_KERNEL
+#define AES_CTR_KERNEL_CHECK_BLOCKS 8
+
+/**
+ * Set up key_stream_aes_ctr and only enable it if it produces the same key stream as the crypto library.
+ */
+static void gkcrypt_aes_ctr_kernel_init(ChiakiGKCrypt *gkcrypt)
+{
+	gkcrypt->key_stream_aes_ctr_enabled = false;
+	chiaki_aes_ctr_init(&gkcrypt->key_stream_aes_ctr, gkcrypt->key_base);
+
+	// one run from the start and one across a carry into the upper counter bytes
+	static const uint64_t check_key_pos[] = { 0, 0xfff0 * CHIAKI_GKCRYPT_BLOCK_SIZE };
+	uint8_t expected[AES_CTR_KERNEL_CHECK_BLOCKS * CHIAKI_GKCRYPT_BLOCK_SIZE];
+	uint8_t actual[AES_CTR_KERNEL_CHECK_BLOCKS * CHIAKI_GKCRYPT_BLOCK_SIZE];
+	for(size_t i=0; i<sizeof(check_key_pos) / sizeof(check_key_pos[0]); i++)
+	{
+		if(gkcrypt_gen_key_stream_ctx(gkcrypt, &gkcrypt->key_stream_ctx_sync, check_key_pos[i], expected, sizeof(expected)) != CHIAKI_ERR_SUCCESS)
+			return;
+		chiaki_aes_ctr_gen_key_stream(&gkcrypt->key_stream_aes_ctr, gkcrypt->iv,
+				check_key_pos[i] / CHIAKI_GKCRYPT_BLOCK_SIZE, actual, AES_CTR_KERNEL_CHECK_BLOCKS);
+		if(memcmp(expected, actual, sizeof(expected)) != 0)
+		{
+			CHIAKI_LOGE(gkcrypt->log, "GKCrypt %d AES-CTR kernel does not match the reference, falling back to the crypto library", (int)gkcrypt->index);
+			return;
+		}
 	}
 
-	EVP_CIPHER_CTX_free(ctx);
+	gkcrypt->key_stream_aes_ctr_enabled = true;
+}
 #endif
-	return CHIAKI_ERR_SUCCESS;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gen_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+{
+#ifdef CHIAKI_GKCRYPT_AES_CTR_KERNEL
+	if(gkcrypt->key_stream_aes_ctr_enabled)
+		return gkcrypt_gen_key_stream_ctx(gkcrypt, NULL, key_pos, buf, buf_size);
+#endif
+	ChiakiErrorCode err = chiaki_mutex_lock(&gkcrypt->key_stream_ctx_sync_mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	err = gkcrypt_gen_key_stream_ctx(gkcrypt, &gkcrypt->key_stream_ctx_sync, key_pos, buf, buf_size);
+	chiaki_mutex_unlock(&gkcrypt->key_stream_ctx_sync_mutex);
+	return err;
 }
 
 static bool gkcrypt_key_buf_should_generate(ChiakiGKCrypt *gkcrypt)
 {
-	return gkcrypt->last_key_pos > gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated / 2;
+	size_t next = chiaki_atomic_load_acquire(&gkcrypt->key_buf_next_chunk);
+	size_t consumer = chiaki_atomic_load_acquire(&gkcrypt->key_buf_consumer_chunk);
+	return next < consumer + gkcrypt->key_buf_chunks - KEY_BUF_CHUNKS_BEHIND(gkcrypt->key_buf_chunks);
+}
+
+/**
+ * Copy the key stream out of key_buf without locking.
+ * Every chunk is checked before and after copying, so a chunk overwritten by key_buf_thread meanwhile is detected.
+ *
+ * @return false if any part is not in key_buf
+ */
+static bool gkcrypt_key_buf_read(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+{
+	size_t chunk_first = (size_t)(key_pos / KEY_BUF_CHUNK_SIZE);
+	size_t chunk_last = (size_t)((key_pos + buf_size - 1) / KEY_BUF_CHUNK_SIZE);
+	if(chunk_last - chunk_first >= gkcrypt->key_buf_chunks)
+		return false;
+
+	uint64_t pos = key_pos;
+	uint8_t *out = buf;
+	for(size_t chunk = chunk_first; chunk <= chunk_last; chunk++)
+	{
+		size_t slot = chunk % gkcrypt->key_buf_chunks;
+		if(chiaki_atomic_load_acquire(&gkcrypt->key_buf_chunk_tags[slot]) != chunk + 1)
+			return false;
+		size_t offset = (size_t)(pos % KEY_BUF_CHUNK_SIZE);
+		size_t size = KEY_BUF_CHUNK_SIZE - offset;
+		if(size > buf_size - (size_t)(out - buf))
+			size = buf_size - (size_t)(out - buf);
+		memcpy(out, gkcrypt->key_buf + slot * KEY_BUF_CHUNK_SIZE + offset, size);
+		out += size;
+		pos += size;
+	}
+
+	// order the copies before checking the tags again
+	chiaki_atomic_fence_seq_cst();
+	for(size_t chunk = chunk_first; chunk <= chunk_last; chunk++)
+	{
+		if(chiaki_atomic_load_seq_cst(&gkcrypt->key_buf_chunk_tags[chunk % gkcrypt->key_buf_chunks]) != chunk + 1)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * XOR the key stream directly from key_buf into buf.
+ *
+ * Only chunks the generator thread will not overwrite while the consumer stays at its current chunk are used,
+ * so no copy and re-check is necessary. Must be called by the consumer after gkcrypt_key_buf_consume().
+ *
+ * @return false without touching buf if any part is not available this way
+ */
+static bool gkcrypt_key_buf_xor(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+{
+	size_t chunk_first = (size_t)(key_pos / KEY_BUF_CHUNK_SIZE);
+	size_t chunk_last = (size_t)((key_pos + buf_size - 1) / KEY_BUF_CHUNK_SIZE);
+	size_t consumer = chiaki_atomic_load_acquire(&gkcrypt->key_buf_consumer_chunk);
+	if(chunk_first + KEY_BUF_CHUNKS_BEHIND(gkcrypt->key_buf_chunks) < consumer || chunk_last > consumer)
+		return false;
+
+	for(size_t chunk = chunk_first; chunk <= chunk_last; chunk++)
+	{
+		if(chiaki_atomic_load_acquire(&gkcrypt->key_buf_chunk_tags[chunk % gkcrypt->key_buf_chunks]) != chunk + 1)
+			return false;
+	}
+
+	uint64_t pos = key_pos;
+	uint8_t *cur = buf;
+	uint8_t *end = buf + buf_size;
+	while(cur < end)
+	{
+		size_t slot = (size_t)(pos / KEY_BUF_CHUNK_SIZE) % gkcrypt->key_buf_chunks;
+		size_t offset = (size_t)(pos % KEY_BUF_CHUNK_SIZE);
+		size_t size = KEY_BUF_CHUNK_SIZE - offset;
+		if(size > (size_t)(end - cur))
+			size = (size_t)(end - cur);
+		xor_bytes(cur, gkcrypt->key_buf + slot * KEY_BUF_CHUNK_SIZE + offset, size);
+		cur += size;
+		pos += size;
+	}
+	return true;
+}
+
+/**
+ * Tell the generator thread that the key stream up to and including chunk_last has been requested.
+ */
+static void gkcrypt_key_buf_consume(ChiakiGKCrypt *gkcrypt, size_t chunk_last)
+{
+	if(chunk_last <= chiaki_atomic_load_acquire(&gkcrypt->key_buf_consumer_chunk))
+		return;
+
+	chiaki_atomic_store_release(&gkcrypt->key_buf_consumer_chunk, chunk_last);
+
+	// pairs with the fence in gkcrypt_thread_func(), so either we see it waiting or it sees our new position
+	chiaki_atomic_fence_seq_cst();
+	if(chiaki_atomic_load_seq_cst(&gkcrypt->key_buf_thread_waiting) && gkcrypt_key_buf_should_generate(gkcrypt))
+		chiaki_event_flags_set(&gkcrypt->key_buf_event, KEY_BUF_EVENT_WAKEUP);
+}
+
+static void gkcrypt_key_buf_log_miss(ChiakiGKCrypt *gkcrypt, uint64_t key_pos)
+{
+	gkcrypt->key_buf_misses++;
+	CHIAKI_LOGV(gkcrypt->log, "Requested key stream for key pos %#llx on GKCrypt %d, but it's not in the buffer:"
+			" next chunk: %#llx, consumer chunk: %#llx, misses: %llu",
+			(unsigned long long)key_pos,
+			gkcrypt->index,
+			(unsigned long long)chiaki_atomic_load_acquire(&gkcrypt->key_buf_next_chunk),
+			(unsigned long long)chiaki_atomic_load_acquire(&gkcrypt->key_buf_consumer_chunk),
+			(unsigned long long)gkcrypt->key_buf_misses);
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_get_key_stream(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
 {
-	if(!gkcrypt->key_buf)
+	if(!gkcrypt->key_buf || !buf_size)
 		return chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos, buf, buf_size);
 
-	chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
+	gkcrypt_key_buf_consume(gkcrypt, (size_t)((key_pos + buf_size - 1) / KEY_BUF_CHUNK_SIZE));
 
-	if(key_pos + buf_size > gkcrypt->last_key_pos)
-		gkcrypt->last_key_pos = key_pos + buf_size;
-	bool signal = gkcrypt_key_buf_should_generate(gkcrypt);
+	if(gkcrypt_key_buf_read(gkcrypt, key_pos, buf, buf_size))
+		return CHIAKI_ERR_SUCCESS;
 
-	ChiakiErrorCode err;
-	if(key_pos < gkcrypt->key_buf_key_pos_min
-		|| key_pos + buf_size >= gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated)
-	{
-		CHIAKI_LOGW(gkcrypt->log, "Requested key stream for key pos %#llx on GKCrypt %d, but it's not in the buffer:"
-				" key buf size %#llx, start offset: %#llx, populated: %#llx, min key pos: %#llx, last key pos: %#llx",
-				(unsigned long long)key_pos,
-				gkcrypt->index,
-				(unsigned long long)gkcrypt->key_buf_size,
-				(unsigned long long)gkcrypt->key_buf_start_offset,
-				(unsigned long long)gkcrypt->key_buf_populated,
-				(unsigned long long)gkcrypt->key_buf_key_pos_min,
-				(unsigned long long)gkcrypt->last_key_pos);
-		chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
-		err = chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos, buf, buf_size);
+	gkcrypt_key_buf_log_miss(gkcrypt, key_pos);
+	return chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos, buf, buf_size);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_decrypt(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+{
+	if(!buf_size)
+		return CHIAKI_ERR_SUCCESS;
+
+	if(gkcrypt->key_buf)
+	{
+		gkcrypt_key_buf_consume(gkcrypt, (size_t)((key_pos + buf_size - 1) / KEY_BUF_CHUNK_SIZE));
+		if(gkcrypt_key_buf_xor(gkcrypt, key_pos, buf, buf_size))
+			return CHIAKI_ERR_SUCCESS;
 	}
-	else
+
+	// key stream is only generated in whole blocks, so go through a small stack buffer, block-aligned at the head
+	bool missed = false;
+	uint8_t key_stream[DECRYPT_KEY_STREAM_STACK_SIZE];
+	uint64_t pos = key_pos;
+	uint8_t *cur = buf;
+	uint8_t *end = buf + buf_size;
+	while(cur < end)
 	{
-		size_t offset_in_buf = key_pos - gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_start_offset;
-		offset_in_buf %= gkcrypt->key_buf_size;
-		size_t end = offset_in_buf + buf_size;
-		if(end > gkcrypt->key_buf_size)
+		size_t padding_pre = (size_t)(pos % CHIAKI_GKCRYPT_BLOCK_SIZE);
+		size_t size = sizeof(key_stream) - padding_pre;
+		if(size > (size_t)(end - cur))
+			size = (size_t)(end - cur);
+		size_t full_size = ((padding_pre + size + CHIAKI_GKCRYPT_BLOCK_SIZE - 1) / CHIAKI_GKCRYPT_BLOCK_SIZE) * CHIAKI_GKCRYPT_BLOCK_SIZE;
+		uint64_t pos_aligned = pos - padding_pre;
+
+		if(!gkcrypt->key_buf || !gkcrypt_key_buf_read(gkcrypt, pos_aligned, key_stream, full_size))
 		{
-			size_t excess = end - gkcrypt->key_buf_size;
-			memcpy(buf, gkcrypt->key_buf + offset_in_buf, buf_size - excess);
-			memcpy(buf + (buf_size - excess), gkcrypt->key_buf, excess);
+			if(gkcrypt->key_buf && !missed)
+			{
+				gkcrypt_key_buf_log_miss(gkcrypt, key_pos);
+				missed = true;
+			}
+			ChiakiErrorCode err = chiaki_gkcrypt_gen_key_stream(gkcrypt, pos_aligned, key_stream, full_size);
+			if(err != CHIAKI_ERR_SUCCESS)
+				return err;
 		}
-		else
-			memcpy(buf, gkcrypt->key_buf + offset_in_buf, buf_size);
-		err = CHIAKI_ERR_SUCCESS;
-		chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
-	}
 
-	if(signal)
-		chiaki_cond_signal(&gkcrypt->key_buf_cond);
+		xor_bytes(cur, key_stream + padding_pre, size);
+		cur += size;
+		pos += size;
+	}
 
-	return err;
+	return CHIAKI_ERR_SUCCESS;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_decrypt(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, uint8_t *buf, size_t buf_size)
+static void gkcrypt_gmac_cache_entry_fini(ChiakiGKCryptGMacCacheEntry *entry)
 {
-	uint64_t padding_pre = key_pos % CHIAKI_GKCRYPT_BLOCK_SIZE;
-	size_t full_size = ((padding_pre + buf_size + CHIAKI_GKCRYPT_BLOCK_SIZE - 1) / CHIAKI_GKCRYPT_BLOCK_SIZE) * CHIAKI_GKCRYPT_BLOCK_SIZE;
+	if(!entry->valid)
+		return;
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	mbedtls_gcm_free(&entry->gcm_ctx);
+#else
+	EVP_CIPHER_CTX_free(entry->gcm_ctx);
+#endif
+	entry->valid = false;
+}
 
-	uint8_t *key_stream = malloc(full_size);
-	if(!key_stream)
+static ChiakiErrorCode gkcrypt_gmac_cache_entry_init(ChiakiGKCryptGMacCacheEntry *entry, const uint8_t *gmac_key)
+{
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	mbedtls_gcm_init(&entry->gcm_ctx);
+	if(mbedtls_gcm_setkey(&entry->gcm_ctx, MBEDTLS_CIPHER_ID_AES, gmac_key, CHIAKI_GKCRYPT_BLOCK_SIZE * 8) != 0)
+	{
+		mbedtls_gcm_free(&entry->gcm_ctx);
+		return CHIAKI_ERR_UNKNOWN;
+	}
+#else
+	entry->gcm_ctx = EVP_CIPHER_CTX_new();
+	if(!entry->gcm_ctx)
 		return CHIAKI_ERR_MEMORY;
 
-	ChiakiErrorCode err = chiaki_gkcrypt_get_key_stream(gkcrypt, key_pos - padding_pre, key_stream, full_size);
-	if(err != CHIAKI_ERR_SUCCESS)
+	if(!EVP_CipherInit_ex(entry->gcm_ctx, EVP_aes_128_gcm(), NULL, NULL, NULL, 1)
+			|| !EVP_CIPHER_CTX_ctrl(entry->gcm_ctx, EVP_CTRL_GCM_SET_IVLEN, CHIAKI_GKCRYPT_BLOCK_SIZE, NULL)
+			|| !EVP_CipherInit_ex(entry->gcm_ctx, NULL, NULL, gmac_key, NULL, 1))
 	{
-		free(key_stream);
-		return err;
+		EVP_CIPHER_CTX_free(entry->gcm_ctx);
+		return CHIAKI_ERR_UNKNOWN;
 	}
+#endif
+	entry->valid = true;
+	return CHIAKI_ERR_SUCCESS;
+}
 
-	xor_bytes(buf, key_stream + padding_pre, buf_size);
-	free(key_stream);
+CHIAKI_EXPORT void chiaki_gkcrypt_gmac_cache_init(ChiakiGKCryptGMacCache *cache)
+{
+	for(size_t i=0; i<CHIAKI_GKCRYPT_GMAC_CACHE_SIZE; i++)
+		cache->entries[i].valid = false;
+	cache->uses = 0;
+	cache->hits = 0;
+	cache->misses = 0;
+}
 
-	return CHIAKI_ERR_SUCCESS;
+CHIAKI_EXPORT void chiaki_gkcrypt_gmac_cache_fini(ChiakiGKCryptGMacCache *cache)
+{
+	for(size_t i=0; i<CHIAKI_GKCRYPT_GMAC_CACHE_SIZE; i++)
+		gkcrypt_gmac_cache_entry_fini(&cache->entries[i]);
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out)
+/**
+ * Get the cache entry for key_index, deriving the GMAC key and keying a new context on a miss.
+ * The least recently used entry is replaced.
+ *
+ * @param own whether cache is gkcrypt->gmac_cache, which may also advance key_gmac_current.
+ * Other caches only derive temporary keys, so they never write to gkcrypt.
+ */
+static ChiakiGKCryptGMacCacheEntry *gkcrypt_gmac_cache_get(ChiakiGKCrypt *gkcrypt, ChiakiGKCryptGMacCache *cache, bool own, uint64_t key_index)
 {
-	uint8_t iv[CHIAKI_GKCRYPT_BLOCK_SIZE];
-	counter_add(iv, gkcrypt->iv, key_pos / 0x10);
+	ChiakiGKCryptGMacCacheEntry *victim = &cache->entries[0];
+	for(size_t i=0; i<CHIAKI_GKCRYPT_GMAC_CACHE_SIZE; i++)
+	{
+		ChiakiGKCryptGMacCacheEntry *entry = &cache->entries[i];
+		if(entry->valid && entry->key_index == key_index)
+		{
+			cache->hits++;
+			entry->last_used = ++cache->uses;
+			return entry;
+		}
+		if(victim->valid && (!entry->valid || entry->last_used < victim->last_used))
+			victim = entry;
+	}
+
+	cache->misses++;
 
 	uint8_t *gmac_key = gkcrypt->key_gmac_current;
 	uint8_t gmac_key_tmp[CHIAKI_GKCRYPT_BLOCK_SIZE];
-	uint64_t key_index = (key_pos > 0 ? key_pos - 1 : 0) / CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS;
-
-	if(key_index > gkcrypt->key_gmac_index_current)
+	if(!own)
+	{
+		chiaki_gkcrypt_gen_tmp_gmac_key(gkcrypt, key_index, gmac_key_tmp);
+		gmac_key = gmac_key_tmp;
+	}
+	else if(key_index > gkcrypt->key_gmac_index_current)
 	{
 		chiaki_gkcrypt_gen_new_gmac_key(gkcrypt, key_index);
 	}
@@ -371,128 +671,95 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, uint64
 		gmac_key = gmac_key_tmp;
 	}
 
-#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
-	// build mbedtls gcm context AES_128_GCM
-	// Encryption
-	mbedtls_gcm_context actx;
-	mbedtls_gcm_init(&actx);
-	// set gmac_key 128 bits key
-	if(mbedtls_gcm_setkey(&actx, MBEDTLS_CIPHER_ID_AES, gmac_key, CHIAKI_GKCRYPT_BLOCK_SIZE * 8) != 0)
-	{
-		mbedtls_gcm_free(&actx);
-		return CHIAKI_ERR_UNKNOWN;
-	}
+	gkcrypt_gmac_cache_entry_fini(victim);
+	if(gkcrypt_gmac_cache_entry_init(victim, gmac_key) != CHIAKI_ERR_SUCCESS)
+		return NULL;
+	victim->key_index = key_index;
+	victim->last_used = ++cache->uses;
+	return victim;
+}
 
-	// encrypt without additional data
-	if(mbedtls_gcm_starts(&actx, MBEDTLS_GCM_ENCRYPT, iv, CHIAKI_GKCRYPT_BLOCK_SIZE, NULL, 0) != 0)
-	{
-		mbedtls_gcm_free(&actx);
+static ChiakiErrorCode gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, ChiakiGKCryptGMacCache *cache, bool own, uint64_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out)
+{
+	uint8_t iv[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	counter_add(iv, gkcrypt->iv, key_pos / 0x10);
+
+	uint64_t key_index = (key_pos > 0 ? key_pos - 1 : 0) / CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS;
+	ChiakiGKCryptGMacCacheEntry *entry = gkcrypt_gmac_cache_get(gkcrypt, cache, own, key_index);
+	if(!entry)
 		return CHIAKI_ERR_UNKNOWN;
-	}
+
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
 	// set "additional data" only whitout input nor output
 	// to get the same result as:
 	// EVP_EncryptUpdate(ctx, NULL, &len, buf, (int)buf_size)
-	if(mbedtls_gcm_crypt_and_tag(&actx, MBEDTLS_GCM_ENCRYPT,
+	if(mbedtls_gcm_crypt_and_tag(&entry->gcm_ctx, MBEDTLS_GCM_ENCRYPT,
 		   0, iv, CHIAKI_GKCRYPT_BLOCK_SIZE,
 		   buf, buf_size, NULL, NULL,
 		   CHIAKI_GKCRYPT_GMAC_SIZE, gmac_out) != 0)
-	{
-
-		mbedtls_gcm_free(&actx);
 		return CHIAKI_ERR_UNKNOWN;
-	}
-
-	mbedtls_gcm_free(&actx);
 
 	return CHIAKI_ERR_SUCCESS;
 #else
-	ChiakiErrorCode ret = CHIAKI_ERR_SUCCESS;
-
-	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-	if(!ctx)
-	{
-		ret = CHIAKI_ERR_MEMORY;
-		goto fail;
-	}
-
-	if(!EVP_CipherInit_ex(ctx, EVP_aes_128_gcm(), NULL, NULL, NULL, 1))
-	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
-	}
-
-	if(!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, CHIAKI_GKCRYPT_BLOCK_SIZE, NULL))
-	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
-	}
-
-	if(!EVP_CipherInit_ex(ctx, NULL, NULL, gmac_key, iv, 1))
-	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
-	}
+	// the key is kept in the context, only the iv is set again
+	if(!EVP_CipherInit_ex(entry->gcm_ctx, NULL, NULL, NULL, iv, 1))
+		return CHIAKI_ERR_UNKNOWN;
 
 	int len;
-	if(!EVP_EncryptUpdate(ctx, NULL, &len, buf, (int)buf_size))
-	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
-	}
+	if(!EVP_EncryptUpdate(entry->gcm_ctx, NULL, &len, buf, (int)buf_size))
+		return CHIAKI_ERR_UNKNOWN;
 
-	if(!EVP_EncryptFinal_ex(ctx, NULL, &len))
-	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
-	}
+	if(!EVP_EncryptFinal_ex(entry->gcm_ctx, NULL, &len))
+		return CHIAKI_ERR_UNKNOWN;
 
-	if(!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, CHIAKI_GKCRYPT_GMAC_SIZE, gmac_out))
-	{
-		ret = CHIAKI_ERR_UNKNOWN;
-		goto fail_cipher;
-	}
+	if(!EVP_CIPHER_CTX_ctrl(entry->gcm_ctx, EVP_CTRL_GCM_GET_TAG, CHIAKI_GKCRYPT_GMAC_SIZE, gmac_out))
+		return CHIAKI_ERR_UNKNOWN;
 
-fail_cipher:
-	EVP_CIPHER_CTX_free(ctx);
-fail:
-	return ret;
+	return CHIAKI_ERR_SUCCESS;
 #endif
 }
 
-static bool key_buf_mutex_pred(void *user)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, uint64_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out)
 {
-	ChiakiGKCrypt *gkcrypt = user;
-	if(gkcrypt->key_buf_thread_stop)
-		return true;
-
-	if(gkcrypt->key_buf_populated < gkcrypt->key_buf_size)
-		return true;
-
-	if(gkcrypt_key_buf_should_generate(gkcrypt))
-		return true;
+	return gkcrypt_gmac(gkcrypt, &gkcrypt->gmac_cache, true, key_pos, buf, buf_size, gmac_out);
+}
 
-	return false;
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac_cached(ChiakiGKCrypt *gkcrypt, ChiakiGKCryptGMacCache *cache, uint64_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out)
+{
+	return gkcrypt_gmac(gkcrypt, cache, cache == &gkcrypt->gmac_cache, key_pos, buf, buf_size, gmac_out);
 }
 
 static ChiakiErrorCode gkcrypt_generate_next_chunk(ChiakiGKCrypt *gkcrypt)
 {
-	assert(gkcrypt->key_buf_populated + KEY_BUF_CHUNK_SIZE <= gkcrypt->key_buf_size);
-	size_t buf_offset = (gkcrypt->key_buf_start_offset + gkcrypt->key_buf_populated) % gkcrypt->key_buf_size;
-	uint64_t key_pos = gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated;
-	uint8_t *buf_start = gkcrypt->key_buf + buf_offset;
+	size_t chunk = chiaki_atomic_load_acquire(&gkcrypt->key_buf_next_chunk);
+	size_t consumer = chiaki_atomic_load_acquire(&gkcrypt->key_buf_consumer_chunk);
+	if(consumer > chunk + KEY_BUF_CHUNKS_BEHIND(gkcrypt->key_buf_chunks))
+	{
+		// skip ahead if the consumer is already far beyond what we have
+		CHIAKI_LOGW(gkcrypt->log, "Already requested a higher key pos than in the buffer, skipping ahead from chunk %#llx to %#llx",
+				(unsigned long long)chunk, (unsigned long long)consumer);
+		chunk = consumer;
+	}
 
-	chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
+	size_t slot = chunk % gkcrypt->key_buf_chunks;
+	size_t *tag = &gkcrypt->key_buf_chunk_tags[slot];
 
-	ChiakiErrorCode err = chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos, buf_start, KEY_BUF_CHUNK_SIZE);
+	// invalidate the slot before overwriting it, so concurrent readers notice
+	chiaki_atomic_store_seq_cst(tag, 0);
+	chiaki_atomic_fence_seq_cst();
+
+	ChiakiErrorCode err = gkcrypt_gen_key_stream_ctx(gkcrypt, &gkcrypt->key_stream_ctx_thread,
+			(uint64_t)chunk * KEY_BUF_CHUNK_SIZE, gkcrypt->key_buf + slot * KEY_BUF_CHUNK_SIZE, KEY_BUF_CHUNK_SIZE);
 	if(err != CHIAKI_ERR_SUCCESS)
+	{
 		CHIAKI_LOGE(gkcrypt->log, "GKCrypt failed to generate key stream chunk");
+		return err;
+	}
 
-	chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
-
-	if(err == CHIAKI_ERR_SUCCESS)
-		gkcrypt->key_buf_populated += KEY_BUF_CHUNK_SIZE;
-
-	return err;
+	chiaki_atomic_store_release(tag, chunk + 1);
+	chiaki_atomic_store_release(&gkcrypt->key_buf_next_chunk, chunk + 1);
+	CHIAKI_TRACE(GKCRYPT, KEY_STREAM_CHUNK, gkcrypt->index);
+	return CHIAKI_ERR_SUCCESS;
 }
 
 static void *gkcrypt_thread_func(void *user)
@@ -500,48 +767,30 @@ static void *gkcrypt_thread_func(void *user)
 	ChiakiGKCrypt *gkcrypt = user;
 	CHIAKI_LOGV(gkcrypt->log, "GKCrypt %d thread starting", (int)gkcrypt->index);
 
-	ChiakiErrorCode err = chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
-	assert(err == CHIAKI_ERR_SUCCESS);
 	while(1)
 	{
-		err = chiaki_cond_wait_pred(&gkcrypt->key_buf_cond, &gkcrypt->key_buf_mutex, key_buf_mutex_pred, gkcrypt);
-
-		if(gkcrypt->key_buf_thread_stop || err != CHIAKI_ERR_SUCCESS)
-			break;
-
-		/*
-		CHIAKI_LOGV(gkcrypt->log, "GKCrypt %d key buf size %#llx, start offset: %#llx, populated: %#llx, min key pos: %#llx, last key pos: %#llx, generating next chunk",
-					(int)gkcrypt->index,
-					(unsigned long long)gkcrypt->key_buf_size,
-					(unsigned long long)gkcrypt->key_buf_start_offset,
-					(unsigned long long)gkcrypt->key_buf_populated,
-					(unsigned long long)gkcrypt->key_buf_key_pos_min,
-					(unsigned long long)gkcrypt->last_key_pos);
-		*/
-
-		if(gkcrypt->last_key_pos > gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated)
-		{
-			// skip ahead if the last key pos is already beyond our buffer
-			uint64_t key_pos = (gkcrypt->last_key_pos / KEY_BUF_CHUNK_SIZE) * KEY_BUF_CHUNK_SIZE;
-			CHIAKI_LOGW(gkcrypt->log, "Already requested a higher key pos than in the buffer, skipping ahead from min %#llx to %#llx",
-						(unsigned long long)gkcrypt->key_buf_key_pos_min,
-						(unsigned long long)key_pos);
-			gkcrypt->key_buf_key_pos_min = key_pos;
-			gkcrypt->key_buf_start_offset = 0;
-			gkcrypt->key_buf_populated = 0;
-		}
-		else if(gkcrypt->key_buf_populated == gkcrypt->key_buf_size)
+		ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
+		while(!chiaki_atomic_load_seq_cst(&gkcrypt->key_buf_thread_stop) && !gkcrypt_key_buf_should_generate(gkcrypt))
 		{
-			gkcrypt->key_buf_start_offset = (gkcrypt->key_buf_start_offset + KEY_BUF_CHUNK_SIZE) % gkcrypt->key_buf_size;
-			gkcrypt->key_buf_key_pos_min += KEY_BUF_CHUNK_SIZE;
-			gkcrypt->key_buf_populated -= KEY_BUF_CHUNK_SIZE;
+			chiaki_atomic_store_seq_cst(&gkcrypt->key_buf_thread_waiting, 1);
+			chiaki_atomic_fence_seq_cst();
+			if(gkcrypt_key_buf_should_generate(gkcrypt))
+			{
+				chiaki_atomic_store_seq_cst(&gkcrypt->key_buf_thread_waiting, 0);
+				break;
+			}
+			err = chiaki_event_flags_wait(&gkcrypt->key_buf_event, KEY_BUF_EVENT_WAKEUP, NULL);
+			chiaki_atomic_store_seq_cst(&gkcrypt->key_buf_thread_waiting, 0);
+			if(err != CHIAKI_ERR_SUCCESS)
+				break;
 		}
-		err = gkcrypt_generate_next_chunk(gkcrypt);
-		if(err != CHIAKI_ERR_SUCCESS)
+		if(chiaki_atomic_load_seq_cst(&gkcrypt->key_buf_thread_stop) || err != CHIAKI_ERR_SUCCESS)
+			break;
+
+		if(gkcrypt_generate_next_chunk(gkcrypt) != CHIAKI_ERR_SUCCESS)
 			break;
 	}
 
-	chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
 	return NULL;
 }
 
@@ -0,0 +1,204 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/impair.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+CHIAKI_EXPORT void chiaki_impair_config_default(ChiakiImpairConfig *config)
+{
+	memset(config, 0, sizeof(*config));
+	config->seed = 1;
+	config->bad_to_good = 1.0;
+	config->reorder_ms = 10;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_impair_config_parse(ChiakiImpairConfig *config, const char *str)
+{
+	while(*str)
+	{
+		const char *end = strchr(str, ',');
+		size_t len = end ? (size_t)(end - str) : strlen(str);
+		char pair[0x40];
+		if(len >= sizeof(pair))
+			return CHIAKI_ERR_INVALID_DATA;
+		memcpy(pair, str, len);
+		pair[len] = '\0';
+		str += end ? len + 1 : len;
+
+		char *value = strchr(pair, '=');
+		if(!value)
+			return CHIAKI_ERR_INVALID_DATA;
+		*value++ = '\0';
+
+		unsigned long long seed;
+		unsigned int send;
+		int expected = 1;
+		int parsed;
+		if(!strcmp(pair, "seed"))
+		{
+			parsed = sscanf(value, "%llu", &seed);
+			config->seed = seed;
+		}
+		else if(!strcmp(pair, "loss"))
+			parsed = sscanf(value, "%lf", &config->loss);
+		else if(!strcmp(pair, "burst"))
+		{
+			expected = 3;
+			parsed = sscanf(value, "%lf:%lf:%lf", &config->good_to_bad, &config->bad_to_good, &config->burst_loss);
+		}
+		else if(!strcmp(pair, "dup"))
+			parsed = sscanf(value, "%lf", &config->duplicate);
+		else if(!strcmp(pair, "reorder"))
+		{
+			expected = 2;
+			parsed = sscanf(value, "%lf:%" SCNu32, &config->reorder, &config->reorder_ms);
+		}
+		else if(!strcmp(pair, "delay"))
+			parsed = sscanf(value, "%" SCNu32, &config->delay_ms);
+		else if(!strcmp(pair, "jitter"))
+			parsed = sscanf(value, "%" SCNu32, &config->jitter_ms);
+		else if(!strcmp(pair, "send"))
+		{
+			parsed = sscanf(value, "%u", &send);
+			config->send = send != 0;
+		}
+		else
+			return CHIAKI_ERR_INVALID_DATA;
+		if(parsed != expected)
+			return CHIAKI_ERR_INVALID_DATA;
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_impair_init(ChiakiImpair *impair, const ChiakiImpairConfig *config, bool queue)
+{
+	memset(impair, 0, sizeof(*impair));
+	impair->config = *config;
+	impair->rng = config->seed;
+	if(queue)
+	{
+		impair->queue = malloc(CHIAKI_IMPAIR_QUEUE_SIZE * sizeof(ChiakiImpairEntry));
+		if(!impair->queue)
+			return CHIAKI_ERR_MEMORY;
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_impair_fini(ChiakiImpair *impair)
+{
+	free(impair->queue);
+}
+
+/**
+ * splitmix64, so decisions only depend on the seed and are the same on every platform
+ */
+static uint64_t impair_rand(ChiakiImpair *impair)
+{
+	uint64_t z = (impair->rng += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/**
+ * @return uniformly distributed in [0, 1)
+ */
+static double impair_rand_unit(ChiakiImpair *impair)
+{
+	return (double)(impair_rand(impair) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static bool impair_chance(ChiakiImpair *impair, double p)
+{
+	return p > 0.0 && impair_rand_unit(impair) < p;
+}
+
+CHIAKI_EXPORT unsigned int chiaki_impair_roll(ChiakiImpair *impair)
+{
+	impair->datagrams++;
+	if(impair->bad ? impair_chance(impair, impair->config.bad_to_good) : impair_chance(impair, impair->config.good_to_bad))
+		impair->bad = !impair->bad;
+	if(impair_chance(impair, impair->bad ? impair->config.burst_loss : impair->config.loss))
+	{
+		impair->lost++;
+		return 0;
+	}
+	if(impair_chance(impair, impair->config.duplicate))
+	{
+		impair->duplicated++;
+		return 2;
+	}
+	return 1;
+}
+
+static bool impair_entry_before(ChiakiImpairEntry *a, ChiakiImpairEntry *b)
+{
+	return a->due_us < b->due_us || (a->due_us == b->due_us && a->order < b->order);
+}
+
+CHIAKI_EXPORT bool chiaki_impair_push(ChiakiImpair *impair, uint64_t now_us, uint8_t *buf, size_t buf_size)
+{
+	if(!impair->queue || impair->queue_count == CHIAKI_IMPAIR_QUEUE_SIZE)
+	{
+		impair->overflowed++;
+		return false;
+	}
+
+	uint64_t due_us = now_us + (uint64_t)impair->config.delay_ms * 1000;
+	if(impair->config.jitter_ms)
+		due_us += impair_rand(impair) % ((uint64_t)impair->config.jitter_ms * 1000 + 1);
+	if(impair_chance(impair, impair->config.reorder))
+	{
+		impair->reordered++;
+		due_us += (uint64_t)impair->config.reorder_ms * 1000;
+	}
+	else
+	{
+		// jitter alone must not let a datagram overtake the one before it
+		if(due_us < impair->due_last_us)
+			due_us = impair->due_last_us;
+		impair->due_last_us = due_us;
+	}
+
+	size_t i = impair->queue_count++;
+	ChiakiImpairEntry entry = { due_us, impair->order_next++, buf, buf_size };
+	while(i > 0)
+	{
+		size_t parent = (i - 1) / 2;
+		if(!impair_entry_before(&entry, &impair->queue[parent]))
+			break;
+		impair->queue[i] = impair->queue[parent];
+		i = parent;
+	}
+	impair->queue[i] = entry;
+	return true;
+}
+
+CHIAKI_EXPORT bool chiaki_impair_pop(ChiakiImpair *impair, uint64_t now_us, uint8_t **buf, size_t *buf_size)
+{
+	if(!impair->queue_count || impair->queue[0].due_us > now_us)
+		return false;
+	*buf = impair->queue[0].buf;
+	*buf_size = impair->queue[0].buf_size;
+
+	ChiakiImpairEntry last = impair->queue[--impair->queue_count];
+	size_t i = 0;
+	while(true)
+	{
+		size_t child = 2 * i + 1;
+		if(child >= impair->queue_count)
+			break;
+		if(child + 1 < impair->queue_count && impair_entry_before(&impair->queue[child + 1], &impair->queue[child]))
+			child++;
+		if(!impair_entry_before(&impair->queue[child], &last))
+			break;
+		impair->queue[i] = impair->queue[child];
+		i = child;
+	}
+	if(impair->queue_count)
+		impair->queue[i] = last;
+	return true;
+}
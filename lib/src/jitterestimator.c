@@ -0,0 +1,121 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/jitterestimator.h>
+
+#include <string.h>
+#include <stddef.h>
+
+// exponential moving averages of the delay for the trend
+#define DELAY_FAST_SHIFT 2
+#define DELAY_SLOW_SHIFT 5
+
+// start over after a gap this long, the delay before and after is unrelated
+#define ARRIVAL_GAP_MAX_US 1000000
+
+CHIAKI_EXPORT const char *chiaki_jitter_stream_string(ChiakiJitterStream stream)
+{
+	switch(stream)
+	{
+		case CHIAKI_JITTER_STREAM_VIDEO:
+			return "video";
+		case CHIAKI_JITTER_STREAM_AUDIO:
+			return "audio";
+		default:
+			return "unknown";
+	}
+}
+
+static void stream_restart(ChiakiJitterEstimatorStream *stream)
+{
+	stream->valid = false;
+	stream->send_prev_us = 0;
+	stream->transit_prev_us = 0;
+	stream->transit_min_started_us = 0;
+}
+
+CHIAKI_EXPORT void chiaki_jitter_estimator_reset(ChiakiJitterEstimator *estimator)
+{
+	memset(estimator, 0, sizeof(*estimator));
+}
+
+CHIAKI_EXPORT void chiaki_jitter_estimator_set_interval(ChiakiJitterEstimator *estimator, ChiakiJitterStream stream, uint64_t interval_us)
+{
+	ChiakiJitterEstimatorStream *s = &estimator->streams[stream];
+	s->interval_us = interval_us;
+	stream_restart(s);
+}
+
+CHIAKI_EXPORT void chiaki_jitter_estimator_push(ChiakiJitterEstimator *estimator, ChiakiJitterStream stream, ChiakiSeqNum16 frame_index, uint64_t arrival_us)
+{
+	ChiakiJitterEstimatorStream *s = &estimator->streams[stream];
+	if(!s->interval_us)
+		return;
+
+	uint64_t send_us = 0;
+	if(s->valid)
+	{
+		int frames = (int16_t)(frame_index - s->frame_index_prev);
+		if(frames <= 0)
+			return; // later packet of the same frame, or reordered
+		send_us = s->send_prev_us + (uint64_t)frames * s->interval_us;
+		if((uint64_t)frames * s->interval_us > ARRIVAL_GAP_MAX_US)
+			stream_restart(s);
+	}
+	int64_t transit_us = (int64_t)arrival_us - (int64_t)send_us;
+
+	if(!s->valid)
+	{
+		s->valid = true;
+		s->frame_index_prev = frame_index;
+		s->send_prev_us = 0;
+		s->transit_prev_us = (int64_t)arrival_us;
+		s->transit_min_cur_us = s->transit_min_prev_us = (int64_t)arrival_us;
+		s->transit_min_started_us = arrival_us;
+		s->delay_fast_x16 = s->delay_slow_x16 = 0;
+		return;
+	}
+	s->frame_index_prev = frame_index;
+	s->send_prev_us = send_us;
+
+	// RFC 3550 6.4.1: J += (|D| - J) / 16
+	int64_t d = transit_us - s->transit_prev_us;
+	s->transit_prev_us = transit_us;
+	uint64_t d_abs = (uint64_t)(d < 0 ? -d : d);
+	s->jitter_x16 = s->jitter_x16 + d_abs - ((s->jitter_x16 + 8) >> 4);
+
+	// lowest transit over two halves of the window, so old ones fall out eventually
+	if(arrival_us - s->transit_min_started_us >= CHIAKI_JITTER_DELAY_MIN_WINDOW_US / 2)
+	{
+		s->transit_min_prev_us = s->transit_min_cur_us;
+		s->transit_min_cur_us = transit_us;
+		s->transit_min_started_us = arrival_us;
+	}
+	else if(transit_us < s->transit_min_cur_us)
+		s->transit_min_cur_us = transit_us;
+	int64_t transit_min_us = s->transit_min_cur_us < s->transit_min_prev_us ? s->transit_min_cur_us : s->transit_min_prev_us;
+	if(transit_us < transit_min_us)
+		transit_min_us = transit_us;
+	int64_t delay_us = transit_us - transit_min_us;
+
+	s->delay_fast_x16 += delay_us - (s->delay_fast_x16 >> DELAY_FAST_SHIFT);
+	s->delay_slow_x16 += delay_us - (s->delay_slow_x16 >> DELAY_SLOW_SHIFT);
+	int64_t trend_us = (s->delay_fast_x16 >> DELAY_FAST_SHIFT) - (s->delay_slow_x16 >> DELAY_SLOW_SHIFT);
+
+	chiaki_atomic_store_release(&s->jitter_us, (size_t)(s->jitter_x16 >> 4));
+	chiaki_atomic_store_release(&s->delay_us, (size_t)delay_us);
+	chiaki_atomic_store_release(&s->delay_trend_us, (size_t)trend_us);
+	chiaki_atomic_store_release(&s->samples, chiaki_atomic_load_acquire(&s->samples) + 1);
+}
+
+CHIAKI_EXPORT void chiaki_jitter_estimator_get(ChiakiJitterEstimator *estimator, ChiakiJitterStats *stats)
+{
+	for(size_t i=0; i<CHIAKI_JITTER_STREAM_COUNT; i++)
+	{
+		ChiakiJitterEstimatorStream *s = &estimator->streams[i];
+		ChiakiJitterStreamStats *r = &stats->streams[i];
+		r->jitter_us = chiaki_atomic_load_acquire(&s->jitter_us);
+		r->delay_us = chiaki_atomic_load_acquire(&s->delay_us);
+		r->delay_trend_us = (int64_t)(ptrdiff_t)chiaki_atomic_load_acquire(&s->delay_trend_us);
+		r->samples = chiaki_atomic_load_acquire(&s->samples);
+	}
+}
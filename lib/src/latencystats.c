@@ -0,0 +1,212 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/latencystats.h>
+
+#include <string.h>
+
+CHIAKI_EXPORT const char *chiaki_latency_stage_string(ChiakiLatencyStage stage)
+{
+	switch(stage)
+	{
+		case CHIAKI_LATENCY_STAGE_RECEIVE:
+			return "receive";
+		case CHIAKI_LATENCY_STAGE_ASSEMBLE:
+			return "assemble";
+		case CHIAKI_LATENCY_STAGE_QUEUE:
+			return "queue";
+		case CHIAKI_LATENCY_STAGE_DECODE:
+			return "decode";
+		case CHIAKI_LATENCY_STAGE_PRESENT:
+			return "present";
+		case CHIAKI_LATENCY_STAGE_TOTAL:
+			return "total";
+		case CHIAKI_LATENCY_STAGE_INPUT:
+			return "input";
+		default:
+			return "unknown";
+	}
+}
+
+static void histograms_reset(ChiakiLatencyStats *stats)
+{
+	memset(stats->stages, 0, sizeof(stats->stages));
+	chiaki_latency_frame_reset(&stats->sink_frame);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_latency_stats_init(ChiakiLatencyStats *stats)
+{
+	histograms_reset(stats);
+	ChiakiErrorCode err = chiaki_mutex_init(&stats->mutex, false);
+	if(err == CHIAKI_ERR_SUCCESS)
+		chiaki_mutex_set_name(&stats->mutex, "latency stats");
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_latency_stats_fini(ChiakiLatencyStats *stats)
+{
+	chiaki_mutex_fini(&stats->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_latency_stats_reset(ChiakiLatencyStats *stats)
+{
+	chiaki_mutex_lock(&stats->mutex);
+	histograms_reset(stats);
+	chiaki_mutex_unlock(&stats->mutex);
+}
+
+static void histogram_add(ChiakiLatencyHistogram *hist, uint64_t us)
+{
+	uint64_t bucket = us / CHIAKI_LATENCY_HISTOGRAM_BUCKET_US;
+	if(bucket >= CHIAKI_LATENCY_HISTOGRAM_BUCKETS)
+		bucket = CHIAKI_LATENCY_HISTOGRAM_BUCKETS - 1;
+	hist->buckets[bucket]++;
+	if(!hist->count || us < hist->min_us)
+		hist->min_us = us;
+	if(us > hist->max_us)
+		hist->max_us = us;
+	hist->count++;
+	hist->sum_us += us;
+}
+
+/**
+ * Add the interval between two stamps of frame, if both have been taken. Must be called with the mutex locked.
+ */
+static void stage_add(ChiakiLatencyStats *stats, ChiakiLatencyStage stage, ChiakiLatencyFrame *frame,
+		ChiakiLatencyStamp from, ChiakiLatencyStamp to)
+{
+	uint64_t t_from = frame->stamps[from];
+	uint64_t t_to = frame->stamps[to];
+	if(!t_from || !t_to || t_to < t_from)
+		return;
+	histogram_add(&stats->stages[stage], t_to - t_from);
+}
+
+CHIAKI_EXPORT void chiaki_latency_stats_sink_frame(ChiakiLatencyStats *stats, ChiakiLatencyFrame *frame)
+{
+	chiaki_latency_frame_stamp(frame, CHIAKI_LATENCY_STAMP_SINK);
+	chiaki_mutex_lock(&stats->mutex);
+	stats->sink_frame = *frame;
+	stage_add(stats, CHIAKI_LATENCY_STAGE_RECEIVE, frame, CHIAKI_LATENCY_STAMP_FIRST_UNIT, CHIAKI_LATENCY_STAMP_LAST_UNIT);
+	stage_add(stats, CHIAKI_LATENCY_STAGE_ASSEMBLE, frame, CHIAKI_LATENCY_STAMP_LAST_UNIT, CHIAKI_LATENCY_STAMP_FEC_DONE);
+	stage_add(stats, CHIAKI_LATENCY_STAGE_QUEUE, frame, CHIAKI_LATENCY_STAMP_FEC_DONE, CHIAKI_LATENCY_STAMP_SINK);
+	chiaki_mutex_unlock(&stats->mutex);
+}
+
+CHIAKI_EXPORT uint64_t chiaki_latency_stats_stamp(ChiakiLatencyStats *stats, ChiakiLatencyStamp stamp)
+{
+	if(stamp != CHIAKI_LATENCY_STAMP_DECODED && stamp != CHIAKI_LATENCY_STAMP_DISPLAYED)
+		return 0;
+	uint64_t total_us = 0;
+	uint64_t now = chiaki_time_now_monotonic_us();
+	chiaki_mutex_lock(&stats->mutex);
+	ChiakiLatencyFrame *frame = &stats->sink_frame;
+	if(!frame->stamps[CHIAKI_LATENCY_STAMP_SINK] || frame->stamps[stamp])
+		goto beach;
+	frame->stamps[stamp] = now;
+	if(stamp == CHIAKI_LATENCY_STAMP_DECODED)
+		stage_add(stats, CHIAKI_LATENCY_STAGE_DECODE, frame, CHIAKI_LATENCY_STAMP_SINK, CHIAKI_LATENCY_STAMP_DECODED);
+	else
+	{
+		stage_add(stats, CHIAKI_LATENCY_STAGE_PRESENT, frame, CHIAKI_LATENCY_STAMP_DECODED, CHIAKI_LATENCY_STAMP_DISPLAYED);
+		stage_add(stats, CHIAKI_LATENCY_STAGE_TOTAL, frame, CHIAKI_LATENCY_STAMP_FIRST_UNIT, CHIAKI_LATENCY_STAMP_DISPLAYED);
+		uint64_t first_unit = frame->stamps[CHIAKI_LATENCY_STAMP_FIRST_UNIT];
+		if(first_unit && now >= first_unit)
+			total_us = now - first_unit;
+	}
+beach:
+	chiaki_mutex_unlock(&stats->mutex);
+	return total_us;
+}
+
+CHIAKI_EXPORT void chiaki_latency_stats_add(ChiakiLatencyStats *stats, ChiakiLatencyStage stage, uint64_t us)
+{
+	chiaki_mutex_lock(&stats->mutex);
+	histogram_add(&stats->stages[stage], us);
+	chiaki_mutex_unlock(&stats->mutex);
+}
+
+/**
+ * @return upper bound of the bucket that contains the given fraction of all samples
+ */
+static uint64_t histogram_percentile(ChiakiLatencyHistogram *hist, unsigned int percent)
+{
+	uint64_t target = (hist->count * percent + 99) / 100;
+	uint64_t seen = 0;
+	for(size_t i=0; i<CHIAKI_LATENCY_HISTOGRAM_BUCKETS; i++)
+	{
+		seen += hist->buckets[i];
+		if(seen >= target)
+		{
+			uint64_t us = (i + 1) * CHIAKI_LATENCY_HISTOGRAM_BUCKET_US;
+			return us < hist->max_us ? us : hist->max_us;
+		}
+	}
+	return hist->max_us;
+}
+
+CHIAKI_EXPORT void chiaki_latency_stats_get(ChiakiLatencyStats *stats, ChiakiLatencyReport *report)
+{
+	chiaki_mutex_lock(&stats->mutex);
+	for(size_t i=0; i<CHIAKI_LATENCY_STAGE_COUNT; i++)
+	{
+		ChiakiLatencyHistogram *hist = &stats->stages[i];
+		ChiakiLatencyStageStats *stage = &report->stages[i];
+		stage->count = hist->count;
+		if(!hist->count)
+		{
+			stage->min_us = stage->avg_us = stage->p95_us = stage->p99_us = stage->max_us = 0;
+			continue;
+		}
+		stage->min_us = hist->min_us;
+		stage->avg_us = hist->sum_us / hist->count;
+		stage->p95_us = histogram_percentile(hist, 95);
+		stage->p99_us = histogram_percentile(hist, 99);
+		stage->max_us = hist->max_us;
+	}
+	chiaki_mutex_unlock(&stats->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_latency_stats_get_totals(ChiakiLatencyStats *stats, ChiakiLatencyTotals *totals)
+{
+	chiaki_mutex_lock(&stats->mutex);
+	for(size_t i=0; i<CHIAKI_LATENCY_STAGE_COUNT; i++)
+	{
+		totals->count[i] = stats->stages[i].count;
+		totals->sum_us[i] = stats->stages[i].sum_us;
+	}
+	chiaki_mutex_unlock(&stats->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_latency_stats_get_coarse_histograms(ChiakiLatencyStats *stats, ChiakiLatencyCoarseHistograms *histograms)
+{
+	memset(histograms, 0, sizeof(*histograms));
+	chiaki_mutex_lock(&stats->mutex);
+	for(size_t i=0; i<CHIAKI_LATENCY_STAGE_COUNT; i++)
+	{
+		// bucket k >= 1 covers the fine buckets [2^(k-1), 2^k)
+		size_t coarse = 0;
+		for(size_t j=0; j<CHIAKI_LATENCY_HISTOGRAM_BUCKETS; j++)
+		{
+			if(j && !(j & (j - 1)) && coarse < CHIAKI_LATENCY_COARSE_BUCKETS - 1)
+				coarse++;
+			histograms->buckets[i][coarse] += stats->stages[i].buckets[j];
+		}
+	}
+	chiaki_mutex_unlock(&stats->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_latency_stats_log(ChiakiLatencyStats *stats, ChiakiLog *log)
+{
+	ChiakiLatencyReport report;
+	chiaki_latency_stats_get(stats, &report);
+	for(size_t i=0; i<CHIAKI_LATENCY_STAGE_COUNT; i++)
+	{
+		ChiakiLatencyStageStats *stage = &report.stages[i];
+		if(!stage->count)
+			continue;
+		CHIAKI_LOGI(log, "Latency %-8s min %6.2f avg %6.2f p95 %6.2f p99 %6.2f max %6.2f ms (%llu frames)",
+				chiaki_latency_stage_string((ChiakiLatencyStage)i),
+				stage->min_us / 1000.0, stage->avg_us / 1000.0, stage->p95_us / 1000.0,
+				stage->p99_us / 1000.0, stage->max_us / 1000.0, (unsigned long long)stage->count);
+	}
+}
@@ -0,0 +1,200 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/loadmonitor.h>
+
+#include <string.h>
+
+#define LOAD_MONITOR_PERIOD_US 1000000
+#define LOAD_MONITOR_FRAMES_MIN 10 // periods with fewer frames passed to the sink say nothing about the load, e.g. while paused
+
+// an overload must last this many periods in a row for a step down, headroom this many for a step back up
+#define OVERLOAD_PERIODS 3
+#define HEADROOM_PERIODS 10
+
+// overloaded above these, relative to the frame interval or stream fps
+#define OVERLOAD_DECODE 0.9
+#define OVERLOAD_QUEUE 1.0
+#define OVERLOAD_PRESENT_FPS 0.85
+#define OVERLOAD_DROP_RATE 0.1
+
+// headroom below these
+#define HEADROOM_DECODE 0.6
+#define HEADROOM_QUEUE 0.5
+#define HEADROOM_PRESENT_FPS 0.95
+#define HEADROOM_DROP_RATE 0.02
+#define HEADROOM_PACKET_LOSS 0.01 // a lossy network is no time to ask for more
+
+CHIAKI_EXPORT const char *chiaki_client_load_string(ChiakiClientLoad load)
+{
+	switch(load)
+	{
+		case CHIAKI_CLIENT_LOAD_NORMAL:
+			return "normal";
+		case CHIAKI_CLIENT_LOAD_OVERLOADED:
+			return "overloaded";
+		case CHIAKI_CLIENT_LOAD_HEADROOM:
+			return "headroom";
+		default:
+			return "unknown";
+	}
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_load_monitor_init(ChiakiLoadMonitor *monitor, ChiakiLog *log, ChiakiLatencyStats *latency_stats)
+{
+	monitor->log = log;
+	monitor->latency_stats = latency_stats;
+	ChiakiErrorCode err = chiaki_mutex_init(&monitor->stats_mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	chiaki_load_monitor_reset(monitor, 0);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_load_monitor_fini(ChiakiLoadMonitor *monitor)
+{
+	chiaki_mutex_fini(&monitor->stats_mutex);
+}
+
+CHIAKI_EXPORT void chiaki_load_monitor_reset(ChiakiLoadMonitor *monitor, uint64_t frame_interval_us)
+{
+	monitor->frame_interval_us = frame_interval_us;
+	monitor->period_start_us = 0;
+	memset(&monitor->totals_prev, 0, sizeof(monitor->totals_prev));
+	monitor->loss_sum = 0.0;
+	monitor->loss_samples = 0;
+	monitor->streak_load = CHIAKI_CLIENT_LOAD_NORMAL;
+	monitor->streak_periods = 0;
+	chiaki_mutex_lock(&monitor->stats_mutex);
+	memset(&monitor->stats, 0, sizeof(monitor->stats));
+	monitor->stats.load = CHIAKI_CLIENT_LOAD_NORMAL;
+	chiaki_mutex_unlock(&monitor->stats_mutex);
+}
+
+static double stage_avg_us(ChiakiLatencyTotals *cur, ChiakiLatencyTotals *prev, ChiakiLatencyStage stage, uint64_t *count)
+{
+	*count = cur->count[stage] - prev->count[stage];
+	return *count ? (double)(cur->sum_us[stage] - prev->sum_us[stage]) / (double)*count : 0.0;
+}
+
+/**
+ * Classify the period since the last one and fill the measured parts of stats.
+ *
+ * @return false if there were too few frames to tell
+ */
+static bool load_classify(ChiakiLoadMonitor *monitor, uint64_t elapsed_us, double packet_loss, ChiakiLoadMonitorStats *stats, ChiakiClientLoad *load)
+{
+	ChiakiLatencyTotals totals;
+	chiaki_latency_stats_get_totals(monitor->latency_stats, &totals);
+	ChiakiLatencyTotals *prev = &monitor->totals_prev;
+	if(totals.count[CHIAKI_LATENCY_STAGE_QUEUE] < prev->count[CHIAKI_LATENCY_STAGE_QUEUE])
+		memset(prev, 0, sizeof(*prev)); // the stats were reset
+
+	uint64_t sunk, decoded, presented;
+	double queue_us = stage_avg_us(&totals, prev, CHIAKI_LATENCY_STAGE_QUEUE, &sunk);
+	double decode_us = stage_avg_us(&totals, prev, CHIAKI_LATENCY_STAGE_DECODE, &decoded);
+	stage_avg_us(&totals, prev, CHIAKI_LATENCY_STAGE_PRESENT, &presented);
+	*prev = totals;
+
+	stats->decode_ms = decode_us / 1000.0;
+	stats->queue_ms = queue_us / 1000.0;
+	stats->present_fps = (double)presented * 1000000.0 / (double)elapsed_us;
+	stats->drop_rate = presented && sunk > presented ? (double)(sunk - presented) / (double)sunk : 0.0;
+	stats->packet_loss = packet_loss;
+	if(sunk < LOAD_MONITOR_FRAMES_MIN)
+		return false;
+
+	double interval_us = (double)monitor->frame_interval_us;
+	double stream_fps = 1000000.0 / interval_us;
+	bool overloaded = queue_us > OVERLOAD_QUEUE * interval_us;
+	bool headroom = queue_us < HEADROOM_QUEUE * interval_us && packet_loss < HEADROOM_PACKET_LOSS;
+	if(decoded)
+	{
+		overloaded = overloaded || decode_us > OVERLOAD_DECODE * interval_us;
+		headroom = headroom && decode_us < HEADROOM_DECODE * interval_us;
+	}
+	if(presented)
+	{
+		overloaded = overloaded || stats->present_fps < OVERLOAD_PRESENT_FPS * stream_fps || stats->drop_rate > OVERLOAD_DROP_RATE;
+		headroom = headroom && stats->present_fps >= HEADROOM_PRESENT_FPS * stream_fps && stats->drop_rate < HEADROOM_DROP_RATE;
+	}
+	*load = overloaded ? CHIAKI_CLIENT_LOAD_OVERLOADED : (headroom ? CHIAKI_CLIENT_LOAD_HEADROOM : CHIAKI_CLIENT_LOAD_NORMAL);
+	return true;
+}
+
+CHIAKI_EXPORT double chiaki_load_monitor_update(ChiakiLoadMonitor *monitor, uint64_t now_us, double packet_loss)
+{
+	if(!monitor->frame_interval_us)
+		return 0.0;
+
+	monitor->loss_sum += packet_loss;
+	monitor->loss_samples++;
+	if(!monitor->period_start_us)
+	{
+		// only start counting from here
+		monitor->period_start_us = now_us;
+		chiaki_latency_stats_get_totals(monitor->latency_stats, &monitor->totals_prev);
+		monitor->loss_sum = 0.0;
+		monitor->loss_samples = 0;
+		return 0.0;
+	}
+
+	chiaki_mutex_lock(&monitor->stats_mutex);
+	unsigned int steps = monitor->stats.steps;
+	chiaki_mutex_unlock(&monitor->stats_mutex);
+
+	uint64_t elapsed_us = now_us - monitor->period_start_us;
+	if(elapsed_us < LOAD_MONITOR_PERIOD_US)
+		return steps * CHIAKI_LOAD_MONITOR_LOSS_PER_STEP;
+
+	ChiakiLoadMonitorStats stats;
+	ChiakiClientLoad load = CHIAKI_CLIENT_LOAD_NORMAL;
+	bool classified = load_classify(monitor, elapsed_us, monitor->loss_sum / monitor->loss_samples, &stats, &load);
+	monitor->period_start_us = now_us;
+	monitor->loss_sum = 0.0;
+	monitor->loss_samples = 0;
+
+	if(classified)
+	{
+		if(load != monitor->streak_load)
+		{
+			monitor->streak_load = load;
+			monitor->streak_periods = 0;
+		}
+		monitor->streak_periods++;
+
+		if(load == CHIAKI_CLIENT_LOAD_OVERLOADED && monitor->streak_periods >= OVERLOAD_PERIODS)
+		{
+			monitor->streak_periods = 0;
+			if(steps < CHIAKI_LOAD_MONITOR_STEPS_MAX)
+			{
+				steps++;
+				CHIAKI_LOGI(monitor->log, "Load Monitor: client can not keep up (decode %.1f ms, queue %.1f ms, %.1f fps, %.0f%% dropped), lowering bitrate to step %u",
+						stats.decode_ms, stats.queue_ms, stats.present_fps, stats.drop_rate * 100.0, steps);
+			}
+		}
+		else if(load == CHIAKI_CLIENT_LOAD_HEADROOM && monitor->streak_periods >= HEADROOM_PERIODS)
+		{
+			monitor->streak_periods = 0;
+			if(steps)
+			{
+				steps--;
+				CHIAKI_LOGI(monitor->log, "Load Monitor: client has headroom again, raising bitrate to step %u", steps);
+			}
+		}
+	}
+
+	stats.load = classified ? load : CHIAKI_CLIENT_LOAD_NORMAL;
+	stats.steps = steps;
+	chiaki_mutex_lock(&monitor->stats_mutex);
+	monitor->stats = stats;
+	chiaki_mutex_unlock(&monitor->stats_mutex);
+
+	return steps * CHIAKI_LOAD_MONITOR_LOSS_PER_STEP;
+}
+
+CHIAKI_EXPORT void chiaki_load_monitor_get_stats(ChiakiLoadMonitor *monitor, ChiakiLoadMonitorStats *stats)
+{
+	chiaki_mutex_lock(&monitor->stats_mutex);
+	*stats = monitor->stats;
+	chiaki_mutex_unlock(&monitor->stats_mutex);
+}
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
 #include <chiaki/log.h>
+#include <chiaki/logring.h>
 
 #include <stdio.h>
 #include <stdarg.h>
@@ -10,6 +11,8 @@ CHIAKI_EXPORT char chiaki_log_level_char(ChiakiLogLevel level)
 {
 	switch(level)
 	{
+		case CHIAKI_LOG_TRACE:
+			return 'T';
 		case CHIAKI_LOG_VERBOSE:
 			return 'V';
 		case CHIAKI_LOG_DEBUG:
@@ -30,6 +33,7 @@ CHIAKI_EXPORT void chiaki_log_init(ChiakiLog *log, uint32_t level_mask, ChiakiLo
 	log->level_mask = level_mask;
 	log->cb = cb;
 	log->user = user;
+	log->ring = NULL;
 }
 
 CHIAKI_EXPORT void chiaki_log_cb_print(ChiakiLogLevel level, const char *msg, void *user)
@@ -66,7 +70,19 @@ CHIAKI_EXPORT void chiaki_log(ChiakiLog *log, ChiakiLogLevel level, const char *
 	if(log && !(log->level_mask & level))
 		return;
 
+	ChiakiLogCb cb = log && log->cb ? log->cb : chiaki_log_cb_print;
+	void *user = log ? log->user : NULL;
+
 	va_list args;
+	if(log && log->ring)
+	{
+		va_start(args, fmt);
+		bool pushed = chiaki_log_ring_vpush(log->ring, level, cb, user, fmt, args);
+		va_end(args);
+		if(pushed)
+			return;
+	}
+
 	char buf[0x100];
 	char *msg = buf;
 
@@ -94,8 +110,6 @@ CHIAKI_EXPORT void chiaki_log(ChiakiLog *log, ChiakiLogLevel level, const char *
 		}
 	}
 
-	ChiakiLogCb cb = log && log->cb ? log->cb : chiaki_log_cb_print;
-	void *user = log ? log->user : NULL;
 	cb(level, msg, user);
 
 	if(msg != buf)
@@ -0,0 +1,494 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/logring.h>
+#include <chiaki/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RING_SIZE (((size_t)1) << ring->size_exp)
+#define RING_MASK (RING_SIZE - 1)
+
+// conversion specifications longer than this are formatted synchronously
+#define SPEC_SIZE_MAX 24
+
+typedef enum log_arg_type_t
+{
+	LOG_ARG_NONE, // %%
+	LOG_ARG_INT,
+	LOG_ARG_UINT,
+	LOG_ARG_LONG,
+	LOG_ARG_ULONG,
+	LOG_ARG_LLONG,
+	LOG_ARG_ULLONG,
+	LOG_ARG_SIZE,
+	LOG_ARG_PTRDIFF,
+	LOG_ARG_INTMAX,
+	LOG_ARG_UINTMAX,
+	LOG_ARG_DOUBLE,
+	LOG_ARG_STR,
+	LOG_ARG_PTR
+} LogArgType;
+
+typedef enum log_arg_length_t
+{
+	LOG_LENGTH_NONE,
+	LOG_LENGTH_L,
+	LOG_LENGTH_LL,
+	LOG_LENGTH_Z,
+	LOG_LENGTH_T,
+	LOG_LENGTH_J
+} LogArgLength;
+
+typedef struct log_spec_t
+{
+	size_t len; // of the whole specification, starting at '%'
+	bool width_arg;
+	bool precision_arg;
+	int precision; // -1 if not given as digits
+	LogArgType type;
+} LogSpec;
+
+static void *log_ring_thread_func(void *user);
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_log_ring_init(ChiakiLogRing *ring, size_t size_exp, bool timestamps)
+{
+	ring->size_exp = size_exp;
+	ring->timestamps = timestamps;
+	ring->tail = 0;
+	ring->head = 0;
+	ring->dropped = 0;
+	ring->should_stop = false;
+
+	ring->records = malloc(RING_SIZE * sizeof(ChiakiLogRingRecord));
+	if(!ring->records)
+		return CHIAKI_ERR_MEMORY;
+	for(size_t i=0; i<RING_SIZE; i++)
+		ring->records[i].seq = i;
+
+	ChiakiErrorCode err = chiaki_mutex_init(&ring->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_records;
+
+	err = chiaki_cond_init(&ring->cond, &ring->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	err = chiaki_thread_create_role(&ring->thread, log_ring_thread_func, ring, CHIAKI_THREAD_ROLE_LOG);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_cond;
+
+	return CHIAKI_ERR_SUCCESS;
+error_cond:
+	chiaki_cond_fini(&ring->cond);
+error_mutex:
+	chiaki_mutex_fini(&ring->mutex);
+error_records:
+	free(ring->records);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_log_ring_fini(ChiakiLogRing *ring)
+{
+	chiaki_mutex_lock(&ring->mutex);
+	ring->should_stop = true;
+	chiaki_cond_signal(&ring->cond);
+	chiaki_mutex_unlock(&ring->mutex);
+	chiaki_thread_join(&ring->thread, NULL);
+
+	chiaki_cond_fini(&ring->cond);
+	chiaki_mutex_fini(&ring->mutex);
+	free(ring->records);
+}
+
+/**
+ * Parse the conversion specification at fmt, which points to its '%'.
+ *
+ * @return false if it cannot be captured
+ */
+static bool log_spec_parse(const char *fmt, LogSpec *spec)
+{
+	const char *p = fmt + 1;
+	spec->width_arg = false;
+	spec->precision_arg = false;
+	spec->precision = -1;
+
+	while(*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0')
+		p++;
+	if(*p == '*')
+	{
+		spec->width_arg = true;
+		p++;
+	}
+	else
+	{
+		while(*p >= '0' && *p <= '9')
+			p++;
+	}
+
+	if(*p == '.')
+	{
+		p++;
+		if(*p == '*')
+		{
+			spec->precision_arg = true;
+			p++;
+		}
+		else
+		{
+			spec->precision = 0;
+			while(*p >= '0' && *p <= '9')
+			{
+				if(spec->precision < 0x10000)
+					spec->precision = spec->precision * 10 + (*p - '0');
+				p++;
+			}
+		}
+	}
+
+	LogArgLength length = LOG_LENGTH_NONE;
+	switch(*p)
+	{
+		case 'h':
+			p++;
+			if(*p == 'h')
+				p++;
+			break; // promoted to int anyway
+		case 'l':
+			p++;
+			length = LOG_LENGTH_L;
+			if(*p == 'l')
+			{
+				p++;
+				length = LOG_LENGTH_LL;
+			}
+			break;
+		case 'z':
+			p++;
+			length = LOG_LENGTH_Z;
+			break;
+		case 't':
+			p++;
+			length = LOG_LENGTH_T;
+			break;
+		case 'j':
+			p++;
+			length = LOG_LENGTH_J;
+			break;
+		default:
+			break;
+	}
+
+	switch(*p)
+	{
+		case 'd':
+		case 'i':
+		{
+			static const LogArgType types[] = { LOG_ARG_INT, LOG_ARG_LONG, LOG_ARG_LLONG, LOG_ARG_PTRDIFF, LOG_ARG_PTRDIFF, LOG_ARG_INTMAX };
+			spec->type = types[length];
+			break;
+		}
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+		{
+			static const LogArgType types[] = { LOG_ARG_UINT, LOG_ARG_ULONG, LOG_ARG_ULLONG, LOG_ARG_SIZE, LOG_ARG_SIZE, LOG_ARG_UINTMAX };
+			spec->type = types[length];
+			break;
+		}
+		case 'c':
+			if(length != LOG_LENGTH_NONE)
+				return false;
+			spec->type = LOG_ARG_INT;
+			break;
+		case 'f':
+		case 'F':
+		case 'e':
+		case 'E':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+			if(length != LOG_LENGTH_NONE && length != LOG_LENGTH_L)
+				return false;
+			spec->type = LOG_ARG_DOUBLE;
+			break;
+		case 's':
+			if(length != LOG_LENGTH_NONE)
+				return false;
+			spec->type = LOG_ARG_STR;
+			break;
+		case 'p':
+			spec->type = LOG_ARG_PTR;
+			break;
+		case '%':
+			if(p != fmt + 1)
+				return false;
+			spec->type = LOG_ARG_NONE;
+			break;
+		default:
+			return false;
+	}
+
+	spec->len = (size_t)(p + 1 - fmt);
+	return spec->len < SPEC_SIZE_MAX;
+}
+
+/**
+ * Copy the arguments for fmt into record.
+ *
+ * @return false if fmt cannot be captured
+ */
+static bool log_record_capture(ChiakiLogRingRecord *record, const char *fmt, va_list args)
+{
+	record->args_count = 0;
+	record->strs_size = 0;
+	for(const char *c = fmt; *c; c++)
+	{
+		if(*c != '%')
+			continue;
+		LogSpec spec;
+		if(!log_spec_parse(c, &spec))
+			return false;
+		c += spec.len - 1;
+		if(spec.type == LOG_ARG_NONE)
+			continue;
+
+		if(record->args_count + 1 + spec.width_arg + spec.precision_arg > CHIAKI_LOG_RING_ARGS_MAX)
+			return false;
+		if(spec.width_arg)
+			record->args[record->args_count++].i = va_arg(args, int);
+		if(spec.precision_arg)
+		{
+			spec.precision = va_arg(args, int);
+			record->args[record->args_count++].i = spec.precision;
+		}
+
+		ChiakiLogRingArg *arg = &record->args[record->args_count++];
+		switch(spec.type)
+		{
+			case LOG_ARG_INT: arg->i = va_arg(args, int); break;
+			case LOG_ARG_UINT: arg->u = va_arg(args, unsigned int); break;
+			case LOG_ARG_LONG: arg->i = va_arg(args, long); break;
+			case LOG_ARG_ULONG: arg->u = va_arg(args, unsigned long); break;
+			case LOG_ARG_LLONG: arg->i = va_arg(args, long long); break;
+			case LOG_ARG_ULLONG: arg->u = va_arg(args, unsigned long long); break;
+			case LOG_ARG_SIZE: arg->u = va_arg(args, size_t); break;
+			case LOG_ARG_PTRDIFF: arg->i = va_arg(args, ptrdiff_t); break;
+			case LOG_ARG_INTMAX: arg->i = va_arg(args, intmax_t); break;
+			case LOG_ARG_UINTMAX: arg->u = va_arg(args, uintmax_t); break;
+			case LOG_ARG_DOUBLE: arg->d = va_arg(args, double); break;
+			case LOG_ARG_PTR: arg->p = va_arg(args, const void *); break;
+			case LOG_ARG_STR:
+			{
+				const char *s = va_arg(args, const char *);
+				if(!s)
+				{
+					arg->str = SIZE_MAX;
+					break;
+				}
+				// the pointer may be gone by the time the record is formatted, so keep a copy
+				size_t max = CHIAKI_LOG_RING_STRS_SIZE - 1 - record->strs_size;
+				if(spec.precision >= 0 && (size_t)spec.precision < max)
+					max = spec.precision;
+				size_t len = 0;
+				while(len < max && s[len])
+					len++;
+				arg->str = record->strs_size;
+				memcpy(record->strs + record->strs_size, s, len);
+				record->strs[record->strs_size + len] = '\0';
+				record->strs_size += len + 1;
+				break;
+			}
+			default:
+				break;
+		}
+	}
+	return true;
+}
+
+CHIAKI_EXPORT bool chiaki_log_ring_vpush(ChiakiLogRing *ring, ChiakiLogLevel level, ChiakiLogCb cb, void *user, const char *fmt, va_list args)
+{
+	ChiakiLogRingRecord record;
+	if(!log_record_capture(&record, fmt, args))
+		return false;
+	record.level = level;
+	record.cb = cb;
+	record.user = user;
+	record.time_us = chiaki_time_now_monotonic_us();
+	record.fmt = fmt;
+
+	// claim a position whose record has been read in the previous round
+	ChiakiLogRingRecord *r;
+	size_t pos = chiaki_atomic_load_acquire(&ring->tail);
+	while(true)
+	{
+		r = &ring->records[pos & RING_MASK];
+		size_t seq = chiaki_atomic_load_acquire(&r->seq);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if(diff == 0)
+		{
+			if(chiaki_atomic_compare_exchange(&ring->tail, &pos, pos + 1))
+				break;
+		}
+		else if(diff < 0)
+		{
+			chiaki_atomic_fetch_add(&ring->dropped, 1);
+			return true;
+		}
+		else
+			pos = chiaki_atomic_load_acquire(&ring->tail);
+	}
+
+	r->level = record.level;
+	r->cb = record.cb;
+	r->user = record.user;
+	r->time_us = record.time_us;
+	r->fmt = record.fmt;
+	r->args_count = record.args_count;
+	memcpy(r->args, record.args, record.args_count * sizeof(ChiakiLogRingArg));
+	r->strs_size = record.strs_size;
+	memcpy(r->strs, record.strs, record.strs_size);
+	chiaki_atomic_store_release(&r->seq, pos + 1);
+
+	// the thread polls anyway, only wake it up early before the ring runs full
+	if(pos + 1 - chiaki_atomic_load_acquire(&ring->head) == RING_SIZE / 2)
+	{
+		chiaki_mutex_lock(&ring->mutex);
+		chiaki_cond_signal(&ring->cond);
+		chiaki_mutex_unlock(&ring->mutex);
+	}
+	return true;
+}
+
+/**
+ * Format a single conversion with its arguments from record, starting at *arg.
+ */
+static int log_spec_format(char *out, size_t out_size, const char *fmt, const LogSpec *spec, const ChiakiLogRingRecord *record, size_t *arg)
+{
+	// substitute * by the captured values, so every type needs only one call
+	char spec_buf[SPEC_SIZE_MAX + 2 * 12];
+	size_t spec_len = 0;
+	for(size_t i=0; i<spec->len; i++)
+	{
+		if(fmt[i] != '*')
+		{
+			spec_buf[spec_len++] = fmt[i];
+			continue;
+		}
+		int v = (int)record->args[(*arg)++].i;
+		if(i > 0 && fmt[i - 1] == '.' && v < 0)
+		{
+			spec_len--; // negative precision is as if there was none
+			continue;
+		}
+		spec_len += snprintf(spec_buf + spec_len, sizeof(spec_buf) - spec_len, "%d", v);
+	}
+	spec_buf[spec_len] = '\0';
+
+	const ChiakiLogRingArg *a = &record->args[(*arg)++];
+	switch(spec->type)
+	{
+		case LOG_ARG_INT: return snprintf(out, out_size, spec_buf, (int)a->i);
+		case LOG_ARG_UINT: return snprintf(out, out_size, spec_buf, (unsigned int)a->u);
+		case LOG_ARG_LONG: return snprintf(out, out_size, spec_buf, (long)a->i);
+		case LOG_ARG_ULONG: return snprintf(out, out_size, spec_buf, (unsigned long)a->u);
+		case LOG_ARG_LLONG: return snprintf(out, out_size, spec_buf, (long long)a->i);
+		case LOG_ARG_ULLONG: return snprintf(out, out_size, spec_buf, (unsigned long long)a->u);
+		case LOG_ARG_SIZE: return snprintf(out, out_size, spec_buf, (size_t)a->u);
+		case LOG_ARG_PTRDIFF: return snprintf(out, out_size, spec_buf, (ptrdiff_t)a->i);
+		case LOG_ARG_INTMAX: return snprintf(out, out_size, spec_buf, (intmax_t)a->i);
+		case LOG_ARG_UINTMAX: return snprintf(out, out_size, spec_buf, (uintmax_t)a->u);
+		case LOG_ARG_DOUBLE: return snprintf(out, out_size, spec_buf, a->d);
+		case LOG_ARG_PTR: return snprintf(out, out_size, spec_buf, a->p);
+		case LOG_ARG_STR: return snprintf(out, out_size, spec_buf, a->str == SIZE_MAX ? "(null)" : record->strs + a->str);
+		default: return 0;
+	}
+}
+
+static void log_record_output(ChiakiLogRing *ring, const ChiakiLogRingRecord *record)
+{
+	char msg[CHIAKI_LOG_RING_MSG_SIZE];
+	size_t msg_len = 0;
+	if(ring->timestamps)
+		msg_len = snprintf(msg, sizeof(msg), "%llu.%03llu ",
+				(unsigned long long)(record->time_us / 1000), (unsigned long long)(record->time_us % 1000));
+
+	size_t arg = 0;
+	for(const char *c = record->fmt; *c && msg_len < sizeof(msg) - 1; c++)
+	{
+		if(*c != '%')
+		{
+			msg[msg_len++] = *c;
+			continue;
+		}
+		// was already parsed successfully when capturing
+		LogSpec spec;
+		log_spec_parse(c, &spec);
+		if(spec.type == LOG_ARG_NONE)
+			msg[msg_len++] = '%';
+		else
+		{
+			int written = log_spec_format(msg + msg_len, sizeof(msg) - msg_len, c, &spec, record, &arg);
+			if(written > 0)
+				msg_len += written;
+			if(msg_len > sizeof(msg) - 1)
+				msg_len = sizeof(msg) - 1;
+		}
+		c += spec.len - 1;
+	}
+	msg[msg_len] = '\0';
+	record->cb(record->level, msg, record->user);
+}
+
+/**
+ * Output all records that are ready. Only called from the ring's thread.
+ */
+static void log_ring_drain(ChiakiLogRing *ring, ChiakiLogCb *last_cb, void **last_user)
+{
+	while(true)
+	{
+		size_t head = ring->head;
+		ChiakiLogRingRecord *record = &ring->records[head & RING_MASK];
+		if(chiaki_atomic_load_acquire(&record->seq) != head + 1)
+			break;
+		log_record_output(ring, record);
+		*last_cb = record->cb;
+		*last_user = record->user;
+		chiaki_atomic_store_release(&record->seq, head + RING_SIZE);
+		chiaki_atomic_store_release(&ring->head, head + 1);
+	}
+
+	size_t dropped = chiaki_atomic_load_acquire(&ring->dropped);
+	if(dropped && *last_cb)
+	{
+		chiaki_atomic_fetch_add(&ring->dropped, (size_t)0 - dropped);
+		char msg[64];
+		snprintf(msg, sizeof(msg), "Log Ring was full, dropped %llu messages", (unsigned long long)dropped);
+		(*last_cb)(CHIAKI_LOG_WARNING, msg, *last_user);
+	}
+}
+
+static void *log_ring_thread_func(void *user)
+{
+	ChiakiLogRing *ring = user;
+	ChiakiLogCb last_cb = NULL;
+	void *last_user = NULL;
+	while(true)
+	{
+		chiaki_mutex_lock(&ring->mutex);
+		if(!ring->should_stop)
+			chiaki_cond_timedwait(&ring->cond, &ring->mutex, CHIAKI_LOG_RING_POLL_MS);
+		bool stop = ring->should_stop;
+		chiaki_mutex_unlock(&ring->mutex);
+
+		log_ring_drain(ring, &last_cb, &last_user);
+		if(stop)
+			break;
+	}
+	return NULL;
+}
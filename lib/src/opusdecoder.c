@@ -7,28 +7,39 @@
 
 #include <opus/opus.h>
 
+#include <stdlib.h>
 #include <string.h>
 
 static void chiaki_opus_decoder_header(ChiakiAudioHeader *header, void *user);
 static void chiaki_opus_decoder_frame(uint8_t *buf, size_t buf_size, void *user);
+static void chiaki_opus_decoder_frames_lost(unsigned int frames_lost, void *user);
 
 CHIAKI_EXPORT void chiaki_opus_decoder_init(ChiakiOpusDecoder *decoder, ChiakiLog *log)
 {
 	decoder->log = log;
 	decoder->opus_decoder = NULL;
+	// allocated ahead of the stream, the first header only initializes it
+	decoder->opus_decoder_mem = malloc(opus_decoder_get_size(CHIAKI_OPUS_DECODER_CHANNELS_MAX));
 	memset(&decoder->audio_header, 0, sizeof(decoder->audio_header));
 
 	decoder->pcm_buf = NULL;
 	decoder->pcm_buf_size = 0;
+	decoder->pcm_buf_alloc_size = 0;
+	decoder->frames_lost = 0;
+	decoder->frames_concealed = 0;
 
 	decoder->cb_user = NULL;
 	decoder->settings_cb = NULL;
 	decoder->frame_cb = NULL;
+	decoder->buf_cb = NULL;
 }
 
 CHIAKI_EXPORT void chiaki_opus_decoder_fini(ChiakiOpusDecoder *decoder)
 {
+	if(decoder->frames_concealed)
+		CHIAKI_LOGI(decoder->log, "ChiakiOpusDecoder concealed %llu lost frames", (unsigned long long)decoder->frames_concealed);
 	free(decoder->pcm_buf);
+	free(decoder->opus_decoder_mem);
 }
 
 CHIAKI_EXPORT void chiaki_opus_decoder_get_sink(ChiakiOpusDecoder *decoder, ChiakiAudioSink *sink)
@@ -36,49 +47,79 @@ CHIAKI_EXPORT void chiaki_opus_decoder_get_sink(ChiakiOpusDecoder *decoder, Chia
 	sink->user = decoder;
 	sink->header_cb = chiaki_opus_decoder_header;
 	sink->frame_cb = chiaki_opus_decoder_frame;
+	sink->frames_lost_cb = chiaki_opus_decoder_frames_lost;
 }
 
 static void chiaki_opus_decoder_header(ChiakiAudioHeader *header, void *user)
 {
 	ChiakiOpusDecoder *decoder = user;
+	bool same_format = decoder->opus_decoder
+		&& decoder->audio_header.rate == header->rate
+		&& decoder->audio_header.channels == header->channels;
 	memcpy(&decoder->audio_header, header, sizeof(decoder->audio_header));
 
-	opus_decoder_destroy(decoder->opus_decoder);
-
-	int error;
-	decoder->opus_decoder = opus_decoder_create(header->rate, header->channels, &error);
-
-	if(error != OPUS_OK)
+	if(same_format)
 	{
-		CHIAKI_LOGE(decoder->log, "ChiakiOpusDecoder failed to initialize opus decoder: %s", opus_strerror(error));
-		decoder->opus_decoder = NULL;
-		return;
+		// only the history of the previous stream has to go
+		opus_decoder_ctl(decoder->opus_decoder, OPUS_RESET_STATE);
+		CHIAKI_LOGI(decoder->log, "ChiakiOpusDecoder reset");
 	}
-
-	CHIAKI_LOGI(decoder->log, "ChiakiOpusDecoder initialized");
-
-	size_t pcm_buf_size_required = chiaki_audio_header_frame_buf_size(header);
-	int16_t *pcm_buf_old = decoder->pcm_buf;
-	if(!decoder->pcm_buf || decoder->pcm_buf_size != pcm_buf_size_required) {
-		decoder->pcm_buf = realloc(decoder->pcm_buf, pcm_buf_size_required);
-	}
-
-	if(!decoder->pcm_buf)
+	else
 	{
-		free(pcm_buf_old);
-		CHIAKI_LOGE(decoder->log, "ChiakiOpusDecoder failed to alloc pcm buffer");
-		opus_decoder_destroy(decoder->opus_decoder);
 		decoder->opus_decoder = NULL;
-		decoder->pcm_buf_size = 0;
-		return;
+		if(!decoder->opus_decoder_mem)
+			decoder->opus_decoder_mem = malloc(opus_decoder_get_size(CHIAKI_OPUS_DECODER_CHANNELS_MAX));
+		if(!decoder->opus_decoder_mem)
+		{
+			CHIAKI_LOGE(decoder->log, "ChiakiOpusDecoder failed to alloc opus decoder");
+			return;
+		}
+		int error = header->channels > CHIAKI_OPUS_DECODER_CHANNELS_MAX ? OPUS_BAD_ARG
+			: opus_decoder_init(decoder->opus_decoder_mem, header->rate, header->channels);
+		if(error != OPUS_OK)
+		{
+			CHIAKI_LOGE(decoder->log, "ChiakiOpusDecoder failed to initialize opus decoder: %s", opus_strerror(error));
+			return;
+		}
+		decoder->opus_decoder = decoder->opus_decoder_mem;
+		CHIAKI_LOGI(decoder->log, "ChiakiOpusDecoder initialized");
 	}
+	decoder->frames_lost = 0;
 
-	decoder->pcm_buf_size = pcm_buf_size_required;
+	decoder->pcm_buf_size = chiaki_audio_header_frame_buf_size(header);
+	if(decoder->pcm_buf_alloc_size < decoder->pcm_buf_size)
+	{
+		free(decoder->pcm_buf);
+		decoder->pcm_buf = NULL;
+		decoder->pcm_buf_alloc_size = 0;
+	}
 
 	if(decoder->settings_cb)
 		decoder->settings_cb(header->channels, header->rate, decoder->cb_user);
 }
 
+/**
+ * @return the buffer to decode the next frame into, from the buffer callback if possible
+ */
+static int16_t *frame_buf(ChiakiOpusDecoder *decoder)
+{
+	if(decoder->buf_cb)
+	{
+		int16_t *r = decoder->buf_cb(decoder->audio_header.frame_size, decoder->cb_user);
+		if(r)
+			return r;
+	}
+	if(!decoder->pcm_buf)
+	{
+		decoder->pcm_buf = malloc(decoder->pcm_buf_size);
+		if(decoder->pcm_buf)
+			decoder->pcm_buf_alloc_size = decoder->pcm_buf_size;
+		else
+			CHIAKI_LOGE(decoder->log, "ChiakiOpusDecoder failed to alloc pcm buffer");
+	}
+	return decoder->pcm_buf;
+}
+
 static void chiaki_opus_decoder_frame(uint8_t *buf, size_t buf_size, void *user)
 {
 	ChiakiOpusDecoder *decoder = user;
@@ -88,11 +129,52 @@ static void chiaki_opus_decoder_frame(uint8_t *buf, size_t buf_size, void *user)
 		return;
 	}
 
-	int r = opus_decode(decoder->opus_decoder, buf, (opus_int32)buf_size, decoder->pcm_buf, decoder->audio_header.frame_size, 0);
+	if(decoder->frames_lost)
+	{
+		// plc for all but the last lost frame, which may be recovered from the in-band fec data of this one
+		unsigned int frames_lost = decoder->frames_lost;
+		decoder->frames_lost = 0;
+		for(unsigned int i=0; i<frames_lost; i++)
+		{
+			int16_t *pcm = frame_buf(decoder);
+			if(!pcm)
+				return;
+			bool fec = i + 1 == frames_lost;
+			int r = opus_decode(decoder->opus_decoder, fec ? buf : NULL, fec ? (opus_int32)buf_size : 0,
+					pcm, decoder->audio_header.frame_size, fec ? 1 : 0);
+			if(r < 1)
+			{
+				CHIAKI_LOGW(decoder->log, "Concealing lost audio frame with opus failed: %s", opus_strerror(r));
+				break;
+			}
+			decoder->frames_concealed++;
+			if(decoder->frame_cb)
+				decoder->frame_cb(pcm, (size_t)r, decoder->cb_user);
+		}
+	}
+
+	int16_t *pcm = frame_buf(decoder);
+	if(!pcm)
+		return;
+	int r = opus_decode(decoder->opus_decoder, buf, (opus_int32)buf_size, pcm, decoder->audio_header.frame_size, 0);
 	if(r < 1)
 		CHIAKI_LOGE(decoder->log, "Decoding audio frame with opus failed: %s", opus_strerror(r));
 	else if(decoder->frame_cb)
-		decoder->frame_cb(decoder->pcm_buf, (size_t)r, decoder->cb_user);
+		decoder->frame_cb(pcm, (size_t)r, decoder->cb_user);
+}
+
+static void chiaki_opus_decoder_frames_lost(unsigned int frames_lost, void *user)
+{
+	ChiakiOpusDecoder *decoder = user;
+	if(!decoder->opus_decoder)
+		return;
+	if(frames_lost > CHIAKI_OPUS_DECODER_CONCEAL_FRAMES_MAX)
+	{
+		// after a gap this long, synthesized audio would only delay playback, conceal just the tail for a smooth restart
+		CHIAKI_LOGW(decoder->log, "ChiakiOpusDecoder lost %u frames, concealing only the last %u", frames_lost, CHIAKI_OPUS_DECODER_CONCEAL_FRAMES_MAX);
+		frames_lost = CHIAKI_OPUS_DECODER_CONCEAL_FRAMES_MAX;
+	}
+	decoder->frames_lost = frames_lost;
 }
 
 #endif
\ No newline at end of file
@@ -4,23 +4,50 @@
 #if CHIAKI_LIB_ENABLE_OPUS
 
 #include <chiaki/opusencoder.h>
+#include <chiaki/time.h>
 
 #include <opus/opus.h>
 
 #include <string.h>
 
+CHIAKI_EXPORT void chiaki_opus_encoder_settings_preset(ChiakiOpusEncoderSettings *settings, ChiakiOpusEncoderProfile profile)
+{
+	switch(profile)
+	{
+		case CHIAKI_OPUS_ENCODER_PROFILE_LOW_CPU:
+			settings->complexity = 2;
+			settings->vbr = false;
+			settings->dtx = true;
+			break;
+		case CHIAKI_OPUS_ENCODER_PROFILE_DEFAULT:
+		default:
+			settings->complexity = 10;
+			settings->vbr = true;
+			settings->dtx = false;
+			break;
+	}
+}
+
 CHIAKI_EXPORT void chiaki_opus_encoder_init(ChiakiOpusEncoder *encoder, ChiakiLog *log)
 {
 	encoder->log = log;
+	chiaki_opus_encoder_settings_preset(&encoder->settings, CHIAKI_OPUS_ENCODER_PROFILE_DEFAULT);
 	encoder->opus_encoder = NULL;
 	memset(&encoder->audio_header, 0, sizeof(encoder->audio_header));
 	encoder->audio_sender = NULL;
 	encoder->opus_frame_buf = NULL;
 	encoder->opus_frame_buf_size = 0;
+	encoder->frames = 0;
+	encoder->frames_silent = 0;
+	encoder->encode_us_sum = 0;
 }
 
 CHIAKI_EXPORT void chiaki_opus_encoder_fini(ChiakiOpusEncoder *encoder)
 {
+	if(encoder->frames)
+		CHIAKI_LOGI(encoder->log, "ChiakiOpusEncoder encoded %llu frames in %.3f ms avg, %llu silent frames not sent",
+				(unsigned long long)encoder->frames, (double)encoder->encode_us_sum / encoder->frames / 1000.0,
+				(unsigned long long)encoder->frames_silent);
 	free(encoder->opus_frame_buf);
 	chiaki_audio_sender_free(encoder->audio_sender);
 }
@@ -49,9 +76,22 @@ CHIAKI_EXPORT void chiaki_opus_encoder_header(ChiakiAudioHeader *header, ChiakiO
 		return;
 	}
 
-	CHIAKI_LOGI(encoder->log, "ChiakiOpusEncoder initialized");
+	size_t opus_frame_buf_size_required = encoder->audio_sender->buf_size_per_unit;
+
+	ChiakiOpusEncoderSettings *settings = &encoder->settings;
+	opus_encoder_ctl(encoder->opus_encoder, OPUS_SET_COMPLEXITY(settings->complexity));
+	opus_encoder_ctl(encoder->opus_encoder, OPUS_SET_VBR(settings->vbr ? 1 : 0));
+	opus_encoder_ctl(encoder->opus_encoder, OPUS_SET_DTX(settings->dtx ? 1 : 0));
+	if(!settings->vbr && header->frame_size)
+	{
+		// exactly the bitrate that fills every packet unit
+		opus_int32 bitrate = (opus_int32)((uint64_t)opus_frame_buf_size_required * 8 * header->rate / header->frame_size);
+		opus_encoder_ctl(encoder->opus_encoder, OPUS_SET_BITRATE(bitrate));
+	}
+
+	CHIAKI_LOGI(encoder->log, "ChiakiOpusEncoder initialized with complexity %d, %s%s",
+			settings->complexity, settings->vbr ? "vbr" : "cbr", settings->dtx ? ", dtx" : "");
 
-	size_t opus_frame_buf_size_required = 40;
 	uint8_t *opus_frame_buf_old = encoder->opus_frame_buf;
 	if(!encoder->opus_frame_buf || encoder->opus_frame_buf_size != opus_frame_buf_size_required)
 		encoder->opus_frame_buf = realloc(encoder->opus_frame_buf, opus_frame_buf_size_required);
@@ -77,9 +117,17 @@ CHIAKI_EXPORT void chiaki_opus_encoder_frame(int16_t *pcm_buf, ChiakiOpusEncoder
 		return;
 	}
 
+	uint64_t start_us = chiaki_time_now_monotonic_us();
 	int r = opus_encode(encoder->opus_encoder, pcm_buf, encoder->audio_header.frame_size, encoder->opus_frame_buf, encoder->opus_frame_buf_size);
+	encoder->encode_us_sum += chiaki_time_now_monotonic_us() - start_us;
+	encoder->frames++;
 	if(r < 1)
 		CHIAKI_LOGE(encoder->log, "Encoding audio frame with opus failed: %s", opus_strerror(r));
+	else if(encoder->settings.dtx && r <= 2)
+	{
+		// dtx: nothing worth sending, the server fills in silence
+		encoder->frames_silent++;
+	}
 	else
 	{
 		chiaki_audio_sender_opus_data(encoder->audio_sender, encoder->opus_frame_buf, (size_t)r);
@@ -3,10 +3,11 @@
 #include <chiaki/orientation.h>
 #include <math.h>
 
-#define SIN_1_4_PI      0.7071067811865475
-#define SIN_NEG_1_4_PI -0.7071067811865475
-#define COS_1_4_PI      0.7071067811865476
-#define COS_NEG_1_4_PI  0.7071067811865476
+// float, so that nothing here is promoted to double
+#define SIN_1_4_PI      0.7071067811865475f
+#define SIN_NEG_1_4_PI -0.7071067811865475f
+#define COS_1_4_PI      0.7071067811865476f
+#define COS_NEG_1_4_PI  0.7071067811865476f
 
 #define WARMUP_SAMPLES_COUNT 30
 #define BETA_WARMUP 20.0f
@@ -109,7 +110,7 @@ CHIAKI_EXPORT void chiaki_orientation_update(ChiakiOrientation *orient,
 static float inv_sqrt(float x)
 {
 #if 1
-	return 1.0f / sqrt(x);
+	return 1.0f / sqrtf(x);
 #else
 	// Fast inverse square-root
 	// See: http://en.wikipedia.org/wiki/Fast_inverse_square_root
@@ -134,15 +135,12 @@ CHIAKI_EXPORT void chiaki_orientation_tracker_init(ChiakiOrientationTracker *tra
 	tracker->sample_index = 0;
 }
 
-CHIAKI_EXPORT void chiaki_orientation_tracker_update(ChiakiOrientationTracker *tracker,
+/**
+ * Integrate a single sample into the orientation, without updating the current gyro/accel state
+ */
+static void tracker_integrate(ChiakiOrientationTracker *tracker,
 		float gx, float gy, float gz, float ax, float ay, float az, uint32_t timestamp_us)
 {
-	tracker->gyro_x = gx;
-	tracker->gyro_y = gy;
-	tracker->gyro_z = gz;
-	tracker->accel_x = ax;
-	tracker->accel_y = ay;
-	tracker->accel_z = az;
 	tracker->sample_index++;
 	if(tracker->sample_index <= 1)
 	{
@@ -159,6 +157,38 @@ CHIAKI_EXPORT void chiaki_orientation_tracker_update(ChiakiOrientationTracker *t
 			(float)delta_us / 1000000.0f);
 }
 
+CHIAKI_EXPORT void chiaki_orientation_tracker_update(ChiakiOrientationTracker *tracker,
+		float gx, float gy, float gz, float ax, float ay, float az, uint32_t timestamp_us)
+{
+	tracker->gyro_x = gx;
+	tracker->gyro_y = gy;
+	tracker->gyro_z = gz;
+	tracker->accel_x = ax;
+	tracker->accel_y = ay;
+	tracker->accel_z = az;
+	tracker_integrate(tracker, gx, gy, gz, ax, ay, az, timestamp_us);
+}
+
+CHIAKI_EXPORT void chiaki_orientation_tracker_update_batch(ChiakiOrientationTracker *tracker,
+		const ChiakiOrientationSample *samples, size_t samples_count)
+{
+	if(!samples_count)
+		return;
+	for(size_t i=0; i<samples_count; i++)
+	{
+		const ChiakiOrientationSample *sample = &samples[i];
+		tracker_integrate(tracker, sample->gx, sample->gy, sample->gz,
+				sample->ax, sample->ay, sample->az, sample->timestamp_us);
+	}
+	const ChiakiOrientationSample *last = &samples[samples_count - 1];
+	tracker->gyro_x = last->gx;
+	tracker->gyro_y = last->gy;
+	tracker->gyro_z = last->gz;
+	tracker->accel_x = last->ax;
+	tracker->accel_y = last->ay;
+	tracker->accel_z = last->az;
+}
+
 CHIAKI_EXPORT void chiaki_orientation_tracker_apply_to_controller_state(ChiakiOrientationTracker *tracker,
 		ChiakiControllerState *state)
 {
@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/packetpool.h>
+
+#include <stdlib.h>
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_packet_pool_init(ChiakiPacketPool *pool, size_t bufs_count)
+{
+	pool->buf_size = CHIAKI_PACKET_POOL_BUF_SIZE;
+	pool->buf_stride = CHIAKI_PACKET_POOL_BUF_STRIDE;
+	pool->bufs_count = bufs_count;
+	pool->in_use_max = 0;
+	pool->fallback_allocs = 0;
+
+	pool->slab = malloc(pool->buf_stride * bufs_count);
+	if(!pool->slab)
+		return CHIAKI_ERR_MEMORY;
+
+	pool->free_bufs = malloc(bufs_count * sizeof(uint8_t *));
+	if(!pool->free_bufs)
+	{
+		free(pool->slab);
+		return CHIAKI_ERR_MEMORY;
+	}
+
+	// push in reverse so the first allocations come from the start of the slab
+	for(size_t i=0; i<bufs_count; i++)
+		pool->free_bufs[i] = pool->slab + (bufs_count - 1 - i) * pool->buf_stride;
+	pool->free_count = bufs_count;
+
+	ChiakiErrorCode err = chiaki_mutex_init(&pool->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		free(pool->free_bufs);
+		free(pool->slab);
+		return err;
+	}
+
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_packet_pool_fini(ChiakiPacketPool *pool)
+{
+	chiaki_mutex_fini(&pool->mutex);
+	free(pool->free_bufs);
+	free(pool->slab);
+}
+
+CHIAKI_EXPORT uint8_t *chiaki_packet_pool_alloc(ChiakiPacketPool *pool)
+{
+	uint8_t *buf = NULL;
+	chiaki_mutex_lock(&pool->mutex);
+	if(pool->free_count)
+	{
+		buf = pool->free_bufs[--pool->free_count];
+		size_t in_use = pool->bufs_count - pool->free_count;
+		if(in_use > pool->in_use_max)
+			pool->in_use_max = in_use;
+	}
+	else
+		pool->fallback_allocs++;
+	chiaki_mutex_unlock(&pool->mutex);
+
+	if(!buf)
+		buf = malloc(pool->buf_stride);
+	return buf;
+}
+
+CHIAKI_EXPORT void chiaki_packet_pool_free(ChiakiPacketPool *pool, uint8_t *buf)
+{
+	if(!buf)
+		return;
+	if(!chiaki_packet_pool_owns(pool, buf))
+	{
+		free(buf);
+		return;
+	}
+	chiaki_mutex_lock(&pool->mutex);
+	pool->free_bufs[pool->free_count++] = buf;
+	chiaki_mutex_unlock(&pool->mutex);
+}
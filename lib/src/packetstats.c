@@ -1,76 +1,201 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
 #include <chiaki/packetstats.h>
-#include <chiaki/log.h>
+
+#include <string.h>
+
+#define SLOT_READ_RETRIES 4
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_packet_stats_init(ChiakiPacketStats *stats)
 {
-	stats->gen_received = 0;
-	stats->gen_lost = 0;
-	stats->seq_min = 0;
-	stats->seq_max = 0;
-	stats->seq_received = 0;
-	return chiaki_mutex_init(&stats->mutex, false);
+	memset(stats, 0, sizeof(*stats));
+	return CHIAKI_ERR_SUCCESS;
 }
 
 CHIAKI_EXPORT void chiaki_packet_stats_fini(ChiakiPacketStats *stats)
 {
-	chiaki_mutex_fini(&stats->mutex);
 }
 
-static void reset_stats(ChiakiPacketStats *stats)
+/**
+ * Add to a counter, must only be called from the receiving thread
+ */
+static void counter_add(size_t *counter, size_t v)
+{
+	chiaki_atomic_store_release(counter, chiaki_atomic_load_acquire(counter) + v);
+}
+
+static void totals_get(ChiakiPacketStats *stats, size_t *received, size_t *lost)
+{
+	*received = chiaki_atomic_load_acquire(&stats->gen_received) + chiaki_atomic_load_acquire(&stats->seq_received);
+	*lost = chiaki_atomic_load_acquire(&stats->gen_lost) + chiaki_atomic_load_acquire(&stats->seq_lost);
+}
+
+static void loss_burst_add(ChiakiPacketStats *stats, uint64_t lost)
 {
-	stats->gen_received = 0;
-	stats->gen_lost = 0;
-	stats->seq_min = stats->seq_max;
-	stats->seq_received = 0;
+	if(!lost)
+		return;
+	size_t bucket = 0;
+	for(uint64_t v = lost - 1; v && bucket < CHIAKI_PACKET_STATS_BURST_BUCKETS - 1; v >>= 1)
+		bucket++;
+	counter_add(&stats->loss_bursts[bucket], 1);
 }
 
 CHIAKI_EXPORT void chiaki_packet_stats_reset(ChiakiPacketStats *stats)
 {
-	chiaki_mutex_lock(&stats->mutex);
-	reset_stats(stats);
-	chiaki_mutex_unlock(&stats->mutex);
+	size_t received, lost;
+	totals_get(stats, &received, &lost);
+	chiaki_atomic_store_release(&stats->reset_received, received);
+	chiaki_atomic_store_release(&stats->reset_lost, lost);
 }
 
 CHIAKI_EXPORT void chiaki_packet_stats_push_generation(ChiakiPacketStats *stats, uint64_t received, uint64_t lost)
 {
-	chiaki_mutex_lock(&stats->mutex);
-	stats->gen_received += received;
-	stats->gen_lost += lost;
-	chiaki_mutex_unlock(&stats->mutex);
+	counter_add(&stats->gen_received, (size_t)received);
+	counter_add(&stats->gen_lost, (size_t)lost);
+	loss_burst_add(stats, lost);
 }
 
 CHIAKI_EXPORT void chiaki_packet_stats_push_seq(ChiakiPacketStats *stats, ChiakiSeqNum16 seq_num)
 {
-	stats->seq_received++;
-	if(chiaki_seq_num_16_gt(seq_num, stats->seq_max))
+	counter_add(&stats->seq_received, 1);
+	if(!stats->seq_valid)
+	{
+		stats->seq_valid = true;
 		stats->seq_max = seq_num;
+		return;
+	}
+	if(!chiaki_seq_num_16_gt(seq_num, stats->seq_max))
+		return; // reordered, it has already been counted as lost, which keeps the counters monotonic
+	ChiakiSeqNum16 gap = seq_num - stats->seq_max - 1;
+	stats->seq_max = seq_num;
+	counter_add(&stats->seq_lost, gap);
+	loss_burst_add(stats, gap);
 }
 
-CHIAKI_EXPORT void chiaki_packet_stats_get(ChiakiPacketStats *stats, bool reset, uint64_t *received, uint64_t *lost)
+static void slot_write(ChiakiPacketStats *stats, size_t index, size_t received, size_t lost)
 {
-	chiaki_mutex_lock(&stats->mutex);
+	ChiakiPacketStatsSlot *slot = &stats->slots[index % CHIAKI_PACKET_STATS_SLOTS];
+	size_t seq = chiaki_atomic_load_acquire(&slot->seq);
+	chiaki_atomic_store_seq_cst(&slot->seq, seq + 1);
+	chiaki_atomic_fence_seq_cst();
+	chiaki_atomic_store_release(&slot->index, index);
+	chiaki_atomic_store_release(&slot->received, received);
+	chiaki_atomic_store_release(&slot->lost, lost);
+	chiaki_atomic_store_release(&slot->seq, seq + 2);
+}
 
-	// gen
-	*received = stats->gen_received;
-	*lost = stats->gen_lost;
+typedef enum
+{
+	SLOT_READ_OK,
+	SLOT_READ_MISSING, // slot holds a different index, e.g. because index is older than the stats
+	SLOT_READ_BUSY // kept being written while reading
+} SlotReadResult;
 
-	//CHIAKI_LOGD(NULL, "gen received: %llu, lost: %llu",
-	//		(unsigned long long)stats->gen_received,
-	//		(unsigned long long)stats->gen_lost);
+static SlotReadResult slot_read(ChiakiPacketStats *stats, size_t index, size_t *received, size_t *lost)
+{
+	ChiakiPacketStatsSlot *slot = &stats->slots[index % CHIAKI_PACKET_STATS_SLOTS];
+	for(size_t i=0; i<SLOT_READ_RETRIES; i++)
+	{
+		size_t seq = chiaki_atomic_load_acquire(&slot->seq);
+		if(seq & 1)
+			continue;
+		size_t slot_index = chiaki_atomic_load_acquire(&slot->index);
+		*received = chiaki_atomic_load_acquire(&slot->received);
+		*lost = chiaki_atomic_load_acquire(&slot->lost);
+		chiaki_atomic_fence_seq_cst();
+		if(chiaki_atomic_load_acquire(&slot->seq) == seq)
+			return slot_index == index ? SLOT_READ_OK : SLOT_READ_MISSING;
+	}
+	return SLOT_READ_BUSY;
+}
 
-	// seq
-	uint64_t seq_diff = stats->seq_max - stats->seq_min; // overflow on purpose if max < min
-	uint64_t seq_lost = stats->seq_received > seq_diff ? seq_diff : seq_diff - stats->seq_received;
-	*received += stats->seq_received;
-	*lost += seq_lost;
+CHIAKI_EXPORT void chiaki_packet_stats_push_arrival(ChiakiPacketStats *stats, uint64_t arrival_us)
+{
+	if(stats->arrival_prev_us && arrival_us >= stats->arrival_prev_us)
+	{
+		uint64_t interval_us = arrival_us - stats->arrival_prev_us;
+		size_t bucket = 0;
+		if(interval_us >= CHIAKI_PACKET_STATS_ARRIVAL_BUCKET_MIN_US)
+		{
+			bucket = 1;
+			for(uint64_t v = interval_us / CHIAKI_PACKET_STATS_ARRIVAL_BUCKET_MIN_US; v > 1 && bucket < CHIAKI_PACKET_STATS_ARRIVAL_BUCKETS - 1; v >>= 1)
+				bucket++;
+		}
+		counter_add(&stats->arrival_intervals[bucket], 1);
+	}
+	stats->arrival_prev_us = arrival_us;
 
-	//CHIAKI_LOGD(NULL, "seq received: %llu, lost: %llu",
-	//		(unsigned long long)stats->seq_received,
-	//		(unsigned long long)seq_lost);
+	// entering a new slot, record where the totals were at its start, and at the start of all skipped ones
+	size_t slot = (size_t)(arrival_us / CHIAKI_PACKET_STATS_SLOT_US);
+	size_t slot_cur = chiaki_atomic_load_acquire(&stats->slot_cur);
+	if(slot_cur && slot <= slot_cur)
+		return;
+	size_t first = slot;
+	if(slot_cur && slot - slot_cur < CHIAKI_PACKET_STATS_SLOTS)
+		first = slot_cur + 1;
+	else if(slot_cur)
+		first = slot - CHIAKI_PACKET_STATS_SLOTS + 1;
+	size_t received, lost;
+	totals_get(stats, &received, &lost);
+	for(size_t i = first; i != slot + 1; i++)
+		slot_write(stats, i, received, lost);
+	chiaki_atomic_store_release(&stats->slot_cur, slot);
+}
 
+CHIAKI_EXPORT void chiaki_packet_stats_get(ChiakiPacketStats *stats, bool reset, uint64_t *received, uint64_t *lost)
+{
+	size_t total_received, total_lost;
+	totals_get(stats, &total_received, &total_lost);
+	*received = total_received - chiaki_atomic_load_acquire(&stats->reset_received);
+	*lost = total_lost - chiaki_atomic_load_acquire(&stats->reset_lost);
 	if(reset)
-		reset_stats(stats);
-	chiaki_mutex_unlock(&stats->mutex);
+	{
+		chiaki_atomic_store_release(&stats->reset_received, total_received);
+		chiaki_atomic_store_release(&stats->reset_lost, total_lost);
+	}
+}
+
+static void window_get(ChiakiPacketStats *stats, uint64_t now_us, uint64_t window_us,
+		size_t received, size_t lost, ChiakiPacketStatsCounts *counts)
+{
+	counts->received = 0;
+	counts->lost = 0;
+	size_t slot_cur = chiaki_atomic_load_acquire(&stats->slot_cur);
+	if(!slot_cur || now_us < window_us)
+		return;
+	size_t base = (size_t)((now_us - window_us) / CHIAKI_PACKET_STATS_SLOT_US);
+	if((size_t)(slot_cur - base) >= CHIAKI_PACKET_STATS_SLOTS)
+		return; // nothing arrived since the window started
+	size_t base_received = 0, base_lost = 0;
+	for(; base != slot_cur + 1; base++)
+	{
+		SlotReadResult r = slot_read(stats, base, &base_received, &base_lost);
+		if(r == SLOT_READ_OK)
+			break;
+		if(r == SLOT_READ_MISSING)
+		{
+			// stats are younger than the window
+			base_received = base_lost = 0;
+			break;
+		}
+		// try the next one, making the window a little shorter
+	}
+	if(base == slot_cur + 1)
+		return;
+	counts->received = (size_t)(received - base_received);
+	counts->lost = (size_t)(lost - base_lost);
+}
+
+CHIAKI_EXPORT void chiaki_packet_stats_snapshot(ChiakiPacketStats *stats, uint64_t now_us, ChiakiPacketStatsSnapshot *snapshot)
+{
+	size_t received, lost;
+	totals_get(stats, &received, &lost);
+	snapshot->total.received = received;
+	snapshot->total.lost = lost;
+	window_get(stats, now_us, CHIAKI_PACKET_STATS_WINDOW_SHORT_US, received, lost, &snapshot->window_short);
+	window_get(stats, now_us, CHIAKI_PACKET_STATS_WINDOW_LONG_US, received, lost, &snapshot->window_long);
+	for(size_t i=0; i<CHIAKI_PACKET_STATS_BURST_BUCKETS; i++)
+		snapshot->loss_bursts[i] = chiaki_atomic_load_acquire(&stats->loss_bursts[i]);
+	for(size_t i=0; i<CHIAKI_PACKET_STATS_ARRIVAL_BUCKETS; i++)
+		snapshot->arrival_intervals[i] = chiaki_atomic_load_acquire(&stats->arrival_intervals[i]);
 }
@@ -107,6 +107,24 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_pi_decoder_init(ChiakiPiDecoder *decoder, C
 		return CHIAKI_ERR_UNKNOWN;
 	}
 
+	// few large buffers instead of many small ones, so frames never have to be split
+	OMX_PARAM_PORTDEFINITIONTYPE port_def;
+	memset(&port_def, 0, sizeof(OMX_PARAM_PORTDEFINITIONTYPE));
+	port_def.nSize = sizeof(OMX_PARAM_PORTDEFINITIONTYPE);
+	port_def.nVersion.nVersion = OMX_VERSION;
+	port_def.nPortIndex = 130;
+	if(OMX_GetParameter(ILC_GET_HANDLE(decoder->video_decode), OMX_IndexParamPortDefinition, &port_def) == OMX_ErrorNone)
+	{
+		port_def.nBufferSize = CHIAKI_PI_DECODER_INPUT_BUFFER_SIZE;
+		// the ones held for frames in assembly plus some for the decoder to work on
+		if(port_def.nBufferCountActual < CHIAKI_VIDEO_FRAME_SLOTS + 2)
+			port_def.nBufferCountActual = CHIAKI_VIDEO_FRAME_SLOTS + 2;
+		if(port_def.nBufferCountActual < port_def.nBufferCountMin)
+			port_def.nBufferCountActual = port_def.nBufferCountMin;
+		if(OMX_SetParameter(ILC_GET_HANDLE(decoder->video_decode), OMX_IndexParamPortDefinition, &port_def) != OMX_ErrorNone)
+			CHIAKI_LOGW(decoder->log, "OMX_SetParameter failed for input buffers, using the default ones");
+	}
+
 	if(ilclient_enable_port_buffers(decoder->video_decode, 130, NULL, NULL, NULL) != 0)
 	{
 		CHIAKI_LOGE(decoder->log, "ilclient_enable_port_buffers failed");
@@ -127,6 +145,18 @@ CHIAKI_EXPORT void chiaki_pi_decoder_fini(ChiakiPiDecoder *decoder)
 {
 	if(decoder->video_decode)
 	{
+		// return the buffers held for frames in assembly
+		for(size_t i=0; i<CHIAKI_VIDEO_FRAME_SLOTS; i++)
+		{
+			OMX_BUFFERHEADERTYPE *au_buf = decoder->au_bufs[i];
+			if(!au_buf)
+				continue;
+			au_buf->nFilledLen = 0;
+			au_buf->nFlags = 0;
+			OMX_EmptyThisBuffer(ILC_GET_HANDLE(decoder->video_decode), au_buf);
+			decoder->au_bufs[i] = NULL;
+		}
+
 		OMX_BUFFERHEADERTYPE *buf;
 		if((buf = ilclient_get_input_buffer(decoder->video_decode, 130, 1)))
 		{
@@ -154,6 +184,40 @@ CHIAKI_EXPORT void chiaki_pi_decoder_fini(ChiakiPiDecoder *decoder)
 		ilclient_destroy(decoder->client);
 }
 
+/**
+ * Pass a filled input buffer on to the decoder, setting up the tunnel once the stream format is known.
+ */
+static bool empty_buffer(ChiakiPiDecoder *decoder, OMX_BUFFERHEADERTYPE *omx_buf)
+{
+	if(decoder->first_packet)
+	{
+		omx_buf->nFlags |= OMX_BUFFERFLAG_STARTTIME;
+		decoder->first_packet = false;
+	}
+
+	if(!decoder->port_settings_changed
+		&& ((omx_buf->nFilledLen > 0 && ilclient_remove_event(decoder->video_decode, OMX_EventPortSettingsChanged, 131, 0, 0, 1) == 0)
+			|| (omx_buf->nFilledLen == 0 && ilclient_wait_for_event(decoder->video_decode, OMX_EventPortSettingsChanged, 131, 0, 0, 1, ILCLIENT_EVENT_ERROR | ILCLIENT_PARAMETER_CHANGED, 10000) == 0)))
+	{
+		decoder->port_settings_changed = true;
+
+		if(ilclient_setup_tunnel(decoder->tunnel, 0, 0) != 0)
+		{
+			CHIAKI_LOGE(decoder->log, "ilclient_setup_tunnel failed");
+			return false;
+		}
+
+		ilclient_change_component_state(decoder->video_render, OMX_StateExecuting);
+	}
+
+	if(OMX_EmptyThisBuffer(ILC_GET_HANDLE(decoder->video_decode), omx_buf) != OMX_ErrorNone)
+	{
+		CHIAKI_LOGE(decoder->log, "OMX_EmptyThisBuffer failed");
+		return false;
+	}
+	return true;
+}
+
 static bool push_buffer(ChiakiPiDecoder *decoder, uint8_t *buf, size_t buf_size)
 {
 	while(buf_size)
@@ -179,32 +243,8 @@ static bool push_buffer(ChiakiPiDecoder *decoder, uint8_t *buf, size_t buf_size)
 		omx_buf->nFlags = 0;
 		if(!buf_size)
 			omx_buf->nFlags |= OMX_BUFFERFLAG_ENDOFFRAME;
-		if(decoder->first_packet)
-		{
-			omx_buf->nFlags |= OMX_BUFFERFLAG_STARTTIME;
-			decoder->first_packet = false;
-		}
-
-		if(!decoder->port_settings_changed
-			&& ((omx_buf->nFilledLen > 0 && ilclient_remove_event(decoder->video_decode, OMX_EventPortSettingsChanged, 131, 0, 0, 1) == 0)
-				|| (omx_buf->nFilledLen == 0 && ilclient_wait_for_event(decoder->video_decode, OMX_EventPortSettingsChanged, 131, 0, 0, 1, ILCLIENT_EVENT_ERROR | ILCLIENT_PARAMETER_CHANGED, 10000) == 0)))
-		{
-			decoder->port_settings_changed = true;
-
-			if(ilclient_setup_tunnel(decoder->tunnel, 0, 0) != 0)
-			{
-				CHIAKI_LOGE(decoder->log, "ilclient_setup_tunnel failed");
-				return false;
-			}
-
-			ilclient_change_component_state(decoder->video_render, OMX_StateExecuting);
-		}
-
-		if(OMX_EmptyThisBuffer(ILC_GET_HANDLE(decoder->video_decode), omx_buf) != OMX_ErrorNone)
-		{
-			CHIAKI_LOGE(decoder->log, "OMX_EmptyThisBuffer failed");
+		if(!empty_buffer(decoder, omx_buf))
 			return false;
-		}
 	}
 	return true;
 }
@@ -236,7 +276,39 @@ CHIAKI_EXPORT void chiaki_pi_decoder_set_params(ChiakiPiDecoder *decoder, int x,
 		CHIAKI_LOGE(decoder->log, "OMX_SetParameter failed for display params");
 }
 
+CHIAKI_EXPORT uint8_t *chiaki_pi_decoder_au_buffer_cb(size_t size, void *user)
+{
+	ChiakiPiDecoder *decoder = user;
+
+	// the frame assembled in this one was dropped if it was not emptied by now, so it can be reused
+	OMX_BUFFERHEADERTYPE **au_buf = &decoder->au_bufs[decoder->au_buf_next];
+	decoder->au_buf_next = (decoder->au_buf_next + 1) % CHIAKI_VIDEO_FRAME_SLOTS;
+	if(!*au_buf)
+	{
+		// don't block the receiving thread, the frame is copied later if the decoder holds all buffers
+		*au_buf = ilclient_get_input_buffer(decoder->video_decode, 130, 0);
+		if(!*au_buf)
+			return NULL;
+	}
+	if(size > (*au_buf)->nAllocLen)
+		return NULL; // stays held for the next frame
+	return (*au_buf)->pBuffer;
+}
+
 CHIAKI_EXPORT bool chiaki_pi_decoder_video_sample_cb(uint8_t *buf, size_t buf_size, void *user)
 {
-	return push_buffer(user, buf, buf_size);
+	ChiakiPiDecoder *decoder = user;
+	for(size_t i=0; i<CHIAKI_VIDEO_FRAME_SLOTS; i++)
+	{
+		OMX_BUFFERHEADERTYPE *omx_buf = decoder->au_bufs[i];
+		if(!omx_buf || buf < omx_buf->pBuffer || buf + buf_size > omx_buf->pBuffer + omx_buf->nAllocLen)
+			continue;
+		// assembled in place, hand it over as it is
+		decoder->au_bufs[i] = NULL;
+		omx_buf->nOffset = buf - omx_buf->pBuffer;
+		omx_buf->nFilledLen = buf_size;
+		omx_buf->nFlags = OMX_BUFFERFLAG_ENDOFFRAME;
+		return empty_buffer(decoder, omx_buf);
+	}
+	return push_buffer(decoder, buf, buf_size);
 }
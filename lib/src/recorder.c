@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/recorder.h>
+#include <chiaki/time.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+static void *recorder_thread_func(void *user);
+
+static void write_u32(uint8_t *buf, uint32_t v)
+{
+	for(size_t i=0; i<4; i++)
+		buf[i] = (uint8_t)(v >> (8 * i));
+}
+
+static void write_u64(uint8_t *buf, uint64_t v)
+{
+	for(size_t i=0; i<8; i++)
+		buf[i] = (uint8_t)(v >> (8 * i));
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_recorder_init(ChiakiRecorder *recorder, const char *filename, size_t queue_size)
+{
+	memset(recorder, 0, sizeof(*recorder));
+	recorder->queue_size = queue_size;
+	recorder->queue = malloc(queue_size);
+	if(!recorder->queue)
+		return CHIAKI_ERR_MEMORY;
+
+	ChiakiErrorCode err = CHIAKI_ERR_UNKNOWN;
+	recorder->file = fopen(filename, "wb");
+	if(!recorder->file)
+		goto error_queue;
+	if(fwrite(CHIAKI_RECORDER_MAGIC, 1, CHIAKI_RECORDER_MAGIC_SIZE, recorder->file) != CHIAKI_RECORDER_MAGIC_SIZE)
+		goto error_file;
+
+	err = chiaki_mutex_init(&recorder->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_file;
+	err = chiaki_cond_init(&recorder->cond, &recorder->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	recorder->start_us = chiaki_time_now_monotonic_us();
+	err = chiaki_thread_create_role(&recorder->thread, recorder_thread_func, recorder, CHIAKI_THREAD_ROLE_RECORDER);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_cond;
+	return CHIAKI_ERR_SUCCESS;
+
+error_cond:
+	chiaki_cond_fini(&recorder->cond);
+error_mutex:
+	chiaki_mutex_fini(&recorder->mutex);
+error_file:
+	fclose(recorder->file);
+error_queue:
+	free(recorder->queue);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_recorder_fini(ChiakiRecorder *recorder)
+{
+	chiaki_mutex_lock(&recorder->mutex);
+	recorder->should_stop = true;
+	chiaki_cond_signal(&recorder->cond);
+	chiaki_mutex_unlock(&recorder->mutex);
+	chiaki_thread_join(&recorder->thread, NULL);
+
+	fclose(recorder->file);
+	chiaki_cond_fini(&recorder->cond);
+	chiaki_mutex_fini(&recorder->mutex);
+	free(recorder->queue);
+}
+
+static void *recorder_thread_func(void *user)
+{
+	ChiakiRecorder *recorder = user;
+	chiaki_mutex_lock(&recorder->mutex);
+	while(true)
+	{
+		while(!recorder->queue_used && !recorder->should_stop)
+			chiaki_cond_wait(&recorder->cond, &recorder->mutex);
+		// when stopping, only after everything has been written
+		if(!recorder->queue_used)
+			break;
+
+		// new frames only go behind these bytes, so they can be written without holding the mutex
+		size_t head = recorder->queue_head;
+		size_t used = recorder->queue_used;
+		bool failed = recorder->stats.failed;
+		chiaki_mutex_unlock(&recorder->mutex);
+
+		size_t first = recorder->queue_size - head;
+		if(first > used)
+			first = used;
+		uint64_t start_us = chiaki_time_now_monotonic_us();
+		bool ok = failed || (fwrite(recorder->queue + head, 1, first, recorder->file) == first
+			&& (used == first || fwrite(recorder->queue, 1, used - first, recorder->file) == used - first));
+		uint64_t write_us = chiaki_time_now_monotonic_us() - start_us;
+
+		chiaki_mutex_lock(&recorder->mutex);
+		recorder->queue_head = (head + used) % recorder->queue_size;
+		recorder->queue_used -= used;
+		recorder->stats.write_us += write_us;
+		if(!failed)
+			recorder->stats.bytes_written += used;
+		if(!ok)
+			recorder->stats.failed = true;
+	}
+	chiaki_mutex_unlock(&recorder->mutex);
+	return NULL;
+}
+
+/**
+ * Must be called with the mutex locked and enough free space in the queue.
+ */
+static void recorder_queue_copy(ChiakiRecorder *recorder, const uint8_t *buf, size_t buf_size)
+{
+	size_t tail = (recorder->queue_head + recorder->queue_used) % recorder->queue_size;
+	size_t first = recorder->queue_size - tail;
+	if(first > buf_size)
+		first = buf_size;
+	memcpy(recorder->queue + tail, buf, first);
+	memcpy(recorder->queue, buf + first, buf_size - first);
+	recorder->queue_used += buf_size;
+}
+
+static void recorder_push(ChiakiRecorder *recorder, ChiakiRecorderRecordType type, const uint8_t *payload, size_t payload_size, bool keyframe)
+{
+	uint64_t start_us = chiaki_time_now_monotonic_us();
+	uint8_t header[CHIAKI_RECORDER_RECORD_HEADER_SIZE];
+	write_u32(header, (uint32_t)type);
+	write_u32(header + 4, (uint32_t)payload_size);
+	write_u64(header + 8, start_us - recorder->start_us);
+	size_t size = sizeof(header) + payload_size;
+	bool video = type == CHIAKI_RECORDER_RECORD_VIDEO;
+
+	chiaki_mutex_lock(&recorder->mutex);
+	if(video && keyframe)
+		recorder->video_resync = false;
+	if(recorder->stats.failed || (video && recorder->video_resync) || recorder->queue_size - recorder->queue_used < size)
+	{
+		recorder->stats.frames_dropped++;
+		recorder->stats.bytes_dropped += payload_size;
+		if(video)
+			recorder->video_resync = true;
+	}
+	else
+	{
+		recorder_queue_copy(recorder, header, sizeof(header));
+		recorder_queue_copy(recorder, payload, payload_size);
+		recorder->stats.frames_written++;
+		if(recorder->queue_used > recorder->stats.queue_peak)
+			recorder->stats.queue_peak = recorder->queue_used;
+		chiaki_cond_signal(&recorder->cond);
+	}
+	recorder->stats.push_us += chiaki_time_now_monotonic_us() - start_us;
+	chiaki_mutex_unlock(&recorder->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_recorder_video(ChiakiRecorder *recorder, const uint8_t *buf, size_t buf_size, bool keyframe)
+{
+	recorder_push(recorder, CHIAKI_RECORDER_RECORD_VIDEO, buf, buf_size, keyframe);
+}
+
+CHIAKI_EXPORT void chiaki_recorder_audio_header(ChiakiRecorder *recorder, ChiakiAudioHeader *audio_header)
+{
+	uint8_t buf[CHIAKI_AUDIO_HEADER_SIZE];
+	chiaki_audio_header_save(audio_header, buf);
+	recorder_push(recorder, CHIAKI_RECORDER_RECORD_AUDIO_HEADER, buf, sizeof(buf), false);
+}
+
+CHIAKI_EXPORT void chiaki_recorder_audio(ChiakiRecorder *recorder, const uint8_t *buf, size_t buf_size)
+{
+	recorder_push(recorder, CHIAKI_RECORDER_RECORD_AUDIO, buf, buf_size, false);
+}
+
+CHIAKI_EXPORT void chiaki_recorder_get_stats(ChiakiRecorder *recorder, ChiakiRecorderStats *stats)
+{
+	chiaki_mutex_lock(&recorder->mutex);
+	*stats = recorder->stats;
+	chiaki_mutex_unlock(&recorder->mutex);
+}
@@ -27,10 +27,24 @@ typedef uint32_t in_addr_t;
 #define SEARCH_REQUEST_SLEEP_MS 100
 #define REGIST_SEARCH_TIMEOUT_MS 3000
 #define REGIST_REPONSE_TIMEOUT_MS 3000
+#define REGIST_SEARCH_RESEND_MS 500
+#define REGIST_SEARCH_PROBES_MAX CHIAKI_STOP_PIPE_WAITER_SOCKS_MAX
+
+/**
+ * A search socket for one of the resolved addresses of the host, all of them are probed at the same time
+ * and the first one the console answers on wins.
+ */
+typedef struct regist_search_probe_t
+{
+	chiaki_socket_t sock;
+	struct sockaddr_storage send_addr;
+	socklen_t send_addr_len;
+} RegistSearchProbe;
 
 static void *regist_thread_func(void *user);
 static ChiakiErrorCode regist_search(ChiakiRegist *regist, struct addrinfo *addrinfos, struct sockaddr *recv_addr, socklen_t *recv_addr_size);
-static chiaki_socket_t regist_search_connect(ChiakiRegist *regist, struct addrinfo *addrinfos, struct sockaddr *send_addr, socklen_t *send_addr_len);
+static size_t regist_search_connect(ChiakiRegist *regist, struct addrinfo *addrinfos, RegistSearchProbe *probes, size_t probes_max);
+static chiaki_socket_t regist_search_socket(ChiakiRegist *regist, struct sockaddr *send_addr, socklen_t send_addr_len);
 static chiaki_socket_t regist_request_connect(ChiakiRegist *regist, const struct sockaddr *addr, size_t addr_len);
 static ChiakiErrorCode regist_recv_response(ChiakiRegist *regist, ChiakiRegisteredHost *host, chiaki_socket_t sock, ChiakiRPCrypt *rpcrypt, uint16_t remote_counter, char *send_buf, size_t send_buf_size);
 static ChiakiErrorCode regist_parse_response_payload(ChiakiRegist *regist, ChiakiRegisteredHost *host, char *buf, size_t buf_size);
@@ -66,7 +80,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_regist_start(ChiakiRegist *regist, ChiakiLo
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_psn_id;
 
-	err = chiaki_thread_create(&regist->thread, regist_thread_func, regist);
+	err = chiaki_thread_create_role(&regist->thread, regist_thread_func, regist, CHIAKI_THREAD_ROLE_REGIST);
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_stop_pipe;
 
@@ -291,6 +305,10 @@ static void *regist_thread_func(void *user)
 	chiaki_socket_t sock = CHIAKI_INVALID_SOCKET;
 	uint16_t remote_counter = 0;
 	struct addrinfo *addrinfos;
+	// phases of a regular regist, logged at the end to see where the time goes
+	uint64_t start_ms = chiaki_time_now_monotonic_ms();
+	uint64_t search_ms = 0;
+	uint64_t connect_ms = 0;
 	if(psn)
 	{
 		CHIAKI_LOGI(regist->log, "REGIST - Starting RUDP session");
@@ -335,6 +353,7 @@ static void *regist_thread_func(void *user)
 				CHIAKI_LOGE(regist->log, "Regist search failed");
 			goto fail_addrinfos;
 		}
+		search_ms = chiaki_time_now_monotonic_ms() - start_ms;
 
 		err = chiaki_stop_pipe_sleep(&regist->stop_pipe, SEARCH_REQUEST_SLEEP_MS); // PS4 doesn't accept requests immediately
 		if(err != CHIAKI_ERR_TIMEOUT)
@@ -349,6 +368,7 @@ static void *regist_thread_func(void *user)
 			CHIAKI_LOGE(regist->log, "Regist eventually failed to connect for request");
 			goto fail_addrinfos;
 		}
+		connect_ms = chiaki_time_now_monotonic_ms() - start_ms - search_ms;
 		CHIAKI_LOGI(regist->log, "Regist connected to %s, sending request", regist->info.host);
 	}
 	if(!psn)
@@ -405,6 +425,13 @@ static void *regist_thread_func(void *user)
 	}
 
 	CHIAKI_LOGI(regist->log, "Regist successfully received response");
+	if(!psn)
+	{
+		uint64_t total_ms = chiaki_time_now_monotonic_ms() - start_ms;
+		CHIAKI_LOGI(regist->log, "Regist took %llu ms: search %llu ms, connect %llu ms (including %d ms delay), request and response %llu ms",
+				(unsigned long long)total_ms, (unsigned long long)search_ms, (unsigned long long)connect_ms,
+				SEARCH_REQUEST_SLEEP_MS, (unsigned long long)(total_ms - search_ms - connect_ms));
+	}
 
 	success = true;
 
@@ -436,90 +463,143 @@ fail:
 	return NULL;
 }
 
+static bool regist_search_send(ChiakiRegist *regist, RegistSearchProbe *probe, const char *src)
+{
+	int r;
+	if(regist->info.broadcast)
+		r = sendto_broadcast(regist->log, probe->sock, src, strlen(src) + 1, 0, (struct sockaddr *)&probe->send_addr, probe->send_addr_len);
+	else
+		// #ifdef __PSVITA__
+		// 	r = sceNetSend(sock, src, strlen(src) + 1, 0);
+		// #else
+			r = send(probe->sock, src, strlen(src) + 1, 0);
+		// #endif
+	if(r < 0)
+	{
+		char addr[64];
+		const char *addr_str = sockaddr_str((struct sockaddr *)&probe->send_addr, addr, sizeof(addr));
+		CHIAKI_LOGE(regist->log, "Regist failed to send search to %s: %s", addr_str ? addr_str : "", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
 static ChiakiErrorCode regist_search(ChiakiRegist *regist, struct addrinfo *addrinfos, struct sockaddr *recv_addr, socklen_t *recv_addr_size)
 {
 	CHIAKI_LOGI(regist->log, "Regist starting search");
-	struct sockaddr_in6 send_addr;
-	socklen_t send_addr_len = sizeof(send_addr);
-	chiaki_socket_t sock = regist_search_connect(regist, addrinfos, (struct sockaddr *)&send_addr, &send_addr_len);
-	if(CHIAKI_SOCKET_IS_INVALID(sock))
+	uint64_t start_ms = chiaki_time_now_monotonic_ms();
+	RegistSearchProbe probes[REGIST_SEARCH_PROBES_MAX];
+	size_t probes_count = regist_search_connect(regist, addrinfos, probes, REGIST_SEARCH_PROBES_MAX);
+	if(!probes_count)
 	{
 		CHIAKI_LOGE(regist->log, "Regist eventually failed to connect for search");
 		return CHIAKI_ERR_NETWORK;
 	}
 
-	ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
+	ChiakiStopPipeWaiter waiter;
+	ChiakiErrorCode err = chiaki_stop_pipe_waiter_init(&waiter, &regist->stop_pipe);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(regist->log, "Regist failed to init waiter for search");
+		goto done_probes;
+	}
+	for(size_t i=0; i<probes_count; i++)
+	{
+		err = chiaki_stop_pipe_waiter_add(&waiter, probes[i].sock, false);
+		if(err != CHIAKI_ERR_SUCCESS)
+			goto done;
+	}
 
 	const char *src = chiaki_target_is_ps5(regist->info.target) ? "SRC3" : "SRC2";
 	const char *res = chiaki_target_is_ps5(regist->info.target) ? "RES3" : "RES2";
 	size_t res_size = strlen(res);
 
-	CHIAKI_LOGI(regist->log, "Regist sending search packet");
-	int r;
-	if(regist->info.broadcast)
-		r = sendto_broadcast(regist->log, sock, src, strlen(src) + 1, 0, (struct sockaddr *)&send_addr, send_addr_len);
-	else
-		// #ifdef __PSVITA__
-		// 	r = sceNetSend(sock, src, strlen(src) + 1, 0);
-		// #else
-			r = send(sock, src, strlen(src) + 1, 0);
-		// #endif
-	if(r < 0)
-	{
-		CHIAKI_LOGE(regist->log, "Regist failed to send search: %s", strerror(errno));
-		err = CHIAKI_ERR_NETWORK;
-		goto done;
-	}
-
-	uint64_t timeout_abs_ms = chiaki_time_now_monotonic_ms() + REGIST_SEARCH_TIMEOUT_MS;
+	CHIAKI_LOGI(regist->log, "Regist sending search packets to %zu addresses", probes_count);
+	socklen_t recv_addr_capacity = *recv_addr_size;
+	uint64_t timeout_abs_ms = start_ms + REGIST_SEARCH_TIMEOUT_MS;
+	uint64_t send_next_ms = start_ms;
 	while(true)
 	{
 		uint64_t now_ms = chiaki_time_now_monotonic_ms();
-		if(now_ms > timeout_abs_ms)
-			err = CHIAKI_ERR_TIMEOUT;
-		else
-			err = chiaki_stop_pipe_select_single(&regist->stop_pipe, sock, false, timeout_abs_ms - now_ms);
-		if(err != CHIAKI_ERR_SUCCESS)
+		if(now_ms >= send_next_ms)
 		{
-			if(err == CHIAKI_ERR_TIMEOUT)
-				CHIAKI_LOGE(regist->log, "Regist timed out waiting for search response");
-			break;
+			// datagrams may be lost, so every address gets the search again until one answers
+			size_t sent = 0;
+			for(size_t i=0; i<probes_count; i++)
+				sent += regist_search_send(regist, &probes[i], src) ? 1 : 0;
+			if(!sent)
+			{
+				err = CHIAKI_ERR_NETWORK;
+				break;
+			}
+			send_next_ms = now_ms + REGIST_SEARCH_RESEND_MS;
 		}
-
-		uint8_t buf[0x100];
-		int n = recvfrom(sock, (CHIAKI_SOCKET_BUF_TYPE)buf, sizeof(buf) - 1, 0, recv_addr, recv_addr_size);
-		if(n <= 0)
+		if(now_ms >= timeout_abs_ms)
 		{
-			if(n < 0)
-				CHIAKI_LOGE(regist->log, "Regist failed to receive search response: %s", strerror(errno));
-			else
-				CHIAKI_LOGE(regist->log, "Regist failed to receive search response");
-			err = CHIAKI_ERR_NETWORK;
-			goto done;
+			CHIAKI_LOGE(regist->log, "Regist timed out waiting for search response");
+			err = CHIAKI_ERR_TIMEOUT;
+			break;
 		}
 
-		CHIAKI_LOGV(regist->log, "Regist received packet: %d >= %d", n, res_size);
-		chiaki_log_hexdump(regist->log, CHIAKI_LOG_VERBOSE, buf, n);
+		uint64_t wait_until_ms = send_next_ms < timeout_abs_ms ? send_next_ms : timeout_abs_ms;
+		uint32_t ready_mask = 0;
+		err = chiaki_stop_pipe_waiter_wait(&waiter, wait_until_ms - now_ms, &ready_mask);
+		if(err == CHIAKI_ERR_TIMEOUT)
+			continue;
+		if(err != CHIAKI_ERR_SUCCESS)
+			break;
 
-		if(n >= res_size && !memcmp(buf, res, res_size))
+		bool found = false;
+		for(size_t i=0; i<probes_count && !found; i++)
 		{
-			char addr[64];
-			const char *addr_str = sockaddr_str(recv_addr, addr, sizeof(addr));
-			CHIAKI_LOGI(regist->log, "Regist received search response from %s", addr_str ? addr_str : "");
-			break;
+			if(!(ready_mask & (1 << i)))
+				continue;
+			uint8_t buf[0x100];
+			*recv_addr_size = recv_addr_capacity;
+			int n = recvfrom(probes[i].sock, (CHIAKI_SOCKET_BUF_TYPE)buf, sizeof(buf) - 1, 0, recv_addr, recv_addr_size);
+			if(n <= 0)
+			{
+				// e.g. an unreachable address of a multi-homed host, the others may still answer
+				if(n < 0)
+					CHIAKI_LOGW(regist->log, "Regist failed to receive search response: %s", strerror(errno));
+				else
+					CHIAKI_LOGW(regist->log, "Regist failed to receive search response");
+				continue;
+			}
+
+			CHIAKI_LOGV(regist->log, "Regist received packet: %d >= %d", n, res_size);
+			chiaki_log_hexdump(regist->log, CHIAKI_LOG_VERBOSE, buf, n);
+
+			if(n >= res_size && !memcmp(buf, res, res_size))
+			{
+				char addr[64];
+				const char *addr_str = sockaddr_str(recv_addr, addr, sizeof(addr));
+				CHIAKI_LOGI(regist->log, "Regist received search response from %s after %llu ms",
+						addr_str ? addr_str : "", (unsigned long long)(chiaki_time_now_monotonic_ms() - start_ms));
+				found = true;
+			}
 		}
+		if(found)
+			break;
 	}
 
 done:
-	CHIAKI_SOCKET_CLOSE(sock);
-	sock = CHIAKI_INVALID_SOCKET;
+	chiaki_stop_pipe_waiter_fini(&waiter);
+done_probes:
+	for(size_t i=0; i<probes_count; i++)
+		CHIAKI_SOCKET_CLOSE(probes[i].sock);
 	return err;
 }
 
-static chiaki_socket_t regist_search_connect(ChiakiRegist *regist, struct addrinfo *addrinfos, struct sockaddr *send_addr, socklen_t *send_addr_len)
+/**
+ * Open a search socket for every usable address.
+ *
+ * @return number of probes filled
+ */
+static size_t regist_search_connect(ChiakiRegist *regist, struct addrinfo *addrinfos, RegistSearchProbe *probes, size_t probes_max)
 {
-	chiaki_socket_t sock = CHIAKI_INVALID_SOCKET;
-	for(struct addrinfo *ai=addrinfos; ai; ai=ai->ai_next)
+	size_t probes_count = 0;
+	for(struct addrinfo *ai=addrinfos; ai && probes_count < probes_max; ai=ai->ai_next)
 	{
 		//if(ai->ai_protocol != IPPROTO_UDP)
 		//	continue;
@@ -527,90 +607,100 @@ static chiaki_socket_t regist_search_connect(ChiakiRegist *regist, struct addrin
 		if(ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
 			continue;
 
-		if(ai->ai_addrlen > *send_addr_len)
+		RegistSearchProbe *probe = &probes[probes_count];
+		if(ai->ai_addrlen > sizeof(probe->send_addr))
+			continue;
+		memset(&probe->send_addr, 0, sizeof(probe->send_addr));
+		memcpy(&probe->send_addr, ai->ai_addr, ai->ai_addrlen);
+		probe->send_addr_len = (socklen_t)ai->ai_addrlen;
+		probe->sock = regist_search_socket(regist, (struct sockaddr *)&probe->send_addr, probe->send_addr_len);
+		if(CHIAKI_SOCKET_IS_INVALID(probe->sock))
 			continue;
-		memcpy(send_addr, ai->ai_addr, ai->ai_addrlen);
-		*send_addr_len = ai->ai_addrlen;
+		probes_count++;
+	}
 
-		set_port(send_addr, htons(REGIST_PORT));
+	return probes_count;
+}
 
-		sock = socket(send_addr->sa_family, SOCK_DGRAM, IPPROTO_UDP);
-		if(CHIAKI_SOCKET_IS_INVALID(sock))
-		{
-			CHIAKI_LOGE(regist->log, "Regist failed to create socket for search");
-			continue;
-		}
-		int r = 0;
-		if(regist->info.broadcast)
-		{
-			const int broadcast = 1;
+static chiaki_socket_t regist_search_socket(ChiakiRegist *regist, struct sockaddr *send_addr, socklen_t send_addr_len)
+{
+	set_port(send_addr, htons(REGIST_PORT));
+
+	chiaki_socket_t sock = socket(send_addr->sa_family, SOCK_DGRAM, IPPROTO_UDP);
+	if(CHIAKI_SOCKET_IS_INVALID(sock))
+	{
+		CHIAKI_LOGE(regist->log, "Regist failed to create socket for search");
+		return CHIAKI_INVALID_SOCKET;
+	}
+	int r = 0;
+	if(regist->info.broadcast)
+	{
+		const int broadcast = 1;
 #ifndef __PSVITA__
-			if(send_addr->sa_family == AF_INET)
+		if(send_addr->sa_family == AF_INET)
 #endif
+		{
+			r = setsockopt(sock, SOL_SOCKET, SO_BROADCAST, (const CHIAKI_SOCKET_BUF_TYPE)&broadcast, sizeof(broadcast));
+			if(r < 0)
 			{
-				r = setsockopt(sock, SOL_SOCKET, SO_BROADCAST, (const CHIAKI_SOCKET_BUF_TYPE)&broadcast, sizeof(broadcast));
-				if(r < 0)
-				{
 #ifdef _WIN32
-					CHIAKI_LOGE(regist->log, "Regist failed to setsockopt SO_BROADCAST, error %u", WSAGetLastError());
+				CHIAKI_LOGE(regist->log, "Regist failed to setsockopt SO_BROADCAST, error %u", WSAGetLastError());
 #elif defined(__PSVITA__)
-					CHIAKI_LOGE(regist->log, "Regist failed to setsockopt SO_BROADCAST, error 0x%x", r);
+				CHIAKI_LOGE(regist->log, "Regist failed to setsockopt SO_BROADCAST, error 0x%x", r);
 #else
-					CHIAKI_LOGE(regist->log, "Regist failed to setsockopt SO_BROADCAST");
+				CHIAKI_LOGE(regist->log, "Regist failed to setsockopt SO_BROADCAST");
 #endif
-					goto connect_fail;
-				}
-				in_addr_t ip = ((struct sockaddr_in *)send_addr)->sin_addr.s_addr;
-				((struct sockaddr_in *)send_addr)->sin_addr.s_addr = htonl(INADDR_ANY);
-				((struct sockaddr_in *)send_addr)->sin_port = 0;
-				((struct sockaddr_in *)send_addr)->sin_family = AF_INET;
-				r = bind(sock, send_addr, *send_addr_len);
-				((struct sockaddr_in *)send_addr)->sin_addr.s_addr = ip;
-			}
-#ifndef __PSVITA__
-			else
-			{
-				struct sockaddr_in6 host_addr;
-				host_addr.sin6_addr = in6addr_any;
-				host_addr.sin6_port = 0;
-				host_addr.sin6_family = AF_INET6;
-				r = bind(sock, (struct sockaddr *)&host_addr, sizeof(host_addr));
-			}
-#endif
-			if(r < 0)
-			{
-				CHIAKI_LOGE(regist->log, "Regist failed to bind socket");
 				goto connect_fail;
 			}
+			in_addr_t ip = ((struct sockaddr_in *)send_addr)->sin_addr.s_addr;
+			((struct sockaddr_in *)send_addr)->sin_addr.s_addr = htonl(INADDR_ANY);
+			((struct sockaddr_in *)send_addr)->sin_port = 0;
+			((struct sockaddr_in *)send_addr)->sin_family = AF_INET;
+			r = bind(sock, send_addr, send_addr_len);
+			((struct sockaddr_in *)send_addr)->sin_addr.s_addr = ip;
+			((struct sockaddr_in *)send_addr)->sin_port = htons(REGIST_PORT);
 		}
+#ifndef __PSVITA__
 		else
 		{
-			// #ifdef __PSVITA__
-			// int r = sceNetConnect(sock, (SceNetSockaddr*) send_addr, *send_addr_len);
-			// #else
-			int r = connect(sock, send_addr, *send_addr_len);
-			// #endif
-			if(r < 0)
-			{
+			struct sockaddr_in6 host_addr;
+			host_addr.sin6_addr = in6addr_any;
+			host_addr.sin6_port = 0;
+			host_addr.sin6_family = AF_INET6;
+			r = bind(sock, (struct sockaddr *)&host_addr, sizeof(host_addr));
+		}
+#endif
+		if(r < 0)
+		{
+			CHIAKI_LOGE(regist->log, "Regist failed to bind socket");
+			goto connect_fail;
+		}
+	}
+	else
+	{
+		// #ifdef __PSVITA__
+		// int r = sceNetConnect(sock, (SceNetSockaddr*) send_addr, send_addr_len);
+		// #else
+		int r = connect(sock, send_addr, send_addr_len);
+		// #endif
+		if(r < 0)
+		{
 #ifdef _WIN32
-				CHIAKI_LOGE(regist->log, "Regist connect failed, error %u", WSAGetLastError());
+			CHIAKI_LOGE(regist->log, "Regist connect failed, error %u", WSAGetLastError());
 #elif defined(__PSVITA__)
-				CHIAKI_LOGE(regist->log, "Regist connect failed, error 0x%x", r);
+			CHIAKI_LOGE(regist->log, "Regist connect failed, error 0x%x", r);
 #else
-				int errsv = errno;
-				CHIAKI_LOGE(regist->log, "Regist connect failed: %s", strerror(errsv));
+			int errsv = errno;
+			CHIAKI_LOGE(regist->log, "Regist connect failed: %s", strerror(errsv));
 #endif
-				goto connect_fail;
-			}
+			goto connect_fail;
 		}
-		break;
-
-connect_fail:
-		CHIAKI_SOCKET_CLOSE(sock);
-		sock = CHIAKI_INVALID_SOCKET;
 	}
-
 	return sock;
+
+connect_fail:
+	CHIAKI_SOCKET_CLOSE(sock);
+	return CHIAKI_INVALID_SOCKET;
 }
 
 static chiaki_socket_t regist_request_connect(ChiakiRegist *regist, const struct sockaddr *addr, size_t addr_len)
@@ -618,7 +708,7 @@ static chiaki_socket_t regist_request_connect(ChiakiRegist *regist, const struct
 	// #ifdef __PSVITA__
 	// 	chiaki_socket_t sock = sceNetSocket("", SCE_NET_AF_INET, SCE_NET_SOCK_STREAM, SCE_NET_IPPROTO_TCP);
 	// #else
-		chiaki_socket_t sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		chiaki_socket_t sock = socket(addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
 	// #endif
 	if(CHIAKI_SOCKET_IS_INVALID(sock))
 	{
@@ -77,6 +77,20 @@
 #define MSG_TYPE_REQ 0x06000000
 #define MSG_TYPE_RESP 0x07000000
 #define EXTRA_CANDIDATE_ADDRESSES 3
+// how long the NAT allocation measured by STUN is reused for following sessions on the same network
+#define STUN_CACHE_TTL_MS 120000
+// UPnP port mappings are leased and kept across sessions, renewed while in use when less than UPNP_RENEW_BEFORE_MS remain
+#define UPNP_LEASE_SEC 3600
+#define UPNP_RENEW_BEFORE_MS (10 * 60 * 1000)
+#define UPNP_CACHE_MAPPINGS_MAX 4
+// PSN data behind ChiakiHolepunchCache, refreshed in the background once older than 3/4 of its TTL
+#define PSN_CACHE_DEVICES_TTL_MS (10 * 60 * 1000)
+#define PSN_CACHE_WS_FQDN_TTL_MS (60 * 60 * 1000)
+#define PSN_CACHE_USER_PROFILE_URL_TTL_MS (60 * 60 * 1000)
+#define PSN_CACHE_REFRESH_CHECK_MS (60 * 1000)
+// connectivity checks: every pair retransmits its outstanding request on its own timer, backing off up to the max
+#define CHECK_RETRANSMIT_INITIAL_MS 100
+#define CHECK_RETRANSMIT_MAX_MS 500
 
 static const char oauth_header_fmt[] = "Authorization: Bearer %s";
 
@@ -176,21 +190,43 @@ typedef enum notification_type_t
     NOTIFICATION_TYPE_SESSION_DELETED = 1 << 5
 } NotificationType;
 
-typedef struct notification_t
+// set in notif_event besides the NotificationType bits when the waiting thread is canceled
+#define NOTIFICATION_EVENT_CANCEL (1u << 31)
+#define NOTIFICATION_RING_SIZE 32
+
+static const struct
 {
-    struct notification_t *next;
+    const char *data_type;
+    NotificationType type;
+} notification_data_types[] = {
+    { "psn:sessionManager:sys:remotePlaySession:created", NOTIFICATION_TYPE_SESSION_CREATED },
+    { "psn:sessionManager:sys:rps:members:created", NOTIFICATION_TYPE_MEMBER_CREATED },
+    { "psn:sessionManager:sys:rps:members:deleted", NOTIFICATION_TYPE_MEMBER_DELETED },
+    { "psn:sessionManager:sys:rps:customData1:updated", NOTIFICATION_TYPE_CUSTOM_DATA1_UPDATED },
+    { "psn:sessionManager:sys:rps:sessionMessage:created", NOTIFICATION_TYPE_SESSION_MESSAGE_CREATED },
+    { "psn:sessionManager:sys:remotePlaySession:deleted", NOTIFICATION_TYPE_SESSION_DELETED }
+};
 
+typedef struct notification_t
+{
+    uint64_t seq;
     NotificationType type;
     json_object* json;
-    char* json_buf;
-    size_t json_buf_size;
 } Notification;
 
-typedef struct notification_queue_t
+/**
+ * The notifications received over the websocket that have not been cleared yet, oldest first.
+ * A slot is only reused once its notification has been cleared, so one returned by wait_for_notification()
+ * stays valid until then.
+ */
+typedef struct notification_ring_t
 {
-    Notification *front, *rear;
-
-} NotificationQueue;
+    Notification slots[NOTIFICATION_RING_SIZE];
+    uint64_t begin; // seq of the oldest notification kept
+    uint64_t end; // seq of the next notification to arrive
+    uint64_t filtered; // only written by the websocket thread, discarded by type before parsing
+    uint64_t dropped; // discarded because the ring was full
+} NotificationRing;
 
 typedef enum session_state_t
 {
@@ -215,6 +251,52 @@ typedef enum session_state_t
     SESSION_STATE_DELETED = 1 << 17
 } SessionState;
 
+/**
+ * Phases of setting up a remote connection, timed to see where the time goes
+ */
+typedef enum holepunch_phase_t
+{
+    HOLEPUNCH_PHASE_SESSION_CREATE,
+    HOLEPUNCH_PHASE_SESSION_START,
+    HOLEPUNCH_PHASE_CTRL_OFFER,
+    HOLEPUNCH_PHASE_CTRL_CHECK,
+    HOLEPUNCH_PHASE_CTRL_ACCEPT,
+    HOLEPUNCH_PHASE_DATA_OFFER,
+    HOLEPUNCH_PHASE_DATA_CHECK,
+    HOLEPUNCH_PHASE_DATA_ACCEPT,
+    HOLEPUNCH_PHASE_COUNT
+} HolepunchPhase;
+
+typedef enum psn_cache_entry_type_t
+{
+    PSN_CACHE_ENTRY_DEVICES_PS4,
+    PSN_CACHE_ENTRY_DEVICES_PS5,
+    PSN_CACHE_ENTRY_WS_FQDN,
+    PSN_CACHE_ENTRY_USER_PROFILE_URL,
+    PSN_CACHE_ENTRY_COUNT
+} PsnCacheEntryType;
+
+typedef struct psn_cache_entry_t
+{
+    bool valid;
+    bool wanted; // used at least once, so it is kept fresh
+    uint64_t fetched_ms;
+    char *str; // websocket FQDN or user profile URL
+    ChiakiHolepunchDeviceInfo *devices;
+    size_t device_count;
+} PsnCacheEntry;
+
+typedef struct psn_cache_t
+{
+    ChiakiLog *log;
+    ChiakiMutex mutex; // guards everything below
+    char *oauth_token;
+    PsnCacheEntry entries[PSN_CACHE_ENTRY_COUNT];
+
+    ChiakiThread thread;
+    ChiakiBoolPredCond stop_cond;
+} PsnCache;
+
 typedef struct upnp_gateway_info_t
 {
     char lan_ip[INET6_ADDRSTRLEN];
@@ -249,7 +331,7 @@ typedef struct session_t
     StunServer stun_server_list_ipv6[10];
     size_t num_stun_servers;
     size_t num_stun_servers_ipv6;
-    UPNPGatewayInfo gw;
+    ChiakiMutex upnp_mutex; // guards upnp_cache against the websocket thread renewing leases
 
     uint8_t data1[16];
     uint8_t data2[16];
@@ -259,10 +341,12 @@ typedef struct session_t
     char client_local_ip[INET6_ADDRSTRLEN];
 
     CURLSH* curl_share;
+    ChiakiMutex curl_share_mutex[CURL_LOCK_DATA_LAST]; // one per kind of data shared, the websocket thread uses the share too
 
+    PsnCache *psn_cache; // may be NULL
     char* ws_fqdn;
     ChiakiThread ws_thread;
-    NotificationQueue* ws_notification_queue;
+    NotificationRing ws_notifications; // protected by notif_mutex
     bool ws_thread_should_stop;
     bool ws_open;
 
@@ -272,7 +356,7 @@ typedef struct session_t
     ChiakiStopPipe select_pipe;
 
     ChiakiMutex notif_mutex;
-    ChiakiCond notif_cond;
+    ChiakiEventFlags notif_event; // NotificationType bits of the notifications pushed, and NOTIFICATION_EVENT_CANCEL
 
     SessionState state;
     ChiakiMutex state_mutex;
@@ -284,6 +368,8 @@ typedef struct session_t
     chiaki_socket_t ctrl_sock;
     chiaki_socket_t data_sock;
 
+    uint64_t phase_us[HOLEPUNCH_PHASE_COUNT];
+
     ChiakiLog *log;
 } Session;
 
@@ -343,6 +429,11 @@ typedef struct session_message_t
 static ChiakiErrorCode make_oauth2_header(char** out, const char* token);
 static ChiakiErrorCode get_websocket_fqdn(
     Session *session, char **fqdn);
+static ChiakiErrorCode fetch_websocket_fqdn(
+    ChiakiLog *log, const char *oauth_header, CURLSH *curl_share, char **fqdn);
+static ChiakiErrorCode get_user_profile_url(Session *session, char **url);
+static ChiakiErrorCode fetch_user_profile_url(
+    ChiakiLog *log, const char *oauth_header, CURLSH *curl_share, char **url);
 static inline size_t curl_write_cb(
     void* ptr, size_t size, size_t nmemb, void* userdata);
 static void hex_to_bytes(const char* hex_str, uint8_t* bytes, size_t max_len);
@@ -350,6 +441,7 @@ static void bytes_to_hex(const uint8_t* bytes, size_t len, char* hex_str, size_t
 static void random_uuidv4(char* out);
 static void *websocket_thread_func(void *user);
 static NotificationType parse_notification_type(ChiakiLog *log, json_object* json);
+static NotificationType notification_type_from_data_type(const char *data_type, size_t data_type_size);
 static ChiakiErrorCode send_offer(Session *session, int req_id, Candidate *local_console_candidate, Candidate *local_candidates, Candidate *candidates_received, size_t num_candidates);
 static ChiakiErrorCode send_accept(Session *session, int req_id, Candidate *selected_candidate);
 static ChiakiErrorCode http_create_session(Session *session);
@@ -359,12 +451,18 @@ static ChiakiErrorCode http_ps4_session_wakeup(Session *session);
 static ChiakiErrorCode get_client_addr_local(Session *session, Candidate *local_console_candidate, char *out, size_t out_len);
 static ChiakiErrorCode upnp_get_gateway_info(ChiakiLog *log, UPNPGatewayInfo *info);
 static bool get_client_addr_remote_upnp(ChiakiLog *log, UPNPGatewayInfo *gw_info, char *out);
-static bool upnp_add_udp_port_mapping(ChiakiLog *log, UPNPGatewayInfo *gw_info, uint16_t port_internal, uint16_t port_external);
+static bool upnp_add_udp_port_mapping(ChiakiLog *log, UPNPGatewayInfo *gw_info, uint16_t port_internal, uint16_t port_external, uint32_t *lease_sec);
 static bool upnp_delete_udp_port_mapping(ChiakiLog *log, UPNPGatewayInfo *gw_info, uint16_t port_external);
+static ChiakiErrorCode upnp_cache_gateway(ChiakiLog *log, bool rediscover, UPNPGatewayInfo **gw, bool *cached);
+static uint16_t upnp_cache_port_free();
+static bool upnp_cache_mapping_acquire(ChiakiLog *log, uint16_t port);
+static void upnp_cache_mapping_release(uint16_t port);
+static void upnp_cache_renew(ChiakiLog *log);
 static bool get_client_addr_remote_stun(Session *session, char *address, uint16_t *port, chiaki_socket_t *sock, bool ipv4);
 static ChiakiErrorCode get_stun_servers(Session *session);
 // static bool get_mac_addr(ChiakiLog *log, uint8_t *mac_addr);
 static void log_session_state(Session *session);
+static void phase_done(Session *session, HolepunchPhase phase, uint64_t start_us);
 static ChiakiErrorCode decode_customdata1(const char *customdata1, uint8_t *out, size_t out_len);
 static ChiakiErrorCode check_candidates(
     Session *session, Candidate *local_candidates, Candidate *candidates_received, size_t num_candidates, chiaki_socket_t *out,
@@ -377,11 +475,10 @@ static ChiakiErrorCode wait_for_notification(
     uint16_t types, uint64_t timeout_ms);
 static ChiakiErrorCode clear_notification(
     Session *session, Notification *notification);
-static void notification_queue_free(NotificationQueue* queue);
-static NotificationQueue *createNq();
-static void dequeueNq(NotificationQueue *nq);
-static void enqueueNq(NotificationQueue *nq, Notification *notif);
-static Notification* newNotification(NotificationType type, json_object *json, char* json_buf, size_t json_buf_size);
+static NotificationType notification_type_from_payload(const char *buf, size_t buf_size);
+static bool notification_ring_push(NotificationRing *ring, NotificationType type, json_object *json);
+static void notification_ring_retire(NotificationRing *ring, uint64_t end);
+static void notification_ring_fini(Session *session);
 static void remove_substring(char *str, char *substring);
 
 static ChiakiErrorCode wait_for_session_message(
@@ -411,6 +508,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_holepunch_list_devices(
     ChiakiHolepunchDeviceInfo **devices, size_t *device_count,
     ChiakiLog *log)
 {
+    uint64_t start_us = chiaki_time_now_monotonic_us();
     CURL *curl = curl_easy_init();
     if(!curl)
     {
@@ -594,6 +692,8 @@ cleanup:
     free(oauth_header);
     free(response_data.data);
     curl_easy_cleanup(curl);
+    if (err == CHIAKI_ERR_SUCCESS)
+        CHIAKI_LOGI(log, "Holepunch device lookup took %.1f ms", (chiaki_time_now_monotonic_us() - start_us) / 1000.0);
     return err;
 }
 
@@ -603,6 +703,261 @@ CHIAKI_EXPORT void chiaki_holepunch_free_device_list(ChiakiHolepunchDeviceInfo**
     *devices = NULL;
 }
 
+static const uint64_t psn_cache_ttl_ms[PSN_CACHE_ENTRY_COUNT] = {
+    PSN_CACHE_DEVICES_TTL_MS,
+    PSN_CACHE_DEVICES_TTL_MS,
+    PSN_CACHE_WS_FQDN_TTL_MS,
+    PSN_CACHE_USER_PROFILE_URL_TTL_MS
+};
+
+static const char *const psn_cache_entry_names[PSN_CACHE_ENTRY_COUNT] = {
+    "PS4 device list",
+    "PS5 device list",
+    "websocket FQDN",
+    "user profile URL"
+};
+
+static void psn_cache_entry_clear(PsnCacheEntry *entry)
+{
+    free(entry->str);
+    free(entry->devices);
+    entry->str = NULL;
+    entry->devices = NULL;
+    entry->device_count = 0;
+    entry->valid = false;
+}
+
+/**
+ * Must be called with the mutex locked, takes ownership of str or devices.
+ */
+static void psn_cache_entry_put(PsnCache *cache, PsnCacheEntryType type, char *str, ChiakiHolepunchDeviceInfo *devices, size_t device_count)
+{
+    PsnCacheEntry *entry = &cache->entries[type];
+    psn_cache_entry_clear(entry);
+    entry->str = str;
+    entry->devices = devices;
+    entry->device_count = device_count;
+    entry->valid = true;
+    entry->wanted = true;
+    entry->fetched_ms = chiaki_time_now_monotonic_ms();
+}
+
+/**
+ * Must be called with the mutex locked.
+ */
+static bool psn_cache_entry_fresh(PsnCache *cache, PsnCacheEntryType type)
+{
+    PsnCacheEntry *entry = &cache->entries[type];
+    return entry->valid && chiaki_time_now_monotonic_ms() - entry->fetched_ms < psn_cache_ttl_ms[type];
+}
+
+/**
+ * Fetch an entry from PSN with the cache's token, without holding the mutex during the request.
+ */
+static ChiakiErrorCode psn_cache_fetch(PsnCache *cache, PsnCacheEntryType type)
+{
+    chiaki_mutex_lock(&cache->mutex);
+    char *token = strdup(cache->oauth_token);
+    chiaki_mutex_unlock(&cache->mutex);
+    if(!token)
+        return CHIAKI_ERR_MEMORY;
+
+    char *str = NULL;
+    ChiakiHolepunchDeviceInfo *devices = NULL;
+    size_t device_count = 0;
+    ChiakiErrorCode err;
+    if(type == PSN_CACHE_ENTRY_DEVICES_PS4 || type == PSN_CACHE_ENTRY_DEVICES_PS5)
+    {
+        err = chiaki_holepunch_list_devices(token,
+            type == PSN_CACHE_ENTRY_DEVICES_PS4 ? CHIAKI_HOLEPUNCH_CONSOLE_TYPE_PS4 : CHIAKI_HOLEPUNCH_CONSOLE_TYPE_PS5,
+            &devices, &device_count, cache->log);
+    }
+    else
+    {
+        char *oauth_header = NULL;
+        err = make_oauth2_header(&oauth_header, token);
+        if(err == CHIAKI_ERR_SUCCESS)
+        {
+            if(type == PSN_CACHE_ENTRY_WS_FQDN)
+                err = fetch_websocket_fqdn(cache->log, oauth_header, NULL, &str);
+            else
+                err = fetch_user_profile_url(cache->log, oauth_header, NULL, &str);
+            free(oauth_header);
+        }
+    }
+    free(token);
+    if(err != CHIAKI_ERR_SUCCESS)
+        return err;
+
+    chiaki_mutex_lock(&cache->mutex);
+    psn_cache_entry_put(cache, type, str, devices, device_count);
+    chiaki_mutex_unlock(&cache->mutex);
+    CHIAKI_LOGV(cache->log, "PSN cache fetched %s", psn_cache_entry_names[type]);
+    return CHIAKI_ERR_SUCCESS;
+}
+
+/**
+ * @return a copy of a fresh cached string entry, NULL if there is none
+ */
+static char *psn_cache_get_str(PsnCache *cache, PsnCacheEntryType type)
+{
+    chiaki_mutex_lock(&cache->mutex);
+    char *str = NULL;
+    cache->entries[type].wanted = true;
+    if(psn_cache_entry_fresh(cache, type))
+        str = strdup(cache->entries[type].str);
+    chiaki_mutex_unlock(&cache->mutex);
+    if(str)
+        CHIAKI_LOGV(cache->log, "PSN cache hit for %s", psn_cache_entry_names[type]);
+    return str;
+}
+
+static void psn_cache_put_str(PsnCache *cache, PsnCacheEntryType type, const char *str)
+{
+    char *copy = strdup(str);
+    if(!copy)
+        return;
+    chiaki_mutex_lock(&cache->mutex);
+    psn_cache_entry_put(cache, type, copy, NULL, 0);
+    chiaki_mutex_unlock(&cache->mutex);
+}
+
+static bool psn_cache_stopping(PsnCache *cache)
+{
+    chiaki_bool_pred_cond_lock(&cache->stop_cond);
+    bool stopping = cache->stop_cond.pred;
+    chiaki_bool_pred_cond_unlock(&cache->stop_cond);
+    return stopping;
+}
+
+static void *psn_cache_thread_func(void *user)
+{
+    PsnCache *cache = user;
+    ChiakiErrorCode err = chiaki_bool_pred_cond_lock(&cache->stop_cond);
+    if(err != CHIAKI_ERR_SUCCESS)
+        return NULL;
+    uint64_t wait_ms = 0; // the first round fetches what a connect needs right away
+    while(true)
+    {
+        err = chiaki_bool_pred_cond_timedwait(&cache->stop_cond, wait_ms);
+        if(err != CHIAKI_ERR_TIMEOUT)
+            break;
+        wait_ms = PSN_CACHE_REFRESH_CHECK_MS;
+        // requests take a while, stopping must not wait for them
+        chiaki_bool_pred_cond_unlock(&cache->stop_cond);
+        for(int type=0; type<PSN_CACHE_ENTRY_COUNT; type++)
+        {
+            chiaki_mutex_lock(&cache->mutex);
+            PsnCacheEntry *entry = &cache->entries[type];
+            bool refresh = entry->wanted && (!entry->valid
+                || chiaki_time_now_monotonic_ms() - entry->fetched_ms > psn_cache_ttl_ms[type] / 4 * 3);
+            chiaki_mutex_unlock(&cache->mutex);
+            if(!refresh || psn_cache_stopping(cache))
+                continue;
+            err = psn_cache_fetch(cache, (PsnCacheEntryType)type);
+            if(err != CHIAKI_ERR_SUCCESS)
+                CHIAKI_LOGW(cache->log, "PSN cache failed to refresh %s: %s", psn_cache_entry_names[type], chiaki_error_string(err));
+        }
+        err = chiaki_bool_pred_cond_lock(&cache->stop_cond);
+        if(err != CHIAKI_ERR_SUCCESS)
+            return NULL;
+    }
+    chiaki_bool_pred_cond_unlock(&cache->stop_cond);
+    return NULL;
+}
+
+CHIAKI_EXPORT PsnCache *chiaki_holepunch_cache_new(const char *psn_oauth2_token, ChiakiLog *log)
+{
+    PsnCache *cache = calloc(1, sizeof(PsnCache));
+    if(!cache)
+        return NULL;
+    cache->log = log;
+    cache->oauth_token = strdup(psn_oauth2_token);
+    if(!cache->oauth_token)
+        goto error_cache;
+    // what every connect needs
+    cache->entries[PSN_CACHE_ENTRY_DEVICES_PS5].wanted = true;
+    cache->entries[PSN_CACHE_ENTRY_WS_FQDN].wanted = true;
+
+    if(chiaki_mutex_init(&cache->mutex, false) != CHIAKI_ERR_SUCCESS)
+        goto error_token;
+    if(chiaki_bool_pred_cond_init(&cache->stop_cond) != CHIAKI_ERR_SUCCESS)
+        goto error_mutex;
+    if(chiaki_thread_create_role(&cache->thread, psn_cache_thread_func, cache, CHIAKI_THREAD_ROLE_HOLEPUNCH) != CHIAKI_ERR_SUCCESS)
+        goto error_stop_cond;
+    return cache;
+
+error_stop_cond:
+    chiaki_bool_pred_cond_fini(&cache->stop_cond);
+error_mutex:
+    chiaki_mutex_fini(&cache->mutex);
+error_token:
+    free(cache->oauth_token);
+error_cache:
+    free(cache);
+    return NULL;
+}
+
+CHIAKI_EXPORT void chiaki_holepunch_cache_free(PsnCache *cache)
+{
+    if(!cache)
+        return;
+    chiaki_bool_pred_cond_signal(&cache->stop_cond);
+    chiaki_thread_join(&cache->thread, NULL);
+    chiaki_bool_pred_cond_fini(&cache->stop_cond);
+    for(int type=0; type<PSN_CACHE_ENTRY_COUNT; type++)
+        psn_cache_entry_clear(&cache->entries[type]);
+    chiaki_mutex_fini(&cache->mutex);
+    free(cache->oauth_token);
+    free(cache);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_holepunch_cache_set_token(PsnCache *cache, const char *psn_oauth2_token)
+{
+    char *token = strdup(psn_oauth2_token);
+    if(!token)
+        return CHIAKI_ERR_MEMORY;
+    chiaki_mutex_lock(&cache->mutex);
+    free(cache->oauth_token);
+    cache->oauth_token = token;
+    chiaki_mutex_unlock(&cache->mutex);
+    return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_holepunch_cache_list_devices(PsnCache *cache,
+    ChiakiHolepunchConsoleType console_type, ChiakiHolepunchDeviceInfo **devices, size_t *device_count)
+{
+    PsnCacheEntryType type = console_type == CHIAKI_HOLEPUNCH_CONSOLE_TYPE_PS4 ? PSN_CACHE_ENTRY_DEVICES_PS4 : PSN_CACHE_ENTRY_DEVICES_PS5;
+    for(int attempt=0; attempt<2; attempt++)
+    {
+        chiaki_mutex_lock(&cache->mutex);
+        cache->entries[type].wanted = true;
+        if(psn_cache_entry_fresh(cache, type))
+        {
+            PsnCacheEntry *entry = &cache->entries[type];
+            *devices = malloc((entry->device_count ? entry->device_count : 1) * sizeof(ChiakiHolepunchDeviceInfo));
+            if(!*devices)
+            {
+                chiaki_mutex_unlock(&cache->mutex);
+                return CHIAKI_ERR_MEMORY;
+            }
+            memcpy(*devices, entry->devices, entry->device_count * sizeof(ChiakiHolepunchDeviceInfo));
+            *device_count = entry->device_count;
+            chiaki_mutex_unlock(&cache->mutex);
+            if(!attempt)
+                CHIAKI_LOGV(cache->log, "PSN cache hit for %s", psn_cache_entry_names[type]);
+            return CHIAKI_ERR_SUCCESS;
+        }
+        chiaki_mutex_unlock(&cache->mutex);
+        if(attempt)
+            break;
+        ChiakiErrorCode err = psn_cache_fetch(cache, type);
+        if(err != CHIAKI_ERR_SUCCESS)
+            return err;
+    }
+    return CHIAKI_ERR_UNKNOWN;
+}
+
 CHIAKI_EXPORT ChiakiHolepunchRegistInfo chiaki_get_regist_info(Session *session)
 {
     ChiakiHolepunchRegistInfo regist_info;
@@ -659,19 +1014,31 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_holepunch_generate_client_device_uid(
     return CHIAKI_ERR_SUCCESS;
 }
 
+static void curl_share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *user)
+{
+    Session *session = user;
+    chiaki_mutex_lock(&session->curl_share_mutex[data]);
+}
+
+static void curl_share_unlock(CURL *handle, curl_lock_data data, void *user)
+{
+    Session *session = user;
+    chiaki_mutex_unlock(&session->curl_share_mutex[data]);
+}
+
 CHIAKI_EXPORT Session* chiaki_holepunch_session_init(
     const char* psn_oauth2_token, ChiakiLog *log)
 {
     Session *session = malloc(sizeof(Session));
     if(!session)
         return NULL;
+    memset(session->phase_us, 0, sizeof(session->phase_us));
     make_oauth2_header(&session->oauth_header, psn_oauth2_token);
     session->log = log;
 
+    session->psn_cache = NULL;
     session->ws_fqdn = NULL;
-    session->ws_notification_queue = createNq();
-    if(!session->ws_notification_queue)
-        return NULL;
+    memset(&session->ws_notifications, 0, sizeof(session->ws_notifications));
     session->ws_thread_should_stop = false;
     session->ws_open = false;
     session->online_id = NULL;
@@ -692,12 +1059,11 @@ CHIAKI_EXPORT Session* chiaki_holepunch_session_init(
     session->stun_allocation_increment = -1;
     session->num_stun_servers = 0;
     session->num_stun_servers_ipv6 = 0;
-    session->gw.data = NULL;
 
     ChiakiErrorCode err;
     err = chiaki_mutex_init(&session->notif_mutex, false);
     assert(err == CHIAKI_ERR_SUCCESS);
-    err = chiaki_cond_init(&session->notif_cond, &session->notif_mutex);
+    err = chiaki_event_flags_init(&session->notif_event);
     assert(err == CHIAKI_ERR_SUCCESS);
     err = chiaki_stop_pipe_init(&session->notif_pipe);
     assert(err == CHIAKI_ERR_SUCCESS);
@@ -707,9 +1073,24 @@ CHIAKI_EXPORT Session* chiaki_holepunch_session_init(
     assert(err == CHIAKI_ERR_SUCCESS);
     err = chiaki_cond_init(&session->state_cond, &session->state_mutex);
     assert(err == CHIAKI_ERR_SUCCESS);
+    err = chiaki_mutex_init(&session->upnp_mutex, false);
+    assert(err == CHIAKI_ERR_SUCCESS);
 
     session->curl_share = curl_share_init();
     assert(session->curl_share != NULL);
+    // share DNS, TLS sessions and connections, so consecutive requests to the same PSN hosts skip the handshakes
+    for(int i=0; i < CURL_LOCK_DATA_LAST; i++)
+    {
+        err = chiaki_mutex_init(&session->curl_share_mutex[i], false);
+        assert(err == CHIAKI_ERR_SUCCESS);
+    }
+    curl_share_setopt(session->curl_share, CURLSHOPT_LOCKFUNC, curl_share_lock);
+    curl_share_setopt(session->curl_share, CURLSHOPT_UNLOCKFUNC, curl_share_unlock);
+    curl_share_setopt(session->curl_share, CURLSHOPT_USERDATA, session);
+    curl_share_setopt(session->curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(session->curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    if(curl_share_setopt(session->curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT) != CURLSHE_OK)
+        CHIAKI_LOGW(session->log, "Curl can't share connections, PSN requests will reconnect");
 
     chiaki_mutex_lock(&session->state_mutex);
     session->state = SESSION_STATE_INIT;
@@ -725,8 +1106,14 @@ CHIAKI_EXPORT Session* chiaki_holepunch_session_init(
     return session;
 }
 
+CHIAKI_EXPORT void chiaki_holepunch_session_set_cache(Session *session, PsnCache *cache)
+{
+    session->psn_cache = cache;
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_holepunch_session_create(Session* session)
 {
+    uint64_t start_us = chiaki_time_now_monotonic_us();
     ChiakiErrorCode err = get_websocket_fqdn(session, &session->ws_fqdn);
     if (err != CHIAKI_ERR_SUCCESS)
         goto cleanup_curlsh;
@@ -738,10 +1125,9 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_holepunch_session_create(Session* session)
         goto cleanup_curlsh;
     }
 
-    err = chiaki_thread_create(&session->ws_thread, websocket_thread_func, session);
+    err = chiaki_thread_create_role(&session->ws_thread, websocket_thread_func, session, CHIAKI_THREAD_ROLE_HOLEPUNCH);
     if (err != CHIAKI_ERR_SUCCESS)
         goto cleanup_curlsh;
-    chiaki_thread_set_name(&session->ws_thread, "Chiaki Holepunch WS");
     CHIAKI_LOGV(session->log, "chiaki_holepunch_session_create: Created websocket thread");
 
     chiaki_mutex_lock(&session->state_mutex);
@@ -854,6 +1240,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_holepunch_session_create(Session* session)
         chiaki_mutex_unlock(&session->state_mutex);
         clear_notification(session, notif);
     }
+    if (err == CHIAKI_ERR_SUCCESS)
+        phase_done(session, HOLEPUNCH_PHASE_SESSION_CREATE, start_us);
     return err;
 
 cleanup_thread:
@@ -865,16 +1253,11 @@ cleanup_curlsh:
         free(session->oauth_header);
     if (session->ws_fqdn)
         free(session->ws_fqdn);
-    if (session->ws_notification_queue)
-    {
-        chiaki_mutex_lock(&session->notif_mutex);
-        notification_queue_free(session->ws_notification_queue);
-        chiaki_mutex_unlock(&session->notif_mutex);
-    }
+    notification_ring_fini(session);
     chiaki_stop_pipe_fini(&session->notif_pipe);
     chiaki_mutex_fini(&session->notif_mutex);
     chiaki_stop_pipe_fini(&session->select_pipe);
-    chiaki_cond_fini(&session->notif_cond);
+    chiaki_event_flags_fini(&session->notif_event);
     chiaki_mutex_fini(&session->state_mutex);
     chiaki_cond_fini(&session->state_cond);
     return err;
@@ -884,6 +1267,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_holepunch_session_start(
     Session* session, const uint8_t* device_uid,
     ChiakiHolepunchConsoleType console_type)
 {
+    uint64_t start_us = chiaki_time_now_monotonic_us();
     if (!(session->state & SESSION_STATE_CREATED))
     {
         CHIAKI_LOGE(session->log, "chiaki_holepunch_session_start: Holepunch session not created yet");
@@ -1037,20 +1421,18 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_holepunch_session_start(
         chiaki_mutex_unlock(&session->state_mutex);
     }
     chiaki_mutex_unlock(&session->state_mutex);
+    if (err == CHIAKI_ERR_SUCCESS)
+        phase_done(session, HOLEPUNCH_PHASE_SESSION_START, start_us);
     return err;
 }
 
 /**
- * Wakes up and connects to the main PS4 console connected to a PSN account
- * (only main console can be used for remote connection via PSN due to a limitation imposed by Sony)
+ * Get the base URL of the user profile API, which the PS4 wakeup is sent to.
  *
- * @param session
- * @param[in] json The pointer to the json object of the notification
- * @param[in] json_buf A pointer to the char representation of the json
- * @param[in] json_buf_size The length of the char representation of the json
- * @return notif Created notification
-*/
-static ChiakiErrorCode http_ps4_session_wakeup(Session *session)
+ * @param curl_share may be NULL
+ * @param[out] url set to the URL, must be freed by the caller
+ */
+static ChiakiErrorCode fetch_user_profile_url(ChiakiLog *log, const char *oauth_header, CURLSH *curl_share, char **url)
 {
     HttpResponseData response_data = {
         .data = malloc(0),
@@ -1060,18 +1442,18 @@ static ChiakiErrorCode http_ps4_session_wakeup(Session *session)
     CURL *curl = curl_easy_init();
     if(!curl)
     {
-        CHIAKI_LOGE(session->log, "Curl could not init");
+        CHIAKI_LOGE(log, "Curl could not init");
         return CHIAKI_ERR_MEMORY;
     }
 
     struct curl_slist *headers = NULL;
-    headers = curl_slist_append(headers, session->oauth_header);
+    headers = curl_slist_append(headers, oauth_header);
     headers = curl_slist_append(headers, "Host: asm.np.community.playstation.net");
     headers = curl_slist_append(headers, "Connection: Keep-Alive");
     headers = curl_slist_append(headers, "Content-Type: application/json; charset=utf-8");
     headers = curl_slist_append(headers, "User-Agent: RpNetHttpUtilImpl");
 
-    curl_easy_setopt(curl, CURLOPT_SHARE, session->curl_share);
+    curl_easy_setopt(curl, CURLOPT_SHARE, curl_share);
     curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
     curl_easy_setopt(curl, CURLOPT_TIMEOUT, 2L);
     curl_easy_setopt(curl, CURLOPT_URL, user_profile_url);
@@ -1082,18 +1464,18 @@ static ChiakiErrorCode http_ps4_session_wakeup(Session *session)
     ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
     CURLcode res = curl_easy_perform(curl);
     curl_slist_free_all(headers);
-    CHIAKI_LOGV(session->log, "http_ps4_session_wakeup: Received JSON:\n%.*s", response_data.size, response_data.data);
+    CHIAKI_LOGV(log, "fetch_user_profile_url: Received JSON:\n%.*s", response_data.size, response_data.data);
     if (res != CURLE_OK)
     {
         if (res == CURLE_HTTP_RETURNED_ERROR)
         {
             long http_code = 0;
             curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
-            CHIAKI_LOGE(session->log, "http_ps4_session_wakeup: Retrieving profile information for PS4 wakeup command failed with HTTP code %ld.", http_code);
-            CHIAKI_LOGV(session->log, "Response Body: %.*s.", response_data.size, response_data.data);
+            CHIAKI_LOGE(log, "fetch_user_profile_url: Retrieving profile information for PS4 wakeup command failed with HTTP code %ld.", http_code);
+            CHIAKI_LOGV(log, "Response Body: %.*s.", response_data.size, response_data.data);
             err = CHIAKI_ERR_HTTP_NONOK;
         } else {
-            CHIAKI_LOGE(session->log, "http_ps4_session_wakeup: Retrieving profile information for PS4 wakeup command failed with CURL error %d.", res);
+            CHIAKI_LOGE(log, "fetch_user_profile_url: Retrieving profile information for PS4 wakeup command failed with CURL error %d.", res);
             err = CHIAKI_ERR_NETWORK;
         }
         goto cleanup;
@@ -1102,13 +1484,14 @@ static ChiakiErrorCode http_ps4_session_wakeup(Session *session)
     json_tokener *tok = json_tokener_new();
     if(!tok)
     {
-        CHIAKI_LOGE(session->log, "Couldn't create new json tokener");
+        CHIAKI_LOGE(log, "Couldn't create new json tokener");
+        err = CHIAKI_ERR_MEMORY;
         goto cleanup;
     }
     json_object *json = json_tokener_parse_ex(tok, response_data.data, response_data.size);
     if (json == NULL)
     {
-        CHIAKI_LOGE(session->log, "http_ps4_session_wakeup: Parsing JSON failed");
+        CHIAKI_LOGE(log, "fetch_user_profile_url: Parsing JSON failed");
         err = CHIAKI_ERR_UNKNOWN;
         goto cleanup_json_tokener;
     }
@@ -1121,20 +1504,71 @@ static ChiakiErrorCode http_ps4_session_wakeup(Session *session)
         || !json_object_is_type(user_profile_url_json, json_type_string));
     if (schema_bad)
     {
-        CHIAKI_LOGE(session->log, "http_ps4_session_wakeup: Unexpected JSON schema, could not parse user profile url");
-        CHIAKI_LOGV(session->log, json_object_to_json_string_ext(json, JSON_C_TO_STRING_PRETTY));
+        CHIAKI_LOGE(log, "fetch_user_profile_url: Unexpected JSON schema, could not parse user profile url");
+        CHIAKI_LOGV(log, json_object_to_json_string_ext(json, JSON_C_TO_STRING_PRETTY));
         err = CHIAKI_ERR_UNKNOWN;
         goto cleanup_json;
     }
 
     const char *user_profile_url = json_object_get_string(user_profile_url_json);
-    if (!user_profile_url)
+    if (!user_profile_url || strlen(user_profile_url) >= 128)
     {
-        CHIAKI_LOGE(session->log, "http_ps4_session_wakeup: Could not extract user profile url string.");
+        CHIAKI_LOGE(log, "fetch_user_profile_url: Could not extract user profile url string.");
         err = CHIAKI_ERR_UNKNOWN;
         goto cleanup_json;
     }
 
+    *url = strdup(user_profile_url);
+    if(!*url)
+        err = CHIAKI_ERR_MEMORY;
+
+cleanup_json:
+    json_object_put(json);
+cleanup_json_tokener:
+    json_tokener_free(tok);
+cleanup:
+    curl_easy_cleanup(curl);
+    free(response_data.data);
+    return err;
+}
+
+static ChiakiErrorCode get_user_profile_url(Session *session, char **url)
+{
+    if(session->psn_cache)
+    {
+        *url = psn_cache_get_str(session->psn_cache, PSN_CACHE_ENTRY_USER_PROFILE_URL);
+        if(*url)
+            return CHIAKI_ERR_SUCCESS;
+    }
+    ChiakiErrorCode err = fetch_user_profile_url(session->log, session->oauth_header, session->curl_share, url);
+    if(err == CHIAKI_ERR_SUCCESS && session->psn_cache)
+        psn_cache_put_str(session->psn_cache, PSN_CACHE_ENTRY_USER_PROFILE_URL, *url);
+    return err;
+}
+
+/**
+ * Wakes up and connects to the main PS4 console connected to a PSN account
+ * (only main console can be used for remote connection via PSN due to a limitation imposed by Sony)
+ *
+ * @param session
+ * @param[in] json The pointer to the json object of the notification
+ * @param[in] json_buf A pointer to the char representation of the json
+ * @param[in] json_buf_size The length of the char representation of the json
+ * @return notif Created notification
+*/
+static ChiakiErrorCode http_ps4_session_wakeup(Session *session)
+{
+    char *user_profile_url = NULL;
+    ChiakiErrorCode err = get_user_profile_url(session, &user_profile_url);
+    if(err != CHIAKI_ERR_SUCCESS)
+        return err;
+
+    HttpResponseData response_data = {
+        .data = malloc(0),
+        .size = 0,
+    };
+    struct curl_slist *headers = NULL;
+
     char host_url_starter[128];
     char host_url[128];
     memcpy(host_url, user_profile_url, strlen(user_profile_url) + 1);
@@ -1157,11 +1591,6 @@ static ChiakiErrorCode http_ps4_session_wakeup(Session *session)
     if(!(ptr == (host_url_starter + strlen(host_url_starter))))
         strcpy(host_url, ptr);
 
-    curl_easy_cleanup(curl);
-    free(response_data.data);
-    response_data.data = malloc(0);
-    response_data.size = 0;
-    headers = NULL;
     char url[128] = {0};
     snprintf(url, sizeof(url), wakeup_url_fmt, user_profile_url, session->online_id);
 
@@ -1176,12 +1605,12 @@ static ChiakiErrorCode http_ps4_session_wakeup(Session *session)
         data2_base64,
         session->session_id);
 
-    curl = curl_easy_init();
+    CURL *curl = curl_easy_init();
     if(!curl)
     {
         CHIAKI_LOGE(session->log, "Curl could not init");
-        json_object_put(json);
-        json_tokener_free(tok);
+        free(response_data.data);
+        free(user_profile_url);
         return CHIAKI_ERR_MEMORY;
     }
 
@@ -1203,7 +1632,7 @@ static ChiakiErrorCode http_ps4_session_wakeup(Session *session)
 
     CHIAKI_LOGV(session->log, "http_ps4_session_wakeup: Sending JSON:\n%s", envelope_buf);
 
-    res = curl_easy_perform(curl);
+    CURLcode res = curl_easy_perform(curl);
     curl_slist_free_all(headers);
     CHIAKI_LOGV(session->log, "http_ps4_session_wakeup: Received JSON:\n%.*s", response_data.size, response_data.data);
     if (res != CURLE_OK)
@@ -1222,7 +1651,7 @@ static ChiakiErrorCode http_ps4_session_wakeup(Session *session)
             CHIAKI_LOGE(session->log, "http_ps4_session_wakeup: Waking up ps4 console failed with CURL error %d.", res);
             err = CHIAKI_ERR_NETWORK;
         }
-        goto cleanup_json;
+        goto cleanup;
     }
 
     chiaki_mutex_lock(&session->state_mutex);
@@ -1230,13 +1659,10 @@ static ChiakiErrorCode http_ps4_session_wakeup(Session *session)
     log_session_state(session);
     chiaki_mutex_unlock(&session->state_mutex);
 
-cleanup_json:
-    json_object_put(json);
-cleanup_json_tokener:
-    json_tokener_free(tok);
 cleanup:
     curl_easy_cleanup(curl);
     free(response_data.data);
+    free(user_profile_url);
 
     return err;
 }
@@ -1258,6 +1684,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_holepunch_session_punch_hole(Session* sessi
 
     ChiakiErrorCode err;
     Candidate *local_candidates = NULL;
+    bool ctrl = port_type == CHIAKI_HOLEPUNCH_PORT_TYPE_CTRL;
+    uint64_t phase_start_us = chiaki_time_now_monotonic_us();
 
     // NOTE: Needs to be kept around until the end, we're using the candidates in the message later on
     SessionMessage *console_offer_msg = NULL;
@@ -1351,6 +1779,9 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_holepunch_session_punch_hole(Session* sessi
         goto cleanup;
     }
 
+    phase_done(session, ctrl ? HOLEPUNCH_PHASE_CTRL_OFFER : HOLEPUNCH_PHASE_DATA_OFFER, phase_start_us);
+    phase_start_us = chiaki_time_now_monotonic_us();
+
     // Find candidate that we can use to connect to the console
     chiaki_socket_t sock = CHIAKI_INVALID_SOCKET;
     for(size_t i = 0; i < console_req->num_candidates; i++)
@@ -1366,6 +1797,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_holepunch_session_punch_hole(Session* sessi
             port_type == CHIAKI_HOLEPUNCH_PORT_TYPE_CTRL ? "control" : "data");
         goto cleanup;
     }
+    phase_done(session, ctrl ? HOLEPUNCH_PHASE_CTRL_CHECK : HOLEPUNCH_PHASE_DATA_CHECK, phase_start_us);
+    phase_start_us = chiaki_time_now_monotonic_us();
     if(session->main_should_stop)
     {
         session->main_should_stop = false;
@@ -1429,6 +1862,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_holepunch_session_punch_hole(Session* sessi
         goto cleanup;
     }
     memcpy(session->ps_ip, selected_candidate.addr, sizeof(session->ps_ip));
+    phase_done(session, ctrl ? HOLEPUNCH_PHASE_CTRL_ACCEPT : HOLEPUNCH_PHASE_DATA_ACCEPT, phase_start_us);
 
     chiaki_mutex_lock(&session->state_mutex);
     if(port_type == CHIAKI_HOLEPUNCH_PORT_TYPE_CTRL)
@@ -1529,25 +1963,13 @@ CHIAKI_EXPORT void chiaki_holepunch_session_fini(Session* session)
         chiaki_stop_pipe_stop(&session->select_pipe);
         chiaki_thread_join(&session->ws_thread, NULL);
     }
-    if(session->gw.data)
-    {
-        if(session->local_port_ctrl != 0)
-        {
-            if(upnp_delete_udp_port_mapping(session->log, &session->gw, session->local_port_ctrl))
-                CHIAKI_LOGI(session->log, "Deleted UPNP local port ctrl mapping");
-            else
-                CHIAKI_LOGE(session->log, "Couldn't delete UPNP local port ctrl mapping");
-        }
-        if(session->local_port_data != 0)
-        {
-            if(upnp_delete_udp_port_mapping(session->log, &session->gw, session->local_port_data))
-                CHIAKI_LOGI(session->log, "Deleted UPNP local port data mapping");
-            else
-                CHIAKI_LOGE(session->log, "Couldn't delete UPNP local port data mapping"); 
-        }
-        free(session->gw.data);
-        free(session->gw.urls);
-    }
+    // the mappings stay on the gateway until their lease ends, for the next session to reuse
+    chiaki_mutex_lock(&session->upnp_mutex);
+    if(session->local_port_ctrl != 0)
+        upnp_cache_mapping_release(session->local_port_ctrl);
+    if(session->local_port_data != 0)
+        upnp_cache_mapping_release(session->local_port_data);
+    chiaki_mutex_unlock(&session->upnp_mutex);
     if (session->oauth_header)
         free(session->oauth_header);
     if (session->online_id)
@@ -1556,12 +1978,7 @@ CHIAKI_EXPORT void chiaki_holepunch_session_fini(Session* session)
         curl_share_cleanup(session->curl_share);
     if (session->ws_fqdn)
         free(session->ws_fqdn);
-    if (session->ws_notification_queue)
-    {
-        chiaki_mutex_lock(&session->notif_mutex);
-        notification_queue_free(session->ws_notification_queue);
-        chiaki_mutex_unlock(&session->notif_mutex);
-    }
+    notification_ring_fini(session);
     for(int i=0; i < session->num_stun_servers; i++)
     {
         free(session->stun_server_list[i].host);
@@ -1573,9 +1990,12 @@ CHIAKI_EXPORT void chiaki_holepunch_session_fini(Session* session)
     chiaki_stop_pipe_fini(&session->select_pipe);
     chiaki_stop_pipe_fini(&session->notif_pipe);
     chiaki_mutex_fini(&session->notif_mutex);
-    chiaki_cond_fini(&session->notif_cond);
+    chiaki_event_flags_fini(&session->notif_event);
     chiaki_mutex_fini(&session->state_mutex);
     chiaki_cond_fini(&session->state_cond);
+    chiaki_mutex_fini(&session->upnp_mutex);
+    for(int i=0; i < CURL_LOCK_DATA_LAST; i++)
+        chiaki_mutex_fini(&session->curl_share_mutex[i]);
 }
 
 CHIAKI_EXPORT void chiaki_holepunch_main_thread_cancel(Session *session, bool stop_thread)
@@ -1588,16 +2008,22 @@ CHIAKI_EXPORT void chiaki_holepunch_main_thread_cancel(Session *session, bool st
     else
         CHIAKI_LOGI(session->log, "Canceling establishing connection over PSN");
     session->main_should_stop = true;
-    chiaki_cond_signal(&session->notif_cond);
+    chiaki_event_flags_set(&session->notif_event, NOTIFICATION_EVENT_CANCEL);
     chiaki_cond_signal(&session->state_cond);
 }
 
-void notification_queue_free(NotificationQueue *nq)
+/**
+ * Release all notifications still kept, must be called after the websocket thread has been joined.
+ */
+static void notification_ring_fini(Session *session)
 {
-    while(nq->front != NULL)
-    {
-        dequeueNq(nq);
-    }
+    chiaki_mutex_lock(&session->notif_mutex);
+    NotificationRing *ring = &session->ws_notifications;
+    notification_ring_retire(ring, ring->end);
+    chiaki_mutex_unlock(&session->notif_mutex);
+    if (ring->filtered || ring->dropped)
+        CHIAKI_LOGV(session->log, "Holepunch ignored %llu notifications by type, dropped %llu because too many were pending",
+            (unsigned long long)ring->filtered, (unsigned long long)ring->dropped);
 }
 
 static ChiakiErrorCode make_oauth2_header(char** out, const char* token)
@@ -1614,12 +2040,26 @@ static ChiakiErrorCode make_oauth2_header(char** out, const char* token)
  * Get the fully qualified domain name of the websocket server that we can
  * get PSN notifications from.
  *
- * @param[in] session Session instance
+ * @param[in] curl_share may be NULL
  * @param[out] fqdn Pointer to a char* that will be set to the FQDN of the
  *                 websocket server. Must be freed by the caller.
  * @return CHIAKI_ERR_SUCCESS on success, otherwise an error code
 */
 static ChiakiErrorCode get_websocket_fqdn(Session *session, char **fqdn)
+{
+    if(session->psn_cache)
+    {
+        *fqdn = psn_cache_get_str(session->psn_cache, PSN_CACHE_ENTRY_WS_FQDN);
+        if(*fqdn)
+            return CHIAKI_ERR_SUCCESS;
+    }
+    ChiakiErrorCode err = fetch_websocket_fqdn(session->log, session->oauth_header, session->curl_share, fqdn);
+    if(err == CHIAKI_ERR_SUCCESS && session->psn_cache)
+        psn_cache_put_str(session->psn_cache, PSN_CACHE_ENTRY_WS_FQDN, *fqdn);
+    return err;
+}
+
+static ChiakiErrorCode fetch_websocket_fqdn(ChiakiLog *log, const char *oauth_header, CURLSH *curl_share, char **fqdn)
 {
     HttpResponseData response_data = {
         .data = malloc(0),
@@ -1629,13 +2069,13 @@ static ChiakiErrorCode get_websocket_fqdn(Session *session, char **fqdn)
     CURL *curl = curl_easy_init();
     if(!curl)
     {
-        CHIAKI_LOGE(session->log, "Curl could not init");
+        CHIAKI_LOGE(log, "Curl could not init");
         return CHIAKI_ERR_MEMORY;
     }
     struct curl_slist *headers = NULL;
-    headers = curl_slist_append(headers, session->oauth_header);
+    headers = curl_slist_append(headers, oauth_header);
 
-    curl_easy_setopt(curl, CURLOPT_SHARE, session->curl_share);
+    curl_easy_setopt(curl, CURLOPT_SHARE, curl_share);
     curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
     curl_easy_setopt(curl, CURLOPT_URL, ws_fqdn_api_url);
     curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
@@ -1651,10 +2091,10 @@ static ChiakiErrorCode get_websocket_fqdn(Session *session, char **fqdn)
         {
             long http_code = 0;
             curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
-            CHIAKI_LOGE(session->log, "get_websocket_fqdn: Fetching websocket FQDN from %s failed with HTTP code %ld", ws_fqdn_api_url, http_code);
+            CHIAKI_LOGE(log, "fetch_websocket_fqdn: Fetching websocket FQDN from %s failed with HTTP code %ld", ws_fqdn_api_url, http_code);
             err = CHIAKI_ERR_HTTP_NONOK;
         } else {
-            CHIAKI_LOGE(session->log, "get_websocket_fqdn: Fetching websocket FQDN from %s failed with CURL error %d", ws_fqdn_api_url, res);
+            CHIAKI_LOGE(log, "fetch_websocket_fqdn: Fetching websocket FQDN from %s failed with CURL error %d", ws_fqdn_api_url, res);
             err = CHIAKI_ERR_NETWORK;
         }
         goto cleanup;
@@ -1663,29 +2103,32 @@ static ChiakiErrorCode get_websocket_fqdn(Session *session, char **fqdn)
     json_tokener *tok = json_tokener_new();
     if(!tok)
     {
-        CHIAKI_LOGE(session->log, "Couldn't create new json tokener");
+        CHIAKI_LOGE(log, "Couldn't create new json tokener");
+        err = CHIAKI_ERR_MEMORY;
         goto cleanup;
     }
     json_object *json = json_tokener_parse_ex(tok, response_data.data, response_data.size);
     if (json == NULL)
     {
-        CHIAKI_LOGE(session->log, "get_websocket_fqdn: Parsing JSON failed");
+        CHIAKI_LOGE(log, "fetch_websocket_fqdn: Parsing JSON failed");
         err = CHIAKI_ERR_UNKNOWN;
         goto cleanup_json_tokener;
     }
     json_object *fqdn_json;
     if (!json_object_object_get_ex(json, "fqdn", &fqdn_json))
     {
-        CHIAKI_LOGE(session->log, "get_websocket_fqdn: JSON does not contain \"fqdn\" field");
+        CHIAKI_LOGE(log, "fetch_websocket_fqdn: JSON does not contain \"fqdn\" field");
         err = CHIAKI_ERR_UNKNOWN;
         goto cleanup_json;
     } else if (!json_object_is_type(fqdn_json, json_type_string))
     {
-        CHIAKI_LOGE(session->log, "get_websocket_fqdn: JSON \"fqdn\" field is not a string");
+        CHIAKI_LOGE(log, "fetch_websocket_fqdn: JSON \"fqdn\" field is not a string");
         err = CHIAKI_ERR_UNKNOWN;
         goto cleanup_json;
     }
     *fqdn = strdup(json_object_get_string(fqdn_json));
+    if(!*fqdn)
+        err = CHIAKI_ERR_MEMORY;
 
 cleanup_json:
     json_object_put(json);
@@ -1884,6 +2327,10 @@ static void* websocket_thread_func(void *user) {
             CHIAKI_LOGV(session->log, "websocket_thread_func: PING.");
             last_ping_sent = now;
             expecting_pong = true;
+
+            chiaki_mutex_lock(&session->upnp_mutex);
+            upnp_cache_renew(session->log);
+            chiaki_mutex_unlock(&session->upnp_mutex);
         }
 
         memset(buf, 0, WEBSOCKET_MAX_FRAME_SIZE);
@@ -1937,6 +2384,14 @@ static void* websocket_thread_func(void *user) {
         if (meta->flags & CURLWS_TEXT || meta->flags & CURLWS_BINARY)
         {
             CHIAKI_LOGV(session->log, "websocket_thread_func: Received WebSocket frame with %d bytes of payload.", rlen);
+            // most pushes are of no interest here, those are discarded before building a json tree of them
+            NotificationType type = notification_type_from_payload(buf, rlen);
+            if (type == NOTIFICATION_TYPE_UNKNOWN)
+            {
+                CHIAKI_LOGV(session->log, "websocket_thread_func: Ignoring notification of unknown type");
+                session->ws_notifications.filtered++;
+                continue;
+            }
             json_object *json = json_tokener_parse_ex(tok, buf, rlen);
             if (json == NULL)
             {
@@ -1946,16 +2401,13 @@ static void* websocket_thread_func(void *user) {
             }
             CHIAKI_LOGV(session->log, json_object_to_json_string_ext(json, JSON_C_TO_STRING_PRETTY));
 
-            NotificationType type = parse_notification_type(session->log, json);
-            char *json_buf = malloc(rlen);
-            if(!json_buf)
-                goto cleanup_json;
-            memcpy(json_buf, buf, rlen);
-            size_t json_buf_size = rlen;
+            type = parse_notification_type(session->log, json);
+            if (type == NOTIFICATION_TYPE_UNKNOWN)
+            {
+                json_object_put(json);
+                continue;
+            }
             CHIAKI_LOGV(session->log, "Received notification of type %d", type);
-            Notification *notif = newNotification(type, json, json_buf, json_buf_size);
-            if(!notif)
-                goto cleanup_json;
 
             // Automatically ACK OFFER session messages if we're not currently explicitly
             // waiting on offers
@@ -1966,7 +2418,7 @@ static void* websocket_thread_func(void *user) {
                  && !(session->state & SESSION_STATE_CTRL_ESTABLISHED))
                  // At this point all offers were received and we don't care for new ones anymore
                 || session->state & SESSION_STATE_DATA_OFFER_RECEIVED;
-            if (should_ack_offers && notif->type == NOTIFICATION_TYPE_SESSION_MESSAGE_CREATED)
+            if (should_ack_offers && type == NOTIFICATION_TYPE_SESSION_MESSAGE_CREATED)
             {
                 SessionMessage *msg = NULL;
                 json_object *payload = session_message_get_payload(session->log, json);
@@ -1975,6 +2427,7 @@ static void* websocket_thread_func(void *user) {
                 if (err != CHIAKI_ERR_SUCCESS)
                 {
                     CHIAKI_LOGE(session->log, "websocket_thread_func: Failed to parse session message for ACKing.");
+                    json_object_put(json);
                     continue;
                 }
                 if (msg->action == SESSION_MESSAGE_ACTION_OFFER)
@@ -1992,10 +2445,16 @@ static void* websocket_thread_func(void *user) {
             }
             ChiakiErrorCode mutex_err = chiaki_mutex_lock(&session->notif_mutex);
             assert(mutex_err == CHIAKI_ERR_SUCCESS);
-            enqueueNq(session->ws_notification_queue, notif);
-            chiaki_cond_signal(&session->notif_cond);
+            bool pushed = notification_ring_push(&session->ws_notifications, type, json);
             chiaki_mutex_unlock(&session->notif_mutex);
-            if (notif->type == NOTIFICATION_TYPE_SESSION_DELETED)
+            if (pushed)
+                chiaki_event_flags_set(&session->notif_event, (uint32_t)type);
+            else
+            {
+                CHIAKI_LOGE(session->log, "websocket_thread_func: Too many notifications pending, dropping one of type %d", type);
+                json_object_put(json);
+            }
+            if (type == NOTIFICATION_TYPE_SESSION_DELETED)
             {
                 CHIAKI_LOGI(session->log, "websocket_thread_func: Holepunch session was deleted on PSN server, exiting....");
                 goto cleanup_json;
@@ -2028,30 +2487,54 @@ static NotificationType parse_notification_type(
     }
     const char* datatype_str = json_object_get_string(datatype);
 
-    if (strcmp(datatype_str, "psn:sessionManager:sys:remotePlaySession:created") == 0)
-    {
-        return NOTIFICATION_TYPE_SESSION_CREATED;
-    } else if (strcmp(datatype_str, "psn:sessionManager:sys:rps:members:created") == 0)
-    {
-        return NOTIFICATION_TYPE_MEMBER_CREATED;
-    } else if (strcmp(datatype_str, "psn:sessionManager:sys:rps:customData1:updated") == 0)
-    {
-        return NOTIFICATION_TYPE_CUSTOM_DATA1_UPDATED;
-    } else if (strcmp(datatype_str, "psn:sessionManager:sys:rps:sessionMessage:created") == 0)
-    {
-        return NOTIFICATION_TYPE_SESSION_MESSAGE_CREATED;
-    } else if (strcmp(datatype_str, "psn:sessionManager:sys:rps:members:deleted") == 0)
-    {
-        return NOTIFICATION_TYPE_MEMBER_DELETED;
-    } else if (strcmp(datatype_str, "psn:sessionManager:sys:remotePlaySession:deleted") == 0)
-    {
-        return NOTIFICATION_TYPE_SESSION_DELETED;
-    }else
+    NotificationType type = notification_type_from_data_type(datatype_str, strlen(datatype_str));
+    if (type == NOTIFICATION_TYPE_UNKNOWN)
     {
         CHIAKI_LOGW(log, "parse_notification_type: Unknown notification type \"%s\"", datatype_str);
         CHIAKI_LOGV(log, "parse_notification_type: JSON was:\n%s", json_object_to_json_string_ext(json, JSON_C_TO_STRING_PRETTY));
-        return NOTIFICATION_TYPE_UNKNOWN;
     }
+    return type;
+}
+
+static NotificationType notification_type_from_data_type(const char *data_type, size_t data_type_size)
+{
+    for (size_t i = 0; i < sizeof(notification_data_types) / sizeof(notification_data_types[0]); i++)
+    {
+        const char *known = notification_data_types[i].data_type;
+        if (strlen(known) == data_type_size && memcmp(known, data_type, data_type_size) == 0)
+            return notification_data_types[i].type;
+    }
+    return NOTIFICATION_TYPE_UNKNOWN;
+}
+
+/**
+ * Get the type of a notification from the first "dataType" string in its raw json, without parsing it
+ *
+ * @param[in] buf The payload of the websocket frame, not necessarily null-terminated
+ * @param[in] buf_size The size of the payload
+ * @return The type, NOTIFICATION_TYPE_UNKNOWN if it has none or an unknown one
+*/
+static NotificationType notification_type_from_payload(const char *buf, size_t buf_size)
+{
+    static const char key[] = "\"dataType\"";
+    const size_t key_size = sizeof(key) - 1;
+    for (size_t i = 0; i + key_size <= buf_size; i++)
+    {
+        if (buf[i] != '"' || memcmp(buf + i, key, key_size) != 0)
+            continue;
+        size_t pos = i + key_size;
+        while (pos < buf_size && (buf[pos] == ' ' || buf[pos] == '\t' || buf[pos] == '\r' || buf[pos] == '\n' || buf[pos] == ':'))
+            pos++;
+        if (pos >= buf_size || buf[pos] != '"')
+            return NOTIFICATION_TYPE_UNKNOWN;
+        size_t start = ++pos;
+        while (pos < buf_size && buf[pos] != '"')
+            pos++;
+        if (pos >= buf_size)
+            return NOTIFICATION_TYPE_UNKNOWN;
+        return notification_type_from_data_type(buf + start, pos - start);
+    }
+    return NOTIFICATION_TYPE_UNKNOWN;
 }
 
 
@@ -2089,7 +2572,17 @@ static ChiakiErrorCode send_offer(Session *session, int req_id, Candidate *local
             return CHIAKI_ERR_UNKNOWN;
         }
 #endif
-    bind(session->ipv4_sock, (struct sockaddr*)&client_addr, client_addr_len);
+    // a port whose UPnP mapping is still leased from an earlier session saves adding a mapping
+    chiaki_mutex_lock(&session->upnp_mutex);
+    uint16_t upnp_port = upnp_cache_port_free();
+    chiaki_mutex_unlock(&session->upnp_mutex);
+    client_addr.sin_port = htons(upnp_port);
+    if (bind(session->ipv4_sock, (struct sockaddr*)&client_addr, client_addr_len) < 0 && upnp_port != 0)
+    {
+        CHIAKI_LOGV(session->log, "send_offer: Port %u of an earlier UPnP mapping is taken, binding any port", upnp_port);
+        client_addr.sin_port = 0;
+        bind(session->ipv4_sock, (struct sockaddr*)&client_addr, client_addr_len);
+    }
     if (getsockname(session->ipv4_sock, (struct sockaddr*)&client_addr, &client_addr_len) < 0)
     {
         CHIAKI_LOGE(session->log, "send_offer: Binding socket failed with error " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
@@ -2177,33 +2670,29 @@ static ChiakiErrorCode send_offer(Session *session, int req_id, Candidate *local
     bool have_addr = false;
     Candidate *candidate_remote = &msg.conn_request->candidates[1];
     candidate_remote->type = CANDIDATE_TYPE_STATIC;
-    UPNPGatewayInfo upnp_gw;
-    upnp_gw.data = calloc(1, sizeof(struct IGDdatas));
-    if(!upnp_gw.data)
-    {
-        err = CHIAKI_ERR_MEMORY;
-        goto cleanup;
-    }
-    upnp_gw.urls = calloc(1, sizeof(struct UPNPUrls));
-    if(!upnp_gw.urls)
-    {
-        err = CHIAKI_ERR_MEMORY;
-        free(upnp_gw.data);
-        goto cleanup;
-    }
-    err = upnp_get_gateway_info(session->log, &upnp_gw);
+    UPNPGatewayInfo *upnp_gw = NULL;
+    bool upnp_cached = false;
+    chiaki_mutex_lock(&session->upnp_mutex);
+    err = upnp_cache_gateway(session->log, false, &upnp_gw, &upnp_cached);
     if (err == CHIAKI_ERR_SUCCESS) {
-        memcpy(candidate_local->addr, upnp_gw.lan_ip, sizeof(upnp_gw.lan_ip));
-        have_addr = get_client_addr_remote_upnp(session->log, &upnp_gw, candidate_remote->addr);
-        if(upnp_add_udp_port_mapping(session->log, &upnp_gw, local_port, local_port))
+        have_addr = get_client_addr_remote_upnp(session->log, upnp_gw, candidate_remote->addr);
+        if(!have_addr && upnp_cached)
         {
-            CHIAKI_LOGI(session->log, "Added local UPNP port mapping to port %u", local_port);
-            session->gw = upnp_gw;
+            CHIAKI_LOGI(session->log, "Cached UPnP gateway didn't answer, discovering it again");
+            err = upnp_cache_gateway(session->log, true, &upnp_gw, &upnp_cached);
+            if(err == CHIAKI_ERR_SUCCESS)
+                have_addr = get_client_addr_remote_upnp(session->log, upnp_gw, candidate_remote->addr);
         }
+    }
+    if (err == CHIAKI_ERR_SUCCESS) {
+        memcpy(candidate_local->addr, upnp_gw->lan_ip, sizeof(upnp_gw->lan_ip));
+        if(upnp_cache_mapping_acquire(session->log, local_port))
+            CHIAKI_LOGI(session->log, "Using local UPNP port mapping to port %u", local_port);
         else
             CHIAKI_LOGE(session->log, "Adding upnp port mapping failed");
     }
-    else {
+    chiaki_mutex_unlock(&session->upnp_mutex);
+    if (err != CHIAKI_ERR_SUCCESS) {
         get_client_addr_local(session, candidate_local, candidate_local->addr, sizeof(candidate_local->addr));
     }
     memcpy(session->client_local_ip, candidate_local->addr, sizeof(candidate_local->addr));
@@ -2998,6 +3487,7 @@ static ChiakiErrorCode upnp_get_gateway_info(ChiakiLog *log, UPNPGatewayInfo *in
     success = UPNP_GetValidIGD(devlist, info->urls, info->data, info->lan_ip, sizeof(info->lan_ip));
     if (success != 1) {
         CHIAKI_LOGI(log, "Failed to discover internet gateway via UPnP: err=%d", err);
+        FreeUPNPUrls(info->urls);
         err = CHIAKI_ERR_NETWORK;
         goto cleanup;
     }
@@ -3029,19 +3519,28 @@ static bool get_client_addr_remote_upnp(ChiakiLog *log, UPNPGatewayInfo *gw_info
  * @param gw_info The UPNPGatewayInfo structure containing the gateway information.
  * @param port_internal The internal port to map.
  * @param port_external The external port to map.
- * @param ip_local The local IP address to map to.
+ * @param[in,out] lease_sec The lease duration to request, set to 0 if the gateway only supports permanent mappings.
  * @return true if the port mapping was successfully added, false otherwise.
 */
-static bool upnp_add_udp_port_mapping(ChiakiLog* log, UPNPGatewayInfo *gw_info, uint16_t port_internal, uint16_t port_external)
+static bool upnp_add_udp_port_mapping(ChiakiLog* log, UPNPGatewayInfo *gw_info, uint16_t port_internal, uint16_t port_external, uint32_t *lease_sec)
 {
     char port_internal_str[6];
     snprintf(port_internal_str, sizeof(port_internal_str), "%d", port_internal);
     char port_external_str[6];
     snprintf(port_external_str, sizeof(port_external_str), "%d", port_external);
+    char lease_str[11];
+    snprintf(lease_str, sizeof(lease_str), "%u", (unsigned int)*lease_sec);
 
     int res = UPNP_AddPortMapping(
         gw_info->urls->controlURL, gw_info->data->first.servicetype,
-        port_external_str, port_internal_str, gw_info->lan_ip, "Chiaki Streaming", "UDP", NULL, "0");
+        port_external_str, port_internal_str, gw_info->lan_ip, "Chiaki Streaming", "UDP", NULL, lease_str);
+    if(res == 725 && *lease_sec != 0) // OnlyPermanentLeasesSupported
+    {
+        *lease_sec = 0;
+        res = UPNP_AddPortMapping(
+            gw_info->urls->controlURL, gw_info->data->first.servicetype,
+            port_external_str, port_internal_str, gw_info->lan_ip, "Chiaki Streaming", "UDP", NULL, "0");
+    }
 
     bool success = (res == UPNPCOMMAND_SUCCESS);
     if(!success)
@@ -3070,16 +3569,247 @@ static bool upnp_delete_udp_port_mapping(ChiakiLog *log, UPNPGatewayInfo *gw_inf
     return success;
 }
 
+/**
+ * Gateway of the last UPnP discovery and the port mappings added on it, so following sessions skip the SSDP
+ * discovery and IGD description fetch and can bind to a port that is still mapped.
+ * Mappings are leased, so the ones no session needs anymore disappear from the gateway on their own.
+ * Holepunch sessions are set up one after another, the session's upnp_mutex only guards against its websocket thread.
+ */
+static struct
+{
+    bool valid;
+    UPNPGatewayInfo gw;
+    struct
+    {
+        uint16_t port; // 0 if the slot is unused
+        uint64_t expires_ms; // UINT64_MAX for a permanent mapping
+        bool in_use; // by the current session
+    } mappings[UPNP_CACHE_MAPPINGS_MAX];
+} upnp_cache;
+
+/**
+ * Whether the address the gateway mapped to is still one of ours, i.e. we are still on the same network.
+ */
+static bool upnp_lan_ip_is_local(const char *lan_ip)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    if(inet_pton(AF_INET, lan_ip, &addr.sin_addr) != 1)
+        return false;
+    chiaki_socket_t sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(CHIAKI_SOCKET_IS_INVALID(sock))
+        return false;
+    bool local = bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    CHIAKI_SOCKET_CLOSE(sock);
+    return local;
+}
+
+static void upnp_cache_clear()
+{
+    if(upnp_cache.valid)
+    {
+        FreeUPNPUrls(upnp_cache.gw.urls);
+        free(upnp_cache.gw.urls);
+        free(upnp_cache.gw.data);
+    }
+    memset(&upnp_cache, 0, sizeof(upnp_cache));
+}
+
+/**
+ * Get the gateway, from the cache unless rediscover is set or the cached one belongs to another network.
+ * Must be called with upnp_mutex locked, gw stays valid until it is unlocked.
+ *
+ * @param[out] cached whether gw came from the cache
+ */
+static ChiakiErrorCode upnp_cache_gateway(ChiakiLog *log, bool rediscover, UPNPGatewayInfo **gw, bool *cached)
+{
+    if(upnp_cache.valid && !rediscover && upnp_lan_ip_is_local(upnp_cache.gw.lan_ip))
+    {
+        CHIAKI_LOGV(log, "Using cached UPnP gateway for %s", upnp_cache.gw.lan_ip);
+        *gw = &upnp_cache.gw;
+        *cached = true;
+        return CHIAKI_ERR_SUCCESS;
+    }
+    upnp_cache_clear();
+
+    UPNPGatewayInfo gw_new;
+    gw_new.data = calloc(1, sizeof(struct IGDdatas));
+    if(!gw_new.data)
+        return CHIAKI_ERR_MEMORY;
+    gw_new.urls = calloc(1, sizeof(struct UPNPUrls));
+    if(!gw_new.urls)
+    {
+        free(gw_new.data);
+        return CHIAKI_ERR_MEMORY;
+    }
+    ChiakiErrorCode err = upnp_get_gateway_info(log, &gw_new);
+    if(err != CHIAKI_ERR_SUCCESS)
+    {
+        free(gw_new.urls);
+        free(gw_new.data);
+        return err;
+    }
+    upnp_cache.gw = gw_new;
+    upnp_cache.valid = true;
+    *gw = &upnp_cache.gw;
+    *cached = false;
+    return CHIAKI_ERR_SUCCESS;
+}
+
+/**
+ * @return a port that is still mapped on the cached gateway and not used by the current session, or 0
+ */
+static uint16_t upnp_cache_port_free()
+{
+    if(!upnp_cache.valid)
+        return 0;
+    uint64_t now_ms = chiaki_time_now_monotonic_ms();
+    for(size_t i=0; i<UPNP_CACHE_MAPPINGS_MAX; i++)
+    {
+        if(upnp_cache.mappings[i].port && !upnp_cache.mappings[i].in_use
+            && upnp_cache.mappings[i].expires_ms > now_ms + UPNP_RENEW_BEFORE_MS)
+            return upnp_cache.mappings[i].port;
+    }
+    return 0;
+}
+
+static uint64_t upnp_lease_expires_ms(uint32_t lease_sec)
+{
+    return lease_sec ? chiaki_time_now_monotonic_ms() + lease_sec * 1000ULL : UINT64_MAX;
+}
+
+/**
+ * Make sure port is mapped on the cached gateway for the current session, reusing a mapping of an earlier one.
+ */
+static bool upnp_cache_mapping_acquire(ChiakiLog *log, uint16_t port)
+{
+    uint64_t now_ms = chiaki_time_now_monotonic_ms();
+    size_t slot = UPNP_CACHE_MAPPINGS_MAX;
+    for(size_t i=0; i<UPNP_CACHE_MAPPINGS_MAX; i++)
+    {
+        if(upnp_cache.mappings[i].port == port)
+        {
+            slot = i;
+            break;
+        }
+    }
+    if(slot < UPNP_CACHE_MAPPINGS_MAX && upnp_cache.mappings[slot].expires_ms > now_ms + UPNP_RENEW_BEFORE_MS)
+    {
+        CHIAKI_LOGI(log, "Reusing UPnP port mapping of port %u", port);
+        upnp_cache.mappings[slot].in_use = true;
+        return true;
+    }
+    if(slot == UPNP_CACHE_MAPPINGS_MAX)
+    {
+        // replace the mapping that expires first, removing it from the gateway if it is still there
+        for(size_t i=0; i<UPNP_CACHE_MAPPINGS_MAX; i++)
+        {
+            if(upnp_cache.mappings[i].in_use)
+                continue;
+            if(slot == UPNP_CACHE_MAPPINGS_MAX || upnp_cache.mappings[i].expires_ms < upnp_cache.mappings[slot].expires_ms)
+                slot = i;
+        }
+        if(slot < UPNP_CACHE_MAPPINGS_MAX && upnp_cache.mappings[slot].port && upnp_cache.mappings[slot].expires_ms > now_ms)
+            upnp_delete_udp_port_mapping(log, &upnp_cache.gw, upnp_cache.mappings[slot].port);
+    }
+
+    uint32_t lease_sec = UPNP_LEASE_SEC;
+    if(!upnp_add_udp_port_mapping(log, &upnp_cache.gw, port, port, &lease_sec))
+    {
+        if(slot < UPNP_CACHE_MAPPINGS_MAX)
+            upnp_cache.mappings[slot].port = 0;
+        return false;
+    }
+    if(slot < UPNP_CACHE_MAPPINGS_MAX)
+    {
+        upnp_cache.mappings[slot].port = port;
+        upnp_cache.mappings[slot].expires_ms = upnp_lease_expires_ms(lease_sec);
+        upnp_cache.mappings[slot].in_use = true;
+    }
+    return true;
+}
+
+static void upnp_cache_mapping_release(uint16_t port)
+{
+    for(size_t i=0; i<UPNP_CACHE_MAPPINGS_MAX; i++)
+    {
+        if(upnp_cache.mappings[i].port == port)
+            upnp_cache.mappings[i].in_use = false;
+    }
+}
+
+/**
+ * Renew the leases of the mappings the current session uses that are about to end.
+ */
+static void upnp_cache_renew(ChiakiLog *log)
+{
+    if(!upnp_cache.valid)
+        return;
+    uint64_t now_ms = chiaki_time_now_monotonic_ms();
+    for(size_t i=0; i<UPNP_CACHE_MAPPINGS_MAX; i++)
+    {
+        if(!upnp_cache.mappings[i].port || !upnp_cache.mappings[i].in_use
+            || upnp_cache.mappings[i].expires_ms > now_ms + UPNP_RENEW_BEFORE_MS)
+            continue;
+        uint32_t lease_sec = UPNP_LEASE_SEC;
+        if(upnp_add_udp_port_mapping(log, &upnp_cache.gw, upnp_cache.mappings[i].port, upnp_cache.mappings[i].port, &lease_sec))
+        {
+            CHIAKI_LOGV(log, "Renewed UPnP port mapping of port %u", upnp_cache.mappings[i].port);
+            upnp_cache.mappings[i].expires_ms = upnp_lease_expires_ms(lease_sec);
+        }
+        else if(upnp_cache.mappings[i].expires_ms <= now_ms)
+            upnp_cache.mappings[i].port = 0; // gone, don't retry on every ping
+    }
+}
+
 /**
  * Retrieves the external IP address (i.e. internet-visible) of the client using STUN.
  *
  * @param log The ChiakiLog instance for logging.
  * @return The external IP address of the client, or NULL if the IP address could not be retrieved. Needs to be freed by the caller.
 */
+/**
+ * NAT allocation of the last STUN test, so a session set up right after a failed one
+ * doesn't have to fetch the server list and measure it again.
+ * Holepunch sessions are set up one after another, so this is not locked.
+ */
+static struct
+{
+    bool valid;
+    uint64_t time_ms;
+    char local_ip[INET6_ADDRSTRLEN];
+    int32_t allocation_increment;
+    bool random_allocation;
+} stun_cache;
+
+static bool stun_cache_get(Session *session)
+{
+    if(!stun_cache.valid || strcmp(stun_cache.local_ip, session->client_local_ip) != 0)
+        return false;
+    uint64_t age_ms = chiaki_time_now_monotonic_ms() - stun_cache.time_ms;
+    if(age_ms > STUN_CACHE_TTL_MS)
+        return false;
+    session->stun_allocation_increment = stun_cache.allocation_increment;
+    session->stun_random_allocation = stun_cache.random_allocation;
+    CHIAKI_LOGI(session->log, "Reusing NAT allocation increment %d%s measured %.1f s ago", stun_cache.allocation_increment,
+        stun_cache.random_allocation ? " (random)" : "", age_ms / 1000.0);
+    return true;
+}
+
+static void stun_cache_set(Session *session)
+{
+    stun_cache.valid = true;
+    stun_cache.time_ms = chiaki_time_now_monotonic_ms();
+    memcpy(stun_cache.local_ip, session->client_local_ip, sizeof(stun_cache.local_ip));
+    stun_cache.allocation_increment = session->stun_allocation_increment;
+    stun_cache.random_allocation = session->stun_random_allocation;
+}
+
 static bool get_client_addr_remote_stun(Session *session, char *address, uint16_t *port, chiaki_socket_t *sock, bool ipv4)
 {
     // run STUN test if it hasn't been run yet
-    if(session->stun_allocation_increment == -1)
+    if(session->stun_allocation_increment == -1 && !(ipv4 && stun_cache_get(session)))
     {
         ChiakiErrorCode err = get_stun_servers(session);
         if(err != CHIAKI_ERR_SUCCESS)
@@ -3091,6 +3821,7 @@ static bool get_client_addr_remote_stun(Session *session, char *address, uint16_
             CHIAKI_LOGE(session->log, "get_client_addr_remote_stun: Failed to get external address");
             return false;
         }
+        stun_cache_set(session);
         return true;
     }
     if(ipv4)
@@ -3203,10 +3934,11 @@ static ChiakiErrorCode check_candidates(
     Candidate candidates[num_candidates + EXTRA_CANDIDATE_ADDRESSES];
     memcpy(candidates, candidates_received, num_candidates * sizeof(Candidate));
     int responses_received[num_candidates + EXTRA_CANDIDATE_ADDRESSES];
+    // per pair pacing, and the socket the pair's last response came in on
+    uint64_t next_check_us[num_candidates + EXTRA_CANDIDATE_ADDRESSES];
+    uint64_t check_interval_us[num_candidates + EXTRA_CANDIDATE_ADDRESSES];
+    chiaki_socket_t pair_socks[num_candidates + EXTRA_CANDIDATE_ADDRESSES];
     fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(session->ipv4_sock, &fds);
-    FD_SET(session->ipv6_sock, &fds);
     bool failed = true;
     char service_remote[6];
     struct addrinfo hints;
@@ -3280,6 +4012,10 @@ static ChiakiErrorCode check_candidates(
     {
         Candidate *candidate = &candidates[i];
         responses_received[i] = 0;
+        lens[i] = 0; // not checked if we can't send to it
+        next_check_us[i] = chiaki_time_now_monotonic_us() + CHECK_RETRANSMIT_INITIAL_MS * MILLISECONDS_US;
+        check_interval_us[i] = CHECK_RETRANSMIT_INITIAL_MS * MILLISECONDS_US;
+        pair_socks[i] = CHIAKI_INVALID_SOCKET;
 
         sprintf(service_remote, "%d", candidate->port);
 
@@ -3295,6 +4031,7 @@ static ChiakiErrorCode check_candidates(
         switch(((struct sockaddr *)&addrs[i])->sa_family)
         {
             case AF_INET:
+                pair_socks[i] = session->ipv4_sock;
                 if (sendto(session->ipv4_sock, (CHIAKI_SOCKET_BUF_TYPE) request_buf[0], sizeof(request_buf[0]), 0, (struct sockaddr *)&addrs[i], lens[i]) < 0)
                 {
                     CHIAKI_LOGW(session->log, "check_candidate: Sending request failed for %s:%d with error: " CHIAKI_SOCKET_ERROR_FMT, candidate->addr, candidate->port, CHIAKI_SOCKET_ERROR_VALUE);
@@ -3320,6 +4057,7 @@ static ChiakiErrorCode check_candidates(
                 }
                 break;
             case AF_INET6:
+                pair_socks[i] = session->ipv6_sock;
                 if (sendto(session->ipv6_sock, (CHIAKI_SOCKET_BUF_TYPE) request_buf[0], sizeof(request_buf[0]), 0, (struct sockaddr *)&addrs[i], lens[i]) < 0)
                 {
                     CHIAKI_LOGW(session->log, "check_candidate: Sending request failed for %s:%d with error: " CHIAKI_SOCKET_ERROR_FMT, candidate->addr, candidate->port, CHIAKI_SOCKET_ERROR_VALUE);
@@ -3340,38 +4078,77 @@ static ChiakiErrorCode check_candidates(
         goto cleanup_sockets;
     }
 
-    // Wait for responses
+    // Wait for responses, all pairs are checked concurrently and the first one to complete the exchange is nominated
     uint8_t response_buf[88];
 
-    chiaki_socket_t maxfd = -1;
-    maxfd = session->ipv4_sock;
-    if(session->ipv6_sock > maxfd)
-        maxfd = session->ipv6_sock;
-    if(session->stun_random_allocation)
-    {
-        for(int i=0; i<RANDOM_ALLOCATION_SOCKS_NUMBER; i++)
-        {
-            if(socks[i] > maxfd)
-                maxfd = socks[i];
-            FD_SET(socks[i], &fds);
-        }
-    }
-    maxfd = maxfd + 1;
-
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = SELECT_CANDIDATE_TIMEOUT_SEC * SECOND_US;
-
     chiaki_socket_t selected_sock = CHIAKI_INVALID_SOCKET;
     Candidate *selected_candidate = NULL;
-    bool received_response = false;
     bool responded = false;
-    bool connecting = false;
-    int retry_counter = 0;
+    uint64_t deadline_us = chiaki_time_now_monotonic_us() + (uint64_t)(SELECT_CANDIDATE_TRIES * SELECT_CANDIDATE_TIMEOUT_SEC * SECOND_US);
 
     while (!selected_candidate)
     {
-        int ret = select(maxfd, &fds, NULL, NULL, &tv);
+        uint64_t now_us = chiaki_time_now_monotonic_us();
+        if (now_us >= deadline_us)
+        {
+            // No responsive candidate within timeout, terminate with error
+            CHIAKI_LOGE(session->log, "check_candidate: Select timed out");
+            err = CHIAKI_ERR_HOST_UNREACH;
+            goto cleanup_sockets;
+        }
+
+        // Retransmit the outstanding request of every pair that is due
+        uint64_t wake_us = deadline_us;
+        for (int i=0; i < num_candidates + extra_addresses_used; i++)
+        {
+            if (!lens[i] || CHIAKI_SOCKET_IS_INVALID(pair_socks[i]))
+                continue;
+            if (next_check_us[i] <= now_us)
+            {
+                Candidate *candidate = &candidates[i];
+                int responses = responses_received[i];
+                CHIAKI_LOGV(session->log, "check_candidate: Resending request %d to %s:%d", responses, candidate->addr, candidate->port);
+                if (sendto(pair_socks[i], (CHIAKI_SOCKET_BUF_TYPE) request_buf[responses], sizeof(request_buf[responses]), 0, (struct sockaddr *)&addrs[i], lens[i]) < 0)
+                    CHIAKI_LOGE(session->log, "check_candidate: Sending request failed for %s:%d with error: " CHIAKI_SOCKET_ERROR_FMT, candidate->addr, candidate->port, CHIAKI_SOCKET_ERROR_VALUE);
+                next_check_us[i] = now_us + check_interval_us[i];
+                check_interval_us[i] *= 2;
+                if (check_interval_us[i] > CHECK_RETRANSMIT_MAX_MS * MILLISECONDS_US)
+                    check_interval_us[i] = CHECK_RETRANSMIT_MAX_MS * MILLISECONDS_US;
+            }
+            if (next_check_us[i] < wake_us)
+                wake_us = next_check_us[i];
+        }
+
+        chiaki_socket_t maxfd = -1;
+        FD_ZERO(&fds);
+        if (!CHIAKI_SOCKET_IS_INVALID(session->ipv4_sock))
+        {
+            FD_SET(session->ipv4_sock, &fds);
+            maxfd = session->ipv4_sock;
+        }
+        if (!CHIAKI_SOCKET_IS_INVALID(session->ipv6_sock))
+        {
+            FD_SET(session->ipv6_sock, &fds);
+            if (session->ipv6_sock > maxfd)
+                maxfd = session->ipv6_sock;
+        }
+        if (session->stun_random_allocation)
+        {
+            for (int i=0; i<RANDOM_ALLOCATION_SOCKS_NUMBER; i++)
+            {
+                if (CHIAKI_SOCKET_IS_INVALID(socks[i]))
+                    continue;
+                FD_SET(socks[i], &fds);
+                if (socks[i] > maxfd)
+                    maxfd = socks[i];
+            }
+        }
+
+        uint64_t timeout_us = wake_us > now_us ? wake_us - now_us : 0;
+        struct timeval tv;
+        tv.tv_sec = timeout_us / SECOND_US;
+        tv.tv_usec = timeout_us % SECOND_US;
+        int ret = select(maxfd + 1, &fds, NULL, NULL, &tv);
 #ifdef _WIN32
 	    if (ret < 0 && WSAGetLastError() != WSAEINTR)
 #else
@@ -3381,61 +4158,9 @@ static ChiakiErrorCode check_candidates(
             CHIAKI_LOGE(session->log, "check_candidate: Select failed with error: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
             err = CHIAKI_ERR_NETWORK;
             goto cleanup_sockets;
-        } else if (ret == 0)
-        {
-            if (CHIAKI_SOCKET_IS_INVALID(selected_sock))
-            {
-                if(retry_counter < SELECT_CANDIDATE_TRIES && !received_response)
-                {
-                    retry_counter++;
-                    tv.tv_sec = 0;
-                    tv.tv_usec = SELECT_CANDIDATE_TIMEOUT_SEC * SECOND_US;
-                    FD_ZERO(&fds);
-                    FD_SET(session->ipv4_sock, &fds);
-                    FD_SET(session->ipv6_sock, &fds);
-                    Candidate *candidate = NULL;
-                    chiaki_socket_t sock = CHIAKI_INVALID_SOCKET;
-                    CHIAKI_LOGI(session->log, "check_candidate: Resending requests to all candidates TRY %d... waiting for 1st response", retry_counter);
-                    for (int i=0; i < num_candidates + extra_addresses_used; i++)
-                    {
-                        if(((struct sockaddr *)&addrs[i])->sa_family == AF_INET)
-                            sock = session->ipv4_sock;
-                        else if(((struct sockaddr *)&addrs[i])->sa_family == AF_INET6)
-                            sock = session->ipv6_sock;
-                        else
-                        {
-                            CHIAKI_LOGE(session->log, "check_candidate: Got an address with an unsupported address family %d, skipping ...", ((struct sockaddr *)&addrs[i])->sa_family);
-                            continue;
-                        }
-                        candidate = &candidates[i];
-                        if (sendto(sock, (CHIAKI_SOCKET_BUF_TYPE) request_buf[0], sizeof(request_buf[0]), 0, (struct sockaddr *)&addrs[i], lens[i]) < 0)
-                        {
-                            CHIAKI_LOGE(session->log, "check_candidate: Sending request failed for %s:%d with error: " CHIAKI_SOCKET_ERROR_FMT, candidate->addr, candidate->port, CHIAKI_SOCKET_ERROR_VALUE);
-                            continue;
-                        }
-                        if(session->stun_random_allocation && (candidate->type == CANDIDATE_TYPE_STATIC || candidate->type == CANDIDATE_TYPE_STUN))
-                        {
-                            for(int j=0; j<RANDOM_ALLOCATION_SOCKS_NUMBER; j++)
-                                FD_SET(socks[j], &fds);
-                        }
-                    }
-                    continue;                    
-                }
-                else if(received_response && !connecting)
-                {
-                    connecting = true;
-                    tv.tv_sec = SELECT_CANDIDATE_CONNECTION_SEC;
-                    tv.tv_usec = 0;
-                    continue;
-                }
-                // No responsive candidate within timeout, terminate with error
-                CHIAKI_LOGE(session->log, "check_candidate: Select timed out");
-                err = CHIAKI_ERR_HOST_UNREACH;
-                goto cleanup_sockets;
-            }
-            // Otherwise, we have a responsive candidate, break out of loop
-            break;
         }
+        else if (ret <= 0)
+            continue;
 
         Candidate *candidate = NULL;
         chiaki_socket_t candidate_sock = CHIAKI_INVALID_SOCKET;
@@ -3474,9 +4199,12 @@ static ChiakiErrorCode check_candidates(
                     break;
                 }
             }
-            CHIAKI_LOGE(session->log, "check_candidate: Select returned an invalid socket!");
-            err = CHIAKI_ERR_UNKNOWN;
-            goto cleanup_sockets;
+            if (CHIAKI_SOCKET_IS_INVALID(candidate_sock))
+            {
+                CHIAKI_LOGE(session->log, "check_candidate: Select returned an invalid socket!");
+                err = CHIAKI_ERR_UNKNOWN;
+                goto cleanup_sockets;
+            }
         }
 
         struct sockaddr* recv_address;
@@ -3545,6 +4273,9 @@ static ChiakiErrorCode check_candidates(
             {
                 candidate = &candidates[i];
                 responses_received[i] = 0;
+                next_check_us[i] = chiaki_time_now_monotonic_us() + CHECK_RETRANSMIT_INITIAL_MS * MILLISECONDS_US;
+                check_interval_us[i] = CHECK_RETRANSMIT_INITIAL_MS * MILLISECONDS_US;
+                pair_socks[i] = candidate_sock;
                 memcpy(candidate->addr, recv_address_string, sizeof(recv_address_string));
                 candidate->port_mapped = 0;
                 candidate->type = CANDIDATE_TYPE_DERIVED;
@@ -3569,8 +4300,8 @@ static ChiakiErrorCode check_candidates(
                 extra_addresses_used++;
                 CHIAKI_LOGI(session->log, "check_candidate: Received new candidate at %s:%d", candidate->addr, candidate->port);
             }
-            free(recv_address);
         }
+        free(recv_address);
         CHIAKI_LOGV(session->log, "check_candidate: Received data from %s:%d", candidate->addr, candidate->port);
         if (response_len != sizeof(response_buf))
         {
@@ -3615,9 +4346,15 @@ static ChiakiErrorCode check_candidates(
             chiaki_log_hexdump(session->log, CHIAKI_LOG_ERROR, response_buf, 88);
             continue;
         }
-        received_response = true;
         responses_received[i]++;
         responses = responses_received[i];
+        // the pair is alive: give it time to complete and check it again right away
+        pair_socks[i] = candidate_sock;
+        check_interval_us[i] = CHECK_RETRANSMIT_INITIAL_MS * MILLISECONDS_US;
+        next_check_us[i] = chiaki_time_now_monotonic_us() + check_interval_us[i];
+        uint64_t pair_deadline_us = chiaki_time_now_monotonic_us() + SELECT_CANDIDATE_CONNECTION_SEC * SECOND_US;
+        if (pair_deadline_us > deadline_us)
+            deadline_us = pair_deadline_us;
         if(responses > 2)
         {
             selected_sock = candidate_sock;
@@ -3896,6 +4633,31 @@ static ChiakiErrorCode receive_request_send_response_ps(Session *session, chiaki
  *
  * @param[in] session A pointer to the session context
 */
+static const char *holepunch_phase_string(HolepunchPhase phase)
+{
+    switch(phase)
+    {
+        case HOLEPUNCH_PHASE_SESSION_CREATE: return "session create";
+        case HOLEPUNCH_PHASE_SESSION_START: return "session start";
+        case HOLEPUNCH_PHASE_CTRL_OFFER: return "ctrl candidate exchange";
+        case HOLEPUNCH_PHASE_CTRL_CHECK: return "ctrl connectivity checks";
+        case HOLEPUNCH_PHASE_CTRL_ACCEPT: return "ctrl accept";
+        case HOLEPUNCH_PHASE_DATA_OFFER: return "data candidate exchange";
+        case HOLEPUNCH_PHASE_DATA_CHECK: return "data connectivity checks";
+        case HOLEPUNCH_PHASE_DATA_ACCEPT: return "data accept";
+        default: return "unknown";
+    }
+}
+
+/**
+ * Record how long a phase that started at start_us took
+ */
+static void phase_done(Session *session, HolepunchPhase phase, uint64_t start_us)
+{
+    session->phase_us[phase] = chiaki_time_now_monotonic_us() - start_us;
+    CHIAKI_LOGI(session->log, "Holepunch %s took %.1f ms", holepunch_phase_string(phase), session->phase_us[phase] / 1000.0);
+}
+
 static void log_session_state(Session *session)
 {
     char state_str[1024];
@@ -4080,73 +4842,59 @@ static ChiakiErrorCode wait_for_notification(
     uint16_t types, uint64_t timeout_ms)
 {
     uint64_t waiting_since = chiaki_time_now_monotonic_us();
-    uint64_t now = waiting_since;
-    Notification *last_known = NULL;
+    NotificationRing *ring = &session->ws_notifications;
+    uint64_t seen = 0; // notifications before this seq have been looked at already
 
-    ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
-    chiaki_mutex_lock(&session->notif_mutex);
     while (true) {
-        while (session->ws_notification_queue->rear == last_known || session->ws_notification_queue->rear == NULL)
-        {
-            err = chiaki_cond_timedwait(&session->notif_cond, &session->notif_mutex, timeout_ms);
-            if (err == CHIAKI_ERR_TIMEOUT)
-            {
-                now = chiaki_time_now_monotonic_us();
-                if ((now - waiting_since) > (timeout_ms * MILLISECONDS_US))
-                {
-                    CHIAKI_LOGE(session->log, "wait_for_notification: Timed out waiting for holepunch session messages");
-                    err = CHIAKI_ERR_TIMEOUT;
-                    goto cleanup;
-                }
-            }
-            if(session->main_should_stop)
-            {
-                session->main_should_stop = false;
-                err = CHIAKI_ERR_CANCELED;
-                goto cleanup;
-            }
-            assert(err == CHIAKI_ERR_SUCCESS || err == CHIAKI_ERR_TIMEOUT);
-        }
-        Notification *notif;
-        if(last_known)
-            notif = last_known->next;
-        else
-            notif = session->ws_notification_queue->front;
-        while (notif != NULL && notif != last_known)
+        chiaki_mutex_lock(&session->notif_mutex);
+        if (seen < ring->begin)
+            seen = ring->begin;
+        for (; seen < ring->end; seen++)
         {
+            Notification *notif = &ring->slots[seen % NOTIFICATION_RING_SIZE];
             if (notif->type & types)
             {
+                chiaki_mutex_unlock(&session->notif_mutex);
                 CHIAKI_LOGV(session->log, "wait_for_notification: Found notification of type %d", notif->type);
                 *out = notif;
-                err = CHIAKI_ERR_SUCCESS;
-                goto cleanup;
+                return CHIAKI_ERR_SUCCESS;
             }
-            last_known = notif;
-            notif = notif->next;
         }
-    }
+        chiaki_mutex_unlock(&session->notif_mutex);
 
-cleanup:
-    chiaki_mutex_unlock(&session->notif_mutex);
-    return err;
+        uint64_t waited_ms = (chiaki_time_now_monotonic_us() - waiting_since) / MILLISECONDS_US;
+        if (waited_ms >= timeout_ms)
+        {
+            CHIAKI_LOGE(session->log, "wait_for_notification: Timed out waiting for holepunch session messages");
+            return CHIAKI_ERR_TIMEOUT;
+        }
+        // only notifications of the types waited for wake up, a bit left from one that was cleared costs another look
+        ChiakiErrorCode err = chiaki_event_flags_timedwait(&session->notif_event, types | NOTIFICATION_EVENT_CANCEL,
+            timeout_ms - waited_ms, NULL);
+        if(session->main_should_stop)
+        {
+            session->main_should_stop = false;
+            return CHIAKI_ERR_CANCELED;
+        }
+        if (err != CHIAKI_ERR_SUCCESS && err != CHIAKI_ERR_TIMEOUT)
+            return err;
+    }
 }
 
+/**
+ * Clear a notification returned by wait_for_notification() and all that arrived before it
+ *
+ * @param[in] session Pointer to the session context
+ * @param[in] notification The notification, no longer valid afterwards
+*/
 static ChiakiErrorCode clear_notification(
     Session *session, Notification *notification)
 {
-    bool found = false;
-    NotificationQueue *nq = session->ws_notification_queue;
+    NotificationRing *ring = &session->ws_notifications;
     chiaki_mutex_lock(&session->notif_mutex);
-    while (nq->rear != NULL)
-    {
-        if(nq->front == notification)
-        {
-            found = true;
-            dequeueNq(nq);
-            break;
-        }
-        dequeueNq(nq);
-    }
+    bool found = notification->seq >= ring->begin && notification->seq < ring->end;
+    if (found)
+        notification_ring_retire(ring, notification->seq + 1);
     chiaki_mutex_unlock(&session->notif_mutex);
     if (found)
         return CHIAKI_ERR_SUCCESS;
@@ -4950,83 +5698,41 @@ static void print_candidate(ChiakiLog *log, Candidate *candidate)
 }
 
 /**
- * Create a notification queue for holding notifications for a session.
- *
- * @return nq Pointer to a NotificationQueue to be used for the session.
-*/
-
-static NotificationQueue *createNq()
-{
-    NotificationQueue *nq = (NotificationQueue*)malloc(sizeof(NotificationQueue));
-    if(!nq)
-        return NULL;
-    nq->front = nq->rear = NULL;
-    return nq;
-}
-
-/**
- * Delete a notification from the queue
- *
- * @param nq the notification queue to dequeue from
-*/
-
-static void dequeueNq(NotificationQueue *nq)
-{
-    if(nq->front == NULL)
-        return;
-
-    Notification *notif = nq->front;
-
-    nq->front = nq->front->next;
-
-    if(nq->front == NULL)
-        nq->rear = NULL;
-
-    json_object_put(notif->json);
-    notif->json = NULL;
-    free(notif->json_buf);
-    notif->json_buf = NULL;
-    free(notif);
-}
-
-/**
- * Adds a notification to the queue.
+ * Adds a notification to the ring, must be called with notif_mutex locked.
  *
- * @param nq Notification queue to add to
- * @param[in] notif Notification to add to the queue
+ * @param ring Notification ring to add to
+ * @param[in] type The type of notification
+ * @param[in] json The json of the notification, owned by the ring if added
+ * @return false if the ring is full
 */
-
-static void enqueueNq(NotificationQueue *nq, Notification*notif)
+static bool notification_ring_push(NotificationRing *ring, NotificationType type, json_object *json)
 {
-    if(nq->rear == NULL)
+    if (ring->end - ring->begin >= NOTIFICATION_RING_SIZE)
     {
-        nq->front = nq->rear = notif;
-        return;
+        ring->dropped++;
+        return false;
     }
-    nq->rear->next = notif;
-    nq->rear = notif;
+    Notification *notif = &ring->slots[ring->end % NOTIFICATION_RING_SIZE];
+    notif->seq = ring->end++;
+    notif->type = type;
+    notif->json = json;
+    return true;
 }
 
 /**
- * Creates a notification
+ * Release the notifications before seq end, must be called with notif_mutex locked.
  *
- * @param[in] type The type of notification
- * @param[in] json The pointer to the json object of the notification
- * @param[in] json_buf A pointer to the char representation of the json
- * @param[in] json_buf_size The length of the char representation of the json
- * @return notif Created notification
+ * @param ring Notification ring to release from
+ * @param end Seq of the first notification to keep
 */
-static Notification* newNotification(NotificationType type, json_object *json, char* json_buf, size_t json_buf_size)
+static void notification_ring_retire(NotificationRing *ring, uint64_t end)
 {
-    Notification *notif = (Notification *)malloc(sizeof(Notification));
-    if(!notif)
-        return NULL;
-    notif->type = type;
-    notif->json = json;
-    notif->json_buf = json_buf;
-    notif->json_buf_size = json_buf_size;
-    notif->next = NULL;
-    return notif;
+    for (; ring->begin < end; ring->begin++)
+    {
+        Notification *notif = &ring->slots[ring->begin % NOTIFICATION_RING_SIZE];
+        json_object_put(notif->json);
+        notif->json = NULL;
+    }
 }
 
 /**
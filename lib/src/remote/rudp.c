@@ -12,6 +12,7 @@
 #define RUDP_CONSTANT 0x244F244F
 #define RUDP_SEND_BUFFER_SIZE 16
 #define RUDP_EXPECT_TIMEOUT_MS 1000
+#define RUDP_RECV_BUF_SIZE 1500
 typedef struct rudp_t
 {
     uint16_t counter;
@@ -20,7 +21,9 @@ typedef struct rudp_t
     ChiakiStopPipe stop_pipe;
     chiaki_socket_t sock;
     ChiakiLog *log;
+    ChiakiArena *arena;
     ChiakiRudpSendBuffer send_buffer;
+    uint8_t recv_buf[RUDP_RECV_BUF_SIZE]; // reused by chiaki_rudp_recv_view()
 } RudpInstance;
 
 static uint16_t get_then_increase_counter(RudpInstance *rudp);
@@ -30,12 +33,13 @@ static void print_rudp_message_type(RudpInstance *rudp, RudpPacketType type);
 static bool assign_submessage_to_message(RudpMessage *message);
 
 
-CHIAKI_EXPORT RudpInstance *chiaki_rudp_init(chiaki_socket_t *sock, ChiakiLog *log)
+CHIAKI_EXPORT RudpInstance *chiaki_rudp_init(chiaki_socket_t *sock, ChiakiArena *arena, ChiakiLog *log)
 {
     RudpInstance *rudp = (RudpInstance *)calloc(1, sizeof(RudpInstance));
     if(!rudp)
         return NULL;
     rudp->log = log;
+    rudp->arena = arena;
     ChiakiErrorCode err;
     err = chiaki_mutex_init(&rudp->counter_mutex, false);
     assert(err == CHIAKI_ERR_SUCCESS);
@@ -48,7 +52,7 @@ CHIAKI_EXPORT RudpInstance *chiaki_rudp_init(chiaki_socket_t *sock, ChiakiLog *l
     chiaki_rudp_reset_counter_header(rudp);
     rudp->sock = *sock;
 	// The send buffer size MUST be consistent with the acked seqnums array size in rudp_handle_message_ack()
-    err = chiaki_rudp_send_buffer_init(&rudp->send_buffer, rudp, log, RUDP_SEND_BUFFER_SIZE);
+    err = chiaki_rudp_send_buffer_init(&rudp->send_buffer, rudp, arena, log, RUDP_SEND_BUFFER_SIZE);
     if(err != CHIAKI_ERR_SUCCESS)
     {
         CHIAKI_LOGE(rudp->log, "Rudp failed initializing, failed creating send buffer");
@@ -74,7 +78,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_init_message(RudpInstance *rudp)
     message.data_size = 14;
     uint8_t data[message.data_size];
     size_t alloc_size = 8 + message.data_size;
-    uint8_t *serialized_msg = malloc(alloc_size * sizeof(uint8_t));
+    uint8_t *serialized_msg = chiaki_arena_alloc(rudp->arena, CHIAKI_ARENA_TAG_RUDP, alloc_size * sizeof(uint8_t));
     if(!serialized_msg)
     {
         CHIAKI_LOGE(rudp->log, "Error allocating memory for rudp message");
@@ -91,7 +95,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_init_message(RudpInstance *rudp)
     message.data = data;
     rudp_message_serialize(&message, serialized_msg, &msg_size);
     ChiakiErrorCode err = chiaki_rudp_send_raw(rudp, serialized_msg, msg_size);
-    free(serialized_msg);
+    chiaki_arena_free(rudp->arena, serialized_msg);
     return err;
 }
 
@@ -103,7 +107,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_cookie_message(RudpInstance *rudp
     message.subMessage = NULL;
     message.data_size = 14 + response_size;
     size_t alloc_size = 8 + message.data_size;
-    uint8_t *serialized_msg = malloc(alloc_size * sizeof(uint8_t));
+    uint8_t *serialized_msg = chiaki_arena_alloc(rudp->arena, CHIAKI_ARENA_TAG_RUDP, alloc_size * sizeof(uint8_t));
     if(!serialized_msg)
     {
         CHIAKI_LOGE(rudp->log, "Error allocating memory for rudp message");
@@ -122,7 +126,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_cookie_message(RudpInstance *rudp
     message.data = data;
     rudp_message_serialize(&message, serialized_msg, &msg_size);
     ChiakiErrorCode err = chiaki_rudp_send_raw(rudp, serialized_msg, msg_size);
-    free(serialized_msg);
+    chiaki_arena_free(rudp->arena, serialized_msg);
     return err;
 }
 
@@ -144,7 +148,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_session_message(RudpInstance *rud
     message.subMessage = &subMessage;
     message.data_size = 4;
     size_t alloc_size = 8 + message.data_size + 8 + subMessage.data_size;
-    uint8_t *serialized_msg = malloc(alloc_size * sizeof(uint8_t));
+    uint8_t *serialized_msg = chiaki_arena_alloc(rudp->arena, CHIAKI_ARENA_TAG_RUDP, alloc_size * sizeof(uint8_t));
     if(!serialized_msg)
     {
         CHIAKI_LOGE(rudp->log, "Error allocating memory for rudp message");
@@ -158,7 +162,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_session_message(RudpInstance *rud
     message.data = data;
     rudp_message_serialize(&message, serialized_msg, &msg_size);
     ChiakiErrorCode err = chiaki_rudp_send_raw(rudp, serialized_msg, msg_size);
-    free(serialized_msg);
+    chiaki_arena_free(rudp->arena, serialized_msg);
     return err;
 }
 
@@ -170,7 +174,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_ack_message(RudpInstance *rudp, u
     message.subMessage = NULL;
     message.data_size = 6;
     size_t alloc_size = 8 + message.data_size;
-    uint8_t *serialized_msg = malloc(alloc_size * sizeof(uint8_t));
+    uint8_t *serialized_msg = chiaki_arena_alloc(rudp->arena, CHIAKI_ARENA_TAG_RUDP, alloc_size * sizeof(uint8_t));
     if(!serialized_msg)
     {
         CHIAKI_LOGE(rudp->log, "Error allocating memory for rudp message");
@@ -186,7 +190,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_ack_message(RudpInstance *rudp, u
     message.data = data;
     rudp_message_serialize(&message, serialized_msg, &msg_size);
     ChiakiErrorCode err = chiaki_rudp_send_raw(rudp, serialized_msg, msg_size);
-    free(serialized_msg);
+    chiaki_arena_free(rudp->arena, serialized_msg);
     return err;
 }
 
@@ -199,7 +203,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_ctrl_message(RudpInstance *rudp,
     message.subMessage = NULL;
     message.data_size = 2 + ctrl_message_size;
     size_t alloc_size = 8 + message.data_size;
-    uint8_t *serialized_msg = malloc(alloc_size * sizeof(uint8_t));
+    uint8_t *serialized_msg = chiaki_arena_alloc(rudp->arena, CHIAKI_ARENA_TAG_RUDP, alloc_size * sizeof(uint8_t));
     if(!serialized_msg)
     {
         CHIAKI_LOGE(rudp->log, "Error allocating memory for rudp message");
@@ -215,7 +219,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_ctrl_message(RudpInstance *rudp,
     ChiakiErrorCode err = chiaki_rudp_send_raw(rudp, serialized_msg, msg_size);
     if(err != CHIAKI_ERR_SUCCESS)
     {
-        free(serialized_msg);
+        chiaki_arena_free(rudp->arena, serialized_msg);
         return err;
     }
     err = chiaki_rudp_send_buffer_push(&rudp->send_buffer, counter_ack, serialized_msg, msg_size);
@@ -231,7 +235,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_switch_to_stream_connection_messa
     message.subMessage = NULL;
     message.data_size = 26;
     size_t alloc_size = 8 + message.data_size;
-    uint8_t *serialized_msg = malloc(alloc_size * sizeof(uint8_t));
+    uint8_t *serialized_msg = chiaki_arena_alloc(rudp->arena, CHIAKI_ARENA_TAG_RUDP, alloc_size * sizeof(uint8_t));
     if(!serialized_msg)
     {
         CHIAKI_LOGE(rudp->log, "Error allocating memory for rudp message");
@@ -252,7 +256,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_switch_to_stream_connection_messa
     ChiakiErrorCode err = chiaki_rudp_send_raw(rudp, serialized_msg, msg_size);
     if(err != CHIAKI_ERR_SUCCESS)
     {
-        free(serialized_msg);
+        chiaki_arena_free(rudp->arena, serialized_msg);
         return err;
     }
     err = chiaki_rudp_send_buffer_push(&rudp->send_buffer, counter_ack, serialized_msg, msg_size);
@@ -293,46 +297,85 @@ static void rudp_message_serialize(
 static ChiakiErrorCode chiaki_rudp_message_parse(
     uint8_t *serialized_msg, size_t msg_size, RudpMessage *message)
 {
-    ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
     message->data = NULL;
     message->subMessage = NULL;
     message->subMessage_size = 0;
     message->data_size = 0;
-    message->size = ntohs(*(chiaki_unaligned_uint16_t *)(serialized_msg));
-    message->type = ntohs(*(chiaki_unaligned_uint16_t *)(serialized_msg + 6));
-    message->subtype = serialized_msg[6] & 0xFF;
-    // Eliminate 0xC before length (size of header + data but not submessage)
-    serialized_msg[0] = serialized_msg[0] & 0x0F;
-    message->remote_counter = 0;
-    uint16_t length = ntohs(*(chiaki_unaligned_uint16_t *)(serialized_msg));
-    int remaining = msg_size - 8;
-    int data_size = 0;
-    if(length > 8)
+    RudpMessageView view;
+    ChiakiErrorCode err = chiaki_rudp_message_view_parse(serialized_msg, msg_size, &view);
+    if(err != CHIAKI_ERR_SUCCESS)
+        return err;
+    message->size = view.size;
+    message->type = view.type;
+    message->subtype = view.subtype;
+    message->remote_counter = view.remote_counter;
+    if(view.data_size)
     {
-        data_size = length - 8;
-        if(remaining < data_size)
-            data_size = remaining;
-        message->data_size = data_size;
+        message->data_size = view.data_size;
         message->data = malloc(message->data_size * sizeof(uint8_t));
         if(!message->data)
             return CHIAKI_ERR_MEMORY;
-        memcpy(message->data, serialized_msg + 8, data_size);
-        if(data_size >= 2)
-            message->remote_counter = ntohs(*(chiaki_unaligned_uint16_t *)(message->data)) + 1;
+        memcpy(message->data, view.data, view.data_size);
     }
 
-    remaining = remaining - data_size;
-    if (remaining >= 8)
+    if (view.next)
     {
         message->subMessage = malloc(1 * sizeof(RudpMessage));
         if(!message->subMessage)
             return CHIAKI_ERR_MEMORY;
-        message->subMessage_size = remaining;
-        err = chiaki_rudp_message_parse(serialized_msg + 8 + data_size, remaining, message->subMessage);
+        message->subMessage_size = view.next_size;
+        err = chiaki_rudp_message_parse((uint8_t *)view.next, view.next_size, message->subMessage);
     }
     return err;
 }
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_message_view_parse(const uint8_t *buf, size_t buf_size, RudpMessageView *view)
+{
+    if(buf_size < 8)
+        return CHIAKI_ERR_BUF_TOO_SMALL;
+    view->size = ntohs(*(chiaki_unaligned_uint16_t *)(buf));
+    view->type = ntohs(*(chiaki_unaligned_uint16_t *)(buf + 6));
+    view->subtype = buf[6] & 0xFF;
+    view->data = NULL;
+    view->data_size = 0;
+    view->remote_counter = 0;
+    view->next = NULL;
+    view->next_size = 0;
+    // Eliminate 0xC before length (size of header + data but not submessage)
+    uint16_t length = view->size & 0x0FFF;
+    size_t remaining = buf_size - 8;
+    size_t data_size = 0;
+    if(length > 8)
+    {
+        data_size = length - 8;
+        if(remaining < data_size)
+            data_size = remaining;
+        view->data = buf + 8;
+        view->data_size = data_size;
+        if(data_size >= 2)
+            view->remote_counter = ntohs(*(chiaki_unaligned_uint16_t *)(view->data)) + 1;
+    }
+
+    remaining -= data_size;
+    if (remaining >= 8)
+    {
+        view->next = buf + 8 + data_size;
+        view->next_size = remaining;
+    }
+    return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT bool chiaki_rudp_message_view_next(RudpMessageView *view)
+{
+    if(!view->next)
+        return false;
+    RudpMessageView next;
+    if(chiaki_rudp_message_view_parse(view->next, view->next_size, &next) != CHIAKI_ERR_SUCCESS)
+        return false;
+    *view = next;
+    return true;
+}
+
 /**
  * Get current rudp local counter and then increase rudp local counter
  *
@@ -363,8 +406,11 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_raw(RudpInstance *rudp, uint8_t *
     {
         return CHIAKI_ERR_DISCONNECTED;
     }
-    CHIAKI_LOGV(rudp->log, "Sending Message:");
-    chiaki_log_hexdump(rudp->log, CHIAKI_LOG_VERBOSE, buf, buf_size);
+    CHIAKI_LOGT(rudp->log, "Sending Message:");
+    if(CHIAKI_LOG_ENABLED(CHIAKI_LOG_TRACE))
+    {
+        chiaki_log_hexdump(rudp->log, CHIAKI_LOG_TRACE, buf, buf_size);
+    }
 	int sent = send(rudp->sock, (CHIAKI_SOCKET_BUF_TYPE) buf, buf_size, 0);
 	if(sent < 0)
 	{
@@ -395,8 +441,9 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_select_recv(RudpInstance *rudp, size_t
 			CHIAKI_LOGE(rudp->log, "Rudp recv returned less than the required 8 byte RUDP header");
 		return CHIAKI_ERR_NETWORK;
 	}
-    CHIAKI_LOGV(rudp->log, "Receiving message:");
-    chiaki_log_hexdump(rudp->log, CHIAKI_LOG_VERBOSE, buf, received_sz);
+    CHIAKI_LOGT(rudp->log, "Receiving message:");
+    if(CHIAKI_LOG_ENABLED(CHIAKI_LOG_TRACE))
+        chiaki_log_hexdump(rudp->log, CHIAKI_LOG_TRACE, buf, received_sz);
 
     err = chiaki_rudp_message_parse(buf, received_sz, message);
     
@@ -415,14 +462,35 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_recv_only(RudpInstance *rudp, size_t b
 			CHIAKI_LOGE(rudp->log, "Rudp recv returned less than the required 8 byte RUDP header");
 		return CHIAKI_ERR_NETWORK;
 	}
-    CHIAKI_LOGV(rudp->log, "Receiving message:");
-    chiaki_log_hexdump(rudp->log, CHIAKI_LOG_VERBOSE, buf, received_sz);
+    CHIAKI_LOGT(rudp->log, "Receiving message:");
+    if(CHIAKI_LOG_ENABLED(CHIAKI_LOG_TRACE))
+        chiaki_log_hexdump(rudp->log, CHIAKI_LOG_TRACE, buf, received_sz);
 
     ChiakiErrorCode err = chiaki_rudp_message_parse(buf, received_sz, message);
 
 	return err;
 }
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_recv_view(RudpInstance *rudp, RudpMessageView *view)
+{
+	int received_sz = recv(rudp->sock, (CHIAKI_SOCKET_BUF_TYPE) rudp->recv_buf, sizeof(rudp->recv_buf), 0);
+	if(received_sz <= 8)
+	{
+		if(received_sz < 0)
+			CHIAKI_LOGE(rudp->log, "Rudp recv failed: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+		else
+			CHIAKI_LOGE(rudp->log, "Rudp recv returned less than the required 8 byte RUDP header");
+		return CHIAKI_ERR_NETWORK;
+	}
+    CHIAKI_LOGT(rudp->log, "Receiving message:");
+    if(CHIAKI_LOG_ENABLED(CHIAKI_LOG_TRACE))
+    {
+        chiaki_log_hexdump(rudp->log, CHIAKI_LOG_TRACE, rudp->recv_buf, received_sz);
+    }
+
+	return chiaki_rudp_message_view_parse(rudp->recv_buf, received_sz, view);
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_stop_pipe_select_single(RudpInstance *rudp, ChiakiStopPipe *stop_pipe, uint64_t timeout)
 {
 	ChiakiErrorCode err = chiaki_stop_pipe_select_single(stop_pipe, rudp->sock, false, timeout);
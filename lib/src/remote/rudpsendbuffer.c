@@ -14,17 +14,24 @@
 #include <arpa/inet.h>
 #endif
 
-#define RUDP_DATA_RESEND_TIMEOUT_MS 400
-#define RUDP_DATA_RESEND_WAKEUP_TIMEOUT_MS (RUDP_DATA_RESEND_TIMEOUT_MS/2)
+#define RUDP_DATA_RESEND_TIMEOUT_INITIAL_US 400000 // used until the first rtt sample
+#define RUDP_DATA_RESEND_TIMEOUT_MIN_US 50000
+#define RUDP_DATA_RESEND_TIMEOUT_MAX_US 2000000 // also caps the exponential backoff
+#define RUDP_DATA_RESEND_CLOCK_GRANULARITY_US 1000 // of the thread's timed wait
 #define RUDP_DATA_RESEND_TRIES_MAX 10
+// max packets re-sent at once, the rest is paced out so a burst of loss doesn't flood the path again
+#define RUDP_DATA_RESEND_BURST_MAX 4
+#define RUDP_DATA_RESEND_PACING_US 5000
 
 #endif
 
 struct chiaki_rudp_send_buffer_packet_t
 {
+	bool set;
+	bool fast_resent; // already re-sent early because a later ack didn't cover it
 	ChiakiSeqNum16 seq_num;
 	uint64_t tries;
-	uint64_t last_send_ms; // chiaki_time_now_monotonic_ms()
+	uint64_t last_send_us; // chiaki_time_now_monotonic_us()
 	uint8_t *buf;
 	size_t buf_size;
 }; // ChiakiRudpSendBufferPacket
@@ -33,16 +40,28 @@ struct chiaki_rudp_send_buffer_packet_t
 
 static void *rudp_send_buffer_thread_func(void *user);
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_buffer_init(ChiakiRudpSendBuffer *send_buffer, ChiakiRudp rudp, ChiakiLog *log, size_t size)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_buffer_init(ChiakiRudpSendBuffer *send_buffer, ChiakiRudp rudp, ChiakiArena *arena, ChiakiLog *log, size_t size)
 {
 	send_buffer->rudp = rudp;
+	send_buffer->arena = arena;
 	send_buffer->log = log;
 
+	// slots are indexed by seq_num % size, which only stays contiguous across seqnum wraparound for powers of 2
+	if(!size || (size & (size - 1)))
+		return CHIAKI_ERR_INVALID_DATA;
+
 	send_buffer->packets = calloc(size, sizeof(ChiakiRudpSendBufferPacket));
 	if(!send_buffer->packets)
 		return CHIAKI_ERR_MEMORY;
 	send_buffer->packets_size = size;
 	send_buffer->packets_count = 0;
+	send_buffer->seq_num_begin = 0;
+	send_buffer->seq_num_end = 0;
+
+	send_buffer->rtt_sampled = false;
+	send_buffer->srtt_us = 0;
+	send_buffer->rttvar_us = 0;
+	send_buffer->rto_us = RUDP_DATA_RESEND_TIMEOUT_INITIAL_US;
 
 	send_buffer->should_stop = false;
 
@@ -54,12 +73,10 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_buffer_init(ChiakiRudpSendBuffer
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_mutex;
 
-	err = chiaki_thread_create(&send_buffer->thread, rudp_send_buffer_thread_func, send_buffer);
+	err = chiaki_thread_create_role(&send_buffer->thread, rudp_send_buffer_thread_func, send_buffer, CHIAKI_THREAD_ROLE_RUDP_SEND_BUFFER);
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_cond;
 
-	chiaki_thread_set_name(&send_buffer->thread, "Chiaki Rudp Send Buffer");
-
 	return CHIAKI_ERR_SUCCESS;
 error_cond:
 	chiaki_cond_fini(&send_buffer->cond);
@@ -78,14 +95,22 @@ CHIAKI_EXPORT void chiaki_rudp_send_buffer_fini(ChiakiRudpSendBuffer *send_buffe
 	err = chiaki_thread_join(&send_buffer->thread, NULL);
 	assert(err == CHIAKI_ERR_SUCCESS);
 
-	for(size_t i=0; i<send_buffer->packets_count; i++)
-		free(send_buffer->packets[i].buf);
+	for(size_t i=0; i<send_buffer->packets_size; i++)
+	{
+		if(send_buffer->packets[i].set)
+			chiaki_arena_free(send_buffer->arena, send_buffer->packets[i].buf);
+	}
 
 	chiaki_cond_fini(&send_buffer->cond);
 	chiaki_mutex_fini(&send_buffer->mutex);
 	free(send_buffer->packets);
 }
 
+static inline ChiakiRudpSendBufferPacket *packet_slot(ChiakiRudpSendBuffer *send_buffer, ChiakiSeqNum16 seq_num)
+{
+	return &send_buffer->packets[seq_num % send_buffer->packets_size];
+}
+
 static void GetRudpPacketType(ChiakiRudpSendBuffer *send_buffer, uint16_t packet_type, char *ptype)
 {
     RudpPacketType type = htons(packet_type);
@@ -131,33 +156,50 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_buffer_push(ChiakiRudpSendBuffer
 {
 	ChiakiErrorCode err = chiaki_mutex_lock(&send_buffer->mutex);
 	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		chiaki_arena_free(send_buffer->arena, buf);
 		return err;
+	}
 
-	if(send_buffer->packets_count >= send_buffer->packets_size)
+	ChiakiSeqNum16 begin = send_buffer->seq_num_begin;
+	ChiakiSeqNum16 end = send_buffer->seq_num_end;
+	if(send_buffer->packets_count == 0)
+	{
+		begin = seq_num;
+		end = seq_num + 1;
+	}
+	else if(!chiaki_seq_num_16_lt(seq_num, end))
+		end = seq_num + 1;
+	else if(chiaki_seq_num_16_lt(seq_num, begin))
+		begin = seq_num;
+
+	if((size_t)(ChiakiSeqNum16)(end - begin) > send_buffer->packets_size)
 	{
 		CHIAKI_LOGE(send_buffer->log, "Rudp Send Buffer overflow");
 		err = CHIAKI_ERR_OVERFLOW;
 		goto beach;
 	}
 
-	for(size_t i=0; i<send_buffer->packets_count; i++)
+	ChiakiRudpSendBufferPacket *packet = packet_slot(send_buffer, seq_num);
+	if(packet->set)
 	{
-		if(send_buffer->packets[i].seq_num == seq_num)
-		{
-			CHIAKI_LOGE(send_buffer->log, "Tried to push duplicate seqnum into Rudp Send Buffer");
-			err = CHIAKI_ERR_INVALID_DATA;
-			goto beach;
-		}
+		CHIAKI_LOGE(send_buffer->log, "Tried to push duplicate seqnum into Rudp Send Buffer");
+		err = CHIAKI_ERR_INVALID_DATA;
+		goto beach;
 	}
 
-	ChiakiRudpSendBufferPacket *packet = &send_buffer->packets[send_buffer->packets_count++];
+	send_buffer->seq_num_begin = begin;
+	send_buffer->seq_num_end = end;
+	packet->set = true;
+	packet->fast_resent = false;
 	packet->seq_num = seq_num;
 	packet->tries = 0;
-	packet->last_send_ms = chiaki_time_now_monotonic_ms();
+	packet->last_send_us = chiaki_time_now_monotonic_us();
 	packet->buf = buf;
 	packet->buf_size = buf_size;
+	send_buffer->packets_count++;
 
-	CHIAKI_LOGV(send_buffer->log, "Pushed seq num %#lx into Rudp Send Buffer", (unsigned long)seq_num);
+	CHIAKI_LOGT(send_buffer->log, "Pushed seq num %#lx into Rudp Send Buffer", (unsigned long)seq_num);
 
 	if(send_buffer->packets_count == 1)
 	{
@@ -167,74 +209,119 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_buffer_push(ChiakiRudpSendBuffer
 
 beach:
 	if(err != CHIAKI_ERR_SUCCESS)
-		free(buf);
+		chiaki_arena_free(send_buffer->arena, buf);
 	chiaki_mutex_unlock(&send_buffer->mutex);
 	return err;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_buffer_ack(ChiakiRudpSendBuffer *send_buffer, ChiakiSeqNum16 seq_num, ChiakiSeqNum16 *acked_seq_nums, size_t *acked_seq_nums_count)
+/**
+ * Must be called with the mutex locked.
+ */
+static void send_buffer_rtt_sample(ChiakiRudpSendBuffer *send_buffer, uint64_t rtt_us)
 {
-	ChiakiErrorCode err = chiaki_mutex_lock(&send_buffer->mutex);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
+	if(!send_buffer->rtt_sampled)
+	{
+		send_buffer->srtt_us = rtt_us;
+		send_buffer->rttvar_us = rtt_us / 2;
+		send_buffer->rtt_sampled = true;
+	}
+	else
+	{
+		uint64_t delta = send_buffer->srtt_us > rtt_us ? send_buffer->srtt_us - rtt_us : rtt_us - send_buffer->srtt_us;
+		send_buffer->rttvar_us = (3 * send_buffer->rttvar_us + delta) / 4;
+		send_buffer->srtt_us = (7 * send_buffer->srtt_us + rtt_us) / 8;
+	}
+	uint64_t var = 4 * send_buffer->rttvar_us;
+	if(var < RUDP_DATA_RESEND_CLOCK_GRANULARITY_US)
+		var = RUDP_DATA_RESEND_CLOCK_GRANULARITY_US;
+	uint64_t rto = send_buffer->srtt_us + var;
+	if(rto < RUDP_DATA_RESEND_TIMEOUT_MIN_US)
+		rto = RUDP_DATA_RESEND_TIMEOUT_MIN_US;
+	else if(rto > RUDP_DATA_RESEND_TIMEOUT_MAX_US)
+		rto = RUDP_DATA_RESEND_TIMEOUT_MAX_US;
+	send_buffer->rto_us = rto;
+}
 
-	if(acked_seq_nums_count)
-		*acked_seq_nums_count = 0;
+/**
+ * Must be called with the mutex locked.
+ */
+static void packet_resend(ChiakiRudpSendBuffer *send_buffer, ChiakiRudpSendBufferPacket *packet, uint64_t now)
+{
+	char packet_type[29] = {0};
+	GetRudpPacketType(send_buffer, *((uint16_t *)(packet->buf + 6)), packet_type);
+	CHIAKI_LOGI(send_buffer->log, "rudp Send Buffer re-sending packet with seqnum %#lx and type %s, tries: %llu", (unsigned long)packet->seq_num, packet_type, (unsigned long long)packet->tries);
+	packet->last_send_us = now;
+	chiaki_rudp_send_raw(send_buffer->rudp, packet->buf, packet->buf_size);
+	packet->tries++;
+}
 
-	size_t i;
-	size_t shift = 0; // amount to shift back
-	size_t shift_start = SIZE_MAX;
-	for(i=0; i<send_buffer->packets_count; i++)
+/**
+ * Must be called with the mutex locked.
+ *
+ * @param sample_rtt whether seq_num was acked by the remote, so its round-trip time may be measured
+ */
+static void send_buffer_ack(ChiakiRudpSendBuffer *send_buffer, ChiakiSeqNum16 seq_num, bool sample_rtt, ChiakiSeqNum16 *acked_seq_nums, size_t *acked_seq_nums_count)
+{
+	uint64_t now = chiaki_time_now_monotonic_us();
+	if(sample_rtt)
 	{
-		if(send_buffer->packets[i].seq_num == seq_num || chiaki_seq_num_16_lt(send_buffer->packets[i].seq_num, seq_num))
+		// only time the packet that is directly answered by this ack
+		ChiakiRudpSendBufferPacket *packet = packet_slot(send_buffer, seq_num);
+		if(packet->set && packet->seq_num == seq_num && packet->tries == 0)
+			send_buffer_rtt_sample(send_buffer, now - packet->last_send_us);
+	}
+
+	// everything from begin up to and including seq_num is acked
+	while(send_buffer->packets_count > 0
+			&& (send_buffer->seq_num_begin == seq_num || chiaki_seq_num_16_lt(send_buffer->seq_num_begin, seq_num)))
+	{
+		ChiakiRudpSendBufferPacket *packet = packet_slot(send_buffer, send_buffer->seq_num_begin);
+		if(packet->set)
 		{
 			if(acked_seq_nums)
-				acked_seq_nums[(*acked_seq_nums_count)++] = send_buffer->packets[i].seq_num;
-
-			free(send_buffer->packets[i].buf);
-			if(shift_start == SIZE_MAX)
-			{
-				// first shift
-				shift_start = i;
-				shift = 1;
-			}
-			else if(shift_start + shift == i)
-			{
-				// still in the same gap
-				shift++;
-			}
-			else
-			{
-				// new gap, do shift
-				memmove(send_buffer->packets + shift_start,
-						send_buffer->packets + shift_start + shift,
-						(i - (shift_start + shift)) * sizeof(ChiakiRudpSendBufferPacket));
-				// start new shift
-				shift_start = i - shift;
-				shift++;
-			}
+				acked_seq_nums[(*acked_seq_nums_count)++] = packet->seq_num;
+			chiaki_arena_free(send_buffer->arena, packet->buf);
+			packet->buf = NULL;
+			packet->set = false;
+			send_buffer->packets_count--;
 		}
+		send_buffer->seq_num_begin++;
 	}
+	// keep begin pointing at an outstanding packet
+	while(send_buffer->packets_count > 0 && !packet_slot(send_buffer, send_buffer->seq_num_begin)->set)
+		send_buffer->seq_num_begin++;
 
-	if(shift_start != SIZE_MAX)
+	CHIAKI_LOGT(send_buffer->log, "Acked seq num %#lx from Rudp Send Buffer", (unsigned long)seq_num);
+
+	if(!sample_rtt || !send_buffer->rtt_sampled || !send_buffer->packets_count || !send_buffer->rudp)
+		return;
+
+	// an ack that doesn't cover the oldest packet although it was sent more than an rtt ago means it got lost
+	ChiakiRudpSendBufferPacket *oldest = packet_slot(send_buffer, send_buffer->seq_num_begin);
+	if(!oldest->fast_resent && oldest->tries < RUDP_DATA_RESEND_TRIES_MAX
+			&& now - oldest->last_send_us > send_buffer->srtt_us + send_buffer->rttvar_us)
 	{
-		// do final shift
-		if(shift_start + shift < send_buffer->packets_count)
-		{
-			memmove(send_buffer->packets + shift_start,
-					send_buffer->packets + shift_start + shift,
-					(send_buffer->packets_count - (shift_start + shift)) * sizeof(ChiakiRudpSendBufferPacket));
-		}
-		send_buffer->packets_count -= shift;
+		oldest->fast_resent = true;
+		packet_resend(send_buffer, oldest, now);
 	}
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_rudp_send_buffer_ack(ChiakiRudpSendBuffer *send_buffer, ChiakiSeqNum16 seq_num, ChiakiSeqNum16 *acked_seq_nums, size_t *acked_seq_nums_count)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&send_buffer->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
 
-	CHIAKI_LOGV(send_buffer->log, "Acked seq num %#lx from Rudp Send Buffer", (unsigned long)seq_num);
+	if(acked_seq_nums_count)
+		*acked_seq_nums_count = 0;
+
+	send_buffer_ack(send_buffer, seq_num, true, acked_seq_nums, acked_seq_nums_count);
 
 	chiaki_mutex_unlock(&send_buffer->mutex);
 	return err;
 }
 
-static void rudp_send_buffer_resend(ChiakiRudpSendBuffer *send_buffer);
+static uint64_t rudp_send_buffer_resend(ChiakiRudpSendBuffer *send_buffer);
 
 static bool rudp_send_buffer_check_pred_packets(void *user)
 {
@@ -256,10 +343,11 @@ static void *rudp_send_buffer_thread_func(void *user)
 	if(err != CHIAKI_ERR_SUCCESS)
 		return NULL;
 
+	uint64_t wakeup_timeout_ms = RUDP_DATA_RESEND_TIMEOUT_INITIAL_US / 1000;
 	while(true)
 	{
-		if(send_buffer->packets_count) // if there are packets, wait with timeout
-			err = chiaki_cond_timedwait_pred(&send_buffer->cond, &send_buffer->mutex, RUDP_DATA_RESEND_WAKEUP_TIMEOUT_MS, rudp_send_buffer_check_pred_packets, send_buffer);
+		if(send_buffer->packets_count) // if there are packets, wait until the next one is due
+			err = chiaki_cond_timedwait_pred(&send_buffer->cond, &send_buffer->mutex, wakeup_timeout_ms, rudp_send_buffer_check_pred_packets, send_buffer);
 		else // if not, wait without timeout, but also wakeup if packets become available
 			err = chiaki_cond_wait_pred(&send_buffer->cond, &send_buffer->mutex, rudp_send_buffer_check_pred_no_packets, send_buffer);
 
@@ -269,7 +357,8 @@ static void *rudp_send_buffer_thread_func(void *user)
 		if(send_buffer->should_stop)
 			break;
 
-		rudp_send_buffer_resend(send_buffer);
+		// rounded up, waking up before the packet is due would only find nothing to do
+		wakeup_timeout_ms = (rudp_send_buffer_resend(send_buffer) + 999) / 1000;
 	}
 
 	chiaki_mutex_unlock(&send_buffer->mutex);
@@ -277,37 +366,57 @@ static void *rudp_send_buffer_thread_func(void *user)
 	return NULL;
 }
 
-static void rudp_send_buffer_resend(ChiakiRudpSendBuffer *send_buffer)
+/**
+ * Re-send the oldest packets whose timeout of rto_us, doubled for every previous try, has expired,
+ * at most RUDP_DATA_RESEND_BURST_MAX at once.
+ *
+ * @return us until the next packet is due
+ */
+static uint64_t rudp_send_buffer_resend(ChiakiRudpSendBuffer *send_buffer)
 {
+	uint64_t next_due_us = send_buffer->rto_us;
 	if(!send_buffer->rudp)
-		return;
+		return next_due_us;
 
-	uint64_t now = chiaki_time_now_monotonic_ms();
+	uint64_t now = chiaki_time_now_monotonic_us();
+	size_t resent = 0;
 
-	for(size_t i=0; i<send_buffer->packets_count; i++)
+	ChiakiSeqNum16 seq_num = send_buffer->seq_num_begin;
+	while(send_buffer->packets_count > 0 && chiaki_seq_num_16_lt(seq_num, send_buffer->seq_num_end))
 	{
-		ChiakiRudpSendBufferPacket *packet = &send_buffer->packets[i];
-		if(now - packet->last_send_ms > RUDP_DATA_RESEND_TIMEOUT_MS)
+		ChiakiRudpSendBufferPacket *packet = packet_slot(send_buffer, seq_num);
+		seq_num++;
+		if(!packet->set)
+			continue;
+		uint64_t timeout = send_buffer->rto_us << packet->tries;
+		if(timeout > RUDP_DATA_RESEND_TIMEOUT_MAX_US || packet->tries >= 32)
+			timeout = RUDP_DATA_RESEND_TIMEOUT_MAX_US;
+		uint64_t elapsed = now - packet->last_send_us;
+		if(elapsed >= timeout)
 		{
 			if(packet->tries >= RUDP_DATA_RESEND_TRIES_MAX)
 			{
 				CHIAKI_LOGI(send_buffer->log, "Hit max retries of %d tries giving up on packet with seqnum %#lx", RUDP_DATA_RESEND_TRIES_MAX, (unsigned long)packet->seq_num);
-				ChiakiSeqNum16 ack_seq_nums;
-				size_t ack_seq_nums_count;
-				chiaki_mutex_unlock(&send_buffer->mutex);
-				chiaki_rudp_send_buffer_ack(send_buffer, packet->seq_num, &ack_seq_nums, &ack_seq_nums_count);
-				chiaki_mutex_lock(&send_buffer->mutex);
-				i-= 1;
+				send_buffer_ack(send_buffer, packet->seq_num, false, NULL, NULL);
 				continue;
 			}
-			char packet_type[29] = {0};
-			GetRudpPacketType(send_buffer, *((uint16_t *)(packet->buf + 6)), packet_type);
-			CHIAKI_LOGI(send_buffer->log, "rudp Send Buffer re-sending packet with seqnum %#lx and type %s, tries: %llu", (unsigned long)packet->seq_num, packet_type, (unsigned long long)packet->tries);
-			packet->last_send_ms = now;
-			chiaki_rudp_send_raw(send_buffer->rudp, packet->buf, packet->buf_size);
-			packet->tries++;
+			if(resent >= RUDP_DATA_RESEND_BURST_MAX)
+			{
+				next_due_us = RUDP_DATA_RESEND_PACING_US;
+				break;
+			}
+			packet_resend(send_buffer, packet, now);
+			resent++;
+			timeout = send_buffer->rto_us << packet->tries;
+			if(timeout > RUDP_DATA_RESEND_TIMEOUT_MAX_US)
+				timeout = RUDP_DATA_RESEND_TIMEOUT_MAX_US;
+			elapsed = 0;
 		}
+		if(timeout - elapsed < next_due_us)
+			next_due_us = timeout - elapsed;
 	}
+
+	return next_due_us ? next_due_us : 1;
 }
 
 #endif
@@ -16,8 +16,13 @@
 #include <chiaki/seqnum.h>
 #include <chiaki/sock.h>
 #include <chiaki/random.h>
+#include <chiaki/time.h>
 
 #define STUN_REPLY_TIMEOUT_SEC 1
+// servers queried at once over the same socket
+#define STUN_PARALLEL_QUERIES 4
+// how long to wait for a second server to confirm the first answer
+#define STUN_CONFIRM_WAIT_MS 100
 
 #define STUN_HEADER_SIZE 20
 #define STUN_MSG_TYPE_BINDING_REQUEST 0x0001
@@ -49,13 +54,36 @@ StunServer STUN_SERVERS[] = {
     {"stun4.l.google.com", 19305}
 };
 
-static bool stun_get_external_address_from_server(ChiakiLog *log, StunServer *server, char *address, uint16_t *port, chiaki_socket_t *sock, bool ipv4);
+#define STUN_SERVERS_COUNT (sizeof(STUN_SERVERS) / sizeof(StunServer))
+
+typedef struct stun_result_t {
+    bool ok;
+    size_t arrival; // order the answers came in
+    char address[INET6_ADDRSTRLEN];
+    uint16_t port;
+} StunResult;
+
+static size_t stun_query_servers(ChiakiLog *log, StunServer *servers, size_t num_servers, chiaki_socket_t *sock, bool ipv4, size_t needed, uint64_t confirm_wait_ms, StunResult *results);
+
+/**
+ * Shuffle order of servers other than moonlight server
+ */
+static void stun_shuffle_servers()
+{
+    for (size_t i = STUN_SERVERS_COUNT - 1; i > 1; i--) {
+        size_t j = 1 + chiaki_random_32() % i;
+        StunServer temp = STUN_SERVERS[i];
+        STUN_SERVERS[i] = STUN_SERVERS[j];
+        STUN_SERVERS[j] = temp;
+    }
+}
 
 /**
  * Get external address and port using STUN.
  *
- * This will try multiple STUN servers, preferring the STUN server of the Moonlight
- * project, and if that fails, trying other STUN servers in random order.
+ * This will query STUN_PARALLEL_QUERIES servers at a time, preferring the passed servers
+ * and then the STUN server of the Moonlight project, followed by the other STUN servers in random order.
+ * The first answer is used, after waiting briefly for a second one to confirm it.
  *
  * @param log Log context
  * @param[out] address Buffer to store address in
@@ -64,39 +92,72 @@ static bool stun_get_external_address_from_server(ChiakiLog *log, StunServer *se
  */
 static bool stun_get_external_address(ChiakiLog *log, char *address, uint16_t *port, StunServer *passed_servers, size_t num_passed_servers, chiaki_socket_t *sock, bool ipv4)
 {
-    // Try servers preferred by user (i.e., known to be online)
-    if(num_passed_servers > 0)
+    stun_shuffle_servers();
+    StunServer *lists[2] = { passed_servers, STUN_SERVERS };
+    size_t counts[2] = { num_passed_servers, STUN_SERVERS_COUNT };
+    for (int l = 0; l < 2; l++)
     {
-       for (int i = 0; i < num_passed_servers; i++)
+        for (size_t i = 0; i < counts[l]; i += STUN_PARALLEL_QUERIES)
         {
             if(CHIAKI_SOCKET_IS_INVALID(*sock))
                 return false;
-            if (stun_get_external_address_from_server(log, &passed_servers[i], address, port, sock, ipv4))
-                return true;
-            CHIAKI_LOGW(log, "Failed to get external address from %s:%d, retrying with another STUN server...", passed_servers[i].host, passed_servers[i].port);
-        }
-    }
-    // Shuffle order of servers other than moonlight server
-    size_t num_servers = sizeof(STUN_SERVERS) / sizeof(StunServer);
-    for (int i = num_servers - 1; i > 1; i--) {
-        int j = 1 + chiaki_random_32() % (i - 1);
-        StunServer temp = STUN_SERVERS[i];
-        STUN_SERVERS[i] = STUN_SERVERS[j];
-        STUN_SERVERS[j] = temp;
-    }
-    // Try other servers
-    for (int i = 0; i < num_servers; i++) {
-        if(CHIAKI_SOCKET_IS_INVALID(*sock))
-            return false;
-        if (stun_get_external_address_from_server(log, &STUN_SERVERS[i], address, port, sock, ipv4)) {
+            size_t num = counts[l] - i < STUN_PARALLEL_QUERIES ? counts[l] - i : STUN_PARALLEL_QUERIES;
+            StunResult results[STUN_PARALLEL_QUERIES];
+            if (!stun_query_servers(log, &lists[l][i], num, sock, ipv4, 2, STUN_CONFIRM_WAIT_MS, results))
+            {
+                CHIAKI_LOGW(log, "Failed to get external address from %d STUN servers, retrying with other STUN servers...", (int)num);
+                continue;
+            }
+            StunResult *first = NULL;
+            StunResult *second = NULL;
+            for (size_t j = 0; j < num; j++)
+            {
+                if (!results[j].ok)
+                    continue;
+                if (results[j].arrival == 0)
+                    first = &results[j];
+                else if (results[j].arrival == 1)
+                    second = &results[j];
+            }
+            if (second && (strcmp(first->address, second->address) != 0 || first->port != second->port))
+                CHIAKI_LOGW(log, "STUN servers disagree on the external address (%s:%d and %s:%d), using the first answer", first->address, first->port, second->address, second->port);
+            memcpy(address, first->address, sizeof(first->address));
+            *port = first->port;
             return true;
         }
-        CHIAKI_LOGW(log, "Failed to get external address from %s:%d, retrying with another STUN server...", STUN_SERVERS[i].host, STUN_SERVERS[i].port);
     }
     CHIAKI_LOGE(log, "Failed to get external address from any STUN server.");
     return false;
 }
 
+/**
+ * Query servers in batches until max mapped addresses are collected.
+ * The addresses are appended in the order the requests were sent, which is the order the NAT allocated them in.
+ *
+ * @return count of addresses collected, including the count already collected before
+ */
+static size_t stun_collect_addresses(ChiakiLog *log, StunServer *servers, size_t num_servers, chiaki_socket_t *sock, char **addrs, uint16_t **ports, size_t count, size_t max)
+{
+    for (size_t i = 0; i < num_servers && count < max; i += STUN_PARALLEL_QUERIES)
+    {
+        if(CHIAKI_SOCKET_IS_INVALID(*sock))
+            break;
+        size_t num = num_servers - i < STUN_PARALLEL_QUERIES ? num_servers - i : STUN_PARALLEL_QUERIES;
+        StunResult results[STUN_PARALLEL_QUERIES];
+        stun_query_servers(log, &servers[i], num, sock, true, max - count, 0, results);
+        for (size_t j = 0; j < num && count < max; j++)
+        {
+            if (!results[j].ok)
+                continue;
+            CHIAKI_LOGV(log, "Got response from STUN server %s:%d", servers[i + j].host, servers[i + j].port);
+            memcpy(addrs[count], results[j].address, sizeof(results[j].address));
+            *ports[count] = results[j].port;
+            count++;
+        }
+    }
+    return count;
+}
+
 /**
  * Get external address and port using STUN.
  *
@@ -120,104 +181,15 @@ CHIAKI_EXPORT bool stun_port_allocation_test(ChiakiLog *log, char *address, uint
     char addr3[INET6_ADDRSTRLEN];
     char addr4[INET6_ADDRSTRLEN];
 
-    // Try servers preferred by user (i.e., known to be online)
-    if(num_passed_servers > 0)
+    char *addrs[4] = { addr1, addr2, addr3, addr4 };
+    uint16_t *ports[4] = { &port1, &port2, &port3, &port4 };
+
+    // Try servers preferred by user (i.e., known to be online), then the others
+    size_t count = stun_collect_addresses(log, passed_servers, num_passed_servers, sock, addrs, ports, 0, 4);
+    if(count < 4)
     {
-        for (int i = 0; i < num_passed_servers; i++)
-        {
-            if(port1 == 0)
-            {
-                if(CHIAKI_SOCKET_IS_INVALID(*sock))
-                    break;
-                if (!stun_get_external_address_from_server(log, &passed_servers[i], addr1, &port1, sock, true))
-                    CHIAKI_LOGW(log, "Failed to get external address from %s:%d, retrying with another STUN server...", passed_servers[i].host, passed_servers[i].port);
-                else
-                    CHIAKI_LOGV(log, "Got response from STUN server %s:%d", passed_servers[i].host, passed_servers[i].port);
-            }
-            else if(port2 == 0)
-            {
-                if(CHIAKI_SOCKET_IS_INVALID(*sock))
-                    break;
-                if (!stun_get_external_address_from_server(log, &passed_servers[i], addr2, &port2, sock, true))
-                    CHIAKI_LOGW(log, "Failed to get external address from %s:%d, retrying with another STUN server...", passed_servers[i].host, passed_servers[i].port);
-                else
-                    CHIAKI_LOGV(log, "Got response from STUN server %s:%d", passed_servers[i].host, passed_servers[i].port);
-            }
-            else if(port3 == 0)
-            {
-                if(CHIAKI_SOCKET_IS_INVALID(*sock))
-                    break;
-                if (!stun_get_external_address_from_server(log, &passed_servers[i], addr3, &port3, sock, true))
-                    CHIAKI_LOGW(log, "Failed to get external address from %s:%d, retrying with another STUN server...", passed_servers[i].host, passed_servers[i].port);
-                else
-                    CHIAKI_LOGV(log, "Got response from STUN server %s:%d", passed_servers[i].host, passed_servers[i].port);
-            }
-            else if(port4 == 0)
-            {
-                if(CHIAKI_SOCKET_IS_INVALID(*sock))
-                    break;
-                if (stun_get_external_address_from_server(log, &passed_servers[i], addr4, &port4, sock, true))
-                {
-                    CHIAKI_LOGV(log, "Got response from STUN server %s:%d", passed_servers[i].host, passed_servers[i].port);
-                    break;
-                }
-                else
-                    CHIAKI_LOGW(log, "Failed to get external address from %s:%d, retrying with another STUN server...", passed_servers[i].host, passed_servers[i].port);
-            }
-        }
-    }
-    if(port4 == 0)
-    {
-        size_t num_servers = sizeof(STUN_SERVERS) / sizeof(StunServer);
-        for (int i = num_servers; i > 0; i--) {
-            int j = chiaki_random_32() % i;
-            StunServer temp = STUN_SERVERS[i];
-            STUN_SERVERS[i] = STUN_SERVERS[j];
-            STUN_SERVERS[j] = temp;
-        }
-        // Try other servers
-        for (int i = 0; i < num_servers; i++)
-        {
-            if(port1 == 0)
-            {
-                if(CHIAKI_SOCKET_IS_INVALID(*sock))
-                    break;
-                if (!stun_get_external_address_from_server(log, &STUN_SERVERS[i], addr1, &port1, sock, true))
-                    CHIAKI_LOGW(log, "Failed to get external address from %s:%d, retrying with another STUN server...", STUN_SERVERS[i].host, STUN_SERVERS[i].port);
-                else
-                    CHIAKI_LOGV(log, "Got response from STUN server %s:%d", STUN_SERVERS[i].host, STUN_SERVERS[i].port);
-            }
-            else if(port2 == 0)
-            {
-                if(CHIAKI_SOCKET_IS_INVALID(*sock))
-                    break;
-                if (!stun_get_external_address_from_server(log, &STUN_SERVERS[i], addr2, &port2, sock, true))
-                    CHIAKI_LOGW(log, "Failed to get external address from %s:%d, retrying with another STUN server...", STUN_SERVERS[i].host, STUN_SERVERS[i].port);
-                else
-                    CHIAKI_LOGV(log, "Got response from STUN server %s:%d", STUN_SERVERS[i].host, STUN_SERVERS[i].port);
-            }
-            else if(port3 == 0)
-            {
-                if(CHIAKI_SOCKET_IS_INVALID(*sock))
-                    break;
-                if (!stun_get_external_address_from_server(log, &STUN_SERVERS[i], addr3, &port3, sock, true))
-                    CHIAKI_LOGW(log, "Failed to get external address from %s:%d, retrying with another STUN server...", STUN_SERVERS[i].host, STUN_SERVERS[i].port);
-                else
-                    CHIAKI_LOGV(log, "Got response from STUN server %s:%d", STUN_SERVERS[i].host, STUN_SERVERS[i].port);
-            }
-            else if(port4 == 0)
-            {
-                if(CHIAKI_SOCKET_IS_INVALID(*sock))
-                    break;
-                if (stun_get_external_address_from_server(log, &STUN_SERVERS[i], addr4, &port4, sock, true))
-                {
-                    CHIAKI_LOGV(log, "Got response from STUN server %s:%d", STUN_SERVERS[i].host, STUN_SERVERS[i].port);
-                    break;
-                }
-                else
-                    CHIAKI_LOGW(log, "Failed to get external address from %s:%d, retrying with another STUN server...", STUN_SERVERS[i].host, STUN_SERVERS[i].port);
-            }
-        }
+        stun_shuffle_servers();
+        count = stun_collect_addresses(log, STUN_SERVERS, STUN_SERVERS_COUNT, sock, addrs, ports, count, 4);
     }
     // No servers returned
     if(port1 == 0)
@@ -436,12 +408,10 @@ CHIAKI_EXPORT bool stun_port_allocation_test(ChiakiLog *log, char *address, uint
     return true;
 }
 
-static bool stun_get_external_address_from_server(ChiakiLog *log, StunServer *server, char *address, uint16_t *port, chiaki_socket_t *sock, bool ipv4)
+static bool stun_resolve_server(ChiakiLog *log, StunServer *server, bool ipv4, struct sockaddr_in6 *server_addr, socklen_t *server_addr_len)
 {
     struct addrinfo* resolved;
     struct addrinfo hints;
-    struct sockaddr_in6 *server_addr;
-    socklen_t server_addr_len;
     memset(&hints, 0, sizeof(hints));
     if(ipv4)
         hints.ai_family = AF_INET;
@@ -457,57 +427,127 @@ static bool stun_get_external_address_from_server(ChiakiLog *log, StunServer *se
         CHIAKI_LOGE(log, "remote/stun.h: Failed to resolve STUN server '%s', error was " CHIAKI_SOCKET_ERROR_FMT, server->host, CHIAKI_SOCKET_ERROR_VALUE);
         return false;
     }
+    *server_addr_len = ipv4 ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+    memcpy(server_addr, resolved->ai_addr, *server_addr_len);
+    freeaddrinfo(resolved);
+    return true;
+}
 
-    if(ipv4)
-    {
-        server_addr = (struct sockaddr_in6*)resolved->ai_addr;
-        server_addr_len = sizeof(struct sockaddr_in);
-    }
-    else
-    {
-        server_addr = (struct sockaddr_in6*)resolved->ai_addr;
-        server_addr_len = sizeof(struct sockaddr_in6);
-    }
-
-    uint8_t binding_req[STUN_HEADER_SIZE];
-    memset(binding_req, 0, sizeof(binding_req));
+static void stun_build_binding_request(uint8_t *binding_req)
+{
+    memset(binding_req, 0, STUN_HEADER_SIZE);
     *(uint16_t*)(&binding_req[0]) = htons(STUN_MSG_TYPE_BINDING_REQUEST);
     *(uint16_t*)(&binding_req[2]) = htons(0);  // Length
     *(int*)(&binding_req[4]) = htonl(STUN_MAGIC_COOKIE);
     chiaki_random_bytes_crypt(&binding_req[8], STUN_TRANSACTION_ID_LENGTH);
+}
 
-    CHIAKI_SSIZET_TYPE sent = sendto(*sock, (CHIAKI_SOCKET_BUF_TYPE)binding_req, sizeof(binding_req), 0, (struct sockaddr*)server_addr, server_addr_len);
-    if (sent != sizeof(binding_req)) {
-        CHIAKI_LOGE(log, "remote/stun.h: Failed to send STUN request, error was " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
-        CHIAKI_SOCKET_CLOSE(*sock);
-        *sock = CHIAKI_INVALID_SOCKET;
-        freeaddrinfo(resolved);
-        return false;
-    }
-    freeaddrinfo(resolved);
+static bool stun_parse_binding_response(ChiakiLog *log, uint8_t *binding_resp, CHIAKI_SSIZET_TYPE received, uint8_t *binding_req, char *address, uint16_t *port);
 
-#ifdef _WIN32
-    int timeout = STUN_REPLY_TIMEOUT_SEC * 1000;
-#else
-    struct timeval timeout;
-    timeout.tv_sec = STUN_REPLY_TIMEOUT_SEC;
-    timeout.tv_usec = 0;
-#endif
-    if (setsockopt(*sock, SOL_SOCKET, SO_RCVTIMEO, (const CHIAKI_SOCKET_BUF_TYPE)&timeout, sizeof(timeout)) < 0) {
-        CHIAKI_LOGE(log, "remote/stun.h: Failed to set socket timeout, error was " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
-        CHIAKI_SOCKET_CLOSE(*sock);
-        *sock = CHIAKI_INVALID_SOCKET;
-        return false;
+/**
+ * Send a binding request to each of the servers at once over sock and collect the answers.
+ *
+ * Returns once needed answers came in, confirm_wait_ms after the first answer if not 0,
+ * or after STUN_REPLY_TIMEOUT_SEC.
+ *
+ * @param num_servers at most STUN_PARALLEL_QUERIES
+ * @param[out] results one per server, in the order the requests were sent
+ * @return count of answers
+ */
+static size_t stun_query_servers(ChiakiLog *log, StunServer *servers, size_t num_servers, chiaki_socket_t *sock, bool ipv4, size_t needed, uint64_t confirm_wait_ms, StunResult *results)
+{
+    uint8_t binding_reqs[STUN_PARALLEL_QUERIES][STUN_HEADER_SIZE];
+    bool sent[STUN_PARALLEL_QUERIES];
+    size_t pending = 0;
+    if (num_servers > STUN_PARALLEL_QUERIES)
+        num_servers = STUN_PARALLEL_QUERIES;
+
+    for (size_t i = 0; i < num_servers; i++)
+    {
+        results[i].ok = false;
+        sent[i] = false;
+    }
+    for (size_t i = 0; i < num_servers; i++)
+    {
+        struct sockaddr_in6 server_addr;
+        socklen_t server_addr_len;
+        if (!stun_resolve_server(log, &servers[i], ipv4, &server_addr, &server_addr_len))
+            continue;
+        stun_build_binding_request(binding_reqs[i]);
+        CHIAKI_SSIZET_TYPE sent_size = sendto(*sock, (CHIAKI_SOCKET_BUF_TYPE)binding_reqs[i], sizeof(binding_reqs[i]), 0, (struct sockaddr*)&server_addr, server_addr_len);
+        if (sent_size != sizeof(binding_reqs[i])) {
+            CHIAKI_LOGE(log, "remote/stun.h: Failed to send STUN request, error was " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+            CHIAKI_SOCKET_CLOSE(*sock);
+            *sock = CHIAKI_INVALID_SOCKET;
+            return 0;
+        }
+        sent[i] = true;
+        pending++;
     }
 
-    uint8_t binding_resp[256];
-    CHIAKI_SSIZET_TYPE received = recvfrom(*sock, (CHIAKI_SOCKET_BUF_TYPE)binding_resp, sizeof(binding_resp), 0, NULL, NULL);
-    if (received < 0) {
-        CHIAKI_LOGE(log, "remote/stun.h: Failed to receive STUN response, error was " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
-        return false;
+    size_t answers = 0;
+    uint64_t deadline_ms = chiaki_time_now_monotonic_ms() + STUN_REPLY_TIMEOUT_SEC * 1000;
+    while (pending && answers < needed)
+    {
+        uint64_t now_ms = chiaki_time_now_monotonic_ms();
+        if (now_ms >= deadline_ms)
+            break;
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(*sock, &fds);
+        struct timeval timeout;
+        timeout.tv_sec = (deadline_ms - now_ms) / 1000;
+        timeout.tv_usec = ((deadline_ms - now_ms) % 1000) * 1000;
+        int ret = select(*sock + 1, &fds, NULL, NULL, &timeout);
+        if (ret < 0) {
+            CHIAKI_LOGE(log, "remote/stun.h: Failed to wait for STUN responses, error was " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+            break;
+        }
+        if (ret == 0)
+            break;
+
+        uint8_t binding_resp[256];
+        CHIAKI_SSIZET_TYPE received = recvfrom(*sock, (CHIAKI_SOCKET_BUF_TYPE)binding_resp, sizeof(binding_resp), 0, NULL, NULL);
+        if (received < 0) {
+            CHIAKI_LOGE(log, "remote/stun.h: Failed to receive STUN response, error was " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+            continue;
+        }
+        if (received < STUN_HEADER_SIZE)
+            continue;
+
+        // match the answer to its request by transaction ID
+        size_t i = 0;
+        for (; i < num_servers; i++)
+        {
+            if (sent[i] && !results[i].ok && memcmp(&binding_resp[8], &binding_reqs[i][8], STUN_TRANSACTION_ID_LENGTH) == 0)
+                break;
+        }
+        if (i == num_servers) {
+            CHIAKI_LOGE(log, "remote/stun.h: Received STUN response with invalid transaction ID");
+            continue;
+        }
+        pending--;
+        if (!stun_parse_binding_response(log, binding_resp, received, binding_reqs[i], results[i].address, &results[i].port))
+        {
+            sent[i] = false;
+            continue;
+        }
+        results[i].ok = true;
+        results[i].arrival = answers++;
+        if (answers == 1 && confirm_wait_ms && now_ms + confirm_wait_ms < deadline_ms)
+            deadline_ms = chiaki_time_now_monotonic_ms() + confirm_wait_ms;
     }
 
+    for (size_t i = 0; i < num_servers; i++)
+    {
+        if (sent[i] && !results[i].ok && answers < needed)
+            CHIAKI_LOGW(log, "Failed to get external address from %s:%d", servers[i].host, servers[i].port);
+    }
+    return answers;
+}
 
+static bool stun_parse_binding_response(ChiakiLog *log, uint8_t *binding_resp, CHIAKI_SSIZET_TYPE received, uint8_t *binding_req, char *address, uint16_t *port)
+{
     if (*(uint16_t*)(&binding_resp[0]) != htons(STUN_MSG_TYPE_BINDING_RESPONSE)) {
         CHIAKI_LOGE(log, "remote/stun.h: Received STUN response with invalid message type");
         return false;
@@ -525,11 +565,6 @@ static bool stun_get_external_address_from_server(ChiakiLog *log, StunServer *se
         return false;
     }
 
-    if (memcmp(&binding_resp[8], &binding_req[8], STUN_TRANSACTION_ID_LENGTH) != 0) {
-        CHIAKI_LOGE(log, "remote/stun.h: Received STUN response with invalid transaction ID");
-        return false;
-    }
-
     //uint16_t response_attrs_length = ntohs(*(uint16_t*)(&binding_resp[2]));
     uint16_t response_pos = STUN_HEADER_SIZE;
     while (response_pos < received)
@@ -12,6 +12,9 @@
 #define QUEUE_SIZE (1 << queue->size_exp)
 #define IDX_MASK ((1 << queue->size_exp) - 1)
 #define idx(seq_num) ((seq_num) & IDX_MASK)
+#define bit_get(queue, i) chiaki_reorder_queue_bit_get((queue)->set_bits, (i))
+#define bit_set(queue, i) chiaki_reorder_queue_bit_set((queue)->set_bits, (i))
+#define bit_clear(queue, i) chiaki_reorder_queue_bit_clear((queue)->set_bits, (i))
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_reorder_queue_init(ChiakiReorderQueue *queue, size_t size_exp,
 		uint64_t seq_num_start, ChiakiReorderQueueSeqNumGt seq_num_gt, ChiakiReorderQueueSeqNumLt seq_num_lt, ChiakiReorderQueueSeqNumAdd seq_num_add)
@@ -28,13 +31,19 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_reorder_queue_init(ChiakiReorderQueue *queu
 	queue->queue = calloc(1 << size_exp, sizeof(ChiakiReorderQueueEntry));
 	if(!queue->queue)
 		return CHIAKI_ERR_MEMORY;
+	queue->set_bits = calloc(CHIAKI_REORDER_QUEUE_BITS_WORDS(size_exp), sizeof(uint64_t));
+	if(!queue->set_bits)
+	{
+		free(queue->queue);
+		return CHIAKI_ERR_MEMORY;
+	}
 	return CHIAKI_ERR_SUCCESS;
 }
 
 #define REORDER_QUEUE_INIT(bits) \
 static bool seq_num_##bits##_gt(uint64_t a, uint64_t b) { return chiaki_seq_num_##bits##_gt((ChiakiSeqNum##bits)a, (ChiakiSeqNum##bits)b); } \
 static bool seq_num_##bits##_lt(uint64_t a, uint64_t b) { return chiaki_seq_num_##bits##_lt((ChiakiSeqNum##bits)a, (ChiakiSeqNum##bits)b); } \
-static uint64_t seq_num_##bits##_add(uint64_t a, uint64_t b) { return (uint64_t)((ChiakiSeqNum##bits)a + (ChiakiSeqNum##bits)b); } \
+static uint64_t seq_num_##bits##_add(uint64_t a, uint64_t b) { return (uint64_t)(ChiakiSeqNum##bits)((ChiakiSeqNum##bits)a + (ChiakiSeqNum##bits)b); } \
 \
 CHIAKI_EXPORT ChiakiErrorCode chiaki_reorder_queue_init_##bits(ChiakiReorderQueue *queue, size_t size_exp, ChiakiSeqNum##bits seq_num_start) \
 { \
@@ -52,11 +61,11 @@ CHIAKI_EXPORT void chiaki_reorder_queue_fini(ChiakiReorderQueue *queue)
 		for(uint64_t i=0; i<queue->count; i++)
 		{
 			uint64_t seq_num = add(queue->begin, i);
-			ChiakiReorderQueueEntry *entry = &queue->queue[idx(seq_num)];
-			if(entry->set)
-				queue->drop_cb(seq_num, entry->user, queue->drop_cb_user);
+			if(bit_get(queue, idx(seq_num)))
+				queue->drop_cb(seq_num, queue->queue[idx(seq_num)].user, queue->drop_cb_user);
 		}
 	}
+	free(queue->set_bits);
 	free(queue->queue);
 }
 
@@ -67,11 +76,10 @@ CHIAKI_EXPORT void chiaki_reorder_queue_push(ChiakiReorderQueue *queue, uint64_t
 
 	if(ge(seq_num, queue->begin) && lt(seq_num, end))
 	{
-		ChiakiReorderQueueEntry *entry = &queue->queue[idx(seq_num)];
-		if(entry->set) // received twice
+		if(bit_get(queue, idx(seq_num))) // received twice
 			goto drop_it;
-		entry->user = user;
-		entry->set = true;
+		queue->queue[idx(seq_num)].user = user;
+		bit_set(queue, idx(seq_num));
 		return;
 	}
 
@@ -92,9 +100,12 @@ CHIAKI_EXPORT void chiaki_reorder_queue_push(ChiakiReorderQueue *queue, uint64_t
 		// drop first until empty or enough space
 		while(queue->count > 0 && lt(total_end, new_end))
 		{
-			ChiakiReorderQueueEntry *entry = &queue->queue[idx(queue->begin)];
-			if(entry->set && queue->drop_cb)
-				queue->drop_cb(queue->begin, entry->user, queue->drop_cb_user);
+			if(bit_get(queue, idx(queue->begin)))
+			{
+				bit_clear(queue, idx(queue->begin));
+				if(queue->drop_cb)
+					queue->drop_cb(queue->begin, queue->queue[idx(queue->begin)].user, queue->drop_cb_user);
+			}
 			queue->begin = add(queue->begin, 1);
 			queue->count--;
 			free_elems = QUEUE_SIZE - queue->count;
@@ -106,19 +117,17 @@ CHIAKI_EXPORT void chiaki_reorder_queue_push(ChiakiReorderQueue *queue, uint64_t
 			queue->begin = seq_num;
 	}
 
-	// move end until new_end
+	// move end until new_end, the bits of everything outside of the queue are always clear
 	end = add(queue->begin, queue->count);
 	while(lt(end, new_end))
 	{
 		queue->count++;
-		queue->queue[idx(end)].set = false;
 		end = add(queue->begin, queue->count);
 		assert(queue->count <= QUEUE_SIZE);
 	}
 
-	ChiakiReorderQueueEntry *entry = &queue->queue[idx(seq_num)];
-	entry->set = true;
-	entry->user = user;
+	queue->queue[idx(seq_num)].user = user;
+	bit_set(queue, idx(seq_num));
 
 	return;
 drop_it:
@@ -132,31 +141,37 @@ CHIAKI_EXPORT bool chiaki_reorder_queue_pull(ChiakiReorderQueue *queue, uint64_t
 	if(queue->count == 0)
 		return false;
 
-	ChiakiReorderQueueEntry *entry = &queue->queue[idx(queue->begin)];
-	if(!entry->set)
+	uint64_t i = idx(queue->begin);
+	if(!bit_get(queue, i))
 		return false;
+	bit_clear(queue, i);
 
 	if(seq_num)
 		*seq_num = queue->begin;
 	if(user)
-		*user = entry->user;
+		*user = queue->queue[i].user;
 	queue->begin = add(queue->begin, 1);
 	queue->count--;
 	return true;
 }
 
+CHIAKI_EXPORT uint64_t chiaki_reorder_queue_ready(ChiakiReorderQueue *queue)
+{
+	return chiaki_reorder_queue_bits_run(queue->set_bits, queue->size_exp, idx(queue->begin), queue->count);
+}
+
 CHIAKI_EXPORT bool chiaki_reorder_queue_peek(ChiakiReorderQueue *queue, uint64_t index, uint64_t *seq_num, void **user)
 {
 	if(index >= queue->count)
 		return false;
 
 	uint64_t seq_num_val = add(queue->begin, index);
-	ChiakiReorderQueueEntry *entry = &queue->queue[idx(seq_num_val)];
-	if(!entry->set)
+	if(!bit_get(queue, idx(seq_num_val)))
 		return false;
 
-	*seq_num = seq_num_val;
-	*user = entry->user;
+	if(seq_num)
+		*seq_num = seq_num_val;
+	*user = queue->queue[idx(seq_num_val)].user;
 	return true;
 }
 
@@ -166,23 +181,17 @@ CHIAKI_EXPORT void chiaki_reorder_queue_drop(ChiakiReorderQueue *queue, uint64_t
 		return;
 
 	uint64_t seq_num = add(queue->begin, index);
-	ChiakiReorderQueueEntry *entry = &queue->queue[idx(seq_num)];
-	if(!entry->set)
+	if(!bit_get(queue, idx(seq_num)))
 		return;
+	bit_clear(queue, idx(seq_num));
 
 	if(queue->drop_cb)
-		queue->drop_cb(seq_num, entry->user, queue->drop_cb_user);
+		queue->drop_cb(seq_num, queue->queue[idx(seq_num)].user, queue->drop_cb_user);
 
 	// reduce count if necessary
 	if(index == queue->count - 1)
 	{
-		while(!entry->set)
-		{
+		while(queue->count > 0 && !bit_get(queue, idx(add(queue->begin, queue->count - 1))))
 			queue->count--;
-			if(queue->count == 0)
-				break;
-			seq_num = add(queue->begin, queue->count - 1);
-			entry = &queue->queue[idx(seq_num)];
-		}
 	}
 }
\ No newline at end of file
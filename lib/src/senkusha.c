@@ -33,6 +33,24 @@
 #define SENKUSHA_PING_COUNT_DEFAULT 10
 #define EXPECT_PONG_TIMEOUT_MS 1000
 
+// fast probe: pings are sent this far apart without waiting for the pongs
+#define FAST_PING_COUNT 8
+#define FAST_PING_INTERVAL_MS 2
+// stop pinging once this many RTT samples are within a quarter of the min RTT or FAST_PING_STABLE_SPREAD_US
+#define FAST_PING_STABLE_MIN 4
+#define FAST_PING_STABLE_SPREAD_US 500
+// once a pong has been received, timeouts are this multiple of the min RTT
+#define FAST_PONG_TIMEOUT_RTT_FACTOR 4
+#define FAST_PONG_TIMEOUT_MIN_MS 20
+// sizes probed in parallel per round of the MTU search, which stops once the MTU is known this precisely
+#define FAST_MTU_CANDIDATES 3
+#define FAST_MTU_PRECISION 16
+#define FAST_MTU_RETRIES 2
+
+#if FAST_PING_COUNT > CHIAKI_SENKUSHA_FAST_PINGS_MAX || FAST_MTU_CANDIDATES > CHIAKI_SENKUSHA_FAST_PINGS_MAX
+#error "Too many fast probes in flight"
+#endif
+
 // Assuming IPv4, sizeof(ip header) + sizeof(udp header)
 #define MTU_UDP_PACKET_ADD 0x1c
 
@@ -54,6 +72,8 @@ typedef enum {
 } SenkushaState;
 
 static ChiakiErrorCode senkusha_run_rtt_test(ChiakiSenkusha *senkusha, uint16_t ping_test_index, uint16_t ping_count, uint64_t *rtt_us);
+static ChiakiErrorCode senkusha_run_rtt_test_fast(ChiakiSenkusha *senkusha, uint16_t ping_test_index, uint16_t ping_count, uint64_t *rtt_us);
+static ChiakiErrorCode senkusha_mtu_search_fast(ChiakiSenkusha *senkusha, bool out, uint32_t *min, uint32_t *max, uint32_t first, uint32_t retries, uint64_t timeout_ms, uint8_t *packet_buf, size_t packet_buf_size);
 static ChiakiErrorCode senkusha_run_mtu_in_test(ChiakiSenkusha *senkusha, uint32_t min, uint32_t max, uint32_t retries, uint64_t timeout_ms, uint32_t *mtu);
 static ChiakiErrorCode senkusha_run_mtu_out_test(ChiakiSenkusha *senkusha, uint32_t mtu_in, uint32_t min, uint32_t max, uint32_t retries, uint64_t timeout_ms, uint32_t *mtu);
 static void senkusha_takion_cb(ChiakiTakionEvent *event, void *user);
@@ -64,6 +84,7 @@ static ChiakiErrorCode senkusha_set_version(ChiakiSenkusha *senkusha);
 static ChiakiErrorCode senkusha_send_big(ChiakiSenkusha *senkusha);
 static ChiakiErrorCode senkusha_send_disconnect(ChiakiSenkusha *senkusha);
 static ChiakiErrorCode senkusha_send_echo_command(ChiakiSenkusha *senkusha, bool enable);
+static ChiakiErrorCode senkusha_send_ping(ChiakiSenkusha *senkusha, uint16_t ping_test_index, uint16_t ping_index, uint32_t *tag);
 static ChiakiErrorCode senkusha_send_mtu_command(ChiakiSenkusha *senkusha, tkproto_SenkushaMtuCommand *command);
 static ChiakiErrorCode senkusha_send_client_mtu_command(ChiakiSenkusha *senkusha, tkproto_SenkushaClientMtuCommand *command, bool wait_for_ack);
 static ChiakiErrorCode senkusha_send_data_wait_for_ack(ChiakiSenkusha *senkusha, uint8_t *buf, size_t buf_size);
@@ -88,6 +109,10 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_init(ChiakiSenkusha *senkusha, Chi
 	senkusha->data_ack_seq_num_expected = 0;
 	senkusha->ping_tag = 0;
 	senkusha->pong_time_us = 0;
+	senkusha->fast_probe = session->connect_info.senkusha_fast_probe;
+	memset(senkusha->ping_tags, 0, sizeof(senkusha->ping_tags));
+	memset(senkusha->pong_times_us, 0, sizeof(senkusha->pong_times_us));
+	senkusha->mtu_answered = 0;
 
 	chiaki_key_state_init(&senkusha->takion.key_state);
 
@@ -111,10 +136,11 @@ static bool state_finished_cond_check(void *user)
 	return senkusha->state_finished || senkusha->should_stop;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint32_t *mtu_in, uint32_t *mtu_out, uint64_t *rtt_us, chiaki_socket_t *socket)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint32_t *mtu_in, uint32_t *mtu_out, uint64_t *rtt_us, uint64_t *probe_us, chiaki_socket_t *socket)
 {
 	ChiakiSession *session = senkusha->session;
 	ChiakiErrorCode err;
+	uint64_t start_us = chiaki_time_now_monotonic_us();
 
 	err = chiaki_mutex_lock(&senkusha->state_mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
@@ -152,7 +178,24 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint
 	takion_info.ip_dontfrag = true;
 
 	takion_info.enable_crypt = false;
+	takion_info.recv_batch = false;
+	takion_info.recv_ring_size_exp = 0;
+	takion_info.data_queue_size_exp = 0;
+	takion_info.initial_rtt_us = 0;
+	takion_info.timer_wheel = &session->timer_wheel;
+	takion_info.arena = &session->arena;
+	takion_info.capture = NULL;
+	takion_info.replay = NULL;
+	takion_info.impair = NULL;
 	takion_info.protocol_version = 7;
+	takion_info.av_substreams = CHIAKI_TAKION_AV_SUBSTREAM_ALL;
+	takion_info.mac_offload = false;
+	// the echo packets are timed, so acks must not wait
+	takion_info.ack_delay_us = 0;
+	takion_info.upstream_packets_budget = 0;
+	// marked like the stream, so the path is probed with the treatment the stream will get
+	memset(&takion_info.sock_options, 0, sizeof(takion_info.sock_options));
+	takion_info.sock_options.dscp = session->connect_info.dscp;
 
 	takion_info.cb = senkusha_takion_cb;
 	takion_info.cb_user = senkusha;
@@ -246,7 +289,10 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint
 
 	CHIAKI_LOGI(session->log, "Senkusha successfully received bang");
 
-	err = senkusha_run_rtt_test(senkusha, 0, SENKUSHA_PING_COUNT_DEFAULT, rtt_us);
+	if(senkusha->fast_probe)
+		err = senkusha_run_rtt_test_fast(senkusha, 0, FAST_PING_COUNT, rtt_us);
+	else
+		err = senkusha_run_rtt_test(senkusha, 0, SENKUSHA_PING_COUNT_DEFAULT, rtt_us);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(senkusha->log, "Senkusha Ping Test failed");
@@ -259,14 +305,16 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint
 	if(mtu_timeout_ms > 500)
 		mtu_timeout_ms = 500;
 
-	err = senkusha_run_mtu_in_test(senkusha, 576, 1454, 3, mtu_timeout_ms, mtu_in);
+	uint32_t mtu_retries = senkusha->fast_probe ? FAST_MTU_RETRIES : 3;
+
+	err = senkusha_run_mtu_in_test(senkusha, 576, 1454, mtu_retries, mtu_timeout_ms, mtu_in);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(senkusha->log, "Senkusha MTU in test failed");
 		goto disconnect;
 	}
 
-	err = senkusha_run_mtu_out_test(senkusha, *mtu_in, 576, 1454, 3, mtu_timeout_ms, mtu_out);
+	err = senkusha_run_mtu_out_test(senkusha, *mtu_in, 576, 1454, mtu_retries, mtu_timeout_ms, mtu_out);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(senkusha->log, "Senkusha MTU out test failed");
@@ -283,6 +331,8 @@ quit_takion:
 	chiaki_takion_close(&senkusha->takion);
 	CHIAKI_LOGI(session->log, "Senkusha closed takion");
 quit:
+	if(probe_us)
+		*probe_us = chiaki_time_now_monotonic_us() - start_us;
 	return err;
 }
 
@@ -305,42 +355,18 @@ static ChiakiErrorCode senkusha_run_rtt_test(ChiakiSenkusha *senkusha, uint16_t
 	{
 		CHIAKI_LOGI(senkusha->log, "Senkusha sending Ping %u of test index %u", (unsigned int)ping_index, (unsigned int)ping_test_index);
 
-		ChiakiTakionAVPacket av_packet = { 0 };
-		av_packet.codec = 0xff;
-		av_packet.is_video = false;
-		av_packet.frame_index = ping_test_index;
-		av_packet.unit_index = ping_index;
-		av_packet.units_in_frame_total = 0x800; // or 0
-
-		uint8_t data[0x224];
-		memset(data, 0, sizeof(data));
-
-		size_t header_size;
-		err = chiaki_takion_v7_av_packet_format_header(data, sizeof(data), &header_size, &av_packet);
-		if(err != CHIAKI_ERR_SUCCESS)
-		{
-			CHIAKI_LOGE(senkusha->log, "Senkusha failed to format AV Header");
-			return err;
-		}
-
-		uint32_t tag = chiaki_random_32();
-		*((chiaki_unaligned_uint32_t *)(data + header_size + 4)) = htonl(tag);
-
+		// the state mutex is held, so the pong can not be handled before the tag is set
 		senkusha->state = STATE_EXPECT_PONG;
 		senkusha->state_finished = false;
 		senkusha->state_failed = false;
 		senkusha->ping_test_index = ping_test_index;
 		senkusha->ping_index = ping_index;
-		senkusha->ping_tag = tag;
 
 		uint64_t time_start_us = chiaki_time_now_monotonic_us();
 
-		err = chiaki_takion_send_raw(&senkusha->takion, data, sizeof(data));
+		err = senkusha_send_ping(senkusha, ping_test_index, ping_index, &senkusha->ping_tag);
 		if(err != CHIAKI_ERR_SUCCESS)
-		{
-			CHIAKI_LOGE(senkusha->log, "Senkusha failed to send ping");
 			return err;
-		}
 
 		err = chiaki_cond_timedwait_pred(&senkusha->state_cond, &senkusha->state_mutex, EXPECT_PONG_TIMEOUT_MS, state_finished_cond_check, senkusha);
 		assert(err == CHIAKI_ERR_SUCCESS || err == CHIAKI_ERR_TIMEOUT);
@@ -385,14 +411,319 @@ static ChiakiErrorCode senkusha_run_rtt_test(ChiakiSenkusha *senkusha, uint16_t
 	return CHIAKI_ERR_SUCCESS;
 }
 
+static uint64_t fast_pong_timeout_ms(uint64_t rtt_min_us)
+{
+	uint64_t timeout_ms = (rtt_min_us * FAST_PONG_TIMEOUT_RTT_FACTOR) / 1000;
+	if(timeout_ms < FAST_PONG_TIMEOUT_MIN_MS)
+		timeout_ms = FAST_PONG_TIMEOUT_MIN_MS;
+	if(timeout_ms > EXPECT_PONG_TIMEOUT_MS)
+		timeout_ms = EXPECT_PONG_TIMEOUT_MS;
+	return timeout_ms;
+}
+
+/**
+ * Like senkusha_run_rtt_test(), but the pings are sent FAST_PING_INTERVAL_MS apart without waiting for their pongs
+ * and the test ends as soon as the RTT samples agree.
+ * Until the first pong arrives, the last ping is waited for as long as any ping in the regular test, after that
+ * only for a multiple of the RTT.
+ */
+static ChiakiErrorCode senkusha_run_rtt_test_fast(ChiakiSenkusha *senkusha, uint16_t ping_test_index, uint16_t ping_count, uint64_t *rtt_us)
+{
+	if(ping_count > CHIAKI_SENKUSHA_FAST_PINGS_MAX)
+		ping_count = CHIAKI_SENKUSHA_FAST_PINGS_MAX;
+
+	CHIAKI_LOGI(senkusha->log, "Senkusha fast Ping Test with up to %u pings starting", (unsigned int)ping_count);
+
+	ChiakiErrorCode err = senkusha_send_echo_command(senkusha, true);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(senkusha->log, "Senkusha Ping Test failed because sending echo command (true) failed");
+		return err;
+	}
+
+	CHIAKI_LOGI(senkusha->log, "Senkusha enabled echo");
+
+	senkusha->state = STATE_EXPECT_PONG;
+	senkusha->state_finished = false;
+	senkusha->state_failed = false;
+	senkusha->ping_test_index = ping_test_index;
+	senkusha->ping_index = 0;
+	memset(senkusha->pong_times_us, 0, sizeof(senkusha->pong_times_us));
+
+	uint64_t ping_times_us[CHIAKI_SENKUSHA_FAST_PINGS_MAX];
+	uint32_t pongs_counted = 0;
+	uint16_t pings_sent = 0;
+	uint64_t pings_successful = 0;
+	uint64_t rtt_us_acc = 0;
+	uint64_t rtt_min_us = UINT64_MAX;
+	uint64_t rtt_max_us = 0;
+	while(true)
+	{
+		uint64_t now_us = chiaki_time_now_monotonic_us();
+		uint64_t wait_ms = FAST_PING_INTERVAL_MS;
+		if(pings_sent < ping_count)
+		{
+			err = senkusha_send_ping(senkusha, ping_test_index, pings_sent, &senkusha->ping_tags[pings_sent]);
+			if(err != CHIAKI_ERR_SUCCESS)
+				return err;
+			ping_times_us[pings_sent] = now_us;
+			senkusha->ping_index = ++pings_sent;
+		}
+		else
+		{
+			uint64_t deadline_us = ping_times_us[pings_sent - 1]
+				+ (pings_successful ? fast_pong_timeout_ms(rtt_min_us) : EXPECT_PONG_TIMEOUT_MS) * 1000;
+			if(now_us >= deadline_us)
+			{
+				CHIAKI_LOGI(senkusha->log, "Senkusha pong receive timeout, %u of %u pongs received",
+						(unsigned int)pings_successful, (unsigned int)pings_sent);
+				break;
+			}
+			wait_ms = (deadline_us - now_us + 999) / 1000;
+		}
+
+		err = chiaki_cond_timedwait_pred(&senkusha->state_cond, &senkusha->state_mutex, wait_ms, state_finished_cond_check, senkusha);
+		assert(err == CHIAKI_ERR_SUCCESS || err == CHIAKI_ERR_TIMEOUT);
+		if(senkusha->should_stop)
+			return CHIAKI_ERR_CANCELED;
+		senkusha->state_finished = false;
+
+		for(uint16_t i=0; i<pings_sent; i++)
+		{
+			if(!senkusha->pong_times_us[i] || (pongs_counted & (1u << i)))
+				continue;
+			pongs_counted |= 1u << i;
+			uint64_t delta_us = senkusha->pong_times_us[i] - ping_times_us[i];
+			rtt_us_acc += delta_us;
+			pings_successful += 1;
+			if(delta_us < rtt_min_us)
+				rtt_min_us = delta_us;
+			if(delta_us > rtt_max_us)
+				rtt_max_us = delta_us;
+			CHIAKI_LOGI(senkusha->log, "Senkusha received Pong %u, RTT = %.3f ms", (unsigned int)i, (float)delta_us * 0.001f);
+		}
+
+		if(pings_successful >= FAST_PING_STABLE_MIN
+				&& (rtt_max_us - rtt_min_us <= rtt_min_us / 4 || rtt_max_us - rtt_min_us <= FAST_PING_STABLE_SPREAD_US))
+		{
+			CHIAKI_LOGI(senkusha->log, "Senkusha RTT is stable after %u pongs", (unsigned int)pings_successful);
+			break;
+		}
+		if(pings_sent == ping_count && pings_successful == pings_sent)
+			break;
+	}
+
+	err = senkusha_send_echo_command(senkusha, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(senkusha->log, "Senkusha Ping Test failed because sending echo command (false) failed");
+		return err;
+	}
+
+	CHIAKI_LOGI(senkusha->log, "Senkusha disabled echo");
+
+	if(pings_successful < 1)
+	{
+		CHIAKI_LOGE(senkusha->log, "Senkusha Ping test did not receive a single Pong");
+		return CHIAKI_ERR_UNKNOWN;
+	}
+
+	*rtt_us = rtt_us_acc / pings_successful;
+	CHIAKI_LOGI(senkusha->log, "Senkusha determined average RTT = %.3f ms", (float)(*rtt_us) * 0.001f);
+
+	return CHIAKI_ERR_SUCCESS;
+}
+
+/**
+ * Send one probe of the fast MTU search, which is answered with the given bit in the mask returned by mtu_probes_answered().
+ * Inbound, the console is asked to send a packet of the size, outbound, a ping of the size is sent from the packet_buf
+ * prepared by senkusha_run_mtu_out_test().
+ */
+static ChiakiErrorCode senkusha_send_mtu_probe(ChiakiSenkusha *senkusha, bool out, uint32_t bit, uint32_t size, uint8_t *packet_buf, size_t packet_buf_size)
+{
+	if(!out)
+	{
+		tkproto_SenkushaMtuCommand mtu_cmd = { 0 };
+		mtu_cmd.id = senkusha->mtu_id + bit;
+		mtu_cmd.mtu_req = size;
+		mtu_cmd.num = 1;
+		return senkusha_send_mtu_command(senkusha, &mtu_cmd);
+	}
+
+	uint32_t tag = chiaki_random_32();
+	senkusha->ping_tags[bit] = tag;
+
+	ChiakiTakionAVPacket av_packet = { 0 };
+	av_packet.codec = 0xff;
+	av_packet.is_video = false;
+	av_packet.frame_index = senkusha->ping_test_index;
+	av_packet.unit_index = (uint16_t)bit;
+	av_packet.units_in_frame_total = 0x800;
+
+	size_t header_size;
+	ChiakiErrorCode err = chiaki_takion_v7_av_packet_format_header(packet_buf, packet_buf_size, &header_size, &av_packet);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	assert(header_size == MTU_AV_PACKET_ADD);
+
+	*((chiaki_unaligned_uint32_t *)(packet_buf + MTU_AV_PACKET_ADD)) = 0;
+	*((chiaki_unaligned_uint32_t *)(packet_buf + MTU_AV_PACKET_ADD + 4)) = htonl(tag);
+
+	return chiaki_takion_send_raw(&senkusha->takion, packet_buf, size - MTU_UDP_PACKET_ADD);
+}
+
+static uint32_t mtu_probes_answered(ChiakiSenkusha *senkusha, bool out)
+{
+	if(!out)
+		return senkusha->mtu_answered;
+	uint32_t answered = 0;
+	for(uint32_t i=0; i<FAST_MTU_CANDIDATES; i++)
+	{
+		if(senkusha->pong_times_us[i])
+			answered |= 1u << i;
+	}
+	return answered;
+}
+
+/**
+ * Search the MTU between *min, which is known to work, and *max, testing FAST_MTU_CANDIDATES sizes at once.
+ * The first round tests first, max and the size between first and *min, so the common case of the full
+ * size working is done after a single round. Later rounds split the remaining interval into equal parts.
+ * Sizes that were not answered are sent again up to retries times, as long as no larger one was answered.
+ * Stops once the interval is no wider than FAST_MTU_PRECISION.
+ *
+ * Must be called with the state mutex locked.
+ */
+static ChiakiErrorCode senkusha_mtu_search_fast(ChiakiSenkusha *senkusha, bool out, uint32_t *min, uint32_t *max, uint32_t first, uint32_t retries, uint64_t timeout_ms, uint8_t *packet_buf, size_t packet_buf_size)
+{
+	uint32_t request_id = 0;
+	bool first_round = true;
+	while(*max - *min > FAST_MTU_PRECISION)
+	{
+		uint32_t candidates[FAST_MTU_CANDIDATES];
+		size_t count = 0;
+		for(size_t i=0; i<FAST_MTU_CANDIDATES; i++)
+		{
+			uint32_t size;
+			if(first_round)
+				size = i == 0 ? *min + (first - *min) / 2 : (i == 1 ? first : *max);
+			else
+				size = *min + (uint32_t)(((uint64_t)(*max - *min) * (i + 1)) / (FAST_MTU_CANDIDATES + 1));
+			if(size <= *min || size > *max || (!first_round && size == *max) || (count && size <= candidates[count - 1]))
+				continue;
+			candidates[count++] = size;
+		}
+		first_round = false;
+		if(!count)
+			break;
+
+		uint32_t answered = 0;
+		for(uint32_t attempt=0; attempt<retries; attempt++)
+		{
+			// only sizes above the largest one answered so far are still worth probing
+			uint32_t pending = 0;
+			for(size_t i=0; i<count; i++)
+			{
+				if(answered & (1u << i))
+					pending = 0;
+				else
+					pending |= 1u << i;
+			}
+			if(!pending)
+				break;
+
+			senkusha->state_finished = false;
+			senkusha->state_failed = false;
+			if(out)
+			{
+				senkusha->state = STATE_EXPECT_PONG;
+				senkusha->ping_test_index = 0;
+				senkusha->ping_index = (uint16_t)count;
+				memset(senkusha->pong_times_us, 0, sizeof(senkusha->pong_times_us));
+			}
+			else
+			{
+				senkusha->state = STATE_EXPECT_MTU;
+				senkusha->mtu_id = request_id + 1;
+				senkusha->mtu_answered = 0;
+				request_id += FAST_MTU_CANDIDATES;
+			}
+
+			uint32_t sent = 0;
+			for(size_t i=0; i<count; i++)
+			{
+				if(!(pending & (1u << i)))
+					continue;
+				CHIAKI_LOGI(senkusha->log, "Senkusha MTU %s probe %u (min %u, max %u), attempt %u",
+						out ? "out" : "in", (unsigned int)candidates[i], (unsigned int)*min, (unsigned int)*max, (unsigned int)attempt);
+				ChiakiErrorCode err = senkusha_send_mtu_probe(senkusha, out, (uint32_t)i, candidates[i], packet_buf, packet_buf_size);
+				if(err != CHIAKI_ERR_SUCCESS)
+				{
+					if(!out)
+					{
+						CHIAKI_LOGE(senkusha->log, "Senkusha failed to send MTU command");
+						return err;
+					}
+					// probably too big to be sent at all, so just as good as lost
+					CHIAKI_LOGI(senkusha->log, "Senkusha failed to send MTU %u ping", (unsigned int)candidates[i]);
+					continue;
+				}
+				sent |= 1u << i;
+			}
+
+			uint64_t deadline_us = chiaki_time_now_monotonic_us() + timeout_ms * 1000;
+			while(sent && (mtu_probes_answered(senkusha, out) & sent) != sent)
+			{
+				uint64_t now_us = chiaki_time_now_monotonic_us();
+				if(now_us >= deadline_us)
+					break;
+				ChiakiErrorCode err = chiaki_cond_timedwait_pred(&senkusha->state_cond, &senkusha->state_mutex,
+						(deadline_us - now_us + 999) / 1000, state_finished_cond_check, senkusha);
+				assert(err == CHIAKI_ERR_SUCCESS || err == CHIAKI_ERR_TIMEOUT);
+				if(senkusha->should_stop)
+					return CHIAKI_ERR_CANCELED;
+				senkusha->state_finished = false;
+			}
+			answered |= mtu_probes_answered(senkusha, out) & sent;
+		}
+
+		// losses below the largest answered size are ignored, above it the smallest unanswered one is the new bound
+		uint32_t new_min = *min;
+		uint32_t new_max = *max;
+		for(size_t i=0; i<count; i++)
+		{
+			if(answered & (1u << i))
+			{
+				new_min = candidates[i];
+				new_max = *max;
+			}
+			else if(new_max == *max)
+				new_max = candidates[i];
+		}
+		CHIAKI_LOGI(senkusha->log, "Senkusha MTU %s round narrowed %u-%u to %u-%u",
+				out ? "out" : "in", (unsigned int)*min, (unsigned int)*max, (unsigned int)new_min, (unsigned int)new_max);
+		*min = new_min;
+		*max = new_max;
+	}
+
+	return CHIAKI_ERR_SUCCESS;
+}
+
 static ChiakiErrorCode senkusha_run_mtu_in_test(ChiakiSenkusha *senkusha, uint32_t min, uint32_t max, uint32_t retries, uint64_t timeout_ms, uint32_t *mtu)
 {
 	CHIAKI_LOGI(senkusha->log, "Senkusha starting MTU in test with min %u, max %u, retries %u, timeout %llu ms",
 			(unsigned int)min, (unsigned int)max, (unsigned int)retries, (unsigned long long)timeout_ms);
 
+	if(senkusha->fast_probe)
+	{
+		ChiakiErrorCode err = senkusha_mtu_search_fast(senkusha, false, &min, &max, max, retries, timeout_ms, NULL, 0);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+	}
+
 	uint32_t cur = max;
 	uint32_t request_id = 0;
-	while((max - min) > 1)
+	while(!senkusha->fast_probe && (max - min) > 1)
 	{
 		bool success = false;
 		for(uint32_t attempt=0; attempt<retries; attempt++)
@@ -509,8 +840,15 @@ static ChiakiErrorCode senkusha_run_mtu_out_test(ChiakiSenkusha *senkusha, uint3
 
 	err = CHIAKI_ERR_SUCCESS;
 
+	if(senkusha->fast_probe)
+	{
+		err = senkusha_mtu_search_fast(senkusha, true, &min, &max, mtu_in, retries, timeout_ms, packet_buf, packet_buf_size);
+		if(err != CHIAKI_ERR_SUCCESS)
+			goto beach;
+	}
+
 	uint32_t cur = mtu_in;
-	while((max - min) > 1)
+	while(!senkusha->fast_probe && (max - min) > 1)
 	{
 		bool success = false;
 		for(uint32_t attempt=0; attempt<retries; attempt++)
@@ -724,9 +1062,12 @@ static void senkusha_takion_av(ChiakiSenkusha *senkusha, ChiakiTakionAVPacket *p
 
 	if(senkusha->state == STATE_EXPECT_PONG)
 	{
+		bool index_valid = senkusha->fast_probe
+			? packet->unit_index < senkusha->ping_index
+			: packet->unit_index == senkusha->ping_index;
 		if(packet->is_video
 			|| packet->frame_index != senkusha->ping_test_index
-			|| packet->unit_index != senkusha->ping_index
+			|| !index_valid
 			|| packet->data_size < 8)
 		{
 			CHIAKI_LOGW(senkusha->log, "Senkusha received invalid Pong %u/%u, size: %#llx",
@@ -735,13 +1076,20 @@ static void senkusha_takion_av(ChiakiSenkusha *senkusha, ChiakiTakionAVPacket *p
 		}
 
 		uint32_t tag = ntohl(*((uint32_t *)(packet->data + 4)));
-		if(tag != senkusha->ping_tag)
+		if(tag != (senkusha->fast_probe ? senkusha->ping_tags[packet->unit_index] : senkusha->ping_tag))
 		{
 			CHIAKI_LOGW(senkusha->log, "Senkusha received Pong with invalid tag");
 			goto beach;
 		}
 
-		senkusha->pong_time_us = time_us;
+		if(senkusha->fast_probe)
+		{
+			if(senkusha->pong_times_us[packet->unit_index])
+				goto beach; // duplicate
+			senkusha->pong_times_us[packet->unit_index] = time_us;
+		}
+		else
+			senkusha->pong_time_us = time_us;
 		senkusha->state_finished = true;
 		chiaki_mutex_unlock(&senkusha->state_mutex);
 		chiaki_cond_signal(&senkusha->state_cond);
@@ -753,14 +1101,17 @@ static void senkusha_takion_av(ChiakiSenkusha *senkusha, ChiakiTakionAVPacket *p
 		//chiaki_log_hexdump(senkusha->log, CHIAKI_LOG_DEBUG, packet->data, packet->data_size);
 		//CHIAKI_LOGD(senkusha->log, "packet index: %u, frame index: %u, unit index: %u, units in frame: %u", packet->packet_index, packet->frame_index, packet->unit_index, packet->units_in_frame_total);
 
+		uint32_t bit = (uint32_t)packet->frame_index - senkusha->mtu_id;
 		if(!packet->is_video
-			|| packet->frame_index != senkusha->mtu_id)
+			|| (senkusha->fast_probe ? bit >= FAST_MTU_CANDIDATES : packet->frame_index != senkusha->mtu_id))
 		{
 			CHIAKI_LOGW(senkusha->log, "Senkusha received invalid MTU response %u, size: %#llx, is video: %d",
 					(unsigned int)packet->frame_index, (unsigned long long)packet->data_size, packet->is_video ? 1 : 0);
 			goto beach;
 		}
 
+		if(senkusha->fast_probe)
+			senkusha->mtu_answered |= 1u << bit;
 		senkusha->state_finished = true;
 		chiaki_mutex_unlock(&senkusha->state_mutex);
 		chiaki_cond_signal(&senkusha->state_cond);
@@ -880,6 +1231,35 @@ static ChiakiErrorCode senkusha_send_echo_command(ChiakiSenkusha *senkusha, bool
 	return senkusha_send_data_wait_for_ack(senkusha, buf, stream.bytes_written);
 }
 
+static ChiakiErrorCode senkusha_send_ping(ChiakiSenkusha *senkusha, uint16_t ping_test_index, uint16_t ping_index, uint32_t *tag)
+{
+	ChiakiTakionAVPacket av_packet = { 0 };
+	av_packet.codec = 0xff;
+	av_packet.is_video = false;
+	av_packet.frame_index = ping_test_index;
+	av_packet.unit_index = ping_index;
+	av_packet.units_in_frame_total = 0x800; // or 0
+
+	uint8_t data[0x224];
+	memset(data, 0, sizeof(data));
+
+	size_t header_size;
+	ChiakiErrorCode err = chiaki_takion_v7_av_packet_format_header(data, sizeof(data), &header_size, &av_packet);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(senkusha->log, "Senkusha failed to format AV Header");
+		return err;
+	}
+
+	*tag = chiaki_random_32();
+	*((chiaki_unaligned_uint32_t *)(data + header_size + 4)) = htonl(*tag);
+
+	err = chiaki_takion_send_raw(&senkusha->takion, data, sizeof(data));
+	if(err != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGE(senkusha->log, "Senkusha failed to send ping");
+	return err;
+}
+
 static ChiakiErrorCode senkusha_send_mtu_command(ChiakiSenkusha *senkusha, tkproto_SenkushaMtuCommand *command)
 {
 	tkproto_TakionMessage msg;
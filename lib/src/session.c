@@ -6,6 +6,7 @@
 #include <chiaki/http.h>
 #include <chiaki/base64.h>
 #include <chiaki/random.h>
+#include <chiaki/time.h>
 
 #include <stdlib.h>
 #include <string.h>
@@ -34,6 +35,8 @@
 #define STREAM_CONNECTION_SWITCH_EXPECT_TIMEOUT_MS 2000
 
 static void *session_thread_func(void *arg);
+static void session_thread_run_stream_connection(ChiakiSession *session, chiaki_socket_t *data_sock, bool resumed);
+static bool session_thread_resume(ChiakiSession *session);
 static void regist_cb(ChiakiRegistEvent *event, void *user);
 static ChiakiErrorCode session_thread_request_session(ChiakiSession *session, ChiakiTarget *target_out);
 
@@ -136,6 +139,91 @@ CHIAKI_EXPORT void chiaki_connect_video_profile_preset(ChiakiConnectVideoProfile
 	}
 }
 
+#define FIT_PATH_MTU_FULL 1454 // what Senkusha falls back to, anything below means more packets per frame
+#define FIT_PATH_RTT_LAN_US 10000
+#define FIT_PATH_RTT_FAR_US 60000
+#define FIT_PATH_BITRATE_MIN 1000
+#define FIT_PATH_BITRATE_MIN_540p 3000 // below this, 360p looks better than 540p
+
+CHIAKI_EXPORT void chiaki_connect_video_profile_fit_path(ChiakiConnectVideoProfile *profile, uint64_t rtt_us, uint32_t mtu_in, uint32_t mtu_out)
+{
+	uint64_t bitrate = profile->bitrate;
+
+	// every packet has the same header overhead and is lost as a whole
+	uint32_t mtu = mtu_in < mtu_out ? mtu_in : mtu_out;
+	if(mtu && mtu < FIT_PATH_MTU_FULL)
+		bitrate = bitrate * mtu / FIT_PATH_MTU_FULL;
+
+	// beyond the LAN, the path is shared and its queues are deeper, so leave headroom
+	if(rtt_us > FIT_PATH_RTT_FAR_US)
+		bitrate = bitrate * 6 / 10;
+	else if(rtt_us > FIT_PATH_RTT_LAN_US)
+		bitrate = bitrate * 8 / 10;
+
+	if(bitrate < FIT_PATH_BITRATE_MIN)
+		bitrate = FIT_PATH_BITRATE_MIN;
+	if(bitrate > profile->bitrate)
+		bitrate = profile->bitrate;
+	profile->bitrate = (unsigned int)bitrate;
+
+	if(profile->height > 360 && profile->bitrate < FIT_PATH_BITRATE_MIN_540p)
+	{
+		profile->width = 640;
+		profile->height = 360;
+	}
+}
+
+CHIAKI_EXPORT const char *chiaki_latency_mode_string(ChiakiLatencyMode mode)
+{
+	switch(mode)
+	{
+		case CHIAKI_LATENCY_MODE_COMPETITIVE:
+			return "competitive";
+		case CHIAKI_LATENCY_MODE_BALANCED:
+			return "balanced";
+		case CHIAKI_LATENCY_MODE_UNSTABLE_WIFI:
+			return "unstable Wi-Fi";
+		default:
+			return "unknown";
+	}
+}
+
+CHIAKI_EXPORT void chiaki_latency_profile_preset(ChiakiLatencyProfile *profile, ChiakiLatencyMode mode)
+{
+	switch(mode)
+	{
+		case CHIAKI_LATENCY_MODE_COMPETITIVE:
+			profile->recv_ring_size_exp = 5;
+			profile->data_queue_size_exp = 3;
+			profile->key_buf_chunks = CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT / 2;
+			profile->audio_device_buffers = 3;
+			profile->audio_device_queue_frames = 0;
+			profile->audio_jitter_percentile = 90;
+			profile->video_present_queue = 1;
+			break;
+		case CHIAKI_LATENCY_MODE_UNSTABLE_WIFI:
+			// a burst of loss moves the key stream position far ahead, so more of it is generated in advance
+			profile->recv_ring_size_exp = 7;
+			profile->data_queue_size_exp = 5;
+			profile->key_buf_chunks = CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT * 3 / 2;
+			profile->audio_device_buffers = 6;
+			profile->audio_device_queue_frames = 1;
+			profile->audio_jitter_percentile = 99;
+			profile->video_present_queue = 0;
+			break;
+		case CHIAKI_LATENCY_MODE_BALANCED:
+		default:
+			profile->recv_ring_size_exp = 6;
+			profile->data_queue_size_exp = 4;
+			profile->key_buf_chunks = CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT;
+			profile->audio_device_buffers = 4;
+			profile->audio_device_queue_frames = 0;
+			profile->audio_jitter_percentile = 95;
+			profile->video_present_queue = 0;
+			break;
+	}
+}
+
 CHIAKI_EXPORT const char *chiaki_quit_reason_string(ChiakiQuitReason reason)
 {
 	switch(reason)
@@ -166,6 +254,8 @@ CHIAKI_EXPORT const char *chiaki_quit_reason_string(ChiakiQuitReason reason)
 			return "Remote has disconnected from Stream Connection the because Server shut down";
 		case CHIAKI_QUIT_REASON_PSN_REGIST_FAILED:
 			return "The Console Registration using PSN has failed";
+		case CHIAKI_QUIT_REASON_STREAM_CONNECTION_LINK_LOST:
+			return "The connection to the Console was lost and could not be re-established";
 		case CHIAKI_QUIT_REASON_NONE:
 		default:
 			return "Unknown";
@@ -188,6 +278,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_init(ChiakiSession *session, Chiaki
 	ChiakiErrorCode err = chiaki_mutex_init(&session->state_mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_state_cond;
+	chiaki_mutex_set_name(&session->state_mutex, "session state");
 
 	err = chiaki_cond_init(&session->state_cond, &session->state_mutex);
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -207,11 +298,37 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_init(ChiakiSession *session, Chiaki
 	session->login_pin = NULL;
 	session->login_pin_size = 0;
 
+	err = chiaki_arena_init(&session->arena, session->log);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_stop_pipe;
+
+	err = chiaki_latency_stats_init(&session->latency_stats);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_arena;
+
+	err = chiaki_video_stats_init(&session->video_stats);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_latency_stats;
+
+	err = chiaki_audio_decode_queue_init(&session->audio_decode_queue, session->log);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_video_stats;
+
+	err = chiaki_av_sync_init(&session->av_sync, (uint64_t)connect_info->av_sync_max_offset_ms * 1000);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_audio_decode_queue;
+
+	session->audio_reorder_deadline_us = CHIAKI_AUDIO_RECEIVER_REORDER_DEADLINE_DEFAULT_US;
+
+	err = chiaki_timer_wheel_init(&session->timer_wheel, session->log);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_av_sync;
+
 	err = chiaki_ctrl_init(&session->ctrl, session);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(session->log, "Ctrl init failed");
-		goto error_stop_pipe;
+		goto error_timer_wheel;
 	}
 
 	err = chiaki_stream_connection_init(&session->stream_connection, session);
@@ -259,13 +376,65 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_init(ChiakiSession *session, Chiaki
 
 	session->connect_info.video_profile = connect_info->video_profile;
 	session->connect_info.video_profile_auto_downgrade = connect_info->video_profile_auto_downgrade;
+	session->connect_info.video_profile_fit_path = connect_info->video_profile_fit_path;
+	session->connect_info.senkusha_fast_probe = connect_info->senkusha_fast_probe;
+	session->connect_info.path_known = connect_info->path_known != NULL;
+	if(connect_info->path_known)
+		session->connect_info.path = *connect_info->path_known;
+	session->connect_info.ecdh_key_known = connect_info->ecdh_key != NULL;
+	if(connect_info->ecdh_key)
+		session->connect_info.ecdh_key = *connect_info->ecdh_key;
 	session->connect_info.enable_keyboard = connect_info->enable_keyboard;
 	session->connect_info.enable_dualsense = connect_info->enable_dualsense;
+	session->connect_info.video_decode_queue = connect_info->video_decode_queue;
+	session->connect_info.audio_decode_queue = connect_info->audio_decode_queue;
+	if(connect_info->latency_profile)
+		session->connect_info.latency_profile = *connect_info->latency_profile;
+	else
+		chiaki_latency_profile_preset(&session->connect_info.latency_profile, CHIAKI_LATENCY_MODE_BALANCED);
+	session->connect_info.av_sync_max_offset_ms = connect_info->av_sync_max_offset_ms;
+	session->connect_info.feedback_immediate = connect_info->feedback_immediate;
+	session->connect_info.feedback_state_rate_max = connect_info->feedback_state_rate_max;
+	session->connect_info.congestion_control_delay_based = connect_info->congestion_control_delay_based;
+	session->connect_info.load_monitor = connect_info->load_monitor;
+	session->connect_info.mac_offload = connect_info->mac_offload;
+	session->connect_info.ack_delay_ms = connect_info->ack_delay_ms;
+	session->connect_info.upstream_packets_budget = connect_info->upstream_packets_budget;
+	session->connect_info.recv_buffer_burst_ms = connect_info->recv_buffer_burst_ms;
+	session->connect_info.dscp = connect_info->dscp;
+	session->connect_info.video_ref_frames = connect_info->video_ref_frames;
+	session->connect_info.video_idr_request_frames = connect_info->video_idr_request_frames;
+	session->connect_info.video_backlog_threshold_ms = connect_info->video_backlog_threshold_ms;
+	session->connect_info.video_frame_deadline = connect_info->video_frame_deadline;
+	session->connect_info.fec_workers = connect_info->fec_workers > CHIAKI_FEC_WORKERS_MAX
+		? CHIAKI_FEC_WORKERS_MAX : connect_info->fec_workers;
+	session->connect_info.resume = connect_info->resume;
+	session->connect_info.capture = connect_info->capture;
+	session->connect_info.recorder = connect_info->recorder;
+	session->connect_info.replay = connect_info->replay;
+	session->connect_info.impair = NULL;
+	if(connect_info->impair)
+	{
+		session->connect_info.impair_config = *connect_info->impair;
+		session->connect_info.impair = &session->connect_info.impair_config;
+	}
 
 	return CHIAKI_ERR_SUCCESS;
 
 error_ctrl:
 	chiaki_ctrl_fini(&session->ctrl);
+error_timer_wheel:
+	chiaki_timer_wheel_fini(&session->timer_wheel);
+error_av_sync:
+	chiaki_av_sync_fini(&session->av_sync);
+error_audio_decode_queue:
+	chiaki_audio_decode_queue_fini(&session->audio_decode_queue);
+error_video_stats:
+	chiaki_video_stats_fini(&session->video_stats);
+error_latency_stats:
+	chiaki_latency_stats_fini(&session->latency_stats);
+error_arena:
+	chiaki_arena_fini(&session->arena);
 error_stop_pipe:
 	chiaki_stop_pipe_fini(&session->stop_pipe);
 error_state_mutex:
@@ -294,6 +463,14 @@ CHIAKI_EXPORT void chiaki_session_fini(ChiakiSession *session)
 	if(session->holepunch_session)
 		chiaki_holepunch_session_fini(session->holepunch_session);
 #endif
+	chiaki_latency_stats_log(&session->latency_stats, session->log);
+	chiaki_latency_stats_fini(&session->latency_stats);
+	chiaki_video_stats_fini(&session->video_stats);
+	chiaki_audio_decode_queue_fini(&session->audio_decode_queue);
+	chiaki_av_sync_fini(&session->av_sync);
+	chiaki_timer_wheel_fini(&session->timer_wheel);
+	chiaki_arena_log(&session->arena);
+	chiaki_arena_fini(&session->arena);
 	chiaki_stop_pipe_fini(&session->stop_pipe);
 	chiaki_cond_fini(&session->state_cond);
 	chiaki_mutex_fini(&session->state_mutex);
@@ -302,11 +479,9 @@ CHIAKI_EXPORT void chiaki_session_fini(ChiakiSession *session)
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_start(ChiakiSession *session)
 {
-	ChiakiErrorCode err = chiaki_thread_create(&session->session_thread, session_thread_func, session);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
-	chiaki_thread_set_name(&session->session_thread, "Chiaki Session");
-	return err;
+	// the report at the end only covers this session
+	chiaki_lock_profile_reset();
+	return chiaki_thread_create_role(&session->session_thread, session_thread_func, session, CHIAKI_THREAD_ROLE_SESSION);
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_stop(ChiakiSession *session)
@@ -330,13 +505,18 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_join(ChiakiSession *session)
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_set_controller_state(ChiakiSession *session, ChiakiControllerState *state)
+{
+	return chiaki_session_set_controller_state_sampled(session, state, chiaki_time_now_monotonic_us());
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_session_set_controller_state_sampled(ChiakiSession *session, ChiakiControllerState *state, uint64_t sample_us)
 {
 	ChiakiErrorCode err = chiaki_mutex_lock(&session->stream_connection.feedback_sender_mutex);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 	session->controller_state = *state;
 	if(session->stream_connection.feedback_sender_active)
-		chiaki_feedback_sender_set_controller_state(&session->stream_connection.feedback_sender, &session->controller_state);
+		chiaki_feedback_sender_set_controller_state(&session->stream_connection.feedback_sender, &session->controller_state, sample_us);
 	chiaki_mutex_unlock(&session->stream_connection.feedback_sender_mutex);
 	return CHIAKI_ERR_SUCCESS;
 }
@@ -384,6 +564,12 @@ static bool session_check_state_pred(void *user)
 		|| session->ctrl_failed;
 }
 
+static bool session_check_state_pred_stop(void *user)
+{
+	ChiakiSession *session = user;
+	return session->should_stop;
+}
+
 static bool session_check_state_pred_ctrl_start(void *user)
 {
 	ChiakiSession *session = user;
@@ -438,11 +624,26 @@ static void *session_thread_func(void *arg)
 
 	CHECK_STOP(quit);
 
+	if(session->connect_info.replay)
+	{
+		// everything before the StreamConnection needs the console, so only the StreamConnection is replayed
+		CHIAKI_LOGI(session->log, "Session replaying a capture");
+		memcpy(session->handshake_key, session->connect_info.replay->handshake_key, sizeof(session->handshake_key));
+		if(chiaki_ecdh_init(&session->ecdh) != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGE(session->log, "Session failed to initialize ECDH");
+			session->quit_reason = CHIAKI_QUIT_REASON_STREAM_CONNECTION_UNKNOWN;
+			QUIT(quit);
+		}
+		session_thread_run_stream_connection(session, NULL, false);
+		goto quit;
+	}
+
 #if !(defined(__SWITCH__) || defined(__PSVITA__))
 	if(session->holepunch_session)
 	{
 		chiaki_socket_t *rudp_sock = chiaki_get_holepunch_sock(session->holepunch_session, CHIAKI_HOLEPUNCH_PORT_TYPE_CTRL);
-		session->rudp = chiaki_rudp_init(rudp_sock, session->log);
+		session->rudp = chiaki_rudp_init(rudp_sock, &session->arena, session->log);
 		if(!session->rudp)
 		{
 			CHIAKI_LOGE(session->log, "Initializing rudp failed");
@@ -600,29 +801,53 @@ ctrl_failed:
 		QUIT(quit_ctrl);
 	}
 
+	if(session->connect_info.path_known)
+	{
+		session->mtu_in = session->connect_info.path.mtu_in;
+		session->mtu_out = session->connect_info.path.mtu_out;
+		session->rtt_us = session->connect_info.path.rtt_us;
+		CHIAKI_LOGI(session->log, "Skipping Senkusha, using the known path (rtt %llu us, mtu %u/%u)",
+				(unsigned long long)session->rtt_us, (unsigned int)session->mtu_in, (unsigned int)session->mtu_out);
+	}
 #ifdef ENABLE_SENKUSHA
-	CHIAKI_LOGI(session->log, "Starting Senkusha");
+	else
+	{
+		CHIAKI_LOGI(session->log, "Starting Senkusha");
 
-	ChiakiSenkusha senkusha;
-	err = chiaki_senkusha_init(&senkusha, session);
-	if(err != CHIAKI_ERR_SUCCESS)
-		QUIT(quit_ctrl);
+		ChiakiSenkusha senkusha;
+		err = chiaki_senkusha_init(&senkusha, session);
+		if(err != CHIAKI_ERR_SUCCESS)
+			QUIT(quit_ctrl);
 
-	err = chiaki_senkusha_run(&senkusha, &session->mtu_in, &session->mtu_out, &session->rtt_us, data_sock);
-	chiaki_senkusha_fini(&senkusha);
+		err = chiaki_senkusha_run(&senkusha, &session->mtu_in, &session->mtu_out, &session->rtt_us, &session->senkusha_us, data_sock);
+		chiaki_senkusha_fini(&senkusha);
+		CHIAKI_LOGI(session->log, "Senkusha took %.1f ms%s", session->senkusha_us / 1000.0,
+				session->connect_info.senkusha_fast_probe ? " (fast probe)" : "");
 
-	if(err == CHIAKI_ERR_SUCCESS)
-		CHIAKI_LOGI(session->log, "Senkusha completed successfully");
-	else if(err == CHIAKI_ERR_CANCELED)
-		QUIT(quit_ctrl);
-	else
-	{
-		CHIAKI_LOGE(session->log, "Senkusha failed, but we still try to connect with fallback values");
-		session->mtu_in = 1454;
-		session->mtu_out = 1454;
-		session->rtt_us = 1000;
+		if(err == CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGI(session->log, "Senkusha completed successfully");
+			session->path_probed = true;
+		}
+		else if(err == CHIAKI_ERR_CANCELED)
+			QUIT(quit_ctrl);
+		else
+		{
+			CHIAKI_LOGE(session->log, "Senkusha failed, but we still try to connect with fallback values");
+			session->mtu_in = 1454;
+			session->mtu_out = 1454;
+			session->rtt_us = 1000;
+		}
 	}
 #endif
+	if(session->connect_info.video_profile_fit_path)
+	{
+		ChiakiConnectVideoProfile *profile = &session->connect_info.video_profile;
+		chiaki_connect_video_profile_fit_path(profile, session->rtt_us, session->mtu_in, session->mtu_out);
+		CHIAKI_LOGI(session->log, "Fitted video profile to the path (rtt %llu us, mtu %u/%u): %ux%u@%u, %u kbit/s",
+				(unsigned long long)session->rtt_us, (unsigned int)session->mtu_in, (unsigned int)session->mtu_out,
+				profile->width, profile->height, profile->max_fps, profile->bitrate);
+	}
 	if(session->rudp)
 	{
 		ChiakiErrorCode err;
@@ -649,17 +874,71 @@ ctrl_failed:
 		QUIT(quit_ctrl);
 	}
 
-	err = chiaki_ecdh_init(&session->ecdh);
+	if(session->connect_info.ecdh_key_known)
+	{
+		err = chiaki_ecdh_init_with_key(&session->ecdh, &session->connect_info.ecdh_key);
+		// only ever use it once
+		memset(&session->connect_info.ecdh_key, 0, sizeof(session->connect_info.ecdh_key));
+		session->connect_info.ecdh_key_known = false;
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGW(session->log, "Session failed to use the pre-generated ECDH key, generating a new one");
+			err = chiaki_ecdh_init(&session->ecdh);
+		}
+	}
+	else
+		err = chiaki_ecdh_init(&session->ecdh);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(session->log, "Session failed to initialize ECDH");
 		QUIT(quit_ctrl);
 	}
 
+	session_thread_run_stream_connection(session, data_sock, false);
+
+	// the StreamConnection only notices a lost link with resume, and a punched hole can not be reused
+	if(session->stream_connection.link_lost && !session->rudp)
+	{
+		chiaki_mutex_lock(&session->state_mutex);
+		if(!session_thread_resume(session))
+			goto quit;
+	}
+
+quit_ctrl:
+	chiaki_ctrl_stop(&session->ctrl);
+	chiaki_ctrl_join(&session->ctrl);
+	CHIAKI_LOGI(session->log, "Ctrl stopped");
+
+	ChiakiEvent quit_event;
+quit:
+
+	CHIAKI_LOGI(session->log, "Session has quit");
+	chiaki_lock_profile_log(session->log);
+	quit_event.type = CHIAKI_EVENT_QUIT;
+	quit_event.quit.reason = session->quit_reason;
+	quit_event.quit.reason_str = session->quit_reason_str;
+	chiaki_session_send_event(session, &quit_event);
+	return NULL;
+
+#undef CHECK_STOP
+#undef QUIT
+}
+
+/**
+ * Run the StreamConnection until it finishes and set the quit reason from its result.
+ * Must be called with state_mutex locked, which is unlocked on return, and session->ecdh initialized, which is finalized.
+ */
+static void session_thread_run_stream_connection(ChiakiSession *session, chiaki_socket_t *data_sock, bool resumed)
+{
 	chiaki_mutex_unlock(&session->state_mutex);
-	err = chiaki_stream_connection_run(&session->stream_connection, data_sock);
+	ChiakiErrorCode err = chiaki_stream_connection_run(&session->stream_connection, data_sock, resumed);
 	chiaki_mutex_lock(&session->state_mutex);
-	if(err == CHIAKI_ERR_DISCONNECTED)
+	if(session->stream_connection.link_lost)
+	{
+		CHIAKI_LOGE(session->log, "StreamConnection lost the link");
+		session->quit_reason = CHIAKI_QUIT_REASON_STREAM_CONNECTION_LINK_LOST;
+	}
+	else if(err == CHIAKI_ERR_DISCONNECTED)
 	{
 		CHIAKI_LOGE(session->log, "Remote disconnected from StreamConnection");
 		if(!strcmp(session->stream_connection.remote_disconnect_reason, "Server shutting down"))
@@ -681,24 +960,143 @@ ctrl_failed:
 
 	chiaki_mutex_unlock(&session->state_mutex);
 	chiaki_ecdh_fini(&session->ecdh);
+}
 
-quit_ctrl:
-	chiaki_ctrl_stop(&session->ctrl);
-	chiaki_ctrl_join(&session->ctrl);
-	CHIAKI_LOGI(session->log, "Ctrl stopped");
+/**
+ * Restart ctrl with a new session request for the target negotiated before, without asking for a Login PIN again.
+ * Must be called with state_mutex locked and ctrl joined.
+ *
+ * @param ctrl_running set to whether the ctrl thread was started
+ * @return whether ctrl received a session id
+ */
+static bool session_thread_resume_ctrl(ChiakiSession *session, bool *ctrl_running)
+{
+	chiaki_ctrl_reset(&session->ctrl);
+	session->ctrl_failed = false;
+	session->ctrl_session_id_received = false;
+	session->ctrl_login_pin_requested = false;
+	session->ctrl_first_heartbeat_received = false;
+	session->quit_reason = CHIAKI_QUIT_REASON_NONE;
 
-	ChiakiEvent quit_event;
-quit:
+	if(session_thread_request_session(session, NULL) != CHIAKI_ERR_SUCCESS)
+		return false;
+	chiaki_rpcrypt_init_auth(&session->rpcrypt, session->target, session->nonce, session->connect_info.morning);
 
-	CHIAKI_LOGI(session->log, "Session has quit");
-	quit_event.type = CHIAKI_EVENT_QUIT;
-	quit_event.quit.reason = session->quit_reason;
-	quit_event.quit.reason_str = session->quit_reason_str;
-	chiaki_session_send_event(session, &quit_event);
-	return NULL;
+	if(chiaki_ctrl_start(&session->ctrl) != CHIAKI_ERR_SUCCESS)
+		return false;
+	*ctrl_running = true;
 
-#undef CHECK_STOP
-#undef QUIT
+	chiaki_cond_timedwait_pred(&session->state_cond, &session->state_mutex, SESSION_EXPECT_TIMEOUT_MS, session_check_state_pred_ctrl_start, session);
+	if(session->should_stop || session->ctrl_failed)
+		return false;
+	if(session->ctrl_login_pin_requested)
+	{
+		CHIAKI_LOGE(session->log, "Ctrl requested a Login PIN while resuming");
+		return false;
+	}
+	if(!session->ctrl_session_id_received)
+	{
+		chiaki_mutex_unlock(&session->state_mutex);
+		ChiakiErrorCode err = ctrl_message_set_fallback_session_id(&session->ctrl);
+		chiaki_mutex_lock(&session->state_mutex);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return false;
+		ctrl_enable_features(&session->ctrl);
+	}
+	return session->ctrl_session_id_received;
+}
+
+/**
+ * Re-establish ctrl and StreamConnection after the link was lost while streaming, with the target, path and
+ * video profile of this session and without Senkusha, until it streams again or CHIAKI_SESSION_RESUME_TIMEOUT_MS passed.
+ * Decoders and sinks are left alone, the application gets CHIAKI_EVENT_RECONNECTING and then a resumed CHIAKI_EVENT_CONNECTED.
+ * Must be called with state_mutex locked and ctrl running, state_mutex is unlocked on return.
+ *
+ * @return whether ctrl is still running and must be stopped and joined
+ */
+static bool session_thread_resume(ChiakiSession *session)
+{
+	bool ctrl_running = true;
+	uint64_t start_ms = chiaki_time_now_monotonic_ms();
+	uint64_t retry_ms = CHIAKI_SESSION_RESUME_RETRY_MS;
+	unsigned int attempt = 0;
+	while(true)
+	{
+		if(chiaki_time_now_monotonic_ms() - start_ms >= CHIAKI_SESSION_RESUME_TIMEOUT_MS)
+		{
+			CHIAKI_LOGE(session->log, "Session could not be resumed within %u ms", (unsigned int)CHIAKI_SESSION_RESUME_TIMEOUT_MS);
+			session->quit_reason = CHIAKI_QUIT_REASON_STREAM_CONNECTION_LINK_LOST;
+			break;
+		}
+
+		attempt++;
+		CHIAKI_LOGI(session->log, "Session resuming after the link was lost, attempt %u", attempt);
+		ChiakiEvent event = { 0 };
+		event.type = CHIAKI_EVENT_RECONNECTING;
+		event.reconnecting.attempt = attempt;
+		chiaki_session_send_event(session, &event);
+
+		// give the network a moment, e.g. to finish roaming to another access point
+		chiaki_cond_timedwait_pred(&session->state_cond, &session->state_mutex, retry_ms, session_check_state_pred_stop, session);
+		if(session->should_stop)
+		{
+			session->quit_reason = CHIAKI_QUIT_REASON_STOPPED;
+			break;
+		}
+		retry_ms *= 2;
+		if(retry_ms > CHIAKI_SESSION_RESUME_RETRY_MAX_MS)
+			retry_ms = CHIAKI_SESSION_RESUME_RETRY_MAX_MS;
+
+		// the console usually drops ctrl together with the stream, one that outlived a failed attempt is not trusted either
+		if(session->ctrl_failed || attempt > 1)
+		{
+			if(ctrl_running)
+			{
+				chiaki_mutex_unlock(&session->state_mutex);
+				chiaki_ctrl_stop(&session->ctrl);
+				chiaki_ctrl_join(&session->ctrl);
+				chiaki_mutex_lock(&session->state_mutex);
+				ctrl_running = false;
+			}
+			CHIAKI_LOGI(session->log, "Session restarting ctrl");
+			if(!session_thread_resume_ctrl(session, &ctrl_running))
+			{
+				if(session->should_stop)
+				{
+					session->quit_reason = CHIAKI_QUIT_REASON_STOPPED;
+					break;
+				}
+				CHIAKI_LOGW(session->log, "Session failed to restart ctrl");
+				continue;
+			}
+		}
+
+		if(chiaki_random_bytes_crypt(session->handshake_key, sizeof(session->handshake_key)) != CHIAKI_ERR_SUCCESS
+			|| chiaki_ecdh_init(&session->ecdh) != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGE(session->log, "Session failed to prepare a new handshake");
+			session->quit_reason = CHIAKI_QUIT_REASON_STREAM_CONNECTION_UNKNOWN;
+			break;
+		}
+		session_thread_run_stream_connection(session, NULL, true);
+		chiaki_mutex_lock(&session->state_mutex);
+		if(session->should_stop)
+			break;
+		if(!session->stream_connection.connected)
+		{
+			CHIAKI_LOGW(session->log, "Session failed to resume StreamConnection");
+			continue;
+		}
+		if(!session->stream_connection.link_lost)
+			break;
+
+		// streamed again for a while, so this is a new drop with the full timeout
+		start_ms = chiaki_time_now_monotonic_ms();
+		retry_ms = CHIAKI_SESSION_RESUME_RETRY_MS;
+		attempt = 0;
+	}
+	chiaki_mutex_unlock(&session->state_mutex);
+	return ctrl_running;
 }
 
 typedef struct session_response_t
@@ -733,6 +1131,79 @@ static void parse_session_response(SessionResponse *response, ChiakiHttpResponse
 /**
  * @param target_out if NULL, version mismatch means to fail the entire session, otherwise report the target here
  */
+typedef struct session_addr_t
+{
+	struct sockaddr_storage addr; // with the port set
+	size_t addrlen;
+	struct addrinfo *ai;
+} SessionAddr;
+
+#define SESSION_ADDR_CACHE_SIZE 8
+
+/**
+ * Addresses session requests succeeded with recently, tried first by the next session to the same host.
+ * Only accessed by session threads, of which there is one at a time, like the stun cache in holepunch.c.
+ */
+static struct
+{
+	struct sockaddr_storage addrs[SESSION_ADDR_CACHE_SIZE];
+	size_t addrlens[SESSION_ADDR_CACHE_SIZE];
+	size_t next; // slot to replace next
+} session_addr_cache;
+
+static bool session_addr_cache_contains(const SessionAddr *addr)
+{
+	for(size_t i=0; i<SESSION_ADDR_CACHE_SIZE; i++)
+	{
+		if(session_addr_cache.addrlens[i] == addr->addrlen && !memcmp(&session_addr_cache.addrs[i], &addr->addr, addr->addrlen))
+			return true;
+	}
+	return false;
+}
+
+static void session_addr_cache_put(const SessionAddr *addr)
+{
+	if(session_addr_cache_contains(addr))
+		return;
+	size_t i = session_addr_cache.next;
+	memcpy(&session_addr_cache.addrs[i], &addr->addr, addr->addrlen);
+	session_addr_cache.addrlens[i] = addr->addrlen;
+	session_addr_cache.next = (i + 1) % SESSION_ADDR_CACHE_SIZE;
+}
+
+/**
+ * Order the addresses to connect to: one that succeeded before first, then alternating between the families
+ * starting with the other one, so a family that does not work at all only ever delays the first attempt (RFC 8305).
+ */
+static void session_addrs_order(SessionAddr *addrs, size_t count)
+{
+	for(size_t i=1; i<count; i++)
+	{
+		if(!session_addr_cache_contains(&addrs[i]))
+			continue;
+		SessionAddr cached = addrs[i];
+		memmove(&addrs[1], &addrs[0], i * sizeof(SessionAddr));
+		addrs[0] = cached;
+		break;
+	}
+	for(size_t i=1; i<count; i++)
+	{
+		// the family the address at i should have, find the next one with it
+		sa_family_t family = addrs[i - 1].addr.ss_family == AF_INET ? AF_INET6 : AF_INET;
+		if(addrs[i].addr.ss_family == family)
+			continue;
+		for(size_t j=i+1; j<count; j++)
+		{
+			if(addrs[j].addr.ss_family != family)
+				continue;
+			SessionAddr next = addrs[j];
+			memmove(&addrs[i + 1], &addrs[i], (j - i) * sizeof(SessionAddr));
+			addrs[i] = next;
+			break;
+		}
+	}
+}
+
 static ChiakiErrorCode session_thread_request_session(ChiakiSession *session, ChiakiTarget *target_out)
 {
 	chiaki_socket_t session_sock = CHIAKI_INVALID_SOCKET;
@@ -831,84 +1302,65 @@ static ChiakiErrorCode session_thread_request_session(ChiakiSession *session, Ch
 	}
 	else
 	{
-		for(struct addrinfo *ai=session->connect_info.host_addrinfos; ai; ai=ai->ai_next)
+		SessionAddr addrs[CHIAKI_STOP_PIPE_CONNECT_ANY_MAX];
+		size_t addrs_count = 0;
+		for(struct addrinfo *ai=session->connect_info.host_addrinfos; ai && addrs_count < CHIAKI_STOP_PIPE_CONNECT_ANY_MAX; ai=ai->ai_next)
 		{
-			//if(ai->ai_protocol != IPPROTO_TCP)
-			//	continue;
-
-			struct sockaddr *sa = malloc(ai->ai_addrlen);
-			if(!sa)
+			if((ai->ai_family != AF_INET && ai->ai_family != AF_INET6) || ai->ai_addrlen > sizeof(addrs[0].addr))
 				continue;
-			memcpy(sa, ai->ai_addr, ai->ai_addrlen);
-
-			if(sa->sa_family != AF_INET && sa->sa_family != AF_INET6)
-			{
-				free(sa);
-				continue;
-			}
-
-			set_port(sa, htons(SESSION_PORT));
+			SessionAddr *addr = &addrs[addrs_count++];
+			memset(&addr->addr, 0, sizeof(addr->addr));
+			memcpy(&addr->addr, ai->ai_addr, ai->ai_addrlen);
+			set_port((struct sockaddr *)&addr->addr, htons(SESSION_PORT));
+			addr->addrlen = ai->ai_addrlen;
+			addr->ai = ai;
+		}
+		session_addrs_order(addrs, addrs_count);
+		struct sockaddr *addr_ptrs[CHIAKI_STOP_PIPE_CONNECT_ANY_MAX];
+		size_t addrlens[CHIAKI_STOP_PIPE_CONNECT_ANY_MAX];
+		for(size_t i=0; i<addrs_count; i++)
+		{
+			addr_ptrs[i] = (struct sockaddr *)&addrs[i].addr;
+			addrlens[i] = addrs[i].addrlen;
+		}
 
-			// TODO: this can block, make cancelable somehow
+		CHIAKI_LOGI(session->log, "Trying to request session from %u address%s on port %d",
+				(unsigned int)addrs_count, addrs_count == 1 ? "" : "es", SESSION_PORT);
+		size_t addr_index = 0;
+		chiaki_mutex_unlock(&session->state_mutex);
+		ChiakiErrorCode err = addrs_count
+			? chiaki_stop_pipe_connect_any(&session->stop_pipe, addr_ptrs, addrlens, addrs_count, &session_sock, &addr_index)
+			: CHIAKI_ERR_PARSE_ADDR;
+		chiaki_mutex_lock(&session->state_mutex);
+		if(err == CHIAKI_ERR_CANCELED)
+		{
+			CHIAKI_LOGI(session->log, "Session stopped while connecting for session request");
+			session->quit_reason = CHIAKI_QUIT_REASON_STOPPED;
+			session_sock = CHIAKI_INVALID_SOCKET;
+		}
+		else if(err != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGE(session->log, "Session request connect failed: %s", chiaki_error_string(err));
+			if(err == CHIAKI_ERR_CONNECTION_REFUSED)
+				session->quit_reason = CHIAKI_QUIT_REASON_SESSION_REQUEST_CONNECTION_REFUSED;
+			else
+				session->quit_reason = CHIAKI_QUIT_REASON_NONE;
+			session_sock = CHIAKI_INVALID_SOCKET;
+		}
+		else
+		{
+			session_addr_cache_put(&addrs[addr_index]);
+			session->connect_info.host_addrinfo_selected = addrs[addr_index].ai;
 #ifndef __PSVITA__
-		//  FIXME: ok on vita?
-			int r = getnameinfo(sa, (socklen_t)ai->ai_addrlen, session->connect_info.hostname, sizeof(session->connect_info.hostname), NULL, 0, NI_NUMERICHOST);
+			int r = getnameinfo(addr_ptrs[addr_index], (socklen_t)addrlens[addr_index], session->connect_info.hostname, sizeof(session->connect_info.hostname), NULL, 0, NI_NUMERICHOST);
 			if(r != 0)
 			{
 				CHIAKI_LOGE(session->log, "getnameinfo failed with %s, filling the hostname with fallback", gai_strerror(r));
 				memcpy(session->connect_info.hostname, "unknown", 8);
 			}
 #endif
-
-			CHIAKI_LOGI(session->log, "Trying to request session from %s:%d", session->connect_info.hostname, SESSION_PORT);
-
-			session_sock = socket(ai->ai_family, SOCK_STREAM, 0);
-			if(CHIAKI_SOCKET_IS_INVALID(session_sock))
-			{
-#ifdef _WIN32
-				CHIAKI_LOGE(session->log, "Failed to create socket to request session");
-#else
-				CHIAKI_LOGE(session->log, "Failed to create socket to request session: %s", strerror(errno));
-#endif
-				free(sa);
-				continue;
-			}
-
-			ChiakiErrorCode err = chiaki_socket_set_nonblock(session_sock, true);
-			if(err != CHIAKI_ERR_SUCCESS)
-				CHIAKI_LOGE(session->log, "Failed to set session socket to non-blocking: %s", chiaki_error_string(err));
-
-			chiaki_mutex_unlock(&session->state_mutex);
-			err = chiaki_stop_pipe_connect(&session->stop_pipe, session_sock, sa, ai->ai_addrlen);
-			chiaki_mutex_lock(&session->state_mutex);
-			if(err == CHIAKI_ERR_CANCELED)
-			{
-				CHIAKI_LOGI(session->log, "Session stopped while connecting for session request");
-				session->quit_reason = CHIAKI_QUIT_REASON_STOPPED;
-				CHIAKI_SOCKET_CLOSE(session_sock);
-				session_sock = CHIAKI_INVALID_SOCKET;
-				free(sa);
-				break;
-			}
-			else if(err != CHIAKI_ERR_SUCCESS)
-			{
-				CHIAKI_LOGE(session->log, "Session request connect failed: %s", chiaki_error_string(err));
-				if(err == CHIAKI_ERR_CONNECTION_REFUSED)
-					session->quit_reason = CHIAKI_QUIT_REASON_SESSION_REQUEST_CONNECTION_REFUSED;
-				else
-					session->quit_reason = CHIAKI_QUIT_REASON_NONE;
-				CHIAKI_SOCKET_CLOSE(session_sock);
-				session_sock = CHIAKI_INVALID_SOCKET;
-				free(sa);
-				continue;
-			}
-
-			free(sa);
-
-			session->connect_info.host_addrinfo_selected = ai;
-			break;
 		}
-	
+
 		if(CHIAKI_SOCKET_IS_INVALID(session_sock))
 		{
 			CHIAKI_LOGE(session->log, "Session request connect failed eventually.");
@@ -1196,3 +1648,80 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_go_home(ChiakiSession *session)
 	err = ctrl_message_go_home(&session->ctrl);
 	return err;
 }
+
+CHIAKI_EXPORT void chiaki_session_get_latency_stats(ChiakiSession *session, ChiakiLatencyReport *report)
+{
+	chiaki_latency_stats_get(&session->latency_stats, report);
+}
+
+CHIAKI_EXPORT void chiaki_session_get_latency_histograms(ChiakiSession *session, ChiakiLatencyCoarseHistograms *histograms)
+{
+	chiaki_latency_stats_get_coarse_histograms(&session->latency_stats, histograms);
+}
+
+CHIAKI_EXPORT void chiaki_session_latency_stamp(ChiakiSession *session, ChiakiLatencyStamp stamp)
+{
+	uint64_t total_us = chiaki_latency_stats_stamp(&session->latency_stats, stamp);
+	if(total_us)
+		chiaki_av_sync_video_latency(&session->av_sync, total_us);
+}
+
+CHIAKI_EXPORT void chiaki_session_av_sync_audio_latency(ChiakiSession *session, uint64_t latency_us)
+{
+	chiaki_av_sync_audio_latency(&session->av_sync, latency_us);
+}
+
+CHIAKI_EXPORT void chiaki_session_audio_reorder_deadline(ChiakiSession *session, uint64_t deadline_us)
+{
+	chiaki_atomic_store_release(&session->audio_reorder_deadline_us, (size_t)deadline_us);
+}
+
+CHIAKI_EXPORT void chiaki_session_get_av_sync(ChiakiSession *session, ChiakiAVSyncState *state)
+{
+	chiaki_av_sync_get(&session->av_sync, state);
+}
+
+CHIAKI_EXPORT void chiaki_session_get_video_stats(ChiakiSession *session, ChiakiVideoStatsCounters *counters)
+{
+	chiaki_video_stats_get(&session->video_stats, counters);
+}
+
+CHIAKI_EXPORT void chiaki_session_get_stream_stats(ChiakiSession *session, ChiakiStreamStatsSnapshot *snapshot)
+{
+	chiaki_video_stats_get_stream(&session->video_stats, chiaki_time_now_monotonic_us(), snapshot);
+}
+
+CHIAKI_EXPORT void chiaki_session_get_packet_stats(ChiakiSession *session, uint64_t *received, uint64_t *lost)
+{
+	chiaki_packet_stats_get(&session->stream_connection.packet_stats, false, received, lost);
+}
+
+CHIAKI_EXPORT void chiaki_session_get_packet_stats_snapshot(ChiakiSession *session, ChiakiPacketStatsSnapshot *snapshot)
+{
+	chiaki_packet_stats_snapshot(&session->stream_connection.packet_stats, chiaki_time_now_monotonic_us(), snapshot);
+}
+
+CHIAKI_EXPORT void chiaki_session_get_load_stats(ChiakiSession *session, ChiakiLoadMonitorStats *stats)
+{
+	chiaki_load_monitor_get_stats(&session->stream_connection.load_monitor, stats);
+}
+
+CHIAKI_EXPORT void chiaki_session_get_jitter_stats(ChiakiSession *session, ChiakiJitterStats *stats)
+{
+	chiaki_jitter_estimator_get(&session->stream_connection.jitter_estimator, stats);
+}
+
+CHIAKI_EXPORT void chiaki_session_get_congestion_stats(ChiakiSession *session, ChiakiCongestionControlStats *stats)
+{
+	chiaki_congestion_control_get_stats(&session->stream_connection.congestion_control, stats);
+}
+
+CHIAKI_EXPORT void chiaki_session_get_audio_decode_stats(ChiakiSession *session, ChiakiAudioDecodeQueueStats *stats)
+{
+	chiaki_audio_decode_queue_get_stats(&session->audio_decode_queue, stats);
+}
+
+CHIAKI_EXPORT void chiaki_session_get_arena_usage(ChiakiSession *session, ChiakiArenaUsage *usage)
+{
+	chiaki_arena_get_usage(&session->arena, usage);
+}
@@ -2,10 +2,19 @@
 
 #include <chiaki/sock.h>
 #include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
 
-#ifdef __PSVITA__
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#elif defined(__PSVITA__)
 #include <psp2/net/net.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#else
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
 #endif
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_socket_set_nonblock(chiaki_socket_t sock, bool nonblock)
@@ -27,4 +36,110 @@ int nbio = nonblock ? 1 : 0;
 		return CHIAKI_ERR_UNKNOWN;
 #endif
 	return CHIAKI_ERR_SUCCESS;
-}
\ No newline at end of file
+}
+static int socket_family(chiaki_socket_t sock)
+{
+#ifdef __PSVITA__
+	// no IPv6 on the Vita
+	(void)sock;
+	return AF_INET;
+#else
+	struct sockaddr_in6 addr;
+	socklen_t addr_len = sizeof(addr);
+	memset(&addr, 0, sizeof(addr));
+	if(getsockname(sock, (struct sockaddr *)&addr, &addr_len) < 0)
+		return AF_INET;
+	return ((struct sockaddr *)&addr)->sa_family;
+#endif
+}
+
+static ChiakiErrorCode socket_set_buf(chiaki_socket_t sock, int opt, const char *opt_name, size_t size, const char *name, ChiakiLog *log)
+{
+	if(!size)
+		return CHIAKI_ERR_SUCCESS;
+	int val = size > INT32_MAX ? INT32_MAX : (int)size;
+	if(setsockopt(sock, SOL_SOCKET, opt, (const CHIAKI_SOCKET_BUF_TYPE)&val, sizeof(val)) < 0)
+	{
+		CHIAKI_LOGE(log, "%s failed to setsockopt %s: " CHIAKI_SOCKET_ERROR_FMT, name, opt_name, CHIAKI_SOCKET_ERROR_VALUE);
+		return CHIAKI_ERR_NETWORK;
+	}
+	int granted = 0;
+	socklen_t granted_len = sizeof(granted);
+	if(getsockopt(sock, SOL_SOCKET, opt, (CHIAKI_SOCKET_BUF_TYPE)&granted, &granted_len) == 0)
+		CHIAKI_LOGI(log, "%s %s %zu KB requested, %d KB granted", name, opt_name, size / 1024, granted / 1024);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_socket_set_options(chiaki_socket_t sock, const ChiakiSocketOptions *options, const char *name, ChiakiLog *log)
+{
+	ChiakiErrorCode err = socket_set_buf(sock, SO_RCVBUF, "SO_RCVBUF", options->rcvbuf, name, log);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	err = socket_set_buf(sock, SO_SNDBUF, "SO_SNDBUF", options->sndbuf, name, log);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	if(!options->dscp)
+		return CHIAKI_ERR_SUCCESS;
+	// the code point goes in the upper 6 bits, ECN stays off
+	int tos = (options->dscp & 0x3f) << 2;
+	int r = -1;
+	if(socket_family(sock) == AF_INET6)
+	{
+#ifdef IPV6_TCLASS
+		r = setsockopt(sock, IPPROTO_IPV6, IPV6_TCLASS, (const CHIAKI_SOCKET_BUF_TYPE)&tos, sizeof(tos));
+#endif
+	}
+	else
+	{
+#ifdef IP_TOS
+		r = setsockopt(sock, IPPROTO_IP, IP_TOS, (const CHIAKI_SOCKET_BUF_TYPE)&tos, sizeof(tos));
+#endif
+	}
+	if(r < 0)
+		CHIAKI_LOGW(log, "%s failed to mark packets with DSCP %u", name, (unsigned int)options->dscp);
+	else
+		CHIAKI_LOGI(log, "%s marking packets with DSCP %u", name, (unsigned int)options->dscp);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_socket_get_recv_stats(chiaki_socket_t sock, ChiakiSocketRecvStats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+#if defined(__linux__) && !defined(__PSVITA__) && !defined(__SWITCH__)
+	// the kernel only exposes the drops of a socket in the table of all of them, found by its inode
+	struct stat st;
+	if(fstat(sock, &st) < 0)
+		return CHIAKI_ERR_UNKNOWN;
+	static const char *tables[] = { "/proc/net/udp", "/proc/net/udp6" };
+	for(size_t i=0; i<sizeof(tables) / sizeof(tables[0]); i++)
+	{
+		FILE *f = fopen(tables[i], "r");
+		if(!f)
+			continue;
+		char line[512];
+		bool found = false;
+		// sl local_address rem_address st tx_queue:rx_queue tr:tm->when retrnsmt uid timeout inode ref pointer drops
+		if(fgets(line, sizeof(line), f))
+		{
+			while(!found && fgets(line, sizeof(line), f))
+			{
+				unsigned long rx_queue, inode, drops;
+				if(sscanf(line, " %*u: %*s %*s %*x %*x:%lx %*x:%*x %*x %*u %*u %lu %*d %*s %lu", &rx_queue, &inode, &drops) != 3)
+					continue;
+				if((ino_t)inode != st.st_ino)
+					continue;
+				stats->drops = drops;
+				stats->queued = rx_queue;
+				found = true;
+			}
+		}
+		fclose(f);
+		if(found)
+			return CHIAKI_ERR_SUCCESS;
+	}
+#else
+	(void)sock;
+#endif
+	return CHIAKI_ERR_UNKNOWN;
+}
@@ -0,0 +1,50 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/spscring.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define IDX_MASK ((((size_t)1) << ring->size_exp) - 1)
+#define elem_at(i) (ring->elems + ((i) & IDX_MASK) * ring->elem_size)
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_spsc_ring_init(ChiakiSPSCRing *ring, size_t size_exp, size_t elem_size)
+{
+	ring->elem_size = elem_size;
+	ring->size_exp = size_exp;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->high_water = 0;
+	ring->elems = calloc(((size_t)1) << size_exp, elem_size);
+	if(!ring->elems)
+		return CHIAKI_ERR_MEMORY;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_spsc_ring_fini(ChiakiSPSCRing *ring)
+{
+	free(ring->elems);
+}
+
+CHIAKI_EXPORT bool chiaki_spsc_ring_push(ChiakiSPSCRing *ring, const void *elem)
+{
+	size_t tail = ring->tail;
+	size_t count = tail - chiaki_atomic_load_acquire(&ring->head);
+	if(count >= chiaki_spsc_ring_size(ring))
+		return false;
+	memcpy(elem_at(tail), elem, ring->elem_size);
+	chiaki_atomic_store_release(&ring->tail, tail + 1);
+	if(count + 1 > ring->high_water)
+		ring->high_water = count + 1;
+	return true;
+}
+
+CHIAKI_EXPORT bool chiaki_spsc_ring_pop(ChiakiSPSCRing *ring, void *elem)
+{
+	size_t head = ring->head;
+	if(chiaki_atomic_load_acquire(&ring->tail) == head)
+		return false;
+	memcpy(elem, elem_at(head), ring->elem_size);
+	chiaki_atomic_store_release(&ring->head, head + 1);
+	return true;
+}
@@ -3,8 +3,10 @@
 #include <chiaki/stoppipe.h>
 #include <chiaki/sock.h>
 #include <chiaki/log.h>
+#include <chiaki/time.h>
 
 #include <fcntl.h>
+#include <limits.h>
 
 #ifdef _WIN32
 #include <ws2tcpip.h>
@@ -16,6 +18,10 @@
 #include <sys/select.h>
 #endif
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#endif
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_init(ChiakiStopPipe *stop_pipe)
 {
 #ifdef _WIN32
@@ -256,31 +262,17 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_select_single(ChiakiStopPipe *sto
 #endif
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_connect(ChiakiStopPipe *stop_pipe, chiaki_socket_t fd, struct sockaddr *addr, size_t addrlen)
+/**
+ * Error of a connect() that failed right away.
+ */
+static ChiakiErrorCode stop_pipe_connect_error()
 {
-	// #ifdef __PSVITA__
-	// int r = sceNetConnect(fd, (SceNetSockaddr*) addr, addrlen);
-	// int errno = r;
-	// #else
-	int r = connect(fd, addr, (socklen_t)addrlen);
-	// #endif
-	if(r >= 0)
-		return CHIAKI_ERR_SUCCESS;
-
-	if(CHIAKI_SOCKET_EINPROGRESS)
-	{
-		ChiakiErrorCode err = chiaki_stop_pipe_select_single(stop_pipe, fd, true, UINT64_MAX);
-		if(err != CHIAKI_ERR_SUCCESS)
-			return err;
-	}
-	else
-	{
 #ifdef _WIN32
-		int err = WSAGetLastError();
-		if(err == WSAECONNREFUSED)
-			return CHIAKI_ERR_CONNECTION_REFUSED;
-		else
-			return CHIAKI_ERR_NETWORK;
+	int err = WSAGetLastError();
+	if(err == WSAECONNREFUSED)
+		return CHIAKI_ERR_CONNECTION_REFUSED;
+	else
+		return CHIAKI_ERR_NETWORK;
 // #elif defined(__PSVITA__)
 // 	if (r == SCE_NET_ERROR_ECONNREFUSED)
 // 			return CHIAKI_ERR_CONNECTION_REFUSED;
@@ -288,13 +280,18 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_connect(ChiakiStopPipe *stop_pipe
 // 		return CHIAKI_ERR_NETWORK;
 // 	}
 #else
-		if(errno == ECONNREFUSED)
-			return CHIAKI_ERR_CONNECTION_REFUSED;
-		else
-			return CHIAKI_ERR_NETWORK;
+	if(errno == ECONNREFUSED)
+		return CHIAKI_ERR_CONNECTION_REFUSED;
+	else
+		return CHIAKI_ERR_NETWORK;
 #endif
-	}
+}
 
+/**
+ * Result of a non-blocking connect() after the socket became writable.
+ */
+static ChiakiErrorCode stop_pipe_connect_result(chiaki_socket_t fd)
+{
 	struct sockaddr peer;
 	socklen_t peerlen = sizeof(peer);
 	if(getpeername(fd, &peer, &peerlen) == 0)
@@ -371,6 +368,138 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_connect(ChiakiStopPipe *stop_pipe
 #endif
 }
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_connect(ChiakiStopPipe *stop_pipe, chiaki_socket_t fd, struct sockaddr *addr, size_t addrlen)
+{
+	// #ifdef __PSVITA__
+	// int r = sceNetConnect(fd, (SceNetSockaddr*) addr, addrlen);
+	// int errno = r;
+	// #else
+	int r = connect(fd, addr, (socklen_t)addrlen);
+	// #endif
+	if(r >= 0)
+		return CHIAKI_ERR_SUCCESS;
+
+	if(!CHIAKI_SOCKET_EINPROGRESS)
+		return stop_pipe_connect_error();
+
+	ChiakiErrorCode err = chiaki_stop_pipe_select_single(stop_pipe, fd, true, UINT64_MAX);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	return stop_pipe_connect_result(fd);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_connect_any(ChiakiStopPipe *stop_pipe, struct sockaddr **addrs, const size_t *addrlens,
+		size_t count, chiaki_socket_t *sock_out, size_t *index_out)
+{
+	if(count > CHIAKI_STOP_PIPE_CONNECT_ANY_MAX)
+		count = CHIAKI_STOP_PIPE_CONNECT_ANY_MAX;
+	chiaki_socket_t socks[CHIAKI_STOP_PIPE_CONNECT_ANY_MAX];
+	for(size_t i=0; i<count; i++)
+		socks[i] = CHIAKI_INVALID_SOCKET;
+
+	ChiakiErrorCode result = CHIAKI_ERR_NETWORK; // of the last address that failed
+	size_t next = 0; // first address not tried yet
+	size_t pending = 0;
+	uint64_t next_start_ms = 0;
+	size_t winner = count;
+	while(winner == count)
+	{
+		uint64_t now_ms = chiaki_time_now_monotonic_ms();
+		// the next address gets its turn once the pending ones had their head start or all of them failed
+		if(next < count && pending < CHIAKI_STOP_PIPE_WAITER_SOCKS_MAX && (!pending || now_ms >= next_start_ms))
+		{
+			size_t i = next++;
+			chiaki_socket_t sock = socket(addrs[i]->sa_family, SOCK_STREAM, IPPROTO_TCP);
+			if(CHIAKI_SOCKET_IS_INVALID(sock))
+			{
+				result = CHIAKI_ERR_NETWORK;
+				continue;
+			}
+			if(chiaki_socket_set_nonblock(sock, true) != CHIAKI_ERR_SUCCESS)
+			{
+				CHIAKI_SOCKET_CLOSE(sock);
+				result = CHIAKI_ERR_NETWORK;
+				continue;
+			}
+			socks[i] = sock;
+			if(connect(sock, addrs[i], (socklen_t)addrlens[i]) >= 0)
+			{
+				winner = i;
+				break;
+			}
+			if(!CHIAKI_SOCKET_EINPROGRESS)
+			{
+				result = stop_pipe_connect_error();
+				CHIAKI_SOCKET_CLOSE(sock);
+				socks[i] = CHIAKI_INVALID_SOCKET;
+				continue;
+			}
+			pending++;
+			next_start_ms = now_ms + CHIAKI_STOP_PIPE_CONNECT_STAGGER_MS;
+			continue;
+		}
+		if(!pending)
+			break;
+
+		// the waiter can not remove sockets, so it is set up again with the ones still pending every time
+		ChiakiStopPipeWaiter waiter;
+		ChiakiErrorCode err = chiaki_stop_pipe_waiter_init(&waiter, stop_pipe);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			result = err;
+			break;
+		}
+		size_t waiting[CHIAKI_STOP_PIPE_WAITER_SOCKS_MAX];
+		size_t waiting_count = 0;
+		for(size_t i=0; i<next; i++)
+		{
+			if(CHIAKI_SOCKET_IS_INVALID(socks[i]))
+				continue;
+			if(chiaki_stop_pipe_waiter_add(&waiter, socks[i], true) == CHIAKI_ERR_SUCCESS)
+				waiting[waiting_count++] = i;
+		}
+		uint64_t timeout_ms = next < count && pending < CHIAKI_STOP_PIPE_WAITER_SOCKS_MAX
+			? (next_start_ms > now_ms ? next_start_ms - now_ms : 0) : UINT64_MAX;
+		uint32_t ready = 0;
+		err = chiaki_stop_pipe_waiter_wait(&waiter, timeout_ms, &ready);
+		chiaki_stop_pipe_waiter_fini(&waiter);
+		if(err == CHIAKI_ERR_TIMEOUT)
+			continue;
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			result = err;
+			break;
+		}
+		for(size_t j=0; j<waiting_count; j++)
+		{
+			if(!(ready & (1 << j)))
+				continue;
+			size_t i = waiting[j];
+			ChiakiErrorCode sock_result = stop_pipe_connect_result(socks[i]);
+			if(sock_result == CHIAKI_ERR_SUCCESS)
+			{
+				winner = i;
+				break;
+			}
+			result = sock_result;
+			CHIAKI_SOCKET_CLOSE(socks[i]);
+			socks[i] = CHIAKI_INVALID_SOCKET;
+			pending--;
+		}
+	}
+
+	for(size_t i=0; i<count; i++)
+	{
+		if(i != winner && !CHIAKI_SOCKET_IS_INVALID(socks[i]))
+			CHIAKI_SOCKET_CLOSE(socks[i]);
+	}
+	if(winner == count)
+		return result;
+	*sock_out = socks[winner];
+	*index_out = winner;
+	return CHIAKI_ERR_SUCCESS;
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_reset(ChiakiStopPipe *stop_pipe)
 {
 #ifdef _WIN32
@@ -394,3 +523,189 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_reset(ChiakiStopPipe *stop_pipe)
 	return r < 0 ? CHIAKI_ERR_UNKNOWN : CHIAKI_ERR_SUCCESS;
 #endif
 }
+
+#ifndef _WIN32
+static int stop_pipe_fd(ChiakiStopPipe *stop_pipe)
+{
+#if defined(__SWITCH__) || defined(__PSVITA__)
+	return stop_pipe->fd;
+#else
+	return stop_pipe->fds[0];
+#endif
+}
+#endif
+
+#if defined(__linux__)
+#define EPOLL_DATA_STOP_PIPE CHIAKI_STOP_PIPE_WAITER_SOCKS_MAX
+#endif
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_waiter_init(ChiakiStopPipeWaiter *waiter, ChiakiStopPipe *stop_pipe)
+{
+	waiter->stop_pipe = stop_pipe;
+	waiter->socks_count = 0;
+#if defined(_WIN32)
+	waiter->events[0] = stop_pipe->event;
+#elif defined(__PSVITA__)
+	FD_ZERO(&waiter->rfds);
+	FD_ZERO(&waiter->wfds);
+	int stop_fd = stop_pipe_fd(stop_pipe);
+	FD_SET(stop_fd, &waiter->rfds);
+	waiter->nfds = stop_fd + 1;
+#elif defined(__linux__)
+	waiter->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(waiter->epoll_fd < 0)
+		return CHIAKI_ERR_UNKNOWN;
+	struct epoll_event ev = { 0 };
+	ev.events = EPOLLIN;
+	ev.data.u32 = EPOLL_DATA_STOP_PIPE;
+	if(epoll_ctl(waiter->epoll_fd, EPOLL_CTL_ADD, stop_pipe_fd(stop_pipe), &ev) < 0)
+	{
+		close(waiter->epoll_fd);
+		return CHIAKI_ERR_UNKNOWN;
+	}
+#else
+	waiter->pfds[0].fd = stop_pipe_fd(stop_pipe);
+	waiter->pfds[0].events = POLLIN;
+#endif
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_stop_pipe_waiter_fini(ChiakiStopPipeWaiter *waiter)
+{
+#if defined(_WIN32)
+	for(size_t i=0; i<waiter->socks_count; i++)
+	{
+		WSAEventSelect(waiter->socks[i], NULL, 0); // fails harmlessly if the socket is already closed
+		WSACloseEvent(waiter->events[i + 1]);
+	}
+#elif defined(__linux__)
+	close(waiter->epoll_fd);
+#endif
+	waiter->socks_count = 0;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_waiter_add(ChiakiStopPipeWaiter *waiter, chiaki_socket_t sock, bool write)
+{
+	if(waiter->socks_count >= CHIAKI_STOP_PIPE_WAITER_SOCKS_MAX)
+		return CHIAKI_ERR_OVERFLOW;
+	if(CHIAKI_SOCKET_IS_INVALID(sock))
+		return CHIAKI_ERR_INVALID_DATA;
+	size_t i = waiter->socks_count;
+#if defined(_WIN32)
+	WSAEVENT event = WSACreateEvent();
+	if(event == WSA_INVALID_EVENT)
+		return CHIAKI_ERR_UNKNOWN;
+	// FD_CONNECT, because a failed connect is never signaled by FD_WRITE
+	if(WSAEventSelect(sock, event, write ? FD_WRITE | FD_CONNECT : FD_READ) != 0)
+	{
+		WSACloseEvent(event);
+		return CHIAKI_ERR_NETWORK;
+	}
+	waiter->events[i + 1] = event;
+#elif defined(__PSVITA__)
+	FD_SET(sock, write ? &waiter->wfds : &waiter->rfds);
+	if(sock >= waiter->nfds)
+		waiter->nfds = sock + 1;
+#elif defined(__linux__)
+	struct epoll_event ev = { 0 };
+	ev.events = write ? EPOLLOUT : EPOLLIN;
+	ev.data.u32 = (uint32_t)i;
+	if(epoll_ctl(waiter->epoll_fd, EPOLL_CTL_ADD, sock, &ev) < 0)
+		return CHIAKI_ERR_NETWORK;
+#else
+	waiter->pfds[i + 1].fd = sock;
+	waiter->pfds[i + 1].events = write ? POLLOUT : POLLIN;
+#endif
+	waiter->socks[i] = sock;
+	waiter->socks_write[i] = write;
+	waiter->socks_count++;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_waiter_wait(ChiakiStopPipeWaiter *waiter, uint64_t timeout_ms, uint32_t *ready_mask)
+{
+	uint32_t ready = 0;
+#if defined(_WIN32)
+	DWORD r = WSAWaitForMultipleEvents((DWORD)waiter->socks_count + 1, waiter->events, FALSE,
+			timeout_ms == UINT64_MAX ? WSA_INFINITE : (DWORD)timeout_ms, FALSE);
+	if(r == WSA_WAIT_TIMEOUT)
+		return CHIAKI_ERR_TIMEOUT;
+	if(r == WSA_WAIT_EVENT_0)
+		return CHIAKI_ERR_CANCELED;
+	if(r < WSA_WAIT_EVENT_0 + 1 || r > WSA_WAIT_EVENT_0 + waiter->socks_count)
+		return CHIAKI_ERR_UNKNOWN;
+	// the events are not reset by recv()/send(), which only re-post them if the socket is still ready
+	for(size_t i=r - WSA_WAIT_EVENT_0 - 1; i<waiter->socks_count; i++)
+	{
+		if(WSAWaitForMultipleEvents(1, &waiter->events[i + 1], FALSE, 0, FALSE) != WSA_WAIT_EVENT_0)
+			continue;
+		WSAResetEvent(waiter->events[i + 1]);
+		ready |= 1 << i;
+	}
+#elif defined(__PSVITA__)
+	fd_set rfds = waiter->rfds;
+	fd_set wfds = waiter->wfds;
+	struct timeval timeout;
+	// no NULL timeout, to work around a crash in newlib
+	if(timeout_ms == UINT64_MAX)
+	{
+		timeout.tv_sec = 999999999;
+		timeout.tv_usec = 0;
+	}
+	else
+	{
+		timeout.tv_sec = timeout_ms / 1000;
+		timeout.tv_usec = (timeout_ms % 1000) * 1000;
+	}
+	int r;
+	do
+	{
+		r = select(waiter->nfds, &rfds, &wfds, NULL, &timeout);
+	} while(r < 0 && errno == EINTR);
+	if(r < 0)
+		return CHIAKI_ERR_UNKNOWN;
+	if(FD_ISSET(stop_pipe_fd(waiter->stop_pipe), &rfds))
+		return CHIAKI_ERR_CANCELED;
+	for(size_t i=0; i<waiter->socks_count; i++)
+	{
+		if(FD_ISSET(waiter->socks[i], waiter->socks_write[i] ? &wfds : &rfds))
+			ready |= 1 << i;
+	}
+#elif defined(__linux__)
+	int timeout = timeout_ms == UINT64_MAX ? -1 : (timeout_ms > INT_MAX ? INT_MAX : (int)timeout_ms);
+	struct epoll_event evs[CHIAKI_STOP_PIPE_WAITER_SOCKS_MAX + 1];
+	int r;
+	do
+	{
+		r = epoll_wait(waiter->epoll_fd, evs, (int)waiter->socks_count + 1, timeout);
+	} while(r < 0 && errno == EINTR);
+	if(r < 0)
+		return CHIAKI_ERR_UNKNOWN;
+	for(int i=0; i<r; i++)
+	{
+		if(evs[i].data.u32 == EPOLL_DATA_STOP_PIPE)
+			return CHIAKI_ERR_CANCELED;
+		ready |= 1 << evs[i].data.u32;
+	}
+#else
+	int timeout = timeout_ms == UINT64_MAX ? -1 : (timeout_ms > INT_MAX ? INT_MAX : (int)timeout_ms);
+	int r;
+	do
+	{
+		r = poll(waiter->pfds, (nfds_t)waiter->socks_count + 1, timeout);
+	} while(r < 0 && errno == EINTR);
+	if(r < 0)
+		return CHIAKI_ERR_UNKNOWN;
+	if(waiter->pfds[0].revents & POLLIN)
+		return CHIAKI_ERR_CANCELED;
+	for(size_t i=0; i<waiter->socks_count; i++)
+	{
+		// errors count as ready, so the following recv()/send() reports them
+		if(waiter->pfds[i + 1].revents)
+			ready |= 1 << i;
+	}
+#endif
+	if(ready_mask)
+		*ready_mask = ready;
+	return ready ? CHIAKI_ERR_SUCCESS : CHIAKI_ERR_TIMEOUT;
+}
@@ -8,6 +8,7 @@
 #include <chiaki/base64.h>
 #include <chiaki/audio.h>
 #include <chiaki/video.h>
+#include <chiaki/time.h>
 
 #include <string.h>
 #include <assert.h>
@@ -34,6 +35,7 @@
 #define HEARTBEAT_INTERVAL_MS 1000
 
 
+
 typedef enum {
 	STATE_IDLE,
 	STATE_TAKION_CONNECT,
@@ -57,7 +59,8 @@ static void stream_connection_takion_data_expect_bang(ChiakiStreamConnection *st
 static void stream_connection_takion_data_expect_streaminfo(ChiakiStreamConnection *stream_connection, uint8_t *buf, size_t buf_size);
 static ChiakiErrorCode stream_connection_send_streaminfo_ack(ChiakiStreamConnection *stream_connection);
 static void stream_connection_takion_av(ChiakiStreamConnection *stream_connection, ChiakiTakionAVPacket *packet);
-static ChiakiErrorCode stream_connection_send_heartbeat(ChiakiStreamConnection *stream_connection);
+static uint64_t stream_connection_heartbeat_task_cb(void *user, uint64_t now_us);
+static ChiakiErrorCode stream_connection_encode_templates(ChiakiStreamConnection *stream_connection);
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_init(ChiakiStreamConnection *stream_connection, ChiakiSession *session)
 {
@@ -80,23 +83,54 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_init(ChiakiStreamConnecti
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_state_cond;
 
+	chiaki_jitter_estimator_reset(&stream_connection->jitter_estimator);
+
 	stream_connection->video_receiver = NULL;
 	stream_connection->audio_receiver = NULL;
 	stream_connection->haptics_receiver = NULL;
 
-	err = chiaki_mutex_init(&stream_connection->feedback_sender_mutex, false);
+	err = chiaki_delay_estimator_init(&stream_connection->delay_estimator);
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_packet_stats;
 
+	err = chiaki_load_monitor_init(&stream_connection->load_monitor, stream_connection->log, &session->latency_stats);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_delay_estimator;
+
+	err = chiaki_congestion_control_init(&stream_connection->congestion_control);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_load_monitor;
+
+	err = chiaki_mutex_init(&stream_connection->feedback_sender_mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_congestion_control;
+
+	err = stream_connection_encode_templates(stream_connection);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_feedback_sender_mutex;
+
 	stream_connection->state = STATE_IDLE;
 	stream_connection->state_finished = false;
 	stream_connection->state_failed = false;
 	stream_connection->should_stop = false;
 	stream_connection->remote_disconnected = false;
 	stream_connection->remote_disconnect_reason = NULL;
+	stream_connection->link_lost = false;
+	stream_connection->connected = false;
+	stream_connection->last_recv_ms = 0;
+	stream_connection->resend_timeout_us = 0;
+	chiaki_timer_task_init(&stream_connection->heartbeat_task, "heartbeat", stream_connection_heartbeat_task_cb, stream_connection);
 
 	return CHIAKI_ERR_SUCCESS;
 
+error_feedback_sender_mutex:
+	chiaki_mutex_fini(&stream_connection->feedback_sender_mutex);
+error_congestion_control:
+	chiaki_congestion_control_fini(&stream_connection->congestion_control);
+error_load_monitor:
+	chiaki_load_monitor_fini(&stream_connection->load_monitor);
+error_delay_estimator:
+	chiaki_delay_estimator_fini(&stream_connection->delay_estimator);
 error_packet_stats:
 	chiaki_packet_stats_fini(&stream_connection->packet_stats);
 error_state_cond:
@@ -115,13 +149,10 @@ CHIAKI_EXPORT void chiaki_stream_connection_fini(ChiakiStreamConnection *stream_
 	chiaki_gkcrypt_free(stream_connection->gkcrypt_local);
 
 	free(stream_connection->ecdh_secret);
-#if defined(__PSVITA__)
-	if (stream_connection->congestion_control.thread.thread_id)
-#else
-	if (stream_connection->congestion_control.thread.thread)
-#endif
-		chiaki_congestion_control_stop(&stream_connection->congestion_control);
-
+	chiaki_congestion_control_stop(&stream_connection->congestion_control);
+	chiaki_congestion_control_fini(&stream_connection->congestion_control);
+	chiaki_load_monitor_fini(&stream_connection->load_monitor);
+	chiaki_delay_estimator_fini(&stream_connection->delay_estimator);
 	chiaki_packet_stats_fini(&stream_connection->packet_stats);
 
 	chiaki_mutex_fini(&stream_connection->feedback_sender_mutex);
@@ -133,10 +164,11 @@ CHIAKI_EXPORT void chiaki_stream_connection_fini(ChiakiStreamConnection *stream_
 static bool state_finished_cond_check(void *user)
 {
 	ChiakiStreamConnection *stream_connection = user;
-	return stream_connection->state_finished || stream_connection->should_stop || stream_connection->remote_disconnected;
+	return stream_connection->state_finished || stream_connection->should_stop || stream_connection->remote_disconnected
+		|| stream_connection->link_lost;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnection *stream_connection, chiaki_socket_t *socket)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnection *stream_connection, chiaki_socket_t *socket, bool resumed)
 {
 	ChiakiSession *session = stream_connection->session;
 	ChiakiErrorCode err;
@@ -144,7 +176,10 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 	ChiakiTakionConnectInfo takion_info;
 	takion_info.log = stream_connection->log;
 	takion_info.close_socket = true;
-	if(!socket)
+	takion_info.capture = session->connect_info.capture;
+	takion_info.replay = session->connect_info.replay;
+	takion_info.impair = session->connect_info.impair;
+	if(!socket && !takion_info.replay)
 	{
 		takion_info.sa_len = session->connect_info.host_addrinfo_selected->ai_addrlen;
 		takion_info.sa = malloc(takion_info.sa_len);
@@ -157,8 +192,30 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 	takion_info.ip_dontfrag = false;
 
 	takion_info.enable_crypt = true;
+	takion_info.recv_batch = true;
+	takion_info.recv_ring_size_exp = session->connect_info.latency_profile.recv_ring_size_exp;
+	takion_info.data_queue_size_exp = session->connect_info.latency_profile.data_queue_size_exp;
+	takion_info.initial_rtt_us = session->rtt_us;
+	takion_info.timer_wheel = &session->timer_wheel;
+	takion_info.arena = &session->arena;
 	takion_info.enable_dualsense = session->connect_info.enable_dualsense;
 	takion_info.protocol_version = chiaki_target_is_ps5(session->target) ? 12 : 9;
+	takion_info.av_substreams = chiaki_session_av_substreams(session);
+	takion_info.mac_offload = session->connect_info.mac_offload;
+	takion_info.ack_delay_us = (uint64_t)session->connect_info.ack_delay_ms * 1000;
+	takion_info.upstream_packets_budget = session->connect_info.upstream_packets_budget;
+	memset(&takion_info.sock_options, 0, sizeof(takion_info.sock_options));
+	takion_info.sock_options.dscp = session->connect_info.dscp;
+	if(session->connect_info.recv_buffer_burst_ms)
+	{
+		// an I frame arrives as one burst at line rate, everything of it that does not fit while the Takion thread is late is lost
+		size_t rcvbuf = (size_t)session->connect_info.video_profile.bitrate * session->connect_info.recv_buffer_burst_ms / 8;
+		if(rcvbuf < CHIAKI_SESSION_RECV_BUFFER_MIN)
+			rcvbuf = CHIAKI_SESSION_RECV_BUFFER_MIN;
+		if(rcvbuf > CHIAKI_SESSION_RECV_BUFFER_MAX)
+			rcvbuf = CHIAKI_SESSION_RECV_BUFFER_MAX;
+		takion_info.sock_options.rcvbuf = rcvbuf;
+	}
 
 	takion_info.cb = stream_connection_takion_cb;
 	takion_info.cb_user = stream_connection;
@@ -166,17 +223,35 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 	err = chiaki_mutex_lock(&stream_connection->state_mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
 
+	// everything left over from a previous run, the keys are derived again from the new handshake
+	stream_connection->remote_disconnected = false;
+	free(stream_connection->remote_disconnect_reason);
+	stream_connection->remote_disconnect_reason = NULL;
+	stream_connection->link_lost = false;
+	stream_connection->connected = false;
+	chiaki_gkcrypt_free(stream_connection->gkcrypt_remote);
+	stream_connection->gkcrypt_remote = NULL;
+	chiaki_gkcrypt_free(stream_connection->gkcrypt_local);
+	stream_connection->gkcrypt_local = NULL;
+	free(stream_connection->ecdh_secret);
+	stream_connection->ecdh_secret = NULL;
+
 #define CHECK_STOP(quit_label) do { \
 	if(stream_connection->should_stop) \
 	{ \
 		goto quit_label; \
 	} } while(0)
 
+	if(session->connect_info.audio_decode_queue
+		&& chiaki_audio_decode_queue_start(&session->audio_decode_queue, &session->audio_sink) != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGE(session->log, "StreamConnection failed to start audio decode queue, decoding on the receiving thread");
+
 	stream_connection->audio_receiver = chiaki_audio_receiver_new(session, &stream_connection->packet_stats);
 	if(!stream_connection->audio_receiver)
 	{
 		CHIAKI_LOGE(session->log, "StreamConnection failed to initialize Audio Receiver");
-		return CHIAKI_ERR_UNKNOWN;
+		err = CHIAKI_ERR_UNKNOWN;
+		goto err_audio_decode_queue;
 	}
 
 	stream_connection->haptics_receiver = chiaki_audio_receiver_new(session, NULL);
@@ -195,11 +270,22 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 		goto err_haptics_receiver;
 	}
 
+	chiaki_jitter_estimator_reset(&stream_connection->jitter_estimator);
+	if(session->connect_info.video_profile.max_fps)
+		chiaki_jitter_estimator_set_interval(&stream_connection->jitter_estimator, CHIAKI_JITTER_STREAM_VIDEO,
+				1000000 / session->connect_info.video_profile.max_fps);
+	chiaki_delay_estimator_reset(&stream_connection->delay_estimator,
+			session->connect_info.congestion_control_delay_based && session->connect_info.video_profile.max_fps
+			? 1000000 / session->connect_info.video_profile.max_fps : 0);
+	chiaki_load_monitor_reset(&stream_connection->load_monitor,
+			session->connect_info.load_monitor && session->connect_info.video_profile.max_fps
+			? 1000000 / session->connect_info.video_profile.max_fps : 0);
+
 	stream_connection->state = STATE_TAKION_CONNECT;
 	stream_connection->state_finished = false;
 	stream_connection->state_failed = false;
 	err = chiaki_takion_connect(&stream_connection->takion, &takion_info, socket);
-	if(!socket)
+	if(!socket && !takion_info.replay)
 		free(takion_info.sa);
 
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -209,7 +295,10 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 		goto err_video_receiver;
 	}
 
-	err = chiaki_congestion_control_start(&stream_connection->congestion_control, &stream_connection->takion, &stream_connection->packet_stats);
+	err = chiaki_congestion_control_start(&stream_connection->congestion_control, &session->timer_wheel,
+			&stream_connection->takion, &stream_connection->packet_stats,
+			session->connect_info.congestion_control_delay_based ? &stream_connection->delay_estimator : NULL,
+			session->connect_info.load_monitor ? &stream_connection->load_monitor : NULL);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(session->log, "StreamConnection failed to start Congestion Control");
@@ -284,7 +373,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 
 	err = chiaki_mutex_lock(&stream_connection->feedback_sender_mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
-	err = chiaki_feedback_sender_init(&stream_connection->feedback_sender, &stream_connection->takion);
+	err = chiaki_feedback_sender_init(&stream_connection->feedback_sender, &session->timer_wheel, &stream_connection->takion,
+			&session->latency_stats, session->connect_info.feedback_immediate, session->connect_info.feedback_state_rate_max);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		chiaki_mutex_unlock(&stream_connection->feedback_sender_mutex);
@@ -292,32 +382,32 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 		goto disconnect;
 	}
 	stream_connection->feedback_sender_active = true;
-	chiaki_feedback_sender_set_controller_state(&stream_connection->feedback_sender, &session->controller_state);
+	chiaki_feedback_sender_set_controller_state(&stream_connection->feedback_sender, &session->controller_state, 0);
 	chiaki_mutex_unlock(&stream_connection->feedback_sender_mutex);
 
 	stream_connection->state = STATE_IDLE;
 	stream_connection->state_finished = false;
 	stream_connection->state_failed = false;
 
+	stream_connection->connected = true;
+	chiaki_atomic_store_release(&stream_connection->last_recv_ms, (size_t)chiaki_time_now_monotonic_ms());
+
 	ChiakiEvent event = { 0 };
 	event.type = CHIAKI_EVENT_CONNECTED;
+	event.connected.resumed = resumed;
 	chiaki_mutex_unlock(&stream_connection->state_mutex);
 	chiaki_session_send_event(session, &event);
 	err = chiaki_mutex_lock(&stream_connection->state_mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
 
-	while(true)
-	{
-		err = chiaki_cond_timedwait_pred(&stream_connection->state_cond, &stream_connection->state_mutex, HEARTBEAT_INTERVAL_MS, state_finished_cond_check, stream_connection);
-		if(err != CHIAKI_ERR_TIMEOUT)
-			break;
-
-		err = stream_connection_send_heartbeat(stream_connection);
-		if(err != CHIAKI_ERR_SUCCESS)
-			CHIAKI_LOGE(stream_connection->log, "StreamConnection failed to send heartbeat");
-		else
-			CHIAKI_LOGV(stream_connection->log, "StreamConnection sent heartbeat");
-	}
+	chiaki_timer_wheel_schedule(&session->timer_wheel, &stream_connection->heartbeat_task, HEARTBEAT_INTERVAL_MS * 1000);
+	err = chiaki_cond_wait_pred(&stream_connection->state_cond, &stream_connection->state_mutex, state_finished_cond_check, stream_connection);
+	assert(err == CHIAKI_ERR_SUCCESS);
+	// the heartbeat checks link_lost under state_mutex, so cancelling must not hold it
+	chiaki_mutex_unlock(&stream_connection->state_mutex);
+	chiaki_timer_wheel_cancel(&session->timer_wheel, &stream_connection->heartbeat_task);
+	err = chiaki_mutex_lock(&stream_connection->state_mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
 
 	err = chiaki_mutex_lock(&stream_connection->feedback_sender_mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
@@ -341,6 +431,11 @@ disconnect:
 		CHIAKI_LOGI(stream_connection->log, "StreamConnection closing after Remote disconnected");
 		err = CHIAKI_ERR_DISCONNECTED;
 	}
+	else if(stream_connection->link_lost)
+	{
+		CHIAKI_LOGW(stream_connection->log, "StreamConnection closing after the link was lost");
+		err = CHIAKI_ERR_TIMEOUT;
+	}
 
 err_congestion_control:
 	chiaki_congestion_control_stop(&stream_connection->congestion_control);
@@ -363,6 +458,9 @@ err_audio_receiver:
 	chiaki_audio_receiver_free(stream_connection->audio_receiver);
 	stream_connection->audio_receiver = NULL;
 
+err_audio_decode_queue:
+	chiaki_audio_decode_queue_stop(&session->audio_decode_queue);
+
 	return err;
 }
 
@@ -391,6 +489,19 @@ static void stream_connection_takion_cb(ChiakiTakionEvent *event, void *user)
 				stream_connection->state_failed = event->type == CHIAKI_TAKION_EVENT_TYPE_DISCONNECT;
 				chiaki_cond_signal(&stream_connection->state_cond);
 			}
+			else if(event->type == CHIAKI_TAKION_EVENT_TYPE_DISCONNECT && stream_connection->session->connect_info.replay)
+			{
+				// nothing will ever arrive anymore at the end of a capture
+				stream_connection->should_stop = true;
+				chiaki_cond_signal(&stream_connection->state_cond);
+			}
+			else if(event->type == CHIAKI_TAKION_EVENT_TYPE_DISCONNECT && stream_connection->state == STATE_IDLE
+				&& stream_connection->session->connect_info.resume)
+			{
+				CHIAKI_LOGW(stream_connection->log, "StreamConnection Takion disconnected, link lost");
+				stream_connection->link_lost = true;
+				chiaki_cond_signal(&stream_connection->state_cond);
+			}
 			chiaki_mutex_unlock(&stream_connection->state_mutex);
 			break;
 		case CHIAKI_TAKION_EVENT_TYPE_DATA:
@@ -522,8 +633,9 @@ static void stream_connection_takion_data_idle(ChiakiStreamConnection *stream_co
 		return;
 	}
 
-	CHIAKI_LOGV(stream_connection->log, "StreamConnection received data with msg.type == %d", msg.type);
-	chiaki_log_hexdump(stream_connection->log, CHIAKI_LOG_VERBOSE, buf, buf_size);
+	CHIAKI_LOGT(stream_connection->log, "StreamConnection received data with msg.type == %d", msg.type);
+	if(CHIAKI_LOG_ENABLED(CHIAKI_LOG_TRACE))
+		chiaki_log_hexdump(stream_connection->log, CHIAKI_LOG_TRACE, buf, buf_size);
 
 	switch (msg.type)
 	{
@@ -541,9 +653,12 @@ static void stream_connection_takion_data_idle(ChiakiStreamConnection *stream_co
 			 q.target_bitrate, q.upstream_bitrate,
 			 q.upstream_loss,
 			 q.disable_upstream_audio, q.rtt, q.loss);
-		stream_connection->measured_bitrate = chiaki_stream_stats_bitrate(&stream_connection->video_receiver->frame_processor.stream_stats, stream_connection->session->connect_info.video_profile.max_fps) / 1000000.0;
+		stream_connection->measured_bitrate = chiaki_stream_stats_bitrate(&stream_connection->video_receiver->stream_stats, stream_connection->session->connect_info.video_profile.max_fps) / 1000000.0;
 		CHIAKI_LOGV(stream_connection->log, "StreamConnection measured bitrate: %.4f MBit/s", stream_connection->measured_bitrate);
-		chiaki_stream_stats_reset(&stream_connection->video_receiver->frame_processor.stream_stats);
+		chiaki_video_stats_set_bitrate(&stream_connection->session->video_stats, (uint64_t)(stream_connection->measured_bitrate * 1000000.0));
+		stream_connection->resend_timeout_us = chiaki_takion_send_buffer_get_rto_us(&stream_connection->takion.send_buffer);
+		CHIAKI_LOGV(stream_connection->log, "StreamConnection resend timeout: %llu us", (unsigned long long)stream_connection->resend_timeout_us);
+		chiaki_stream_stats_reset(&stream_connection->video_receiver->stream_stats);
 		break;
 	}
 	case tkproto_TakionMessage_PayloadType_CORRUPTFRAME:
@@ -562,13 +677,13 @@ static ChiakiErrorCode stream_connection_init_crypt(ChiakiStreamConnection *stre
 {
 	ChiakiSession *session = stream_connection->session;
 
-	stream_connection->gkcrypt_local = chiaki_gkcrypt_new(stream_connection->log, CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT, 2, session->handshake_key, stream_connection->ecdh_secret);
+	stream_connection->gkcrypt_local = chiaki_gkcrypt_new(stream_connection->log, session->connect_info.latency_profile.key_buf_chunks, 2, session->handshake_key, stream_connection->ecdh_secret);
 	if(!stream_connection->gkcrypt_local)
 	{
 		CHIAKI_LOGE(stream_connection->log, "StreamConnection failed to initialize local GKCrypt with index 2");
 		return CHIAKI_ERR_UNKNOWN;
 	}
-	stream_connection->gkcrypt_remote = chiaki_gkcrypt_new(stream_connection->log, CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT, 3, session->handshake_key, stream_connection->ecdh_secret);
+	stream_connection->gkcrypt_remote = chiaki_gkcrypt_new(stream_connection->log, session->connect_info.latency_profile.key_buf_chunks, 3, session->handshake_key, stream_connection->ecdh_secret);
 	if(!stream_connection->gkcrypt_remote)
 	{
 		CHIAKI_LOGE(stream_connection->log, "StreamConnection failed to initialize remote GKCrypt with index 3");
@@ -579,6 +694,9 @@ static ChiakiErrorCode stream_connection_init_crypt(ChiakiStreamConnection *stre
 
 	chiaki_takion_set_crypt(&stream_connection->takion, stream_connection->gkcrypt_local, stream_connection->gkcrypt_remote);
 
+	if(session->connect_info.capture)
+		chiaki_capture_keys(session->connect_info.capture, session->handshake_key, stream_connection->ecdh_secret);
+
 	return CHIAKI_ERR_SUCCESS;
 }
 
@@ -663,11 +781,20 @@ static void stream_connection_takion_data_expect_bang(ChiakiStreamConnection *st
 		goto error;
 	}
 
-	ChiakiErrorCode err = chiaki_ecdh_derive_secret(&stream_connection->session->ecdh,
-			stream_connection->ecdh_secret,
-			ecdh_pub_key_buf.buf, ecdh_pub_key_buf.size,
-			stream_connection->session->handshake_key,
-			ecdh_sig_buf.buf, ecdh_sig_buf.size);
+	ChiakiErrorCode err;
+	ChiakiCaptureReader *replay = stream_connection->session->connect_info.replay;
+	if(replay)
+	{
+		// the remote key was made for the recorded session's local key, which is not in the capture
+		memcpy(stream_connection->ecdh_secret, replay->ecdh_secret, CHIAKI_ECDH_SECRET_SIZE);
+		err = CHIAKI_ERR_SUCCESS;
+	}
+	else
+		err = chiaki_ecdh_derive_secret(&stream_connection->session->ecdh,
+				stream_connection->ecdh_secret,
+				ecdh_pub_key_buf.buf, ecdh_pub_key_buf.size,
+				stream_connection->session->handshake_key,
+				ecdh_sig_buf.buf, ecdh_sig_buf.size);
 
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
@@ -793,6 +920,9 @@ static void stream_connection_takion_data_expect_streaminfo(ChiakiStreamConnecti
 	ChiakiAudioHeader audio_header_s;
 	chiaki_audio_header_load(&audio_header_s, audio_header);
 	chiaki_audio_receiver_stream_info(stream_connection->audio_receiver, &audio_header_s);
+	if(audio_header_s.rate)
+		chiaki_jitter_estimator_set_interval(&stream_connection->jitter_estimator, CHIAKI_JITTER_STREAM_AUDIO,
+				(uint64_t)audio_header_s.frame_size * 1000000 / audio_header_s.rate);
 
 	chiaki_video_receiver_stream_info(stream_connection->video_receiver,
 			decode_resolutions_context.video_profiles,
@@ -1080,50 +1210,132 @@ static void stream_connection_takion_av(ChiakiStreamConnection *stream_connectio
 {
 	chiaki_gkcrypt_decrypt(stream_connection->gkcrypt_remote, packet->key_pos + CHIAKI_GKCRYPT_BLOCK_SIZE, packet->data, packet->data_size);
 
+	chiaki_atomic_store_release(&stream_connection->last_recv_ms,
+			(size_t)(packet->recv_us ? packet->recv_us / 1000 : chiaki_time_now_monotonic_ms()));
+
+	if(!packet->is_haptics)
+	{
+		chiaki_packet_stats_push_arrival(&stream_connection->packet_stats, packet->recv_us);
+		chiaki_jitter_estimator_push(&stream_connection->jitter_estimator,
+				packet->is_video ? CHIAKI_JITTER_STREAM_VIDEO : CHIAKI_JITTER_STREAM_AUDIO, packet->frame_index, packet->recv_us);
+	}
+
 	if(packet->is_video)
 		chiaki_video_receiver_av_packet(stream_connection->video_receiver, packet);
 	else if(packet->is_haptics)
 	    chiaki_audio_receiver_av_packet(stream_connection->haptics_receiver, packet);
 	else
 		chiaki_audio_receiver_av_packet(stream_connection->audio_receiver, packet);
+
+	// after the packet, so a late unit that still completes an overdue frame is not thrown away
+	chiaki_video_receiver_check_deadlines(stream_connection->video_receiver, chiaki_time_now_monotonic_us());
+}
+
+static bool encode_template(tkproto_TakionMessage *msg, uint8_t *buf, size_t buf_size, size_t *size)
+{
+	pb_ostream_t stream = pb_ostream_from_buffer(buf, buf_size);
+	if(!pb_encode(&stream, tkproto_TakionMessage_fields, msg))
+		return false;
+	*size = stream.bytes_written;
+	return true;
 }
 
-static ChiakiErrorCode stream_connection_send_heartbeat(ChiakiStreamConnection *stream_connection)
+static ChiakiErrorCode stream_connection_encode_templates(ChiakiStreamConnection *stream_connection)
 {
 	tkproto_TakionMessage msg = { 0 };
 	msg.type = tkproto_TakionMessage_PayloadType_HEARTBEAT;
-
-	uint8_t buf[8];
-
-	pb_ostream_t stream = pb_ostream_from_buffer(buf, sizeof(buf));
-	bool pbr = pb_encode(&stream, tkproto_TakionMessage_fields, &msg);
-	if(!pbr)
+	if(!encode_template(&msg, stream_connection->heartbeat_msg, sizeof(stream_connection->heartbeat_msg), &stream_connection->heartbeat_msg_size))
 	{
 		CHIAKI_LOGE(stream_connection->log, "StreamConnection heartbeat protobuf encoding failed");
 		return CHIAKI_ERR_UNKNOWN;
 	}
 
-	return chiaki_takion_send_message_data(&stream_connection->takion, 1, 1, buf, stream.bytes_written, NULL);
-}
+	msg.type = tkproto_TakionMessage_PayloadType_IDRREQUEST;
+	if(!encode_template(&msg, stream_connection->idr_request_msg, sizeof(stream_connection->idr_request_msg), &stream_connection->idr_request_msg_size))
+	{
+		CHIAKI_LOGE(stream_connection->log, "StreamConnection idr request protobuf encoding failed");
+		return CHIAKI_ERR_UNKNOWN;
+	}
 
-CHIAKI_EXPORT ChiakiErrorCode stream_connection_send_corrupt_frame(ChiakiStreamConnection *stream_connection, ChiakiSeqNum16 start, ChiakiSeqNum16 end)
-{
-	tkproto_TakionMessage msg = { 0 };
+	// corrupt_payload is the last field, encoded as its length followed by start = 0 and end = 0 in 4 bytes
 	msg.type = tkproto_TakionMessage_PayloadType_CORRUPTFRAME;
 	msg.has_corrupt_payload = true;
-	msg.corrupt_payload.start = start;
-	msg.corrupt_payload.end = end;
+	msg.corrupt_payload.start = 0;
+	msg.corrupt_payload.end = 0;
+	size_t size;
+	if(!encode_template(&msg, stream_connection->corrupt_frame_msg_prefix, sizeof(stream_connection->corrupt_frame_msg_prefix), &size)
+			|| size < 5)
+	{
+		CHIAKI_LOGE(stream_connection->log, "StreamConnection corrupt frame protobuf encoding failed");
+		return CHIAKI_ERR_UNKNOWN;
+	}
+	stream_connection->corrupt_frame_msg_prefix_size = size - 5;
+	return CHIAKI_ERR_SUCCESS;
+}
 
-	uint8_t buf[0x10];
+static size_t encode_varint(uint8_t *buf, uint32_t value)
+{
+	size_t size = 0;
+	while(value >= 0x80)
+	{
+		buf[size++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	buf[size++] = (uint8_t)value;
+	return size;
+}
 
-	pb_ostream_t stream = pb_ostream_from_buffer(buf, sizeof(buf));
-	bool pbr = pb_encode(&stream, tkproto_TakionMessage_fields, &msg);
-	if(!pbr)
+static uint64_t stream_connection_heartbeat_task_cb(void *user, uint64_t now_us)
+{
+	ChiakiStreamConnection *stream_connection = user;
+	ChiakiErrorCode err = chiaki_takion_send_message_data(&stream_connection->takion, 1, 1,
+			stream_connection->heartbeat_msg, stream_connection->heartbeat_msg_size, NULL);
+	if(err != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGE(stream_connection->log, "StreamConnection failed to send heartbeat");
+	else
+		CHIAKI_LOGV(stream_connection->log, "StreamConnection sent heartbeat");
+
+	if(stream_connection->session->connect_info.resume)
 	{
-		CHIAKI_LOGE(stream_connection->log, "StreamConnection heartbeat protobuf encoding failed");
-		return CHIAKI_ERR_UNKNOWN;
+		// wraps with size_t, the difference is still right
+		size_t silent_ms = (size_t)(now_us / 1000) - chiaki_atomic_load_acquire(&stream_connection->last_recv_ms);
+		if(silent_ms >= CHIAKI_SESSION_LINK_TIMEOUT_MS && silent_ms < SIZE_MAX / 2)
+		{
+			chiaki_mutex_lock(&stream_connection->state_mutex);
+			if(!stream_connection->link_lost)
+			{
+				CHIAKI_LOGW(stream_connection->log, "StreamConnection received nothing for %u ms, link lost", (unsigned int)silent_ms);
+				stream_connection->link_lost = true;
+				chiaki_cond_signal(&stream_connection->state_cond);
+			}
+			chiaki_mutex_unlock(&stream_connection->state_mutex);
+		}
 	}
+	return HEARTBEAT_INTERVAL_MS * 1000;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode stream_connection_send_corrupt_frame(ChiakiStreamConnection *stream_connection, ChiakiSeqNum16 start, ChiakiSeqNum16 end)
+{
+	// prefix, then CorruptFramePayload as length, tag of start, start, tag of end, end
+	uint8_t buf[sizeof(stream_connection->corrupt_frame_msg_prefix) + 1 + 2 * (1 + 3)];
+	size_t size = stream_connection->corrupt_frame_msg_prefix_size;
+	memcpy(buf, stream_connection->corrupt_frame_msg_prefix, size);
+	uint8_t *payload = buf + size + 1;
+	size_t payload_size = 0;
+	payload[payload_size++] = 0x08;
+	payload_size += encode_varint(payload + payload_size, start);
+	payload[payload_size++] = 0x10;
+	payload_size += encode_varint(payload + payload_size, end);
+	buf[size] = (uint8_t)payload_size;
+	size += 1 + payload_size;
 
 	CHIAKI_LOGD(stream_connection->log, "StreamConnection reporting corrupt frame(s) from %u to %u", (unsigned int)start, (unsigned int)end);
-	return chiaki_takion_send_message_data(&stream_connection->takion, 1, 2, buf, stream.bytes_written, NULL);
+	return chiaki_takion_send_message_data(&stream_connection->takion, 1, 2, buf, size, NULL);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode stream_connection_send_idr_request(ChiakiStreamConnection *stream_connection)
+{
+	CHIAKI_LOGD(stream_connection->log, "StreamConnection requesting IDR frame");
+	return chiaki_takion_send_message_data(&stream_connection->takion, 1, 2,
+			stream_connection->idr_request_msg, stream_connection->idr_request_msg_size, NULL);
 }
@@ -0,0 +1,213 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+/**
+ * Replays a capture recorded with ChiakiConnectInfo.capture through the whole receiving side of a session
+ * (Takion, StreamConnection, video and audio receivers) and reports throughput and per-stage latency.
+ * Video frames are written to a file or discarded, audio is always discarded.
+ */
+
+#include <chiaki/session.h>
+#include <chiaki/capture.h>
+#include <chiaki/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct replay_t
+{
+	ChiakiSession session;
+	FILE *video_file;
+	uint64_t frames;
+	uint64_t frames_lost;
+	uint64_t video_bytes;
+	uint64_t audio_frames;
+	uint64_t first_frame_us;
+	uint64_t last_frame_us;
+	ChiakiQuitReason quit_reason;
+} Replay;
+
+static bool video_cb(uint8_t *buf, size_t buf_size, int32_t frames_lost, bool frame_recovered, void *user)
+{
+	Replay *replay = user;
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	if(!replay->frames)
+		replay->first_frame_us = now_us;
+	replay->last_frame_us = now_us;
+	replay->frames++;
+	replay->frames_lost += frames_lost > 0 ? (uint64_t)frames_lost : 0;
+	replay->video_bytes += buf_size;
+	if(replay->video_file)
+		fwrite(buf, 1, buf_size, replay->video_file);
+	// there is no decoder, so the frame is done as soon as it arrives here
+	chiaki_session_latency_stamp(&replay->session, CHIAKI_LATENCY_STAMP_DECODED);
+	chiaki_session_latency_stamp(&replay->session, CHIAKI_LATENCY_STAMP_DISPLAYED);
+	return true;
+}
+
+static void audio_header_cb(ChiakiAudioHeader *header, void *user)
+{
+}
+
+static void audio_frame_cb(uint8_t *buf, size_t buf_size, void *user)
+{
+	Replay *replay = user;
+	replay->audio_frames++;
+}
+
+static void event_cb(ChiakiEvent *event, void *user)
+{
+	Replay *replay = user;
+	if(event->type == CHIAKI_EVENT_QUIT)
+		replay->quit_reason = event->quit.reason;
+}
+
+static void print_usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [--max-speed] [--video <file.h264>] [--impair <spec>] [--verbose] <capture>\n", name);
+	fprintf(stderr, "  --max-speed  pass packets on as fast as possible once the stream runs, instead of at the recorded times\n");
+	fprintf(stderr, "  --video      write the received video frames to file instead of discarding them\n");
+	fprintf(stderr, "  --impair     simulate network conditions, e.g. loss=0.01,burst=0.02:0.25:0.5,dup=0.001,reorder=0.01:10,delay=30,jitter=10,seed=1\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *capture_filename = NULL;
+	const char *video_filename = NULL;
+	bool max_speed = false;
+	bool verbose = false;
+	ChiakiImpairConfig impair;
+	chiaki_impair_config_default(&impair);
+	bool impair_enabled = false;
+	for(int i=1; i<argc; i++)
+	{
+		if(!strcmp(argv[i], "--max-speed"))
+			max_speed = true;
+		else if(!strcmp(argv[i], "--verbose"))
+			verbose = true;
+		else if(!strcmp(argv[i], "--video") && i + 1 < argc)
+			video_filename = argv[++i];
+		else if(!strcmp(argv[i], "--impair") && i + 1 < argc)
+		{
+			if(chiaki_impair_config_parse(&impair, argv[++i]) != CHIAKI_ERR_SUCCESS)
+			{
+				fprintf(stderr, "Invalid impairment %s\n", argv[i]);
+				return 1;
+			}
+			impair_enabled = true;
+		}
+		else if(argv[i][0] != '-' && !capture_filename)
+			capture_filename = argv[i];
+		else
+		{
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+	if(!capture_filename)
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	ChiakiErrorCode err = chiaki_lib_init();
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to init lib: %s\n", chiaki_error_string(err));
+		return 1;
+	}
+
+	ChiakiLog log;
+	chiaki_log_init(&log, verbose ? CHIAKI_LOG_ALL : CHIAKI_LOG_ALL & ~(CHIAKI_LOG_TRACE | CHIAKI_LOG_VERBOSE | CHIAKI_LOG_DEBUG),
+			chiaki_log_cb_print, NULL);
+
+	ChiakiCaptureReader reader;
+	err = chiaki_capture_reader_init(&reader, capture_filename);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to read capture %s: %s\n", capture_filename, chiaki_error_string(err));
+		return 1;
+	}
+	reader.max_speed = max_speed;
+
+	Replay replay = { 0 };
+	replay.quit_reason = CHIAKI_QUIT_REASON_NONE;
+	if(video_filename)
+	{
+		replay.video_file = fopen(video_filename, "wb");
+		if(!replay.video_file)
+		{
+			fprintf(stderr, "Failed to open %s\n", video_filename);
+			chiaki_capture_reader_fini(&reader);
+			return 1;
+		}
+	}
+
+	ChiakiConnectInfo connect_info = { 0 };
+	connect_info.ps5 = reader.version == 12;
+	connect_info.host = "127.0.0.1"; // never connected to
+	chiaki_connect_video_profile_preset(&connect_info.video_profile, CHIAKI_VIDEO_RESOLUTION_PRESET_720p, CHIAKI_VIDEO_FPS_PRESET_60);
+	connect_info.replay = &reader;
+	connect_info.impair = impair_enabled ? &impair : NULL;
+
+	int ret = 1;
+	err = chiaki_session_init(&replay.session, &connect_info, &log);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to init session: %s\n", chiaki_error_string(err));
+		goto error_reader;
+	}
+
+	ChiakiAudioSink audio_sink = { 0 };
+	audio_sink.user = &replay;
+	audio_sink.header_cb = audio_header_cb;
+	audio_sink.frame_cb = audio_frame_cb;
+	chiaki_session_set_audio_sink(&replay.session, &audio_sink);
+	chiaki_session_set_video_sample_cb(&replay.session, video_cb, &replay);
+	chiaki_session_set_event_cb(&replay.session, event_cb, &replay);
+
+	uint64_t start_us = chiaki_time_now_monotonic_us();
+	err = chiaki_session_start(&replay.session);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to start session: %s\n", chiaki_error_string(err));
+		goto error_session;
+	}
+	chiaki_session_join(&replay.session);
+	uint64_t duration_us = chiaki_time_now_monotonic_us() - start_us;
+
+	uint64_t packets_received, packets_lost;
+	chiaki_session_get_packet_stats(&replay.session, &packets_received, &packets_lost);
+	uint64_t stream_us = replay.last_frame_us - replay.first_frame_us;
+
+	printf("Replay finished after %.3f s: %s\n", (double)duration_us / 1000000.0, chiaki_quit_reason_string(replay.quit_reason));
+	printf("Packets: %llu received, %llu lost\n", (unsigned long long)packets_received, (unsigned long long)packets_lost);
+	printf("Video: %llu frames, %llu lost, %.2f MB\n", (unsigned long long)replay.frames, (unsigned long long)replay.frames_lost,
+			(double)replay.video_bytes / (1024.0 * 1024.0));
+	if(stream_us)
+		printf("Throughput: %.1f frames/s, %.2f Mbit/s\n", (double)(replay.frames - 1) * 1000000.0 / (double)stream_us,
+				(double)replay.video_bytes * 8.0 / (double)stream_us);
+	printf("Audio: %llu frames\n", (unsigned long long)replay.audio_frames);
+
+	ChiakiLatencyReport report;
+	chiaki_session_get_latency_stats(&replay.session, &report);
+	for(size_t i=0; i<CHIAKI_LATENCY_STAGE_COUNT; i++)
+	{
+		ChiakiLatencyStageStats *stage = &report.stages[i];
+		if(!stage->count)
+			continue;
+		printf("Latency %-8s avg %6llu us, p95 %6llu us, p99 %6llu us, max %6llu us\n",
+				chiaki_latency_stage_string((ChiakiLatencyStage)i),
+				(unsigned long long)stage->avg_us, (unsigned long long)stage->p95_us,
+				(unsigned long long)stage->p99_us, (unsigned long long)stage->max_us);
+	}
+	ret = chiaki_quit_reason_is_error(replay.quit_reason) ? 1 : 0;
+
+error_session:
+	chiaki_session_fini(&replay.session);
+error_reader:
+	if(replay.video_file)
+		fclose(replay.video_file);
+	chiaki_capture_reader_fini(&reader);
+	return ret;
+}
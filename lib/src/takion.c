@@ -6,6 +6,8 @@
 #include <chiaki/random.h>
 #include <chiaki/gkcrypt.h>
 #include <chiaki/time.h>
+#include <chiaki/atomic.h>
+#include <chiaki/trace.h>
 
 #include <fcntl.h>
 #include <stdbool.h>
@@ -43,11 +45,23 @@
 #define TAKION_OUTBOUND_STREAMS 0x64
 #define TAKION_INBOUND_STREAMS 0x64
 
-#define TAKION_REORDER_QUEUE_SIZE_EXP 4 // => 16 entries
+#define TAKION_REORDER_QUEUE_SIZE_EXP 4 // => 16 entries, unless ChiakiTakionConnectInfo.data_queue_size_exp says otherwise
 #define TAKION_SEND_BUFFER_SIZE 16
+#define TAKION_SEND_BUFFER_ARENA_BUF_SIZE 0x200 // data packets up to this size are stored without a heap allocation
 
 #define TAKION_POSTPONE_PACKETS_SIZE 32
 
+// when crypt becomes available, this many postponed packets and queued data MACs are handled per received packet
+#define TAKION_CRYPT_BACKLOG_PER_ITERATION 4
+
+// AV packets that are already waiting are handled in batches of up to this many for mac_offload
+#define TAKION_MAC_BATCH_SIZE 16
+// smaller batches are not worth waking up mac_thread for
+#define TAKION_MAC_OFFLOAD_MIN 4
+
+// enough for a full reorder queue, all postponed packets, a MAC batch and some in flight
+#define TAKION_PACKET_POOL_SIZE 80
+
 #define TAKION_MESSAGE_HEADER_SIZE 0x10
 
 #define TAKION_PACKET_BASE_TYPE_MASK 0xf
@@ -158,17 +172,39 @@ typedef struct
 	uint8_t *payload; // inside packet_buf
 	size_t payload_size;
 	uint16_t channel;
+	bool mac_pending; // received before gkcrypt_remote was available, so the MAC has not been checked yet
 } TakionDataPacketEntry;
 
+// lives in the reserve of its packet buffer, so queueing a data packet never allocates
+typedef char TakionDataPacketEntryFitsReserve[sizeof(TakionDataPacketEntry) <= CHIAKI_PACKET_POOL_BUF_RESERVE ? 1 : -1];
+
 typedef struct chiaki_takion_postponed_packet_t
 {
 	uint8_t *buf;
 	size_t buf_size;
+	bool mac_pending;
 } ChiakiTakionPostponedPacket;
 
+typedef struct
+{
+	uint8_t *buf;
+	size_t buf_size;
+} TakionRecvRingEntry;
+
+typedef struct takion_mac_job_t
+{
+	uint8_t *buf;
+	size_t buf_size;
+	uint64_t key_pos;
+	uint8_t mac[CHIAKI_GKCRYPT_GMAC_SIZE]; // as received, buf contains the calculated one after the check
+	bool valid;
+} TakionMacJob;
+
 static void *takion_thread_func(void *user);
 static void takion_handle_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size);
 static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size);
+static void takion_flush_postponed_packets(ChiakiTakion *takion, size_t max_count);
+static bool takion_data_queue_recheck_macs(ChiakiTakion *takion, size_t max_count);
 static void takion_handle_packet_message(ChiakiTakion *takion, uint8_t *buf, size_t buf_size);
 static void takion_handle_packet_message_data(ChiakiTakion *takion, uint8_t *packet_buf, size_t packet_buf_size, uint8_t type_b, uint8_t *payload, size_t payload_size);
 static void takion_handle_packet_message_data_ack(ChiakiTakion *takion, uint8_t flags, uint8_t *buf, size_t buf_size);
@@ -177,10 +213,24 @@ static void takion_write_message_header(uint8_t *buf, uint32_t tag, uint64_t key
 static ChiakiErrorCode takion_send_message_init(ChiakiTakion *takion, TakionMessagePayloadInit *payload);
 static ChiakiErrorCode takion_send_message_cookie(ChiakiTakion *takion, uint8_t *cookie);
 static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms);
+static ChiakiErrorCode takion_recv_nonblock(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size);
+static ChiakiErrorCode takion_recv_next(ChiakiTakion *takion, uint8_t **buf, size_t *buf_size, uint64_t *batch_size);
+static ChiakiErrorCode takion_replay_next(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size);
+static bool takion_recv_poll(ChiakiTakion *takion, bool pipelined, uint8_t **buf, size_t *buf_size, uint64_t *batch_size);
+static ChiakiErrorCode takion_recv_thread_start(ChiakiTakion *takion);
+static void takion_recv_thread_stop(ChiakiTakion *takion);
+static bool takion_recv_ring_pop(ChiakiTakion *takion, TakionRecvRingEntry *entry);
+static void takion_recv_stats_push_batch(ChiakiTakionRecvStats *stats, uint64_t batch_size);
+static ChiakiErrorCode takion_mac_thread_start(ChiakiTakion *takion);
+static void takion_mac_thread_stop(ChiakiTakion *takion);
+static void takion_handle_packet_batch(ChiakiTakion *takion, bool pipelined, uint8_t *buf, size_t buf_size, uint64_t *batch_size);
 static ChiakiErrorCode takion_recv_message_init_ack(ChiakiTakion *takion, TakionMessagePayloadInitAck *payload);
 static ChiakiErrorCode takion_recv_message_cookie_ack(ChiakiTakion *takion);
 static void takion_handle_packet_av(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size);
 static ChiakiErrorCode takion_read_extra_sock_messages(ChiakiTakion *takion);
+static void takion_ack_data(ChiakiTakion *takion, ChiakiSeqNum32 seq_num);
+static uint64_t takion_ack_task_cb(void *user, uint64_t now_us);
+static void takion_ack_stop(ChiakiTakion *takion);
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, ChiakiTakionConnectInfo *info, chiaki_socket_t *sock)
 {
@@ -193,13 +243,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 	switch(takion->version)
 	{
 		case 7:
-			takion->av_packet_parse = chiaki_takion_v7_av_packet_parse;
-			break;
 		case 9:
-			takion->av_packet_parse = chiaki_takion_v9_av_packet_parse;
-			break;
 		case 12:
-			takion->av_packet_parse = chiaki_takion_v12_av_packet_parse;
 			break;
 		default:
 			CHIAKI_LOGE(takion->log, "Unknown Takion Protocol Version %u", (unsigned int)takion->version);
@@ -225,23 +270,109 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 	CHIAKI_LOGI(takion->log, "Mutex2 created");
 	takion->tag_remote = 0;
 
+	ret = chiaki_mutex_init(&takion->ack_mutex, false);
+	if(ret != CHIAKI_ERR_SUCCESS)
+		goto error_seq_num_local_mutex;
+	chiaki_timer_task_init(&takion->ack_task, "takion ack", takion_ack_task_cb, takion);
+	takion->upstream_packets = 0;
+	takion->ack_delay_us = info->timer_wheel ? info->ack_delay_us : 0;
+	takion->upstream_packets_budget = info->upstream_packets_budget;
+	takion->ack_pending = false;
+	takion->ack_held = false;
+	takion->budget_window_start_us = 0;
+	takion->budget_window_packets = 0;
+	takion->budget_window_exceeded = false;
+	memset(&takion->upstream_stats, 0, sizeof(takion->upstream_stats));
+
 	takion->enable_crypt = info->enable_crypt;
 	takion->postponed_packets = NULL;
-	takion->postponed_packets_size = 0;
+	takion->postponed_packets_begin = 0;
 	takion->postponed_packets_count = 0;
+	takion->postponed_packets_dropped = 0;
 	takion->enable_dualsense = info->enable_dualsense;
+	chiaki_atomic_store_release(&takion->av_substreams, info->av_substreams);
+	takion->recv_batch = info->recv_batch;
+	takion->initial_rtt_us = info->initial_rtt_us;
+	takion->timer_wheel = info->timer_wheel;
+	takion->arena = info->arena;
+	takion->recv_ring_size_exp = info->recv_ring_size_exp;
+	takion->data_queue_size_exp = info->data_queue_size_exp ? info->data_queue_size_exp : TAKION_REORDER_QUEUE_SIZE_EXP;
+	takion->mac_offload = info->mac_offload && info->enable_crypt;
+	memset(&takion->recv_stats, 0, sizeof(takion->recv_stats));
+	takion->capture = info->capture;
+	takion->replay = info->replay;
+	takion->replay_av_started = false;
+	if(takion->replay)
+	{
+		// the recorded datagrams were addressed to the recorded tag
+		takion->tag_local = takion->replay->tag_local;
+		takion->seq_num_local = takion->tag_local;
+		takion->recv_batch = false;
+		takion->recv_ring_size_exp = 0;
+	}
 
 	CHIAKI_LOGI(takion->log, "Takion connecting (version %u)", (unsigned int)info->protocol_version);
 	bool mac_dontfrag = true;
+	ChiakiSocketOptions sock_options = info->sock_options;
+	if(!sock_options.rcvbuf)
+		sock_options.rcvbuf = takion->a_rwnd;
+
+	size_t packet_pool_size = TAKION_PACKET_POOL_SIZE;
+	if(takion->recv_ring_size_exp)
+		packet_pool_size += ((size_t)1) << takion->recv_ring_size_exp;
+	if(info->impair)
+		packet_pool_size += CHIAKI_IMPAIR_QUEUE_SIZE;
+	ChiakiErrorCode err = chiaki_packet_pool_init(&takion->packet_pool, packet_pool_size);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(takion->log, "Takion failed to create packet pool");
+		ret = err;
+		goto error_ack_mutex;
+	}
+
+	takion->impair = false;
+	takion->impair_send_active = false;
+	if(info->impair)
+	{
+		err = chiaki_impair_init(&takion->impair_recv, info->impair, true);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGE(takion->log, "Takion failed to create impairment");
+			ret = err;
+			goto error_packet_pool;
+		}
+		// a different seed, so sent datagrams are not lost in lockstep with received ones
+		ChiakiImpairConfig send_config = *info->impair;
+		send_config.seed = ~send_config.seed;
+		chiaki_impair_init(&takion->impair_send, &send_config, false);
+		err = chiaki_mutex_init(&takion->impair_send_mutex, false);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			chiaki_impair_fini(&takion->impair_recv);
+			ret = err;
+			goto error_packet_pool;
+		}
+		takion->impair = true;
+		CHIAKI_LOGW(takion->log, "Takion impairing datagrams: loss %.4f, burst %.4f:%.4f:%.4f, dup %.4f, reorder %.4f:%ums, delay %ums, jitter %ums%s",
+				info->impair->loss, info->impair->good_to_bad, info->impair->bad_to_good, info->impair->burst_loss,
+				info->impair->duplicate, info->impair->reorder, (unsigned int)info->impair->reorder_ms,
+				(unsigned int)info->impair->delay_ms, (unsigned int)info->impair->jitter_ms,
+				info->impair->send ? ", also sending" : "");
+	}
 
-	ChiakiErrorCode err = chiaki_stop_pipe_init(&takion->stop_pipe);
+	err = chiaki_stop_pipe_init(&takion->stop_pipe);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(takion->log, "Takion failed to create stop pipe");
-		goto error_seq_num_local_mutex;
+		goto error_impair;
 	}
 
-	if(sock)
+	if(takion->replay)
+	{
+		CHIAKI_LOGI(takion->log, "Takion replaying capture instead of using a socket");
+		takion->sock = CHIAKI_INVALID_SOCKET;
+	}
+	else if(sock)
 	{
 		takion->sock = *sock;
 		err = takion_read_extra_sock_messages(takion);
@@ -250,14 +381,12 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 			CHIAKI_LOGE(takion->log, "Takion had problem reading extra messages from socket using PSN Connection with error: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
 			goto error_sock;
 		}
-		const int rcvbuf_val = takion->a_rwnd;
-		int r = setsockopt(takion->sock, SOL_SOCKET, SO_RCVBUF, (const CHIAKI_SOCKET_BUF_TYPE)&rcvbuf_val, sizeof(rcvbuf_val));
-		if(r < 0)
+		if(chiaki_socket_set_options(takion->sock, &sock_options, "Takion", takion->log) != CHIAKI_ERR_SUCCESS)
 		{
-			CHIAKI_LOGE(takion->log, "Takion failed to setsockopt SO_RCVBUF: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
 			ret = CHIAKI_ERR_NETWORK;
 			goto error_sock;
 		}
+		int r = 0;
 
 #if defined(__APPLE__)
 		SInt32 majorVersion;
@@ -343,14 +472,12 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 			ret = CHIAKI_ERR_NETWORK;
 			goto error_pipe;
 		}
-		const int rcvbuf_val = takion->a_rwnd;
-		int r = setsockopt(takion->sock, SOL_SOCKET, SO_RCVBUF, (const CHIAKI_SOCKET_BUF_TYPE)&rcvbuf_val, sizeof(rcvbuf_val));
-		if(r < 0)
+		if(chiaki_socket_set_options(takion->sock, &sock_options, "Takion", takion->log) != CHIAKI_ERR_SUCCESS)
 		{
-			CHIAKI_LOGE(takion->log, "Takion failed to setsockopt SO_RCVBUF: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
 			ret = CHIAKI_ERR_NETWORK;
 			goto error_sock;
 		}
+		int r = 0;
 		if(info->ip_dontfrag)
 		{
 #if defined(__APPLE__)
@@ -406,17 +533,44 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 		}
 	}
 
-	err = chiaki_thread_create(&takion->thread, takion_thread_func, takion);
+	err = chiaki_stop_pipe_waiter_init(&takion->sock_waiter, &takion->stop_pipe);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(takion->log, "Takion failed to create socket waiter");
+		ret = err;
+		goto error_sock;
+	}
+	if(!takion->replay)
+		err = chiaki_stop_pipe_waiter_add(&takion->sock_waiter, takion->sock, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(takion->log, "Takion failed to register socket with waiter");
+		ret = err;
+		goto error_sock_waiter;
+	}
 
-	chiaki_thread_set_name(&takion->thread, "Chiaki Takion");
+	err = chiaki_thread_create_role(&takion->thread, takion_thread_func, takion, CHIAKI_THREAD_ROLE_TAKION);
 
 	return CHIAKI_ERR_SUCCESS;
 
+error_sock_waiter:
+	chiaki_stop_pipe_waiter_fini(&takion->sock_waiter);
 error_sock:
 	CHIAKI_SOCKET_CLOSE(takion->sock);
 	takion->sock = CHIAKI_INVALID_SOCKET;
 error_pipe:
 	chiaki_stop_pipe_fini(&takion->stop_pipe);
+error_impair:
+	if(takion->impair)
+	{
+		chiaki_mutex_fini(&takion->impair_send_mutex);
+		chiaki_impair_fini(&takion->impair_recv);
+		takion->impair = false;
+	}
+error_packet_pool:
+	chiaki_packet_pool_fini(&takion->packet_pool);
+error_ack_mutex:
+	chiaki_mutex_fini(&takion->ack_mutex);
 error_seq_num_local_mutex:
 	chiaki_mutex_fini(&takion->seq_num_local_mutex);
 error_gkcrypt_local_mutex:
@@ -428,7 +582,17 @@ CHIAKI_EXPORT void chiaki_takion_close(ChiakiTakion *takion)
 {
 	chiaki_stop_pipe_stop(&takion->stop_pipe);
 	chiaki_thread_join(&takion->thread, NULL);
+	chiaki_stop_pipe_waiter_fini(&takion->sock_waiter);
 	chiaki_stop_pipe_fini(&takion->stop_pipe);
+	CHIAKI_LOGV(takion->log, "Takion packet pool used at most %llu buffers, %llu fallback allocations",
+			(unsigned long long)takion->packet_pool.in_use_max, (unsigned long long)takion->packet_pool.fallback_allocs);
+	chiaki_packet_pool_fini(&takion->packet_pool);
+	if(takion->impair)
+	{
+		chiaki_mutex_fini(&takion->impair_send_mutex);
+		chiaki_impair_fini(&takion->impair_recv);
+	}
+	chiaki_mutex_fini(&takion->ack_mutex);
 	chiaki_mutex_fini(&takion->seq_num_local_mutex);
 	chiaki_mutex_fini(&takion->gkcrypt_local_mutex);
 }
@@ -461,11 +625,25 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_crypt_advance_key_pos(ChiakiTakion *
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_raw(ChiakiTakion *takion, const uint8_t *buf, size_t buf_size)
 {
+	if(takion->replay)
+		return CHIAKI_ERR_SUCCESS;
+	unsigned int copies = 1;
+	if(takion->impair && takion->impair_send.config.send && takion->impair_send_active)
+	{
+		chiaki_mutex_lock(&takion->impair_send_mutex);
+		copies = chiaki_impair_roll(&takion->impair_send);
+		chiaki_mutex_unlock(&takion->impair_send_mutex);
+	}
+	int r = 0;
+	for(unsigned int i=0; i<copies && r >= 0; i++)
+	{
 	// #ifdef __PSVITA__
-	// 	int r = sceNetSend(takion->sock, buf, buf_size, 0);
+	// 	r = sceNetSend(takion->sock, buf, buf_size, 0);
 	// #else
-		int r = send(takion->sock, buf, buf_size, 0);
+		r = send(takion->sock, buf, buf_size, 0);
 	// #endif
+	}
+	chiaki_atomic_fetch_add(&takion->upstream_packets, copies);
 	if(r < 0)
 	{
 		CHIAKI_LOGE(takion->log, "Takion failed to send raw: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
@@ -474,7 +652,10 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_raw(ChiakiTakion *takion, const
 	return CHIAKI_ERR_SUCCESS;
 }
 
-static ChiakiErrorCode chiaki_takion_packet_read_key_pos(ChiakiTakion *takion, uint8_t *buf, size_t buf_size, uint64_t *key_pos_out)
+/**
+ * @param commit whether to advance key_state to the key pos, which is otherwise only done for a valid MAC
+ */
+static ChiakiErrorCode chiaki_takion_packet_read_key_pos(ChiakiKeyState *key_state, bool commit, uint8_t *buf, size_t buf_size, uint64_t *key_pos_out)
 {
 	if(buf_size < 1)
 		return CHIAKI_ERR_BUF_TOO_SMALL;
@@ -488,12 +669,15 @@ static ChiakiErrorCode chiaki_takion_packet_read_key_pos(ChiakiTakion *takion, u
 		return CHIAKI_ERR_BUF_TOO_SMALL;
 
 	uint32_t key_pos_low = ntohl(*((chiaki_unaligned_uint32_t *)(buf + key_pos_offset)));
-	*key_pos_out = chiaki_key_state_request_pos(&takion->key_state, key_pos_low, false);
+	*key_pos_out = chiaki_key_state_request_pos(key_state, key_pos_low, commit);
 
 	return CHIAKI_ERR_SUCCESS;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_packet_mac(ChiakiGKCrypt *crypt, uint8_t *buf, size_t buf_size, uint64_t key_pos, uint8_t *mac_out, uint8_t *mac_old_out)
+/**
+ * @param cache GMAC cache to use instead of the one of crypt, so this may run on another thread, or NULL
+ */
+static ChiakiErrorCode takion_packet_mac(ChiakiGKCrypt *crypt, ChiakiGKCryptGMacCache *cache, uint8_t *buf, size_t buf_size, uint64_t key_pos, uint8_t *mac_out, uint8_t *mac_old_out)
 {
 	if(buf_size < 1)
 		return CHIAKI_ERR_BUF_TOO_SMALL;
@@ -520,7 +704,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_packet_mac(ChiakiGKCrypt *crypt, uin
 			memcpy(key_pos_tmp, buf + key_pos_offset, sizeof(uint32_t));
 			memset(buf + key_pos_offset, 0, sizeof(uint32_t));
 		}
-		chiaki_gkcrypt_gmac(crypt, key_pos, buf, buf_size, buf + mac_offset);
+		chiaki_gkcrypt_gmac_cached(crypt, cache ? cache : &crypt->gmac_cache, key_pos, buf, buf_size, buf + mac_offset);
 		if(base_type == TAKION_PACKET_TYPE_CONTROL || base_type == TAKION_PACKET_TYPE_CONGESTION)
 			memcpy(buf + key_pos_offset, key_pos_tmp, sizeof(uint32_t));
 	}
@@ -531,6 +715,11 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_packet_mac(ChiakiGKCrypt *crypt, uin
 	return CHIAKI_ERR_SUCCESS;
 }
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_packet_mac(ChiakiGKCrypt *crypt, uint8_t *buf, size_t buf_size, uint64_t key_pos, uint8_t *mac_out, uint8_t *mac_old_out)
+{
+	return takion_packet_mac(crypt, NULL, buf, buf_size, key_pos, mac_out, mac_old_out);
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send(ChiakiTakion *takion, uint8_t *buf, size_t buf_size, uint64_t key_pos)
 {
 	ChiakiErrorCode err = chiaki_mutex_lock(&takion->gkcrypt_local_mutex);
@@ -559,7 +748,9 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_message_data(ChiakiTakion *taki
 		return err;
 
 	size_t packet_size = 1 + TAKION_MESSAGE_HEADER_SIZE + 9 + buf_size;
-	uint8_t *packet_buf = malloc(packet_size);
+	// small packets are built on the stack and copied into the send buffer arena
+	uint8_t packet_buf_stack[TAKION_SEND_BUFFER_ARENA_BUF_SIZE];
+	uint8_t *packet_buf = packet_size <= sizeof(packet_buf_stack) ? packet_buf_stack : chiaki_arena_alloc(takion->arena, CHIAKI_ARENA_TAG_TAKION, packet_size);
 	if(!packet_buf)
 		return CHIAKI_ERR_MEMORY;
 	packet_buf[0] = TAKION_PACKET_TYPE_CONTROL;
@@ -570,7 +761,11 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_message_data(ChiakiTakion *taki
 
 	err = chiaki_mutex_lock(&takion->seq_num_local_mutex);
 	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		if(packet_buf != packet_buf_stack)
+			chiaki_arena_free(takion->arena, packet_buf);
 		return err;
+	}
 	ChiakiSeqNum32 seq_num_val = takion->seq_num_local++;
 	chiaki_mutex_unlock(&takion->seq_num_local_mutex);
 
@@ -584,11 +779,15 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_message_data(ChiakiTakion *taki
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(takion->log, "Takion failed to send data packet: %s", chiaki_error_string(err));
-		free(packet_buf);
+		if(packet_buf != packet_buf_stack)
+			chiaki_arena_free(takion->arena, packet_buf);
 		return err;
 	}
 
-	chiaki_takion_send_buffer_push(&takion->send_buffer, seq_num_val, packet_buf, packet_size);
+	if(packet_buf == packet_buf_stack)
+		chiaki_takion_send_buffer_push_copy(&takion->send_buffer, seq_num_val, packet_buf, packet_size);
+	else
+		chiaki_takion_send_buffer_push(&takion->send_buffer, seq_num_val, packet_buf, packet_size);
 
 	if(seq_num)
 		*seq_num = seq_num_val;
@@ -607,7 +806,9 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_message_data_cont(ChiakiTakion
 		return err;
 
 	size_t packet_size = 1 + TAKION_MESSAGE_HEADER_SIZE + 8 + buf_size;
-	uint8_t *packet_buf = malloc(packet_size);
+	// small packets are built on the stack and copied into the send buffer arena
+	uint8_t packet_buf_stack[TAKION_SEND_BUFFER_ARENA_BUF_SIZE];
+	uint8_t *packet_buf = packet_size <= sizeof(packet_buf_stack) ? packet_buf_stack : chiaki_arena_alloc(takion->arena, CHIAKI_ARENA_TAG_TAKION, packet_size);
 	if(!packet_buf)
 		return CHIAKI_ERR_MEMORY;
 	packet_buf[0] = TAKION_PACKET_TYPE_CONTROL;
@@ -618,7 +819,11 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_message_data_cont(ChiakiTakion
 
 	err = chiaki_mutex_lock(&takion->seq_num_local_mutex);
 	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		if(packet_buf != packet_buf_stack)
+			chiaki_arena_free(takion->arena, packet_buf);
 		return err;
+	}
 	ChiakiSeqNum32 seq_num_val = takion->seq_num_local++;
 	chiaki_mutex_unlock(&takion->seq_num_local_mutex);
 
@@ -631,11 +836,15 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_message_data_cont(ChiakiTakion
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(takion->log, "Takion failed to send data packet: %s", chiaki_error_string(err));
-		free(packet_buf);
+		if(packet_buf != packet_buf_stack)
+			chiaki_arena_free(takion->arena, packet_buf);
 		return err;
 	}
 
-	chiaki_takion_send_buffer_push(&takion->send_buffer, seq_num_val, packet_buf, packet_size);
+	if(packet_buf == packet_buf_stack)
+		chiaki_takion_send_buffer_push_copy(&takion->send_buffer, seq_num_val, packet_buf, packet_size);
+	else
+		chiaki_takion_send_buffer_push(&takion->send_buffer, seq_num_val, packet_buf, packet_size);
 
 	if(seq_num)
 		*seq_num = seq_num_val;
@@ -874,8 +1083,7 @@ static void takion_data_drop(uint64_t seq_num, void *elem_user, void *cb_user)
 	ChiakiTakion *takion = cb_user;
 	CHIAKI_LOGE(takion->log, "Takion dropping data with seq num %#llx", (unsigned long long)seq_num);
 	TakionDataPacketEntry *entry = elem_user;
-	free(entry->packet_buf);
-	free(entry);
+	chiaki_packet_pool_free(&takion->packet_pool, entry->packet_buf);
 }
 
 static void *takion_thread_func(void *user)
@@ -883,18 +1091,32 @@ static void *takion_thread_func(void *user)
 	ChiakiTakion *takion = user;
 
 	uint32_t seq_num_remote_initial;
-	if(takion_handshake(takion, &seq_num_remote_initial) != CHIAKI_ERR_SUCCESS)
+	if(takion->replay)
+	{
+		// the recorded handshake cannot be repeated because nothing answers INIT and COOKIE
+		takion->tag_remote = takion->replay->tag_remote;
+		seq_num_remote_initial = takion->tag_remote;
+		takion->replay_start_us = chiaki_time_now_monotonic_us();
+	}
+	else if(takion_handshake(takion, &seq_num_remote_initial) != CHIAKI_ERR_SUCCESS)
 		goto beach;
 
-	if(chiaki_reorder_queue_init_32(&takion->data_queue, TAKION_REORDER_QUEUE_SIZE_EXP, seq_num_remote_initial) != CHIAKI_ERR_SUCCESS)
+	if(takion->capture)
+		chiaki_capture_takion(takion->capture, takion->version, takion->tag_local, takion->tag_remote);
+	takion->impair_send_active = true;
+
+	if(chiaki_reorder_queue32_init(&takion->data_queue, takion->data_queue_size_exp, seq_num_remote_initial) != CHIAKI_ERR_SUCCESS)
 		goto beach;
 
-	chiaki_reorder_queue_set_drop_cb(&takion->data_queue, takion_data_drop, takion);
+	chiaki_reorder_queue32_set_drop_cb(&takion->data_queue, takion_data_drop, takion);
 
 	// The send buffer size MUST be consistent with the acked seqnums array size in takion_handle_packet_message_data_ack()
-	if(chiaki_takion_send_buffer_init(&takion->send_buffer, takion, TAKION_SEND_BUFFER_SIZE) != CHIAKI_ERR_SUCCESS)
+	if(chiaki_takion_send_buffer_init(&takion->send_buffer, takion->timer_wheel, takion, TAKION_SEND_BUFFER_SIZE, TAKION_SEND_BUFFER_ARENA_BUF_SIZE) != CHIAKI_ERR_SUCCESS)
 		goto error_reoder_queue;
 
+	if(takion->initial_rtt_us)
+		chiaki_takion_send_buffer_seed_rtt(&takion->send_buffer, takion->initial_rtt_us);
+
 
 	if(takion->cb)
 	{
@@ -903,74 +1125,127 @@ static void *takion_thread_func(void *user)
 		takion->cb(&event, takion->cb_user);
 	}
 
+	bool recv_pipelined = false;
+	if(takion->recv_ring_size_exp)
+	{
+		if(takion_recv_thread_start(takion) == CHIAKI_ERR_SUCCESS)
+			recv_pipelined = true;
+		else
+			CHIAKI_LOGE(takion->log, "Takion failed to start receive thread, reading the socket directly");
+	}
+
+	bool mac_offloaded = false;
+	if(takion->mac_offload)
+	{
+		if(takion_mac_thread_start(takion) == CHIAKI_ERR_SUCCESS)
+			mac_offloaded = true;
+		else
+			CHIAKI_LOGE(takion->log, "Takion failed to start MAC thread, checking all MACs on the Takion thread");
+	}
+
 	bool crypt_available = takion->gkcrypt_remote ? true : false;
+	uint64_t batch_size = 0; // packets received since the last wakeup, if not pipelined
+
+	bool mac_recheck = false; // whether there may still be entries with mac_pending in data_queue
 
 	while(true)
 	{
 		if(takion->enable_crypt && !crypt_available && takion->gkcrypt_remote)
 		{
 			crypt_available = true;
-			CHIAKI_LOGI(takion->log, "Crypt has become available. Re-checking MACs of %llu packets", (unsigned long long)chiaki_reorder_queue_count(&takion->data_queue));
-			for(uint64_t i=0; i<chiaki_reorder_queue_count(&takion->data_queue); i++)
-			{
-				TakionDataPacketEntry *packet;
-				bool peeked = chiaki_reorder_queue_peek(&takion->data_queue, i, NULL, (void **)&packet);
-				if(!peeked)
-					continue;
-				if(packet->packet_size == 0)
-					continue;
-				uint8_t base_type = (uint8_t)(packet->packet_buf[0] & TAKION_PACKET_BASE_TYPE_MASK);
-				if(takion_handle_packet_mac(takion, base_type, packet->packet_buf, packet->packet_size) != CHIAKI_ERR_SUCCESS)
-				{
-					CHIAKI_LOGW(takion->log, "Found an invalid MAC");
-					chiaki_reorder_queue_drop(&takion->data_queue, i);
-				}
-			}
-
+			mac_recheck = true;
+			CHIAKI_LOGI(takion->log, "Crypt has become available. Re-checking MACs of %llu queued packets and flushing %llu postponed packet(s)",
+					(unsigned long long)chiaki_reorder_queue32_count(&takion->data_queue),
+					(unsigned long long)takion->postponed_packets_count);
 		}
 
-		if(takion->postponed_packets && takion->gkcrypt_remote)
+		uint8_t *buf;
+		size_t received_size;
+		if(crypt_available && (mac_recheck || takion->postponed_packets_count))
 		{
-			// there are some postponed packets that were waiting until crypt is initialized and it is now :-)
-
-			CHIAKI_LOGI(takion->log, "Takion flushing %llu postpone packet(s)", (unsigned long long)takion->postponed_packets_count);
-
-			for(size_t i=0; i<takion->postponed_packets_count; i++)
+			// work through the backlog in small slices so fresh packets are not held up,
+			// or all at once if nothing new has arrived anyway
+			size_t budget = SIZE_MAX;
+			if(takion_recv_poll(takion, recv_pipelined, &buf, &received_size, &batch_size))
 			{
-				ChiakiTakionPostponedPacket *packet = &takion->postponed_packets[i];
-				takion_handle_packet(takion, packet->buf, packet->buf_size);
+				takion_handle_packet(takion, buf, received_size);
+				budget = TAKION_CRYPT_BACKLOG_PER_ITERATION;
 			}
-			free(takion->postponed_packets);
-			takion->postponed_packets = NULL;
-			takion->postponed_packets_size = 0;
-			takion->postponed_packets_count = 0;
+			if(mac_recheck)
+				mac_recheck = takion_data_queue_recheck_macs(takion, budget);
+			takion_flush_postponed_packets(takion, budget);
+			continue;
 		}
 
-		size_t received_size = 1500;
-		uint8_t *buf = malloc(received_size); // TODO: no malloc?
-		if(!buf)
-			break;
-		ChiakiErrorCode err = takion_recv(takion, buf, &received_size, UINT64_MAX);
-		if(err != CHIAKI_ERR_SUCCESS)
-		{
-			free(buf);
-			break;
-		}
-		uint8_t *resized_buf = realloc(buf, received_size);
-		if(!resized_buf)
+		if(recv_pipelined)
 		{
-			free(buf);
-			continue;
+			TakionRecvRingEntry entry;
+			if(!takion_recv_ring_pop(takion, &entry))
+				break;
+			buf = entry.buf;
+			received_size = entry.buf_size;
 		}
-		takion_handle_packet(takion, resized_buf, received_size);
-	}
+		else if(takion_recv_next(takion, &buf, &received_size, &batch_size) != CHIAKI_ERR_SUCCESS)
+			break;
+		if(mac_offloaded && takion->gkcrypt_remote)
+			takion_handle_packet_batch(takion, recv_pipelined, buf, received_size, &batch_size);
+		else
+			takion_handle_packet(takion, buf, received_size);
+	}
+
+	if(mac_offloaded)
+		takion_mac_thread_stop(takion);
+	if(recv_pipelined)
+		takion_recv_thread_stop(takion);
+	else if(batch_size)
+		takion_recv_stats_push_batch(&takion->recv_stats, batch_size);
+	if(takion->impair)
+	{
+		uint8_t *impaired_buf;
+		size_t impaired_size;
+		while(chiaki_impair_pop(&takion->impair_recv, UINT64_MAX, &impaired_buf, &impaired_size))
+			chiaki_packet_pool_free(&takion->packet_pool, impaired_buf);
+		ChiakiImpair *impair = &takion->impair_recv;
+		CHIAKI_LOGI(takion->log, "Takion impaired %llu received datagrams: %llu lost, %llu duplicated, %llu reordered, %llu not delayed because the queue was full",
+				(unsigned long long)impair->datagrams, (unsigned long long)impair->lost, (unsigned long long)impair->duplicated,
+				(unsigned long long)impair->reordered, (unsigned long long)impair->overflowed);
+		impair = &takion->impair_send;
+		if(impair->config.send)
+			CHIAKI_LOGI(takion->log, "Takion impaired %llu sent datagrams: %llu lost, %llu duplicated",
+					(unsigned long long)impair->datagrams, (unsigned long long)impair->lost, (unsigned long long)impair->duplicated);
+	}
+	if(takion->recv_stats.wakeups)
+	{
+		CHIAKI_LOGI(takion->log, "Takion received %llu packets in %llu wakeups (avg batch %.2f, max %llu)",
+				(unsigned long long)takion->recv_stats.packets, (unsigned long long)takion->recv_stats.wakeups,
+				(double)takion->recv_stats.packets / (double)takion->recv_stats.wakeups,
+				(unsigned long long)takion->recv_stats.batch_max);
+	}
+	ChiakiSocketRecvStats sock_stats;
+	if(!CHIAKI_SOCKET_IS_INVALID(takion->sock) && chiaki_socket_get_recv_stats(takion->sock, &sock_stats) == CHIAKI_ERR_SUCCESS)
+	{
+		if(sock_stats.drops)
+			CHIAKI_LOGW(takion->log, "Takion socket receive buffer overflowed, the system dropped %llu datagrams",
+					(unsigned long long)sock_stats.drops);
+	}
+
+	// packets that were never flushed because crypt did not become available
+	for(size_t i=0; i<takion->postponed_packets_count; i++)
+		chiaki_packet_pool_free(&takion->packet_pool, takion->postponed_packets[(takion->postponed_packets_begin + i) % TAKION_POSTPONE_PACKETS_SIZE].buf);
+	if(takion->postponed_packets_dropped)
+		CHIAKI_LOGW(takion->log, "Takion dropped %llu postponed packet(s) while waiting for crypt", (unsigned long long)takion->postponed_packets_dropped);
+	free(takion->postponed_packets);
+	takion->postponed_packets = NULL;
+	takion->postponed_packets_begin = 0;
+	takion->postponed_packets_count = 0;
 
 	// chiaki_congestion_control_stop(&congestion_control);
 
+	takion_ack_stop(takion);
 	chiaki_takion_send_buffer_fini(&takion->send_buffer);
 
 error_reoder_queue:
-	chiaki_reorder_queue_fini(&takion->data_queue);
+	chiaki_reorder_queue32_fini(&takion->data_queue);
 
 beach:
 	if(takion->cb)
@@ -987,9 +1262,284 @@ beach:
 	return NULL;
 }
 
+/**
+ * Receive the next datagram from the socket or replay into a buffer from the packet pool.
+ *
+ * If recv_batch is enabled and datagrams were already received since the last wakeup,
+ * this first tries to get another one without waiting.
+ *
+ * @param buf pointer to write the buffer to, ownership of which is passed to the caller
+ * @param batch_size number of datagrams received since the last wakeup, updated by this function
+ * @param timeout_ms how long to wait for the socket, not applied to replays
+ */
+static ChiakiErrorCode takion_recv_next_socket(ChiakiTakion *takion, uint8_t **buf, size_t *buf_size, uint64_t *batch_size, uint64_t timeout_ms)
+{
+	uint8_t *packet_buf = chiaki_packet_pool_alloc(&takion->packet_pool);
+	if(!packet_buf)
+		return CHIAKI_ERR_MEMORY;
+	size_t received_size = takion->packet_pool.buf_size;
+	ChiakiErrorCode err = CHIAKI_ERR_TIMEOUT;
+	if(takion->replay)
+		err = takion_replay_next(takion, packet_buf, &received_size);
+	else if(takion->recv_batch && *batch_size)
+		err = takion_recv_nonblock(takion, packet_buf, &received_size);
+	if(err == CHIAKI_ERR_TIMEOUT)
+	{
+		// nothing (more) queued, wait for the next wakeup
+		if(*batch_size)
+			takion_recv_stats_push_batch(&takion->recv_stats, *batch_size);
+		*batch_size = 0;
+		received_size = takion->packet_pool.buf_size;
+		err = takion_recv(takion, packet_buf, &received_size, timeout_ms);
+	}
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		chiaki_packet_pool_free(&takion->packet_pool, packet_buf);
+		return err;
+	}
+	if(takion->capture)
+		chiaki_capture_datagram(takion->capture, packet_buf, received_size);
+	(*batch_size)++;
+	*buf = packet_buf;
+	*buf_size = received_size;
+	CHIAKI_TRACE(TAKION_RECV, PACKET_RECV, received_size);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+/**
+ * Pass a received datagram through the impairment, which takes ownership of buf unless it has to be handled right away.
+ *
+ * @return whether buf must be handled right away because the impairment queue is full
+ */
+static bool takion_impair_add(ChiakiTakion *takion, uint8_t *buf, size_t buf_size)
+{
+	ChiakiImpair *impair = &takion->impair_recv;
+	unsigned int copies = chiaki_impair_roll(impair);
+	if(!copies)
+	{
+		chiaki_packet_pool_free(&takion->packet_pool, buf);
+		return false;
+	}
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	if(copies > 1)
+	{
+		uint8_t *dup = chiaki_packet_pool_alloc(&takion->packet_pool);
+		if(dup)
+		{
+			memcpy(dup, buf, buf_size);
+			if(!chiaki_impair_push(impair, now_us, dup, buf_size))
+				chiaki_packet_pool_free(&takion->packet_pool, dup);
+		}
+	}
+	return !chiaki_impair_push(impair, now_us, buf, buf_size);
+}
+
+/**
+ * Like takion_recv_next_socket(), but if impair is enabled, waits for the next datagram that is due
+ * and receives everything arriving in the meantime into the impairment.
+ */
+static ChiakiErrorCode takion_recv_next(ChiakiTakion *takion, uint8_t **buf, size_t *buf_size, uint64_t *batch_size)
+{
+	if(!takion->impair)
+		return takion_recv_next_socket(takion, buf, buf_size, batch_size, UINT64_MAX);
+	while(true)
+	{
+		uint64_t now_us = chiaki_time_now_monotonic_us();
+		if(chiaki_impair_pop(&takion->impair_recv, now_us, buf, buf_size))
+			return CHIAKI_ERR_SUCCESS;
+		uint64_t due_us = chiaki_impair_next_due_us(&takion->impair_recv);
+		uint64_t timeout_ms = due_us == UINT64_MAX ? UINT64_MAX : (due_us - now_us + 999) / 1000;
+		uint8_t *packet_buf;
+		size_t packet_size;
+		ChiakiErrorCode err = takion_recv_next_socket(takion, &packet_buf, &packet_size, batch_size, timeout_ms);
+		if(err == CHIAKI_ERR_TIMEOUT)
+			continue;
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+		if(takion_impair_add(takion, packet_buf, packet_size))
+		{
+			*buf = packet_buf;
+			*buf_size = packet_size;
+			return CHIAKI_ERR_SUCCESS;
+		}
+	}
+}
+
+/**
+ * Get the next datagram from the socket only if one is available right now.
+ */
+static bool takion_recv_poll_socket(ChiakiTakion *takion, uint8_t **buf, size_t *buf_size, uint64_t *batch_size)
+{
+	if(takion->replay)
+		return false;
+
+	uint8_t *packet_buf = chiaki_packet_pool_alloc(&takion->packet_pool);
+	if(!packet_buf)
+		return false;
+	size_t received_size = takion->packet_pool.buf_size;
+	if(takion_recv_nonblock(takion, packet_buf, &received_size) != CHIAKI_ERR_SUCCESS)
+	{
+		chiaki_packet_pool_free(&takion->packet_pool, packet_buf);
+		return false;
+	}
+	if(takion->capture)
+		chiaki_capture_datagram(takion->capture, packet_buf, received_size);
+	(*batch_size)++;
+	*buf = packet_buf;
+	*buf_size = received_size;
+	return true;
+}
+
+/**
+ * Get the next datagram only if one is available right now, from the receive ring if pipelined or the socket otherwise.
+ *
+ * @return whether a datagram was received, ownership of buf is passed to the caller in that case
+ */
+static bool takion_recv_poll(ChiakiTakion *takion, bool pipelined, uint8_t **buf, size_t *buf_size, uint64_t *batch_size)
+{
+	if(pipelined)
+	{
+		TakionRecvRingEntry entry;
+		if(!chiaki_spsc_ring_pop(&takion->recv_ring, &entry))
+			return false;
+		*buf = entry.buf;
+		*buf_size = entry.buf_size;
+		return true;
+	}
+	if(!takion->impair)
+		return takion_recv_poll_socket(takion, buf, buf_size, batch_size);
+	while(takion_recv_poll_socket(takion, buf, buf_size, batch_size))
+	{
+		if(takion_impair_add(takion, *buf, *buf_size))
+			return true;
+	}
+	return chiaki_impair_pop(&takion->impair_recv, chiaki_time_now_monotonic_us(), buf, buf_size);
+}
+
+static void takion_recv_ring_push(ChiakiTakion *takion, uint8_t *buf, size_t buf_size)
+{
+	TakionRecvRingEntry entry = { buf, buf_size };
+	if(!chiaki_spsc_ring_push(&takion->recv_ring, &entry))
+	{
+		takion->recv_ring_drops++;
+		chiaki_packet_pool_free(&takion->packet_pool, buf);
+		return;
+	}
+
+	// pairs with the fence in takion_recv_ring_pop(), so either we see the consumer waiting or it sees our entry
+	chiaki_atomic_fence_seq_cst();
+	if(chiaki_atomic_load_seq_cst(&takion->recv_ring_waiting))
+	{
+		chiaki_mutex_lock(&takion->recv_ring_mutex);
+		chiaki_cond_signal(&takion->recv_ring_cond);
+		chiaki_mutex_unlock(&takion->recv_ring_mutex);
+	}
+}
+
+/**
+ * Pop the next datagram from the receive ring, waiting until one is available.
+ *
+ * @return false if the receive thread has finished and there is nothing left
+ */
+static bool takion_recv_ring_pop(ChiakiTakion *takion, TakionRecvRingEntry *entry)
+{
+	if(chiaki_spsc_ring_pop(&takion->recv_ring, entry))
+		return true;
+
+	chiaki_mutex_lock(&takion->recv_ring_mutex);
+	chiaki_atomic_store_seq_cst(&takion->recv_ring_waiting, 1);
+	chiaki_atomic_fence_seq_cst();
+	bool popped;
+	while(!(popped = chiaki_spsc_ring_pop(&takion->recv_ring, entry)) && !takion->recv_ring_done)
+		chiaki_cond_wait(&takion->recv_ring_cond, &takion->recv_ring_mutex);
+	chiaki_atomic_store_seq_cst(&takion->recv_ring_waiting, 0);
+	chiaki_mutex_unlock(&takion->recv_ring_mutex);
+	return popped;
+}
+
+static void *takion_recv_thread_func(void *user)
+{
+	ChiakiTakion *takion = user;
+	uint64_t batch_size = 0;
+
+	while(true)
+	{
+		uint8_t *buf;
+		size_t buf_size;
+		if(takion_recv_next(takion, &buf, &buf_size, &batch_size) != CHIAKI_ERR_SUCCESS)
+			break;
+		takion_recv_ring_push(takion, buf, buf_size);
+	}
+
+	if(batch_size)
+		takion_recv_stats_push_batch(&takion->recv_stats, batch_size);
+
+	chiaki_mutex_lock(&takion->recv_ring_mutex);
+	takion->recv_ring_done = true;
+	chiaki_cond_signal(&takion->recv_ring_cond);
+	chiaki_mutex_unlock(&takion->recv_ring_mutex);
+	return NULL;
+}
+
+static ChiakiErrorCode takion_recv_thread_start(ChiakiTakion *takion)
+{
+	takion->recv_ring_waiting = 0;
+	takion->recv_ring_done = false;
+	takion->recv_ring_drops = 0;
+
+	ChiakiErrorCode err = chiaki_spsc_ring_init(&takion->recv_ring, takion->recv_ring_size_exp, sizeof(TakionRecvRingEntry));
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	err = chiaki_mutex_init(&takion->recv_ring_mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_ring;
+
+	err = chiaki_cond_init(&takion->recv_ring_cond, &takion->recv_ring_mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	err = chiaki_thread_create_role(&takion->recv_thread, takion_recv_thread_func, takion, CHIAKI_THREAD_ROLE_TAKION_RECV);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_cond;
+
+	CHIAKI_LOGI(takion->log, "Takion reading socket on a separate thread with a ring of %llu entries",
+			(unsigned long long)chiaki_spsc_ring_size(&takion->recv_ring));
+	return CHIAKI_ERR_SUCCESS;
+
+error_cond:
+	chiaki_cond_fini(&takion->recv_ring_cond);
+error_mutex:
+	chiaki_mutex_fini(&takion->recv_ring_mutex);
+error_ring:
+	chiaki_spsc_ring_fini(&takion->recv_ring);
+	return err;
+}
+
+/**
+ * Wait for the receive thread to finish, which happens when the socket fails or the stop pipe is triggered,
+ * and release everything that is still queued.
+ */
+static void takion_recv_thread_stop(ChiakiTakion *takion)
+{
+	chiaki_thread_join(&takion->recv_thread, NULL);
+
+	TakionRecvRingEntry entry;
+	while(chiaki_spsc_ring_pop(&takion->recv_ring, &entry))
+		chiaki_packet_pool_free(&takion->packet_pool, entry.buf);
+
+	CHIAKI_LOGI(takion->log, "Takion receive ring reached a high-water mark of %llu/%llu entries, dropped %llu packets",
+			(unsigned long long)takion->recv_ring.high_water, (unsigned long long)chiaki_spsc_ring_size(&takion->recv_ring),
+			(unsigned long long)takion->recv_ring_drops);
+
+	chiaki_cond_fini(&takion->recv_ring_cond);
+	chiaki_mutex_fini(&takion->recv_ring_mutex);
+	chiaki_spsc_ring_fini(&takion->recv_ring);
+}
+
 static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms)
 {
-	ChiakiErrorCode err = chiaki_stop_pipe_select_single(&takion->stop_pipe, takion->sock, false, timeout_ms);
+	ChiakiErrorCode err = chiaki_stop_pipe_waiter_wait(&takion->sock_waiter, timeout_ms, NULL);
 	if(err == CHIAKI_ERR_TIMEOUT || err == CHIAKI_ERR_CANCELED)
 		return err;
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -1015,6 +1565,94 @@ static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *b
 	return CHIAKI_ERR_SUCCESS;
 }
 
+/**
+ * Receive a datagram only if one is already queued on the socket.
+ *
+ * @return CHIAKI_ERR_TIMEOUT if nothing is available right now
+ */
+static ChiakiErrorCode takion_recv_nonblock(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size)
+{
+#ifdef _WIN32
+	u_long pending = 0;
+	if(ioctlsocket(takion->sock, FIONREAD, &pending) != 0 || !pending)
+		return CHIAKI_ERR_TIMEOUT;
+	int received_sz = recv(takion->sock, buf, *buf_size, 0);
+#else
+	int received_sz = recv(takion->sock, buf, *buf_size, MSG_DONTWAIT);
+	if(received_sz < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return CHIAKI_ERR_TIMEOUT;
+#endif
+	if(received_sz <= 0)
+	{
+		if(received_sz < 0)
+			CHIAKI_LOGE(takion->log, "Takion recv failed: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+		else
+			CHIAKI_LOGE(takion->log, "Takion recv returned 0");
+		return CHIAKI_ERR_NETWORK;
+	}
+	*buf_size = (size_t)received_sz;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+/**
+ * Read the next datagram from the replayed capture, waiting until the time it was recorded at if needed.
+ *
+ * Until the first av packet, recorded times are always kept so control messages do not overtake
+ * the stream connection, which only accepts them in the state it was in when they were recorded.
+ */
+static ChiakiErrorCode takion_replay_next(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size)
+{
+	uint64_t time_us;
+	ChiakiErrorCode err = chiaki_capture_reader_next(takion->replay, buf, buf_size, &time_us);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		if(err == CHIAKI_ERR_DISCONNECTED)
+			CHIAKI_LOGI(takion->log, "Takion reached the end of the replayed capture");
+		else
+			CHIAKI_LOGE(takion->log, "Takion failed to read the replayed capture");
+		return err;
+	}
+
+	if(!takion->replay->max_speed || !takion->replay_av_started)
+	{
+		uint64_t now_us = chiaki_time_now_monotonic_us() - takion->replay_start_us;
+		if(time_us > now_us)
+		{
+			err = chiaki_stop_pipe_waiter_wait(&takion->sock_waiter, (time_us - now_us + 999) / 1000, NULL);
+			if(err != CHIAKI_ERR_TIMEOUT)
+				return err == CHIAKI_ERR_SUCCESS ? CHIAKI_ERR_CANCELED : err;
+		}
+	}
+
+	uint8_t base_type = *buf_size ? buf[0] & TAKION_PACKET_BASE_TYPE_MASK : 0;
+	if(base_type == TAKION_PACKET_TYPE_VIDEO || base_type == TAKION_PACKET_TYPE_AUDIO)
+		takion->replay_av_started = true;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static void takion_recv_stats_push_batch(ChiakiTakionRecvStats *stats, uint64_t batch_size)
+{
+	stats->wakeups++;
+	stats->packets += batch_size;
+	if(batch_size > stats->batch_max)
+		stats->batch_max = batch_size;
+	size_t bucket = 0;
+	while(bucket < CHIAKI_TAKION_RECV_BATCH_HISTOGRAM_SIZE - 1 && (batch_size >> (bucket + 1)))
+		bucket++;
+	stats->batch_histogram[bucket]++;
+}
+
+CHIAKI_EXPORT void chiaki_takion_get_recv_stats(ChiakiTakion *takion, ChiakiTakionRecvStats *stats)
+{
+	*stats = takion->recv_stats;
+	if(takion->recv_ring_size_exp)
+	{
+		stats->ring_size = ((size_t)1) << takion->recv_ring_size_exp;
+		stats->ring_high_water = takion->recv_ring.high_water;
+		stats->ring_drops = takion->recv_ring_drops;
+	}
+}
+
 static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size)
 {
 	if(!takion->gkcrypt_remote)
@@ -1023,7 +1661,7 @@ static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t ba
 	uint8_t mac[CHIAKI_GKCRYPT_GMAC_SIZE];
 	uint8_t mac_expected[CHIAKI_GKCRYPT_GMAC_SIZE];
 	uint64_t key_pos;
-	ChiakiErrorCode err = chiaki_takion_packet_read_key_pos(takion, buf, buf_size, &key_pos);
+	ChiakiErrorCode err = chiaki_takion_packet_read_key_pos(&takion->key_state, false, buf, buf_size, &key_pos);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(takion->log, "Takion failed to pull key_pos out of received packet");
@@ -1052,40 +1690,323 @@ static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t ba
 	return CHIAKI_ERR_SUCCESS;
 }
 
-static void takion_postpone_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size)
+/**
+ * @param mac_pending whether the MAC of buf still has to be checked once it is flushed
+ */
+static void takion_postpone_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size, bool mac_pending)
 {
 	if(!takion->postponed_packets)
 	{
 		takion->postponed_packets = calloc(TAKION_POSTPONE_PACKETS_SIZE, sizeof(ChiakiTakionPostponedPacket));
 		if(!takion->postponed_packets)
+		{
+			chiaki_packet_pool_free(&takion->packet_pool, buf);
 			return;
-		takion->postponed_packets_size = TAKION_POSTPONE_PACKETS_SIZE;
+		}
+		takion->postponed_packets_begin = 0;
 		takion->postponed_packets_count = 0;
 	}
 
-	if(takion->postponed_packets_count >= takion->postponed_packets_size)
+	if(takion->postponed_packets_count >= TAKION_POSTPONE_PACKETS_SIZE)
 	{
-		CHIAKI_LOGE(takion->log, "Should postpone a packet, but there is no space left");
-		return;
+		// newer packets are more useful for getting the stream going, so make room by dropping the oldest
+		if(!takion->postponed_packets_dropped)
+			CHIAKI_LOGW(takion->log, "Takion postponed packets are full, dropping the oldest ones");
+		ChiakiTakionPostponedPacket *oldest = &takion->postponed_packets[takion->postponed_packets_begin];
+		chiaki_packet_pool_free(&takion->packet_pool, oldest->buf);
+		takion->postponed_packets_begin = (takion->postponed_packets_begin + 1) % TAKION_POSTPONE_PACKETS_SIZE;
+		takion->postponed_packets_count--;
+		takion->postponed_packets_dropped++;
 	}
 
-	CHIAKI_LOGI(takion->log, "Postpone packet of size %#llx", (unsigned long long)buf_size);
-	ChiakiTakionPostponedPacket *packet = &takion->postponed_packets[takion->postponed_packets_count++];
+	CHIAKI_LOGV(takion->log, "Postpone packet of size %#llx", (unsigned long long)buf_size);
+	ChiakiTakionPostponedPacket *packet = &takion->postponed_packets[(takion->postponed_packets_begin + takion->postponed_packets_count++) % TAKION_POSTPONE_PACKETS_SIZE];
 	packet->buf = buf;
 	packet->buf_size = buf_size;
+	packet->mac_pending = mac_pending;
+}
+
+/**
+ * Handle up to max_count of the oldest postponed packets. Must only be called when gkcrypt_remote is available.
+ */
+static void takion_flush_postponed_packets(ChiakiTakion *takion, size_t max_count)
+{
+	for(size_t i=0; i<max_count && takion->postponed_packets_count; i++)
+	{
+		ChiakiTakionPostponedPacket packet = takion->postponed_packets[takion->postponed_packets_begin];
+		takion->postponed_packets_begin = (takion->postponed_packets_begin + 1) % TAKION_POSTPONE_PACKETS_SIZE;
+		takion->postponed_packets_count--;
+
+		uint8_t base_type = (uint8_t)(packet.buf[0] & TAKION_PACKET_BASE_TYPE_MASK);
+		if(!packet.mac_pending || takion_handle_packet_mac(takion, base_type, packet.buf, packet.buf_size) == CHIAKI_ERR_SUCCESS)
+			takion_handle_packet_av(takion, base_type, packet.buf, packet.buf_size);
+		chiaki_packet_pool_free(&takion->packet_pool, packet.buf);
+	}
+}
+
+/**
+ * Check the MACs of a data queue entry received before gkcrypt_remote was available.
+ * Must only be called when gkcrypt_remote is available.
+ *
+ * @return whether the MAC is valid
+ */
+static bool takion_data_entry_check_mac(ChiakiTakion *takion, TakionDataPacketEntry *entry)
+{
+	entry->mac_pending = false;
+	if(entry->packet_size == 0)
+		return true;
+	uint8_t base_type = (uint8_t)(entry->packet_buf[0] & TAKION_PACKET_BASE_TYPE_MASK);
+	if(takion_handle_packet_mac(takion, base_type, entry->packet_buf, entry->packet_size) != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGW(takion->log, "Found an invalid MAC");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Check the MACs of up to max_count data queue entries that have not been checked yet, dropping invalid ones.
+ * Entries pulled from the queue before this gets to them are checked in takion_flush_data_queue() instead.
+ *
+ * @return whether there are still unchecked entries left
+ */
+static bool takion_data_queue_recheck_macs(ChiakiTakion *takion, size_t max_count)
+{
+	size_t checked = 0;
+	for(uint64_t i=0; i<chiaki_reorder_queue32_count(&takion->data_queue); i++)
+	{
+		TakionDataPacketEntry *packet;
+		bool peeked = chiaki_reorder_queue32_peek(&takion->data_queue, i, NULL, (void **)&packet);
+		if(!peeked || !packet->mac_pending)
+			continue;
+		if(checked >= max_count)
+			return true;
+		checked++;
+		if(!takion_data_entry_check_mac(takion, packet))
+			chiaki_reorder_queue32_drop(&takion->data_queue, i);
+	}
+	return false;
+}
+
+/**
+ * Decide from the plain header alone whether an AV packet belongs to a subscribed substream,
+ * so unwanted ones cost neither a MAC check nor parsing and decryption.
+ */
+static bool takion_av_packet_subscribed(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size)
+{
+	size_t substreams = chiaki_atomic_load_acquire(&takion->av_substreams);
+	if(base_type == TAKION_PACKET_TYPE_VIDEO)
+		return (substreams & CHIAKI_TAKION_AV_SUBSTREAM_VIDEO) != 0;
+	if(takion->version != 12)
+		return (substreams & CHIAKI_TAKION_AV_SUBSTREAM_AUDIO) != 0;
+
+	// haptics marker right after the audio header, see av_packet_parse()
+	size_t marker = 1 + 0x11 + 1;
+	if((buf[0] >> 4) & 1)
+		marker += 3;
+	if(marker >= buf_size)
+		return true; // let the parser complain about it
+	return (substreams & (buf[marker] == 0x02 ? CHIAKI_TAKION_AV_SUBSTREAM_HAPTICS : CHIAKI_TAKION_AV_SUBSTREAM_AUDIO)) != 0;
+}
+
+/**
+ * Handle an AV packet whose MAC has been checked if possible.
+ *
+ * @param buf ownership of this buf, which must come from takion->packet_pool, is taken.
+ */
+static void takion_handle_packet_av_checked(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size)
+{
+	if(takion->enable_crypt && !takion->gkcrypt_remote)
+		takion_postpone_packet(takion, buf, buf_size, true);
+	else if(takion->postponed_packets_count)
+		takion_postpone_packet(takion, buf, buf_size, false); // keep the order until all postponed ones are flushed
+	else
+	{
+		takion_handle_packet_av(takion, base_type, buf, buf_size);
+		chiaki_packet_pool_free(&takion->packet_pool, buf);
+	}
+}
+
+/**
+ * @param cache see takion_packet_mac()
+ * @param first whether this is the first check of job, which saves the received MAC
+ */
+static bool takion_mac_job_check(ChiakiTakion *takion, ChiakiGKCryptGMacCache *cache, TakionMacJob *job, bool first)
+{
+	uint8_t mac_expected[CHIAKI_GKCRYPT_GMAC_SIZE];
+	if(takion_packet_mac(takion->gkcrypt_remote, cache, job->buf, job->buf_size, job->key_pos, mac_expected, first ? job->mac : NULL) != CHIAKI_ERR_SUCCESS)
+		return false;
+	return memcmp(mac_expected, job->mac, sizeof(mac_expected)) == 0;
+}
+
+static void *takion_mac_thread_func(void *user)
+{
+	ChiakiTakion *takion = user;
+	chiaki_mutex_lock(&takion->mac_mutex);
+	while(true)
+	{
+		while(!takion->mac_jobs_count && !takion->mac_thread_stop)
+			chiaki_cond_wait(&takion->mac_cond, &takion->mac_mutex);
+		if(takion->mac_thread_stop)
+			break;
+		TakionMacJob *jobs = takion->mac_jobs;
+		size_t count = takion->mac_jobs_count;
+		chiaki_mutex_unlock(&takion->mac_mutex);
+
+		for(size_t i=0; i<count; i++)
+			jobs[i].valid = takion_mac_job_check(takion, &takion->mac_cache, &jobs[i], true);
+
+		chiaki_mutex_lock(&takion->mac_mutex);
+		takion->mac_jobs_count = 0;
+		chiaki_cond_broadcast(&takion->mac_cond);
+	}
+	chiaki_mutex_unlock(&takion->mac_mutex);
+	return NULL;
+}
+
+static ChiakiErrorCode takion_mac_thread_start(ChiakiTakion *takion)
+{
+	takion->mac_jobs = NULL;
+	takion->mac_jobs_count = 0;
+	takion->mac_thread_stop = false;
+	chiaki_gkcrypt_gmac_cache_init(&takion->mac_cache);
+
+	ChiakiErrorCode err = chiaki_mutex_init(&takion->mac_mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	err = chiaki_cond_init(&takion->mac_cond, &takion->mac_mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	err = chiaki_thread_create_role(&takion->mac_thread, takion_mac_thread_func, takion, CHIAKI_THREAD_ROLE_TAKION_MAC);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_cond;
+
+	return CHIAKI_ERR_SUCCESS;
+
+error_cond:
+	chiaki_cond_fini(&takion->mac_cond);
+error_mutex:
+	chiaki_mutex_fini(&takion->mac_mutex);
+	return err;
+}
+
+static void takion_mac_thread_stop(ChiakiTakion *takion)
+{
+	chiaki_mutex_lock(&takion->mac_mutex);
+	takion->mac_thread_stop = true;
+	chiaki_cond_broadcast(&takion->mac_cond);
+	chiaki_mutex_unlock(&takion->mac_mutex);
+	chiaki_thread_join(&takion->mac_thread, NULL);
+
+	chiaki_gkcrypt_gmac_cache_fini(&takion->mac_cache);
+	chiaki_cond_fini(&takion->mac_cond);
+	chiaki_mutex_fini(&takion->mac_mutex);
+}
+
+/**
+ * Handle buf together with all AV packets that are already waiting behind it, up to TAKION_MAC_BATCH_SIZE,
+ * and have mac_thread check the MACs of the second half while the first half is checked here.
+ *
+ * Key positions are derived in order assuming every MAC is valid. Afterwards the packets are handled in order,
+ * committing to takion->key_state exactly like takion_handle_packet() would. A packet only gets checked again here
+ * if a rejected one before it changed its key position.
+ * Needs gkcrypt_remote. Must only be called when there are no postponed packets.
+ *
+ * @param buf ownership of this buf, which must come from takion->packet_pool, is taken.
+ */
+static void takion_handle_packet_batch(ChiakiTakion *takion, bool pipelined, uint8_t *buf, size_t buf_size, uint64_t *batch_size)
+{
+	TakionMacJob jobs[TAKION_MAC_BATCH_SIZE];
+	size_t count = 0;
+	ChiakiKeyState key_state = takion->key_state;
+	while(buf)
+	{
+		if(buf_size < 1)
+			break;
+		uint8_t base_type = (uint8_t)(buf[0] & TAKION_PACKET_BASE_TYPE_MASK);
+		if(base_type != TAKION_PACKET_TYPE_VIDEO && base_type != TAKION_PACKET_TYPE_AUDIO)
+			break;
+		if(takion_av_packet_subscribed(takion, base_type, buf, buf_size))
+		{
+			TakionMacJob *job = &jobs[count];
+			if(chiaki_takion_packet_read_key_pos(&key_state, true, buf, buf_size, &job->key_pos) != CHIAKI_ERR_SUCCESS)
+				break;
+			job->buf = buf;
+			job->buf_size = buf_size;
+			job->valid = false;
+			count++;
+		}
+		else
+			chiaki_packet_pool_free(&takion->packet_pool, buf);
+		buf = NULL;
+		if(count == TAKION_MAC_BATCH_SIZE || !takion_recv_poll(takion, pipelined, &buf, &buf_size, batch_size))
+			break;
+	}
+
+	size_t offloaded = count >= TAKION_MAC_OFFLOAD_MIN ? count / 2 : 0;
+	if(offloaded)
+	{
+		chiaki_mutex_lock(&takion->mac_mutex);
+		takion->mac_jobs = jobs + count - offloaded;
+		takion->mac_jobs_count = offloaded;
+		chiaki_cond_broadcast(&takion->mac_cond);
+		chiaki_mutex_unlock(&takion->mac_mutex);
+	}
+	for(size_t i=0; i<count - offloaded; i++)
+		jobs[i].valid = takion_mac_job_check(takion, NULL, &jobs[i], true);
+	if(offloaded)
+	{
+		chiaki_mutex_lock(&takion->mac_mutex);
+		while(takion->mac_jobs_count)
+			chiaki_cond_wait(&takion->mac_cond, &takion->mac_mutex);
+		chiaki_mutex_unlock(&takion->mac_mutex);
+	}
+
+	for(size_t i=0; i<count; i++)
+	{
+		TakionMacJob *job = &jobs[i];
+		uint8_t base_type = (uint8_t)(job->buf[0] & TAKION_PACKET_BASE_TYPE_MASK);
+		uint64_t key_pos;
+		chiaki_takion_packet_read_key_pos(&takion->key_state, false, job->buf, job->buf_size, &key_pos);
+		if(key_pos != job->key_pos)
+		{
+			job->key_pos = key_pos;
+			job->valid = takion_mac_job_check(takion, NULL, job, false);
+		}
+		if(!job->valid)
+		{
+			CHIAKI_LOGE(takion->log, "Takion packet MAC mismatch for packet type %#x with key_pos %#lx", base_type, key_pos);
+			chiaki_packet_pool_free(&takion->packet_pool, job->buf);
+			continue;
+		}
+		chiaki_key_state_commit(&takion->key_state, key_pos);
+		takion_handle_packet_av_checked(takion, base_type, job->buf, job->buf_size);
+	}
+
+	if(buf)
+		takion_handle_packet(takion, buf, buf_size);
 }
 
 /**
- * @param buf ownership of this buf is taken.
+ * @param buf ownership of this buf, which must come from takion->packet_pool, is taken.
  */
 static void takion_handle_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size)
 {
 	assert(buf_size > 0);
 	uint8_t base_type = (uint8_t)(buf[0] & TAKION_PACKET_BASE_TYPE_MASK);
 
+	if((base_type == TAKION_PACKET_TYPE_VIDEO || base_type == TAKION_PACKET_TYPE_AUDIO)
+			&& !takion_av_packet_subscribed(takion, base_type, buf, buf_size))
+	{
+		chiaki_packet_pool_free(&takion->packet_pool, buf);
+		return;
+	}
+
 	if(takion_handle_packet_mac(takion, base_type, buf, buf_size) != CHIAKI_ERR_SUCCESS)
 	{
-		free(buf);
+		chiaki_packet_pool_free(&takion->packet_pool, buf);
 		return;
 	}
 
@@ -1096,18 +2017,12 @@ static void takion_handle_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_
 			break;
 		case TAKION_PACKET_TYPE_VIDEO:
 		case TAKION_PACKET_TYPE_AUDIO:
-			if(takion->enable_crypt && !takion->gkcrypt_remote)
-				takion_postpone_packet(takion, buf, buf_size);
-			else
-			{
-				takion_handle_packet_av(takion, base_type, buf, buf_size);
-				free(buf);
-			}
+			takion_handle_packet_av_checked(takion, base_type, buf, buf_size);
 			break;
 		default:
 			CHIAKI_LOGW(takion->log, "Takion packet with unknown type %#x received", base_type);
 			chiaki_log_hexdump(takion->log, CHIAKI_LOG_WARNING, buf, buf_size);
-			free(buf);
+			chiaki_packet_pool_free(&takion->packet_pool, buf);
 			break;
 	}
 }
@@ -1119,7 +2034,7 @@ static void takion_handle_packet_message(ChiakiTakion *takion, uint8_t *buf, siz
 	ChiakiErrorCode err = takion_parse_message(takion, buf+1, buf_size-1, &msg);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
-		free(buf);
+		chiaki_packet_pool_free(&takion->packet_pool, buf);
 		return;
 	}
 
@@ -1133,31 +2048,37 @@ static void takion_handle_packet_message(ChiakiTakion *takion, uint8_t *buf, siz
 			break;
 		case TAKION_CHUNK_TYPE_DATA_ACK:
 			takion_handle_packet_message_data_ack(takion, msg.chunk_flags, msg.payload, msg.payload_size);
-			free(buf);
+			chiaki_packet_pool_free(&takion->packet_pool, buf);
 			break;
 		default:
 			CHIAKI_LOGW(takion->log, "Takion received message with unknown chunk type = %#x", msg.chunk_type);
-			free(buf);
+			chiaki_packet_pool_free(&takion->packet_pool, buf);
 			break;
 	}
 }
 
 static void takion_flush_data_queue(ChiakiTakion *takion)
 {
-	uint64_t seq_num = 0;
+	ChiakiSeqNum32 seq_num = 0;
+	ChiakiSeqNum32 ack_seq_num = 0;
 	bool ack = false;
-	while(true)
+	// the callback may send, but never pushes into the queue, so the run found here is all there is
+	for(uint64_t ready = chiaki_reorder_queue32_ready(&takion->data_queue); ready; ready--)
 	{
 		TakionDataPacketEntry *entry;
-		bool pulled = chiaki_reorder_queue_pull(&takion->data_queue, &seq_num, (void **)&entry);
-		if(!pulled)
-			break;
+		chiaki_reorder_queue32_pull(&takion->data_queue, &seq_num, (void **)&entry);
+
+		if(entry->mac_pending && takion->gkcrypt_remote && !takion_data_entry_check_mac(takion, entry))
+		{
+			chiaki_packet_pool_free(&takion->packet_pool, entry->packet_buf);
+			continue;
+		}
 		ack = true;
+		ack_seq_num = seq_num;
 
 		if(entry->payload_size < 9)
 		{
-			free(entry->packet_buf);
-			free(entry);
+			chiaki_packet_pool_free(&takion->packet_pool, entry->packet_buf);
 			continue;
 		}
 
@@ -1185,12 +2106,123 @@ static void takion_flush_data_queue(ChiakiTakion *takion)
 			takion->cb(&event, takion->cb_user);
 		}
 
-		free(entry->packet_buf);
-		free(entry);
+		chiaki_packet_pool_free(&takion->packet_pool, entry->packet_buf);
 	}
 
 	if(ack)
-		chiaki_takion_send_message_data_ack(takion, (uint32_t)seq_num);
+		takion_ack_data(takion, ack_seq_num);
+}
+
+/**
+ * Whether the packet budget of the current second is used up.
+ * Must be called with ack_mutex locked.
+ */
+static bool takion_upstream_over_budget(ChiakiTakion *takion, uint64_t now_us)
+{
+	if(!takion->upstream_packets_budget)
+		return false;
+	size_t packets = chiaki_atomic_load_acquire(&takion->upstream_packets);
+	if(now_us - takion->budget_window_start_us >= 1000000)
+	{
+		takion->budget_window_start_us = now_us;
+		takion->budget_window_packets = packets;
+		takion->budget_window_exceeded = false;
+	}
+	if(packets - takion->budget_window_packets < takion->upstream_packets_budget)
+		return false;
+	if(!takion->budget_window_exceeded)
+	{
+		takion->budget_window_exceeded = true;
+		takion->upstream_stats.budget_windows_exceeded++;
+	}
+	return true;
+}
+
+/**
+ * Ack all data up to seq_num, which is newer than anything acked before.
+ * The ack is cumulative, so one that is still pending is simply replaced.
+ */
+static void takion_ack_data(ChiakiTakion *takion, ChiakiSeqNum32 seq_num)
+{
+	chiaki_mutex_lock(&takion->ack_mutex);
+	if(!takion->ack_delay_us)
+	{
+		takion->upstream_stats.acks_sent++;
+		chiaki_mutex_unlock(&takion->ack_mutex);
+		chiaki_takion_send_message_data_ack(takion, seq_num);
+		return;
+	}
+	bool schedule = !takion->ack_pending;
+	if(schedule)
+	{
+		takion->ack_pending = true;
+		takion->ack_held = false;
+		takion->ack_pending_since_us = chiaki_time_now_monotonic_us();
+	}
+	else
+		takion->upstream_stats.acks_merged++;
+	takion->ack_seq_num = seq_num;
+	chiaki_mutex_unlock(&takion->ack_mutex);
+	if(schedule)
+		chiaki_timer_wheel_schedule(takion->timer_wheel, &takion->ack_task, takion->ack_delay_us);
+}
+
+static uint64_t takion_ack_task_cb(void *user, uint64_t now_us)
+{
+	ChiakiTakion *takion = user;
+	chiaki_mutex_lock(&takion->ack_mutex);
+	if(!takion->ack_pending)
+	{
+		chiaki_mutex_unlock(&takion->ack_mutex);
+		return CHIAKI_TIMER_TASK_STOP;
+	}
+	uint64_t delay_us = takion->ack_delay_us;
+	if(takion_upstream_over_budget(takion, now_us))
+	{
+		if(!takion->ack_held)
+		{
+			takion->ack_held = true;
+			takion->upstream_stats.acks_over_budget++;
+		}
+		delay_us *= CHIAKI_TAKION_ACK_DELAY_OVER_BUDGET_FACTOR;
+	}
+	uint64_t waited_us = now_us - takion->ack_pending_since_us;
+	if(waited_us < delay_us)
+	{
+		chiaki_mutex_unlock(&takion->ack_mutex);
+		return delay_us - waited_us;
+	}
+	ChiakiSeqNum32 seq_num = takion->ack_seq_num;
+	takion->ack_pending = false;
+	takion->upstream_stats.acks_sent++;
+	chiaki_mutex_unlock(&takion->ack_mutex);
+	chiaki_takion_send_message_data_ack(takion, seq_num);
+	return CHIAKI_TIMER_TASK_STOP;
+}
+
+/**
+ * Called on the Takion thread when it is done receiving, so no ack is scheduled anymore.
+ */
+static void takion_ack_stop(ChiakiTakion *takion)
+{
+	if(takion->ack_delay_us)
+		chiaki_timer_wheel_cancel(takion->timer_wheel, &takion->ack_task);
+	ChiakiTakionUpstreamStats stats;
+	chiaki_takion_get_upstream_stats(takion, &stats);
+	CHIAKI_LOGI(takion->log, "Takion sent %llu datagrams, %llu data acks, %llu acks merged into later ones",
+			(unsigned long long)stats.packets, (unsigned long long)stats.acks_sent, (unsigned long long)stats.acks_merged);
+	if(stats.budget_windows_exceeded)
+		CHIAKI_LOGI(takion->log, "Takion used up the upstream budget of %u packets/s in %llu seconds, held %llu acks longer",
+				takion->upstream_packets_budget, (unsigned long long)stats.budget_windows_exceeded,
+				(unsigned long long)stats.acks_over_budget);
+}
+
+CHIAKI_EXPORT void chiaki_takion_get_upstream_stats(ChiakiTakion *takion, ChiakiTakionUpstreamStats *stats)
+{
+	chiaki_mutex_lock(&takion->ack_mutex);
+	*stats = takion->upstream_stats;
+	chiaki_mutex_unlock(&takion->ack_mutex);
+	stats->packets = chiaki_atomic_load_acquire(&takion->upstream_packets);
 }
 
 static void takion_handle_packet_message_data(ChiakiTakion *takion, uint8_t *packet_buf, size_t packet_buf_size, uint8_t type_b, uint8_t *payload, size_t payload_size)
@@ -1201,22 +2233,21 @@ static void takion_handle_packet_message_data(ChiakiTakion *takion, uint8_t *pac
 	if(payload_size < 9)
 	{
 		CHIAKI_LOGE(takion->log, "Takion received data with a size less than the header size");
+		chiaki_packet_pool_free(&takion->packet_pool, packet_buf);
 		return;
 	}
 
-	TakionDataPacketEntry *entry = malloc(sizeof(TakionDataPacketEntry));
-	if(!entry)
-		return;
-
+	TakionDataPacketEntry *entry = chiaki_packet_pool_buf_reserve(packet_buf);
 	entry->type_b = type_b;
 	entry->packet_buf = packet_buf;
 	entry->packet_size = packet_buf_size;
 	entry->payload = payload;
 	entry->payload_size = payload_size;
 	entry->channel = ntohs(*((chiaki_unaligned_uint16_t *)(payload + 4)));
+	entry->mac_pending = takion->enable_crypt && !takion->gkcrypt_remote;
 	ChiakiSeqNum32 seq_num = ntohl(*((chiaki_unaligned_uint32_t *)(payload + 0)));
 
-	chiaki_reorder_queue_push(&takion->data_queue, seq_num, entry);
+	chiaki_reorder_queue32_push(&takion->data_queue, seq_num, entry);
 	takion_flush_data_queue(takion);
 }
 
@@ -1242,7 +2273,7 @@ static void takion_handle_packet_message_data_ack(ChiakiTakion *takion, uint8_t
 	if(dup_tsns_count != 0)
 		CHIAKI_LOGW(takion->log, "Takion received data ack with nonzero dup_tsns_count %#x", dup_tsns_count);
 
-	CHIAKI_LOGV(takion->log, "Takion received data ack with cumulative_seq_num = %#x, a_rwnd = %#x, gap_ack_blocks_count = %#x, dup_tsns_count = %#x",
+	CHIAKI_LOGT(takion->log, "Takion received data ack with cumulative_seq_num = %#x, a_rwnd = %#x, gap_ack_blocks_count = %#x, dup_tsns_count = %#x",
 			cumulative_seq_num, a_rwnd, gap_ack_blocks_count, dup_tsns_count);
 
 	ChiakiSeqNum32 acked_seq_nums[TAKION_SEND_BUFFER_SIZE];
@@ -1431,34 +2462,12 @@ static ChiakiErrorCode takion_recv_message_cookie_ack(ChiakiTakion *takion)
 	return CHIAKI_ERR_SUCCESS;
 }
 
-static void takion_handle_packet_av(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size)
-{
-	// HHIxIIx
-
-	assert(base_type == TAKION_PACKET_TYPE_VIDEO || base_type == TAKION_PACKET_TYPE_AUDIO);
-
-	ChiakiTakionAVPacket packet;
-	ChiakiErrorCode err = takion->av_packet_parse(&packet, &takion->key_state, buf, buf_size);
-	if(err != CHIAKI_ERR_SUCCESS)
-	{
-		if(err == CHIAKI_ERR_BUF_TOO_SMALL)
-			CHIAKI_LOGE(takion->log, "Takion received AV packet that was too small");
-		return;
-	}
-
-	if(takion->cb)
-	{
-		ChiakiTakionEvent event = { 0 };
-		event.type = CHIAKI_TAKION_EVENT_TYPE_AV;
-		event.av = &packet;
-		takion->cb(&event, takion->cb_user);
-	}
-}
-
-static ChiakiErrorCode av_packet_parse(bool v12, ChiakiTakionAVPacket *packet, ChiakiKeyState *key_state, uint8_t *buf, size_t buf_size)
+/**
+ * Shared by v9 and v12, called with a constant v12 so each version gets its own copy without the branches of the other.
+ * Every field of packet is written, so it does not have to be cleared before.
+ */
+static inline ChiakiErrorCode av_packet_parse(const bool v12, ChiakiTakionAVPacket *packet, ChiakiKeyState *key_state, uint8_t *buf, size_t buf_size)
 {
-	memset(packet, 0, sizeof(ChiakiTakionAVPacket));
-
 	if(buf_size < 1)
 		return CHIAKI_ERR_BUF_TOO_SMALL;
 
@@ -1467,94 +2476,259 @@ static ChiakiErrorCode av_packet_parse(bool v12, ChiakiTakionAVPacket *packet, C
 	if(base_type != TAKION_PACKET_TYPE_VIDEO && base_type != TAKION_PACKET_TYPE_AUDIO)
 		return CHIAKI_ERR_INVALID_DATA;
 
-	packet->is_video = base_type == TAKION_PACKET_TYPE_VIDEO;
-
-	packet->uses_nalu_info_structs = ((buf[0] >> 4) & 1) != 0;
+	bool is_video = base_type == TAKION_PACKET_TYPE_VIDEO;
+	bool uses_nalu_info_structs = ((buf[0] >> 4) & 1) != 0;
 
 	uint8_t *av = buf+1;
 	size_t av_size = buf_size-1;
 	size_t av_header_size = v12
-		? (packet->is_video ? CHIAKI_TAKION_V12_AV_HEADER_SIZE_VIDEO : CHIAKI_TAKION_V12_AV_HEADER_SIZE_AUDIO)
-		: (packet->is_video ? CHIAKI_TAKION_V9_AV_HEADER_SIZE_VIDEO : CHIAKI_TAKION_V9_AV_HEADER_SIZE_AUDIO);
+		? (is_video ? CHIAKI_TAKION_V12_AV_HEADER_SIZE_VIDEO : CHIAKI_TAKION_V12_AV_HEADER_SIZE_AUDIO)
+		: (is_video ? CHIAKI_TAKION_V9_AV_HEADER_SIZE_VIDEO : CHIAKI_TAKION_V9_AV_HEADER_SIZE_AUDIO);
 	if(av_size < av_header_size + 1)
 		return CHIAKI_ERR_BUF_TOO_SMALL;
 
+	packet->is_video = is_video;
+	packet->uses_nalu_info_structs = uses_nalu_info_structs;
 	packet->packet_index = ntohs(*((chiaki_unaligned_uint16_t *)(av + 0)));
 	packet->frame_index = ntohs(*((chiaki_unaligned_uint16_t *)(av + 2)));
 
 	uint32_t dword_2 = ntohl(*((chiaki_unaligned_uint32_t *)(av + 4)));
-	if(packet->is_video)
+	packet->codec = av[8];
+	uint32_t key_pos_low = ntohl(*((chiaki_unaligned_uint32_t *)(av + 0xd)));
+	packet->key_pos = chiaki_key_state_request_pos(key_state, key_pos_low, true);
+	packet->recv_us = 0;
+
+	// unknown byte at 0x11
+	av += 0x11;
+	av_size -= 0x11;
+
+	if(is_video)
 	{
 		packet->unit_index = (uint16_t)((dword_2 >> 0x15) & 0x7ff);
 		packet->units_in_frame_total = (uint16_t)(((dword_2 >> 0xa) & 0x7ff) + 1);
 		packet->units_in_frame_fec = (uint16_t)(dword_2 & 0x3ff);
+		packet->word_at_0x18 = ntohs(*((chiaki_unaligned_uint16_t *)(av + 0)));
+		packet->adaptive_stream_index = av[2] >> 5;
+		av += 3;
+		av_size -= 3;
+		// TODO: parsing for uses_nalu_info_structs (before: packet.byte_at_0x1a)
+		packet->byte_at_0x2c = av[0];
+		packet->is_haptics = false;
+		if(uses_nalu_info_structs)
+		{
+			av += 3;
+			av_size -= 3;
+		}
 	}
 	else
 	{
 		packet->unit_index = (uint16_t)((dword_2 >> 0x18) & 0xff);
 		packet->units_in_frame_total = (uint16_t)(((dword_2 >> 0x10) & 0xff) + 1);
 		packet->units_in_frame_fec = (uint16_t)(dword_2 & 0xffff);
+		packet->word_at_0x18 = 0;
+		packet->adaptive_stream_index = 0;
+		packet->byte_at_0x2c = 0;
+		av += 1; // unknown
+		av_size -= 1;
+		if(uses_nalu_info_structs)
+		{
+			av += 3;
+			av_size -= 3;
+		}
+		packet->is_haptics = v12 && *av == 0x02;
+		if(v12)
+		{
+			av += 1;
+			av_size -= 1;
+		}
 	}
 
-	packet->codec = av[8];
-	uint32_t key_pos_low = ntohl(*((chiaki_unaligned_uint32_t *)(av + 0xd)));
-	packet->key_pos = chiaki_key_state_request_pos(key_state, key_pos_low, true);
+	packet->data = av;
+	packet->data_size = av_size;
 
-	uint8_t unknown_1 = av[0x11]; (void)unknown_1;
+	return CHIAKI_ERR_SUCCESS;
+}
 
-	av += 0x11;
-	av_size -= 0x11;
+static inline ChiakiErrorCode v7_av_packet_parse(ChiakiTakionAVPacket *packet, uint8_t *buf, size_t buf_size)
+{
+	if(buf_size < 1)
+		return CHIAKI_ERR_BUF_TOO_SMALL;
 
-	if(packet->is_video)
+	uint8_t base_type = buf[0] & TAKION_PACKET_BASE_TYPE_MASK;
+
+	if(base_type != TAKION_PACKET_TYPE_VIDEO && base_type != TAKION_PACKET_TYPE_AUDIO)
+		return CHIAKI_ERR_INVALID_DATA;
+
+	bool is_video = base_type == TAKION_PACKET_TYPE_VIDEO;
+	bool uses_nalu_info_structs = ((buf[0] >> 4) & 1) != 0;
+
+	size_t header_size = CHIAKI_TAKION_V7_AV_HEADER_SIZE_BASE;
+	if(is_video)
+		header_size += CHIAKI_TAKION_V7_AV_HEADER_SIZE_VIDEO_ADD;
+	if(uses_nalu_info_structs)
+		header_size += CHIAKI_TAKION_V7_AV_HEADER_SIZE_NALU_INFO_STRUCTS_ADD;
+
+	if(buf_size < header_size)
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+
+	packet->is_video = is_video;
+	packet->uses_nalu_info_structs = uses_nalu_info_structs;
+	packet->is_haptics = false;
+	packet->packet_index = ntohs(*((chiaki_unaligned_uint16_t *)(buf + 1)));
+	packet->frame_index = ntohs(*((chiaki_unaligned_uint16_t *)(buf + 3)));
+
+	uint32_t dword_2 = ntohl(*((chiaki_unaligned_uint32_t *)(buf + 5)));
+	packet->unit_index = (uint16_t)((dword_2 >> 0x15) & 0x7ff);
+	packet->units_in_frame_total = (uint16_t)(((dword_2 >> 0xa) & 0x7ff) + 1);
+	packet->units_in_frame_fec = (uint16_t)(dword_2 & 0x3ff);
+
+	packet->codec = buf[9];
+	// unknown *(chiaki_unaligned_uint32_t *)(buf + 0xa)
+	packet->key_pos = ntohl(*((chiaki_unaligned_uint32_t *)(buf + 0xe)));
+	packet->recv_us = 0;
+	packet->byte_at_0x2c = 0;
+
+	buf += 0x12;
+	buf_size -= 0x12;
+
+	if(is_video)
 	{
-		packet->word_at_0x18 = ntohs(*((chiaki_unaligned_uint16_t *)(av + 0)));
-		packet->adaptive_stream_index = av[2] >> 5;
-		av += 3;
-		av_size -= 3;
+		packet->word_at_0x18 = ntohs(*((chiaki_unaligned_uint16_t *)(buf + 0)));
+		packet->adaptive_stream_index = buf[2] >> 5;
+		buf += 3;
+		buf_size -= 3;
 	}
 	else
 	{
-		av += 1;
-		av_size -= 1;
+		packet->word_at_0x18 = 0;
+		packet->adaptive_stream_index = 0;
+	}
+
+	if(uses_nalu_info_structs)
+	{
+		buf += 3;
+		buf_size -= 3;
 		// unknown
 	}
 
-	// TODO: parsing for uses_nalu_info_structs (before: packet.byte_at_0x1a)
+	packet->data = buf;
+	packet->data_size = buf_size;
 
-	if(packet->is_video)
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static void takion_handle_packet_av(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size)
+{
+	// HHIxIIx
+
+	assert(base_type == TAKION_PACKET_TYPE_VIDEO || base_type == TAKION_PACKET_TYPE_AUDIO);
+
+	// the version is checked in chiaki_takion_connect(), a switch lets each parser be inlined here
+	ChiakiTakionAVPacket packet;
+	ChiakiErrorCode err;
+	switch(takion->version)
 	{
-		packet->byte_at_0x2c = av[0];
-		//av += 2;
-		//av_size -= 2;
+		case 7:
+			err = v7_av_packet_parse(&packet, buf, buf_size);
+			break;
+		case 9:
+			err = av_packet_parse(false, &packet, &takion->key_state, buf, buf_size);
+			break;
+		default:
+			err = av_packet_parse(true, &packet, &takion->key_state, buf, buf_size);
+			break;
+	}
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		if(err == CHIAKI_ERR_BUF_TOO_SMALL)
+			CHIAKI_LOGE(takion->log, "Takion received AV packet that was too small");
+		return;
 	}
+	packet.recv_us = chiaki_time_now_monotonic_us();
 
-	if(packet->uses_nalu_info_structs)
+	if(takion->cb)
 	{
-		av += 3;
-		av_size -= 3;
+		ChiakiTakionEvent event = { 0 };
+		event.type = CHIAKI_TAKION_EVENT_TYPE_AV;
+		event.av = &packet;
+		takion->cb(&event, takion->cb_user);
 	}
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v9_av_packet_parse(ChiakiTakionAVPacket *packet, ChiakiKeyState *key_state, uint8_t *buf, size_t buf_size)
+{
+	return av_packet_parse(false, packet, key_state, buf, buf_size);
+}
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v12_av_packet_parse(ChiakiTakionAVPacket *packet, ChiakiKeyState *key_state, uint8_t *buf, size_t buf_size)
+{
+	return av_packet_parse(true, packet, key_state, buf, buf_size);
+}
+
+static ChiakiErrorCode av_packet_format_header(bool v12, uint8_t *buf, size_t buf_size, size_t *header_size_out, ChiakiTakionAVPacket *packet)
+{
+	// inverse of av_packet_parse()
+	size_t header_size = 1 + 0x11 + (packet->is_video ? 3 : 1);
+	if(packet->uses_nalu_info_structs)
+		header_size += 3;
 	if(v12 && !packet->is_video)
+		header_size += 1;
+	*header_size_out = header_size;
+
+	if(header_size > buf_size)
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+
+	memset(buf, 0, header_size);
+	buf[0] = packet->is_video ? TAKION_PACKET_TYPE_VIDEO : TAKION_PACKET_TYPE_AUDIO;
+	if(packet->uses_nalu_info_structs)
+		buf[0] |= 0x10;
+
+	uint8_t *av = buf + 1;
+	*(chiaki_unaligned_uint16_t *)(av + 0) = htons(packet->packet_index);
+	*(chiaki_unaligned_uint16_t *)(av + 2) = htons(packet->frame_index);
+
+	uint32_t dword_2;
+	if(packet->is_video)
+		dword_2 = (packet->units_in_frame_fec & 0x3ff)
+			| (((uint32_t)(packet->units_in_frame_total - 1) & 0x7ff) << 0xa)
+			| (((uint32_t)packet->unit_index & 0x7ff) << 0x15);
+	else
+		dword_2 = (packet->units_in_frame_fec & 0xffff)
+			| (((uint32_t)(packet->units_in_frame_total - 1) & 0xff) << 0x10)
+			| (((uint32_t)packet->unit_index & 0xff) << 0x18);
+	*(chiaki_unaligned_uint32_t *)(av + 4) = htonl(dword_2);
+
+	av[8] = packet->codec;
+	// av + 9 is the MAC
+	*(chiaki_unaligned_uint32_t *)(av + 0xd) = htonl((uint32_t)packet->key_pos);
+
+	av += 0x11;
+	if(packet->is_video)
 	{
-		packet->is_haptics = *av == 0x02;
-		av += 1;
-		av_size -= 1;
+		*(chiaki_unaligned_uint16_t *)av = htons(packet->word_at_0x18);
+		av[2] = packet->adaptive_stream_index << 5;
+		av += 3;
 	}
+	else
+		av += 1;
 
-	packet->data = av;
-	packet->data_size = av_size;
+	if(packet->uses_nalu_info_structs)
+		av += 3;
+
+	if(v12 && !packet->is_video)
+		*av = packet->is_haptics ? 0x02 : 0x00;
 
 	return CHIAKI_ERR_SUCCESS;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v9_av_packet_parse(ChiakiTakionAVPacket *packet, ChiakiKeyState *key_state, uint8_t *buf, size_t buf_size)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v9_av_packet_format_header(uint8_t *buf, size_t buf_size, size_t *header_size_out, ChiakiTakionAVPacket *packet)
 {
-	return av_packet_parse(false, packet, key_state, buf, buf_size);
+	return av_packet_format_header(false, buf, buf_size, header_size_out, packet);
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v12_av_packet_parse(ChiakiTakionAVPacket *packet, ChiakiKeyState *key_state, uint8_t *buf, size_t buf_size)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v12_av_packet_format_header(uint8_t *buf, size_t buf_size, size_t *header_size_out, ChiakiTakionAVPacket *packet)
 {
-	return av_packet_parse(true, packet, key_state, buf, buf_size);
+	return av_packet_format_header(true, buf, buf_size, header_size_out, packet);
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v7_av_packet_format_header(uint8_t *buf, size_t buf_size, size_t *header_size_out, ChiakiTakionAVPacket *packet)
@@ -1606,62 +2780,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v7_av_packet_format_header(uint8_t *
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v7_av_packet_parse(ChiakiTakionAVPacket *packet, ChiakiKeyState *key_state, uint8_t *buf, size_t buf_size)
 {
-	memset(packet, 0, sizeof(ChiakiTakionAVPacket));
-
-	if(buf_size < 1)
-		return CHIAKI_ERR_BUF_TOO_SMALL;
-
-	uint8_t base_type = buf[0] & TAKION_PACKET_BASE_TYPE_MASK;
-
-	if(base_type != TAKION_PACKET_TYPE_VIDEO && base_type != TAKION_PACKET_TYPE_AUDIO)
-		return CHIAKI_ERR_INVALID_DATA;
-
-	packet->is_video = base_type == TAKION_PACKET_TYPE_VIDEO;
-	packet->uses_nalu_info_structs = ((buf[0] >> 4) & 1) != 0;
-
-	size_t header_size = CHIAKI_TAKION_V7_AV_HEADER_SIZE_BASE;
-	if(packet->is_video)
-		header_size += CHIAKI_TAKION_V7_AV_HEADER_SIZE_VIDEO_ADD;
-	if(packet->uses_nalu_info_structs)
-		header_size += CHIAKI_TAKION_V7_AV_HEADER_SIZE_NALU_INFO_STRUCTS_ADD;
-
-	if(buf_size < header_size)
-		return CHIAKI_ERR_BUF_TOO_SMALL;
-
-	packet->packet_index = ntohs(*((chiaki_unaligned_uint16_t *)(buf + 1)));
-	packet->frame_index = ntohs(*((chiaki_unaligned_uint16_t *)(buf + 3)));
-
-	uint32_t dword_2 = ntohl(*((chiaki_unaligned_uint32_t *)(buf + 5)));
-	packet->unit_index = (uint16_t)((dword_2 >> 0x15) & 0x7ff);
-	packet->units_in_frame_total = (uint16_t)(((dword_2 >> 0xa) & 0x7ff) + 1);
-	packet->units_in_frame_fec = (uint16_t)(dword_2 & 0x3ff);
-
-	packet->codec = buf[9];
-	// unknown *(chiaki_unaligned_uint32_t *)(buf + 0xa)
-	packet->key_pos = ntohl(*((chiaki_unaligned_uint32_t *)(buf + 0xe)));
-
-	buf += 0x12;
-	buf_size -= 0x12;
-
-	if(packet->is_video)
-	{
-		packet->word_at_0x18 = ntohs(*((chiaki_unaligned_uint16_t *)(buf + 0)));
-		packet->adaptive_stream_index = buf[2] >> 5;
-		buf += 3;
-		buf_size -= 3;
-	}
-
-	if(packet->uses_nalu_info_structs)
-	{
-		buf += 3;
-		buf_size -= 3;
-		// unknown
-	}
-
-	packet->data = buf;
-	packet->data_size = buf_size;
-
-	return CHIAKI_ERR_SUCCESS;
+	(void)key_state;
+	return v7_av_packet_parse(packet, buf, buf_size);
 }
 
 static ChiakiErrorCode takion_read_extra_sock_messages(ChiakiTakion *takion)
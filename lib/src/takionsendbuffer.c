@@ -7,258 +7,405 @@
 #include <chiaki/time.h>
 
 #include <string.h>
-#include <assert.h>
 
-#define TAKION_DATA_RESEND_TIMEOUT_MS 200
-#define TAKION_DATA_RESEND_WAKEUP_TIMEOUT_MS (TAKION_DATA_RESEND_TIMEOUT_MS/2)
+#define TAKION_DATA_RESEND_TIMEOUT_INITIAL_US 200000 // used until the first rtt sample
+#define TAKION_DATA_RESEND_TIMEOUT_MIN_US 20000
+#define TAKION_DATA_RESEND_TIMEOUT_MAX_US 1000000 // also caps the exponential backoff
+#define TAKION_DATA_RESEND_CLOCK_GRANULARITY_US CHIAKI_TIMER_WHEEL_TICK_US
 #define TAKION_DATA_RESEND_TRIES_MAX 10
 
 #endif
 
 struct chiaki_takion_send_buffer_packet_t
 {
+	bool set;
 	ChiakiSeqNum32 seq_num;
 	uint64_t tries;
-	uint64_t last_send_ms; // chiaki_time_now_monotonic_ms()
-	uint8_t *buf;
+	uint64_t last_send_us; // chiaki_time_now_monotonic_us()
+	uint8_t *buf; // either heap-allocated or inside the arena
 	size_t buf_size;
 }; // ChiakiTakionSendBufferPacket
 
 #ifndef CHIAKI_UNIT_TEST
 
-static void *takion_send_buffer_thread_func(void *user);
+static uint64_t takion_send_buffer_resend_task_cb(void *user, uint64_t now_us);
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuffer *send_buffer, ChiakiTakion *takion, size_t size)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuffer *send_buffer, ChiakiTimerWheel *timer_wheel,
+		ChiakiTakion *takion, size_t size, size_t arena_buf_size)
 {
+	send_buffer->timer_wheel = timer_wheel;
 	send_buffer->takion = takion;
 	send_buffer->log = takion ? takion->log : NULL;
+	send_buffer->buf_arena = takion ? takion->arena : NULL;
+
+	// slots are indexed by seq_num % size, which only stays contiguous across seqnum wraparound for powers of 2
+	if(!size || (size & (size - 1)))
+		return CHIAKI_ERR_INVALID_DATA;
 
 	send_buffer->packets = calloc(size, sizeof(ChiakiTakionSendBufferPacket));
 	if(!send_buffer->packets)
 		return CHIAKI_ERR_MEMORY;
 	send_buffer->packets_size = size;
 	send_buffer->packets_count = 0;
+	send_buffer->seq_num_begin = 0;
+	send_buffer->seq_num_end = 0;
+	send_buffer->acked_any = false;
+	send_buffer->seq_num_acked = 0;
+
+	send_buffer->rtt_sampled = false;
+	send_buffer->srtt_us = 0;
+	send_buffer->rttvar_us = 0;
+	send_buffer->rto_us = TAKION_DATA_RESEND_TIMEOUT_INITIAL_US;
+
+	ChiakiErrorCode err;
+	send_buffer->arena_buf_size = arena_buf_size;
+	send_buffer->arena = NULL;
+	if(arena_buf_size)
+	{
+		send_buffer->arena = malloc(size * arena_buf_size);
+		if(!send_buffer->arena)
+		{
+			err = CHIAKI_ERR_MEMORY;
+			goto error_packets;
+		}
+	}
 
-	send_buffer->should_stop = false;
-
-	ChiakiErrorCode err = chiaki_mutex_init(&send_buffer->mutex, false);
-	if(err != CHIAKI_ERR_SUCCESS)
-		goto error_packets;
-
-	err = chiaki_cond_init(&send_buffer->cond, &send_buffer->mutex);
-	if(err != CHIAKI_ERR_SUCCESS)
-		goto error_mutex;
+	chiaki_timer_task_init(&send_buffer->resend_task, "takion resend", takion_send_buffer_resend_task_cb, send_buffer);
 
-	err = chiaki_thread_create(&send_buffer->thread, takion_send_buffer_thread_func, send_buffer);
+	err = chiaki_mutex_init(&send_buffer->mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
-		goto error_cond;
-
-	chiaki_thread_set_name(&send_buffer->thread, "Chiaki Takion Send Buffer");
+		goto error_arena;
+	chiaki_mutex_set_name(&send_buffer->mutex, "takion send buffer");
 
 	return CHIAKI_ERR_SUCCESS;
-error_cond:
-	chiaki_cond_fini(&send_buffer->cond);
-error_mutex:
-	chiaki_mutex_fini(&send_buffer->mutex);
+error_arena:
+	free(send_buffer->arena);
 error_packets:
 	free(send_buffer->packets);
 	return err;
 }
 
+static bool packet_buf_in_arena(ChiakiTakionSendBuffer *send_buffer, uint8_t *buf)
+{
+	return send_buffer->arena && buf >= send_buffer->arena && buf < send_buffer->arena + send_buffer->packets_size * send_buffer->arena_buf_size;
+}
+
+static void packet_release(ChiakiTakionSendBuffer *send_buffer, ChiakiTakionSendBufferPacket *packet)
+{
+	if(!packet_buf_in_arena(send_buffer, packet->buf))
+		chiaki_arena_free(send_buffer->buf_arena, packet->buf);
+	packet->buf = NULL;
+	packet->set = false;
+}
+
+static inline ChiakiTakionSendBufferPacket *packet_slot(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num)
+{
+	return &send_buffer->packets[seq_num % send_buffer->packets_size];
+}
+
 CHIAKI_EXPORT void chiaki_takion_send_buffer_fini(ChiakiTakionSendBuffer *send_buffer)
 {
-	send_buffer->should_stop = true;
-	ChiakiErrorCode err = chiaki_cond_signal(&send_buffer->cond);
-	assert(err == CHIAKI_ERR_SUCCESS);
-	err = chiaki_thread_join(&send_buffer->thread, NULL);
-	assert(err == CHIAKI_ERR_SUCCESS);
+	if(send_buffer->timer_wheel)
+		chiaki_timer_wheel_cancel(send_buffer->timer_wheel, &send_buffer->resend_task);
 
-	for(size_t i=0; i<send_buffer->packets_count; i++)
-		free(send_buffer->packets[i].buf);
+	for(size_t i=0; i<send_buffer->packets_size; i++)
+	{
+		if(send_buffer->packets[i].set)
+			packet_release(send_buffer, &send_buffer->packets[i]);
+	}
 
-	chiaki_cond_fini(&send_buffer->cond);
 	chiaki_mutex_fini(&send_buffer->mutex);
+	free(send_buffer->arena);
 	free(send_buffer->packets);
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_push(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, uint8_t *buf, size_t buf_size)
+/**
+ * Insert a packet into its slot, extending the window of outstanding seqnums if necessary.
+ * Must be called with the mutex locked.
+ *
+ * @param copy if true, buf is copied into the arena or a new heap buffer, otherwise ownership of buf is taken on success
+ */
+static ChiakiErrorCode send_buffer_insert(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, uint8_t *buf, size_t buf_size, bool copy)
 {
-	ChiakiErrorCode err = chiaki_mutex_lock(&send_buffer->mutex);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
+	ChiakiSeqNum32 begin = send_buffer->seq_num_begin;
+	ChiakiSeqNum32 end = send_buffer->seq_num_end;
+	if(send_buffer->packets_count == 0)
+	{
+		begin = seq_num;
+		end = seq_num + 1;
+	}
+	else if(!chiaki_seq_num_32_lt(seq_num, end))
+		end = seq_num + 1;
+	else if(chiaki_seq_num_32_lt(seq_num, begin))
+		begin = seq_num; // pushed out of order by a different thread
 
-	if(send_buffer->packets_count >= send_buffer->packets_size)
+	if((size_t)(ChiakiSeqNum32)(end - begin) > send_buffer->packets_size)
 	{
 		CHIAKI_LOGE(send_buffer->log, "Takion Send Buffer overflow");
-		err = CHIAKI_ERR_OVERFLOW;
-		goto beach;
+		return CHIAKI_ERR_OVERFLOW;
+	}
+
+	ChiakiTakionSendBufferPacket *packet = packet_slot(send_buffer, seq_num);
+	if(packet->set)
+	{
+		CHIAKI_LOGE(send_buffer->log, "Tried to push duplicate seqnum into Takion Send Buffer");
+		return CHIAKI_ERR_INVALID_DATA;
 	}
 
-	for(size_t i=0; i<send_buffer->packets_count; i++)
+	if(copy)
 	{
-		if(send_buffer->packets[i].seq_num == seq_num)
+		const uint8_t *src = buf;
+		if(buf_size <= send_buffer->arena_buf_size)
+			buf = send_buffer->arena + (seq_num % send_buffer->packets_size) * send_buffer->arena_buf_size;
+		else
 		{
-			CHIAKI_LOGE(send_buffer->log, "Tried to push duplicate seqnum into Takion Send Buffer");
-			err = CHIAKI_ERR_INVALID_DATA;
-			goto beach;
+			buf = chiaki_arena_alloc(send_buffer->buf_arena, CHIAKI_ARENA_TAG_TAKION, buf_size);
+			if(!buf)
+				return CHIAKI_ERR_MEMORY;
 		}
+		memcpy(buf, src, buf_size);
 	}
 
-	ChiakiTakionSendBufferPacket *packet = &send_buffer->packets[send_buffer->packets_count++];
+	send_buffer->seq_num_begin = begin;
+	send_buffer->seq_num_end = end;
+
+	packet->set = true;
 	packet->seq_num = seq_num;
 	packet->tries = 0;
-	packet->last_send_ms = chiaki_time_now_monotonic_ms();
+	packet->last_send_us = chiaki_time_now_monotonic_us();
 	packet->buf = buf;
 	packet->buf_size = buf_size;
+	send_buffer->packets_count++;
+
+	CHIAKI_LOGT(send_buffer->log, "Pushed seq num %#llx into Takion Send Buffer", (unsigned long long)seq_num);
+
+	// the task stops while the buffer is empty
+	if(send_buffer->packets_count == 1 && send_buffer->timer_wheel)
+		chiaki_timer_wheel_schedule(send_buffer->timer_wheel, &send_buffer->resend_task, send_buffer->rto_us);
 
-	CHIAKI_LOGV(send_buffer->log, "Pushed seq num %#llx into Takion Send Buffer", (unsigned long long)seq_num);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static bool send_buffer_already_acked(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num)
+{
+	// the ack may overtake the push since packets are pushed after they have been sent
+	return send_buffer->acked_any
+		&& (seq_num == send_buffer->seq_num_acked || chiaki_seq_num_32_lt(seq_num, send_buffer->seq_num_acked))
+		&& (size_t)(ChiakiSeqNum32)(send_buffer->seq_num_acked - seq_num) < send_buffer->packets_size;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_push(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, uint8_t *buf, size_t buf_size)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&send_buffer->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		chiaki_arena_free(send_buffer->buf_arena, buf);
+		return err;
+	}
 
-	if(send_buffer->packets_count == 1)
+	if(send_buffer_already_acked(send_buffer, seq_num))
 	{
-		// buffer was empty before, so it will sleep without timeout => WAKE UP!!
-		chiaki_cond_signal(&send_buffer->cond);
+		CHIAKI_LOGT(send_buffer->log, "Seq num %#llx was already acked before being pushed into Takion Send Buffer", (unsigned long long)seq_num);
+		chiaki_arena_free(send_buffer->buf_arena, buf);
+		goto beach;
 	}
 
-beach:
+	err = send_buffer_insert(send_buffer, seq_num, buf, buf_size, false);
 	if(err != CHIAKI_ERR_SUCCESS)
-		free(buf);
+		chiaki_arena_free(send_buffer->buf_arena, buf);
+
+beach:
 	chiaki_mutex_unlock(&send_buffer->mutex);
 	return err;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_ack(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, ChiakiSeqNum32 *acked_seq_nums, size_t *acked_seq_nums_count)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_push_copy(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, const uint8_t *buf, size_t buf_size)
 {
 	ChiakiErrorCode err = chiaki_mutex_lock(&send_buffer->mutex);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 
-	if(acked_seq_nums_count)
-		*acked_seq_nums_count = 0;
+	if(send_buffer_already_acked(send_buffer, seq_num))
+		CHIAKI_LOGT(send_buffer->log, "Seq num %#llx was already acked before being pushed into Takion Send Buffer", (unsigned long long)seq_num);
+	else
+		err = send_buffer_insert(send_buffer, seq_num, (uint8_t *)buf, buf_size, true);
+
+	chiaki_mutex_unlock(&send_buffer->mutex);
+	return err;
+}
 
-	size_t i;
-	size_t shift = 0; // amount to shift back
-	size_t shift_start = SIZE_MAX;
-	for(i=0; i<send_buffer->packets_count; i++)
+/**
+ * Must be called with the mutex locked.
+ */
+static void send_buffer_rtt_sample(ChiakiTakionSendBuffer *send_buffer, uint64_t rtt_us)
+{
+	if(!send_buffer->rtt_sampled)
 	{
-		if(send_buffer->packets[i].seq_num == seq_num || chiaki_seq_num_32_lt(send_buffer->packets[i].seq_num, seq_num))
-		{
-			if(acked_seq_nums)
-				acked_seq_nums[(*acked_seq_nums_count)++] = send_buffer->packets[i].seq_num;
+		send_buffer->srtt_us = rtt_us;
+		send_buffer->rttvar_us = rtt_us / 2;
+		send_buffer->rtt_sampled = true;
+	}
+	else
+	{
+		uint64_t delta = send_buffer->srtt_us > rtt_us ? send_buffer->srtt_us - rtt_us : rtt_us - send_buffer->srtt_us;
+		send_buffer->rttvar_us = (3 * send_buffer->rttvar_us + delta) / 4;
+		send_buffer->srtt_us = (7 * send_buffer->srtt_us + rtt_us) / 8;
+	}
 
-			free(send_buffer->packets[i].buf);
-			if(shift_start == SIZE_MAX)
-			{
-				// first shift
-				shift_start = i;
-				shift = 1;
-			}
-			else if(shift_start + shift == i)
-			{
-				// still in the same gap
-				shift++;
-			}
-			else
-			{
-				// new gap, do shift
-				memmove(send_buffer->packets + shift_start,
-						send_buffer->packets + shift_start + shift,
-						(i - (shift_start + shift)) * sizeof(ChiakiTakionSendBufferPacket));
-				// start new shift
-				shift_start = i - shift;
-				shift++;
-			}
-		}
+	uint64_t var = 4 * send_buffer->rttvar_us;
+	if(var < TAKION_DATA_RESEND_CLOCK_GRANULARITY_US)
+		var = TAKION_DATA_RESEND_CLOCK_GRANULARITY_US;
+	uint64_t rto = send_buffer->srtt_us + var;
+	if(rto < TAKION_DATA_RESEND_TIMEOUT_MIN_US)
+		rto = TAKION_DATA_RESEND_TIMEOUT_MIN_US;
+	else if(rto > TAKION_DATA_RESEND_TIMEOUT_MAX_US)
+		rto = TAKION_DATA_RESEND_TIMEOUT_MAX_US;
+	send_buffer->rto_us = rto;
+}
+
+/**
+ * Must be called with the mutex locked.
+ *
+ * @param sample_rtt whether seq_num was acked by the remote, so its round-trip time may be measured
+ */
+static void send_buffer_ack(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, bool sample_rtt, ChiakiSeqNum32 *acked_seq_nums, size_t *acked_seq_nums_count)
+{
+	if(sample_rtt)
+	{
+		// only time the packet that is directly answered by this ack
+		ChiakiTakionSendBufferPacket *packet = packet_slot(send_buffer, seq_num);
+		if(packet->set && packet->seq_num == seq_num && packet->tries == 0)
+			send_buffer_rtt_sample(send_buffer, chiaki_time_now_monotonic_us() - packet->last_send_us);
+	}
+
+	if(!send_buffer->acked_any || chiaki_seq_num_32_gt(seq_num, send_buffer->seq_num_acked))
+	{
+		send_buffer->acked_any = true;
+		send_buffer->seq_num_acked = seq_num;
 	}
 
-	if(shift_start != SIZE_MAX)
+	// everything from begin up to and including seq_num is acked
+	while(send_buffer->packets_count > 0
+			&& (send_buffer->seq_num_begin == seq_num || chiaki_seq_num_32_lt(send_buffer->seq_num_begin, seq_num)))
 	{
-		// do final shift
-		if(shift_start + shift < send_buffer->packets_count)
+		ChiakiTakionSendBufferPacket *packet = packet_slot(send_buffer, send_buffer->seq_num_begin);
+		if(packet->set)
 		{
-			memmove(send_buffer->packets + shift_start,
-					send_buffer->packets + shift_start + shift,
-					(send_buffer->packets_count - (shift_start + shift)) * sizeof(ChiakiTakionSendBufferPacket));
+			if(acked_seq_nums)
+				acked_seq_nums[(*acked_seq_nums_count)++] = packet->seq_num;
+			packet_release(send_buffer, packet);
+			send_buffer->packets_count--;
 		}
-		send_buffer->packets_count -= shift;
+		send_buffer->seq_num_begin++;
 	}
 
-	CHIAKI_LOGV(send_buffer->log, "Acked seq num %#llx from Takion Send Buffer", (unsigned long long)seq_num);
+	// keep begin pointing at an outstanding packet
+	while(send_buffer->packets_count > 0 && !packet_slot(send_buffer, send_buffer->seq_num_begin)->set)
+		send_buffer->seq_num_begin++;
+
+	CHIAKI_LOGT(send_buffer->log, "Acked seq num %#llx from Takion Send Buffer", (unsigned long long)seq_num);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_ack(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, ChiakiSeqNum32 *acked_seq_nums, size_t *acked_seq_nums_count)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&send_buffer->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	if(acked_seq_nums_count)
+		*acked_seq_nums_count = 0;
+
+	send_buffer_ack(send_buffer, seq_num, true, acked_seq_nums, acked_seq_nums_count);
 
 	chiaki_mutex_unlock(&send_buffer->mutex);
 	return err;
 }
 
-static void takion_send_buffer_resend(ChiakiTakionSendBuffer *send_buffer);
-
-static bool takion_send_buffer_check_pred_packets(void *user)
+CHIAKI_EXPORT void chiaki_takion_send_buffer_seed_rtt(ChiakiTakionSendBuffer *send_buffer, uint64_t rtt_us)
 {
-	ChiakiTakionSendBuffer *send_buffer = user;
-	return send_buffer->should_stop;
+	if(chiaki_mutex_lock(&send_buffer->mutex) != CHIAKI_ERR_SUCCESS)
+		return;
+	if(!send_buffer->rtt_sampled)
+	{
+		send_buffer_rtt_sample(send_buffer, rtt_us);
+		CHIAKI_LOGI(send_buffer->log, "Takion Send Buffer seeded with rtt %llu us, resend timeout is %llu us",
+				(unsigned long long)rtt_us, (unsigned long long)send_buffer->rto_us);
+	}
+	chiaki_mutex_unlock(&send_buffer->mutex);
 }
 
-static bool takion_send_buffer_check_pred_no_packets(void *user)
+CHIAKI_EXPORT uint64_t chiaki_takion_send_buffer_get_rto_us(ChiakiTakionSendBuffer *send_buffer)
 {
-	ChiakiTakionSendBuffer *send_buffer = user;
-	return send_buffer->should_stop || send_buffer->packets_count;
+	if(chiaki_mutex_lock(&send_buffer->mutex) != CHIAKI_ERR_SUCCESS)
+		return 0;
+	uint64_t r = send_buffer->rto_us;
+	chiaki_mutex_unlock(&send_buffer->mutex);
+	return r;
 }
 
-static void *takion_send_buffer_thread_func(void *user)
+static uint64_t takion_send_buffer_resend(ChiakiTakionSendBuffer *send_buffer, uint64_t now);
+
+static uint64_t takion_send_buffer_resend_task_cb(void *user, uint64_t now_us)
 {
 	ChiakiTakionSendBuffer *send_buffer = user;
 
-	ChiakiErrorCode err = chiaki_mutex_lock(&send_buffer->mutex);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return NULL;
-
-	while(true)
-	{
-		if(send_buffer->packets_count) // if there are packets, wait with timeout
-			err = chiaki_cond_timedwait_pred(&send_buffer->cond, &send_buffer->mutex, TAKION_DATA_RESEND_WAKEUP_TIMEOUT_MS, takion_send_buffer_check_pred_packets, send_buffer);
-		else // if not, wait without timeout, but also wakeup if packets become available
-			err = chiaki_cond_wait_pred(&send_buffer->cond, &send_buffer->mutex, takion_send_buffer_check_pred_no_packets, send_buffer);
-
-		if(err != CHIAKI_ERR_SUCCESS && err != CHIAKI_ERR_TIMEOUT)
-			break;
-
-		if(send_buffer->should_stop)
-			break;
-
-		takion_send_buffer_resend(send_buffer);
-	}
+	if(chiaki_mutex_lock(&send_buffer->mutex) != CHIAKI_ERR_SUCCESS)
+		return CHIAKI_TIMER_TASK_STOP;
+	uint64_t next_due_us = takion_send_buffer_resend(send_buffer, now_us);
+	if(!send_buffer->packets_count)
+		next_due_us = CHIAKI_TIMER_TASK_STOP; // scheduled again by the next push
 	chiaki_mutex_unlock(&send_buffer->mutex);
 
-	return NULL;
+	return next_due_us;
 }
 
-static void takion_send_buffer_resend(ChiakiTakionSendBuffer *send_buffer)
+/**
+ * Re-send all packets whose timeout of rto_us, doubled for every previous try, has expired.
+ *
+ * Must be called with the mutex locked.
+ *
+ * @return us until the next packet is due
+ */
+static uint64_t takion_send_buffer_resend(ChiakiTakionSendBuffer *send_buffer, uint64_t now)
 {
+	uint64_t next_due_us = send_buffer->rto_us;
 	if(!send_buffer->takion)
-		return;
-
-	uint64_t now = chiaki_time_now_monotonic_ms();
+		return next_due_us;
 
-	for(size_t i=0; i<send_buffer->packets_count; i++)
+	ChiakiSeqNum32 seq_num = send_buffer->seq_num_begin;
+	while(send_buffer->packets_count > 0 && chiaki_seq_num_32_lt(seq_num, send_buffer->seq_num_end))
 	{
-		ChiakiTakionSendBufferPacket *packet = &send_buffer->packets[i];
-		if(now - packet->last_send_ms > TAKION_DATA_RESEND_TIMEOUT_MS)
+		ChiakiTakionSendBufferPacket *packet = packet_slot(send_buffer, seq_num);
+		seq_num++;
+		if(!packet->set)
+			continue;
+		uint64_t timeout = send_buffer->rto_us << packet->tries;
+		if(timeout > TAKION_DATA_RESEND_TIMEOUT_MAX_US || packet->tries >= 32)
+			timeout = TAKION_DATA_RESEND_TIMEOUT_MAX_US;
+		uint64_t elapsed = now - packet->last_send_us;
+		if(elapsed >= timeout)
 		{
 			if(packet->tries >= TAKION_DATA_RESEND_TRIES_MAX)
 			{
 				CHIAKI_LOGI(send_buffer->log, "Hit max retries of %d tries... giving up on packet with seqnum %#llx", TAKION_DATA_RESEND_TRIES_MAX, (unsigned long long)packet->seq_num);
-				ChiakiSeqNum32 ack_seq_nums;
-				size_t ack_seq_nums_count;
-				chiaki_mutex_unlock(&send_buffer->mutex);
-				chiaki_takion_send_buffer_ack(send_buffer, packet->seq_num, &ack_seq_nums, &ack_seq_nums_count);
-				chiaki_mutex_lock(&send_buffer->mutex);
-				i-= 1;
+				send_buffer_ack(send_buffer, packet->seq_num, false, NULL, NULL);
 				continue;
 			}
-			CHIAKI_LOGI(send_buffer->log, "Takion Send Buffer re-sending packet with seqnum %#llx, tries: %llu", (unsigned long long)packet->seq_num, (unsigned long long)packet->tries);
-			packet->last_send_ms = now;
+			CHIAKI_LOGI(send_buffer->log, "Takion Send Buffer re-sending packet with seqnum %#llx, tries: %llu, timeout: %llu us",
+					(unsigned long long)packet->seq_num, (unsigned long long)packet->tries, (unsigned long long)timeout);
+			packet->last_send_us = now;
 			chiaki_takion_send_raw(send_buffer->takion, packet->buf, packet->buf_size);
 			packet->tries++;
+			timeout = send_buffer->rto_us << packet->tries;
+			if(timeout > TAKION_DATA_RESEND_TIMEOUT_MAX_US)
+				timeout = TAKION_DATA_RESEND_TIMEOUT_MAX_US;
+			elapsed = 0;
 		}
+		if(timeout - elapsed < next_due_us)
+			next_due_us = timeout - elapsed;
 	}
+
+	return next_due_us;
 }
 
 #endif
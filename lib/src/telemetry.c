@@ -0,0 +1,244 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/telemetry.h>
+#include <chiaki/time.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#elif defined(__PSVITA__)
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#else
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#endif
+
+#include "utils.h"
+
+#define TELEMETRY_SNAPSHOT_SIZE_MAX 1024
+
+static void *telemetry_thread_func(void *user);
+
+typedef struct writer_t
+{
+	uint8_t *buf;
+	size_t size;
+	size_t pos;
+	bool overflow;
+} Writer;
+
+static void write_u32(Writer *w, uint64_t v)
+{
+	if(w->pos + 4 > w->size)
+	{
+		w->overflow = true;
+		return;
+	}
+	// saturate, a counter that ran out of range is more useful than one that wrapped
+	uint32_t v32 = v > UINT32_MAX ? UINT32_MAX : (uint32_t)v;
+	for(size_t i=0; i<4; i++)
+		w->buf[w->pos++] = (uint8_t)(v32 >> (8 * i));
+}
+
+static void write_bytes(Writer *w, const uint8_t *bytes, size_t size)
+{
+	if(w->pos + size > w->size)
+	{
+		w->overflow = true;
+		return;
+	}
+	memcpy(w->buf + w->pos, bytes, size);
+	w->pos += size;
+}
+
+CHIAKI_EXPORT size_t chiaki_telemetry_snapshot(ChiakiSession *session, const ChiakiTelemetryAppStats *app_stats,
+		uint32_t seq, uint64_t time_us, uint8_t *buf, size_t buf_size)
+{
+	Writer w = { buf, buf_size, 0, false };
+	uint8_t header[12];
+	memcpy(header, CHIAKI_TELEMETRY_MAGIC, 4);
+	header[4] = (uint8_t)CHIAKI_TELEMETRY_VERSION;
+	header[5] = (uint8_t)(CHIAKI_TELEMETRY_VERSION >> 8);
+	header[6] = CHIAKI_LATENCY_STAGE_COUNT;
+	header[7] = CHIAKI_THREAD_ROLE_COUNT;
+	for(size_t i=0; i<4; i++)
+		header[8 + i] = (uint8_t)(seq >> (8 * i));
+	write_bytes(&w, header, sizeof(header));
+	write_u32(&w, time_us & UINT32_MAX);
+	write_u32(&w, time_us >> 32);
+
+	ChiakiLatencyReport latency;
+	chiaki_session_get_latency_stats(session, &latency);
+	ChiakiLatencyCoarseHistograms histograms;
+	chiaki_session_get_latency_histograms(session, &histograms);
+	for(size_t i=0; i<CHIAKI_LATENCY_STAGE_COUNT; i++)
+	{
+		ChiakiLatencyStageStats *stage = &latency.stages[i];
+		write_u32(&w, stage->count);
+		write_u32(&w, stage->avg_us);
+		write_u32(&w, stage->p95_us);
+		write_u32(&w, stage->p99_us);
+		write_u32(&w, stage->max_us);
+		for(size_t j=0; j<CHIAKI_LATENCY_COARSE_BUCKETS; j++)
+			write_u32(&w, histograms.buckets[i][j]);
+	}
+
+	ChiakiPacketStatsSnapshot packets;
+	chiaki_session_get_packet_stats_snapshot(session, &packets);
+	ChiakiJitterStats jitter;
+	chiaki_session_get_jitter_stats(session, &jitter);
+	write_u32(&w, packets.total.received);
+	write_u32(&w, packets.total.lost);
+	write_u32(&w, packets.window_short.received);
+	write_u32(&w, packets.window_short.lost);
+	write_u32(&w, jitter.streams[CHIAKI_JITTER_STREAM_VIDEO].jitter_us);
+	write_u32(&w, jitter.streams[CHIAKI_JITTER_STREAM_AUDIO].jitter_us);
+	write_u32(&w, jitter.streams[CHIAKI_JITTER_STREAM_VIDEO].delay_us);
+	write_u32(&w, session->rtt_us);
+
+	ChiakiVideoStatsCounters video;
+	chiaki_session_get_video_stats(session, &video);
+	write_u32(&w, video.frames);
+	write_u32(&w, video.frames_failed);
+	write_u32(&w, video.frames_fec_recovered);
+	write_u32(&w, video.ref_frame_misses);
+	write_u32(&w, video.bitrate / 1000);
+
+	ChiakiAudioDecodeQueueStats audio;
+	chiaki_session_get_audio_decode_stats(session, &audio);
+	write_u32(&w, audio.frames);
+	write_u32(&w, audio.frames_dropped);
+	write_u32(&w, audio.depth);
+	write_u32(&w, audio.decode_us_avg);
+
+	write_u32(&w, app_stats->fps);
+	write_u32(&w, app_stats->audio_buffered_ms);
+	write_u32(&w, app_stats->audio_target_ms);
+	write_u32(&w, app_stats->audio_underruns);
+	write_u32(&w, app_stats->audio_overruns);
+	write_u32(&w, app_stats->cpu_ms);
+
+	for(size_t i=0; i<CHIAKI_THREAD_ROLE_COUNT; i++)
+	{
+		ChiakiThreadRoleStats role;
+		chiaki_thread_role_stats_get((ChiakiThreadRole)i, &role);
+		write_u32(&w, role.cpu_ms + role.running_cpu_ms);
+		write_u32(&w, role.running);
+	}
+
+	return w.overflow ? 0 : w.pos;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_telemetry_init(ChiakiTelemetry *telemetry, ChiakiSession *session,
+		const char *host, uint16_t port, uint64_t interval_ms,
+		ChiakiTelemetryAppStatsCb app_stats_cb, void *app_stats_cb_user, ChiakiLog *log)
+{
+	memset(telemetry, 0, sizeof(*telemetry));
+	telemetry->log = log;
+	telemetry->session = session;
+	telemetry->interval_ms = interval_ms ? interval_ms : CHIAKI_TELEMETRY_INTERVAL_MS_DEFAULT;
+	telemetry->app_stats_cb = app_stats_cb;
+	telemetry->app_stats_cb_user = app_stats_cb_user;
+
+	if(getaddrinfo(host, NULL, NULL, &telemetry->addrinfos) != 0)
+	{
+		CHIAKI_LOGE(log, "Telemetry failed to resolve receiver %s", host);
+		return CHIAKI_ERR_PARSE_ADDR;
+	}
+	for(struct addrinfo *ai=telemetry->addrinfos; ai; ai=ai->ai_next)
+	{
+		if(ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+			continue;
+		if(set_port(ai->ai_addr, htons(port)) != CHIAKI_ERR_SUCCESS)
+			continue;
+		telemetry->addr = ai;
+		break;
+	}
+	ChiakiErrorCode err = CHIAKI_ERR_PARSE_ADDR;
+	if(!telemetry->addr)
+	{
+		CHIAKI_LOGE(log, "Telemetry got no suitable address for receiver %s", host);
+		goto error_addrinfos;
+	}
+
+	err = CHIAKI_ERR_NETWORK;
+	telemetry->sock = socket(telemetry->addr->ai_family, SOCK_DGRAM, IPPROTO_UDP);
+	if(CHIAKI_SOCKET_IS_INVALID(telemetry->sock))
+	{
+		CHIAKI_LOGE(log, "Telemetry failed to create socket");
+		goto error_addrinfos;
+	}
+	err = chiaki_socket_set_nonblock(telemetry->sock, true);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(log, "Telemetry failed to make socket non-blocking");
+		goto error_sock;
+	}
+
+	err = chiaki_bool_pred_cond_init(&telemetry->stop_cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_sock;
+
+	telemetry->start_us = chiaki_time_now_monotonic_us();
+	err = chiaki_thread_create_role(&telemetry->thread, telemetry_thread_func, telemetry, CHIAKI_THREAD_ROLE_TELEMETRY);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_stop_cond;
+	CHIAKI_LOGI(log, "Telemetry sending to %s:%u every %llu ms", host, (unsigned int)port,
+			(unsigned long long)telemetry->interval_ms);
+	return CHIAKI_ERR_SUCCESS;
+
+error_stop_cond:
+	chiaki_bool_pred_cond_fini(&telemetry->stop_cond);
+error_sock:
+	CHIAKI_SOCKET_CLOSE(telemetry->sock);
+error_addrinfos:
+	freeaddrinfo(telemetry->addrinfos);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_telemetry_fini(ChiakiTelemetry *telemetry)
+{
+	chiaki_bool_pred_cond_signal(&telemetry->stop_cond);
+	chiaki_thread_join(&telemetry->thread, NULL);
+	chiaki_bool_pred_cond_fini(&telemetry->stop_cond);
+	CHIAKI_SOCKET_CLOSE(telemetry->sock);
+	freeaddrinfo(telemetry->addrinfos);
+}
+
+static void *telemetry_thread_func(void *user)
+{
+	ChiakiTelemetry *telemetry = user;
+	uint8_t buf[TELEMETRY_SNAPSHOT_SIZE_MAX];
+
+	ChiakiErrorCode err = chiaki_bool_pred_cond_lock(&telemetry->stop_cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return NULL;
+	while(true)
+	{
+		err = chiaki_bool_pred_cond_timedwait(&telemetry->stop_cond, telemetry->interval_ms);
+		if(err != CHIAKI_ERR_TIMEOUT)
+			break;
+
+		ChiakiTelemetryAppStats app_stats;
+		memset(&app_stats, 0, sizeof(app_stats));
+		if(telemetry->app_stats_cb)
+			telemetry->app_stats_cb(&app_stats, telemetry->app_stats_cb_user);
+		uint64_t time_us = chiaki_time_now_monotonic_us() - telemetry->start_us;
+		size_t size = chiaki_telemetry_snapshot(telemetry->session, &app_stats, telemetry->seq++, time_us, buf, sizeof(buf));
+		// never waits for the socket, a snapshot that does not fit is dropped and the next one has the totals anyway
+		if(size && sendto(telemetry->sock, (CHIAKI_SOCKET_BUF_TYPE)buf, size, 0,
+				telemetry->addr->ai_addr, (socklen_t)telemetry->addr->ai_addrlen) >= 0)
+			telemetry->stats.sent++;
+		else
+			telemetry->stats.dropped++;
+	}
+	chiaki_bool_pred_cond_unlock(&telemetry->stop_cond);
+	return NULL;
+}
@@ -4,10 +4,13 @@
 
 #include <chiaki/thread.h>
 #include <chiaki/time.h>
+#include <chiaki/atomic.h>
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <time.h>
 
 #ifdef __SWITCH__
 #include <switch.h>
@@ -18,6 +21,13 @@
 #include <psp2/kernel/error.h>
 #endif
 
+#if defined(__linux__) && !defined(__PSVITA__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <limits.h>
+#endif
+
 #if _WIN32
 static DWORD WINAPI win32_thread_func(LPVOID param)
 {
@@ -57,23 +67,394 @@ static int psp_thread_wrap(SceSize args, void *argp) {
 }
 #endif
 
+#ifdef __PSVITA__
+#define VITA_THREAD_PRIORITY_DEFAULT 0x10000100
+#define VITA_THREAD_STACK_SIZE_DEFAULT 0x10000
+// the decoders have to keep up with the stream, so they run at the highest user priority,
+// video on the first core with the display thread of the app, audio on the second one.
+// Everything else is latency-tolerant and may run anywhere, log output, recordings and telemetry are only written when nothing else wants to run.
+#define ROLE_ATTR(name, priority, cpu_affinity_mask) { name, priority, cpu_affinity_mask, 0 }
+#define ROLE_ATTR_VIDEO_DECODE ROLE_ATTR("Chiaki Video Decode", SCE_KERNEL_HIGHEST_PRIORITY_USER, SCE_KERNEL_CPU_MASK_USER_0)
+#define ROLE_ATTR_AUDIO_DECODE ROLE_ATTR("Chiaki Audio Decode", SCE_KERNEL_HIGHEST_PRIORITY_USER, SCE_KERNEL_CPU_MASK_USER_1)
+#define ROLE_ATTR_LOG ROLE_ATTR("Chiaki Log", SCE_KERNEL_LOWEST_PRIORITY_USER, 0)
+#define ROLE_ATTR_RECORDER ROLE_ATTR("Chiaki Recorder", SCE_KERNEL_LOWEST_PRIORITY_USER, 0)
+#define ROLE_ATTR_TELEMETRY ROLE_ATTR("Chiaki Telemetry", SCE_KERNEL_LOWEST_PRIORITY_USER, 0)
+#elif defined(_WIN32)
+#define ROLE_ATTR(name, priority, cpu_affinity_mask) { name, priority, cpu_affinity_mask, 0 }
+#define ROLE_ATTR_VIDEO_DECODE ROLE_ATTR("Chiaki Video Decode", 0, 0)
+#define ROLE_ATTR_AUDIO_DECODE ROLE_ATTR("Chiaki Audio Decode", THREAD_PRIORITY_HIGHEST, 0)
+#define ROLE_ATTR_LOG ROLE_ATTR("Chiaki Log", THREAD_PRIORITY_LOWEST, 0)
+#define ROLE_ATTR_RECORDER ROLE_ATTR("Chiaki Recorder", THREAD_PRIORITY_LOWEST, 0)
+#define ROLE_ATTR_TELEMETRY ROLE_ATTR("Chiaki Telemetry", THREAD_PRIORITY_LOWEST, 0)
+#else
+// raising the priority needs privileges on most systems, so only names are set
+#define ROLE_ATTR(name, priority, cpu_affinity_mask) { name, 0, 0, 0 }
+#define ROLE_ATTR_VIDEO_DECODE ROLE_ATTR("Chiaki Video Decode", 0, 0)
+#define ROLE_ATTR_AUDIO_DECODE ROLE_ATTR("Chiaki Audio Decode", 0, 0)
+#define ROLE_ATTR_LOG ROLE_ATTR("Chiaki Log", 0, 0)
+#define ROLE_ATTR_RECORDER ROLE_ATTR("Chiaki Recorder", 0, 0)
+#define ROLE_ATTR_TELEMETRY ROLE_ATTR("Chiaki Telemetry", 0, 0)
+#endif
+
+static ChiakiThreadAttr role_attrs[CHIAKI_THREAD_ROLE_COUNT] = {
+	[CHIAKI_THREAD_ROLE_DEFAULT] = ROLE_ATTR(NULL, 0, 0),
+	[CHIAKI_THREAD_ROLE_SESSION] = ROLE_ATTR("Chiaki Session", 0, 0),
+	[CHIAKI_THREAD_ROLE_CTRL] = ROLE_ATTR("Chiaki Ctrl", 0, 0),
+	[CHIAKI_THREAD_ROLE_TAKION] = ROLE_ATTR("Chiaki Takion", 0, 0),
+	[CHIAKI_THREAD_ROLE_TAKION_RECV] = ROLE_ATTR("Chiaki Takion Recv", 0, 0),
+	[CHIAKI_THREAD_ROLE_TAKION_MAC] = ROLE_ATTR("Chiaki Takion MAC", 0, 0),
+	[CHIAKI_THREAD_ROLE_RUDP_SEND_BUFFER] = ROLE_ATTR("Chiaki Rudp Send Buffer", 0, 0),
+	[CHIAKI_THREAD_ROLE_GKCRYPT] = ROLE_ATTR("Chiaki GKCrypt", 0, 0),
+	[CHIAKI_THREAD_ROLE_TIMER_WHEEL] = ROLE_ATTR("Chiaki Timer Wheel", 0, 0),
+	[CHIAKI_THREAD_ROLE_VIDEO_DECODE] = ROLE_ATTR_VIDEO_DECODE,
+	[CHIAKI_THREAD_ROLE_AUDIO_DECODE] = ROLE_ATTR_AUDIO_DECODE,
+	[CHIAKI_THREAD_ROLE_DISCOVERY] = ROLE_ATTR("Chiaki Discovery", 0, 0),
+	[CHIAKI_THREAD_ROLE_DISCOVERY_SERVICE] = ROLE_ATTR("Chiaki Discovery Service", 0, 0),
+	[CHIAKI_THREAD_ROLE_REGIST] = ROLE_ATTR("Chiaki Regist", 0, 0),
+	[CHIAKI_THREAD_ROLE_HOLEPUNCH] = ROLE_ATTR("Chiaki Holepunch WS", 0, 0),
+	[CHIAKI_THREAD_ROLE_LOG] = ROLE_ATTR_LOG,
+	[CHIAKI_THREAD_ROLE_RECORDER] = ROLE_ATTR_RECORDER,
+	[CHIAKI_THREAD_ROLE_TELEMETRY] = ROLE_ATTR_TELEMETRY,
+	[CHIAKI_THREAD_ROLE_FEC] = ROLE_ATTR("Chiaki FEC", 0, 0)
+};
+
+CHIAKI_EXPORT const char *chiaki_thread_role_string(ChiakiThreadRole role)
+{
+	switch(role)
+	{
+		case CHIAKI_THREAD_ROLE_DEFAULT:
+			return "default";
+		case CHIAKI_THREAD_ROLE_SESSION:
+			return "session";
+		case CHIAKI_THREAD_ROLE_CTRL:
+			return "ctrl";
+		case CHIAKI_THREAD_ROLE_TAKION:
+			return "takion";
+		case CHIAKI_THREAD_ROLE_TAKION_RECV:
+			return "takion recv";
+		case CHIAKI_THREAD_ROLE_TAKION_MAC:
+			return "takion mac";
+		case CHIAKI_THREAD_ROLE_RUDP_SEND_BUFFER:
+			return "rudp send buffer";
+		case CHIAKI_THREAD_ROLE_GKCRYPT:
+			return "gkcrypt";
+		case CHIAKI_THREAD_ROLE_TIMER_WHEEL:
+			return "timer wheel";
+		case CHIAKI_THREAD_ROLE_VIDEO_DECODE:
+			return "video decode";
+		case CHIAKI_THREAD_ROLE_AUDIO_DECODE:
+			return "audio decode";
+		case CHIAKI_THREAD_ROLE_DISCOVERY:
+			return "discovery";
+		case CHIAKI_THREAD_ROLE_DISCOVERY_SERVICE:
+			return "discovery service";
+		case CHIAKI_THREAD_ROLE_REGIST:
+			return "regist";
+		case CHIAKI_THREAD_ROLE_HOLEPUNCH:
+			return "holepunch";
+		case CHIAKI_THREAD_ROLE_LOG:
+			return "log";
+		case CHIAKI_THREAD_ROLE_RECORDER:
+			return "recorder";
+		case CHIAKI_THREAD_ROLE_TELEMETRY:
+			return "telemetry";
+		case CHIAKI_THREAD_ROLE_FEC:
+			return "fec";
+		default:
+			return "unknown";
+	}
+}
+
+CHIAKI_EXPORT void chiaki_thread_role_attr_set(ChiakiThreadRole role, const ChiakiThreadAttr *attr)
+{
+	if(role < 0 || role >= CHIAKI_THREAD_ROLE_COUNT)
+		return;
+	role_attrs[role] = *attr;
+}
+
+CHIAKI_EXPORT void chiaki_thread_role_attr_get(ChiakiThreadRole role, ChiakiThreadAttr *attr)
+{
+	if(role < 0 || role >= CHIAKI_THREAD_ROLE_COUNT)
+		role = CHIAKI_THREAD_ROLE_DEFAULT;
+	*attr = role_attrs[role];
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_create(ChiakiThread *thread, ChiakiThreadFunc func, void *arg)
 {
+	return chiaki_thread_create_attr(thread, func, arg, NULL);
+}
+
+// written by ending threads, so only atomics
+static size_t role_stats_threads[CHIAKI_THREAD_ROLE_COUNT];
+static size_t role_stats_cpu_ms[CHIAKI_THREAD_ROLE_COUNT];
+static size_t role_stats_cpu_affinity_mask[CHIAKI_THREAD_ROLE_COUNT];
+
+/**
+ * Running threads of a role, so their CPU time can be sampled before they end.
+ * A slot holds the role + 1 of its thread or 0 if it is free, and the clock
+ * to sample in role_live_clocks, a thread id on Vita or a CPU clock id with glibc.
+ * Threads beyond the slots are only accounted for when they end.
+ */
+#define ROLE_LIVE_SLOTS 32
+#define ROLE_LIVE_CLAIMED ((size_t)-1)
+static size_t role_live_slots[ROLE_LIVE_SLOTS];
+static size_t role_live_clocks[ROLE_LIVE_SLOTS];
+
+static bool role_live_clock_self(size_t *clock);
+static bool role_live_clock_cpu_us(size_t clock, uint64_t *cpu_us);
+
+static size_t role_live_register(ChiakiThreadRole role)
+{
+	size_t clock;
+	if(!role_live_clock_self(&clock))
+		return ROLE_LIVE_SLOTS;
+	for(size_t i=0; i<ROLE_LIVE_SLOTS; i++)
+	{
+		size_t expected = 0;
+		if(!chiaki_atomic_compare_exchange(&role_live_slots[i], &expected, ROLE_LIVE_CLAIMED))
+			continue;
+		role_live_clocks[i] = clock;
+		chiaki_atomic_store_release(&role_live_slots[i], (size_t)role + 1);
+		return i;
+	}
+	return ROLE_LIVE_SLOTS;
+}
+
+typedef struct role_thread_args_t
+{
+	ChiakiThreadFunc func;
+	void *arg;
+	ChiakiThreadRole role;
+} RoleThreadArgs;
+
+static void *role_thread_func(void *user)
+{
+	RoleThreadArgs args = *(RoleThreadArgs *)user;
+	free(user);
+	size_t live_slot = role_live_register(args.role);
+	void *ret = args.func(args.arg);
+	if(live_slot < ROLE_LIVE_SLOTS)
+		chiaki_atomic_store_release(&role_live_slots[live_slot], 0);
+
+	ChiakiThreadStats stats;
+	if(chiaki_thread_get_self_stats(&stats) == CHIAKI_ERR_SUCCESS)
+	{
+		chiaki_atomic_fetch_add(&role_stats_cpu_ms[args.role], (size_t)(stats.cpu_us / 1000));
+		chiaki_atomic_store_release(&role_stats_cpu_affinity_mask[args.role], stats.cpu_affinity_mask);
+	}
+	chiaki_atomic_fetch_add(&role_stats_threads[args.role], 1);
+	return ret;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_create_role(ChiakiThread *thread, ChiakiThreadFunc func, void *arg, ChiakiThreadRole role)
+{
+	if(role < 0 || role >= CHIAKI_THREAD_ROLE_COUNT)
+		role = CHIAKI_THREAD_ROLE_DEFAULT;
+	ChiakiThreadAttr attr;
+	chiaki_thread_role_attr_get(role, &attr);
+
+	RoleThreadArgs *args = malloc(sizeof(RoleThreadArgs));
+	if(!args)
+		return CHIAKI_ERR_MEMORY;
+	args->func = func;
+	args->arg = arg;
+	args->role = role;
+	ChiakiErrorCode err = chiaki_thread_create_attr(thread, role_thread_func, args, &attr);
+	if(err != CHIAKI_ERR_SUCCESS)
+		free(args);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_thread_role_stats_get(ChiakiThreadRole role, ChiakiThreadRoleStats *stats)
+{
+	if(role < 0 || role >= CHIAKI_THREAD_ROLE_COUNT)
+	{
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+	stats->threads = chiaki_atomic_load_acquire(&role_stats_threads[role]);
+	stats->cpu_ms = chiaki_atomic_load_acquire(&role_stats_cpu_ms[role]);
+	stats->cpu_affinity_mask = (unsigned int)chiaki_atomic_load_acquire(&role_stats_cpu_affinity_mask[role]);
+	stats->running = 0;
+	stats->running_cpu_ms = 0;
+	for(size_t i=0; i<ROLE_LIVE_SLOTS; i++)
+	{
+		if(chiaki_atomic_load_acquire(&role_live_slots[i]) != (size_t)role + 1)
+			continue;
+		// a thread ending right now may be counted in both, or not at all once its clock is gone
+		uint64_t cpu_us;
+		if(!role_live_clock_cpu_us(role_live_clocks[i], &cpu_us))
+			continue;
+		stats->running++;
+		stats->running_cpu_ms += (size_t)(cpu_us / 1000);
+	}
+}
+
+CHIAKI_EXPORT void chiaki_thread_role_stats_reset(void)
+{
+	for(size_t i=0; i<CHIAKI_THREAD_ROLE_COUNT; i++)
+	{
+		chiaki_atomic_store_release(&role_stats_threads[i], 0);
+		chiaki_atomic_store_release(&role_stats_cpu_ms[i], 0);
+		chiaki_atomic_store_release(&role_stats_cpu_affinity_mask[i], 0);
+	}
+}
+
+#if _WIN32
+static ChiakiErrorCode win32_thread_stats(HANDLE thread, ChiakiThreadStats *stats)
+{
+	FILETIME creation, exit, kernel, user;
+	if(!GetThreadTimes(thread, &creation, &exit, &kernel, &user))
+		return CHIAKI_ERR_THREAD;
+	uint64_t t = ((uint64_t)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime)
+		+ ((uint64_t)user.dwHighDateTime << 32 | user.dwLowDateTime);
+	stats->cpu_us = t / 10; // 100 ns units
+	stats->cpu_affinity_mask = 0;
+	stats->priority = GetThreadPriority(thread);
+	return CHIAKI_ERR_SUCCESS;
+}
+#elif defined(__PSVITA__)
+static ChiakiErrorCode vita_thread_stats(SceUID thread_id, ChiakiThreadStats *stats)
+{
+	SceKernelThreadInfo info;
+	memset(&info, 0, sizeof(info));
+	info.size = sizeof(info);
+	if(sceKernelGetThreadInfo(thread_id, &info) < 0)
+		return CHIAKI_ERR_THREAD;
+	stats->cpu_us = info.runClocks;
+	stats->cpu_affinity_mask = (unsigned int)info.currentCpuAffinityMask;
+	stats->priority = info.currentPriority;
+	return CHIAKI_ERR_SUCCESS;
+}
+#elif defined(__GLIBC__)
+static ChiakiErrorCode pthread_stats(pthread_t thread, clockid_t clock, ChiakiThreadStats *stats)
+{
+	struct timespec ts;
+	if(clock_gettime(clock, &ts) != 0)
+		return CHIAKI_ERR_THREAD;
+	stats->cpu_us = (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+	stats->cpu_affinity_mask = 0;
+	stats->priority = 0;
+	cpu_set_t cpus;
+	if(pthread_getaffinity_np(thread, sizeof(cpus), &cpus) == 0)
+	{
+		for(unsigned int i=0; i<sizeof(stats->cpu_affinity_mask) * 8; i++)
+			if(CPU_ISSET(i, &cpus))
+				stats->cpu_affinity_mask |= 1u << i;
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+#endif
+
+static bool role_live_clock_self(size_t *clock)
+{
+#if defined(__PSVITA__)
+	*clock = (size_t)sceKernelGetThreadId();
+	return true;
+#elif defined(__GLIBC__) && !_WIN32
+	// unlike a pthread_t, the clock id of an ended thread can still be queried safely, it just fails
+	clockid_t cpu_clock;
+	if(pthread_getcpuclockid(pthread_self(), &cpu_clock) != 0)
+		return false;
+	*clock = (size_t)cpu_clock;
+	return true;
+#else
+	(void)clock;
+	return false;
+#endif
+}
+
+static bool role_live_clock_cpu_us(size_t clock, uint64_t *cpu_us)
+{
+#if defined(__PSVITA__)
+	ChiakiThreadStats stats;
+	if(vita_thread_stats((SceUID)clock, &stats) != CHIAKI_ERR_SUCCESS)
+		return false;
+	*cpu_us = stats.cpu_us;
+	return true;
+#elif defined(__GLIBC__) && !_WIN32
+	struct timespec ts;
+	if(clock_gettime((clockid_t)clock, &ts) != 0)
+		return false;
+	*cpu_us = (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+	return true;
+#else
+	(void)clock;
+	(void)cpu_us;
+	return false;
+#endif
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_get_stats(ChiakiThread *thread, ChiakiThreadStats *stats)
+{
+#if _WIN32
+	return win32_thread_stats(thread->thread, stats);
+#elif defined(__PSVITA__)
+	return vita_thread_stats(thread->thread_id, stats);
+#elif defined(__GLIBC__)
+	clockid_t clock;
+	if(pthread_getcpuclockid(thread->thread, &clock) != 0)
+		return CHIAKI_ERR_THREAD;
+	return pthread_stats(thread->thread, clock, stats);
+#else
+	(void)thread;
+	memset(stats, 0, sizeof(*stats));
+	return CHIAKI_ERR_UNKNOWN;
+#endif
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_get_self_stats(ChiakiThreadStats *stats)
+{
+#if _WIN32
+	return win32_thread_stats(GetCurrentThread(), stats);
+#elif defined(__PSVITA__)
+	return vita_thread_stats(sceKernelGetThreadId(), stats);
+#elif defined(__GLIBC__)
+	return pthread_stats(pthread_self(), CLOCK_THREAD_CPUTIME_ID, stats);
+#else
+	memset(stats, 0, sizeof(*stats));
+	return CHIAKI_ERR_UNKNOWN;
+#endif
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_create_attr(ChiakiThread *thread, ChiakiThreadFunc func, void *arg, const ChiakiThreadAttr *attr)
+{
+	ChiakiThreadAttr defaults;
+	if(!attr)
+	{
+		memset(&defaults, 0, sizeof(defaults));
+		attr = &defaults;
+	}
 #if _WIN32
 	thread->func = func;
 	thread->arg = arg;
 	thread->ret = NULL;
-	thread->thread = CreateThread(NULL, 0, win32_thread_func, thread, 0, 0);
+	thread->thread = CreateThread(NULL, attr->stack_size, win32_thread_func, thread, 0, 0);
 	if(!thread->thread)
 		return CHIAKI_ERR_THREAD;
+	if(attr->priority)
+		SetThreadPriority(thread->thread, attr->priority);
+	if(attr->cpu_affinity_mask)
+		SetThreadAffinityMask(thread->thread, attr->cpu_affinity_mask);
 #elif defined(__PSVITA__)
-	snprintf(name_buffer, sizeof(name_buffer), "0x%08X", (unsigned int) thread);
-	thread->thread_id = sceKernelCreateThread(
-		name_buffer, psp_thread_wrap, 0x10000100, 0x10000, 0, 0, NULL);
+	const char *name = attr->name;
+	if(!name)
+	{
+		snprintf(name_buffer, sizeof(name_buffer), "0x%08X", (unsigned int) thread);
+		name = name_buffer;
+	}
+	thread->thread_id = sceKernelCreateThread(name, psp_thread_wrap,
+		attr->priority ? attr->priority : VITA_THREAD_PRIORITY_DEFAULT,
+		attr->stack_size ? attr->stack_size : VITA_THREAD_STACK_SIZE_DEFAULT,
+		0, attr->cpu_affinity_mask, NULL);
+	if (thread->thread_id < 0) {
+		return CHIAKI_ERR_THREAD;
+	}
 	sce_thread_args_struct sthread_args;
 	sthread_args.arg = arg;
 	sthread_args.func = func;
 	if (sceKernelStartThread(thread->thread_id, sizeof(sthread_args), &sthread_args) < 0) {
+		sceKernelDeleteThread(thread->thread_id);
 		return CHIAKI_ERR_THREAD;
 	}
 #else
@@ -81,9 +462,31 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_create(ChiakiThread *thread, ChiakiT
 	if(get_thread_limit() <= 1)
 		return CHIAKI_ERR_THREAD;
 #endif
-	int r = pthread_create(&thread->thread, NULL, func, arg);
+	pthread_attr_t pattr;
+	int r = pthread_attr_init(&pattr);
+	if(r != 0)
+		return CHIAKI_ERR_THREAD;
+	if(attr->stack_size)
+		pthread_attr_setstacksize(&pattr, attr->stack_size);
+#if defined(__GLIBC__)
+	if(attr->cpu_affinity_mask)
+	{
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		for(unsigned int i=0; i<sizeof(attr->cpu_affinity_mask) * 8; i++)
+			if(attr->cpu_affinity_mask & (1u << i))
+				CPU_SET(i, &cpus);
+		pthread_attr_setaffinity_np(&pattr, sizeof(cpus), &cpus);
+	}
+#endif
+	r = pthread_create(&thread->thread, &pattr, func, arg);
+	pthread_attr_destroy(&pattr);
 	if(r != 0)
 		return CHIAKI_ERR_THREAD;
+#endif
+#ifndef __PSVITA__
+	if(attr->name)
+		chiaki_thread_set_name(thread, attr->name);
 #endif
 	return CHIAKI_ERR_SUCCESS;
 }
@@ -141,8 +544,207 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_set_name(ChiakiThread *thread, const
 	return CHIAKI_ERR_SUCCESS;
 }
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_set_high_priority(ChiakiThread *thread)
+{
+#if _WIN32
+	if(!SetThreadPriority(thread->thread, THREAD_PRIORITY_HIGHEST))
+		return CHIAKI_ERR_THREAD;
+#elif defined(__PSVITA__)
+	if(sceKernelChangeThreadPriority(thread->thread_id, SCE_KERNEL_HIGHEST_PRIORITY_USER) < 0)
+		return CHIAKI_ERR_THREAD;
+#else
+	// raising the priority needs privileges on most systems, keep the default
+	(void)thread;
+#endif
+	return CHIAKI_ERR_SUCCESS;
+}
+
+#ifdef CHIAKI_LIB_ENABLE_LOCK_PROFILING
+/**
+ * Counters of all mutexes of a name. Mutexes of the same name may be locked at the same time, so everything
+ * is updated atomically.
+ */
+typedef struct chiaki_lock_profile_t
+{
+	const char *name;
+	uint64_t locks;
+	uint64_t contended;
+	uint64_t wait_us;
+	uint64_t wait_max_us;
+	uint64_t hold_us;
+	uint64_t hold_max_us;
+} ChiakiLockProfile;
+
+static ChiakiLockProfile lock_profiles[CHIAKI_LOCK_PROFILE_NAMES_MAX];
+static size_t lock_profiles_count = 0;
+static size_t lock_profiles_adding = 0; // spin lock for adding names, a ChiakiMutex would have to be profiled itself
+
+static void lock_profile_add(uint64_t *counter, uint64_t v)
+{
+	__atomic_fetch_add(counter, v, __ATOMIC_RELAXED);
+}
+
+static void lock_profile_max(uint64_t *max, uint64_t v)
+{
+	uint64_t cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+	while(v > cur && !__atomic_compare_exchange_n(max, &cur, v, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * Count the time the mutex was held so far, must be called while the mutex is locked.
+ */
+static void lock_profile_hold_end(ChiakiMutex *mutex)
+{
+	if(!mutex->profile || !mutex->depth)
+		return;
+	uint64_t hold_us = chiaki_time_now_monotonic_us() - mutex->locked_us;
+	lock_profile_add(&mutex->profile->hold_us, hold_us);
+	lock_profile_max(&mutex->profile->hold_max_us, hold_us);
+}
+
+/**
+ * Start counting the hold time again after waiting on a cond.
+ */
+static void lock_profile_hold_begin(ChiakiMutex *mutex)
+{
+	if(mutex->profile && mutex->depth)
+		mutex->locked_us = chiaki_time_now_monotonic_us();
+}
+
+static void lock_profile_acquired(ChiakiMutex *mutex, uint64_t start_us, bool contended)
+{
+	if(mutex->depth++)
+		return;
+	ChiakiLockProfile *profile = mutex->profile;
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	mutex->locked_us = now_us;
+	lock_profile_add(&profile->locks, 1);
+	if(!contended)
+		return;
+	lock_profile_add(&profile->contended, 1);
+	lock_profile_add(&profile->wait_us, now_us - start_us);
+	lock_profile_max(&profile->wait_max_us, now_us - start_us);
+}
+
+static void lock_profile_release(ChiakiMutex *mutex)
+{
+	if(!mutex->profile || !mutex->depth)
+		return;
+	if(mutex->depth == 1)
+		lock_profile_hold_end(mutex);
+	mutex->depth--;
+}
+#endif
+
+CHIAKI_EXPORT void chiaki_mutex_set_name(ChiakiMutex *mutex, const char *name)
+{
+#ifdef CHIAKI_LIB_ENABLE_LOCK_PROFILING
+	size_t unlocked = 0;
+	while(!chiaki_atomic_compare_exchange(&lock_profiles_adding, &unlocked, 1))
+		unlocked = 0;
+	ChiakiLockProfile *profile = NULL;
+	for(size_t i=0; i<lock_profiles_count; i++)
+	{
+		if(strcmp(lock_profiles[i].name, name) == 0)
+		{
+			profile = &lock_profiles[i];
+			break;
+		}
+	}
+	if(!profile && lock_profiles_count < CHIAKI_LOCK_PROFILE_NAMES_MAX)
+	{
+		profile = &lock_profiles[lock_profiles_count];
+		memset(profile, 0, sizeof(*profile));
+		profile->name = name;
+		chiaki_atomic_store_release(&lock_profiles_count, lock_profiles_count + 1);
+	}
+	chiaki_atomic_store_release(&lock_profiles_adding, 0);
+	mutex->profile = profile;
+#else
+	(void)mutex;
+	(void)name;
+#endif
+}
+
+#ifdef CHIAKI_LIB_ENABLE_LOCK_PROFILING
+static int lock_profile_stats_cmp(const void *a, const void *b)
+{
+	const ChiakiLockProfileStats *sa = a, *sb = b;
+	return sa->wait_us < sb->wait_us ? 1 : sa->wait_us > sb->wait_us ? -1 : 0;
+}
+#endif
+
+CHIAKI_EXPORT size_t chiaki_lock_profile_get(ChiakiLockProfileStats *stats, size_t stats_max)
+{
+#ifdef CHIAKI_LIB_ENABLE_LOCK_PROFILING
+	size_t count = chiaki_atomic_load_acquire(&lock_profiles_count);
+	if(count > stats_max)
+		count = stats_max;
+	for(size_t i=0; i<count; i++)
+	{
+		ChiakiLockProfile *profile = &lock_profiles[i];
+		stats[i].name = profile->name;
+		stats[i].locks = __atomic_load_n(&profile->locks, __ATOMIC_RELAXED);
+		stats[i].contended = __atomic_load_n(&profile->contended, __ATOMIC_RELAXED);
+		stats[i].wait_us = __atomic_load_n(&profile->wait_us, __ATOMIC_RELAXED);
+		stats[i].wait_max_us = __atomic_load_n(&profile->wait_max_us, __ATOMIC_RELAXED);
+		stats[i].hold_us = __atomic_load_n(&profile->hold_us, __ATOMIC_RELAXED);
+		stats[i].hold_max_us = __atomic_load_n(&profile->hold_max_us, __ATOMIC_RELAXED);
+	}
+	qsort(stats, count, sizeof(*stats), lock_profile_stats_cmp);
+	return count;
+#else
+	(void)stats;
+	(void)stats_max;
+	return 0;
+#endif
+}
+
+CHIAKI_EXPORT void chiaki_lock_profile_reset(void)
+{
+#ifdef CHIAKI_LIB_ENABLE_LOCK_PROFILING
+	size_t count = chiaki_atomic_load_acquire(&lock_profiles_count);
+	for(size_t i=0; i<count; i++)
+	{
+		ChiakiLockProfile *profile = &lock_profiles[i];
+		__atomic_store_n(&profile->locks, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&profile->contended, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&profile->wait_us, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&profile->wait_max_us, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&profile->hold_us, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&profile->hold_max_us, 0, __ATOMIC_RELAXED);
+	}
+#endif
+}
+
+CHIAKI_EXPORT void chiaki_lock_profile_log(ChiakiLog *log)
+{
+#ifdef CHIAKI_LIB_ENABLE_LOCK_PROFILING
+	ChiakiLockProfileStats stats[CHIAKI_LOCK_PROFILE_NAMES_MAX];
+	size_t count = chiaki_lock_profile_get(stats, CHIAKI_LOCK_PROFILE_NAMES_MAX);
+	CHIAKI_LOGI(log, "Lock profile, ranked by the time spent waiting:");
+	for(size_t i=0; i<count; i++)
+	{
+		ChiakiLockProfileStats *s = &stats[i];
+		if(!s->locks)
+			continue;
+		CHIAKI_LOGI(log, "%-24s %8llu locks, %6llu contended (%2llu%%), wait %6llu ms (max %6llu us), hold %6llu ms (max %6llu us)",
+				s->name, (unsigned long long)s->locks, (unsigned long long)s->contended,
+				(unsigned long long)(s->contended * 100 / s->locks),
+				(unsigned long long)(s->wait_us / 1000), (unsigned long long)s->wait_max_us,
+				(unsigned long long)(s->hold_us / 1000), (unsigned long long)s->hold_max_us);
+	}
+#else
+	(void)log;
+#endif
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_mutex_init(ChiakiMutex *mutex, bool rec)
 {
+#ifdef CHIAKI_LIB_ENABLE_LOCK_PROFILING
+	mutex->profile = NULL;
+	mutex->depth = 0;
+#endif
 #if _WIN32
 	InitializeCriticalSection(&mutex->cs);
 	(void)rec; // always recursive
@@ -187,7 +789,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_mutex_fini(ChiakiMutex *mutex)
 	return CHIAKI_ERR_SUCCESS;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_mutex_lock(ChiakiMutex *mutex)
+static ChiakiErrorCode mutex_lock_raw(ChiakiMutex *mutex)
 {
 #if _WIN32
 	EnterCriticalSection(&mutex->cs);
@@ -203,7 +805,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_mutex_lock(ChiakiMutex *mutex)
 	return CHIAKI_ERR_SUCCESS;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_mutex_trylock(ChiakiMutex *mutex)
+static ChiakiErrorCode mutex_trylock_raw(ChiakiMutex *mutex)
 {
 #if _WIN32
 	int r = TryEnterCriticalSection(&mutex->cs);
@@ -226,8 +828,40 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_mutex_trylock(ChiakiMutex *mutex)
 	return CHIAKI_ERR_SUCCESS;
 }
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_mutex_lock(ChiakiMutex *mutex)
+{
+#ifdef CHIAKI_LIB_ENABLE_LOCK_PROFILING
+	if(mutex->profile)
+	{
+		uint64_t start_us = chiaki_time_now_monotonic_us();
+		// failing to get it right away is what makes a lock contended
+		ChiakiErrorCode err = mutex_trylock_raw(mutex);
+		bool contended = err == CHIAKI_ERR_MUTEX_LOCKED;
+		if(contended)
+			err = mutex_lock_raw(mutex);
+		if(err == CHIAKI_ERR_SUCCESS)
+			lock_profile_acquired(mutex, start_us, contended);
+		return err;
+	}
+#endif
+	return mutex_lock_raw(mutex);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_mutex_trylock(ChiakiMutex *mutex)
+{
+	ChiakiErrorCode err = mutex_trylock_raw(mutex);
+#ifdef CHIAKI_LIB_ENABLE_LOCK_PROFILING
+	if(err == CHIAKI_ERR_SUCCESS && mutex->profile)
+		lock_profile_acquired(mutex, 0, false);
+#endif
+	return err;
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_mutex_unlock(ChiakiMutex *mutex)
 {
+#ifdef CHIAKI_LIB_ENABLE_LOCK_PROFILING
+	lock_profile_release(mutex);
+#endif
 #if _WIN32
 	LeaveCriticalSection(&mutex->cs);
 #elif defined(__PSVITA__)
@@ -291,7 +925,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_cond_fini(ChiakiCond *cond)
 	return CHIAKI_ERR_SUCCESS;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_cond_wait(ChiakiCond *cond, ChiakiMutex *mutex)
+static ChiakiErrorCode cond_wait_raw(ChiakiCond *cond, ChiakiMutex *mutex)
 {
 #if _WIN32
 	int r = SleepConditionVariableCS(&cond->cond, &mutex->cs, INFINITE);
@@ -310,10 +944,28 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_cond_wait(ChiakiCond *cond, ChiakiMutex *mu
 	return CHIAKI_ERR_SUCCESS;
 }
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_cond_wait(ChiakiCond *cond, ChiakiMutex *mutex)
+{
+#ifdef CHIAKI_LIB_ENABLE_LOCK_PROFILING
+	lock_profile_hold_end(mutex);
+	ChiakiErrorCode err = cond_wait_raw(cond, mutex);
+	lock_profile_hold_begin(mutex);
+	return err;
+#else
+	return cond_wait_raw(cond, mutex);
+#endif
+}
+
 #if !__APPLE__ && !defined(_WIN32) && !defined(__PSVITA__)
 static ChiakiErrorCode chiaki_cond_timedwait_abs(ChiakiCond *cond, ChiakiMutex *mutex, struct timespec *timeout)
 {
+#ifdef CHIAKI_LIB_ENABLE_LOCK_PROFILING
+	lock_profile_hold_end(mutex);
 	int r = pthread_cond_timedwait(&cond->cond, &mutex->mutex, timeout);
+	lock_profile_hold_begin(mutex);
+#else
+	int r = pthread_cond_timedwait(&cond->cond, &mutex->mutex, timeout);
+#endif
 	if(r != 0)
 	{
 		if(r == ETIMEDOUT)
@@ -381,7 +1033,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_timedjoin(ChiakiThread *thread, void
 }
 #endif
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_cond_timedwait(ChiakiCond *cond, ChiakiMutex *mutex, uint64_t timeout_ms)
+static ChiakiErrorCode cond_timedwait_raw(ChiakiCond *cond, ChiakiMutex *mutex, uint64_t timeout_ms)
 {
 #if _WIN32
 	int r = SleepConditionVariableCS(&cond->cond, &mutex->cs, (DWORD)timeout_ms);
@@ -421,6 +1073,19 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_cond_timedwait(ChiakiCond *cond, ChiakiMute
 #endif
 }
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_cond_timedwait(ChiakiCond *cond, ChiakiMutex *mutex, uint64_t timeout_ms)
+{
+#if defined(CHIAKI_LIB_ENABLE_LOCK_PROFILING) && (__APPLE__ || defined(_WIN32) || defined(__PSVITA__))
+	// chiaki_cond_timedwait_abs() takes care of it everywhere else
+	lock_profile_hold_end(mutex);
+	ChiakiErrorCode err = cond_timedwait_raw(cond, mutex, timeout_ms);
+	lock_profile_hold_begin(mutex);
+	return err;
+#else
+	return cond_timedwait_raw(cond, mutex, timeout_ms);
+#endif
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_cond_wait_pred(ChiakiCond *cond, ChiakiMutex *mutex, ChiakiCheckPred check_pred, void *check_pred_user)
 {
 	while(!check_pred(check_pred_user))
@@ -579,3 +1244,180 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_bool_pred_cond_broadcast(ChiakiBoolPredCond
 
 	return chiaki_cond_broadcast(&cond->cond);
 }
+
+#if defined(__linux__) && !defined(__PSVITA__)
+static int futex_wait(uint32_t *addr, uint32_t val, const struct timespec *timeout)
+{
+	return (int)syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+static void futex_wake(uint32_t *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+#endif
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_flags_init(ChiakiEventFlags *event)
+{
+#if defined(__PSVITA__)
+	snprintf(name_buffer, sizeof(name_buffer), "0x%08X", (unsigned int) event);
+	event->evf_id = sceKernelCreateEventFlag(name_buffer, SCE_EVENT_WAITMULTIPLE, 0, NULL);
+	if (event->evf_id < 0) {
+		return CHIAKI_ERR_UNKNOWN;
+	}
+#elif defined(__linux__)
+	event->bits = 0;
+	event->waiting = 0;
+#else
+	event->bits = 0;
+	ChiakiErrorCode err = chiaki_mutex_init(&event->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	err = chiaki_cond_init(&event->cond, &event->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		chiaki_mutex_fini(&event->mutex);
+		return err;
+	}
+#endif
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_flags_fini(ChiakiEventFlags *event)
+{
+#if defined(__PSVITA__)
+	if (sceKernelDeleteEventFlag(event->evf_id) < 0) {
+		return CHIAKI_ERR_UNKNOWN;
+	}
+#elif defined(__linux__)
+	(void)event;
+#else
+	ChiakiErrorCode err = chiaki_cond_fini(&event->cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	return chiaki_mutex_fini(&event->mutex);
+#endif
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_flags_set(ChiakiEventFlags *event, uint32_t bits)
+{
+#if defined(__PSVITA__)
+	if (sceKernelSetEventFlag(event->evf_id, bits) < 0) {
+		return CHIAKI_ERR_UNKNOWN;
+	}
+#elif defined(__linux__)
+	uint32_t prev = __atomic_fetch_or(&event->bits, bits, __ATOMIC_SEQ_CST);
+	// pairs with the increment of waiting in chiaki_event_flags_timedwait(), so either we see the waiter or it sees the bits
+	if((prev & bits) != bits && __atomic_load_n(&event->waiting, __ATOMIC_SEQ_CST))
+		futex_wake(&event->bits);
+#else
+	ChiakiErrorCode err = chiaki_mutex_lock(&event->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	event->bits |= bits;
+	chiaki_mutex_unlock(&event->mutex);
+	return chiaki_cond_signal(&event->cond);
+#endif
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static ChiakiErrorCode event_wait(ChiakiEventFlags *event, uint32_t mask, bool timed, uint64_t timeout_ms, uint32_t *bits_out)
+{
+	if(bits_out)
+		*bits_out = 0;
+#if defined(__PSVITA__)
+	SceUInt timeout_us = timeout_ms * 1000 > 0xffffffff ? 0xffffffff : (SceUInt)(timeout_ms * 1000);
+	unsigned int bits = 0;
+	int r = sceKernelWaitEventFlag(event->evf_id, mask, SCE_EVENT_WAITOR | SCE_EVENT_WAITCLEAR_PAT, &bits, timed ? &timeout_us : NULL);
+	if (r == SCE_KERNEL_ERROR_WAIT_TIMEOUT) {
+		return CHIAKI_ERR_TIMEOUT;
+	} else if (r < 0) {
+		return CHIAKI_ERR_UNKNOWN;
+	}
+	if (bits_out) {
+		*bits_out = bits & mask;
+	}
+	return CHIAKI_ERR_SUCCESS;
+#elif defined(__linux__)
+	uint64_t deadline_ms = timed ? chiaki_time_now_monotonic_ms() + timeout_ms : 0;
+	ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
+	__atomic_fetch_add(&event->waiting, 1, __ATOMIC_SEQ_CST);
+	while(true)
+	{
+		uint32_t cur = __atomic_load_n(&event->bits, __ATOMIC_SEQ_CST);
+		if(cur & mask)
+		{
+			if(!__atomic_compare_exchange_n(&event->bits, &cur, cur & ~mask, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+				continue;
+			if(bits_out)
+				*bits_out = cur & mask;
+			break;
+		}
+		struct timespec timeout;
+		if(timed)
+		{
+			uint64_t now_ms = chiaki_time_now_monotonic_ms();
+			if(now_ms >= deadline_ms)
+			{
+				err = CHIAKI_ERR_TIMEOUT;
+				break;
+			}
+			uint64_t left_ms = deadline_ms - now_ms;
+			timeout.tv_sec = left_ms / 1000;
+			timeout.tv_nsec = (left_ms % 1000) * 1000000;
+		}
+		if(futex_wait(&event->bits, cur, timed ? &timeout : NULL) != 0
+				&& errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT)
+		{
+			err = CHIAKI_ERR_THREAD;
+			break;
+		}
+	}
+	__atomic_fetch_sub(&event->waiting, 1, __ATOMIC_SEQ_CST);
+	return err;
+#else
+	uint64_t deadline_ms = timed ? chiaki_time_now_monotonic_ms() + timeout_ms : 0;
+	ChiakiErrorCode err = chiaki_mutex_lock(&event->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	while(!(event->bits & mask))
+	{
+		if(timed)
+		{
+			uint64_t now_ms = chiaki_time_now_monotonic_ms();
+			if(now_ms >= deadline_ms)
+			{
+				err = CHIAKI_ERR_TIMEOUT;
+				break;
+			}
+			err = chiaki_cond_timedwait(&event->cond, &event->mutex, deadline_ms - now_ms);
+			if(err == CHIAKI_ERR_TIMEOUT)
+				continue;
+		}
+		else
+			err = chiaki_cond_wait(&event->cond, &event->mutex);
+		if(err != CHIAKI_ERR_SUCCESS)
+			break;
+	}
+	if(event->bits & mask)
+	{
+		if(bits_out)
+			*bits_out = event->bits & mask;
+		event->bits &= ~mask;
+		err = CHIAKI_ERR_SUCCESS;
+	}
+	chiaki_mutex_unlock(&event->mutex);
+	return err;
+#endif
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_flags_timedwait(ChiakiEventFlags *event, uint32_t mask, uint64_t timeout_ms, uint32_t *bits_out)
+{
+	return event_wait(event, mask, true, timeout_ms, bits_out);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_event_flags_wait(ChiakiEventFlags *event, uint32_t mask, uint32_t *bits_out)
+{
+	return event_wait(event, mask, false, 0, bits_out);
+}
@@ -24,12 +24,12 @@ CHIAKI_EXPORT uint64_t chiaki_time_now_monotonic_us()
 	v.QuadPart /= f.QuadPart;
 	return v.QuadPart;
 #elif __PSVITA__
-	SceKernelSysClock clk;
-	sceKernelGetProcessTime(&clk);
-	return clk;
+	// returned directly instead of through a SceKernelSysClock, this is called for every packet
+	return sceKernelGetProcessTimeWide();
 #else
 	struct timespec time;
 	clock_gettime(CLOCK_MONOTONIC, &time);
-	return time.tv_sec * 1000000 + time.tv_nsec / 1000;
+	// time_t may be 32 bits
+	return (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
 #endif
 }
@@ -0,0 +1,273 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/timerwheel.h>
+#include <chiaki/time.h>
+
+#include <string.h>
+
+#define EVENT_WAKEUP 1
+
+static void *timer_wheel_thread_func(void *user);
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_timer_wheel_init(ChiakiTimerWheel *wheel, ChiakiLog *log)
+{
+	wheel->log = log;
+	wheel->should_stop = false;
+	memset(wheel->slots, 0, sizeof(wheel->slots));
+	wheel->tick = chiaki_time_now_monotonic_us() / CHIAKI_TIMER_WHEEL_TICK_US;
+	wheel->wakeup_us = UINT64_MAX;
+	wheel->running = NULL;
+
+	ChiakiErrorCode err = chiaki_mutex_init(&wheel->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	err = chiaki_cond_init(&wheel->task_done_cond, &wheel->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	err = chiaki_event_flags_init(&wheel->event);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_cond;
+
+	err = chiaki_thread_create_role(&wheel->thread, timer_wheel_thread_func, wheel, CHIAKI_THREAD_ROLE_TIMER_WHEEL);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_event;
+
+	return CHIAKI_ERR_SUCCESS;
+error_event:
+	chiaki_event_flags_fini(&wheel->event);
+error_cond:
+	chiaki_cond_fini(&wheel->task_done_cond);
+error_mutex:
+	chiaki_mutex_fini(&wheel->mutex);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_timer_wheel_fini(ChiakiTimerWheel *wheel)
+{
+	chiaki_mutex_lock(&wheel->mutex);
+	wheel->should_stop = true;
+	chiaki_mutex_unlock(&wheel->mutex);
+	chiaki_event_flags_set(&wheel->event, EVENT_WAKEUP);
+	chiaki_thread_join(&wheel->thread, NULL);
+
+	for(size_t i=0; i<CHIAKI_TIMER_WHEEL_SLOTS; i++)
+	{
+		for(ChiakiTimerTask *task = wheel->slots[i]; task; task = task->next)
+			CHIAKI_LOGW(wheel->log, "Timer Wheel task %s was still scheduled when stopping", task->name);
+	}
+
+	chiaki_event_flags_fini(&wheel->event);
+	chiaki_cond_fini(&wheel->task_done_cond);
+	chiaki_mutex_fini(&wheel->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_timer_task_init(ChiakiTimerTask *task, const char *name, ChiakiTimerTaskCallback cb, void *user)
+{
+	task->name = name;
+	task->cb = cb;
+	task->user = user;
+	task->prev = NULL;
+	task->next = NULL;
+	task->scheduled = false;
+	task->slot = 0;
+	task->due_us = 0;
+	task->fires = 0;
+	task->late_us_sum = 0;
+	task->late_us_max = 0;
+}
+
+/**
+ * Must be called with the mutex locked.
+ */
+static void task_unlink(ChiakiTimerWheel *wheel, ChiakiTimerTask *task)
+{
+	if(!task->scheduled)
+		return;
+	if(task->prev)
+		task->prev->next = task->next;
+	else
+		wheel->slots[task->slot] = task->next;
+	if(task->next)
+		task->next->prev = task->prev;
+	task->prev = task->next = NULL;
+	task->scheduled = false;
+}
+
+/**
+ * Put task into the slot of its due time, or of the current tick if that has already passed.
+ * Must be called with the mutex locked and task not scheduled.
+ */
+static void task_link(ChiakiTimerWheel *wheel, ChiakiTimerTask *task, uint64_t due_us)
+{
+	uint64_t tick = due_us / CHIAKI_TIMER_WHEEL_TICK_US;
+	if(tick < wheel->tick)
+		tick = wheel->tick;
+	task->slot = tick % CHIAKI_TIMER_WHEEL_SLOTS;
+	ChiakiTimerTask **slot = &wheel->slots[task->slot];
+	task->due_us = due_us;
+	task->prev = NULL;
+	task->next = *slot;
+	if(*slot)
+		(*slot)->prev = task;
+	*slot = task;
+	task->scheduled = true;
+}
+
+CHIAKI_EXPORT void chiaki_timer_wheel_schedule(ChiakiTimerWheel *wheel, ChiakiTimerTask *task, uint64_t delay_us)
+{
+	uint64_t due_us = chiaki_time_now_monotonic_us() + delay_us;
+	chiaki_mutex_lock(&wheel->mutex);
+	if(task->scheduled && task->due_us <= due_us)
+	{
+		chiaki_mutex_unlock(&wheel->mutex);
+		return;
+	}
+	task_unlink(wheel, task);
+	task_link(wheel, task, due_us);
+	bool wakeup = due_us < wheel->wakeup_us;
+	if(wakeup)
+		wheel->wakeup_us = due_us;
+	chiaki_mutex_unlock(&wheel->mutex);
+	if(wakeup)
+		chiaki_event_flags_set(&wheel->event, EVENT_WAKEUP);
+}
+
+CHIAKI_EXPORT void chiaki_timer_wheel_cancel(ChiakiTimerWheel *wheel, ChiakiTimerTask *task)
+{
+	chiaki_mutex_lock(&wheel->mutex);
+	while(wheel->running == task)
+		chiaki_cond_wait(&wheel->task_done_cond, &wheel->mutex);
+	task_unlink(wheel, task);
+	chiaki_mutex_unlock(&wheel->mutex);
+
+	ChiakiTimerTaskStats stats;
+	chiaki_timer_wheel_get_task_stats(wheel, task, &stats);
+	if(stats.fires)
+		CHIAKI_LOGI(wheel->log, "Timer Wheel task %s fired %llu times, late avg %.2f max %.2f ms",
+				task->name, (unsigned long long)stats.fires, stats.late_us_avg / 1000.0, stats.late_us_max / 1000.0);
+}
+
+CHIAKI_EXPORT void chiaki_timer_wheel_get_task_stats(ChiakiTimerWheel *wheel, ChiakiTimerTask *task, ChiakiTimerTaskStats *stats)
+{
+	chiaki_mutex_lock(&wheel->mutex);
+	stats->fires = task->fires;
+	stats->late_us_avg = task->fires ? task->late_us_sum / task->fires : 0;
+	stats->late_us_max = task->late_us_max;
+	chiaki_mutex_unlock(&wheel->mutex);
+}
+
+/**
+ * Fire all tasks in the slot of tick that are due at now_us.
+ * Must be called with the mutex locked, which is released during the callbacks.
+ */
+static void process_slot(ChiakiTimerWheel *wheel, uint64_t tick, uint64_t now_us)
+{
+	ChiakiTimerTask **slot = &wheel->slots[tick % CHIAKI_TIMER_WHEEL_SLOTS];
+	while(!wheel->should_stop)
+	{
+		// the slot may have changed while a callback ran, so start over after every one
+		ChiakiTimerTask *task = *slot;
+		while(task && task->due_us > now_us)
+			task = task->next;
+		if(!task)
+			break;
+
+		task_unlink(wheel, task);
+		uint64_t fire_us = chiaki_time_now_monotonic_us();
+		uint64_t late_us = fire_us - task->due_us;
+		task->fires++;
+		task->late_us_sum += late_us;
+		if(late_us > task->late_us_max)
+			task->late_us_max = late_us;
+		wheel->running = task;
+		chiaki_mutex_unlock(&wheel->mutex);
+
+		uint64_t next_us = task->cb(task->user, fire_us);
+
+		chiaki_mutex_lock(&wheel->mutex);
+		if(next_us != CHIAKI_TIMER_TASK_STOP)
+		{
+			if(next_us < CHIAKI_TIMER_WHEEL_TICK_US)
+				next_us = CHIAKI_TIMER_WHEEL_TICK_US;
+			uint64_t due_us = fire_us + next_us;
+			// it may have been scheduled again from another thread meanwhile
+			if(!task->scheduled || due_us < task->due_us)
+			{
+				task_unlink(wheel, task);
+				task_link(wheel, task, due_us);
+			}
+		}
+		wheel->running = NULL;
+		chiaki_cond_broadcast(&wheel->task_done_cond);
+	}
+}
+
+/**
+ * Must be called with the mutex locked.
+ *
+ * @return due time of the earliest scheduled task, UINT64_MAX if there is none
+ */
+static uint64_t next_due_us(ChiakiTimerWheel *wheel)
+{
+	uint64_t r = UINT64_MAX;
+	for(size_t i=0; i<CHIAKI_TIMER_WHEEL_SLOTS; i++)
+	{
+		for(ChiakiTimerTask *task = wheel->slots[i]; task; task = task->next)
+		{
+			if(task->due_us < r)
+				r = task->due_us;
+		}
+	}
+	return r;
+}
+
+static void *timer_wheel_thread_func(void *user)
+{
+	ChiakiTimerWheel *wheel = user;
+
+	chiaki_mutex_lock(&wheel->mutex);
+	while(!wheel->should_stop)
+	{
+		uint64_t now_us = chiaki_time_now_monotonic_us();
+		uint64_t now_tick = now_us / CHIAKI_TIMER_WHEEL_TICK_US;
+
+		// after a long stall every slot is visited once
+		uint64_t tick = wheel->tick;
+		if(now_tick - tick >= CHIAKI_TIMER_WHEEL_SLOTS)
+			tick = now_tick - CHIAKI_TIMER_WHEEL_SLOTS + 1;
+		for(; tick <= now_tick && !wheel->should_stop; tick++)
+		{
+			wheel->tick = tick;
+			process_slot(wheel, tick, now_us);
+		}
+		if(wheel->should_stop)
+			break;
+
+		// the current tick stays open for tasks that are due at a later point of it
+		wheel->tick = now_tick;
+		uint64_t due_us = next_due_us(wheel);
+		wheel->wakeup_us = due_us;
+		chiaki_mutex_unlock(&wheel->mutex);
+
+		now_us = chiaki_time_now_monotonic_us();
+		ChiakiErrorCode err;
+		if(due_us == UINT64_MAX)
+			err = chiaki_event_flags_wait(&wheel->event, EVENT_WAKEUP, NULL);
+		else if(due_us > now_us)
+			err = chiaki_event_flags_timedwait(&wheel->event, EVENT_WAKEUP, (due_us - now_us + 999) / 1000, NULL);
+		else
+			err = CHIAKI_ERR_SUCCESS;
+
+		chiaki_mutex_lock(&wheel->mutex);
+		if(err != CHIAKI_ERR_SUCCESS && err != CHIAKI_ERR_TIMEOUT)
+		{
+			CHIAKI_LOGE(wheel->log, "Timer Wheel failed to wait for its event");
+			break;
+		}
+	}
+	chiaki_mutex_unlock(&wheel->mutex);
+
+	return NULL;
+}
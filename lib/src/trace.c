@@ -0,0 +1,191 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/trace.h>
+#include <chiaki/atomic.h>
+#include <chiaki/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+typedef struct trace_ring_t
+{
+	ChiakiTraceRecord *records;
+	size_t pos; // number of records written since the start, claimed with an atomic add
+} TraceRing;
+
+static TraceRing trace_rings[CHIAKI_TRACE_TRACK_COUNT];
+static size_t trace_size_exp;
+static size_t trace_active;
+
+#define TRACE_SIZE (((size_t)1) << trace_size_exp)
+#define TRACE_MASK (TRACE_SIZE - 1)
+
+CHIAKI_EXPORT const char *chiaki_trace_track_string(ChiakiTraceTrack track)
+{
+	switch(track)
+	{
+		case CHIAKI_TRACE_TRACK_TAKION_RECV:
+			return "takion recv";
+		case CHIAKI_TRACE_TRACK_TAKION:
+			return "takion";
+		case CHIAKI_TRACE_TRACK_GKCRYPT:
+			return "gkcrypt";
+		case CHIAKI_TRACE_TRACK_FEEDBACK:
+			return "feedback";
+		case CHIAKI_TRACE_TRACK_VIDEO_DECODE:
+			return "video decode";
+		case CHIAKI_TRACE_TRACK_VIDEO_PRESENT:
+			return "video present";
+		case CHIAKI_TRACE_TRACK_AUDIO_OUTPUT:
+			return "audio output";
+		case CHIAKI_TRACE_TRACK_INPUT:
+			return "input";
+		default:
+			return "unknown";
+	}
+}
+
+CHIAKI_EXPORT const char *chiaki_trace_event_string(ChiakiTraceEvent event)
+{
+	switch(event)
+	{
+		case CHIAKI_TRACE_EVENT_PACKET_RECV:
+			return "packet recv";
+		case CHIAKI_TRACE_EVENT_FRAME_FLUSH_BEGIN:
+		case CHIAKI_TRACE_EVENT_FRAME_FLUSH_END:
+			return "frame flush";
+		case CHIAKI_TRACE_EVENT_FEC_BEGIN:
+		case CHIAKI_TRACE_EVENT_FEC_END:
+			return "fec";
+		case CHIAKI_TRACE_EVENT_KEY_STREAM_CHUNK:
+			return "key stream chunk";
+		case CHIAKI_TRACE_EVENT_FEEDBACK_STATE_SEND:
+			return "feedback state send";
+		case CHIAKI_TRACE_EVENT_FEEDBACK_HISTORY_SEND:
+			return "feedback history send";
+		case CHIAKI_TRACE_EVENT_DECODE_BEGIN:
+		case CHIAKI_TRACE_EVENT_DECODE_END:
+			return "decode";
+		case CHIAKI_TRACE_EVENT_PRESENT_BEGIN:
+		case CHIAKI_TRACE_EVENT_PRESENT_END:
+			return "present";
+		case CHIAKI_TRACE_EVENT_AUDIO_OUTPUT:
+			return "audio output";
+		case CHIAKI_TRACE_EVENT_INPUT_SAMPLE:
+			return "input sample";
+		default:
+			return "unknown";
+	}
+}
+
+/**
+ * @return the Chrome trace phase of event
+ */
+static char trace_event_phase(ChiakiTraceEvent event)
+{
+	switch(event)
+	{
+		case CHIAKI_TRACE_EVENT_FRAME_FLUSH_BEGIN:
+		case CHIAKI_TRACE_EVENT_FEC_BEGIN:
+		case CHIAKI_TRACE_EVENT_DECODE_BEGIN:
+		case CHIAKI_TRACE_EVENT_PRESENT_BEGIN:
+			return 'B';
+		case CHIAKI_TRACE_EVENT_FRAME_FLUSH_END:
+		case CHIAKI_TRACE_EVENT_FEC_END:
+		case CHIAKI_TRACE_EVENT_DECODE_END:
+		case CHIAKI_TRACE_EVENT_PRESENT_END:
+			return 'E';
+		default:
+			return 'i';
+	}
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_trace_init(size_t size_exp)
+{
+	trace_size_exp = size_exp;
+	for(size_t i=0; i<CHIAKI_TRACE_TRACK_COUNT; i++)
+	{
+		trace_rings[i].pos = 0;
+		trace_rings[i].records = calloc(TRACE_SIZE, sizeof(ChiakiTraceRecord));
+		if(!trace_rings[i].records)
+		{
+			chiaki_trace_fini();
+			return CHIAKI_ERR_MEMORY;
+		}
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_trace_fini()
+{
+	chiaki_atomic_store_release(&trace_active, 0);
+	for(size_t i=0; i<CHIAKI_TRACE_TRACK_COUNT; i++)
+	{
+		free(trace_rings[i].records);
+		trace_rings[i].records = NULL;
+	}
+}
+
+CHIAKI_EXPORT void chiaki_trace_start()
+{
+	if(!trace_rings[0].records)
+		return;
+	for(size_t i=0; i<CHIAKI_TRACE_TRACK_COUNT; i++)
+		chiaki_atomic_store_release(&trace_rings[i].pos, 0);
+	chiaki_atomic_store_release(&trace_active, 1);
+}
+
+CHIAKI_EXPORT void chiaki_trace_stop()
+{
+	chiaki_atomic_store_release(&trace_active, 0);
+}
+
+CHIAKI_EXPORT void chiaki_trace_event(ChiakiTraceTrack track, ChiakiTraceEvent event, uint32_t arg)
+{
+	if(!chiaki_atomic_load_acquire(&trace_active))
+		return;
+	TraceRing *ring = &trace_rings[track];
+	ChiakiTraceRecord *record = &ring->records[chiaki_atomic_fetch_add(&ring->pos, 1) & TRACE_MASK];
+	record->time_us = chiaki_time_now_monotonic_us();
+	record->event = (uint32_t)event;
+	record->arg = arg;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_trace_dump(const char *filename)
+{
+	if(!trace_rings[0].records)
+		return CHIAKI_ERR_UNINITIALIZED;
+	FILE *f = fopen(filename, "w");
+	if(!f)
+		return CHIAKI_ERR_UNKNOWN;
+
+	fprintf(f, "{\"traceEvents\":[\n");
+	bool first = true;
+	for(size_t i=0; i<CHIAKI_TRACE_TRACK_COUNT; i++)
+	{
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				first ? "" : ",\n", (int)i, chiaki_trace_track_string((ChiakiTraceTrack)i));
+		first = false;
+
+		TraceRing *ring = &trace_rings[i];
+		size_t end = chiaki_atomic_load_acquire(&ring->pos);
+		size_t begin = end > TRACE_SIZE ? end - TRACE_SIZE : 0;
+		for(size_t pos = begin; pos < end; pos++)
+		{
+			ChiakiTraceRecord *record = &ring->records[pos & TRACE_MASK];
+			if(record->event >= CHIAKI_TRACE_EVENT_COUNT)
+				continue;
+			ChiakiTraceEvent event = (ChiakiTraceEvent)record->event;
+			char phase = trace_event_phase(event);
+			fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",%s\"ts\":%llu,\"pid\":1,\"tid\":%d,\"args\":{\"arg\":%lu}}",
+					chiaki_trace_event_string(event), phase, phase == 'i' ? "\"s\":\"t\"," : "",
+					(unsigned long long)record->time_us, (int)i, (unsigned long)record->arg);
+		}
+	}
+	fprintf(f, "\n]}\n");
+
+	ChiakiErrorCode err = ferror(f) ? CHIAKI_ERR_UNKNOWN : CHIAKI_ERR_SUCCESS;
+	fclose(f);
+	return err;
+}
@@ -26,6 +26,10 @@
 
 #include <stdint.h>
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
 static inline ChiakiErrorCode set_port(struct sockaddr *sa, uint16_t port)
 {
 	if(sa->sa_family == AF_INET)
@@ -101,6 +105,10 @@ static inline int sendto_broadcast(ChiakiLog *log, chiaki_socket_t s, const void
 
 static inline void xor_bytes(uint8_t *dst, uint8_t *src, size_t sz)
 {
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	for(; sz >= 16; sz -= 16, dst += 16, src += 16)
+		vst1q_u8(dst, veorq_u8(vld1q_u8(dst), vld1q_u8(src)));
+#endif
 	while(sz > 0)
 	{
 		*dst ^= *src;
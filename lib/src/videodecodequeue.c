@@ -0,0 +1,223 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/videodecodequeue.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAME_AT(i) (&queue->frames[(queue->frames_head + (i)) % CHIAKI_VIDEO_DECODE_QUEUE_SIZE])
+
+static void *video_decode_queue_thread_func(void *user);
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_video_decode_queue_init(ChiakiVideoDecodeQueue *queue, ChiakiLog *log,
+		ChiakiVideoDecodeQueueCallback cb, void *cb_user)
+{
+	queue->log = log;
+	queue->cb = cb;
+	queue->cb_user = cb_user;
+	queue->should_stop = false;
+	queue->frames_head = 0;
+	queue->frames_count = 0;
+	memset(queue->bufs, 0, sizeof(queue->bufs));
+	queue->frames_dropped = 0;
+
+	ChiakiErrorCode err = chiaki_mutex_init(&queue->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	err = chiaki_cond_init(&queue->cond, &queue->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	err = chiaki_thread_create_role(&queue->thread, video_decode_queue_thread_func, queue, CHIAKI_THREAD_ROLE_VIDEO_DECODE);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_cond;
+
+	return CHIAKI_ERR_SUCCESS;
+error_cond:
+	chiaki_cond_fini(&queue->cond);
+error_mutex:
+	chiaki_mutex_fini(&queue->mutex);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_video_decode_queue_fini(ChiakiVideoDecodeQueue *queue)
+{
+	chiaki_mutex_lock(&queue->mutex);
+	queue->should_stop = true;
+	chiaki_mutex_unlock(&queue->mutex);
+	chiaki_cond_signal(&queue->cond);
+	chiaki_thread_join(&queue->thread, NULL);
+	chiaki_cond_fini(&queue->cond);
+	chiaki_mutex_fini(&queue->mutex);
+
+	if(queue->frames_dropped)
+		CHIAKI_LOGI(queue->log, "Video Decode Queue dropped %llu frames", (unsigned long long)queue->frames_dropped);
+
+	for(size_t i=0; i<CHIAKI_VIDEO_DECODE_QUEUE_BUFS_COUNT; i++)
+		free(queue->bufs[i].buf);
+}
+
+CHIAKI_EXPORT uint8_t *chiaki_video_decode_queue_buf_get(size_t size, void *user)
+{
+	ChiakiVideoDecodeQueue *queue = user;
+	chiaki_mutex_lock(&queue->mutex);
+
+	// prefer a buffer that is already big enough
+	ChiakiVideoDecodeQueueBuf *buf = NULL;
+	for(size_t i=0; i<CHIAKI_VIDEO_DECODE_QUEUE_BUFS_COUNT; i++)
+	{
+		ChiakiVideoDecodeQueueBuf *b = &queue->bufs[i];
+		if(b->in_use)
+			continue;
+		if(b->size >= size)
+		{
+			buf = b;
+			break;
+		}
+		if(!buf)
+			buf = b;
+	}
+
+	uint8_t *r = NULL;
+	if(!buf)
+	{
+		// should never happen by design
+		CHIAKI_LOGE(queue->log, "Video Decode Queue has no free buffer");
+		goto beach;
+	}
+
+	if(buf->size < size)
+	{
+		free(buf->buf);
+		buf->buf = malloc(size);
+		if(!buf->buf)
+		{
+			buf->size = 0;
+			goto beach;
+		}
+		buf->size = size;
+	}
+
+	buf->in_use = true;
+	r = buf->buf;
+beach:
+	chiaki_mutex_unlock(&queue->mutex);
+	return r;
+}
+
+static void buf_release(ChiakiVideoDecodeQueue *queue, uint8_t *buf)
+{
+	if(!buf)
+		return;
+	for(size_t i=0; i<CHIAKI_VIDEO_DECODE_QUEUE_BUFS_COUNT; i++)
+	{
+		if(queue->bufs[i].buf == buf)
+		{
+			queue->bufs[i].in_use = false;
+			return;
+		}
+	}
+}
+
+CHIAKI_EXPORT void chiaki_video_decode_queue_buf_release(ChiakiVideoDecodeQueue *queue, uint8_t *buf)
+{
+	chiaki_mutex_lock(&queue->mutex);
+	buf_release(queue, buf);
+	chiaki_mutex_unlock(&queue->mutex);
+}
+
+/**
+ * @return index in the queue of the frame to drop to make room, or frames_count if no frame can be dropped
+ */
+static size_t drop_candidate(ChiakiVideoDecodeQueue *queue)
+{
+	size_t r = queue->frames_count;
+	for(size_t i=0; i<queue->frames_count; i++)
+	{
+		ChiakiVideoDecodeQueueFrame *frame = FRAME_AT(i);
+		if(frame->frame_index < 0)
+			continue;
+		if(frame->slice_valid && !frame->slice.is_reference)
+			return i;
+		if(r == queue->frames_count)
+			r = i;
+	}
+	return r;
+}
+
+CHIAKI_EXPORT bool chiaki_video_decode_queue_push(ChiakiVideoDecodeQueue *queue, ChiakiVideoDecodeQueueFrame *frame)
+{
+	chiaki_mutex_lock(&queue->mutex);
+
+	if(queue->frames_count == CHIAKI_VIDEO_DECODE_QUEUE_SIZE)
+	{
+		size_t drop = drop_candidate(queue);
+		if(drop == queue->frames_count)
+		{
+			CHIAKI_LOGE(queue->log, "Video Decode Queue is full of headers, dropping frame %d", (int)frame->frame_index);
+			buf_release(queue, frame->buf);
+			chiaki_mutex_unlock(&queue->mutex);
+			return false;
+		}
+
+		ChiakiVideoDecodeQueueFrame *dropped = FRAME_AT(drop);
+		CHIAKI_LOGW(queue->log, "Video Decode Queue is full, dropping %sframe %d",
+				dropped->slice_valid && !dropped->slice.is_reference ? "non-reference " : "",
+				(int)dropped->frame_index);
+		buf_release(queue, dropped->buf);
+		queue->frames_dropped++;
+
+		// the next frame reports the dropped one as lost
+		int32_t frames_lost = dropped->frames_lost + 1;
+		for(size_t i=drop; i+1<queue->frames_count; i++)
+			*FRAME_AT(i) = *FRAME_AT(i+1);
+		queue->frames_count--;
+		if(drop < queue->frames_count)
+			FRAME_AT(drop)->frames_lost += frames_lost;
+		else
+			frame->frames_lost += frames_lost;
+	}
+
+	*FRAME_AT(queue->frames_count) = *frame;
+	queue->frames_count++;
+
+	chiaki_mutex_unlock(&queue->mutex);
+	chiaki_cond_signal(&queue->cond);
+	return true;
+}
+
+static bool queue_cond_check(void *user)
+{
+	ChiakiVideoDecodeQueue *queue = user;
+	return queue->should_stop || queue->frames_count;
+}
+
+static void *video_decode_queue_thread_func(void *user)
+{
+	ChiakiVideoDecodeQueue *queue = user;
+
+	ChiakiErrorCode err = chiaki_mutex_lock(&queue->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return NULL;
+
+	while(true)
+	{
+		err = chiaki_cond_wait_pred(&queue->cond, &queue->mutex, queue_cond_check, queue);
+		if(err != CHIAKI_ERR_SUCCESS || queue->should_stop)
+			break;
+
+		ChiakiVideoDecodeQueueFrame frame = *FRAME_AT(0);
+		queue->frames_head = (queue->frames_head + 1) % CHIAKI_VIDEO_DECODE_QUEUE_SIZE;
+		queue->frames_count--;
+
+		chiaki_mutex_unlock(&queue->mutex);
+		queue->cb(&frame, queue->cb_user);
+		chiaki_mutex_lock(&queue->mutex);
+
+		buf_release(queue, frame.buf);
+	}
+
+	chiaki_mutex_unlock(&queue->mutex);
+	return NULL;
+}
@@ -2,41 +2,74 @@
 
 #include <chiaki/videoreceiver.h>
 #include <chiaki/session.h>
+#include <chiaki/trace.h>
+#include <chiaki/time.h>
 
 #include <string.h>
 
-static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver);
+// a frame is given up on at most this many frame intervals after its first unit, however spread out frames arrive
+#define FRAME_DEADLINE_INTERVALS_MAX 3
 
-static void add_ref_frame(ChiakiVideoReceiver *video_receiver, int32_t frame)
+static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver, ChiakiVideoFrameSlot *slot);
+static void video_receiver_decode_frame(ChiakiVideoDecodeQueueFrame *frame, void *user);
+static void video_receiver_stream_slices(ChiakiVideoReceiver *video_receiver, ChiakiVideoFrameSlot *slot);
+static void video_receiver_stream_end(ChiakiVideoReceiver *video_receiver, ChiakiVideoFrameSlot *slot, uint8_t *frame, size_t frame_size);
+static void video_receiver_stream_abort(ChiakiVideoReceiver *video_receiver, ChiakiVideoFrameSlot *slot);
+
+static void ref_frames_init(ChiakiVideoRefFrames *ref_frames, unsigned int depth)
+{
+	if(!depth || depth > CHIAKI_VIDEO_REF_FRAMES_MAX)
+		depth = CHIAKI_VIDEO_REF_FRAMES_MAX;
+	ref_frames->bits = 0;
+	ref_frames->newest = -1;
+	ref_frames->depth = depth;
+}
+
+static void add_ref_frame(ChiakiVideoReceiver *video_receiver, ChiakiSeqNum16 frame)
 {
-	if(video_receiver->reference_frames[0] != -1)
+	ChiakiVideoRefFrames *ref_frames = &video_receiver->ref_frames;
+	if(ref_frames->newest < 0)
 	{
-		memmove(&video_receiver->reference_frames[1], &video_receiver->reference_frames[0], sizeof(int32_t) * 15);
-		video_receiver->reference_frames[0] = frame;
+		ref_frames->newest = frame;
+		ref_frames->bits = 1;
 		return;
 	}
-	for(int i=15; i>=0; i--)
+
+	ChiakiSeqNum16 newest = (ChiakiSeqNum16)ref_frames->newest;
+	if(chiaki_seq_num_16_gt(frame, newest))
 	{
-		if(video_receiver->reference_frames[i] == -1)
-		{
-			video_receiver->reference_frames[i] = frame;
-			return;
-		}
+		ChiakiSeqNum16 shift = frame - newest;
+		ref_frames->bits = shift < ref_frames->depth ? ref_frames->bits << shift : 0;
+		ref_frames->bits |= 1;
+		ref_frames->newest = frame;
+	}
+	else
+	{
+		ChiakiSeqNum16 age = newest - frame;
+		if(age < ref_frames->depth)
+			ref_frames->bits |= (uint32_t)1 << age;
 	}
+	ref_frames->bits &= ((uint32_t)1 << ref_frames->depth) - 1;
 }
 
-static bool have_ref_frame(ChiakiVideoReceiver *video_receiver, int32_t frame)
+static bool have_ref_frame(ChiakiVideoReceiver *video_receiver, ChiakiSeqNum16 frame)
 {
-	for(int i=0; i<16; i++)
-		if(video_receiver->reference_frames[i] == frame)
-			return true;
-	return false;
+	ChiakiVideoRefFrames *ref_frames = &video_receiver->ref_frames;
+	if(ref_frames->newest < 0 || chiaki_seq_num_16_gt(frame, (ChiakiSeqNum16)ref_frames->newest))
+		return false;
+	ChiakiSeqNum16 age = (ChiakiSeqNum16)ref_frames->newest - frame;
+	return age < ref_frames->depth && (ref_frames->bits >> age) & 1;
 }
 
-CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receiver, struct chiaki_session_t *session, ChiakiPacketStats *packet_stats)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_video_receiver_init(ChiakiVideoReceiver *video_receiver, struct chiaki_session_t *session, ChiakiPacketStats *packet_stats)
 {
 	video_receiver->session = session;
 	video_receiver->log = session->log;
+	ChiakiErrorCode err = chiaki_corrupt_frame_reporter_init(&video_receiver->corrupt_frame_reporter, video_receiver->log,
+			&session->stream_connection, session->connect_info.video_idr_request_frames);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
 	memset(video_receiver->profiles, 0, sizeof(video_receiver->profiles));
 	video_receiver->profiles_count = 0;
 	video_receiver->profile_cur = -1;
@@ -45,19 +78,108 @@ CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receive
 	video_receiver->frame_index_prev = -1;
 	video_receiver->frame_index_prev_complete = 0;
 
-	chiaki_frame_processor_init(&video_receiver->frame_processor, video_receiver->log);
-	video_receiver->packet_stats = packet_stats;
-
 	video_receiver->frames_lost = 0;
-	memset(video_receiver->reference_frames, -1, sizeof(video_receiver->reference_frames));
+	video_receiver->frames_lost_decode = 0;
+	ref_frames_init(&video_receiver->ref_frames, session->connect_info.video_ref_frames);
+	video_receiver->ref_frame_misses = 0;
+	video_receiver->ref_frame_retargets = 0;
 	chiaki_bitstream_init(&video_receiver->bitstream, video_receiver->log, video_receiver->session->connect_info.video_profile.codec);
+
+	video_receiver->decode_queue = NULL;
+	if(session->connect_info.video_decode_queue)
+	{
+		video_receiver->decode_queue = CHIAKI_NEW(ChiakiVideoDecodeQueue);
+		if(!video_receiver->decode_queue
+			|| chiaki_video_decode_queue_init(video_receiver->decode_queue, video_receiver->log, video_receiver_decode_frame, video_receiver) != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGE(video_receiver->log, "Video Receiver failed to start decode queue, decoding on the receiving thread");
+			free(video_receiver->decode_queue);
+			video_receiver->decode_queue = NULL;
+		}
+	}
+
+	video_receiver->fec_workers = NULL;
+	if(session->connect_info.fec_workers)
+	{
+		video_receiver->fec_workers = CHIAKI_NEW(ChiakiFecWorkers);
+		if(!video_receiver->fec_workers
+			|| chiaki_fec_workers_init(video_receiver->fec_workers, session->connect_info.fec_workers) != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGE(video_receiver->log, "Video Receiver failed to start FEC workers, recovering frames on the receiving thread");
+			free(video_receiver->fec_workers);
+			video_receiver->fec_workers = NULL;
+		}
+	}
+
+	video_receiver->slice_streaming = session->video_slice_cb && !video_receiver->decode_queue;
+	if(session->video_slice_cb && video_receiver->decode_queue)
+		CHIAKI_LOGW(video_receiver->log, "Video Receiver does not stream slices with the decode queue");
+
+	for(size_t i=0; i<CHIAKI_VIDEO_FRAME_SLOTS; i++)
+	{
+		ChiakiVideoFrameSlot *slot = &video_receiver->frame_slots[i];
+		slot->frame_index = -1;
+		slot->pending = false;
+		slot->deadline_us = 0;
+		chiaki_frame_processor_init(&slot->frame_processor, &session->arena, video_receiver->log);
+		chiaki_frame_processor_set_stream(&slot->frame_processor, video_receiver->slice_streaming);
+		chiaki_frame_processor_set_fec_workers(&slot->frame_processor, video_receiver->fec_workers);
+		if(video_receiver->decode_queue)
+			chiaki_frame_processor_set_buf_cb(&slot->frame_processor, chiaki_video_decode_queue_buf_get, video_receiver->decode_queue);
+		else
+			chiaki_frame_processor_set_buf_cb(&slot->frame_processor, session->video_au_buffer_cb, session->video_au_buffer_cb_user);
+	}
+	chiaki_stream_stats_reset(&video_receiver->stream_stats);
+	video_receiver->packet_stats = packet_stats;
+	video_receiver->delay_estimator = session->connect_info.congestion_control_delay_based
+		? &session->stream_connection.delay_estimator : NULL;
+	chiaki_backlog_detector_init(&video_receiver->backlog_detector, video_receiver->log,
+			session->connect_info.video_backlog_threshold_ms && session->connect_info.video_profile.max_fps
+			? 1000000 / session->connect_info.video_profile.max_fps : 0,
+			session->connect_info.video_backlog_threshold_ms);
+	video_receiver->frame_interval_us = session->connect_info.video_frame_deadline && session->connect_info.video_profile.max_fps
+		? 1000000 / session->connect_info.video_profile.max_fps : 0;
+	video_receiver->unit_spread_us = video_receiver->frame_interval_us;
+	video_receiver->frames_overdue = 0;
+	return CHIAKI_ERR_SUCCESS;
 }
 
 CHIAKI_EXPORT void chiaki_video_receiver_fini(ChiakiVideoReceiver *video_receiver)
 {
+	// first, because queued frames may still point to profile headers
+	if(video_receiver->decode_queue)
+	{
+		chiaki_video_decode_queue_fini(video_receiver->decode_queue);
+		free(video_receiver->decode_queue);
+	}
+	if(video_receiver->ref_frame_misses)
+		CHIAKI_LOGI(video_receiver->log, "Video Receiver missed reference frames for %llu frames, %llu of them changed to an older reference",
+				(unsigned long long)video_receiver->ref_frame_misses, (unsigned long long)video_receiver->ref_frame_retargets);
+
+	ChiakiBacklogStats *backlog = &video_receiver->backlog_detector.stats;
+	if(backlog->backlogs)
+		CHIAKI_LOGI(video_receiver->log, "Video Receiver skipped %llu stale frames in %llu backlogs (max age %llu ms), requested %llu IDR frames, %llu timed out",
+				(unsigned long long)backlog->frames_skipped, (unsigned long long)backlog->backlogs,
+				(unsigned long long)(backlog->age_max_us / 1000), (unsigned long long)backlog->idr_requests,
+				(unsigned long long)backlog->timeouts);
+	if(video_receiver->frames_overdue)
+		CHIAKI_LOGI(video_receiver->log, "Video Receiver flushed %llu frames at their deadline, average unit spread %llu us",
+				(unsigned long long)video_receiver->frames_overdue, (unsigned long long)video_receiver->unit_spread_us);
+
+	chiaki_corrupt_frame_reporter_fini(&video_receiver->corrupt_frame_reporter);
+
 	for(size_t i=0; i<video_receiver->profiles_count; i++)
 		free(video_receiver->profiles[i].header);
-	chiaki_frame_processor_fini(&video_receiver->frame_processor);
+	for(size_t i=0; i<CHIAKI_VIDEO_FRAME_SLOTS; i++)
+		chiaki_frame_processor_fini(&video_receiver->frame_slots[i].frame_processor);
+
+	if(video_receiver->fec_workers)
+	{
+		CHIAKI_LOGI(video_receiver->log, "Video Receiver split %llu frame recoveries across %zu FEC workers",
+				(unsigned long long)video_receiver->fec_workers->splits, video_receiver->fec_workers->count);
+		chiaki_fec_workers_fini(video_receiver->fec_workers);
+		free(video_receiver->fec_workers);
+	}
 }
 
 CHIAKI_EXPORT void chiaki_video_receiver_stream_info(ChiakiVideoReceiver *video_receiver, ChiakiVideoProfile *profiles, size_t profiles_count)
@@ -80,12 +202,152 @@ CHIAKI_EXPORT void chiaki_video_receiver_stream_info(ChiakiVideoReceiver *video_
 	}
 }
 
+static ChiakiVideoFrameSlot *frame_slot_find(ChiakiVideoReceiver *video_receiver, ChiakiSeqNum16 frame_index)
+{
+	for(size_t i=0; i<CHIAKI_VIDEO_FRAME_SLOTS; i++)
+	{
+		ChiakiVideoFrameSlot *slot = &video_receiver->frame_slots[i];
+		if(slot->frame_index >= 0 && (ChiakiSeqNum16)slot->frame_index == frame_index)
+			return slot;
+	}
+	return NULL;
+}
+
+/**
+ * @return the pending slot with the oldest frame that is older than frame_index, or NULL
+ */
+static ChiakiVideoFrameSlot *frame_slot_oldest_pending(ChiakiVideoReceiver *video_receiver, ChiakiSeqNum16 frame_index)
+{
+	ChiakiVideoFrameSlot *r = NULL;
+	for(size_t i=0; i<CHIAKI_VIDEO_FRAME_SLOTS; i++)
+	{
+		ChiakiVideoFrameSlot *slot = &video_receiver->frame_slots[i];
+		if(!slot->pending || !chiaki_seq_num_16_lt((ChiakiSeqNum16)slot->frame_index, frame_index))
+			continue;
+		if(!r || chiaki_seq_num_16_lt((ChiakiSeqNum16)slot->frame_index, (ChiakiSeqNum16)r->frame_index))
+			r = slot;
+	}
+	return r;
+}
+
+/**
+ * Flush all pending frames older than frame_index, because frames must be passed on in order.
+ */
+static void flush_frames_before(ChiakiVideoReceiver *video_receiver, ChiakiSeqNum16 frame_index)
+{
+	ChiakiVideoFrameSlot *slot;
+	while((slot = frame_slot_oldest_pending(video_receiver, frame_index)))
+		chiaki_video_receiver_flush_frame(video_receiver, slot);
+}
+
+/**
+ * Start skipping stale frames: everything pending is skipped too, and an IDR frame is requested to resume from.
+ */
+static void backlog_skip_pending(ChiakiVideoReceiver *video_receiver, bool request_idr)
+{
+	for(size_t i=0; i<CHIAKI_VIDEO_FRAME_SLOTS; i++)
+	{
+		ChiakiVideoFrameSlot *slot = &video_receiver->frame_slots[i];
+		if(slot->pending)
+			slot->backlog_skip = true;
+	}
+	if(request_idr)
+		stream_connection_send_idr_request(&video_receiver->session->stream_connection);
+}
+
+/**
+ * A keyframe of a skipped backlog arrived, it and everything after it is passed on again.
+ */
+static void backlog_resume(ChiakiVideoReceiver *video_receiver, ChiakiVideoFrameSlot *keyframe_slot)
+{
+	ChiakiSeqNum16 frame_index = (ChiakiSeqNum16)keyframe_slot->frame_index;
+	uint64_t skipped = chiaki_backlog_detector_keyframe(&video_receiver->backlog_detector);
+	CHIAKI_LOGI(video_receiver->log, "Video Receiver resuming at keyframe %d after skipping %llu stale frames",
+			(int)frame_index, (unsigned long long)skipped);
+	for(size_t i=0; i<CHIAKI_VIDEO_FRAME_SLOTS; i++)
+	{
+		ChiakiVideoFrameSlot *slot = &video_receiver->frame_slots[i];
+		if(slot->pending && !chiaki_seq_num_16_lt((ChiakiSeqNum16)slot->frame_index, frame_index))
+			slot->backlog_skip = false;
+	}
+}
+
+/**
+ * @return whether the packet is the first unit of a frame that starts with an I slice
+ */
+static bool packet_is_keyframe(ChiakiVideoReceiver *video_receiver, ChiakiTakionAVPacket *packet)
+{
+	if(packet->unit_index != 0 || packet->data_size <= 2)
+		return false;
+	// units start with 2 bytes that are not part of the frame, see chiaki_frame_processor_flush()
+	ChiakiBitstreamSlice slice;
+	return chiaki_bitstream_slice(&video_receiver->bitstream, packet->data + 2, (unsigned)(packet->data_size - 2), &slice)
+		&& slice.slice_type == CHIAKI_BITSTREAM_SLICE_I;
+}
+
+/**
+ * @return when a frame whose first unit arrived at first_unit_us is flushed at the latest, 0 if frames have no deadline
+ */
+static uint64_t frame_deadline(ChiakiVideoReceiver *video_receiver, uint64_t first_unit_us)
+{
+	if(!video_receiver->frame_interval_us)
+		return 0;
+	uint64_t wait_us = video_receiver->frame_interval_us + 2 * video_receiver->unit_spread_us;
+	if(wait_us > FRAME_DEADLINE_INTERVALS_MAX * video_receiver->frame_interval_us)
+		wait_us = FRAME_DEADLINE_INTERVALS_MAX * video_receiver->frame_interval_us;
+	return first_unit_us + wait_us;
+}
+
+/**
+ * Learn how far apart the first and last unit of a completely received frame arrived.
+ */
+static void frame_unit_spread_push(ChiakiVideoReceiver *video_receiver, ChiakiLatencyFrame *latency)
+{
+	if(!video_receiver->frame_interval_us)
+		return;
+	uint64_t first_us = latency->stamps[CHIAKI_LATENCY_STAMP_FIRST_UNIT];
+	uint64_t last_us = latency->stamps[CHIAKI_LATENCY_STAMP_LAST_UNIT];
+	uint64_t spread_us = last_us > first_us ? last_us - first_us : 0;
+	video_receiver->unit_spread_us = (7 * video_receiver->unit_spread_us + spread_us) / 8;
+}
+
+static ChiakiVideoFrameSlot *frame_slot_next(ChiakiVideoReceiver *video_receiver, ChiakiSeqNum16 frame_index)
+{
+	while(true)
+	{
+		// prefer the slot with the oldest frame, which will not get any more late units
+		ChiakiVideoFrameSlot *r = NULL;
+		for(size_t i=0; i<CHIAKI_VIDEO_FRAME_SLOTS; i++)
+		{
+			ChiakiVideoFrameSlot *slot = &video_receiver->frame_slots[i];
+			if(slot->pending)
+				continue;
+			if(slot->frame_index < 0)
+				return slot;
+			if(!r || chiaki_seq_num_16_lt((ChiakiSeqNum16)slot->frame_index, (ChiakiSeqNum16)r->frame_index))
+				r = slot;
+		}
+		if(r)
+			return r;
+
+		// all slots still assembling, give up on the oldest one
+		ChiakiVideoFrameSlot *oldest = frame_slot_oldest_pending(video_receiver, frame_index);
+		if(!oldest)
+			return NULL;
+		chiaki_video_receiver_flush_frame(video_receiver, oldest);
+	}
+}
+
 CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_receiver, ChiakiTakionAVPacket *packet)
 {
+	if(video_receiver->delay_estimator)
+		chiaki_delay_estimator_packet(video_receiver->delay_estimator, packet->data_size);
+
 	// old frame?
 	ChiakiSeqNum16 frame_index = packet->frame_index;
-	if(video_receiver->frame_index_cur >= 0
-		&& chiaki_seq_num_16_lt(frame_index, (ChiakiSeqNum16)video_receiver->frame_index_cur))
+	ChiakiVideoFrameSlot *slot = frame_slot_find(video_receiver, frame_index);
+	if(!slot && video_receiver->frame_index_cur >= 0
+		&& !chiaki_seq_num_16_gt(frame_index, (ChiakiSeqNum16)video_receiver->frame_index_cur))
 	{
 		CHIAKI_LOGW(video_receiver->log, "Video Receiver received old frame packet");
 		return;
@@ -105,104 +367,278 @@ CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_re
 
 		ChiakiVideoProfile *profile = video_receiver->profiles + video_receiver->profile_cur;
 		CHIAKI_LOGI(video_receiver->log, "Switched to profile %d, resolution: %ux%u", video_receiver->profile_cur, profile->width, profile->height);
-		if(video_receiver->session->video_sample_cb)
-			video_receiver->session->video_sample_cb(profile->header, profile->header_sz, 0, false, video_receiver->session->video_sample_cb_user);
 		if(!chiaki_bitstream_header(&video_receiver->bitstream, profile->header, profile->header_sz))
 			CHIAKI_LOGE(video_receiver->log, "Failed to parse video header");
+
+		ChiakiVideoDecodeQueueFrame header = { 0 };
+		header.buf = profile->header;
+		header.buf_size = profile->header_sz;
+		header.frame_index = -1;
+		header.bitstream = video_receiver->bitstream;
+		if(video_receiver->decode_queue)
+			chiaki_video_decode_queue_push(video_receiver->decode_queue, &header);
+		else
+			video_receiver_decode_frame(&header, video_receiver);
 	}
 
 	// next frame?
-	if(video_receiver->frame_index_cur < 0 ||
-		chiaki_seq_num_16_gt(frame_index, (ChiakiSeqNum16)video_receiver->frame_index_cur))
+	if(!slot)
 	{
-		if(video_receiver->packet_stats)
-			chiaki_frame_processor_report_packet_stats(&video_receiver->frame_processor, video_receiver->packet_stats);
-
-		// last frame not flushed yet?
-		if(video_receiver->frame_index_cur >= 0 && video_receiver->frame_index_prev != video_receiver->frame_index_cur)
-			chiaki_video_receiver_flush_frame(video_receiver);
-
-		ChiakiSeqNum16 next_frame_expected = (ChiakiSeqNum16)(video_receiver->frame_index_prev_complete + 1);
-		if(chiaki_seq_num_16_gt(frame_index, next_frame_expected)
-			&& !(frame_index == 1 && video_receiver->frame_index_cur < 0)) // ok for frame 1
+		slot = frame_slot_next(video_receiver, frame_index);
+		if(!slot)
 		{
-			CHIAKI_LOGW(video_receiver->log, "Detected missing or corrupt frame(s) from %d to %d", next_frame_expected, (int)frame_index);
-			stream_connection_send_corrupt_frame(&video_receiver->session->stream_connection, next_frame_expected, frame_index - 1);
+			// should never happen by design
+			CHIAKI_LOGE(video_receiver->log, "Video Receiver has no free frame slot");
+			return;
 		}
 
+		// the frame previously in this slot will not receive any more units
+		if(slot->frame_index >= 0 && video_receiver->packet_stats)
+			chiaki_frame_processor_report_packet_stats(&slot->frame_processor, video_receiver->packet_stats);
+
 		video_receiver->frame_index_cur = frame_index;
-		chiaki_frame_processor_alloc_frame(&video_receiver->frame_processor, packet);
+		slot->frame_index = frame_index;
+		slot->pending = true;
+		slot->stream_started = false;
+		slot->stream_failed = false;
+		slot->stream_recovered = false;
+		slot->stream_frames_lost = 0;
+		slot->stream_emitted = 0;
+		slot->stream_scan = 0;
+		chiaki_latency_frame_reset(&slot->latency);
+		chiaki_latency_frame_stamp(&slot->latency, CHIAKI_LATENCY_STAMP_FIRST_UNIT);
+		slot->deadline_us = frame_deadline(video_receiver, slot->latency.stamps[CHIAKI_LATENCY_STAMP_FIRST_UNIT]);
+		if(video_receiver->delay_estimator)
+			chiaki_delay_estimator_frame(video_receiver->delay_estimator, frame_index, slot->latency.stamps[CHIAKI_LATENCY_STAMP_FIRST_UNIT]);
+		chiaki_frame_processor_alloc_frame(&slot->frame_processor, packet);
+
+		ChiakiBacklogAction backlog = chiaki_backlog_detector_frame(&video_receiver->backlog_detector, frame_index,
+				slot->latency.stamps[CHIAKI_LATENCY_STAMP_FIRST_UNIT]);
+		slot->backlog_skip = false;
+		if(backlog == CHIAKI_BACKLOG_ACTION_SKIP_REQUEST_IDR)
+			backlog_skip_pending(video_receiver, true);
+		else if(backlog == CHIAKI_BACKLOG_ACTION_SKIP)
+			slot->backlog_skip = true;
+	}
+
+	// units of an already flushed frame are only counted for the packet stats
+	chiaki_frame_processor_put_unit(&slot->frame_processor, packet);
+
+	if(!slot->pending)
+		return;
+
+	if(slot->backlog_skip && packet_is_keyframe(video_receiver, packet))
+		backlog_resume(video_receiver, slot);
+
+	// if we are currently building up this frame and already have enough for all of it, flush it already
+	if(chiaki_frame_processor_flush_possible(&slot->frame_processor) || packet->unit_index == packet->units_in_frame_total - 1)
+	{
+		chiaki_latency_frame_stamp(&slot->latency, CHIAKI_LATENCY_STAMP_LAST_UNIT);
+		if(packet->unit_index == packet->units_in_frame_total - 1)
+			frame_unit_spread_push(video_receiver, &slot->latency);
+		flush_frames_before(video_receiver, frame_index);
+		chiaki_video_receiver_flush_frame(video_receiver, slot);
 	}
+	else if(video_receiver->slice_streaming && !slot->backlog_skip && !frame_slot_oldest_pending(video_receiver, frame_index))
+		video_receiver_stream_slices(video_receiver, slot);
+}
 
-	chiaki_frame_processor_put_unit(&video_receiver->frame_processor, packet);
+CHIAKI_EXPORT void chiaki_video_receiver_check_deadlines(ChiakiVideoReceiver *video_receiver, uint64_t now_us)
+{
+	if(!video_receiver->frame_interval_us)
+		return;
 
-	// if we are currently building up a frame
-	if(video_receiver->frame_index_cur != video_receiver->frame_index_prev)
+	// the newest overdue frame, everything older goes with it because frames are passed on in order
+	ChiakiVideoFrameSlot *overdue = NULL;
+	for(size_t i=0; i<CHIAKI_VIDEO_FRAME_SLOTS; i++)
 	{
-		// if we already have enough for the whole frame, flush it already
-		if(chiaki_frame_processor_flush_possible(&video_receiver->frame_processor) || packet->unit_index == packet->units_in_frame_total - 1)
-			chiaki_video_receiver_flush_frame(video_receiver);
+		ChiakiVideoFrameSlot *slot = &video_receiver->frame_slots[i];
+		if(!slot->pending || !slot->deadline_us || now_us < slot->deadline_us)
+			continue;
+		if(!overdue || chiaki_seq_num_16_gt((ChiakiSeqNum16)slot->frame_index, (ChiakiSeqNum16)overdue->frame_index))
+			overdue = slot;
 	}
+	if(!overdue)
+		return;
+
+	ChiakiSeqNum16 frame_index = (ChiakiSeqNum16)overdue->frame_index;
+	ChiakiFrameProcessor *frame_processor = &overdue->frame_processor;
+	CHIAKI_LOGV(video_receiver->log, "Video Receiver frame %d is %llu us past its deadline, flushing it with %u of %u units",
+			(int)frame_index, (unsigned long long)(now_us - overdue->deadline_us),
+			frame_processor->units_source_received + frame_processor->units_fec_received, frame_processor->units_source_expected);
+	video_receiver->frames_overdue++;
+	flush_frames_before(video_receiver, frame_index);
+	chiaki_video_receiver_flush_frame(video_receiver, overdue);
 }
 
-static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver)
+static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver, ChiakiVideoFrameSlot *slot)
 {
+	ChiakiSeqNum16 frame_index = (ChiakiSeqNum16)slot->frame_index;
+	slot->pending = false;
+	chiaki_corrupt_frame_reporter_poll(&video_receiver->corrupt_frame_reporter);
+
+	if(slot->backlog_skip)
+	{
+		// nothing older is coming anymore and an IDR frame has been requested, so gaps are not reported either
+		chiaki_frame_processor_discard(&slot->frame_processor);
+		if(video_receiver->decode_queue)
+			chiaki_video_decode_queue_buf_release(video_receiver->decode_queue, slot->frame_processor.frame_buf_cur);
+		if(video_receiver->slice_streaming)
+			video_receiver_stream_abort(video_receiver, slot);
+		chiaki_backlog_detector_skipped(&video_receiver->backlog_detector);
+		video_receiver->frame_index_prev = frame_index;
+		video_receiver->frame_index_prev_complete = frame_index;
+		return CHIAKI_ERR_SUCCESS;
+	}
+
+	ChiakiSeqNum16 next_frame_expected = (ChiakiSeqNum16)(video_receiver->frame_index_prev_complete + 1);
+	if(chiaki_seq_num_16_gt(frame_index, next_frame_expected)
+		&& !(frame_index == 1 && video_receiver->frame_index_prev < 0)) // ok for frame 1
+	{
+		CHIAKI_LOGW(video_receiver->log, "Detected missing or corrupt frame(s) from %d to %d", next_frame_expected, (int)frame_index);
+		chiaki_corrupt_frame_reporter_report(&video_receiver->corrupt_frame_reporter, next_frame_expected, frame_index - 1);
+	}
+
 	uint8_t *frame;
 	size_t frame_size;
-	ChiakiFrameProcessorFlushResult flush_result = chiaki_frame_processor_flush(&video_receiver->frame_processor, &frame, &frame_size);
+	CHIAKI_TRACE(TAKION, FRAME_FLUSH_BEGIN, frame_index);
+	ChiakiFrameProcessorFlushResult flush_result = chiaki_frame_processor_flush(&slot->frame_processor, &frame, &frame_size);
+	CHIAKI_TRACE(TAKION, FRAME_FLUSH_END, flush_result);
+	chiaki_video_stats_flush(&video_receiver->session->video_stats, flush_result);
+	ChiakiBitstreamSlice slice = { 0 };
+	bool slice_valid = false;
+	if(flush_result != CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED)
+	{
+		chiaki_latency_frame_stamp(&slot->latency, CHIAKI_LATENCY_STAMP_FEC_DONE);
+		slice_valid = chiaki_bitstream_slice(&video_receiver->bitstream, frame, frame_size, &slice);
+		uint64_t now_us = chiaki_time_now_monotonic_us();
+		ChiakiBitstreamSliceType slice_type = slice_valid ? slice.slice_type : CHIAKI_BITSTREAM_SLICE_UNKNOWN;
+		chiaki_stream_stats_frame(&video_receiver->stream_stats, (uint64_t)frame_size, slice_type, now_us);
+		chiaki_video_stats_frame(&video_receiver->session->video_stats, (uint64_t)frame_size, slice_type, now_us);
+	}
 
 	if(flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED
 		|| flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED)
 	{
+		if(video_receiver->decode_queue)
+			chiaki_video_decode_queue_buf_release(video_receiver->decode_queue, slot->frame_processor.frame_buf_cur);
+		if(video_receiver->slice_streaming)
+			video_receiver_stream_abort(video_receiver, slot);
 		if (flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED)
 		{
-			ChiakiSeqNum16 next_frame_expected = (ChiakiSeqNum16)(video_receiver->frame_index_prev_complete + 1);
-			stream_connection_send_corrupt_frame(&video_receiver->session->stream_connection, next_frame_expected, video_receiver->frame_index_cur);
-			video_receiver->frames_lost += video_receiver->frame_index_cur - next_frame_expected + 1;
-			video_receiver->frame_index_prev = video_receiver->frame_index_cur;
+			chiaki_corrupt_frame_reporter_report(&video_receiver->corrupt_frame_reporter, next_frame_expected, frame_index);
+			video_receiver->frames_lost += frame_index - next_frame_expected + 1;
+			video_receiver->frame_index_prev = frame_index;
 		}
-		CHIAKI_LOGW(video_receiver->log, "Failed to complete frame %d", (int)video_receiver->frame_index_cur);
+		CHIAKI_LOGW(video_receiver->log, "Failed to complete frame %d", (int)frame_index);
 		return CHIAKI_ERR_UNKNOWN;
 	}
 
-	bool succ = flush_result != CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED;
-	bool recovered = false;
+	video_receiver->frame_index_prev = frame_index;
+	video_receiver->frame_index_prev_complete = frame_index;
 
-	ChiakiBitstreamSlice slice;
-	if(chiaki_bitstream_slice(&video_receiver->bitstream, frame, frame_size, &slice))
+	if(video_receiver->slice_streaming)
 	{
-		if(slice.slice_type == CHIAKI_BITSTREAM_SLICE_P)
+		video_receiver_stream_end(video_receiver, slot, frame, frame_size);
+		return CHIAKI_ERR_SUCCESS;
+	}
+
+	ChiakiVideoDecodeQueueFrame decode_frame = { 0 };
+	decode_frame.buf = frame;
+	decode_frame.buf_size = frame_size;
+	decode_frame.frame_index = frame_index;
+	decode_frame.frames_lost = video_receiver->frames_lost;
+	video_receiver->frames_lost = 0;
+	decode_frame.slice_valid = slice_valid;
+	decode_frame.slice = slice;
+	decode_frame.bitstream = video_receiver->bitstream;
+	decode_frame.latency = slot->latency;
+
+	if(video_receiver->decode_queue)
+		chiaki_video_decode_queue_push(video_receiver->decode_queue, &decode_frame);
+	else
+		video_receiver_decode_frame(&decode_frame, video_receiver);
+
+	return CHIAKI_ERR_SUCCESS;
+}
+
+/**
+ * Check that the frame a P slice references has been decoded and change the reference to an older one if not.
+ *
+ * @return false if the frame can not be decoded
+ */
+static bool check_reference_frame(ChiakiVideoReceiver *video_receiver, ChiakiBitstream *bitstream, ChiakiSeqNum16 frame_index,
+		ChiakiBitstreamSlice *slice, uint8_t *buf, size_t buf_size, bool *recovered)
+{
+	*recovered = false;
+	if(slice->slice_type != CHIAKI_BITSTREAM_SLICE_P)
+		return true;
+
+	ChiakiSeqNum16 ref_frame_index = frame_index - slice->reference_frame - 1;
+	if(slice->reference_frame == 0xff || have_ref_frame(video_receiver, ref_frame_index))
+		return true;
+
+	video_receiver->ref_frame_misses++;
+	for(unsigned i=slice->reference_frame+1; i<CHIAKI_VIDEO_REF_FRAMES_MAX; i++)
+	{
+		ChiakiSeqNum16 ref_frame_index_new = frame_index - i - 1;
+		if(have_ref_frame(video_receiver, ref_frame_index_new))
 		{
-			ChiakiSeqNum16 ref_frame_index = video_receiver->frame_index_cur - slice.reference_frame - 1;
-			if(slice.reference_frame != 0xff && !have_ref_frame(video_receiver, ref_frame_index))
+			if(chiaki_bitstream_slice_set_reference_frame(bitstream, buf, buf_size, i))
 			{
-				for(unsigned i=slice.reference_frame+1; i<16; i++)
-				{
-					ChiakiSeqNum16 ref_frame_index_new = video_receiver->frame_index_cur - i - 1;
-					if(have_ref_frame(video_receiver, ref_frame_index_new))
-					{
-						if(chiaki_bitstream_slice_set_reference_frame(&video_receiver->bitstream, frame, frame_size, i))
-						{
-							recovered = true;
-							CHIAKI_LOGW(video_receiver->log, "Missing reference frame %d for decoding frame %d -> changed to %d", (int)ref_frame_index, (int)video_receiver->frame_index_cur, (int)ref_frame_index_new);
-						}
-						break;
-					}
-				}
-				if(!recovered)
-				{
-					succ = false;
-					video_receiver->frames_lost++;
-					CHIAKI_LOGW(video_receiver->log, "Missing reference frame %d for decoding frame %d", (int)ref_frame_index, (int)video_receiver->frame_index_cur);
-				}
+				*recovered = true;
+				video_receiver->ref_frame_retargets++;
+				CHIAKI_LOGW(video_receiver->log, "Missing reference frame %d for decoding frame %d -> changed to %d", (int)ref_frame_index, (int)frame_index, (int)ref_frame_index_new);
 			}
+			break;
 		}
 	}
+	chiaki_video_stats_ref_frame_miss(&video_receiver->session->video_stats, *recovered);
+	if(!*recovered)
+		CHIAKI_LOGW(video_receiver->log, "Missing reference frame %d for decoding frame %d", (int)ref_frame_index, (int)frame_index);
+	return *recovered;
+}
+
+/**
+ * Second half of handling a frame, after it has been assembled.
+ * Runs on the decode queue's thread if there is one, so reference tracking is based on what the sink actually got.
+ */
+static void video_receiver_decode_frame(ChiakiVideoDecodeQueueFrame *frame, void *user)
+{
+	ChiakiVideoReceiver *video_receiver = user;
+	ChiakiSession *session = video_receiver->session;
+
+	ChiakiRecorder *recorder = session->connect_info.recorder;
+	if(frame->frame_index < 0)
+	{
+		if(recorder)
+			chiaki_recorder_video(recorder, frame->buf, frame->buf_size, true);
+		if(video_receiver->slice_streaming)
+			session->video_slice_cb(frame->buf, frame->buf_size, true, false, 0, false, session->video_slice_cb_user);
+		else if(session->video_sample_cb)
+			session->video_sample_cb(frame->buf, frame->buf_size, 0, false, session->video_sample_cb_user);
+		return;
+	}
+
+	ChiakiSeqNum16 frame_index = (ChiakiSeqNum16)frame->frame_index;
+	video_receiver->frames_lost_decode += frame->frames_lost;
+
+	bool recovered = false;
+	ChiakiBitstreamSlice *slice = &frame->slice;
+	bool succ = !frame->slice_valid
+		|| check_reference_frame(video_receiver, &frame->bitstream, frame_index, slice, frame->buf, frame->buf_size, &recovered);
+	if(!succ)
+		video_receiver->frames_lost_decode++;
+
+	// exactly what the sink gets, so the recording decodes the way the stream did
+	if(succ && recorder)
+		chiaki_recorder_video(recorder, frame->buf, frame->buf_size, frame->slice_valid && slice->slice_type == CHIAKI_BITSTREAM_SLICE_I);
 
-	if(succ && video_receiver->session->video_sample_cb)
+	if(succ && session->video_sample_cb)
 	{
-		bool cb_succ = video_receiver->session->video_sample_cb(frame, frame_size, video_receiver->frames_lost, recovered, video_receiver->session->video_sample_cb_user);
-		video_receiver->frames_lost = 0;
+		chiaki_latency_stats_sink_frame(&session->latency_stats, &frame->latency);
+		bool cb_succ = session->video_sample_cb(frame->buf, frame->buf_size, video_receiver->frames_lost_decode, recovered, session->video_sample_cb_user);
+		video_receiver->frames_lost_decode = 0;
 		if(!cb_succ)
 		{
 			succ = false;
@@ -210,15 +646,138 @@ static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *vi
 		}
 		else
 		{
-			add_ref_frame(video_receiver, video_receiver->frame_index_cur);
-			CHIAKI_LOGV(video_receiver->log, "Added reference %c frame %d", slice.slice_type == CHIAKI_BITSTREAM_SLICE_I ? 'I' : 'P', (int)video_receiver->frame_index_cur);
+			add_ref_frame(video_receiver, frame_index);
+			chiaki_corrupt_frame_reporter_frame_decoded(&video_receiver->corrupt_frame_reporter);
+			CHIAKI_LOGT(video_receiver->log, "Added reference %c frame %d", slice->slice_type == CHIAKI_BITSTREAM_SLICE_I ? 'I' : 'P', (int)frame_index);
 		}
 	}
 
-	video_receiver->frame_index_prev = video_receiver->frame_index_cur;
+	// the frame was assembled completely, but could not be decoded, so the server must not reference it anymore
+	if(!succ)
+		chiaki_corrupt_frame_reporter_report_unrecoverable(&video_receiver->corrupt_frame_reporter, frame_index);
+}
 
-	if(succ)
-		video_receiver->frame_index_prev_complete = video_receiver->frame_index_cur;
+/**
+ * @return offset of the start code of the last NAL unit that begins after slot->stream_emitted in buf,
+ * which is where the slices before it end, or slot->stream_emitted if there is none yet
+ */
+static size_t stream_find_slices_end(ChiakiVideoFrameSlot *slot, uint8_t *buf, size_t size)
+{
+	size_t end = slot->stream_emitted;
+	size_t i = slot->stream_scan;
+	if(i < slot->stream_emitted + 1) // skip the start code of the first slice not passed on yet
+		i = slot->stream_emitted + 1;
+	while(i + 3 <= size)
+	{
+		size_t start = i + chiaki_bitstream_find_startcode(buf + i, size - i);
+		if(start == size)
+		{
+			i = size - 2; // the last 2 bytes may still become the beginning of a start code
+			break;
+		}
+		end = buf[start-1] == 0 ? start - 1 : start; // 4 byte start code
+		i = start + 3;
+	}
+	slot->stream_scan = i;
+	return end;
+}
 
-	return CHIAKI_ERR_SUCCESS;
+/**
+ * Check the reference frame of the first slice before anything of the frame is passed on.
+ *
+ * @return false if the frame can not be decoded
+ */
+static bool video_receiver_stream_begin(ChiakiVideoReceiver *video_receiver, ChiakiVideoFrameSlot *slot, uint8_t *buf, size_t size)
+{
+	slot->stream_started = true;
+	slot->stream_frames_lost = video_receiver->frames_lost + video_receiver->frames_lost_decode;
+	video_receiver->frames_lost = 0;
+	video_receiver->frames_lost_decode = 0;
+
+	ChiakiBitstreamSlice slice;
+	if(chiaki_bitstream_slice(&video_receiver->bitstream, buf, size, &slice)
+		&& !check_reference_frame(video_receiver, &video_receiver->bitstream, (ChiakiSeqNum16)slot->frame_index, &slice, buf, size, &slot->stream_recovered))
+	{
+		slot->stream_failed = true;
+		video_receiver->frames_lost_decode = slot->stream_frames_lost + 1; // reported with the next frame
+		return false;
+	}
+	chiaki_latency_stats_sink_frame(&video_receiver->session->latency_stats, &slot->latency);
+	return true;
+}
+
+static void video_receiver_stream_emit(ChiakiVideoReceiver *video_receiver, ChiakiVideoFrameSlot *slot, uint8_t *buf, size_t size, bool frame_end)
+{
+	ChiakiSession *session = video_receiver->session;
+	if(session->video_slice_cb(buf, size, frame_end, false, slot->stream_frames_lost, slot->stream_recovered, session->video_slice_cb_user))
+		return;
+
+	CHIAKI_LOGW(video_receiver->log, "Video slice callback did not process slices of frame %d successfully.", (int)slot->frame_index);
+	slot->stream_failed = true;
+	if(!frame_end)
+		session->video_slice_cb(NULL, 0, true, true, slot->stream_frames_lost, slot->stream_recovered, session->video_slice_cb_user);
+}
+
+/**
+ * Pass on all slices of the frame that have been received completely so far.
+ * Must only be called for the oldest pending frame, so slices stay in order.
+ */
+static void video_receiver_stream_slices(ChiakiVideoReceiver *video_receiver, ChiakiVideoFrameSlot *slot)
+{
+	if(slot->stream_failed)
+		return;
+
+	uint8_t *buf;
+	size_t size = chiaki_frame_processor_stream(&slot->frame_processor, &buf);
+	size_t end = stream_find_slices_end(slot, buf, size);
+	if(end <= slot->stream_emitted)
+		return;
+
+	if(!slot->stream_started && !video_receiver_stream_begin(video_receiver, slot, buf, end))
+		return;
+
+	video_receiver_stream_emit(video_receiver, slot, buf + slot->stream_emitted, end - slot->stream_emitted, false);
+	slot->stream_emitted = end;
+}
+
+/**
+ * Pass on the rest of a successfully flushed frame.
+ */
+static void video_receiver_stream_end(ChiakiVideoReceiver *video_receiver, ChiakiVideoFrameSlot *slot, uint8_t *frame, size_t frame_size)
+{
+	ChiakiSeqNum16 frame_index = (ChiakiSeqNum16)slot->frame_index;
+
+	if(!slot->stream_started)
+		video_receiver_stream_begin(video_receiver, slot, frame, frame_size);
+
+	if(!slot->stream_failed)
+		video_receiver_stream_emit(video_receiver, slot, frame + slot->stream_emitted, frame_size - slot->stream_emitted, true);
+	slot->stream_emitted = frame_size;
+
+	if(slot->stream_failed)
+	{
+		// the frame was assembled completely, but could not be decoded, so the server must not reference it anymore
+		chiaki_corrupt_frame_reporter_report_unrecoverable(&video_receiver->corrupt_frame_reporter, frame_index);
+		return;
+	}
+
+	add_ref_frame(video_receiver, frame_index);
+	chiaki_corrupt_frame_reporter_frame_decoded(&video_receiver->corrupt_frame_reporter);
+	CHIAKI_LOGT(video_receiver->log, "Added reference frame %d", (int)frame_index);
+}
+
+/**
+ * Discard what has been passed on of a frame that could not be completed.
+ */
+static void video_receiver_stream_abort(ChiakiVideoReceiver *video_receiver, ChiakiVideoFrameSlot *slot)
+{
+	if(!slot->stream_started || slot->stream_failed)
+		return;
+	slot->stream_failed = true;
+	video_receiver->frames_lost_decode += slot->stream_frames_lost;
+	if(slot->stream_emitted)
+	{
+		ChiakiSession *session = video_receiver->session;
+		session->video_slice_cb(NULL, 0, true, true, slot->stream_frames_lost, slot->stream_recovered, session->video_slice_cb_user);
+	}
 }
@@ -0,0 +1,76 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/videostats.h>
+
+#include <string.h>
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_video_stats_init(ChiakiVideoStats *stats)
+{
+	memset(&stats->counters, 0, sizeof(stats->counters));
+	chiaki_stream_stats_reset(&stats->stream);
+	ChiakiErrorCode err = chiaki_mutex_init(&stats->mutex, false);
+	if(err == CHIAKI_ERR_SUCCESS)
+		chiaki_mutex_set_name(&stats->mutex, "video stats");
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_video_stats_fini(ChiakiVideoStats *stats)
+{
+	chiaki_mutex_fini(&stats->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_video_stats_flush(ChiakiVideoStats *stats, ChiakiFrameProcessorFlushResult result)
+{
+	chiaki_mutex_lock(&stats->mutex);
+	stats->counters.frames++;
+	switch(result)
+	{
+		case CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS:
+			stats->counters.frames_fec_recovered++;
+			break;
+		case CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED:
+		case CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED:
+			stats->counters.frames_failed++;
+			break;
+		default:
+			break;
+	}
+	chiaki_mutex_unlock(&stats->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_video_stats_ref_frame_miss(ChiakiVideoStats *stats, bool retargeted)
+{
+	chiaki_mutex_lock(&stats->mutex);
+	stats->counters.ref_frame_misses++;
+	if(retargeted)
+		stats->counters.ref_frame_retargets++;
+	chiaki_mutex_unlock(&stats->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_video_stats_set_bitrate(ChiakiVideoStats *stats, uint64_t bitrate)
+{
+	chiaki_mutex_lock(&stats->mutex);
+	stats->counters.bitrate = bitrate;
+	chiaki_mutex_unlock(&stats->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_video_stats_frame(ChiakiVideoStats *stats, uint64_t size, ChiakiBitstreamSliceType slice_type, uint64_t now_us)
+{
+	chiaki_mutex_lock(&stats->mutex);
+	chiaki_stream_stats_frame(&stats->stream, size, slice_type, now_us);
+	chiaki_mutex_unlock(&stats->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_video_stats_get(ChiakiVideoStats *stats, ChiakiVideoStatsCounters *counters)
+{
+	chiaki_mutex_lock(&stats->mutex);
+	*counters = stats->counters;
+	chiaki_mutex_unlock(&stats->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_video_stats_get_stream(ChiakiVideoStats *stats, uint64_t now_us, ChiakiStreamStatsSnapshot *snapshot)
+{
+	chiaki_mutex_lock(&stats->mutex);
+	chiaki_stream_stats_snapshot(&stats->stream, now_us, snapshot);
+	chiaki_mutex_unlock(&stats->mutex);
+}
@@ -1,7 +1,26 @@
 #pragma once
 
+#include <stdint.h>
+
+typedef struct vita_audio_stats_t {
+  unsigned int buffered_ms;
+  unsigned int target_ms; // jitter buffer target depth
+  uint32_t underruns; // times the device ran dry with nothing to output
+  uint32_t overruns; // times the buffer was full and skipped ahead
+  uint32_t dropped; // near-silent frames dropped to shrink the buffer
+  uint32_t duplicated; // near-silent frames duplicated to grow it
+  int drift_ppm; // playback rate correction for the clock drift to the host
+} VitaAudioStats;
+
 void vita_audio_init(unsigned int channels, unsigned int rate, void *user);
 
 void vita_audio_cb(int16_t *buf, size_t samples_count, void *user);
 
+// Where the next decoded frame should go, so it does not have to be copied
+int16_t *vita_audio_buf_cb(size_t samples_count, void *user);
+
 void vita_audio_cleanup();
+
+// Audio queued for output, in the intermediate buffer and the device, in ms
+unsigned int vita_audio_buffered_ms();
+void vita_audio_get_stats(VitaAudioStats *stats);
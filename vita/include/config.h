@@ -6,6 +6,10 @@
 
 #define CFG_VERSION 1
 #define CFG_FILENAME "ux0:data/vita-chiaki/chiaki.toml"
+#define CFG_HOST_CACHE_FILENAME "ux0:data/vita-chiaki/hosts.bin"
+#define TRACE_FILENAME "ux0:data/vita-chiaki/trace.json"
+#define CAPTURE_FILENAME "ux0:data/vita-chiaki/capture.bin"
+#define RECORDING_FILENAME "ux0:data/vita-chiaki/recording.bin"
 
 /// Action to perform after terminating a session
 typedef enum vita_chiaki_disconnect_action_t {
@@ -14,6 +18,59 @@ typedef enum vita_chiaki_disconnect_action_t {
   DISCONNECT_ACTION_NOTHING,  // Just leave the console running
 } VitaChiakiDisconnectAction;
 
+/// How decoded frames are presented
+typedef enum vita_chiaki_frame_pacing_t {
+  FRAME_PACING_LOWEST_LATENCY,  // Present the newest frame as soon as possible, drop older ones
+  FRAME_PACING_SMOOTHEST,       // Present frames in order at a steady vblank cadence
+} VitaChiakiFramePacing;
+
+/// When the input thread samples buttons, touch and motion
+typedef enum vita_chiaki_input_sampling_t {
+  INPUT_SAMPLING_VBLANK,    // Once per vblank, right after the system has taken a new sample
+  INPUT_SAMPLING_BLOCKING,  // Block in sceCtrlReadBufferPositive until the next button sample
+  INPUT_SAMPLING_FEEDBACK,  // Every 8 ms, the minimum interval between two feedback packets
+} VitaChiakiInputSampling;
+
+/// Which cores the streaming threads run on
+typedef enum vita_chiaki_thread_placement_t {
+  THREAD_PLACEMENT_SPREAD,   // Network reader and crypto on core 0, decode and present on core 1, audio and input on core 2
+  THREAD_PLACEMENT_DEFAULT,  // Keep the placement of the library, most threads may run on any core
+} VitaChiakiThreadPlacement;
+
+/// Which memory a video buffer is allocated from
+typedef enum vita_chiaki_mem_placement_t {
+  MEM_PLACEMENT_AUTO,     // Whatever the startup benchmark found fastest on this device and firmware
+  MEM_PLACEMENT_CDRAM,    // Video memory, the default of the SDK samples
+  MEM_PLACEMENT_PHYCONT,  // Physically contiguous, uncached main memory
+  MEM_PLACEMENT_MAIN,     // Uncached main memory
+  MEM_PLACEMENT_COUNT
+} VitaChiakiMemPlacement;
+
+/// DiffServ marking of the stream packets, which Wi-Fi access points with WMM map to their access categories
+typedef enum vita_chiaki_dscp_t {
+  DSCP_OFF,   // Best effort
+  DSCP_AF41,  // Interactive video, the video access category
+  DSCP_EF,    // Expedited forwarding, the voice access category
+} VitaChiakiDscp;
+
+/// How past sessions with a console went, to pick the profile when it is chosen automatically
+typedef struct vita_chiaki_stream_history_t {
+  uint8_t server_mac[6];
+  uint32_t sessions;
+  ChiakiVideoResolutionPreset resolution;  // of the last session
+  ChiakiVideoFPSPreset fps;
+  uint32_t bitrate;  // kbit/s, as requested in the last session
+  uint32_t loss_permille;  // averaged over the recent sessions
+  uint32_t decode_us;
+  uint32_t fps_achieved;
+  // last RTT and MTU measurement, reused by the next sessions on the same network for a while
+  char path_network[64];  // SSID and own address the Vita had then
+  uint64_t path_time;  // unix time of the measurement, 0 if there is none
+  uint32_t path_mtu_in;
+  uint32_t path_mtu_out;
+  uint64_t path_rtt_us;
+} VitaChiakiStreamHistory;
+
 /// Settings for the app
 typedef struct vita_chiaki_config_t {
   int cfg_version;
@@ -24,18 +81,61 @@ typedef struct vita_chiaki_config_t {
   VitaChiakiDisconnectAction disconnect_action;
   ChiakiVideoResolutionPreset resolution;
   ChiakiVideoFPSPreset fps;
+  bool auto_profile;  // Pick resolution and bitrate from past sessions and the measured path, fps stays the upper bound
   size_t num_manual_hosts;
   VitaChiakiHost* manual_hosts[MAX_NUM_HOSTS];
   size_t num_registered_hosts;
   VitaChiakiHost* registered_hosts[MAX_NUM_HOSTS];
-  // TODO: Logfile path
+  size_t num_stream_histories;
+  VitaChiakiStreamHistory stream_histories[MAX_NUM_HOSTS];  // serialized with the registered host of the same MAC
+  bool file_log;  // Also write the log to FILE_LOG_FILENAME
+  bool trace;  // Record a timeline of every session and write it to TRACE_FILENAME when it ends
+  bool capture;  // Record the received packets and keys of every session to CAPTURE_FILENAME for replaying it
+  bool record;  // Record the video and audio of every session to RECORDING_FILENAME, see ChiakiRecorder
+  char* impair;  // Network conditions to simulate on every session for benchmarking, see chiaki_impair_config_parse(), or NULL
+  char* telemetry;  // "host" or "host:port" of a PC running scripts/telemetry_receiver.py to stream stats to, or NULL
+  char* latency_probe;  // "x,y,width,height" of the stream to watch for the response to scripted presses, see latency_probe.h, or NULL
+  uint32_t latency_probe_button;  // ChiakiControllerButton the latency probe presses
   // TODO: Loglevel
   // controller map id // TODO should probably replace with fully customizable map
   int controller_map_id;
   bool circle_btn_confirm;
   bool show_latency;  // Display real-time latency in Profile screen
+  bool show_stream_stats;  // Draw the performance overlay on top of the stream
+  bool low_power_ui;  // Pause the particle background so menus are only redrawn on input and discovery updates
+  VitaChiakiFramePacing frame_pacing;
+  bool decode_yuv420;  // Decode to YUV420 and let the GPU convert, instead of RGBA
+  bool low_latency_decoder;  // Ask the decoder to output every frame immediately, see vita_h264_setup()
+  bool decoder_latency_test;  // Alternate low_latency_decoder per stream and log the decode to output delay
+  bool direct_display;  // Scan out decoded 960x544 frames directly, without drawing them with the GPU
+  bool gpu_upscale;  // Decode streams below the screen size at their own size and let the GPU scale them up when drawing
+  int av_sync_max_offset_ms;  // Max audio/video latency difference before one is delayed, 0 to disable
+  VitaChiakiInputSampling input_sampling;
+  bool input_immediate_send;  // Send controller changes from the input thread instead of waking up the Feedback Sender
+  int input_state_rate_max;  // Packets per second at most for stick and motion changes, buttons are always sent right away, 0 for no limit
+  bool delay_based_congestion_control;  // Make the console lower its bitrate as soon as queueing delay builds up
+  bool fast_path_probe;  // Pipeline the RTT and MTU measurement before the stream starts to connect faster
+  bool path_cache;  // Skip the RTT and MTU measurement if it was done recently on the same network
+  VitaChiakiThreadPlacement thread_placement;
+  ChiakiLatencyMode latency_mode;  // Depth of every buffer from the network to audio and video, see chiaki_latency_profile_preset()
+  // Placement of the decoder library context, the decoder frame memory and the frame textures, see vita_h264_reserve()
+  VitaChiakiMemPlacement mem_videodec;
+  VitaChiakiMemPlacement mem_decoder;
+  VitaChiakiMemPlacement mem_textures;
+  int recv_buffer_burst_ms;  // Size the stream socket's receive buffer for this much video at the stream bitrate, 0 for the default
+  VitaChiakiDscp dscp;
+  int backlog_skip_ms;  // Skip stale frames arriving this late after a network stall until an IDR frame, 0 to decode all of them
+  bool resume;  // Re-establish the stream after the network dropped for a moment instead of quitting
 } VitaChiakiConfig;
 
 void config_parse(VitaChiakiConfig* cfg);
 void config_free(VitaChiakiConfig* cfg);
+/// Save the config, the file is written in the background shortly after
 void config_serialize(VitaChiakiConfig* cfg);
+/// Wait until everything passed to config_serialize() is written
+void config_flush();
+VitaChiakiStreamHistory* config_stream_history(VitaChiakiConfig* cfg, uint8_t* server_mac, bool create);
+/// Read a whole file, NUL-terminated for text, the caller frees the returned buffer
+char* config_read_file(const char* filename, size_t* size);
+/// Write to a temporary file first and move it over the old one
+bool config_write_file_atomic(const char* filename, const void* data, size_t size);
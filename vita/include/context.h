@@ -3,39 +3,22 @@
 #include <psp2/kernel/processmgr.h>
 #include <chiaki/discoveryservice.h>
 #include <chiaki/log.h>
+#include <chiaki/logring.h>
 #include <chiaki/opusdecoder.h>
 
 #include "config.h"
 #include "discovery.h"
 #include "host.h"
 #include "message_log.h"
+#include "file_log.h"
 #include "controller.h"
 #include "ui.h"
 // #include "debugnet.h"
 
-#define LOGD(fmt, ...) do {\
-    uint64_t timestamp = sceKernelGetProcessTimeWide(); \
-    sceClibPrintf("[DEBUG] %ju "fmt"\n", timestamp __VA_OPT__(,) __VA_ARGS__); \
-    if (!context.stream.is_streaming) { \
-        if (context.mlog) { \
-          char msg[800]; \
-          sceClibSnprintf(msg, 800, "[DEBUG] %ju "fmt"\n", timestamp __VA_OPT__(,) __VA_ARGS__); \
-          write_message_log(context.mlog, msg); \
-        } \
-      } \
-  } while (0)
+// formatted and printed on the log ring's thread, so logging from the stream threads costs no output
+#define LOGD(fmt, ...) chiaki_log(&context.app_log, CHIAKI_LOG_DEBUG, fmt __VA_OPT__(,) __VA_ARGS__)
   //debugNetPrintf(DEBUG, "%ju "fmt"\n", timestamp __VA_OPT__(,) __VA_ARGS__);
-#define LOGE(fmt, ...) do {\
-    uint64_t timestamp = sceKernelGetProcessTimeWide(); \
-    sceClibPrintf("[ERROR] %ju "fmt"\n", timestamp __VA_OPT__(,) __VA_ARGS__); \
-    if (!context.stream.is_streaming) { \
-        if (context.mlog) { \
-          char msg[800]; \
-          sceClibSnprintf(msg, 800, "[ERROR] %ju "fmt"\n", timestamp __VA_OPT__(,) __VA_ARGS__); \
-          write_message_log(context.mlog, msg); \
-        } \
-      } \
-  } while (0)
+#define LOGE(fmt, ...) chiaki_log(&context.app_log, CHIAKI_LOG_ERROR, fmt __VA_OPT__(,) __VA_ARGS__)
   //debugNetPrintf(ERROR, "%ju "fmt"\n", timestamp __VA_OPT__(,) __VA_ARGS__);
 
 typedef struct vita_chiaki_stream_t {
@@ -45,22 +28,28 @@ typedef struct vita_chiaki_stream_t {
   bool session_init;
   bool is_streaming;
   int fps;
+  ChiakiLatencyProfile latency_profile;  // of the current session, from config.latency_mode
   ChiakiOpusDecoder opus_decoder;
   ChiakiThread input_thread;
 } VitaChiakiStream;
 
 typedef struct vita_chiaki_context_t {
   ChiakiLog log;
+  ChiakiLog app_log; // for LOGD and LOGE
+  ChiakiLogRing log_ring;
+  bool log_ring_init;
   ChiakiDiscoveryService discovery;
   bool discovery_enabled;
   VitaChiakiDiscoveryCallbackState* discovery_cb_state;
   VitaChiakiHost* hosts[MAX_NUM_HOSTS];
+  uint32_t hosts_revision;  // bumped whenever hosts or one of them changes
   VitaChiakiHost* active_host;
   VitaChiakiStream stream;
   VitaChiakiConfig config;
   VitaChiakiUIState ui_state;
   uint8_t num_hosts;
   VitaChiakiMessageLog* mlog;
+  VitaChiakiFileLog* flog;  // NULL unless enabled in the config
 } VitaChiakiContext;
 
 /// Global context singleton
@@ -89,12 +89,57 @@ typedef enum vitaki_ctrl_out_t {
   VITAKI_CTRL_OUT_NONE     = 0,
 } VitakiCtrlOut;
 
+// Compiled map outputs are a ChiakiControllerButton mask plus these flags
+#define VITAKI_CTRL_OUT_BUTTONS_MASK      0xffff
+#define VITAKI_CTRL_OUT_FLAG_L2           (1 << 16)
+#define VITAKI_CTRL_OUT_FLAG_R2           (1 << 17)
+#define VITAKI_CTRL_OUT_FLAG_REARTOUCH_L  (1 << 18) // rear touch left half, for REARTOUCH_LEFT_L1
+#define VITAKI_CTRL_OUT_FLAG_REARTOUCH_R  (1 << 19) // rear touch right half, for REARTOUCH_RIGHT_R1
+
+#define VITAKI_TOUCH_MAX_WIDTH   1919
+#define VITAKI_TOUCH_MAX_HEIGHT  1087
+
+// Touch zones are looked up in a grid of 32x32 px cells
+#define VITAKI_TOUCH_GRID_SHIFT  5
+#define VITAKI_TOUCH_GRID_COLS   ((VITAKI_TOUCH_MAX_WIDTH >> VITAKI_TOUCH_GRID_SHIFT) + 1)
+#define VITAKI_TOUCH_GRID_ROWS   ((VITAKI_TOUCH_MAX_HEIGHT >> VITAKI_TOUCH_GRID_SHIFT) + 1)
+#define VITAKI_TOUCH_GRID_CELLS  (VITAKI_TOUCH_GRID_COLS * VITAKI_TOUCH_GRID_ROWS)
+
+// Button combos that replace the outputs of their buttons, e.g. Select + Start
+#define VITAKI_CTRL_COMBOS_MAX 3
+
+typedef struct vitaki_ctrl_combo_t {
+  uint32_t buttons;  // SceCtrlButtons that all have to be held
+  uint32_t clear;    // outputs of the single buttons to take away
+  uint32_t out;
+} VitakiCtrlCombo;
+
 typedef struct vitaki_ctrl_map_info_t {
   bool in_state[VITAKI_CTRL_IN_COUNT];
   int in_out_btn[VITAKI_CTRL_IN_COUNT];
   int in_l2;
   int in_r2;
   bool did_init;
+
+  // Compiled from the above by init_controller_map(), so the input thread only needs lookups
+  uint32_t btn_lo[0x100];  // SceCtrlButtons bits 0-7
+  uint32_t btn_hi[0x100];  // SceCtrlButtons bits 8-15, without the triggers
+  uint32_t ltrigger;
+  uint32_t ltrigger_reartouch;  // while the left half of the rear touch is touched
+  uint32_t rtrigger;
+  uint32_t rtrigger_reartouch;
+  VitakiCtrlCombo combos[VITAKI_CTRL_COMBOS_MAX];
+  int combos_count;
+  uint32_t front_grid[VITAKI_TOUCH_GRID_CELLS];
+  uint32_t rear_grid[VITAKI_TOUCH_GRID_CELLS];
 } VitakiCtrlMapInfo;
 
+static inline int vitaki_touch_grid_cell(int x, int y) {
+  if (x < 0) x = 0;
+  if (x > VITAKI_TOUCH_MAX_WIDTH) x = VITAKI_TOUCH_MAX_WIDTH;
+  if (y < 0) y = 0;
+  if (y > VITAKI_TOUCH_MAX_HEIGHT) y = VITAKI_TOUCH_MAX_HEIGHT;
+  return (y >> VITAKI_TOUCH_GRID_SHIFT) * VITAKI_TOUCH_GRID_COLS + (x >> VITAKI_TOUCH_GRID_SHIFT);
+}
+
 void init_controller_map(VitakiCtrlMapInfo* vcmi, VitakiControllerMapId controller_map_id);
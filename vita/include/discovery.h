@@ -12,4 +12,5 @@ typedef struct vita_chiaki_discovery_callback_state_t {
 } VitaChiakiDiscoveryCallbackState;
 
 ChiakiErrorCode start_discovery(VitaChiakiDiscoveryCb cb, void* cb_user);
-void stop_discovery();
\ No newline at end of file
+void stop_discovery();
+void pause_discovery(bool paused);
\ No newline at end of file
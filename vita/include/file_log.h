@@ -0,0 +1,30 @@
+#pragma once
+#include <chiaki/thread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FILE_LOG_FILENAME "ux0:data/vita-chiaki/chiaki.log"
+#define FILE_LOG_BUF_SIZE (64 * 1024)
+#define FILE_LOG_FLUSH_MS 1000
+
+// Log file that is written by its own thread in large sequential batches, so a stalling
+// memory card never blocks the thread that logs. Lines are collected in one buffer while
+// the other one is being written. If both are full, lines are dropped and counted.
+typedef struct vita_chiaki_file_log_t {
+  int fd;
+  ChiakiThread thread;
+  ChiakiMutex mutex;
+  ChiakiCond cond;
+  bool should_stop;
+  char* bufs[2];
+  char* fill;  // buffer lines are appended to, the other one belongs to the thread while writing
+  size_t fill_size;
+  uint64_t dropped;
+} VitaChiakiFileLog;
+
+VitaChiakiFileLog* file_log_create(const char* filename);
+// Write everything that is still buffered and close the file
+void file_log_destroy(VitaChiakiFileLog* fl);
+// Can be called from any thread, a newline is appended if line has none
+void file_log_write(VitaChiakiFileLog* fl, const char* prefix, const char* line);
@@ -20,6 +20,7 @@ typedef struct vita_chiaki_host_t {
 
   ChiakiDiscoveryHost* discovery_state;
   ChiakiRegisteredHost* registered_state;
+  uint32_t revision;  // bumped by host_changed(), so the UI knows which cards to refresh
 } VitaChiakiHost;
 
 
@@ -29,7 +30,17 @@ void host_free(VitaChiakiHost* host);
 int host_register(VitaChiakiHost* host, int pin);
 int host_wakeup(VitaChiakiHost* host);
 int host_stream(VitaChiakiHost* host);
+/// Send a wakeup and poll the host directly until it is ready, host_wake_poll() then starts the stream
+int host_wake_and_stream(VitaChiakiHost* host);
+/// Call regularly after host_wake_and_stream(), returns 1 once the stream was started, 0 while waiting, -1 on error
+int host_wake_poll();
+void host_wake_cancel();
+void host_crypto_warmup();
 bool mac_addrs_match(MacAddr* a, MacAddr* b);
+/// @return slot in context.hosts of the host with this MAC and any of the types, -1 if there is none
+int context_host_index(MacAddr* mac, int types);
+/// Note that what is shown of host changed, also bumps context.hosts_revision
+void host_changed(VitaChiakiHost* host);
 void save_manual_host(VitaChiakiHost* rhost, char* new_hostname);
 void delete_manual_host(VitaChiakiHost* mhost);
 void update_context_hosts();
@@ -0,0 +1,26 @@
+#pragma once
+#include <chiaki/controller.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Measures the latency from input to the decoded picture on the device alone: the input thread
+// presses a button now and then and the decoded frames are watched for the game's response in
+// a region of the picture, e.g. a menu or highlight the button toggles.
+// A press is only made once the region has been steady for a while, so it should be a part of
+// the picture that does not change on its own.
+#define LATENCY_PROBE_INTERVAL_MS 1500  // from a response to the next press
+#define LATENCY_PROBE_PRESS_MS 100  // how long the button is held
+#define LATENCY_PROBE_TIMEOUT_MS 1000  // a press without a response after this long is counted as missed
+#define LATENCY_PROBE_SETTLE_FRAMES 15  // steady frames needed before a press
+#define LATENCY_PROBE_THRESHOLD 24  // change of the average luma in the region (0-255) taken as the response
+#define LATENCY_PROBE_SAMPLES_MAX 512
+
+// Start probing a stream, region is "x,y,width,height" in pixels of the stream
+// @return false if region can't be parsed, the probe stays off then
+bool latency_probe_start(const char* region, uint32_t button);
+// Stop probing and log the distribution of the round trips
+void latency_probe_stop();
+// Add the scripted press to state, from the input thread before the state is passed to the session
+void latency_probe_input(ChiakiControllerState* state, uint64_t now_us);
+// Look for the response in a decoded picture, RGBA8888 or the Y plane of YUV420, pitch in pixels
+void latency_probe_frame(const uint8_t* data, int pitch, bool yuv420, int width, int height, uint64_t now_us);
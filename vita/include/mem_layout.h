@@ -0,0 +1,43 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <psp2/kernel/sysmem.h>
+
+#include "config.h"
+
+#define MEM_LAYOUT_FILENAME "ux0:data/vita-chiaki/mem_layout.bin"
+
+// The video buffers whose placement can be chosen
+typedef enum vita_video_buffer_t {
+  VIDEO_BUFFER_VIDEODEC,  // decoder library context
+  VIDEO_BUFFER_DECODER,  // decoder frame memory, holds the reference frames
+  VIDEO_BUFFER_TEXTURES,  // frame textures, written by the decoder and sampled by the GPU
+  VIDEO_BUFFER_COUNT
+} VitaVideoBuffer;
+
+// Never MEM_PLACEMENT_AUTO once resolved
+typedef struct vita_mem_layout_t {
+  VitaChiakiMemPlacement placement[VIDEO_BUFFER_COUNT];
+} VitaMemLayout;
+
+// Result of the benchmark of one layout
+typedef struct vita_mem_layout_score_t {
+  bool valid;  // everything could be allocated and a stream decoded into it
+  uint32_t decode_us;  // per frame
+  uint32_t sample_us;  // per full screen draw of a frame texture
+} VitaMemLayoutScore;
+
+const char* mem_placement_name(VitaChiakiMemPlacement placement);
+SceKernelMemBlockType mem_placement_memblock_type(VitaChiakiMemPlacement placement);
+// Memblocks of the placement must be a multiple of it in size
+SceSize mem_placement_granularity(VitaChiakiMemPlacement placement);
+
+// The layout saved for this device and firmware, false if there is none or it is from another
+bool mem_layout_load(VitaMemLayout* layout);
+bool mem_layout_save(const VitaMemLayout* layout);
+
+// Write an access unit of the benchmark stream for a width x height (in macroblocks) baseline picture:
+// a flat intra frame for frame 0, frames that skip every macroblock after it.
+// Returns its size, 0 if buf is too small
+size_t mem_layout_bench_au(uint8_t* buf, size_t size, unsigned int width_mbs, unsigned int height_mbs, unsigned int frame);
@@ -1,20 +1,34 @@
 #pragma once
 #include <chiaki/common.h>
 #include "string.h"
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
 #define MLOG_LINE_LEN 80
-#define MLOG_LINES 500
+#define MLOG_LINES 512  // power of two
+#define MLOG_BUF_SIZE 65536  // power of two and at least MLOG_LINES * MLOG_LINE_LEN, so lines are evicted by count only
 
-// A hard-wrapped message log
+typedef struct vita_chiaki_message_log_line_t {
+  uint32_t offset;  // position of the first char in the byte stream
+  uint32_t len;
+  uint32_t seq;  // line number + 1, set once the text is complete
+} VitaChiakiMessageLogLine;
+
+// A hard-wrapped message log: text goes into a byte ring buffer, lines are indexed in a second
+// ring. Writers reserve their lines and bytes with a single atomic add, so any thread can append
+// without locks or allocations. Readers check that a line was not overwritten while copying it.
 typedef struct vita_chiaki_message_log_t {
-  char log[MLOG_LINES+1][MLOG_LINE_LEN+1];
-  uint8_t start_offset;
-  uint8_t lines;
+  char buf[MLOG_BUF_SIZE];
+  VitaChiakiMessageLogLine lines[MLOG_LINES];
+  uint64_t head;  // reserved lines in the upper, bytes in the lower 32 bits
   uint64_t last_update;
 } VitaChiakiMessageLog;
 
 VitaChiakiMessageLog* message_log_create();
 void write_message_log(VitaChiakiMessageLog* ml, const char* text);
-char* get_message_log_line(VitaChiakiMessageLog* ml, size_t line);
+// Lines still in the log are first, ..., first + count - 1
+void message_log_range(VitaChiakiMessageLog* ml, uint32_t* first, uint32_t* count);
+// Copy a line into buf, which should hold MLOG_LINE_LEN + 1 chars
+// @return false if the line is not complete yet or was overwritten, buf is empty then
+bool get_message_log_line(VitaChiakiMessageLog* ml, uint32_t line, char* buf, size_t buf_size);
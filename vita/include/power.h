@@ -0,0 +1,19 @@
+#pragma once
+#include <stdint.h>
+
+// Clock levels of the app: menus only need a fraction of what decoding a stream does
+typedef enum vita_power_level_t {
+  POWER_LEVEL_MENU,
+  POWER_LEVEL_STREAM,  // everything at the maximum, from session start to quit
+  POWER_LEVEL_STREAM_DIRECT,  // streaming, but frames are scanned out directly, so the GPU has little to do
+  POWER_LEVEL_COUNT
+} VitaPowerLevel;
+
+void power_init();
+// Can be called from any thread, does nothing if the level is already set
+void power_set_level(VitaPowerLevel level);
+VitaPowerLevel power_level();
+// Record how long decoding a frame took at the current level
+void power_decode_sample(uint32_t decode_us);
+// Log the decode time at each level used since the last call against the time per frame, and start over
+void power_log_decode_headroom(uint32_t frame_us);
@@ -0,0 +1,57 @@
+#pragma once
+#include <chiaki/session.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SESSION_REPORTS_FILENAME "ux0:data/vita-chiaki/sessions.bin"
+// Reports kept per console, the oldest one is dropped for a new one
+#define SESSION_REPORTS_PER_HOST 16
+
+// Summary of how one session went, kept after it ended to compare sessions and network setups
+typedef struct vita_session_report_t {
+  uint8_t server_mac[6];
+  uint8_t latency_mode;  // ChiakiLatencyMode
+  uint8_t quit_reason;  // ChiakiQuitReason
+  uint64_t start_time;  // unix time the session connected, 0 if it never did
+  uint32_t duration_ms;  // from connecting to quitting
+  // profile as requested, after the session fitted it to the path
+  uint16_t width;
+  uint16_t height;
+  uint16_t fps;
+  uint16_t fps_achieved;
+  uint32_t bitrate;  // kbit/s
+  uint32_t bitrate_measured;  // kbit/s received on average
+  // video
+  uint32_t frames;  // flushed, including failed ones
+  uint32_t frames_failed;
+  uint32_t frames_fec_recovered;
+  uint32_t ref_frame_misses;
+  uint32_t i_frame_bytes_avg;
+  uint32_t burst_bytes_max;
+  // latency from the first unit received to the frame displayed, and of decoding alone
+  uint32_t latency_avg_us;
+  uint32_t latency_p95_us;
+  uint32_t latency_p99_us;
+  uint32_t decode_p95_us;
+  // network
+  uint32_t loss_permille;
+  uint32_t jitter_video_us;
+  uint32_t jitter_audio_us;
+  // audio
+  uint32_t audio_underruns;
+  uint32_t audio_overruns;
+  // path to the console, by Senkusha if path_probed, otherwise fallbacks or known values
+  uint32_t rtt_us;
+  uint16_t mtu_in;
+  uint16_t mtu_out;
+  bool path_probed;
+} VitaSessionReport;
+
+// Fill in everything the session knows, to be called when it quits, before the audio is cleaned up
+void session_report_collect(VitaSessionReport* report, ChiakiSession* session, uint8_t* server_mac,
+                            uint64_t start_time, uint64_t duration_ms, ChiakiQuitReason quit_reason);
+// Append the report to the history of its console, replacing the oldest one after SESSION_REPORTS_PER_HOST
+bool session_report_save(const VitaSessionReport* report);
+// Reports of the console, oldest first, returns how many were written to reports
+size_t session_reports_load(const uint8_t* server_mac, VitaSessionReport* reports, size_t max);
@@ -0,0 +1,29 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <vita2d.h>
+
+#include "ui_atlas.h"  // generated by scripts/pack_atlas.py
+
+#define SPRITE_ATLAS_PATH "app0:/assets/ui_atlas.png"
+#define SPRITE_BATCH_MAX 64  // quads per draw call
+#define SPRITE_TINT_NONE 0xFFFFFFFF
+
+// The small UI images all live in one atlas texture. Sprites are queued and drawn together
+// in a single call until the tint changes, the batch is full or sprite_flush() is called.
+// Everything else is drawn immediately, so flush before drawing anything that has to end up
+// above queued sprites.
+
+// Only loads the texture, so it can be called from any thread
+vita2d_texture* sprite_atlas_load(const char* path);
+// Until an atlas is set, sprites are not drawn
+void sprite_atlas_set(vita2d_texture* texture);
+int sprite_width(UISprite sprite);
+int sprite_height(UISprite sprite);
+// Queue a sprite with its top-left corner at x, y
+void sprite_draw(UISprite sprite, float x, float y, float scale_x, float scale_y, uint32_t tint);
+// Queue a sprite centered at x, y and rotated by rad around its center
+void sprite_draw_rotate(UISprite sprite, float x, float y, float scale, float rad, uint32_t tint);
+// Like sprite_draw_rotate() with the cosine and sine of the angle already known
+void sprite_draw_transform(UISprite sprite, float x, float y, float scale, float c, float s, uint32_t tint);
+void sprite_flush();
@@ -0,0 +1,21 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TEXT_CACHE_WIDTH 1024
+#define TEXT_CACHE_HEIGHT 512
+#define TEXT_CACHE_ENTRIES 128
+#define TEXT_CACHE_MAX_LEN 96  // longer strings are drawn glyph by glyph
+
+// Menu text is mostly the same from frame to frame, so instead of laying out and drawing every
+// glyph each frame, each string is rasterized once into an alpha texture and drawn as one quad.
+// Strings are keyed by their content and size, so changed text simply gets a new entry. When the
+// texture is full, everything is dropped at the start of the next frame and rasterized again.
+// Works like vita2d_font_draw_text() with the font the cache was initialized with, y is the baseline.
+
+// Doesn't touch the UI state, so it can be called from a loader thread
+bool text_cache_init(const char* font_path);
+// Call before drawing each frame
+void text_cache_next_frame();
+void text_cache_draw(int x, int y, uint32_t color, unsigned int size, const char* text);
+int text_cache_width(unsigned int size, const char* text);
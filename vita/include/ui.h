@@ -30,4 +30,9 @@ typedef enum ui_main_widget_id_t {
 } MainWidgetId;
 
 
+/// Bring up vita2d with a first frame and start loading the UI assets in the background
+void ui_start_loading();
 void draw_ui();
+
+/// Make the menus redraw on the next frame, for state changed outside of the UI thread
+void ui_invalidate();
@@ -32,13 +32,29 @@
 // Original value: 8 (stable, tested)
 // Lower values cause decoder freeze/corruption with PS5 streams
 #define REF_FRAMES 8
+// Decoder output textures, so decoding never writes into the texture the GPU is still sampling:
+// one being decoded into, up to two waiting to be presented and one sampled by the last scene
+#define FRAME_TEXTURES 4
+
+typedef struct vita_video_mem_stats_t {
+  uint32_t cdram; // bytes of decoder memblocks and frame textures placed in CDRAM
+  uint32_t cdram_peak;
+  uint32_t cdram_allocs; // memblocks and textures allocated since app start
+  uint32_t au_buffers; // heap bytes of the access unit buffers
+} VitaVideoMemStats;
 
 void vita_h264_start();
 void vita_h264_stop();
+// show the last frame with a notice on top while the session reconnects, see CHIAKI_EVENT_RECONNECTING
+void vita_h264_set_reconnecting(bool reconnecting);
 void vitavideo_show_poor_net_indicator();
 void vitavideo_hide_poor_net_indicator();
 int vitavideo_initialized();
 
+int vita_h264_reserve();  // reserve decoder, AU and texture memory for the largest stream, once at app start after vita2d_init()
 int vita_h264_setup(int width, int height);
 void vita_h264_cleanup();
-int vita_h264_decode_frame(uint8_t *buf, size_t buf_size);
\ No newline at end of file
+uint8_t *vita_h264_get_au_buffer(size_t size);
+int vita_h264_decode_frame(uint8_t *buf, size_t buf_size);
+uint32_t vita_h264_fps_achieved();
+void vita_video_get_mem_stats(VitaVideoMemStats *stats);  // average presented fps since setup, over the seconds anything was presented
\ No newline at end of file
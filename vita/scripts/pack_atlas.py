@@ -0,0 +1,217 @@
+#!/usr/bin/env python3
+"""
+Pack the small UI images into a single RGBA atlas and a header with the sprite rectangles.
+
+Usage: pack_atlas.py <atlas.png> <atlas.h> <name>=<image.png>[@<size>] ...
+
+@<size> downscales the image so its larger side is size pixels, for images that are only ever
+drawn much smaller than their source. Only the standard library is used, so the build does not
+need anything besides the Python that nanopb already requires.
+"""
+
+import struct
+import sys
+import zlib
+
+ATLAS_WIDTH = 512
+PADDING = 2  # edge pixels are repeated into it so linear filtering never samples a neighbour
+
+
+def read_png(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    if data[:8] != b"\x89PNG\r\n\x1a\n":
+        raise ValueError("%s: not a PNG" % path)
+    pos = 8
+    idat = b""
+    palette = None
+    trns = None
+    while pos < len(data):
+        length, ctype = struct.unpack(">I4s", data[pos:pos + 8])
+        chunk = data[pos + 8:pos + 8 + length]
+        pos += 12 + length
+        if ctype == b"IHDR":
+            width, height, depth, color, _, _, interlace = struct.unpack(">IIBBBBB", chunk)
+        elif ctype == b"PLTE":
+            palette = [tuple(chunk[i:i + 3]) for i in range(0, len(chunk), 3)]
+        elif ctype == b"tRNS":
+            trns = chunk
+        elif ctype == b"IDAT":
+            idat += chunk
+        elif ctype == b"IEND":
+            break
+    if interlace:
+        raise ValueError("%s: interlaced PNGs are not supported" % path)
+
+    channels = {0: 1, 2: 3, 3: 1, 4: 2, 6: 4}[color]
+    bits = channels * depth
+    stride = (width * bits + 7) // 8
+    bpp = max(1, bits // 8)
+    raw = zlib.decompress(idat)
+    rows = []
+    prev = bytearray(stride)
+    for y in range(height):
+        start = y * (stride + 1)
+        ftype = raw[start]
+        line = bytearray(raw[start + 1:start + 1 + stride])
+        for i in range(stride):
+            a = line[i - bpp] if i >= bpp else 0
+            b = prev[i]
+            c = prev[i - bpp] if i >= bpp else 0
+            if ftype == 1:
+                line[i] = (line[i] + a) & 0xff
+            elif ftype == 2:
+                line[i] = (line[i] + b) & 0xff
+            elif ftype == 3:
+                line[i] = (line[i] + ((a + b) >> 1)) & 0xff
+            elif ftype == 4:
+                p = a + b - c
+                pa, pb, pc = abs(p - a), abs(p - b), abs(p - c)
+                line[i] = (line[i] + (a if pa <= pb and pa <= pc else b if pb <= pc else c)) & 0xff
+        rows.append(line)
+        prev = line
+
+    def samples(line):
+        if depth == 8:
+            return list(line)
+        if depth == 16:
+            return [line[i] for i in range(0, len(line), 2)]
+        mask = (1 << depth) - 1
+        out = []
+        for byte in line:
+            for shift in range(8 - depth, -1, -depth):
+                out.append((byte >> shift) & mask)
+        return out
+
+    pixels = []
+    for line in rows:
+        s = samples(line)
+        row = []
+        for x in range(width):
+            if color == 3:
+                i = s[x]
+                r, g, b = palette[i]
+                row.append((r, g, b, trns[i] if trns and i < len(trns) else 255))
+                continue
+            v = s[x * channels:(x + 1) * channels]
+            if depth < 8:
+                v = [c * 255 // ((1 << depth) - 1) for c in v]
+            if color == 0:
+                row.append((v[0], v[0], v[0], 255))
+            elif color == 2:
+                row.append((v[0], v[1], v[2], 255))
+            elif color == 4:
+                row.append((v[0], v[0], v[0], v[1]))
+            else:
+                row.append(tuple(v))
+        pixels.append(row)
+    return width, height, pixels
+
+
+def downscale(width, height, pixels, size):
+    scale = size / max(width, height)
+    if scale >= 1.0:
+        return width, height, pixels
+    w = max(1, round(width * scale))
+    h = max(1, round(height * scale))
+    out = []
+    for y in range(h):
+        y0, y1 = y * height // h, max(y * height // h + 1, (y + 1) * height // h)
+        row = []
+        for x in range(w):
+            x0, x1 = x * width // w, max(x * width // w + 1, (x + 1) * width // w)
+            # average with premultiplied alpha so transparent pixels do not darken the edges
+            r = g = b = a = 0
+            for sy in range(y0, y1):
+                src = pixels[sy]
+                for sx in range(x0, x1):
+                    pr, pg, pb, pa = src[sx]
+                    r += pr * pa
+                    g += pg * pa
+                    b += pb * pa
+                    a += pa
+            n = (y1 - y0) * (x1 - x0)
+            row.append((r // a, g // a, b // a, a // n) if a else (0, 0, 0, 0))
+        out.append(row)
+    return w, h, out
+
+
+def write_png(path, width, height, pixels):
+    raw = bytearray()
+    for row in pixels:
+        raw.append(0)
+        for p in row:
+            raw.extend(p)
+
+    def chunk(ctype, payload):
+        return struct.pack(">I", len(payload)) + ctype + payload + struct.pack(">I", zlib.crc32(ctype + payload) & 0xffffffff)
+
+    with open(path, "wb") as f:
+        f.write(b"\x89PNG\r\n\x1a\n")
+        f.write(chunk(b"IHDR", struct.pack(">IIBBBBB", width, height, 8, 6, 0, 0, 0)))
+        f.write(chunk(b"IDAT", zlib.compress(bytes(raw), 9)))
+        f.write(chunk(b"IEND", b""))
+
+
+def main(argv):
+    if len(argv) < 4:
+        sys.stderr.write(__doc__)
+        return 1
+    atlas_path, header_path = argv[1], argv[2]
+
+    sprites = []
+    for arg in argv[3:]:
+        name, path = arg.split("=", 1)
+        size = None
+        if "@" in path:
+            path, size = path.rsplit("@", 1)
+        w, h, pixels = read_png(path)
+        if size:
+            w, h, pixels = downscale(w, h, pixels, int(size))
+        sprites.append([name, w, h, pixels, 0, 0])
+
+    # shelf packing, tallest first
+    order = sorted(sprites, key=lambda s: (-s[2], -s[1]))
+    x = y = shelf_h = 0
+    for s in order:
+        cell_w, cell_h = s[1] + 2 * PADDING, s[2] + 2 * PADDING
+        if cell_w > ATLAS_WIDTH:
+            raise ValueError("%s is wider than the atlas" % s[0])
+        if x + cell_w > ATLAS_WIDTH:
+            x = 0
+            y += shelf_h
+            shelf_h = 0
+        s[4], s[5] = x + PADDING, y + PADDING
+        x += cell_w
+        shelf_h = max(shelf_h, cell_h)
+    height = y + shelf_h
+    height = (height + 7) & ~7
+
+    atlas = [[(0, 0, 0, 0)] * ATLAS_WIDTH for _ in range(height)]
+    for name, w, h, pixels, sx, sy in sprites:
+        for py in range(-PADDING, h + PADDING):
+            src = pixels[min(max(py, 0), h - 1)]
+            dst = atlas[sy + py]
+            for px in range(-PADDING, w + PADDING):
+                dst[sx + px] = src[min(max(px, 0), w - 1)]
+    write_png(atlas_path, ATLAS_WIDTH, height, atlas)
+
+    with open(header_path, "w") as f:
+        f.write("// Generated by scripts/pack_atlas.py, do not edit\n")
+        f.write("#pragma once\n\n")
+        f.write("#define UI_ATLAS_WIDTH %d\n" % ATLAS_WIDTH)
+        f.write("#define UI_ATLAS_HEIGHT %d\n\n" % height)
+        f.write("typedef enum ui_sprite_t {\n")
+        for s in sprites:
+            f.write("  UI_SPRITE_%s,\n" % s[0].upper())
+        f.write("  UI_SPRITE_COUNT\n} UISprite;\n\n")
+        f.write("/// x, y, width, height of every sprite, in UISprite order\n")
+        f.write("#define UI_ATLAS_RECTS { \\\n")
+        for name, w, h, _, sx, sy in sprites:
+            f.write("  { %d, %d, %d, %d }, \\\n" % (sx, sy, w, h))
+        f.write("}\n")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,243 @@
+#!/usr/bin/env python3
+"""
+Receive the telemetry a session sends with the telemetry setting and print or log it, see chiaki/telemetry.h.
+
+Usage: telemetry_receiver.py [--port <port>] [--csv <file.csv>] [--plot]
+
+Set telemetry = "<address of this PC>[:<port>]" in chiaki.toml on the Vita. All counters in a snapshot are
+totals since the session started, so every line shows the interval since the previous snapshot that arrived.
+--plot draws the latencies, loss and thread load live and needs matplotlib, everything else only uses the
+standard library.
+"""
+
+import argparse
+import socket
+import struct
+import sys
+import time
+
+MAGIC = b"CKTM"
+VERSION = 1
+DEFAULT_PORT = 9350
+COARSE_BUCKETS = 10
+COARSE_BUCKET_US = 250  # bucket 0 is below this, bucket k below this << k
+
+# in the order of ChiakiLatencyStage and ChiakiThreadRole, newer senders may append more
+STAGES = ["receive", "assemble", "queue", "decode", "present", "total", "input"]
+ROLES = ["default", "session", "ctrl", "takion", "takion recv", "takion mac", "rudp send buffer", "gkcrypt",
+         "timer wheel", "video decode", "audio decode", "discovery", "discovery service", "regist", "holepunch",
+         "log", "recorder", "telemetry", "fec"]
+
+NETWORK_FIELDS = ["received", "lost", "window_received", "window_lost", "jitter_video_us", "jitter_audio_us",
+                  "delay_video_us", "rtt_us"]
+VIDEO_FIELDS = ["frames", "frames_failed", "frames_fec_recovered", "ref_frame_misses", "bitrate_kbps"]
+AUDIO_QUEUE_FIELDS = ["audio_frames", "audio_frames_dropped", "audio_queue_depth", "audio_decode_us"]
+APP_FIELDS = ["fps", "audio_buffered_ms", "audio_target_ms", "audio_underruns", "audio_overruns", "app_cpu_ms"]
+
+
+def stage_name(i):
+    return STAGES[i] if i < len(STAGES) else "stage%d" % i
+
+
+def role_name(i):
+    return ROLES[i] if i < len(ROLES) else "role%d" % i
+
+
+def parse(data):
+    if len(data) < 20 or data[:4] != MAGIC:
+        return None
+    version, stage_count, role_count, seq, time_us = struct.unpack_from("<HBBIQ", data, 4)
+    if version != VERSION:
+        return None
+    fields = struct.unpack_from("<%dI" % ((len(data) - 20) // 4), data, 20)
+    expected = stage_count * (5 + COARSE_BUCKETS) + len(NETWORK_FIELDS) + len(VIDEO_FIELDS) \
+        + len(AUDIO_QUEUE_FIELDS) + len(APP_FIELDS) + role_count * 2
+    if len(fields) != expected:
+        return None
+    pos = 0
+
+    def take(n):
+        nonlocal pos
+        values = fields[pos:pos + n]
+        pos += n
+        return values
+
+    snap = {"seq": seq, "time_us": time_us, "stages": [], "roles": []}
+    for i in range(stage_count):
+        count, avg_us, p95_us, p99_us, max_us = take(5)
+        snap["stages"].append({"name": stage_name(i), "count": count, "avg_us": avg_us, "p95_us": p95_us,
+                               "p99_us": p99_us, "max_us": max_us, "buckets": list(take(COARSE_BUCKETS))})
+    for names in (NETWORK_FIELDS, VIDEO_FIELDS, AUDIO_QUEUE_FIELDS, APP_FIELDS):
+        snap.update(zip(names, take(len(names))))
+    for i in range(role_count):
+        cpu_ms, running = take(2)
+        snap["roles"].append({"name": role_name(i), "cpu_ms": cpu_ms, "running": running})
+    return snap
+
+
+def bucket_percentile(buckets, percent):
+    """Upper bound of the coarse bucket holding the given share of the samples of an interval."""
+    total = sum(buckets)
+    if not total:
+        return 0
+    target = total * percent / 100.0
+    seen = 0
+    for k, n in enumerate(buckets):
+        seen += n
+        if seen >= target:
+            return COARSE_BUCKET_US << k
+    return COARSE_BUCKET_US << (len(buckets) - 1)
+
+
+class Interval:
+    """What happened between two snapshots."""
+
+    def __init__(self, prev, cur):
+        self.cur = cur
+        self.seconds = max((cur["time_us"] - prev["time_us"]) / 1e6, 1e-6)
+        self.missed = cur["seq"] - prev["seq"] - 1
+        self.stages = []
+        for a, b in zip(prev["stages"], cur["stages"]):
+            buckets = [max(y - x, 0) for x, y in zip(a["buckets"], b["buckets"])]
+            self.stages.append({"name": b["name"], "count": max(b["count"] - a["count"], 0),
+                                "p50_us": bucket_percentile(buckets, 50), "p95_us": bucket_percentile(buckets, 95)})
+        received = cur["received"] - prev["received"]
+        lost = cur["lost"] - prev["lost"]
+        self.loss = lost / (received + lost) if received + lost > 0 else 0.0
+        self.fps = (cur["frames"] - prev["frames"]) / self.seconds
+        self.frames_failed = cur["frames_failed"] - prev["frames_failed"]
+        self.underruns = cur["audio_underruns"] - prev["audio_underruns"]
+        self.roles = []
+        for a, b in zip(prev["roles"], cur["roles"]):
+            # threads that ended in between can make the total drop for a moment
+            load = max(b["cpu_ms"] - a["cpu_ms"], 0) / (self.seconds * 1000.0)
+            self.roles.append({"name": b["name"], "load": load, "running": b["running"]})
+
+    def stage(self, name):
+        for s in self.stages:
+            if s["name"] == name:
+                return s
+        return {"count": 0, "p50_us": 0, "p95_us": 0}
+
+    def line(self):
+        total = self.stage("total")
+        decode = self.stage("decode")
+        busy = sorted((r for r in self.roles if r["load"] >= 0.01), key=lambda r: -r["load"])[:4]
+        return ("%7.1fs %5.1f fps  total p50 %5.1f p95 %5.1f ms  decode p95 %5.1f ms  loss %5.2f%%  "
+                "jitter %5.1f ms  rtt %5.1f ms  %6d kbit/s  audio %3d ms%s  %s%s") % (
+            self.cur["time_us"] / 1e6, self.fps, total["p50_us"] / 1000.0, total["p95_us"] / 1000.0,
+            decode["p95_us"] / 1000.0, self.loss * 100.0, self.cur["jitter_video_us"] / 1000.0,
+            self.cur["rtt_us"] / 1000.0, self.cur["bitrate_kbps"], self.cur["audio_buffered_ms"],
+            " (%d underruns)" % self.underruns if self.underruns else "",
+            " ".join("%s %d%%" % (r["name"], r["load"] * 100) for r in busy),
+            "  (%d snapshots missed)" % self.missed if self.missed > 0 else "")
+
+
+class CsvLog:
+    def __init__(self, path):
+        self.file = open(path, "w")
+        self.header = None
+
+    def write(self, interval):
+        row = {"time_s": interval.cur["time_us"] / 1e6, "fps": interval.fps, "loss": interval.loss,
+               "frames_failed": interval.frames_failed}
+        for name in NETWORK_FIELDS + VIDEO_FIELDS + AUDIO_QUEUE_FIELDS + APP_FIELDS:
+            row[name] = interval.cur[name]
+        for s in interval.stages:
+            row["%s_p50_us" % s["name"]] = s["p50_us"]
+            row["%s_p95_us" % s["name"]] = s["p95_us"]
+        for r in interval.roles:
+            row["cpu_%s" % r["name"].replace(" ", "_")] = "%.3f" % r["load"]
+        if self.header is None:
+            self.header = list(row)
+            self.file.write(",".join(self.header) + "\n")
+        self.file.write(",".join(str(row.get(k, "")) for k in self.header) + "\n")
+        self.file.flush()
+
+
+class Plot:
+    HISTORY_S = 60
+
+    def __init__(self):
+        import matplotlib.pyplot as plt
+        self.plt = plt
+        plt.ion()
+        self.fig, (self.ax_latency, self.ax_net, self.ax_cpu) = plt.subplots(3, 1, sharex=True, figsize=(10, 8))
+        self.intervals = []
+
+    def add(self, interval):
+        self.intervals.append(interval)
+        start = interval.cur["time_us"] / 1e6 - self.HISTORY_S
+        self.intervals = [i for i in self.intervals if i.cur["time_us"] / 1e6 >= start]
+
+    def draw(self):
+        t = [i.cur["time_us"] / 1e6 for i in self.intervals]
+        self.ax_latency.clear()
+        for name in ("total", "decode", "receive"):
+            self.ax_latency.plot(t, [i.stage(name)["p95_us"] / 1000.0 for i in self.intervals], label="%s p95" % name)
+        self.ax_latency.set_ylabel("ms")
+        self.ax_latency.legend(loc="upper left")
+        self.ax_net.clear()
+        self.ax_net.plot(t, [i.loss * 100.0 for i in self.intervals], label="loss %")
+        self.ax_net.plot(t, [i.cur["jitter_video_us"] / 1000.0 for i in self.intervals], label="jitter ms")
+        self.ax_net.plot(t, [i.cur["audio_buffered_ms"] for i in self.intervals], label="audio buffered ms")
+        self.ax_net.legend(loc="upper left")
+        self.ax_cpu.clear()
+        if self.intervals:
+            for k, role in enumerate(self.intervals[-1].roles):
+                loads = [i.roles[k]["load"] * 100.0 for i in self.intervals]
+                if max(loads) >= 1.0:
+                    self.ax_cpu.plot(t, loads, label=role["name"])
+        self.ax_cpu.set_ylabel("CPU %")
+        self.ax_cpu.set_xlabel("s")
+        self.ax_cpu.legend(loc="upper left", fontsize="small")
+        self.plt.pause(0.001)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Receive Vita telemetry snapshots")
+    parser.add_argument("--port", type=int, default=DEFAULT_PORT)
+    parser.add_argument("--csv", help="append every interval to this file")
+    parser.add_argument("--plot", action="store_true", help="plot live with matplotlib")
+    args = parser.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("", args.port))
+    sock.settimeout(0.2)
+    csv = CsvLog(args.csv) if args.csv else None
+    plot = Plot() if args.plot else None
+    print("Listening on UDP port %d" % args.port, file=sys.stderr)
+
+    prev = {}
+    last_draw = 0.0
+    while True:
+        try:
+            data, addr = sock.recvfrom(2048)
+        except socket.timeout:
+            data = None
+        except KeyboardInterrupt:
+            break
+        if data:
+            snap = parse(data)
+            if snap is None:
+                print("Ignoring invalid snapshot from %s" % addr[0], file=sys.stderr)
+                continue
+            last = prev.get(addr[0])
+            prev[addr[0]] = snap
+            # a new session restarts the counters
+            if last is None or snap["seq"] <= last["seq"]:
+                print("Session from %s" % addr[0], file=sys.stderr)
+                continue
+            interval = Interval(last, snap)
+            print(interval.line())
+            if csv:
+                csv.write(interval)
+            if plot:
+                plot.add(interval)
+        if plot and time.monotonic() - last_draw >= 0.5:
+            plot.draw()
+            last_draw = time.monotonic()
+
+
+if __name__ == "__main__":
+    main()
@@ -2,20 +2,47 @@
 #include <stdlib.h>
 #include <psp2/audioout.h>
 #include <psp2/kernel/threadmgr.h>
+#include <chiaki/trace.h>
 
 
 #include "audio.h"
 #include "context.h"
 
-// The following parameters may need to be changed if audio problems crop up
+// The following parameters come from the latency profile of the session
+// (context.stream.latency_profile) and may need to be changed if audio problems crop up
 //
-// DEVICE_BUFFERS: number of device buffers in the intermediate buffer
+// device_buffers: number of device buffers in the intermediate buffer
 // A larger value should make queue clearing and the corresponding audio chop
 // less frequent.
-#define DEVICE_BUFFERS 4
-// DEVICE_FRAME_QUEUE_LIMIT: Send more audio to the device when there are
+static size_t device_buffers = 4;
+// device_frame_queue_limit: Send more audio to the device when there are
 // samples corresponding to this many frames remaining in the device queue
-#define DEVICE_FRAME_QUEUE_LIMIT 0
+static size_t device_frame_queue_limit = 0;
+
+// Jitter buffer: how late frames arrive compared to the frame duration is kept
+// for the last JITTER_WINDOW frames, in 1ms buckets. Every JITTER_UPDATE_FRAMES
+// the target depth (frames waiting in `buffer`) is set so the jitter_percentile
+// (usually p95) lateness is covered. The depth is then steered towards the target
+// one frame at a time, by dropping or duplicating frames that are close to silence,
+// so it is not audible.
+#define JITTER_WINDOW 256
+#define JITTER_BUCKETS 100
+#define JITTER_UPDATE_FRAMES 50
+// the network jitter of the audio stream, as measured by the session, times this
+// is covered as well, in case the decoder thread smooths out some of the lateness
+#define JITTER_NETWORK_FACTOR 3
+// peak amplitude below which a frame may be dropped or duplicated
+#define JITTER_SILENCE_PEAK 512
+static size_t jitter_percentile = 95;
+
+// Clock drift: the host's audio clock and sceAudioOut's are not exactly the same,
+// so the depth slowly moves away from the target. Every JITTER_UPDATE_FRAMES the
+// depth error feeds a PI controller whose output is the playback rate correction,
+// applied by a linear interpolating resampler in front of `buffer`.
+// Error units are 1/16 frame, correction units are ppm.
+#define DRIFT_MAX_PPM 5000
+#define DRIFT_KP 32
+#define DRIFT_KI 2
 
 // Notes:
 // 1. The Vita requires a sample count divisible by 64.
@@ -25,16 +52,16 @@
 // 2. Our intermediate buffer is longer than the buffer we send to the audio
 //    device. We call the latter the `device_buffer` (sorry for my poor naming
 //    skills). So the intermediate buffer (`buffer`) consists of a total of
-//    `DEVICE_BUFFERS` device buffers, and each of these consists of
+//    `device_buffers` device buffers, and each of these consists of
 //    mult * frame_size samples in order to be divisible by 64.
 //    As we receive data from Chiaki (`buf_in`), we add it onto `buffer`. As
 //    each device_buffer segment gets filled out, we send it to the audio device.
 // 3. Audio is not sent to the device until it has has <=
-//    DEVICE_FRAME_QUEUE_LIMIT*frame_size samples remaining (gotten through
-//    sceAudioOutGetRestSample). This value, along with the DEVICE_BUFFERS
+//    device_frame_queue_limit*frame_size samples remaining (gotten through
+//    sceAudioOutGetRestSample). This value, along with the device_buffers
 //    parameter, may need to be adjusted if there are audio problems in
 //    different situations. I have tested only on decent wifi and a PS5, for
-//    which DEVICE_FRAME_QUEUE_LIMIT=0 works and the audio data from chiaki
+//    which device_frame_queue_limit=0 works and the audio data from chiaki
 //    never gets ahead of the audio output device.
 
 int port = -1;
@@ -49,8 +76,8 @@ size_t frame_size; // # of samples in frame
 int16_t* buffer;
 size_t buffer_frames; // # of frames in buffer
 size_t buffer_samples; // # of samples in buffer
-size_t device_buffer_frames; // # of frames in device_buffer (buffer_frames / DEVICE_BUFFERS)
-size_t device_buffer_samples; // # of samples in device buffer (buffer_samples / DEVICE_BUFFERS)
+size_t device_buffer_frames; // # of frames in device_buffer (buffer_frames / device_buffers)
+size_t device_buffer_samples; // # of samples in device buffer (buffer_samples / device_buffers)
 size_t sample_bytes; // channels * sizeof(int16_t)
 size_t sample_steps; // (=channels) steps to use for array arithmetic
 size_t buffer_bytes; // size of buffer in bytes = buffer_samples * sample_bytes
@@ -66,9 +93,34 @@ size_t device_buffer_offset;
 int write_read_framediff;
 
 // Audio buffer monitoring for detecting lag accumulation
-static uint64_t audio_catchup_count = 0;
+static uint64_t audio_catchup_count = 0; // overruns
 static uint64_t audio_frames_processed = 0;
 
+static uint64_t jitter_last_arrival_us = 0;
+static uint8_t jitter_samples[JITTER_WINDOW]; // bucket of each of the last frames
+static size_t jitter_samples_next = 0;
+static size_t jitter_samples_count = 0;
+static uint32_t jitter_buckets[JITTER_BUCKETS];
+static int jitter_target_frames = 0;
+static int jitter_depth_avg_x16 = 0; // average of write_read_framediff, fixed point * 16
+static bool audio_starving = false;
+static uint32_t audio_underruns = 0;
+static uint32_t audio_frames_dropped = 0;
+static uint32_t audio_frames_duplicated = 0;
+
+static int av_sync_delay_frames = 0; // added to the jitter target to keep audio in sync with video
+static int drift_integral_ppm = 0;
+static int drift_correction_ppm = 0;
+
+// Resampler input, interleaved: sample 0 is the last one already used, then the
+// ones not consumed yet. Position and step are 16.16 fixed point, in samples.
+// Opus decodes straight into its end, and it is resampled straight into `buffer`.
+static int16_t *resample_in = NULL;
+static size_t resample_in_capacity; // in samples per channel
+static size_t resample_in_count;
+static uint32_t resample_pos;
+static uint32_t resample_step;
+
 size_t device_buffer_from_frame(int frame) {
     return (size_t) ( (frame + buffer_frames) % buffer_frames ) / device_buffer_frames;
 }
@@ -95,6 +147,164 @@ void vita_audio_init(unsigned int channels_, unsigned int rate_, void *user) {
 }
 
 
+static void jitter_reset() {
+    jitter_last_arrival_us = 0;
+    jitter_samples_next = 0;
+    jitter_samples_count = 0;
+    memset(jitter_buckets, 0, sizeof(jitter_buckets));
+    jitter_target_frames = device_buffer_frames;
+    jitter_depth_avg_x16 = 0;
+    audio_starving = false;
+    audio_underruns = 0;
+    audio_frames_dropped = 0;
+    audio_frames_duplicated = 0;
+    drift_integral_ppm = 0;
+    drift_correction_ppm = 0;
+    av_sync_delay_frames = 0;
+}
+
+static int clamp_ppm(int ppm) {
+    return ppm > DRIFT_MAX_PPM ? DRIFT_MAX_PPM : (ppm < -DRIFT_MAX_PPM ? -DRIFT_MAX_PPM : ppm);
+}
+
+// Positive error means the buffer is too full, so input is consumed slightly faster
+static void drift_update() {
+    int err_x16 = jitter_depth_avg_x16 - jitter_target_frames * 16;
+    drift_integral_ppm = clamp_ppm(drift_integral_ppm + err_x16 * DRIFT_KI);
+    drift_correction_ppm = clamp_ppm(drift_integral_ppm + err_x16 * DRIFT_KP);
+    resample_step = (uint32_t)((1 << 16) + (int64_t)drift_correction_ppm * (1 << 16) / 1000000);
+}
+
+static void resample_reset() {
+    memset(resample_in, 0, sample_bytes);
+    resample_in_count = 1;
+    resample_pos = 0;
+    resample_step = 1 << 16;
+}
+
+// Where the next frame has to go in the resampler input
+static int16_t *resample_tail() {
+    if (resample_in_count + frame_size > resample_in_capacity) {
+        // can not happen with the correction limited to DRIFT_MAX_PPM
+        LOGD("VITA AUDIO :: resampler overflow");
+        resample_reset();
+    }
+    return resample_in + resample_in_count * sample_steps;
+}
+
+static void resample_push(int16_t *frame) {
+    int16_t *tail = resample_tail();
+    if (frame != tail)
+        memcpy(tail, frame, frame_size * sample_bytes);
+    resample_in_count += frame_size;
+}
+
+// Produce one frame at the current rate, if there is enough input for it
+static bool resample_pull(int16_t *out) {
+    uint32_t pos = resample_pos;
+    uint32_t step = resample_step;
+    if (((pos + (frame_size - 1) * step) >> 16) + 1 >= resample_in_count)
+        return false;
+
+    if (step == 1 << 16 && (pos & 0xFFFF) == 0) {
+        memcpy(out, resample_in + (pos >> 16) * sample_steps, frame_size * sample_bytes);
+        pos += frame_size << 16;
+    } else {
+        for (size_t i = 0; i < frame_size; i++) {
+            int16_t *a = resample_in + (pos >> 16) * sample_steps;
+            int16_t *b = a + sample_steps;
+            int32_t frac = (pos & 0xFFFF) >> 1; // Q15, so the product fits in 32 bits
+            for (size_t c = 0; c < sample_steps; c++)
+                out[i * sample_steps + c] = (int16_t)(a[c] + (((b[c] - a[c]) * frac) >> 15));
+            pos += step;
+        }
+    }
+
+    size_t consumed = pos >> 16;
+    resample_in_count -= consumed;
+    memmove(resample_in, resample_in + consumed * sample_steps, resample_in_count * sample_bytes);
+    resample_pos = pos & 0xFFFF;
+    return true;
+}
+
+static uint64_t frame_duration_us() {
+    return (uint64_t)frame_size * 1000000 / rate;
+}
+
+// Record how late this frame is compared to the previous one
+static void jitter_arrival() {
+    uint64_t now = sceKernelGetSystemTimeWide();
+    uint64_t last = jitter_last_arrival_us;
+    jitter_last_arrival_us = now;
+    if (!last)
+        return;
+    uint64_t interval = now - last;
+    uint64_t frame_us = frame_duration_us();
+    uint64_t late_ms = interval > frame_us ? (interval - frame_us) / 1000 : 0;
+    uint8_t bucket = late_ms < JITTER_BUCKETS ? (uint8_t)late_ms : JITTER_BUCKETS - 1;
+
+    if (jitter_samples_count == JITTER_WINDOW)
+        jitter_buckets[jitter_samples[jitter_samples_next]]--;
+    else
+        jitter_samples_count++;
+    jitter_samples[jitter_samples_next] = bucket;
+    jitter_samples_next = (jitter_samples_next + 1) % JITTER_WINDOW;
+    jitter_buckets[bucket]++;
+}
+
+// Target depth in frames: one device buffer plus enough frames to cover the jitter_percentile lateness,
+// or the network jitter if that is higher
+static void jitter_update_target() {
+    if (!jitter_samples_count)
+        return;
+    size_t target = (jitter_samples_count * jitter_percentile + 99) / 100;
+    size_t seen = 0;
+    int p95_ms = JITTER_BUCKETS;
+    for (int i = 0; i < JITTER_BUCKETS; i++) {
+        seen += jitter_buckets[i];
+        if (seen >= target) {
+            p95_ms = i + 1;
+            break;
+        }
+    }
+    ChiakiJitterStats network;
+    chiaki_session_get_jitter_stats(&context.stream.session, &network);
+    int network_ms = (int)((network.streams[CHIAKI_JITTER_STREAM_AUDIO].jitter_us * JITTER_NETWORK_FACTOR + 999) / 1000);
+    if (network_ms > p95_ms)
+        p95_ms = network_ms;
+    uint64_t frame_us = frame_duration_us();
+    int frames = device_buffer_frames + av_sync_delay_frames + (int)(((uint64_t)p95_ms * 1000 + frame_us - 1) / frame_us);
+    int max_frames = buffer_frames - device_buffer_frames;
+    if (frames > max_frames)
+        frames = max_frames;
+    if (frames != jitter_target_frames) {
+        LOGD("VITA AUDIO :: jitter p95 %d ms, target depth %d -> %d frames", p95_ms, jitter_target_frames, frames);
+        // a reordered frame may use up half the margin for lateness, frames arriving
+        // late on their own still need the other half
+        int margin = frames - device_buffer_frames;
+        chiaki_session_audio_reorder_deadline(&context.stream.session, margin > 0 ? (uint64_t)margin * frame_us / 2 : 0);
+    }
+    jitter_target_frames = frames;
+}
+
+// Report how long the newest frame takes to be played and pick up the delay the A/V sync wants
+static void av_sync_update() {
+    uint64_t frame_us = frame_duration_us();
+    ChiakiSession *session = &context.stream.session;
+    chiaki_session_av_sync_audio_latency(session, (uint64_t)vita_audio_buffered_ms() * 1000 + frame_us);
+    ChiakiAVSyncState state;
+    chiaki_session_get_av_sync(session, &state);
+    av_sync_delay_frames = (int)((state.audio_delay_us + frame_us / 2) / frame_us);
+}
+
+static bool frame_is_silent(int16_t *frame) {
+    for (size_t i = 0; i < frame_size * sample_steps; i++) {
+        if (frame[i] > JITTER_SILENCE_PEAK || frame[i] < -JITTER_SILENCE_PEAK)
+            return false;
+    }
+    return true;
+}
+
 // Determine required buffer size and allocate the required memory
 void init_buffer() {
     // set global buffer_frames
@@ -106,8 +316,14 @@ void init_buffer() {
         device_buffer_frames = 64 / two_pow;
     }
 
+    ChiakiLatencyProfile *profile = &context.stream.latency_profile;
+    // at least two, so one can be filled while the other is played
+    device_buffers = profile->audio_device_buffers >= 2 ? profile->audio_device_buffers : 2;
+    device_frame_queue_limit = profile->audio_device_queue_frames;
+    jitter_percentile = profile->audio_jitter_percentile > 0 && profile->audio_jitter_percentile <= 100 ? profile->audio_jitter_percentile : 95;
+
     // set globals
-    buffer_frames = device_buffer_frames * DEVICE_BUFFERS;
+    buffer_frames = device_buffer_frames * device_buffers;
     buffer_samples = frame_size * buffer_frames;
     buffer_bytes = buffer_samples * sample_bytes;
 
@@ -118,6 +334,12 @@ void init_buffer() {
     write_frame_offset = 0;
     device_buffer_offset = 0;
     write_read_framediff = 0;
+    jitter_reset();
+
+    // the history sample, up to two frames waiting at the slowest rate and the new one
+    resample_in_capacity = 3 * frame_size + 1;
+    resample_in = (int16_t*)malloc(resample_in_capacity * sample_bytes);
+    resample_reset();
 
     LOGD("VITA AUDIO :: buffer init: buffer_frames %d, buffer_samples %d, buffer_bytes %d, frame_size %d, sample_bytes %d", buffer_frames, buffer_samples, buffer_bytes, frame_size, sample_bytes);
 }
@@ -129,84 +351,157 @@ void vita_audio_cleanup() {
             float catchup_rate = (float)audio_catchup_count / (float)audio_frames_processed * 100.0f;
             LOGD("VITA AUDIO :: Session stats - Frames: %lu, Catchups: %lu (%.2f%%)",
                  audio_frames_processed, audio_catchup_count, catchup_rate);
+            LOGD("VITA AUDIO :: Jitter buffer - target %d frames, underruns %u, dropped %u, duplicated %u",
+                 jitter_target_frames, audio_underruns, audio_frames_dropped, audio_frames_duplicated);
+            LOGD("VITA AUDIO :: Clock drift correction %d ppm at the end", drift_correction_ppm);
         }
 
         free(buffer);
+        free(resample_in);
+        resample_in = NULL;
         did_secondary_init = false;
         audio_catchup_count = 0;
         audio_frames_processed = 0;
     }
 }
 
-void vita_audio_cb(int16_t *buf_in, size_t samples_count, void *user) {
-    if (!did_secondary_init) {
-        // Set audio thread priority for low latency
-        sceKernelChangeThreadPriority(SCE_KERNEL_THREAD_ID_SELF, 64);
-        sceKernelChangeThreadCpuAffinityMask(SCE_KERNEL_THREAD_ID_SELF, 0);
-
-        frame_size = samples_count;
+void vita_audio_get_stats(VitaAudioStats *stats) {
+    stats->buffered_ms = vita_audio_buffered_ms();
+    stats->target_ms = did_secondary_init ? (unsigned int)(jitter_target_frames * frame_duration_us() / 1000) : 0;
+    stats->underruns = audio_underruns;
+    stats->overruns = (uint32_t)audio_catchup_count;
+    stats->dropped = audio_frames_dropped;
+    stats->duplicated = audio_frames_duplicated;
+    stats->drift_ppm = drift_correction_ppm;
+}
 
-        init_buffer();
+unsigned int vita_audio_buffered_ms() {
+    if (!did_secondary_init || rate <= 0)
+        return 0;
+    int rest_samples = sceAudioOutGetRestSample(port);
+    int samples = write_read_framediff * (int)frame_size + (rest_samples > 0 ? rest_samples : 0);
+    return (unsigned int)(samples * 1000 / rate);
+}
 
-        sceAudioOutSetConfig(port, device_buffer_samples, rate, channels == 2 ? SCE_AUDIO_OUT_PARAM_FORMAT_S16_STEREO : SCE_AUDIO_OUT_PARAM_FORMAT_S16_MONO);
+static int16_t *buffer_write_frame() {
+    return buffer + write_frame_offset * frame_size * sample_steps;
+}
 
-        did_secondary_init = true;
-        LOGD("VITA AUDIO :: secondary init complete");
+// Take the frame just written at `write_frame_offset` into `buffer` and pass the next
+// device buffer on once the device is ready
+static void buffer_frame() {
+    int16_t *frame = buffer_write_frame();
+    // steer the depth towards the target, only on frames nobody will hear missing or doubled
+    jitter_depth_avg_x16 += write_read_framediff - jitter_depth_avg_x16 / 16;
+    int writes = 1;
+    if (frame_is_silent(frame)) {
+        if (jitter_depth_avg_x16 > (jitter_target_frames + 1) * 16) {
+            writes = 0;
+            audio_frames_dropped++;
+        } else if (jitter_depth_avg_x16 < jitter_target_frames * 16 && write_read_framediff + 2 < buffer_frames) {
+            writes = 2;
+            audio_frames_duplicated++;
+        }
     }
 
-    if (samples_count == frame_size) {
-
-        // write to buffer
-        memcpy(buffer + write_frame_offset*frame_size*sample_steps, buf_in, frame_size * sample_bytes);
+    // advance past it, or a copy of it for a duplicate
+    for (int i = 0; i < writes; i++) {
+        if (i > 0)
+            memcpy(buffer_write_frame(), frame, frame_size * sample_bytes);
         write_frame_offset = (write_frame_offset + 1) % buffer_frames;
         write_read_framediff++;
-        audio_frames_processed++;
+    }
 
-        if (write_read_framediff >= device_buffer_frames) {
-
-            bool should_output = false;
-            if (write_read_framediff >= buffer_frames) {
-                // If the incoming buffers (write) have caught up to the audio
-                // (read), just skip ahead. This should be analogous to the
-                // queue clearing in the nintendo switch code.
-                //
-                // Specifically: if we have just written to a frame filling up
-                // the device buffer behind the current device buffer offset,
-                // move the device buffer offset back by one so that we output
-                // the data just written. Otherwise, if we wait for the next
-                // frame, we'll be stuck playing a device buffer which contains
-                // one frame of new data and the rest old data.
-
-                audio_catchup_count++;
-
-                LOGD("VITA AUDIO :: audio catchup: [before] write_read_framediff %d, write_frame_offset %d, device_buffer_offset %d (read frame offset %d)", write_read_framediff, write_frame_offset, device_buffer_offset, device_buffer_offset*device_buffer_frames);
-
-                device_buffer_offset = device_buffer_from_frame( ((int) write_frame_offset) - 1 );
-
-                write_read_framediff = device_buffer_frames + write_frame_offset % device_buffer_frames;
-
-                LOGD("VITA AUDIO :: audio catchup: [before] write_read_framediff %d, write_frame_offset %d, device_buffer_offset %d (read frame offset %d)", write_read_framediff, write_frame_offset, device_buffer_offset, device_buffer_offset*device_buffer_frames);
-                should_output = true;
-            } else {
-                // Otherwise, tell the device to output only if it has <=
-                // DEVICE_FRAME_QUEUE_LIMIT*frame_size samples remaining.
-                //
-                // NOTE: I'm not sure how the Vita audio out works. I think we
-                // want to avoid too long of an audio queue, but this has never
-                // happened in my testing. If we run into audio problems this
-                // would be a good place to start debugging.
-                int remaining_samples = sceAudioOutGetRestSample(port);
-                if (remaining_samples <= DEVICE_FRAME_QUEUE_LIMIT*frame_size) should_output = true;
-            }
-
-            if (should_output) {
-                sceAudioOutOutput(port, buffer + device_buffer_offset*device_buffer_samples*sample_steps);
-                device_buffer_offset = (device_buffer_offset + 1) % DEVICE_BUFFERS;
-                write_read_framediff -= device_buffer_frames;
-            }
-            //LOGD("VITA AUDIO :: Vita audio output write_read_framediff: %d", write_read_framediff);
+    if (write_read_framediff < device_buffer_frames) {
+        // nothing to give to the device, count it once if it ran dry meanwhile
+        if (!audio_starving && sceAudioOutGetRestSample(port) == 0) {
+            audio_starving = true;
+            audio_underruns++;
         }
+    } else {
+
+        bool should_output = false;
+        if (write_read_framediff >= buffer_frames) {
+            // If the incoming buffers (write) have caught up to the audio
+            // (read), just skip ahead. This should be analogous to the
+            // queue clearing in the nintendo switch code.
+            //
+            // Specifically: if we have just written to a frame filling up
+            // the device buffer behind the current device buffer offset,
+            // move the device buffer offset back by one so that we output
+            // the data just written. Otherwise, if we wait for the next
+            // frame, we'll be stuck playing a device buffer which contains
+            // one frame of new data and the rest old data.
+
+            audio_catchup_count++;
+
+            LOGD("VITA AUDIO :: audio catchup: [before] write_read_framediff %d, write_frame_offset %d, device_buffer_offset %d (read frame offset %d)", write_read_framediff, write_frame_offset, device_buffer_offset, device_buffer_offset*device_buffer_frames);
+
+            device_buffer_offset = device_buffer_from_frame( ((int) write_frame_offset) - 1 );
+
+            write_read_framediff = device_buffer_frames + write_frame_offset % device_buffer_frames;
+
+            LOGD("VITA AUDIO :: audio catchup: [before] write_read_framediff %d, write_frame_offset %d, device_buffer_offset %d (read frame offset %d)", write_read_framediff, write_frame_offset, device_buffer_offset, device_buffer_offset*device_buffer_frames);
+            should_output = true;
+        } else {
+            // Otherwise, tell the device to output only if it has <=
+            // device_frame_queue_limit*frame_size samples remaining.
+            //
+            // NOTE: I'm not sure how the Vita audio out works. I think we
+            // want to avoid too long of an audio queue, but this has never
+            // happened in my testing. If we run into audio problems this
+            // would be a good place to start debugging.
+            int remaining_samples = sceAudioOutGetRestSample(port);
+            if (remaining_samples <= device_frame_queue_limit*frame_size) should_output = true;
+        }
+
+        if (should_output) {
+            audio_starving = false;
+            CHIAKI_TRACE(AUDIO_OUTPUT, AUDIO_OUTPUT, device_buffer_offset);
+            sceAudioOutOutput(port, buffer + device_buffer_offset*device_buffer_samples*sample_steps);
+            device_buffer_offset = (device_buffer_offset + 1) % device_buffers;
+            write_read_framediff -= device_buffer_frames;
+        }
+        //LOGD("VITA AUDIO :: Vita audio output write_read_framediff: %d", write_read_framediff);
+    }
+}
+
+static void secondary_init(size_t samples_count) {
+    // runs on the audio decode queue thread, which the library creates with a low latency priority
+    frame_size = samples_count;
+
+    init_buffer();
+
+    sceAudioOutSetConfig(port, device_buffer_samples, rate, channels == 2 ? SCE_AUDIO_OUT_PARAM_FORMAT_S16_STEREO : SCE_AUDIO_OUT_PARAM_FORMAT_S16_MONO);
+
+    did_secondary_init = true;
+    LOGD("VITA AUDIO :: secondary init complete");
+}
+
+int16_t *vita_audio_buf_cb(size_t samples_count, void *user) {
+    if (!did_secondary_init)
+        secondary_init(samples_count);
+    if (samples_count != frame_size)
+        return NULL;
+    return resample_tail();
+}
+
+void vita_audio_cb(int16_t *buf_in, size_t samples_count, void *user) {
+    if (!did_secondary_init)
+        secondary_init(samples_count);
+
+    if (samples_count == frame_size) {
+        jitter_arrival();
+        if (audio_frames_processed % JITTER_UPDATE_FRAMES == 0) {
+            av_sync_update();
+            jitter_update_target();
+            drift_update();
+        }
+        audio_frames_processed++;
 
+        resample_push(buf_in);
+        while (resample_pull(buffer_write_frame()))
+            buffer_frame();
     } else {
         LOGD("VITA AUDIO :: Expected %d (frame_size) samples but received %d.", frame_size, samples_count);
     }
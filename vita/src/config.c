@@ -1,13 +1,126 @@
 #include <sys/param.h>
+#include <stdarg.h>
 #include <string.h>
 #include <tomlc99/toml.h>
 #include <chiaki/base64.h>
+#include <chiaki/thread.h>
+#include <chiaki/time.h>
 
 #include "config.h"
 #include "context.h"
 #include "host.h"
 #include "util.h"
 
+#define CFG_TMP_SUFFIX ".tmp"
+#define CFG_WRITE_DELAY_MS 500  // changes within this time after the first one are written together
+#define CFG_HOST_CACHE_MAGIC 0x48434b56  // "VKCH"
+#define CFG_HOST_CACHE_VERSION 1
+
+/// Growing buffer the config is serialized into, data is NULL if an allocation failed
+typedef struct config_buf_t {
+  char* data;
+  size_t len;
+  size_t size;
+} ConfigBuf;
+
+typedef struct config_host_cache_header_t {
+  uint32_t magic;
+  uint32_t version;
+  // the records are copied as they are, so layout changes invalidate the cache
+  uint32_t registered_host_size;
+  uint32_t stream_history_size;
+  // of the host sections of the TOML file the cache was written with
+  uint32_t hosts_hash;
+  uint32_t hosts_len;
+  uint32_t num_registered_hosts;
+  uint32_t num_stream_histories;
+  uint32_t num_manual_hosts;
+} ConfigHostCacheHeader;
+
+/// Writes the config off the UI thread, see config_serialize()
+static struct {
+  bool started;
+  ChiakiThread thread;
+  ChiakiMutex mutex;
+  ChiakiCond cond;
+  bool text;  // text_buf and cache_buf hold a state that is not written yet
+  ConfigBuf text_buf;
+  ConfigBuf cache_buf;
+  uint64_t due_us;
+  bool writing;
+  bool flush;
+} config_store;
+
+static bool cfg_reserve(ConfigBuf* out, size_t len) {
+  if (!out->data && out->size) return false;
+  if (out->len + len + 1 <= out->size) return true;
+  size_t size = out->size ? out->size : 4096;
+  while (size < out->len + len + 1) size *= 2;
+  char* data = realloc(out->data, size);
+  if (!data) {
+    free(out->data);
+    out->data = NULL;
+    return false;
+  }
+  out->data = data;
+  out->size = size;
+  return true;
+}
+
+static void cfg_append(ConfigBuf* out, const void* data, size_t len) {
+  if (!cfg_reserve(out, len)) return;
+  memcpy(out->data + out->len, data, len);
+  out->len += len;
+  out->data[out->len] = '\0';
+}
+
+static void cfg_printf(ConfigBuf* out, const char* fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(NULL, 0, fmt, args);
+  va_end(args);
+  if (len < 0 || !cfg_reserve(out, len)) return;
+  va_start(args, fmt);
+  vsnprintf(out->data + out->len, len + 1, fmt, args);
+  va_end(args);
+  out->len += len;
+}
+
+/// FNV-1a
+static uint32_t config_hash(const char* data, size_t len) {
+  uint32_t hash = 0x811c9dc5;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (uint8_t)data[i];
+    hash *= 0x01000193;
+  }
+  return hash;
+}
+
+/// @return where the [[manual_hosts]] and [[registered_hosts]] sections start, they follow the settings
+static size_t config_hosts_offset(const char* text) {
+  const char* hosts = strstr(text, "\n[[");
+  return hosts ? (size_t)(hosts - text) + 1 : strlen(text);
+}
+
+char* config_read_file(const char* filename, size_t* size) {
+  FILE* fp = fopen(filename, "rb");
+  if (!fp) return NULL;
+  char* data = NULL;
+  if (fseek(fp, 0, SEEK_END) != 0) goto error;
+  long len = ftell(fp);
+  if (len < 0 || fseek(fp, 0, SEEK_SET) != 0) goto error;
+  data = malloc(len + 1);
+  if (!data || fread(data, 1, len, fp) != (size_t)len) goto error;
+  data[len] = '\0';
+  fclose(fp);
+  *size = len;
+  return data;
+error:
+  free(data);
+  fclose(fp);
+  return NULL;
+}
+
 void zero_pad(char* buf, size_t size) {
   bool pad = false;
   for (int i=0; i < size; i++) {
@@ -32,12 +145,155 @@ VitaChiakiDisconnectAction parse_disconnect_action(char* action) {
   return DISCONNECT_ACTION_NOTHING;
 }
 
+VitaChiakiFramePacing parse_frame_pacing(char* pacing) {
+  if (strcmp(pacing, "smoothest") == 0)
+    return FRAME_PACING_SMOOTHEST;
+  return FRAME_PACING_LOWEST_LATENCY;
+}
+
+VitaChiakiInputSampling parse_input_sampling(char* sampling) {
+  if (strcmp(sampling, "blocking") == 0)
+    return INPUT_SAMPLING_BLOCKING;
+  if (strcmp(sampling, "feedback") == 0)
+    return INPUT_SAMPLING_FEEDBACK;
+  return INPUT_SAMPLING_VBLANK;
+}
+
+VitaChiakiThreadPlacement parse_thread_placement(char* placement) {
+  if (strcmp(placement, "default") == 0)
+    return THREAD_PLACEMENT_DEFAULT;
+  return THREAD_PLACEMENT_SPREAD;
+}
+
+ChiakiLatencyMode parse_latency_mode(char* mode) {
+  if (strcmp(mode, "competitive") == 0)
+    return CHIAKI_LATENCY_MODE_COMPETITIVE;
+  if (strcmp(mode, "unstable_wifi") == 0)
+    return CHIAKI_LATENCY_MODE_UNSTABLE_WIFI;
+  return CHIAKI_LATENCY_MODE_BALANCED;
+}
+
+VitaChiakiMemPlacement parse_mem_placement(char* placement) {
+  if (strcmp(placement, "cdram") == 0)
+    return MEM_PLACEMENT_CDRAM;
+  if (strcmp(placement, "phycont") == 0)
+    return MEM_PLACEMENT_PHYCONT;
+  if (strcmp(placement, "main") == 0)
+    return MEM_PLACEMENT_MAIN;
+  return MEM_PLACEMENT_AUTO;
+}
+
+VitaChiakiDscp parse_dscp(char* dscp) {
+  if (strcmp(dscp, "off") == 0)
+    return DSCP_OFF;
+  if (strcmp(dscp, "ef") == 0)
+    return DSCP_EF;
+  return DSCP_AF41;
+}
+
+typedef struct probe_button_name_t {
+  const char* name;
+  uint32_t button;
+} ProbeButtonName;
+
+static const ProbeButtonName probe_button_names[] = {
+  { "cross", CHIAKI_CONTROLLER_BUTTON_CROSS },
+  { "circle", CHIAKI_CONTROLLER_BUTTON_MOON },
+  { "square", CHIAKI_CONTROLLER_BUTTON_BOX },
+  { "triangle", CHIAKI_CONTROLLER_BUTTON_PYRAMID },
+  { "l1", CHIAKI_CONTROLLER_BUTTON_L1 },
+  { "r1", CHIAKI_CONTROLLER_BUTTON_R1 },
+  { "options", CHIAKI_CONTROLLER_BUTTON_OPTIONS },
+  { "touchpad", CHIAKI_CONTROLLER_BUTTON_TOUCHPAD },
+};
+
+uint32_t parse_probe_button(char* button) {
+  for (size_t i = 0; i < sizeof(probe_button_names) / sizeof(probe_button_names[0]); i++) {
+    if (strcmp(button, probe_button_names[i].name) == 0)
+      return probe_button_names[i].button;
+  }
+  return CHIAKI_CONTROLLER_BUTTON_CROSS;
+}
+
+const char* serialize_probe_button(uint32_t button) {
+  for (size_t i = 0; i < sizeof(probe_button_names) / sizeof(probe_button_names[0]); i++) {
+    if (probe_button_names[i].button == button)
+      return probe_button_names[i].name;
+  }
+  return "cross";
+}
+
 ChiakiVideoResolutionPreset parse_resolution_preset(char* preset) {
   if (strcmp(preset, "360p") == 0)
     return CHIAKI_VIDEO_RESOLUTION_PRESET_360p;
   return CHIAKI_VIDEO_RESOLUTION_PRESET_540p;
 }
 
+VitaChiakiStreamHistory* config_stream_history(VitaChiakiConfig* cfg, uint8_t* server_mac, bool create) {
+  for (size_t i = 0; i < cfg->num_stream_histories; i++) {
+    if (memcmp(cfg->stream_histories[i].server_mac, server_mac, 6) == 0)
+      return &cfg->stream_histories[i];
+  }
+  if (!create || cfg->num_stream_histories >= MAX_NUM_HOSTS)
+    return NULL;
+  VitaChiakiStreamHistory* history = &cfg->stream_histories[cfg->num_stream_histories++];
+  memset(history, 0, sizeof(*history));
+  memcpy(history->server_mac, server_mac, 6);
+  return history;
+}
+
+static void parse_path(VitaChiakiStreamHistory* history, toml_table_t* host_cfg) {
+  toml_datum_t datum = toml_string_in(host_cfg, "path_network");
+  if (!datum.ok)
+    return;
+  strncpy(history->path_network, datum.u.s, sizeof(history->path_network) - 1);
+  free(datum.u.s);
+  datum = toml_int_in(host_cfg, "path_mtu_in");
+  history->path_mtu_in = datum.ok && datum.u.i > 0 ? (uint32_t)datum.u.i : 0;
+  datum = toml_int_in(host_cfg, "path_mtu_out");
+  history->path_mtu_out = datum.ok && datum.u.i > 0 ? (uint32_t)datum.u.i : 0;
+  datum = toml_int_in(host_cfg, "path_rtt_us");
+  history->path_rtt_us = datum.ok && datum.u.i > 0 ? (uint64_t)datum.u.i : 0;
+  datum = toml_int_in(host_cfg, "path_time");
+  // only complete measurements count
+  if (datum.ok && datum.u.i > 0 && history->path_mtu_in && history->path_mtu_out && history->path_rtt_us)
+    history->path_time = (uint64_t)datum.u.i;
+}
+
+static void parse_stream_history(VitaChiakiConfig* cfg, toml_table_t* host_cfg, uint8_t* server_mac) {
+  toml_datum_t datum = toml_int_in(host_cfg, "stream_history_sessions");
+  bool has_sessions = datum.ok && datum.u.i > 0;
+  toml_datum_t path_time = toml_int_in(host_cfg, "path_time");
+  bool has_path = path_time.ok && path_time.u.i > 0;
+  if (!has_sessions && !has_path)
+    return;
+  VitaChiakiStreamHistory* history = config_stream_history(cfg, server_mac, true);
+  if (!history)
+    return;
+  if (has_path)
+    parse_path(history, host_cfg);
+  if (!has_sessions)
+    return;
+  history->sessions = (uint32_t)datum.u.i;
+  datum = toml_string_in(host_cfg, "stream_history_resolution");
+  if (datum.ok) {
+    history->resolution = parse_resolution_preset(datum.u.s);
+    free(datum.u.s);
+  } else {
+    history->resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_540p;
+  }
+  datum = toml_int_in(host_cfg, "stream_history_fps");
+  history->fps = datum.ok && datum.u.i == 60 ? CHIAKI_VIDEO_FPS_PRESET_60 : CHIAKI_VIDEO_FPS_PRESET_30;
+  datum = toml_int_in(host_cfg, "stream_history_bitrate");
+  history->bitrate = datum.ok && datum.u.i > 0 ? (uint32_t)datum.u.i : 0;
+  datum = toml_int_in(host_cfg, "stream_history_loss_permille");
+  history->loss_permille = datum.ok && datum.u.i > 0 ? (uint32_t)datum.u.i : 0;
+  datum = toml_int_in(host_cfg, "stream_history_decode_us");
+  history->decode_us = datum.ok && datum.u.i > 0 ? (uint32_t)datum.u.i : 0;
+  datum = toml_int_in(host_cfg, "stream_history_fps_achieved");
+  history->fps_achieved = datum.ok && datum.u.i > 0 ? (uint32_t)datum.u.i : 0;
+}
+
 ChiakiTarget parse_target(char* target_name) {
   if (strcmp("ps4_unknown", target_name) == 0) {
     return CHIAKI_TARGET_PS4_UNKNOWN;
@@ -71,37 +327,154 @@ bool get_circle_btn_confirm_default() {
   return (button_assign == 0);
 }
 
+static bool host_cache_valid(const char* cache, size_t cache_len, const char* hosts_text, size_t hosts_len) {
+  ConfigHostCacheHeader header;
+  if (cache_len < sizeof(header)) return false;
+  memcpy(&header, cache, sizeof(header));
+  if (header.magic != CFG_HOST_CACHE_MAGIC || header.version != CFG_HOST_CACHE_VERSION ||
+      header.registered_host_size != sizeof(ChiakiRegisteredHost) ||
+      header.stream_history_size != sizeof(VitaChiakiStreamHistory) ||
+      header.num_registered_hosts > MAX_NUM_HOSTS || header.num_stream_histories > MAX_NUM_HOSTS ||
+      header.num_manual_hosts > MAX_NUM_HOSTS)
+    return false;
+  if (header.hosts_len != hosts_len || header.hosts_hash != config_hash(hosts_text, hosts_len))
+    return false;
+  // the manual hosts are variable-sized, check that they are all there
+  size_t pos = sizeof(header) + header.num_registered_hosts * sizeof(ChiakiRegisteredHost) +
+               header.num_stream_histories * sizeof(VitaChiakiStreamHistory);
+  for (uint32_t i = 0; i < header.num_manual_hosts; i++) {
+    uint16_t len;
+    if (pos + 6 + sizeof(len) > cache_len) return false;
+    memcpy(&len, cache + pos + 6, sizeof(len));
+    pos += 6 + sizeof(len) + len;
+  }
+  return pos == cache_len;
+}
+
+/// Fill in the hosts from a cache that host_cache_valid() accepted
+static void load_host_cache(VitaChiakiConfig* cfg, const char* cache) {
+  ConfigHostCacheHeader header;
+  memcpy(&header, cache, sizeof(header));
+  const char* pos = cache + sizeof(header);
+  for (uint32_t i = 0; i < header.num_registered_hosts; i++) {
+    VitaChiakiHost* host = calloc(1, sizeof(VitaChiakiHost));
+    ChiakiRegisteredHost* rstate = malloc(sizeof(ChiakiRegisteredHost));
+    if (!host || !rstate) {
+      free(host);
+      free(rstate);
+      return;
+    }
+    memcpy(rstate, pos, sizeof(ChiakiRegisteredHost));
+    pos += sizeof(ChiakiRegisteredHost);
+    host->registered_state = rstate;
+    memcpy(host->server_mac, rstate->server_mac, 6);
+    host->target = rstate->target;
+    cfg->registered_hosts[cfg->num_registered_hosts++] = host;
+  }
+  memcpy(cfg->stream_histories, pos, header.num_stream_histories * sizeof(VitaChiakiStreamHistory));
+  cfg->num_stream_histories = header.num_stream_histories;
+  pos += header.num_stream_histories * sizeof(VitaChiakiStreamHistory);
+  for (uint32_t i = 0; i < header.num_manual_hosts; i++) {
+    uint8_t server_mac[6];
+    uint16_t len;
+    memcpy(server_mac, pos, 6);
+    memcpy(&len, pos + 6, sizeof(len));
+    const char* hostname = pos + 6 + sizeof(len);
+    pos += 6 + sizeof(len) + len;
+    // like in the TOML, manual hosts without a registration are dropped
+    for (size_t hidx = 0; hidx < cfg->num_registered_hosts; hidx++) {
+      if (!mac_addrs_match(&server_mac, &cfg->registered_hosts[hidx]->server_mac)) continue;
+      VitaChiakiHost* host = malloc(sizeof(VitaChiakiHost));
+      if (!host) return;
+      copy_host(host, cfg->registered_hosts[hidx], false);
+      host->type = REGISTERED | MANUALLY_ADDED;
+      host->hostname = strndup(hostname, len);
+      cfg->manual_hosts[cfg->num_manual_hosts++] = host;
+      break;
+    }
+  }
+}
+
 void config_parse(VitaChiakiConfig* cfg) {
   cfg->psn_account_id = NULL;
   cfg->auto_discovery = true;
   cfg->disconnect_action = DISCONNECT_ACTION_ASK;
   cfg->resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_540p;
   cfg->fps = CHIAKI_VIDEO_FPS_PRESET_30;
+  cfg->auto_profile = false;
+  cfg->num_stream_histories = 0;
   cfg->controller_map_id = 0;
   cfg->show_latency = false;  // Default: latency display disabled
+  cfg->show_stream_stats = false;
+  cfg->low_power_ui = false;
+  cfg->frame_pacing = FRAME_PACING_LOWEST_LATENCY;
+  cfg->decode_yuv420 = false;
+  cfg->direct_display = false;
+  cfg->gpu_upscale = false;
+  cfg->low_latency_decoder = false;
+  cfg->decoder_latency_test = false;
+  cfg->av_sync_max_offset_ms = 40;
+  cfg->input_sampling = INPUT_SAMPLING_VBLANK;
+  cfg->input_immediate_send = true;
+  cfg->input_state_rate_max = 125;
+  cfg->delay_based_congestion_control = true;
+  cfg->fast_path_probe = true;
+  cfg->path_cache = true;
+  cfg->thread_placement = THREAD_PLACEMENT_SPREAD;
+  cfg->latency_mode = CHIAKI_LATENCY_MODE_BALANCED;
+  cfg->mem_videodec = MEM_PLACEMENT_AUTO;
+  cfg->mem_decoder = MEM_PLACEMENT_AUTO;
+  cfg->mem_textures = MEM_PLACEMENT_AUTO;
+  // an I frame at 15 MBit/s is about this long at line rate
+  cfg->recv_buffer_burst_ms = 100;
+  cfg->dscp = DSCP_AF41;
+  cfg->backlog_skip_ms = 200;
+  cfg->resume = true;
+  cfg->file_log = false;
+  cfg->trace = false;
+  cfg->capture = false;
+  cfg->record = false;
+  cfg->impair = NULL;
+  cfg->telemetry = NULL;
+  cfg->latency_probe = NULL;
+  cfg->latency_probe_button = CHIAKI_CONTROLLER_BUTTON_CROSS;
 
   bool circle_btn_confirm_default = get_circle_btn_confirm_default();
   cfg->circle_btn_confirm = circle_btn_confirm_default;
 
-  if (access(CFG_FILENAME, F_OK) == 0) {
-    FILE* fp = fopen(CFG_FILENAME, "r");
+  // only the temporary file is left if writing stopped between removing and renaming
+  if (access(CFG_FILENAME, F_OK) != 0 && access(CFG_FILENAME CFG_TMP_SUFFIX, F_OK) == 0)
+    rename(CFG_FILENAME CFG_TMP_SUFFIX, CFG_FILENAME);
+
+  size_t text_len;
+  char* text = config_read_file(CFG_FILENAME, &text_len);
+  if (text) {
+    // with a matching host cache only the settings need to be parsed
+    size_t hosts_offset = config_hosts_offset(text);
+    size_t cache_len = 0;
+    char* cache = config_read_file(CFG_HOST_CACHE_FILENAME, &cache_len);
+    bool cached = cache && host_cache_valid(cache, cache_len, text + hosts_offset, text_len - hosts_offset);
+    if (cached)
+      text[hosts_offset] = '\0';
+
     char errbuf[200];
-    toml_table_t* parsed = toml_parse_file(fp, errbuf, sizeof(errbuf));
-    fclose(fp);
-    if (!cfg) {
+    toml_table_t* parsed = toml_parse(text, errbuf, sizeof(errbuf));
+    free(text);
+    if (!parsed) {
       CHIAKI_LOGE(&(context.log), "Failed to parse config due to illegal TOML: %s", errbuf);
-      return NULL;
+      free(cache);
+      return;
     }
     toml_table_t* general = toml_table_in(parsed, "general");
     if (!general) {
       CHIAKI_LOGE(&(context.log), "Failed to parse config due to missing [general] section");
-      return NULL;
+      goto done;
     }
     toml_datum_t datum;
     datum = toml_int_in(general, "version");
     if (!datum.ok || datum.u.i != CFG_VERSION) {
       CHIAKI_LOGE(&(context.log), "Failed to parse config due to bad general.version, expected %d.", CFG_VERSION);
-      return NULL;
+      goto done;
     }
 
     toml_table_t* settings = toml_table_in(parsed, "settings");
@@ -117,6 +490,7 @@ void config_parse(VitaChiakiConfig* cfg) {
       }
       datum = toml_string_in(settings, "resolution");
       if (datum.ok) {
+        cfg->auto_profile = strcmp(datum.u.s, "auto") == 0;
         cfg->resolution = parse_resolution_preset(datum.u.s);
         free(datum.u.s);
       } else {
@@ -145,141 +519,266 @@ void config_parse(VitaChiakiConfig* cfg) {
 
       datum = toml_bool_in(settings, "show_latency");
       cfg->show_latency = datum.ok ? datum.u.b : false;  // Default: disabled
+
+      datum = toml_bool_in(settings, "show_stream_stats");
+      cfg->show_stream_stats = datum.ok ? datum.u.b : false;
+
+      datum = toml_bool_in(settings, "low_power_ui");
+      cfg->low_power_ui = datum.ok ? datum.u.b : false;
+
+      datum = toml_string_in(settings, "frame_pacing");
+      if (datum.ok) {
+        cfg->frame_pacing = parse_frame_pacing(datum.u.s);
+        free(datum.u.s);
+      }
+
+      datum = toml_bool_in(settings, "decode_yuv420");
+      cfg->decode_yuv420 = datum.ok ? datum.u.b : false;
+
+      datum = toml_bool_in(settings, "direct_display");
+      cfg->direct_display = datum.ok ? datum.u.b : false;
+
+      datum = toml_bool_in(settings, "gpu_upscale");
+      cfg->gpu_upscale = datum.ok ? datum.u.b : false;
+
+      datum = toml_bool_in(settings, "low_latency_decoder");
+      cfg->low_latency_decoder = datum.ok ? datum.u.b : false;
+
+      datum = toml_bool_in(settings, "decoder_latency_test");
+      cfg->decoder_latency_test = datum.ok ? datum.u.b : false;
+
+      datum = toml_int_in(settings, "av_sync_max_offset_ms");
+      if (datum.ok && datum.u.i >= 0) {
+        cfg->av_sync_max_offset_ms = datum.u.i;
+      }
+
+      datum = toml_string_in(settings, "input_sampling");
+      if (datum.ok) {
+        cfg->input_sampling = parse_input_sampling(datum.u.s);
+        free(datum.u.s);
+      }
+
+      datum = toml_bool_in(settings, "input_immediate_send");
+      cfg->input_immediate_send = datum.ok ? datum.u.b : true;
+      datum = toml_int_in(settings, "input_state_rate_max");
+      if (datum.ok && datum.u.i >= 0) {
+        cfg->input_state_rate_max = datum.u.i;
+      }
+      datum = toml_bool_in(settings, "delay_based_congestion_control");
+      cfg->delay_based_congestion_control = datum.ok ? datum.u.b : true;
+      datum = toml_bool_in(settings, "fast_path_probe");
+      cfg->fast_path_probe = datum.ok ? datum.u.b : true;
+      datum = toml_bool_in(settings, "path_cache");
+      cfg->path_cache = datum.ok ? datum.u.b : true;
+      datum = toml_string_in(settings, "thread_placement");
+      if (datum.ok) {
+        cfg->thread_placement = parse_thread_placement(datum.u.s);
+        free(datum.u.s);
+      }
+      datum = toml_string_in(settings, "latency_mode");
+      if (datum.ok) {
+        cfg->latency_mode = parse_latency_mode(datum.u.s);
+        free(datum.u.s);
+      }
+      datum = toml_string_in(settings, "mem_videodec");
+      if (datum.ok) {
+        cfg->mem_videodec = parse_mem_placement(datum.u.s);
+        free(datum.u.s);
+      }
+      datum = toml_string_in(settings, "mem_decoder");
+      if (datum.ok) {
+        cfg->mem_decoder = parse_mem_placement(datum.u.s);
+        free(datum.u.s);
+      }
+      datum = toml_string_in(settings, "mem_textures");
+      if (datum.ok) {
+        cfg->mem_textures = parse_mem_placement(datum.u.s);
+        free(datum.u.s);
+      }
+      datum = toml_int_in(settings, "recv_buffer_burst_ms");
+      if (datum.ok && datum.u.i >= 0) {
+        cfg->recv_buffer_burst_ms = datum.u.i;
+      }
+      datum = toml_string_in(settings, "dscp");
+      if (datum.ok) {
+        cfg->dscp = parse_dscp(datum.u.s);
+        free(datum.u.s);
+      }
+      datum = toml_int_in(settings, "backlog_skip_ms");
+      if (datum.ok && datum.u.i >= 0) {
+        cfg->backlog_skip_ms = datum.u.i;
+      }
+      datum = toml_bool_in(settings, "resume");
+      cfg->resume = datum.ok ? datum.u.b : true;
+      datum = toml_bool_in(settings, "file_log");
+      cfg->file_log = datum.ok ? datum.u.b : false;
+      datum = toml_bool_in(settings, "trace");
+      cfg->trace = datum.ok ? datum.u.b : false;
+      datum = toml_bool_in(settings, "capture");
+      cfg->capture = datum.ok ? datum.u.b : false;
+      datum = toml_bool_in(settings, "record");
+      cfg->record = datum.ok ? datum.u.b : false;
+      datum = toml_string_in(settings, "impair");
+      if (datum.ok) {
+        cfg->impair = datum.u.s;
+      }
+      datum = toml_string_in(settings, "telemetry");
+      if (datum.ok) {
+        cfg->telemetry = datum.u.s;
+      }
+      datum = toml_string_in(settings, "latency_probe");
+      if (datum.ok) {
+        cfg->latency_probe = datum.u.s;
+      }
+      datum = toml_string_in(settings, "latency_probe_button");
+      if (datum.ok) {
+        cfg->latency_probe_button = parse_probe_button(datum.u.s);
+        free(datum.u.s);
+      }
     }
 
-    toml_array_t* regist_hosts = toml_array_in(parsed, "registered_hosts");
-    if (regist_hosts && toml_array_kind(regist_hosts) == 't') {
-      int num_rhosts = toml_array_nelem(regist_hosts);
-      for (int i=0; i < MIN(MAX_NUM_HOSTS, num_rhosts); i++) {
-        VitaChiakiHost* host = malloc(sizeof(VitaChiakiHost));
-        ChiakiRegisteredHost* rstate = malloc(sizeof(ChiakiRegisteredHost));
-        LOGD("Assigning registered state: 0x%x", rstate);
-        host->registered_state = rstate;
-        toml_table_t* host_cfg = toml_table_at(regist_hosts, i);
-        datum = toml_string_in(host_cfg, "server_mac");
-        if (datum.ok) {
-          parse_b64(datum.u.s, host->server_mac, 6);
-          printf("MAC %X%X%X%X%X%X\n", host->server_mac[0], host->server_mac[1], host->server_mac[2],
-                          host->server_mac[3], host->server_mac[4], host->server_mac[5]);
-          memcpy(&rstate->server_mac, &(host->server_mac), 6);
-          free(datum.u.s);
-        }
-        datum = toml_string_in(host_cfg, "server_nickname");
-        if (datum.ok) {
-          strncpy(rstate->server_nickname, datum.u.s, sizeof(rstate->server_nickname));
-          rstate->server_nickname[sizeof(rstate->server_nickname)-1] = '\0';
-          free(datum.u.s);
-        }
-        datum = toml_string_in(host_cfg, "target");
-        if (datum.ok) {
-          rstate->target = parse_target(datum.u.s);
-          host->target = parse_target(datum.u.s);
-          free(datum.u.s);
-        }
-        datum = toml_string_in(host_cfg, "rp_key");
-        if (datum.ok) {
-          printf("after rp %s\n", datum.u.s);
-          parse_b64(datum.u.s, rstate->rp_key, 0x10);
-          hexdump(rstate->rp_key, (size_t)0x10);
-          free(datum.u.s);
-        }
-        datum = toml_int_in(host_cfg, "rp_key_type");
-        if (datum.ok) {
-          rstate->rp_key_type = datum.u.i;
-        }
-        datum = toml_string_in(host_cfg, "rp_regist_key");
-        if (datum.ok) {
-          strncpy(rstate->rp_regist_key, datum.u.s, sizeof(rstate->rp_regist_key));
-          zero_pad(rstate->rp_regist_key, sizeof(rstate->rp_regist_key));
-          free(datum.u.s);
+    if (cached) {
+      load_host_cache(cfg, cache);
+    } else {
+      toml_array_t* regist_hosts = toml_array_in(parsed, "registered_hosts");
+      if (regist_hosts && toml_array_kind(regist_hosts) == 't') {
+        int num_rhosts = toml_array_nelem(regist_hosts);
+        for (int i=0; i < MIN(MAX_NUM_HOSTS, num_rhosts); i++) {
+          VitaChiakiHost* host = malloc(sizeof(VitaChiakiHost));
+          ChiakiRegisteredHost* rstate = malloc(sizeof(ChiakiRegisteredHost));
+          LOGD("Assigning registered state: 0x%x", rstate);
+          host->registered_state = rstate;
+          toml_table_t* host_cfg = toml_table_at(regist_hosts, i);
+          datum = toml_string_in(host_cfg, "server_mac");
+          if (datum.ok) {
+            parse_b64(datum.u.s, host->server_mac, 6);
+            printf("MAC %X%X%X%X%X%X\n", host->server_mac[0], host->server_mac[1], host->server_mac[2],
+                            host->server_mac[3], host->server_mac[4], host->server_mac[5]);
+            memcpy(&rstate->server_mac, &(host->server_mac), 6);
+            free(datum.u.s);
+          }
+          datum = toml_string_in(host_cfg, "server_nickname");
+          if (datum.ok) {
+            strncpy(rstate->server_nickname, datum.u.s, sizeof(rstate->server_nickname));
+            rstate->server_nickname[sizeof(rstate->server_nickname)-1] = '\0';
+            free(datum.u.s);
+          }
+          datum = toml_string_in(host_cfg, "target");
+          if (datum.ok) {
+            rstate->target = parse_target(datum.u.s);
+            host->target = parse_target(datum.u.s);
+            free(datum.u.s);
+          }
+          datum = toml_string_in(host_cfg, "rp_key");
+          if (datum.ok) {
+            printf("after rp %s\n", datum.u.s);
+            parse_b64(datum.u.s, rstate->rp_key, 0x10);
+            hexdump(rstate->rp_key, (size_t)0x10);
+            free(datum.u.s);
+          }
+          datum = toml_int_in(host_cfg, "rp_key_type");
+          if (datum.ok) {
+            rstate->rp_key_type = datum.u.i;
+          }
+          datum = toml_string_in(host_cfg, "rp_regist_key");
+          if (datum.ok) {
+            strncpy(rstate->rp_regist_key, datum.u.s, sizeof(rstate->rp_regist_key));
+            zero_pad(rstate->rp_regist_key, sizeof(rstate->rp_regist_key));
+            free(datum.u.s);
+          }
+          parse_stream_history(cfg, host_cfg, host->server_mac);
+          // datum = toml_string_in(host_cfg, "ap_bssid");
+          // if (datum.ok) {
+          //   strncpy(rstate->ap_bssid, datum.u.s, sizeof(rstate->ap_bssid));
+          //   zero_pad(rstate->ap_bssid, sizeof(rstate->ap_bssid));
+          //   free(datum.u.s);
+          // }
+          // datum = toml_string_in(host_cfg, "ap_key");
+          // if (datum.ok) {
+          //   strncpy(rstate->ap_key, datum.u.s, sizeof(rstate->ap_key));
+          //   zero_pad(rstate->ap_key, sizeof(rstate->ap_key));
+          //   free(datum.u.s);
+          // }
+          // datum = toml_string_in(host_cfg, "ap_ssid");
+          // if (datum.ok) {
+          //   strncpy(rstate->ap_ssid, datum.u.s, sizeof(rstate->ap_ssid));
+          //   zero_pad(rstate->ap_ssid, sizeof(rstate->ap_ssid));
+          //   free(datum.u.s);
+          // }
+          // datum = toml_string_in(host_cfg, "ap_name");
+          // if (datum.ok) {
+          //   strncpy(rstate->ap_name, datum.u.s, sizeof(rstate->ap_name));
+          //   zero_pad(rstate->ap_name, sizeof(rstate->ap_name));
+          //   free(datum.u.s);
+          // }
+          cfg->registered_hosts[i] = host;
+          cfg->num_registered_hosts++;
         }
-        // datum = toml_string_in(host_cfg, "ap_bssid");
-        // if (datum.ok) {
-        //   strncpy(rstate->ap_bssid, datum.u.s, sizeof(rstate->ap_bssid));
-        //   zero_pad(rstate->ap_bssid, sizeof(rstate->ap_bssid));
-        //   free(datum.u.s);
-        // }
-        // datum = toml_string_in(host_cfg, "ap_key");
-        // if (datum.ok) {
-        //   strncpy(rstate->ap_key, datum.u.s, sizeof(rstate->ap_key));
-        //   zero_pad(rstate->ap_key, sizeof(rstate->ap_key));
-        //   free(datum.u.s);
-        // }
-        // datum = toml_string_in(host_cfg, "ap_ssid");
-        // if (datum.ok) {
-        //   strncpy(rstate->ap_ssid, datum.u.s, sizeof(rstate->ap_ssid));
-        //   zero_pad(rstate->ap_ssid, sizeof(rstate->ap_ssid));
-        //   free(datum.u.s);
-        // }
-        // datum = toml_string_in(host_cfg, "ap_name");
-        // if (datum.ok) {
-        //   strncpy(rstate->ap_name, datum.u.s, sizeof(rstate->ap_name));
-        //   zero_pad(rstate->ap_name, sizeof(rstate->ap_name));
-        //   free(datum.u.s);
-        // }
-        cfg->registered_hosts[i] = host;
-        cfg->num_registered_hosts++;
       }
-    }
 
-    toml_array_t* manual_hosts = toml_array_in(parsed, "manual_hosts");
-    if (manual_hosts && toml_array_kind(manual_hosts) == 't') {
-      int num_mhosts = toml_array_nelem(manual_hosts);
-      LOGD("Found %d manual hosts", num_mhosts);
-      for (int i=0; i < MIN(MAX_NUM_HOSTS, num_mhosts) ; i++) {
-        VitaChiakiHost* host = NULL;
-
-        bool has_mac = false;
-        bool has_hostname = false;
-        bool has_registration = false;
-
-        toml_table_t* host_cfg = toml_table_at(manual_hosts, i);
-        datum = toml_string_in(host_cfg, "server_mac");
-        uint8_t server_mac[6];
-        if (datum.ok) {
-          // We have a MAC for the manual host, try to find corresponding
-          // registered host
-          parse_b64(datum.u.s, server_mac, sizeof(server_mac));
-          has_mac = true;
-          free(datum.u.s);
-          for (int hidx=0; hidx < cfg->num_registered_hosts; hidx++) {
-            uint8_t* candidate_mac = cfg->registered_hosts[hidx]->server_mac;
-            if (candidate_mac) {
-              if (mac_addrs_match(&server_mac, candidate_mac)) {
-                // copy registered host (TODO for the registered_state, should we use a pointer instead?)
-                host = malloc(sizeof(VitaChiakiHost));
-                copy_host(host, cfg->registered_hosts[hidx], false);
-                host->type = REGISTERED;
-                has_registration = true;
-                break;
+      toml_array_t* manual_hosts = toml_array_in(parsed, "manual_hosts");
+      if (manual_hosts && toml_array_kind(manual_hosts) == 't') {
+        int num_mhosts = toml_array_nelem(manual_hosts);
+        LOGD("Found %d manual hosts", num_mhosts);
+        for (int i=0; i < MIN(MAX_NUM_HOSTS, num_mhosts) ; i++) {
+          VitaChiakiHost* host = NULL;
+
+          bool has_mac = false;
+          bool has_hostname = false;
+          bool has_registration = false;
+
+          toml_table_t* host_cfg = toml_table_at(manual_hosts, i);
+          datum = toml_string_in(host_cfg, "server_mac");
+          uint8_t server_mac[6];
+          if (datum.ok) {
+            // We have a MAC for the manual host, try to find corresponding
+            // registered host
+            parse_b64(datum.u.s, server_mac, sizeof(server_mac));
+            has_mac = true;
+            free(datum.u.s);
+            for (int hidx=0; hidx < cfg->num_registered_hosts; hidx++) {
+              uint8_t* candidate_mac = cfg->registered_hosts[hidx]->server_mac;
+              if (candidate_mac) {
+                if (mac_addrs_match(&server_mac, candidate_mac)) {
+                  // copy registered host (TODO for the registered_state, should we use a pointer instead?)
+                  host = malloc(sizeof(VitaChiakiHost));
+                  copy_host(host, cfg->registered_hosts[hidx], false);
+                  host->type = REGISTERED;
+                  has_registration = true;
+                  break;
+                }
               }
             }
           }
-        }
-        if (!host) {
-          // No corresponding registered host found. Don't save.
-          CHIAKI_LOGW(&(context.log), "Manual host missing registered host.");
-          continue;
-        }
+          if (!host) {
+            // No corresponding registered host found. Don't save.
+            CHIAKI_LOGW(&(context.log), "Manual host missing registered host.");
+            continue;
+          }
 
-        host->type |= MANUALLY_ADDED;
-        host->type &= ~DISCOVERED; // ensure discovered is off
+          host->type |= MANUALLY_ADDED;
+          host->type &= ~DISCOVERED; // ensure discovered is off
 
-        datum = toml_string_in(host_cfg, "hostname");
-        if (datum.ok) {
-          host->hostname = datum.u.s;
-          has_hostname = true;
-        }
+          datum = toml_string_in(host_cfg, "hostname");
+          if (datum.ok) {
+            host->hostname = datum.u.s;
+            has_hostname = true;
+          }
 
-        if (has_hostname && has_mac) {
-          cfg->manual_hosts[i] = host;
-          cfg->num_manual_hosts++;
-        } else {
-          CHIAKI_LOGW(&(context.log), "Failed to parse manual host due to missing hostname or mac.");
-          free(host);
+          if (has_hostname && has_mac) {
+            cfg->manual_hosts[i] = host;
+            cfg->num_manual_hosts++;
+          } else {
+            CHIAKI_LOGW(&(context.log), "Failed to parse manual host due to missing hostname or mac.");
+            free(host);
+          }
         }
       }
     }
+
+done:
+    toml_free(parsed);
+    free(cache);
   }
 }
 
@@ -288,6 +787,9 @@ void config_free(VitaChiakiConfig* cfg) {
     return;
   }
   free(cfg->psn_account_id);
+  free(cfg->impair);
+  free(cfg->telemetry);
+  free(cfg->latency_probe);
   for (int i = 0; i < MAX_NUM_HOSTS; i++) {
     if (cfg->manual_hosts[i] != NULL) {
       host_free(cfg->manual_hosts[i]);
@@ -299,6 +801,76 @@ void config_free(VitaChiakiConfig* cfg) {
   free(cfg);
 }
 
+char* serialize_frame_pacing(VitaChiakiFramePacing pacing) {
+  switch (pacing) {
+    case FRAME_PACING_SMOOTHEST:
+      return "smoothest";
+    case FRAME_PACING_LOWEST_LATENCY:
+    default:
+      return "lowest_latency";
+  }
+}
+
+char* serialize_thread_placement(VitaChiakiThreadPlacement placement) {
+  switch (placement) {
+    case THREAD_PLACEMENT_DEFAULT:
+      return "default";
+    case THREAD_PLACEMENT_SPREAD:
+    default:
+      return "spread";
+  }
+}
+
+char* serialize_latency_mode(ChiakiLatencyMode mode) {
+  switch (mode) {
+    case CHIAKI_LATENCY_MODE_COMPETITIVE:
+      return "competitive";
+    case CHIAKI_LATENCY_MODE_UNSTABLE_WIFI:
+      return "unstable_wifi";
+    case CHIAKI_LATENCY_MODE_BALANCED:
+    default:
+      return "balanced";
+  }
+}
+
+char* serialize_mem_placement(VitaChiakiMemPlacement placement) {
+  switch (placement) {
+    case MEM_PLACEMENT_CDRAM:
+      return "cdram";
+    case MEM_PLACEMENT_PHYCONT:
+      return "phycont";
+    case MEM_PLACEMENT_MAIN:
+      return "main";
+    case MEM_PLACEMENT_AUTO:
+    default:
+      return "auto";
+  }
+}
+
+char* serialize_dscp(VitaChiakiDscp dscp) {
+  switch (dscp) {
+    case DSCP_OFF:
+      return "off";
+    case DSCP_EF:
+      return "ef";
+    case DSCP_AF41:
+    default:
+      return "af41";
+  }
+}
+
+char* serialize_input_sampling(VitaChiakiInputSampling sampling) {
+  switch (sampling) {
+    case INPUT_SAMPLING_BLOCKING:
+      return "blocking";
+    case INPUT_SAMPLING_FEEDBACK:
+      return "feedback";
+    case INPUT_SAMPLING_VBLANK:
+    default:
+      return "vblank";
+  }
+}
+
 char* serialize_disconnect_action(VitaChiakiDisconnectAction action) {
   switch (action) {
     case DISCONNECT_ACTION_ASK:
@@ -321,7 +893,7 @@ char* serialize_resolution_preset(ChiakiVideoResolutionPreset preset) {
   }
 }
 
-void serialize_b64(FILE* fp, char* field_name, uint8_t* val, size_t len) {
+void serialize_b64(ConfigBuf* out, char* field_name, uint8_t* val, size_t len) {
   bool all_zero = true;
   for (size_t i=0; i < len; i++) {
     if (val[i] != 0) {
@@ -332,93 +904,317 @@ void serialize_b64(FILE* fp, char* field_name, uint8_t* val, size_t len) {
   if (all_zero) {
     return;
   }
-  fprintf(fp, "%s = \"", field_name);
+  cfg_printf(out, "%s = \"", field_name);
   // for (size_t i=0; i < len; i++) {
-  //   fprintf(fp, "%02X", val[i]);
+  //   cfg_printf(out, "%02X", val[i]);
   // }
   char b64[get_base64_size(len) + 1];
   memset(b64, 0, get_base64_size(len) + 1);
   chiaki_base64_encode(val, len, b64, get_base64_size(len));
-  fprintf(fp, "%s\"\n", b64);
+  cfg_printf(out, "%s\"\n", b64);
 }
 
-void serialize_target(FILE* fp, char* field_name, ChiakiTarget* target) {
-  fprintf(fp, "%s = \"", field_name);
+void serialize_target(ConfigBuf* out, char* field_name, ChiakiTarget* target) {
+  cfg_printf(out, "%s = \"", field_name);
   switch (*target) {
     case CHIAKI_TARGET_PS4_UNKNOWN:
-      fprintf(fp, "ps4_unknown");
+      cfg_printf(out, "ps4_unknown");
       break;
     case CHIAKI_TARGET_PS4_8:
-      fprintf(fp, "ps4_8");
+      cfg_printf(out, "ps4_8");
       break;
     case CHIAKI_TARGET_PS4_9:
-      fprintf(fp, "ps4_9");
+      cfg_printf(out, "ps4_9");
       break;
     case CHIAKI_TARGET_PS4_10:
-      fprintf(fp, "ps4_10");
+      cfg_printf(out, "ps4_10");
       break;
     case CHIAKI_TARGET_PS5_UNKNOWN:
-      fprintf(fp, "ps5_unknown");
+      cfg_printf(out, "ps5_unknown");
       break;
     case CHIAKI_TARGET_PS5_1:
-      fprintf(fp, "ps5_1");
+      cfg_printf(out, "ps5_1");
       break;
   }
-  fprintf(fp, "\"\n");
+  cfg_printf(out, "\"\n");
 }
 
-void config_serialize(VitaChiakiConfig* cfg) {
-  FILE *fp = fopen(CFG_FILENAME, "w");
-  fprintf(fp, "[general]\nversion = 1\n");
+/// Manual hosts are only saved with a valid mac
+static bool manual_host_saved(VitaChiakiHost* host) {
+  if (!host->hostname) return false;
+  for (int m = 0; m < 6; m++) {
+    if (host->server_mac[m] != 0) return true;
+  }
+  return false;
+}
+
+static void config_write_text(VitaChiakiConfig* cfg, ConfigBuf* out) {
+  cfg_printf(out, "[general]\nversion = 1\n");
 
   // Settings
-  fprintf(fp, "[settings]\n");
-  fprintf(fp, "auto_discovery = %s\n",
+  cfg_printf(out, "[settings]\n");
+  cfg_printf(out, "auto_discovery = %s\n",
           cfg->auto_discovery ? "true" : "false");
-  fprintf(fp, "disconnect_action = \"%s\"\n",
+  cfg_printf(out, "disconnect_action = \"%s\"\n",
           serialize_disconnect_action(cfg->disconnect_action));
-  fprintf(fp, "resolution = \"%s\"\n",
-          serialize_resolution_preset(cfg->resolution));
-  fprintf(fp, "fps = %d\n", cfg->fps);
+  cfg_printf(out, "resolution = \"%s\"\n",
+          cfg->auto_profile ? "auto" : serialize_resolution_preset(cfg->resolution));
+  cfg_printf(out, "fps = %d\n", cfg->fps);
   if (cfg->psn_account_id) {
-    fprintf(fp, "psn_account_id = \"%s\"\n", cfg->psn_account_id);
+    cfg_printf(out, "psn_account_id = \"%s\"\n", cfg->psn_account_id);
   }
-  fprintf(fp, "controller_map_id = %d\n", cfg->controller_map_id);
-  fprintf(fp, "circle_btn_confirm = %s\n",
+  cfg_printf(out, "controller_map_id = %d\n", cfg->controller_map_id);
+  cfg_printf(out, "circle_btn_confirm = %s\n",
           cfg->circle_btn_confirm ? "true" : "false");
-  fprintf(fp, "show_latency = %s\n",
+  cfg_printf(out, "show_latency = %s\n",
           cfg->show_latency ? "true" : "false");
+  cfg_printf(out, "show_stream_stats = %s\n",
+          cfg->show_stream_stats ? "true" : "false");
+  cfg_printf(out, "low_power_ui = %s\n",
+          cfg->low_power_ui ? "true" : "false");
+  cfg_printf(out, "frame_pacing = \"%s\"\n",
+          serialize_frame_pacing(cfg->frame_pacing));
+  cfg_printf(out, "decode_yuv420 = %s\n",
+          cfg->decode_yuv420 ? "true" : "false");
+  cfg_printf(out, "direct_display = %s\n",
+          cfg->direct_display ? "true" : "false");
+  cfg_printf(out, "gpu_upscale = %s\n",
+          cfg->gpu_upscale ? "true" : "false");
+  cfg_printf(out, "low_latency_decoder = %s\n",
+          cfg->low_latency_decoder ? "true" : "false");
+  cfg_printf(out, "decoder_latency_test = %s\n",
+          cfg->decoder_latency_test ? "true" : "false");
+  cfg_printf(out, "av_sync_max_offset_ms = %d\n", cfg->av_sync_max_offset_ms);
+  cfg_printf(out, "input_sampling = \"%s\"\n",
+          serialize_input_sampling(cfg->input_sampling));
+  cfg_printf(out, "input_immediate_send = %s\n",
+          cfg->input_immediate_send ? "true" : "false");
+  cfg_printf(out, "input_state_rate_max = %d\n", cfg->input_state_rate_max);
+  cfg_printf(out, "delay_based_congestion_control = %s\n",
+          cfg->delay_based_congestion_control ? "true" : "false");
+  cfg_printf(out, "fast_path_probe = %s\n",
+          cfg->fast_path_probe ? "true" : "false");
+  cfg_printf(out, "path_cache = %s\n",
+          cfg->path_cache ? "true" : "false");
+  cfg_printf(out, "thread_placement = \"%s\"\n",
+          serialize_thread_placement(cfg->thread_placement));
+  cfg_printf(out, "latency_mode = \"%s\"\n",
+          serialize_latency_mode(cfg->latency_mode));
+  cfg_printf(out, "mem_videodec = \"%s\"\n",
+          serialize_mem_placement(cfg->mem_videodec));
+  cfg_printf(out, "mem_decoder = \"%s\"\n",
+          serialize_mem_placement(cfg->mem_decoder));
+  cfg_printf(out, "mem_textures = \"%s\"\n",
+          serialize_mem_placement(cfg->mem_textures));
+  cfg_printf(out, "recv_buffer_burst_ms = %d\n", cfg->recv_buffer_burst_ms);
+  cfg_printf(out, "dscp = \"%s\"\n", serialize_dscp(cfg->dscp));
+  cfg_printf(out, "backlog_skip_ms = %d\n", cfg->backlog_skip_ms);
+  cfg_printf(out, "resume = %s\n",
+          cfg->resume ? "true" : "false");
+  cfg_printf(out, "file_log = %s\n",
+          cfg->file_log ? "true" : "false");
+  cfg_printf(out, "trace = %s\n",
+          cfg->trace ? "true" : "false");
+  cfg_printf(out, "capture = %s\n",
+          cfg->capture ? "true" : "false");
+  cfg_printf(out, "record = %s\n",
+          cfg->record ? "true" : "false");
+  if (cfg->impair) {
+    cfg_printf(out, "impair = \"%s\"\n", cfg->impair);
+  }
+  if (cfg->telemetry) {
+    cfg_printf(out, "telemetry = \"%s\"\n", cfg->telemetry);
+  }
+  if (cfg->latency_probe) {
+    cfg_printf(out, "latency_probe = \"%s\"\n", cfg->latency_probe);
+    cfg_printf(out, "latency_probe_button = \"%s\"\n", serialize_probe_button(cfg->latency_probe_button));
+  }
 
   for (int i = 0; i < cfg->num_manual_hosts; i++) {
     VitaChiakiHost* host = cfg->manual_hosts[i];
-    uint8_t* mac = NULL;
-    for (int m = 0; m < 6; m++) {
-      if (host->server_mac[m] != 0) {
-        mac = host->server_mac;
-        break;
-      }
-    }
-    if (mac) {
-      // only save if mac is valid
-      fprintf(fp, "\n\n[[manual_hosts]]\n");
-      fprintf(fp, "hostname = \"%s\"\n", host->hostname);
-      serialize_b64(fp, "server_mac", mac, 6);
+    if (manual_host_saved(host)) {
+      cfg_printf(out, "\n\n[[manual_hosts]]\n");
+      cfg_printf(out, "hostname = \"%s\"\n", host->hostname);
+      serialize_b64(out, "server_mac", host->server_mac, 6);
     }
   }
 
   for (int i = 0; i < cfg->num_registered_hosts; i++) {
     ChiakiRegisteredHost* rhost = cfg->registered_hosts[i]->registered_state;
-    fprintf(fp, "\n\n[[registered_hosts]]\n");
-    serialize_b64(fp, "server_mac", rhost->server_mac, 6);
-    fprintf(fp, "server_nickname = \"%s\"\n", rhost->server_nickname);
-    serialize_target(fp, "target", &rhost->target);
-    serialize_b64(fp, "rp_key", rhost->rp_key, 0x10);
-    fprintf(fp, "rp_key_type = %d\n", rhost->rp_key_type);
-    fprintf(fp, "rp_regist_key = \"%s\"\n", rhost->rp_regist_key);
-    // fprintf(fp, "ap_bssid = \"%s\"\n", rhost->ap_bssid);
-    // fprintf(fp, "ap_key = \"%s\"\n", rhost->ap_key);
-    // fprintf(fp, "ap_ssid = \"%s\"\n", rhost->ap_ssid);
-    // fprintf(fp, "ap_name = \"%s\"\n", rhost->ap_name);
+    cfg_printf(out, "\n\n[[registered_hosts]]\n");
+    serialize_b64(out, "server_mac", rhost->server_mac, 6);
+    cfg_printf(out, "server_nickname = \"%s\"\n", rhost->server_nickname);
+    serialize_target(out, "target", &rhost->target);
+    serialize_b64(out, "rp_key", rhost->rp_key, 0x10);
+    cfg_printf(out, "rp_key_type = %d\n", rhost->rp_key_type);
+    cfg_printf(out, "rp_regist_key = \"%s\"\n", rhost->rp_regist_key);
+    VitaChiakiStreamHistory* history = config_stream_history(cfg, rhost->server_mac, false);
+    if (history && history->sessions) {
+      cfg_printf(out, "stream_history_sessions = %u\n", history->sessions);
+      cfg_printf(out, "stream_history_resolution = \"%s\"\n", serialize_resolution_preset(history->resolution));
+      cfg_printf(out, "stream_history_fps = %d\n", history->fps);
+      cfg_printf(out, "stream_history_bitrate = %u\n", history->bitrate);
+      cfg_printf(out, "stream_history_loss_permille = %u\n", history->loss_permille);
+      cfg_printf(out, "stream_history_decode_us = %u\n", history->decode_us);
+      cfg_printf(out, "stream_history_fps_achieved = %u\n", history->fps_achieved);
+    }
+    if (history && history->path_time) {
+      cfg_printf(out, "path_network = \"%s\"\n", history->path_network);
+      cfg_printf(out, "path_time = %llu\n", (unsigned long long)history->path_time);
+      cfg_printf(out, "path_mtu_in = %u\n", history->path_mtu_in);
+      cfg_printf(out, "path_mtu_out = %u\n", history->path_mtu_out);
+      cfg_printf(out, "path_rtt_us = %llu\n", (unsigned long long)history->path_rtt_us);
+    }
+    // cfg_printf(out, "ap_bssid = \"%s\"\n", rhost->ap_bssid);
+    // cfg_printf(out, "ap_key = \"%s\"\n", rhost->ap_key);
+    // cfg_printf(out, "ap_ssid = \"%s\"\n", rhost->ap_ssid);
+    // cfg_printf(out, "ap_name = \"%s\"\n", rhost->ap_name);
   }
-  fclose(fp);
+}
+
+/// The host cache holds what follows the settings in the TOML file in binary and is only used
+/// while the text it was written with is unchanged, so editing the file by hand still works.
+static void config_write_host_cache(VitaChiakiConfig* cfg, ConfigBuf* out, const char* hosts_text, size_t hosts_len) {
+  ConfigHostCacheHeader header = {
+    .magic = CFG_HOST_CACHE_MAGIC,
+    .version = CFG_HOST_CACHE_VERSION,
+    .registered_host_size = sizeof(ChiakiRegisteredHost),
+    .stream_history_size = sizeof(VitaChiakiStreamHistory),
+    .hosts_hash = config_hash(hosts_text, hosts_len),
+    .hosts_len = hosts_len,
+    .num_registered_hosts = cfg->num_registered_hosts,
+    .num_stream_histories = cfg->num_stream_histories,
+    .num_manual_hosts = 0,
+  };
+  for (size_t i = 0; i < cfg->num_manual_hosts; i++) {
+    if (manual_host_saved(cfg->manual_hosts[i])) header.num_manual_hosts++;
+  }
+  cfg_append(out, &header, sizeof(header));
+  for (size_t i = 0; i < cfg->num_registered_hosts; i++)
+    cfg_append(out, cfg->registered_hosts[i]->registered_state, sizeof(ChiakiRegisteredHost));
+  cfg_append(out, cfg->stream_histories, cfg->num_stream_histories * sizeof(VitaChiakiStreamHistory));
+  for (size_t i = 0; i < cfg->num_manual_hosts; i++) {
+    VitaChiakiHost* host = cfg->manual_hosts[i];
+    if (!manual_host_saved(host)) continue;
+    uint16_t len = strlen(host->hostname);
+    cfg_append(out, host->server_mac, 6);
+    cfg_append(out, &len, sizeof(len));
+    cfg_append(out, host->hostname, len);
+  }
+}
+
+/// Write to a temporary file first and move it over the old one, so a crash never leaves a
+/// truncated file behind
+bool config_write_file_atomic(const char* filename, const void* data, size_t size) {
+  char tmp_filename[128];
+  snprintf(tmp_filename, sizeof(tmp_filename), "%s" CFG_TMP_SUFFIX, filename);
+  FILE* fp = fopen(tmp_filename, "wb");
+  if (!fp) return false;
+  bool ok = fwrite(data, 1, size, fp) == size;
+  ok = fclose(fp) == 0 && ok;
+  if (!ok) {
+    remove(tmp_filename);
+    return false;
+  }
+  if (rename(tmp_filename, filename) != 0) {
+    // sceIoRename does not replace existing files, config_parse() recovers from a crash in between
+    remove(filename);
+    if (rename(tmp_filename, filename) != 0) return false;
+  }
+  return true;
+}
+
+static void* config_store_thread_func(void* user) {
+  chiaki_mutex_lock(&config_store.mutex);
+  while (true) {
+    while (!config_store.text)
+      chiaki_cond_wait(&config_store.cond, &config_store.mutex);
+    // let further changes come in, only the last state is written
+    uint64_t now_us = chiaki_time_now_monotonic_us();
+    if (!config_store.flush && now_us < config_store.due_us) {
+      chiaki_cond_timedwait(&config_store.cond, &config_store.mutex, (config_store.due_us - now_us + 999) / 1000);
+      continue;
+    }
+    ConfigBuf text = config_store.text_buf;
+    ConfigBuf cache = config_store.cache_buf;
+    config_store.text = false;
+    config_store.text_buf = (ConfigBuf){ 0 };
+    config_store.cache_buf = (ConfigBuf){ 0 };
+    config_store.writing = true;
+    chiaki_mutex_unlock(&config_store.mutex);
+
+    if (!config_write_file_atomic(CFG_FILENAME, text.data, text.len))
+      CHIAKI_LOGE(&(context.log), "Failed to write config to %s", CFG_FILENAME);
+    else if (!cache.data || !config_write_file_atomic(CFG_HOST_CACHE_FILENAME, cache.data, cache.len))
+      remove(CFG_HOST_CACHE_FILENAME);
+    free(text.data);
+    free(cache.data);
+
+    chiaki_mutex_lock(&config_store.mutex);
+    config_store.writing = false;
+    chiaki_cond_broadcast(&config_store.cond);
+  }
+  return NULL;
+}
+
+static bool config_store_start() {
+  if (config_store.started) return true;
+  if (chiaki_mutex_init(&config_store.mutex, false) != CHIAKI_ERR_SUCCESS)
+    return false;
+  if (chiaki_cond_init(&config_store.cond, &config_store.mutex) != CHIAKI_ERR_SUCCESS)
+    goto error_mutex;
+  if (chiaki_thread_create(&config_store.thread, config_store_thread_func, NULL) != CHIAKI_ERR_SUCCESS)
+    goto error_cond;
+  chiaki_thread_set_name(&config_store.thread, "Vitaki Config Writer");
+  config_store.started = true;
+  return true;
+error_cond:
+  chiaki_cond_fini(&config_store.cond);
+error_mutex:
+  chiaki_mutex_fini(&config_store.mutex);
+  return false;
+}
+
+void config_serialize(VitaChiakiConfig* cfg) {
+  ConfigBuf text = { 0 };
+  ConfigBuf cache = { 0 };
+  config_write_text(cfg, &text);
+  if (!text.data) {
+    CHIAKI_LOGE(&(context.log), "Failed to serialize config");
+    return;
+  }
+  size_t hosts_offset = config_hosts_offset(text.data);
+  config_write_host_cache(cfg, &cache, text.data + hosts_offset, text.len - hosts_offset);
+
+  if (!config_store_start()) {
+    // write synchronously as a last resort
+    config_write_file_atomic(CFG_FILENAME, text.data, text.len);
+    if (!cache.data || !config_write_file_atomic(CFG_HOST_CACHE_FILENAME, cache.data, cache.len))
+      remove(CFG_HOST_CACHE_FILENAME);
+    free(text.data);
+    free(cache.data);
+    return;
+  }
+
+  chiaki_mutex_lock(&config_store.mutex);
+  if (!config_store.text)
+    config_store.due_us = chiaki_time_now_monotonic_us() + CFG_WRITE_DELAY_MS * 1000;
+  free(config_store.text_buf.data);
+  free(config_store.cache_buf.data);
+  config_store.text_buf = text;
+  config_store.cache_buf = cache;
+  config_store.text = true;
+  chiaki_cond_broadcast(&config_store.cond);
+  chiaki_mutex_unlock(&config_store.mutex);
+}
+
+void config_flush() {
+  if (!config_store.started) return;
+  chiaki_mutex_lock(&config_store.mutex);
+  config_store.flush = true;
+  chiaki_cond_broadcast(&config_store.cond);
+  while (config_store.text || config_store.writing)
+    chiaki_cond_wait(&config_store.cond, &config_store.mutex);
+  config_store.flush = false;
+  chiaki_mutex_unlock(&config_store.mutex);
 }
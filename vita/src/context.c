@@ -9,7 +9,7 @@
 #include "config.h"
 #include "ui.h"
 
-VitaChiakiContext context;
+#include <chiaki/trace.h>
 
 void log_cb_debugnet(ChiakiLogLevel lvl, const char *msg, void *user) {
   // int debugnet_lvl;
@@ -29,9 +29,11 @@ void log_cb_debugnet(ChiakiLogLevel lvl, const char *msg, void *user) {
   //   default:
   //     return;
   // }
-  if (lvl == CHIAKI_LOG_ALL || lvl == CHIAKI_LOG_VERBOSE) return;
+  if (lvl == CHIAKI_LOG_ALL || lvl == CHIAKI_LOG_VERBOSE || lvl == CHIAKI_LOG_TRACE) return;
   // uint64_t timestamp = sceKernelGetProcessTimeWide();
   sceClibPrintf("[CHIAKI] %s\n", msg);
+  if (context.flog)
+    file_log_write(context.flog, "[CHIAKI]", msg);
   if (!context.stream.is_streaming) {
       if (context.mlog) {
         write_message_log(context.mlog, msg);
@@ -39,13 +41,45 @@ void log_cb_debugnet(ChiakiLogLevel lvl, const char *msg, void *user) {
     }
 }
 
+static void log_cb_app(ChiakiLogLevel lvl, const char *msg, void *user) {
+  const char *prefix = lvl == CHIAKI_LOG_ERROR ? "[ERROR]" : "[DEBUG]";
+  sceClibPrintf("%s %s\n", prefix, msg);
+  if (context.flog)
+    file_log_write(context.flog, prefix, msg);
+  if (!context.stream.is_streaming) {
+      if (context.mlog) {
+        char line[800];
+        sceClibSnprintf(line, sizeof(line), "%s %s\n", prefix, msg);
+        write_message_log(context.mlog, line);
+      }
+    }
+}
+
+// LOGD and LOGE print synchronously until the log ring is started
+VitaChiakiContext context = {
+  .app_log = { .level_mask = CHIAKI_LOG_ALL, .cb = log_cb_app, .user = NULL, .ring = NULL }
+};
+
 bool vita_chiaki_init_context() {
   config_parse(&context.config);
 
   // TODO: Load log level from config
-  // TODO: Custom logging callback that logs to a file
-  chiaki_log_init(&(context.log), CHIAKI_LOG_ALL & ~(CHIAKI_LOG_VERBOSE | CHIAKI_LOG_DEBUG), &log_cb_debugnet, NULL);
+  chiaki_log_init(&(context.log), CHIAKI_LOG_ALL & ~(CHIAKI_LOG_TRACE | CHIAKI_LOG_VERBOSE | CHIAKI_LOG_DEBUG), &log_cb_debugnet, NULL);
   context.mlog = message_log_create();
+  if (context.config.file_log)
+    context.flog = file_log_create(FILE_LOG_FILENAME);
+  // 16k events per track, 2 MiB in total
+  if (context.config.trace && chiaki_trace_init(14) != CHIAKI_ERR_SUCCESS)
+    LOGE("Failed to allocate the trace buffers, tracing disabled");
+
+  // timestamped when logged, formatted and printed at the lowest priority
+  if (chiaki_log_ring_init(&context.log_ring, 8, true) == CHIAKI_ERR_SUCCESS) {
+    context.log_ring_init = true;
+    chiaki_log_set_ring(&context.log, &context.log_ring);
+    chiaki_log_set_ring(&context.app_log, &context.log_ring);
+  } else {
+    LOGE("Failed to start the log ring, logging synchronously");
+  }
 
   write_message_log(context.mlog, "----- Debug log start -----"); // debug
 
@@ -1,6 +1,134 @@
 #include "controller.h"
 #include "context.h"
 #include <stdio.h>
+#include <psp2/ctrl.h>
+
+// Fixed part of the map, Vita button to DualShock button
+static const struct {
+  uint32_t sce;
+  uint32_t out;
+} button_map[] = {
+  { SCE_CTRL_SELECT,   CHIAKI_CONTROLLER_BUTTON_SHARE },
+  { SCE_CTRL_START,    CHIAKI_CONTROLLER_BUTTON_OPTIONS },
+  { SCE_CTRL_UP,       CHIAKI_CONTROLLER_BUTTON_DPAD_UP },
+  { SCE_CTRL_RIGHT,    CHIAKI_CONTROLLER_BUTTON_DPAD_RIGHT },
+  { SCE_CTRL_DOWN,     CHIAKI_CONTROLLER_BUTTON_DPAD_DOWN },
+  { SCE_CTRL_LEFT,     CHIAKI_CONTROLLER_BUTTON_DPAD_LEFT },
+  { SCE_CTRL_TRIANGLE, CHIAKI_CONTROLLER_BUTTON_PYRAMID },
+  { SCE_CTRL_CIRCLE,   CHIAKI_CONTROLLER_BUTTON_MOON },
+  { SCE_CTRL_CROSS,    CHIAKI_CONTROLLER_BUTTON_CROSS },
+  { SCE_CTRL_SQUARE,   CHIAKI_CONTROLLER_BUTTON_BOX },
+  // only on the PSTV
+  { SCE_CTRL_L3,       CHIAKI_CONTROLLER_BUTTON_L3 },
+  { SCE_CTRL_R3,       CHIAKI_CONTROLLER_BUTTON_R3 },
+};
+
+static uint32_t button_out(uint32_t sce_buttons) {
+  uint32_t out = 0;
+  for (size_t i = 0; i < sizeof(button_map) / sizeof(button_map[0]); i++) {
+    if (sce_buttons & button_map[i].sce)
+      out |= button_map[i].out;
+  }
+  return out;
+}
+
+// Output of ctrl_in, made L2/R2 if it is the input mapped to it
+static uint32_t l2pos_out(VitakiCtrlMapInfo* vcmi, VitakiCtrlIn ctrl_in) {
+  return vcmi->in_l2 == ctrl_in ? VITAKI_CTRL_OUT_FLAG_L2 : (uint32_t)vcmi->in_out_btn[ctrl_in];
+}
+
+static uint32_t r2pos_out(VitakiCtrlMapInfo* vcmi, VitakiCtrlIn ctrl_in) {
+  return vcmi->in_r2 == ctrl_in ? VITAKI_CTRL_OUT_FLAG_R2 : (uint32_t)vcmi->in_out_btn[ctrl_in];
+}
+
+static uint32_t rear_touch_out(VitakiCtrlMapInfo* vcmi, int x, int y) {
+  // note: rear touch may be active in Y only from 108 to 889? (see Vita3K code)
+  uint32_t out = vcmi->in_out_btn[VITAKI_CTRL_IN_REARTOUCH_ANY];
+  if (x > VITAKI_TOUCH_MAX_WIDTH/2) {
+    out |= VITAKI_CTRL_OUT_FLAG_REARTOUCH_R;
+    out |= r2pos_out(vcmi, VITAKI_CTRL_IN_REARTOUCH_RIGHT);
+    out |= r2pos_out(vcmi, y > VITAKI_TOUCH_MAX_HEIGHT/2 ? VITAKI_CTRL_IN_REARTOUCH_LR : VITAKI_CTRL_IN_REARTOUCH_UR);
+  } else if (x < VITAKI_TOUCH_MAX_WIDTH/2) {
+    out |= VITAKI_CTRL_OUT_FLAG_REARTOUCH_L;
+    out |= l2pos_out(vcmi, VITAKI_CTRL_IN_REARTOUCH_LEFT);
+    out |= l2pos_out(vcmi, y > VITAKI_TOUCH_MAX_HEIGHT/2 ? VITAKI_CTRL_IN_REARTOUCH_LL : VITAKI_CTRL_IN_REARTOUCH_UL);
+  }
+  return out;
+}
+
+static uint32_t front_touch_out(VitakiCtrlMapInfo* vcmi, int x, int y) {
+  int w = VITAKI_TOUCH_MAX_WIDTH;
+  int h = VITAKI_TOUCH_MAX_HEIGHT;
+  int arc_radius_2 = (h/3) * (h/3);
+  uint32_t out = vcmi->in_out_btn[VITAKI_CTRL_IN_FRONTTOUCH_ANY];
+  if (x > w/2) {
+    out |= r2pos_out(vcmi, VITAKI_CTRL_IN_FRONTTOUCH_RIGHT);
+    if (y*y + (x-w)*(x-w) <= arc_radius_2) {
+      out |= r2pos_out(vcmi, VITAKI_CTRL_IN_FRONTTOUCH_UR_ARC);
+    } else if ((y-h)*(y-h) + (x-w)*(x-w) <= arc_radius_2) {
+      out |= r2pos_out(vcmi, VITAKI_CTRL_IN_FRONTTOUCH_LR_ARC);
+    }
+  } else if (x < w/2) {
+    out |= l2pos_out(vcmi, VITAKI_CTRL_IN_FRONTTOUCH_LEFT);
+    if (y*y + x*x <= arc_radius_2) {
+      out |= l2pos_out(vcmi, VITAKI_CTRL_IN_FRONTTOUCH_UL_ARC);
+    } else if ((y-h)*(y-h) + x*x <= arc_radius_2) {
+      out |= l2pos_out(vcmi, VITAKI_CTRL_IN_FRONTTOUCH_LL_ARC);
+    }
+  }
+  if (x >= w/4 && x <= w - w/4 && y >= h/4 && y <= h - h/4)
+    out |= vcmi->in_out_btn[VITAKI_CTRL_IN_FRONTTOUCH_CENTER];
+  return out;
+}
+
+static void add_combo(VitakiCtrlMapInfo* vcmi, uint32_t sce_buttons, uint32_t out) {
+  VitakiCtrlCombo* combo = &vcmi->combos[vcmi->combos_count++];
+  combo->buttons = sce_buttons;
+  combo->clear = button_out(sce_buttons);
+  combo->out = out;
+}
+
+// Turn the in/out map into the lookup tables used by the input thread
+static void compile_controller_map(VitakiCtrlMapInfo* vcmi) {
+  for (uint32_t i = 0; i < 0x100; i++) {
+    vcmi->btn_lo[i] = button_out(i);
+    vcmi->btn_hi[i] = button_out(i << 8);
+  }
+
+  // an output of 0 means the input is not mapped
+  vcmi->ltrigger = l2pos_out(vcmi, VITAKI_CTRL_IN_L1);
+  vcmi->ltrigger_reartouch = l2pos_out(vcmi, VITAKI_CTRL_IN_REARTOUCH_LEFT_L1);
+  if (!vcmi->ltrigger_reartouch)
+    vcmi->ltrigger_reartouch = vcmi->ltrigger;
+  vcmi->rtrigger = r2pos_out(vcmi, VITAKI_CTRL_IN_R1);
+  vcmi->rtrigger_reartouch = r2pos_out(vcmi, VITAKI_CTRL_IN_REARTOUCH_RIGHT_R1);
+  if (!vcmi->rtrigger_reartouch)
+    vcmi->rtrigger_reartouch = vcmi->rtrigger;
+
+  vcmi->combos_count = 0;
+  uint32_t select_start = vcmi->in_out_btn[VITAKI_CTRL_IN_SELECT_START];
+  uint32_t left_square = l2pos_out(vcmi, VITAKI_CTRL_IN_LEFT_SQUARE);
+  uint32_t right_circle = r2pos_out(vcmi, VITAKI_CTRL_IN_RIGHT_CIRCLE);
+  if (select_start)
+    add_combo(vcmi, SCE_CTRL_SELECT | SCE_CTRL_START, select_start);
+  if (left_square)
+    add_combo(vcmi, SCE_CTRL_LEFT | SCE_CTRL_SQUARE, left_square);
+  if (right_circle)
+    add_combo(vcmi, SCE_CTRL_RIGHT | SCE_CTRL_CIRCLE, right_circle);
+
+  // each cell gets the output of its center
+  int half_cell = 1 << (VITAKI_TOUCH_GRID_SHIFT - 1);
+  for (int row = 0; row < VITAKI_TOUCH_GRID_ROWS; row++) {
+    int y = (row << VITAKI_TOUCH_GRID_SHIFT) + half_cell;
+    if (y > VITAKI_TOUCH_MAX_HEIGHT) y = VITAKI_TOUCH_MAX_HEIGHT;
+    for (int col = 0; col < VITAKI_TOUCH_GRID_COLS; col++) {
+      int x = (col << VITAKI_TOUCH_GRID_SHIFT) + half_cell;
+      if (x > VITAKI_TOUCH_MAX_WIDTH) x = VITAKI_TOUCH_MAX_WIDTH;
+      vcmi->front_grid[row * VITAKI_TOUCH_GRID_COLS + col] = front_touch_out(vcmi, x, y);
+      vcmi->rear_grid[row * VITAKI_TOUCH_GRID_COLS + col] = rear_touch_out(vcmi, x, y);
+    }
+  }
+}
 
 void init_controller_map(VitakiCtrlMapInfo* vcmi, VitakiControllerMapId controller_map_id) {
   // TODO make fully configurable instead of using controller_map_id
@@ -161,5 +289,6 @@ void init_controller_map(VitakiCtrlMapInfo* vcmi, VitakiControllerMapId controll
     vcmi->in_r2 = VITAKI_CTRL_IN_REARTOUCH_UR;
   }
 
+  compile_controller_map(vcmi);
   vcmi->did_init = true;
 }
@@ -3,6 +3,8 @@
 #include <string.h>
 #include <chiaki/discoveryservice.h>
 #include <chiaki/log.h>
+#include <chiaki/thread.h>
+#include <chiaki/time.h>
 
 #include <netinet/in.h>
 #include <sys/socket.h>
@@ -12,33 +14,58 @@
 #include "host.h"
 #include "util.h"
 
+#define DISCOVERY_PING_MS 500
+
+static bool discovery_paused = false;
+static uint64_t discovery_pause_us = 0;
+static uint64_t discovery_pause_cpu_ms = 0;
+
+static bool strings_equal(const char* a, const char* b) {
+  if (!a || !b) return a == b;
+  return strcmp(a, b) == 0;
+}
+
+/// Whether anything the UI shows of a discovered host differs
+static bool discovery_state_changed(ChiakiDiscoveryHost* a, ChiakiDiscoveryHost* b) {
+  return a->state != b->state || a->host_request_port != b->host_request_port ||
+         !strings_equal(a->host_addr, b->host_addr) || !strings_equal(a->host_name, b->host_name) ||
+         !strings_equal(a->host_type, b->host_type) || !strings_equal(a->system_version, b->system_version) ||
+         !strings_equal(a->running_app_titleid, b->running_app_titleid) ||
+         !strings_equal(a->running_app_name, b->running_app_name);
+}
+
 /// Save a newly discovered host into the context
 // Returns the index in context.hosts where it is saved (-1 if not saved)
-int save_discovered_host(ChiakiDiscoveryHost* host) {
-  CHIAKI_LOGI(&(context.log), "Saving discovered host...");
+// and sets *changed if a host was added or its state changed
+int save_discovered_host(ChiakiDiscoveryHost* host, bool* changed) {
   // Check if the host is already known, and if not, locate a free spot for it
   uint8_t host_mac[6];
   parse_mac(host->host_id, host_mac);
 
-  // Check if there is an identical discovered host in context; return if so
-  for (int host_idx = 0; host_idx < MAX_NUM_HOSTS; host_idx++) {
-    VitaChiakiHost* h = context.hosts[host_idx];
-    if (h && (h->type & DISCOVERED)) {
-      if (mac_addrs_match(&(h->server_mac), &host_mac)) {
-        // Already known discovered host. Just copy the discovery state and exit.
-        if (h->discovery_state && (h->discovery_state != host)) {
-          free(h->discovery_state);
-        }
-        h->discovery_state =
-            (ChiakiDiscoveryHost*)malloc(sizeof(ChiakiDiscoveryHost));
-        memcpy(h->discovery_state, host, sizeof(ChiakiDiscoveryHost));
-        if (h->hostname) free(h->hostname);
-        h->hostname = strdup(h->discovery_state->host_addr);
-        return host_idx;
-      }
+  // A known discovered host only takes the new state, this runs for every host on every ping
+  int known_idx = context_host_index(&host_mac, DISCOVERED);
+  if (known_idx >= 0) {
+    VitaChiakiHost* h = context.hosts[known_idx];
+    if (!h->discovery_state) {
+      h->discovery_state = (ChiakiDiscoveryHost*)malloc(sizeof(ChiakiDiscoveryHost));
+      if (!h->discovery_state) return known_idx;
+    } else if (!discovery_state_changed(h->discovery_state, host)) {
+      // the strings belong to the discovery service and may have moved
+      memcpy(h->discovery_state, host, sizeof(ChiakiDiscoveryHost));
+      return known_idx;
     }
+    memcpy(h->discovery_state, host, sizeof(ChiakiDiscoveryHost));
+    if (!h->hostname || !strings_equal(h->hostname, host->host_addr)) {
+      free(h->hostname);
+      h->hostname = strdup(host->host_addr);
+    }
+    host_changed(h);
+    *changed = true;
+    return known_idx;
   }
 
+  CHIAKI_LOGI(&(context.log), "Saving discovered host...");
+
   // Determine whether there is room in context for a new host to be added
   int target_idx = -1;
   for (int host_idx = 0; host_idx < MAX_NUM_HOSTS; host_idx++) {
@@ -96,6 +123,7 @@ int save_discovered_host(ChiakiDiscoveryHost* host) {
   VitaChiakiHost* h = (VitaChiakiHost*)malloc(sizeof(VitaChiakiHost));
   h->registered_state = NULL;
   h->type = DISCOVERED;
+  h->revision = 0;
 
   ChiakiTarget target = chiaki_discovery_host_system_version_target(host);
   CHIAKI_LOGI(&(context.log),   "Is PS5:                            %s", chiaki_target_is_ps5(target) ? "true" : "false");
@@ -139,17 +167,19 @@ int save_discovered_host(ChiakiDiscoveryHost* host) {
     }
   }
 
-  // Add to context
+  // Add to context, discovery_cb() removes any extra manual host copies afterwards
   if (!context.hosts[target_idx]) context.num_hosts++;
   context.hosts[target_idx] = h;
-
-  update_context_hosts(); // to remove any extra manual host copies
+  host_changed(h);
+  *changed = true;
 
   return target_idx;
 }
 
 // remove discovered hosts from context except those with index in discovered_idxs
-void remove_lost_discovered_hosts(int* discovered_idxs, size_t discovered_hosts_count) {
+// @return whether any were removed
+bool remove_lost_discovered_hosts(int* discovered_idxs, size_t discovered_hosts_count) {
+  bool removed = false;
   for (int host_idx = 0; host_idx < MAX_NUM_HOSTS; host_idx++) {
     VitaChiakiHost* h = context.hosts[host_idx];
     if (h && (h->type & DISCOVERED)) {
@@ -165,21 +195,28 @@ void remove_lost_discovered_hosts(int* discovered_idxs, size_t discovered_hosts_
         // free and remove from context
         host_free(h);
         context.hosts[host_idx] = NULL;
+        removed = true;
       }
     }
   }
-
-  update_context_hosts();
+  return removed;
 }
 
 /// Called whenever new hosts are discovered
 void discovery_cb(ChiakiDiscoveryHost* hosts, size_t hosts_count, void* user) {
+  // slots stay put until update_context_hosts(), so discovered_idxs stay valid
+  bool changed = false;
   int discovered_idxs[hosts_count];
   for (int dhost_idx = 0; dhost_idx < hosts_count; dhost_idx++) {
-    discovered_idxs[dhost_idx] = save_discovered_host(&hosts[dhost_idx]);
+    discovered_idxs[dhost_idx] = save_discovered_host(&hosts[dhost_idx], &changed);
   }
 
-  remove_lost_discovered_hosts(discovered_idxs, hosts_count);
+  if (remove_lost_discovered_hosts(discovered_idxs, hosts_count))
+    changed = true;
+  if (changed) {
+    update_context_hosts();
+    ui_invalidate();
+  }
 
   // Call caller-defined callback
   VitaChiakiDiscoveryCallbackState* cb_state =
@@ -203,7 +240,7 @@ ChiakiErrorCode start_discovery(VitaChiakiDiscoveryCb cb, void* cb_user) {
   ChiakiDiscoveryServiceOptions opts;
   opts.cb = discovery_cb;
   opts.cb_user = context.discovery_cb_state;
-  opts.ping_ms = 500;
+  opts.ping_ms = DISCOVERY_PING_MS;
   opts.ping_initial_ms = opts.ping_ms;
   opts.hosts_max = MAX_NUM_HOSTS;
   opts.host_drop_pings = HOST_DROP_PINGS;
@@ -215,6 +252,22 @@ ChiakiErrorCode start_discovery(VitaChiakiDiscoveryCb cb, void* cb_user) {
   opts.send_addr_size = sizeof(addr);
   opts.send_host = NULL;
 
+  // ping consoles we already know directly, so they show up before the first broadcast round trips
+  const char* known_hosts[2 * MAX_NUM_HOSTS];
+  size_t known_hosts_count = 0;
+  for (int i = 0; i < context.config.num_manual_hosts && i < MAX_NUM_HOSTS; i++) {
+    VitaChiakiHost* h = context.config.manual_hosts[i];
+    if (h && h->hostname)
+      known_hosts[known_hosts_count++] = h->hostname;
+  }
+  for (int i = 0; i < MAX_NUM_HOSTS; i++) {
+    VitaChiakiHost* h = context.hosts[i];
+    if (h && h->hostname)
+      known_hosts[known_hosts_count++] = h->hostname;
+  }
+  opts.known_hosts = known_hosts;
+  opts.known_hosts_count = known_hosts_count;
+
   ChiakiErrorCode err = chiaki_discovery_service_init(&(context.discovery),
                                                       &opts, &(context.log));
   context.discovery_enabled = true;
@@ -224,6 +277,44 @@ ChiakiErrorCode start_discovery(VitaChiakiDiscoveryCb cb, void* cb_user) {
   return err;
 }
 
+/// CPU time of the discovery threads so far
+static uint64_t discovery_cpu_ms() {
+  uint64_t cpu_ms = 0;
+  ChiakiThreadRole roles[] = { CHIAKI_THREAD_ROLE_DISCOVERY, CHIAKI_THREAD_ROLE_DISCOVERY_SERVICE };
+  for (size_t i = 0; i < sizeof(roles) / sizeof(roles[0]); i++) {
+    ChiakiThreadRoleStats stats;
+    chiaki_thread_role_stats_get(roles[i], &stats);
+    cpu_ms += stats.cpu_ms + stats.running_cpu_ms;
+  }
+  return cpu_ms;
+}
+
+/// Stop pinging and receiving while streaming, consoles can't be selected meanwhile anyway
+void pause_discovery(bool paused) {
+  if (!context.discovery_enabled || discovery_paused == paused) {
+    return;
+  }
+  discovery_paused = paused;
+  uint64_t now_us = chiaki_time_now_monotonic_us();
+  if (paused) {
+    discovery_pause_us = now_us;
+    discovery_pause_cpu_ms = discovery_cpu_ms();
+    chiaki_discovery_service_set_paused(&(context.discovery), true);
+    return;
+  }
+  chiaki_discovery_service_set_paused(&(context.discovery), false);
+
+  // the broadcast pings are what a pause saves on air, the known hosts are pinged on top of them
+  uint64_t paused_ms = (now_us - discovery_pause_us) / 1000;
+  uint64_t cpu_ms = discovery_cpu_ms();
+  ChiakiDiscoveryServiceStats stats;
+  chiaki_discovery_service_get_stats(&(context.discovery), &stats);
+  LOGD("Discovery paused for %llu ms while streaming, about %llu pings not sent, %llu ms CPU meanwhile, %llu pings sent in total",
+       (unsigned long long)paused_ms, (unsigned long long)(paused_ms / DISCOVERY_PING_MS * 2),
+       (unsigned long long)(cpu_ms > discovery_pause_cpu_ms ? cpu_ms - discovery_pause_cpu_ms : 0),
+       (unsigned long long)stats.pings_sent);
+}
+
 /// Terminate the Chiaki discovery thread, clean up discovey state in context
 void stop_discovery() {
   if (!context.discovery_enabled) {
@@ -231,6 +322,7 @@ void stop_discovery() {
   }
   chiaki_discovery_service_fini(&(context.discovery));
   context.discovery_enabled = false;
+  discovery_paused = false;
   for (int i = 0; i < MAX_NUM_HOSTS; i++) {
     VitaChiakiHost* h = context.hosts[i];
     if (h == NULL) {
@@ -0,0 +1,129 @@
+#include <psp2/io/fcntl.h>
+#include <psp2/kernel/clib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file_log.h"
+
+static void write_all(VitaChiakiFileLog* fl, const char* buf, size_t size) {
+  while (size > 0) {
+    int r = sceIoWrite(fl->fd, buf, size);
+    if (r <= 0) {
+      sceClibPrintf("[ERROR] Failed to write log file: 0x%x\n", r);
+      return;
+    }
+    buf += r;
+    size -= r;
+  }
+}
+
+static void* file_log_thread_func(void* user) {
+  VitaChiakiFileLog* fl = user;
+  chiaki_mutex_lock(&fl->mutex);
+  while (true) {
+    // wait for half a buffer, so writes stay large, but flush at least every FILE_LOG_FLUSH_MS
+    if (!fl->should_stop && fl->fill_size < FILE_LOG_BUF_SIZE / 2)
+      chiaki_cond_timedwait(&fl->cond, &fl->mutex, FILE_LOG_FLUSH_MS);
+    bool stop = fl->should_stop;
+    char* buf = fl->fill;
+    size_t size = fl->fill_size;
+    uint64_t dropped = fl->dropped;
+    fl->fill = buf == fl->bufs[0] ? fl->bufs[1] : fl->bufs[0];
+    fl->fill_size = 0;
+    fl->dropped = 0;
+    chiaki_mutex_unlock(&fl->mutex);
+
+    if (size > 0)
+      write_all(fl, buf, size);
+    if (dropped > 0) {
+      char msg[64];
+      int len = sceClibSnprintf(msg, sizeof(msg), "[FILELOG] Dropped %llu lines\n", (unsigned long long)dropped);
+      write_all(fl, msg, len);
+    }
+
+    chiaki_mutex_lock(&fl->mutex);
+    if (stop && fl->fill_size == 0)
+      break;
+  }
+  chiaki_mutex_unlock(&fl->mutex);
+  return NULL;
+}
+
+VitaChiakiFileLog* file_log_create(const char* filename) {
+  VitaChiakiFileLog* fl = calloc(1, sizeof(VitaChiakiFileLog));
+  if (!fl)
+    return NULL;
+  fl->bufs[0] = malloc(FILE_LOG_BUF_SIZE);
+  fl->bufs[1] = malloc(FILE_LOG_BUF_SIZE);
+  if (!fl->bufs[0] || !fl->bufs[1])
+    goto error_bufs;
+  fl->fill = fl->bufs[0];
+
+  fl->fd = sceIoOpen(filename, SCE_O_WRONLY | SCE_O_CREAT | SCE_O_TRUNC, 0777);
+  if (fl->fd < 0) {
+    sceClibPrintf("[ERROR] Failed to open log file %s: 0x%x\n", filename, fl->fd);
+    goto error_bufs;
+  }
+
+  if (chiaki_mutex_init(&fl->mutex, false) != CHIAKI_ERR_SUCCESS)
+    goto error_fd;
+  if (chiaki_cond_init(&fl->cond, &fl->mutex) != CHIAKI_ERR_SUCCESS)
+    goto error_mutex;
+  // the memory card only gets the time that nothing else wants
+  if (chiaki_thread_create_role(&fl->thread, file_log_thread_func, fl, CHIAKI_THREAD_ROLE_LOG) != CHIAKI_ERR_SUCCESS)
+    goto error_cond;
+  chiaki_thread_set_name(&fl->thread, "Vitaki File Log");
+  return fl;
+
+error_cond:
+  chiaki_cond_fini(&fl->cond);
+error_mutex:
+  chiaki_mutex_fini(&fl->mutex);
+error_fd:
+  sceIoClose(fl->fd);
+error_bufs:
+  free(fl->bufs[0]);
+  free(fl->bufs[1]);
+  free(fl);
+  return NULL;
+}
+
+void file_log_destroy(VitaChiakiFileLog* fl) {
+  chiaki_mutex_lock(&fl->mutex);
+  fl->should_stop = true;
+  chiaki_cond_signal(&fl->cond);
+  chiaki_mutex_unlock(&fl->mutex);
+  chiaki_thread_join(&fl->thread, NULL);
+
+  sceIoClose(fl->fd);
+  chiaki_cond_fini(&fl->cond);
+  chiaki_mutex_fini(&fl->mutex);
+  free(fl->bufs[0]);
+  free(fl->bufs[1]);
+  free(fl);
+}
+
+void file_log_write(VitaChiakiFileLog* fl, const char* prefix, const char* line) {
+  size_t prefix_len = strlen(prefix);
+  size_t line_len = strlen(line);
+  bool newline = line_len == 0 || line[line_len - 1] != '\n';
+  size_t size = prefix_len + 1 + line_len + (newline ? 1 : 0);
+
+  chiaki_mutex_lock(&fl->mutex);
+  if (fl->should_stop || size > FILE_LOG_BUF_SIZE - fl->fill_size) {
+    fl->dropped++;
+    chiaki_mutex_unlock(&fl->mutex);
+    return;
+  }
+  char* p = fl->fill + fl->fill_size;
+  memcpy(p, prefix, prefix_len);
+  p[prefix_len] = ' ';
+  memcpy(p + prefix_len + 1, line, line_len);
+  if (newline)
+    p[size - 1] = '\n';
+  bool wakeup = fl->fill_size < FILE_LOG_BUF_SIZE / 2 && fl->fill_size + size >= FILE_LOG_BUF_SIZE / 2;
+  fl->fill_size += size;
+  if (wakeup)
+    chiaki_cond_signal(&fl->cond);
+  chiaki_mutex_unlock(&fl->mutex);
+}
@@ -3,15 +3,25 @@
 #include "controller.h"
 #include "host.h"
 #include "discovery.h"
+#include "latency_probe.h"
 #include "audio.h"
 #include "video.h"
+#include "session_report.h"
+#include "power.h"
 #include "string.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <psp2/ctrl.h>
+#include <psp2/display.h>
 #include <psp2/motion.h>
 #include <psp2/touch.h>
+#include <psp2/net/netctl.h>
+#include <time.h>
 #include <chiaki/base64.h>
 #include <chiaki/session.h>
+#include <chiaki/telemetry.h>
+#include <chiaki/time.h>
+#include <chiaki/trace.h>
 
 void host_free(VitaChiakiHost *host) {
   if (host) {
@@ -59,6 +69,7 @@ static void regist_cb(ChiakiRegistEvent *event, void *user) {
       context.config.registered_hosts[context.config.num_registered_hosts++] = context.active_host;
     }
 
+    host_changed(context.active_host);
     config_serialize(&context.config);
   }
 
@@ -93,27 +104,503 @@ int host_wakeup(VitaChiakiHost* host) {
                           context.discovery_enabled ? &context.discovery.discovery : NULL,
                           host->hostname, credential,
                           chiaki_target_is_ps5(host->target));
+  // catch the console coming up as soon as it answers
+  if (context.discovery_enabled)
+    chiaki_discovery_service_fast_ping(&context.discovery);
   return 0;
 }
 
+// While waiting for a woken console to report ready, it is polled directly at this interval
+#define WAKE_POLL_INTERVAL_MS 100
+#define WAKE_POLL_TIMEOUT_MS 30000
+
+static VitaChiakiHost* wake_stream_host = NULL;
+static uint64_t wake_start_us = 0; // when the wakeup was requested, for time to first frame
+static uint64_t stream_start_us = 0;
+
+int host_wake_and_stream(VitaChiakiHost* host) {
+  int err = host_wakeup(host);
+  if (err)
+    return err;
+  wake_stream_host = host;
+  wake_start_us = chiaki_time_now_monotonic_us();
+  if (context.discovery_enabled)
+    chiaki_discovery_service_poll_host(&context.discovery, host->hostname, WAKE_POLL_INTERVAL_MS, WAKE_POLL_TIMEOUT_MS);
+  return 0;
+}
+
+int host_wake_poll() {
+  VitaChiakiHost* host = wake_stream_host;
+  if (!host)
+    return -1;
+  // without discovery there is nothing to wait for
+  bool ready = (host->type & REGISTERED) &&
+               (!host->discovery_state || host->discovery_state->state == CHIAKI_DISCOVERY_HOST_STATE_READY);
+  if (!ready)
+    return 0;
+  LOGD("Woken console ready after %llu ms", (unsigned long long)((chiaki_time_now_monotonic_us() - wake_start_us) / 1000));
+  wake_stream_host = NULL;
+  if (context.discovery_enabled)
+    chiaki_discovery_service_poll_host(&context.discovery, NULL, 0, 0);
+  return host_stream(host) == 0 ? 1 : -1;
+}
+
+void host_wake_cancel() {
+  if (!wake_stream_host)
+    return;
+  wake_stream_host = NULL;
+  wake_start_us = 0;
+  if (context.discovery_enabled)
+    chiaki_discovery_service_poll_host(&context.discovery, NULL, 0, 0);
+}
+
+// Auto profile: sessions with the console that lost more than this get a lower bitrate, ones that
+// lost less probe a higher one. Only sessions that ran long enough to tell are recorded.
+#define AUTO_PROFILE_LOSS_HIGH_PERMILLE 20
+#define AUTO_PROFILE_LOSS_LOW_PERMILLE 5
+#define AUTO_PROFILE_BITRATE_MIN 1500
+#define AUTO_PROFILE_FRAMES_MIN 900
+
+// Known paths are reused for this long, and dropped if a session using one lost more than this
+#define PATH_CACHE_MAX_AGE_S (24 * 60 * 60)
+#define PATH_CACHE_LOSS_MAX_PERMILLE 30
+
+static uint8_t stream_server_mac[6];
+static bool stream_path_cached;
+static ChiakiConnectPath stream_path;
+
+// The session connects while host_stream() sets up the decoder, only the first frame and the cleanup wait for it
+static ChiakiBoolPredCond video_ready;
+static bool video_ready_init = false;
+static bool video_setup_ok;
+static bool stream_video_ready;
+
+// Generating the ECDH key pair is the slowest part of the handshake on the Vita, so the one for the
+// next session is generated in the background ahead of time
+static ChiakiThread ecdh_warmup_thread;
+static ChiakiMutex ecdh_warmup_mutex;
+static bool ecdh_warmup_init = false;
+static bool ecdh_warmup_started = false;
+static bool ecdh_warmup_ready = false;
+static ChiakiECDHKey ecdh_warmup_key;
+static ChiakiECDHKey stream_ecdh_key;
+static ChiakiCapture stream_capture;
+static bool stream_capture_open = false;
+static ChiakiRecorder stream_recorder;
+static bool stream_recorder_open = false;
+static ChiakiTelemetry stream_telemetry;
+static bool stream_telemetry_open = false;
+static bool stream_input_started = false;
+static uint64_t stream_connected_time; // unix time, 0 until the session connected
+static uint64_t stream_connected_us;
+static uint64_t stream_link_lost_us; // when the session last started reconnecting
+
+static void *ecdh_warmup_thread_func(void *user) {
+  ChiakiECDHKey key;
+  ChiakiErrorCode err = chiaki_ecdh_generate_key(&key);
+  if (err != CHIAKI_ERR_SUCCESS) {
+    LOGE("Failed to pre-generate ECDH key: %s", chiaki_error_string(err));
+    return NULL;
+  }
+  chiaki_mutex_lock(&ecdh_warmup_mutex);
+  ecdh_warmup_key = key;
+  ecdh_warmup_ready = true;
+  chiaki_mutex_unlock(&ecdh_warmup_mutex);
+  memset(&key, 0, sizeof(key));
+  return NULL;
+}
+
+void host_crypto_warmup() {
+  if (!ecdh_warmup_init) {
+    if (chiaki_mutex_init(&ecdh_warmup_mutex, false) != CHIAKI_ERR_SUCCESS)
+      return;
+    ecdh_warmup_init = true;
+  }
+  if (ecdh_warmup_started) {
+    chiaki_thread_join(&ecdh_warmup_thread, NULL);
+    ecdh_warmup_started = false;
+  }
+  chiaki_mutex_lock(&ecdh_warmup_mutex);
+  bool ready = ecdh_warmup_ready;
+  chiaki_mutex_unlock(&ecdh_warmup_mutex);
+  if (ready)
+    return;
+  if (chiaki_thread_create(&ecdh_warmup_thread, ecdh_warmup_thread_func, NULL) != CHIAKI_ERR_SUCCESS) {
+    LOGE("Failed to start crypto warm-up thread");
+    return;
+  }
+  chiaki_thread_set_name(&ecdh_warmup_thread, "Vitaki Crypto Warmup");
+  ecdh_warmup_started = true;
+}
+
+/**
+ * Take the pre-generated key pair, if it is ready, otherwise the session generates its own.
+ */
+static bool take_ecdh_key(ChiakiECDHKey* key) {
+  if (!ecdh_warmup_init)
+    return false;
+  chiaki_mutex_lock(&ecdh_warmup_mutex);
+  bool ready = ecdh_warmup_ready;
+  if (ready) {
+    *key = ecdh_warmup_key;
+    memset(&ecdh_warmup_key, 0, sizeof(ecdh_warmup_key));
+    ecdh_warmup_ready = false;
+  }
+  chiaki_mutex_unlock(&ecdh_warmup_mutex);
+  return ready;
+}
+
+static bool wait_video_ready() {
+  chiaki_bool_pred_cond_lock(&video_ready);
+  chiaki_bool_pred_cond_wait(&video_ready);
+  bool ok = video_setup_ok;
+  chiaki_bool_pred_cond_unlock(&video_ready);
+  return ok;
+}
+
+static ChiakiVideoResolutionPreset resolution_preset_of(unsigned int height) {
+  return height <= 360 ? CHIAKI_VIDEO_RESOLUTION_PRESET_360p : CHIAKI_VIDEO_RESOLUTION_PRESET_540p;
+}
+
+// Pick the profile from how the last sessions with the console went, the session then fits it to the
+// path measured by Senkusha. The configured fps is the upper bound.
+static void auto_profile(VitaChiakiHost* host, ChiakiConnectVideoProfile* profile) {
+  ChiakiVideoFPSPreset fps = context.config.fps;
+  chiaki_connect_video_profile_preset(profile, CHIAKI_VIDEO_RESOLUTION_PRESET_540p, fps);
+  VitaChiakiStreamHistory* history = config_stream_history(&context.config, host->server_mac, false);
+  if (!history || !history->sessions || !history->bitrate)
+    return;
+
+  uint32_t frame_us = 1000000 / (uint32_t)fps;
+  bool decode_slow = history->decode_us > frame_us * 3 / 4;
+  bool fps_short = history->fps == fps && history->fps_achieved * 10 < (uint32_t)fps * 9;
+  bool loss_high = history->loss_permille > AUTO_PROFILE_LOSS_HIGH_PERMILLE;
+
+  unsigned int bitrate = history->bitrate;
+  if (loss_high)
+    bitrate = bitrate * 3 / 4;
+  else if (history->loss_permille < AUTO_PROFILE_LOSS_LOW_PERMILLE)
+    bitrate = bitrate * 5 / 4;
+
+  ChiakiVideoResolutionPreset resolution = history->resolution;
+  if (decode_slow || fps_short) {
+    // already at the lowest resolution, so the device can not keep up with the frame rate
+    if (resolution == CHIAKI_VIDEO_RESOLUTION_PRESET_360p && fps == CHIAKI_VIDEO_FPS_PRESET_60)
+      fps = CHIAKI_VIDEO_FPS_PRESET_30;
+    resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_360p;
+  } else if (resolution == CHIAKI_VIDEO_RESOLUTION_PRESET_360p && !loss_high && history->decode_us < frame_us / 2) {
+    resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_540p;
+  }
+
+  chiaki_connect_video_profile_preset(profile, resolution, fps);
+  if (bitrate < profile->bitrate)
+    profile->bitrate = bitrate < AUTO_PROFILE_BITRATE_MIN ? AUTO_PROFILE_BITRATE_MIN : bitrate;
+  LOGD("Auto profile from %u sessions (loss %u permille, decode %u us, %u fps): %ux%u@%u, %u kbit/s",
+       history->sessions, history->loss_permille, history->decode_us, history->fps_achieved,
+       profile->width, profile->height, profile->max_fps, profile->bitrate);
+}
+
+static uint32_t history_avg(uint32_t sessions, uint32_t avg, uint32_t value) {
+  return sessions ? (avg * 3 + value) / 4 : value;
+}
+
+// Remember how the session that just ended went, for auto_profile()
+static void record_stream_history() {
+  ChiakiSession *session = &context.stream.session;
+  ChiakiVideoStatsCounters video;
+  chiaki_session_get_video_stats(session, &video);
+  if (video.frames < AUTO_PROFILE_FRAMES_MIN)
+    return;
+  VitaChiakiStreamHistory* history = config_stream_history(&context.config, stream_server_mac, true);
+  if (!history)
+    return;
+
+  ChiakiPacketStatsSnapshot packets;
+  chiaki_session_get_packet_stats_snapshot(session, &packets);
+  uint64_t total = packets.total.received + packets.total.lost;
+  uint32_t loss_permille = total ? (uint32_t)(packets.total.lost * 1000 / total) : 0;
+  ChiakiLatencyReport latency;
+  chiaki_session_get_latency_stats(session, &latency);
+  uint32_t decode_us = (uint32_t)latency.stages[CHIAKI_LATENCY_STAGE_DECODE].avg_us;
+
+  // the session may have fitted the profile to the path, which is what it actually used
+  ChiakiConnectVideoProfile *profile = &session->connect_info.video_profile;
+  history->loss_permille = history_avg(history->sessions, history->loss_permille, loss_permille);
+  history->decode_us = history_avg(history->sessions, history->decode_us, decode_us);
+  history->fps_achieved = history_avg(history->sessions, history->fps_achieved, vita_h264_fps_achieved());
+  history->resolution = resolution_preset_of(profile->height);
+  history->fps = profile->max_fps == 60 ? CHIAKI_VIDEO_FPS_PRESET_60 : CHIAKI_VIDEO_FPS_PRESET_30;
+  history->bitrate = profile->bitrate;
+  history->sessions++;
+  LOGD("Recorded stream history: loss %u permille, decode %u us, %u fps at %u kbit/s",
+       loss_permille, decode_us, vita_h264_fps_achieved(), profile->bitrate);
+  config_serialize(&context.config);
+}
+
+// The network the Vita is on, as the SSID and the address it got there, which changes with the network too
+static bool network_identity(char* buf, size_t buf_size) {
+  SceNetCtlInfo ssid, addr;
+  if (sceNetCtlInetGetInfo(SCE_NETCTL_INFO_GET_SSID, &ssid) < 0
+      || sceNetCtlInetGetInfo(SCE_NETCTL_INFO_GET_IP_ADDRESS, &addr) < 0)
+    return false;
+  snprintf(buf, buf_size, "%s/%s", ssid.ssid, addr.ip_address);
+  return true;
+}
+
+// Look up a recent measurement of the path to the console, to let the session skip Senkusha
+static bool known_path(VitaChiakiHost* host, ChiakiConnectPath* path) {
+  char network[sizeof(((VitaChiakiStreamHistory*)0)->path_network)];
+  VitaChiakiStreamHistory* history = config_stream_history(&context.config, host->server_mac, false);
+  if (!history || !history->path_time || !network_identity(network, sizeof(network)))
+    return false;
+  uint64_t now = (uint64_t)time(NULL);
+  if (strcmp(history->path_network, network) != 0
+      || now < history->path_time || now - history->path_time > PATH_CACHE_MAX_AGE_S)
+    return false;
+  path->mtu_in = history->path_mtu_in;
+  path->mtu_out = history->path_mtu_out;
+  path->rtt_us = history->path_rtt_us;
+  LOGD("Using the path measured %llu s ago on %s: rtt %llu us, mtu %u/%u",
+       (unsigned long long)(now - history->path_time), network,
+       (unsigned long long)path->rtt_us, path->mtu_in, path->mtu_out);
+  return true;
+}
+
+// Remember what Senkusha measured in the session that just connected
+static void record_path() {
+  ChiakiSession *session = &context.stream.session;
+  if (!session->path_probed)
+    return;
+  VitaChiakiStreamHistory* history = config_stream_history(&context.config, stream_server_mac, true);
+  if (!history || !network_identity(history->path_network, sizeof(history->path_network)))
+    return;
+  history->path_time = (uint64_t)time(NULL);
+  history->path_mtu_in = session->mtu_in;
+  history->path_mtu_out = session->mtu_out;
+  history->path_rtt_us = session->rtt_us;
+  config_serialize(&context.config);
+}
+
+// The known path is only as good as the stream that used it: if that never got going or lost a lot,
+// measure again next time
+static void check_known_path() {
+  ChiakiSession *session = &context.stream.session;
+  ChiakiVideoStatsCounters video;
+  chiaki_session_get_video_stats(session, &video);
+  ChiakiPacketStatsSnapshot packets;
+  chiaki_session_get_packet_stats_snapshot(session, &packets);
+  uint64_t total = packets.total.received + packets.total.lost;
+  uint32_t loss_permille = total ? (uint32_t)(packets.total.lost * 1000 / total) : 0;
+  if (video.frames && loss_permille <= PATH_CACHE_LOSS_MAX_PERMILLE)
+    return;
+  VitaChiakiStreamHistory* history = config_stream_history(&context.config, stream_server_mac, false);
+  if (!history || !history->path_time)
+    return;
+  LOGD("Dropping the known path after %llu frames with loss %u permille",
+       (unsigned long long)video.frames, loss_permille);
+  history->path_time = 0;
+  config_serialize(&context.config);
+}
+
+static ChiakiThreadAttr default_role_attrs[CHIAKI_THREAD_ROLE_COUNT];
+static bool default_role_attrs_saved = false;
+
+static void role_attr_place(ChiakiThreadRole role, unsigned int cpu_affinity_mask) {
+  ChiakiThreadAttr attr = default_role_attrs[role];
+  attr.cpu_affinity_mask = cpu_affinity_mask;
+  chiaki_thread_role_attr_set(role, &attr);
+}
+
+// Lay out the library threads for the next stream. Video is decoded on the takion thread,
+// so it is created with the attributes of the decoder either way.
+static void setup_thread_placement() {
+  if (!default_role_attrs_saved) {
+    for (size_t i = 0; i < CHIAKI_THREAD_ROLE_COUNT; i++)
+      chiaki_thread_role_attr_get((ChiakiThreadRole)i, &default_role_attrs[i]);
+    default_role_attrs_saved = true;
+  }
+  for (size_t i = 0; i < CHIAKI_THREAD_ROLE_COUNT; i++)
+    chiaki_thread_role_attr_set((ChiakiThreadRole)i, &default_role_attrs[i]);
+
+  if (context.config.thread_placement == THREAD_PLACEMENT_SPREAD) {
+    // the main thread draws nothing while streaming, so core 0 is left to receiving and decrypting
+    role_attr_place(CHIAKI_THREAD_ROLE_TAKION_RECV, SCE_KERNEL_CPU_MASK_USER_0);
+    role_attr_place(CHIAKI_THREAD_ROLE_GKCRYPT, SCE_KERNEL_CPU_MASK_USER_0);
+    role_attr_place(CHIAKI_THREAD_ROLE_TIMER_WHEEL, SCE_KERNEL_CPU_MASK_USER_0);
+    role_attr_place(CHIAKI_THREAD_ROLE_VIDEO_DECODE, SCE_KERNEL_CPU_MASK_USER_1);
+    role_attr_place(CHIAKI_THREAD_ROLE_AUDIO_DECODE, SCE_KERNEL_CPU_MASK_USER_2);
+    role_attr_place(CHIAKI_THREAD_ROLE_TAKION_MAC, SCE_KERNEL_CPU_MASK_USER_2);
+    // FEC of a frame is waited for on the takion thread, so the workers take the other two cores at its priority
+    ChiakiThreadAttr fec_attr = default_role_attrs[CHIAKI_THREAD_ROLE_FEC];
+    fec_attr.priority = default_role_attrs[CHIAKI_THREAD_ROLE_VIDEO_DECODE].priority;
+    fec_attr.cpu_affinity_mask = SCE_KERNEL_CPU_MASK_USER_0 | SCE_KERNEL_CPU_MASK_USER_2;
+    chiaki_thread_role_attr_set(CHIAKI_THREAD_ROLE_FEC, &fec_attr);
+  }
+
+  ChiakiThreadAttr takion_attr;
+  chiaki_thread_role_attr_get(CHIAKI_THREAD_ROLE_VIDEO_DECODE, &takion_attr);
+  takion_attr.name = default_role_attrs[CHIAKI_THREAD_ROLE_TAKION].name;
+  chiaki_thread_role_attr_set(CHIAKI_THREAD_ROLE_TAKION, &takion_attr);
+  chiaki_thread_role_stats_reset();
+}
+
+// CPU time of the stream threads, to verify the load is spread over the cores
+static void log_thread_stats() {
+  uint64_t stream_ms = (chiaki_time_now_monotonic_us() - stream_start_us) / 1000;
+  if (!stream_ms)
+    return;
+  for (size_t i = 0; i < CHIAKI_THREAD_ROLE_COUNT; i++) {
+    ChiakiThreadRoleStats stats;
+    chiaki_thread_role_stats_get((ChiakiThreadRole)i, &stats);
+    if (!stats.threads && !stats.running)
+      continue;
+    size_t cpu_ms = stats.cpu_ms + stats.running_cpu_ms;
+    LOGD("Thread %-18s %u threads (%u running), %6u ms CPU (%2u%%), affinity 0x%05X",
+      chiaki_thread_role_string((ChiakiThreadRole)i), (unsigned int)(stats.threads + stats.running),
+      (unsigned int)stats.running, (unsigned int)cpu_ms, (unsigned int)(cpu_ms * 100 / stream_ms), stats.cpu_affinity_mask);
+  }
+  ChiakiThreadStats input_stats;
+  if (chiaki_thread_get_stats(&context.stream.input_thread, &input_stats) == CHIAKI_ERR_SUCCESS)
+    LOGD("Thread %-18s %llu ms CPU in total, affinity 0x%05X", "input",
+      (unsigned long long)(input_stats.cpu_us / 1000), input_stats.cpu_affinity_mask);
+}
+
+static void close_capture() {
+  if (!stream_capture_open)
+    return;
+  LOGD("Captured %llu datagrams to %s%s", (unsigned long long)stream_capture.datagrams, CAPTURE_FILENAME,
+       stream_capture.failed ? ", but writing failed" : "");
+  chiaki_capture_fini(&stream_capture);
+  stream_capture_open = false;
+}
+
+static void close_recording() {
+  if (!stream_recorder_open)
+    return;
+  chiaki_recorder_fini(&stream_recorder);
+  stream_recorder_open = false;
+  ChiakiRecorderStats* stats = &stream_recorder.stats;
+  LOGD("Recorded %llu frames, %llu KB to %s%s, dropped %llu frames, queueing took %llu ms, writing %llu ms, queue peak %zu KB",
+       (unsigned long long)stats->frames_written, (unsigned long long)(stats->bytes_written / 1024), RECORDING_FILENAME,
+       stats->failed ? ", but writing failed" : "", (unsigned long long)stats->frames_dropped,
+       (unsigned long long)(stats->push_us / 1000), (unsigned long long)(stats->write_us / 1000), stats->queue_peak / 1024);
+}
+
+static void telemetry_app_stats_cb(ChiakiTelemetryAppStats* stats, void* user) {
+  stats->fps = vita_h264_fps_achieved();
+  VitaAudioStats audio;
+  vita_audio_get_stats(&audio);
+  stats->audio_buffered_ms = audio.buffered_ms;
+  stats->audio_target_ms = audio.target_ms;
+  stats->audio_underruns = audio.underruns;
+  stats->audio_overruns = audio.overruns;
+  ChiakiThreadStats input_stats;
+  if (stream_input_started && chiaki_thread_get_stats(&context.stream.input_thread, &input_stats) == CHIAKI_ERR_SUCCESS)
+    stats->cpu_ms = (uint32_t)(input_stats.cpu_us / 1000);
+}
+
+// Stream the stats to the receiver in the config, given as "host" or "host:port"
+static void open_telemetry() {
+  char host[128];
+  snprintf(host, sizeof(host), "%s", context.config.telemetry);
+  unsigned int port = CHIAKI_TELEMETRY_PORT_DEFAULT;
+  char* sep = strrchr(host, ':');
+  if (sep) {
+    *sep = '\0';
+    port = (unsigned int)strtoul(sep + 1, NULL, 10);
+  }
+  if (!host[0] || !port || port > UINT16_MAX) {
+    LOGE("Invalid telemetry setting %s, not sending telemetry", context.config.telemetry);
+    return;
+  }
+  if (chiaki_telemetry_init(&stream_telemetry, &context.stream.session, host, (uint16_t)port,
+                            CHIAKI_TELEMETRY_INTERVAL_MS_DEFAULT, telemetry_app_stats_cb, NULL, &context.log) == CHIAKI_ERR_SUCCESS)
+    stream_telemetry_open = true;
+  else
+    LOGE("Failed to start telemetry to %s", context.config.telemetry);
+}
+
+static void close_telemetry() {
+  if (!stream_telemetry_open)
+    return;
+  chiaki_telemetry_fini(&stream_telemetry);
+  stream_telemetry_open = false;
+  LOGD("Sent %llu telemetry snapshots, dropped %llu", (unsigned long long)stream_telemetry.stats.sent,
+       (unsigned long long)stream_telemetry.stats.dropped);
+}
+
+// Keep a summary of the session that just ended with the history of the console
+static void save_session_report(ChiakiQuitReason quit_reason) {
+  uint64_t duration_ms = stream_connected_time ? (chiaki_time_now_monotonic_us() - stream_connected_us) / 1000 : 0;
+  VitaSessionReport report;
+  session_report_collect(&report, &context.stream.session, stream_server_mac, stream_connected_time, duration_ms, quit_reason);
+  if (!session_report_save(&report))
+    LOGE("Failed to write the session report to %s", SESSION_REPORTS_FILENAME);
+  else
+    LOGD("Saved session report: %u s, %u frames, %u failed, latency p95 %u us, loss %u permille",
+         report.duration_ms / 1000, report.frames, report.frames_failed, report.latency_p95_us, report.loss_permille);
+}
+
 static void event_cb(ChiakiEvent *event, void *user) {
 	switch(event->type)
 	{
 		case CHIAKI_EVENT_CONNECTED:
 			LOGD("EventCB CHIAKI_EVENT_CONNECTED");
+      if (event->connected.resumed) {
+        // decoder, audio and the session's stats carried on, only the notice goes
+        LOGD("Stream resumed %llu ms after the link was lost",
+             (unsigned long long)((chiaki_time_now_monotonic_us() - stream_link_lost_us) / 1000));
+        vita_h264_set_reconnecting(false);
+        break;
+      }
+      stream_connected_time = (uint64_t)time(NULL);
+      stream_connected_us = chiaki_time_now_monotonic_us();
+      if (context.config.path_cache)
+        record_path();
 			break;
 		case CHIAKI_EVENT_LOGIN_PIN_REQUEST:
 			LOGD("EventCB CHIAKI_EVENT_LOGIN_PIN_REQUEST");
 			break;
+		case CHIAKI_EVENT_RECONNECTING:
+			LOGD("EventCB CHIAKI_EVENT_RECONNECTING attempt %u", event->reconnecting.attempt);
+      if (event->reconnecting.attempt == 1)
+        stream_link_lost_us = chiaki_time_now_monotonic_us();
+      vita_h264_set_reconnecting(true);
+			break;
 		case CHIAKI_EVENT_RUMBLE:
 			LOGD("EventCB CHIAKI_EVENT_RUMBLE");
 			break;
 		case CHIAKI_EVENT_QUIT:
 			LOGE("EventCB CHIAKI_EVENT_QUIT");
+      if (context.config.auto_profile)
+        record_stream_history();
+      if (stream_path_cached)
+        check_known_path();
+      log_thread_stats();
+      latency_probe_stop();
+      save_session_report(event->quit.reason);
+      stream_connected_time = 0;
 	    chiaki_opus_decoder_fini(&context.stream.opus_decoder);
+      wait_video_ready();
       vita_h264_cleanup();
       vita_audio_cleanup();
+      unsigned int max_fps = context.stream.session.connect_info.video_profile.max_fps;
+      power_log_decode_headroom(1000000 / (max_fps ? max_fps : 60));
+      power_set_level(POWER_LEVEL_MENU);
+      if (context.config.trace) {
+        chiaki_trace_stop();
+        ChiakiErrorCode trace_err = chiaki_trace_dump(TRACE_FILENAME);
+        if (trace_err == CHIAKI_ERR_SUCCESS)
+          LOGD("Wrote trace to %s", TRACE_FILENAME);
+        else
+          LOGE("Failed to write trace to %s: %s", TRACE_FILENAME, chiaki_error_string(trace_err));
+      }
+      close_capture();
+      close_recording();
+      close_telemetry();
       context.stream.is_streaming = false;
+      pause_discovery(false);
+      host_crypto_warmup();
 			break;
 	}
 }
@@ -124,6 +611,18 @@ static bool video_cb(uint8_t *buf, size_t buf_size, void *user) {
     LOGD("VIDEO CALLBACK: First frame received (size=%zu)", buf_size);
     first_frame = false;
   }
+  if (!stream_video_ready) {
+    if (!wait_video_ready())
+      return false;
+    stream_video_ready = true;
+    uint64_t now = chiaki_time_now_monotonic_us();
+    if (wake_start_us)
+      LOGD("First frame %llu ms after wakeup, %llu ms after stream start",
+           (unsigned long long)((now - wake_start_us) / 1000), (unsigned long long)((now - stream_start_us) / 1000));
+    else
+      LOGD("First frame %llu ms after stream start", (unsigned long long)((now - stream_start_us) / 1000));
+    wake_start_us = 0;
+  }
   context.stream.is_streaming = true;
   int err = vita_h264_decode_frame(buf, buf_size);
   if (err != 0) {
@@ -133,58 +632,29 @@ static bool video_cb(uint8_t *buf, size_t buf_size, void *user) {
   return true;
 }
 
-static void set_ctrl_out(VitaChiakiStream *stream, VitakiCtrlOut ctrl_out) {
-  if (ctrl_out == VITAKI_CTRL_OUT_L2) {
-    stream->controller_state.l2_state = 0xff;
-  } else if (ctrl_out == VITAKI_CTRL_OUT_R2) {
-    stream->controller_state.r2_state = 0xff;
-  } else {
-    // in this case ctrl_out is a controller button mask
-    //if (ctrl_out == VITAKI_CTRL_OUT_NONE) {
-    //// do nothing
-    //} else {
-    stream->controller_state.buttons |= ctrl_out;
-    //}
-  }
-}
-
-void set_ctrl_l2pos(VitaChiakiStream *stream, VitakiCtrlIn ctrl_in) {
-  // check if ctrl_in should be l2; if not, hit corresponding mapped button
-  VitakiCtrlMapInfo vcmi = stream->vcmi;
-  if (vcmi.in_l2 == ctrl_in) {
-    stream->controller_state.l2_state = 0xff;
-  } else {
-    stream->controller_state.buttons |= vcmi.in_out_btn[ctrl_in];
-  }
-}
-void set_ctrl_r2pos(VitaChiakiStream *stream, VitakiCtrlIn ctrl_in) {
-  // check if ctrl_in should be r2; if not, hit corresponding mapped button
-  VitakiCtrlMapInfo vcmi = stream->vcmi;
-  if (vcmi.in_r2 == ctrl_in) {
-    stream->controller_state.r2_state = 0xff;
-  } else {
-    stream->controller_state.buttons |= vcmi.in_out_btn[ctrl_in];
-  }
+static uint8_t *video_au_buffer_cb(size_t size, void *user) {
+  return vita_h264_get_au_buffer(size);
 }
 
 static void *input_thread_func(void* user) {
-  // Set input thread to highest priority for lowest input lag
-  // Note: Using CPU 0 same as video/audio to avoid scheduling issues
-  // Priority 96 is higher than video (64) so input takes precedence
-  sceKernelChangeThreadPriority(SCE_KERNEL_THREAD_ID_SELF, 96);
-  sceKernelChangeThreadCpuAffinityMask(SCE_KERNEL_THREAD_ID_SELF, 0);
-
   sceMotionStartSampling();
   sceCtrlSetSamplingMode(SCE_CTRL_MODE_ANALOG_WIDE);
   sceCtrlSetSamplingModeExt(SCE_CTRL_MODE_ANALOG_WIDE);
   SceCtrlData ctrl;
   SceMotionState motion;
 	VitaChiakiStream *stream = user;
-  int ms_per_loop = 2;
+  // Buttons, touch and motion are all sampled by the system once per vblank, so
+  // polling more often only reads the same sample again. FEEDBACK wakes up at the
+  // pace the feedback sender can send at most.
+  VitaChiakiInputSampling sampling = context.config.input_sampling;
+  int feedback_us_per_loop = 8000;
+  ChiakiControllerState state_prev;
+  chiaki_controller_state_set_idle(&state_prev);
+  bool state_pushed = false;
 
-  VitakiCtrlMapInfo vcmi = stream->vcmi;
+  VitakiCtrlMapInfo *vcmi = &stream->vcmi;
 
-  if (!vcmi.did_init) init_controller_map(&vcmi, context.config.controller_map_id);
+  if (!vcmi->did_init) init_controller_map(vcmi, context.config.controller_map_id);
 
   // Touchscreen setup
 	sceTouchSetSamplingState(SCE_TOUCH_PORT_FRONT, SCE_TOUCH_SAMPLING_STATE_START);
@@ -192,22 +662,6 @@ static void *input_thread_func(void* user) {
 	sceTouchEnableTouchForce(SCE_TOUCH_PORT_FRONT);
 	sceTouchEnableTouchForce(SCE_TOUCH_PORT_BACK);
 	SceTouchData touch[SCE_TOUCH_PORT_MAX_NUM];
-  int TOUCH_MAX_WIDTH = 1919;
-  int TOUCH_MAX_HEIGHT = 1087;
-  int TOUCH_MAX_WIDTH_BY_2 = TOUCH_MAX_WIDTH/2;
-  int TOUCH_MAX_HEIGHT_BY_2 = TOUCH_MAX_HEIGHT/2;
-  int TOUCH_MAX_WIDTH_BY_4 = TOUCH_MAX_WIDTH/4;
-  int TOUCH_MAX_HEIGHT_BY_4 = TOUCH_MAX_HEIGHT/4;
-  int FRONT_ARC_RADIUS = TOUCH_MAX_HEIGHT/3;
-  int FRONT_ARC_RADIUS_2 = FRONT_ARC_RADIUS*FRONT_ARC_RADIUS;
-  // note: rear touch may be active in Y only from 108 to 889? (see Vita3K code)
-
-  // manually create bools for each combo (since there's only 5)
-  bool vitaki_reartouch_left_l1_mapped = (vcmi.in_out_btn[VITAKI_CTRL_IN_REARTOUCH_LEFT_L1] != 0) || (vcmi.in_l2 == VITAKI_CTRL_IN_REARTOUCH_LEFT_L1);
-  bool vitaki_reartouch_right_r1_mapped = (vcmi.in_out_btn[VITAKI_CTRL_IN_REARTOUCH_RIGHT_R1] != 0) || (vcmi.in_r2 == VITAKI_CTRL_IN_REARTOUCH_RIGHT_R1);
-  bool vitaki_select_start_mapped = (vcmi.in_out_btn[VITAKI_CTRL_IN_SELECT_START] != 0);
-  bool vitaki_left_square_mapped = (vcmi.in_out_btn[VITAKI_CTRL_IN_LEFT_SQUARE] != 0) || (vcmi.in_l2 == VITAKI_CTRL_IN_LEFT_SQUARE);
-  bool vitaki_right_circle_mapped = (vcmi.in_out_btn[VITAKI_CTRL_IN_RIGHT_CIRCLE] != 0) || (vcmi.in_r2 == VITAKI_CTRL_IN_RIGHT_CIRCLE);
 
   static int wait_count = 0;
   while (true) {
@@ -223,8 +677,16 @@ static void *input_thread_func(void* user) {
       }
       int start_time_us = sceKernelGetProcessTimeWide();
 
-      // get button state
-      sceCtrlPeekBufferPositive(0, &ctrl, 1);
+      // get button state, waiting for the next sample first
+      if (sampling == INPUT_SAMPLING_BLOCKING) {
+        sceCtrlReadBufferPositive(0, &ctrl, 1);
+      } else {
+        if (sampling == INPUT_SAMPLING_VBLANK)
+          sceDisplayWaitVblankStart();
+        sceCtrlPeekBufferPositive(0, &ctrl, 1);
+      }
+      uint64_t sample_us = chiaki_time_now_monotonic_us();
+      CHIAKI_TRACE(INPUT, INPUT_SAMPLE, ctrl.buttons);
 
       // get touchscreen state
       for(int port = 0; port < SCE_TOUCH_PORT_MAX_NUM; port++) {
@@ -252,135 +714,53 @@ static void *input_thread_func(void* user) {
       stream->controller_state.right_x = (ctrl.rx - 128) * 2 * 0x7F/*.FF*/;
       stream->controller_state.right_y = (ctrl.ry - 128) * 2 * 0x7F/*.FF*/;
 
-      stream->controller_state.buttons = 0x00;
-      stream->controller_state.l2_state = 0x00;
-      stream->controller_state.r2_state = 0x00;
-
-      bool reartouch_right = false;
-      bool reartouch_left = false;
-
+      // the map is compiled into lookup tables by init_controller_map()
+      uint32_t out = 0;
       for (int touch_i = 0; touch_i < touch[SCE_TOUCH_PORT_BACK].reportNum; touch_i++) {
-        int x = touch[SCE_TOUCH_PORT_BACK].report[touch_i].x;
-        int y = touch[SCE_TOUCH_PORT_BACK].report[touch_i].y;
-
-        stream->controller_state.buttons |= vcmi.in_out_btn[VITAKI_CTRL_IN_REARTOUCH_ANY];
-
-        if (x > TOUCH_MAX_WIDTH_BY_2) {
-          set_ctrl_r2pos(stream, VITAKI_CTRL_IN_REARTOUCH_RIGHT);
-          reartouch_right = true;
-          if (y > TOUCH_MAX_HEIGHT_BY_2) {
-            set_ctrl_r2pos(stream, VITAKI_CTRL_IN_REARTOUCH_LR);
-          } else {
-            set_ctrl_r2pos(stream, VITAKI_CTRL_IN_REARTOUCH_UR);
-          }
-        } else if (x < TOUCH_MAX_WIDTH_BY_2) {
-          set_ctrl_l2pos(stream, VITAKI_CTRL_IN_REARTOUCH_LEFT);
-          reartouch_left = true;
-          if (y > TOUCH_MAX_HEIGHT_BY_2) {
-            set_ctrl_l2pos(stream, VITAKI_CTRL_IN_REARTOUCH_LL);
-          } else {
-            set_ctrl_l2pos(stream, VITAKI_CTRL_IN_REARTOUCH_UL);
-          }
-        }
+        SceTouchReport *report = &touch[SCE_TOUCH_PORT_BACK].report[touch_i];
+        out |= vcmi->rear_grid[vitaki_touch_grid_cell(report->x, report->y)];
       }
-
       for (int touch_i = 0; touch_i < touch[SCE_TOUCH_PORT_FRONT].reportNum; touch_i++) {
-        int x = touch[SCE_TOUCH_PORT_FRONT].report[touch_i].x;
-        int y = touch[SCE_TOUCH_PORT_FRONT].report[touch_i].y;
-        stream->controller_state.buttons |= vcmi.in_out_btn[VITAKI_CTRL_IN_FRONTTOUCH_ANY];
-
-        if (x > TOUCH_MAX_WIDTH_BY_2) {
-          set_ctrl_r2pos(stream, VITAKI_CTRL_IN_FRONTTOUCH_RIGHT);
-
-          if (y*y + (x-TOUCH_MAX_WIDTH)*(x-TOUCH_MAX_WIDTH) <= FRONT_ARC_RADIUS_2) {
-            set_ctrl_r2pos(stream, VITAKI_CTRL_IN_FRONTTOUCH_UR_ARC);
-          } else if ((y-TOUCH_MAX_HEIGHT)*(y-TOUCH_MAX_HEIGHT) + (x-TOUCH_MAX_WIDTH)*(x-TOUCH_MAX_WIDTH) <= FRONT_ARC_RADIUS_2) {
-            set_ctrl_r2pos(stream, VITAKI_CTRL_IN_FRONTTOUCH_LR_ARC);
-          }
-        } else if (x < TOUCH_MAX_WIDTH_BY_2) {
-          set_ctrl_l2pos(stream, VITAKI_CTRL_IN_FRONTTOUCH_LEFT);
-
-          if (y*y + x*x <= FRONT_ARC_RADIUS_2) {
-            set_ctrl_l2pos(stream, VITAKI_CTRL_IN_FRONTTOUCH_UL_ARC);
-          } else if ((y-TOUCH_MAX_HEIGHT)*(y-TOUCH_MAX_HEIGHT) + x*x <= FRONT_ARC_RADIUS_2) {
-            set_ctrl_l2pos(stream, VITAKI_CTRL_IN_FRONTTOUCH_LL_ARC);
-          }
-        }
-
-        if ((x >= TOUCH_MAX_WIDTH_BY_4) && (x <= TOUCH_MAX_WIDTH - TOUCH_MAX_WIDTH_BY_4)
-            && (y >= TOUCH_MAX_HEIGHT_BY_4) && (y <= TOUCH_MAX_HEIGHT - TOUCH_MAX_HEIGHT_BY_4)
-            ) {
-          stream->controller_state.buttons |= vcmi.in_out_btn[VITAKI_CTRL_IN_FRONTTOUCH_CENTER];
-        }
+        SceTouchReport *report = &touch[SCE_TOUCH_PORT_FRONT].report[touch_i];
+        out |= vcmi->front_grid[vitaki_touch_grid_cell(report->x, report->y)];
       }
 
-      // cursed conversion
-      if (ctrl.buttons & SCE_CTRL_SELECT)   stream->controller_state.buttons |= CHIAKI_CONTROLLER_BUTTON_SHARE;
-      if (ctrl.buttons & SCE_CTRL_START)    stream->controller_state.buttons |= CHIAKI_CONTROLLER_BUTTON_OPTIONS;
-      if (ctrl.buttons & SCE_CTRL_UP)       stream->controller_state.buttons |= CHIAKI_CONTROLLER_BUTTON_DPAD_UP;
-      if (ctrl.buttons & SCE_CTRL_RIGHT)    stream->controller_state.buttons |= CHIAKI_CONTROLLER_BUTTON_DPAD_RIGHT;
-      if (ctrl.buttons & SCE_CTRL_DOWN)     stream->controller_state.buttons |= CHIAKI_CONTROLLER_BUTTON_DPAD_DOWN;
-      if (ctrl.buttons & SCE_CTRL_LEFT)     stream->controller_state.buttons |= CHIAKI_CONTROLLER_BUTTON_DPAD_LEFT;
-      if (ctrl.buttons & SCE_CTRL_TRIANGLE) stream->controller_state.buttons |= CHIAKI_CONTROLLER_BUTTON_PYRAMID;
-      if (ctrl.buttons & SCE_CTRL_CIRCLE)   stream->controller_state.buttons |= CHIAKI_CONTROLLER_BUTTON_MOON;
-      if (ctrl.buttons & SCE_CTRL_CROSS)    stream->controller_state.buttons |= CHIAKI_CONTROLLER_BUTTON_CROSS;
-      if (ctrl.buttons & SCE_CTRL_SQUARE)   stream->controller_state.buttons |= CHIAKI_CONTROLLER_BUTTON_BOX;
-      // what is L3??
-      if (ctrl.buttons & SCE_CTRL_L3)       stream->controller_state.buttons |= CHIAKI_CONTROLLER_BUTTON_L3;
-      if (ctrl.buttons & SCE_CTRL_R3)       stream->controller_state.buttons |= CHIAKI_CONTROLLER_BUTTON_R3;
-
-      if (ctrl.buttons & SCE_CTRL_LTRIGGER) {
-        if (reartouch_left && vitaki_reartouch_left_l1_mapped) {
-          set_ctrl_l2pos(stream, VITAKI_CTRL_IN_REARTOUCH_LEFT_L1);
-        } else {
-          set_ctrl_l2pos(stream, VITAKI_CTRL_IN_L1);
-        }
-      }
-      if (ctrl.buttons & SCE_CTRL_RTRIGGER) {
-        if (reartouch_right && vitaki_reartouch_right_r1_mapped) {
-          set_ctrl_r2pos(stream, VITAKI_CTRL_IN_REARTOUCH_RIGHT_R1);
-        } else {
-          set_ctrl_r2pos(stream, VITAKI_CTRL_IN_R1);
-        }
+      uint32_t buttons = ctrl.buttons;
+      out |= vcmi->btn_lo[buttons & 0xff] | vcmi->btn_hi[(buttons >> 8) & 0xff];
+      if (buttons & SCE_CTRL_LTRIGGER)
+        out |= (out & VITAKI_CTRL_OUT_FLAG_REARTOUCH_L) ? vcmi->ltrigger_reartouch : vcmi->ltrigger;
+      if (buttons & SCE_CTRL_RTRIGGER)
+        out |= (out & VITAKI_CTRL_OUT_FLAG_REARTOUCH_R) ? vcmi->rtrigger_reartouch : vcmi->rtrigger;
+
+      // Select + Start, Dpad-left + Square, Dpad-right + Circle
+      for (int i = 0; i < vcmi->combos_count; i++) {
+        VitakiCtrlCombo *combo = &vcmi->combos[i];
+        if ((buttons & combo->buttons) == combo->buttons)
+          out = (out & ~combo->clear) | combo->out;
       }
 
-      // Select + Start
-      if (vitaki_select_start_mapped) {
-        if ((ctrl.buttons & SCE_CTRL_SELECT) && (ctrl.buttons & SCE_CTRL_START)) {
-          stream->controller_state.buttons &= ~CHIAKI_CONTROLLER_BUTTON_SHARE;
-          stream->controller_state.buttons &= ~CHIAKI_CONTROLLER_BUTTON_OPTIONS;
-          stream->controller_state.buttons |= vcmi.in_out_btn[VITAKI_CTRL_IN_SELECT_START];
-        }
-      }
+      stream->controller_state.buttons = out & VITAKI_CTRL_OUT_BUTTONS_MASK;
+      stream->controller_state.l2_state = (out & VITAKI_CTRL_OUT_FLAG_L2) ? 0xff : 0x00;
+      stream->controller_state.r2_state = (out & VITAKI_CTRL_OUT_FLAG_R2) ? 0xff : 0x00;
+      latency_probe_input(&stream->controller_state, sample_us);
 
-      // Dpad-left + Square
-      if (vitaki_left_square_mapped) {
-        if ((ctrl.buttons & SCE_CTRL_LEFT) && (ctrl.buttons & SCE_CTRL_SQUARE)) {
-          stream->controller_state.buttons &= ~CHIAKI_CONTROLLER_BUTTON_DPAD_LEFT;
-          stream->controller_state.buttons &= ~CHIAKI_CONTROLLER_BUTTON_BOX;
-          set_ctrl_l2pos(stream, VITAKI_CTRL_IN_LEFT_SQUARE);
-        }
+      // the session wakes up the feedback sender on every call, so skip it if nothing changed
+      if (!state_pushed || !chiaki_controller_state_equals(&stream->controller_state, &state_prev)) {
+        chiaki_session_set_controller_state_sampled(&stream->session, &stream->controller_state, sample_us);
+        state_prev = stream->controller_state;
+        state_pushed = true;
       }
-      // Dpad-right + Circle
-      if (vitaki_right_circle_mapped) {
-        if ((ctrl.buttons & SCE_CTRL_RIGHT) && (ctrl.buttons & SCE_CTRL_CIRCLE)) {
-          stream->controller_state.buttons &= ~CHIAKI_CONTROLLER_BUTTON_DPAD_RIGHT;
-          stream->controller_state.buttons &= ~CHIAKI_CONTROLLER_BUTTON_MOON;
-          set_ctrl_r2pos(stream, VITAKI_CTRL_IN_RIGHT_CIRCLE);
-        }
-      }
-
-      chiaki_session_set_controller_state(&stream->session, &stream->controller_state);
       // LOGD("ly 0x%x %d", ctrl.ly, ctrl.ly);
 
-      // Adjust sleep time to account for calculations above
-      int diff_time_us = sceKernelGetProcessTimeWide() - start_time_us;
-      if (diff_time_us >= ms_per_loop*1000) {
-        // Control loop appears to usually take ~70-90 us, sometimes up to 130
-        // Far less than the 5000 us of the default loop
-        LOGD("SLOW CTRL LOOP! %d microseconds", diff_time_us);
-      } else {
-        usleep(ms_per_loop*1000 - diff_time_us);
+      if (sampling == INPUT_SAMPLING_FEEDBACK) {
+        // Adjust sleep time to account for calculations above
+        int diff_time_us = sceKernelGetProcessTimeWide() - start_time_us;
+        if (diff_time_us >= feedback_us_per_loop) {
+          // Control loop appears to usually take ~70-90 us, sometimes up to 130
+          LOGD("SLOW CTRL LOOP! %d microseconds", diff_time_us);
+        } else {
+          usleep(feedback_us_per_loop - diff_time_us);
+        }
       }
 
     } else {
@@ -398,13 +778,18 @@ static void *input_thread_func(void* user) {
 
 int host_stream(VitaChiakiHost* host) {
   LOGD("Preparing to start host_stream");
+  stream_start_us = chiaki_time_now_monotonic_us();
   if (!host->hostname || !host->registered_state) {
     return 1;
   }
   // stop_discovery();
   ChiakiConnectVideoProfile profile = {};
-	chiaki_connect_video_profile_preset(&profile,
-		context.config.resolution, context.config.fps);
+  if (context.config.auto_profile)
+    auto_profile(host, &profile);
+  else
+    chiaki_connect_video_profile_preset(&profile,
+      context.config.resolution, context.config.fps);
+  memcpy(stream_server_mac, host->server_mac, sizeof(stream_server_mac));
   // profile.bitrate = 15000;
 	// Build chiaki ps4 stream session
 	ChiakiConnectInfo chiaki_connect_info = {};
@@ -412,15 +797,80 @@ int host_stream(VitaChiakiHost* host) {
 	chiaki_connect_info.host = host->hostname;
 	chiaki_connect_info.video_profile = profile;
 	chiaki_connect_info.video_profile_auto_downgrade = true;
+	chiaki_connect_info.video_profile_fit_path = context.config.auto_profile;
+	chiaki_connect_info.video_ref_frames = REF_FRAMES;
+	// keep opus decoding and audio output off the takion thread
+	chiaki_connect_info.audio_decode_queue = true;
+	// the audio and video sinks pick up the rest of it from context.stream
+	chiaki_latency_profile_preset(&context.stream.latency_profile, context.config.latency_mode);
+	chiaki_connect_info.latency_profile = &context.stream.latency_profile;
+	chiaki_connect_info.av_sync_max_offset_ms = context.config.av_sync_max_offset_ms;
+	chiaki_connect_info.feedback_immediate = context.config.input_immediate_send;
+	// motion changes on every 2 ms input sample, which would otherwise cost a packet of upstream airtime each
+	chiaki_connect_info.feedback_state_rate_max = (unsigned int)context.config.input_state_rate_max;
+	chiaki_connect_info.congestion_control_delay_based = context.config.delay_based_congestion_control;
+	// the profile can not be switched mid-stream, so lower the bitrate when decoding falls behind
+	chiaki_connect_info.load_monitor = true;
+	// only worth it with the threads spread, so the MAC thread gets a core of its own
+	chiaki_connect_info.mac_offload = context.config.thread_placement == THREAD_PLACEMENT_SPREAD;
+	// every small upstream packet contends for the same airtime as a big one, so merge the acks of data bursts
+	// and hold them a little longer once the feedback at full rate already costs that many a second
+	chiaki_connect_info.ack_delay_ms = 4;
+	chiaki_connect_info.upstream_packets_budget = 250;
+	// recovering an I frame is the worst case of the takion thread, the spare cores take a share of it
+	chiaki_connect_info.fec_workers = context.config.thread_placement == THREAD_PLACEMENT_SPREAD ? 2 : 0;
+	chiaki_connect_info.senkusha_fast_probe = context.config.fast_path_probe;
+	// sceNet's default receive buffer is far smaller than an I frame, which then shows up as FEC failures
+	chiaki_connect_info.recv_buffer_burst_ms = (unsigned int)context.config.recv_buffer_burst_ms;
+	chiaki_connect_info.dscp = context.config.dscp == DSCP_EF ? CHIAKI_DSCP_EF
+		: context.config.dscp == DSCP_AF41 ? CHIAKI_DSCP_AF41 : 0;
+	// after a Wi-Fi stall, catching up on every queued frame keeps the display lagging for seconds
+	chiaki_connect_info.video_backlog_threshold_ms = (unsigned int)context.config.backlog_skip_ms;
+	// a frame whose last unit is lost would otherwise only be reported once the next one starts arriving
+	chiaki_connect_info.video_frame_deadline = true;
+	// roaming between access points or a short Wi-Fi drop would otherwise end the session
+	chiaki_connect_info.resume = context.config.resume;
+	stream_path_cached = context.config.path_cache && known_path(host, &stream_path);
+	chiaki_connect_info.path_known = stream_path_cached ? &stream_path : NULL;
+	chiaki_connect_info.ecdh_key = take_ecdh_key(&stream_ecdh_key) ? &stream_ecdh_key : NULL;
 
 	chiaki_connect_info.ps5 = chiaki_target_is_ps5(host->target);
 
+	if (context.config.capture) {
+		if (chiaki_capture_init(&stream_capture, CAPTURE_FILENAME) == CHIAKI_ERR_SUCCESS) {
+			stream_capture_open = true;
+			chiaki_connect_info.capture = &stream_capture;
+		} else
+			LOGE("Failed to open %s, not capturing", CAPTURE_FILENAME);
+	}
+	if (context.config.record) {
+		if (chiaki_recorder_init(&stream_recorder, RECORDING_FILENAME, CHIAKI_RECORDER_QUEUE_SIZE_DEFAULT) == CHIAKI_ERR_SUCCESS) {
+			stream_recorder_open = true;
+			chiaki_connect_info.recorder = &stream_recorder;
+		} else
+			LOGE("Failed to open %s, not recording", RECORDING_FILENAME);
+	}
+
+	ChiakiImpairConfig impair;
+	if (context.config.impair) {
+		chiaki_impair_config_default(&impair);
+		if (chiaki_impair_config_parse(&impair, context.config.impair) == CHIAKI_ERR_SUCCESS)
+			chiaki_connect_info.impair = &impair;
+		else
+			LOGE("Invalid impair setting %s, not impairing", context.config.impair);
+	}
+
 	memcpy(chiaki_connect_info.regist_key, host->registered_state->rp_regist_key, sizeof(chiaki_connect_info.regist_key));
 	memcpy(chiaki_connect_info.morning, host->registered_state->rp_key, sizeof(chiaki_connect_info.morning));
 
+	setup_thread_placement();
+
 	ChiakiErrorCode err = chiaki_session_init(&context.stream.session, &chiaki_connect_info, &context.log);
+	memset(&stream_ecdh_key, 0, sizeof(stream_ecdh_key)); // copied by the session
 	if(err != CHIAKI_ERR_SUCCESS) {
 		LOGE("Error during stream setup: %s", chiaki_error_string(err));
+    close_capture();
+    close_recording();
     return 1;
   }
   init_controller_map(&(context.stream.vcmi), context.config.controller_map_id);
@@ -429,32 +879,74 @@ int host_stream(VitaChiakiHost* host) {
 	ChiakiAudioSink audio_sink;
 	chiaki_opus_decoder_init(&context.stream.opus_decoder, &context.log);
 	chiaki_opus_decoder_set_cb(&context.stream.opus_decoder, vita_audio_init, vita_audio_cb, NULL);
+	chiaki_opus_decoder_set_buf_cb(&context.stream.opus_decoder, vita_audio_buf_cb);
 	chiaki_opus_decoder_get_sink(&context.stream.opus_decoder, &audio_sink);
 	chiaki_session_set_audio_sink(&context.stream.session, &audio_sink);
   chiaki_session_set_video_sample_cb(&context.stream.session, video_cb, NULL);
+  chiaki_session_set_video_au_buffer_cb(&context.stream.session, video_au_buffer_cb, NULL);
 	chiaki_session_set_event_cb(&context.stream.session, event_cb, NULL);
 
 	// init controller states
 	chiaki_controller_state_set_idle(&context.stream.controller_state);
 
-  err = vita_h264_setup(profile.width, profile.height);
-  if (err != 0) {
-		LOGE("Error during video start: %d", err);
-    return 1;
+  if (!video_ready_init) {
+    if (chiaki_bool_pred_cond_init(&video_ready) != CHIAKI_ERR_SUCCESS) {
+      LOGE("Failed to init video ready cond");
+      return 1;
+    }
+    video_ready_init = true;
   }
-  vita_h264_start();
-
+  chiaki_bool_pred_cond_lock(&video_ready);
+  video_ready.pred = false;
+  video_setup_ok = false;
+  chiaki_bool_pred_cond_unlock(&video_ready);
+  stream_video_ready = false;
+
+	if (context.config.trace)
+		chiaki_trace_start();
+	// the handshake and the decoder setup already benefit, the session quitting lowers it again
+	power_set_level(POWER_LEVEL_STREAM);
 	err = chiaki_session_start(&context.stream.session);
   if(err != CHIAKI_ERR_SUCCESS) {
 		LOGE("Error during stream start: %s", chiaki_error_string(err));
+    power_set_level(POWER_LEVEL_MENU);
+    close_capture();
+    close_recording();
+    return 1;
+  }
+  stream_input_started = false;
+  if (context.config.telemetry)
+    open_telemetry();
+  if (context.config.latency_probe)
+    latency_probe_start(context.config.latency_probe, context.config.latency_probe_button);
+  // no pings or replies to handle while streaming, CHIAKI_EVENT_QUIT resumes it
+  pause_discovery(true);
+
+  // the handshake and Senkusha don't need the decoder, so set it up meanwhile
+  int video_err = vita_h264_setup(profile.width, profile.height);
+  if (video_err == 0)
+    vita_h264_start();
+  chiaki_bool_pred_cond_lock(&video_ready);
+  video_setup_ok = video_err == 0;
+  chiaki_bool_pred_cond_unlock(&video_ready);
+  chiaki_bool_pred_cond_broadcast(&video_ready);
+  if (video_err != 0) {
+		LOGE("Error during video start: %d", video_err);
+    chiaki_session_stop(&context.stream.session);
     return 1;
   }
 
-	err = chiaki_thread_create(&context.stream.input_thread, input_thread_func, &context.stream);
+	// just below the decoders (64)
+	ChiakiThreadAttr input_attr = { "Vita Input", 96, 0, 0 };
+	if (context.config.thread_placement == THREAD_PLACEMENT_SPREAD)
+		input_attr.cpu_affinity_mask = SCE_KERNEL_CPU_MASK_USER_2;
+	err = chiaki_thread_create_attr(&context.stream.input_thread, input_thread_func, &context.stream, &input_attr);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		LOGE("Failed to create input thread");
 	}
+	else
+		stream_input_started = true;
   return 0;
 }
 
@@ -468,6 +960,20 @@ bool mac_addrs_match(MacAddr* a, MacAddr* b) {
   return true;
 }
 
+int context_host_index(MacAddr* mac, int types) {
+  for (int host_idx = 0; host_idx < MAX_NUM_HOSTS; host_idx++) {
+    VitaChiakiHost* h = context.hosts[host_idx];
+    if (h && (h->type & types) && mac_addrs_match(&(h->server_mac), mac))
+      return host_idx;
+  }
+  return -1;
+}
+
+void host_changed(VitaChiakiHost* host) {
+  host->revision++;
+  context.hosts_revision++;
+}
+
 /// Save a new manual host into the context, given existing registered host and new remote ip ("hostname")
 void save_manual_host(VitaChiakiHost* rhost, char* new_hostname) {
   if ((!rhost->server_mac)) {
@@ -563,6 +1069,8 @@ int count_nonnull_context_hosts() {
 
 void update_context_hosts() {
   bool hide_remote_if_discovered = true;
+  VitaChiakiHost* prev_hosts[MAX_NUM_HOSTS];
+  memcpy(prev_hosts, context.hosts, sizeof(prev_hosts));
 
   // Remove any no-longer-existent manual hosts
   for (int host_idx = 0; host_idx < MAX_NUM_HOSTS; host_idx++) {
@@ -663,6 +1171,8 @@ void update_context_hosts() {
 
   // Update num_hosts
   context.num_hosts = count_nonnull_context_hosts();
+  if (memcmp(prev_hosts, context.hosts, sizeof(prev_hosts)) != 0)
+    context.hosts_revision++;
 }
 
 int count_manual_hosts_of_console(VitaChiakiHost* host) {
@@ -707,6 +1217,7 @@ void copy_host(VitaChiakiHost* h_dest, VitaChiakiHost* h_src, bool copy_hostname
 
         // don't copy discovery state
         h_dest->discovery_state = NULL;
+        h_dest->revision = 0;
 }
 
 void copy_host_registered_state(ChiakiRegisteredHost* rstate_dest, ChiakiRegisteredHost* rstate_src) {
@@ -0,0 +1,162 @@
+#include "latency_probe.h"
+#include "context.h"
+
+#include <chiaki/thread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum latency_probe_phase_t {
+  PROBE_SETTLING,  // waiting for the region to be steady before the next press
+  PROBE_PRESSED,  // waiting for the response
+} LatencyProbePhase;
+
+static struct {
+  bool init;
+  volatile bool active;  // read without the mutex to skip the work while probing is off
+  ChiakiMutex mutex;
+  int x, y, width, height;
+  uint32_t button;
+  LatencyProbePhase phase;
+  int baseline;  // average luma of the region, fixed point with 4 fractional bits
+  bool baseline_valid;
+  uint32_t settled_frames;
+  uint64_t next_press_us;
+  uint64_t press_us;
+  uint32_t presses;
+  uint32_t timeouts;
+  uint32_t samples_count;
+  uint32_t samples_us[LATENCY_PROBE_SAMPLES_MAX];
+} probe;
+
+bool latency_probe_start(const char* region, uint32_t button) {
+  int x, y, width, height;
+  if (!region || sscanf(region, "%d,%d,%d,%d", &x, &y, &width, &height) != 4 ||
+      x < 0 || y < 0 || width <= 0 || height <= 0) {
+    LOGE("Latency probe region \"%s\" is not x,y,width,height", region ? region : "");
+    return false;
+  }
+  if (!probe.init) {
+    if (chiaki_mutex_init(&probe.mutex, false) != CHIAKI_ERR_SUCCESS)
+      return false;
+    probe.init = true;
+  }
+  chiaki_mutex_lock(&probe.mutex);
+  probe.x = x;
+  probe.y = y;
+  probe.width = width;
+  probe.height = height;
+  probe.button = button;
+  probe.phase = PROBE_SETTLING;
+  probe.baseline_valid = false;
+  probe.settled_frames = 0;
+  probe.next_press_us = 0;
+  probe.presses = 0;
+  probe.timeouts = 0;
+  probe.samples_count = 0;
+  probe.active = true;
+  chiaki_mutex_unlock(&probe.mutex);
+  LOGD("Latency probe pressing 0x%x, watching %dx%d at %d,%d", button, width, height, x, y);
+  return true;
+}
+
+static int compare_u32(const void* a, const void* b) {
+  uint32_t va = *(const uint32_t*)a, vb = *(const uint32_t*)b;
+  return va < vb ? -1 : va > vb;
+}
+
+void latency_probe_stop() {
+  if (!probe.init || !probe.active)
+    return;
+  chiaki_mutex_lock(&probe.mutex);
+  probe.active = false;
+  chiaki_mutex_unlock(&probe.mutex);
+
+  // nothing writes the samples anymore
+  uint32_t n = probe.samples_count;
+  if (!n) {
+    LOGD("Latency probe: no responses to %u presses", probe.presses);
+    return;
+  }
+  qsort(probe.samples_us, n, sizeof(probe.samples_us[0]), compare_u32);
+  uint64_t sum = 0;
+  for (uint32_t i = 0; i < n; i++)
+    sum += probe.samples_us[i];
+  LOGD("Latency probe, input to decoded picture of %u presses (%u missed): min %u p50 %u p95 %u max %u avg %llu us",
+       probe.presses, probe.timeouts, probe.samples_us[0], probe.samples_us[n / 2],
+       probe.samples_us[(n * 95) / 100 < n ? (n * 95) / 100 : n - 1], probe.samples_us[n - 1],
+       (unsigned long long)(sum / n));
+}
+
+void latency_probe_input(ChiakiControllerState* state, uint64_t now_us) {
+  if (!probe.active)
+    return;
+  chiaki_mutex_lock(&probe.mutex);
+  if (probe.phase == PROBE_SETTLING) {
+    if (probe.settled_frames >= LATENCY_PROBE_SETTLE_FRAMES && now_us >= probe.next_press_us) {
+      probe.phase = PROBE_PRESSED;
+      probe.press_us = now_us;
+      probe.presses++;
+    }
+  } else if (now_us - probe.press_us >= LATENCY_PROBE_TIMEOUT_MS * 1000ULL) {
+    probe.timeouts++;
+    probe.phase = PROBE_SETTLING;
+    probe.settled_frames = 0;
+    probe.next_press_us = now_us + LATENCY_PROBE_INTERVAL_MS * 1000ULL;
+  }
+  if (probe.phase == PROBE_PRESSED && now_us - probe.press_us < LATENCY_PROBE_PRESS_MS * 1000ULL)
+    state->buttons |= probe.button;
+  chiaki_mutex_unlock(&probe.mutex);
+}
+
+/// Average luma of the region, with 4 fractional bits, every 4th pixel of every 4th row is enough
+static int region_luma(const uint8_t* data, int pitch, bool yuv420, int x0, int y0, int x1, int y1) {
+  uint32_t sum = 0, count = 0;
+  for (int y = y0; y < y1; y += 4) {
+    const uint8_t* row = data + (size_t)y * pitch * (yuv420 ? 1 : 4);
+    for (int x = x0; x < x1; x += 4) {
+      if (yuv420) {
+        sum += row[x];
+      } else {
+        const uint8_t* px = row + x * 4;
+        sum += (px[0] + 2 * px[1] + px[2]) / 4;
+      }
+      count++;
+    }
+  }
+  return count ? (int)((sum << 4) / count) : 0;
+}
+
+void latency_probe_frame(const uint8_t* data, int pitch, bool yuv420, int width, int height, uint64_t now_us) {
+  if (!probe.active)
+    return;
+  int x1 = probe.x + probe.width < width ? probe.x + probe.width : width;
+  int y1 = probe.y + probe.height < height ? probe.y + probe.height : height;
+  if (probe.x >= x1 || probe.y >= y1)
+    return;
+  int luma = region_luma(data, pitch, yuv420, probe.x, probe.y, x1, y1);
+
+  chiaki_mutex_lock(&probe.mutex);
+  int diff = probe.baseline_valid ? abs(luma - probe.baseline) : 0;
+  if (probe.phase == PROBE_PRESSED) {
+    if (diff > LATENCY_PROBE_THRESHOLD << 4) {
+      if (probe.samples_count < LATENCY_PROBE_SAMPLES_MAX)
+        probe.samples_us[probe.samples_count++] = (uint32_t)(now_us - probe.press_us);
+      probe.phase = PROBE_SETTLING;
+      probe.settled_frames = 0;
+      probe.next_press_us = now_us + LATENCY_PROBE_INTERVAL_MS * 1000ULL;
+      probe.baseline = luma;
+    }
+  } else {
+    // the region has to stay close to its average for a while, so changes of its own are not taken for responses
+    if (!probe.baseline_valid || diff > (LATENCY_PROBE_THRESHOLD << 4) / 2) {
+      probe.baseline = luma;
+      probe.baseline_valid = true;
+      probe.settled_frames = 0;
+    } else {
+      probe.baseline += (luma - probe.baseline) / 4;
+      probe.settled_frames++;
+    }
+  }
+  chiaki_mutex_unlock(&probe.mutex);
+}
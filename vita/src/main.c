@@ -45,14 +45,12 @@
 
 #include "context.h"
 #include "discovery.h"
+#include "power.h"
 #include "ui.h"
 
 static int vita_init() {
-  // Overclock various aspects of the vita
-  scePowerSetArmClockFrequency(444);
-  scePowerSetGpuClockFrequency(222);
-  scePowerSetBusClockFrequency(222);
-  scePowerSetGpuXbarClockFrequency(166);
+  // menus run at reduced clocks, host_stream() raises them to the maximum for the session
+  power_init();
   // Seed OpenSSL
   char random_seed[0x40] = {0};
   sceKernelGetRandomNumber(random_seed, sizeof(random_seed));
@@ -74,7 +72,7 @@ static int vita_init() {
   }
 
   SceNetInitParam param;
-  // TODO: this is probably way too large
+  // the socket buffers come out of this, the stream's receive buffer alone up to CHIAKI_SESSION_RECV_BUFFER_MAX
   static char memory[4 * 1024 * 1024];
   param.memory = memory;
   param.size = sizeof(memory);
@@ -132,12 +130,15 @@ unsigned int _newlib_heap_size_user = 64 * 1024 * 1024;
 int main(int argc, char* argv[]) {
   vita_init();
 
-  // Note: Power management is configured in vita_init() (scePowerSet* calls)
+  // Note: Clocks are managed by the governor in power.c, set up in vita_init()
   // Note: Input thread is created per-stream in host.c when streaming starts
 
   sceIoMkdir("ux0:/data/vita-chiaki", 0777);
 
+  // config, hosts and discovery are set up while the assets load
+  ui_start_loading();
   vita_chiaki_init_context();
+  host_crypto_warmup();
   if (context.config.auto_discovery) {
     LOGD("Starting discovery");
     ChiakiErrorCode err = start_discovery(NULL, NULL);
@@ -149,8 +150,17 @@ int main(int argc, char* argv[]) {
 
   LOGD("Starting to draw UI");
   draw_ui();
+  config_flush();
 
   // TODO: Cleanup
+  if (context.log_ring_init) {
+    chiaki_log_set_ring(&context.log, NULL);
+    chiaki_log_set_ring(&context.app_log, NULL);
+    chiaki_log_ring_fini(&context.log_ring);
+  }
+  if (context.flog) {
+    file_log_destroy(context.flog);
+  }
   if (context.mlog) {
     free(context.mlog);
   }
@@ -0,0 +1,228 @@
+#include "mem_layout.h"
+
+#include <psp2/kernel/modulemgr.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEM_LAYOUT_MAGIC 0x4c4d4b56  // "VKML"
+#define MEM_LAYOUT_VERSION 1
+
+typedef struct mem_layout_file_t {
+  uint32_t magic;
+  uint32_t version;
+  // the fastest placement depends on the memory controllers and the firmware's decoder
+  int32_t model;
+  uint32_t fw_version;
+  uint8_t placement[VIDEO_BUFFER_COUNT];
+} MemLayoutFile;
+
+const char* mem_placement_name(VitaChiakiMemPlacement placement) {
+  switch (placement) {
+    case MEM_PLACEMENT_CDRAM:
+      return "cdram";
+    case MEM_PLACEMENT_PHYCONT:
+      return "phycont";
+    case MEM_PLACEMENT_MAIN:
+      return "main";
+    case MEM_PLACEMENT_AUTO:
+    default:
+      return "auto";
+  }
+}
+
+SceKernelMemBlockType mem_placement_memblock_type(VitaChiakiMemPlacement placement) {
+  switch (placement) {
+    case MEM_PLACEMENT_PHYCONT:
+      return SCE_KERNEL_MEMBLOCK_TYPE_USER_MAIN_PHYCONT_NC_RW;
+    case MEM_PLACEMENT_MAIN:
+      return SCE_KERNEL_MEMBLOCK_TYPE_USER_RW_UNCACHE;
+    case MEM_PLACEMENT_CDRAM:
+    default:
+      return SCE_KERNEL_MEMBLOCK_TYPE_USER_CDRAM_RW;
+  }
+}
+
+SceSize mem_placement_granularity(VitaChiakiMemPlacement placement) {
+  switch (placement) {
+    case MEM_PLACEMENT_PHYCONT:
+      return 1024 * 1024;
+    case MEM_PLACEMENT_MAIN:
+      return 4 * 1024;
+    case MEM_PLACEMENT_CDRAM:
+    default:
+      return 256 * 1024;
+  }
+}
+
+static void mem_layout_device(MemLayoutFile* file) {
+  file->model = sceKernelGetModel();
+  SceKernelFwInfo fw;
+  memset(&fw, 0, sizeof(fw));
+  fw.size = sizeof(fw);
+  file->fw_version = sceKernelGetSystemSwVersion(&fw) < 0 ? 0 : fw.version;
+}
+
+bool mem_layout_load(VitaMemLayout* layout) {
+  size_t size;
+  char* data = config_read_file(MEM_LAYOUT_FILENAME, &size);
+  if (!data)
+    return false;
+  MemLayoutFile file, device;
+  bool ok = size == sizeof(file);
+  if (ok) {
+    memcpy(&file, data, sizeof(file));
+    mem_layout_device(&device);
+    ok = file.magic == MEM_LAYOUT_MAGIC && file.version == MEM_LAYOUT_VERSION
+      && file.model == device.model && file.fw_version == device.fw_version;
+  }
+  for (size_t i = 0; ok && i < VIDEO_BUFFER_COUNT; i++) {
+    if (file.placement[i] == MEM_PLACEMENT_AUTO || file.placement[i] >= MEM_PLACEMENT_COUNT)
+      ok = false;
+    else
+      layout->placement[i] = (VitaChiakiMemPlacement)file.placement[i];
+  }
+  free(data);
+  return ok;
+}
+
+bool mem_layout_save(const VitaMemLayout* layout) {
+  MemLayoutFile file;
+  memset(&file, 0, sizeof(file));
+  file.magic = MEM_LAYOUT_MAGIC;
+  file.version = MEM_LAYOUT_VERSION;
+  mem_layout_device(&file);
+  for (size_t i = 0; i < VIDEO_BUFFER_COUNT; i++)
+    file.placement[i] = (uint8_t)layout->placement[i];
+  return config_write_file_atomic(MEM_LAYOUT_FILENAME, &file, sizeof(file));
+}
+
+// Writes NAL units with emulation prevention
+typedef struct bit_writer_t {
+  uint8_t* buf;
+  size_t size;
+  size_t pos;
+  uint32_t cur;
+  int bits;
+  int zeros;
+  bool overflow;
+} BitWriter;
+
+static void bw_emit(BitWriter* bw, uint8_t byte) {
+  if (bw->pos >= bw->size) {
+    bw->overflow = true;
+    return;
+  }
+  bw->buf[bw->pos++] = byte;
+}
+
+static void bw_byte(BitWriter* bw, uint8_t byte) {
+  if (bw->zeros >= 2 && byte <= 3) {
+    bw_emit(bw, 3);
+    bw->zeros = 0;
+  }
+  bw_emit(bw, byte);
+  bw->zeros = byte ? 0 : bw->zeros + 1;
+}
+
+static void bw_bits(BitWriter* bw, uint32_t value, int count) {
+  for (int i = count - 1; i >= 0; i--) {
+    bw->cur = (bw->cur << 1) | ((value >> i) & 1);
+    if (++bw->bits == 8) {
+      bw_byte(bw, (uint8_t)bw->cur);
+      bw->cur = 0;
+      bw->bits = 0;
+    }
+  }
+}
+
+static void bw_ue(BitWriter* bw, uint32_t value) {
+  uint32_t v = value + 1;
+  int len = 0;
+  while (v >> len)
+    len++;
+  bw_bits(bw, 0, len - 1);
+  bw_bits(bw, v, len);
+}
+
+static void bw_se(BitWriter* bw, int32_t value) {
+  bw_ue(bw, value > 0 ? (uint32_t)value * 2 - 1 : (uint32_t)-value * 2);
+}
+
+static void bw_nal_start(BitWriter* bw, uint8_t ref_idc, uint8_t type) {
+  static const uint8_t start_code[] = { 0, 0, 0, 1 };
+  for (size_t i = 0; i < sizeof(start_code); i++)
+    bw_emit(bw, start_code[i]);
+  bw_emit(bw, (uint8_t)(ref_idc << 5 | type));
+  bw->zeros = 0;
+}
+
+static void bw_rbsp_trailing(BitWriter* bw) {
+  bw_bits(bw, 1, 1);
+  while (bw->bits)
+    bw_bits(bw, 0, 1);
+}
+
+size_t mem_layout_bench_au(uint8_t* buf, size_t size, unsigned int width_mbs, unsigned int height_mbs, unsigned int frame) {
+  BitWriter bw = { .buf = buf, .size = size };
+  if (frame == 0) {
+    // constrained baseline, level 3.1, poc type 2 so frames are output in decode order
+    bw_nal_start(&bw, 3, 7);
+    bw_bits(&bw, 66, 8);
+    bw_bits(&bw, 0xc0, 8);
+    bw_bits(&bw, 31, 8);
+    bw_ue(&bw, 0);  // sps id
+    bw_ue(&bw, 0);  // log2_max_frame_num - 4
+    bw_ue(&bw, 2);  // pic_order_cnt_type
+    bw_ue(&bw, 1);  // max_num_ref_frames
+    bw_bits(&bw, 0, 1);
+    bw_ue(&bw, width_mbs - 1);
+    bw_ue(&bw, height_mbs - 1);
+    bw_bits(&bw, 1, 1);  // frame_mbs_only
+    bw_bits(&bw, 1, 1);  // direct_8x8_inference
+    bw_bits(&bw, 0, 2);  // no cropping, no vui
+    bw_rbsp_trailing(&bw);
+
+    bw_nal_start(&bw, 3, 8);
+    bw_ue(&bw, 0);  // pps id
+    bw_ue(&bw, 0);  // sps id
+    bw_bits(&bw, 0, 2);  // cavlc, no field order
+    bw_ue(&bw, 0);  // one slice group
+    bw_ue(&bw, 0);  // num_ref_idx_l0_default - 1
+    bw_ue(&bw, 0);
+    bw_bits(&bw, 0, 3);  // no weighted prediction
+    bw_se(&bw, 0);  // pic_init_qp - 26
+    bw_se(&bw, 0);
+    bw_se(&bw, 0);  // chroma_qp_index_offset
+    bw_bits(&bw, 1, 1);  // deblocking_filter_control_present
+    bw_bits(&bw, 0, 2);
+    bw_rbsp_trailing(&bw);
+
+    bw_nal_start(&bw, 3, 5);
+    bw_ue(&bw, 0);  // first_mb_in_slice
+    bw_ue(&bw, 7);  // I, all slices
+    bw_ue(&bw, 0);
+    bw_bits(&bw, 0, 4);  // frame_num
+    bw_ue(&bw, 0);  // idr_pic_id
+    bw_bits(&bw, 0, 2);  // dec_ref_pic_marking
+    bw_se(&bw, 0);  // slice_qp_delta
+    bw_ue(&bw, 1);  // deblocking off
+    // I_16x16 with DC prediction and nothing coded, which is mid grey without neighbours:
+    // mb_type 3, intra_chroma_pred_mode 0, mb_qp_delta 0, no luma DC coefficients
+    for (unsigned int i = 0; i < width_mbs * height_mbs; i++)
+      bw_bits(&bw, 0x27, 8);
+    bw_rbsp_trailing(&bw);
+  } else {
+    bw_nal_start(&bw, 2, 1);
+    bw_ue(&bw, 0);
+    bw_ue(&bw, 5);  // P, all slices
+    bw_ue(&bw, 0);
+    bw_bits(&bw, frame & 0xf, 4);
+    bw_bits(&bw, 0, 3);  // no ref idx override, no list modification, sliding window
+    bw_se(&bw, 0);
+    bw_ue(&bw, 1);
+    // every macroblock copies the reference, which is what moves the most memory per bit
+    bw_ue(&bw, width_mbs * height_mbs);
+    bw_rbsp_trailing(&bw);
+  }
+  return bw.overflow ? 0 : bw.pos;
+}
@@ -1,53 +1,85 @@
+#include <psp2/kernel/processmgr.h>
+
 #include "message_log.h"
 
 VitaChiakiMessageLog* message_log_create() {
-  VitaChiakiMessageLog* ml = (VitaChiakiMessageLog*)malloc(sizeof(VitaChiakiMessageLog));
-  ml->start_offset = 0; // offset of first line
-  ml->lines = 0; // total lines
-  ml->last_update = 0; // update time
-
-  // create an extra blank line at the end
-  ml->log[MLOG_LINES][0] = 0;
+  VitaChiakiMessageLog* ml = (VitaChiakiMessageLog*)calloc(1, sizeof(VitaChiakiMessageLog));
   return ml;
 }
 
+/// Length of the next line of text, which ends at a newline or MLOG_LINE_LEN chars
+static size_t next_line_len(const char* text, size_t len) {
+  size_t n = len < MLOG_LINE_LEN ? len : MLOG_LINE_LEN;
+  const char* nl = memchr(text, '\n', n);
+  return nl ? (size_t)(nl - text) : n;
+}
+
 void write_message_log(VitaChiakiMessageLog* ml, const char* text) {
   size_t text_len = strlen(text);
   if (text_len == 0) return;
 
-  int text_lines = 1 + (text_len-1) / MLOG_LINE_LEN;
-  int start_line = text_lines > MLOG_LINES ? (text_lines - MLOG_LINES) : 0;
-  int offset = 0;
-  for (int j = start_line; j < text_lines; j++) {
-    int n = MLOG_LINE_LEN;
-    if (j == text_lines-1) { // on the last line
-        n = ((text_len-1) % MLOG_LINE_LEN)+1;
-    }
-
-    int line_offset = ml->lines; // if not yet wrapped
-    if (ml->lines >= MLOG_LINES) {
-      line_offset = ml->start_offset;
-      ml->start_offset = (ml->start_offset + 1) % MLOG_LINES;
-    }
-
-    memcpy(ml->log[line_offset], text + offset, n);
-    ml->log[line_offset][n+1] = 0; // add null char
-    ml->lines++;
-    if (ml->lines > MLOG_LINES) ml->lines = MLOG_LINES;
-    offset += MLOG_LINE_LEN;
+  // count what to reserve, newlines end a line and are not stored
+  uint32_t n_lines = 0, n_bytes = 0;
+  for (size_t pos = 0; pos < text_len;) {
+    size_t n = next_line_len(text + pos, text_len - pos);
+    pos += n;
+    if (pos < text_len && text[pos] == '\n') pos++;
+    n_lines++;
+    n_bytes += n;
+  }
+  // older lines of a huge message would be overwritten by its own newer ones anyway
+  if (n_lines > MLOG_LINES) return;
+
+  uint64_t head = __atomic_fetch_add(&ml->head, ((uint64_t)n_lines << 32) | n_bytes, __ATOMIC_ACQ_REL);
+  uint32_t line = (uint32_t)(head >> 32);
+  uint32_t offset = (uint32_t)head;
+
+  for (size_t pos = 0; pos < text_len; line++) {
+    size_t n = next_line_len(text + pos, text_len - pos);
+    VitaChiakiMessageLogLine* l = &ml->lines[line % MLOG_LINES];
+    // invalidate the slot first, so readers don't take new text for the line it held before
+    __atomic_store_n(&l->seq, 0, __ATOMIC_RELEASE);
+    size_t start = offset % MLOG_BUF_SIZE;
+    size_t first = n < MLOG_BUF_SIZE - start ? n : MLOG_BUF_SIZE - start;
+    memcpy(ml->buf + start, text + pos, first);
+    memcpy(ml->buf, text + pos + first, n - first);
+    l->offset = offset;
+    l->len = n;
+    __atomic_store_n(&l->seq, line + 1, __ATOMIC_RELEASE);
 
+    offset += n;
+    pos += n;
+    if (pos < text_len && text[pos] == '\n') pos++;
   }
-  ml->last_update = sceKernelGetProcessTimeWide();
+  __atomic_store_n(&ml->last_update, sceKernelGetProcessTimeWide(), __ATOMIC_RELAXED);
 }
 
-char* get_message_log_line(VitaChiakiMessageLog* ml, size_t line) {
-    if (ml->lines == 0) return ml->log[MLOG_LINES];
-
-    int line_offset = (ml->start_offset + line) % MLOG_LINES;
+void message_log_range(VitaChiakiMessageLog* ml, uint32_t* first, uint32_t* count) {
+  uint32_t lines = (uint32_t)(__atomic_load_n(&ml->head, __ATOMIC_ACQUIRE) >> 32);
+  *count = lines < MLOG_LINES ? lines : MLOG_LINES;
+  *first = lines - *count;
+}
 
-    if (line_offset < 0) line_offset = MLOG_LINES;
-    if (line_offset >= ml->lines) line_offset = MLOG_LINES;
-    if (line_offset >= MLOG_LINES) line_offset = MLOG_LINES;
+bool get_message_log_line(VitaChiakiMessageLog* ml, uint32_t line, char* buf, size_t buf_size) {
+  buf[0] = 0;
+  VitaChiakiMessageLogLine* l = &ml->lines[line % MLOG_LINES];
+  if (__atomic_load_n(&l->seq, __ATOMIC_ACQUIRE) != line + 1) return false;
+  uint32_t offset = l->offset;
+  size_t n = l->len;
+  if (n > buf_size - 1) n = buf_size - 1;
+  size_t start = offset % MLOG_BUF_SIZE;
+  size_t first = n < MLOG_BUF_SIZE - start ? n : MLOG_BUF_SIZE - start;
+  memcpy(buf, ml->buf + start, first);
+  memcpy(buf + first, ml->buf, n - first);
+  buf[n] = 0;
 
-    return ml->log[line_offset];
+  // a writer that reserved the slot or the bytes since may have changed them while copying
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  uint64_t head = __atomic_load_n(&ml->head, __ATOMIC_RELAXED);
+  if ((uint32_t)(head >> 32) - line > MLOG_LINES || (uint32_t)head - offset > MLOG_BUF_SIZE ||
+      __atomic_load_n(&l->seq, __ATOMIC_RELAXED) != line + 1) {
+    buf[0] = 0;
+    return false;
+  }
+  return true;
 }
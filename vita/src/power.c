@@ -0,0 +1,108 @@
+#include "power.h"
+#include "context.h"
+
+#include <chiaki/thread.h>
+#include <psp2/power.h>
+#include <string.h>
+
+typedef struct power_clocks_t {
+  const char* name;
+  int arm;
+  int bus;
+  int gpu;
+  int gpu_xbar;
+} PowerClocks;
+
+static const PowerClocks power_clocks[POWER_LEVEL_COUNT] = {
+  [POWER_LEVEL_MENU] = { "menu", 333, 166, 111, 111 },
+  [POWER_LEVEL_STREAM] = { "stream", 444, 222, 222, 166 },
+  // the decoder still needs the memory bandwidth of the full bus clock
+  [POWER_LEVEL_STREAM_DIRECT] = { "stream direct", 444, 222, 111, 111 },
+};
+
+typedef struct power_decode_stats_t {
+  uint32_t frames;
+  uint64_t decode_us_sum;
+  uint32_t decode_us_max;
+} PowerDecodeStats;
+
+static struct {
+  bool init;
+  ChiakiMutex mutex;
+  VitaPowerLevel level;
+  PowerDecodeStats decode[POWER_LEVEL_COUNT];
+} power;
+
+static void power_apply(VitaPowerLevel level) {
+  const PowerClocks* clocks = &power_clocks[level];
+  scePowerSetArmClockFrequency(clocks->arm);
+  scePowerSetBusClockFrequency(clocks->bus);
+  scePowerSetGpuClockFrequency(clocks->gpu);
+  scePowerSetGpuXbarClockFrequency(clocks->gpu_xbar);
+  LOGD("Power level %s: cpu %d, bus %d, gpu %d, xbar %d MHz", clocks->name,
+       scePowerGetArmClockFrequency(), scePowerGetBusClockFrequency(),
+       scePowerGetGpuClockFrequency(), scePowerGetGpuXbarClockFrequency());
+}
+
+void power_init() {
+  if (chiaki_mutex_init(&power.mutex, false) != CHIAKI_ERR_SUCCESS) {
+    // without the governor, stay at the maximum
+    power_apply(POWER_LEVEL_STREAM);
+    return;
+  }
+  power.init = true;
+  power.level = POWER_LEVEL_MENU;
+  memset(power.decode, 0, sizeof(power.decode));
+  power_apply(power.level);
+}
+
+void power_set_level(VitaPowerLevel level) {
+  if (!power.init)
+    return;
+  chiaki_mutex_lock(&power.mutex);
+  if (level != power.level) {
+    power.level = level;
+    power_apply(level);
+  }
+  chiaki_mutex_unlock(&power.mutex);
+}
+
+VitaPowerLevel power_level() {
+  if (!power.init)
+    return POWER_LEVEL_STREAM;
+  chiaki_mutex_lock(&power.mutex);
+  VitaPowerLevel level = power.level;
+  chiaki_mutex_unlock(&power.mutex);
+  return level;
+}
+
+void power_decode_sample(uint32_t decode_us) {
+  if (!power.init)
+    return;
+  chiaki_mutex_lock(&power.mutex);
+  PowerDecodeStats* stats = &power.decode[power.level];
+  stats->frames++;
+  stats->decode_us_sum += decode_us;
+  if (decode_us > stats->decode_us_max)
+    stats->decode_us_max = decode_us;
+  chiaki_mutex_unlock(&power.mutex);
+}
+
+void power_log_decode_headroom(uint32_t frame_us) {
+  if (!power.init || !frame_us)
+    return;
+  PowerDecodeStats decode[POWER_LEVEL_COUNT];
+  chiaki_mutex_lock(&power.mutex);
+  memcpy(decode, power.decode, sizeof(decode));
+  memset(power.decode, 0, sizeof(power.decode));
+  chiaki_mutex_unlock(&power.mutex);
+  for (int i = 0; i < POWER_LEVEL_COUNT; i++) {
+    PowerDecodeStats* stats = &decode[i];
+    if (!stats->frames)
+      continue;
+    uint32_t avg_us = (uint32_t)(stats->decode_us_sum / stats->frames);
+    LOGD("Power level %s: %u frames decoded in %u us avg, %u us max, %d%% headroom at %u us per frame",
+         power_clocks[i].name, stats->frames, avg_us, stats->decode_us_max,
+         (int)(((int64_t)frame_us - avg_us) * 100 / frame_us), frame_us);
+  }
+}
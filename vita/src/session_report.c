@@ -0,0 +1,182 @@
+#include "session_report.h"
+#include "audio.h"
+#include "config.h"
+#include "context.h"
+#include "video.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SESSION_REPORTS_MAGIC 0x52534b56  // "VKSR"
+#define SESSION_REPORTS_VERSION 1
+#define SESSION_REPORTS_MAX (MAX_NUM_HOSTS * SESSION_REPORTS_PER_HOST)
+
+typedef struct session_reports_header_t {
+  uint32_t magic;
+  uint32_t version;
+  // the reports are copied as they are, so layout changes start a new history
+  uint32_t report_size;
+  uint32_t count;
+} SessionReportsHeader;
+
+static uint32_t clamp_u32(uint64_t v) {
+  return v > UINT32_MAX ? UINT32_MAX : (uint32_t)v;
+}
+
+void session_report_collect(VitaSessionReport* report, ChiakiSession* session, uint8_t* server_mac,
+                            uint64_t start_time, uint64_t duration_ms, ChiakiQuitReason quit_reason) {
+  memset(report, 0, sizeof(*report));
+  memcpy(report->server_mac, server_mac, sizeof(report->server_mac));
+  report->latency_mode = (uint8_t)context.config.latency_mode;
+  report->quit_reason = (uint8_t)quit_reason;
+  report->start_time = start_time;
+  report->duration_ms = clamp_u32(duration_ms);
+
+  ChiakiConnectVideoProfile* profile = &session->connect_info.video_profile;
+  report->width = (uint16_t)profile->width;
+  report->height = (uint16_t)profile->height;
+  report->fps = (uint16_t)profile->max_fps;
+  report->fps_achieved = (uint16_t)vita_h264_fps_achieved();
+  report->bitrate = profile->bitrate;
+
+  ChiakiVideoStatsCounters video;
+  chiaki_session_get_video_stats(session, &video);
+  report->frames = clamp_u32(video.frames);
+  report->frames_failed = clamp_u32(video.frames_failed);
+  report->frames_fec_recovered = clamp_u32(video.frames_fec_recovered);
+  report->ref_frame_misses = clamp_u32(video.ref_frame_misses);
+
+  ChiakiStreamStatsSnapshot stream;
+  chiaki_session_get_stream_stats(session, &stream);
+  if (duration_ms)
+    report->bitrate_measured = clamp_u32(stream.bytes * 8 / duration_ms);
+  ChiakiStreamStatsSizes* i_frames = &stream.sizes[CHIAKI_BITSTREAM_SLICE_I];
+  if (i_frames->frames)
+    report->i_frame_bytes_avg = clamp_u32(i_frames->bytes / i_frames->frames);
+  report->burst_bytes_max = clamp_u32(stream.burst_bytes_max);
+
+  ChiakiLatencyReport latency;
+  chiaki_session_get_latency_stats(session, &latency);
+  ChiakiLatencyStageStats* total = &latency.stages[CHIAKI_LATENCY_STAGE_TOTAL];
+  report->latency_avg_us = clamp_u32(total->avg_us);
+  report->latency_p95_us = clamp_u32(total->p95_us);
+  report->latency_p99_us = clamp_u32(total->p99_us);
+  report->decode_p95_us = clamp_u32(latency.stages[CHIAKI_LATENCY_STAGE_DECODE].p95_us);
+
+  ChiakiPacketStatsSnapshot packets;
+  chiaki_session_get_packet_stats_snapshot(session, &packets);
+  uint64_t packets_total = packets.total.received + packets.total.lost;
+  report->loss_permille = packets_total ? (uint32_t)(packets.total.lost * 1000 / packets_total) : 0;
+  ChiakiJitterStats jitter;
+  chiaki_session_get_jitter_stats(session, &jitter);
+  report->jitter_video_us = clamp_u32(jitter.streams[CHIAKI_JITTER_STREAM_VIDEO].jitter_us);
+  report->jitter_audio_us = clamp_u32(jitter.streams[CHIAKI_JITTER_STREAM_AUDIO].jitter_us);
+
+  VitaAudioStats audio;
+  vita_audio_get_stats(&audio);
+  report->audio_underruns = audio.underruns;
+  report->audio_overruns = audio.overruns;
+
+  report->rtt_us = clamp_u32(session->rtt_us);
+  report->mtu_in = (uint16_t)session->mtu_in;
+  report->mtu_out = (uint16_t)session->mtu_out;
+  report->path_probed = session->path_probed;
+}
+
+// All reports in the file, oldest first, or none if it is missing or from another version
+static VitaSessionReport* load_all(size_t* count) {
+  *count = 0;
+  size_t size;
+  char* data = config_read_file(SESSION_REPORTS_FILENAME, &size);
+  if (!data)
+    return NULL;
+  SessionReportsHeader header;
+  if (size < sizeof(header))
+    goto invalid;
+  memcpy(&header, data, sizeof(header));
+  if (header.magic != SESSION_REPORTS_MAGIC || header.version != SESSION_REPORTS_VERSION ||
+      header.report_size != sizeof(VitaSessionReport) || header.count > SESSION_REPORTS_MAX ||
+      size != sizeof(header) + header.count * sizeof(VitaSessionReport))
+    goto invalid;
+  VitaSessionReport* reports = malloc(SESSION_REPORTS_MAX * sizeof(VitaSessionReport));
+  if (!reports)
+    goto invalid;
+  memcpy(reports, data + sizeof(header), header.count * sizeof(VitaSessionReport));
+  free(data);
+  *count = header.count;
+  return reports;
+invalid:
+  free(data);
+  return NULL;
+}
+
+bool session_report_save(const VitaSessionReport* report) {
+  size_t count;
+  VitaSessionReport* reports = load_all(&count);
+  if (!reports) {
+    reports = malloc(SESSION_REPORTS_MAX * sizeof(VitaSessionReport));
+    if (!reports)
+      return false;
+  }
+
+  size_t host_count = 0;
+  size_t host_oldest = count;
+  for (size_t i = 0; i < count; i++) {
+    if (memcmp(reports[i].server_mac, report->server_mac, sizeof(report->server_mac)) != 0)
+      continue;
+    if (!host_count)
+      host_oldest = i;
+    host_count++;
+  }
+  // make room for the new one, from the same console if it has a full history, otherwise from any
+  size_t drop = host_count >= SESSION_REPORTS_PER_HOST ? host_oldest : count == SESSION_REPORTS_MAX ? 0 : count;
+  if (drop < count) {
+    memmove(&reports[drop], &reports[drop + 1], (count - drop - 1) * sizeof(VitaSessionReport));
+    count--;
+  }
+  reports[count++] = *report;
+
+  SessionReportsHeader header = {
+    .magic = SESSION_REPORTS_MAGIC,
+    .version = SESSION_REPORTS_VERSION,
+    .report_size = sizeof(VitaSessionReport),
+    .count = (uint32_t)count,
+  };
+  size_t size = sizeof(header) + count * sizeof(VitaSessionReport);
+  char* data = malloc(size);
+  bool ok = false;
+  if (data) {
+    memcpy(data, &header, sizeof(header));
+    memcpy(data + sizeof(header), reports, count * sizeof(VitaSessionReport));
+    ok = config_write_file_atomic(SESSION_REPORTS_FILENAME, data, size);
+    free(data);
+  }
+  free(reports);
+  return ok;
+}
+
+size_t session_reports_load(const uint8_t* server_mac, VitaSessionReport* reports, size_t max) {
+  size_t count;
+  VitaSessionReport* all = load_all(&count);
+  if (!all)
+    return 0;
+  // only the newest max of them
+  size_t skip = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (memcmp(all[i].server_mac, server_mac, sizeof(all[i].server_mac)) == 0)
+      skip++;
+  }
+  skip = skip > max ? skip - max : 0;
+  size_t found = 0;
+  for (size_t i = 0; i < count && found < max; i++) {
+    if (memcmp(all[i].server_mac, server_mac, sizeof(all[i].server_mac)) != 0)
+      continue;
+    if (skip) {
+      skip--;
+      continue;
+    }
+    reports[found++] = all[i];
+  }
+  free(all);
+  return found;
+}
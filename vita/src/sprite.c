@@ -0,0 +1,85 @@
+#include <math.h>
+#include <string.h>
+#include <vita2d.h>
+
+#include "sprite.h"
+
+static vita2d_texture* atlas = NULL;
+static const int sprite_rects[UI_SPRITE_COUNT][4] = UI_ATLAS_RECTS;
+static vita2d_texture_vertex batch[SPRITE_BATCH_MAX * 6];
+static size_t batch_count = 0;  // vertices
+static uint32_t batch_tint = SPRITE_TINT_NONE;
+
+vita2d_texture* sprite_atlas_load(const char* path) {
+  return vita2d_load_PNG_file(path);
+}
+
+void sprite_atlas_set(vita2d_texture* texture) {
+  atlas = texture;
+}
+
+int sprite_width(UISprite sprite) {
+  return sprite_rects[sprite][2];
+}
+
+int sprite_height(UISprite sprite) {
+  return sprite_rects[sprite][3];
+}
+
+void sprite_flush() {
+  if (!batch_count) return;
+  // the GPU reads the vertices when the scene is done, so they have to live in the frame's pool
+  vita2d_texture_vertex* v = vita2d_pool_memalign(batch_count * sizeof(vita2d_texture_vertex), sizeof(vita2d_texture_vertex));
+  if (v) {
+    memcpy(v, batch, batch_count * sizeof(vita2d_texture_vertex));
+    vita2d_draw_array_textured(atlas, SCE_GXM_PRIMITIVE_TRIANGLES, v, batch_count, batch_tint);
+  }
+  batch_count = 0;
+}
+
+/// Queue the quad with the corners (x[i], y[i]) in the order top-left, top-right, bottom-left, bottom-right
+static void sprite_queue(UISprite sprite, const float x[4], const float y[4], uint32_t tint) {
+  if (!atlas) return;
+  if (tint != batch_tint || batch_count == SPRITE_BATCH_MAX * 6) {
+    sprite_flush();
+    batch_tint = tint;
+  }
+
+  const int* r = sprite_rects[sprite];
+  float tex_w = vita2d_texture_get_width(atlas);
+  float tex_h = vita2d_texture_get_height(atlas);
+  float u0 = r[0] / tex_w, u1 = (r[0] + r[2]) / tex_w;
+  float v0 = r[1] / tex_h, v1 = (r[1] + r[3]) / tex_h;
+  const float u[4] = { u0, u1, u0, u1 };
+  const float v[4] = { v0, v0, v1, v1 };
+  static const int order[6] = { 0, 1, 2, 2, 1, 3 };
+  for (int i = 0; i < 6; i++) {
+    int c = order[i];
+    batch[batch_count++] = (vita2d_texture_vertex){ x[c], y[c], 0.5f, u[c], v[c] };
+  }
+}
+
+void sprite_draw(UISprite sprite, float x, float y, float scale_x, float scale_y, uint32_t tint) {
+  float w = sprite_rects[sprite][2] * scale_x;
+  float h = sprite_rects[sprite][3] * scale_y;
+  const float xs[4] = { x, x + w, x, x + w };
+  const float ys[4] = { y, y, y + h, y + h };
+  sprite_queue(sprite, xs, ys, tint);
+}
+
+void sprite_draw_rotate(UISprite sprite, float x, float y, float scale, float rad, uint32_t tint) {
+  sprite_draw_transform(sprite, x, y, scale, cosf(rad), sinf(rad), tint);
+}
+
+void sprite_draw_transform(UISprite sprite, float x, float y, float scale, float c, float s, uint32_t tint) {
+  float hw = sprite_rects[sprite][2] * scale / 2;
+  float hh = sprite_rects[sprite][3] * scale / 2;
+  const float dx[4] = { -hw, hw, -hw, hw };
+  const float dy[4] = { -hh, -hh, hh, hh };
+  float xs[4], ys[4];
+  for (int i = 0; i < 4; i++) {
+    xs[i] = x + dx[i] * c - dy[i] * s;
+    ys[i] = y + dx[i] * s + dy[i] * c;
+  }
+  sprite_queue(sprite, xs, ys, tint);
+}
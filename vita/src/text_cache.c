@@ -0,0 +1,182 @@
+#include <string.h>
+#include <vita2d.h>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#include "text_cache.h"
+
+typedef struct {
+  uint32_t hash;
+  unsigned int size;
+  char text[TEXT_CACHE_MAX_LEN + 1];
+  int x, y, w, h;  // area in the texture
+  int left, top;  // offset of the area from the pen position at the first baseline
+  int width;  // as returned by vita2d_font_text_width()
+} TextCacheEntry;
+
+static FT_Library ft_library;
+static FT_Face ft_face;
+static vita2d_texture* texture = NULL;
+static TextCacheEntry entries[TEXT_CACHE_ENTRIES];
+static int entry_count = 0;
+static int shelf_x = 0, shelf_y = 0, shelf_h = 0;
+static bool full = false;
+
+extern vita2d_font* font;
+
+bool text_cache_init(const char* font_path) {
+  if (FT_Init_FreeType(&ft_library)) return false;
+  if (FT_New_Face(ft_library, font_path, 0, &ft_face)) {
+    FT_Done_FreeType(ft_library);
+    return false;
+  }
+  texture = vita2d_create_empty_texture_format(TEXT_CACHE_WIDTH, TEXT_CACHE_HEIGHT, SCE_GXM_TEXTURE_FORMAT_U8_R111);
+  if (!texture) {
+    FT_Done_Face(ft_face);
+    FT_Done_FreeType(ft_library);
+    return false;
+  }
+  return true;
+}
+
+void text_cache_next_frame() {
+  if (!full) return;
+  // the GPU may still read the previous frames' text from the texture
+  vita2d_wait_rendering_done();
+  entry_count = 0;
+  shelf_x = shelf_y = shelf_h = 0;
+  full = false;
+}
+
+static uint32_t hash_text(unsigned int size, const char* text) {
+  uint32_t h = 2166136261u ^ size;
+  for (; *text; text++) h = (h ^ (uint8_t)*text) * 16777619u;
+  return h;
+}
+
+/// Decode one UTF-8 code point and advance *s past it
+static uint32_t next_codepoint(const char** s) {
+  const uint8_t* p = (const uint8_t*)*s;
+  uint32_t c = *p++;
+  int extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+  if (extra) c &= 0x3F >> extra;
+  for (; extra && (*p & 0xC0) == 0x80; extra--) c = (c << 6) | (*p++ & 0x3F);
+  *s = (const char*)p;
+  return c;
+}
+
+/// Lay out the text like vita2d does, writing the glyphs into the texture at (dst_x, dst_y) if draw is set
+static void layout(unsigned int size, const char* text, bool draw, int dst_x, int dst_y,
+                   int* min_x, int* min_y, int* max_x, int* max_y, int* width) {
+  uint8_t* data = draw ? vita2d_texture_get_datap(texture) : NULL;
+  unsigned int stride = draw ? vita2d_texture_get_stride(texture) : 0;
+  int pen_x = 0, pen_y = 0;
+  *min_x = *min_y = 0x7fffffff;
+  *max_x = *max_y = -0x7fffffff;
+  *width = 0;
+  while (*text) {
+    uint32_t c = next_codepoint(&text);
+    if (c == '\n') {
+      if (pen_x > *width) *width = pen_x;
+      pen_x = 0;
+      pen_y += size;
+      continue;
+    }
+    // rendered in both passes, the metrics alone can be off by a pixel after hinting
+    if (FT_Load_Char(ft_face, c, FT_LOAD_RENDER)) continue;
+    FT_GlyphSlot g = ft_face->glyph;
+    int gx = pen_x + g->bitmap_left;
+    int gy = pen_y - g->bitmap_top;
+    int gw = g->bitmap.width;
+    int gh = g->bitmap.rows;
+    if (draw) {
+      for (int row = 0; row < gh; row++) {
+        uint8_t* dst = data + (dst_y + gy + row) * stride + dst_x + gx;
+        const uint8_t* src = g->bitmap.buffer + row * g->bitmap.pitch;
+        for (int col = 0; col < gw; col++) {
+          // glyphs may overlap their neighbours
+          if (src[col] > dst[col]) dst[col] = src[col];
+        }
+      }
+    }
+    if (gw > 0 && gh > 0) {
+      if (gx < *min_x) *min_x = gx;
+      if (gy < *min_y) *min_y = gy;
+      if (gx + gw > *max_x) *max_x = gx + gw;
+      if (gy + gh > *max_y) *max_y = gy + gh;
+    }
+    pen_x += g->advance.x >> 6;
+  }
+  if (pen_x > *width) *width = pen_x;
+}
+
+/// @return the entry for the text, rasterizing it if needed, or NULL if it can't be cached
+static TextCacheEntry* lookup(unsigned int size, const char* text) {
+  if (!texture) return NULL;
+  size_t len = strlen(text);
+  if (!len || len > TEXT_CACHE_MAX_LEN) return NULL;
+  uint32_t hash = hash_text(size, text);
+  for (int i = 0; i < entry_count; i++) {
+    TextCacheEntry* e = &entries[i];
+    if (e->hash == hash && e->size == size && !strcmp(e->text, text)) return e;
+  }
+  if (full || entry_count == TEXT_CACHE_ENTRIES) {
+    full = true;
+    return NULL;
+  }
+
+  FT_Set_Pixel_Sizes(ft_face, size, size);
+  int min_x, min_y, max_x, max_y, width;
+  layout(size, text, false, 0, 0, &min_x, &min_y, &max_x, &max_y, &width);
+  if (max_x <= min_x) {
+    // only whitespace, nothing to draw but the width
+    min_x = min_y = 0;
+    max_x = max_y = 1;
+  }
+  int w = max_x - min_x;
+  int h = max_y - min_y;
+  if (w > TEXT_CACHE_WIDTH) return NULL;
+  if (shelf_x + w > TEXT_CACHE_WIDTH) {
+    shelf_x = 0;
+    shelf_y += shelf_h + 1;
+    shelf_h = 0;
+  }
+  if (shelf_y + h > TEXT_CACHE_HEIGHT) {
+    full = true;
+    return NULL;
+  }
+
+  TextCacheEntry* e = &entries[entry_count++];
+  e->hash = hash;
+  e->size = size;
+  memcpy(e->text, text, len + 1);
+  e->x = shelf_x;
+  e->y = shelf_y;
+  e->w = w;
+  e->h = h;
+  e->left = min_x;
+  e->top = min_y;
+  e->width = width;
+  shelf_x += w + 1;
+  if (h > shelf_h) shelf_h = h;
+
+  uint8_t* data = vita2d_texture_get_datap(texture);
+  unsigned int stride = vita2d_texture_get_stride(texture);
+  for (int row = 0; row < h; row++) memset(data + (e->y + row) * stride + e->x, 0, w);
+  layout(size, text, true, e->x - min_x, e->y - min_y, &min_x, &min_y, &max_x, &max_y, &width);
+  return e;
+}
+
+void text_cache_draw(int x, int y, uint32_t color, unsigned int size, const char* text) {
+  TextCacheEntry* e = lookup(size, text);
+  if (!e) {
+    vita2d_font_draw_text(font, x, y, color, size, text);
+    return;
+  }
+  vita2d_draw_texture_tint_part(texture, x + e->left, y + e->top, e->x, e->y, e->w, e->h, color);
+}
+
+int text_cache_width(unsigned int size, const char* text) {
+  TextCacheEntry* e = lookup(size, text);
+  return e ? e->width : vita2d_font_text_width(font, size, text);
+}
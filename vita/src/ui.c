@@ -11,11 +11,15 @@
 #include <psp2/ime_dialog.h>
 #include <psp2/kernel/processmgr.h>
 #include <chiaki/base64.h>
+#include <chiaki/thread.h>
 
 #include "context.h"
 #include "host.h"
+#include "sprite.h"
+#include "text_cache.h"
 #include "ui.h"
 #include "util.h"
+#include "video.h"
 
 // Legacy colors (kept for compatibility)
 #define COLOR_WHITE RGBA8(255, 255, 255, 255)
@@ -38,12 +42,6 @@
 #define UI_COLOR_ACCENT_PURPLE 0xFFB0279C       // Accent Purple #9C27B0
 #define UI_COLOR_SHADOW 0x3C000000           // Semi-transparent black for shadows
 
-// Particle colors (ABGR with alpha for transparency - 80% opacity = 0xCC)
-#define PARTICLE_COLOR_RED    0xCCFF5555  // 80% transparent red
-#define PARTICLE_COLOR_GREEN  0xCC55FF55  // 80% transparent green
-#define PARTICLE_COLOR_BLUE   0xCC5555FF  // 80% transparent blue
-#define PARTICLE_COLOR_ORANGE 0xCC55AAFF  // 80% transparent orange
-
 #define VITA_WIDTH 960
 #define VITA_HEIGHT 544
 
@@ -69,44 +67,46 @@
 #define HOST_SLOT_W 400
 #define HOST_SLOT_H 190
 
-// Particle structure for background animation
+// Particles for the background animation, as structure of arrays so the update loop is plain
+// integer arithmetic over contiguous arrays. Positions and velocities are in 1/256 px,
+// rotations in 1/65536 of a turn.
+#define PARTICLE_FRAC 256
+#define PARTICLE_SINE_STEPS 256
 typedef struct {
-  float x, y;
-  float vx, vy;
-  float scale;
-  float rotation;
-  float rotation_speed;
-  int symbol_type;  // 0=triangle, 1=circle, 2=x, 3=square
-  uint32_t color;
-  bool active;
-} Particle;
+  int32_t x[PARTICLE_COUNT], y[PARTICLE_COUNT];
+  int32_t vx[PARTICLE_COUNT], vy[PARTICLE_COUNT];
+  uint16_t rotation[PARTICLE_COUNT];
+  int16_t rotation_speed[PARTICLE_COUNT];
+  float scale[PARTICLE_COUNT];
+  uint8_t symbol_type[PARTICLE_COUNT];  // 0=triangle, 1=circle, 2=x, 3=square
+} Particles;
 
 #define TEXTURE_PATH "app0:/assets/"
-#define IMG_PS4_PATH TEXTURE_PATH "ps4.png"
-#define IMG_PS4_OFF_PATH TEXTURE_PATH "ps4_off.png"
-#define IMG_PS4_REST_PATH TEXTURE_PATH "ps4_rest.png"
-#define IMG_PS5_PATH TEXTURE_PATH "ps5.png"
-#define IMG_PS5_OFF_PATH TEXTURE_PATH "ps5_off.png"
-#define IMG_PS5_REST_PATH TEXTURE_PATH "ps5_rest.png"
 #define IMG_DISCOVERY_HOST TEXTURE_PATH "discovered_host.png"
 
 vita2d_font* font;
 vita2d_font* font_mono;
-vita2d_texture *img_ps4, *img_ps4_off, *img_ps4_rest,
-    *img_ps5, *img_ps5_off, *img_ps5_rest, *img_discovery_host;
+vita2d_texture *img_discovery_host;
 
-// VitaRPS5 UI textures
-vita2d_texture *symbol_triangle, *symbol_circle, *symbol_ex, *symbol_square;
+// VitaRPS5 UI textures, the small ones are sprites in the UI atlas
 vita2d_texture *wave_top, *wave_bottom;
-vita2d_texture *ellipse_green, *ellipse_yellow, *ellipse_red;
-vita2d_texture *button_add_new;
-vita2d_texture *icon_play, *icon_settings, *icon_controller, *icon_profile;
+vita2d_texture *icon_profile;
 vita2d_texture *background_gradient, *vita_rps5_logo;
-vita2d_texture *vita_front, *ps5_logo;
+vita2d_texture *vita_front;
 
 // Particle system state
-static Particle particles[PARTICLE_COUNT];
+static Particles particles;
+static float particle_sine[PARTICLE_SINE_STEPS];
+static uint32_t particle_rng = 1;
 static bool particles_initialized = false;
+static int particle_steps = 1;  // vblanks since the particles were last moved, so skipped frames keep their speed
+
+// Menus are only redrawn when something changed, see draw_ui()
+#define UI_ANIMATION_TICK_FRAMES 2  // move the particles at 30 Hz instead of every vblank
+#define UI_HEARTBEAT_US (1000 * 1000)  // status text and the card cache also change without any event
+#define UI_SETTLE_FRAMES 2  // keep drawing briefly after an event, the draw functions apply some of their state a frame late
+#define UI_STREAMING_POLL_US (50 * 1000)  // nothing is read or drawn while streaming, only the end of it is waited for
+static volatile uint32_t ui_invalidations = 0;
 
 // Wave navigation state
 #define WAVE_NAV_ICON_SIZE 48
@@ -141,12 +141,12 @@ static int selected_console_index = 0;
 // Console card cache to prevent flickering during discovery updates
 typedef struct {
   ConsoleCardInfo cards[MAX_NUM_HOSTS];
+  uint32_t card_revisions[MAX_NUM_HOSTS];  // of the host each card was mapped from
   int num_cards;
-  uint64_t last_update_time;  // Microseconds since epoch
+  uint32_t hosts_revision;  // context.hosts_revision the cards are up to date with
 } ConsoleCardCache;
 
 static ConsoleCardCache card_cache = {0};
-#define CARD_CACHE_UPDATE_INTERVAL_US (10 * 1000000)  // 10 seconds in microseconds
 
 // Wave navigation sidebar uses simple colored bar (no animation)
 
@@ -212,6 +212,65 @@ bool btn_pressed(SceCtrlButtons btn) {
 
 // Modern rendering helpers (extracted from VitaRPS5)
 
+// Rounded shapes are drawn as one triangle fan each instead of a rectangle per pixel
+#define ROUNDED_SEGMENTS_MAX 16  // per quarter circle
+static float quarter_cos[ROUNDED_SEGMENTS_MAX + 1];
+static float quarter_sin[ROUNDED_SEGMENTS_MAX + 1];
+static bool quarter_initialized = false;
+
+/// Draw a filled rectangle with corners rounded by radius as a single draw call
+static void draw_rounded_fan(float x, float y, float width, float height, float radius, uint32_t color) {
+  if (radius > width / 2) radius = width / 2;
+  if (radius > height / 2) radius = height / 2;
+  if (radius < 1.0f) {
+    vita2d_draw_rectangle(x, y, width, height, color);
+    return;
+  }
+
+  if (!quarter_initialized) {
+    for (int i = 0; i <= ROUNDED_SEGMENTS_MAX; i++) {
+      float a = 1.5707963f * i / ROUNDED_SEGMENTS_MAX;
+      quarter_cos[i] = cosf(a);
+      quarter_sin[i] = sinf(a);
+    }
+    quarter_initialized = true;
+  }
+
+  // a segment every few px of arc is indistinguishable from a true circle at these sizes,
+  // the step has to divide the table so every corner ends exactly at 90 degrees
+  int step = ROUNDED_SEGMENTS_MAX;
+  while (step > 1 && radius / (ROUNDED_SEGMENTS_MAX / step) > 2.0f) step /= 2;
+  int segments = ROUNDED_SEGMENTS_MAX / step;
+
+  // the GPU reads the vertices when the scene is done, so they have to live in the frame's pool
+  size_t count = 2 + 4 * (segments + 1);
+  vita2d_color_vertex* v = vita2d_pool_memalign(count * sizeof(vita2d_color_vertex), sizeof(vita2d_color_vertex));
+  if (!v) return;
+
+  // corner centers in fan order: bottom-right, bottom-left, top-left, top-right
+  const float ccx[4] = { x + width - radius, x + radius, x + radius, x + width - radius };
+  const float ccy[4] = { y + height - radius, y + height - radius, y + radius, y + radius };
+  size_t n = 0;
+  v[n++] = (vita2d_color_vertex){ x + width / 2, y + height / 2, 0.5f, color };
+  for (int corner = 0; corner < 4; corner++) {
+    for (int i = 0; i <= segments; i++) {
+      // each corner sweeps a quarter, rotated by 90 degrees from the one before
+      float c = quarter_cos[i * step];
+      float s = quarter_sin[i * step];
+      float dx, dy;
+      switch (corner) {
+        case 0: dx = c; dy = s; break;
+        case 1: dx = -s; dy = c; break;
+        case 2: dx = -c; dy = -s; break;
+        default: dx = s; dy = -c; break;
+      }
+      v[n++] = (vita2d_color_vertex){ ccx[corner] + dx * radius, ccy[corner] + dy * radius, 0.5f, color };
+    }
+  }
+  v[n++] = v[1];
+  vita2d_draw_array(SCE_GXM_PRIMITIVE_TRIANGLE_FAN, v, n);
+}
+
 /// Draw a circle at the given position with the given radius and color
 static void draw_circle(int cx, int cy, int radius, uint32_t color) {
   // Bounds checking
@@ -229,43 +288,15 @@ static void draw_circle(int cx, int cy, int radius, uint32_t color) {
     color |= 0xFF000000;
   }
 
-  for (int y = -radius; y <= radius; y++) {
-    for (int x = -radius; x <= radius; x++) {
-      if (x * x + y * y <= radius * radius) {
-        int draw_x = cx + x;
-        int draw_y = cy + y;
-
-        if (draw_x < 0 || draw_x >= 960 || draw_y < 0 || draw_y >= 544) {
-          continue;
-        }
-
-        vita2d_draw_rectangle(draw_x, draw_y, 1, 1, color);
-      }
-    }
-  }
+  // + 0.5 matches the extent of the pixels that were inside x * x + y * y <= radius * radius
+  float r = radius + 0.5f;
+  draw_rounded_fan(cx - r + 0.5f, cy - r + 0.5f, 2 * r, 2 * r, r, color);
 }
 
 /// Draw a rounded rectangle with the given parameters
 static void draw_rounded_rectangle(int x, int y, int width, int height, int radius, uint32_t color) {
-  // Main rectangle body
-  vita2d_draw_rectangle(x + radius, y, width - 2 * radius, height, color);
-  vita2d_draw_rectangle(x, y + radius, width, height - 2 * radius, color);
-
-  // Corner circles (simplified as small rectangles for performance)
-  for (int i = 0; i < radius; i++) {
-    for (int j = 0; j < radius; j++) {
-      if (i * i + j * j <= radius * radius) {
-        // Top-left corner
-        vita2d_draw_rectangle(x + radius - i, y + radius - j, 1, 1, color);
-        // Top-right corner
-        vita2d_draw_rectangle(x + width - radius + i - 1, y + radius - j, 1, 1, color);
-        // Bottom-left corner
-        vita2d_draw_rectangle(x + radius - i, y + height - radius + j - 1, 1, 1, color);
-        // Bottom-right corner
-        vita2d_draw_rectangle(x + width - radius + i - 1, y + height - radius + j - 1, 1, 1, color);
-      }
-    }
-  }
+  if (width <= 0 || height <= 0) return;
+  draw_rounded_fan(x, y, width, height, radius, color);
 }
 
 /// Draw a card with a shadow effect
@@ -333,12 +364,12 @@ static void draw_dropdown(int x, int y, int width, int height, const char* label
   }
 
   // Label text (left)
-  vita2d_font_draw_text(font, x + 15, y + height/2 + 6, UI_COLOR_TEXT_PRIMARY, 16, label);
+  text_cache_draw(x + 15, y + height/2 + 6, UI_COLOR_TEXT_PRIMARY, 16, label);
 
   // Value text (right)
-  int value_width = vita2d_font_text_width(font, 16, value);
-  vita2d_font_draw_text(font, x + width - value_width - 30, y + height/2 + 6,
-                        UI_COLOR_TEXT_PRIMARY, 16, value);
+  int value_width = text_cache_width(16, value);
+  text_cache_draw(x + width - value_width - 30, y + height/2 + 6,
+                  UI_COLOR_TEXT_PRIMARY, 16, value);
 
   // Down arrow indicator (simple triangle)
   int arrow_x = x + width - 18;
@@ -371,11 +402,11 @@ static void draw_tab_bar(int x, int y, int width, int height,
     draw_rounded_rectangle(tab_x, y, tab_width - 4, height, 8, colors[i]);
 
     // Tab text (centered) - use subheader font size
-    int text_width = vita2d_font_text_width(font, FONT_SIZE_SUBHEADER, tabs[i]);
+    int text_width = text_cache_width(FONT_SIZE_SUBHEADER, tabs[i]);
     int text_x = tab_x + (tab_width - text_width) / 2;
     int text_y = y + height/2 + 6;
 
-    vita2d_font_draw_text(font, text_x, text_y, UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SUBHEADER, tabs[i]);
+    text_cache_draw(text_x, text_y, UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SUBHEADER, tabs[i]);
 
     // Selection indicator (bottom bar) - only visual difference
     if (i == selected) {
@@ -417,30 +448,33 @@ static void draw_status_dot(int x, int y, int radius, StatusType status) {
 
 // Particle system functions
 
+/// xorshift32, cheaper than rand() and only used for particles
+static uint32_t particle_rand() {
+  particle_rng ^= particle_rng << 13;
+  particle_rng ^= particle_rng >> 17;
+  particle_rng ^= particle_rng << 5;
+  return particle_rng;
+}
+
 /// Initialize particle system with random positions and velocities
 void init_particles() {
   if (particles_initialized) return;
 
-  srand((unsigned int)sceKernelGetProcessTimeWide());
+  particle_rng = (uint32_t)sceKernelGetProcessTimeWide() | 1;
+  for (int i = 0; i < PARTICLE_SINE_STEPS; i++) {
+    particle_sine[i] = sinf(6.2831853f * i / PARTICLE_SINE_STEPS);
+  }
 
   for (int i = 0; i < PARTICLE_COUNT; i++) {
-    particles[i].x = (float)(rand() % VITA_WIDTH);
-    particles[i].y = -(float)(rand() % 200);  // Start above screen (0 to -200)
-    particles[i].vx = ((float)(rand() % 100) / 100.0f - 0.5f) * 0.5f;  // Slight horizontal drift
-    particles[i].vy = ((float)(rand() % 100) / 100.0f + 0.3f) * 1.2f;  // Downward (positive Y, gravity)
-    particles[i].scale = 0.30f + ((float)(rand() % 100) / 100.0f) * 0.50f;  // 2x bigger: 0.30 to 0.80
-    particles[i].rotation = (float)(rand() % 360);
-    particles[i].rotation_speed = ((float)(rand() % 100) / 100.0f - 0.5f) * 1.0f;  // Half speed: -0.5 to +0.5
-    particles[i].symbol_type = rand() % 4;
-
-    // Assign color based on symbol
-    switch (particles[i].symbol_type) {
-      case 0: particles[i].color = PARTICLE_COLOR_RED; break;
-      case 1: particles[i].color = PARTICLE_COLOR_BLUE; break;
-      case 2: particles[i].color = PARTICLE_COLOR_GREEN; break;
-      case 3: particles[i].color = PARTICLE_COLOR_ORANGE; break;
-    }
-    particles[i].active = true;
+    particles.x[i] = (particle_rand() % VITA_WIDTH) * PARTICLE_FRAC;
+    particles.y[i] = -(int32_t)(particle_rand() % 200) * PARTICLE_FRAC;  // Start above screen (0 to -200)
+    particles.vx[i] = ((int32_t)(particle_rand() % 100) - 50) * PARTICLE_FRAC / 200;  // Slight horizontal drift: -0.25 to +0.25
+    particles.vy[i] = ((int32_t)(particle_rand() % 100) + 30) * PARTICLE_FRAC * 12 / 1000;  // Downward (gravity): 0.36 to 1.55
+    particles.scale[i] = 0.30f + ((float)(particle_rand() % 100) / 100.0f) * 0.50f;  // 2x bigger: 0.30 to 0.80
+    particles.rotation[i] = (uint16_t)particle_rand();
+    // Half speed: -0.5 to +0.5 rad per frame
+    particles.rotation_speed[i] = (int16_t)(((int32_t)(particle_rand() % 100) - 50) * 65536 / 628);
+    particles.symbol_type[i] = particle_rand() % 4;
   }
 
   particles_initialized = true;
@@ -450,52 +484,46 @@ void init_particles() {
 void update_particles() {
   if (!particles_initialized) return;
 
+  int32_t steps = particle_steps;
   for (int i = 0; i < PARTICLE_COUNT; i++) {
-    if (!particles[i].active) continue;
-
-    // Update position
-    particles[i].x += particles[i].vx;
-    particles[i].y += particles[i].vy;
-    particles[i].rotation += particles[i].rotation_speed;
+    particles.x[i] += particles.vx[i] * steps;
+    particles.y[i] += particles.vy[i] * steps;
+    particles.rotation[i] += (uint16_t)(particles.rotation_speed[i] * steps);
+  }
 
-    // Wrap around screen edges (respawn at top when falling off bottom)
-    if (particles[i].y > VITA_HEIGHT + 50) {
-      particles[i].y = -(float)(rand() % 100);  // Respawn at top
-      particles[i].x = (float)(rand() % VITA_WIDTH);
+  // Wrap around screen edges (respawn at top when falling off bottom)
+  for (int i = 0; i < PARTICLE_COUNT; i++) {
+    if (particles.y[i] > (VITA_HEIGHT + 50) * PARTICLE_FRAC) {
+      particles.y[i] = -(int32_t)(particle_rand() % 100) * PARTICLE_FRAC;  // Respawn at top
+      particles.x[i] = (particle_rand() % VITA_WIDTH) * PARTICLE_FRAC;
     }
-    if (particles[i].x < -50) particles[i].x = VITA_WIDTH + 50;
-    if (particles[i].x > VITA_WIDTH + 50) particles[i].x = -50;
+    if (particles.x[i] < -50 * PARTICLE_FRAC) particles.x[i] = (VITA_WIDTH + 50) * PARTICLE_FRAC;
+    if (particles.x[i] > (VITA_WIDTH + 50) * PARTICLE_FRAC) particles.x[i] = -50 * PARTICLE_FRAC;
   }
 }
 
-// Forward declarations
-void draw_play_icon(int center_x, int center_y, int size);
-
-/// Render all active particles
+/// Render all particles, in a single draw from the UI atlas
 void render_particles() {
   if (!particles_initialized) return;
 
-  vita2d_texture* symbol_textures[4] = {
-    symbol_triangle, symbol_circle, symbol_ex, symbol_square
+  static const UISprite symbol_sprites[4] = {
+    UI_SPRITE_SYMBOL_TRIANGLE, UI_SPRITE_SYMBOL_CIRCLE, UI_SPRITE_SYMBOL_EX, UI_SPRITE_SYMBOL_SQUARE
   };
 
   for (int i = 0; i < PARTICLE_COUNT; i++) {
-    if (!particles[i].active) continue;
-
-    vita2d_texture* tex = symbol_textures[particles[i].symbol_type];
-    if (!tex) continue;
-
-    // Draw with scale and rotation
-    vita2d_draw_texture_scale_rotate(tex,
-      particles[i].x, particles[i].y,
-      particles[i].scale, particles[i].scale,
-      particles[i].rotation);
-
-    // Note: Color tinting would require custom shader
-    // For now particles use texture colors
-  }
+    int angle = particles.rotation[i] / (65536 / PARTICLE_SINE_STEPS);
+    float s = particle_sine[angle];
+    float c = particle_sine[(angle + PARTICLE_SINE_STEPS / 4) % PARTICLE_SINE_STEPS];
+    sprite_draw_transform(symbol_sprites[particles.symbol_type[i]],
+      (float)particles.x[i] / PARTICLE_FRAC, (float)particles.y[i] / PARTICLE_FRAC,
+      particles.scale[i], c, s, SPRITE_TINT_NONE);
+  }
+  sprite_flush();
 }
 
+// Forward declarations
+void draw_play_icon(int center_x, int center_y, int size);
+
 /// Render VitaRPS5 navigation sidebar with simple colored bar
 void render_wave_navigation() {
   // Draw simple teal/cyan colored bar for navigation sidebar
@@ -503,9 +531,9 @@ void render_wave_navigation() {
   uint32_t nav_bar_color = RGBA8(78, 133, 139, 255);  // Teal color from wave texture
   vita2d_draw_rectangle(0, 0, WAVE_NAV_WIDTH, VITA_HEIGHT, nav_bar_color);
 
-  // Navigation icons array
-  vita2d_texture* nav_icons[4] = {
-    icon_play, icon_settings, icon_controller, icon_profile
+  // Navigation icons array, play is drawn as a shape
+  static const UISprite nav_icons[4] = {
+    UI_SPRITE_COUNT, UI_SPRITE_NAV_SETTINGS, UI_SPRITE_NAV_CONTROLLER, UI_SPRITE_NAV_PROFILE
   };
 
   // Draw navigation icons (static, no animation)
@@ -524,19 +552,18 @@ void render_wave_navigation() {
       // First icon: Draw white triangle play icon instead of texture
       draw_play_icon(WAVE_NAV_ICON_X, y, WAVE_NAV_ICON_SIZE);
     } else {
-      // Other icons: Draw from textures
-      if (!nav_icons[i]) continue;
-
-      int icon_w = vita2d_texture_get_width(nav_icons[i]);
-      int icon_h = vita2d_texture_get_height(nav_icons[i]);
+      // Other icons: Draw from the atlas, batched until the end of the bar
+      int icon_w = sprite_width(nav_icons[i]);
+      int icon_h = sprite_height(nav_icons[i]);
       float scale = (float)WAVE_NAV_ICON_SIZE / (float)(icon_w > icon_h ? icon_w : icon_h);
 
-      vita2d_draw_texture_scale(nav_icons[i],
+      sprite_draw(nav_icons[i],
         WAVE_NAV_ICON_X - (icon_w * scale / 2.0f),
         y - (icon_h * scale / 2.0f),
-        scale, scale);
+        scale, scale, SPRITE_TINT_NONE);
     }
   }
+  sprite_flush();
 }
 
 /// Map VitaChiakiHost to ConsoleCardInfo
@@ -612,9 +639,9 @@ void render_console_card(ConsoleCardInfo* console, int x, int y, bool selected)
   // PS5 logo (centered, properly scaled for card)
   bool is_ps5 = console->host && chiaki_target_is_ps5(console->host->target);
 
-  if (is_ps5 && ps5_logo) {
-    int logo_w = vita2d_texture_get_width(ps5_logo);
-    int logo_h = vita2d_texture_get_height(ps5_logo);
+  if (is_ps5) {
+    int logo_w = sprite_width(UI_SPRITE_PS5_LOGO);
+    int logo_h = sprite_height(UI_SPRITE_PS5_LOGO);
 
     // Scale logo to fit card width (max 60% of card width)
     float max_width = CONSOLE_CARD_WIDTH * 0.6f;
@@ -626,22 +653,15 @@ void render_console_card(ConsoleCardInfo* console, int x, int y, bool selected)
     int logo_y = y + 50;  // Fixed position from top
 
     // Dimmed for unpaired consoles
-    if (is_unpaired) {
-      vita2d_draw_texture_tint_scale(ps5_logo, logo_x, logo_y, scale, scale,
-                                     RGBA8(255, 255, 255, 100));
-    } else {
-      vita2d_draw_texture_scale(ps5_logo, logo_x, logo_y, scale, scale);
-    }
-  } else if (!is_ps5) {
+    sprite_draw(UI_SPRITE_PS5_LOGO, logo_x, logo_y, scale, scale,
+                is_unpaired ? RGBA8(255, 255, 255, 100) : SPRITE_TINT_NONE);
+  } else {
     // Fallback to PS4 icon for PS4 consoles
-    vita2d_texture* logo = img_ps4;
-    if (logo) {
-      int logo_w = vita2d_texture_get_width(logo);
-      int logo_h = vita2d_texture_get_height(logo);
-      int logo_x = x + (CONSOLE_CARD_WIDTH / 2) - (logo_w / 2);
-      int logo_y = y + (CONSOLE_CARD_HEIGHT / 3) - (logo_h / 2);
-      vita2d_draw_texture(logo, logo_x, logo_y);
-    }
+    int logo_w = sprite_width(UI_SPRITE_PS4);
+    int logo_h = sprite_height(UI_SPRITE_PS4);
+    int logo_x = x + (CONSOLE_CARD_WIDTH / 2) - (logo_w / 2);
+    int logo_y = y + (CONSOLE_CARD_HEIGHT / 3) - (logo_h / 2);
+    sprite_draw(UI_SPRITE_PS4, logo_x, logo_y, 1.0f, 1.0f, SPRITE_TINT_NONE);
   }
 
   // Console name bar (1/3 from bottom)
@@ -650,18 +670,18 @@ void render_console_card(ConsoleCardInfo* console, int x, int y, bool selected)
     RGBA8(70, 75, 80, 255));
 
   // Console name text (centered in bar)
-  int text_width = vita2d_font_text_width(font, 20, console->name);
+  int text_width = text_cache_width(20, console->name);
   int text_x = x + (CONSOLE_CARD_WIDTH / 2) - (text_width / 2);
-  vita2d_font_draw_text(font, text_x, name_bar_y + 27, UI_COLOR_TEXT_PRIMARY, 20, console->name);
+  text_cache_draw(text_x, name_bar_y + 27, UI_COLOR_TEXT_PRIMARY, 20, console->name);
 
-  // Status indicator (top-right)
-  vita2d_texture* status_tex = NULL;
-  if (console->status == 0) status_tex = ellipse_green;
-  else if (console->status == 1) status_tex = ellipse_red;
-  else if (console->status == 2) status_tex = ellipse_yellow;
+  // Status indicator (top-right), goes out together with the logo since nothing else overlaps them
+  UISprite status_sprite = UI_SPRITE_COUNT;
+  if (console->status == 0) status_sprite = UI_SPRITE_ELLIPSE_GREEN;
+  else if (console->status == 1) status_sprite = UI_SPRITE_ELLIPSE_RED;
+  else if (console->status == 2) status_sprite = UI_SPRITE_ELLIPSE_YELLOW;
 
-  if (status_tex) {
-    vita2d_draw_texture(status_tex, x + CONSOLE_CARD_WIDTH - 35, y + 10);
+  if (status_sprite != UI_SPRITE_COUNT) {
+    sprite_draw(status_sprite, x + CONSOLE_CARD_WIDTH - 35, y + 10, 1.0f, 1.0f, SPRITE_TINT_NONE);
   }
 
   // State text ("Ready" / "Standby" / "Unpaired")
@@ -680,38 +700,47 @@ void render_console_card(ConsoleCardInfo* console, int x, int y, bool selected)
   }
 
   if (state_text) {
-    int state_text_width = vita2d_font_text_width(font, 18, state_text);
+    int state_text_width = text_cache_width(18, state_text);
     int state_x = x + (CONSOLE_CARD_WIDTH / 2) - (state_text_width / 2);
-    vita2d_font_draw_text(font, state_x, name_bar_y + 55, state_color, 18, state_text);
+    text_cache_draw(state_x, name_bar_y + 55, state_color, 18, state_text);
   }
+
+  // Cards overlap each other, so the next one must be drawn above these
+  sprite_flush();
 }
 
 /// Update console card cache to prevent flickering during discovery updates
+/// Only cards whose host changed since they were mapped are mapped again
 void update_console_card_cache(bool force_update) {
-  uint64_t current_time = sceKernelGetProcessTimeWide();
-
-  // Only update cache if enough time has passed or if forced
-  if (!force_update &&
-      (current_time - card_cache.last_update_time) < CARD_CACHE_UPDATE_INTERVAL_US) {
+  uint32_t hosts_revision = context.hosts_revision;
+  if (!force_update && card_cache.num_cards > 0 && hosts_revision == card_cache.hosts_revision) {
     return;
   }
 
   // Count current valid hosts
   int num_hosts = 0;
   ConsoleCardInfo temp_cards[MAX_NUM_HOSTS];
+  uint32_t temp_revisions[MAX_NUM_HOSTS];
 
   for (int i = 0; i < MAX_NUM_HOSTS; i++) {
-    if (context.hosts[i]) {
-      map_host_to_console_card(context.hosts[i], &temp_cards[num_hosts]);
-      num_hosts++;
+    VitaChiakiHost* host = context.hosts[i];
+    if (!host) continue;
+    if (!force_update && num_hosts < card_cache.num_cards && card_cache.cards[num_hosts].host == host &&
+        card_cache.card_revisions[num_hosts] == host->revision) {
+      temp_cards[num_hosts] = card_cache.cards[num_hosts];
+    } else {
+      map_host_to_console_card(host, &temp_cards[num_hosts]);
     }
+    temp_revisions[num_hosts] = host->revision;
+    num_hosts++;
   }
 
   // Only update cache if we have valid hosts (prevents storing empty state during discovery updates)
   if (num_hosts > 0) {
     card_cache.num_cards = num_hosts;
     memcpy(card_cache.cards, temp_cards, sizeof(ConsoleCardInfo) * num_hosts);
-    card_cache.last_update_time = current_time;
+    memcpy(card_cache.card_revisions, temp_revisions, sizeof(uint32_t) * num_hosts);
+    card_cache.hosts_revision = hosts_revision;
   }
 }
 
@@ -721,7 +750,7 @@ void render_console_grid() {
   int screen_center_x = VITA_WIDTH / 2;
   int screen_center_y = VITA_HEIGHT / 2;
 
-  // Update cache (respects 10-second interval)
+  // Update cache (only when hosts changed)
   update_console_card_cache(false);
 
   // Calculate card position - centered on full screen
@@ -730,11 +759,11 @@ void render_console_grid() {
 
   // Header text - centered horizontally on full screen above the card
   const char* header_text = "Which do you want to connect?";
-  int text_width = vita2d_font_text_width(font, 24, header_text);
+  int text_width = text_cache_width(24, header_text);
   int text_x = screen_center_x - (text_width / 2);
   int text_y = card_y - 50;  // Position text 50px above card
 
-  vita2d_font_draw_text(font, text_x, text_y, UI_COLOR_TEXT_PRIMARY, 24, header_text);
+  text_cache_draw(text_x, text_y, UI_COLOR_TEXT_PRIMARY, 24, header_text);
 
   // Use cached cards to prevent flickering
   if (card_cache.num_cards > 0) {
@@ -770,39 +799,96 @@ void draw_play_icon(int center_x, int center_y, int size) {
   }
 }
 
-/// Load all textures required for rendering the UI
-void load_textures() {
-  img_ps4 = vita2d_load_PNG_file(IMG_PS4_PATH);
-  img_ps4_off = vita2d_load_PNG_file(IMG_PS4_OFF_PATH);
-  img_ps4_rest = vita2d_load_PNG_file(IMG_PS4_REST_PATH);
-  img_ps5 = vita2d_load_PNG_file(IMG_PS5_PATH);
-  img_ps5_off = vita2d_load_PNG_file(IMG_PS5_OFF_PATH);
-  img_ps5_rest = vita2d_load_PNG_file(IMG_PS5_REST_PATH);
-  img_discovery_host = vita2d_load_PNG_file(IMG_DISCOVERY_HOST);
-
-  // Load VitaRPS5 UI assets
-  symbol_triangle = vita2d_load_PNG_file("app0:/assets/symbol_triangle.png");
-  symbol_circle = vita2d_load_PNG_file("app0:/assets/symbol_circle.png");
-  symbol_ex = vita2d_load_PNG_file("app0:/assets/symbol_ex.png");
-  symbol_square = vita2d_load_PNG_file("app0:/assets/symbol_square.png");
-  wave_top = vita2d_load_PNG_file("app0:/assets/wave_top.png");
-  wave_bottom = vita2d_load_PNG_file("app0:/assets/wave_bottom.png");
-  ellipse_green = vita2d_load_PNG_file("app0:/assets/ellipse_green.png");
-  ellipse_yellow = vita2d_load_PNG_file("app0:/assets/ellipse_yellow.png");
-  ellipse_red = vita2d_load_PNG_file("app0:/assets/ellipse_red.png");
-  button_add_new = vita2d_load_PNG_file("app0:/assets/button_add_new.png");
-
-  // Load navigation icons
-  icon_play = vita2d_load_PNG_file("app0:/assets/icon_play.png");
-  icon_settings = vita2d_load_PNG_file("app0:/assets/icon_settings.png");
-  icon_controller = vita2d_load_PNG_file("app0:/assets/icon_controller.png");
-  icon_profile = vita2d_load_PNG_file("app0:/assets/icon_profile.png");
-
-  // Load new professional assets
-  background_gradient = vita2d_load_PNG_file("app0:/assets/background.png");
-  vita_rps5_logo = vita2d_load_PNG_file("app0:/assets/Vita_RPS5_Logo.png");
-  vita_front = vita2d_load_PNG_file("app0:/assets/Vita_Front.png");
-  ps5_logo = vita2d_load_PNG_file("app0:/assets/PS5_logo.png");
+// Assets are decoded by a loader thread while the first frames are already on screen, in this order
+typedef enum ui_asset_stage_t {
+  UI_ASSETS_NONE,
+  UI_ASSETS_FONTS,  // fonts and the text cache, every screen needs them
+  UI_ASSETS_SPRITES,
+  UI_ASSETS_BACKGROUND,
+  UI_ASSETS_ALL,
+} UIAssetStage;
+
+static struct {
+  ChiakiThread thread;
+  ChiakiMutex mutex;
+  bool threaded;
+  UIAssetStage loaded;  // set by the loader when a stage is done
+  UIAssetStage installed;  // the stages the UI thread has taken over into the globals
+  bool text_cache_ok;
+  vita2d_font *font, *font_mono;
+  vita2d_texture *atlas, *background, *logo;
+  vita2d_texture *discovery_host, *wave_top, *wave_bottom, *icon_profile, *vita_front;
+} assets;
+
+static void assets_publish(UIAssetStage stage) {
+  if (assets.threaded) chiaki_mutex_lock(&assets.mutex);
+  assets.loaded = stage;
+  if (assets.threaded) chiaki_mutex_unlock(&assets.mutex);
+}
+
+/// Load all textures and fonts required for rendering the UI, nothing in here may touch the UI state
+static void* load_assets(void* user) {
+  assets.font = vita2d_load_font_file("app0:/assets/fonts/Roboto-Regular.ttf");
+  assets.font_mono = vita2d_load_font_file("app0:/assets/fonts/RobotoMono-Regular.ttf");
+  assets.text_cache_ok = text_cache_init("app0:/assets/fonts/Roboto-Regular.ttf");
+  assets_publish(UI_ASSETS_FONTS);
+
+  // Console images, status dots, particle symbols and nav icons
+  assets.atlas = sprite_atlas_load(SPRITE_ATLAS_PATH);
+  assets_publish(UI_ASSETS_SPRITES);
+
+  assets.background = vita2d_load_PNG_file("app0:/assets/background.png");
+  assets.logo = vita2d_load_PNG_file("app0:/assets/Vita_RPS5_Logo.png");
+  assets_publish(UI_ASSETS_BACKGROUND);
+
+  assets.discovery_host = vita2d_load_PNG_file(IMG_DISCOVERY_HOST);
+  assets.wave_top = vita2d_load_PNG_file("app0:/assets/wave_top.png");
+  assets.wave_bottom = vita2d_load_PNG_file("app0:/assets/wave_bottom.png");
+  // Full size profile picture, the nav bar uses the atlas sprite
+  assets.icon_profile = vita2d_load_PNG_file("app0:/assets/icon_profile.png");
+  assets.vita_front = vita2d_load_PNG_file("app0:/assets/Vita_Front.png");
+  assets_publish(UI_ASSETS_ALL);
+  return NULL;
+}
+
+/// Take over the assets the loader has finished since the last call, until then the screens draw without them
+static void install_assets() {
+  if (assets.installed == UI_ASSETS_ALL) return;
+  if (assets.threaded) chiaki_mutex_lock(&assets.mutex);
+  UIAssetStage loaded = assets.loaded;
+  if (assets.threaded) chiaki_mutex_unlock(&assets.mutex);
+
+  while (assets.installed < loaded) {
+    assets.installed++;
+    switch (assets.installed) {
+      case UI_ASSETS_FONTS:
+        font = assets.font;
+        font_mono = assets.font_mono;
+        if (!assets.text_cache_ok) LOGE("Failed to init the text cache, drawing text directly");
+        break;
+      case UI_ASSETS_SPRITES:
+        if (!assets.atlas) LOGE("Failed to load UI atlas %s", SPRITE_ATLAS_PATH);
+        sprite_atlas_set(assets.atlas);
+        break;
+      case UI_ASSETS_BACKGROUND:
+        background_gradient = assets.background;
+        vita_rps5_logo = assets.logo;
+        break;
+      case UI_ASSETS_ALL:
+        img_discovery_host = assets.discovery_host;
+        wave_top = assets.wave_top;
+        wave_bottom = assets.wave_bottom;
+        icon_profile = assets.icon_profile;
+        vita_front = assets.vita_front;
+        if (assets.threaded) chiaki_thread_join(&assets.thread, NULL);
+        // after the UI textures, so streams get the rest of CDRAM in one piece
+        vita_h264_reserve();
+        break;
+      default:
+        break;
+    }
+    ui_invalidate();
+  }
 }
 
 /// Check if a given region is touched on the front touch screen
@@ -883,8 +969,9 @@ UIScreenType handle_vitarps5_touch_input(int num_hosts) {
                 if (discovered && !at_rest && registered) {
                   host_stream(context.active_host);
                   return UI_SCREEN_TYPE_STREAM;
-                } else if (at_rest) {
-                  host_wakeup(context.active_host);
+                } else if (at_rest && registered) {
+                  if (host_wake_and_stream(context.active_host) == 0)
+                    return UI_SCREEN_TYPE_WAKING;
                 } else if (!registered) {
                   return UI_SCREEN_TYPE_REGISTER_HOST;
                 }
@@ -898,16 +985,14 @@ UIScreenType handle_vitarps5_touch_input(int num_hosts) {
       }
 
       // Check "Add New" button
-      if (button_add_new) {
-        int btn_w = vita2d_texture_get_width(button_add_new);
-        int btn_x = content_area_x - (btn_w / 2);
-        int btn_y = CONSOLE_CARD_START_Y + (num_hosts * CONSOLE_CARD_SPACING) + 20;
-        int btn_h = vita2d_texture_get_height(button_add_new);
-
-        if (is_point_in_rect(touch_x, touch_y, btn_x, btn_y, btn_w, btn_h)) {
-          if (!context.discovery_enabled) {
-            start_discovery(NULL, NULL);
-          }
+      int btn_w = sprite_width(UI_SPRITE_BUTTON_ADD_NEW);
+      int btn_x = content_area_x - (btn_w / 2);
+      int btn_y = CONSOLE_CARD_START_Y + (num_hosts * CONSOLE_CARD_SPACING) + 20;
+      int btn_h = sprite_height(UI_SPRITE_BUTTON_ADD_NEW);
+
+      if (is_point_in_rect(touch_x, touch_y, btn_x, btn_y, btn_w, btn_h)) {
+        if (!context.discovery_enabled) {
+          start_discovery(NULL, NULL);
         }
       }
     }
@@ -942,17 +1027,17 @@ UIHostAction host_tile(int host_slot, VitaChiakiHost* host) {
 
   // Draw host name (nickname) and host id (mac)
   if (discovered) {
-    vita2d_draw_texture(img_discovery_host, x, y);
-    vita2d_font_draw_text(font, x + 68, y + 40, COLOR_WHITE, 40,
+    if (img_discovery_host) vita2d_draw_texture(img_discovery_host, x, y);
+    text_cache_draw(x + 68, y + 40, COLOR_WHITE, 40,
                          host->discovery_state->host_name);
-    vita2d_font_draw_text(font, x + 255, y + 23, COLOR_WHITE, 20,
+    text_cache_draw(x + 255, y + 23, COLOR_WHITE, 20,
                          host->discovery_state->host_id);
   } else if (registered) {
     char* nickname = host->registered_state->server_nickname;
     if (!nickname) nickname = "";
     uint8_t* host_mac = host->server_mac;
-    vita2d_font_draw_text(font, x + 68, y + 40, COLOR_WHITE, 40,
-                          nickname);
+    text_cache_draw(x + 68, y + 40, COLOR_WHITE, 40,
+                    nickname);
     vita2d_font_draw_textf(font, x + 255, y + 23, COLOR_WHITE, 20,
                           "%X%X%X%X%X%X", host_mac[0], host_mac[1], host_mac[2],
                           host_mac[3], host_mac[4], host_mac[5]);
@@ -962,7 +1047,7 @@ UIHostAction host_tile(int host_slot, VitaChiakiHost* host) {
   if (discovered && registered) {
     int num_mhosts = count_manual_hosts_of_console(host);
     if (num_mhosts == 1) {
-      vita2d_font_draw_text(font, x + 10, y + HOST_SLOT_H - 10, COLOR_WHITE, 20, "(1 manual remote host)");
+      text_cache_draw(x + 10, y + HOST_SLOT_H - 10, COLOR_WHITE, 20, "(1 manual remote host)");
     } else if (num_mhosts > 1) {
       vita2d_font_draw_textf(font, x + 10, y + HOST_SLOT_H - 10, COLOR_WHITE, 20, "(%d manual remote hosts)", num_mhosts);
     } else {
@@ -971,27 +1056,28 @@ UIHostAction host_tile(int host_slot, VitaChiakiHost* host) {
   }
 
   // Draw host address
-  vita2d_font_draw_text(font, x + 260, y + HOST_SLOT_H - 10, COLOR_WHITE, 20, host->hostname);
+  text_cache_draw(x + 260, y + HOST_SLOT_H - 10, COLOR_WHITE, 20, host->hostname);
 
-  vita2d_texture* console_img;
+  UISprite console_img;
   bool is_ps5 = chiaki_target_is_ps5(host->target);
   // TODO: Don't use separate textures for off/on/rest, use tinting instead
   if (added) {// && !discovered) {
-    console_img = is_ps5 ? img_ps5_off : img_ps4_off;
+    console_img = is_ps5 ? UI_SPRITE_PS5_OFF : UI_SPRITE_PS4_OFF;
   } else if (at_rest) {
-    console_img = is_ps5 ? img_ps5_rest : img_ps4_rest;
+    console_img = is_ps5 ? UI_SPRITE_PS5_REST : UI_SPRITE_PS4_REST;
   } else {
-    console_img = is_ps5 ? img_ps5 : img_ps4;
+    console_img = is_ps5 ? UI_SPRITE_PS5 : UI_SPRITE_PS4;
   }
-  vita2d_draw_texture(console_img, x + 64, y + 64);
+  sprite_draw(console_img, x + 64, y + 64, 1.0f, 1.0f, SPRITE_TINT_NONE);
+  sprite_flush();
   if (discovered && !at_rest) {
     const char* app_name = host->discovery_state->running_app_name;
     const char* app_id = host->discovery_state->running_app_titleid;
     // printf("%s", app_name);
     // printf("%s", app_id);
     if (app_name && app_id) {
-      vita2d_font_draw_text(font, x + 32, y + 16, COLOR_WHITE, 16, app_name);
-      vita2d_font_draw_text(font, x + 300, y + 170, COLOR_WHITE, 16, app_id);
+      text_cache_draw(x + 32, y + 16, COLOR_WHITE, 16, app_name);
+      text_cache_draw(x + 300, y + 170, COLOR_WHITE, 16, app_id);
     }
   }
 
@@ -1218,8 +1304,8 @@ UIScreenType draw_main_menu() {
             } else if (at_rest) {
               // Dormant console - wake and show waking screen
               LOGD("Waking dormant console...");
-              host_wakeup(context.active_host);
-              next_screen = UI_SCREEN_TYPE_WAKING;
+              if (host_wake_and_stream(context.active_host) == 0)
+                next_screen = UI_SCREEN_TYPE_WAKING;
             } else if (registered) {
               // Ready console - start streaming
               next_screen = UI_SCREEN_TYPE_STREAM;
@@ -1295,7 +1381,7 @@ UIScreenType draw_main_menu() {
   // VitaRPS5 UI control hints at bottom
   int hint_y = VITA_HEIGHT - 25;
   int hint_x = WAVE_NAV_WIDTH + 20;
-  vita2d_font_draw_text(font, hint_x, hint_y, UI_COLOR_TEXT_TERTIARY, 16,
+  text_cache_draw(hint_x, hint_y, UI_COLOR_TEXT_TERTIARY, 16,
     "D-Pad: Navigate | Cross: Connect/Wake | Square: Re-pair");
 
 
@@ -1361,7 +1447,7 @@ static void draw_settings_streaming_tab(int content_x, int content_y, int conten
 
   // Quality Preset dropdown
   draw_dropdown(content_x, y, content_w, item_h, "Quality Preset",
-                get_resolution_string(context.config.resolution),
+                context.config.auto_profile ? "Auto" : get_resolution_string(context.config.resolution),
                 false, settings_state.selected_item == 0);
   y += item_h + item_spacing;
 
@@ -1374,15 +1460,29 @@ static void draw_settings_streaming_tab(int content_x, int content_y, int conten
   // Auto Discovery toggle
   draw_toggle_switch(content_x + content_w - 70, y + (item_h - 30)/2, 60, 30,
                      context.config.auto_discovery, settings_state.selected_item == 2);
-  vita2d_font_draw_text(font, content_x + 15, y + item_h/2 + 6,
-                        UI_COLOR_TEXT_PRIMARY, FONT_SIZE_BODY, "Auto Discovery");
+  text_cache_draw(content_x + 15, y + item_h/2 + 6,
+                  UI_COLOR_TEXT_PRIMARY, FONT_SIZE_BODY, "Auto Discovery");
   y += item_h + item_spacing;
 
   // Show Latency toggle
   draw_toggle_switch(content_x + content_w - 70, y + (item_h - 30)/2, 60, 30,
                      context.config.show_latency, settings_state.selected_item == 3);
-  vita2d_font_draw_text(font, content_x + 15, y + item_h/2 + 6,
-                        UI_COLOR_TEXT_PRIMARY, FONT_SIZE_BODY, "Show Latency");
+  text_cache_draw(content_x + 15, y + item_h/2 + 6,
+                  UI_COLOR_TEXT_PRIMARY, FONT_SIZE_BODY, "Show Latency");
+  y += item_h + item_spacing;
+
+  // Stream stats overlay toggle
+  draw_toggle_switch(content_x + content_w - 70, y + (item_h - 30)/2, 60, 30,
+                     context.config.show_stream_stats, settings_state.selected_item == 4);
+  text_cache_draw(content_x + 15, y + item_h/2 + 6,
+                  UI_COLOR_TEXT_PRIMARY, FONT_SIZE_BODY, "Stream Stats Overlay");
+  y += item_h + item_spacing;
+
+  // Low power menus toggle
+  draw_toggle_switch(content_x + content_w - 70, y + (item_h - 30)/2, 60, 30,
+                     context.config.low_power_ui, settings_state.selected_item == 5);
+  text_cache_draw(content_x + 15, y + item_h/2 + 6,
+                  UI_COLOR_TEXT_PRIMARY, FONT_SIZE_BODY, "Low Power Menus");
 }
 
 /// Draw Controller Settings tab content
@@ -1401,15 +1501,15 @@ static void draw_settings_controller_tab(int content_x, int content_y, int conte
   // Button layout toggle (Circle vs Cross confirm)
   draw_toggle_switch(content_x + content_w - 70, y + (item_h - 30)/2, 60, 30,
                      context.config.circle_btn_confirm, settings_state.selected_item == 1);
-  vita2d_font_draw_text(font, content_x + 15, y + item_h/2 + 6,
-                        UI_COLOR_TEXT_PRIMARY, 16, "Circle Button Confirm");
+  text_cache_draw(content_x + 15, y + item_h/2 + 6,
+                  UI_COLOR_TEXT_PRIMARY, 16, "Circle Button Confirm");
   y += item_h + item_spacing;
 
   // TODO(PHASE2-STUB): Motion Controls - Not implemented
   draw_toggle_switch(content_x + content_w - 70, y + (item_h - 30)/2, 60, 30,
                      false, settings_state.selected_item == 2);
-  vita2d_font_draw_text(font, content_x + 15, y + item_h/2 + 6,
-                        UI_COLOR_TEXT_SECONDARY, 16, "Motion Controls (Stub)");
+  text_cache_draw(content_x + 15, y + item_h/2 + 6,
+                  UI_COLOR_TEXT_SECONDARY, 16, "Motion Controls (Stub)");
 }
 
 /// Main Settings screen rendering function
@@ -1426,7 +1526,7 @@ bool draw_settings() {
   int content_w = VITA_WIDTH - WAVE_NAV_WIDTH - 80;
 
   // Settings title (streaming settings only now)
-  vita2d_font_draw_text(font, content_x, 50, UI_COLOR_TEXT_PRIMARY, FONT_SIZE_HEADER, "Streaming Settings");
+  text_cache_draw(content_x, 50, UI_COLOR_TEXT_PRIMARY, FONT_SIZE_HEADER, "Streaming Settings");
 
   // Content area (no tabs needed - only one section)
   int tab_content_y = 90;
@@ -1439,13 +1539,13 @@ bool draw_settings() {
   // Control hints at bottom
   int hint_y = VITA_HEIGHT - 25;
   int hint_x = WAVE_NAV_WIDTH + 20;
-  vita2d_font_draw_text(font, hint_x, hint_y, UI_COLOR_TEXT_TERTIARY, FONT_SIZE_SMALL,
+  text_cache_draw(hint_x, hint_y, UI_COLOR_TEXT_TERTIARY, FONT_SIZE_SMALL,
     "Up/Down: Navigate | X: Toggle/Select | Circle: Back");
 
   // === INPUT HANDLING ===
 
   // No tab switching needed - only one section
-  int max_items = 4; // Streaming tab: Resolution, FPS, Auto Discovery, Show Latency
+  int max_items = 6; // Streaming tab: Resolution, FPS, Auto Discovery, Show Latency, Stream Stats Overlay, Low Power Menus
 
   // Up/Down: Navigate items
   if (btn_pressed(SCE_CTRL_UP)) {
@@ -1457,8 +1557,11 @@ bool draw_settings() {
   // X: Activate selected item (toggle or cycle dropdown)
   if (btn_pressed(SCE_CTRL_CROSS)) {
     if (settings_state.selected_item == 0) {
-          // Cycle resolution: 360p → 540p → 720p → 1080p → 360p
-          switch (context.config.resolution) {
+          // Cycle resolution: 360p → 540p → 720p → 1080p → Auto → 360p
+          if (context.config.auto_profile) {
+            context.config.auto_profile = false;
+            context.config.resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_360p;
+          } else switch (context.config.resolution) {
             case CHIAKI_VIDEO_RESOLUTION_PRESET_360p:
               context.config.resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_540p;
               break;
@@ -1470,7 +1573,8 @@ bool draw_settings() {
               break;
             case CHIAKI_VIDEO_RESOLUTION_PRESET_1080p:
             default:
-              context.config.resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_360p;
+              context.config.auto_profile = true;
+              context.config.resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_540p;
               break;
           }
           config_serialize(&context.config);
@@ -1487,6 +1591,14 @@ bool draw_settings() {
       // Show latency toggle
       context.config.show_latency = !context.config.show_latency;
       config_serialize(&context.config);
+    } else if (settings_state.selected_item == 4) {
+      // Stream stats overlay toggle
+      context.config.show_stream_stats = !context.config.show_stream_stats;
+      config_serialize(&context.config);
+    } else if (settings_state.selected_item == 5) {
+      // Low power menus toggle
+      context.config.low_power_ui = !context.config.low_power_ui;
+      config_serialize(&context.config);
     }
   }
 
@@ -1548,23 +1660,23 @@ static void draw_profile_card(int x, int y, int width, int height, bool selected
 
   // PSN Account ID
   const char* psn_id = context.config.psn_account_id ? context.config.psn_account_id : "Not Set";
-  vita2d_font_draw_text(font, content_x + icon_size + 20, content_y + 20,
-                        UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SUBHEADER, psn_id);
+  text_cache_draw(content_x + icon_size + 20, content_y + 20,
+                  UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SUBHEADER, psn_id);
 
   // PlayStation Network label
-  vita2d_font_draw_text(font, content_x + icon_size + 20, content_y + 42,
-                        UI_COLOR_TEXT_SECONDARY, FONT_SIZE_SMALL, "PlayStation Network");
+  text_cache_draw(content_x + icon_size + 20, content_y + 42,
+                  UI_COLOR_TEXT_SECONDARY, FONT_SIZE_SMALL, "PlayStation Network");
 
   // Divider line
   vita2d_draw_rectangle(content_x, content_y + 70, width - 40, 1,
                         RGBA8(0x50, 0x50, 0x50, 255));
 
   // "Account ID: xxxx" label at bottom
-  vita2d_font_draw_text(font, content_x, y + height - 30,
-                        UI_COLOR_TEXT_TERTIARY, FONT_SIZE_SMALL, "Account ID");
-  vita2d_font_draw_text(font, content_x, y + height - 12,
-                        UI_COLOR_TEXT_SECONDARY, FONT_SIZE_SMALL,
-                        psn_id);
+  text_cache_draw(content_x, y + height - 30,
+                  UI_COLOR_TEXT_TERTIARY, FONT_SIZE_SMALL, "Account ID");
+  text_cache_draw(content_x, y + height - 12,
+                  UI_COLOR_TEXT_SECONDARY, FONT_SIZE_SMALL,
+                  psn_id);
 }
 
 /// Draw connection info card (right side) - two-column layout
@@ -1583,15 +1695,15 @@ static void draw_connection_info_card(int x, int y, int width, int height, bool
   int col2_x = content_x + 120;  // Value column
 
   // Title
-  vita2d_font_draw_text(font, content_x, content_y, UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SUBHEADER,
-                        "Connection Information");
+  text_cache_draw(content_x, content_y, UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SUBHEADER,
+                  "Connection Information");
   content_y += 30;
 
   // Network Type
-  vita2d_font_draw_text(font, content_x, content_y, UI_COLOR_TEXT_SECONDARY, FONT_SIZE_SMALL,
-                        "Network Type");
-  vita2d_font_draw_text(font, col2_x, content_y, UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SMALL,
-                        "Local WiFi");
+  text_cache_draw(content_x, content_y, UI_COLOR_TEXT_SECONDARY, FONT_SIZE_SMALL,
+                  "Network Type");
+  text_cache_draw(col2_x, content_y, UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SMALL,
+                  "Local WiFi");
   content_y += line_h;
 
   // Console IP
@@ -1600,10 +1712,10 @@ static void draw_connection_info_card(int x, int y, int width, int height, bool
       context.active_host->discovery_state->host_addr) {
     console_ip = context.active_host->discovery_state->host_addr;
   }
-  vita2d_font_draw_text(font, content_x, content_y, UI_COLOR_TEXT_SECONDARY, FONT_SIZE_SMALL,
-                        "Console IP");
-  vita2d_font_draw_text(font, col2_x, content_y, UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SMALL,
-                        console_ip);
+  text_cache_draw(content_x, content_y, UI_COLOR_TEXT_SECONDARY, FONT_SIZE_SMALL,
+                  "Console IP");
+  text_cache_draw(col2_x, content_y, UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SMALL,
+                  console_ip);
   content_y += line_h;
 
   // Latency (if enabled)
@@ -1625,28 +1737,28 @@ static void draw_connection_info_card(int x, int y, int width, int height, bool
       }
     }
 
-    vita2d_font_draw_text(font, content_x, content_y, UI_COLOR_TEXT_SECONDARY, FONT_SIZE_SMALL,
-                          "Latency");
-    vita2d_font_draw_text(font, col2_x, content_y, latency_color, FONT_SIZE_SMALL,
-                          latency_text);
+    text_cache_draw(content_x, content_y, UI_COLOR_TEXT_SECONDARY, FONT_SIZE_SMALL,
+                    "Latency");
+    text_cache_draw(col2_x, content_y, latency_color, FONT_SIZE_SMALL,
+                    latency_text);
     content_y += line_h;
   }
 
   // Connection status
   bool is_connected = context.active_host != NULL;
   const char* connection_text = is_connected ? "Direct" : "None";
-  vita2d_font_draw_text(font, content_x, content_y, UI_COLOR_TEXT_SECONDARY, FONT_SIZE_SMALL,
-                        "Connection");
-  vita2d_font_draw_text(font, col2_x, content_y, UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SMALL,
-                        connection_text);
+  text_cache_draw(content_x, content_y, UI_COLOR_TEXT_SECONDARY, FONT_SIZE_SMALL,
+                  "Connection");
+  text_cache_draw(col2_x, content_y, UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SMALL,
+                  connection_text);
   content_y += line_h;
 
   // Remote Play status
   const char* remote_play = is_connected ? "Available" : "Unavailable";
-  vita2d_font_draw_text(font, content_x, content_y, UI_COLOR_TEXT_SECONDARY, FONT_SIZE_SMALL,
-                        "Remote Play");
-  vita2d_font_draw_text(font, col2_x, content_y, UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SMALL,
-                        remote_play);
+  text_cache_draw(content_x, content_y, UI_COLOR_TEXT_SECONDARY, FONT_SIZE_SMALL,
+                  "Remote Play");
+  text_cache_draw(col2_x, content_y, UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SMALL,
+                  remote_play);
   content_y += line_h;
 
   // Quality Setting
@@ -1656,10 +1768,10 @@ static void draw_connection_info_card(int x, int y, int width, int height, bool
   } else if (context.config.resolution == CHIAKI_VIDEO_RESOLUTION_PRESET_1080p) {
     quality_text = "1080p";
   }
-  vita2d_font_draw_text(font, content_x, content_y, UI_COLOR_TEXT_SECONDARY, FONT_SIZE_SMALL,
-                        "Quality Setting");
-  vita2d_font_draw_text(font, col2_x, content_y, UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SMALL,
-                        quality_text);
+  text_cache_draw(content_x, content_y, UI_COLOR_TEXT_SECONDARY, FONT_SIZE_SMALL,
+                  "Quality Setting");
+  text_cache_draw(col2_x, content_y, UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SMALL,
+                  quality_text);
 }
 
 /// Draw PSN Authentication section (bottom) - modern design with status indicators
@@ -1676,13 +1788,13 @@ static void draw_registration_section(int x, int y, int width, int height, bool
   int content_y = y + 25;
 
   // Title
-  vita2d_font_draw_text(font, content_x, content_y, UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SUBHEADER,
-                        "PSN Authentication");
+  text_cache_draw(content_x, content_y, UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SUBHEADER,
+                  "PSN Authentication");
   content_y += 30;
 
   // Description text
-  vita2d_font_draw_text(font, content_x, content_y, UI_COLOR_TEXT_SECONDARY, FONT_SIZE_SMALL,
-                        "Required for remote play on PS5 over local net.");
+  text_cache_draw(content_x, content_y, UI_COLOR_TEXT_SECONDARY, FONT_SIZE_SMALL,
+                  "Required for remote play on PS5 over local net.");
   content_y += 25;
 
   // Authentication status indicators
@@ -1691,9 +1803,9 @@ static void draw_registration_section(int x, int y, int width, int height, bool
 
   // Status indicator 1: Not authenticated (red X) or authenticated (green checkmark)
   draw_status_dot(content_x, content_y - 3, 6, authenticated ? STATUS_ACTIVE : STATUS_ERROR);
-  vita2d_font_draw_text(font, content_x + 15, content_y,
-                        authenticated ? RGBA8(0x4C, 0xAF, 0x50, 255) : RGBA8(0xF4, 0x43, 0x36, 255),
-                        FONT_SIZE_SMALL, authenticated ? "Authenticated" : "Not authenticated");
+  text_cache_draw(content_x + 15, content_y,
+                  authenticated ? RGBA8(0x4C, 0xAF, 0x50, 255) : RGBA8(0xF4, 0x43, 0x36, 255),
+                  FONT_SIZE_SMALL, authenticated ? "Authenticated" : "Not authenticated");
   content_y += 22;
 
   // "Add New" button
@@ -1705,15 +1817,15 @@ static void draw_registration_section(int x, int y, int width, int height, bool
   uint32_t btn_color = selected ? UI_COLOR_PRIMARY_BLUE : RGBA8(0x50, 0x70, 0xA0, 255);
   draw_rounded_rectangle(btn_x, btn_y, btn_w, btn_h, 6, btn_color);
 
-  int text_w = vita2d_font_text_width(font, FONT_SIZE_SMALL, "Add New");
-  vita2d_font_draw_text(font, btn_x + (btn_w - text_w) / 2, btn_y + btn_h / 2 + 5,
-                        UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SMALL, "Add New");
+  int text_w = text_cache_width(FONT_SIZE_SMALL, "Add New");
+  text_cache_draw(btn_x + (btn_w - text_w) / 2, btn_y + btn_h / 2 + 5,
+                  UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SMALL, "Add New");
 
   // Hint if selected
   if (selected) {
-    vita2d_font_draw_text(font, btn_x + btn_w + 15, btn_y + btn_h / 2 + 5,
-                          UI_COLOR_TEXT_TERTIARY, FONT_SIZE_SMALL,
-                          "Press X to register");
+    text_cache_draw(btn_x + btn_w + 15, btn_y + btn_h / 2 + 5,
+                    UI_COLOR_TEXT_TERTIARY, FONT_SIZE_SMALL,
+                    "Press X to register");
   }
 }
 
@@ -1731,7 +1843,7 @@ UIScreenType draw_profile_screen() {
   int content_w = VITA_WIDTH - WAVE_NAV_WIDTH - 80;
 
   // Title
-  vita2d_font_draw_text(font, content_x, 50, UI_COLOR_TEXT_PRIMARY, 26, "Profile & Connection");
+  text_cache_draw(content_x, 50, UI_COLOR_TEXT_PRIMARY, 26, "Profile & Connection");
 
   // Layout: Profile card (left), Connection info (right) - registration removed
   int card_spacing = 15;
@@ -1749,7 +1861,7 @@ UIScreenType draw_profile_screen() {
   // Control hints at bottom
   int hint_y = VITA_HEIGHT - 25;
   int hint_x = WAVE_NAV_WIDTH + 20;
-  vita2d_font_draw_text(font, hint_x, hint_y, UI_COLOR_TEXT_TERTIARY, 16,
+  text_cache_draw(hint_x, hint_y, UI_COLOR_TEXT_TERTIARY, 16,
     "Left/Right: Switch Card | Circle: Back");
 
   UIScreenType next_screen = UI_SCREEN_TYPE_PROFILE;
@@ -1914,26 +2026,26 @@ static void draw_controller_mappings_tab(int content_x, int content_y, int conte
   draw_card_with_shadow(content_x, selector_y, content_w, selector_h, 8, UI_COLOR_CARD_BG);
 
   // Left arrow
-  vita2d_font_draw_text(font, content_x + 30, selector_y + selector_h/2 + 8,
-                        UI_COLOR_PRIMARY_BLUE, FONT_SIZE_HEADER, "<");
+  text_cache_draw(content_x + 30, selector_y + selector_h/2 + 8,
+                  UI_COLOR_PRIMARY_BLUE, FONT_SIZE_HEADER, "<");
 
   // Scheme text (centered)
   char scheme_text[64];
   snprintf(scheme_text, sizeof(scheme_text), "Scheme %d: %s",
            context.config.controller_map_id, get_scheme_name(context.config.controller_map_id));
-  int text_w = vita2d_font_text_width(font, FONT_SIZE_SUBHEADER, scheme_text);
-  vita2d_font_draw_text(font, content_x + (content_w - text_w)/2, selector_y + selector_h/2 + 6,
-                        UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SUBHEADER, scheme_text);
+  int text_w = text_cache_width(FONT_SIZE_SUBHEADER, scheme_text);
+  text_cache_draw(content_x + (content_w - text_w)/2, selector_y + selector_h/2 + 6,
+                  UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SUBHEADER, scheme_text);
 
   // Right arrow
-  vita2d_font_draw_text(font, content_x + content_w - 50, selector_y + selector_h/2 + 8,
-                        UI_COLOR_PRIMARY_BLUE, FONT_SIZE_HEADER, ">");
+  text_cache_draw(content_x + content_w - 50, selector_y + selector_h/2 + 8,
+                  UI_COLOR_PRIMARY_BLUE, FONT_SIZE_HEADER, ">");
 
   // Hint below selector
   const char* hint = "Press Left/Right to cycle schemes";
-  int hint_w = vita2d_font_text_width(font, FONT_SIZE_SMALL, hint);
-  vita2d_font_draw_text(font, content_x + (content_w - hint_w)/2, selector_y + selector_h + 18,
-                        UI_COLOR_TEXT_TERTIARY, FONT_SIZE_SMALL, hint);
+  int hint_w = text_cache_width(FONT_SIZE_SMALL, hint);
+  text_cache_draw(content_x + (content_w - hint_w)/2, selector_y + selector_h + 18,
+                  UI_COLOR_TEXT_TERTIARY, FONT_SIZE_SMALL, hint);
 
   // Layout for mapping table and diagram (side by side)
   int panel_y = selector_y + selector_h + 35;
@@ -1945,16 +2057,16 @@ static void draw_controller_mappings_tab(int content_x, int content_y, int conte
   int table_x = content_x;
   draw_card_with_shadow(table_x, panel_y, panel_w, panel_h, 8, UI_COLOR_CARD_BG);
 
-  vita2d_font_draw_text(font, table_x + 15, panel_y + 30,
-                        UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SUBHEADER, "Button Mappings");
+  text_cache_draw(table_x + 15, panel_y + 30,
+                  UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SUBHEADER, "Button Mappings");
 
   // Table headers
   int row_y = panel_y + 55;
   int col1_x = table_x + 15;
   int col2_x = table_x + panel_w/2 + 10;
 
-  vita2d_font_draw_text(font, col1_x, row_y, UI_COLOR_TEXT_SECONDARY, FONT_SIZE_SMALL, "Vita");
-  vita2d_font_draw_text(font, col2_x, row_y, UI_COLOR_TEXT_SECONDARY, FONT_SIZE_SMALL, "PS5");
+  text_cache_draw(col1_x, row_y, UI_COLOR_TEXT_SECONDARY, FONT_SIZE_SMALL, "Vita");
+  text_cache_draw(col2_x, row_y, UI_COLOR_TEXT_SECONDARY, FONT_SIZE_SMALL, "PS5");
   row_y += 25;
 
   // Get mappings
@@ -1965,18 +2077,18 @@ static void draw_controller_mappings_tab(int content_x, int content_y, int conte
   // Draw first 8 mappings
   int row_spacing = 24;
   for (int i = 0; i < mapping_count && i < 8; i++) {
-    vita2d_font_draw_text(font, col1_x, row_y + (i * row_spacing),
-                          UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SMALL, mappings[i].vita_button);
-    vita2d_font_draw_text(font, col2_x, row_y + (i * row_spacing),
-                          UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SMALL, mappings[i].ps5_button);
+    text_cache_draw(col1_x, row_y + (i * row_spacing),
+                    UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SMALL, mappings[i].vita_button);
+    text_cache_draw(col2_x, row_y + (i * row_spacing),
+                    UI_COLOR_TEXT_PRIMARY, FONT_SIZE_SMALL, mappings[i].ps5_button);
   }
 
   // Vita diagram (right panel) - professional assets with white background
   int diagram_x = content_x + panel_w + panel_spacing;
   draw_card_with_shadow(diagram_x, panel_y, panel_w, panel_h, 8, RGBA8(255, 255, 255, 255));
 
-  vita2d_font_draw_text(font, diagram_x + 15, panel_y + 30,
-                        RGBA8(0, 0, 0, 255), FONT_SIZE_SUBHEADER, "Vita Layout");
+  text_cache_draw(diagram_x + 15, panel_y + 30,
+                  RGBA8(0, 0, 0, 255), FONT_SIZE_SUBHEADER, "Vita Layout");
 
   // Draw Vita Front diagram (centered in card)
   if (vita_front) {
@@ -2012,17 +2124,17 @@ static void draw_controller_settings_tab(int content_x, int content_y, int conte
   // Circle Button Confirm toggle
   draw_toggle_switch(content_x + content_w - 70, y + (item_h - 30)/2, 60, 30,
                      context.config.circle_btn_confirm, controller_state.selected_item == 0);
-  vita2d_font_draw_text(font, content_x + 15, y + item_h/2 + 6,
-                        UI_COLOR_TEXT_PRIMARY, FONT_SIZE_BODY, "Circle Button Confirm");
+  text_cache_draw(content_x + 15, y + item_h/2 + 6,
+                  UI_COLOR_TEXT_PRIMARY, FONT_SIZE_BODY, "Circle Button Confirm");
   y += item_h + item_spacing;
 
   // Motion Controls - requires gyro backend integration (Phase 4)
   draw_toggle_switch(content_x + content_w - 70, y + (item_h - 30)/2, 60, 30,
                      false, controller_state.selected_item == 1);
-  vita2d_font_draw_text(font, content_x + 15, y + item_h/2 + 6,
-                        UI_COLOR_TEXT_TERTIARY, FONT_SIZE_BODY, "Motion Controls");
-  vita2d_font_draw_text(font, content_x + content_w - 165, y + item_h/2 + 6,
-                        UI_COLOR_TEXT_TERTIARY, FONT_SIZE_SMALL, "(Coming Soon)");
+  text_cache_draw(content_x + 15, y + item_h/2 + 6,
+                  UI_COLOR_TEXT_TERTIARY, FONT_SIZE_BODY, "Motion Controls");
+  text_cache_draw(content_x + content_w - 165, y + item_h/2 + 6,
+                  UI_COLOR_TEXT_TERTIARY, FONT_SIZE_SMALL, "(Coming Soon)");
 }
 
 /// Main Controller Configuration screen with tabs
@@ -2038,7 +2150,7 @@ bool draw_controller_config_screen() {
   int content_w = VITA_WIDTH - WAVE_NAV_WIDTH - 80;
 
   // Controller title
-  vita2d_font_draw_text(font, content_x, 50, UI_COLOR_TEXT_PRIMARY, FONT_SIZE_HEADER, "Controller Configuration");
+  text_cache_draw(content_x, 50, UI_COLOR_TEXT_PRIMARY, FONT_SIZE_HEADER, "Controller Configuration");
 
   // Tab bar
   int tab_bar_y = 70;
@@ -2068,7 +2180,7 @@ bool draw_controller_config_screen() {
   const char* hints = (controller_state.current_tab == CONTROLLER_TAB_MAPPINGS) ?
     "L1/R1: Switch Tab | Left/Right: Change Scheme | Circle: Back" :
     "L1/R1: Switch Tab | Up/Down: Navigate | X: Toggle | Circle: Back";
-  vita2d_font_draw_text(font, hint_x, hint_y, UI_COLOR_TEXT_TERTIARY, FONT_SIZE_SMALL, hints);
+  text_cache_draw(hint_x, hint_y, UI_COLOR_TEXT_TERTIARY, FONT_SIZE_SMALL, hints);
 
   // === INPUT HANDLING ===
 
@@ -2195,10 +2307,10 @@ void render_pin_digit(int x, int y, uint32_t digit, bool is_current, bool has_va
   // Digit text or cursor
   if (has_value && digit <= 9) {
     char digit_text[2] = {'0' + digit, '\0'};
-    int text_w = vita2d_font_text_width(font, 40, digit_text);
+    int text_w = text_cache_width(40, digit_text);
     int text_x = x + (PIN_DIGIT_WIDTH / 2) - (text_w / 2);
     int text_y = y + (PIN_DIGIT_HEIGHT / 2) + 15;
-    vita2d_font_draw_text(font, text_x, text_y, UI_COLOR_TEXT_PRIMARY, 40, digit_text);
+    text_cache_draw(text_x, text_y, UI_COLOR_TEXT_PRIMARY, 40, digit_text);
   } else if (is_current && show_cursor) {
     // Blinking cursor
     int cursor_x = x + PIN_DIGIT_WIDTH / 2;
@@ -2226,8 +2338,8 @@ bool draw_registration_dialog() {
   draw_card_with_shadow(card_x, card_y, PIN_CARD_WIDTH, PIN_CARD_HEIGHT, 12, UI_COLOR_CARD_BG);
 
   // Title
-  vita2d_font_draw_text(font, card_x + 20, card_y + 50, UI_COLOR_TEXT_PRIMARY, 28,
-                        "PS5 Console Registration");
+  text_cache_draw(card_x + 20, card_y + 50, UI_COLOR_TEXT_PRIMARY, 28,
+                  "PS5 Console Registration");
 
   // Console info (name and IP)
   if (context.active_host) {
@@ -2256,12 +2368,12 @@ bool draw_registration_dialog() {
     } else {
       snprintf(console_info, sizeof(console_info), "%s", console_name);
     }
-    vita2d_font_draw_text(font, card_x + 20, card_y + 100, UI_COLOR_TEXT_SECONDARY, 20, console_info);
+    text_cache_draw(card_x + 20, card_y + 100, UI_COLOR_TEXT_SECONDARY, 20, console_info);
   }
 
   // Instructions
-  vita2d_font_draw_text(font, card_x + 20, card_y + 150, UI_COLOR_TEXT_PRIMARY, 20,
-                        "Enter the 8-digit session PIN displayed on your PS5:");
+  text_cache_draw(card_x + 20, card_y + 150, UI_COLOR_TEXT_PRIMARY, 20,
+                  "Enter the 8-digit session PIN displayed on your PS5:");
 
   // PIN digit boxes (centered in card)
   int pin_total_width = (PIN_DIGIT_WIDTH * PIN_DIGIT_COUNT) + (PIN_DIGIT_SPACING * (PIN_DIGIT_COUNT - 1));
@@ -2276,8 +2388,8 @@ bool draw_registration_dialog() {
   }
 
   // Navigation hints
-  vita2d_font_draw_text(font, card_x + 20, card_y + PIN_CARD_HEIGHT - 50, UI_COLOR_TEXT_SECONDARY, 18,
-                        "Left/Right: Move   Up/Down: Change digit   Cross: Confirm   Circle: Cancel");
+  text_cache_draw(card_x + 20, card_y + PIN_CARD_HEIGHT - 50, UI_COLOR_TEXT_SECONDARY, 18,
+                  "Left/Right: Move   Up/Down: Change digit   Cross: Confirm   Circle: Cancel");
 
   // Input handling
   if (btn_pressed(SCE_CTRL_LEFT)) {
@@ -2353,21 +2465,15 @@ UIScreenType draw_waking_screen() {
   if (elapsed > WAKING_TIMEOUT_MS) {
     // Timeout - reset and go back to main
     waking_start_time = 0;
+    host_wake_cancel();
     return UI_SCREEN_TYPE_MAIN;
   }
 
-  // Check if console woke up (became ready for streaming)
-  if (context.active_host) {
-    bool ready = (context.active_host->type & REGISTERED) &&
-                 !(context.active_host->discovery_state &&
-                   context.active_host->discovery_state->state == CHIAKI_DISCOVERY_HOST_STATE_STANDBY);
-
-    if (ready) {
-      // Console woke up! Reset state and start streaming
-      waking_start_time = 0;
-      host_stream(context.active_host);
-      return UI_SCREEN_TYPE_STREAM;
-    }
+  // Start streaming as soon as the console reports ready
+  int wake = host_wake_poll();
+  if (wake != 0) {
+    waking_start_time = 0;
+    return wake > 0 ? UI_SCREEN_TYPE_STREAM : UI_SCREEN_TYPE_MAIN;
   }
 
   // Draw waking screen
@@ -2388,13 +2494,13 @@ UIScreenType draw_waking_screen() {
 
   // Draw title
   const char* title = "Waking Up Console";
-  vita2d_font_draw_text(font, card_x + 30, card_y + 60, UI_COLOR_TEXT_PRIMARY, 28, title);
+  text_cache_draw(card_x + 30, card_y + 60, UI_COLOR_TEXT_PRIMARY, 28, title);
 
   // Draw console name if available
   if (context.active_host && context.active_host->hostname) {
     char console_text[128];
     snprintf(console_text, sizeof(console_text), "Console: %s", context.active_host->hostname);
-    vita2d_font_draw_text(font, card_x + 30, card_y + 100, UI_COLOR_TEXT_SECONDARY, 20, console_text);
+    text_cache_draw(card_x + 30, card_y + 100, UI_COLOR_TEXT_SECONDARY, 20, console_text);
   }
 
   // Animate dots (simple animation: 0, 1, 2, 3 dots cycling)
@@ -2407,7 +2513,7 @@ UIScreenType draw_waking_screen() {
 
   char status_text[64];
   snprintf(status_text, sizeof(status_text), "Please wait%s", dots);
-  vita2d_font_draw_text(font, card_x + 30, card_y + 150, UI_COLOR_TEXT_PRIMARY, 22, status_text);
+  text_cache_draw(card_x + 30, card_y + 150, UI_COLOR_TEXT_PRIMARY, 22, status_text);
 
   // Draw timeout progress bar
   int progress_w = card_w - 60;
@@ -2427,11 +2533,12 @@ UIScreenType draw_waking_screen() {
   int remaining_sec = (WAKING_TIMEOUT_MS - elapsed) / 1000;
   char timeout_text[32];
   snprintf(timeout_text, sizeof(timeout_text), "Timeout in %d seconds", remaining_sec);
-  vita2d_font_draw_text(font, card_x + 30, card_y + card_h - 30, UI_COLOR_TEXT_SECONDARY, 18, timeout_text);
+  text_cache_draw(card_x + 30, card_y + card_h - 30, UI_COLOR_TEXT_SECONDARY, 18, timeout_text);
 
   // Circle to cancel
   if (btn_pressed(SCE_CTRL_CIRCLE)) {
     waking_start_time = 0;
+    host_wake_cancel();
     return UI_SCREEN_TYPE_MAIN;
   }
 
@@ -2446,12 +2553,18 @@ bool draw_messages() {
 
   // initialize mlog_line_offset
   if (!context.ui_state.mlog_last_update) context.ui_state.mlog_line_offset = -1;
-  if (context.ui_state.mlog_last_update != context.mlog->last_update) {
-    context.ui_state.mlog_last_update = context.mlog->last_update;
+  uint64_t mlog_last_update = __atomic_load_n(&context.mlog->last_update, __ATOMIC_RELAXED);
+  if (context.ui_state.mlog_last_update != mlog_last_update) {
+    context.ui_state.mlog_last_update = mlog_last_update;
     context.ui_state.mlog_line_offset = -1;
   }
 
 
+  // writers may append while drawing, so stick to the lines present now
+  uint32_t mlog_first, mlog_count;
+  message_log_range(context.mlog, &mlog_first, &mlog_count);
+  int mlog_lines = mlog_count;
+
   int w = VITA_WIDTH;
   int h = VITA_HEIGHT;
 
@@ -2464,11 +2577,11 @@ bool draw_messages() {
   // compute lines to print
   // TODO enable scrolling etc
   int max_lines = (h - top_margin - bottom_margin) / line_height;
-  bool overflow = (context.mlog->lines > max_lines);
+  bool overflow = (mlog_lines > max_lines);
 
   int max_line_offset = 0;
   if (overflow) {
-    max_line_offset = context.mlog->lines - max_lines + 1;
+    max_line_offset = mlog_lines - max_lines + 1;
   } else {
     max_line_offset = 0;
     context.ui_state.mlog_line_offset = -1;
@@ -2499,22 +2612,24 @@ bool draw_messages() {
     i_y ++;
   }
 
+  char line[MLOG_LINE_LEN + 1];
   int j;
-  for (j = line_offset; j < context.mlog->lines; j++) {
+  for (j = line_offset; j < mlog_lines; j++) {
     if (i_y > max_lines - 1) break;
     if (overflow && (i_y == max_lines - 1)) {
-      if (j < context.mlog->lines - 1) break;
+      if (j < mlog_lines - 1) break;
     }
+    get_message_log_line(context.mlog, mlog_first + j, line, sizeof(line));
     vita2d_font_draw_text(font_mono, left_margin, y,
                           COLOR_WHITE, font_size,
-                          get_message_log_line(context.mlog, j)
+                          line
                           );
     y += line_height;
     i_y ++;
   }
-  if (overflow && (j < context.mlog->lines - 1)) {
+  if (overflow && (j < mlog_lines - 1)) {
     char note[100];
-    int lines_below = context.mlog->lines - j - 1;
+    int lines_below = mlog_lines - j - 1;
     if (lines_below == 1) {
       snprintf(note, 100, "<%d line below>", lines_below);
     } else {
@@ -2560,15 +2675,31 @@ bool draw_messages() {
   return true;
 }
 
-void init_ui() {
+void ui_start_loading() {
   vita2d_init();
   vita2d_set_clear_color(RGBA8(0x40, 0x40, 0x40, 0xFF));
-  load_textures();
-  init_particles();  // Initialize VitaRPS5 particle background
-  font = vita2d_load_font_file("app0:/assets/fonts/Roboto-Regular.ttf");
-  font_mono = vita2d_load_font_file("app0:/assets/fonts/RobotoMono-Regular.ttf");
   vita2d_set_vblank_wait(true);
 
+  // Show the background color right away, the rest is drawn as soon as it is loaded
+  vita2d_start_drawing();
+  vita2d_clear_screen();
+  vita2d_draw_rectangle(0, 0, VITA_WIDTH, VITA_HEIGHT, UI_COLOR_BACKGROUND);
+  vita2d_end_drawing();
+  vita2d_swap_buffers();
+
+  assets.threaded = chiaki_mutex_init(&assets.mutex, false) == CHIAKI_ERR_SUCCESS;
+  if (assets.threaded && chiaki_thread_create(&assets.thread, load_assets, NULL) == CHIAKI_ERR_SUCCESS) {
+    chiaki_thread_set_name(&assets.thread, "Vitaki Asset Loader");
+    return;
+  }
+  if (assets.threaded) chiaki_mutex_fini(&assets.mutex);
+  assets.threaded = false;
+  load_assets(NULL);
+}
+
+void init_ui() {
+  init_particles();  // Initialize VitaRPS5 particle background
+
   // Initialize touch screen
   sceTouchSetSamplingState(SCE_TOUCH_PORT_FRONT, SCE_TOUCH_SAMPLING_STATE_START);
   sceTouchSetSamplingState(SCE_TOUCH_PORT_BACK, SCE_TOUCH_SAMPLING_STATE_START);
@@ -2581,6 +2712,16 @@ void init_ui() {
   cancel_btn_str  = context.config.circle_btn_confirm ? "Cross" : "Circle";
 }
 
+void ui_invalidate() {
+  ui_invalidations++;
+}
+
+/// Whether the screen has to be drawn every frame, because it animates or handles input on its own
+static bool screen_always_redraws(UIScreenType screen) {
+  return screen == UI_SCREEN_TYPE_REGISTER_HOST || screen == UI_SCREEN_TYPE_MESSAGES ||
+         screen == UI_SCREEN_TYPE_STREAM || screen == UI_SCREEN_TYPE_WAKING;
+}
+
 /// Main UI loop
 void draw_ui() {
   init_ui();
@@ -2590,9 +2731,36 @@ void draw_ui() {
 
   UIScreenType screen = UI_SCREEN_TYPE_MAIN;
 
+  // The menus stay static between events, so only draw when input, a discovery update,
+  // an animation tick or the heartbeat asks for it and otherwise keep the last frame on screen
+  UIScreenType drawn_screen = screen;
+  uint32_t drawn_invalidations = ui_invalidations;
+  bool was_streaming = context.stream.is_streaming;
+  int settle_frames = UI_SETTLE_FRAMES;
+  int frames_since_draw = UI_ANIMATION_TICK_FRAMES;
+  uint64_t last_draw_us = 0;
+  uint64_t idle_start_us = 0;
+  uint32_t idle_polls = 0;
+
   load_psn_id_if_needed();
 
   while (true) {
+    // the input thread reads the controls and the video callback presents while streaming,
+    // so the loop skips its per-vblank input, asset and item work until the stream has quit
+    if (context.stream.is_streaming) {
+      if (!idle_polls)
+        idle_start_us = sceKernelGetProcessTimeWide();
+      idle_polls++;
+      sceKernelDelayThread(UI_STREAMING_POLL_US);
+      continue;
+    }
+    if (idle_polls) {
+      uint64_t idle_ms = (sceKernelGetProcessTimeWide() - idle_start_us) / 1000;
+      LOGD("UI idled for %llu ms while streaming, %u wakeups instead of about %llu vblanks",
+           (unsigned long long)idle_ms, idle_polls, (unsigned long long)(idle_ms * 60 / 1000));
+      idle_polls = 0;
+    }
+
     // Always read controller input - input thread uses Ext2 variant to access controller independently
     if (!sceCtrlReadBufferPositive(0, &ctrl, 1)) {
       // Try again...
@@ -2605,6 +2773,8 @@ void draw_ui() {
     // Get current touch state
     sceTouchPeek(SCE_TOUCH_PORT_FRONT, &(context.ui_state.touch_state_front), 1);
 
+    install_assets();
+
 
       // handle invalid items
       int this_active_item = context.ui_state.next_active_item;
@@ -2630,8 +2800,32 @@ void draw_ui() {
         context.ui_state.next_active_item = -1;
       }
 
+      uint64_t now_us = sceKernelGetProcessTimeWide();
+      frames_since_draw++;
+      bool touching = context.ui_state.touch_state_front.reportNum > 0;
+      uint32_t invalidations = ui_invalidations;
+      if (context.ui_state.button_state || context.ui_state.old_button_state || touching ||
+          invalidations != drawn_invalidations || screen != drawn_screen ||
+          context.stream.is_streaming != was_streaming) {
+        settle_frames = UI_SETTLE_FRAMES;
+      }
+      drawn_invalidations = invalidations;
+      was_streaming = context.stream.is_streaming;
+      bool animation_tick = !context.config.low_power_ui && frames_since_draw >= UI_ANIMATION_TICK_FRAMES;
+      bool redraw = settle_frames > 0 || animation_tick || screen_always_redraws(screen) ||
+                    now_us - last_draw_us >= UI_HEARTBEAT_US;
+
       // Skip ALL rendering when streaming - match ywnico pattern
-      if (!context.stream.is_streaming) {
+      if (!context.stream.is_streaming && redraw) {
+        if (settle_frames > 0) settle_frames--;
+        // paused particles must not jump by the whole pause once they run again
+        particle_steps = context.config.low_power_ui ? 0 :
+                         frames_since_draw < UI_ANIMATION_TICK_FRAMES ? frames_since_draw : UI_ANIMATION_TICK_FRAMES;
+        frames_since_draw = 0;
+        last_draw_us = now_us;
+        drawn_screen = screen;
+        text_cache_next_frame();
+
         vita2d_start_drawing();
         vita2d_clear_screen();
 
@@ -2658,8 +2852,10 @@ void draw_ui() {
                                          RGBA8(255, 255, 255, 128));
         }
 
-        // Render the current screen
-        if (screen == UI_SCREEN_TYPE_MAIN) {
+        // Render the current screen, once there is a font to draw it with
+        if (assets.installed < UI_ASSETS_FONTS) {
+          // still loading, the background is all there is
+        } else if (screen == UI_SCREEN_TYPE_MAIN) {
           screen = draw_main_menu();
         } else if (screen == UI_SCREEN_TYPE_REGISTER_HOST) {
           context.ui_state.next_active_item = (UI_MAIN_WIDGET_TEXT_INPUT | 0);
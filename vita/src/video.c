@@ -18,27 +18,37 @@
  */
 
 #include "video.h"
+#include "audio.h"
 #include "context.h"
+#include "power.h"
+#include "mem_layout.h"
+#include "latency_probe.h"
 
 #include <h264-bitstream/h264_stream.h>
 
 #include <chiaki/thread.h>
+#include <chiaki/time.h>
+#include <chiaki/video.h>
+#include <chiaki/trace.h>
 
 #include <stdbool.h>
 #include <psp2/kernel/sysmem.h>
 #include <psp2/kernel/threadmgr.h>
 #include <psp2/display.h>
+#include <psp2/gxm.h>
 #include <psp2/videodec.h>
 #include <vita2d.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <malloc.h>
 #include <string.h>
 
 #include <stdarg.h>
 
-void draw_streaming(vita2d_texture *frame_texture);
 void draw_fps();
 void draw_indicators();
+void draw_stream_stats();
+static void draw_reconnecting();
 
 enum {
   VITA_VIDEO_INIT_OK                    = 0,
@@ -55,10 +65,43 @@ enum {
 #define AU_BUF_SIZE(STREAM_WIDTH, STREAM_HEIGHT) (STREAM_WIDTH*STREAM_HEIGHT*3/2/2)
 #define DECODE_AU_ALIGNMENT (0x100)
 
-static char* decoder_buffer = NULL;
+static char* decoder_buffers[CHIAKI_VIDEO_FRAME_SLOTS] = { NULL };
+static size_t decoder_buffer_sizes[CHIAKI_VIDEO_FRAME_SLOTS] = { 0 };
+static size_t decoder_buffer_next = 0;
 static char* header_buf = NULL;
 static size_t header_buf_size;
 
+// Low latency decoder profile: every SPS is rewritten to allow no reordering, so the decoder
+// outputs each picture from the sceAvcdecDecode() call that decoded it, and the number of
+// reference frames is taken from the SPS the host sent (for the next setup at the same resolution).
+static bool low_latency_decoder = false;
+static int decoder_ref_frames = REF_FRAMES;
+static int sps_ref_frames = 0; // 0 if not known yet
+static int sps_ref_frames_width = 0;
+static int sps_ref_frames_height = 0;
+// decoded AUs, and of those the ones that produced no picture (held by the decoder or broken)
+static uint32_t decoder_frames = 0;
+static uint32_t decoder_frames_no_output = 0;
+
+// The host repeats the same SPS with every IDR, so its rewrite is only redone when it changes
+#define SPS_CACHE_SIZE 256
+static uint8_t sps_cache_in[SPS_CACHE_SIZE];
+static int sps_cache_in_size = 0; // 0 if nothing is cached
+static uint8_t sps_cache_out[SPS_CACHE_SIZE];
+static int sps_cache_out_size = 0;
+
+// Decoder latency test: streams alternate between the plain and the rewritten SPS, every AU is
+// tagged with its index as pts, and output pictures are matched back to when their AU was submitted.
+#define DECODE_DELAY_SLOTS 32
+static bool decoder_latency_test = false;
+static uint32_t decoder_latency_test_streams = 0;
+static uint64_t decode_submit_us[DECODE_DELAY_SLOTS];
+static uint32_t decode_delay_samples = 0;
+static uint64_t decode_delay_us_sum = 0;
+static uint32_t decode_delay_us_max = 0;
+static uint32_t decode_delay_frames_sum = 0; // AUs submitted after the one that came out
+static uint32_t decode_delay_frames_max = 0;
+
 enum {
   SCREEN_WIDTH = 960,
   SCREEN_HEIGHT = 544,
@@ -77,7 +120,32 @@ enum VideoStatus {
   INIT_FRAME_PACER_THREAD,
 };
 
+// Decoder output textures, frame_texture is the one displayed last.
+// Everything below up to frame_texture is protected by present_mtx.
+static vita2d_texture *frame_textures[FRAME_TEXTURES] = { NULL };
+// number of the scene that last sampled each texture, 0 if none
+static uint64_t frame_texture_scenes[FRAME_TEXTURES] = { 0 };
+static bool frame_texture_queued[FRAME_TEXTURES] = { false };
+// scenes submitted/whose vita2d_swap_buffers() returned. vita2d allows only one pending swap,
+// so once swap n returned, scene n - 1 has finished rendering and the textures it sampled can be reused.
+static uint64_t scenes_submitted = 0;
+static uint64_t scenes_swapped = 0;
+
+// decoded frames (texture indices) waiting for the display thread, oldest first
+#define PRESENT_QUEUE_SIZE (FRAME_TEXTURES - 2)
+static int present_queue[PRESENT_QUEUE_SIZE];
+static size_t present_queue_count = 0;
+static uint32_t present_dropped = 0;
+static ChiakiMutex present_mtx;
+static ChiakiCond present_cond;
+static bool active_display_thread = false;
+static ChiakiThread display_thread;
+
 vita2d_texture *frame_texture = NULL;
+// decoder writes YUV420 with interleaved chroma (1.5 bytes/pixel) that the GPU converts when sampling
+static bool output_yuv420 = false;
+// decoded frames are already in the display's format and size, so they can be set as the framebuffer
+static bool direct_display = false;
 enum VideoStatus video_status = NOT_INIT;
 
 SceAvcdecCtrl *decoder = NULL;
@@ -86,7 +154,6 @@ SceUID decoderblock = -1;
 SceUID videodecblock = -1;
 SceUID videodecUnmap = -1;
 SceUIntVAddr videodecContext = 0;
-SceUID pacer_thread = -1;
 SceAvcdecQueryDecoderInfo *decoder_info = NULL;
 
 typedef struct {
@@ -97,13 +164,21 @@ typedef struct {
 
 static unsigned numframes;
 static bool active_video_thread = true;
-static bool active_pacer_thread = false;
 static indicator_status poor_net_indicator = {0};
+// no frames arrive while the session reconnects, so the last one is presented again this often to show the notice
+#define RECONNECTING_REDRAW_US 250000
+static bool stream_reconnecting = false;  // protected by present_mtx
 
-uint32_t frame_count = 0;
-uint32_t need_drop = 0;
+// anything drawn on top of the video, which means frames have to be composited with vita2d
+static bool overlays_visible() {
+  return poor_net_indicator.activated || context.config.show_stream_stats || stream_reconnecting;
+}
+
+// frames presented/vblanks in the last second
 uint32_t curr_fps[2] = {0, 0};
-float carry = 0;
+// frames presented and seconds with any frame presented since setup, for the average
+static uint32_t stream_presented = 0;
+static uint32_t stream_seconds = 0;
 
 typedef struct {
   unsigned int texture_width;
@@ -114,9 +189,26 @@ typedef struct {
   float region_y1;
   float region_x2;
   float region_y2;
+  // the GPU scales the texture by these when drawing, 1 if the decoder already scaled it to the screen
+  float scale_x;
+  float scale_y;
 } image_scaling_settings;
 
+// scaling of the stream that is decoded now, only written by setup and the decoding thread
 static image_scaling_settings image_scaling = {0};
+// resolution that is decoded now, and the one the decoder and textures were sized for at setup
+static int stream_width = 0;
+static int stream_height = 0;
+static unsigned int frame_texture_alloc_width = 0;
+static unsigned int frame_texture_alloc_height = 0;
+// scaling each texture was decoded with, and whether it may be scanned out as is, set when queued
+static image_scaling_settings frame_texture_scaling[FRAME_TEXTURES];
+static bool frame_texture_direct[FRAME_TEXTURES];
+static uint64_t frame_texture_queued_us[FRAME_TEXTURES];
+// held back before presenting, to keep video in sync with audio, see ChiakiAVSync
+static uint64_t av_sync_video_delay_us = 0;
+
+static void draw_streaming(vita2d_texture *frame_texture, const image_scaling_settings *scaling);
 
 void update_scaling_settings(int width, int height) {
   image_scaling.texture_width = SCREEN_WIDTH;
@@ -127,6 +219,8 @@ void update_scaling_settings(int width, int height) {
   image_scaling.region_y1 = 0;
   image_scaling.region_x2 = image_scaling.texture_width;
   image_scaling.region_y2 = image_scaling.texture_height;
+  image_scaling.scale_x = 1;
+  image_scaling.scale_y = 1;
 
   double scaled_width = (double) SCREEN_HEIGHT * width / height;
   double scaled_height = (double) SCREEN_WIDTH * height / width;
@@ -160,6 +254,22 @@ void update_scaling_settings(int width, int height) {
     }
   }
 
+  // Decoding e.g. 360p at its own size writes less than half the pixels of the screen. The texture unit then
+  // filters it up and, for YUV420, converts it in the same pass the frame is drawn with anyway.
+  unsigned int decode_width = VITA_DECODER_RESOLUTION(width);
+  unsigned int decode_height = VITA_DECODER_RESOLUTION(height);
+  if (context.config.gpu_upscale
+      && decode_width < image_scaling.texture_width && decode_height < image_scaling.texture_height) {
+    image_scaling.scale_x = (float) image_scaling.texture_width / decode_width;
+    image_scaling.scale_y = (float) image_scaling.texture_height / decode_height;
+    image_scaling.texture_width = decode_width;
+    image_scaling.texture_height = decode_height;
+    image_scaling.region_x1 /= image_scaling.scale_x;
+    image_scaling.region_y1 /= image_scaling.scale_y;
+    image_scaling.region_x2 /= image_scaling.scale_x;
+    image_scaling.region_y2 /= image_scaling.scale_y;
+  }
+
   LOGD("update_scaling_settings: width = %u\n", width);
   LOGD("update_scaling_settings: height = %u\n", height);
   LOGD("update_scaling_settings: scaled_width = %f\n", scaled_width);
@@ -172,86 +282,293 @@ void update_scaling_settings(int width, int height) {
   LOGD("update_scaling_settings: image_scaling.region_y1 = %f\n", image_scaling.region_y1);
   LOGD("update_scaling_settings: image_scaling.region_x2 = %f\n", image_scaling.region_x2);
   LOGD("update_scaling_settings: image_scaling.region_y2 = %f\n", image_scaling.region_y2);
+  LOGD("update_scaling_settings: image_scaling.scale_x = %f\n", image_scaling.scale_x);
+  LOGD("update_scaling_settings: image_scaling.scale_y = %f\n", image_scaling.scale_y);
+}
+
+// Must be called with present_mtx locked
+static void present_queue_pop(int *texture) {
+  *texture = present_queue[0];
+  frame_texture_queued[*texture] = false;
+  for (size_t i = 1; i < present_queue_count; i++)
+    present_queue[i - 1] = present_queue[i];
+  present_queue_count--;
+}
+
+// Must be called with present_mtx locked
+static void present_queue_drop_oldest() {
+  int texture;
+  present_queue_pop(&texture);
+  present_dropped++;
+}
+
+// Must be called with present_mtx locked
+static bool frame_texture_free(int i) {
+  return !frame_texture_queued[i] && (!frame_texture_scenes[i] || frame_texture_scenes[i] < scenes_swapped);
 }
 
-static int vita_pacer_thread_main(SceSize args, void *argp) {
-  // 1s
-  int wait = 1000000;
-  //float max_fps = 0;
-  //sceDisplayGetRefreshRate(&max_fps);
-  //if (config.stream.fps == 30) {
-  //  max_fps /= 2;
-  //}
-  int max_fps = context.stream.fps; // bug?
-  uint64_t last_vblank_count = sceDisplayGetVcount();
+/**
+ * Get a texture that is neither waiting to be presented nor possibly still sampled by the GPU.
+ * If all of them are waiting, the oldest pending frame is dropped.
+ * Never waits for the GPU, so the caller (the takion thread) is not blocked by rendering.
+ *
+ * @param present set to false if the frame must not be presented because only a texture
+ * that may still be sampled was left (can not happen with FRAME_TEXTURES >= 3)
+ * @return index in frame_textures
+ */
+static int acquire_decode_texture(bool *present) {
+  int r = -1;
+  *present = true;
+  chiaki_mutex_lock(&present_mtx);
+  while (r < 0) {
+    for (int i = 0; i < FRAME_TEXTURES; i++) {
+      if (frame_texture_free(i)) {
+        r = i;
+        break;
+      }
+    }
+    if (r >= 0 || present_queue_count == 0)
+      break;
+    present_queue_drop_oldest();
+  }
+  if (r < 0) {
+    // the decoder must still get every frame for its references, take the least recently sampled texture
+    r = 0;
+    for (int i = 1; i < FRAME_TEXTURES; i++) {
+      if (frame_texture_scenes[i] < frame_texture_scenes[r])
+        r = i;
+    }
+    *present = false;
+    LOGD("VIDEO: no free output texture, frame is not presented");
+  }
+  chiaki_mutex_unlock(&present_mtx);
+  return r;
+}
+
+static void present_queue_push(int texture) {
+  size_t limit = context.stream.latency_profile.video_present_queue;
+  if (!limit || limit > PRESENT_QUEUE_SIZE)
+    limit = PRESENT_QUEUE_SIZE;
+  chiaki_mutex_lock(&present_mtx);
+  while (present_queue_count >= limit)
+    present_queue_drop_oldest();
+  present_queue[present_queue_count++] = texture;
+  frame_texture_queued[texture] = true;
+  frame_texture_scaling[texture] = image_scaling;
+  frame_texture_direct[texture] = direct_display;
+  frame_texture_queued_us[texture] = sceKernelGetSystemTimeWide();
+  chiaki_mutex_unlock(&present_mtx);
+  chiaki_cond_broadcast(&present_cond);
+}
+
+// Must be called with present_mtx locked
+static uint64_t present_delay_remaining_us(int texture) {
+  if (!av_sync_video_delay_us)
+    return 0;
+  uint64_t due = frame_texture_queued_us[texture] + av_sync_video_delay_us;
+  uint64_t now = sceKernelGetSystemTimeWide();
+  return now < due ? due - now : 0;
+}
+
+/**
+ * Scan out a decoded RGBA texture as it is, starting with the next vblank.
+ * Returns once the display uses it, so the previously set texture can be reused afterwards,
+ * same as after vita2d_swap_buffers().
+ */
+static void display_set_texture(vita2d_texture *texture) {
+  SceDisplayFrameBuf framebuf = {0};
+  framebuf.size = sizeof(framebuf);
+  framebuf.base = vita2d_texture_get_datap(texture);
+  framebuf.pitch = vita2d_texture_get_stride(texture) / 4;
+  framebuf.pixelformat = SCE_DISPLAY_PIXELFORMAT_A8B8G8R8;
+  framebuf.width = SCREEN_WIDTH;
+  framebuf.height = SCREEN_HEIGHT;
+  int ret = sceDisplaySetFrameBuf(&framebuf, SCE_DISPLAY_SETBUF_NEXTFRAME);
+  if (ret < 0) {
+    LOGD("sceDisplaySetFrameBuf 0x%x\n", ret);
+    return;
+  }
+  sceDisplayWaitSetFrameBuf();
+}
+
+// Presents decoded frames, which is the only place vita2d is used while streaming.
+// Lowest latency: present the newest frame as soon as it is decoded, dropping older ones.
+// The display picks up the new framebuffer on the next vblank.
+// Smoothest: on every vblank (sceDisplayWaitVblankStart), present the oldest frame once
+// a whole frame interval has passed, so frames are shown for equally many vblanks.
+// If no frame is ready, the last one is held.
+// Either way, a frame is not presented before the A/V sync video delay has passed since it was decoded.
+// With direct_display, frames are set as the framebuffer without any GPU work,
+// unless an overlay has to be drawn on top.
+static void *vita_display_thread_main(void *user) {
+  VitaChiakiFramePacing pacing = context.config.frame_pacing;
+  int fps = context.config.fps > 0 ? (int)context.config.fps : 60;
+  int vblanks_per_frame = fps < 60 ? 60 / fps : 1;
+  int vblanks = 0;
+  bool scanning_out_texture = false;
+  int last_texture = -1;
+  uint64_t reconnecting_drawn_us = 0;
+
+  uint32_t presented = 0;
+  uint32_t last_dropped = 0;
+  int last_vblank_count = sceDisplayGetVcount();
   uint64_t last_check_time = sceKernelGetSystemTimeWide();
-  //float carry = 0;
-  need_drop = 0;
-  frame_count = 0;
-  while (active_pacer_thread) {
-    uint64_t curr_vblank_count = sceDisplayGetVcount();
-    uint32_t vblank_fps = curr_vblank_count - last_vblank_count;
-    uint32_t curr_frame_count = frame_count;
-    frame_count = 0;
-
-    if (!active_video_thread) {
-    //  carry = 0;
-    LOGD("thread inactive");
+
+  chiaki_mutex_lock(&present_mtx);
+  while (active_display_thread) {
+    int texture = -1;
+    ChiakiAVSyncState av_sync;
+    chiaki_session_get_av_sync(&context.stream.session, &av_sync);
+    av_sync_video_delay_us = av_sync.video_delay_us;
+    if (pacing == FRAME_PACING_SMOOTHEST) {
+      chiaki_mutex_unlock(&present_mtx);
+      sceDisplayWaitVblankStart();
+      chiaki_mutex_lock(&present_mtx);
+      if (vblanks < vblanks_per_frame)
+        vblanks++;
+      if (vblanks >= vblanks_per_frame && present_queue_count > 0 && !present_delay_remaining_us(present_queue[0])) {
+        present_queue_pop(&texture);
+        vblanks = 0;
+      }
     } else {
-      if (/*config.enable_frame_pacer*/false && curr_frame_count > max_fps) {
-        //carry += curr_frame_count - max_fps;
-        //if (carry > 1) {
-        //  need_drop += (int)carry;
-        //  carry -= (int)carry;
-        //}
-        need_drop += curr_frame_count - max_fps;
+      if (present_queue_count == 0)
+        chiaki_cond_timedwait(&present_cond, &present_mtx, 100);
+      while (present_queue_count > 1)
+        present_queue_drop_oldest();
+      if (present_queue_count > 0) {
+        uint64_t delay_us = present_delay_remaining_us(present_queue[0]);
+        if (delay_us) {
+          chiaki_mutex_unlock(&present_mtx);
+          sceKernelDelayThread((SceUInt)delay_us);
+          chiaki_mutex_lock(&present_mtx);
+        } else {
+          present_queue_pop(&texture);
+        }
+      }
+    }
+
+    bool repeat = false;
+    if (texture < 0 && stream_reconnecting && last_texture >= 0) {
+      uint64_t now_us = sceKernelGetSystemTimeWide();
+      if (now_us - reconnecting_drawn_us >= RECONNECTING_REDRAW_US) {
+        texture = last_texture;
+        repeat = true;
+        reconnecting_drawn_us = now_us;
       }
-      LOGD("fps0/fps1/carry/need_drop: %u/%u/%f/%u\n",
-                    curr_frame_count, vblank_fps, carry, need_drop);
     }
 
-    curr_fps[0] = curr_frame_count;
-    curr_fps[1] = vblank_fps;
+    if (texture >= 0 && active_video_thread) {
+      last_texture = texture;
+      bool reconnecting = stream_reconnecting;
+      frame_texture = frame_textures[texture];
+      frame_texture_scenes[texture] = ++scenes_submitted;
+      image_scaling_settings scaling = frame_texture_scaling[texture];
+      bool direct = frame_texture_direct[texture] && !overlays_visible();
+      chiaki_mutex_unlock(&present_mtx);
+
+      if (direct != scanning_out_texture) {
+        // let pending flips finish, so a flip queued by vita2d can not override ours and the
+        // texture scanned out last is not reused while the display still reads it
+        vita2d_wait_rendering_done();
+        sceGxmDisplayQueueFinish();
+        scanning_out_texture = direct;
+      }
+      CHIAKI_TRACE(VIDEO_PRESENT, PRESENT_BEGIN, texture);
+      if (direct) {
+        display_set_texture(frame_texture);
+      } else {
+        vita2d_start_drawing();
+        draw_streaming(frame_texture, &scaling);
+        if (context.config.show_stream_stats)
+          draw_stream_stats();
+        if (reconnecting)
+          draw_reconnecting();
+        // draw_fps();
+        // draw_indicators();
+        vita2d_end_drawing();
+        vita2d_swap_buffers();
+      }
+      CHIAKI_TRACE(VIDEO_PRESENT, PRESENT_END, direct);
+      if (!repeat) {
+        chiaki_session_latency_stamp(&context.stream.session, CHIAKI_LATENCY_STAMP_DISPLAYED);
+        presented++;
+      }
 
-    last_vblank_count = curr_vblank_count;
-    uint64_t curr_check_time = sceKernelGetSystemTimeWide();
-    uint32_t lapse = curr_check_time - last_check_time;
-    last_check_time = curr_check_time;
-    if (lapse > wait && (lapse - wait) < wait) {
-      LOGD("sleep: %d wait: %d lapse: %d", wait * 2 - lapse, wait, lapse);
-      sceKernelDelayThread(wait * 2 - lapse);
-    } else {
-      sceKernelDelayThread(wait);
+      chiaki_mutex_lock(&present_mtx);
+      scenes_swapped++;
+      chiaki_cond_broadcast(&present_cond);
+    }
+
+    uint64_t now = sceKernelGetSystemTimeWide();
+    if (now - last_check_time >= 1000000) {
+      int vblank_count = sceDisplayGetVcount();
+      curr_fps[0] = presented;
+      curr_fps[1] = vblank_count - last_vblank_count;
+      if (present_dropped != last_dropped)
+        LOGD("VIDEO: presented %u frames in %u vblanks, dropped %u", curr_fps[0], curr_fps[1], present_dropped - last_dropped);
+      last_dropped = present_dropped;
+      last_vblank_count = vblank_count;
+      last_check_time = now;
+      if (presented) {
+        stream_presented += presented;
+        stream_seconds++;
+      }
+      presented = 0;
     }
   }
-  return 0;
+  chiaki_mutex_unlock(&present_mtx);
+
+  if (scanning_out_texture) {
+    // hand the display back to vita2d before the textures are freed
+    vita2d_start_drawing();
+    vita2d_clear_screen();
+    vita2d_end_drawing();
+    vita2d_swap_buffers();
+    vita2d_wait_rendering_done();
+    sceGxmDisplayQueueFinish();
+  }
+
+  ChiakiThreadStats stats;
+  if (chiaki_thread_get_self_stats(&stats) == CHIAKI_ERR_SUCCESS)
+    LOGD("Thread %-18s %llu ms CPU, affinity 0x%05X", "display",
+      (unsigned long long)(stats.cpu_us / 1000), stats.cpu_affinity_mask);
+  return NULL;
 }
 
 ChiakiMutex mtx;
 
-bool threadSetupComplete = false;
+static void decoder_drain();
 
 void vita_h264_cleanup() {
 	if (video_status == INIT_FRAME_PACER_THREAD) {
-		// active_pacer_thread = false;
-		// // wait 10sec
-		// SceUInt timeout = 10000000;
-		// int ret;
-		// sceKernelWaitThreadEnd(pacer_thread, &ret, &timeout);
-		// sceKernelDeleteThread(pacer_thread);
+		chiaki_mutex_lock(&present_mtx);
+		active_display_thread = false;
+		chiaki_mutex_unlock(&present_mtx);
+		chiaki_cond_broadcast(&present_cond);
+		chiaki_thread_join(&display_thread, NULL);
+		chiaki_cond_fini(&present_cond);
+		chiaki_mutex_fini(&present_mtx);
+		stream_reconnecting = false;
 		video_status--;
 	}
 
 	if (video_status == INIT_AVC_DEC) {
+		if (low_latency_decoder)
+			decoder_drain();
+		if (decoder_frames_no_output)
+			LOGD("VIDEO: %u of %u decoded frames produced no picture\n", decoder_frames_no_output, decoder_frames);
+		if (decoder_latency_test && decode_delay_samples)
+			LOGD("VIDEO: latency test, SPS rewrite %s: decode to output avg %llu us max %u us, held avg %u.%02u max %u frames (%u pictures)\n",
+				low_latency_decoder ? "on" : "off",
+				(unsigned long long)(decode_delay_us_sum / decode_delay_samples), decode_delay_us_max,
+				decode_delay_frames_sum / decode_delay_samples, decode_delay_frames_sum * 100 / decode_delay_samples % 100,
+				decode_delay_frames_max, decode_delay_samples);
 		sceAvcdecDeleteDecoder(decoder);
 		video_status--;
 	}
 
 	if (video_status == INIT_DECODER_MEMBLOCK) {
-		if (decoderblock >= 0) {
-			sceKernelFreeMemBlock(decoderblock);
-			decoderblock = -1;
-		}
+		// decoderblock stays reserved for the next stream
 		if (decoder != NULL) {
 			free(decoder);
 			decoder = NULL;
@@ -265,42 +582,25 @@ void vita_h264_cleanup() {
 
 	if (video_status == INIT_AVC_LIB) {
 
+		// the library context memory stays reserved for the next stream
 		sceVideodecTermLibrary(SCE_VIDEODEC_TYPE_HW_AVCDEC);
-
-		if (videodecContext != 0) {
-			sceCodecEngineFreeMemoryFromUnmapMemBlock(videodecUnmap, videodecContext);
-			videodecContext = 0;
-		}
-
-		if (videodecUnmap != -1) {
-			sceCodecEngineCloseUnmapMemBlock(videodecUnmap);
-			videodecUnmap = -1;
-		}
-
-		if (videodecblock != -1) {
-			sceKernelFreeMemBlock(videodecblock);
-			videodecblock = -1;
-		}
-
 		video_status--;
 	}
 
 	if (video_status == INIT_FRAMEBUFFER) {
-		if (frame_texture != NULL) {
-			vita2d_free_texture(frame_texture);
-			frame_texture = NULL;
-		}
-
-		if (decoder_buffer != NULL) {
-			free(decoder_buffer);
-			decoder_buffer = NULL;
-		}
+		// the textures and AU buffers stay reserved for the next stream, which must not reinit
+		// a texture the GPU may still sample
+		vita2d_wait_rendering_done();
+		frame_texture = NULL;
+		decoder_buffer_next = 0;
+		free(header_buf);
+		header_buf = NULL;
+		header_buf_size = 0;
 		video_status--;
 	}
 
 	if (video_status == INIT_GS) {
 		// gs_sps_stop();
-    threadSetupComplete = false;
 		video_status--;
 	}
 
@@ -326,20 +626,552 @@ struct SceAvcdecPicture picture = {0};
 struct SceAvcdecPicture *pictures = { &picture };
 
 
+// Decoder, AU and texture memory outlives the streams: vita_h264_reserve() sets it up for the largest
+// stream at app start and every vita_h264_setup() reuses it, only growing it if a stream needs more.
+// Connecting again thus neither allocates CDRAM nor fragments it.
+// Each buffer is placed as video_mem_layout says, see resolve_mem_layout().
+static VitaMemLayout video_mem_layout = { { MEM_PLACEMENT_CDRAM, MEM_PLACEMENT_CDRAM, MEM_PLACEMENT_CDRAM } };
+static SceUInt32 videodec_reserved_size = 0;
+static SceUInt32 decoder_reserved_size = 0;
+static void *decoder_reserved_base = NULL;
+static bool frame_textures_reserved = false;
+static VitaChiakiMemPlacement frame_textures_placement = MEM_PLACEMENT_CDRAM;
+
+// CDRAM held by the memblocks above and the frame textures, as far as they are placed there
+#define TRACKED_MEMBLOCKS 4
+static struct { SceUID block; SceSize size; bool cdram; } tracked_memblocks[TRACKED_MEMBLOCKS] = { 0 };
+static uint32_t cdram_bytes = 0;
+static uint32_t cdram_bytes_peak = 0;
+static uint32_t cdram_allocs = 0;
+
+static void cdram_account(int32_t size) {
+  cdram_bytes += size;
+  if (size > 0) {
+    cdram_allocs++;
+    if (cdram_bytes > cdram_bytes_peak)
+      cdram_bytes_peak = cdram_bytes;
+  }
+}
+
+// size must be a multiple of mem_placement_granularity()
+static SceUID alloc_video_memblock(const char *name, SceSize size, VitaChiakiMemPlacement placement, SceKernelAllocMemBlockOpt *opt) {
+  SceUID block = sceKernelAllocMemBlock(name, mem_placement_memblock_type(placement), size, opt);
+  if (block < 0)
+    return block;
+  for (size_t i = 0; i < TRACKED_MEMBLOCKS; i++) {
+    if (!tracked_memblocks[i].size) {
+      tracked_memblocks[i].block = block;
+      tracked_memblocks[i].size = size;
+      tracked_memblocks[i].cdram = placement == MEM_PLACEMENT_CDRAM;
+      if (tracked_memblocks[i].cdram)
+        cdram_account(size);
+      break;
+    }
+  }
+  return block;
+}
+
+static void free_video_memblock(SceUID block) {
+  for (size_t i = 0; i < TRACKED_MEMBLOCKS; i++) {
+    if (tracked_memblocks[i].size && tracked_memblocks[i].block == block) {
+      if (tracked_memblocks[i].cdram)
+        cdram_account(-(int32_t)tracked_memblocks[i].size);
+      tracked_memblocks[i].size = 0;
+      break;
+    }
+  }
+  sceKernelFreeMemBlock(block);
+}
+
+void vita_video_get_mem_stats(VitaVideoMemStats *stats) {
+  stats->cdram = cdram_bytes;
+  stats->cdram_peak = cdram_bytes_peak;
+  stats->cdram_allocs = cdram_allocs;
+  stats->au_buffers = 0;
+  for (size_t i = 0; i < CHIAKI_VIDEO_FRAME_SLOTS; i++)
+    stats->au_buffers += decoder_buffer_sizes[i];
+}
+
+static void release_videodec_memory() {
+  if (videodecContext > 0)
+    sceCodecEngineFreeMemoryFromUnmapMemBlock(videodecUnmap, videodecContext);
+  videodecContext = 0;
+  if (videodecUnmap >= 0)
+    sceCodecEngineCloseUnmapMemBlock(videodecUnmap);
+  videodecUnmap = -1;
+  if (videodecblock >= 0)
+    free_video_memblock(videodecblock);
+  videodecblock = -1;
+  videodec_reserved_size = 0;
+}
+
+// Make sure the decoder library has at least size bytes of context memory
+static int reserve_videodec_memory(SceUInt32 size) {
+  VitaChiakiMemPlacement placement = video_mem_layout.placement[VIDEO_BUFFER_VIDEODEC];
+  size = ROUND_UP(ROUND_UP(size, 256 * 1024), mem_placement_granularity(placement));
+  if (videodec_reserved_size >= size)
+    return 0;
+  release_videodec_memory();
+  LOGD("VIDEO: reserving 0x%x bytes of decoder library memory in %s\n", size, mem_placement_name(placement));
+
+  SceKernelAllocMemBlockOpt opt;
+  sceClibMemset(&opt, 0, sizeof(SceKernelAllocMemBlockOpt));
+  opt.size = sizeof(SceKernelAllocMemBlockOpt);
+  opt.attr = 4;
+  opt.alignment = 256 * 1024;
+  void *mem;
+  int ret;
+
+  videodecblock = alloc_video_memblock("videodec", size, placement, &opt);
+  if (videodecblock < 0) {
+    sceClibPrintf("videodecblock: 0x%08x\n", videodecblock);
+    goto error;
+  }
+
+  ret = sceKernelGetMemBlockBase(videodecblock, &mem);
+  if (ret < 0) {
+    sceClibPrintf("sceKernelGetMemBlockBase: 0x%x\n", ret);
+    goto error;
+  }
+
+  videodecUnmap = sceCodecEngineOpenUnmapMemBlock(mem, size);
+  if (videodecUnmap < 0) {
+    sceClibPrintf("sceCodecEngineOpenUnmapMemBlock: 0x%x\n", videodecUnmap);
+    goto error;
+  }
+
+  videodecContext = sceCodecEngineAllocMemoryFromUnmapMemBlock(videodecUnmap, size, 256 * 1024);
+  if (videodecContext <= 0) {
+    sceClibPrintf("sceCodecEngineAllocMemoryFromUnmapMemBlock: 0x%x\n", videodecContext);
+    goto error;
+  }
+
+  videodec_reserved_size = size;
+  return 0;
+
+error:
+  release_videodec_memory();
+  return VITA_VIDEO_ERROR_INIT_LIB;
+}
+
+static void release_decoder_memory() {
+  if (decoderblock >= 0)
+    free_video_memblock(decoderblock);
+  decoderblock = -1;
+  decoder_reserved_size = 0;
+  decoder_reserved_base = NULL;
+}
+
+// Make sure the decoder has a block of at least size bytes for its frames
+static int reserve_decoder_memory(SceUInt32 size) {
+  if (decoder_reserved_size >= size)
+    return 0;
+  release_decoder_memory();
+  VitaChiakiMemPlacement placement = video_mem_layout.placement[VIDEO_BUFFER_DECODER];
+  size = ROUND_UP(size, mem_placement_granularity(placement));
+  LOGD("VIDEO: reserving 0x%x bytes of decoder frame memory in %s\n", size, mem_placement_name(placement));
+
+  SceKernelAllocMemBlockOpt opt;
+  sceClibMemset(&opt, 0, sizeof(SceKernelAllocMemBlockOpt));
+  opt.size = sizeof(SceKernelAllocMemBlockOpt);
+  opt.attr = 4;
+  opt.alignment = 1024 * 1024;
+  decoderblock = alloc_video_memblock("decoder", size, placement, &opt);
+  if (decoderblock < 0) {
+    LOGD("decoderblock: 0x%08x\n", decoderblock);
+    decoderblock = -1;
+    return VITA_VIDEO_ERROR_ALLOC_MEM;
+  }
+
+  int ret = sceKernelGetMemBlockBase(decoderblock, &decoder_reserved_base);
+  if (ret < 0) {
+    LOGD("sceKernelGetMemBlockBase: 0x%x\n", ret);
+    release_decoder_memory();
+    return VITA_VIDEO_ERROR_GET_MEMBASE;
+  }
+  decoder_reserved_size = size;
+  return 0;
+}
+
+/**
+ * The frame textures are allocated once as RGBA at the screen size, which is the largest any stream
+ * decodes into, and reinitialized for each stream by init_frame_texture().
+ */
+static int reserve_frame_textures() {
+  if (frame_textures_reserved)
+    return 0;
+  frame_textures_placement = video_mem_layout.placement[VIDEO_BUFFER_TEXTURES];
+  // every other texture of the app stays in CDRAM
+  vita2d_texture_set_alloc_memblock_type(mem_placement_memblock_type(frame_textures_placement));
+  for (size_t i = 0; i < FRAME_TEXTURES; i++) {
+    frame_textures[i] = vita2d_create_empty_texture_format(SCREEN_WIDTH, SCREEN_HEIGHT, SCE_GXM_TEXTURE_FORMAT_U8U8U8U8_ABGR);
+    if (frame_textures[i] == NULL) {
+      vita2d_texture_set_alloc_memblock_type(SCE_KERNEL_MEMBLOCK_TYPE_USER_CDRAM_RW);
+      LOGD("not enough memory4\n");
+      for (size_t j = 0; j < i; j++) {
+        vita2d_free_texture(frame_textures[j]);
+        frame_textures[j] = NULL;
+      }
+      return VITA_VIDEO_ERROR_NO_MEM;
+    }
+  }
+  vita2d_texture_set_alloc_memblock_type(SCE_KERNEL_MEMBLOCK_TYPE_USER_CDRAM_RW);
+  frame_textures_reserved = true;
+  if (frame_textures_placement == MEM_PLACEMENT_CDRAM) {
+    for (size_t i = 0; i < FRAME_TEXTURES; i++)
+      cdram_account(vita2d_texture_get_stride(frame_textures[i]) * vita2d_texture_get_height(frame_textures[i]));
+  }
+  return 0;
+}
+
+// Only while no stream is set up, so the GPU is done with them once rendering is
+static void release_frame_textures() {
+  if (!frame_textures_reserved)
+    return;
+  vita2d_wait_rendering_done();
+  for (size_t i = 0; i < FRAME_TEXTURES; i++) {
+    if (frame_textures_placement == MEM_PLACEMENT_CDRAM)
+      cdram_account(-(int32_t)(vita2d_texture_get_stride(frame_textures[i]) * vita2d_texture_get_height(frame_textures[i])));
+    vita2d_free_texture(frame_textures[i]);
+    frame_textures[i] = NULL;
+  }
+  frame_textures_reserved = false;
+}
+
+/**
+ * Point a reserved texture at a frame of the given size. For YUV420, the memory holds a two-plane YUV420
+ * texture with BT.709 conversion done by the texture unit, which needs 1.5 instead of 4 bytes per pixel.
+ */
+static bool init_frame_texture(vita2d_texture *texture, unsigned int width, unsigned int height) {
+  if (width > SCREEN_WIDTH || height > SCREEN_HEIGHT)
+    return false;
+  int ret = sceGxmTextureInitLinear(&texture->gxm_tex, vita2d_texture_get_datap(texture),
+      output_yuv420 ? SCE_GXM_TEXTURE_FORMAT_YUV420P2_CSC1 : SCE_GXM_TEXTURE_FORMAT_U8U8U8U8_ABGR, width, height, 0);
+  if (ret < 0) {
+    LOGD("sceGxmTextureInitLinear 0x%x\n", ret);
+    return false;
+  }
+  // reinitializing resets the filters, bilinear for frames the GPU scales up, texels map 1:1 otherwise anyway
+  vita2d_texture_set_filters(texture, SCE_GXM_TEXTURE_FILTER_LINEAR, SCE_GXM_TEXTURE_FILTER_LINEAR);
+  return true;
+}
+
+static bool reserve_au_buffer(size_t i, size_t size) {
+  if (decoder_buffer_sizes[i] >= size)
+    return true;
+  free(decoder_buffers[i]);
+  decoder_buffer_sizes[i] = 0;
+  decoder_buffers[i] = memalign(DECODE_AU_ALIGNMENT, ROUND_UP(size, DECODE_AU_ALIGNMENT));
+  if (decoder_buffers[i] == NULL)
+    return false;
+  decoder_buffer_sizes[i] = ROUND_UP(size, DECODE_AU_ALIGNMENT);
+  return true;
+}
+
+static int query_videodec_size(SceVideodecQueryInitInfo *init, int width, int height, int ref_frames, SceUInt32 *size) {
+  sceClibMemset(&init->hwAvc, 0, sizeof(SceVideodecQueryInitInfoHwAvcdec));
+  init->hwAvc.size = sizeof(SceVideodecQueryInitInfoHwAvcdec);
+  init->hwAvc.horizontal = VITA_DECODER_RESOLUTION(width);
+  init->hwAvc.vertical = VITA_DECODER_RESOLUTION(height);
+  init->hwAvc.numOfStreams = 1;
+  init->hwAvc.numOfRefFrames = ref_frames;
+
+  SceVideodecMemInfo mem_info;
+  int ret = sceVideodecQueryMemSize(SCE_VIDEODEC_TYPE_HW_AVCDEC, init, &mem_info);
+  if (ret < 0) {
+    sceClibPrintf("sceVideodecQueryMemSize 0x%x\n", ret);
+    return VITA_VIDEO_ERROR_INIT_LIB;
+  }
+  *size = mem_info.memSize;
+  return 0;
+}
+
+static int init_videodec_library(SceVideodecQueryInitInfo *init) {
+  SceVideodecCtrl lib_ctrl;
+  sceClibMemset(&lib_ctrl, 0, sizeof(SceVideodecCtrl));
+  lib_ctrl.vaContext = videodecContext;
+  lib_ctrl.contextSize = videodec_reserved_size;
+  int ret = sceVideodecInitLibraryWithUnmapMem(SCE_VIDEODEC_TYPE_HW_AVCDEC, &lib_ctrl, init);
+  if (ret < 0) {
+    LOGD("sceVideodecInitLibrary 0x%x\n", ret);
+    return VITA_VIDEO_ERROR_INIT_LIB;
+  }
+  return 0;
+}
+
+// Needs the library to be initialized
+static int query_decoder_size(SceAvcdecQueryDecoderInfo *info, SceUInt32 *size) {
+  SceAvcdecDecoderInfo info_out = {0};
+  int ret = sceAvcdecQueryDecoderMemSize(SCE_VIDEODEC_TYPE_HW_AVCDEC, info, &info_out);
+  if (ret < 0) {
+    LOGD("sceAvcdecQueryDecoderMemSize 0x%x size 0x%x\n", ret, info_out.frameMemSize);
+    return VITA_VIDEO_ERROR_QUERY_DEC_MEMSIZE;
+  }
+  *size = info_out.frameMemSize;
+  return 0;
+}
+
+// Decoded frames and GPU draws per layout in the memory layout benchmark
+#define MEM_BENCH_FRAMES 60
+#define MEM_BENCH_DRAWS 30
+#define MEM_BENCH_AU_SIZE 0x1000
+
+// Decode the benchmark stream into the frame textures, timing only the frames after the intra one
+static bool bench_decode(SceAvcdecCtrl *ctrl, uint32_t *decode_us) {
+  uint8_t *buf = memalign(DECODE_AU_ALIGNMENT, MEM_BENCH_AU_SIZE);
+  if (buf == NULL)
+    return false;
+  SceAvcdecAu bench_au = {0};
+  bench_au.dts.lower = 0xFFFFFFFF;
+  bench_au.dts.upper = 0xFFFFFFFF;
+  bench_au.pts.lower = 0xFFFFFFFF;
+  bench_au.pts.upper = 0xFFFFFFFF;
+  struct SceAvcdecPicture bench_picture = {0};
+  struct SceAvcdecPicture *bench_pictures = &bench_picture;
+  SceAvcdecArrayPicture bench_array = {0};
+  bench_array.numOfElm = 1;
+  bench_array.pPicture = &bench_pictures;
+  bench_picture.size = sizeof(bench_picture);
+  bench_picture.frame.pixelType = SCE_AVCDEC_PIXELFORMAT_RGBA8888;
+  bench_picture.frame.framePitch = SCREEN_WIDTH;
+  bench_picture.frame.frameWidth = SCREEN_WIDTH;
+  bench_picture.frame.frameHeight = SCREEN_HEIGHT;
+
+  bool ok = true;
+  uint32_t outputs = 0;
+  uint64_t elapsed_us = 0;
+  for (unsigned int frame = 0; ok && frame <= MEM_BENCH_FRAMES; frame++) {
+    bench_au.es.pBuf = buf;
+    bench_au.es.size = mem_layout_bench_au(buf, MEM_BENCH_AU_SIZE, SCREEN_WIDTH / 16, SCREEN_HEIGHT / 16, frame);
+    bench_picture.frame.pPicture[0] = vita2d_texture_get_datap(frame_textures[frame % FRAME_TEXTURES]);
+    uint64_t start_us = sceKernelGetSystemTimeWide();
+    ok = bench_au.es.size && sceAvcdecDecode(ctrl, &bench_au, &bench_array) >= 0;
+    if (frame)
+      elapsed_us += sceKernelGetSystemTimeWide() - start_us;
+    outputs += bench_array.numOfOutput;
+  }
+  if (ok && sceAvcdecDecodeStop(ctrl, &bench_array) >= 0)
+    outputs += bench_array.numOfOutput;
+  free(buf);
+  *decode_us = (uint32_t)(elapsed_us / MEM_BENCH_FRAMES);
+  return ok && outputs > 0;
+}
+
+// Draw the frame textures full screen into the back buffer, which the next UI frame clears again
+static uint32_t bench_sample() {
+  vita2d_wait_rendering_done();
+  uint64_t start_us = sceKernelGetSystemTimeWide();
+  vita2d_start_drawing();
+  for (size_t i = 0; i < MEM_BENCH_DRAWS; i++)
+    vita2d_draw_texture(frame_textures[i % FRAME_TEXTURES], 0, 0);
+  vita2d_end_drawing();
+  vita2d_wait_rendering_done();
+  return (uint32_t)((sceKernelGetSystemTimeWide() - start_us) / MEM_BENCH_DRAWS);
+}
+
+// Reserve the decoder and texture memory of the largest stream as layout says and decode and draw into it
+static VitaMemLayoutScore benchmark_mem_layout(const VitaMemLayout *layout) {
+  VitaMemLayoutScore score = {0};
+  release_videodec_memory();
+  release_decoder_memory();
+  release_frame_textures();
+  video_mem_layout = *layout;
+
+  SceVideodecQueryInitInfo init;
+  SceUInt32 size;
+  int ret = query_videodec_size(&init, SCREEN_WIDTH, SCREEN_HEIGHT, REF_FRAMES, &size);
+  if (ret == 0)
+    ret = reserve_videodec_memory(size);
+  if (ret == 0)
+    ret = reserve_frame_textures();
+  if (ret == 0)
+    ret = init_videodec_library(&init);
+  if (ret != 0)
+    return score;
+
+  SceAvcdecQueryDecoderInfo info = {0};
+  info.horizontal = init.hwAvc.horizontal;
+  info.vertical = init.hwAvc.vertical;
+  info.numOfRefFrames = init.hwAvc.numOfRefFrames;
+  ret = query_decoder_size(&info, &size);
+  if (ret == 0)
+    ret = reserve_decoder_memory(size);
+  if (ret == 0) {
+    SceAvcdecCtrl ctrl = {0};
+    ctrl.frameBuf.size = size;
+    ctrl.frameBuf.pBuf = decoder_reserved_base;
+    if (sceAvcdecCreateDecoder(SCE_VIDEODEC_TYPE_HW_AVCDEC, &ctrl, &info) >= 0) {
+      score.valid = bench_decode(&ctrl, &score.decode_us);
+      sceAvcdecDeleteDecoder(&ctrl);
+    }
+  }
+  sceVideodecTermLibrary(SCE_VIDEODEC_TYPE_HW_AVCDEC);
+  if (score.valid)
+    score.sample_us = bench_sample();
+  LOGD("VIDEO: memory layout videodec %s, decoder %s, textures %s: %s, decode %u us, sample %u us\n",
+       mem_placement_name(layout->placement[VIDEO_BUFFER_VIDEODEC]),
+       mem_placement_name(layout->placement[VIDEO_BUFFER_DECODER]),
+       mem_placement_name(layout->placement[VIDEO_BUFFER_TEXTURES]),
+       score.valid ? "valid" : "invalid", score.decode_us, score.sample_us);
+  return score;
+}
+
+static uint32_t mem_layout_cost_us(const VitaMemLayoutScore *score) {
+  return score->decode_us + score->sample_us;
+}
+
+/**
+ * Starting from everything in CDRAM, try every placement of one buffer after the other and keep the
+ * fastest valid one. The buffers barely influence each other, so this needs far fewer runs than every
+ * combination would.
+ *
+ * @return false if not even everything in CDRAM worked, best is all CDRAM then
+ */
+static bool benchmark_mem_layouts(VitaMemLayout *best) {
+  for (size_t i = 0; i < VIDEO_BUFFER_COUNT; i++)
+    best->placement[i] = MEM_PLACEMENT_CDRAM;
+  VitaMemLayoutScore best_score = benchmark_mem_layout(best);
+  for (size_t buffer = 0; buffer < VIDEO_BUFFER_COUNT; buffer++) {
+    for (int placement = MEM_PLACEMENT_CDRAM; placement < MEM_PLACEMENT_COUNT; placement++) {
+      if (placement == best->placement[buffer])
+        continue;
+      VitaMemLayout layout = *best;
+      layout.placement[buffer] = (VitaChiakiMemPlacement)placement;
+      VitaMemLayoutScore score = benchmark_mem_layout(&layout);
+      if (score.valid && (!best_score.valid || mem_layout_cost_us(&score) < mem_layout_cost_us(&best_score))) {
+        *best = layout;
+        best_score = score;
+      }
+    }
+  }
+  // leave nothing of the last run reserved, vita_h264_reserve() starts over with the result
+  release_videodec_memory();
+  release_decoder_memory();
+  release_frame_textures();
+  return best_score.valid;
+}
+
+/**
+ * The configured placement of each buffer, or for the ones left on auto, the fastest layout measured
+ * on this device and firmware. It is benchmarked on the first start and whenever the firmware changes.
+ */
+static void resolve_mem_layout() {
+  VitaChiakiMemPlacement configured[VIDEO_BUFFER_COUNT] = {
+    [VIDEO_BUFFER_VIDEODEC] = context.config.mem_videodec,
+    [VIDEO_BUFFER_DECODER] = context.config.mem_decoder,
+    [VIDEO_BUFFER_TEXTURES] = context.config.mem_textures,
+  };
+  bool any_auto = false;
+  for (size_t i = 0; i < VIDEO_BUFFER_COUNT; i++)
+    any_auto |= configured[i] == MEM_PLACEMENT_AUTO;
+
+  VitaMemLayout measured = { { MEM_PLACEMENT_CDRAM, MEM_PLACEMENT_CDRAM, MEM_PLACEMENT_CDRAM } };
+  if (any_auto && !mem_layout_load(&measured)) {
+    LOGD("VIDEO: benchmarking memory layouts for this device\n");
+    // a failed run is not saved, so the next start measures again
+    if (benchmark_mem_layouts(&measured) && !mem_layout_save(&measured))
+      LOGE("VIDEO: failed to save the memory layout to %s", MEM_LAYOUT_FILENAME);
+  }
+  for (size_t i = 0; i < VIDEO_BUFFER_COUNT; i++)
+    video_mem_layout.placement[i] = configured[i] == MEM_PLACEMENT_AUTO ? measured.placement[i] : configured[i];
+  LOGD("VIDEO: memory layout videodec %s, decoder %s, textures %s\n",
+       mem_placement_name(video_mem_layout.placement[VIDEO_BUFFER_VIDEODEC]),
+       mem_placement_name(video_mem_layout.placement[VIDEO_BUFFER_DECODER]),
+       mem_placement_name(video_mem_layout.placement[VIDEO_BUFFER_TEXTURES]));
+}
+
+int vita_h264_reserve() {
+  if (video_status != NOT_INIT)
+    return 0;
+  resolve_mem_layout();
+  SceVideodecQueryInitInfo init;
+  SceUInt32 size;
+  int ret = query_videodec_size(&init, SCREEN_WIDTH, SCREEN_HEIGHT, REF_FRAMES, &size);
+  if (ret == 0)
+    ret = reserve_videodec_memory(size);
+  if (ret == 0)
+    ret = init_videodec_library(&init);
+  if (ret == 0) {
+    SceAvcdecQueryDecoderInfo info = {0};
+    info.horizontal = init.hwAvc.horizontal;
+    info.vertical = init.hwAvc.vertical;
+    info.numOfRefFrames = init.hwAvc.numOfRefFrames;
+    ret = query_decoder_size(&info, &size);
+    sceVideodecTermLibrary(SCE_VIDEODEC_TYPE_HW_AVCDEC);
+    if (ret == 0)
+      ret = reserve_decoder_memory(size);
+  }
+  if (ret == 0)
+    ret = reserve_frame_textures();
+  for (size_t i = 0; ret == 0 && i < CHIAKI_VIDEO_FRAME_SLOTS; i++) {
+    if (!reserve_au_buffer(i, AU_BUF_SIZE(SCREEN_WIDTH, SCREEN_HEIGHT)))
+      ret = VITA_VIDEO_ERROR_NO_MEM;
+  }
+  if (ret != 0)
+    LOGD("VIDEO: reserving memory failed 0x%x, the rest is allocated by the first stream\n", ret);
+  return ret;
+}
+
+static void set_decode_target(vita2d_texture *texture) {
+  uint8_t *data = vita2d_texture_get_datap(texture);
+  picture.frame.pPicture[0] = data;
+  if (output_yuv420)
+    picture.frame.pPicture[1] = data + picture.frame.framePitch * frame_texture_alloc_height;
+}
+
+// Whether frames of the stream decoded now can be scanned out without any scaling
+static bool direct_display_possible() {
+  return context.config.direct_display && !output_yuv420
+    && stream_width == SCREEN_WIDTH && stream_height == SCREEN_HEIGHT
+    && image_scaling.texture_width == SCREEN_WIDTH && image_scaling.texture_height == SCREEN_HEIGHT
+    && image_scaling.origin_x == 0 && image_scaling.origin_y == 0;
+}
+
+// Release whatever pictures the decoder still holds, before it is deleted
+static void decoder_drain() {
+  set_decode_target(frame_textures[0]);
+  int ret = sceAvcdecDecodeStop(decoder, &array_picture);
+  if (ret < 0)
+    LOGD("sceAvcdecDecodeStop 0x%x\n", ret);
+  else if (array_picture.numOfOutput > 0)
+    LOGD("VIDEO: decoder still held %u pictures\n", array_picture.numOfOutput);
+}
+
 bool first_frame = false;
 int vita_h264_setup(int width, int height) {
   int ret;
   LOGD("vita video setup\n");
-	SceVideodecCtrl libCtrl;
-	SceVideodecMemInfo libMemInfo;
   SceVideodecQueryInitInfo initVideodec;
-	void *libMem;
   first_frame = true;
+  stream_presented = 0;
+  stream_seconds = 0;
+  low_latency_decoder = context.config.low_latency_decoder;
+  decoder_latency_test = context.config.decoder_latency_test;
+  if (decoder_latency_test) {
+    // the first stream is the baseline without the rewrite
+    low_latency_decoder = decoder_latency_test_streams++ % 2 == 1;
+    LOGD("VIDEO: latency test stream %u, SPS rewrite %s\n", decoder_latency_test_streams, low_latency_decoder ? "on" : "off");
+  }
+  sps_cache_in_size = 0;
+  decode_delay_samples = 0;
+  decode_delay_us_sum = 0;
+  decode_delay_us_max = 0;
+  decode_delay_frames_sum = 0;
+  decode_delay_frames_max = 0;
+  if (sps_ref_frames_width != width || sps_ref_frames_height != height) {
+    sps_ref_frames = 0;
+    sps_ref_frames_width = width;
+    sps_ref_frames_height = height;
+  }
+  decoder_ref_frames = low_latency_decoder && sps_ref_frames > 0 ? sps_ref_frames : REF_FRAMES;
+  decoder_frames = 0;
+  decoder_frames_no_output = 0;
 
   array_picture.numOfElm = 1;
   array_picture.pPicture = &pictures;
   picture.size = sizeof(picture);
-  picture.frame.pixelType = SCE_AVCDEC_PIXELFORMAT_RGBA8888;
+  output_yuv420 = context.config.decode_yuv420;
+  picture.frame.pixelType = output_yuv420 ? SCE_AVCDEC_PIXELFORMAT_YUV420_PACKED_RAW : SCE_AVCDEC_PIXELFORMAT_RGBA8888;
 
   au.dts.lower = 0xFFFFFFFF;
   au.dts.upper = 0xFFFFFFFF;
@@ -356,9 +1188,17 @@ int vita_h264_setup(int width, int height) {
     // INIT_FRAMEBUFFER
     // update_scaling_settings(SCREEN_WIDTH, SCREEN_HEIGHT);
     update_scaling_settings(width, height);
+    stream_width = width;
+    stream_height = height;
+    frame_texture_alloc_width = image_scaling.texture_width;
+    frame_texture_alloc_height = image_scaling.texture_height;
     picture.frame.framePitch = image_scaling.texture_width;
     picture.frame.frameWidth = image_scaling.texture_width;
     picture.frame.frameHeight = image_scaling.texture_height;
+    direct_display = direct_display_possible();
+    if (context.config.direct_display && !direct_display)
+      LOGD("VIDEO: direct display needs a native resolution RGBA stream, drawing frames with the GPU\n");
+    power_set_level(direct_display ? POWER_LEVEL_STREAM_DIRECT : POWER_LEVEL_STREAM);
 
 		// decoder_buffer = memalign(DECODE_AU_ALIGNMENT, AU_BUF_SIZE(SCREEN_WIDTH, SCREEN_HEIGHT));
     // // decoder_buffer = malloc(DECODER_BUFFER_SIZE);
@@ -370,14 +1210,24 @@ int vita_h264_setup(int width, int height) {
 
     // au.es.pBuf = decoder_buffer;
 
-    frame_texture = vita2d_create_empty_texture_format(image_scaling.texture_width, image_scaling.texture_height, SCE_GXM_TEXTURE_FORMAT_U8U8U8U8_ABGR);
-    if (frame_texture == NULL) {
-      LOGD("not enough memory4\n");
-      ret = VITA_VIDEO_ERROR_NO_MEM;
+    ret = reserve_frame_textures();
+    if (ret != 0)
       goto cleanup;
+    for (size_t i = 0; i < FRAME_TEXTURES; i++) {
+      if (!init_frame_texture(frame_textures[i], image_scaling.texture_width, image_scaling.texture_height)) {
+        ret = VITA_VIDEO_ERROR_NO_MEM;
+        goto cleanup;
+      }
+      frame_texture_scenes[i] = 0;
+      frame_texture_queued[i] = false;
     }
+    present_queue_count = 0;
+    present_dropped = 0;
+    frame_texture = NULL;
+    scenes_submitted = 0;
+    scenes_swapped = 0;
 
-    picture.frame.pPicture[0] = vita2d_texture_get_datap(frame_texture);
+    set_decode_target(frame_textures[0]);
 
     video_status++;
   }
@@ -391,67 +1241,16 @@ int vita_h264_setup(int width, int height) {
         // goto cleanup;
       // }
     // }
-    sceClibMemset(&initVideodec.hwAvc, 0, sizeof(SceVideodecQueryInitInfoHwAvcdec));
-
-		initVideodec.hwAvc.size = sizeof(SceVideodecQueryInitInfoHwAvcdec);
-		initVideodec.hwAvc.horizontal = VITA_DECODER_RESOLUTION(width);
-		initVideodec.hwAvc.vertical = VITA_DECODER_RESOLUTION(height);
-		initVideodec.hwAvc.numOfStreams = 1;
-		initVideodec.hwAvc.numOfRefFrames = REF_FRAMES;
-
-		ret = sceVideodecQueryMemSize(SCE_VIDEODEC_TYPE_HW_AVCDEC, &initVideodec, &libMemInfo);
-		if (ret < 0) {
-			sceClibPrintf("sceVideodecQueryMemSize 0x%x\n", ret);
-			ret = VITA_VIDEO_ERROR_INIT_LIB;
-			goto cleanup;
-		}
-
-		libMemInfo.memSize = ROUND_UP(libMemInfo.memSize, 256 * 1024);
-
-		SceKernelAllocMemBlockOpt   opt;
-    sceClibMemset(&opt, 0, sizeof(SceKernelAllocMemBlockOpt));
-		opt.size = sizeof(SceKernelAllocMemBlockOpt);
-		opt.attr = 4;
-		opt.alignment = 256 * 1024;
-
-		videodecblock = sceKernelAllocMemBlock("videodec", SCE_KERNEL_MEMBLOCK_TYPE_USER_CDRAM_RW, libMemInfo.memSize, &opt);
-		if (videodecblock < 0) {
-			sceClibPrintf("videodecblock: 0x%08x\n", videodecblock);
-			ret = VITA_VIDEO_ERROR_INIT_LIB;
-			goto cleanup;
-		}
-
-		ret = sceKernelGetMemBlockBase(videodecblock, &libMem);
-		if (ret < 0) {
-			sceClibPrintf("sceKernelGetMemBlockBase: 0x%x\n", ret);
-			ret = VITA_VIDEO_ERROR_INIT_LIB;
-			goto cleanup;
-		}
-
-		videodecUnmap = sceCodecEngineOpenUnmapMemBlock(libMem, libMemInfo.memSize);
-		if (videodecUnmap < 0) {
-			sceClibPrintf("sceCodecEngineOpenUnmapMemBlock: 0x%x\n", videodecUnmap);
-			ret = VITA_VIDEO_ERROR_INIT_LIB;
-			goto cleanup;
-		}
-
-		videodecContext = sceCodecEngineAllocMemoryFromUnmapMemBlock(videodecUnmap, libMemInfo.memSize, 256 * 1024);
-		if (videodecContext < 0) {
-			sceClibPrintf("sceCodecEngineAllocMemoryFromUnmapMemBlock: 0x%x\n", videodecContext);
-			ret = VITA_VIDEO_ERROR_INIT_LIB;
-			goto cleanup;
-		}
-
-    sceClibMemset(&libCtrl, 0, sizeof(SceVideodecCtrl));
-		libCtrl.vaContext = videodecContext;
-		libCtrl.contextSize = libMemInfo.memSize;
-
-    ret = sceVideodecInitLibraryWithUnmapMem(SCE_VIDEODEC_TYPE_HW_AVCDEC, &libCtrl, &initVideodec);
-    if (ret < 0) {
-      LOGD("sceVideodecInitLibrary 0x%x\n", ret);
-      ret = VITA_VIDEO_ERROR_INIT_LIB;
+    SceUInt32 videodec_size;
+    ret = query_videodec_size(&initVideodec, width, height, decoder_ref_frames, &videodec_size);
+    if (ret != 0)
+      goto cleanup;
+    ret = reserve_videodec_memory(videodec_size);
+    if (ret != 0)
+      goto cleanup;
+    ret = init_videodec_library(&initVideodec);
+    if (ret != 0)
       goto cleanup;
-    }
     video_status++;
   }
 
@@ -469,14 +1268,13 @@ int vita_h264_setup(int width, int height) {
 		decoder_info->vertical = initVideodec.hwAvc.vertical;
 		decoder_info->numOfRefFrames = initVideodec.hwAvc.numOfRefFrames;
 
-    SceAvcdecDecoderInfo decoder_info_out = {0};
-
-    ret = sceAvcdecQueryDecoderMemSize(SCE_VIDEODEC_TYPE_HW_AVCDEC, decoder_info, &decoder_info_out);
-    if (ret < 0) {
-      LOGD("sceAvcdecQueryDecoderMemSize 0x%x size 0x%x\n", ret, decoder_info_out.frameMemSize);
-      ret = VITA_VIDEO_ERROR_QUERY_DEC_MEMSIZE;
+    SceUInt32 decoder_size;
+    ret = query_decoder_size(decoder_info, &decoder_size);
+    if (ret != 0)
+      goto cleanup;
+    ret = reserve_decoder_memory(decoder_size);
+    if (ret != 0)
       goto cleanup;
-    }
 
     decoder = calloc(1, sizeof(SceAvcdecCtrl));
     if (decoder == NULL) {
@@ -484,28 +1282,8 @@ int vita_h264_setup(int width, int height) {
       ret = VITA_VIDEO_ERROR_ALLOC_MEM;
       goto cleanup;
     }
-
-    decoder->frameBuf.size = decoder_info_out.frameMemSize;
-    LOGD("allocating size 0x%x\n", decoder_info_out.frameMemSize);
-		SceKernelAllocMemBlockOpt   opt;
-    sceClibMemset(&opt, 0, sizeof(SceKernelAllocMemBlockOpt));
-		opt.size = sizeof(SceKernelAllocMemBlockOpt);
-		opt.attr = 4;
-		opt.alignment = 1024 * 1024;
-    decoderblock = sceKernelAllocMemBlock("decoder", SCE_KERNEL_MEMBLOCK_TYPE_USER_CDRAM_RW, decoder_info_out.frameMemSize, &opt);
-    // decoderblock = sceKernelAllocMemBlock("decoder", SCE_KERNEL_MEMBLOCK_TYPE_USER_MAIN_PHYCONT_NC_RW, sz, NULL);
-    if (decoderblock < 0) {
-      LOGD("decoderblock: 0x%08x\n", decoderblock);
-      ret = VITA_VIDEO_ERROR_ALLOC_MEM;
-      goto cleanup;
-    }
-
-    ret = sceKernelGetMemBlockBase(decoderblock, &decoder->frameBuf.pBuf);
-    if (ret < 0) {
-      LOGD("sceKernelGetMemBlockBase: 0x%x\n", ret);
-      ret = VITA_VIDEO_ERROR_GET_MEMBASE;
-      goto cleanup;
-    }
+    decoder->frameBuf.size = decoder_size;
+    decoder->frameBuf.pBuf = decoder_reserved_base;
     video_status++;
   }
 
@@ -524,15 +1302,30 @@ int vita_h264_setup(int width, int height) {
 
   if (video_status == INIT_AVC_DEC) {
     // INIT_FRAME_PACER_THREAD
-    // ret = sceKernelCreateThread("frame_pacer", vita_pacer_thread_main, 0, 4 * 1024, 0, 0, NULL);
-    // if (ret < 0) {
-    //   LOGD("sceKernelCreateThread 0x%x\n", ret);
-    //   ret = VITA_VIDEO_ERROR_CREATE_PACER_THREAD;
-    //   goto cleanup;
-    // }
-    // pacer_thread = ret;
-    // active_pacer_thread = true;
-    // sceKernelStartThread(pacer_thread, 0, NULL);
+    if (chiaki_mutex_init(&present_mtx, false) != CHIAKI_ERR_SUCCESS) {
+      ret = VITA_VIDEO_ERROR_CREATE_PACER_THREAD;
+      goto cleanup;
+    }
+    chiaki_mutex_set_name(&present_mtx, "vita video present");
+    if (chiaki_cond_init(&present_cond, &present_mtx) != CHIAKI_ERR_SUCCESS) {
+      chiaki_mutex_fini(&present_mtx);
+      ret = VITA_VIDEO_ERROR_CREATE_PACER_THREAD;
+      goto cleanup;
+    }
+    active_display_thread = true;
+    // same priority and core as the decoding thread, so presenting a frame is not delayed by the next decode
+    ChiakiThreadAttr display_attr;
+    chiaki_thread_role_attr_get(CHIAKI_THREAD_ROLE_VIDEO_DECODE, &display_attr);
+    display_attr.name = "Vita Display";
+    if (chiaki_thread_create_attr(&display_thread, vita_display_thread_main, NULL, &display_attr) != CHIAKI_ERR_SUCCESS) {
+      LOGD("failed to create display thread\n");
+      active_display_thread = false;
+      chiaki_cond_fini(&present_cond);
+      chiaki_mutex_fini(&present_mtx);
+      ret = VITA_VIDEO_ERROR_CREATE_PACER_THREAD;
+      goto cleanup;
+    }
+    chiaki_thread_set_name(&display_thread, "Chiaki Display");
     video_status++;
   }
 
@@ -596,93 +1389,159 @@ void hexdump(void *mem, unsigned int len)
 // #define GS_SPS_BITSTREAM_FIXUP 0x01
 // #define GS_SPS_BASELINE_HACK 0x02
 
-// https://github.dev/intel-linyonghui/RPiPlay/blob/4a65c7b84ff09acd7d6d494bb9037bbf106153a8/renderers/video_renderer_rpi.c?q=NAL_UNIT_TYPE_SPS & https://github.dev/Stary2001/moonlight-embedded/blob/04a7c1d8b24571f2bc7807894c2db8b8096b0c33/libgamestream/sps.c
-bool vita_h264_process_header(uint8_t *data, size_t data_len) {
-  // uint8_t *modified_data;
-  // This reduces the Raspberry Pi H264 decode pipeline delay from about 11 to 6 frames for RPiPlay.
-  // Described at https://www.raspberrypi.org/forums/viewtopic.php?t=41053
+/**
+ * @return whether the AU starts with an SPS, and if so, the cropped resolution it declares
+ */
+static bool sps_resolution(uint8_t *buf, size_t buf_size, int *width, int *height) {
   int sps_start, sps_end;
-  int sps_size = find_nal_unit(data, data_len, &sps_start, &sps_end);
-  if (sps_size > 0) {
-      LOGD("replacing SPS");
-      // const int sps_wiggle_room = 12;
-      // const unsigned char nal_marker[] = { 0x0, 0x0, 0x0, 0x1 };
-      // int modified_data_len = *data_len + sps_wiggle_room + sizeof(nal_marker);
-      // uint8_t* modified_data = malloc(data_len);
-
-      h264_stream_t *h = h264_new();
-      int actual_sps_size = read_nal_unit(h, &data[sps_start], sps_size);
-      if (actual_sps_size < 0) {
-        LOGD("Reading NAL error %d", actual_sps_size);
-        return false;
-      }
-      // h->nal->nal_unit_type = NAL_UNIT_TYPE_SPS;
-      h->sps->num_ref_frames = REF_FRAMES;
-      // h->sps->level_idc = 32; // Max 5 buffered frames at 1280x720x60
-      // h->sps->vui.bitstream_restriction_flag = 1;
-      // h->sps->vui.max_bits_per_mb_denom = 1;
-      // h->sps->vui.log2_max_mv_length_horizontal = 16;
-      // h->sps->vui.log2_max_mv_length_vertical = 16;
-      // h->sps->vui.num_reorder_frames = 0;
-      // h->sps->profile_idc = H264_PROFILE_BASELINE;
-
-      // h->sps->vui.motion_vectors_over_pic_boundaries_flag = 1;
-      // h->sps->vui.matrix_coefficients = 0;
-
-      // h->sps->log2_max_frame_num_minus4 = 4;
-      // h->sps->vui.aspect_ratio_idc = 255;
-
-      // h->sps->frame_cropping_flag = 0;
-      // h->sps->frame_crop_bottom_offset = 0;
-      // h->sps->level_idc = 31;
-      // h->sps->profile_idc = 100;
-      // h->sps->constraint_set1_flag = 0;
-      // h->sps->vui.log2_max_mv_length_horizontal = 1;
-      // h->sps->vui.log2_max_mv_length_vertical = 1;
-
-      // h->sps->vui.num_units_in_tick = 1000;
-      // h->sps->vui.time_scale = 60000;
-
-
-      // GFE 2.5.11 changed the SPS to add additional extensions
-      // Some devices don't like these so we remove them here.
-      // h->sps->vui.video_signal_type_present_flag = 0;
-      // h->sps->vui.chroma_loc_info_present_flag = 0;
-
-      // // Some devices throw errors if max_dec_frame_buffering < num_ref_frames
-      h->sps->vui.max_dec_frame_buffering = REF_FRAMES;
-
-      // // These values are the default for the fields, but they are more aggressive
-      // // than what GFE sends in 2.5.11, but it doesn't seem to cause picture problems.
-      // h->sps->vui.max_bytes_per_pic_denom = 2;
-      // h->sps->vui.max_bits_per_mb_denom = 1;
-
-      LOGD("sps real type %d type %d starts at 0x%x ends at 0x%x length 0x%x buf size 0x%x sps size 0x%x actual size 0x%x", (*(data + sps_start) & 0x1F), h->nal->nal_unit_type, sps_start, sps_end, data_len - sps_start, data_len, sps_size, actual_sps_size);
-      int new_sps_size = write_nal_unit(h, data + sps_start, data_len); // i dont know why we need data_len instead of sps_size but it works and doesnt destroy it lel
-      LOGD("new size 0x%x or %d", new_sps_size, new_sps_size);
-      // bool ret;
-      // if (new_sps_size > 0 && new_sps_size <= sps_wiggle_room) {
-      //     memcpy(modified_data, *data, sps_start);
-      //     memcpy(modified_data + sps_start + new_sps_size, nal_marker, sizeof(nal_marker));
-      //     memcpy(modified_data + sps_start + new_sps_size + sizeof(nal_marker), *data + sps_start, *data_len - sps_start);
-      //     *data = modified_data;
-      //     *data_len = *data_len + new_sps_size + sizeof(nal_marker);
-      //     ret = true;
-      // } else {
-      //     free(modified_data);
-      //     modified_data = NULL;
-      //     ret = false;
-      // }
-      h264_free(h);
-      return true;
-  } else {
-    LOGD("cant find SPS");
+  int sps_size = find_nal_unit(buf, (int)buf_size, &sps_start, &sps_end);
+  if (sps_size <= 0 || (buf[sps_start] & 0x1F) != NAL_UNIT_TYPE_SPS)
     return false;
+
+  h264_stream_t *h = h264_new();
+  bool r = read_nal_unit(h, &buf[sps_start], sps_size) >= 0;
+  if (r) {
+    sps_t *sps = h->sps;
+    int crop_unit_x = sps->chroma_format_idc == 1 || sps->chroma_format_idc == 2 ? 2 : 1;
+    int crop_unit_y = (sps->chroma_format_idc == 1 ? 2 : 1) * (2 - sps->frame_mbs_only_flag);
+    *width = (sps->pic_width_in_mbs_minus1 + 1) * 16;
+    *height = (2 - sps->frame_mbs_only_flag) * (sps->pic_height_in_map_units_minus1 + 1) * 16;
+    if (sps->frame_cropping_flag) {
+      *width -= crop_unit_x * (sps->frame_crop_left_offset + sps->frame_crop_right_offset);
+      *height -= crop_unit_y * (sps->frame_crop_top_offset + sps->frame_crop_bottom_offset);
+    }
   }
+  h264_free(h);
+  return r;
+}
+
+/**
+ * Switch to a new stream resolution (e.g. after the host changed the adaptive stream) without
+ * recreating the decoder or textures, which are kept at the size of the profile from setup.
+ * Frames already queued keep the scaling they were decoded with, so nothing is mis-rendered.
+ *
+ * @return false if the new resolution does not fit, the stream then needs a restart
+ */
+static bool reconfigure_stream(int width, int height) {
+  image_scaling_settings prev = image_scaling;
+  update_scaling_settings(width, height);
+  if (image_scaling.texture_width > frame_texture_alloc_width
+      || image_scaling.texture_height > frame_texture_alloc_height
+      || VITA_DECODER_RESOLUTION(width) > decoder_info->horizontal
+      || VITA_DECODER_RESOLUTION(height) > decoder_info->vertical) {
+    LOGD("VIDEO: can not switch to %dx%d without recreating the decoder\n", width, height);
+    image_scaling = prev;
+    return false;
+  }
+  stream_width = width;
+  stream_height = height;
+  picture.frame.frameWidth = image_scaling.texture_width;
+  picture.frame.frameHeight = image_scaling.texture_height;
+  direct_display = direct_display_possible();
+  power_set_level(direct_display ? POWER_LEVEL_STREAM_DIRECT : POWER_LEVEL_STREAM);
+  LOGD("VIDEO: switched to %dx%d in place\n", width, height);
+  return true;
+}
+
+/**
+ * Header rewrite stage of the low latency profile: if the AU starts with an SPS, write a copy of the AU
+ * to header_buf whose SPS has bitstream restrictions with num_reorder_frames = 0 and
+ * max_dec_frame_buffering = num_ref_frames, so the decoder has no reason to hold back pictures.
+ * The rewritten SPS is cached, it is only parsed again when the host sends a different one.
+ *
+ * @return the AU to decode, either buf or header_buf
+ */
+static uint8_t *low_latency_rewrite_sps(uint8_t *buf, size_t *buf_size) {
+  int sps_start, sps_end;
+  int sps_size = find_nal_unit(buf, (int)*buf_size, &sps_start, &sps_end);
+  if (sps_size <= 0 || (buf[sps_start] & 0x1F) != NAL_UNIT_TYPE_SPS)
+    return buf;
+
+  // the rewritten SPS grows by at most the bitstream restriction fields
+  size_t size_needed = ROUND_UP(*buf_size + 64, DECODE_AU_ALIGNMENT);
+  if (header_buf_size < size_needed) {
+    free(header_buf);
+    header_buf_size = 0;
+    header_buf = memalign(DECODE_AU_ALIGNMENT, size_needed);
+    if (header_buf == NULL)
+      return buf;
+    header_buf_size = size_needed;
+  }
+
+  size_t rest = *buf_size - sps_end;
+  if (sps_cache_in_size == sps_size && memcmp(sps_cache_in, buf + sps_start, sps_size) == 0) {
+    if (sps_start + sps_cache_out_size + rest > header_buf_size)
+      return buf;
+    sceClibMemcpy(header_buf, buf, sps_start);
+    sceClibMemcpy(header_buf + sps_start, sps_cache_out, sps_cache_out_size);
+    sceClibMemcpy(header_buf + sps_start + sps_cache_out_size, buf + sps_end, rest);
+    *buf_size = sps_start + sps_cache_out_size + rest;
+    return (uint8_t *)header_buf;
+  }
+
+  h264_stream_t *h = h264_new();
+  uint8_t *r = buf;
+  if (read_nal_unit(h, &buf[sps_start], sps_size) < 0) {
+    LOGD("VIDEO: failed to parse SPS\n");
+    goto beach;
+  }
+
+  int ref_frames = h->sps->num_ref_frames > 0 ? h->sps->num_ref_frames : 1;
+  int decoder_max = ref_frames < REF_FRAMES ? ref_frames : REF_FRAMES;
+  if (decoder_max != sps_ref_frames) {
+    LOGD("VIDEO: SPS uses %d reference frames, decoder was set up for %d\n", ref_frames, decoder_ref_frames);
+    sps_ref_frames = decoder_max;
+  }
+
+  h->sps->vui_parameters_present_flag = 1;
+  if (!h->sps->vui.bitstream_restriction_flag) {
+    // values the spec infers when the fields are absent
+    h->sps->vui.bitstream_restriction_flag = 1;
+    h->sps->vui.motion_vectors_over_pic_boundaries_flag = 1;
+    h->sps->vui.max_bytes_per_pic_denom = 2;
+    h->sps->vui.max_bits_per_mb_denom = 1;
+    h->sps->vui.log2_max_mv_length_horizontal = 16;
+    h->sps->vui.log2_max_mv_length_vertical = 16;
+  }
+  h->sps->vui.num_reorder_frames = 0;
+  h->sps->vui.max_dec_frame_buffering = ref_frames;
+
+  sceClibMemcpy(header_buf, buf, sps_start);
+  int new_sps_size = write_nal_unit(h, (uint8_t *)header_buf + sps_start, (int)(header_buf_size - sps_start));
+  if (new_sps_size <= 0 || sps_start + new_sps_size + rest > header_buf_size) {
+    LOGD("VIDEO: failed to write SPS\n");
+    goto beach;
+  }
+  LOGD("VIDEO: rewrote new SPS (0x%x -> 0x%x bytes), %d reference frames\n", sps_size, new_sps_size, ref_frames);
+  if (sps_size <= SPS_CACHE_SIZE && new_sps_size <= SPS_CACHE_SIZE) {
+    sceClibMemcpy(sps_cache_in, buf + sps_start, sps_size);
+    sps_cache_in_size = sps_size;
+    sceClibMemcpy(sps_cache_out, header_buf + sps_start, new_sps_size);
+    sps_cache_out_size = new_sps_size;
+  }
+  sceClibMemcpy(header_buf + sps_start + new_sps_size, buf + sps_end, rest);
+  *buf_size = sps_start + new_sps_size + rest;
+  r = (uint8_t *)header_buf;
+beach:
+  h264_free(h);
+  return r;
 }
 
 // uint8_t *lbuf;
 // bool infirst_frame = false;
+// Frames are assembled directly in here by chiaki (see ChiakiVideoAUBufferCallback) and passed to
+// vita_h264_decode_frame() as-is. Decoding is synchronous, so one buffer per frame slot is enough,
+// handed out round-robin.
+uint8_t *vita_h264_get_au_buffer(size_t size) {
+  size_t i = decoder_buffer_next;
+  decoder_buffer_next = (decoder_buffer_next + 1) % CHIAKI_VIDEO_FRAME_SLOTS;
+  if (!reserve_au_buffer(i, size)) {
+    LOGD("VIDEO: not enough memory for a 0x%x byte AU buffer", (unsigned int)size);
+    return NULL;
+  }
+  return (uint8_t *)decoder_buffers[i];
+}
+
 int vita_h264_decode_frame(uint8_t *buf, size_t buf_size) {
   // Early validation to detect corrupted frames before decoding
   if (buf == NULL || buf_size == 0) {
@@ -699,31 +1558,6 @@ int vita_h264_decode_frame(uint8_t *buf, size_t buf_size) {
   // free(lbuf);
   // lbuf = buf;
   chiaki_mutex_lock(&mtx);
-  if(!threadSetupComplete) {
-		sceKernelChangeThreadPriority(SCE_KERNEL_THREAD_ID_SELF, 64);
-		sceKernelChangeThreadCpuAffinityMask(SCE_KERNEL_THREAD_ID_SELF, 0);
-		threadSetupComplete = true;
-	}
-  // if (first_frame) {
-  //   first_frame = false;
-  //   // infirst_frame = true;
-  //   // header_buf = memalign(DECODE_AU_ALIGNMENT, buf_size);
-  //   // if (header_buf == NULL) {
-  //   //   LOGD("not enough memory for header buf\n");
-  //   //   return 1;
-  //   // }
-
-  //   // header_buf_size = buf_size;
-  //   // sceClibMemcpy(header_buf, buf, buf_size);
-
-  //   vita_h264_process_header(buf, buf_size);
-  //   // header_buf = buf;
-  //   // header_buf_size = buf_size;
-  //   // hexdump(buf, buf_size);
-
-  //   // chiaki_mutex_unlock(&mtx);
-  //   // return 0;
-  // }
 
 
 
@@ -735,6 +1569,14 @@ int vita_h264_decode_frame(uint8_t *buf, size_t buf_size) {
 
 
 
+  int sps_width, sps_height;
+  if (sps_resolution(buf, buf_size, &sps_width, &sps_height)
+      && (sps_width != stream_width || sps_height != stream_height))
+    reconfigure_stream(sps_width, sps_height);
+
+  if (low_latency_decoder)
+    buf = low_latency_rewrite_sps(buf, &buf_size);
+
   if (buf_size > sceAvcdecDecodeAvailableSize(decoder)) {
     sceClibPrintf("Video decode buffer too small\n");
     chiaki_mutex_unlock(&mtx);
@@ -783,9 +1625,24 @@ int vita_h264_decode_frame(uint8_t *buf, size_t buf_size) {
   // sceClibMemcpy(decoder_buffer, buf, buf_size);
 
   // au.es.pBuf = decoder_buffer;
+  // decode into a texture that is neither waiting to be presented nor sampled by the GPU anymore
+  bool target_present;
+  int target_texture = acquire_decode_texture(&target_present);
+  set_decode_target(frame_textures[target_texture]);
+
   au.es.pBuf = buf;
   au.es.size = buf_size;
+  CHIAKI_TRACE(VIDEO_DECODE, DECODE_BEGIN, buf_size);
+  uint64_t decode_start_us = sceKernelGetSystemTimeWide();
+  if (decoder_latency_test) {
+    au.pts.lower = decoder_frames;
+    au.pts.upper = 0;
+    decode_submit_us[decoder_frames % DECODE_DELAY_SLOTS] = decode_start_us;
+  }
   ret = sceAvcdecDecode(decoder, &au, &array_picture);
+  power_decode_sample((uint32_t)(sceKernelGetSystemTimeWide() - decode_start_us));
+  CHIAKI_TRACE(VIDEO_DECODE, DECODE_END, array_picture.numOfOutput);
+  chiaki_session_latency_stamp(&context.stream.session, CHIAKI_LATENCY_STAMP_DECODED);
   if (ret < 0) {
     LOGD("sceAvcdecDecode (len=0x%x): 0x%x numOfOutput %d\n", buf_size, ret, array_picture.numOfOutput);
     // if (isEdited) free(buf);
@@ -794,6 +1651,22 @@ int vita_h264_decode_frame(uint8_t *buf, size_t buf_size) {
     // goto fix;
   }
 
+  if (decoder_latency_test && array_picture.numOfOutput == 1) {
+    uint32_t held = decoder_frames - picture.info.pts.lower;
+    if (picture.info.pts.upper == 0 && held < DECODE_DELAY_SLOTS) {
+      uint32_t delay_us = (uint32_t)(sceKernelGetSystemTimeWide() - decode_submit_us[picture.info.pts.lower % DECODE_DELAY_SLOTS]);
+      decode_delay_samples++;
+      decode_delay_us_sum += delay_us;
+      if (delay_us > decode_delay_us_max)
+        decode_delay_us_max = delay_us;
+      decode_delay_frames_sum += held;
+      if (held > decode_delay_frames_max)
+        decode_delay_frames_max = held;
+    }
+  }
+  decoder_frames++;
+  if (array_picture.numOfOutput == 0)
+    decoder_frames_no_output++;
   if (array_picture.numOfOutput != 1) {
     LOGD("numOfOutput %d bufSize 0x%x\n", array_picture.numOfOutput, buf_size);
     // if (infirst_frame) {
@@ -816,27 +1689,13 @@ int vita_h264_decode_frame(uint8_t *buf, size_t buf_size) {
     // }
     // goto fix;
   }
-  // display:
-  if (active_video_thread) {
-    if (need_drop > 0) {
-      LOGD("remain frameskip: %d\n", need_drop);
-      // skip
-      need_drop--;
-    } else {
-      vita2d_start_drawing();
-
-      draw_streaming(frame_texture);
-      // draw_fps();
-      // draw_indicators();
+  latency_probe_frame(vita2d_texture_get_datap(frame_textures[target_texture]), picture.frame.framePitch,
+                      output_yuv420, stream_width, stream_height, chiaki_time_now_monotonic_us());
 
-      vita2d_end_drawing();
-
-      vita2d_wait_rendering_done();
-      vita2d_swap_buffers();
-
-      frame_count++;
-      // LOGD("frc: %d", frame_count);
-    }
+  // display: only hand over to the display thread, which draws and swaps
+  if (active_video_thread) {
+    if (target_present)
+      present_queue_push(target_texture);
   } else {
     LOGD("inactive video thread");
   }
@@ -847,16 +1706,28 @@ int vita_h264_decode_frame(uint8_t *buf, size_t buf_size) {
   return 0;
 }
 
-void draw_streaming(vita2d_texture *frame_texture) {
+static void draw_streaming(vita2d_texture *frame_texture, const image_scaling_settings *scaling) {
   // ui is still rendering in the background, clear the screen first
   // vita2d_clear_screen();
+  if (scaling->scale_x != 1 || scaling->scale_y != 1) {
+    vita2d_draw_texture_part_scale(frame_texture,
+                                   scaling->origin_x,
+                                   scaling->origin_y,
+                                   scaling->region_x1,
+                                   scaling->region_y1,
+                                   scaling->region_x2,
+                                   scaling->region_y2,
+                                   scaling->scale_x,
+                                   scaling->scale_y);
+    return;
+  }
   vita2d_draw_texture_part(frame_texture,
-                           image_scaling.origin_x,
-                           image_scaling.origin_y,
-                           image_scaling.region_x1,
-                           image_scaling.region_y1,
-                           image_scaling.region_x2,
-                           image_scaling.region_y2);
+                           scaling->origin_x,
+                           scaling->origin_y,
+                           scaling->region_x1,
+                           scaling->region_y1,
+                           scaling->region_x2,
+                           scaling->region_y2);
 }
 
 extern vita2d_font* font;
@@ -867,6 +1738,121 @@ void draw_fps() {
   // }
 }
 
+// The overlay text is only rebuilt this often, drawing the cached lines on every frame is cheap
+#define STREAM_STATS_UPDATE_US 500000
+#define STREAM_STATS_LINES 14
+#define STREAM_STATS_LINE_SIZE 64
+
+static char stream_stats_text[STREAM_STATS_LINES][STREAM_STATS_LINE_SIZE];
+static uint64_t stream_stats_updated_us = 0;
+// at the last update, to show the allocation churn in between
+static uint64_t stream_stats_allocs = 0;
+static uint64_t stream_stats_frames = 0;
+
+static void update_stream_stats_text() {
+  ChiakiSession *session = &context.stream.session;
+  ChiakiLatencyReport latency;
+  chiaki_session_get_latency_stats(session, &latency);
+  ChiakiVideoStatsCounters video;
+  chiaki_session_get_video_stats(session, &video);
+  ChiakiPacketStatsSnapshot packets;
+  chiaki_session_get_packet_stats_snapshot(session, &packets);
+  ChiakiPacketStatsCounts *loss_short = &packets.window_short;
+  ChiakiPacketStatsCounts *loss_long = &packets.window_long;
+  ChiakiCongestionControlStats congestion;
+  chiaki_session_get_congestion_stats(session, &congestion);
+
+  ChiakiLatencyStageStats *decode = &latency.stages[CHIAKI_LATENCY_STAGE_DECODE];
+  ChiakiLatencyStageStats *total = &latency.stages[CHIAKI_LATENCY_STAGE_TOTAL];
+  snprintf(stream_stats_text[0], STREAM_STATS_LINE_SIZE, "decode %.1f ms (p95 %.1f)  total %.1f ms",
+           decode->avg_us / 1000.0, decode->p95_us / 1000.0, total->avg_us / 1000.0);
+  snprintf(stream_stats_text[1], STREAM_STATS_LINE_SIZE, "fps %u / %u stream, %u vblanks",
+           curr_fps[0], (unsigned int)context.config.fps, curr_fps[1]);
+  snprintf(stream_stats_text[2], STREAM_STATS_LINE_SIZE, "loss %.1f%% (10s %.1f%%)  bitrate %.1f Mbit/s",
+           loss_short->received + loss_short->lost ? loss_short->lost * 100.0 / (loss_short->received + loss_short->lost) : 0.0,
+           loss_long->received + loss_long->lost ? loss_long->lost * 100.0 / (loss_long->received + loss_long->lost) : 0.0,
+           video.bitrate / 1000000.0);
+  snprintf(stream_stats_text[3], STREAM_STATS_LINE_SIZE, "FEC recovered %llu, failed %llu frames",
+           (unsigned long long)video.frames_fec_recovered, (unsigned long long)video.frames_failed);
+  snprintf(stream_stats_text[4], STREAM_STATS_LINE_SIZE, "ref misses %llu, substituted %llu",
+           (unsigned long long)video.ref_frame_misses, (unsigned long long)video.ref_frame_retargets);
+  VitaAudioStats audio;
+  vita_audio_get_stats(&audio);
+  snprintf(stream_stats_text[5], STREAM_STATS_LINE_SIZE, "audio %u/%u ms, drift %d ppm, under %u, over %u",
+           audio.buffered_ms, audio.target_ms, audio.drift_ppm, audio.underruns, audio.overruns);
+  ChiakiAudioDecodeQueueStats audio_decode;
+  chiaki_session_get_audio_decode_stats(session, &audio_decode);
+  snprintf(stream_stats_text[6], STREAM_STATS_LINE_SIZE, "audio queue %u (max %u), decode %.2f ms (max %.2f)",
+           (unsigned int)audio_decode.depth, (unsigned int)audio_decode.depth_max,
+           audio_decode.decode_us_avg / 1000.0, audio_decode.decode_us_max / 1000.0);
+  ChiakiAVSyncState av_sync;
+  chiaki_session_get_av_sync(session, &av_sync);
+  snprintf(stream_stats_text[7], STREAM_STATS_LINE_SIZE, "A/V offset %+.0f ms, delay audio %.0f video %.0f ms",
+           av_sync.offset_us / 1000.0, av_sync.audio_delay_us / 1000.0, av_sync.video_delay_us / 1000.0);
+  ChiakiLatencyStageStats *input = &latency.stages[CHIAKI_LATENCY_STAGE_INPUT];
+  snprintf(stream_stats_text[8], STREAM_STATS_LINE_SIZE, "input to wire %.2f ms (p99 %.2f, max %.2f)",
+           input->avg_us / 1000.0, input->p99_us / 1000.0, input->max_us / 1000.0);
+  snprintf(stream_stats_text[9], STREAM_STATS_LINE_SIZE, "delay %s, est %.1f Mbps, loss sent %.1f%%",
+           chiaki_delay_usage_string(congestion.delay_usage), congestion.bandwidth_bps / 1000000.0,
+           congestion.reported_loss * 100.0);
+  ChiakiJitterStats jitter;
+  chiaki_session_get_jitter_stats(session, &jitter);
+  ChiakiJitterStreamStats *jitter_video = &jitter.streams[CHIAKI_JITTER_STREAM_VIDEO];
+  ChiakiJitterStreamStats *jitter_audio = &jitter.streams[CHIAKI_JITTER_STREAM_AUDIO];
+  snprintf(stream_stats_text[10], STREAM_STATS_LINE_SIZE, "jitter video %.1f audio %.1f ms, delay %+.1f ms",
+           jitter_video->jitter_us / 1000.0, jitter_audio->jitter_us / 1000.0, jitter_video->delay_trend_us / 1000.0);
+  ChiakiArenaUsage arena;
+  chiaki_session_get_arena_usage(session, &arena);
+  uint64_t allocs = 0;
+  for (size_t i = 0; i < CHIAKI_ARENA_TAG_COUNT; i++)
+    allocs += arena.tags[i].allocs;
+  if (allocs < stream_stats_allocs || video.frames < stream_stats_frames) {
+    // a new session
+    stream_stats_allocs = 0;
+    stream_stats_frames = 0;
+  }
+  uint64_t frames = video.frames - stream_stats_frames;
+  VitaVideoMemStats video_mem;
+  vita_video_get_mem_stats(&video_mem);
+  snprintf(stream_stats_text[11], STREAM_STATS_LINE_SIZE, "heap %u KiB (peak %u), %.1f allocs/frame, cdram %u MiB",
+           (unsigned int)(arena.reserved / 1024), (unsigned int)(arena.reserved_peak / 1024),
+           frames ? (double)(allocs - stream_stats_allocs) / frames : 0.0, video_mem.cdram / (1024 * 1024));
+  stream_stats_allocs = allocs;
+  stream_stats_frames = video.frames;
+  ChiakiLoadMonitorStats load;
+  chiaki_session_get_load_stats(session, &load);
+  snprintf(stream_stats_text[12], STREAM_STATS_LINE_SIZE, "load %s, downgrade %u, dropped %.0f%%",
+           chiaki_client_load_string(load.load), load.steps, load.drop_rate * 100.0);
+  ChiakiStreamStatsSnapshot stream;
+  chiaki_session_get_stream_stats(session, &stream);
+  ChiakiStreamStatsSizes *i_frames = &stream.sizes[CHIAKI_BITSTREAM_SLICE_I];
+  ChiakiStreamStatsSizes *p_frames = &stream.sizes[CHIAKI_BITSTREAM_SLICE_P];
+  // burst in Mbit/s over CHIAKI_STREAM_STATS_BURST_US, to compare with what the Wi-Fi sustains
+  snprintf(stream_stats_text[13], STREAM_STATS_LINE_SIZE, "%.1f/%.1f Mbps, I %.0f P %.0f KiB, burst %.1f",
+           stream.bitrate_window / 1000000.0, stream.bitrate_ewma / 1000000.0,
+           i_frames->frames ? i_frames->bytes / 1024.0 / i_frames->frames : 0.0,
+           p_frames->frames ? p_frames->bytes / 1024.0 / p_frames->frames : 0.0,
+           stream.burst_bytes_max * 8.0 / CHIAKI_STREAM_STATS_BURST_US);
+}
+
+void draw_stream_stats() {
+  uint64_t now = sceKernelGetSystemTimeWide();
+  if (!stream_stats_updated_us || now - stream_stats_updated_us >= STREAM_STATS_UPDATE_US) {
+    update_stream_stats_text();
+    stream_stats_updated_us = now;
+  }
+  vita2d_draw_rectangle(10, 10, 330, 20 * STREAM_STATS_LINES + 10, RGBA8(0, 0, 0, 0xA0));
+  for (int i = 0; i < STREAM_STATS_LINES; i++)
+    vita2d_font_draw_text(font, 20, 30 + 20 * i, RGBA8(0xFF, 0xFF, 0xFF, 0xFF), 16, stream_stats_text[i]);
+}
+
+static void draw_reconnecting() {
+  const char *text = "Reconnecting...";
+  int width = vita2d_font_text_width(font, 24, text);
+  vita2d_draw_rectangle((SCREEN_WIDTH - width) / 2 - 20, SCREEN_HEIGHT / 2 - 30, width + 40, 50, RGBA8(0, 0, 0, 0xA0));
+  vita2d_font_draw_text(font, (SCREEN_WIDTH - width) / 2, SCREEN_HEIGHT / 2 + 5, RGBA8(0xFF, 0xFF, 0xFF, 0xFF), 24, text);
+}
+
 void draw_indicators() {
 //   if (poor_net_indicator.activated) {
 //     vita2d_font_draw_text(font, 40, 500, RGBA8(0xFF, 0xFF, 0xFF, poor_net_indicator.alpha), 64, ICON_NETWORK);
@@ -878,9 +1864,14 @@ void draw_indicators() {
 //   }
 }
 
+uint32_t vita_h264_fps_achieved() {
+  return stream_seconds ? stream_presented / stream_seconds : 0;
+}
+
 void vita_h264_start() {
   active_video_thread = true;
 	chiaki_mutex_init(&mtx, false);
+  chiaki_mutex_set_name(&mtx, "vita video decode");
   vita2d_set_vblank_wait(false);
 }
 
@@ -890,6 +1881,15 @@ void vita_h264_stop() {
 	chiaki_mutex_fini(&mtx);
 }
 
+void vita_h264_set_reconnecting(bool reconnecting) {
+  // present_mtx only exists while the display thread runs
+  if (video_status != INIT_FRAME_PACER_THREAD)
+    return;
+  chiaki_mutex_lock(&present_mtx);
+  stream_reconnecting = reconnecting;
+  chiaki_mutex_unlock(&present_mtx);
+}
+
 void vitavideo_show_poor_net_indicator() {
   poor_net_indicator.activated = true;
 }